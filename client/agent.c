@@ -75,7 +75,7 @@ static struct l_dbus_message *agent_error(struct l_dbus_message *message,
 	if (!command_is_interactive_mode()) {
 		command_set_exit_status(EXIT_FAILURE);
 
-		l_main_quit();
+		command_noninteractive_done();
 	}
 
 	return agent_reply_canceled(message, text);
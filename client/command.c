@@ -26,6 +26,7 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <getopt.h>
 #include <ell/ell.h>
@@ -43,6 +44,19 @@ static struct command_noninteractive {
 	int argc;
 } command_noninteractive;
 
+/*
+ * Batch mode: commands are read one per line from a file or stdin and run
+ * in order over the same bus connection and proxy cache, each starting
+ * once the previous one has completed.
+ */
+static struct command_batch {
+	FILE *file;
+	char *line;
+	size_t line_size;
+	unsigned int lineno;
+	struct l_idle *next;
+} command_batch;
+
 struct command_option {
 	const char *name;
 	char *value;
@@ -387,7 +401,7 @@ static void execute_cmd(const char *family, const char *entity,
 		goto error;
 
 	if (status == CMD_STATUS_DONE && !interactive_mode) {
-		l_main_quit();
+		command_noninteractive_done();
 
 		return;
 	}
@@ -431,7 +445,7 @@ error:
 failure:
 	exit_status = EXIT_FAILURE;
 
-	l_main_quit();
+	command_noninteractive_done();
 }
 
 static bool match_cmd(const char *family, const char *param,
@@ -518,6 +532,9 @@ static void list_cmd_options(void)
 	display(MARGIN "--%-*s%s\n", 48, COMMAND_OPTION_DONTASK,
 					"Don't ask for missing\n"
 					"\t\t\t\t\t\t    credentials");
+	display(MARGIN "--%-*s%s\n", 48, "batch",
+					"Read commands from a file, or from\n"
+					"\t\t\t\t\t\t    stdin if '-'");
 	display(MARGIN "--%-*s%s\n", 48, "help", "Display help");
 }
 
@@ -582,15 +599,12 @@ void command_process_prompt(char **argv, int argc)
 		return;
 
 	if (!interactive_mode) {
-		if (command_match_misc_commands(argv, argc)) {
-			exit_status = EXIT_SUCCESS;
-			goto quit;
+		if (!command_match_misc_commands(argv, argc)) {
+			display_error("Invalid command\n");
+			exit_status = EXIT_FAILURE;
 		}
 
-		display_error("Invalid command\n");
-		exit_status = EXIT_FAILURE;
-quit:
-		l_main_quit();
+		command_noninteractive_done();
 		return;
 	}
 
@@ -602,8 +616,67 @@ quit:
 	display_error("Invalid command\n");
 }
 
+static void command_batch_next(struct l_idle *idle, void *user_data)
+{
+	l_idle_remove(command_batch.next);
+	command_batch.next = NULL;
+
+	while (getline(&command_batch.line, &command_batch.line_size,
+						command_batch.file) != -1) {
+		char **argv;
+		int argc;
+
+		command_batch.lineno++;
+
+		argv = l_parse_args(command_batch.line, &argc);
+		if (!argv) {
+			display_error("Invalid command\n");
+			l_error("Parse error on line %u", command_batch.lineno);
+			exit_status = EXIT_FAILURE;
+			continue;
+		}
+
+		if (!argc || argv[0][0] == '#') {
+			l_strfreev(argv);
+			continue;
+		}
+
+		/*
+		 * Commands copy whatever they need from argv, as in the
+		 * interactive mode, so it can be freed right away.
+		 */
+		command_process_prompt(argv, argc);
+		l_strfreev(argv);
+		return;
+	}
+
+	l_main_quit();
+}
+
+/*
+ * Called when the command run in non-interactive mode has completed,
+ * either synchronously or once its method call has returned.
+ */
+void command_noninteractive_done(void)
+{
+	if (!command_batch.file) {
+		l_main_quit();
+		return;
+	}
+
+	/* Don't recurse from inside the command's own callback */
+	if (!command_batch.next)
+		command_batch.next = l_idle_create(command_batch_next,
+								NULL, NULL);
+}
+
 void command_noninteractive_trigger(void)
 {
+	if (command_batch.file) {
+		command_batch_next(NULL, NULL);
+		return;
+	}
+
 	if (!command_noninteractive.argc)
 		return;
 
@@ -616,6 +689,41 @@ bool command_is_interactive_mode(void)
 	return interactive_mode;
 }
 
+/*
+ * Whether the proxies for an on-demand interface type are needed.  In
+ * interactive mode any command may follow so they always are, otherwise
+ * only if the family of the command being run lists the interface.
+ */
+bool command_needs_interface(const char *interface)
+{
+	const struct l_queue_entry *entry;
+	size_t i;
+
+	if (interactive_mode || command_batch.file ||
+					!command_noninteractive.argc)
+		return true;
+
+	for (entry = l_queue_get_entries(command_families); entry;
+							entry = entry->next) {
+		const struct command_family *family = entry->data;
+
+		if (strcmp(family->name, command_noninteractive.argv[0]))
+			continue;
+
+		if (!family->on_demand_interfaces)
+			return false;
+
+		for (i = 0; family->on_demand_interfaces[i]; i++)
+			if (!strcmp(family->on_demand_interfaces[i],
+								interface))
+				return true;
+
+		return false;
+	}
+
+	return false;
+}
+
 void command_set_exit_status(int status)
 {
 	exit_status = status;
@@ -656,6 +764,7 @@ static const struct option command_opts[] = {
 	{ COMMAND_OPTION_PASSWORD,	required_argument, NULL, 'p' },
 	{ COMMAND_OPTION_PASSPHRASE,	required_argument, NULL, 'P' },
 	{ COMMAND_OPTION_DONTASK,	no_argument,	   NULL, 'd' },
+	{ "batch",			required_argument, NULL, 'b' },
 	{ "help",			no_argument,	   NULL, 'h' },
 	{ }
 };
@@ -681,7 +790,7 @@ bool command_init(char **argv, int argc)
 	for (;;) {
 		struct command_option *option;
 
-		opt = getopt_long(argc, argv, "u:p:P:dh", command_opts, NULL);
+		opt = getopt_long(argc, argv, "u:p:P:db:h", command_opts, NULL);
 
 		switch (opt) {
 		case 'u':
@@ -714,6 +823,25 @@ bool command_init(char **argv, int argc)
 
 			l_queue_push_tail(command_options, option);
 
+			break;
+		case 'b':
+			if (command_batch.file && command_batch.file != stdin)
+				fclose(command_batch.file);
+
+			if (!strcmp(optarg, "-")) {
+				command_batch.file = stdin;
+				break;
+			}
+
+			command_batch.file = fopen(optarg, "re");
+			if (!command_batch.file) {
+				l_error("Can't open %s: %s", optarg,
+							strerror(errno));
+				exit_status = EXIT_FAILURE;
+
+				return true;
+			}
+
 			break;
 		case 'h':
 			command_display_help();
@@ -734,6 +862,16 @@ options_parsed:
 	argv += optind;
 	argc -= optind;
 
+	if (command_batch.file) {
+		if (!argc)
+			return false;
+
+		l_error("Commands can't be combined with --batch");
+		exit_status = EXIT_FAILURE;
+
+		return true;
+	}
+
 	if (argc < 2) {
 		interactive_mode = true;
 		return false;
@@ -761,4 +899,12 @@ void command_exit(void)
 
 	l_queue_destroy(command_options, command_options_destroy);
 	command_options = NULL;
+
+	l_idle_remove(command_batch.next);
+	l_free(command_batch.line);
+
+	if (command_batch.file && command_batch.file != stdin)
+		fclose(command_batch.file);
+
+	memset(&command_batch, 0, sizeof(command_batch));
 }
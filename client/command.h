@@ -55,6 +55,7 @@ struct command_family {
 	command_completion_func_t entity_arg_completion;
 	void (*set_default_entity)(const char *entity);
 	void (*reset_default_entity)(void);
+	const char *const *on_demand_interfaces;
 };
 
 bool command_option_get(const char *name, const char **value_out);
@@ -68,7 +69,9 @@ char *command_entity_arg_completion(const char *text, int state,
 void command_process_prompt(char **argv, int argc);
 
 void command_noninteractive_trigger(void);
+void command_noninteractive_done(void);
 bool command_is_interactive_mode(void);
+bool command_needs_interface(const char *interface);
 int command_get_exit_status(void);
 void command_set_exit_status(int status);
 void command_reset_default_entities(void);
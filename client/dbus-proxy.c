@@ -319,7 +319,7 @@ static void proxy_callback(struct l_dbus_message *message, void *user_data)
 		return;
 
 quit:
-	l_main_quit();
+	command_noninteractive_done();
 }
 
 bool proxy_property_set(const struct proxy_interface *proxy, const char *name,
@@ -489,6 +489,8 @@ static void properties_changed_callback(struct l_dbus_message *message,
 		return;
 
 	interface_update_properties(proxy, &changed, &invalidated);
+
+	display_refresh_invalidate();
 }
 
 static bool is_ignorable(const char *interface)
@@ -563,6 +565,10 @@ static void proxy_interface_create(const char *path,
 			continue;
 		}
 
+		if (interface_type->on_demand &&
+				!command_needs_interface(interface))
+			continue;
+
 		proxy = proxy_interface_find(interface_type->interface, path);
 
 		if (proxy)
@@ -683,6 +689,8 @@ static void interfaces_added_callback(struct l_dbus_message *message,
 		return;
 
 	proxy_interfaces_update_properties(path, &object);
+
+	display_refresh_invalidate();
 }
 
 static void interfaces_removed_callback(struct l_dbus_message *message,
@@ -709,6 +717,8 @@ static void interfaces_removed_callback(struct l_dbus_message *message,
 
 		proxy_interface_destroy(proxy);
 	}
+
+	display_refresh_invalidate();
 }
 
 static void get_managed_objects_callback(struct l_dbus_message *message,
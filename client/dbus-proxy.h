@@ -60,6 +60,11 @@ struct proxy_interface_type {
 	const char *interface;
 	const struct proxy_interface_property *properties;
 	const struct proxy_interface_type_ops *ops;
+	/*
+	 * One object per network: only create the proxies in non-interactive
+	 * mode if the command family asks for them.
+	 */
+	bool on_demand;
 };
 
 char *proxy_property_completion(
@@ -43,6 +43,14 @@
 	"\001" COLOR_GREEN "\002" "[iwd]" "\001" COLOR_OFF "\002" "# "
 #define LINE_LEN 81
 
+/*
+ * Refreshable commands are only re-run when iwd signalled a change, at most
+ * once per second.  Some output, e.g. diagnostics, comes from method calls
+ * without change signals, so it is still refreshed after this many idle
+ * seconds.
+ */
+#define REFRESH_MAX_IDLE 5
+
 static struct l_signal *window_change_signal;
 static struct l_io *io;
 static char dashed_line[LINE_LEN] = { [0 ... LINE_LEN - 2] = '-' };
@@ -60,6 +68,8 @@ static struct display_refresh {
 	size_t undo_lines;
 	struct l_queue *redo_entries;
 	bool recording;
+	bool stale;
+	unsigned int idle_ticks;
 } display_refresh = { .enabled = true };
 
 struct saved_input {
@@ -181,6 +191,8 @@ void display_refresh_set_cmd(const char *family, const char *entity,
 
 		display_refresh.recording = false;
 		display_refresh.undo_lines = 0;
+		display_refresh.stale = false;
+		display_refresh.idle_ticks = 0;
 
 		return;
 	}
@@ -265,6 +277,15 @@ static void timeout_callback(struct l_timeout *timeout, void *user_data)
 		return;
 	}
 
+	if (!display_refresh.stale &&
+			++display_refresh.idle_ticks < REFRESH_MAX_IDLE) {
+		display_refresh_timeout_set();
+		return;
+	}
+
+	display_refresh.stale = false;
+	display_refresh.idle_ticks = 0;
+
 	input = save_input();
 	display_refresh_undo_lines();
 	restore_input(input);
@@ -275,6 +296,12 @@ static void timeout_callback(struct l_timeout *timeout, void *user_data)
 						display_refresh.argc);
 }
 
+/* Called on any object or property change signalled by iwd */
+void display_refresh_invalidate(void)
+{
+	display_refresh.stale = true;
+}
+
 void display_refresh_timeout_set(void)
 {
 	if (refresh_timeout)
@@ -43,6 +43,7 @@ void display_command_line(const char *command_family,
 						const struct command *cmd);
 
 void display_refresh_timeout_set(void);
+void display_refresh_invalidate(void);
 void display_refresh_reset(void);
 void display_refresh_set_cmd(const char *family, const char *entity,
 					const struct command *cmd,
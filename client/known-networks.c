@@ -239,6 +239,7 @@ static struct proxy_interface_type known_network_interface_type = {
 	.interface = IWD_KNOWN_NETWORK_INTREFACE,
 	.properties = known_network_properties,
 	.ops = &known_network_ops,
+	.on_demand = true,
 };
 
 static bool known_network_match(const void *a, const void *b)
@@ -454,6 +455,10 @@ static struct command_family known_networks_command_family = {
 	.command_list = known_networks_commands,
 	.family_arg_completion = family_arg_completion,
 	.entity_arg_completion = entity_arg_completion,
+	.on_demand_interfaces = (const char *const []) {
+		IWD_KNOWN_NETWORK_INTREFACE,
+		NULL
+	},
 };
 
 static int known_networks_command_family_init(void)
@@ -203,6 +203,7 @@ static struct proxy_interface_type network_interface_type = {
 	.interface = IWD_NETWORK_INTERFACE,
 	.properties = network_properties,
 	.ops = &ops,
+	.on_demand = true,
 };
 
 struct completion_search_parameters {
@@ -693,6 +693,10 @@ static struct command_family station_command_family = {
 	.command_list = station_commands,
 	.family_arg_completion = family_arg_completion,
 	.entity_arg_completion = entity_arg_completion,
+	.on_demand_interfaces = (const char *const []) {
+		IWD_NETWORK_INTERFACE,
+		NULL
+	},
 };
 
 static int station_command_family_init(void)
@@ -32,6 +32,8 @@
 #include "queue.h"
 #include "asn1-private.h"
 #include "cipher.h"
+#include "checksum.h"
+#include "time.h"
 #include "pem-private.h"
 #include "cert.h"
 #include "cert-private.h"
@@ -150,6 +152,20 @@ LIB_EXPORT struct l_cert *l_cert_new_from_der(const uint8_t *buf,
 	return cert;
 }
 
+LIB_EXPORT struct l_cert *l_cert_clone(struct l_cert *cert)
+{
+	struct l_cert *copy;
+
+	if (unlikely(!cert))
+		return NULL;
+
+	copy = l_memdup(cert, sizeof(struct l_cert) + cert->asn1_len);
+	copy->issuer = NULL;
+	copy->issued = NULL;
+
+	return copy;
+}
+
 LIB_EXPORT void l_cert_free(struct l_cert *cert)
 {
 	l_free(cert);
@@ -319,6 +335,22 @@ LIB_EXPORT void l_certchain_free(struct l_certchain *chain)
 	l_free(chain);
 }
 
+LIB_EXPORT struct l_certchain *l_certchain_clone(struct l_certchain *chain)
+{
+	struct l_certchain *copy;
+	struct l_cert *cert;
+
+	if (unlikely(!chain || !chain->leaf))
+		return NULL;
+
+	copy = certchain_new_from_leaf(l_cert_clone(chain->leaf));
+
+	for (cert = chain->leaf->issuer; cert; cert = cert->issuer)
+		certchain_link_issuer(copy, l_cert_clone(cert));
+
+	return copy;
+}
+
 LIB_EXPORT struct l_cert *l_certchain_get_leaf(struct l_certchain *chain)
 {
 	if (unlikely(!chain))
@@ -446,9 +478,8 @@ static struct l_key *cert_try_link(struct l_cert *cert, struct l_keyring *ring)
 		return false;	\
 	} while (0)
 
-LIB_EXPORT bool l_certchain_verify(struct l_certchain *chain,
-					struct l_queue *ca_certs,
-					const char **error)
+static bool cert_chain_verify(struct l_certchain *chain,
+				struct l_queue *ca_certs, const char **error)
 {
 	struct l_keyring *ca_ring = NULL;
 	_auto_(l_keyring_free) struct l_keyring *verify_ring = NULL;
@@ -578,6 +609,131 @@ LIB_EXPORT bool l_certchain_verify(struct l_certchain *chain,
 	return true;
 }
 
+/*
+ * Successful verifications are remembered for a while so that the same
+ * peer chain presented again, e.g. on every full EAP reauthentication
+ * while roaming within an ESS, doesn't cost a kernel keyring and a
+ * keyctl round trip per signature each time.  The kernel doesn't look at
+ * the certificate validity periods during verification so neither does
+ * the cache, entries simply expire after CERT_VERIFY_CACHE_TTL.
+ */
+#define CERT_VERIFY_CACHE_SIZE	8
+#define CERT_VERIFY_CACHE_TTL	(3600 * L_USEC_PER_SEC)
+
+static struct cert_verify_cache_entry {
+	uint8_t digest[32];
+	uint64_t expiry;
+} cert_verify_cache[CERT_VERIFY_CACHE_SIZE];
+
+static void cert_digest_update(struct l_checksum *checksum,
+				const struct l_cert *cert)
+{
+	uint8_t len[4];
+
+	l_put_be32(cert->asn1_len, len);
+	l_checksum_update(checksum, len, sizeof(len));
+	l_checksum_update(checksum, cert->asn1, cert->asn1_len);
+}
+
+/*
+ * The key covers both the chain and the trusted CA set it was verified
+ * against, with each certificate length-prefixed so that no two
+ * different inputs can be concatenated into the same byte stream.
+ */
+static bool cert_verify_cache_key(struct l_certchain *chain,
+					struct l_queue *ca_certs,
+					uint8_t *out_digest)
+{
+	struct l_checksum *checksum = l_checksum_new(L_CHECKSUM_SHA256);
+	const struct l_queue_entry *entry;
+	struct l_cert *cert;
+	uint8_t count[4];
+	bool r;
+
+	if (!checksum)
+		return false;
+
+	for (cert = chain->leaf; cert; cert = cert->issuer)
+		cert_digest_update(checksum, cert);
+
+	l_put_be32(l_queue_length(ca_certs), count);
+	l_checksum_update(checksum, count, sizeof(count));
+
+	for (entry = l_queue_get_entries(ca_certs); entry;
+			entry = entry->next)
+		cert_digest_update(checksum, entry->data);
+
+	r = l_checksum_get_digest(checksum, out_digest, 32) == 32;
+	l_checksum_free(checksum);
+
+	return r;
+}
+
+static struct cert_verify_cache_entry *cert_verify_cache_find(
+						const uint8_t *digest,
+						uint64_t now)
+{
+	unsigned int i;
+
+	for (i = 0; i < CERT_VERIFY_CACHE_SIZE; i++) {
+		struct cert_verify_cache_entry *entry = &cert_verify_cache[i];
+
+		if (entry->expiry && l_time_before(now, entry->expiry) &&
+				!memcmp(entry->digest, digest, 32))
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void cert_verify_cache_add(const uint8_t *digest, uint64_t now)
+{
+	struct cert_verify_cache_entry *oldest = &cert_verify_cache[0];
+	unsigned int i;
+
+	/* Reuse an expired slot or else the one closest to expiring */
+	for (i = 0; i < CERT_VERIFY_CACHE_SIZE; i++) {
+		struct cert_verify_cache_entry *entry = &cert_verify_cache[i];
+
+		if (!entry->expiry || !l_time_before(now, entry->expiry)) {
+			oldest = entry;
+			break;
+		}
+
+		if (l_time_before(entry->expiry, oldest->expiry))
+			oldest = entry;
+	}
+
+	memcpy(oldest->digest, digest, 32);
+	oldest->expiry = l_time_offset(now, CERT_VERIFY_CACHE_TTL);
+}
+
+LIB_EXPORT bool l_certchain_verify(struct l_certchain *chain,
+					struct l_queue *ca_certs,
+					const char **error)
+{
+	uint8_t digest[32];
+	bool have_digest;
+	uint64_t now;
+
+	if (unlikely(!chain || !chain->leaf))
+		return cert_chain_verify(chain, ca_certs, error);
+
+	now = l_time_now();
+	have_digest = cert_verify_cache_key(chain, ca_certs, digest);
+
+	if (have_digest && cert_verify_cache_find(digest, now))
+		return true;
+
+	if (!cert_chain_verify(chain, ca_certs, error))
+		return false;
+
+	if (have_digest)
+		cert_verify_cache_add(digest, now);
+
+	return true;
+}
+
 struct l_key *cert_key_from_pkcs8_private_key_info(const uint8_t *der,
 							size_t der_len)
 {
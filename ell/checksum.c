@@ -30,9 +30,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "useful.h"
 #include "checksum.h"
+#include "util.h"
 #include "private.h"
 
 #ifndef HAVE_LINUX_IF_ALG_H
@@ -78,6 +80,7 @@ static struct checksum_info checksum_algs[] = {
 	[L_CHECKSUM_MD4] = { .name = "md4", .digest_len = 16 },
 	[L_CHECKSUM_MD5] = { .name = "md5", .digest_len = 16 },
 	[L_CHECKSUM_SHA1] = { .name = "sha1", .digest_len = 20 },
+	[L_CHECKSUM_SHA224] = { .name = "sha224", .digest_len = 28 },
 	[L_CHECKSUM_SHA256] = { .name = "sha256", .digest_len = 32 },
 	[L_CHECKSUM_SHA384] = { .name = "sha384", .digest_len = 48 },
 	[L_CHECKSUM_SHA512] = { .name = "sha512", .digest_len = 64 },
@@ -90,6 +93,7 @@ static struct checksum_info checksum_hmac_algs[] = {
 	[L_CHECKSUM_MD4] = { .name = "hmac(md4)", .digest_len = 16 },
 	[L_CHECKSUM_MD5] = { .name = "hmac(md5)", .digest_len = 16 },
 	[L_CHECKSUM_SHA1] = { .name = "hmac(sha1)", .digest_len = 20 },
+	[L_CHECKSUM_SHA224] = { .name = "hmac(sha224)", .digest_len = 28 },
 	[L_CHECKSUM_SHA256] = { .name = "hmac(sha256)", .digest_len = 32 },
 	[L_CHECKSUM_SHA384] = { .name = "hmac(sha384)", .digest_len = 48 },
 	[L_CHECKSUM_SHA512] = { .name = "hmac(sha512)", .digest_len = 64 },
@@ -114,6 +118,442 @@ static const struct {
 
 #define is_valid_index(array, i) ((i) >= 0 && (i) < L_ARRAY_SIZE(array))
 
+/*
+ * In-process implementations of the hash functions.  For the short
+ * messages typical of the protocols using ell, the syscalls and the
+ * copies into the kernel make AF_ALG sockets much slower than hashing
+ * locally, and the algif_hash module is not always available.  The
+ * kernel is still used for checksum types not implemented here.
+ */
+struct soft_hash_ctx {
+	union {
+		uint32_t h32[8];
+		uint64_t h64[8];
+	};
+	uint64_t len;
+	uint8_t buf[128];
+};
+
+struct soft_hash {
+	const void *iv;
+	unsigned int block_len;
+	bool big_endian;
+	void (*compress)(struct soft_hash_ctx *ctx, const uint8_t *block);
+};
+
+static inline uint32_t rol32(uint32_t x, unsigned int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t ror32(uint32_t x, unsigned int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static inline uint64_t ror64(uint64_t x, unsigned int n)
+{
+	return (x >> n) | (x << (64 - n));
+}
+
+static const uint32_t md_iv[8] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+/* RFC 1320 */
+static void md4_compress(struct soft_hash_ctx *ctx, const uint8_t *block)
+{
+	static const uint8_t idx[48] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+		0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15,
+	};
+	static const uint8_t shift[3][4] = {
+		{ 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 },
+	};
+	uint32_t x[16];
+	uint32_t a = ctx->h32[0], b = ctx->h32[1];
+	uint32_t c = ctx->h32[2], d = ctx->h32[3];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = l_get_le32(block + i * 4);
+
+	for (i = 0; i < 48; i++) {
+		uint32_t f, t;
+
+		if (i < 16)
+			f = (b & c) | (~b & d);
+		else if (i < 32)
+			f = ((b & c) | (b & d) | (c & d)) + 0x5a827999;
+		else
+			f = (b ^ c ^ d) + 0x6ed9eba1;
+
+		t = rol32(a + f + x[idx[i]], shift[i / 16][i % 4]);
+		a = d;
+		d = c;
+		c = b;
+		b = t;
+	}
+
+	ctx->h32[0] += a;
+	ctx->h32[1] += b;
+	ctx->h32[2] += c;
+	ctx->h32[3] += d;
+}
+
+/* RFC 1321 */
+static void md5_compress(struct soft_hash_ctx *ctx, const uint8_t *block)
+{
+	static const uint32_t k[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+		0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+		0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+		0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+		0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+		0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+		0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+		0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+		0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+		0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+		0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+		0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+		0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+		0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+	};
+	static const uint8_t shift[4][4] = {
+		{ 7, 12, 17, 22 }, { 5, 9, 14, 20 },
+		{ 4, 11, 16, 23 }, { 6, 10, 15, 21 },
+	};
+	uint32_t m[16];
+	uint32_t a = ctx->h32[0], b = ctx->h32[1];
+	uint32_t c = ctx->h32[2], d = ctx->h32[3];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = l_get_le32(block + i * 4);
+
+	for (i = 0; i < 64; i++) {
+		uint32_t f;
+		unsigned int g;
+
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) % 16;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) % 16;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) % 16;
+		}
+
+		f += a + k[i] + m[g];
+		a = d;
+		d = c;
+		c = b;
+		b += rol32(f, shift[i / 16][i % 4]);
+	}
+
+	ctx->h32[0] += a;
+	ctx->h32[1] += b;
+	ctx->h32[2] += c;
+	ctx->h32[3] += d;
+}
+
+/* FIPS 180-4, Section 6.1.2 */
+static void sha1_compress(struct soft_hash_ctx *ctx, const uint8_t *block)
+{
+	uint32_t w[80];
+	uint32_t a = ctx->h32[0], b = ctx->h32[1], c = ctx->h32[2];
+	uint32_t d = ctx->h32[3], e = ctx->h32[4];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = l_get_be32(block + i * 4);
+
+	for (; i < 80; i++)
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	for (i = 0; i < 80; i++) {
+		uint32_t f, t;
+
+		if (i < 20)
+			f = ((b & c) | (~b & d)) + 0x5a827999;
+		else if (i < 40)
+			f = (b ^ c ^ d) + 0x6ed9eba1;
+		else if (i < 60)
+			f = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+		else
+			f = (b ^ c ^ d) + 0xca62c1d6;
+
+		t = rol32(a, 5) + f + e + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	ctx->h32[0] += a;
+	ctx->h32[1] += b;
+	ctx->h32[2] += c;
+	ctx->h32[3] += d;
+	ctx->h32[4] += e;
+}
+
+static const uint32_t sha224_iv[8] = {
+	0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939,
+	0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4,
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* FIPS 180-4, Section 6.2.2 */
+static void sha256_compress(struct soft_hash_ctx *ctx, const uint8_t *block)
+{
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+		0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+		0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+		0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+		0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+		0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+		0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+		0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+		0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+	uint32_t w[64];
+	uint32_t s[8];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = l_get_be32(block + i * 4);
+
+	for (; i < 64; i++) {
+		uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+				(w[i - 15] >> 3);
+		uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+				(w[i - 2] >> 10);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, ctx->h32, sizeof(s));
+
+	for (i = 0; i < 64; i++) {
+		uint32_t t1 = s[7] + (ror32(s[4], 6) ^ ror32(s[4], 11) ^
+					ror32(s[4], 25)) +
+				((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		uint32_t t2 = (ror32(s[0], 2) ^ ror32(s[0], 13) ^
+					ror32(s[0], 22)) +
+				((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		memmove(s + 1, s, 7 * sizeof(uint32_t));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->h32[i] += s[i];
+}
+
+static const uint64_t sha384_iv[8] = {
+	0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL,
+	0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+	0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL,
+	0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL,
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+	0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+	0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+/* FIPS 180-4, Section 6.4.2 */
+static void sha512_compress(struct soft_hash_ctx *ctx, const uint8_t *block)
+{
+	static const uint64_t k[80] = {
+		0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL,
+		0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+		0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+		0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+		0xd807aa98a3030242ULL, 0x12835b0145706fbeULL,
+		0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+		0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL,
+		0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+		0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+		0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+		0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL,
+		0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+		0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL,
+		0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+		0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+		0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+		0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL,
+		0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+		0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL,
+		0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+		0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+		0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+		0xd192e819d6ef5218ULL, 0xd69906245565a910ULL,
+		0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+		0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL,
+		0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+		0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+		0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+		0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL,
+		0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+		0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL,
+		0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+		0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+		0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+		0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL,
+		0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+		0x28db77f523047d84ULL, 0x32caab7b40c72493ULL,
+		0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+		0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+		0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+	};
+	uint64_t w[80];
+	uint64_t s[8];
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = l_get_be64(block + i * 8);
+
+	for (; i < 80; i++) {
+		uint64_t s0 = ror64(w[i - 15], 1) ^ ror64(w[i - 15], 8) ^
+				(w[i - 15] >> 7);
+		uint64_t s1 = ror64(w[i - 2], 19) ^ ror64(w[i - 2], 61) ^
+				(w[i - 2] >> 6);
+
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(s, ctx->h64, sizeof(s));
+
+	for (i = 0; i < 80; i++) {
+		uint64_t t1 = s[7] + (ror64(s[4], 14) ^ ror64(s[4], 18) ^
+					ror64(s[4], 41)) +
+				((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		uint64_t t2 = (ror64(s[0], 28) ^ ror64(s[0], 34) ^
+					ror64(s[0], 39)) +
+				((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+		memmove(s + 1, s, 7 * sizeof(uint64_t));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->h64[i] += s[i];
+}
+
+static const struct soft_hash soft_hashes[] = {
+	[L_CHECKSUM_MD4] = { md_iv, 64, false, md4_compress },
+	[L_CHECKSUM_MD5] = { md_iv, 64, false, md5_compress },
+	[L_CHECKSUM_SHA1] = { md_iv, 64, true, sha1_compress },
+	[L_CHECKSUM_SHA224] = { sha224_iv, 64, true, sha256_compress },
+	[L_CHECKSUM_SHA256] = { sha256_iv, 64, true, sha256_compress },
+	[L_CHECKSUM_SHA384] = { sha384_iv, 128, true, sha512_compress },
+	[L_CHECKSUM_SHA512] = { sha512_iv, 128, true, sha512_compress },
+};
+
+static void soft_hash_init(const struct soft_hash *hash,
+				struct soft_hash_ctx *ctx)
+{
+	if (hash->block_len == 128)
+		memcpy(ctx->h64, hash->iv, sizeof(ctx->h64));
+	else
+		memcpy(ctx->h32, hash->iv, sizeof(ctx->h32));
+
+	ctx->len = 0;
+}
+
+static void soft_hash_update(const struct soft_hash *hash,
+				struct soft_hash_ctx *ctx,
+				const uint8_t *data, size_t len)
+{
+	size_t used = ctx->len % hash->block_len;
+
+	ctx->len += len;
+
+	if (used) {
+		size_t n = minsize(len, hash->block_len - used);
+
+		memcpy(ctx->buf + used, data, n);
+		data += n;
+		len -= n;
+
+		if (used + n < hash->block_len)
+			return;
+
+		hash->compress(ctx, ctx->buf);
+	}
+
+	for (; len >= hash->block_len; data += hash->block_len,
+						len -= hash->block_len)
+		hash->compress(ctx, data);
+
+	memcpy(ctx->buf, data, len);
+}
+
+static void soft_hash_final(const struct soft_hash *hash,
+				struct soft_hash_ctx *ctx,
+				uint8_t *digest, size_t digest_len)
+{
+	size_t bl = hash->block_len;
+	size_t used = ctx->len % bl;
+	/* SHA-384/512 use a 128-bit length, we only need the low half */
+	size_t len_size = bl == 128 ? 16 : 8;
+	uint64_t bits = ctx->len * 8;
+	unsigned int i;
+
+	ctx->buf[used++] = 0x80;
+
+	if (used > bl - len_size) {
+		memset(ctx->buf + used, 0, bl - used);
+		hash->compress(ctx, ctx->buf);
+		used = 0;
+	}
+
+	memset(ctx->buf + used, 0, bl - used);
+
+	if (hash->big_endian)
+		l_put_be64(bits, ctx->buf + bl - 8);
+	else
+		l_put_le64(bits, ctx->buf + bl - 8);
+
+	hash->compress(ctx, ctx->buf);
+
+	for (i = 0; i < digest_len; i++) {
+		if (bl == 128)
+			digest[i] = ctx->h64[i / 8] >> (56 - (i % 8) * 8);
+		else if (hash->big_endian)
+			digest[i] = ctx->h32[i / 4] >> (24 - (i % 4) * 8);
+		else
+			digest[i] = ctx->h32[i / 4] >> ((i % 4) * 8);
+	}
+}
+
 /**
  * l_checksum:
  *
@@ -122,8 +562,104 @@ static const struct {
 struct l_checksum {
 	int sk;
 	const struct checksum_info *alg_info;
+	/* Set for checksums computed in-process, @sk is unused then */
+	const struct soft_hash *soft;
+	bool hmac;
+	struct soft_hash_ctx ctx;
+	/* HMAC states after hashing the ipad and opad blocks */
+	struct soft_hash_ctx inner;
+	struct soft_hash_ctx outer;
 };
 
+static struct l_checksum *soft_checksum_new(enum l_checksum_type type,
+						const struct checksum_info *info,
+						bool hmac, const void *key,
+						size_t key_len)
+{
+	const struct soft_hash *hash = &soft_hashes[type];
+	size_t digest_len = checksum_algs[type].digest_len;
+	struct l_checksum *checksum;
+	uint8_t pad[128];
+	uint8_t key_digest[64];
+	unsigned int i;
+
+	checksum = l_new(struct l_checksum, 1);
+	checksum->sk = -1;
+	checksum->alg_info = info;
+	checksum->soft = hash;
+	checksum->hmac = hmac;
+
+	if (!hmac) {
+		soft_hash_init(hash, &checksum->ctx);
+		return checksum;
+	}
+
+	/* RFC 2104: keys longer than the block size are hashed first */
+	if (key_len > hash->block_len) {
+		soft_hash_init(hash, &checksum->ctx);
+		soft_hash_update(hash, &checksum->ctx, key, key_len);
+		soft_hash_final(hash, &checksum->ctx, key_digest, digest_len);
+		key = key_digest;
+		key_len = digest_len;
+	}
+
+	memset(pad, 0x36, hash->block_len);
+	for (i = 0; i < key_len; i++)
+		pad[i] ^= ((const uint8_t *) key)[i];
+
+	soft_hash_init(hash, &checksum->inner);
+	soft_hash_update(hash, &checksum->inner, pad, hash->block_len);
+
+	memset(pad, 0x5c, hash->block_len);
+	for (i = 0; i < key_len; i++)
+		pad[i] ^= ((const uint8_t *) key)[i];
+
+	soft_hash_init(hash, &checksum->outer);
+	soft_hash_update(hash, &checksum->outer, pad, hash->block_len);
+
+	memcpy(&checksum->ctx, &checksum->inner, sizeof(checksum->ctx));
+
+	explicit_bzero(pad, sizeof(pad));
+	explicit_bzero(key_digest, sizeof(key_digest));
+	return checksum;
+}
+
+static void soft_checksum_reset(struct l_checksum *checksum)
+{
+	if (checksum->hmac)
+		memcpy(&checksum->ctx, &checksum->inner,
+			sizeof(checksum->ctx));
+	else
+		soft_hash_init(checksum->soft, &checksum->ctx);
+}
+
+static ssize_t soft_checksum_get_digest(struct l_checksum *checksum,
+					uint8_t *out, size_t len)
+{
+	size_t digest_len = checksum->alg_info->digest_len;
+	uint8_t digest[64];
+
+	soft_hash_final(checksum->soft, &checksum->ctx, digest, digest_len);
+
+	if (checksum->hmac) {
+		struct soft_hash_ctx outer;
+
+		memcpy(&outer, &checksum->outer, sizeof(outer));
+		soft_hash_update(checksum->soft, &outer, digest, digest_len);
+		soft_hash_final(checksum->soft, &outer, digest, digest_len);
+		explicit_bzero(&outer, sizeof(outer));
+	}
+
+	len = minsize(len, digest_len);
+	memcpy(out, digest, len);
+	explicit_bzero(digest, sizeof(digest));
+
+	/* Same as with AF_ALG, the next update starts a new operation */
+	soft_checksum_reset(checksum);
+
+	return len;
+}
+
 static int create_alg(const char *alg)
 {
 	struct sockaddr_alg salg;
@@ -162,6 +698,10 @@ LIB_EXPORT struct l_checksum *l_checksum_new(enum l_checksum_type type)
 	if (!is_valid_index(checksum_algs, type) || !checksum_algs[type].name)
 		return NULL;
 
+	if (soft_hashes[type].compress)
+		return soft_checksum_new(type, &checksum_algs[type], false,
+						NULL, 0);
+
 	checksum = l_new(struct l_checksum, 1);
 	checksum->alg_info = &checksum_algs[type];
 
@@ -220,6 +760,10 @@ LIB_EXPORT struct l_checksum *l_checksum_new_hmac(enum l_checksum_type type,
 			!checksum_hmac_algs[type].name)
 		return NULL;
 
+	if (soft_hashes[type].compress)
+		return soft_checksum_new(type, &checksum_hmac_algs[type], true,
+						key, key_len);
+
 	fd = create_alg(checksum_hmac_algs[type].name);
 	if (fd < 0)
 		return NULL;
@@ -257,6 +801,9 @@ LIB_EXPORT struct l_checksum *l_checksum_clone(struct l_checksum *checksum)
 	if (unlikely(!checksum))
 		return NULL;
 
+	if (checksum->soft)
+		return l_memdup(checksum, sizeof(struct l_checksum));
+
 	clone = l_new(struct l_checksum, 1);
 	clone->sk = accept4(checksum->sk, NULL, 0, SOCK_CLOEXEC);
 
@@ -280,7 +827,10 @@ LIB_EXPORT void l_checksum_free(struct l_checksum *checksum)
 	if (unlikely(!checksum))
 		return;
 
-	close(checksum->sk);
+	if (!checksum->soft)
+		close(checksum->sk);
+
+	explicit_bzero(checksum, sizeof(struct l_checksum));
 	l_free(checksum);
 }
 
@@ -295,6 +845,11 @@ LIB_EXPORT void l_checksum_reset(struct l_checksum *checksum)
 	if (unlikely(!checksum))
 		return;
 
+	if (checksum->soft) {
+		soft_checksum_reset(checksum);
+		return;
+	}
+
 	send(checksum->sk, NULL, 0, 0);
 }
 
@@ -316,6 +871,11 @@ LIB_EXPORT bool l_checksum_update(struct l_checksum *checksum,
 	if (unlikely(!checksum))
 		return false;
 
+	if (checksum->soft) {
+		soft_hash_update(checksum->soft, &checksum->ctx, data, len);
+		return true;
+	}
+
 	written = send(checksum->sk, data, len, MSG_MORE);
 	if (written < 0)
 		return false;
@@ -346,6 +906,16 @@ LIB_EXPORT bool l_checksum_updatev(struct l_checksum *checksum,
 	if (unlikely(!iov) || unlikely(!iov_len))
 		return false;
 
+	if (checksum->soft) {
+		size_t i;
+
+		for (i = 0; i < iov_len; i++)
+			soft_hash_update(checksum->soft, &checksum->ctx,
+						iov[i].iov_base, iov[i].iov_len);
+
+		return true;
+	}
+
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_iov = (struct iovec *) iov;
 	msg.msg_iovlen = iov_len;
@@ -383,6 +953,9 @@ LIB_EXPORT ssize_t l_checksum_get_digest(struct l_checksum *checksum,
 	if (unlikely(!len))
 		return -EINVAL;
 
+	if (checksum->soft)
+		return soft_checksum_get_digest(checksum, digest, len);
+
 	result = recv(checksum->sk, digest, len, 0);
 	if (result < 0)
 		return -errno;
@@ -425,6 +998,14 @@ static void init_supported()
 
 	initialized = true;
 
+	for (i = 0; i < L_ARRAY_SIZE(soft_hashes); i++) {
+		if (!soft_hashes[i].compress)
+			continue;
+
+		checksum_algs[i].supported = true;
+		checksum_hmac_algs[i].supported = true;
+	}
+
 	sk = socket(PF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
 	if (sk < 0)
 		return;
@@ -303,6 +303,7 @@ static ssize_t operate_cipher(int sk, __u32 operation,
 	struct msghdr msg;
 	struct cmsghdr *c_msg;
 	struct iovec iov[2];
+	uint8_t ad_buf[64];
 	ssize_t result;
 
 	c_msg_size = CMSG_SPACE(sizeof(operation));
@@ -372,9 +373,11 @@ static ssize_t operate_cipher(int sk, __u32 operation,
 		 * than force the caller to pad their result buffer with
 		 * the correct number of bytes for the additional data,
 		 * the necessary space is allocated here and then the
-		 * duplicate AAD is discarded.
+		 * duplicate AAD is discarded.  The AAD is usually small, e.g.
+		 * 13 bytes per TLS record, so avoid the allocation then.
 		 */
-		iov[0].iov_base = l_malloc(ad_len);
+		iov[0].iov_base = ad_len <= sizeof(ad_buf) ?
+					ad_buf : l_malloc(ad_len);
 		iov[0].iov_len = ad_len;
 		iov[1].iov_base = (void *) out;
 		iov[1].iov_len = out_len;
@@ -390,7 +393,8 @@ static ssize_t operate_cipher(int sk, __u32 operation,
 		else if (result > 0)
 			result = 0;
 
-		l_free(iov[0].iov_base);
+		if (iov[0].iov_base != ad_buf)
+			l_free(iov[0].iov_base);
 	} else {
 		result = read(sk, out, out_len);
 	}
@@ -73,6 +73,7 @@ struct l_dbus_message {
 	char *sender;
 	int fds[16];
 	uint32_t num_fds;
+	uint64_t rx_time;
 
 	bool sealed : 1;
 	bool signature_free : 1;
@@ -915,6 +916,7 @@ struct builder_driver {
 	char *(*finish)(struct dbus_builder *, void **, size_t *);
 	bool (*mark)(struct dbus_builder *);
 	bool (*rewind)(struct dbus_builder *);
+	bool (*reserve)(struct dbus_builder *, size_t);
 	struct dbus_builder *(*new)(void *, size_t);
 	void (*free)(struct dbus_builder *);
 };
@@ -932,6 +934,7 @@ static struct builder_driver dbus1_driver = {
 	.finish = _dbus1_builder_finish,
 	.mark = _dbus1_builder_mark,
 	.rewind = _dbus1_builder_rewind,
+	.reserve = _dbus1_builder_reserve,
 	.new = _dbus1_builder_new,
 	.free = _dbus1_builder_free,
 };
@@ -949,6 +952,7 @@ static struct builder_driver gvariant_driver = {
 	.finish = _gvariant_builder_finish,
 	.mark = _gvariant_builder_mark,
 	.rewind = _gvariant_builder_rewind,
+	.reserve = _gvariant_builder_reserve,
 	.new = _gvariant_builder_new,
 	.free = _gvariant_builder_free,
 };
@@ -1279,6 +1283,25 @@ LIB_EXPORT const char *l_dbus_message_get_member(struct l_dbus_message *message)
 	return message->member;
 }
 
+/*
+ * The time a received message was read off the bus, for measuring how long
+ * a method call took to answer.  0 for messages created locally.
+ */
+LIB_EXPORT uint64_t l_dbus_message_get_receive_time(
+					struct l_dbus_message *message)
+{
+	if (unlikely(!message))
+		return 0;
+
+	return message->rx_time;
+}
+
+void _dbus_message_set_receive_time(struct l_dbus_message *message,
+					uint64_t time)
+{
+	message->rx_time = time;
+}
+
 LIB_EXPORT const char *l_dbus_message_get_destination(struct l_dbus_message *message)
 {
 	if (unlikely(!message))
@@ -1980,6 +2003,16 @@ bool _dbus_message_builder_mark(struct l_dbus_message_builder *builder)
 	return builder->driver->mark(builder->builder);
 }
 
+/* Make room for at least @size more bytes of body to avoid regrowing */
+bool _dbus_message_builder_reserve(struct l_dbus_message_builder *builder,
+					size_t size)
+{
+	if (unlikely(!builder))
+		return false;
+
+	return builder->driver->reserve(builder->builder, size);
+}
+
 bool _dbus_message_builder_rewind(struct l_dbus_message_builder *builder)
 {
 	if (unlikely(!builder))
@@ -91,6 +91,7 @@ bool _dbus1_iter_skip_entry(struct l_dbus_message_iter *iter);
 
 struct dbus_builder *_dbus1_builder_new(void *body, size_t body_size);
 void _dbus1_builder_free(struct dbus_builder *builder);
+bool _dbus1_builder_reserve(struct dbus_builder *builder, size_t size);
 bool _dbus1_builder_append_basic(struct dbus_builder *builder,
 					char type, const void *value);
 bool _dbus1_builder_enter_struct(struct dbus_builder *builder,
@@ -122,6 +123,8 @@ void _dbus_message_set_sender(struct l_dbus_message *message,
 					const char *sender);
 void _dbus_message_set_destination(struct l_dbus_message *message,
 					const char *destination);
+void _dbus_message_set_receive_time(struct l_dbus_message *message,
+					uint64_t time);
 
 enum dbus_message_type _dbus_message_get_type(struct l_dbus_message *message);
 const char * _dbus_message_get_type_as_string(struct l_dbus_message *message);
@@ -155,6 +158,8 @@ bool dbus_message_compare(struct l_dbus_message *message,
 
 bool _dbus_message_builder_mark(struct l_dbus_message_builder *builder);
 bool _dbus_message_builder_rewind(struct l_dbus_message_builder *builder);
+bool _dbus_message_builder_reserve(struct l_dbus_message_builder *builder,
+					size_t size);
 
 unsigned int _dbus_message_unix_fds_from_header(const void *data, size_t size);
 
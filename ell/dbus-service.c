@@ -130,6 +130,8 @@ struct _dbus_object_tree {
 	struct object_node *root;
 	struct l_queue *object_managers;
 	struct l_queue *property_changes;
+	struct l_hashmap *property_change_map;
+	size_t get_objects_size_hint;
 	struct l_idle *emit_signals_work;
 	bool flushing;
 };
@@ -576,6 +578,7 @@ struct _dbus_object_tree *_dbus_object_tree_new()
 	tree->root = l_new(struct object_node, 1);
 
 	tree->property_changes = l_queue_new();
+	tree->property_change_map = l_hashmap_new();
 
 	_dbus_object_tree_register_interface(tree, L_DBUS_INTERFACE_PROPERTIES,
 						properties_setup_func, NULL,
@@ -634,6 +637,7 @@ void _dbus_object_tree_free(struct _dbus_object_tree *tree)
 	l_queue_destroy(tree->object_managers, object_manager_free);
 
 	l_queue_destroy(tree->property_changes, property_change_record_free);
+	l_hashmap_destroy(tree->property_change_map, NULL);
 
 	if (tree->emit_signals_work)
 		l_idle_remove(tree->emit_signals_work);
@@ -1037,6 +1041,7 @@ struct emit_signals_data {
 	struct l_dbus *dbus;
 	struct object_manager *manager;
 	struct object_node *node;
+	struct l_hashmap *property_change_map;
 };
 
 static bool emit_interfaces_removed(void *data, void *user_data)
@@ -1101,6 +1106,7 @@ static bool emit_properties_changed(void *data, void *user_data)
 			l_dbus_send(es->dbus, signal);
 	}
 
+	l_hashmap_remove(es->property_change_map, rec->instance);
 	property_change_record_free(rec);
 
 	return true;
@@ -1112,6 +1118,7 @@ void _dbus_object_tree_signals_flush(struct l_dbus *dbus, const char *path)
 	const struct l_queue_entry *entry;
 	struct emit_signals_data data;
 	bool all_done = true;
+	bool foreign = false;
 
 	if (!tree->emit_signals_work || tree->flushing)
 		return;
@@ -1119,7 +1126,22 @@ void _dbus_object_tree_signals_flush(struct l_dbus *dbus, const char *path)
 	tree->flushing = true;
 
 	data.dbus = dbus;
-	data.node = path ? _dbus_object_tree_lookup(tree, path) : NULL;
+	data.node = NULL;
+	data.property_change_map = tree->property_change_map;
+
+	if (path) {
+		data.node = _dbus_object_tree_lookup(tree, path);
+
+		/*
+		 * A message to an object that is not ours, such as a method
+		 * call to an agent, may still refer to objects we've only
+		 * just added or removed, so flush the Object Manager
+		 * announcements.  It has no ordering relationship with our
+		 * PropertiesChanged signals though, so keep coalescing those
+		 * until idle.
+		 */
+		foreign = !data.node;
+	}
 
 	for (entry = l_queue_get_entries(tree->object_managers); entry;
 			entry = entry->next) {
@@ -1138,8 +1160,9 @@ void _dbus_object_tree_signals_flush(struct l_dbus *dbus, const char *path)
 			all_done = false;
 	}
 
-	l_queue_foreach_remove(tree->property_changes,
-				emit_properties_changed, &data);
+	if (!foreign)
+		l_queue_foreach_remove(tree->property_changes,
+					emit_properties_changed, &data);
 
 	if (!l_queue_isempty(tree->property_changes))
 		all_done = false;
@@ -1169,13 +1192,6 @@ static void schedule_emit_signals(struct l_dbus *dbus)
 	tree->emit_signals_work = l_idle_create(emit_signals, dbus, NULL);
 }
 
-static bool match_property_changes_instance(const void *a, const void *b)
-{
-	const struct property_change_record *rec = a;
-
-	return rec->instance == b;
-}
-
 static bool match_pointer(const void *a, const void *b)
 {
 	return a == b;
@@ -1206,8 +1222,7 @@ bool _dbus_object_tree_property_changed(struct l_dbus *dbus,
 	if (!property)
 		return false;
 
-	rec = l_queue_find(tree->property_changes,
-				match_property_changes_instance, instance);
+	rec = l_hashmap_lookup(tree->property_change_map, instance);
 
 	if (rec) {
 		if (l_queue_find(rec->properties, match_pointer, property))
@@ -1220,6 +1235,7 @@ bool _dbus_object_tree_property_changed(struct l_dbus *dbus,
 		rec->properties = l_queue_new();
 
 		l_queue_push_tail(tree->property_changes, rec);
+		l_hashmap_insert(tree->property_change_map, instance, rec);
 	}
 
 	l_queue_push_tail(rec->properties, property);
@@ -1685,11 +1701,12 @@ bool _dbus_object_tree_remove_interface(struct _dbus_object_tree *tree,
 		schedule_emit_signals(manager->dbus);
 	}
 
-	property_change_rec = l_queue_remove_if(tree->property_changes,
-						match_property_changes_instance,
+	property_change_rec = l_hashmap_remove(tree->property_change_map,
 						instance);
-	if (property_change_rec)
+	if (property_change_rec) {
+		l_queue_remove(tree->property_changes, property_change_rec);
 		property_change_record_free(property_change_rec);
+	}
 
 	interface_instance_free(instance);
 
@@ -2099,12 +2116,19 @@ struct l_dbus_message *_dbus_object_tree_get_objects(
 	const struct object_node *node;
 	struct l_dbus_message *reply;
 	struct l_dbus_message_builder *builder;
+	size_t body_size;
 
 	node = l_hashmap_lookup(tree->objects, path);
 
 	reply = l_dbus_message_new_method_return(message);
 	builder = l_dbus_message_builder_new(reply);
 
+	/*
+	 * The object tree rarely changes much between calls so the size of
+	 * the previous reply is a good estimate of the size of this one
+	 */
+	_dbus_message_builder_reserve(builder, tree->get_objects_size_hint);
+
 	l_dbus_message_builder_enter_array(builder, "{oa{sa{sv}}}");
 
 	if (!collect_objects(dbus, message, builder, node, path)) {
@@ -2123,6 +2147,9 @@ struct l_dbus_message *_dbus_object_tree_get_objects(
 	l_dbus_message_builder_finalize(builder);
 	l_dbus_message_builder_destroy(builder);
 
+	_dbus_message_get_body(reply, &body_size);
+	tree->get_objects_size_hint = body_size;
+
 	return reply;
 }
 
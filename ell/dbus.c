@@ -39,6 +39,7 @@
 #include "idle.h"
 #include "queue.h"
 #include "hashmap.h"
+#include "time.h"
 #include "dbus.h"
 #include "private.h"
 #include "useful.h"
@@ -264,6 +265,8 @@ static bool message_read_handler(struct l_io *io, void *user_data)
 	if (!message)
 		return true;
 
+	_dbus_message_set_receive_time(message, l_time_now());
+
 	header = _dbus_message_get_header(message, &header_size);
 	body = _dbus_message_get_body(message, &body_size);
 	l_util_hexdump_two(true, header, header_size, body, body_size,
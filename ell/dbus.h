@@ -131,6 +131,7 @@ const char *l_dbus_message_get_member(struct l_dbus_message *message);
 const char *l_dbus_message_get_destination(struct l_dbus_message *message);
 const char *l_dbus_message_get_sender(struct l_dbus_message *message);
 const char *l_dbus_message_get_signature(struct l_dbus_message *message);
+uint64_t l_dbus_message_get_receive_time(struct l_dbus_message *message);
 
 bool l_dbus_message_set_no_reply(struct l_dbus_message *message, bool on);
 bool l_dbus_message_get_no_reply(struct l_dbus_message *message);
@@ -65,6 +65,7 @@ enum dhcp_option_overload {
 #define DHCP_OPTION_PARAMETER_REQUEST_LIST 55 /* Section 9.8 */
 #define DHCP_OPTION_MAXIMUM_MESSAGE_SIZE 57 /* Section 9.10 */
 #define DHCP_OPTION_CLIENT_IDENTIFIER 61 /* Section 9.14 */
+#define DHCP_OPTION_RAPID_COMMIT 80 /* RFC 4039, Section 4 */
 
 /* RFC 2131, Figure 1 */
 struct dhcp_message {
@@ -163,6 +164,8 @@ struct l_dhcp_lease {
 	char *domain_name;
 	/* for server */
 	uint8_t mac[6];
+	/* 1-based position in the server's expiry heap, 0 if not queued */
+	unsigned int heap_pos;
 
 	/* set for an offered lease, but not ACK'ed */
 	bool offering : 1;
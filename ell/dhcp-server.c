@@ -37,6 +37,8 @@
 #include "dhcp.h"
 #include "dhcp-private.h"
 #include "queue.h"
+#include "hashmap.h"
+#include "uintset.h"
 #include "useful.h"
 #include "strv.h"
 #include "timeout.h"
@@ -67,8 +69,18 @@ struct l_dhcp_server {
 	uint32_t lease_seconds;
 	unsigned int max_expired;
 
-	struct l_queue *lease_list;
+	/* Active and offered leases keyed by MAC */
+	struct l_hashmap *lease_map;
 	struct l_queue *expired_list;
+	/* All leases, active or expired, keyed by address (network order) */
+	struct l_hashmap *ip_map;
+	/* Addresses in [start_ip, end_ip] used by leases or reserved */
+	struct l_uintset *ip_in_use;
+
+	/* Min-heap of the active (not offered) leases by lifetime */
+	struct l_dhcp_lease **expire_heap;
+	unsigned int expire_heap_len;
+	unsigned int expire_heap_size;
 
 	/* Next lease expiring */
 	struct l_timeout *next_expire;
@@ -110,26 +122,181 @@ static bool is_expired_lease(struct l_dhcp_lease *lease)
 	return false;
 }
 
-static bool match_lease_mac(const void *data, const void *user_data)
+static unsigned int mac_hash(const void *p)
 {
-	const struct l_dhcp_lease *lease = data;
-	const uint8_t *mac = user_data;
+	const uint8_t *mac = p;
+	unsigned int h = 0;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		h = (h << 5) - h + mac[i];
+
+	return h;
+}
 
-	return !memcmp(lease->mac, mac, 6);
+static int mac_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, ETH_ALEN);
 }
 
 static struct l_dhcp_lease *find_lease_by_mac(struct l_dhcp_server *server,
 						const uint8_t *mac)
 {
-	return l_queue_find(server->lease_list, match_lease_mac, mac);
+	return l_hashmap_lookup(server->lease_map, mac);
+}
+
+static bool is_active_lease(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	return find_lease_by_mac(server, lease->mac) == lease;
+}
+
+static void expire_heap_set(struct l_dhcp_server *server, unsigned int i,
+				struct l_dhcp_lease *lease)
+{
+	server->expire_heap[i] = lease;
+	lease->heap_pos = i + 1;
+}
+
+static void expire_heap_sift_up(struct l_dhcp_server *server, unsigned int i)
+{
+	struct l_dhcp_lease *lease = server->expire_heap[i];
+
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (server->expire_heap[parent]->lifetime <= lease->lifetime)
+			break;
+
+		expire_heap_set(server, i, server->expire_heap[parent]);
+		i = parent;
+	}
+
+	expire_heap_set(server, i, lease);
+}
+
+static void expire_heap_sift_down(struct l_dhcp_server *server,
+					unsigned int i)
+{
+	struct l_dhcp_lease *lease = server->expire_heap[i];
+
+	while (true) {
+		unsigned int child = i * 2 + 1;
+
+		if (child >= server->expire_heap_len)
+			break;
+
+		if (child + 1 < server->expire_heap_len &&
+				server->expire_heap[child + 1]->lifetime <
+				server->expire_heap[child]->lifetime)
+			child++;
+
+		if (lease->lifetime <= server->expire_heap[child]->lifetime)
+			break;
+
+		expire_heap_set(server, i, server->expire_heap[child]);
+		i = child;
+	}
+
+	expire_heap_set(server, i, lease);
+}
+
+static void expire_heap_push(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	if (server->expire_heap_len == server->expire_heap_size) {
+		server->expire_heap_size = server->expire_heap_size * 2 ?: 16;
+		server->expire_heap = l_realloc(server->expire_heap,
+					server->expire_heap_size *
+					sizeof(struct l_dhcp_lease *));
+	}
+
+	server->expire_heap[server->expire_heap_len] = lease;
+	expire_heap_sift_up(server, server->expire_heap_len++);
+}
+
+static void expire_heap_remove(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	unsigned int i = lease->heap_pos - 1;
+	struct l_dhcp_lease *last;
+
+	if (!lease->heap_pos)
+		return;
+
+	lease->heap_pos = 0;
+	last = server->expire_heap[--server->expire_heap_len];
+
+	if (last == lease)
+		return;
+
+	server->expire_heap[i] = last;
+
+	if (i && server->expire_heap[(i - 1) / 2]->lifetime > last->lifetime)
+		expire_heap_sift_up(server, i);
+	else
+		expire_heap_sift_down(server, i);
+}
+
+static struct l_dhcp_lease *expire_heap_peek(struct l_dhcp_server *server)
+{
+	if (!server->expire_heap_len)
+		return NULL;
+
+	return server->expire_heap[0];
+}
+
+/* Network, broadcast (assuming a /24) and our own address can't be leased */
+static bool is_reserved_ip(struct l_dhcp_server *server, uint32_t ip_addr)
+{
+	return (ip_addr & 0xff) == 0 || (ip_addr & 0xff) == 0xff ||
+		htonl(ip_addr) == server->address;
+}
+
+static void lease_index_add(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	l_hashmap_replace(server->ip_map, L_UINT_TO_PTR(lease->address),
+				lease, NULL);
+	l_uintset_put(server->ip_in_use, ntohl(lease->address));
+}
+
+static void lease_index_remove(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	void *key = L_UINT_TO_PTR(lease->address);
+
+	if (l_hashmap_lookup(server->ip_map, key) != lease)
+		return;
+
+	l_hashmap_remove(server->ip_map, key);
+
+	if (!is_reserved_ip(server, ntohl(lease->address)))
+		l_uintset_take(server->ip_in_use, ntohl(lease->address));
+}
+
+/* Remove an active or offered lease from the MAC index and expiry heap */
+static void unlink_lease(struct l_dhcp_server *server,
+				struct l_dhcp_lease *lease)
+{
+	if (is_active_lease(server, lease))
+		l_hashmap_remove(server->lease_map, lease->mac);
+
+	expire_heap_remove(server, lease);
 }
 
+static void set_next_expire_timer(struct l_dhcp_server *server,
+					struct l_dhcp_lease *expired);
+
 static void remove_lease(struct l_dhcp_server *server,
 				struct l_dhcp_lease *lease)
 {
-	l_queue_remove(server->lease_list, lease);
+	unlink_lease(server, lease);
+	lease_index_remove(server, lease);
 
 	_dhcp_lease_free(lease);
+
+	set_next_expire_timer(server, NULL);
 }
 
 /* Clear the old lease and create the new one */
@@ -157,7 +324,8 @@ static int get_lease(struct l_dhcp_server *server, uint32_t yiaddr,
 	lease = find_lease_by_mac(server, mac);
 
 	if (lease) {
-		l_queue_remove(server->lease_list, lease);
+		unlink_lease(server, lease);
+		lease_index_remove(server, lease);
 
 		*lease_out = lease;
 
@@ -169,28 +337,13 @@ static int get_lease(struct l_dhcp_server *server, uint32_t yiaddr,
 	return 0;
 }
 
-static int compare_lifetime_or_offering(const void *a, const void *b,
-					void *user_data)
-{
-	const struct l_dhcp_lease *lease1 = a;
-	const struct l_dhcp_lease *lease2 = b;
-
-	/*
-	 * Ensures offered but not active leases stay at the head of the queue.
-	 * This lets us peek at the tail to find the next expiring (active)
-	 */
-	if (lease1->offering)
-		return 1;
-
-	return lease2->lifetime - lease1->lifetime;
-}
-
 static void lease_expired_cb(struct l_timeout *timeout, void *user_data);
 
 static void set_next_expire_timer(struct l_dhcp_server *server,
 					struct l_dhcp_lease *expired)
 {
 	struct l_dhcp_lease *next;
+	uint32_t now;
 	unsigned int next_timeout;
 
 	/*
@@ -198,28 +351,36 @@ static void set_next_expire_timer(struct l_dhcp_server *server,
 	 * a lease if we have reached the max
 	 */
 	if (expired) {
-		l_queue_remove(server->lease_list, expired);
+		unlink_lease(server, expired);
 
-		if (l_queue_length(server->expired_list) > server->max_expired)
-			_dhcp_lease_free(l_queue_pop_head(
-							server->expired_list));
+		if (l_queue_length(server->expired_list) > server->max_expired) {
+			struct l_dhcp_lease *oldest =
+				l_queue_pop_head(server->expired_list);
+
+			lease_index_remove(server, oldest);
+			_dhcp_lease_free(oldest);
+		}
 
 		l_queue_push_tail(server->expired_list, expired);
 	}
 
-	next = l_queue_peek_tail(server->lease_list);
-	if (!next || next->offering) {
-		server->next_expire = NULL;
+	next = expire_heap_peek(server);
+	if (!next) {
+		if (server->next_expire) {
+			l_timeout_remove(server->next_expire);
+			server->next_expire = NULL;
+		}
+
 		return;
 	}
 
-	next_timeout = l_time_to_secs(l_time_diff(l_time_now(),
-							next->lifetime));
+	now = l_time_to_secs(l_time_now());
+	next_timeout = next->lifetime > now ? next->lifetime - now : 1;
 
 	if (server->next_expire)
 		l_timeout_modify(server->next_expire, next_timeout);
 	else
-		server->next_expire = l_timeout_create(server->lease_seconds,
+		server->next_expire = l_timeout_create(next_timeout,
 							lease_expired_cb,
 							server, NULL);
 }
@@ -227,7 +388,12 @@ static void set_next_expire_timer(struct l_dhcp_server *server,
 static void lease_expired_cb(struct l_timeout *timeout, void *user_data)
 {
 	struct l_dhcp_server *server = user_data;
-	struct l_dhcp_lease *lease = l_queue_peek_tail(server->expired_list);
+	struct l_dhcp_lease *lease = expire_heap_peek(server);
+
+	if (!lease || !is_expired_lease(lease)) {
+		set_next_expire_timer(server, NULL);
+		return;
+	}
 
 	if (server->event_handler)
 		server->event_handler(server, L_DHCP_SERVER_EVENT_LEASE_EXPIRED,
@@ -241,6 +407,7 @@ static struct l_dhcp_lease *add_lease(struct l_dhcp_server *server,
 					uint32_t yiaddr)
 {
 	struct l_dhcp_lease *lease = NULL;
+	struct l_dhcp_lease *old;
 	int ret;
 
 	ret = get_lease(server, yiaddr, chaddr, &lease);
@@ -255,25 +422,35 @@ static struct l_dhcp_lease *add_lease(struct l_dhcp_server *server,
 	lease->offering = offering;
 	lease->lifetime = l_time_to_secs(l_time_now());
 
+	/*
+	 * Anyone still holding the address has an expired lease, drop it so
+	 * each address maps to a single lease.
+	 */
+	old = l_hashmap_lookup(server->ip_map, L_UINT_TO_PTR(yiaddr));
+	if (old) {
+		if (is_active_lease(server, old))
+			unlink_lease(server, old);
+		else
+			l_queue_remove(server->expired_list, old);
+
+		lease_index_remove(server, old);
+		_dhcp_lease_free(old);
+	}
+
+	l_hashmap_insert(server->lease_map, lease->mac, lease);
+	lease_index_add(server, lease);
+
 	if (!offering) {
 		lease->lifetime += server->lease_seconds;
 
 		/*
-		 * Insert into queue by lifetime (skipping any offered leases
-		 * at the head)
-		 */
-		l_queue_insert(server->lease_list, lease,
-					compare_lifetime_or_offering, NULL);
-		/*
-		 * This is a new (or renewed lease) so pass NULL for expired so
-		 * the queue's are not modified, only the next_expired timer
+		 * Only active leases are in the expiry heap, offered leases
+		 * don't run the expiry timer.
 		 */
+		expire_heap_push(server, lease);
 		set_next_expire_timer(server, NULL);
-	} else {
+	} else
 		lease->lifetime += OFFER_TIME;
-		/* Push offered leases to head, active leases after those */
-		l_queue_push_head(server->lease_list, lease);
-	}
 
 	SERVER_DEBUG("added lease IP %s for "MAC " lifetime=%u",
 			IP_STR(yiaddr), MAC_STR(chaddr),
@@ -300,19 +477,6 @@ static void lease_release(struct l_dhcp_server *server,
 	set_next_expire_timer(server, lease);
 }
 
-static bool match_lease_ip(const void *data, const void *user_data)
-{
-	const struct l_dhcp_lease *lease = data;
-
-	return lease->address == L_PTR_TO_UINT(user_data);
-}
-
-static struct l_dhcp_lease *find_lease_by_ip(struct l_queue *lease_list,
-						uint32_t nip)
-{
-	return l_queue_find(lease_list, match_lease_ip, L_UINT_TO_PTR(nip));
-}
-
 static bool check_requested_ip(struct l_dhcp_server *server,
 				uint32_t requested_nip)
 {
@@ -330,8 +494,8 @@ static bool check_requested_ip(struct l_dhcp_server *server,
 	if (requested_nip == server->address)
 		return false;
 
-	lease = find_lease_by_ip(server->lease_list, requested_nip);
-	if (!lease)
+	lease = l_hashmap_lookup(server->ip_map, L_UINT_TO_PTR(requested_nip));
+	if (!lease || !is_active_lease(server, lease))
 		return true;
 
 	if (!is_expired_lease(lease))
@@ -353,44 +517,25 @@ static uint32_t find_free_or_expired_ip(struct l_dhcp_server *server,
 	uint32_t ip_addr;
 	struct l_dhcp_lease *lease;
 
-	for (ip_addr = server->start_ip; ip_addr <= server->end_ip; ip_addr++) {
-		/* Get IP in network order to return/check for matches */
-		uint32_t ip_nl = htonl(ip_addr);
-
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
-
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
-
-		if (ip_nl == server->address)
-			continue;
-
-		/*
-		 * Search both active and expired leases. If this exausts all
-		 * IP's in the range pop the expired list (oldest expired lease)
-		 * and use that IP. If the expired list is empty we have reached
-		 * our maximum number of clients.
-		 */
-		lease = find_lease_by_ip(server->lease_list, ip_nl);
-		if (lease)
-			continue;
-
-		lease = find_lease_by_ip(server->expired_list, ip_nl);
-		if (lease)
-			continue;
-
-		if (arp_check(ip_nl, safe_mac))
-			return ip_nl;
-	}
+	/*
+	 * Skips both active and expired leases. If this exausts all IP's in
+	 * the range pop the expired list (oldest expired lease) and use that
+	 * IP. If the expired list is empty we have reached our maximum number
+	 * of clients.
+	 */
+	ip_addr = l_uintset_find_unused_min(server->ip_in_use);
+	if (ip_addr <= server->end_ip && arp_check(htonl(ip_addr), safe_mac))
+		return htonl(ip_addr);
 
 	lease = l_queue_pop_head(server->expired_list);
 	if (!lease)
 		return 0;
 
-	return lease->address;
+	ip_addr = lease->address;
+	lease_index_remove(server, lease);
+	_dhcp_lease_free(lease);
+
+	return ip_addr;
 }
 
 static void server_message_init(struct l_dhcp_server *server,
@@ -709,12 +854,45 @@ struct dhcp_transport *_dhcp_server_get_transport(struct l_dhcp_server *server)
 	return server->transport;
 }
 
+static void mark_lease_ip(const void *key, void *value, void *user_data)
+{
+	struct l_dhcp_server *server = user_data;
+	struct l_dhcp_lease *lease = value;
+
+	l_uintset_put(server->ip_in_use, ntohl(lease->address));
+}
+
+static void build_ip_in_use(struct l_dhcp_server *server)
+{
+	uint32_t ip_addr;
+
+	l_uintset_free(server->ip_in_use);
+	server->ip_in_use = l_uintset_new_from_range(server->start_ip,
+							server->end_ip);
+
+	l_uintset_put(server->ip_in_use, ntohl(server->address));
+
+	for (ip_addr = server->start_ip & ~0xff; ip_addr <= server->end_ip;
+			ip_addr += 0x100) {
+		l_uintset_put(server->ip_in_use, ip_addr);
+		l_uintset_put(server->ip_in_use, ip_addr | 0xff);
+
+		if (ip_addr + 0x100 < ip_addr)
+			break;
+	}
+
+	l_hashmap_foreach(server->ip_map, mark_lease_ip, server);
+}
+
 LIB_EXPORT struct l_dhcp_server *l_dhcp_server_new(int ifindex)
 {
 	struct l_dhcp_server *server = l_new(struct l_dhcp_server, 1);
 
-	server->lease_list = l_queue_new();
+	server->lease_map = l_hashmap_new();
+	l_hashmap_set_hash_function(server->lease_map, mac_hash);
+	l_hashmap_set_compare_function(server->lease_map, mac_compare);
 	server->expired_list = l_queue_new();
+	server->ip_map = l_hashmap_new();
 
 	server->started = false;
 
@@ -741,10 +919,13 @@ LIB_EXPORT void l_dhcp_server_destroy(struct l_dhcp_server *server)
 	_dhcp_transport_free(server->transport);
 	l_free(server->ifname);
 
-	l_queue_destroy(server->lease_list,
-				(l_queue_destroy_func_t) _dhcp_lease_free);
+	l_hashmap_destroy(server->lease_map,
+				(l_hashmap_destroy_func_t) _dhcp_lease_free);
 	l_queue_destroy(server->expired_list,
 				(l_queue_destroy_func_t) _dhcp_lease_free);
+	l_hashmap_destroy(server->ip_map, NULL);
+	l_uintset_free(server->ip_in_use);
+	l_free(server->expire_heap);
 
 	if (server->dns_list)
 		l_free(server->dns_list);
@@ -810,6 +991,8 @@ LIB_EXPORT bool l_dhcp_server_start(struct l_dhcp_server *server)
 	if (server->start_ip > server->end_ip)
 		return false;
 
+	build_ip_in_use(server);
+
 	if (!server->ifname) {
 		server->ifname = l_net_get_name(server->ifindex);
 
@@ -1035,3 +1218,24 @@ failed:
 	l_free(dns_list);
 	return false;
 }
+
+/*
+ * Drop the client's lease as if it had sent a DHCPRELEASE, e.g. once the
+ * link to it is known to be gone.  The address is kept with the expired
+ * leases so the same client gets it back if it returns.
+ */
+LIB_EXPORT bool l_dhcp_server_expire_by_mac(struct l_dhcp_server *server,
+						const uint8_t *mac)
+{
+	struct l_dhcp_lease *lease;
+
+	if (unlikely(!server || !mac))
+		return false;
+
+	lease = find_lease_by_mac(server, mac);
+	if (!lease)
+		return false;
+
+	lease_release(server, lease);
+	return true;
+}
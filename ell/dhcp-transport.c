@@ -328,8 +328,19 @@ static int _dhcp_default_transport_bind(struct dhcp_transport *s,
 	if (fd < 0)
 		return fd;
 
+	if (transport->udp_fd >= 0)
+		L_TFR(close(transport->udp_fd));
+
 	transport->udp_fd = fd;
 
+	/*
+	 * Nothing is expected from the server until the client renews, so
+	 * stop receiving the DHCP traffic of the whole broadcast domain.
+	 * The client reopens the packet socket when renewing.
+	 */
+	l_io_destroy(transport->io);
+	transport->io = NULL;
+
 	return 0;
 }
 
@@ -511,6 +522,7 @@ struct dhcp_transport *_dhcp_default_transport_new(uint32_t ifindex,
 	transport->super.ifindex = ifindex;
 	l_strlcpy(transport->ifname, ifname, IFNAMSIZ);
 	transport->port = port;
+	transport->udp_fd = -1;
 
 	return &transport->super;
 }
@@ -24,7 +24,11 @@
 #include <config.h>
 #endif
 
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netpacket/packet.h>
 #include <netinet/ip.h>
+#include <netinet/if_ether.h>
 #include <net/ethernet.h>
 #include <linux/types.h>
 #include <net/if_arp.h>
@@ -43,6 +47,7 @@
 #include "netlink.h"
 #include "rtnl.h"
 #include "acd.h"
+#include "io.h"
 
 #define CLIENT_DEBUG(fmt, args...)					\
 	l_util_debug(client->debug_handler, client->debug_data,		\
@@ -55,6 +60,13 @@
 
 #define BITS_PER_LONG (sizeof(unsigned long) * 8)
 
+/* DHCPREQUESTs sent in INIT-REBOOT before falling back to DISCOVER */
+#define DHCP_REBOOT_ATTEMPTS 2
+
+/* Unicast ARP Requests sent to the router, RFC 4436 Section 2.1.4 */
+#define DHCP_ARP_ATTEMPTS 3
+#define DHCP_ARP_RETRANS_MS 200
+
 enum dhcp_state {
 	DHCP_STATE_INIT,
 	DHCP_STATE_SELECTING,
@@ -194,8 +206,21 @@ struct l_dhcp_client {
 	l_dhcp_destroy_cb_t debug_destroy;
 	struct l_acd *acd;
 	void *debug_data;
+	uint32_t requested_ip;
+	uint8_t *ack;
+	size_t ack_len;
+	struct l_dhcp_lease *cached_lease;
+	uint32_t cached_lease_age;
+	uint8_t router_mac[6];
+	struct l_io *arp_io;
+	struct l_timeout *arp_timeout;
+	uint8_t arp_attempt;
 	bool have_addr : 1;
 	bool override_xid : 1;
+	bool preset_xid : 1;
+	bool rapid_commit : 1;
+	bool no_release : 1;
+	bool have_router_mac : 1;
 };
 
 static inline void dhcp_enable_option(struct l_dhcp_client *client,
@@ -335,33 +360,61 @@ static void dhcp_client_event_notify(struct l_dhcp_client *client,
 		client->event_handler(client, event, client->event_data);
 }
 
-static int dhcp_client_send_discover(struct l_dhcp_client *client)
+static struct dhcp_message *dhcp_client_build_discover(
+					struct l_dhcp_client *client,
+					size_t *out_len)
 {
 	struct dhcp_message_builder builder;
 	size_t optlen = DHCP_MIN_OPTIONS_SIZE;
 	size_t len = sizeof(struct dhcp_message) + optlen;
-	L_AUTO_FREE_VAR(struct dhcp_message *, discover);
-	int err;
-
-	CLIENT_DEBUG("");
+	struct dhcp_message *discover;
 
 	discover = (struct dhcp_message *) l_new(uint8_t, len);
 
 	_dhcp_message_builder_init(&builder, discover, len,
 					DHCP_MESSAGE_TYPE_DISCOVER);
 
-	err = client_message_init(client, discover, &builder);
-	if (err < 0)
-		return err;
+	if (client_message_init(client, discover, &builder) < 0)
+		goto error;
 
 	if (client->hostname)
 		if (!_dhcp_message_builder_append(&builder,
 						L_DHCP_OPTION_HOST_NAME,
 						strlen(client->hostname),
 						client->hostname))
-			return -EINVAL;
+			goto error;
 
-	_dhcp_message_builder_finalize(&builder, &len);
+	/*
+	 * RFC 4039, Section 3.1:
+	 * "If the client will accept a DHCPACK message in response to the
+	 * DHCPDISCOVER message, it MUST include a Rapid Commit option in the
+	 * DHCPDISCOVER message."
+	 */
+	if (client->rapid_commit)
+		if (!_dhcp_message_builder_append(&builder,
+						DHCP_OPTION_RAPID_COMMIT,
+						0, ""))
+			goto error;
+
+	_dhcp_message_builder_finalize(&builder, out_len);
+
+	return discover;
+
+error:
+	l_free(discover);
+	return NULL;
+}
+
+static int dhcp_client_send_discover(struct l_dhcp_client *client)
+{
+	L_AUTO_FREE_VAR(struct dhcp_message *, discover);
+	size_t len;
+
+	CLIENT_DEBUG("");
+
+	discover = dhcp_client_build_discover(client, &len);
+	if (!discover)
+		return -EINVAL;
 
 	return client->transport->l2_send(client->transport,
 					INADDR_ANY, DHCP_PORT_CLIENT,
@@ -434,6 +487,22 @@ static int dhcp_client_send_request(struct l_dhcp_client *client)
 			return -EINVAL;
 		}
 
+		break;
+	case DHCP_STATE_REBOOTING:
+		/*
+		 * RFC 2131, Section 4.3.2:
+		 * "DHCPREQUEST generated during INIT-REBOOT state:
+		 * 'server identifier' MUST NOT be filled in, 'requested IP
+		 * address' option MUST be filled in with client's notion of
+		 * its previously assigned address. 'ciaddr' MUST be zero."
+		 */
+		if (!_dhcp_message_builder_append(&builder,
+					L_DHCP_OPTION_REQUESTED_IP_ADDRESS,
+					4, &client->requested_ip)) {
+			CLIENT_DEBUG("Failed to append requested IP");
+			return -EINVAL;
+		}
+
 		break;
 	case DHCP_STATE_RENEWING:
 	case DHCP_STATE_REBINDING:
@@ -443,7 +512,6 @@ static int dhcp_client_send_request(struct l_dhcp_client *client)
 	case DHCP_STATE_INIT:
 	case DHCP_STATE_SELECTING:
 	case DHCP_STATE_INIT_REBOOT:
-	case DHCP_STATE_REBOOTING:
 	case DHCP_STATE_BOUND:
 		return -EINVAL;
 	}
@@ -514,6 +582,42 @@ static void dhcp_client_send_release(struct l_dhcp_client *client)
 	dhcp_client_send_unicast(client, request, len);
 }
 
+static void dhcp_client_arp_stop(struct l_dhcp_client *client)
+{
+	l_timeout_remove(client->arp_timeout);
+	client->arp_timeout = NULL;
+
+	l_io_destroy(client->arp_io);
+	client->arp_io = NULL;
+}
+
+static void dhcp_client_dna_stop(struct l_dhcp_client *client)
+{
+	if (!client->cached_lease)
+		return;
+
+	dhcp_client_arp_stop(client);
+
+	_dhcp_lease_free(client->cached_lease);
+	client->cached_lease = NULL;
+}
+
+/*
+ * The previously assigned address could not be confirmed, forget it and
+ * restart the configuration from scratch.
+ */
+static int dhcp_client_reboot_fallback(struct l_dhcp_client *client)
+{
+	CLIENT_DEBUG("INIT-REBOOT failed, falling back to DISCOVER");
+
+	dhcp_client_dna_stop(client);
+	client->requested_ip = 0;
+	CLIENT_ENTER_STATE(DHCP_STATE_SELECTING);
+	client->attempt = 0;
+
+	return dhcp_client_send_discover(client);
+}
+
 static void dhcp_client_timeout_resend(struct l_timeout *timeout,
 								void *user_data)
 {
@@ -533,6 +637,19 @@ static void dhcp_client_timeout_resend(struct l_timeout *timeout,
 		}
 
 		break;
+	case DHCP_STATE_REBOOTING:
+		if (client->attempt >= DHCP_REBOOT_ATTEMPTS) {
+			r = dhcp_client_reboot_fallback(client);
+			if (r < 0) {
+				CLIENT_DEBUG("Sending discover failed: %s",
+								strerror(-r));
+				goto error;
+			}
+
+			break;
+		}
+
+		/* Fall through */
 	case DHCP_STATE_RENEWING:
 	case DHCP_STATE_REQUESTING:
 	case DHCP_STATE_REBINDING:
@@ -546,7 +663,6 @@ static void dhcp_client_timeout_resend(struct l_timeout *timeout,
 		break;
 	case DHCP_STATE_INIT:
 	case DHCP_STATE_INIT_REBOOT:
-	case DHCP_STATE_REBOOTING:
 	case DHCP_STATE_BOUND:
 		break;
 	}
@@ -570,9 +686,16 @@ static void dhcp_client_timeout_resend(struct l_timeout *timeout,
 		client->attempt += 1;
 		next_timeout = minsize(2 << client->attempt, 64);
 		break;
+	case DHCP_STATE_REBOOTING:
+		/*
+		 * Don't back off, the point of INIT-REBOOT is a quick
+		 * confirmation.  A silent server means it's time to DISCOVER.
+		 */
+		client->attempt += 1;
+		next_timeout = 2;
+		break;
 	case DHCP_STATE_INIT:
 	case DHCP_STATE_INIT_REBOOT:
-	case DHCP_STATE_REBOOTING:
 	case DHCP_STATE_BOUND:
 		break;
 	}
@@ -628,6 +751,16 @@ static void dhcp_client_t1_expired(struct l_timeout *timeout, void *user_data)
 	CLIENT_ENTER_STATE(DHCP_STATE_RENEWING);
 	client->attempt = 1;
 
+	/* The transport may have stopped listening once bound */
+	if (client->transport->open) {
+		r = client->transport->open(client->transport, client->xid);
+		if (r < 0 && r != -EALREADY) {
+			CLIENT_DEBUG("Reopening transport failed: %s",
+								strerror(-r));
+			goto error;
+		}
+	}
+
 	r = dhcp_client_send_request(client);
 	if  (r < 0) {
 		CLIENT_DEBUG("Sending request failed: %s", strerror(-r));
@@ -670,6 +803,45 @@ static void dhcp_client_address_add_cb(int error, uint16_t type,
 	}
 }
 
+static void dhcp_client_add_rtnl_address(struct l_dhcp_client *client)
+{
+	struct l_rtnl_address *a;
+	L_AUTO_FREE_VAR(char *, ip) = NULL;
+	uint8_t prefix_len;
+	uint32_t l = l_dhcp_lease_get_lifetime(client->lease);
+	L_AUTO_FREE_VAR(char *, netmask) = NULL;
+	L_AUTO_FREE_VAR(char *, broadcast) = NULL;
+	struct in_addr in_addr;
+
+	if (!client->rtnl)
+		return;
+
+	ip = l_dhcp_lease_get_address(client->lease);
+	netmask = l_dhcp_lease_get_netmask(client->lease);
+	broadcast = l_dhcp_lease_get_broadcast(client->lease);
+
+	if (inet_pton(AF_INET, netmask, &in_addr) > 0)
+		prefix_len = __builtin_popcountl(in_addr.s_addr);
+	else
+		prefix_len = 24;
+
+	a = l_rtnl_address_new(ip, prefix_len);
+	l_rtnl_address_set_noprefixroute(a, true);
+	l_rtnl_address_set_lifetimes(a, l, l);
+	l_rtnl_address_set_broadcast(a, broadcast);
+
+	client->rtnl_add_cmdid =
+		l_rtnl_ifaddr_add(client->rtnl, client->ifindex, a,
+					dhcp_client_address_add_cb,
+					client, NULL);
+	if (client->rtnl_add_cmdid)
+		client->rtnl_configured_address = a;
+	else {
+		CLIENT_DEBUG("Configuring address via RTNL failed");
+		l_rtnl_address_free(a);
+	}
+}
+
 static int dhcp_client_receive_ack(struct l_dhcp_client *client,
 					const struct dhcp_message *ack,
 					size_t len)
@@ -703,49 +875,25 @@ static int dhcp_client_receive_ack(struct l_dhcp_client *client,
 				client->lease->router != lease->router)
 			r = L_DHCP_CLIENT_EVENT_IP_CHANGED;
 
+		if (client->lease->router != lease->router)
+			client->have_router_mac = false;
+
 		_dhcp_lease_free(client->lease);
-	}
+	} else
+		client->have_router_mac = false;
 
 	client->lease = lease;
 
+	l_free(client->ack);
+	client->ack = l_memdup(ack, len);
+	client->ack_len = len;
+
 	/* In case this is an initial request, override to LEASE_OBTAINED */
 	if (client->state == DHCP_STATE_REQUESTING ||
 			client->state == DHCP_STATE_REBOOTING)
 		r = L_DHCP_CLIENT_EVENT_LEASE_OBTAINED;
 
-	if (client->rtnl) {
-		struct l_rtnl_address *a;
-		L_AUTO_FREE_VAR(char *, ip) =
-			l_dhcp_lease_get_address(client->lease);
-		uint8_t prefix_len;
-		uint32_t l = l_dhcp_lease_get_lifetime(client->lease);
-		L_AUTO_FREE_VAR(char *, netmask) =
-				l_dhcp_lease_get_netmask(client->lease);
-		L_AUTO_FREE_VAR(char *, broadcast) =
-				l_dhcp_lease_get_broadcast(client->lease);
-		struct in_addr in_addr;
-
-		if (inet_pton(AF_INET, netmask, &in_addr) > 0)
-			prefix_len = __builtin_popcountl(in_addr.s_addr);
-		else
-			prefix_len = 24;
-
-		a = l_rtnl_address_new(ip, prefix_len);
-		l_rtnl_address_set_noprefixroute(a, true);
-		l_rtnl_address_set_lifetimes(a, l, l);
-		l_rtnl_address_set_broadcast(a, broadcast);
-
-		client->rtnl_add_cmdid =
-			l_rtnl_ifaddr_add(client->rtnl, client->ifindex, a,
-						dhcp_client_address_add_cb,
-						client, NULL);
-		if (client->rtnl_add_cmdid)
-			client->rtnl_configured_address = a;
-		else {
-			CLIENT_DEBUG("Configuring address via RTNL failed");
-			l_rtnl_address_free(a);
-		}
-	}
+	dhcp_client_add_rtnl_address(client);
 
 	return r;
 }
@@ -773,47 +921,344 @@ static int dhcp_client_receive_offer(struct l_dhcp_client *client,
 	return 0;
 }
 
-static void dhcp_client_rx_message(const void *data, size_t len, void *userdata)
+static void dhcp_client_bound(struct l_dhcp_client *client, int event);
+
+/*
+ * While checking the cached lease (Detecting Network Attachment) the ARP
+ * Request is unicast to the router's remembered MAC, otherwise we're
+ * learning that MAC for later and broadcast it.
+ */
+static int dhcp_client_arp_send(struct l_dhcp_client *client)
+{
+	const struct l_dhcp_lease *lease = client->cached_lease ?:
+								client->lease;
+	struct sockaddr_ll dest;
+	struct ether_arp p;
+	int n;
+
+	memset(&dest, 0, sizeof(dest));
+	memset(&p, 0, sizeof(p));
+
+	dest.sll_family = AF_PACKET;
+	dest.sll_protocol = htons(ETH_P_ARP);
+	dest.sll_ifindex = client->ifindex;
+	dest.sll_halen = ETH_ALEN;
+
+	if (client->cached_lease)
+		memcpy(dest.sll_addr, client->router_mac, ETH_ALEN);
+	else
+		memset(dest.sll_addr, 0xff, ETH_ALEN);
+
+	p.arp_hrd = htons(ARPHRD_ETHER);
+	p.arp_pro = htons(ETHERTYPE_IP);
+	p.arp_hln = ETH_ALEN;
+	p.arp_pln = 4;
+	p.arp_op = htons(ARPOP_REQUEST);
+
+	/*
+	 * RFC 4436 Section 2.1.4: "the sender protocol address field MUST be
+	 * set to the IPv4 address of the host" being tested.
+	 */
+	memcpy(&p.arp_sha, client->addr, ETH_ALEN);
+	memcpy(&p.arp_spa, &lease->address, sizeof(p.arp_spa));
+	memcpy(&p.arp_tpa, &lease->router, sizeof(p.arp_tpa));
+
+	n = sendto(l_io_get_fd(client->arp_io), &p, sizeof(p), 0,
+			(struct sockaddr *) &dest, sizeof(dest));
+	if (n < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void dhcp_client_dna_confirmed(struct l_dhcp_client *client)
+{
+	struct l_dhcp_lease *lease = l_steal_ptr(client->cached_lease);
+	uint32_t age = client->cached_lease_age;
+
+	CLIENT_DEBUG("Router reachable, reusing cached lease");
+
+	dhcp_client_arp_stop(client);
+
+	/* Count the lease times from when the cached lease was obtained */
+	if (lease->lifetime != 0xffffffffu) {
+		lease->lifetime -= age;
+		lease->t2 = lease->t2 > age ? lease->t2 - age : 1;
+		lease->t1 = lease->t1 > age ? lease->t1 - age : 1;
+
+		if (lease->t2 > lease->lifetime)
+			lease->t2 = lease->lifetime;
+
+		if (lease->t1 > lease->t2)
+			lease->t1 = lease->t2;
+	}
+
+	_dhcp_lease_free(client->lease);
+	client->lease = lease;
+
+	dhcp_client_add_rtnl_address(client);
+	dhcp_client_bound(client, L_DHCP_CLIENT_EVENT_LEASE_OBTAINED);
+}
+
+static bool dhcp_client_arp_read(struct l_io *io, void *user_data)
+{
+	struct l_dhcp_client *client = user_data;
+	const struct l_dhcp_lease *lease = client->cached_lease ?:
+								client->lease;
+	struct ether_arp arp;
+	ssize_t len;
+
+	len = read(l_io_get_fd(io), &arp, sizeof(arp));
+	if (len < 0)
+		return false;
+
+	if (len != sizeof(arp) || arp.arp_op != htons(ARPOP_REPLY) || !lease)
+		return true;
+
+	if (memcmp(arp.arp_spa, &lease->router, sizeof(arp.arp_spa)))
+		return true;
+
+	if (!client->cached_lease) {
+		memcpy(client->router_mac, arp.arp_sha, ETH_ALEN);
+		client->have_router_mac = true;
+		dhcp_client_arp_stop(client);
+		return true;
+	}
+
+	/*
+	 * RFC 4436 Section 2.2.1: the reply must come from the same MAC
+	 * address as the one stored with the lease, otherwise this is a
+	 * different network and we wait for the DHCP server's answer.
+	 */
+	if (memcmp(arp.arp_sha, client->router_mac, ETH_ALEN)) {
+		CLIENT_DEBUG("Router MAC doesn't match the cached lease");
+		return true;
+	}
+
+	dhcp_client_dna_confirmed(client);
+	return true;
+}
+
+static void dhcp_client_arp_timeout(struct l_timeout *timeout,
+							void *user_data)
+{
+	struct l_dhcp_client *client = user_data;
+
+	if (client->arp_attempt >= DHCP_ARP_ATTEMPTS) {
+		CLIENT_DEBUG("No ARP reply from the router");
+		dhcp_client_arp_stop(client);
+
+		if (client->cached_lease) {
+			_dhcp_lease_free(client->cached_lease);
+			client->cached_lease = NULL;
+		}
+
+		return;
+	}
+
+	client->arp_attempt++;
+	dhcp_client_arp_send(client);
+	l_timeout_modify_ms(timeout, DHCP_ARP_RETRANS_MS);
+}
+
+static void dhcp_client_arp_start(struct l_dhcp_client *client)
+{
+	struct sockaddr_ll addr;
+	int fd;
+
+	dhcp_client_arp_stop(client);
+
+	fd = socket(PF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto error;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ARP);
+	addr.sll_ifindex = client->ifindex;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		goto error;
+	}
+
+	client->arp_io = l_io_new(fd);
+	l_io_set_close_on_destroy(client->arp_io, true);
+	l_io_set_read_handler(client->arp_io, dhcp_client_arp_read,
+				client, NULL);
+
+	client->arp_attempt = 1;
+
+	if (dhcp_client_arp_send(client) < 0) {
+		dhcp_client_arp_stop(client);
+		goto error;
+	}
+
+	client->arp_timeout = l_timeout_create_ms(DHCP_ARP_RETRANS_MS,
+						dhcp_client_arp_timeout,
+						client, NULL);
+	return;
+
+error:
+	CLIENT_DEBUG("Unable to send ARP Requests to the router");
+}
+
+static void dhcp_client_bound(struct l_dhcp_client *client, int event)
+{
+	struct in_addr ia;
+
+	CLIENT_ENTER_STATE(DHCP_STATE_BOUND);
+	l_timeout_remove(client->timeout_resend);
+	client->timeout_resend = NULL;
+	client->requested_ip = 0;
+	dhcp_client_dna_stop(client);
+
+	if (client->transport->bind)
+		client->transport->bind(client->transport,
+					client->lease->address);
+
+	dhcp_client_event_notify(client, event);
+
+	/* Remember the router's MAC for Detecting Network Attachment */
+	if (client->lease->router && !client->have_router_mac &&
+			!client->arp_io)
+		dhcp_client_arp_start(client);
+
+	/*
+	 * Start T1, once it expires we will start the T2 timer.  If
+	 * we renew the lease, we will end up back here.
+	 *
+	 * RFC2131, Section 4.4.5 states:
+	 * "Times T1 and T2 SHOULD be chosen with some random "fuzz"
+	 * around a fixed value, to avoid synchronization of client
+	 * reacquisition."
+	 */
+	l_timeout_remove(client->timeout_lease);
+	client->timeout_lease = NULL;
+
+	/* Infinite lease, no need to start t1 */
+	if (client->lease->lifetime != 0xffffffffu) {
+		uint32_t next_timeout =
+				dhcp_fuzz_secs(client->lease->t1);
+
+		CLIENT_DEBUG("T1 expiring in %u ms", next_timeout);
+		client->timeout_lease =
+			l_timeout_create_ms(next_timeout,
+						dhcp_client_t1_expired,
+						client, NULL);
+	}
+
+	/* ACD is already running, no need to re-announce */
+	if (client->acd)
+		return;
+
+	client->acd = l_acd_new(client->ifindex);
+
+	if (client->debug_handler)
+		l_acd_set_debug(client->acd, client->debug_handler,
+				client->debug_data,
+				client->debug_destroy);
+
+	/*
+	 * TODO: There is no mechanism yet to deal with IPs leased by
+	 * the DHCP server which conflict with other devices. For now
+	 * the ACD object is being initialized to defend infinitely
+	 * which is effectively no different than the non-ACD behavior
+	 * (ignore conflicts and continue using address). The only
+	 * change is that announcements will be sent if conflicts are
+	 * found.
+	 */
+	l_acd_set_defend_policy(client->acd,
+					L_ACD_DEFEND_POLICY_INFINITE);
+	l_acd_set_skip_probes(client->acd, true);
+
+	ia.s_addr = client->lease->address;
+
+	/* For unit testing we don't want this to be a fatal error */
+	if (!l_acd_start(client->acd, inet_ntoa(ia))) {
+		CLIENT_DEBUG("Failed to start ACD on %s, continuing",
+					inet_ntoa(ia));
+		l_acd_destroy(client->acd);
+		client->acd = NULL;
+	}
+}
+
+static bool dhcp_client_parse_reply(struct l_dhcp_client *client,
+					const struct dhcp_message *message,
+					size_t len, uint8_t *out_msg_type,
+					bool *out_rapid_commit)
 {
-	struct l_dhcp_client *client = userdata;
-	const struct dhcp_message *message = data;
 	struct dhcp_message_iter iter;
 	uint8_t msg_type = 0;
+	bool rapid_commit = false;
 	uint8_t t, l;
 	const void *v;
-	int r;
-	struct in_addr ia;
-
-	CLIENT_DEBUG("");
 
 	if (len < sizeof(struct dhcp_message))
-		return;
+		return false;
 
 	if (message->op != DHCP_OP_CODE_BOOTREPLY)
-		return;
+		return false;
 
 	if (L_BE32_TO_CPU(message->xid) != client->xid)
-		return;
+		return false;
 
 	if (memcmp(message->chaddr, client->addr, client->addr_len))
-		return;
+		return false;
 
 	if (!_dhcp_message_iter_init(&iter, message, len))
-		return;
+		return false;
 
-	while (_dhcp_message_iter_next(&iter, &t, &l, &v) && !msg_type) {
+	while (_dhcp_message_iter_next(&iter, &t, &l, &v)) {
 		switch (t) {
 		case DHCP_OPTION_MESSAGE_TYPE:
-			if (l == 1)
+			if (l == 1 && !msg_type)
 				msg_type = l_get_u8(v);
 			break;
+		case DHCP_OPTION_RAPID_COMMIT:
+			if (l == 0)
+				rapid_commit = true;
+			break;
 		}
 	}
 
+	*out_msg_type = msg_type;
+	*out_rapid_commit = rapid_commit;
+	return true;
+}
+
+static void dhcp_client_rx_message(const void *data, size_t len, void *userdata)
+{
+	struct l_dhcp_client *client = userdata;
+	const struct dhcp_message *message = data;
+	uint8_t msg_type;
+	bool rapid_commit;
+	int r;
+
+	CLIENT_DEBUG("");
+
+	if (!dhcp_client_parse_reply(client, message, len, &msg_type,
+					&rapid_commit))
+		return;
+
 	switch (client->state) {
 	case DHCP_STATE_INIT:
 		return;
 	case DHCP_STATE_SELECTING:
+		/*
+		 * RFC 4039, Section 3.1:
+		 * "If the client receives a DHCPACK message with a Rapid
+		 * Commit option, it SHOULD process the DHCPACK immediately
+		 * [...] and not wait for additional DHCPOFFER or DHCPACK
+		 * messages."
+		 */
+		if (msg_type == DHCP_MESSAGE_TYPE_ACK && rapid_commit &&
+				client->rapid_commit) {
+			CLIENT_DEBUG("Rapid Commit ACK received");
+			CLIENT_ENTER_STATE(DHCP_STATE_REQUESTING);
+			goto receive_ack;
+		}
+
 		if (msg_type != DHCP_MESSAGE_TYPE_OFFER)
 			return;
 
@@ -831,6 +1276,25 @@ static void dhcp_client_rx_message(const void *data, size_t len, void *userdata)
 
 		l_timeout_modify_ms(client->timeout_resend, dhcp_fuzz_secs(4));
 		break;
+	case DHCP_STATE_REBOOTING:
+		/*
+		 * RFC 2131, Section 3.2:
+		 * "If the client receives a DHCPNAK message, it cannot reuse
+		 * its remembered network address.  It must instead request a
+		 * new address by restarting the configuration process"
+		 */
+		if (msg_type == DHCP_MESSAGE_TYPE_NAK) {
+			if (dhcp_client_reboot_fallback(client) < 0) {
+				l_dhcp_client_stop(client);
+				return;
+			}
+
+			l_timeout_modify_ms(client->timeout_resend,
+						dhcp_fuzz_msecs(600));
+			return;
+		}
+
+		/* Fall through */
 	case DHCP_STATE_REQUESTING:
 	case DHCP_STATE_RENEWING:
 	case DHCP_STATE_REBINDING:
@@ -846,81 +1310,14 @@ static void dhcp_client_rx_message(const void *data, size_t len, void *userdata)
 		if (msg_type != DHCP_MESSAGE_TYPE_ACK)
 			return;
 
+receive_ack:
 		r = dhcp_client_receive_ack(client, message, len);
 		if (r < 0)
 			return;
 
-		CLIENT_ENTER_STATE(DHCP_STATE_BOUND);
-		l_timeout_remove(client->timeout_resend);
-		client->timeout_resend = NULL;
-
-		if (client->transport->bind)
-			client->transport->bind(client->transport,
-						client->lease->address);
-
-		dhcp_client_event_notify(client, r);
-
-		/*
-		 * Start T1, once it expires we will start the T2 timer.  If
-		 * we renew the lease, we will end up back here.
-		 *
-		 * RFC2131, Section 4.4.5 states:
-		 * "Times T1 and T2 SHOULD be chosen with some random "fuzz"
-		 * around a fixed value, to avoid synchronization of client
-		 * reacquisition."
-		 */
-		l_timeout_remove(client->timeout_lease);
-		client->timeout_lease = NULL;
-
-		/* Infinite lease, no need to start t1 */
-		if (client->lease->lifetime != 0xffffffffu) {
-			uint32_t next_timeout =
-					dhcp_fuzz_secs(client->lease->t1);
-
-			CLIENT_DEBUG("T1 expiring in %u ms", next_timeout);
-			client->timeout_lease =
-				l_timeout_create_ms(next_timeout,
-							dhcp_client_t1_expired,
-							client, NULL);
-		}
-
-		/* ACD is already running, no need to re-announce */
-		if (client->acd)
-			break;
-
-		client->acd = l_acd_new(client->ifindex);
-
-		if (client->debug_handler)
-			l_acd_set_debug(client->acd, client->debug_handler,
-					client->debug_data,
-					client->debug_destroy);
-
-		/*
-		 * TODO: There is no mechanism yet to deal with IPs leased by
-		 * the DHCP server which conflict with other devices. For now
-		 * the ACD object is being initialized to defend infinitely
-		 * which is effectively no different than the non-ACD behavior
-		 * (ignore conflicts and continue using address). The only
-		 * change is that announcements will be sent if conflicts are
-		 * found.
-		 */
-		l_acd_set_defend_policy(client->acd,
-						L_ACD_DEFEND_POLICY_INFINITE);
-		l_acd_set_skip_probes(client->acd, true);
-
-		ia.s_addr = client->lease->address;
-
-		/* For unit testing we don't want this to be a fatal error */
-		if (!l_acd_start(client->acd, inet_ntoa(ia))) {
-			CLIENT_DEBUG("Failed to start ACD on %s, continuing",
-						inet_ntoa(ia));
-			l_acd_destroy(client->acd);
-			client->acd = NULL;
-		}
-
+		dhcp_client_bound(client, r);
 		break;
 	case DHCP_STATE_INIT_REBOOT:
-	case DHCP_STATE_REBOOTING:
 	case DHCP_STATE_BOUND:
 		break;
 	}
@@ -960,6 +1357,8 @@ LIB_EXPORT void l_dhcp_client_destroy(struct l_dhcp_client *client)
 	_dhcp_transport_free(client->transport);
 	l_free(client->ifname);
 	l_free(client->hostname);
+	_dhcp_lease_free(client->cached_lease);
+	l_free(client->ack);
 
 	l_free(client);
 }
@@ -1028,6 +1427,128 @@ LIB_EXPORT bool l_dhcp_client_set_interface_name(struct l_dhcp_client *client,
 	return true;
 }
 
+/*
+ * Set the address previously assigned to this client on the same network,
+ * e.g. remembered from an earlier connection.  The next l_dhcp_client_start
+ * will try to confirm it with a DHCPREQUEST in the INIT-REBOOT state
+ * (RFC 2131, Section 3.2) before falling back to DISCOVER if the address
+ * is NAKed or no server replies.  The address is forgotten once the client
+ * is bound or stopped.
+ */
+LIB_EXPORT bool l_dhcp_client_set_requested_address(
+					struct l_dhcp_client *client,
+					const char *ip)
+{
+	struct in_addr ia;
+
+	if (unlikely(!client))
+		return false;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return false;
+
+	if (!ip) {
+		client->requested_ip = 0;
+		return true;
+	}
+
+	if (inet_pton(AF_INET, ip, &ia) != 1 || !ia.s_addr)
+		return false;
+
+	client->requested_ip = ia.s_addr;
+	return true;
+}
+
+/*
+ * Provide a lease obtained earlier on the same network, @ack being the
+ * DHCPACK as returned by l_dhcp_client_get_ack and @age the number of
+ * seconds since it was received.  The next l_dhcp_client_start will try to
+ * confirm it with INIT-REBOOT, as with l_dhcp_client_set_requested_address.
+ * If @router_mac is given, the router is also probed with unicast ARP
+ * (RFC 4436) and the lease is reused as soon as it replies from that MAC,
+ * without waiting for the DHCP server.
+ */
+LIB_EXPORT bool l_dhcp_client_set_cached_lease(struct l_dhcp_client *client,
+						const void *ack, size_t len,
+						uint32_t age,
+						const uint8_t *router_mac)
+{
+	const struct dhcp_message *message = ack;
+	struct dhcp_message_iter iter;
+	struct l_dhcp_lease *lease;
+
+	if (unlikely(!client || !ack))
+		return false;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return false;
+
+	if (len < sizeof(struct dhcp_message) || !message->yiaddr)
+		return false;
+
+	if (!_dhcp_message_iter_init(&iter, message, len))
+		return false;
+
+	lease = _dhcp_lease_parse_options(&iter);
+	if (!lease)
+		return false;
+
+	lease->address = message->yiaddr;
+
+	if (lease->lifetime != 0xffffffffu && age >= lease->lifetime) {
+		_dhcp_lease_free(lease);
+		return false;
+	}
+
+	_dhcp_lease_free(client->cached_lease);
+	client->cached_lease = lease;
+	client->cached_lease_age = age;
+	client->requested_ip = lease->address;
+
+	l_free(client->ack);
+	client->ack = l_memdup(ack, len);
+	client->ack_len = len;
+
+	client->have_router_mac = router_mac && lease->router;
+	if (client->have_router_mac)
+		memcpy(client->router_mac, router_mac, ETH_ALEN);
+
+	return true;
+}
+
+/*
+ * Whether to send a DHCPRELEASE when stopped, the default.  Disabling this
+ * is useful when the lease is expected to be reused on the next connection
+ * to the same network.
+ */
+LIB_EXPORT bool l_dhcp_client_set_release_on_stop(
+					struct l_dhcp_client *client,
+					bool enable)
+{
+	if (unlikely(!client))
+		return false;
+
+	client->no_release = !enable;
+	return true;
+}
+
+/*
+ * Request two-message address assignment as specified in RFC 4039.  The
+ * server may reply to our DHCPDISCOVER with a DHCPACK directly.
+ */
+LIB_EXPORT bool l_dhcp_client_set_rapid_commit(struct l_dhcp_client *client,
+						bool enable)
+{
+	if (unlikely(!client))
+		return false;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return false;
+
+	client->rapid_commit = enable;
+	return true;
+}
+
 LIB_EXPORT bool l_dhcp_client_set_hostname(struct l_dhcp_client *client,
 						const char *hostname)
 {
@@ -1090,16 +1611,36 @@ LIB_EXPORT const struct l_dhcp_lease *l_dhcp_client_get_lease(
 	return client->lease;
 }
 
-LIB_EXPORT bool l_dhcp_client_start(struct l_dhcp_client *client)
+LIB_EXPORT const void *l_dhcp_client_get_ack(
+					const struct l_dhcp_client *client,
+					size_t *out_len)
 {
-	int err;
+	if (unlikely(!client))
+		return NULL;
+
+	if (!client->lease || !client->ack)
+		return NULL;
 
+	if (out_len)
+		*out_len = client->ack_len;
+
+	return client->ack;
+}
+
+LIB_EXPORT const uint8_t *l_dhcp_client_get_router_mac(
+					const struct l_dhcp_client *client)
+{
 	if (unlikely(!client))
-		return false;
+		return NULL;
 
-	if (unlikely(client->state != DHCP_STATE_INIT))
-		return false;
+	if (!client->lease || !client->have_router_mac)
+		return NULL;
 
+	return client->router_mac;
+}
+
+static bool dhcp_client_set_defaults(struct l_dhcp_client *client)
+{
 	if (!client->have_addr) {
 		uint8_t mac[6];
 
@@ -1126,9 +1667,45 @@ LIB_EXPORT bool l_dhcp_client_start(struct l_dhcp_client *client)
 			return false;
 	}
 
+	return true;
+}
+
+/*
+ * Build a DHCPDISCOVER to be carried out of band, e.g. in the FILS HLP
+ * container of an (Re)Association Request.  The transaction ID is kept
+ * so that the reply can be handed to l_dhcp_client_start_with_ack.
+ */
+LIB_EXPORT void *l_dhcp_client_build_discover(struct l_dhcp_client *client,
+						size_t *out_len)
+{
+	if (unlikely(!client || !out_len))
+		return NULL;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return NULL;
+
+	if (!dhcp_client_set_defaults(client))
+		return NULL;
+
 	if (!client->override_xid)
 		l_getrandom(&client->xid, sizeof(client->xid));
 
+	client->preset_xid = true;
+	client->start_t = l_time_now();
+
+	return dhcp_client_build_discover(client, out_len);
+}
+
+static bool dhcp_client_open(struct l_dhcp_client *client)
+{
+	if (!dhcp_client_set_defaults(client))
+		return false;
+
+	if (!client->override_xid && !client->preset_xid)
+		l_getrandom(&client->xid, sizeof(client->xid));
+
+	client->preset_xid = false;
+
 	if (client->transport->open)
 		if (client->transport->open(client->transport,
 							client->xid) < 0)
@@ -1138,21 +1715,106 @@ LIB_EXPORT bool l_dhcp_client_start(struct l_dhcp_client *client)
 						dhcp_client_rx_message,
 						client);
 
+	return true;
+}
+
+LIB_EXPORT bool l_dhcp_client_start(struct l_dhcp_client *client)
+{
+	int err;
+
+	if (unlikely(!client))
+		return false;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return false;
+
+	if (!dhcp_client_open(client))
+		return false;
+
 	client->start_t = l_time_now();
 
-	err = dhcp_client_send_discover(client);
-	if (err < 0)
+	if (client->requested_ip) {
+		CLIENT_ENTER_STATE(DHCP_STATE_REBOOTING);
+		err = dhcp_client_send_request(client);
+
+		/*
+		 * RFC 4436 Section 2.4: the DHCPREQUEST and the unicast ARP
+		 * Requests to the router are sent in parallel, whichever
+		 * confirms the address first wins.
+		 */
+		if (err >= 0 && client->cached_lease &&
+				client->have_router_mac)
+			dhcp_client_arp_start(client);
+	} else {
+		CLIENT_ENTER_STATE(DHCP_STATE_SELECTING);
+		err = dhcp_client_send_discover(client);
+	}
+
+	if (err < 0) {
+		CLIENT_ENTER_STATE(DHCP_STATE_INIT);
 		return false;
+	}
 
 	client->timeout_resend = l_timeout_create_ms(dhcp_fuzz_msecs(600),
 						dhcp_client_timeout_resend,
 						client, NULL);
-	CLIENT_ENTER_STATE(DHCP_STATE_SELECTING);
 	client->attempt = 1;
 
 	return true;
 }
 
+/*
+ * Start the client with the DHCPACK answering a DHCPDISCOVER from
+ * l_dhcp_client_build_discover.  The lease is applied without any further
+ * exchange.  If the ACK is not usable the client falls back to
+ * l_dhcp_client_start.
+ */
+LIB_EXPORT bool l_dhcp_client_start_with_ack(struct l_dhcp_client *client,
+						const void *ack, size_t len)
+{
+	const struct dhcp_message *message = ack;
+	uint8_t msg_type;
+	bool rapid_commit;
+	int r;
+
+	if (unlikely(!client || !ack))
+		return false;
+
+	if (unlikely(client->state != DHCP_STATE_INIT))
+		return false;
+
+	if (!client->preset_xid || client->requested_ip)
+		return l_dhcp_client_start(client);
+
+	if (!dhcp_client_open(client))
+		return false;
+
+	if (!dhcp_client_parse_reply(client, message, len, &msg_type,
+					&rapid_commit) ||
+			msg_type != DHCP_MESSAGE_TYPE_ACK)
+		goto fallback;
+
+	CLIENT_DEBUG("Using the out of band ACK");
+	CLIENT_ENTER_STATE(DHCP_STATE_REQUESTING);
+
+	r = dhcp_client_receive_ack(client, message, len);
+	if (r < 0)
+		goto fallback;
+
+	dhcp_client_bound(client, r);
+	return true;
+
+fallback:
+	CLIENT_DEBUG("Out of band ACK unusable, sending DISCOVER");
+
+	if (client->transport->close)
+		client->transport->close(client->transport);
+
+	CLIENT_ENTER_STATE(DHCP_STATE_INIT);
+
+	return l_dhcp_client_start(client);
+}
+
 LIB_EXPORT bool l_dhcp_client_stop(struct l_dhcp_client *client)
 {
 	if (unlikely(!client))
@@ -1164,9 +1826,9 @@ LIB_EXPORT bool l_dhcp_client_stop(struct l_dhcp_client *client)
 	 * (e.g., the client is gracefully shut down), the client sends a
 	 * DHCPRELEASE message to the server.""
 	 */
-	if (client->state == DHCP_STATE_BOUND ||
-			client->state == DHCP_STATE_RENEWING ||
-			client->state == DHCP_STATE_REBINDING)
+	if (!client->no_release && (client->state == DHCP_STATE_BOUND ||
+				client->state == DHCP_STATE_RENEWING ||
+				client->state == DHCP_STATE_REBINDING))
 		dhcp_client_send_release(client);
 
 	if (client->rtnl_add_cmdid) {
@@ -1192,11 +1854,20 @@ LIB_EXPORT bool l_dhcp_client_stop(struct l_dhcp_client *client)
 		client->transport->close(client->transport);
 
 	client->start_t = 0;
+	client->requested_ip = 0;
 	CLIENT_ENTER_STATE(DHCP_STATE_INIT);
 
 	_dhcp_lease_free(client->lease);
 	client->lease = NULL;
 
+	dhcp_client_dna_stop(client);
+	dhcp_client_arp_stop(client);
+	client->have_router_mac = false;
+
+	l_free(client->ack);
+	client->ack = NULL;
+	client->ack_len = 0;
+
 	if (client->acd) {
 		l_acd_destroy(client->acd);
 		client->acd = NULL;
@@ -85,14 +85,32 @@ bool l_dhcp_client_set_interface_name(struct l_dhcp_client *client,
 							const char *ifname);
 bool l_dhcp_client_set_hostname(struct l_dhcp_client *client,
 							const char *hostname);
+bool l_dhcp_client_set_requested_address(struct l_dhcp_client *client,
+							const char *ip);
+bool l_dhcp_client_set_rapid_commit(struct l_dhcp_client *client,
+							bool enable);
+bool l_dhcp_client_set_cached_lease(struct l_dhcp_client *client,
+					const void *ack, size_t len,
+					uint32_t age, const uint8_t *router_mac);
+bool l_dhcp_client_set_release_on_stop(struct l_dhcp_client *client,
+							bool enable);
 
 bool l_dhcp_client_set_rtnl(struct l_dhcp_client *client,
 					struct l_netlink *rtnl);
 
 const struct l_dhcp_lease *l_dhcp_client_get_lease(
 					const struct l_dhcp_client *client);
+const void *l_dhcp_client_get_ack(const struct l_dhcp_client *client,
+					size_t *out_len);
+const uint8_t *l_dhcp_client_get_router_mac(
+					const struct l_dhcp_client *client);
+
+void *l_dhcp_client_build_discover(struct l_dhcp_client *client,
+						size_t *out_len);
 
 bool l_dhcp_client_start(struct l_dhcp_client *client);
+bool l_dhcp_client_start_with_ack(struct l_dhcp_client *client,
+						const void *ack, size_t len);
 bool l_dhcp_client_stop(struct l_dhcp_client *client);
 
 bool l_dhcp_client_set_event_handler(struct l_dhcp_client *client,
@@ -141,6 +159,8 @@ bool l_dhcp_server_set_ip_address(struct l_dhcp_server *server,
 bool l_dhcp_server_set_netmask(struct l_dhcp_server *server, const char *mask);
 bool l_dhcp_server_set_gateway(struct l_dhcp_server *server, const char *ip);
 bool l_dhcp_server_set_dns(struct l_dhcp_server *server, char **dns);
+bool l_dhcp_server_expire_by_mac(struct l_dhcp_server *server,
+					const uint8_t *mac);
 #ifdef __cplusplus
 }
 #endif
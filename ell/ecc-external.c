@@ -30,11 +30,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "private.h"
 #include "ecc.h"
 #include "ecc-private.h"
 #include "random.h"
+#include "missing.h"
 
 typedef struct {
 	uint64_t m_low;
@@ -552,7 +554,7 @@ static void vli_mmod_fast_384(uint64_t *result, const uint64_t *product,
 /* Computes result = product % curve_prime
  *  from http://www.nsa.gov/ia/_files/nist-routines.pdf
 */
-static bool vli_mmod_fast(uint64_t *result, uint64_t *product,
+bool _vli_mmod_fast(uint64_t *result, uint64_t *product,
 				const uint64_t *curve_prime,
 				unsigned int ndigits)
 {
@@ -583,7 +585,7 @@ void _vli_mod_mult_fast(uint64_t *result, const uint64_t *left,
 	uint64_t product[2 * L_ECC_MAX_DIGITS];
 
 	vli_mult(product, left, right, ndigits);
-	vli_mmod_fast(result, product, curve_prime, ndigits);
+	_vli_mmod_fast(result, product, curve_prime, ndigits);
 }
 
 /* Computes result = left^2 % curve_p. */
@@ -594,7 +596,7 @@ void _vli_mod_square_fast(uint64_t *result, const uint64_t *left,
 	uint64_t product[2 * L_ECC_MAX_DIGITS];
 
 	vli_square(product, left, ndigits);
-	vli_mmod_fast(result, product, curve_prime, ndigits);
+	_vli_mmod_fast(result, product, curve_prime, ndigits);
 }
 
 #define EVEN(vli) (!(vli[0] & 1))
@@ -943,6 +945,287 @@ void _ecc_point_mult(struct l_ecc_point *result,
 	vli_set(result->y, ry[0], ndigits);
 }
 
+/* ------ Fixed-base point multiplication ------ */
+
+/*
+ * Multiplications of the curve generator use a fixed window comb over a
+ * per-curve table of odd multiples: row i holds (2j + 1) * 16^i * G for
+ * j = 0 .. 7, in affine coordinates.  The scalar is recoded into signed
+ * odd digits so that every row contributes exactly one mixed point addition
+ * and no doublings are needed.  Table entries are fetched by scanning the
+ * whole row, so neither timing nor memory access pattern depend on the
+ * scalar.  The table is built on first use and kept for the lifetime of
+ * the process.
+ */
+#define ECC_COMB_WINDOW		4
+#define ECC_COMB_ROW_SIZE	(1 << (ECC_COMB_WINDOW - 1))
+#define ECC_COMB_MAX_ROWS	(L_ECC_MAX_DIGITS * 64 / ECC_COMB_WINDOW)
+
+struct ecc_comb_point {
+	uint64_t x[L_ECC_MAX_DIGITS];
+	uint64_t y[L_ECC_MAX_DIGITS];
+};
+
+static struct ecc_comb_table {
+	const struct l_ecc_curve *curve;
+	struct ecc_comb_point *points;
+} comb_tables[2];
+
+/* Converts Jacobian (x1, y1, z1) to affine in place, z1 is clobbered */
+static void ecc_point_to_affine(uint64_t *x1, uint64_t *y1, uint64_t *z1,
+					const uint64_t *curve_prime,
+					unsigned int ndigits)
+{
+	_vli_mod_inv(z1, z1, curve_prime, ndigits);
+	apply_z(x1, y1, z1, curve_prime, ndigits);
+}
+
+static const struct ecc_comb_point *ecc_comb_table_get(
+					const struct l_ecc_curve *curve)
+{
+	unsigned int ndigits = curve->ndigits;
+	unsigned int rows = ndigits * 64 / ECC_COMB_WINDOW;
+	struct ecc_comb_point *points;
+	struct l_ecc_point base = curve->g;
+	struct l_ecc_point twice = { .curve = curve };
+	struct l_ecc_point sum = { .curve = curve };
+	uint64_t z[L_ECC_MAX_DIGITS];
+	unsigned int slot;
+	unsigned int i, j;
+
+	for (slot = 0; slot < L_ARRAY_SIZE(comb_tables); slot++) {
+		if (comb_tables[slot].curve == curve)
+			return comb_tables[slot].points;
+
+		if (!comb_tables[slot].curve)
+			break;
+	}
+
+	if (slot == L_ARRAY_SIZE(comb_tables))
+		return NULL;
+
+	points = l_new(struct ecc_comb_point, rows * ECC_COMB_ROW_SIZE);
+
+	for (i = 0; i < rows; i++) {
+		struct ecc_comb_point *row = points + i * ECC_COMB_ROW_SIZE;
+
+		/* 2 * base, never equal to any odd multiple of base below */
+		vli_set(twice.x, base.x, ndigits);
+		vli_set(twice.y, base.y, ndigits);
+		vli_clear(z, ndigits);
+		z[0] = 1;
+		ecc_point_double_jacobian(twice.x, twice.y, z, curve->p,
+						ndigits);
+		ecc_point_to_affine(twice.x, twice.y, z, curve->p, ndigits);
+
+		vli_set(sum.x, base.x, ndigits);
+		vli_set(sum.y, base.y, ndigits);
+
+		for (j = 0; j < ECC_COMB_ROW_SIZE; j++) {
+			if (j)
+				_ecc_point_add(&sum, &sum, &twice, curve->p);
+
+			vli_set(row[j].x, sum.x, ndigits);
+			vli_set(row[j].y, sum.y, ndigits);
+		}
+
+		/* Next row starts at 16 * base */
+		vli_clear(z, ndigits);
+		z[0] = 1;
+
+		for (j = 0; j < ECC_COMB_WINDOW; j++)
+			ecc_point_double_jacobian(base.x, base.y, z, curve->p,
+							ndigits);
+
+		ecc_point_to_affine(base.x, base.y, z, curve->p, ndigits);
+	}
+
+	comb_tables[slot].curve = curve;
+	comb_tables[slot].points = points;
+
+	return points;
+}
+
+/* dest = cond ? src : dest, in constant time.  cond must be 0 or 1 */
+static void vli_cond_set(uint64_t *dest, const uint64_t *src, uint64_t cond,
+				unsigned int ndigits)
+{
+	uint64_t mask = -cond;
+	unsigned int i;
+
+	for (i = 0; i < ndigits; i++)
+		dest[i] = (dest[i] & ~mask) | (src[i] & mask);
+}
+
+/*
+ * Recodes an odd scalar k < 2^(ndigits * 64) into signed odd digits d[i]
+ * such that k = sum(d[i] * 16^i).  Every digit but the last is
+ * (k mod 32) - 16, after which k = (k - d[i]) / 16 stays odd.  The last
+ * digit is what remains of k, which is odd and below 16.
+ */
+static void ecc_comb_recode(int8_t *digits, const uint64_t *scalar,
+				unsigned int ndigits)
+{
+	unsigned int rows = ndigits * 64 / ECC_COMB_WINDOW;
+	uint64_t k[L_ECC_MAX_DIGITS];
+	unsigned int i, j;
+
+	vli_set(k, scalar, ndigits);
+
+	for (i = 0; i < rows - 1; i++) {
+		unsigned int w = k[0] & ((2 << ECC_COMB_WINDOW) - 1);
+
+		digits[i] = (int) w - (1 << ECC_COMB_WINDOW);
+
+		/* k - d[i] only replaces the low bits of k with 16 */
+		k[0] = (k[0] & ~(uint64_t) w) | (1 << ECC_COMB_WINDOW);
+
+		for (j = 0; j < ndigits - 1; j++)
+			k[j] = (k[j] >> ECC_COMB_WINDOW) |
+				(k[j + 1] << (64 - ECC_COMB_WINDOW));
+
+		k[ndigits - 1] >>= ECC_COMB_WINDOW;
+	}
+
+	digits[rows - 1] = k[0];
+
+	explicit_bzero(k, sizeof(k));
+}
+
+/* (x, y) = sign(digit) * row[(|digit| - 1) / 2], touching every entry */
+static void ecc_comb_select(uint64_t *x, uint64_t *y,
+				const struct ecc_comb_point *row, int8_t digit,
+				const uint64_t *curve_prime,
+				unsigned int ndigits)
+{
+	uint64_t neg = (uint8_t) digit >> 7;
+	unsigned int idx = ((digit ^ -(int) neg) + neg) >> 1;
+	uint64_t t[L_ECC_MAX_DIGITS];
+	unsigned int j;
+
+	vli_clear(x, ndigits);
+	vli_clear(y, ndigits);
+
+	for (j = 0; j < ECC_COMB_ROW_SIZE; j++) {
+		vli_cond_set(x, row[j].x, j == idx, ndigits);
+		vli_cond_set(y, row[j].y, j == idx, ndigits);
+	}
+
+	_vli_sub(t, curve_prime, y, ndigits);
+	vli_cond_set(y, t, neg, ndigits);
+}
+
+/*
+ * Mixed addition (x1, y1, z1) += (x2, y2, 1).  The caller guarantees that
+ * the points are neither equal nor opposite and not the point at infinity.
+ */
+static void ecc_point_add_mixed(uint64_t *x1, uint64_t *y1, uint64_t *z1,
+				const uint64_t *x2, const uint64_t *y2,
+				const uint64_t *curve_prime,
+				unsigned int ndigits)
+{
+	uint64_t t1[L_ECC_MAX_DIGITS];
+	uint64_t t2[L_ECC_MAX_DIGITS];
+	uint64_t h[L_ECC_MAX_DIGITS];
+	uint64_t r[L_ECC_MAX_DIGITS];
+
+	/* t1 = z1^2 */
+	_vli_mod_square_fast(t1, z1, curve_prime, ndigits);
+	/* h = x2 * z1^2 - x1 */
+	_vli_mod_mult_fast(h, x2, t1, curve_prime, ndigits);
+	_vli_mod_sub(h, h, x1, curve_prime, ndigits);
+	/* r = y2 * z1^3 - y1 */
+	_vli_mod_mult_fast(t1, t1, z1, curve_prime, ndigits);
+	_vli_mod_mult_fast(r, y2, t1, curve_prime, ndigits);
+	_vli_mod_sub(r, r, y1, curve_prime, ndigits);
+	/* z3 = z1 * h */
+	_vli_mod_mult_fast(z1, z1, h, curve_prime, ndigits);
+	/* t1 = h^2, t2 = h^3 */
+	_vli_mod_square_fast(t1, h, curve_prime, ndigits);
+	_vli_mod_mult_fast(t2, t1, h, curve_prime, ndigits);
+	/* t1 = x1 * h^2 */
+	_vli_mod_mult_fast(t1, x1, t1, curve_prime, ndigits);
+	/* y1 = y1 * h^3 */
+	_vli_mod_mult_fast(y1, y1, t2, curve_prime, ndigits);
+	/* x3 = r^2 - h^3 - 2 * x1 * h^2 */
+	_vli_mod_square_fast(x1, r, curve_prime, ndigits);
+	_vli_mod_sub(x1, x1, t2, curve_prime, ndigits);
+	_vli_mod_sub(x1, x1, t1, curve_prime, ndigits);
+	_vli_mod_sub(x1, x1, t1, curve_prime, ndigits);
+	/* y3 = r * (x1 * h^2 - x3) - y1 * h^3 */
+	_vli_mod_sub(t1, t1, x1, curve_prime, ndigits);
+	_vli_mod_mult_fast(t1, r, t1, curve_prime, ndigits);
+	_vli_mod_sub(y1, t1, y1, curve_prime, ndigits);
+}
+
+/*
+ * result = scalar * G for 0 < scalar < n.  Since every partial sum of the
+ * recoded digits is odd and smaller in magnitude than the next row's
+ * multiplier, the additions never hit the doubling or infinity cases.
+ */
+void _ecc_point_mult_g(struct l_ecc_point *result,
+			const struct l_ecc_curve *curve, const uint64_t *scalar)
+{
+	const struct ecc_comb_point *points = ecc_comb_table_get(curve);
+	unsigned int ndigits = curve->ndigits;
+	unsigned int rows = ndigits * 64 / ECC_COMB_WINDOW;
+	int8_t digits[ECC_COMB_MAX_ROWS];
+	uint64_t k[L_ECC_MAX_DIGITS];
+	uint64_t x[L_ECC_MAX_DIGITS];
+	uint64_t y[L_ECC_MAX_DIGITS];
+	uint64_t z[L_ECC_MAX_DIGITS];
+	uint64_t t[L_ECC_MAX_DIGITS];
+	uint64_t even;
+	unsigned int i;
+
+	if (!points) {
+		_ecc_point_mult(result, &curve->g, scalar, NULL, curve->p);
+		return;
+	}
+
+	/*
+	 * The recoding needs an odd scalar.  For an even one use n - scalar,
+	 * odd since n is, and negate the result at the end.
+	 */
+	even = !vli_test_bit(scalar, 0);
+	vli_set(k, scalar, ndigits);
+	_vli_sub(t, curve->n, scalar, ndigits);
+	vli_cond_set(k, t, even, ndigits);
+
+	ecc_comb_recode(digits, k, ndigits);
+
+	ecc_comb_select(x, y, points, digits[0], curve->p, ndigits);
+	vli_clear(z, ndigits);
+	z[0] = 1;
+
+	for (i = 1; i < rows; i++) {
+		uint64_t px[L_ECC_MAX_DIGITS];
+		uint64_t py[L_ECC_MAX_DIGITS];
+
+		ecc_comb_select(px, py, points + i * ECC_COMB_ROW_SIZE,
+					digits[i], curve->p, ndigits);
+		ecc_point_add_mixed(x, y, z, px, py, curve->p, ndigits);
+	}
+
+	/* 1 / z by Fermat's little theorem, which unlike _vli_mod_inv runs
+	 * in constant time
+	 */
+	vli_clear(t, ndigits);
+	t[0] = 2;
+	_vli_sub(t, curve->p, t, ndigits);
+	_vli_mod_exp(z, z, t, curve->p, ndigits);
+	apply_z(x, y, z, curve->p, ndigits);
+
+	_vli_sub(t, curve->p, y, ndigits);
+	vli_cond_set(y, t, even, ndigits);
+
+	vli_set(result->x, x, ndigits);
+	vli_set(result->y, y, ndigits);
+
+	explicit_bzero(digits, sizeof(digits));
+	explicit_bzero(k, sizeof(k));
+}
+
 /* Returns true if p_point is the point at infinity, false otherwise. */
 bool _ecc_point_is_zero(const struct l_ecc_point *point)
 {
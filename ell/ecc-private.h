@@ -43,6 +43,7 @@ struct l_ecc_curve {
 	uint64_t p[L_ECC_MAX_DIGITS];
 	uint64_t n[L_ECC_MAX_DIGITS];
 	uint64_t b[L_ECC_MAX_DIGITS];
+	int z;		/* SSWU non-square constant, see RFC 9380 */
 };
 
 struct l_ecc_scalar {
@@ -103,6 +104,8 @@ void _vli_rshift1(uint64_t *vli, unsigned int ndigits);
 void _vli_mod_mult_fast(uint64_t *result, const uint64_t *left,
 		const uint64_t *right, const uint64_t *curve_prime,
 		unsigned int ndigits);
+bool _vli_mmod_fast(uint64_t *result, uint64_t *product,
+			const uint64_t *curve_prime, unsigned int ndigits);
 void _vli_mod_square_fast(uint64_t *result, const uint64_t *left,
 					const uint64_t *curve_prime,
 					unsigned int ndigits);
@@ -126,6 +129,8 @@ bool _ecc_compute_y(const struct l_ecc_curve *curve, uint64_t *y, uint64_t *x);
 void _ecc_point_mult(struct l_ecc_point *result,
 			const struct l_ecc_point *point, const uint64_t *scalar,
 			uint64_t *initial_z, const uint64_t *curve_prime);
+void _ecc_point_mult_g(struct l_ecc_point *result,
+			const struct l_ecc_curve *curve, const uint64_t *scalar);
 void _ecc_point_add(struct l_ecc_point *ret, const struct l_ecc_point *p,
 			const struct l_ecc_point *q,
 			const uint64_t *curve_prime);
@@ -65,6 +65,7 @@ static const struct l_ecc_curve p256 = {
 	.p = P256_CURVE_P,
 	.n = P256_CURVE_N,
 	.b = P256_CURVE_B,
+	.z = -10,
 };
 
 /*
@@ -98,7 +99,8 @@ static const struct l_ecc_curve p384 = {
 	},
 	.p = P384_CURVE_P,
 	.n = P384_CURVE_N,
-	.b = P384_CURVE_B
+	.b = P384_CURVE_B,
+	.z = -12,
 };
 
 static const struct l_ecc_curve *curves[] = {
@@ -401,32 +403,60 @@ void _ecc_point_add(struct l_ecc_point *ret, const struct l_ecc_point *p,
 	memcpy(ret->y, resy, ndigits * 8);
 }
 
-/* result = (base ^ exp) % p */
+#define ECC_EXP_WINDOW		4
+#define ECC_EXP_TABLE_SIZE	(1 << ECC_EXP_WINDOW)
+
+/*
+ * result = (base ^ exp) % p
+ *
+ * Fixed 4-bit window exponentiation.  Every window costs 4 squarings and a
+ * multiplication by a table entry that is selected by scanning the whole
+ * table, so neither the timing nor the memory access pattern depend on the
+ * exponent.  This also needs about a third fewer multiplications than the
+ * binary method for the dense exponents used by the Legendre symbol and the
+ * square root.
+ */
 void _vli_mod_exp(uint64_t *result, uint64_t *base, uint64_t *exp,
 			const uint64_t *mod, unsigned int ndigits)
 {
-	unsigned int i;
-	int bit;
-	uint64_t n[L_ECC_MAX_DIGITS];
+	uint64_t table[ECC_EXP_TABLE_SIZE][L_ECC_MAX_DIGITS];
 	uint64_t r[L_ECC_MAX_DIGITS] = { 1 };
+	uint64_t t[L_ECC_MAX_DIGITS];
+	unsigned int i, j, k;
+	int w;
+
+	memset(table[0], 0, sizeof(table[0]));
+	table[0][0] = 1;
+	memcpy(table[1], base, ndigits * 8);
 
-	memcpy(n, base, ndigits * 8);
+	for (i = 2; i < ECC_EXP_TABLE_SIZE; i++)
+		_vli_mod_mult_fast(table[i], table[i - 1], base, mod, ndigits);
 
-	for (i = 0; i < ndigits; i++) {
-		for (bit = 0; bit < 64; bit++) {
-			uint64_t tmp[L_ECC_MAX_DIGITS];
+	for (w = ndigits * 64 / ECC_EXP_WINDOW - 1; w >= 0; w--) {
+		unsigned int bit = w * ECC_EXP_WINDOW;
+		unsigned int idx = (exp[bit / 64] >> (bit % 64)) &
+						(ECC_EXP_TABLE_SIZE - 1);
 
-			if (exp[i] & (1ull << bit)) {
-				_vli_mod_mult_fast(tmp, r, n, mod, ndigits);
-				memcpy(r, tmp, ndigits * 8);
-			}
+		for (i = 0; i < ECC_EXP_WINDOW; i++)
+			_vli_mod_square_fast(r, r, mod, ndigits);
 
-			_vli_mod_mult_fast(tmp, n, n, mod, ndigits);
-			memcpy(n, tmp, ndigits * 8);
+		memset(t, 0, sizeof(t));
+
+		for (j = 0; j < ECC_EXP_TABLE_SIZE; j++) {
+			uint64_t mask = -(uint64_t) (j == idx);
+
+			for (k = 0; k < ndigits; k++)
+				t[k] |= table[j][k] & mask;
 		}
+
+		_vli_mod_mult_fast(r, r, t, mod, ndigits);
 	}
 
 	memcpy(result, r, ndigits * 8);
+
+	explicit_bzero(table, sizeof(table));
+	explicit_bzero(r, sizeof(r));
+	explicit_bzero(t, sizeof(t));
 }
 
 int _vli_legendre(uint64_t *val, const uint64_t *p, unsigned int ndigits)
@@ -534,6 +564,124 @@ failed:
 	return NULL;
 }
 
+static void vli_select(uint64_t *result, const uint64_t *a,
+				const uint64_t *b, bool sel_a,
+				unsigned int ndigits)
+{
+	uint64_t mask = -(uint64_t) sel_a;
+	unsigned int i;
+
+	for (i = 0; i < ndigits; i++)
+		result[i] = (a[i] & mask) | (b[i] & ~mask);
+}
+
+/*
+ * Maps a field element u onto the curve using the Simplified Shallue-van de
+ * Woestijne-Ulas method, as used by RFC 9380 and the SAE hash-to-element
+ * derivation (IEEE 802.11-2020 Section 12.4.4.2.3).  The same u always maps
+ * to the same point and the computation does not branch on u.
+ */
+LIB_EXPORT struct l_ecc_point *l_ecc_point_from_sswu(
+					const struct l_ecc_scalar *u)
+{
+	const struct l_ecc_curve *curve;
+	unsigned int ndigits;
+	const uint64_t *p;
+	uint64_t z[L_ECC_MAX_DIGITS] = { 0 };
+	uint64_t a[L_ECC_MAX_DIGITS] = { 3ull };
+	uint64_t one[L_ECC_MAX_DIGITS] = { 1ull };
+	uint64_t zero[L_ECC_MAX_DIGITS] = { 0 };
+	uint64_t exp[L_ECC_MAX_DIGITS];
+	uint64_t zu2[L_ECC_MAX_DIGITS];
+	uint64_t m[L_ECC_MAX_DIGITS];
+	uint64_t t[L_ECC_MAX_DIGITS];
+	uint64_t x1[L_ECC_MAX_DIGITS];
+	uint64_t x1_exc[L_ECC_MAX_DIGITS];
+	uint64_t x2[L_ECC_MAX_DIGITS];
+	uint64_t gx1[L_ECC_MAX_DIGITS];
+	uint64_t gx2[L_ECC_MAX_DIGITS];
+	uint64_t v[L_ECC_MAX_DIGITS];
+	uint64_t tmp[L_ECC_MAX_DIGITS];
+	struct l_ecc_point *point;
+	bool is_qr;
+
+	if (unlikely(!u))
+		return NULL;
+
+	curve = u->curve;
+	ndigits = curve->ndigits;
+	p = curve->p;
+
+	/* All supported curves have a = -3 and a negative z */
+	z[0] = -curve->z;
+	_vli_mod_sub(z, p, z, p, ndigits);
+	_vli_mod_sub(a, p, a, p, ndigits);
+
+	/* m = z^2 * u^4 + z * u^2 */
+	_vli_mod_square_fast(zu2, u->c, p, ndigits);
+	_vli_mod_mult_fast(zu2, zu2, z, p, ndigits);
+	_vli_mod_square_fast(m, zu2, p, ndigits);
+	_vli_mod_add(m, m, zu2, p, ndigits);
+
+	/* t = inv0(m) = m^(p - 2), which is 0 for m == 0 */
+	_vli_sub(exp, p, one, ndigits);
+	_vli_sub(exp, exp, one, ndigits);
+	_vli_mod_exp(t, m, exp, p, ndigits);
+
+	/* x1 = (-b / a) * (1 + t), or b / (z * a) if m == 0 */
+	_vli_mod_inv(tmp, a, p, ndigits);
+	_vli_mod_mult_fast(tmp, tmp, curve->b, p, ndigits);
+	_vli_mod_sub(tmp, p, tmp, p, ndigits);
+	_vli_mod_add(x1, t, one, p, ndigits);
+	_vli_mod_mult_fast(x1, x1, tmp, p, ndigits);
+
+	_vli_mod_mult_fast(tmp, z, a, p, ndigits);
+	_vli_mod_inv(tmp, tmp, p, ndigits);
+	_vli_mod_mult_fast(x1_exc, tmp, curve->b, p, ndigits);
+
+	vli_select(x1, x1_exc, x1, _vli_cmp(m, zero, ndigits) == 0, ndigits);
+
+	/* gx1 = x1^3 + a * x1 + b */
+	ecc_compute_y_sqr(curve, gx1, x1);
+
+	/* x2 = z * u^2 * x1, gx2 = x2^3 + a * x2 + b */
+	_vli_mod_mult_fast(x2, zu2, x1, p, ndigits);
+	ecc_compute_y_sqr(curve, gx2, x2);
+
+	/* Both are computed, pick (x1, gx1) if gx1 is a square */
+	is_qr = _vli_legendre(gx1, p, ndigits) >= 0;
+	vli_select(v, gx1, gx2, is_qr, ndigits);
+
+	point = l_ecc_point_new(curve);
+	vli_select(point->x, x1, x2, is_qr, ndigits);
+
+	/* y = sqrt(v) = v^((p + 1) / 4) since p = 3 mod 4 */
+	memcpy(exp, p, ndigits * 8);
+	_vli_rshift1(exp, ndigits);
+	_vli_rshift1(exp, ndigits);
+	_vli_mod_add(exp, exp, one, p, ndigits);
+	_vli_mod_exp(point->y, v, exp, p, ndigits);
+
+	/* Make the parity of y match the parity of u */
+	_vli_mod_sub(tmp, p, point->y, p, ndigits);
+	vli_select(point->y, point->y, tmp,
+			(point->y[0] & 1) == (u->c[0] & 1), ndigits);
+
+	explicit_bzero(zu2, sizeof(zu2));
+	explicit_bzero(m, sizeof(m));
+	explicit_bzero(t, sizeof(t));
+	explicit_bzero(x1, sizeof(x1));
+	explicit_bzero(x2, sizeof(x2));
+	explicit_bzero(v, sizeof(v));
+
+	if (!ecc_valid_point(point)) {
+		l_ecc_point_free(point);
+		return NULL;
+	}
+
+	return point;
+}
+
 LIB_EXPORT ssize_t l_ecc_point_get_x(const struct l_ecc_point *p, void *x,
 					size_t xlen)
 {
@@ -628,6 +776,83 @@ LIB_EXPORT struct l_ecc_scalar *l_ecc_scalar_new_random(
 	return _ecc_constant_new(curve, r, curve->ndigits * 8);
 }
 
+/*
+ * Creates a scalar from a big-endian value of up to twice the curve size
+ * reduced modulo the prime p.  Useful for hash-to-curve where the input is
+ * longer than p in order to keep the bias negligible.
+ */
+LIB_EXPORT struct l_ecc_scalar *l_ecc_scalar_new_modp(
+					const struct l_ecc_curve *curve,
+					const void *buf, size_t len)
+{
+	uint8_t padded[2 * L_ECC_SCALAR_MAX_BYTES] = { 0 };
+	uint64_t product[2 * L_ECC_MAX_DIGITS];
+	struct l_ecc_scalar *c;
+	unsigned int i;
+
+	if (unlikely(!curve || !buf))
+		return NULL;
+
+	if (len > curve->ndigits * 16)
+		return NULL;
+
+	memcpy(padded + curve->ndigits * 16 - len, buf, len);
+
+	for (i = 0; i < curve->ndigits * 2; i++)
+		product[curve->ndigits * 2 - 1 - i] =
+						l_get_be64(padded + i * 8);
+
+	c = _ecc_constant_new(curve, NULL, 0);
+	_vli_mmod_fast(c->c, product, curve->p, curve->ndigits);
+
+	explicit_bzero(padded, sizeof(padded));
+	explicit_bzero(product, sizeof(product));
+
+	return c;
+}
+
+/*
+ * Creates a scalar equal to (buf mod (n - 1)) + 1, where buf is a big-endian
+ * value the size of the curve order.  The result is always in [1, n - 1].
+ */
+LIB_EXPORT struct l_ecc_scalar *l_ecc_scalar_new_reduced_1_to_n(
+					const struct l_ecc_curve *curve,
+					const void *buf, size_t len)
+{
+	uint64_t one[L_ECC_MAX_DIGITS] = { 1 };
+	uint64_t n_1[L_ECC_MAX_DIGITS];
+	uint64_t tmp[L_ECC_MAX_DIGITS];
+	struct l_ecc_scalar *c;
+	uint64_t mask;
+	unsigned int i;
+
+	if (unlikely(!curve || !buf))
+		return NULL;
+
+	if (len != curve->ndigits * 8)
+		return NULL;
+
+	c = _ecc_constant_new(curve, NULL, 0);
+	_ecc_be2native(c->c, buf, curve->ndigits);
+
+	_vli_sub(n_1, curve->n, one, curve->ndigits);
+
+	/*
+	 * The input is shorter than 2 * (n - 1), a single conditional
+	 * subtraction is enough.  Select the result without branching.
+	 */
+	mask = _vli_sub(tmp, c->c, n_1, curve->ndigits) - 1;
+
+	for (i = 0; i < curve->ndigits; i++)
+		c->c[i] = (tmp[i] & mask) | (c->c[i] & ~mask);
+
+	_vli_mod_add(c->c, c->c, one, curve->n, curve->ndigits);
+
+	explicit_bzero(tmp, sizeof(tmp));
+
+	return c;
+}
+
 LIB_EXPORT ssize_t l_ecc_scalar_get_data(const struct l_ecc_scalar *c,
 						void *buf, size_t len)
 {
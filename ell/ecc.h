@@ -56,6 +56,7 @@ struct l_ecc_point *l_ecc_point_new(const struct l_ecc_curve *curve);
 struct l_ecc_point *l_ecc_point_from_data(const struct l_ecc_curve *curve,
 					enum l_ecc_point_type type,
 					const void *data, size_t len);
+struct l_ecc_point *l_ecc_point_from_sswu(const struct l_ecc_scalar *u);
 
 ssize_t l_ecc_point_get_x(const struct l_ecc_point *p, void *x, size_t xlen);
 ssize_t l_ecc_point_get_data(const struct l_ecc_point *p, void *buf, size_t len);
@@ -65,6 +66,11 @@ struct l_ecc_scalar *l_ecc_scalar_new(const struct l_ecc_curve *curve,
 						const void *buf, size_t len);
 struct l_ecc_scalar *l_ecc_scalar_new_random(
 					const struct l_ecc_curve *curve);
+struct l_ecc_scalar *l_ecc_scalar_new_modp(const struct l_ecc_curve *curve,
+						const void *buf, size_t len);
+struct l_ecc_scalar *l_ecc_scalar_new_reduced_1_to_n(
+					const struct l_ecc_curve *curve,
+					const void *buf, size_t len);
 ssize_t l_ecc_scalar_get_data(const struct l_ecc_scalar *c, void *buf,
 					size_t len);
 void l_ecc_scalar_free(struct l_ecc_scalar *c);
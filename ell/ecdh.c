@@ -63,8 +63,7 @@ LIB_EXPORT bool l_ecdh_generate_key_pair(const struct l_ecc_curve *curve,
 	while (!compliant && iter++ < ECDH_MAX_ITERATIONS) {
 		*out_private = l_ecc_scalar_new_random(curve);
 
-		_ecc_point_mult(*out_public, &curve->g, (*out_private)->c,
-					NULL, curve->p);
+		_ecc_point_mult_g(*out_public, curve, (*out_private)->c);
 
 		/* ensure public key is compliant */
 		if (_vli_cmp((*out_public)->y, p2, curve->ndigits) >= 0) {
@@ -55,6 +55,13 @@ struct unicast_watch {
 	l_genl_destroy_func_t destroy;
 };
 
+struct overrun_watch {
+	uint32_t id;
+	l_genl_overrun_func_t handler;
+	void *user_data;
+	l_genl_destroy_func_t destroy;
+};
+
 struct family_watch {
 	uint32_t id;
 	char *name;
@@ -85,6 +92,7 @@ struct l_genl {
 	struct genl_discovery *discovery;
 	uint32_t next_watch_id;
 	struct l_queue *unicast_watches;
+	struct l_queue *overrun_watches;
 	struct l_queue *family_watches;
 	struct l_queue *family_infos;
 	struct l_genl_family *nlctrl;
@@ -93,8 +101,11 @@ struct l_genl {
 	l_genl_destroy_func_t debug_destroy;
 	void *debug_data;
 
+	unsigned char *rx_buf;
+
 	bool in_family_watch_notify : 1;
 	bool in_unicast_watch_notify : 1;
+	bool in_overrun_watch_notify : 1;
 	bool in_mcast_notify : 1;
 	bool writer_active : 1;
 };
@@ -129,11 +140,29 @@ struct mcast_notify {
 	uint32_t handle_id;
 	uint16_t type;
 	uint32_t group;
+	uint16_t filter_type;
+	uint8_t filter_len;		/* 0 if not filtered */
+	uint8_t filter[8];
 	l_genl_msg_func_t callback;
 	l_genl_destroy_func_t destroy;
 	void *user_data;
 };
 
+/*
+ * Distinct attribute types the notifies filter on are looked up in each
+ * message in a single pass over its attributes, the first time one of them
+ * is needed
+ */
+#define MCAST_FILTER_MAX_TYPES 4
+
+struct mcast_filter_index {
+	bool built;
+	unsigned int n_types;
+	uint16_t types[MCAST_FILTER_MAX_TYPES];
+	const void *data[MCAST_FILTER_MAX_TYPES];
+	uint16_t len[MCAST_FILTER_MAX_TYPES];
+};
+
 struct genl_op {
 	uint32_t id;
 	uint32_t flags;
@@ -490,6 +519,34 @@ static void unicast_watch_prune(struct l_genl *genl)
 		unicast_watch_free(watch);
 }
 
+static void overrun_watch_free(void *data)
+{
+	struct overrun_watch *watch = data;
+
+	if (watch->destroy)
+		watch->destroy(watch->user_data);
+
+	l_free(watch);
+}
+
+static bool overrun_watch_match(const void *a, const void *b)
+{
+	const struct overrun_watch *watch = a;
+	uint32_t id = L_PTR_TO_UINT(b);
+
+	return watch->id == id;
+}
+
+static void overrun_watch_prune(struct l_genl *genl)
+{
+	struct overrun_watch *watch;
+
+	while ((watch = l_queue_remove_if(genl->overrun_watches,
+						overrun_watch_match,
+						L_UINT_TO_PTR(0))))
+		overrun_watch_free(watch);
+}
+
 static void family_watch_free(void *data)
 {
 	struct family_watch *watch = data;
@@ -741,19 +798,68 @@ static bool match_request_hid(const void *a, const void *b)
 #define NLA_DATA(nla)		((void*)(((char*)(nla)) + NLA_LENGTH(0)))
 #define NLA_PAYLOAD(nla)	((int)((nla)->nla_len) - NLA_LENGTH(0))
 
-static struct l_genl_msg *msg_alloc(uint8_t cmd, uint8_t version, uint32_t size)
+/*
+ * Small cache of released messages, along with their data buffers, so that
+ * the commands sent over and over (scans, frames, station polls) and their
+ * replies don't each go through malloc/realloc/free.  Only messages with
+ * buffers up to MSG_POOL_MAX_SIZE bytes are kept.
+ */
+#define MSG_POOL_LEN 8
+#define MSG_POOL_MAX_SIZE 4096
+
+static struct l_genl_msg *msg_pool[MSG_POOL_LEN];
+static unsigned int msg_pool_count;
+
+static struct l_genl_msg *msg_pool_get(uint32_t size)
 {
+	unsigned int i;
 	struct l_genl_msg *msg;
 
+	for (i = 0; i < msg_pool_count; i++) {
+		if (msg_pool[i]->size < size)
+			continue;
+
+		msg = msg_pool[i];
+		msg_pool[i] = msg_pool[--msg_pool_count];
+		return msg;
+	}
+
 	msg = l_new(struct l_genl_msg, 1);
+	msg->data = l_malloc(size);
+	msg->size = size;
+
+	return msg;
+}
+
+static bool msg_pool_put(struct l_genl_msg *msg)
+{
+	void *data = msg->data;
+	uint32_t size = msg->size;
+
+	if (!data || size > MSG_POOL_MAX_SIZE ||
+			msg_pool_count == MSG_POOL_LEN)
+		return false;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->data = data;
+	msg->size = size;
+	msg_pool[msg_pool_count++] = msg;
+
+	return true;
+}
+
+static struct l_genl_msg *msg_alloc(uint8_t cmd, uint8_t version, uint32_t size)
+{
+	struct l_genl_msg *msg;
+	uint32_t len = NLMSG_HDRLEN + GENL_HDRLEN;
+
+	msg = msg_pool_get(len + NLMSG_ALIGN(size));
 
 	msg->cmd = cmd;
 	msg->version = version;
 
-	msg->len = NLMSG_HDRLEN + GENL_HDRLEN;
-	msg->size = msg->len + NLMSG_ALIGN(size);
+	msg->len = len;
 
-	msg->data = l_realloc(NULL, msg->size);
 	memset(msg->data, 0, msg->size);
 	msg->nesting_level = 0;
 
@@ -772,6 +878,10 @@ static bool msg_grow(struct l_genl_msg *msg, uint32_t needed)
 	if (grow_by < 32)
 		grow_by = 128;
 
+	/* Grow geometrically to keep the number of reallocs down */
+	if (grow_by < msg->size)
+		grow_by = msg->size;
+
 	msg->data = l_realloc(msg->data, msg->size + grow_by);
 	memset(msg->data + msg->size, 0, grow_by);
 	msg->size += grow_by;
@@ -781,9 +891,7 @@ static bool msg_grow(struct l_genl_msg *msg, uint32_t needed)
 
 static struct l_genl_msg *msg_create(const struct nlmsghdr *nlmsg)
 {
-	struct l_genl_msg *msg;
-
-	msg = l_new(struct l_genl_msg, 1);
+	struct l_genl_msg *msg = NULL;
 
 	if (nlmsg->nlmsg_type == NLMSG_ERROR) {
 		struct nlmsgerr *err = NLMSG_DATA(nlmsg);
@@ -791,6 +899,7 @@ static struct l_genl_msg *msg_create(const struct nlmsghdr *nlmsg)
 		struct nlattr *nla;
 		int len;
 
+		msg = l_new(struct l_genl_msg, 1);
 		msg->error = err->error;
 
 		if (!(nlmsg->nlmsg_flags & NLM_F_ACK_TLVS))
@@ -829,10 +938,16 @@ static struct l_genl_msg *msg_create(const struct nlmsghdr *nlmsg)
 		}
 	}
 
-	msg->data = l_memdup(nlmsg, nlmsg->nlmsg_len);
+	if (!msg)
+		msg = msg_pool_get(nlmsg->nlmsg_len);
+	else {
+		msg->data = l_malloc(nlmsg->nlmsg_len);
+		msg->size = nlmsg->nlmsg_len;
+	}
+
+	memcpy(msg->data, nlmsg, nlmsg->nlmsg_len);
 
 	msg->len = nlmsg->nlmsg_len;
-	msg->size = nlmsg->nlmsg_len;
 
 	if (msg->len >= GENL_HDRLEN) {
 		struct genlmsghdr *genlmsg = msg->data + NLMSG_HDRLEN;
@@ -937,10 +1052,14 @@ static void dispatch_unicast_watches(struct l_genl *genl, uint16_t id,
 							struct l_genl_msg *msg)
 {
 	const struct l_queue_entry *entry;
-	struct l_genl_family_info *info = l_queue_find(genl->family_infos,
-							family_info_match,
-							L_UINT_TO_PTR(id));
+	struct l_genl_family_info *info;
 
+	/* Most unsolicited unicast messages have no watches at all */
+	if (l_queue_isempty(genl->unicast_watches))
+		return;
+
+	info = l_queue_find(genl->family_infos, family_info_match,
+							L_UINT_TO_PTR(id));
 	if (!info)
 		return;
 
@@ -982,8 +1101,18 @@ static void process_unicast(struct l_genl *genl, const struct nlmsghdr *nlmsg)
 		goto done;
 	}
 
-	request = l_queue_remove_if(genl->pending_list, match_request_seq,
+	/*
+	 * wakeup_writer only sends a new request once the pending list is
+	 * empty so the reply normally belongs to the head of the list.
+	 */
+	request = l_queue_peek_head(genl->pending_list);
+	if (request && request->seq == nlmsg->nlmsg_seq)
+		l_queue_pop_head(genl->pending_list);
+	else
+		request = l_queue_remove_if(genl->pending_list,
+					match_request_seq,
 					L_UINT_TO_PTR(nlmsg->nlmsg_seq));
+
 	if (!request)
 		goto done;
 
@@ -1006,11 +1135,70 @@ done:
 	l_genl_msg_unref(msg);
 }
 
+static void mcast_filter_index_build(struct l_genl *genl,
+					struct l_genl_msg *msg, uint16_t type,
+					uint32_t group,
+					struct mcast_filter_index *index)
+{
+	const struct l_queue_entry *entry;
+	struct l_genl_attr attr;
+	uint16_t attr_type, len;
+	const void *data;
+	unsigned int i;
+
+	index->built = true;
+
+	for (entry = l_queue_get_entries(genl->notify_list);
+						entry; entry = entry->next) {
+		const struct mcast_notify *notify = entry->data;
+
+		if (notify->type != type || notify->group != group ||
+				!notify->filter_len)
+			continue;
+
+		for (i = 0; i < index->n_types; i++)
+			if (index->types[i] == notify->filter_type)
+				break;
+
+		if (i == index->n_types && i < MCAST_FILTER_MAX_TYPES)
+			index->types[index->n_types++] = notify->filter_type;
+	}
+
+	if (!l_genl_attr_init(&attr, msg))
+		return;
+
+	while (l_genl_attr_next(&attr, &attr_type, &len, &data)) {
+		for (i = 0; i < index->n_types; i++) {
+			if (index->types[i] != attr_type || index->data[i])
+				continue;
+
+			index->data[i] = data;
+			index->len[i] = len;
+		}
+	}
+}
+
+static bool mcast_notify_filter_match(const struct mcast_notify *notify,
+					const struct mcast_filter_index *index)
+{
+	unsigned int i;
+
+	for (i = 0; i < index->n_types; i++)
+		if (index->types[i] == notify->filter_type)
+			return index->data[i] &&
+				index->len[i] == notify->filter_len &&
+				!memcmp(index->data[i], notify->filter,
+					notify->filter_len);
+
+	return false;
+}
+
 static void process_multicast(struct l_genl *genl, uint32_t group,
 						const struct nlmsghdr *nlmsg)
 {
 	const struct l_queue_entry *entry;
 	struct l_genl_msg *msg = msg_create(nlmsg);
+	struct mcast_filter_index index = { .built = false };
 
 	if (!msg)
 		return;
@@ -1030,6 +1218,16 @@ static void process_multicast(struct l_genl *genl, uint32_t group,
 		if (!notify->callback)
 			continue;
 
+		if (notify->filter_len) {
+			if (!index.built)
+				mcast_filter_index_build(genl, msg,
+							nlmsg->nlmsg_type,
+							group, &index);
+
+			if (!mcast_notify_filter_match(notify, &index))
+				continue;
+		}
+
 		notify->callback(msg, notify->user_data);
 	}
 
@@ -1043,13 +1241,63 @@ static void read_watch_destroy(void *user_data)
 {
 }
 
-static bool received_data(struct l_io *io, void *user_data)
+/*
+ * The kernel sizes dump messages after the receive buffer used by the
+ * reader, up to 32KiB, so a large buffer lets it pack many more entries
+ * (e.g. scan results) into each datagram.  Several datagrams are then read
+ * per wakeup to drain a dump in fewer main loop iterations.
+ */
+#define RX_BUF_SIZE 32768
+#define RX_BATCH 8
+#define RCVBUF_SIZE (512 * 1024)
+#define RCVBUF_MAX_SIZE (8 * 1024 * 1024)
+
+/*
+ * The kernel dropped messages because the socket receive buffer was full.
+ * Lost replies are not recoverable but multicast notifications are, by the
+ * owner querying the state they would have updated.  Grow the buffer to
+ * make a repeat less likely and let the overrun watches resynchronize.
+ */
+static void handle_overrun(struct l_genl *genl)
+{
+	const struct l_queue_entry *entry;
+	int rcvbuf;
+	socklen_t len = sizeof(rcvbuf);
+
+	if (getsockopt(genl->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len) == 0 &&
+			rcvbuf < RCVBUF_MAX_SIZE) {
+		/* The kernel reports twice the size set, for its overhead */
+		rcvbuf = rcvbuf > RCVBUF_MAX_SIZE / 2 ?
+					RCVBUF_MAX_SIZE : rcvbuf * 2;
+
+		/* FORCE ignores rmem_max but needs CAP_NET_ADMIN */
+		if (setsockopt(genl->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+					&rcvbuf, sizeof(rcvbuf)) < 0)
+			setsockopt(genl->fd, SOL_SOCKET, SO_RCVBUF,
+					&rcvbuf, sizeof(rcvbuf));
+	}
+
+	genl->in_overrun_watch_notify = true;
+
+	for (entry = l_queue_get_entries(genl->overrun_watches);
+						entry; entry = entry->next) {
+		struct overrun_watch *watch = entry->data;
+
+		if (!watch->id)
+			continue;
+
+		watch->handler(watch->user_data);
+	}
+
+	genl->in_overrun_watch_notify = false;
+	overrun_watch_prune(genl);
+}
+
+static bool received_datagram(struct l_genl *genl)
 {
-	struct l_genl *genl = user_data;
 	struct cmsghdr *cmsg;
 	struct msghdr msg;
 	struct iovec iov;
-	unsigned char buf[8192];
 	unsigned char control[32];
 	ssize_t bytes_read;
 	struct nlmsghdr *nlmsg;
@@ -1057,8 +1305,8 @@ static bool received_data(struct l_io *io, void *user_data)
 	uint32_t group = 0;
 
 	memset(&iov, 0, sizeof(iov));
-	iov.iov_base = buf;
-	iov.iov_len = sizeof(buf);
+	iov.iov_base = genl->rx_buf;
+	iov.iov_len = RX_BUF_SIZE;
 
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_iov = &iov;
@@ -1066,17 +1314,13 @@ static bool received_data(struct l_io *io, void *user_data)
 	msg.msg_control = control;
 	msg.msg_controllen = sizeof(control);
 
-	bytes_read = recvmsg(genl->fd, &msg, 0);
-	if (bytes_read < 0) {
-		if (errno != EAGAIN && errno != EINTR)
-			return false;
-
-		return true;
-	}
+	bytes_read = recvmsg(genl->fd, &msg, MSG_DONTWAIT);
+	if (bytes_read < 0)
+		return false;
 
 	nlmsg_len = bytes_read;
 
-	l_util_hexdump(true, buf, nlmsg_len,
+	l_util_hexdump(true, genl->rx_buf, nlmsg_len,
 				genl->debug_callback, genl->debug_data);
 
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
@@ -1105,6 +1349,45 @@ static bool received_data(struct l_io *io, void *user_data)
 	return true;
 }
 
+static bool received_data(struct l_io *io, void *user_data)
+{
+	struct l_genl *genl = user_data;
+	unsigned int i;
+	bool ret = true;
+
+	if (!genl->rx_buf)
+		genl->rx_buf = l_malloc(RX_BUF_SIZE);
+
+	/* Callbacks may drop the last reference to genl */
+	l_genl_ref(genl);
+
+	for (i = 0; i < RX_BATCH; i++) {
+		if (received_datagram(genl)) {
+			/* Stop if the owner is gone */
+			if (__atomic_load_n(&genl->ref_count,
+						__ATOMIC_SEQ_CST) == 1)
+				break;
+
+			continue;
+		}
+
+		/* The socket stays usable, keep reading what's queued */
+		if (errno == ENOBUFS) {
+			handle_overrun(genl);
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EINTR)
+			ret = false;
+
+		break;
+	}
+
+	l_genl_unref(genl);
+
+	return ret;
+}
+
 static struct l_genl_family_info *build_nlctrl_info()
 {
 	struct l_genl_family_info *r = family_info_new("nlctrl");
@@ -1124,6 +1407,7 @@ LIB_EXPORT struct l_genl *l_genl_new(void)
 	int fd;
 	int pktinfo = 1;
 	int ext_ack = 1;
+	int rcvbuf = RCVBUF_SIZE;
 
 	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
 							NETLINK_GENERIC);
@@ -1148,6 +1432,9 @@ LIB_EXPORT struct l_genl *l_genl_new(void)
 	setsockopt(fd, SOL_NETLINK, NETLINK_EXT_ACK,
 					&ext_ack, sizeof(ext_ack));
 
+	/* Best effort, avoids ENOBUFS while large dumps are in flight */
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
 	genl = l_new(struct l_genl, 1);
 	genl->pid = addr.nl_pid;
 	genl->ref_count = 1;
@@ -1162,6 +1449,7 @@ LIB_EXPORT struct l_genl *l_genl_new(void)
 	genl->family_watches = l_queue_new();
 	genl->family_infos = l_queue_new();
 	genl->unicast_watches = l_queue_new();
+	genl->overrun_watches = l_queue_new();
 
 	l_queue_push_head(genl->family_infos, build_nlctrl_info());
 
@@ -1205,6 +1493,7 @@ LIB_EXPORT void l_genl_unref(struct l_genl *genl)
 	l_genl_family_free(genl->nlctrl);
 
 	l_queue_destroy(genl->unicast_watches, unicast_watch_free);
+	l_queue_destroy(genl->overrun_watches, overrun_watch_free);
 	l_queue_destroy(genl->family_watches, family_watch_free);
 	l_queue_destroy(genl->family_infos, family_info_free);
 	l_queue_destroy(genl->notify_list, mcast_notify_free);
@@ -1221,6 +1510,7 @@ LIB_EXPORT void l_genl_unref(struct l_genl *genl)
 	if (genl->debug_destroy)
 		genl->debug_destroy(genl->debug_data);
 
+	l_free(genl->rx_buf);
 	l_free(genl);
 }
 
@@ -1242,6 +1532,14 @@ LIB_EXPORT bool l_genl_set_debug(struct l_genl *genl,
 	return true;
 }
 
+LIB_EXPORT bool l_genl_set_priority(struct l_genl *genl, int priority)
+{
+	if (unlikely(!genl))
+		return false;
+
+	return l_io_set_priority(genl->io, priority);
+}
+
 static void dump_family_callback(struct l_genl_msg *msg, void *user_data)
 {
 	struct l_genl *genl = user_data;
@@ -1385,6 +1683,81 @@ LIB_EXPORT bool l_genl_remove_unicast_watch(struct l_genl *genl,
 	return true;
 }
 
+/**
+ * l_genl_add_overrun_watch:
+ * @genl: GENL connection
+ * @handler: Callback to call when messages were lost
+ * @user_data: user data for the callback
+ * @destroy: Destroy callback for user data
+ *
+ * Adds a watch called whenever the kernel had to drop messages, including
+ * multicast notifications, because the socket receive buffer was full.
+ * The receive buffer is grown each time, up to a limit.  The handler is
+ * expected to query any state the lost notifications may have changed.
+ *
+ * Returns: a non-zero watch identifier that can be passed to
+ *          l_genl_remove_overrun_watch to remove this watch, or zero if the
+ *          watch could not be created successfully.
+ **/
+LIB_EXPORT unsigned int l_genl_add_overrun_watch(struct l_genl *genl,
+						l_genl_overrun_func_t handler,
+						void *user_data,
+						l_genl_destroy_func_t destroy)
+{
+	struct overrun_watch *watch;
+
+	if (unlikely(!genl || !handler))
+		return 0;
+
+	watch = l_new(struct overrun_watch, 1);
+	watch->handler = handler;
+	watch->destroy = destroy;
+	watch->user_data = user_data;
+	watch->id = get_next_id(&genl->next_watch_id);
+	l_queue_push_tail(genl->overrun_watches, watch);
+
+	return watch->id;
+}
+
+/**
+ * l_genl_remove_overrun_watch:
+ * @genl: GENL connection
+ * @id: unique identifier of the overrun watch to remove
+ *
+ * Removes the overrun watch.  If a destroy callback was provided, then it is
+ * called in order to free any associated user data.
+ *
+ * Returns: #true if the watch was removed successfully and #false otherwise.
+ **/
+LIB_EXPORT bool l_genl_remove_overrun_watch(struct l_genl *genl,
+							unsigned int id)
+{
+	struct overrun_watch *watch;
+
+	if (unlikely(!genl))
+		return false;
+
+	if (genl->in_overrun_watch_notify) {
+		watch = l_queue_find(genl->overrun_watches,
+					overrun_watch_match,
+					L_UINT_TO_PTR(id));
+		if (!watch)
+			return false;
+
+		watch->id = 0;
+		return true;
+	}
+
+	watch = l_queue_remove_if(genl->overrun_watches, overrun_watch_match,
+							L_UINT_TO_PTR(id));
+	if (!watch)
+		return false;
+
+	overrun_watch_free(watch);
+
+	return true;
+}
+
 /**
  * l_genl_add_family_watch:
  * @genl: GENL connection
@@ -1612,6 +1985,10 @@ LIB_EXPORT void l_genl_msg_unref(struct l_genl_msg *msg)
 		return;
 
 	l_free(msg->error_msg);
+
+	if (msg_pool_put(msg))
+		return;
+
 	l_free(msg->data);
 	l_free(msg);
 }
@@ -1992,8 +2369,11 @@ static void drop_membership(struct l_genl *genl, struct genl_mcast *mcast)
 							&group, sizeof(group));
 }
 
-LIB_EXPORT unsigned int l_genl_family_register(struct l_genl_family *family,
+static unsigned int genl_family_register(struct l_genl_family *family,
 						const char *group,
+						uint16_t filter_type,
+						const void *filter,
+						size_t filter_len,
 						l_genl_msg_func_t callback,
 						void *user_data,
 						l_genl_destroy_func_t destroy)
@@ -2022,6 +2402,10 @@ LIB_EXPORT unsigned int l_genl_family_register(struct l_genl_family *family,
 	notify = l_new(struct mcast_notify, 1);
 	notify->type = info->id;
 	notify->group = mcast->id;
+	notify->filter_type = filter_type;
+	notify->filter_len = filter_len;
+	if (filter_len)
+		memcpy(notify->filter, filter, filter_len);
 	notify->callback = callback;
 	notify->destroy = destroy;
 	notify->user_data = user_data;
@@ -2034,6 +2418,40 @@ LIB_EXPORT unsigned int l_genl_family_register(struct l_genl_family *family,
 	return notify->id;
 }
 
+LIB_EXPORT unsigned int l_genl_family_register(struct l_genl_family *family,
+						const char *group,
+						l_genl_msg_func_t callback,
+						void *user_data,
+						l_genl_destroy_func_t destroy)
+{
+	return genl_family_register(family, group, 0, NULL, 0,
+					callback, user_data, destroy);
+}
+
+/*
+ * Like l_genl_family_register but @callback only gets the group's messages
+ * carrying a top-level @attr_type attribute equal to @value, e.g. those for
+ * a single interface.  @value_len can be at most 8 bytes.
+ */
+LIB_EXPORT unsigned int l_genl_family_register_filtered(
+						struct l_genl_family *family,
+						const char *group,
+						uint16_t attr_type,
+						const void *value,
+						size_t value_len,
+						l_genl_msg_func_t callback,
+						void *user_data,
+						l_genl_destroy_func_t destroy)
+{
+	if (unlikely(!value) || unlikely(!value_len) ||
+			unlikely(value_len > 8))
+		return 0;
+
+	return genl_family_register(family, group, attr_type, value,
+					value_len, callback, user_data,
+					destroy);
+}
+
 LIB_EXPORT bool l_genl_family_unregister(struct l_genl_family *family,
 							unsigned int id)
 {
@@ -44,6 +44,7 @@ typedef void (*l_genl_msg_func_t)(struct l_genl_msg *msg, void *user_data);
 typedef void (*l_genl_discover_func_t)(const struct l_genl_family_info *info,
 						void *user_data);
 typedef void (*l_genl_vanished_func_t)(const char *name, void *user_data);
+typedef void (*l_genl_overrun_func_t)(void *user_data);
 
 struct l_genl *l_genl_new(void);
 struct l_genl *l_genl_ref(struct l_genl *genl);
@@ -52,6 +53,8 @@ void l_genl_unref(struct l_genl *genl);
 bool l_genl_set_debug(struct l_genl *genl, l_genl_debug_func_t callback,
 				void *user_data, l_genl_destroy_func_t destroy);
 
+bool l_genl_set_priority(struct l_genl *genl, int priority);
+
 bool l_genl_discover_families(struct l_genl *genl,
 				l_genl_discover_func_t cb, void *user_data,
 				l_genl_destroy_func_t destroy);
@@ -63,6 +66,12 @@ unsigned int l_genl_add_unicast_watch(struct l_genl *genl,
 						l_genl_destroy_func_t destroy);
 bool l_genl_remove_unicast_watch(struct l_genl *genl, unsigned int id);
 
+unsigned int l_genl_add_overrun_watch(struct l_genl *genl,
+						l_genl_overrun_func_t handler,
+						void *user_data,
+						l_genl_destroy_func_t destroy);
+bool l_genl_remove_overrun_watch(struct l_genl *genl, unsigned int id);
+
 unsigned int l_genl_add_family_watch(struct l_genl *genl,
 					const char *name,
 					l_genl_discover_func_t appeared_func,
@@ -145,6 +154,11 @@ bool l_genl_family_cancel(struct l_genl_family *family, unsigned int id);
 unsigned int l_genl_family_register(struct l_genl_family *family,
 				const char *group, l_genl_msg_func_t callback,
 				void *user_data, l_genl_destroy_func_t destroy);
+unsigned int l_genl_family_register_filtered(struct l_genl_family *family,
+				const char *group, uint16_t attr_type,
+				const void *value, size_t value_len,
+				l_genl_msg_func_t callback,
+				void *user_data, l_genl_destroy_func_t destroy);
 bool l_genl_family_unregister(struct l_genl_family *family, unsigned int id);
 
 #ifdef __cplusplus
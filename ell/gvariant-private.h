@@ -45,6 +45,7 @@ int _gvariant_num_children(const char *sig);
 
 struct dbus_builder *_gvariant_builder_new(void *body, size_t body_size);
 void _gvariant_builder_free(struct dbus_builder *builder);
+bool _gvariant_builder_reserve(struct dbus_builder *builder, size_t size);
 bool _gvariant_builder_append_basic(struct dbus_builder *builder,
 					char type, const void *value);
 bool _gvariant_builder_mark(struct dbus_builder *builder);
@@ -782,15 +782,37 @@ struct container {
 	uint8_t sigindex;
 };
 
+#define BODY_MIN_ALLOC 128
+
+/*
+ * Grow the buffer geometrically so that building a large message, such as
+ * a GetManagedObjects reply, doesn't take one reallocation (and possibly
+ * one copy of everything built so far) per appended value.
+ */
+static void reserve_body(struct dbus_builder *builder, size_t size)
+{
+	size_t alloc = builder->body_size * 2;
+
+	if (size <= builder->body_size)
+		return;
+
+	if (alloc < BODY_MIN_ALLOC)
+		alloc = BODY_MIN_ALLOC;
+
+	if (alloc < size)
+		alloc = size;
+
+	builder->body = l_realloc(builder->body, alloc);
+	builder->body_size = alloc;
+}
+
 static inline size_t grow_body(struct dbus_builder *builder,
 					size_t len, unsigned int alignment)
 {
 	size_t size = align_len(builder->body_pos, alignment);
 
-	if (size + len > builder->body_size) {
-		builder->body = l_realloc(builder->body, size + len);
-		builder->body_size = size + len;
-	}
+	if (size + len > builder->body_size)
+		reserve_body(builder, size + len);
 
 	if (size - builder->body_pos > 0)
 		memset(builder->body + builder->body_pos, 0,
@@ -1261,6 +1283,16 @@ bool _gvariant_builder_append_basic(struct dbus_builder *builder,
 	return true;
 }
 
+bool _gvariant_builder_reserve(struct dbus_builder *builder, size_t size)
+{
+	if (unlikely(!builder))
+		return false;
+
+	reserve_body(builder, builder->body_pos + size);
+
+	return true;
+}
+
 bool _gvariant_builder_mark(struct dbus_builder *builder)
 {
 	struct container *container = l_queue_peek_head(builder->containers);
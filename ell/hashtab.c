@@ -0,0 +1,510 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "hashtab.h"
+#include "random.h"
+#include "siphash-private.h"
+#include "private.h"
+#include "useful.h"
+
+/**
+ * SECTION:hashtab
+ * @short_description: Open addressing hash table
+ *
+ * A hash table for small fixed size keys, such as MAC addresses, that are
+ * stored inline in the table.  Entries live in a single array and are
+ * placed with Robin Hood linear probing, so lookups touch a few adjacent
+ * slots and inserting an entry does not allocate unless the table grows.
+ *
+ * Keys are hashed either with a fast seeded multiply-mix hash or, where
+ * they may be chosen by a remote party and the table could be flooded
+ * with colliding keys, with SipHash-2-4 under a random key.
+ *
+ * The table must not be modified from within foreach callbacks, use
+ * l_hashtab_foreach_remove() to drop entries while iterating.
+ */
+
+#define HASHTAB_MIN_SLOTS 8
+
+struct hashtab_slot {
+	uint32_t psl;		/* Probe sequence length + 1, 0 if empty */
+	uint32_t hash;
+	void *value;
+	uint8_t key[];
+};
+
+/**
+ * l_hashtab:
+ *
+ * Opaque object representing the hash table.
+ */
+struct l_hashtab {
+	uint8_t *slots;
+	size_t stride;
+	size_t key_len;
+	unsigned int n_slots;
+	unsigned int entries;
+	enum l_hashtab_hash hash;
+	uint8_t sip_key[16];
+	uint64_t seed;
+};
+
+static inline struct hashtab_slot *slot_at(const struct l_hashtab *tab,
+							unsigned int i)
+{
+	return (struct hashtab_slot *) (tab->slots + i * tab->stride);
+}
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t) a * b;
+
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+#else
+	uint64_t r = a * b;
+
+	return r ^ (r >> 29) ^ (a >> 32) * b;
+#endif
+}
+
+static uint32_t hash_fast(const uint8_t *key, size_t len, uint64_t seed)
+{
+	uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+	uint64_t v;
+
+	for (; len >= 8; key += 8, len -= 8) {
+		memcpy(&v, key, 8);
+		h = hash_mix(h ^ v, 0xa0761d6478bd642fULL);
+	}
+
+	if (len) {
+		v = 0;
+		memcpy(&v, key, len);
+		h = hash_mix(h ^ v, 0xe7037ed1a0b428dbULL);
+	}
+
+	h = hash_mix(h, 0x8ebc6af09c88c6e3ULL);
+
+	return h ^ (h >> 32);
+}
+
+static uint32_t hashtab_hash(const struct l_hashtab *tab, const void *key)
+{
+	uint8_t out[8];
+
+	if (tab->hash == L_HASHTAB_HASH_FAST)
+		return hash_fast(key, tab->key_len, tab->seed);
+
+	_siphash24(out, key, tab->key_len, tab->sip_key);
+
+	return l_get_le32(out) ^ l_get_le32(out + 4);
+}
+
+static int hashtab_find(const struct l_hashtab *tab, const void *key,
+							uint32_t hash)
+{
+	unsigned int mask = tab->n_slots - 1;
+	unsigned int i = hash & mask;
+	uint32_t psl;
+
+	if (!tab->entries)
+		return -1;
+
+	for (psl = 1;; psl++, i = (i + 1) & mask) {
+		const struct hashtab_slot *slot = slot_at(tab, i);
+
+		/* An entry further out would have displaced this one */
+		if (slot->psl < psl)
+			return -1;
+
+		if (slot->hash == hash && !memcmp(slot->key, key, tab->key_len))
+			return i;
+	}
+}
+
+/* Place an entry known not to be in the table, which must have room */
+static void hashtab_place(struct l_hashtab *tab, struct hashtab_slot *entry)
+{
+	uint64_t buf[2][(sizeof(struct hashtab_slot) +
+					L_HASHTAB_MAX_KEY_LEN + 7) / 8];
+	struct hashtab_slot *cur = (struct hashtab_slot *) buf[0];
+	struct hashtab_slot *tmp = (struct hashtab_slot *) buf[1];
+	unsigned int mask = tab->n_slots - 1;
+	unsigned int i;
+
+	memcpy(cur, entry, tab->stride);
+	cur->psl = 1;
+	i = cur->hash & mask;
+
+	for (;; i = (i + 1) & mask, cur->psl++) {
+		struct hashtab_slot *slot = slot_at(tab, i);
+
+		if (!slot->psl) {
+			memcpy(slot, cur, tab->stride);
+			break;
+		}
+
+		/* Take from the rich: the resident is closer to its home */
+		if (slot->psl < cur->psl) {
+			memcpy(tmp, slot, tab->stride);
+			memcpy(slot, cur, tab->stride);
+			memcpy(cur, tmp, tab->stride);
+		}
+	}
+
+	tab->entries += 1;
+}
+
+static void hashtab_resize(struct l_hashtab *tab, unsigned int n_slots)
+{
+	uint8_t *old = tab->slots;
+	unsigned int old_n_slots = tab->n_slots;
+	unsigned int i;
+
+	tab->slots = l_malloc(n_slots * tab->stride);
+	memset(tab->slots, 0, n_slots * tab->stride);
+	tab->n_slots = n_slots;
+	tab->entries = 0;
+
+	for (i = 0; i < old_n_slots; i++) {
+		struct hashtab_slot *slot =
+			(struct hashtab_slot *) (old + i * tab->stride);
+
+		if (slot->psl)
+			hashtab_place(tab, slot);
+	}
+
+	l_free(old);
+}
+
+/* Backward shift deletion, no tombstones are left behind */
+static void hashtab_remove_at(struct l_hashtab *tab, unsigned int i)
+{
+	unsigned int mask = tab->n_slots - 1;
+
+	while (true) {
+		unsigned int next = (i + 1) & mask;
+		struct hashtab_slot *slot = slot_at(tab, i);
+		struct hashtab_slot *next_slot = slot_at(tab, next);
+
+		if (next_slot->psl <= 1) {
+			slot->psl = 0;
+			break;
+		}
+
+		memcpy(slot, next_slot, tab->stride);
+		slot->psl -= 1;
+		i = next;
+	}
+
+	tab->entries -= 1;
+}
+
+/**
+ * l_hashtab_new:
+ * @key_len: size of the keys in bytes, at most #L_HASHTAB_MAX_KEY_LEN
+ * @hash: hash function to use
+ *
+ * Create a new hash table for keys of @key_len bytes.  Keys are copied into
+ * the table.
+ *
+ * Returns: a newly allocated #l_hashtab object, or NULL if @key_len is not
+ * supported.
+ **/
+LIB_EXPORT struct l_hashtab *l_hashtab_new(size_t key_len,
+						enum l_hashtab_hash hash)
+{
+	struct l_hashtab *tab;
+
+	if (unlikely(!key_len || key_len > L_HASHTAB_MAX_KEY_LEN))
+		return NULL;
+
+	tab = l_new(struct l_hashtab, 1);
+	tab->key_len = key_len;
+	tab->stride = align_len(sizeof(struct hashtab_slot) + key_len,
+							sizeof(void *));
+	tab->hash = hash;
+
+	if (hash == L_HASHTAB_HASH_SIPHASH)
+		l_getrandom(tab->sip_key, sizeof(tab->sip_key));
+	else
+		l_getrandom(&tab->seed, sizeof(tab->seed));
+
+	return tab;
+}
+
+/**
+ * l_hashtab_destroy:
+ * @tab: hash table object
+ * @destroy: destroy function, called for each value
+ *
+ * Free the hash table and all of its entries.
+ **/
+LIB_EXPORT void l_hashtab_destroy(struct l_hashtab *tab,
+					l_hashtab_destroy_func_t destroy)
+{
+	unsigned int i;
+
+	if (unlikely(!tab))
+		return;
+
+	for (i = 0; destroy && i < tab->n_slots; i++) {
+		struct hashtab_slot *slot = slot_at(tab, i);
+
+		if (slot->psl)
+			destroy(slot->value);
+	}
+
+	l_free(tab->slots);
+	l_free(tab);
+}
+
+/**
+ * l_hashtab_replace:
+ * @tab: hash table object
+ * @key: key of the entry
+ * @value: new value
+ * @old_value: return location for the previous value, if any
+ *
+ * Set the value of the entry for @key, inserting it if it doesn't exist.
+ *
+ * Returns: #true on success, #false if @tab is NULL
+ **/
+LIB_EXPORT bool l_hashtab_replace(struct l_hashtab *tab, const void *key,
+					void *value, void **old_value)
+{
+	uint64_t buf[(sizeof(struct hashtab_slot) +
+					L_HASHTAB_MAX_KEY_LEN + 7) / 8];
+	struct hashtab_slot *entry = (struct hashtab_slot *) buf;
+	uint32_t hash;
+	int i;
+
+	if (unlikely(!tab))
+		return false;
+
+	hash = hashtab_hash(tab, key);
+	i = hashtab_find(tab, key, hash);
+
+	if (old_value)
+		*old_value = i < 0 ? NULL : slot_at(tab, i)->value;
+
+	if (i >= 0) {
+		slot_at(tab, i)->value = value;
+		return true;
+	}
+
+	/* Keep the load factor at or below 7/8 */
+	if (!tab->n_slots)
+		hashtab_resize(tab, HASHTAB_MIN_SLOTS);
+	else if ((tab->entries + 1) * 8 > tab->n_slots * 7)
+		hashtab_resize(tab, tab->n_slots * 2);
+
+	memset(entry, 0, tab->stride);
+	entry->hash = hash;
+	entry->value = value;
+	memcpy(entry->key, key, tab->key_len);
+	hashtab_place(tab, entry);
+
+	return true;
+}
+
+/**
+ * l_hashtab_insert:
+ * @tab: hash table object
+ * @key: key of the entry
+ * @value: value of the entry
+ *
+ * Insert a new entry into the hash table.
+ *
+ * Returns: #true on success, #false if an entry for @key already exists
+ **/
+LIB_EXPORT bool l_hashtab_insert(struct l_hashtab *tab, const void *key,
+								void *value)
+{
+	if (unlikely(!tab))
+		return false;
+
+	if (hashtab_find(tab, key, hashtab_hash(tab, key)) >= 0)
+		return false;
+
+	return l_hashtab_replace(tab, key, value, NULL);
+}
+
+/**
+ * l_hashtab_remove:
+ * @tab: hash table object
+ * @key: key of the entry
+ *
+ * Remove the entry for @key from the hash table.
+ *
+ * Returns: the value of the removed entry, or NULL if there was none
+ **/
+LIB_EXPORT void *l_hashtab_remove(struct l_hashtab *tab, const void *key)
+{
+	void *value;
+	int i;
+
+	if (unlikely(!tab))
+		return NULL;
+
+	i = hashtab_find(tab, key, hashtab_hash(tab, key));
+	if (i < 0)
+		return NULL;
+
+	value = slot_at(tab, i)->value;
+	hashtab_remove_at(tab, i);
+
+	return value;
+}
+
+/**
+ * l_hashtab_lookup:
+ * @tab: hash table object
+ * @key: key of the entry
+ *
+ * Returns: the value of the entry for @key, or NULL if there is none
+ **/
+LIB_EXPORT void *l_hashtab_lookup(struct l_hashtab *tab, const void *key)
+{
+	int i;
+
+	if (unlikely(!tab))
+		return NULL;
+
+	i = hashtab_find(tab, key, hashtab_hash(tab, key));
+
+	return i < 0 ? NULL : slot_at(tab, i)->value;
+}
+
+/**
+ * l_hashtab_foreach:
+ * @tab: hash table object
+ * @function: function called for each entry
+ * @user_data: user data passed to @function
+ *
+ * Call @function for each entry of the hash table, in no particular order.
+ **/
+LIB_EXPORT void l_hashtab_foreach(struct l_hashtab *tab,
+			l_hashtab_foreach_func_t function, void *user_data)
+{
+	unsigned int i;
+
+	if (unlikely(!tab || !function))
+		return;
+
+	for (i = 0; i < tab->n_slots; i++) {
+		struct hashtab_slot *slot = slot_at(tab, i);
+
+		if (slot->psl)
+			function(slot->key, slot->value, user_data);
+	}
+}
+
+/**
+ * l_hashtab_foreach_remove:
+ * @tab: hash table object
+ * @function: function called for each entry
+ * @user_data: user data passed to @function
+ *
+ * Call @function for each entry of the hash table and remove the entries
+ * for which it returns #true.
+ *
+ * Returns: the number of removed entries
+ **/
+LIB_EXPORT unsigned int l_hashtab_foreach_remove(struct l_hashtab *tab,
+			l_hashtab_remove_func_t function, void *user_data)
+{
+	unsigned int removed = 0;
+	unsigned int i;
+
+	if (unlikely(!tab || !function))
+		return 0;
+
+	/*
+	 * Shifting entries back while iterating could visit an entry twice
+	 * when it wraps around the end, so mark the removed slots and
+	 * rebuild the table once at the end.
+	 */
+	for (i = 0; i < tab->n_slots; i++) {
+		struct hashtab_slot *slot = slot_at(tab, i);
+
+		if (!slot->psl)
+			continue;
+
+		if (function(slot->key, slot->value, user_data)) {
+			slot->value = NULL;
+			slot->psl = UINT32_MAX;
+			removed += 1;
+		}
+	}
+
+	if (!removed)
+		return 0;
+
+	for (i = 0; i < tab->n_slots; i++) {
+		struct hashtab_slot *slot = slot_at(tab, i);
+
+		if (slot->psl == UINT32_MAX)
+			slot->psl = 0;
+	}
+
+	hashtab_resize(tab, tab->n_slots);
+
+	return removed;
+}
+
+/**
+ * l_hashtab_size:
+ * @tab: hash table object
+ *
+ * Returns: the number of entries in the hash table
+ **/
+LIB_EXPORT unsigned int l_hashtab_size(struct l_hashtab *tab)
+{
+	if (unlikely(!tab))
+		return 0;
+
+	return tab->entries;
+}
+
+/**
+ * l_hashtab_isempty:
+ * @tab: hash table object
+ *
+ * Returns: #true if the hash table has no entries
+ **/
+LIB_EXPORT bool l_hashtab_isempty(struct l_hashtab *tab)
+{
+	if (unlikely(!tab))
+		return true;
+
+	return tab->entries == 0;
+}
@@ -0,0 +1,70 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __ELL_HASHTAB_H
+#define __ELL_HASHTAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define L_HASHTAB_MAX_KEY_LEN 64
+
+enum l_hashtab_hash {
+	L_HASHTAB_HASH_FAST,
+	L_HASHTAB_HASH_SIPHASH,
+};
+
+typedef void (*l_hashtab_foreach_func_t) (const void *key, void *value,
+							void *user_data);
+typedef bool (*l_hashtab_remove_func_t) (const void *key, void *value,
+							void *user_data);
+typedef void (*l_hashtab_destroy_func_t) (void *value);
+
+struct l_hashtab;
+
+struct l_hashtab *l_hashtab_new(size_t key_len, enum l_hashtab_hash hash);
+void l_hashtab_destroy(struct l_hashtab *tab,
+				l_hashtab_destroy_func_t destroy);
+
+bool l_hashtab_insert(struct l_hashtab *tab, const void *key, void *value);
+bool l_hashtab_replace(struct l_hashtab *tab, const void *key, void *value,
+							void **old_value);
+void *l_hashtab_remove(struct l_hashtab *tab, const void *key);
+void *l_hashtab_lookup(struct l_hashtab *tab, const void *key);
+
+void l_hashtab_foreach(struct l_hashtab *tab,
+			l_hashtab_foreach_func_t function, void *user_data);
+unsigned int l_hashtab_foreach_remove(struct l_hashtab *tab,
+			l_hashtab_remove_func_t function, void *user_data);
+
+unsigned int l_hashtab_size(struct l_hashtab *tab);
+bool l_hashtab_isempty(struct l_hashtab *tab);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ELL_HASHTAB_H */
@@ -0,0 +1,372 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <limits.h>
+
+#include "util.h"
+#include "heap.h"
+#include "private.h"
+#include "useful.h"
+
+/**
+ * SECTION:heap
+ * @short_description: Indexed priority queue
+ *
+ * A binary min-heap of pointers, ordered by a caller supplied compare
+ * function.  Inserting, popping and removing entries take logarithmic
+ * time.  Each entry is identified by a handle returned from
+ * l_heap_push(), which stays valid until the entry leaves the heap and
+ * can be used to remove the entry or to restore the ordering after its
+ * key has changed.
+ *
+ * Entries that compare equal are returned in no particular order.
+ * Callers that need FIFO behaviour among equal keys should break ties
+ * with a sequence number.
+ */
+
+#define HEAP_MIN_ALLOC 8
+#define HEAP_NO_SLOT UINT_MAX
+
+struct heap_node {
+	void *data;
+	unsigned int slot;
+};
+
+struct l_heap {
+	l_heap_compare_func_t compare;
+	struct heap_node *nodes;
+	unsigned int size;
+	unsigned int alloc;
+	unsigned int *pos;	/* Node index by slot, or next free slot */
+	unsigned int n_slots;
+	unsigned int free_slot;
+};
+
+static inline void heap_set(struct l_heap *heap, unsigned int i,
+						const struct heap_node *node)
+{
+	heap->nodes[i] = *node;
+	heap->pos[node->slot] = i;
+}
+
+static unsigned int heap_sift_up(struct l_heap *heap, unsigned int i)
+{
+	struct heap_node node = heap->nodes[i];
+
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (heap->compare(node.data, heap->nodes[parent].data) >= 0)
+			break;
+
+		heap_set(heap, i, &heap->nodes[parent]);
+		i = parent;
+	}
+
+	heap_set(heap, i, &node);
+
+	return i;
+}
+
+static void heap_sift_down(struct l_heap *heap, unsigned int i)
+{
+	struct heap_node node = heap->nodes[i];
+
+	while (true) {
+		unsigned int child = 2 * i + 1;
+
+		if (child >= heap->size)
+			break;
+
+		if (child + 1 < heap->size &&
+				heap->compare(heap->nodes[child + 1].data,
+						heap->nodes[child].data) < 0)
+			child += 1;
+
+		if (heap->compare(heap->nodes[child].data, node.data) >= 0)
+			break;
+
+		heap_set(heap, i, &heap->nodes[child]);
+		i = child;
+	}
+
+	heap_set(heap, i, &node);
+}
+
+static void heap_restore(struct l_heap *heap, unsigned int i)
+{
+	if (heap_sift_up(heap, i) == i)
+		heap_sift_down(heap, i);
+}
+
+static bool heap_slot_valid(struct l_heap *heap, unsigned int slot)
+{
+	unsigned int i;
+
+	if (slot >= heap->n_slots)
+		return false;
+
+	i = heap->pos[slot];
+
+	return i < heap->size && heap->nodes[i].slot == slot;
+}
+
+static void *heap_remove_at(struct l_heap *heap, unsigned int i)
+{
+	struct heap_node *node = &heap->nodes[i];
+	void *data = node->data;
+	unsigned int slot = node->slot;
+
+	heap->size -= 1;
+
+	if (i != heap->size) {
+		heap_set(heap, i, &heap->nodes[heap->size]);
+		heap_restore(heap, i);
+	}
+
+	heap->pos[slot] = heap->free_slot;
+	heap->free_slot = slot;
+
+	return data;
+}
+
+/**
+ * l_heap_new:
+ * @compare: compare function, returning a negative value if its first
+ *           argument should be returned before the second
+ *
+ * Create a new, empty heap.
+ *
+ * Returns: a newly allocated #l_heap object, or NULL if @compare is NULL
+ **/
+LIB_EXPORT struct l_heap *l_heap_new(l_heap_compare_func_t compare)
+{
+	struct l_heap *heap;
+
+	if (unlikely(!compare))
+		return NULL;
+
+	heap = l_new(struct l_heap, 1);
+	heap->compare = compare;
+	heap->free_slot = HEAP_NO_SLOT;
+
+	return heap;
+}
+
+/**
+ * l_heap_destroy:
+ * @heap: heap object
+ * @destroy: destroy function, called for each entry
+ *
+ * Free the heap and all of its entries.
+ **/
+LIB_EXPORT void l_heap_destroy(struct l_heap *heap,
+					l_heap_destroy_func_t destroy)
+{
+	unsigned int i;
+
+	if (unlikely(!heap))
+		return;
+
+	for (i = 0; destroy && i < heap->size; i++)
+		destroy(heap->nodes[i].data);
+
+	l_free(heap->nodes);
+	l_free(heap->pos);
+	l_free(heap);
+}
+
+/**
+ * l_heap_push:
+ * @heap: heap object
+ * @data: entry to insert
+ *
+ * Insert @data into the heap.
+ *
+ * Returns: a non-zero handle for the entry, or 0 if @heap is NULL
+ **/
+LIB_EXPORT unsigned int l_heap_push(struct l_heap *heap, void *data)
+{
+	struct heap_node node;
+
+	if (unlikely(!heap))
+		return 0;
+
+	if (heap->size == heap->alloc) {
+		heap->alloc = heap->alloc ? heap->alloc * 2 : HEAP_MIN_ALLOC;
+		heap->nodes = l_realloc(heap->nodes,
+				heap->alloc * sizeof(struct heap_node));
+		heap->pos = l_realloc(heap->pos,
+				heap->alloc * sizeof(unsigned int));
+	}
+
+	/* There are never more slots than the heap has room for entries */
+	if (heap->free_slot != HEAP_NO_SLOT) {
+		node.slot = heap->free_slot;
+		heap->free_slot = heap->pos[node.slot];
+	} else
+		node.slot = heap->n_slots++;
+
+	node.data = data;
+	heap->nodes[heap->size] = node;
+	heap->pos[node.slot] = heap->size;
+	heap->size += 1;
+
+	heap_sift_up(heap, heap->size - 1);
+
+	return node.slot + 1;
+}
+
+/**
+ * l_heap_peek:
+ * @heap: heap object
+ *
+ * Returns: the first entry of the heap, or NULL if it is empty
+ **/
+LIB_EXPORT void *l_heap_peek(struct l_heap *heap)
+{
+	if (unlikely(!heap) || !heap->size)
+		return NULL;
+
+	return heap->nodes[0].data;
+}
+
+/**
+ * l_heap_pop:
+ * @heap: heap object
+ *
+ * Remove the first entry of the heap.
+ *
+ * Returns: the removed entry, or NULL if the heap is empty
+ **/
+LIB_EXPORT void *l_heap_pop(struct l_heap *heap)
+{
+	if (unlikely(!heap) || !heap->size)
+		return NULL;
+
+	return heap_remove_at(heap, 0);
+}
+
+/**
+ * l_heap_lookup:
+ * @heap: heap object
+ * @handle: handle returned by l_heap_push()
+ *
+ * Returns: the entry for @handle, or NULL if it is no longer in the heap
+ **/
+LIB_EXPORT void *l_heap_lookup(struct l_heap *heap, unsigned int handle)
+{
+	if (unlikely(!heap) || !heap_slot_valid(heap, handle - 1))
+		return NULL;
+
+	return heap->nodes[heap->pos[handle - 1]].data;
+}
+
+/**
+ * l_heap_remove:
+ * @heap: heap object
+ * @handle: handle returned by l_heap_push()
+ *
+ * Remove the entry for @handle from the heap.
+ *
+ * Returns: the removed entry, or NULL if it is no longer in the heap
+ **/
+LIB_EXPORT void *l_heap_remove(struct l_heap *heap, unsigned int handle)
+{
+	if (unlikely(!heap) || !heap_slot_valid(heap, handle - 1))
+		return NULL;
+
+	return heap_remove_at(heap, heap->pos[handle - 1]);
+}
+
+/**
+ * l_heap_update:
+ * @heap: heap object
+ * @handle: handle returned by l_heap_push()
+ *
+ * Restore the heap ordering after the key of the entry for @handle has
+ * changed, in either direction.
+ *
+ * Returns: #true on success, #false if the entry is no longer in the heap
+ **/
+LIB_EXPORT bool l_heap_update(struct l_heap *heap, unsigned int handle)
+{
+	if (unlikely(!heap) || !heap_slot_valid(heap, handle - 1))
+		return false;
+
+	heap_restore(heap, heap->pos[handle - 1]);
+
+	return true;
+}
+
+/**
+ * l_heap_foreach:
+ * @heap: heap object
+ * @function: callback function
+ * @user_data: user data given to callback function
+ *
+ * Call @function for every entry of the heap, in no particular order.
+ * The heap must not be modified from within @function.
+ **/
+LIB_EXPORT void l_heap_foreach(struct l_heap *heap,
+				l_heap_foreach_func_t function, void *user_data)
+{
+	unsigned int i;
+
+	if (unlikely(!heap || !function))
+		return;
+
+	for (i = 0; i < heap->size; i++)
+		function(heap->nodes[i].data, user_data);
+}
+
+/**
+ * l_heap_size:
+ * @heap: heap object
+ *
+ * Returns: the number of entries in the heap
+ **/
+LIB_EXPORT unsigned int l_heap_size(struct l_heap *heap)
+{
+	if (unlikely(!heap))
+		return 0;
+
+	return heap->size;
+}
+
+/**
+ * l_heap_isempty:
+ * @heap: heap object
+ *
+ * Returns: #true if the heap has no entries
+ **/
+LIB_EXPORT bool l_heap_isempty(struct l_heap *heap)
+{
+	if (unlikely(!heap))
+		return true;
+
+	return heap->size == 0;
+}
@@ -0,0 +1,59 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __ELL_HEAP_H
+#define __ELL_HEAP_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*l_heap_compare_func_t) (const void *a, const void *b);
+typedef void (*l_heap_foreach_func_t) (void *data, void *user_data);
+typedef void (*l_heap_destroy_func_t) (void *data);
+
+struct l_heap;
+
+struct l_heap *l_heap_new(l_heap_compare_func_t compare);
+void l_heap_destroy(struct l_heap *heap, l_heap_destroy_func_t destroy);
+
+unsigned int l_heap_push(struct l_heap *heap, void *data);
+void *l_heap_peek(struct l_heap *heap);
+void *l_heap_pop(struct l_heap *heap);
+
+void *l_heap_lookup(struct l_heap *heap, unsigned int handle);
+void *l_heap_remove(struct l_heap *heap, unsigned int handle);
+bool l_heap_update(struct l_heap *heap, unsigned int handle);
+
+void l_heap_foreach(struct l_heap *heap, l_heap_foreach_func_t function,
+							void *user_data);
+
+unsigned int l_heap_size(struct l_heap *heap);
+bool l_heap_isempty(struct l_heap *heap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ELL_HEAP_H */
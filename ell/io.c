@@ -257,6 +257,23 @@ LIB_EXPORT bool l_io_set_close_on_destroy(struct l_io *io, bool do_close)
 	return true;
 }
 
+/**
+ * l_io_set_priority:
+ * @io: IO object
+ * @priority: one of the #l_main_priority classes
+ *
+ * Set the class in which events on @io are dispatched by the main loop.
+ *
+ * Returns: #true on success and #false on failure
+ **/
+LIB_EXPORT bool l_io_set_priority(struct l_io *io, int priority)
+{
+	if (unlikely(!io))
+		return false;
+
+	return watch_set_priority(io->fd, priority) == 0;
+}
+
 /**
  * l_io_set_read_handler:
  * @io: IO object
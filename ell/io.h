@@ -43,6 +43,7 @@ void l_io_destroy(struct l_io *io);
 
 int l_io_get_fd(struct l_io *io);
 bool l_io_set_close_on_destroy(struct l_io *io, bool do_close);
+bool l_io_set_priority(struct l_io *io, int priority);
 
 bool l_io_set_read_handler(struct l_io *io, l_io_read_cb_t callback,
 				void *user_data, l_io_destroy_cb_t destroy);
@@ -26,6 +26,7 @@
 
 #define _GNU_SOURCE
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -36,6 +37,10 @@
 
 #include "queue.h"
 #include "log.h"
+#include "ringbuf.h"
+#include "time.h"
+#include "useful.h"
+#include "main-private.h"
 #include "private.h"
 
 struct debug_section {
@@ -68,8 +73,49 @@ static const char *log_ident = "";
 static int log_fd = -1;
 static unsigned long log_pid;
 
+/*
+ * Asynchronous mode.  Messages are formatted into log_ring and handed to
+ * log_func from an idle callback, after the main loop is done with the
+ * current batch of events.  Only the main thread logs, so the ring has a
+ * single producer and consumer and needs no locking.
+ */
+#define LOG_LINE_MAX		512
+#define LOG_RATELIMIT_SLOTS	256
+
+struct log_record {
+	int priority;
+	unsigned int len;
+	const char *file;
+	const char *line;
+	const char *func;
+};
+
+struct log_ratelimit {
+	const char *file;
+	const char *line;
+	uint64_t window_start;
+	unsigned int count;
+	unsigned int suppressed;
+};
+
+static struct l_ringbuf *log_ring;
+static int log_idle_id = -1;
+static bool log_flushing;
+static unsigned long log_dropped_overflow;
+static unsigned long log_dropped_ratelimit;
+static unsigned long log_overflow_pending;
+
+static struct log_ratelimit *log_ratelimits;
+static unsigned int log_ratelimit_burst;
+static uint64_t log_ratelimit_interval;
+
+static void log_flush(void);
+
 static inline void close_log(void)
 {
+	/* Anything still queued belongs to the outgoing handler */
+	log_flush();
+
 	if (log_fd > 0) {
 		close(log_fd);
 		log_fd = -1;
@@ -275,6 +321,268 @@ LIB_EXPORT void l_log_set_journal(void)
 	log_func = log_journal;
 }
 
+__attribute__((format(printf, 5, 6)))
+static void log_emit(int priority, const char *file, const char *line,
+			const char *func, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	log_func(priority, file, line, func, format, ap);
+	va_end(ap);
+}
+
+static void log_ring_copy(size_t offset, void *dest, size_t len)
+{
+	size_t nowrap;
+	void *src = l_ringbuf_peek(log_ring, offset, &nowrap);
+
+	if (nowrap >= len) {
+		memcpy(dest, src, len);
+		return;
+	}
+
+	memcpy(dest, src, nowrap);
+	memcpy((uint8_t *) dest + nowrap, l_ringbuf_peek(log_ring, offset + nowrap, NULL),
+							len - nowrap);
+}
+
+static void log_flush(void)
+{
+	struct log_record rec;
+	char buf[LOG_LINE_MAX];
+	char *str;
+
+	if (!log_ring || log_flushing)
+		return;
+
+	log_flushing = true;
+
+	while (l_ringbuf_len(log_ring) >= sizeof(rec)) {
+		log_ring_copy(0, &rec, sizeof(rec));
+
+		str = rec.len > sizeof(buf) ? l_malloc(rec.len) : buf;
+		log_ring_copy(sizeof(rec), str, rec.len);
+		l_ringbuf_drain(log_ring, sizeof(rec) + rec.len);
+
+		log_emit(rec.priority, rec.file, rec.line, rec.func,
+						"%.*s", (int) rec.len, str);
+
+		if (str != buf)
+			l_free(str);
+	}
+
+	if (log_overflow_pending) {
+		log_emit(L_LOG_WARNING, __FILE__, L_STRINGIFY(__LINE__),
+				__func__, "%lu log messages dropped, "
+				"buffer full\n", log_overflow_pending);
+		log_overflow_pending = 0;
+	}
+
+	log_flushing = false;
+}
+
+static void log_idle_callback(void *user_data)
+{
+	log_flush();
+	idle_remove(log_idle_id);
+}
+
+static void log_idle_destroy(void *user_data)
+{
+	log_idle_id = -1;
+	log_flush();
+}
+
+static void log_enqueue(int priority, const char *file, const char *line,
+			const char *func, const char *str, size_t len)
+{
+	struct log_record rec = {
+		.priority = priority,
+		.len = len,
+		.file = file,
+		.line = line,
+		.func = func,
+	};
+
+	if (l_ringbuf_avail(log_ring) < sizeof(rec) + len) {
+		log_dropped_overflow += 1;
+		log_overflow_pending += 1;
+		return;
+	}
+
+	l_ringbuf_append(log_ring, &rec, sizeof(rec));
+	l_ringbuf_append(log_ring, str, len);
+
+	if (log_idle_id < 0)
+		log_idle_id = idle_add(log_idle_callback, NULL,
+					IDLE_FLAG_NO_WARN_DANGLING,
+					log_idle_destroy);
+
+	/* No main loop to flush from, e.g. during startup or shutdown */
+	if (log_idle_id < 0)
+		log_flush();
+}
+
+/*
+ * Per call site rate limiting, keyed on the location strings which are
+ * unique per call site.  Colliding call sites simply take over the slot.
+ */
+static bool log_ratelimited(const char *file, const char *line)
+{
+	struct log_ratelimit *rl;
+	uint64_t now = l_time_now();
+	unsigned int slot;
+	char buf[128];
+	int len;
+
+	slot = (((uintptr_t) file >> 3) * 31 + ((uintptr_t) line >> 3)) %
+							LOG_RATELIMIT_SLOTS;
+	rl = &log_ratelimits[slot];
+
+	if (rl->file != file || rl->line != line) {
+		rl->file = file;
+		rl->line = line;
+		rl->window_start = now;
+		rl->count = 0;
+		rl->suppressed = 0;
+	} else if (l_time_diff(now, rl->window_start) >=
+						log_ratelimit_interval) {
+		if (rl->suppressed) {
+			len = snprintf(buf, sizeof(buf),
+					"%s:%s: %u messages suppressed\n",
+					file, line, rl->suppressed);
+			log_enqueue(L_LOG_WARNING, file, line, "", buf,
+					minsize(len, sizeof(buf) - 1));
+		}
+
+		rl->window_start = now;
+		rl->count = 0;
+		rl->suppressed = 0;
+	}
+
+	if (rl->count < log_ratelimit_burst) {
+		rl->count += 1;
+		return false;
+	}
+
+	rl->suppressed += 1;
+	log_dropped_ratelimit += 1;
+
+	return true;
+}
+
+__attribute__((format(printf, 5, 0)))
+static void log_async(int priority, const char *file, const char *line,
+			const char *func, const char *format, va_list ap)
+{
+	char buf[LOG_LINE_MAX];
+	char *str = buf;
+	va_list aq;
+	int len;
+
+	if (log_ratelimits && priority > L_LOG_ERR &&
+				log_ratelimited(file, line))
+		return;
+
+	va_copy(aq, ap);
+	len = vsnprintf(buf, sizeof(buf), format, aq);
+	va_end(aq);
+
+	if (len < 0)
+		return;
+
+	if ((size_t) len >= sizeof(buf)) {
+		len = vasprintf(&str, format, ap);
+		if (len < 0)
+			return;
+	}
+
+	log_enqueue(priority, file, line, func, str, len);
+
+	if (str != buf)
+		free(str);
+
+	/* Errors go out right away in case they precede a crash */
+	if (priority <= L_LOG_ERR)
+		log_flush();
+}
+
+/**
+ * l_log_set_async:
+ * @size: size of the message buffer in bytes, 0 to disable
+ *
+ * Switches logging to asynchronous mode.  Messages are formatted into a
+ * ring buffer of @size bytes and passed on to the log handler from the
+ * main loop once it is idle, so that logging does not add to the latency
+ * of event processing.  Messages that do not fit are dropped and counted.
+ * Errors are always passed on immediately.
+ *
+ * Disabling asynchronous mode flushes any pending messages.
+ *
+ * Returns: #true on success, #false if the buffer could not be created
+ **/
+LIB_EXPORT bool l_log_set_async(size_t size)
+{
+	struct l_ringbuf *ring = NULL;
+
+	if (size) {
+		ring = l_ringbuf_new(size);
+		if (!ring)
+			return false;
+	}
+
+	log_flush();
+
+	if (log_idle_id >= 0)
+		idle_remove(log_idle_id);
+
+	l_ringbuf_free(log_ring);
+	log_ring = ring;
+
+	return true;
+}
+
+/**
+ * l_log_set_ratelimit:
+ * @burst: number of messages allowed per interval, 0 to disable
+ * @interval_ms: length of the interval in milliseconds
+ *
+ * Limits each logging call site to @burst messages every @interval_ms
+ * milliseconds while in asynchronous mode.  The number of suppressed
+ * messages is logged once the interval ends.  Errors are never limited.
+ **/
+LIB_EXPORT void l_log_set_ratelimit(unsigned int burst,
+					unsigned int interval_ms)
+{
+	l_free(log_ratelimits);
+	log_ratelimits = NULL;
+
+	if (!burst || !interval_ms)
+		return;
+
+	log_ratelimits = l_new(struct log_ratelimit, LOG_RATELIMIT_SLOTS);
+	log_ratelimit_burst = burst;
+	log_ratelimit_interval = (uint64_t) interval_ms * L_USEC_PER_MSEC;
+}
+
+/**
+ * l_log_get_dropped:
+ * @overflow: return location for messages dropped due to a full buffer
+ * @ratelimited: return location for messages dropped by rate limiting
+ *
+ * Retrieves the number of messages dropped in asynchronous mode.
+ **/
+LIB_EXPORT void l_log_get_dropped(unsigned long *overflow,
+					unsigned long *ratelimited)
+{
+	if (overflow)
+		*overflow = log_dropped_overflow;
+
+	if (ratelimited)
+		*ratelimited = log_dropped_ratelimit;
+}
+
 /**
  * l_log_with_location:
  * @priority: priority level
@@ -293,7 +601,12 @@ LIB_EXPORT void l_log_with_location(int priority,
 	va_list ap;
 
 	va_start(ap, format);
-	log_func(priority, file, line, func, format, ap);
+
+	if (log_ring && log_func != log_null)
+		log_async(priority, file, line, func, format, ap);
+	else
+		log_func(priority, file, line, func, format, ap);
+
 	va_end(ap);
 }
 
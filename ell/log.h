@@ -25,6 +25,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +46,10 @@ void l_log_set_stderr(void);
 void l_log_set_syslog(void);
 void l_log_set_journal(void);
 
+bool l_log_set_async(size_t size);
+void l_log_set_ratelimit(unsigned int burst, unsigned int interval_ms);
+void l_log_get_dropped(unsigned long *overflow, unsigned long *ratelimited);
+
 void l_log_with_location(int priority, const char *file, const char *line,
 				const char *func, const char *format, ...)
 				__attribute__((format(printf, 5, 6)));
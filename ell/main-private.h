@@ -31,6 +31,7 @@ int watch_add(int fd, uint32_t events, watch_event_cb_t callback,
 int watch_modify(int fd, uint32_t events, bool force);
 int watch_remove(int fd, bool epoll_del);
 int watch_clear(int fd);
+int watch_set_priority(int fd, int priority);
 
 #define IDLE_FLAG_NO_WARN_DANGLING 0x10000000
 int idle_add(idle_event_cb_t callback, void *user_data, uint32_t flags,
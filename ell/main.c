@@ -51,7 +51,7 @@
  * Main loop handling
  */
 
-#define MAX_EPOLL_EVENTS 10
+#define MAX_EPOLL_EVENTS 32
 
 #define IDLE_FLAG_DISPATCHING	1
 #define IDLE_FLAG_DESTROYED	2
@@ -61,6 +61,15 @@
 
 #define WATCHDOG_TRIGGER_FREQ	2
 
+#define WATCH_PRIORITIES	(L_MAIN_PRIORITY_LOW + 1)
+
+/* Dispatches per iteration, anything left over waits for the next one */
+static const unsigned int watch_budget[WATCH_PRIORITIES] = {
+	[L_MAIN_PRIORITY_HIGH] = UINT_MAX,
+	[L_MAIN_PRIORITY_DEFAULT] = 16,
+	[L_MAIN_PRIORITY_LOW] = 4,
+};
+
 static int epoll_fd;
 static bool epoll_running;
 static bool epoll_terminate;
@@ -76,6 +85,7 @@ struct watch_data {
 	int fd;
 	uint32_t events;
 	uint32_t flags;
+	int priority;
 	watch_event_cb_t callback;
 	watch_destroy_cb_t destroy;
 	void *user_data;
@@ -147,6 +157,7 @@ int watch_add(int fd, uint32_t events, watch_event_cb_t callback,
 	data->fd = fd;
 	data->events = events;
 	data->flags = 0;
+	data->priority = L_MAIN_PRIORITY_DEFAULT;
 	data->callback = callback;
 	data->destroy = destroy;
 	data->user_data = user_data;
@@ -198,6 +209,29 @@ int watch_modify(int fd, uint32_t events, bool force)
 	return 0;
 }
 
+int watch_set_priority(int fd, int priority)
+{
+	struct watch_data *data;
+
+	if (unlikely(fd < 0))
+		return -EINVAL;
+
+	if (unlikely(priority < L_MAIN_PRIORITY_HIGH ||
+					priority > L_MAIN_PRIORITY_LOW))
+		return -EINVAL;
+
+	if ((unsigned int) fd > watch_entries - 1)
+		return -ERANGE;
+
+	data = watch_list[fd];
+	if (!data)
+		return -ENXIO;
+
+	data->priority = priority;
+
+	return 0;
+}
+
 int watch_clear(int fd)
 {
 	struct watch_data *data;
@@ -458,8 +492,10 @@ LIB_EXPORT int l_main_prepare(void)
 LIB_EXPORT void l_main_iterate(int timeout)
 {
 	struct epoll_event events[MAX_EPOLL_EVENTS];
+	int priorities[MAX_EPOLL_EVENTS];
 	struct watch_data *data;
 	int n, nfds;
+	int priority;
 
 	nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
 
@@ -467,16 +503,29 @@ LIB_EXPORT void l_main_iterate(int timeout)
 		data = events[n].data.ptr;
 
 		data->flags |= WATCH_FLAG_DISPATCHING;
+		priorities[n] = data->priority;
 	}
 
-	for (n = 0; n < nfds; n++) {
-		data = events[n].data.ptr;
+	/*
+	 * All watches are level triggered, so events skipped once a class
+	 * has used up its budget are reported again by the next epoll_wait
+	 */
+	for (priority = 0; priority < WATCH_PRIORITIES; priority++) {
+		unsigned int budget = watch_budget[priority];
 
-		if (data->flags & WATCH_FLAG_DESTROYED)
-			continue;
+		for (n = 0; n < nfds && budget; n++) {
+			if (priorities[n] != priority)
+				continue;
+
+			data = events[n].data.ptr;
+
+			if (data->flags & WATCH_FLAG_DESTROYED)
+				continue;
 
-		data->callback(data->fd, events[n].events,
+			data->callback(data->fd, events[n].events,
 							data->user_data);
+			budget--;
+		}
 	}
 
 	for (n = 0; n < nfds; n++) {
@@ -30,6 +30,18 @@
 extern "C" {
 #endif
 
+/*
+ * Within one main loop iteration ready watches are dispatched in priority
+ * order, and each class below the highest one only gets a limited number
+ * of dispatches per iteration, the rest is picked up by the next one.
+ * Idle callbacks always run last.
+ */
+enum l_main_priority {
+	L_MAIN_PRIORITY_HIGH = 0,
+	L_MAIN_PRIORITY_DEFAULT,
+	L_MAIN_PRIORITY_LOW,
+};
+
 bool l_main_init(void);
 int l_main_prepare(void);
 void l_main_iterate(int timeout);
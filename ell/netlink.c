@@ -26,6 +26,7 @@
 
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <linux/netlink.h>
 
 #include "useful.h"
@@ -95,17 +96,51 @@ static void destroy_notify_group(void *data)
 	l_hashmap_destroy(notify_list, destroy_notify);
 }
 
+/*
+ * Everything queued by the time the socket becomes writable goes out in a
+ * single datagram.  The kernel walks the messages in order and answers each
+ * one separately, so callers still get one reply per command but a burst of
+ * related requests (an address followed by its routes, say) only costs one
+ * system call and one trip through the netlink layer.  A dump ends a batch
+ * since the kernel only runs one dump per socket at a time.
+ */
+#define MAX_BATCH 32
+
 static bool can_write_data(struct l_io *io, void *user_data)
 {
 	struct l_netlink *netlink = user_data;
-	struct command *command;
+	struct command *batch[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
 	struct sockaddr_nl addr;
-	const void *data;
+	struct msghdr msg;
+	unsigned int count = 0;
+	unsigned int i;
+	size_t total = 0;
 	ssize_t written;
 	int sk;
 
-	command = l_queue_pop_head(netlink->command_queue);
-	if (!command)
+	while (count < MAX_BATCH) {
+		struct command *command =
+				l_queue_pop_head(netlink->command_queue);
+		const struct nlmsghdr *nlmsg;
+
+		if (!command)
+			break;
+
+		nlmsg = ((void *) command) +
+					NLMSG_ALIGN(sizeof(struct command));
+
+		batch[count] = command;
+		iov[count].iov_base = (void *) nlmsg;
+		iov[count].iov_len = command->len;
+		total += command->len;
+		count++;
+
+		if ((nlmsg->nlmsg_flags & NLM_F_DUMP) == NLM_F_DUMP)
+			break;
+	}
+
+	if (!count)
 		return false;
 
 	sk = l_io_get_fd(io);
@@ -114,22 +149,30 @@ static bool can_write_data(struct l_io *io, void *user_data)
 	addr.nl_family = AF_NETLINK;
 	addr.nl_pid = 0;
 
-	data = ((void *) command) + NLMSG_ALIGN(sizeof(struct command));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
 
-	written = sendto(sk, data, command->len, 0,
-				(struct sockaddr *) &addr, sizeof(addr));
-	if (written < 0 || (uint32_t) written != command->len) {
-		l_hashmap_remove(netlink->command_lookup,
-					L_UINT_TO_PTR(command->id));
-		destroy_command(command);
-		return true;
-	}
+	written = sendmsg(sk, &msg, 0);
+
+	for (i = 0; i < count; i++) {
+		struct command *command = batch[i];
+
+		if (written < 0 || (size_t) written != total) {
+			l_hashmap_remove(netlink->command_lookup,
+						L_UINT_TO_PTR(command->id));
+			destroy_command(command);
+			continue;
+		}
 
-	l_util_hexdump(false, data, command->len,
+		l_util_hexdump(false, iov[i].iov_base, command->len,
 				netlink->debug_handler, netlink->debug_data);
 
-	l_hashmap_insert(netlink->command_pending,
-				L_UINT_TO_PTR(command->seq), command);
+		l_hashmap_insert(netlink->command_pending,
+					L_UINT_TO_PTR(command->seq), command);
+	}
 
 	return l_queue_length(netlink->command_queue) > 0;
 }
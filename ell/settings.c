@@ -52,38 +52,62 @@
 #include "missing.h"
 #include "pem-private.h"
 
+/*
+ * Loaded data is copied once into a buffer owned by the l_settings object
+ * and the group names, keys and values parsed from it, including embedded
+ * groups, are slices of that buffer terminated in place.  Only strings set
+ * through the API are allocated individually, the owned flags tell which
+ * is which.  Values are kept escaped and only unescaped on access by the
+ * getters.
+ */
 struct setting_data {
 	char *key;
 	char *value;
+	bool key_owned : 1;
+	bool value_owned : 1;
 };
 
 struct embedded_group_data {
 	char *name;
 	char type[32];
 	size_t len;
-	char data[0];
+	char *data;
 };
 
 struct group_data {
 	char *name;
+	bool name_owned;
 	struct l_queue *settings;
 };
 
+struct settings_buffer {
+	size_t len;
+	char data[];
+};
+
 struct l_settings {
 	l_settings_debug_cb_t debug_handler;
 	l_settings_destroy_cb_t debug_destroy;
 	void *debug_data;
 	struct l_queue *groups;
 	struct l_queue *embedded_groups;
+	struct l_queue *buffers;
+	char **terminators;		/* Only used while loading */
+	size_t n_terminators;
 };
 
 static void setting_destroy(void *data)
 {
 	struct setting_data *pair = data;
 
-	l_free(pair->key);
+	if (pair->key_owned)
+		l_free(pair->key);
+
 	explicit_bzero(pair->value, strlen(pair->value));
-	l_free(pair->value);
+
+	if (pair->value_owned)
+		l_free(pair->value);
+
 	l_free(pair);
 }
 
@@ -91,7 +115,9 @@ static void group_destroy(void *data)
 {
 	struct group_data *group = data;
 
-	l_free(group->name);
+	if (group->name_owned)
+		l_free(group->name);
+
 	l_queue_destroy(group->settings, setting_destroy);
 
 	l_free(group);
@@ -99,10 +125,31 @@ static void group_destroy(void *data)
 
 static void embedded_group_destroy(void *data)
 {
-	struct embedded_group_data *group = data;
+	l_free(data);
+}
+
+static void buffer_destroy(void *data)
+{
+	struct settings_buffer *buf = data;
 
-	l_free(group->name);
-	l_free(group);
+	explicit_bzero(buf->data, buf->len);
+	l_free(buf);
+}
+
+/*
+ * Slices can't be terminated while the buffer is still being parsed since
+ * the terminating character, usually a newline, is still needed.  Record
+ * the position and terminate once parsing is done.
+ */
+static void terminate_later(struct l_settings *settings, char *pos)
+{
+	/* Grow to the next power of two when full */
+	if (!(settings->n_terminators & (settings->n_terminators + 1)))
+		settings->terminators = l_realloc(settings->terminators,
+					(settings->n_terminators + 1) * 2 *
+					sizeof(char *));
+
+	settings->terminators[settings->n_terminators++] = pos;
 }
 
 LIB_EXPORT struct l_settings *l_settings_new(void)
@@ -112,6 +159,7 @@ LIB_EXPORT struct l_settings *l_settings_new(void)
 	settings = l_new(struct l_settings, 1);
 	settings->groups = l_queue_new();
 	settings->embedded_groups = l_queue_new();
+	settings->buffers = l_queue_new();
 
 	return settings;
 }
@@ -126,6 +174,7 @@ LIB_EXPORT void l_settings_free(struct l_settings *settings)
 
 	l_queue_destroy(settings->groups, group_destroy);
 	l_queue_destroy(settings->embedded_groups, embedded_group_destroy);
+	l_queue_destroy(settings->buffers, buffer_destroy);
 
 	l_free(settings);
 }
@@ -298,16 +347,16 @@ static const struct group_extension *find_group_extension(const char *type,
 }
 
 static ssize_t parse_embedded_group(struct l_settings *setting,
-					const char *data,
+					char *data,
 					size_t line_len, size_t len,
 					size_t line)
 {
 	struct embedded_group_data *group;
 	const struct group_extension *ext;
-	const char *ptr;
+	char *ptr;
 	const char *type;
 	size_t type_len;
-	const char *name;
+	char *name;
 	size_t name_len;
 	ssize_t bytes;
 
@@ -355,16 +404,17 @@ static ssize_t parse_embedded_group(struct l_settings *setting,
 		return -EINVAL;
 	}
 
-	group = l_malloc(sizeof(struct embedded_group_data) + bytes + 1);
+	group = l_new(struct embedded_group_data, 1);
 
-	group->name = l_strndup(name, name_len);
+	group->name = name;
+	terminate_later(setting, name + name_len);
 
 	memcpy(group->type, type, type_len);
 	group->type[type_len] = '\0';
 
 	group->len = bytes;
-	memcpy(group->data, ptr + 2, bytes);
-	group->data[bytes] = '\0';
+	group->data = ptr + 2;
+	terminate_later(setting, ptr + 2 + bytes);
 
 	l_queue_push_tail(setting->embedded_groups, group);
 
@@ -377,7 +427,7 @@ invalid_group:
 	return -EINVAL;
 }
 
-static bool parse_group(struct l_settings *settings, const char *data,
+static bool parse_group(struct l_settings *settings, char *data,
 			size_t len, size_t line)
 {
 	size_t i = 1;
@@ -414,8 +464,9 @@ static bool parse_group(struct l_settings *settings, const char *data,
 	}
 
 	group = l_new(struct group_data, 1);
-	group->name = l_strndup(data + 1, end - 1);
+	group->name = data + 1;
 	group->settings = l_queue_new();
+	terminate_later(settings, data + end);
 
 	l_queue_push_tail(settings->groups, group);
 
@@ -433,7 +484,7 @@ static bool validate_key_character(char c)
 	return false;
 }
 
-static unsigned int parse_key(struct l_settings *settings, const char *data,
+static unsigned int parse_key(struct l_settings *settings, char *data,
 				size_t len, size_t line)
 {
 	unsigned int i;
@@ -469,16 +520,16 @@ static unsigned int parse_key(struct l_settings *settings, const char *data,
 
 	group = l_queue_peek_tail(settings->groups);
 	pair = l_new(struct setting_data, 1);
-	pair->key = l_strndup(data, end);
+	pair->key = data;
+	terminate_later(settings, data + end);
 	l_queue_push_head(group->settings, pair);
 
 	return end;
 }
 
-static bool parse_value(struct l_settings *settings, const char *data,
+static bool parse_value(struct l_settings *settings, char *data,
 			size_t len, size_t line)
 {
-	unsigned int end = len;
 	struct group_data *group;
 	struct setting_data *pair;
 
@@ -489,22 +540,22 @@ static bool parse_value(struct l_settings *settings, const char *data,
 		l_util_debug(settings->debug_handler, settings->debug_data,
 				"Invalid UTF8 in value on line: %zd", line);
 
-		l_free(pair->key);
 		l_free(pair);
 
 		return false;
 	}
 
-	pair->value = l_strndup(data, end);
+	pair->value = data;
+	terminate_later(settings, data + len);
 	l_queue_push_tail(group->settings, pair);
 
 	return true;
 }
 
-static bool parse_keyvalue(struct l_settings *settings, const char *data,
+static bool parse_keyvalue(struct l_settings *settings, char *data,
 				size_t len, size_t line)
 {
-	const char *equal = memchr(data, '=', len);
+	char *equal = memchr(data, '=', len);
 
 	if (!equal) {
 		l_util_debug(settings->debug_handler, settings->debug_data,
@@ -528,8 +579,7 @@ static bool parse_keyvalue(struct l_settings *settings, const char *data,
 	return parse_value(settings, equal, len - (equal - data), line);
 }
 
-LIB_EXPORT bool l_settings_load_from_data(struct l_settings *settings,
-						const char *data, size_t len)
+static bool parse_data(struct l_settings *settings, char *data, size_t len)
 {
 	size_t pos = 0;
 	bool r = true;
@@ -538,9 +588,6 @@ LIB_EXPORT bool l_settings_load_from_data(struct l_settings *settings,
 	size_t line = 1;
 	size_t line_len;
 
-	if (unlikely(!settings || !data || !len))
-		return false;
-
 	while (pos < len && r) {
 		if (l_ascii_isblank(data[pos])) {
 			pos += 1;
@@ -591,6 +638,38 @@ LIB_EXPORT bool l_settings_load_from_data(struct l_settings *settings,
 	return r;
 }
 
+LIB_EXPORT bool l_settings_load_from_data(struct l_settings *settings,
+						const char *data, size_t len)
+{
+	struct settings_buffer *buf;
+	size_t i;
+	bool r;
+
+	if (unlikely(!settings || !data || !len))
+		return false;
+
+	buf = l_malloc(sizeof(struct settings_buffer) + len + 1);
+	buf->len = len + 1;
+	memcpy(buf->data, data, len);
+	buf->data[len] = '\0';
+	l_queue_push_tail(settings->buffers, buf);
+
+	r = parse_data(settings, buf->data, len);
+
+	/*
+	 * Whatever has been parsed stays in the object even on failure, so
+	 * terminate it either way
+	 */
+	for (i = 0; i < settings->n_terminators; i++)
+		*settings->terminators[i] = '\0';
+
+	l_free(settings->terminators);
+	settings->terminators = NULL;
+	settings->n_terminators = 0;
+
+	return r;
+}
+
 LIB_EXPORT char *l_settings_to_data(const struct l_settings *settings,
 								size_t *len)
 {
@@ -928,6 +1007,7 @@ static bool set_value(struct l_settings *settings, const char *group_name,
 	if (!group) {
 		group = l_new(struct group_data, 1);
 		group->name = l_strdup(group_name);
+		group->name_owned = true;
 		group->settings = l_queue_new();
 
 		l_queue_push_tail(settings->groups, group);
@@ -939,15 +1019,21 @@ static bool set_value(struct l_settings *settings, const char *group_name,
 add_pair:
 		pair = l_new(struct setting_data, 1);
 		pair->key = l_strdup(key);
+		pair->key_owned = true;
 		pair->value = value;
+		pair->value_owned = true;
 		l_queue_push_tail(group->settings, pair);
 
 		return true;
 	}
 
 	explicit_bzero(pair->value, strlen(pair->value));
-	l_free(pair->value);
+
+	if (pair->value_owned)
+		l_free(pair->value);
+
 	pair->value = value;
+	pair->value_owned = true;
 
 	return true;
 
@@ -33,6 +33,8 @@
 #include <sys/timerfd.h>
 #include <time.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "useful.h"
 #include "timeout.h"
@@ -46,74 +48,440 @@
  * Timeout support
  */
 
+/*
+ * All timeouts share a single timerfd.  They are kept in a hierarchical
+ * timer wheel with a resolution of one millisecond: level 0 has a slot
+ * for each of the next 256 ticks and each of the four levels above it
+ * covers 64 times the span of the one below, which reaches about 49 days.
+ * Timeouts further out than that are parked in the last level and placed
+ * again whenever their slot comes up.  A slot on a higher level is
+ * cascaded into the lower levels when its span starts.
+ *
+ * The timerfd is only programmed when a timeout is armed before the
+ * currently programmed expiry, or after the expired timeouts have been
+ * dispatched, so arming, modifying and removing a timeout normally cost
+ * no system calls.  A removed timeout may leave the timerfd programmed,
+ * which results in at most one spurious wakeup.
+ */
+
+#define WHEEL_LVL0_BITS		8
+#define WHEEL_LVL0_SIZE		(1U << WHEEL_LVL0_BITS)
+#define WHEEL_LVLN_BITS		6
+#define WHEEL_LVLN_SIZE		(1U << WHEEL_LVLN_BITS)
+#define WHEEL_LEVELS		5
+#define WHEEL_SLOTS		(WHEEL_LVL0_SIZE + \
+					(WHEEL_LEVELS - 1) * WHEEL_LVLN_SIZE)
+#define WHEEL_MAX_TICKS		((1ULL << (WHEEL_LVL0_BITS + \
+				(WHEEL_LEVELS - 1) * WHEEL_LVLN_BITS)) - 1)
+
+#define WHEEL_LVL_SHIFT(lvl)	((lvl) ? WHEEL_LVL0_BITS + \
+					((lvl) - 1) * WHEEL_LVLN_BITS : 0)
+#define WHEEL_LVL_OFFSET(lvl)	((lvl) ? WHEEL_LVL0_SIZE + \
+					((lvl) - 1) * WHEEL_LVLN_SIZE : 0)
+
+struct timeout_link {
+	struct timeout_link *next;
+	struct timeout_link *prev;
+};
+
+enum timeout_state {
+	TIMEOUT_IDLE,
+	TIMEOUT_PENDING,
+	TIMEOUT_EXPIRED,
+	TIMEOUT_DETACHED,
+};
+
 /**
  * l_timeout:
  *
  * Opague object representing the timeout.
  */
 struct l_timeout {
-	int fd;
+	struct timeout_link link;
+	uint64_t expires;
+	unsigned long slack;
+	uint16_t slot;
+	enum timeout_state state;
 	l_timeout_notify_cb_t callback;
 	l_timeout_destroy_cb_t destroy;
 	void *user_data;
 };
 
-static void timeout_destroy(void *user_data)
+static struct {
+	int fd;
+	bool dispatching;
+	unsigned int pending;
+	uint64_t base;
+	uint64_t programmed;
+	uint64_t map[WHEEL_SLOTS / 64];
+	struct timeout_link slots[WHEEL_SLOTS];
+	struct timeout_link idle;
+} wheel = { .fd = -1 };
+
+static inline void link_init(struct timeout_link *head)
 {
-	struct l_timeout *timeout = user_data;
+	head->next = head;
+	head->prev = head;
+}
 
-	close(timeout->fd);
-	timeout->fd = -1;
+static inline bool link_empty(const struct timeout_link *head)
+{
+	return head->next == head;
+}
 
-	if (timeout->destroy)
-		timeout->destroy(timeout->user_data);
+static inline void link_add_tail(struct timeout_link *head,
+					struct timeout_link *link)
+{
+	link->prev = head->prev;
+	link->next = head;
+	head->prev->next = link;
+	head->prev = link;
 }
 
-static void timeout_callback(int fd, uint32_t events, void *user_data)
+static inline void link_del(struct timeout_link *link)
 {
-	struct l_timeout *timeout = user_data;
-	uint64_t expired;
-	ssize_t result;
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link_init(link);
+}
 
-	result = read(timeout->fd, &expired, sizeof(expired));
-	if (result != sizeof(expired))
+static inline void link_splice(struct timeout_link *from,
+					struct timeout_link *to)
+{
+	if (link_empty(from))
 		return;
 
-	if (timeout->callback)
-		timeout->callback(timeout, timeout->user_data);
+	from->next->prev = to->prev;
+	to->prev->next = from->next;
+	from->prev->next = to;
+	to->prev = from->prev;
+	link_init(from);
 }
 
-static inline int timeout_set(int fd, unsigned int seconds, long nanoseconds)
+static uint64_t wheel_now(bool round_up)
+{
+	struct timespec ts;
+	uint64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	ms = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	if (round_up && ts.tv_nsec % 1000000)
+		ms += 1;
+
+	return ms;
+}
+
+static int wheel_program(uint64_t tick)
 {
 	struct itimerspec itimer;
 
 	memset(&itimer, 0, sizeof(itimer));
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_nsec = 0;
-	itimer.it_value.tv_sec = seconds;
-	itimer.it_value.tv_nsec = nanoseconds;
+	itimer.it_value.tv_sec = tick / 1000;
+	itimer.it_value.tv_nsec = (tick % 1000) * 1000000L;
+
+	/* An all-zero value would disarm the timer */
+	if (!tick)
+		itimer.it_value.tv_nsec = 1;
+
+	if (timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &itimer, NULL) < 0)
+		return -errno;
+
+	wheel.programmed = tick;
+	return 0;
+}
 
-	return timerfd_settime(fd, 0, &itimer, NULL);
+/*
+ * Find the first occupied slot of a level at or after index @start,
+ * wrapping around.  Returns the distance from @start or -1 if the level
+ * is empty.
+ */
+static int wheel_find_slot(unsigned int lvl, unsigned int start)
+{
+	unsigned int size = lvl ? WHEEL_LVLN_SIZE : WHEEL_LVL0_SIZE;
+	const uint64_t *map = wheel.map + WHEEL_LVL_OFFSET(lvl) / 64;
+	unsigned int words = size / 64;
+	unsigned int i;
+
+	for (i = 0; i <= words; i++) {
+		unsigned int word = (start / 64 + i) % words;
+		uint64_t bits = map[word];
+
+		if (i == 0)
+			bits &= ~0ULL << (start % 64);
+		else if (i == words)
+			bits &= (1ULL << (start % 64)) - 1;
+
+		if (bits)
+			return (word * 64 + __builtin_ctzll(bits) +
+						size - start) % size;
+	}
+
+	return -1;
 }
 
-static bool convert_ms(unsigned long milliseconds, unsigned int *seconds,
-			long *nanoseconds)
+/*
+ * The tick at which the wheel next has work to do: either a level 0 slot
+ * expiring or a higher level slot that needs to be cascaded.
+ */
+static uint64_t wheel_next_tick(void)
 {
-	unsigned long big_seconds = milliseconds / 1000;
+	uint64_t next = UINT64_MAX;
+	unsigned int lvl;
+	int dist;
+
+	if (!wheel.pending)
+		return next;
+
+	dist = wheel_find_slot(0, wheel.base % WHEEL_LVL0_SIZE);
+	if (dist >= 0)
+		next = wheel.base + dist;
+
+	for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+		unsigned int shift = WHEEL_LVL_SHIFT(lvl);
+		uint64_t span = 1ULL << shift;
+		uint64_t first = (wheel.base + span - 1) >> shift;
+		uint64_t tick;
+
+		dist = wheel_find_slot(lvl, first % WHEEL_LVLN_SIZE);
+		if (dist < 0)
+			continue;
+
+		tick = (first + dist) << shift;
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+static uint64_t wheel_insert(struct l_timeout *timeout)
+{
+	uint64_t expires = timeout->expires;
+	uint64_t delta;
+	unsigned int lvl;
+	unsigned int shift;
+
+	if (expires < wheel.base)
+		expires = wheel.base;
+
+	delta = expires - wheel.base;
+
+	if (delta > WHEEL_MAX_TICKS) {
+		expires = wheel.base + WHEEL_MAX_TICKS;
+		delta = WHEEL_MAX_TICKS;
+	}
+
+	for (lvl = 0; lvl < WHEEL_LEVELS - 1; lvl++)
+		if (delta < 1ULL << WHEEL_LVL_SHIFT(lvl + 1))
+			break;
+
+	shift = WHEEL_LVL_SHIFT(lvl);
+	timeout->slot = WHEEL_LVL_OFFSET(lvl) + ((expires >> shift) %
+				(lvl ? WHEEL_LVLN_SIZE : WHEEL_LVL0_SIZE));
+	timeout->state = TIMEOUT_PENDING;
+
+	link_add_tail(&wheel.slots[timeout->slot], &timeout->link);
+	wheel.map[timeout->slot / 64] |= 1ULL << (timeout->slot % 64);
+	wheel.pending += 1;
+
+	return (expires >> shift) << shift;
+}
+
+static void wheel_unlink(struct l_timeout *timeout)
+{
+	link_del(&timeout->link);
+
+	if (timeout->state != TIMEOUT_PENDING)
+		return;
+
+	if (link_empty(&wheel.slots[timeout->slot]))
+		wheel.map[timeout->slot / 64] &=
+					~(1ULL << (timeout->slot % 64));
+
+	wheel.pending -= 1;
+}
+
+static void wheel_take_slot(unsigned int slot, struct timeout_link *to)
+{
+	struct timeout_link *link;
+
+	for (link = wheel.slots[slot].next; link != &wheel.slots[slot];
+							link = link->next)
+		wheel.pending -= 1;
+
+	link_splice(&wheel.slots[slot], to);
+	wheel.map[slot / 64] &= ~(1ULL << (slot % 64));
+}
+
+/* Process the tick at wheel.base, moving its expired timeouts to @expired */
+static void wheel_run_tick(struct timeout_link *expired)
+{
+	uint64_t tick = wheel.base;
+	unsigned int lvl;
+
+	for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+		unsigned int shift = WHEEL_LVL_SHIFT(lvl);
+		struct timeout_link cascade;
+
+		if (tick & ((1ULL << shift) - 1))
+			break;
+
+		link_init(&cascade);
+		wheel_take_slot(WHEEL_LVL_OFFSET(lvl) +
+				(tick >> shift) % WHEEL_LVLN_SIZE, &cascade);
+
+		while (!link_empty(&cascade)) {
+			struct l_timeout *timeout = l_container_of(cascade.next,
+						struct l_timeout, link);
+
+			link_del(&timeout->link);
+			wheel_insert(timeout);
+		}
+	}
+
+	wheel_take_slot(tick % WHEEL_LVL0_SIZE, expired);
+	wheel.base = tick + 1;
+}
 
-	if (big_seconds > UINT_MAX)
+static void wheel_callback(int fd, uint32_t events, void *user_data)
+{
+	struct timeout_link expired;
+	uint64_t expirations;
+	uint64_t now;
+	uint64_t next;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 &&
+							errno != EAGAIN)
+		return;
+
+	link_init(&expired);
+	now = wheel_now(false);
+	wheel.programmed = UINT64_MAX;
+
+	while ((next = wheel_next_tick()) <= now) {
+		wheel.base = next;
+		wheel_run_tick(&expired);
+	}
+
+	/* Nothing is due up to now, so the empty ticks can be skipped */
+	if (wheel.base <= now)
+		wheel.base = now + 1;
+
+	wheel.dispatching = true;
+
+	while (!link_empty(&expired)) {
+		struct l_timeout *timeout = l_container_of(expired.next,
+						struct l_timeout, link);
+
+		link_del(&timeout->link);
+		link_add_tail(&wheel.idle, &timeout->link);
+		timeout->state = TIMEOUT_IDLE;
+
+		if (timeout->callback)
+			timeout->callback(timeout, timeout->user_data);
+	}
+
+	wheel.dispatching = false;
+
+	next = wheel_next_tick();
+	if (next != UINT64_MAX)
+		wheel_program(next);
+}
+
+static void wheel_destroy(void *user_data)
+{
+	unsigned int i;
+
+	close(wheel.fd);
+	wheel.fd = -1;
+	wheel.pending = 0;
+	memset(wheel.map, 0, sizeof(wheel.map));
+
+	for (i = 0; i <= WHEEL_SLOTS; i++) {
+		struct timeout_link *head = i < WHEEL_SLOTS ?
+						&wheel.slots[i] : &wheel.idle;
+
+		while (!link_empty(head)) {
+			struct l_timeout *timeout = l_container_of(head->next,
+						struct l_timeout, link);
+
+			link_del(&timeout->link);
+			timeout->state = TIMEOUT_DETACHED;
+
+			if (timeout->destroy)
+				timeout->destroy(timeout->user_data);
+		}
+	}
+}
+
+static bool wheel_setup(void)
+{
+	unsigned int i;
+	int fd;
+
+	if (wheel.fd >= 0)
+		return true;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
 		return false;
 
-	*seconds = big_seconds;
-	*nanoseconds = (milliseconds % 1000) * 1000000L;
+	if (watch_add(fd, EPOLLIN, wheel_callback, NULL, wheel_destroy) < 0) {
+		close(fd);
+		return false;
+	}
+
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		link_init(&wheel.slots[i]);
+
+	link_init(&wheel.idle);
+
+	wheel.fd = fd;
+	wheel.base = wheel_now(false);
+	wheel.programmed = UINT64_MAX;
 
 	return true;
 }
 
+static void timeout_arm(struct l_timeout *timeout, uint64_t milliseconds)
+{
+	uint64_t now = wheel_now(true);
+	uint64_t tick;
+
+	wheel_unlink(timeout);
+
+	/*
+	 * Let the wheel catch up with the clock if it has had nothing to
+	 * do for a while, so that the new timeout lands on a low level.
+	 */
+	if (wheel.base < now && !wheel.dispatching) {
+		tick = wheel_next_tick();
+		wheel.base = tick < now ? tick : now;
+	}
+
+	timeout->expires = now + milliseconds;
+
+	if (timeout->slack > 1)
+		timeout->expires += timeout->slack - 1 -
+				(timeout->expires + timeout->slack - 1) %
+				timeout->slack;
+
+	tick = wheel_insert(timeout);
+
+	if (!wheel.dispatching && tick < wheel.programmed)
+		wheel_program(tick);
+}
+
+static bool convert_ms(unsigned long milliseconds)
+{
+	return milliseconds / 1000 <= UINT_MAX;
+}
+
 /**
- * timeout_create_with_nanoseconds:
- * @seconds: number of seconds
- * @nanoseconds: number of nanoseconds
+ * timeout_create_with_milliseconds:
+ * @milliseconds: number of milliseconds
  * @callback: timeout callback function
  * @user_data: user data provided to timeout callback function
  * @destroy: destroy function for user data
@@ -126,44 +494,30 @@ static bool convert_ms(unsigned long milliseconds, unsigned int *seconds,
  * Returns: a newly allocated #l_timeout object. On failure, the function
  * returns NULL.
  **/
-static struct l_timeout *timeout_create_with_nanoseconds(unsigned int seconds,
-			long nanoseconds, l_timeout_notify_cb_t callback,
+static struct l_timeout *timeout_create_with_milliseconds(
+			uint64_t milliseconds, l_timeout_notify_cb_t callback,
 			void *user_data, l_timeout_destroy_cb_t destroy)
 {
 	struct l_timeout *timeout;
-	int err;
 
 	if (unlikely(!callback))
 		return NULL;
 
+	if (!wheel_setup())
+		return NULL;
+
 	timeout = l_new(struct l_timeout, 1);
 
 	timeout->callback = callback;
 	timeout->destroy = destroy;
 	timeout->user_data = user_data;
 
-	timeout->fd = timerfd_create(CLOCK_MONOTONIC,
-					TFD_NONBLOCK | TFD_CLOEXEC);
-	if (timeout->fd < 0) {
-		l_free(timeout);
-		return NULL;
-	}
-
-	if (seconds > 0 || nanoseconds > 0) {
-		if (timeout_set(timeout->fd, seconds, nanoseconds) < 0) {
-			close(timeout->fd);
-			l_free(timeout);
-			return NULL;
-		}
-	}
-
-	err = watch_add(timeout->fd, EPOLLIN | EPOLLONESHOT, timeout_callback,
-			timeout, timeout_destroy);
+	link_init(&timeout->link);
+	link_add_tail(&wheel.idle, &timeout->link);
+	timeout->state = TIMEOUT_IDLE;
 
-	if (err < 0) {
-		l_free(timeout);
-		return NULL;
-	}
+	if (milliseconds > 0)
+		timeout_arm(timeout, milliseconds);
 
 	return timeout;
 }
@@ -187,8 +541,8 @@ LIB_EXPORT struct l_timeout *l_timeout_create(unsigned int seconds,
 			l_timeout_notify_cb_t callback,
 			void *user_data, l_timeout_destroy_cb_t destroy)
 {
-	return timeout_create_with_nanoseconds(seconds, 0, callback,
-							user_data, destroy);
+	return timeout_create_with_milliseconds((uint64_t) seconds * 1000,
+					callback, user_data, destroy);
 }
 
 /**
@@ -210,13 +564,10 @@ LIB_EXPORT struct l_timeout *l_timeout_create_ms(unsigned long milliseconds,
 			l_timeout_notify_cb_t callback,
 			void *user_data, l_timeout_destroy_cb_t destroy)
 {
-	unsigned int seconds;
-	long nanoseconds;
-
-	if (!convert_ms(milliseconds, &seconds, &nanoseconds))
+	if (!convert_ms(milliseconds))
 		return NULL;
 
-	return timeout_create_with_nanoseconds(seconds, nanoseconds, callback,
+	return timeout_create_with_milliseconds(milliseconds, callback,
 						user_data, destroy);
 }
 
@@ -233,15 +584,11 @@ LIB_EXPORT void l_timeout_modify(struct l_timeout *timeout,
 	if (unlikely(!timeout))
 		return;
 
-	if (unlikely(timeout->fd < 0))
+	if (unlikely(timeout->state == TIMEOUT_DETACHED))
 		return;
 
-	if (seconds > 0) {
-		if (timeout_set(timeout->fd, seconds, 0) < 0)
-			return;
-	}
-
-	watch_modify(timeout->fd, EPOLLIN | EPOLLONESHOT, true);
+	if (seconds > 0)
+		timeout_arm(timeout, (uint64_t) seconds * 1000);
 }
 
 /**
@@ -257,19 +604,31 @@ LIB_EXPORT void l_timeout_modify_ms(struct l_timeout *timeout,
 	if (unlikely(!timeout))
 		return;
 
-	if (unlikely(timeout->fd < 0))
+	if (unlikely(timeout->state == TIMEOUT_DETACHED))
 		return;
 
-	if (milliseconds > 0) {
-		unsigned int sec;
-		long nanosec;
+	if (milliseconds > 0 && convert_ms(milliseconds))
+		timeout_arm(timeout, milliseconds);
+}
 
-		if (!convert_ms(milliseconds, &sec, &nanosec) ||
-			timeout_set(timeout->fd, sec, nanosec) < 0)
-			return;
-	}
+/**
+ * l_timeout_set_slack:
+ * @timeout: timeout object
+ * @milliseconds: allowed delay in milliseconds
+ *
+ * Allow @timeout to fire up to @milliseconds late, from the next time it is
+ * armed on.  Expiry times are rounded up to a multiple of the slack, so
+ * timeouts with the same slack that are due at about the same time are
+ * dispatched together.  Useful for housekeeping timers that do not need
+ * to be precise.
+ **/
+LIB_EXPORT void l_timeout_set_slack(struct l_timeout *timeout,
+					unsigned long milliseconds)
+{
+	if (unlikely(!timeout))
+		return;
 
-	watch_modify(timeout->fd, EPOLLIN | EPOLLONESHOT, true);
+	timeout->slack = milliseconds;
 }
 
 /**
@@ -283,7 +642,12 @@ LIB_EXPORT void l_timeout_remove(struct l_timeout *timeout)
 	if (unlikely(!timeout))
 		return;
 
-	watch_remove(timeout->fd, false);
+	if (timeout->state != TIMEOUT_DETACHED) {
+		wheel_unlink(timeout);
+
+		if (timeout->destroy)
+			timeout->destroy(timeout->user_data);
+	}
 
 	l_free(timeout);
 }
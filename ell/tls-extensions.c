@@ -841,6 +841,44 @@ static bool tls_signature_algorithms_client_absent(struct l_tls *tls)
 	return true;
 }
 
+/* RFC 5077, Section 3.2 */
+static ssize_t tls_session_ticket_client_write(struct l_tls *tls,
+						uint8_t *buf, size_t len)
+{
+	if (!tls->session_settings)
+		return -ENOMSG;
+
+	if (len < tls->session_ticket_len)
+		return -ENOSPC;
+
+	if (tls->session_ticket_len)
+		memcpy(buf, tls->session_ticket, tls->session_ticket_len);
+
+	return tls->session_ticket_len;
+}
+
+static bool tls_session_ticket_client_handle(struct l_tls *tls,
+						const uint8_t *buf, size_t len)
+{
+	/* We don't issue tickets, ignore */
+	return true;
+}
+
+static bool tls_session_ticket_server_handle(struct l_tls *tls,
+						const uint8_t *buf, size_t len)
+{
+	/*
+	 * "The server uses a zero-length SessionTicket extension to
+	 * indicate to the client that it will send a new session ticket
+	 * using the NewSessionTicket handshake message"
+	 */
+	if (len)
+		return false;
+
+	tls->session_ticket_expected = true;
+	return true;
+}
+
 const struct tls_hello_extension tls_extensions[] = {
 	{
 		"Supported Groups", "elliptic_curves", 10,
@@ -864,6 +902,15 @@ const struct tls_hello_extension tls_extensions[] = {
 		tls_signature_algorithms_client_absent,
 		NULL, NULL, NULL,
 	},
+	{
+		"Session Ticket", "session_ticket", 35,
+		tls_session_ticket_client_write,
+		tls_session_ticket_client_handle,
+		NULL,
+		NULL,
+		tls_session_ticket_server_handle,
+		NULL,
+	},
 	{}
 };
 
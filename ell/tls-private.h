@@ -23,6 +23,9 @@
 #define TLS_MAX_VERSION	L_TLS_V12
 #define TLS_MIN_VERSION	L_TLS_V10
 
+/* Longer RFC 5077 tickets are dropped rather than cached */
+#define TLS_MAX_SESSION_TICKET_LEN	2048
+
 enum tls_cipher_type {
 	TLS_CIPHER_STREAM,
 	TLS_CIPHER_BLOCK,
@@ -187,6 +190,7 @@ enum tls_handshake_type {
 	TLS_HELLO_REQUEST	= 0,
 	TLS_CLIENT_HELLO	= 1,
 	TLS_SERVER_HELLO	= 2,
+	TLS_NEW_SESSION_TICKET	= 4,
 	TLS_CERTIFICATE		= 11,
 	TLS_SERVER_KEY_EXCHANGE	= 12,
 	TLS_CERTIFICATE_REQUEST	= 13,
@@ -218,6 +222,24 @@ struct l_tls {
 
 	struct tls_cipher_suite **cipher_suite_pref_list;
 
+	/* Client session cache (RFC 5246 session IDs and RFC 5077 tickets) */
+	struct l_settings *session_settings;
+	char *session_group;
+	unsigned int session_lifetime;
+	l_tls_session_update_cb_t session_update_cb;
+	void *session_update_data;
+	uint8_t session_id[32];
+	size_t session_id_size;
+	uint8_t *session_ticket;
+	size_t session_ticket_len;
+	enum l_tls_version session_version;
+	struct tls_cipher_suite *session_cipher_suite;
+	unsigned int session_compression_method;
+	char *session_peer_identity;
+	bool session_offered;
+	bool session_resumed;
+	bool session_ticket_expected;
+
 	bool in_callback;
 	bool pending_destroy;
 
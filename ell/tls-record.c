@@ -76,7 +76,6 @@ static void tls_tx_record_plaintext(struct l_tls *tls,
 	uint8_t buf[TX_RECORD_HEADROOM + TX_RECORD_MAX_LEN +
 				TX_RECORD_TAILROOM];
 	uint8_t iv[32];
-	uint8_t *assocdata;
 	int offset;
 
 	/*
@@ -157,50 +156,6 @@ static void tls_tx_record_plaintext(struct l_tls *tls,
 
 		break;
 
-	case TLS_CIPHER_AEAD:
-		/* Prepend seq_num to TLSCompressed.type + .version + .length */
-		assocdata = compressed - 8;
-		l_put_be64(tls->seq_num[1]++, assocdata);
-
-		cipher_input = compressed + 5;
-		cipher_input_len = compressed_len;
-
-		/*
-		 * Build the IV.  The explicit part generation method is
-		 * actually cipher suite-specific but our only AEAD cipher
-		 * suites only require this part to be unique for each
-		 * record.  For future suites there may need to be a callback
-		 * that generates the per-record IV or an enum for the suite
-		 * to select one of a few IV types.
-		 *
-		 * Note kernel's rfc4106(gcm(...)) algorithm could potentially
-		 * be used to build the IV.
-		 */
-		memcpy(iv, tls->fixed_iv[1], tls->fixed_iv_length[1]);
-		l_put_le64(tls->seq_num[1], iv + tls->fixed_iv_length[1]);
-
-		if (tls->record_iv_length[1] > 8)
-			memset(iv + tls->fixed_iv_length[1] + 8, 42,
-				tls->record_iv_length[1] - 8);
-
-		/* Build the GenericAEADCipher struct */
-		ciphertext = buf + TX_RECORD_HEADROOM;
-		memcpy(ciphertext, iv + tls->fixed_iv_length[1],
-			tls->record_iv_length[1]);
-		l_aead_cipher_encrypt(tls->aead_cipher[1],
-					cipher_input, cipher_input_len,
-					assocdata, 13,
-					iv, tls->fixed_iv_length[1] +
-					tls->record_iv_length[1],
-					ciphertext + tls->record_iv_length[1],
-					cipher_input_len +
-					tls->auth_tag_length[1]);
-
-		ciphertext_len = tls->record_iv_length[1] +
-			cipher_input_len + tls->auth_tag_length[1];
-
-		break;
-
 	default:
 		return;
 	}
@@ -216,6 +171,69 @@ static void tls_tx_record_plaintext(struct l_tls *tls,
 	tls->tx(ciphertext, ciphertext_len + 5, tls->user_data);
 }
 
+/*
+ * AEAD suites need no MAC or padding appended to the fragment so it is
+ * encrypted straight from the caller's buffer into the TLSCiphertext,
+ * without being copied into a TLSPlaintext structure first.
+ */
+static void tls_tx_record_aead(struct l_tls *tls, const uint8_t *header,
+				const uint8_t *fragment, uint16_t fragment_len)
+{
+	uint8_t buf[TX_RECORD_HEADROOM + TX_RECORD_MAX_LEN +
+				TX_RECORD_TAILROOM];
+	uint8_t assocdata[13];
+	uint8_t iv[32];
+	uint8_t *ciphertext;
+	uint16_t ciphertext_len;
+
+	/* Prepend seq_num to TLSCompressed.type + .version + .length */
+	l_put_be64(tls->seq_num[1]++, assocdata);
+	memcpy(assocdata + 8, header, 5);
+
+	/*
+	 * Build the IV.  The explicit part generation method is
+	 * actually cipher suite-specific but our only AEAD cipher
+	 * suites only require this part to be unique for each
+	 * record.  For future suites there may need to be a callback
+	 * that generates the per-record IV or an enum for the suite
+	 * to select one of a few IV types.
+	 *
+	 * Note kernel's rfc4106(gcm(...)) algorithm could potentially
+	 * be used to build the IV.
+	 */
+	memcpy(iv, tls->fixed_iv[1], tls->fixed_iv_length[1]);
+	l_put_le64(tls->seq_num[1], iv + tls->fixed_iv_length[1]);
+
+	if (tls->record_iv_length[1] > 8)
+		memset(iv + tls->fixed_iv_length[1] + 8, 42,
+			tls->record_iv_length[1] - 8);
+
+	/* Build the GenericAEADCipher struct */
+	ciphertext = buf + TX_RECORD_HEADROOM;
+	memcpy(ciphertext, iv + tls->fixed_iv_length[1],
+		tls->record_iv_length[1]);
+	l_aead_cipher_encrypt(tls->aead_cipher[1],
+				fragment, fragment_len,
+				assocdata, 13,
+				iv, tls->fixed_iv_length[1] +
+				tls->record_iv_length[1],
+				ciphertext + tls->record_iv_length[1],
+				fragment_len + tls->auth_tag_length[1]);
+
+	ciphertext_len = tls->record_iv_length[1] +
+		fragment_len + tls->auth_tag_length[1];
+
+	/* Build a TLSCiphertext struct */
+	ciphertext -= 5;
+	ciphertext[0] = header[0]; /* Copy type and version fields */
+	ciphertext[1] = header[1];
+	ciphertext[2] = header[2];
+	ciphertext[3] = ciphertext_len >> 8;
+	ciphertext[4] = ciphertext_len >> 0;
+
+	tls->tx(ciphertext, ciphertext_len + 5, tls->user_data);
+}
+
 void tls_tx_record(struct l_tls *tls, enum tls_content_type type,
 			const uint8_t *data, size_t len)
 {
@@ -240,9 +258,14 @@ void tls_tx_record(struct l_tls *tls, enum tls_content_type type,
 		plaintext[2] = (uint8_t) (version >> 0);
 		plaintext[3] = fragment_len >> 8;
 		plaintext[4] = fragment_len >> 0;
-		memcpy(plaintext + 5, data, fragment_len);
 
-		tls_tx_record_plaintext(tls, plaintext, fragment_len + 5);
+		if (tls->cipher_type[1] == TLS_CIPHER_AEAD)
+			tls_tx_record_aead(tls, plaintext, data, fragment_len);
+		else {
+			memcpy(plaintext + 5, data, fragment_len);
+			tls_tx_record_plaintext(tls, plaintext,
+						fragment_len + 5);
+		}
 
 		data += fragment_len;
 		len -= fragment_len;
@@ -405,7 +428,12 @@ static bool tls_handle_ciphertext(struct l_tls *tls)
 		return false;
 	}
 
-	compressed = alloca(8 + 5 + fragment_len);
+	/* AEAD records only need the associated data built here */
+	if (tls->cipher_type[0] == TLS_CIPHER_AEAD)
+		compressed = alloca(8 + 5);
+	else
+		compressed = alloca(8 + 5 + fragment_len);
+
 	/* Copy the type and version fields */
 	compressed[8] = type;
 	l_put_be16(version, compressed + 9);
@@ -558,13 +586,18 @@ static bool tls_handle_ciphertext(struct l_tls *tls)
 		/* Prepend seq_num to TLSCompressed.type + .version + .length */
 		assocdata = compressed;
 		l_put_be64(tls->seq_num[0]++, assocdata);
-		compressed += 13;
 
 		/* Build the IV */
 		memcpy(iv, tls->fixed_iv[0], tls->fixed_iv_length[0]);
 		memcpy(iv + tls->fixed_iv_length[0], tls->record_buf + 5,
 			tls->record_iv_length[0]);
 
+		/*
+		 * Decrypt in place, the kernel has consumed all of the
+		 * ciphertext by the time it writes out the plaintext
+		 */
+		compressed = tls->record_buf + 5 + tls->record_iv_length[0];
+
 		if (!l_aead_cipher_decrypt(tls->aead_cipher[0],
 				tls->record_buf + 5 + tls->record_iv_length[0],
 				fragment_len - tls->record_iv_length[0],
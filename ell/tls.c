@@ -46,6 +46,7 @@
 #include "strv.h"
 #include "missing.h"
 #include "string.h"
+#include "settings.h"
 
 bool tls10_prf(const void *secret, size_t secret_len,
 		const char *label,
@@ -832,6 +833,7 @@ static const char *tls_handshake_type_to_str(enum tls_handshake_type type)
 	SWITCH_ENUM_TO_STR(TLS_HELLO_REQUEST)
 	SWITCH_ENUM_TO_STR(TLS_CLIENT_HELLO)
 	SWITCH_ENUM_TO_STR(TLS_SERVER_HELLO)
+	SWITCH_ENUM_TO_STR(TLS_NEW_SESSION_TICKET)
 	SWITCH_ENUM_TO_STR(TLS_CERTIFICATE)
 	SWITCH_ENUM_TO_STR(TLS_SERVER_KEY_EXCHANGE)
 	SWITCH_ENUM_TO_STR(TLS_CERTIFICATE_REQUEST)
@@ -865,9 +867,189 @@ static void tls_send_alert(struct l_tls *tls, bool fatal,
  * user-supplied disconnected callback here is free to use l_tls_free
  * for example.
  */
+static void tls_forget_cached_session(struct l_tls *tls)
+{
+	if (!l_settings_remove_group(tls->session_settings,
+					tls->session_group))
+		return;
+
+	if (tls->session_update_cb)
+		tls->session_update_cb(tls->session_update_data);
+}
+
+static void tls_load_cached_session(struct l_tls *tls)
+{
+	struct l_settings *settings = tls->session_settings;
+	const char *group = tls->session_group;
+	_auto_(l_free) uint8_t *session_id = NULL;
+	_auto_(l_free) uint8_t *master_secret = NULL;
+	_auto_(l_free) uint8_t *suite_id = NULL;
+	uint8_t *ticket;
+	size_t session_id_len;
+	size_t master_secret_len;
+	size_t suite_id_len;
+	size_t ticket_len = 0;
+	uint64_t expiry;
+	unsigned int version;
+	unsigned int compression;
+	struct tls_cipher_suite **suite;
+	char *peer_identity;
+
+	l_free(tls->session_ticket);
+	tls->session_ticket = NULL;
+	tls->session_ticket_len = 0;
+	l_free(tls->session_peer_identity);
+	tls->session_peer_identity = NULL;
+	tls->session_id_size = 0;
+	tls->session_offered = false;
+	tls->session_resumed = false;
+	tls->session_ticket_expected = false;
+
+	if (!settings || !l_settings_has_group(settings, group))
+		return;
+
+	if (!l_settings_get_uint64(settings, group, "SessionExpiryTime",
+					&expiry) ||
+			expiry <= (uint64_t) time(NULL))
+		goto forget;
+
+	session_id = l_settings_get_bytes(settings, group, "SessionID",
+						&session_id_len);
+	master_secret = l_settings_get_bytes(settings, group,
+						"SessionMasterSecret",
+						&master_secret_len);
+	suite_id = l_settings_get_bytes(settings, group, "SessionCipherSuite",
+					&suite_id_len);
+
+	if (!session_id || session_id_len > 32 || !master_secret ||
+			master_secret_len != 48 ||
+			!suite_id || suite_id_len != 2 ||
+			!l_settings_get_uint(settings, group, "SessionVersion",
+						&version) ||
+			!l_settings_get_uint(settings, group,
+						"SessionCompressionMethod",
+						&compression))
+		goto forget;
+
+	if (version < tls->min_version || version > tls->max_version)
+		goto forget;
+
+	for (suite = tls->cipher_suite_pref_list; *suite; suite++)
+		if (!memcmp((*suite)->id, suite_id, 2))
+			break;
+
+	if (!*suite || !tls_cipher_suite_is_compatible(tls, *suite, NULL))
+		goto forget;
+
+	/*
+	 * The server's certificate isn't sent again so only resume sessions
+	 * where it was validated if the caller requires it now.
+	 */
+	peer_identity = l_settings_get_string(settings, group,
+						"SessionPeerIdentity");
+	if (tls->ca_certs && !peer_identity)
+		goto forget;
+
+	ticket = l_settings_get_bytes(settings, group, "SessionTicket",
+					&ticket_len);
+	if (ticket && !ticket_len) {
+		l_free(ticket);
+		ticket = NULL;
+	}
+
+	if (!session_id_len && !ticket) {
+		l_free(peer_identity);
+		goto forget;
+	}
+
+	/*
+	 * RFC 5077, Section 3.4: "When presenting a ticket, the client MAY
+	 * generate and include a Session ID in the TLS ClientHello", the
+	 * server echoes it back if it accepts the ticket.
+	 */
+	if (!session_id_len) {
+		l_getrandom(tls->session_id, 32);
+		tls->session_id_size = 32;
+	} else {
+		memcpy(tls->session_id, session_id, session_id_len);
+		tls->session_id_size = session_id_len;
+	}
+
+	memcpy(tls->pending.master_secret, master_secret, 48);
+	tls->session_ticket = ticket;
+	tls->session_ticket_len = ticket_len;
+	tls->session_version = version;
+	tls->session_cipher_suite = *suite;
+	tls->session_compression_method = compression;
+	tls->session_peer_identity = peer_identity;
+	tls->session_offered = true;
+
+	explicit_bzero(master_secret, master_secret_len);
+	TLS_DEBUG("Offering cached session");
+	return;
+
+forget:
+	if (master_secret)
+		explicit_bzero(master_secret, master_secret_len);
+
+	tls_forget_cached_session(tls);
+}
+
+static void tls_save_session(struct l_tls *tls, const char *peer_identity)
+{
+	struct l_settings *settings = tls->session_settings;
+	const char *group = tls->session_group;
+
+	if (!tls->session_resumed) {
+		l_settings_remove_group(settings, group);
+
+		/* Server doesn't support session resumption */
+		if (!tls->session_id_size && !tls->session_ticket)
+			goto done;
+
+		l_settings_set_bytes(settings, group, "SessionID",
+					tls->session_id, tls->session_id_size);
+		l_settings_set_bytes(settings, group, "SessionMasterSecret",
+					tls->pending.master_secret, 48);
+		l_settings_set_uint(settings, group, "SessionVersion",
+					tls->negotiated_version);
+		l_settings_set_bytes(settings, group, "SessionCipherSuite",
+					tls->pending.cipher_suite->id, 2);
+		l_settings_set_uint(settings, group,
+					"SessionCompressionMethod",
+					tls->pending.compression_method->id);
+		l_settings_set_uint64(settings, group, "SessionExpiryTime",
+					(uint64_t) time(NULL) +
+					tls->session_lifetime);
+
+		if (peer_identity)
+			l_settings_set_string(settings, group,
+						"SessionPeerIdentity",
+						peer_identity);
+	}
+
+	if (tls->session_ticket)
+		l_settings_set_bytes(settings, group, "SessionTicket",
+					tls->session_ticket,
+					tls->session_ticket_len);
+	else
+		l_settings_remove_key(settings, group, "SessionTicket");
+
+done:
+	if (tls->session_update_cb)
+		tls->session_update_cb(tls->session_update_data);
+}
+
 void tls_disconnect(struct l_tls *tls, enum l_tls_alert_desc desc,
 			enum l_tls_alert_desc local_desc)
 {
+	/*
+	 * RFC 5246, Section 7.2.2: "Any connection terminated with a fatal
+	 * alert MUST NOT be resumed."
+	 */
+	if (tls->session_offered && !tls->ready)
+		tls_forget_cached_session(tls);
+
 	tls_send_alert(tls, true, desc);
 
 	tls_reset_handshake(tls);
@@ -994,7 +1176,8 @@ static ssize_t tls_append_hello_extensions(struct l_tls *tls,
 
 static bool tls_send_client_hello(struct l_tls *tls)
 {
-	uint8_t buf[1024 + L_ARRAY_SIZE(tls_compression_pref)];
+	uint8_t buf[1024 + L_ARRAY_SIZE(tls_compression_pref) + 32 +
+			TLS_MAX_SESSION_TICKET_LEN];
 	uint8_t *ptr = buf + TLS_HANDSHAKE_HEADER_SIZE;
 	uint8_t *len_ptr;
 	unsigned int i;
@@ -1010,7 +1193,10 @@ static bool tls_send_client_hello(struct l_tls *tls)
 	memcpy(ptr, tls->pending.client_random, 32);
 	ptr += 32;
 
-	*ptr++ = 0; /* No SessionID */
+	/* SessionID of a cached session if we're trying to resume it */
+	*ptr++ = tls->session_id_size;
+	memcpy(ptr, tls->session_id, tls->session_id_size);
+	ptr += tls->session_id_size;
 
 	len_ptr = ptr;
 	ptr += 2;
@@ -1257,22 +1443,10 @@ static void tls_send_server_hello_done(struct l_tls *tls)
 				TLS_HANDSHAKE_HEADER_SIZE);
 }
 
-void tls_generate_master_secret(struct l_tls *tls,
-				const uint8_t *pre_master_secret,
-				int pre_master_secret_len)
+static void tls_generate_key_block(struct l_tls *tls)
 {
 	uint8_t seed[64];
-	int key_block_size;
-
-	memcpy(seed +  0, tls->pending.client_random, 32);
-	memcpy(seed + 32, tls->pending.server_random, 32);
-
-	tls_prf_get_bytes(tls, pre_master_secret, pre_master_secret_len,
-				"master secret", seed, 64,
-				tls->pending.master_secret, 48);
-
-	/* Directly generate the key block while we're at it */
-	key_block_size = 0;
+	int key_block_size = 0;
 
 	if (tls->pending.cipher_suite->encryption)
 		key_block_size += 2 *
@@ -1304,6 +1478,24 @@ void tls_generate_master_secret(struct l_tls *tls,
 	explicit_bzero(seed, 64);
 }
 
+void tls_generate_master_secret(struct l_tls *tls,
+				const uint8_t *pre_master_secret,
+				int pre_master_secret_len)
+{
+	uint8_t seed[64];
+
+	memcpy(seed +  0, tls->pending.client_random, 32);
+	memcpy(seed + 32, tls->pending.server_random, 32);
+
+	tls_prf_get_bytes(tls, pre_master_secret, pre_master_secret_len,
+				"master secret", seed, 64,
+				tls->pending.master_secret, 48);
+	explicit_bzero(seed, 64);
+
+	/* Directly generate the key block while we're at it */
+	tls_generate_key_block(tls);
+}
+
 static void tls_get_handshake_hash(struct l_tls *tls,
 					enum handshake_hash_type type,
 					uint8_t *out)
@@ -1778,6 +1970,7 @@ static void tls_handle_server_hello(struct l_tls *tls,
 					const uint8_t *buf, size_t len)
 {
 	uint8_t session_id_size, cipher_suite_id[2], compression_method_id;
+	const uint8_t *session_id = buf + 35;
 	const char *error;
 	struct tls_cipher_suite **iter;
 	int i;
@@ -1792,6 +1985,9 @@ static void tls_handle_server_hello(struct l_tls *tls,
 	session_id_size = buf[34];
 	len -= 35;
 
+	if (session_id_size > 32)
+		goto decode_error;
+
 	/* Do we have enough for SessionID + CipherSuite ID + Compression ID */
 	if (len < (size_t) session_id_size + 2 + 1)
 		goto decode_error;
@@ -1876,6 +2072,45 @@ static void tls_handle_server_hello(struct l_tls *tls,
 
 	TLS_DEBUG("Negotiated %s", tls->pending.compression_method->name);
 
+	/*
+	 * RFC 5246, Section 7.3: the server echoes our SessionID if it
+	 * agrees to resume, in which case it continues directly with its
+	 * ChangeCipherSpec and Finished.
+	 */
+	if (tls->session_offered && session_id_size == tls->session_id_size &&
+			!memcmp(session_id, tls->session_id, session_id_size)) {
+		if (tls->negotiated_version != tls->session_version ||
+				tls->pending.cipher_suite !=
+				tls->session_cipher_suite ||
+				tls->pending.compression_method->id !=
+				(int) tls->session_compression_method) {
+			TLS_DISCONNECT(TLS_ALERT_ILLEGAL_PARAM, 0,
+					"Resumed session parameters changed");
+			return;
+		}
+
+		TLS_DEBUG("Resuming cached session");
+		tls->session_resumed = true;
+		tls_generate_key_block(tls);
+		TLS_SET_STATE(TLS_HANDSHAKE_WAIT_CHANGE_CIPHER_SPEC);
+		return;
+	}
+
+	if (tls->session_offered) {
+		TLS_DEBUG("Server declined session resumption");
+		tls_forget_cached_session(tls);
+		tls->session_offered = false;
+
+		l_free(tls->session_ticket);
+		tls->session_ticket = NULL;
+		tls->session_ticket_len = 0;
+		l_free(tls->session_peer_identity);
+		tls->session_peer_identity = NULL;
+	}
+
+	memcpy(tls->session_id, session_id, session_id_size);
+	tls->session_id_size = session_id_size;
+
 	if (tls->pending.cipher_suite->signature)
 		TLS_SET_STATE(TLS_HANDSHAKE_WAIT_CERTIFICATE);
 	else
@@ -2321,12 +2556,53 @@ error:
 	return NULL;
 }
 
+static void tls_handle_new_session_ticket(struct l_tls *tls,
+						const uint8_t *buf, size_t len)
+{
+	size_t ticket_len;
+
+	/* ticket_lifetime_hint + ticket length */
+	if (len < 6)
+		goto decode_error;
+
+	ticket_len = l_get_be16(buf + 4);
+	if (len != 6 + ticket_len)
+		goto decode_error;
+
+	l_free(tls->session_ticket);
+	tls->session_ticket = NULL;
+	tls->session_ticket_len = 0;
+	tls->session_ticket_expected = false;
+
+	/* An empty ticket means the server won't be issuing one after all */
+	if (!ticket_len)
+		return;
+
+	if (ticket_len > TLS_MAX_SESSION_TICKET_LEN) {
+		TLS_DEBUG("Ignoring %zu byte session ticket", ticket_len);
+		return;
+	}
+
+	tls->session_ticket = l_memdup(buf + 6, ticket_len);
+	tls->session_ticket_len = ticket_len;
+	return;
+
+decode_error:
+	TLS_DISCONNECT(TLS_ALERT_DECODE_ERROR, 0,
+			"NewSessionTicket decode error");
+}
+
 static void tls_finished(struct l_tls *tls)
 {
 	char *peer_identity = NULL;
 
 	if (tls->peer_authenticated) {
-		peer_identity = tls_get_peer_identity_str(tls->peer_cert);
+		if (tls->session_resumed)
+			peer_identity = l_strdup(tls->session_peer_identity);
+		else
+			peer_identity =
+				tls_get_peer_identity_str(tls->peer_cert);
+
 		if (!peer_identity) {
 			TLS_DISCONNECT(TLS_ALERT_INTERNAL_ERROR, 0,
 					"tls_get_peer_identity_str failed");
@@ -2334,6 +2610,10 @@ static void tls_finished(struct l_tls *tls)
 		}
 	}
 
+	/* The master secret is still around until tls_cleanup_handshake */
+	if (!tls->server && tls->session_settings)
+		tls_save_session(tls, peer_identity);
+
 	/* Free up the resources used in the handshake */
 	tls_reset_handshake(tls);
 
@@ -2414,6 +2694,25 @@ static void tls_handle_handshake(struct l_tls *tls, int type,
 
 		break;
 
+	case TLS_NEW_SESSION_TICKET:
+		if (tls->server) {
+			TLS_DISCONNECT(TLS_ALERT_UNEXPECTED_MESSAGE, 0,
+					"Message invalid in server mode");
+			break;
+		}
+
+		if (tls->state != TLS_HANDSHAKE_WAIT_CHANGE_CIPHER_SPEC ||
+				!tls->session_ticket_expected) {
+			TLS_DISCONNECT(TLS_ALERT_UNEXPECTED_MESSAGE, 0,
+					"Message invalid in state %s",
+					tls_handshake_state_to_str(tls->state));
+			break;
+		}
+
+		tls_handle_new_session_ticket(tls, buf, len);
+
+		break;
+
 	case TLS_CERTIFICATE:
 		if (tls->state != TLS_HANDSHAKE_WAIT_CERTIFICATE) {
 			TLS_DISCONNECT(TLS_ALERT_UNEXPECTED_MESSAGE, 0,
@@ -2538,7 +2837,8 @@ static void tls_handle_handshake(struct l_tls *tls, int type,
 		if (!tls_verify_finished(tls, buf, len))
 			break;
 
-		if (tls->server) {
+		/* In an abbreviated handshake the client's Finished is last */
+		if (tls->server || tls->session_resumed) {
 			const char *error;
 
 			tls_send_change_cipher_spec(tls);
@@ -2581,7 +2881,15 @@ static void tls_handle_handshake(struct l_tls *tls, int type,
 		 *      pair.
 		 */
 		if (!tls->server && tls->cipher_suite[0]->signature &&
-				tls->ca_certs)
+				tls->ca_certs && !tls->session_resumed)
+			tls->peer_authenticated = true;
+
+		/*
+		 * A resumed session proves the server knows the master secret
+		 * of the session in which its certificate was verified.
+		 */
+		if (tls->session_resumed && tls->ca_certs &&
+				tls->session_peer_identity)
 			tls->peer_authenticated = true;
 
 		tls_finished(tls);
@@ -2642,6 +2950,9 @@ LIB_EXPORT void l_tls_free(struct l_tls *tls)
 	l_tls_set_auth_data(tls, NULL, NULL);
 	l_tls_set_domain_mask(tls, NULL);
 	l_tls_set_cert_dump_path(tls, NULL);
+	l_free(tls->session_group);
+	l_free(tls->session_ticket);
+	l_free(tls->session_peer_identity);
 
 	tls_reset_handshake(tls);
 	tls_cleanup_handshake(tls);
@@ -2843,6 +3154,8 @@ LIB_EXPORT bool l_tls_start(struct l_tls *tls)
 	if (!tls_init_handshake_hash(tls))
 		return false;
 
+	tls_load_cached_session(tls);
+
 	if (!tls_send_client_hello(tls))
 		return false;
 
@@ -2992,6 +3305,40 @@ LIB_EXPORT void l_tls_set_domain_mask(struct l_tls *tls, char **mask)
 	tls->subject_mask = l_strv_copy(mask);
 }
 
+LIB_EXPORT bool l_tls_set_session_cache(struct l_tls *tls,
+					struct l_settings *settings,
+					const char *group,
+					unsigned int lifetime,
+					l_tls_session_update_cb_t update_cb,
+					void *user_data)
+{
+	if (unlikely(!tls || tls->server))
+		return false;
+
+	if (unlikely(settings && !group))
+		return false;
+
+	if (tls->state != TLS_HANDSHAKE_WAIT_START)
+		return false;
+
+	l_free(tls->session_group);
+	tls->session_settings = settings;
+	tls->session_group = l_strdup(group);
+	tls->session_lifetime = lifetime;
+	tls->session_update_cb = update_cb;
+	tls->session_update_data = user_data;
+
+	return true;
+}
+
+LIB_EXPORT bool l_tls_get_session_resumed(struct l_tls *tls)
+{
+	if (unlikely(!tls))
+		return false;
+
+	return tls->session_resumed;
+}
+
 LIB_EXPORT const char *l_tls_alert_to_str(enum l_tls_alert_desc desc)
 {
 	switch (desc) {
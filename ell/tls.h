@@ -36,6 +36,7 @@ struct l_tls;
 struct l_key;
 struct l_certchain;
 struct l_queue;
+struct l_settings;
 
 enum l_tls_alert_desc {
 	TLS_ALERT_CLOSE_NOTIFY		= 0,
@@ -72,6 +73,7 @@ typedef void (*l_tls_disconnect_cb_t)(enum l_tls_alert_desc reason,
 					bool remote, void *user_data);
 typedef void (*l_tls_debug_cb_t)(const char *str, void *user_data);
 typedef void (*l_tls_destroy_cb_t)(void *user_data);
+typedef void (*l_tls_session_update_cb_t)(void *user_data);
 
 /*
  * app_data_handler gets called with newly received decrypted data.
@@ -124,6 +126,17 @@ void l_tls_set_version_range(struct l_tls *tls,
 
 void l_tls_set_domain_mask(struct l_tls *tls, char **mask);
 
+/*
+ * Client only: remember the session in @group of @settings so that the
+ * next l_tls object given the same group can offer an abbreviated
+ * handshake.  @update_cb is called whenever @settings has been modified.
+ */
+bool l_tls_set_session_cache(struct l_tls *tls, struct l_settings *settings,
+				const char *group, unsigned int lifetime,
+				l_tls_session_update_cb_t update_cb,
+				void *user_data);
+bool l_tls_get_session_resumed(struct l_tls *tls);
+
 const char *l_tls_alert_to_str(enum l_tls_alert_desc desc);
 
 enum l_checksum_type;
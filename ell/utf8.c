@@ -25,6 +25,8 @@
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <wchar.h>
 
 #include "strv.h"
@@ -144,11 +146,36 @@ error:
  **/
 LIB_EXPORT bool l_utf8_validate(const char *str, size_t len, const char **end)
 {
+	static const uint64_t ones = 0x0101010101010101ULL;
+	static const uint64_t highs = 0x8080808080808080ULL;
 	size_t pos = 0;
 	int ret;
 	wchar_t val;
 
 	while (pos < len && str[pos]) {
+		/*
+		 * Most text is plain ASCII, skip over it a word at a time as
+		 * long as no byte has the high bit set or is NUL
+		 */
+		while (len - pos >= sizeof(uint64_t)) {
+			uint64_t word;
+
+			memcpy(&word, str + pos, sizeof(word));
+
+			if ((word | ((word - ones) & ~word)) & highs)
+				break;
+
+			pos += sizeof(word);
+		}
+
+		if (pos == len || !str[pos])
+			break;
+
+		if ((signed char) str[pos] > 0) {
+			pos += 1;
+			continue;
+		}
+
 		ret = l_utf8_get_codepoint(str + pos, len - pos, &val);
 
 		if (ret < 0)
@@ -0,0 +1,343 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "useful.h"
+#include "queue.h"
+#include "work.h"
+#include "main-private.h"
+#include "private.h"
+
+/**
+ * SECTION:work
+ * @short_description: Worker thread pool
+ *
+ * Runs CPU heavy jobs on a small pool of worker threads and delivers their
+ * completion on the main loop.  The work function runs on a worker thread
+ * and must only touch the data it has been handed; it must not call into
+ * any main loop bound object.  The done and destroy functions run on the
+ * main loop.  Threads are started on demand, by default up to the number
+ * of online CPUs but no more than four, and are stopped by l_main_exit().
+ */
+
+#define WORK_DEFAULT_MAX_THREADS 4
+
+struct work_job {
+	uint32_t id;
+	bool canceled;
+	l_work_func_t work;
+	l_work_done_func_t done;
+	l_work_destroy_func_t destroy;
+	void *user_data;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct l_queue *todo;		/* Protected by lock */
+	struct l_queue *done;		/* Protected by lock */
+	unsigned int idle_threads;	/* Protected by lock */
+	bool stopping;			/* Protected by lock */
+	struct l_queue *jobs;		/* Main thread only */
+	pthread_t *threads;
+	unsigned int n_threads;
+	unsigned int max_threads;
+	uint32_t next_id;
+	int fd;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+};
+
+static void work_job_free(void *data)
+{
+	struct work_job *job = data;
+
+	if (job->destroy)
+		job->destroy(job->user_data);
+
+	l_free(job);
+}
+
+static void *work_thread(void *user_data)
+{
+	struct work_job *job;
+	static const uint64_t one = 1;
+
+	pthread_mutex_lock(&pool.lock);
+
+	while (true) {
+		job = l_queue_pop_head(pool.todo);
+		if (!job) {
+			if (pool.stopping)
+				break;
+
+			pool.idle_threads += 1;
+			pthread_cond_wait(&pool.cond, &pool.lock);
+			pool.idle_threads -= 1;
+			continue;
+		}
+
+		pthread_mutex_unlock(&pool.lock);
+
+		job->work(job->user_data);
+
+		pthread_mutex_lock(&pool.lock);
+		l_queue_push_tail(pool.done, job);
+
+		if (L_TFR(write(pool.fd, &one, sizeof(one))) < 0 &&
+							errno != EAGAIN)
+			break;
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+
+	return NULL;
+}
+
+static void work_complete(int fd, uint32_t events, void *user_data)
+{
+	struct l_queue *done;
+	struct work_job *job;
+	uint64_t count;
+
+	if (L_TFR(read(fd, &count, sizeof(count))) < 0 && errno != EAGAIN)
+		return;
+
+	pthread_mutex_lock(&pool.lock);
+	done = pool.done;
+	pool.done = l_queue_new();
+	pthread_mutex_unlock(&pool.lock);
+
+	while ((job = l_queue_pop_head(done))) {
+		l_queue_remove(pool.jobs, job);
+
+		if (!job->canceled && job->done)
+			job->done(job->user_data);
+
+		work_job_free(job);
+	}
+
+	l_queue_destroy(done, NULL);
+}
+
+static void work_pool_destroy(void *user_data)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i = 0; i < pool.n_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+
+	l_free(pool.threads);
+	pool.threads = NULL;
+	pool.n_threads = 0;
+
+	close(pool.fd);
+	pool.fd = -1;
+
+	/* Completed or not, none of the remaining jobs get their done call */
+	l_queue_destroy(pool.todo, NULL);
+	pool.todo = NULL;
+	l_queue_destroy(pool.done, NULL);
+	pool.done = NULL;
+	l_queue_destroy(pool.jobs, work_job_free);
+	pool.jobs = NULL;
+
+	pool.stopping = false;
+}
+
+static bool work_pool_setup(void)
+{
+	int fd;
+
+	if (pool.fd >= 0)
+		return true;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	if (watch_add(fd, EPOLLIN, work_complete, NULL,
+					work_pool_destroy) < 0) {
+		close(fd);
+		return false;
+	}
+
+	if (!pool.max_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		pool.max_threads = cpus > 0 && cpus < WORK_DEFAULT_MAX_THREADS ?
+					cpus : WORK_DEFAULT_MAX_THREADS;
+	}
+
+	pool.fd = fd;
+	pool.todo = l_queue_new();
+	pool.done = l_queue_new();
+	pool.jobs = l_queue_new();
+	pool.threads = l_new(pthread_t, pool.max_threads);
+
+	return true;
+}
+
+/**
+ * l_work_submit:
+ * @work: function to run on a worker thread
+ * @done: function called on the main loop once @work has returned
+ * @user_data: user data passed to all callbacks
+ * @destroy: destroy function for @user_data, called on the main loop
+ *
+ * Queues @work to be run on one of the worker threads.  Jobs are started
+ * in the order they were submitted, but may complete in any order.
+ *
+ * Returns: an id for use with l_work_cancel(), or 0 on failure.
+ **/
+LIB_EXPORT uint32_t l_work_submit(l_work_func_t work, l_work_done_func_t done,
+				void *user_data, l_work_destroy_func_t destroy)
+{
+	struct work_job *job;
+	bool start_thread;
+
+	if (unlikely(!work))
+		return 0;
+
+	if (!work_pool_setup())
+		return 0;
+
+	job = l_new(struct work_job, 1);
+	job->work = work;
+	job->done = done;
+	job->destroy = destroy;
+	job->user_data = user_data;
+
+	if (++pool.next_id == 0)
+		pool.next_id = 1;
+
+	job->id = pool.next_id;
+
+	pthread_mutex_lock(&pool.lock);
+	l_queue_push_tail(pool.todo, job);
+	start_thread = l_queue_length(pool.todo) > pool.idle_threads &&
+					pool.n_threads < pool.max_threads;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	if (start_thread && !pthread_create(&pool.threads[pool.n_threads],
+						NULL, work_thread, NULL))
+		pool.n_threads += 1;
+
+	if (!pool.n_threads) {
+		pthread_mutex_lock(&pool.lock);
+		l_queue_remove(pool.todo, job);
+		pthread_mutex_unlock(&pool.lock);
+		l_free(job);
+		return 0;
+	}
+
+	l_queue_push_tail(pool.jobs, job);
+
+	return job->id;
+}
+
+static bool work_job_match(const void *a, const void *b)
+{
+	const struct work_job *job = a;
+
+	return job->id == L_PTR_TO_UINT(b);
+}
+
+/**
+ * l_work_cancel:
+ * @id: id returned by l_work_submit()
+ *
+ * Cancels a job.  If the job has not started yet it is dropped and its
+ * destroy function is called right away.  Otherwise the work function is
+ * allowed to finish, but the done function is not called and the destroy
+ * function is called once it has.
+ *
+ * Returns: #true if the job was found, #false otherwise
+ **/
+LIB_EXPORT bool l_work_cancel(uint32_t id)
+{
+	struct work_job *job;
+	bool queued;
+
+	if (unlikely(!id))
+		return false;
+
+	job = l_queue_find(pool.jobs, work_job_match, L_UINT_TO_PTR(id));
+	if (!job)
+		return false;
+
+	pthread_mutex_lock(&pool.lock);
+	queued = l_queue_remove(pool.todo, job);
+	pthread_mutex_unlock(&pool.lock);
+
+	if (!queued) {
+		job->canceled = true;
+		return true;
+	}
+
+	l_queue_remove(pool.jobs, job);
+	work_job_free(job);
+
+	return true;
+}
+
+/**
+ * l_work_set_max_threads:
+ * @max_threads: maximum number of worker threads
+ *
+ * Sets the size of the worker pool.  This has to be called before the first
+ * job is submitted.
+ *
+ * Returns: #true on success, #false if the pool is already running
+ **/
+LIB_EXPORT bool l_work_set_max_threads(unsigned int max_threads)
+{
+	if (unlikely(!max_threads))
+		return false;
+
+	if (pool.fd >= 0)
+		return false;
+
+	pool.max_threads = max_threads;
+
+	return true;
+}
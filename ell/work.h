@@ -0,0 +1,46 @@
+/*
+ *
+ *  Embedded Linux library
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __ELL_WORK_H
+#define __ELL_WORK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*l_work_func_t) (void *user_data);
+typedef void (*l_work_done_func_t) (void *user_data);
+typedef void (*l_work_destroy_func_t) (void *user_data);
+
+uint32_t l_work_submit(l_work_func_t work, l_work_done_func_t done,
+			void *user_data, l_work_destroy_func_t destroy);
+bool l_work_cancel(uint32_t id);
+bool l_work_set_max_threads(unsigned int max_threads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ELL_WORK_H */
@@ -0,0 +1,547 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2013-2019  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <ell/ell.h>
+
+#include "linux/nl80211.h"
+#include "src/nl80211cmd.h"
+#include "monitor/analyze.h"
+
+#define NLA_OK(nla,len)         ((len) >= (int) sizeof(struct nlattr) && \
+				(nla)->nla_len >= sizeof(struct nlattr) && \
+				(nla)->nla_len <= (len))
+#define NLA_NEXT(nla,attrlen)	((attrlen) -= NLA_ALIGN((nla)->nla_len), \
+				(struct nlattr*)(((char*)(nla)) + \
+				NLA_ALIGN((nla)->nla_len)))
+
+#define NLA_LENGTH(len)		(NLA_ALIGN(sizeof(struct nlattr)) + (len))
+#define NLA_DATA(nla)		((void*)(((char*)(nla)) + NLA_LENGTH(0)))
+#define NLA_PAYLOAD(nla)	((int)((nla)->nla_len - NLA_LENGTH(0)))
+
+/* Bounds the memory used by requests that never see a reply */
+#define MAX_PENDING_REQUESTS	4096
+
+/*
+ * The few top-level attributes the filters and statistics look at.  Nested
+ * attributes are never walked so that non-matching messages stay cheap.
+ */
+struct nl80211_summary {
+	uint8_t cmd;
+	uint32_t ifindex;
+	const uint8_t *mac;
+	const uint8_t *frame;
+	uint32_t frame_len;
+};
+
+static bool is_nl80211(uint16_t nl80211_family, const struct nlmsghdr *nlmsg)
+{
+	if (nlmsg->nlmsg_type < NLMSG_MIN_TYPE ||
+					nlmsg->nlmsg_type == GENL_ID_CTRL)
+		return false;
+
+	/* Without a family lookup in the trace assume any GENL family */
+	return !nl80211_family || nlmsg->nlmsg_type == nl80211_family;
+}
+
+static bool nl80211_summarize(const struct nlmsghdr *nlmsg,
+					struct nl80211_summary *summary)
+{
+	const struct genlmsghdr *genlmsg = NLMSG_DATA(nlmsg);
+	const struct nlattr *nla;
+	int len;
+
+	if (nlmsg->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+		return false;
+
+	memset(summary, 0, sizeof(*summary));
+	summary->cmd = genlmsg->cmd;
+
+	len = nlmsg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+	for (nla = NLMSG_DATA(nlmsg) + GENL_HDRLEN; NLA_OK(nla, len);
+						nla = NLA_NEXT(nla, len)) {
+		switch (nla->nla_type & NLA_TYPE_MASK) {
+		case NL80211_ATTR_IFINDEX:
+			if (NLA_PAYLOAD(nla) == 4)
+				summary->ifindex = l_get_u32(NLA_DATA(nla));
+			break;
+		case NL80211_ATTR_MAC:
+			if (NLA_PAYLOAD(nla) == 6)
+				summary->mac = NLA_DATA(nla);
+			break;
+		case NL80211_ATTR_FRAME:
+			summary->frame = NLA_DATA(nla);
+			summary->frame_len = NLA_PAYLOAD(nla);
+			break;
+		}
+	}
+
+	return true;
+}
+
+void analyze_filter_init(struct analyze_filter *filter)
+{
+	memset(filter, 0, sizeof(*filter));
+	filter->cmd = -1;
+	filter->subtype = -1;
+}
+
+/* Compare ignoring case, spaces and underscores, so set_key == "Set Key" */
+static bool cmd_name_equal(const char *a, const char *b)
+{
+	while (*a || *b) {
+		if (*a == ' ' || *a == '_') {
+			a++;
+			continue;
+		}
+
+		if (*b == ' ' || *b == '_') {
+			b++;
+			continue;
+		}
+
+		if (tolower(*a) != tolower(*b))
+			return false;
+
+		a++;
+		b++;
+	}
+
+	return true;
+}
+
+bool analyze_filter_set_cmd(struct analyze_filter *filter, const char *str)
+{
+	char *endp;
+	unsigned long cmd;
+
+	if (isdigit(str[0])) {
+		cmd = strtoul(str, &endp, 0);
+		if (*endp || cmd > NL80211_CMD_MAX)
+			return false;
+
+		filter->cmd = cmd;
+		filter->active = true;
+		return true;
+	}
+
+	for (cmd = 1; cmd <= NL80211_CMD_MAX; cmd++) {
+		if (!cmd_name_equal(str, nl80211cmd_to_string(cmd)))
+			continue;
+
+		filter->cmd = cmd;
+		filter->active = true;
+		return true;
+	}
+
+	return false;
+}
+
+bool analyze_filter_match_pae(const struct analyze_filter *filter)
+{
+	/* PAE packets carry no command, interface or 802.11 header */
+	return filter->cmd < 0 && filter->subtype < 0 && !filter->ifindex &&
+							!filter->has_addr;
+}
+
+static bool frame_match_addr(const struct nl80211_summary *summary,
+				const uint8_t *addr)
+{
+	unsigned int i;
+
+	/* Address 1, 2 and 3 of the 802.11 header */
+	for (i = 0; i < 3; i++) {
+		if (summary->frame_len < 4 + (i + 1) * 6)
+			break;
+
+		if (!memcmp(summary->frame + 4 + i * 6, addr, 6))
+			return true;
+	}
+
+	return false;
+}
+
+bool analyze_filter_match_genl(const struct analyze_filter *filter,
+					uint16_t nl80211_family,
+					const struct nlmsghdr *nlmsg)
+{
+	struct nl80211_summary summary;
+
+	if (!filter->active)
+		return true;
+
+	/* Family lookups are always needed to decode the rest */
+	if (nlmsg->nlmsg_type == GENL_ID_CTRL)
+		return true;
+
+	if (!is_nl80211(nl80211_family, nlmsg))
+		return false;
+
+	if (!nl80211_summarize(nlmsg, &summary))
+		return false;
+
+	if (filter->eapol_only &&
+			summary.cmd != NL80211_CMD_CONTROL_PORT_FRAME)
+		return false;
+
+	if (filter->cmd >= 0 && summary.cmd != filter->cmd)
+		return false;
+
+	if (filter->ifindex && summary.ifindex != filter->ifindex)
+		return false;
+
+	if (filter->subtype >= 0) {
+		uint16_t fc;
+
+		if (!summary.frame || summary.frame_len < 2)
+			return false;
+
+		fc = l_get_le16(summary.frame);
+
+		/* Management frames only */
+		if (((fc >> 2) & 0x3) != 0 ||
+				((fc >> 4) & 0xf) != filter->subtype)
+			return false;
+	}
+
+	if (filter->has_addr) {
+		bool match = summary.mac && !memcmp(summary.mac,
+							filter->addr, 6);
+
+		if (!match && summary.frame)
+			match = frame_match_addr(&summary, filter->addr);
+
+		if (!match)
+			return false;
+	}
+
+	return true;
+}
+
+uint16_t analyze_nl80211_family(const struct nlmsghdr *nlmsg)
+{
+	const struct genlmsghdr *genlmsg = NLMSG_DATA(nlmsg);
+	const struct nlattr *nla;
+	uint16_t id = 0;
+	bool nl80211 = false;
+	int len;
+
+	if (nlmsg->nlmsg_type != GENL_ID_CTRL ||
+			nlmsg->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN) ||
+			genlmsg->cmd != CTRL_CMD_NEWFAMILY)
+		return 0;
+
+	len = nlmsg->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+
+	for (nla = NLMSG_DATA(nlmsg) + GENL_HDRLEN; NLA_OK(nla, len);
+						nla = NLA_NEXT(nla, len)) {
+		switch (nla->nla_type & NLA_TYPE_MASK) {
+		case CTRL_ATTR_FAMILY_ID:
+			if (NLA_PAYLOAD(nla) == 2)
+				id = l_get_u16(NLA_DATA(nla));
+			break;
+		case CTRL_ATTR_FAMILY_NAME:
+			nl80211 = !strncmp(NLA_DATA(nla), NL80211_GENL_NAME,
+							NLA_PAYLOAD(nla));
+			break;
+		}
+	}
+
+	return nl80211 ? id : 0;
+}
+
+static const struct {
+	uint64_t limit;
+	const char *label;
+} latency_buckets[] = {
+	{ 100,		"< 100us"	},
+	{ 1000,		"< 1ms"		},
+	{ 10000,	"< 10ms"	},
+	{ 100000,	"< 100ms"	},
+	{ 1000000,	"< 1s"		},
+	{ UINT64_MAX,	">= 1s"		},
+};
+
+struct cmd_stats {
+	uint64_t count;
+	uint64_t requests;
+	uint64_t completed;
+	uint64_t total_usec;
+	uint64_t max_usec;
+};
+
+struct pending_request {
+	uint32_t seq;
+	uint8_t cmd;
+	bool wait_for_ack;
+	uint64_t time;
+};
+
+struct pending_scan {
+	uint32_t ifindex;
+	uint64_t time;
+};
+
+struct analyze_stats {
+	struct cmd_stats cmds[256];
+	uint64_t histogram[L_ARRAY_SIZE(latency_buckets)];
+	struct l_queue *pending;
+	struct l_queue *scans;
+	uint64_t scan_count;
+	uint64_t scan_aborted;
+	uint64_t scan_total_usec;
+	uint64_t scan_min_usec;
+	uint64_t scan_max_usec;
+};
+
+struct analyze_stats *analyze_stats_new(void)
+{
+	struct analyze_stats *stats = l_new(struct analyze_stats, 1);
+
+	stats->pending = l_queue_new();
+	stats->scans = l_queue_new();
+	stats->scan_min_usec = UINT64_MAX;
+
+	return stats;
+}
+
+void analyze_stats_free(struct analyze_stats *stats)
+{
+	if (!stats)
+		return;
+
+	l_queue_destroy(stats->pending, l_free);
+	l_queue_destroy(stats->scans, l_free);
+	l_free(stats);
+}
+
+static bool match_seq(const void *a, const void *b)
+{
+	const struct pending_request *req = a;
+
+	return req->seq == L_PTR_TO_UINT(b);
+}
+
+static bool match_ifindex(const void *a, const void *b)
+{
+	const struct pending_scan *scan = a;
+
+	return scan->ifindex == L_PTR_TO_UINT(b);
+}
+
+static void stats_complete_request(struct analyze_stats *stats,
+					struct pending_request *req,
+					uint64_t now)
+{
+	struct cmd_stats *cmd = &stats->cmds[req->cmd];
+	uint64_t latency = now > req->time ? now - req->time : 0;
+	unsigned int i;
+
+	cmd->completed++;
+	cmd->total_usec += latency;
+
+	if (latency > cmd->max_usec)
+		cmd->max_usec = latency;
+
+	for (i = 0; latency >= latency_buckets[i].limit; i++)
+		;
+
+	stats->histogram[i]++;
+
+	l_free(req);
+}
+
+static void stats_add_request(struct analyze_stats *stats,
+				const struct nlmsghdr *nlmsg, uint8_t cmd,
+				uint64_t now)
+{
+	struct pending_request *req;
+
+	stats->cmds[cmd].requests++;
+
+	/* Dumps complete with NLMSG_DONE, others with a reply or an ACK */
+	req = l_new(struct pending_request, 1);
+	req->seq = nlmsg->nlmsg_seq;
+	req->cmd = cmd;
+	req->wait_for_ack = nlmsg->nlmsg_flags & (NLM_F_ACK | NLM_F_DUMP);
+	req->time = now;
+
+	if (l_queue_length(stats->pending) >= MAX_PENDING_REQUESTS)
+		l_free(l_queue_pop_head(stats->pending));
+
+	l_queue_push_tail(stats->pending, req);
+}
+
+static void stats_scan_event(struct analyze_stats *stats,
+				const struct nl80211_summary *summary,
+				uint64_t now)
+{
+	struct pending_scan *scan;
+	uint64_t duration;
+
+	scan = l_queue_remove_if(stats->scans, match_ifindex,
+					L_UINT_TO_PTR(summary->ifindex));
+
+	if (summary->cmd == NL80211_CMD_TRIGGER_SCAN) {
+		if (!scan)
+			scan = l_new(struct pending_scan, 1);
+
+		scan->ifindex = summary->ifindex;
+		scan->time = now;
+		l_queue_push_tail(stats->scans, scan);
+		return;
+	}
+
+	if (!scan)
+		return;
+
+	duration = now > scan->time ? now - scan->time : 0;
+	l_free(scan);
+
+	if (summary->cmd == NL80211_CMD_SCAN_ABORTED) {
+		stats->scan_aborted++;
+		return;
+	}
+
+	stats->scan_count++;
+	stats->scan_total_usec += duration;
+
+	if (duration < stats->scan_min_usec)
+		stats->scan_min_usec = duration;
+
+	if (duration > stats->scan_max_usec)
+		stats->scan_max_usec = duration;
+}
+
+void analyze_stats_genl(struct analyze_stats *stats, const struct timeval *tv,
+					uint16_t nl80211_family,
+					const struct nlmsghdr *nlmsg)
+{
+	uint64_t now = tv->tv_sec * L_USEC_PER_SEC + tv->tv_usec;
+	struct nl80211_summary summary;
+	struct pending_request *req;
+
+	if (nlmsg->nlmsg_type == NLMSG_ERROR ||
+				nlmsg->nlmsg_type == NLMSG_DONE) {
+		req = l_queue_remove_if(stats->pending, match_seq,
+					L_UINT_TO_PTR(nlmsg->nlmsg_seq));
+		if (req)
+			stats_complete_request(stats, req, now);
+
+		return;
+	}
+
+	if (!is_nl80211(nl80211_family, nlmsg) ||
+			!nl80211_summarize(nlmsg, &summary))
+		return;
+
+	stats->cmds[summary.cmd].count++;
+
+	if (nlmsg->nlmsg_flags & NLM_F_REQUEST) {
+		stats_add_request(stats, nlmsg, summary.cmd, now);
+		return;
+	}
+
+	/* Unsolicited events */
+	if (!nlmsg->nlmsg_seq) {
+		switch (summary.cmd) {
+		case NL80211_CMD_TRIGGER_SCAN:
+		case NL80211_CMD_NEW_SCAN_RESULTS:
+		case NL80211_CMD_SCAN_ABORTED:
+			stats_scan_event(stats, &summary, now);
+			break;
+		}
+
+		return;
+	}
+
+	req = l_queue_find(stats->pending, match_seq,
+					L_UINT_TO_PTR(nlmsg->nlmsg_seq));
+	if (req && !req->wait_for_ack) {
+		l_queue_remove(stats->pending, req);
+		stats_complete_request(stats, req, now);
+	}
+}
+
+static void print_usec(const char *label, uint64_t usec)
+{
+	printf("%19s %" PRIu64 ".%03" PRIu64 " ms\n", label,
+					usec / 1000, usec % 1000);
+}
+
+void analyze_stats_print(struct analyze_stats *stats)
+{
+	unsigned int i;
+
+	printf("  nl80211 commands:\n");
+	printf("  %-32s %8s %8s %8s %12s %12s\n", "Command", "Messages",
+				"Requests", "Replies", "Avg (us)", "Max (us)");
+
+	for (i = 0; i < L_ARRAY_SIZE(stats->cmds); i++) {
+		const struct cmd_stats *cmd = &stats->cmds[i];
+
+		if (!cmd->count)
+			continue;
+
+		printf("  %-32s %8" PRIu64 " %8" PRIu64 " %8" PRIu64,
+				nl80211cmd_to_string(i), cmd->count,
+				cmd->requests, cmd->completed);
+
+		if (cmd->completed)
+			printf(" %12" PRIu64 " %12" PRIu64 "\n",
+				cmd->total_usec / cmd->completed,
+				cmd->max_usec);
+		else
+			printf(" %12s %12s\n", "-", "-");
+	}
+
+	printf("\n");
+	printf("  Request latency:\n");
+
+	for (i = 0; i < L_ARRAY_SIZE(latency_buckets); i++)
+		printf("%19s %" PRIu64 "\n", latency_buckets[i].label,
+							stats->histogram[i]);
+
+	printf("%19s %u\n", "Unanswered", l_queue_length(stats->pending));
+	printf("\n");
+	printf("%19s %" PRIu64 "\n", "Completed scans:", stats->scan_count);
+	printf("%19s %" PRIu64 "\n", "Aborted scans:", stats->scan_aborted);
+
+	if (stats->scan_count) {
+		print_usec("Min scan duration:", stats->scan_min_usec);
+		print_usec("Avg scan duration:",
+				stats->scan_total_usec / stats->scan_count);
+		print_usec("Max scan duration:", stats->scan_max_usec);
+	}
+
+	printf("\n");
+}
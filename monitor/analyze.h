@@ -0,0 +1,56 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2013-2019  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+struct nlmsghdr;
+
+struct analyze_filter {
+	bool active;
+	bool eapol_only;
+	int cmd;			/* nl80211 command, -1 for any */
+	int subtype;			/* Management frame subtype, -1 for any */
+	uint32_t ifindex;		/* 0 for any */
+	bool has_addr;
+	uint8_t addr[6];
+};
+
+void analyze_filter_init(struct analyze_filter *filter);
+bool analyze_filter_set_cmd(struct analyze_filter *filter, const char *str);
+
+bool analyze_filter_match_pae(const struct analyze_filter *filter);
+bool analyze_filter_match_genl(const struct analyze_filter *filter,
+					uint16_t nl80211_family,
+					const struct nlmsghdr *nlmsg);
+
+uint16_t analyze_nl80211_family(const struct nlmsghdr *nlmsg);
+
+struct analyze_stats;
+
+struct analyze_stats *analyze_stats_new(void);
+void analyze_stats_free(struct analyze_stats *stats);
+void analyze_stats_genl(struct analyze_stats *stats, const struct timeval *tv,
+					uint16_t nl80211_family,
+					const struct nlmsghdr *nlmsg);
+void analyze_stats_print(struct analyze_stats *stats);
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
@@ -43,9 +44,11 @@
 #endif
 
 #include "linux/nl80211.h"
+#include "src/util.h"
 #include "monitor/nlmon.h"
 #include "monitor/pcap.h"
 #include "monitor/display.h"
+#include "monitor/analyze.h"
 
 #define MAX_SNAPLEN (1024 * 16)
 
@@ -53,6 +56,12 @@ static struct nlmon *nlmon = NULL;
 static const char *writer_path = NULL;
 static struct l_timeout *timeout = NULL;
 static struct nlmon_config config;
+static struct analyze_filter filter;
+static struct pcap_write_config pcap_config = {
+	.buffer_size = 64 * 1024,
+	.flush_interval = 1,
+	.rotate_count = 4,
+};
 
 #define NLA_OK(nla,len)         ((len) >= (int) sizeof(struct nlattr) && \
 				(nla)->nla_len >= sizeof(struct nlattr) && \
@@ -404,9 +413,11 @@ static void iwmon_interface_lookup(struct iwmon_interface *monitor_interface)
 						iwmon_interface_lookup_done);
 }
 
-static int analyze_pcap(const char *pathname)
+static int analyze_pcap(const char *pathname, uint16_t id)
 {
 	struct l_queue *genl_list;
+	struct analyze_stats *stats;
+	uint16_t nl80211_family = id;
 	const struct l_queue_entry *genl_entry;
 	struct pcap *pcap;
 	struct timeval tv;
@@ -448,6 +459,7 @@ static int analyze_pcap(const char *pathname)
 	}
 
 	genl_list = l_queue_new();
+	stats = analyze_stats_new();
 
 	while (pcap_read(pcap, &tv, buf, snaplen, &len, &real_len)) {
 		struct nlmsghdr *nlmsg;
@@ -513,6 +525,22 @@ static int analyze_pcap(const char *pathname)
 					l_queue_push_tail(genl_list,
 							L_UINT_TO_PTR(type));
 				}
+
+				if (type == GENL_ID_CTRL) {
+					uint16_t family =
+						analyze_nl80211_family(nlmsg);
+
+					if (family)
+						nl80211_family = family;
+				}
+
+				/* Replies are matched against filtered requests */
+				if (type < NLMSG_MIN_TYPE ||
+						analyze_filter_match_genl(&filter,
+							nl80211_family, nlmsg))
+					analyze_stats_genl(stats, &tv,
+							nl80211_family, nlmsg);
+
 				msg_genl++;
 				break;
 			}
@@ -557,6 +585,9 @@ static int analyze_pcap(const char *pathname)
 	}
 	printf("\n");
 
+	analyze_stats_print(stats);
+	analyze_stats_free(stats);
+
 	l_queue_destroy(genl_list, NULL);
 
 	free(buf);
@@ -569,12 +600,40 @@ done:
 	return exit_status;
 }
 
+/*
+ * Only pass the messages matching the filter on to the decoder.  The
+ * filter looks at a handful of top-level attributes, which is much cheaper
+ * than decoding and printing messages that would be thrown away anyway.
+ */
+static void process_genl_filtered(struct nlmon *nlmon,
+					const struct timeval *tv,
+					uint16_t *nl80211_family,
+					const void *data, uint32_t size)
+{
+	const struct nlmsghdr *nlmsg;
+
+	for (nlmsg = data; NLMSG_OK(nlmsg, size);
+				nlmsg = NLMSG_NEXT(nlmsg, size)) {
+		uint16_t family = analyze_nl80211_family(nlmsg);
+
+		if (family)
+			*nl80211_family = family;
+
+		if (!analyze_filter_match_genl(&filter, *nl80211_family,
+								nlmsg))
+			continue;
+
+		nlmon_print_genl(nlmon, tv, nlmsg, nlmsg->nlmsg_len);
+	}
+}
+
 static int process_pcap(struct pcap *pcap, uint16_t id)
 {
 	struct nlmon *nlmon = NULL;
 	struct timeval tv;
 	uint8_t *buf;
 	uint32_t snaplen, len, real_len;
+	uint16_t nl80211_family = id;
 
 	snaplen = pcap_get_snaplen(pcap);
 	if (snaplen > MAX_SNAPLEN)
@@ -586,7 +645,7 @@ static int process_pcap(struct pcap *pcap, uint16_t id)
 		return EXIT_FAILURE;
 	}
 
-	nlmon = nlmon_create(id);
+	nlmon = nlmon_create(id, &config);
 
 	while (pcap_read(pcap, &tv, buf, snaplen, &len, &real_len)) {
 		uint16_t arphrd_type;
@@ -611,6 +670,10 @@ static int process_pcap(struct pcap *pcap, uint16_t id)
 		case ARPHRD_ETHER:
 			switch (proto_type) {
 			case ETH_P_PAE:
+				if (filter.active &&
+					!analyze_filter_match_pae(&filter))
+					break;
+
 				nlmon_print_pae(nlmon, &tv, pkt_type, -1,
 							buf + 16, len - 16);
 				break;
@@ -619,10 +682,20 @@ static int process_pcap(struct pcap *pcap, uint16_t id)
 		case ARPHRD_NETLINK:
 			switch (proto_type) {
 			case NETLINK_ROUTE:
+				if (filter.active)
+					break;
+
 				nlmon_print_rtnl(nlmon, &tv,
 							buf + 16, len - 16);
 				break;
 			case NETLINK_GENERIC:
+				if (filter.active) {
+					process_genl_filtered(nlmon, &tv,
+							&nl80211_family,
+							buf + 16, len - 16);
+					break;
+				}
+
 				nlmon_print_genl(nlmon, &tv,
 							buf + 16, len - 16);
 				break;
@@ -658,6 +731,23 @@ static void signal_handler(uint32_t signo, void *user_data)
 	}
 }
 
+static bool parse_count(const char *str, unsigned int *out)
+{
+	char *endp;
+	unsigned long value;
+
+	if (!isdigit(str[0]))
+		return false;
+
+	errno = 0;
+	value = strtoul(str, &endp, 10);
+	if (*endp != '\0' || errno || value > UINT_MAX)
+		return false;
+
+	*out = value;
+	return true;
+}
+
 static void usage(void)
 {
 	printf("iwmon - Wireless monitor\n"
@@ -666,25 +756,54 @@ static void usage(void)
 	printf("Options:\n"
 		"\t-r, --read <file>      Read netlink PCAP trace file\n"
 		"\t-w, --write <file>     Write netlink PCAP trace file\n"
+		"\t-b, --buffer <kbytes>  Buffer writes, 0 disables (64)\n"
+		"\t-f, --flush <seconds>  Flush the write buffer interval (1)\n"
+		"\t-R, --rotate-size <megabytes>\n"
+		"\t                       Rotate the trace file at this size\n"
+		"\t-T, --rotate-time <seconds>\n"
+		"\t                       Rotate the trace file at this age\n"
+		"\t-C, --rotate-count <n> Rotated trace files to keep (4)\n"
+		"\t-g, --pcapng           Write pcapng instead of pcap\n"
 		"\t-a, --analyze <file>   Analyze netlink PCAP trace file\n"
+		"\t-c, --cmd <cmd>        Only nl80211 command, by name or number\n"
+		"\t-I, --ifindex <index>  Only messages for interface index\n"
+		"\t-m, --addr <address>   Only messages for MAC address\n"
+		"\t-t, --subtype <n>      Only management frames of subtype\n"
+		"\t-E, --eapol            Only EAPoL frames\n"
 		"\t-i, --interface <dev>  Use specified netlink monitor\n"
 		"\t-n, --nortnl           Don't show RTNL output\n"
 		"\t-y, --nowiphy          Don't show 'New Wiphy' output\n"
 		"\t-s, --noscan           Don't show scan result output\n"
 		"\t-e, --noies            Don't show IEs except SSID\n"
+		"\t-u, --summary          Show one line per message\n"
+		"\t-S, --stats[=seconds]  Only show nl80211 latency statistics\n"
+		"\t                       at the given interval (10)\n"
 		"\t-h, --help             Show help options\n");
 }
 
 static const struct option main_options[] = {
 	{ "read",      required_argument, NULL, 'r' },
 	{ "write",     required_argument, NULL, 'w' },
+	{ "buffer",    required_argument, NULL, 'b' },
+	{ "flush",     required_argument, NULL, 'f' },
+	{ "rotate-size",  required_argument, NULL, 'R' },
+	{ "rotate-time",  required_argument, NULL, 'T' },
+	{ "rotate-count", required_argument, NULL, 'C' },
+	{ "pcapng",    no_argument,       NULL, 'g' },
 	{ "analyze",   required_argument, NULL, 'a' },
+	{ "cmd",       required_argument, NULL, 'c' },
+	{ "ifindex",   required_argument, NULL, 'I' },
+	{ "addr",      required_argument, NULL, 'm' },
+	{ "subtype",   required_argument, NULL, 't' },
+	{ "eapol",     no_argument,       NULL, 'E' },
 	{ "nl80211",   required_argument, NULL, 'F' },
 	{ "interface", required_argument, NULL, 'i' },
 	{ "nortnl",    no_argument,       NULL, 'n' },
 	{ "nowiphy",   no_argument,       NULL, 'y' },
 	{ "noscan",    no_argument,       NULL, 's' },
 	{ "noies",     no_argument,       NULL, 'e' },
+	{ "summary",   no_argument,       NULL, 'u' },
+	{ "stats",     optional_argument, NULL, 'S' },
 	{ "version",   no_argument,       NULL, 'v' },
 	{ "help",      no_argument,       NULL, 'h' },
 	{ }
@@ -698,10 +817,13 @@ int main(int argc, char *argv[])
 	uint16_t nl80211_family = 0;
 	int exit_status;
 
+	analyze_filter_init(&filter);
+
 	for (;;) {
+		unsigned int value;
 		int opt;
 
-		opt = getopt_long(argc, argv, "r:w:a:F:i:nvhys",
+		opt = getopt_long(argc, argv, "r:w:b:f:R:T:C:ga:c:I:m:t:EF:i:S::nvhysu",
 						main_options, NULL);
 		if (opt < 0)
 			break;
@@ -713,9 +835,81 @@ int main(int argc, char *argv[])
 		case 'w':
 			writer_path = optarg;
 			break;
+		case 'b':
+			if (!parse_count(optarg, &value) || value > 65536) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			pcap_config.buffer_size = value * 1024;
+			break;
+		case 'f':
+			if (!parse_count(optarg, &value)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			pcap_config.flush_interval = value;
+			break;
+		case 'R':
+			if (!parse_count(optarg, &value)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			pcap_config.rotate_size = (uint64_t) value * 1024 * 1024;
+			break;
+		case 'T':
+			if (!parse_count(optarg, &value)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			pcap_config.rotate_interval = value;
+			break;
+		case 'C':
+			if (!parse_count(optarg, &value) || !value) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			pcap_config.rotate_count = value;
+			break;
+		case 'g':
+			pcap_config.pcapng = true;
+			break;
 		case 'a':
 			analyze_path = optarg;
 			break;
+		case 'c':
+			if (!analyze_filter_set_cmd(&filter, optarg)) {
+				fprintf(stderr, "Unknown command %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'I':
+			if (!parse_count(optarg, &value) || !value) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			filter.ifindex = value;
+			filter.active = true;
+			break;
+		case 'm':
+			if (!util_string_to_address(optarg, filter.addr)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			filter.has_addr = true;
+			filter.active = true;
+			break;
+		case 't':
+			if (!parse_count(optarg, &value) || value > 15) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			filter.subtype = value;
+			filter.active = true;
+			break;
+		case 'E':
+			filter.eapol_only = true;
+			filter.active = true;
+			break;
 		case 'F':
 			if (strlen(optarg) > 3) {
 				if (!strncasecmp(optarg, "0x", 2) &&
@@ -751,6 +945,20 @@ int main(int argc, char *argv[])
 		case 'e':
 			config.noies = true;
 			break;
+		case 'u':
+			config.summary = true;
+			break;
+		case 'S':
+			config.stats_interval = 10;
+
+			if (optarg && (!parse_count(optarg, &value) || !value)) {
+				usage();
+				return EXIT_FAILURE;
+			}
+
+			if (optarg)
+				config.stats_interval = value;
+			break;
 		case 'v':
 			printf("%s\n", VERSION);
 			return EXIT_SUCCESS;
@@ -772,13 +980,15 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+	config.pcap_config = &pcap_config;
+
 	if (!l_main_init())
 		return EXIT_FAILURE;
 
 	printf("Wireless monitor ver %s\n", VERSION);
 
 	if (analyze_path) {
-		exit_status = analyze_pcap(analyze_path);
+		exit_status = analyze_pcap(analyze_path, nl80211_family);
 		goto done;
 	}
 
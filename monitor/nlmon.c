@@ -30,6 +30,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <net/ethernet.h>
@@ -94,16 +95,30 @@ enum msg_type {
 	MSG_EVENT,
 };
 
+struct nlmon_ring;
+
 struct nlmon {
 	uint16_t id;
 	struct l_io *io;
 	struct l_io *pae_io;
+	struct nlmon_ring *ring;
+	struct nlmon_ring *pae_ring;
 	struct l_queue *req_list;
 	struct pcap *pcap;
+	uint32_t pcap_nl_iface;
+	uint32_t pcap_pae_iface;
+	struct timespec ts;		/* Kernel timestamp of current packet */
+	bool has_ts;
+	uint64_t kernel_packets;
+	uint64_t kernel_drops;
+	unsigned int stats_interval;
+	struct l_queue *stats;
+	struct l_timeout *stats_timeout;
 	bool nortnl;
 	bool nowiphy;
 	bool noscan;
 	bool noies;
+	bool summary;
 };
 
 struct nlmon_req {
@@ -112,6 +127,23 @@ struct nlmon_req {
 	uint16_t flags;
 	uint8_t cmd;
 	uint8_t version;
+	uint32_t ifindex;
+	uint64_t time;
+};
+
+/*
+ * Latencies are kept in log-linear buckets, four per power of two, which
+ * bounds the percentile error to 25% at constant memory and cost per reply.
+ */
+#define LATENCY_BUCKETS		256
+
+struct nlmon_cmd_stats {
+	uint8_t cmd;
+	uint32_t ifindex;
+	uint32_t events;
+	uint32_t replies;
+	uint64_t max_usec;
+	uint32_t histogram[LATENCY_BUCKETS];
 };
 
 typedef void (*attr_func_t) (unsigned int level, const char *label,
@@ -149,6 +181,19 @@ struct attr_entry {
 static void print_attributes(int indent, const struct attr_entry *table,
 						const void *buf, uint32_t len);
 
+/*
+ * Direct lookup tables for the attribute tables, built the first time each
+ * one is used.  The larger tables have hundreds of entries and scan dumps
+ * carry dozens of attributes per BSS, so walking them linearly for every
+ * attribute dominated the decoding time.
+ */
+struct attr_index {
+	uint16_t size;
+	const struct attr_entry *entries[];
+};
+
+static struct l_hashmap *attr_indexes;
+
 struct flag_names {
 	uint16_t flag;
 	const char *name;
@@ -6119,12 +6164,51 @@ static void print_array(int indent, enum attr_type type,
 	}
 }
 
+static const struct attr_index *attr_index_get(
+					const struct attr_entry *table)
+{
+	struct attr_index *index;
+	uint16_t size = 0;
+	unsigned int i;
+
+	if (!attr_indexes)
+		attr_indexes = l_hashmap_new();
+
+	index = l_hashmap_lookup(attr_indexes, table);
+	if (index)
+		return index;
+
+	for (i = 0; table[i].str; i++)
+		if (table[i].attr >= size)
+			size = table[i].attr + 1;
+
+	index = l_malloc(sizeof(struct attr_index) +
+					size * sizeof(struct attr_entry *));
+	index->size = size;
+	memset(index->entries, 0, size * sizeof(struct attr_entry *));
+
+	/* Keep the first entry for an attribute, as the linear walk did */
+	for (i = 0; table[i].str; i++)
+		if (!index->entries[table[i].attr])
+			index->entries[table[i].attr] = &table[i];
+
+	l_hashmap_insert(attr_indexes, table, index);
+
+	return index;
+}
+
+static void attr_indexes_free(void)
+{
+	l_hashmap_destroy(attr_indexes, l_free);
+	attr_indexes = NULL;
+}
+
 static void print_attributes(int indent, const struct attr_entry *table,
 						const void *buf, uint32_t len)
 {
+	const struct attr_index *index = table ? attr_index_get(table) : NULL;
 	const struct nlattr *nla;
 	const char *str;
-	int i;
 
 	for (nla = buf ; NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
 		uint16_t nla_type = nla->nla_type & NLA_TYPE_MASK;
@@ -6146,17 +6230,16 @@ static void print_attributes(int indent, const struct attr_entry *table,
 		array_type = ATTR_UNSPEC;
 		nested = NULL;
 
-		if (table) {
-			for (i = 0; table[i].str; i++) {
-				if (nla_type == table[i].attr) {
-					str = table[i].str;
-					type = table[i].type;
-					nested = table[i].nested;
-					array_type = table[i].array_type;
-					function = table[i].function;
-					break;
-				}
-			}
+		if (index && nla_type < index->size &&
+						index->entries[nla_type]) {
+			const struct attr_entry *entry =
+						index->entries[nla_type];
+
+			str = entry->str;
+			type = entry->type;
+			nested = entry->nested;
+			array_type = entry->array_type;
+			function = entry->function;
 		}
 
 		switch (type) {
@@ -6366,18 +6449,95 @@ static void netlink_str(char *str, size_t size,
 	}
 }
 
+static const char *msg_type_to_string(enum msg_type type)
+{
+	switch (type) {
+	case MSG_REQUEST:
+		return "Request";
+	case MSG_RESPONSE:
+		return "Response";
+	case MSG_COMPLETE:
+		return "Complete";
+	case MSG_RESULT:
+		return "Result";
+	case MSG_EVENT:
+		return "Event";
+	}
+
+	return "";
+}
+
+/*
+ * Append the attributes identifying what a message is about, without
+ * decoding the rest of it, for the one line per message summary mode.
+ */
+static void summary_str(char *str, size_t size, const void *data,
+								uint32_t len)
+{
+	const struct nlattr *nla;
+	size_t pos = strlen(str);
+	int n;
+
+	for (nla = data; NLA_OK(nla, len) && pos < size;
+						nla = NLA_NEXT(nla, len)) {
+		const uint8_t *addr = NLA_DATA(nla);
+
+		switch (nla->nla_type & NLA_TYPE_MASK) {
+		case NL80211_ATTR_WIPHY:
+			if (NLA_PAYLOAD(nla) != 4)
+				continue;
+
+			n = snprintf(str + pos, size - pos, " wiphy %u",
+						*((uint32_t *) NLA_DATA(nla)));
+			break;
+		case NL80211_ATTR_IFINDEX:
+			if (NLA_PAYLOAD(nla) != 4)
+				continue;
+
+			n = snprintf(str + pos, size - pos, " ifindex %u",
+						*((uint32_t *) NLA_DATA(nla)));
+			break;
+		case NL80211_ATTR_WDEV:
+			if (NLA_PAYLOAD(nla) != 8)
+				continue;
+
+			n = snprintf(str + pos, size - pos, " wdev %"PRIu64,
+						*((uint64_t *) NLA_DATA(nla)));
+			break;
+		case NL80211_ATTR_MAC:
+			if (NLA_PAYLOAD(nla) != 6)
+				continue;
+
+			n = snprintf(str + pos, size - pos,
+					" %02X:%02X:%02X:%02X:%02X:%02X",
+					addr[0], addr[1], addr[2],
+					addr[3], addr[4], addr[5]);
+			break;
+		default:
+			continue;
+		}
+
+		if (n > 0)
+			pos += n;
+	}
+}
+
 static void print_message(struct nlmon *nlmon, const struct timeval *tv,
 						enum msg_type type,
 						uint16_t flags, int status,
 						uint8_t cmd, uint8_t version,
 						const void *data, uint32_t len)
 {
-	char extra_str[64];
-	const char *label = "";
+	char extra_str[128];
+	const char *label;
 	const char *color = COLOR_OFF;
 	const char *cmd_str;
 	bool out = false;
 
+	/* Only the periodic statistics are printed in statistics mode */
+	if (nlmon->stats)
+		return;
+
 	if (nlmon->nowiphy && (cmd == NL80211_CMD_NEW_WIPHY))
 		return;
 
@@ -6387,32 +6547,50 @@ static void print_message(struct nlmon *nlmon, const struct timeval *tv,
 
 	switch (type) {
 	case MSG_REQUEST:
-		label = "Request";
 		color = COLOR_REQUEST;
 		out = true;
 		break;
 	case MSG_RESPONSE:
-		label = "Response";
 		color = COLOR_RESPONSE;
 		break;
 	case MSG_COMPLETE:
-		label = "Complete";
 		color = COLOR_COMPLETE;
 		break;
 	case MSG_RESULT:
-		label = "Result";
 		color = COLOR_RESULT;
 		break;
 	case MSG_EVENT:
-		label = "Event";
 		color = COLOR_EVENT;
 		break;
 	}
 
+	label = msg_type_to_string(type);
+
 	cmd_str = nl80211cmd_to_string(cmd);
 
 	netlink_str(extra_str, sizeof(extra_str), cmd, flags, len);
 
+	if (nlmon->summary) {
+		switch (type) {
+		case MSG_REQUEST:
+		case MSG_RESULT:
+		case MSG_EVENT:
+			summary_str(extra_str, sizeof(extra_str), data, len);
+			break;
+		case MSG_RESPONSE:
+		case MSG_COMPLETE:
+			if (status)
+				snprintf(extra_str + strlen(extra_str),
+					sizeof(extra_str) - strlen(extra_str),
+					" status %d", status);
+			break;
+		}
+
+		print_packet(tv, out ? '<' : '>', color, label, cmd_str,
+								extra_str);
+		return;
+	}
+
 	print_packet(tv, out ? '<' : '>', color, label, cmd_str, extra_str);
 
 	switch (type) {
@@ -6457,13 +6635,203 @@ static bool nlmon_req_match(const void *a, const void *b)
 	return (req->seq == match->seq && req->pid == match->pid);
 }
 
+static unsigned int latency_bucket(uint64_t usec)
+{
+	unsigned int msb;
+
+	if (usec < 4)
+		return usec;
+
+	msb = 63 - __builtin_clzll(usec);
+
+	return msb * 4 + ((usec >> (msb - 2)) & 3) - 4;
+}
+
+/* Upper bound of the values falling into a bucket */
+static uint64_t latency_bucket_max(unsigned int bucket)
+{
+	unsigned int msb;
+	unsigned int frac;
+
+	if (bucket < 4)
+		return bucket;
+
+	msb = (bucket + 4) / 4;
+	frac = (bucket + 4) % 4;
+
+	return ((uint64_t) (4 + frac + 1) << (msb - 2)) - 1;
+}
+
+static uint64_t timeval_to_usec(const struct timeval *tv)
+{
+	if (!tv)
+		return l_time_now();
+
+	return tv->tv_sec * L_USEC_PER_SEC + tv->tv_usec;
+}
+
+static uint32_t genl_get_ifindex(const struct nlmsghdr *nlmsg)
+{
+	const struct nlattr *nla;
+	int len = NLMSG_PAYLOAD(nlmsg, GENL_HDRLEN);
+
+	for (nla = NLMSG_DATA(nlmsg) + GENL_HDRLEN; NLA_OK(nla, len);
+						nla = NLA_NEXT(nla, len)) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == NL80211_ATTR_IFINDEX &&
+						NLA_PAYLOAD(nla) == 4)
+			return l_get_u32(NLA_DATA(nla));
+	}
+
+	return 0;
+}
+
+static int cmd_stats_compare(const void *a, const void *b, void *user_data)
+{
+	const struct nlmon_cmd_stats *new = a;
+	const struct nlmon_cmd_stats *entry = b;
+
+	if (new->cmd != entry->cmd)
+		return new->cmd < entry->cmd ? -1 : 1;
+
+	return new->ifindex < entry->ifindex ? -1 : 1;
+}
+
+static struct nlmon_cmd_stats *nlmon_cmd_stats_get(struct nlmon *nlmon,
+							uint8_t cmd,
+							uint32_t ifindex)
+{
+	const struct l_queue_entry *entry;
+	struct nlmon_cmd_stats *stats;
+
+	for (entry = l_queue_get_entries(nlmon->stats); entry;
+						entry = entry->next) {
+		stats = entry->data;
+
+		if (stats->cmd == cmd && stats->ifindex == ifindex)
+			return stats;
+	}
+
+	stats = l_new(struct nlmon_cmd_stats, 1);
+	stats->cmd = cmd;
+	stats->ifindex = ifindex;
+	l_queue_insert(nlmon->stats, stats, cmd_stats_compare, NULL);
+
+	return stats;
+}
+
+static void nlmon_stats_reply(struct nlmon *nlmon, const struct nlmon_req *req,
+					const struct timeval *tv)
+{
+	struct nlmon_cmd_stats *stats;
+	uint64_t now = timeval_to_usec(tv);
+	uint64_t latency = now > req->time ? now - req->time : 0;
+
+	if (!nlmon->stats)
+		return;
+
+	stats = nlmon_cmd_stats_get(nlmon, req->cmd, req->ifindex);
+	stats->replies++;
+	stats->histogram[latency_bucket(latency)]++;
+
+	if (latency > stats->max_usec)
+		stats->max_usec = latency;
+}
+
+static void nlmon_stats_event(struct nlmon *nlmon,
+					const struct nlmsghdr *nlmsg, uint8_t cmd)
+{
+	if (!nlmon->stats)
+		return;
+
+	nlmon_cmd_stats_get(nlmon, cmd, genl_get_ifindex(nlmsg))->events++;
+}
+
+static uint64_t cmd_stats_percentile(const struct nlmon_cmd_stats *stats,
+						unsigned int percent)
+{
+	uint64_t target = ((uint64_t) stats->replies * percent + 99) / 100;
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		count += stats->histogram[i];
+
+		if (count >= target)
+			break;
+	}
+
+	/* The top bucket is better described by the exact maximum */
+	if (latency_bucket_max(i) > stats->max_usec)
+		return stats->max_usec;
+
+	return latency_bucket_max(i);
+}
+
+static void nlmon_stats_print(struct nlmon *nlmon)
+{
+	const struct l_queue_entry *entry;
+
+	printf("%-28s %7s %7s %9s %9s %9s %9s %9s\n", "Command", "Ifindex",
+			"Replies", "p50 (us)", "p90 (us)", "p99 (us)",
+			"Max (us)", "Events/s");
+
+	for (entry = l_queue_get_entries(nlmon->stats); entry;
+						entry = entry->next) {
+		struct nlmon_cmd_stats *stats = entry->data;
+		char ifindex[11] = "-";
+
+		if (!stats->replies && !stats->events)
+			continue;
+
+		if (stats->ifindex)
+			snprintf(ifindex, sizeof(ifindex), "%u",
+							stats->ifindex);
+
+		printf("%-28s %7s %7u", nl80211cmd_to_string(stats->cmd),
+						ifindex, stats->replies);
+
+		if (stats->replies)
+			printf(" %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+					" %9" PRIu64,
+					cmd_stats_percentile(stats, 50),
+					cmd_stats_percentile(stats, 90),
+					cmd_stats_percentile(stats, 99),
+					stats->max_usec);
+		else
+			printf(" %9s %9s %9s %9s", "-", "-", "-", "-");
+
+		printf(" %9.1f\n", (double) stats->events /
+						nlmon->stats_interval);
+
+		/* Each report only covers its own interval */
+		stats->events = 0;
+		stats->replies = 0;
+		stats->max_usec = 0;
+		memset(stats->histogram, 0, sizeof(stats->histogram));
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static void nlmon_stats_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct nlmon *nlmon = user_data;
+
+	nlmon_stats_print(nlmon);
+
+	l_timeout_modify(timeout, nlmon->stats_interval);
+}
+
 static void store_packet(struct nlmon *nlmon, const struct timeval *tv,
+					uint32_t interface, const char *comment,
 					uint16_t pkt_type,
 					uint16_t arphrd_type,
 					uint16_t proto_type,
 					const void *data, uint32_t size)
 {
 	uint8_t sll_hdr[16], *buf = sll_hdr;
+	struct timespec ts;
 
 	if (!nlmon->pcap)
 		return;
@@ -6474,21 +6842,43 @@ static void store_packet(struct nlmon *nlmon, const struct timeval *tv,
 	l_put_be16(arphrd_type, buf + 2);
 	l_put_be16(proto_type, buf + 14);
 
-	pcap_write(nlmon->pcap, tv, &sll_hdr, sizeof(sll_hdr), data, size);
+	/* Prefer the nanosecond kernel timestamp of the current packet */
+	if (nlmon->has_ts)
+		ts = nlmon->ts;
+	else if (tv) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+	}
+
+	pcap_write_ts(nlmon->pcap, (nlmon->has_ts || tv) ? &ts : NULL,
+			interface, comment, &sll_hdr, sizeof(sll_hdr),
+			data, size);
 }
 
 static void store_netlink(struct nlmon *nlmon, const struct timeval *tv,
 					uint16_t proto_type,
-					const struct nlmsghdr *nlmsg)
+					const struct nlmsghdr *nlmsg,
+					const char *comment)
 {
-	store_packet(nlmon, tv, PACKET_HOST, ARPHRD_NETLINK, proto_type,
-						nlmsg, nlmsg->nlmsg_len);
+	store_packet(nlmon, tv, nlmon->pcap_nl_iface, comment, PACKET_HOST,
+				ARPHRD_NETLINK, proto_type,
+				nlmsg, nlmsg->nlmsg_len);
 }
 
 static void store_message(struct nlmon *nlmon, const struct timeval *tv,
-					const struct nlmsghdr *nlmsg)
+					const struct nlmsghdr *nlmsg,
+					enum msg_type type, uint8_t cmd)
 {
-	store_netlink(nlmon, tv, NETLINK_GENERIC, nlmsg);
+	char comment[64];
+
+	if (!nlmon->pcap)
+		return;
+
+	/* Decoded command names show up in pcapng packet comments */
+	snprintf(comment, sizeof(comment), "%s: %s", msg_type_to_string(type),
+						nl80211cmd_to_string(cmd));
+
+	store_netlink(nlmon, tv, NETLINK_GENERIC, nlmsg, comment);
 }
 
 static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
@@ -6524,7 +6914,8 @@ static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
 				return;
 			}
 
-			store_message(nlmon, tv, nlmsg);
+			store_message(nlmon, tv, nlmsg, type, req->cmd);
+			nlmon_stats_reply(nlmon, req, tv);
 			print_message(nlmon, tv, type, nlmsg->nlmsg_flags, status,
 						req->cmd, req->version,
 						NULL, sizeof(status));
@@ -6535,7 +6926,7 @@ static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
 
 	if (nlmsg->nlmsg_type != nlmon->id) {
 		if (nlmsg->nlmsg_type == GENL_ID_CTRL)
-			store_message(nlmon, tv, nlmsg);
+			store_netlink(nlmon, tv, NETLINK_GENERIC, nlmsg, NULL);
 		return;
 	}
 
@@ -6551,9 +6942,14 @@ static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
 		req->cmd = genlmsg->cmd;
 		req->version = genlmsg->version;
 
+		if (nlmon->stats) {
+			req->ifindex = genl_get_ifindex(nlmsg);
+			req->time = timeval_to_usec(tv);
+		}
+
 		l_queue_push_tail(nlmon->req_list, req);
 
-		store_message(nlmon, tv, nlmsg);
+		store_message(nlmon, tv, nlmsg, MSG_REQUEST, req->cmd);
 		print_message(nlmon, tv, MSG_REQUEST, flags, 0,
 					req->cmd, req->version,
 					NLMSG_DATA(nlmsg) + GENL_HDRLEN,
@@ -6570,13 +6966,15 @@ static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
 		req = l_queue_find(nlmon->req_list, nlmon_req_match, &match);
 		if (req) {
 			if (!(req->flags & NLM_F_ACK)) {
+				nlmon_stats_reply(nlmon, req, tv);
 				l_queue_remove(nlmon->req_list, req);
 				nlmon_req_free(req);
 			}
 			type = MSG_RESULT;
-		}
+		} else
+			nlmon_stats_event(nlmon, nlmsg, genlmsg->cmd);
 
-		store_message(nlmon, tv, nlmsg);
+		store_message(nlmon, tv, nlmsg, type, genlmsg->cmd);
 		print_message(nlmon, tv, type, nlmsg->nlmsg_flags, 0,
 					genlmsg->cmd, genlmsg->version,
 					NLMSG_DATA(nlmsg) + GENL_HDRLEN,
@@ -6584,7 +6982,7 @@ static void nlmon_message(struct nlmon *nlmon, const struct timeval *tv,
 	}
 }
 
-struct nlmon *nlmon_create(uint16_t id)
+struct nlmon *nlmon_create(uint16_t id, const struct nlmon_config *config)
 {
 	struct nlmon *nlmon;
 
@@ -6593,6 +6991,14 @@ struct nlmon *nlmon_create(uint16_t id)
 	nlmon->id = id;
 	nlmon->req_list = l_queue_new();
 
+	if (config) {
+		nlmon->nortnl = config->nortnl;
+		nlmon->nowiphy = config->nowiphy;
+		nlmon->noscan = config->noscan;
+		nlmon->noies = config->noies;
+		nlmon->summary = config->summary;
+	}
+
 	return nlmon;
 }
 
@@ -6604,6 +7010,8 @@ void nlmon_destroy(struct nlmon *nlmon)
 	l_queue_destroy(nlmon->req_list, nlmon_req_free);
 
 	l_free(nlmon);
+
+	attr_indexes_free();
 }
 
 static void genl_ctrl(struct nlmon *nlmon, const void *data, uint32_t len)
@@ -7300,7 +7708,7 @@ static const char *nlmsg_type_to_str(uint32_t msg_type)
 	return str;
 }
 
-static void print_nlmsghdr(const struct timeval *tv,
+static void print_nlmsg_line(const struct timeval *tv,
 						const struct nlmsghdr *nlmsg)
 {
 	char extra_str[256];
@@ -7314,6 +7722,12 @@ static void print_nlmsghdr(const struct timeval *tv,
 				nlmsg->nlmsg_flags, NLMSG_PAYLOAD(nlmsg, 0));
 
 	print_packet(tv, out ? '<' : '>', COLOR_YELLOW, "RTNL", str, extra_str);
+}
+
+static void print_nlmsghdr(const struct timeval *tv,
+						const struct nlmsghdr *nlmsg)
+{
+	print_nlmsg_line(tv, nlmsg);
 
 	print_field("Flags: %hu (0x%03x)", nlmsg->nlmsg_flags,
 							nlmsg->nlmsg_flags);
@@ -7418,6 +7832,11 @@ void nlmon_print_rtnl(struct nlmon *nlmon, const struct timeval *tv,
 
 	for (nlmsg = data; NLMSG_OK(nlmsg, aligned_size);
 				nlmsg = NLMSG_NEXT(nlmsg, aligned_size)) {
+		if (nlmon->summary) {
+			print_nlmsg_line(tv, nlmsg);
+			continue;
+		}
+
 		switch (nlmsg->nlmsg_type) {
 		case NLMSG_NOOP:
 		case NLMSG_OVERRUN:
@@ -7459,10 +7878,35 @@ void nlmon_print_genl(struct nlmon *nlmon, const struct timeval *tv,
 	}
 }
 
+static void nlmon_netlink_packet(struct nlmon *nlmon,
+					const struct timeval *tv,
+					const struct tpacket_auxdata *tp,
+					uint16_t proto_type,
+					const void *data, uint32_t size)
+{
+	const struct nlmsghdr *nlmsg;
+	int nlmsg_len = size;
+
+	for (nlmsg = data; NLMSG_OK(nlmsg, nlmsg_len);
+				nlmsg = NLMSG_NEXT(nlmsg, nlmsg_len)) {
+		switch (proto_type) {
+		case NETLINK_ROUTE:
+			store_netlink(nlmon, tv, proto_type, nlmsg, NULL);
+
+			if (!nlmon->nortnl && !nlmon->stats)
+				nlmon_print_rtnl(nlmon, tv, nlmsg,
+							nlmsg->nlmsg_len);
+			break;
+		case NETLINK_GENERIC:
+			nlmon_message(nlmon, tv, tp, nlmsg);
+			break;
+		}
+	}
+}
+
 static bool nlmon_receive(struct l_io *io, void *user_data)
 {
 	struct nlmon *nlmon = user_data;
-	struct nlmsghdr *nlmsg;
 	struct msghdr msg;
 	struct sockaddr_ll sll;
 	struct iovec iov;
@@ -7475,7 +7919,6 @@ static bool nlmon_receive(struct l_io *io, void *user_data)
 	unsigned char buf[8192];
 	unsigned char control[32];
 	ssize_t bytes_read;
-	int nlmsg_len;
 	int fd;
 
 	fd = l_io_get_fd(io);
@@ -7509,11 +7952,17 @@ static bool nlmon_receive(struct l_io *io, void *user_data)
 
 	proto_type = ntohs(sll.sll_protocol);
 
+	nlmon->has_ts = false;
+
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
 				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 		if (cmsg->cmsg_level == SOL_SOCKET &&
-					cmsg->cmsg_type == SCM_TIMESTAMP) {
-			memcpy(&copy_tv, CMSG_DATA(cmsg), sizeof(copy_tv));
+					cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&nlmon->ts, CMSG_DATA(cmsg), sizeof(nlmon->ts));
+			nlmon->has_ts = true;
+
+			copy_tv.tv_sec = nlmon->ts.tv_sec;
+			copy_tv.tv_usec = nlmon->ts.tv_nsec / 1000;
 			tv = &copy_tv;
 		}
 
@@ -7524,23 +7973,7 @@ static bool nlmon_receive(struct l_io *io, void *user_data)
 		}
 	}
 
-	nlmsg_len = bytes_read;
-
-	for (nlmsg = iov.iov_base; NLMSG_OK(nlmsg, nlmsg_len);
-				nlmsg = NLMSG_NEXT(nlmsg, nlmsg_len)) {
-		switch (proto_type) {
-		case NETLINK_ROUTE:
-			store_netlink(nlmon, tv, proto_type, nlmsg);
-
-			if (!nlmon->nortnl)
-				nlmon_print_rtnl(nlmon, tv, nlmsg,
-							nlmsg->nlmsg_len);
-			break;
-		case NETLINK_GENERIC:
-			nlmon_message(nlmon, tv, tp, nlmsg);
-			break;
-		}
-	}
+	nlmon_netlink_packet(nlmon, tv, tp, proto_type, buf, bytes_read);
 
 	return true;
 }
@@ -7613,7 +8046,8 @@ static struct l_io *open_packet(const char *name)
 		return NULL;
 	}
 
-	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt)) < 0) {
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+						&opt, sizeof(opt)) < 0) {
 		perror("Failed to enable monitor timestamps");
 		close(fd);
 		return NULL;
@@ -7632,12 +8066,18 @@ void nlmon_print_pae(struct nlmon *nlmon, const struct timeval *tv,
 {
 	char extra_str[16];
 
+	if (nlmon->stats)
+		return;
+
 	update_time_offset(tv);
 
 	sprintf(extra_str, "len %u", size);
 
 	print_packet(tv, (type == PACKET_HOST) ? '>' : '<',
 					COLOR_YELLOW, "PAE", extra_str, "");
+	if (nlmon->summary)
+		return;
+
 	if (index >= 0)
 		print_attr(0, "Interface Index: %u", index);
 
@@ -7687,17 +8127,24 @@ static bool pae_receive(struct l_io *io, void *user_data)
 	if (sll.sll_hatype != ARPHRD_ETHER)
 		return true;
 
+	nlmon->has_ts = false;
+
 	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
 				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
 		if (cmsg->cmsg_level == SOL_SOCKET &&
-					cmsg->cmsg_type == SCM_TIMESTAMP) {
-			memcpy(&copy_tv, CMSG_DATA(cmsg), sizeof(copy_tv));
+					cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&nlmon->ts, CMSG_DATA(cmsg), sizeof(nlmon->ts));
+			nlmon->has_ts = true;
+
+			copy_tv.tv_sec = nlmon->ts.tv_sec;
+			copy_tv.tv_usec = nlmon->ts.tv_nsec / 1000;
 			tv = &copy_tv;
 		}
 	}
 
-	store_packet(nlmon, tv, sll.sll_pkttype, ARPHRD_ETHER,
-				ntohs(sll.sll_protocol), buf, bytes_read);
+	store_packet(nlmon, tv, nlmon->pcap_pae_iface, NULL, sll.sll_pkttype,
+				ARPHRD_ETHER, ntohs(sll.sll_protocol),
+				buf, bytes_read);
 
 	nlmon_print_pae(nlmon, tv, sll.sll_pkttype, sll.sll_ifindex,
 							buf, bytes_read);
@@ -7740,7 +8187,8 @@ static struct l_io *open_pae(void)
 		return NULL;
 	}
 
-	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt)) < 0) {
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+						&opt, sizeof(opt)) < 0) {
 		perror("Failed to enable authentication timestamps");
 		close(fd);
 		return NULL;
@@ -7753,6 +8201,161 @@ static struct l_io *open_pae(void)
 	return io;
 }
 
+/*
+ * TPACKET_V3 receive ring.  The kernel fills whole blocks with packets and
+ * hands them over once a block is full or its retire timeout expires, so a
+ * single wakeup processes a batch of packets without any copy or syscall
+ * per packet.  Timestamps come from the kernel packet headers.
+ */
+#define NLMON_RING_BLOCK_SIZE	(1 << 17)
+#define NLMON_RING_BLOCK_NR	64
+#define NLMON_RING_FRAME_SIZE	2048
+#define NLMON_RING_RETIRE_TOV	10	/* ms */
+
+typedef void (*nlmon_ring_func_t)(struct nlmon *nlmon,
+					const struct timeval *tv,
+					const struct sockaddr_ll *sll,
+					const void *data, uint32_t size);
+
+struct nlmon_ring {
+	uint8_t *map;
+	size_t map_len;
+	unsigned int current;
+	struct nlmon *nlmon;
+	nlmon_ring_func_t func;
+};
+
+static struct nlmon_ring *nlmon_ring_new(int fd, struct nlmon *nlmon,
+						nlmon_ring_func_t func)
+{
+	struct nlmon_ring *ring;
+	struct tpacket_req3 req;
+	int version = TPACKET_V3;
+	void *map;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION,
+					&version, sizeof(version)) < 0)
+		return NULL;
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = NLMON_RING_BLOCK_SIZE;
+	req.tp_block_nr = NLMON_RING_BLOCK_NR;
+	req.tp_frame_size = NLMON_RING_FRAME_SIZE;
+	req.tp_frame_nr = NLMON_RING_BLOCK_SIZE / NLMON_RING_FRAME_SIZE *
+							NLMON_RING_BLOCK_NR;
+	req.tp_retire_blk_tov = NLMON_RING_RETIRE_TOV;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+		goto fallback;
+
+	map = mmap(NULL, (size_t) req.tp_block_size * req.tp_block_nr,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		memset(&req, 0, sizeof(req));
+		setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+		goto fallback;
+	}
+
+	ring = l_new(struct nlmon_ring, 1);
+	ring->map = map;
+	ring->map_len = (size_t) req.tp_block_size * req.tp_block_nr;
+	ring->nlmon = nlmon;
+	ring->func = func;
+
+	return ring;
+
+fallback:
+	version = TPACKET_V1;
+	setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version));
+
+	return NULL;
+}
+
+static void nlmon_ring_free(struct nlmon_ring *ring)
+{
+	if (!ring)
+		return;
+
+	munmap(ring->map, ring->map_len);
+	l_free(ring);
+}
+
+static void nlmon_ring_process_block(struct nlmon_ring *ring,
+					struct tpacket_block_desc *bd)
+{
+	struct tpacket3_hdr *hdr;
+	uint32_t i;
+
+	hdr = (void *) bd + bd->hdr.bh1.offset_to_first_pkt;
+
+	for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+		const struct sockaddr_ll *sll = (void *) hdr +
+				TPACKET_ALIGN(sizeof(struct tpacket3_hdr));
+		struct timeval tv;
+
+		ring->nlmon->ts.tv_sec = hdr->tp_sec;
+		ring->nlmon->ts.tv_nsec = hdr->tp_nsec;
+		ring->nlmon->has_ts = true;
+
+		tv.tv_sec = hdr->tp_sec;
+		tv.tv_usec = hdr->tp_nsec / 1000;
+
+		ring->func(ring->nlmon, &tv, sll, (void *) hdr + hdr->tp_mac,
+							hdr->tp_snaplen);
+
+		hdr = (void *) hdr + hdr->tp_next_offset;
+	}
+}
+
+static bool nlmon_ring_receive(struct l_io *io, void *user_data)
+{
+	struct nlmon_ring *ring = user_data;
+
+	while (true) {
+		struct tpacket_block_desc *bd = (void *) ring->map +
+				(size_t) ring->current * NLMON_RING_BLOCK_SIZE;
+
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+					__ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		nlmon_ring_process_block(ring, bd);
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+							__ATOMIC_RELEASE);
+
+		ring->current = (ring->current + 1) % NLMON_RING_BLOCK_NR;
+	}
+
+	return true;
+}
+
+static void nlmon_ring_netlink(struct nlmon *nlmon, const struct timeval *tv,
+					const struct sockaddr_ll *sll,
+					const void *data, uint32_t size)
+{
+	if (sll->sll_hatype != ARPHRD_NETLINK)
+		return;
+
+	nlmon_netlink_packet(nlmon, tv, NULL, ntohs(sll->sll_protocol),
+								data, size);
+}
+
+static void nlmon_ring_pae(struct nlmon *nlmon, const struct timeval *tv,
+					const struct sockaddr_ll *sll,
+					const void *data, uint32_t size)
+{
+	if (sll->sll_hatype != ARPHRD_ETHER)
+		return;
+
+	store_packet(nlmon, tv, nlmon->pcap_pae_iface, NULL, sll->sll_pkttype,
+				ARPHRD_ETHER, ntohs(sll->sll_protocol),
+				data, size);
+
+	nlmon_print_pae(nlmon, tv, sll->sll_pkttype, sll->sll_ifindex,
+								data, size);
+}
+
 struct nlmon *nlmon_open(const char *ifname, uint16_t id, const char *pathname,
 				const struct nlmon_config *config)
 {
@@ -7771,7 +8374,7 @@ struct nlmon *nlmon_open(const char *ifname, uint16_t id, const char *pathname,
 	}
 
 	if (pathname) {
-		pcap = pcap_create(pathname);
+		pcap = pcap_create_with_config(pathname, config->pcap_config);
 		if (!pcap) {
 			l_io_destroy(pae_io);
 			l_io_destroy(io);
@@ -7780,34 +8383,93 @@ struct nlmon *nlmon_open(const char *ifname, uint16_t id, const char *pathname,
 	} else
 		pcap = NULL;
 
-	nlmon = l_new(struct nlmon, 1);
+	nlmon = nlmon_create(id, config);
 
-	nlmon->id = id;
 	nlmon->io = io;
 	nlmon->pae_io = pae_io;
-	nlmon->req_list = l_queue_new();
 	nlmon->pcap = pcap;
-	nlmon->nortnl = config->nortnl;
-	nlmon->nowiphy = config->nowiphy;
-	nlmon->noscan = config->noscan;
-	nlmon->noies = config->noies;
+	nlmon->pcap_nl_iface = pcap_add_interface(pcap, ifname);
+	nlmon->pcap_pae_iface = pcap_add_interface(pcap, "pae");
+
+	if (config->stats_interval) {
+		nlmon->stats_interval = config->stats_interval;
+		nlmon->stats = l_queue_new();
+		nlmon->stats_timeout = l_timeout_create(nlmon->stats_interval,
+							nlmon_stats_timeout,
+							nlmon, NULL);
+	}
+
+	/* Prefer the mmap'ed receive rings, fall back to recvmsg */
+	nlmon->ring = nlmon_ring_new(l_io_get_fd(io), nlmon,
+							nlmon_ring_netlink);
+	if (nlmon->ring)
+		l_io_set_read_handler(nlmon->io, nlmon_ring_receive,
+							nlmon->ring, NULL);
+	else
+		l_io_set_read_handler(nlmon->io, nlmon_receive, nlmon, NULL);
 
-	l_io_set_read_handler(nlmon->io, nlmon_receive, nlmon, NULL);
-	l_io_set_read_handler(nlmon->pae_io, pae_receive, nlmon, NULL);
+	nlmon->pae_ring = nlmon_ring_new(l_io_get_fd(pae_io), nlmon,
+							nlmon_ring_pae);
+	if (nlmon->pae_ring)
+		l_io_set_read_handler(nlmon->pae_io, nlmon_ring_receive,
+							nlmon->pae_ring, NULL);
+	else
+		l_io_set_read_handler(nlmon->pae_io, pae_receive, nlmon, NULL);
 
 	wlan_iface_list = l_hashmap_new();
 
 	return nlmon;
 }
 
+/* Reading PACKET_STATISTICS resets the kernel counters, so accumulate */
+static void nlmon_update_kernel_stats(struct nlmon *nlmon)
+{
+	struct tpacket_stats stats;
+	socklen_t len = sizeof(stats);
+
+	if (getsockopt(l_io_get_fd(nlmon->io), SOL_PACKET, PACKET_STATISTICS,
+							&stats, &len) < 0)
+		return;
+
+	nlmon->kernel_packets += stats.tp_packets;
+	nlmon->kernel_drops += stats.tp_drops;
+}
+
+static void nlmon_print_stats(struct nlmon *nlmon)
+{
+	struct pcap_stats stats;
+
+	nlmon_update_kernel_stats(nlmon);
+
+	printf("Captured %" PRIu64 " packets, %" PRIu64
+			" dropped by kernel\n",
+			nlmon->kernel_packets, nlmon->kernel_drops);
+
+	if (!nlmon->pcap)
+		return;
+
+	pcap_get_stats(nlmon->pcap, &stats);
+
+	printf("Wrote %" PRIu64 " packets (%" PRIu64 " bytes) in %u files, %"
+			PRIu64 " dropped by writer\n",
+			stats.packets, stats.bytes, stats.rotations + 1,
+			stats.dropped);
+}
+
 void nlmon_close(struct nlmon *nlmon)
 {
 	if (!nlmon)
 		return;
 
+	nlmon_print_stats(nlmon);
+
 	l_io_destroy(nlmon->io);
 	l_io_destroy(nlmon->pae_io);
+	nlmon_ring_free(nlmon->ring);
+	nlmon_ring_free(nlmon->pae_ring);
 	l_queue_destroy(nlmon->req_list, nlmon_req_free);
+	l_timeout_remove(nlmon->stats_timeout);
+	l_queue_destroy(nlmon->stats, l_free);
 
 	l_hashmap_destroy(wlan_iface_list, wlan_iface_list_free);
 	wlan_iface_list = NULL;
@@ -7816,4 +8478,6 @@ void nlmon_close(struct nlmon *nlmon)
 		pcap_close(nlmon->pcap);
 
 	l_free(nlmon);
+
+	attr_indexes_free();
 }
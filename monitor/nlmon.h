@@ -24,19 +24,23 @@
 #include <sys/time.h>
 
 struct nlmon;
+struct pcap_write_config;
 
 struct nlmon_config {
 	bool nortnl;
 	bool nowiphy;
 	bool noscan;
 	bool noies;
+	bool summary;			/* One line per message */
+	unsigned int stats_interval;	/* Seconds, 0 prints every message */
+	const struct pcap_write_config *pcap_config;
 };
 
 struct nlmon *nlmon_open(const char *ifname, uint16_t id, const char *pathname,
 				const struct nlmon_config *config);
 void nlmon_close(struct nlmon *nlmon);
 
-struct nlmon *nlmon_create(uint16_t id);
+struct nlmon *nlmon_create(uint16_t id, const struct nlmon_config *config);
 void nlmon_destroy(struct nlmon *nlmon);
 void nlmon_print_rtnl(struct nlmon *nlmon, const struct timeval *tv,
 					const void *data, uint32_t size);
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <sys/types.h>
@@ -55,11 +56,60 @@ struct pcap_pkt {
 } __attribute__ ((packed));
 #define PCAP_PKT_SIZE (sizeof(struct pcap_pkt))
 
+#define PCAPNG_BLOCK_SHB	0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB	0x00000001
+#define PCAPNG_BLOCK_EPB	0x00000006
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_COMMENT	1
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+
+#define PCAPNG_ALIGN(len)	(((len) + 3) & ~3)
+#define PCAPNG_MAX_COMMENT	128
+#define PCAPNG_MAX_IF_NAME	64
+
+struct pcapng_shb {
+	uint32_t block_type;
+	uint32_t block_len;
+	uint32_t byte_order_magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int64_t section_len;
+	uint32_t block_len_trailer;
+} __attribute__ ((packed));
+
+struct pcapng_epb {
+	uint32_t block_type;
+	uint32_t block_len;
+	uint32_t interface_id;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t captured_len;
+	uint32_t orig_len;
+} __attribute__ ((packed));
+
+struct pcapng_opt {
+	uint16_t code;
+	uint16_t len;
+} __attribute__ ((packed));
+
 struct pcap {
 	int fd;
 	bool closed;
 	uint32_t type;
 	uint32_t snaplen;
+	char *pathname;
+	struct pcap_write_config config;
+	uint8_t *buf;
+	uint32_t buf_len;
+	uint64_t buf_packets;
+	struct l_timeout *flush_timeout;
+	uint64_t file_size;
+	uint64_t header_size;
+	uint64_t file_start;
+	struct l_queue *interfaces;
+	struct pcap_stats stats;
 };
 
 struct pcap *pcap_open(const char *pathname)
@@ -111,26 +161,136 @@ failed:
 	return NULL;
 }
 
+static bool write_all(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t written = writev(fd, iov, iovcnt);
 
-struct pcap *pcap_create(const char *pathname)
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		while (iovcnt && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+static bool pcapng_write_idb(struct pcap *pcap, const char *name)
+{
+	uint8_t block[8 + 8 + 4 + PCAPNG_MAX_IF_NAME + 8 + 4 + 4];
+	struct pcapng_opt *opt;
+	struct iovec iov;
+	size_t name_len = strlen(name);
+	size_t len;
+
+	if (name_len > PCAPNG_MAX_IF_NAME)
+		name_len = PCAPNG_MAX_IF_NAME;
+
+	memset(block, 0, sizeof(block));
+	l_put_u32(PCAPNG_BLOCK_IDB, block);
+	l_put_u16(pcap->type, block + 8);
+	l_put_u32(pcap->snaplen, block + 12);
+	len = 16;
+
+	opt = (struct pcapng_opt *) (block + len);
+	opt->code = PCAPNG_OPT_IF_NAME;
+	opt->len = name_len;
+	memcpy(block + len + 4, name, name_len);
+	len += 4 + PCAPNG_ALIGN(name_len);
+
+	/* Timestamps are in nanoseconds */
+	opt = (struct pcapng_opt *) (block + len);
+	opt->code = PCAPNG_OPT_IF_TSRESOL;
+	opt->len = 1;
+	block[len + 4] = 9;
+	len += 8;
+
+	/* opt_endofopt is left zeroed */
+	len += 4;
+
+	len += 4;
+	l_put_u32(len, block + 4);
+	l_put_u32(len, block + len - 4);
+
+	iov.iov_base = block;
+	iov.iov_len = len;
+
+	if (!write_all(pcap->fd, &iov, 1))
+		return false;
+
+	pcap->file_size += len;
+
+	return true;
+}
+
+static bool pcapng_write_headers(struct pcap *pcap)
+{
+	struct pcapng_shb shb;
+	const struct l_queue_entry *entry;
+	struct iovec iov;
+
+	memset(&shb, 0, sizeof(shb));
+	shb.block_type = PCAPNG_BLOCK_SHB;
+	shb.block_len = sizeof(shb);
+	shb.byte_order_magic = 0x1a2b3c4d;
+	shb.version_major = 1;
+	shb.version_minor = 0;
+	shb.section_len = -1;
+	shb.block_len_trailer = sizeof(shb);
+
+	iov.iov_base = &shb;
+	iov.iov_len = sizeof(shb);
+
+	if (!write_all(pcap->fd, &iov, 1))
+		return false;
+
+	pcap->file_size = sizeof(shb);
+
+	for (entry = l_queue_get_entries(pcap->interfaces); entry;
+						entry = entry->next)
+		if (!pcapng_write_idb(pcap, entry->data))
+			return false;
+
+	return true;
+}
+
+static bool pcap_create_file(struct pcap *pcap)
 {
-	struct pcap *pcap;
 	struct pcap_hdr hdr;
 	ssize_t len;
 
-	pcap = l_new(struct pcap, 1);
-
-	pcap->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
-					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	pcap->fd = open(pcap->pathname,
+				O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	if (pcap->fd < 0) {
 		perror("Failed to create PCAP file");
-		l_free(pcap);
-		return NULL;
+		return false;
 	}
 
-	pcap->closed = false;
-	pcap->snaplen = 0x0000ffff;
-	pcap->type = 0x00000071;
+	pcap->file_start = l_time_now();
+
+	if (pcap->config.pcapng) {
+		if (!pcapng_write_headers(pcap)) {
+			perror("Failed to write PCAP header");
+			goto failed;
+		}
+
+		pcap->header_size = pcap->file_size;
+		return true;
+	}
 
 	memset(&hdr, 0, sizeof(hdr));
 	hdr.magic_number = 0xa1b2c3d4;
@@ -152,13 +312,65 @@ struct pcap *pcap_create(const char *pathname)
 		goto failed;
 	}
 
-	return pcap;
+	pcap->file_size = PCAP_HDR_SIZE;
+	pcap->header_size = PCAP_HDR_SIZE;
+
+	return true;
 
 failed:
 	close(pcap->fd);
-	l_free(pcap);
+	pcap->fd = -1;
 
-	return NULL;
+	return false;
+}
+
+static void pcap_flush_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct pcap *pcap = user_data;
+
+	pcap_flush(pcap);
+
+	l_timeout_modify(timeout, pcap->config.flush_interval);
+}
+
+struct pcap *pcap_create_with_config(const char *pathname,
+					const struct pcap_write_config *config)
+{
+	struct pcap *pcap;
+
+	pcap = l_new(struct pcap, 1);
+
+	pcap->closed = false;
+	pcap->snaplen = 0x0000ffff;
+	pcap->type = 0x00000071;
+	pcap->pathname = l_strdup(pathname);
+	pcap->interfaces = l_queue_new();
+
+	if (config)
+		pcap->config = *config;
+
+	if (!pcap_create_file(pcap)) {
+		l_queue_destroy(pcap->interfaces, NULL);
+		l_free(pcap->pathname);
+		l_free(pcap);
+		return NULL;
+	}
+
+	if (pcap->config.buffer_size) {
+		pcap->buf = l_malloc(pcap->config.buffer_size);
+
+		if (pcap->config.flush_interval)
+			pcap->flush_timeout = l_timeout_create(
+						pcap->config.flush_interval,
+						pcap_flush_timeout, pcap, NULL);
+	}
+
+	return pcap;
+}
+
+struct pcap *pcap_create(const char *pathname)
+{
+	return pcap_create_with_config(pathname, NULL);
 }
 
 void pcap_close(struct pcap *pcap)
@@ -166,12 +378,46 @@ void pcap_close(struct pcap *pcap)
 	if (!pcap)
 		return;
 
+	l_timeout_remove(pcap->flush_timeout);
+	pcap_flush(pcap);
+
 	if (pcap->fd >= 0)
 		close(pcap->fd);
 
+	l_free(pcap->buf);
+	l_free(pcap->pathname);
+	l_queue_destroy(pcap->interfaces, l_free);
 	l_free(pcap);
 }
 
+/*
+ * Packets written with an interface index refer to the interfaces in the
+ * order they were added.  Classic pcap files have no notion of interfaces,
+ * so the index is ignored for those.
+ */
+uint32_t pcap_add_interface(struct pcap *pcap, const char *name)
+{
+	uint32_t index;
+
+	if (!pcap)
+		return 0;
+
+	index = l_queue_length(pcap->interfaces);
+	l_queue_push_tail(pcap->interfaces, l_strdup(name));
+
+	if (!pcap->config.pcapng || pcap->closed)
+		return index;
+
+	if (!pcap_flush(pcap) || !pcapng_write_idb(pcap, name)) {
+		pcap->closed = true;
+		return index;
+	}
+
+	pcap->header_size = pcap->file_size;
+
+	return index;
+}
+
 uint32_t pcap_get_type(struct pcap *pcap)
 {
 	if (!pcap)
@@ -239,24 +485,231 @@ bool pcap_read(struct pcap *pcap, struct timeval *tv,
 	return true;
 }
 
-bool pcap_write(struct pcap *pcap, const struct timeval *tv,
+static void pcap_write_failed(struct pcap *pcap)
+{
+	perror("Failed to write PCAP file");
+
+	pcap->stats.packets -= pcap->buf_packets;
+	pcap->stats.dropped += pcap->buf_packets;
+	pcap->buf_len = 0;
+	pcap->buf_packets = 0;
+	pcap->closed = true;
+}
+
+bool pcap_flush(struct pcap *pcap)
+{
+	struct iovec iov;
+
+	if (!pcap || pcap->closed)
+		return false;
+
+	if (!pcap->buf_len)
+		return true;
+
+	iov.iov_base = pcap->buf;
+	iov.iov_len = pcap->buf_len;
+
+	if (!write_all(pcap->fd, &iov, 1)) {
+		pcap_write_failed(pcap);
+		return false;
+	}
+
+	pcap->buf_len = 0;
+	pcap->buf_packets = 0;
+
+	return true;
+}
+
+static bool pcap_need_rotate(struct pcap *pcap, uint32_t len)
+{
+	if (pcap->file_size == pcap->header_size)
+		return false;
+
+	if (pcap->config.rotate_size &&
+			pcap->file_size + len > pcap->config.rotate_size)
+		return true;
+
+	if (pcap->config.rotate_interval &&
+			l_time_after(l_time_now(),
+				l_time_offset(pcap->file_start,
+					pcap->config.rotate_interval *
+					L_USEC_PER_SEC)))
+		return true;
+
+	return false;
+}
+
+/*
+ * Rename <path> to <path>.1, <path>.1 to <path>.2 and so on up to the
+ * configured number of rotated files, then start a new <path>.
+ */
+static bool pcap_rotate(struct pcap *pcap)
+{
+	unsigned int count = pcap->config.rotate_count ?: 1;
+	unsigned int i;
+	char *from;
+	char *to;
+
+	if (!pcap_flush(pcap))
+		return false;
+
+	close(pcap->fd);
+	pcap->fd = -1;
+
+	for (i = count; i > 1; i--) {
+		from = l_strdup_printf("%s.%u", pcap->pathname, i - 1);
+		to = l_strdup_printf("%s.%u", pcap->pathname, i);
+
+		rename(from, to);
+
+		l_free(from);
+		l_free(to);
+	}
+
+	to = l_strdup_printf("%s.1", pcap->pathname);
+	rename(pcap->pathname, to);
+	l_free(to);
+
+	if (!pcap_create_file(pcap)) {
+		pcap->closed = true;
+		return false;
+	}
+
+	pcap->stats.rotations++;
+
+	return true;
+}
+
+static bool pcap_emit(struct pcap *pcap, struct iovec *iov, int iovcnt,
+								uint32_t len)
+{
+	int i;
+
+	if (pcap->buf && pcap->buf_len + len > pcap->config.buffer_size &&
+			!pcap_flush(pcap))
+		return false;
+
+	if (pcap->buf && len <= pcap->config.buffer_size) {
+		for (i = 0; i < iovcnt; i++) {
+			memcpy(pcap->buf + pcap->buf_len, iov[i].iov_base,
+							iov[i].iov_len);
+			pcap->buf_len += iov[i].iov_len;
+		}
+
+		pcap->buf_packets++;
+		goto done;
+	}
+
+	if (!write_all(pcap->fd, iov, iovcnt)) {
+		pcap_write_failed(pcap);
+		return false;
+	}
+
+done:
+	pcap->file_size += len;
+	pcap->stats.packets++;
+	pcap->stats.bytes += len;
+
+	return true;
+}
+
+static bool pcapng_write_epb(struct pcap *pcap, const struct timespec *ts,
+					uint32_t interface, const char *comment,
+					const void *phdr, uint32_t plen,
+					const void *data, uint32_t size)
+{
+	static const uint8_t padding[3];
+	uint8_t trailer[4 + PCAPNG_MAX_COMMENT + 4 + 4];
+	struct pcapng_opt *opt;
+	struct pcapng_epb epb;
+	struct iovec iov[5];
+	uint32_t data_len = plen + size;
+	uint32_t pad_len = PCAPNG_ALIGN(data_len) - data_len;
+	uint32_t trailer_len = 0;
+	uint64_t nsec = 0;
+
+	if (ts)
+		nsec = ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+
+	memset(trailer, 0, sizeof(trailer));
+
+	if (comment) {
+		size_t comment_len = strlen(comment);
+
+		if (comment_len > PCAPNG_MAX_COMMENT)
+			comment_len = PCAPNG_MAX_COMMENT;
+
+		opt = (struct pcapng_opt *) trailer;
+		opt->code = PCAPNG_OPT_COMMENT;
+		opt->len = comment_len;
+		memcpy(trailer + 4, comment, comment_len);
+		trailer_len = 4 + PCAPNG_ALIGN(comment_len);
+
+		/* opt_endofopt is left zeroed */
+		trailer_len += 4;
+	}
+
+	epb.block_type = PCAPNG_BLOCK_EPB;
+	epb.block_len = sizeof(epb) + data_len + pad_len + trailer_len + 4;
+	epb.interface_id = interface;
+	epb.ts_high = nsec >> 32;
+	epb.ts_low = nsec;
+	epb.captured_len = data_len;
+	epb.orig_len = data_len;
+
+	memcpy(trailer + trailer_len, &epb.block_len, 4);
+	trailer_len += 4;
+
+	iov[0].iov_base = &epb;
+	iov[0].iov_len = sizeof(epb);
+	iov[1].iov_base = (void *) phdr;
+	iov[1].iov_len = plen;
+	iov[2].iov_base = (void *) data;
+	iov[2].iov_len = size;
+	iov[3].iov_base = (void *) padding;
+	iov[3].iov_len = pad_len;
+	iov[4].iov_base = trailer;
+	iov[4].iov_len = trailer_len;
+
+	return pcap_emit(pcap, iov, 5, epb.block_len);
+}
+
+bool pcap_write_ts(struct pcap *pcap, const struct timespec *ts,
+					uint32_t interface, const char *comment,
 					const void *phdr, uint32_t plen,
 					const void *data, uint32_t size)
 {
 	struct iovec iov[3];
 	struct pcap_pkt pkt;
-	ssize_t written;
+	uint32_t len;
 
 	if (!pcap)
 		return false;
 
 	if (pcap->closed)
-		return false;
+		goto dropped;
+
+	if (pcap->config.pcapng)
+		len = sizeof(struct pcapng_epb) + PCAPNG_ALIGN(plen + size) +
+			(comment ? 8 + PCAPNG_MAX_COMMENT : 0) + 4;
+	else
+		len = PCAP_PKT_SIZE + plen + size;
+
+	if (pcap_need_rotate(pcap, len) && !pcap_rotate(pcap))
+		goto dropped;
+
+	if (pcap->config.pcapng) {
+		if (!pcapng_write_epb(pcap, ts, interface, comment,
+						phdr, plen, data, size))
+			goto dropped;
+
+		return true;
+	}
 
 	memset(&pkt, 0, sizeof(pkt));
-	if (tv) {
-		pkt.ts_sec = tv->tv_sec;
-		pkt.ts_usec = tv->tv_usec;
+	if (ts) {
+		pkt.ts_sec = ts->tv_sec;
+		pkt.ts_usec = ts->tv_nsec / 1000;
 	}
 	pkt.incl_len = plen + size;
 	pkt.orig_len = plen + size;
@@ -268,16 +721,39 @@ bool pcap_write(struct pcap *pcap, const struct timeval *tv,
 	iov[2].iov_base = (void *) data;
 	iov[2].iov_len = size;
 
-	written = writev(pcap->fd, iov, 3);
-	if (written < 0) {
-		pcap->closed = true;
-		return false;
-	}
+	if (!pcap_emit(pcap, iov, 3, len))
+		goto dropped;
 
-	if (written < (ssize_t) (PCAP_PKT_SIZE + plen + size)) {
-		pcap->closed = true;
-		return false;
+	return true;
+
+dropped:
+	pcap->stats.dropped++;
+
+	return false;
+}
+
+bool pcap_write(struct pcap *pcap, const struct timeval *tv,
+					const void *phdr, uint32_t plen,
+					const void *data, uint32_t size)
+{
+	struct timespec ts;
+
+	if (!tv)
+		return pcap_write_ts(pcap, NULL, 0, NULL,
+						phdr, plen, data, size);
+
+	ts.tv_sec = tv->tv_sec;
+	ts.tv_nsec = tv->tv_usec * 1000;
+
+	return pcap_write_ts(pcap, &ts, 0, NULL, phdr, plen, data, size);
+}
+
+void pcap_get_stats(struct pcap *pcap, struct pcap_stats *stats)
+{
+	if (!pcap) {
+		memset(stats, 0, sizeof(*stats));
+		return;
 	}
 
-	return true;
+	*stats = pcap->stats;
 }
@@ -23,6 +23,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <time.h>
 
 #define PCAP_TYPE_INVALID	0
 #define PCAP_TYPE_LINUX_SLL	113
@@ -30,9 +31,28 @@
 
 struct pcap;
 
+struct pcap_write_config {
+	uint32_t buffer_size;		/* Bytes, 0 writes every packet */
+	unsigned int flush_interval;	/* Seconds, 0 flushes when full */
+	uint64_t rotate_size;		/* Bytes, 0 disables */
+	unsigned int rotate_interval;	/* Seconds, 0 disables */
+	unsigned int rotate_count;	/* Rotated files kept */
+	bool pcapng;			/* pcapng instead of classic pcap */
+};
+
+struct pcap_stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t dropped;
+	unsigned int rotations;
+};
+
 struct pcap *pcap_open(const char *pathname);
 struct pcap *pcap_create(const char *pathname);
+struct pcap *pcap_create_with_config(const char *pathname,
+					const struct pcap_write_config *config);
 void pcap_close(struct pcap *pcap);
+uint32_t pcap_add_interface(struct pcap *pcap, const char *name);
 
 uint32_t pcap_get_type(struct pcap *pcap);
 uint32_t pcap_get_snaplen(struct pcap *pcap);
@@ -43,3 +63,9 @@ bool pcap_read(struct pcap *pcap, struct timeval *tv,
 bool pcap_write(struct pcap *pcap, const struct timeval *tv,
 					const void *phdr, uint32_t plen,
 					const void *data, uint32_t size);
+bool pcap_write_ts(struct pcap *pcap, const struct timespec *ts,
+					uint32_t interface, const char *comment,
+					const void *phdr, uint32_t plen,
+					const void *data, uint32_t size);
+bool pcap_flush(struct pcap *pcap);
+void pcap_get_stats(struct pcap *pcap, struct pcap_stats *stats);
@@ -50,6 +50,7 @@ struct adhoc_state {
 	char *ssid;
 	uint8_t pmk[32];
 	struct l_queue *sta_states;
+	struct l_hashtab *sta_index;	/* sta_states keyed by address */
 	uint32_t sta_watch_id;
 	uint32_t netdev_watch_id;
 	unsigned int mlme_watch;
@@ -58,6 +59,8 @@ struct adhoc_state {
 	uint32_t group_cipher;
 	uint8_t gtk[CRYPTO_MAX_GTK_LEN];
 	uint8_t gtk_index;
+	uint32_t gtk_query_cmd_id;
+	struct l_queue *gtk_waiters;	/* stations waiting for the RSC */
 	bool started : 1;
 	bool open : 1;
 	bool gtk_set : 1;
@@ -70,7 +73,6 @@ struct sta_state {
 	struct handshake_state *hs_sta;
 	struct eapol_sm *sm_a;
 	struct handshake_state *hs_auth;
-	uint32_t gtk_query_cmd_id;
 	bool hs_sta_done : 1;
 	bool hs_auth_done : 1;
 	bool authenticated : 1;
@@ -85,10 +87,6 @@ static void adhoc_sta_free(void *data)
 	if (sta->adhoc->open)
 		goto end;
 
-	if (sta->gtk_query_cmd_id)
-		l_genl_family_cancel(sta->adhoc->nl80211,
-						sta->gtk_query_cmd_id);
-
 	if (sta->sm)
 		eapol_sm_free(sta->sm);
 
@@ -105,18 +103,34 @@ end:
 	l_free(sta);
 }
 
+static struct sta_state *adhoc_sta_find(struct adhoc_state *adhoc,
+						const uint8_t *addr)
+{
+	return l_hashtab_lookup(adhoc->sta_index, addr);
+}
+
+static void adhoc_sta_add(struct adhoc_state *adhoc, struct sta_state *sta)
+{
+	/* Addresses are picked by the peers, use a keyed hash */
+	if (!adhoc->sta_index)
+		adhoc->sta_index = l_hashtab_new(6, L_HASHTAB_HASH_SIPHASH);
+
+	l_queue_push_tail(adhoc->sta_states, sta);
+	l_hashtab_insert(adhoc->sta_index, sta->addr, sta);
+}
+
 static void adhoc_remove_sta(struct sta_state *sta)
 {
-	if (!l_queue_remove(sta->adhoc->sta_states, sta)) {
+	struct adhoc_state *adhoc = sta->adhoc;
+
+	if (l_hashtab_lookup(adhoc->sta_index, sta->addr) != sta) {
 		l_error("station %p was not found", sta);
 		return;
 	}
 
-	if (sta->gtk_query_cmd_id) {
-		l_genl_family_cancel(sta->adhoc->nl80211,
-						sta->gtk_query_cmd_id);
-		sta->gtk_query_cmd_id = 0;
-	}
+	l_hashtab_remove(adhoc->sta_index, sta->addr);
+	l_queue_remove(adhoc->sta_states, sta);
+	l_queue_remove(adhoc->gtk_waiters, sta);
 
 	/* signal station has been removed */
 	if (sta->authenticated) {
@@ -140,6 +154,17 @@ static void adhoc_reset(struct adhoc_state *adhoc)
 	netdev_station_watch_remove(adhoc->netdev, adhoc->sta_watch_id);
 	adhoc->sta_watch_id = 0;
 
+	if (adhoc->gtk_query_cmd_id) {
+		l_genl_family_cancel(adhoc->nl80211, adhoc->gtk_query_cmd_id);
+		adhoc->gtk_query_cmd_id = 0;
+	}
+
+	l_queue_destroy(adhoc->gtk_waiters, NULL);
+	adhoc->gtk_waiters = NULL;
+
+	l_hashtab_destroy(adhoc->sta_index, NULL);
+	adhoc->sta_index = NULL;
+
 	l_queue_destroy(adhoc->sta_states, adhoc_sta_free);
 	adhoc->sta_states = NULL;
 
@@ -161,13 +186,6 @@ static void adhoc_set_rsn_info(struct adhoc_state *adhoc,
 	rsn->group_cipher = adhoc->group_cipher;
 }
 
-static bool ap_sta_match_addr(const void *a, const void *b)
-{
-	const struct sta_state *sta = a;
-
-	return !memcmp(sta->addr, b, 6);
-}
-
 static void adhoc_operstate_cb(int error, uint16_t type,
 					const void *data,
 					uint32_t len, void *user_data)
@@ -333,22 +351,54 @@ static void adhoc_gtk_op_cb(struct l_genl_msg *msg, void *user_data)
 	}
 }
 
+/*
+ * All stations that joined while the GET_KEY was pending are started with
+ * the same RSC.  It can only lag the current one, which the peers accept.
+ */
 static void adhoc_gtk_query_cb(struct l_genl_msg *msg, void *user_data)
 {
-	struct sta_state *sta = user_data;
+	struct adhoc_state *adhoc = user_data;
+	struct l_queue *waiters = adhoc->gtk_waiters;
+	struct sta_state *sta;
 	const void *gtk_rsc;
 
-	sta->gtk_query_cmd_id = 0;
+	adhoc->gtk_query_cmd_id = 0;
+	adhoc->gtk_waiters = NULL;
 
 	gtk_rsc = nl80211_parse_get_key_seq(msg);
-	if (!gtk_rsc)
-		goto error;
 
-	adhoc_start_rsna(sta, gtk_rsc);
-	return;
+	while ((sta = l_queue_pop_head(waiters))) {
+		if (gtk_rsc)
+			adhoc_start_rsna(sta, gtk_rsc);
+		else
+			adhoc_remove_sta(sta);
+	}
 
-error:
-	adhoc_remove_sta(sta);
+	l_queue_destroy(waiters, NULL);
+}
+
+static bool adhoc_query_gtk(struct adhoc_state *adhoc, struct sta_state *sta)
+{
+	struct l_genl_msg *msg;
+
+	if (!adhoc->gtk_query_cmd_id) {
+		msg = nl80211_build_get_key(netdev_get_ifindex(adhoc->netdev),
+						adhoc->gtk_index);
+		adhoc->gtk_query_cmd_id = l_genl_family_send(adhoc->nl80211,
+							msg, adhoc_gtk_query_cb,
+							adhoc, NULL);
+		if (!adhoc->gtk_query_cmd_id) {
+			l_genl_msg_unref(msg);
+			return false;
+		}
+	}
+
+	if (!adhoc->gtk_waiters)
+		adhoc->gtk_waiters = l_queue_new();
+
+	l_queue_push_tail(adhoc->gtk_waiters, sta);
+
+	return true;
 }
 
 static void adhoc_new_station(struct adhoc_state *adhoc, const uint8_t *mac)
@@ -356,7 +406,7 @@ static void adhoc_new_station(struct adhoc_state *adhoc, const uint8_t *mac)
 	struct sta_state *sta;
 	struct l_genl_msg *msg;
 
-	sta = l_queue_find(adhoc->sta_states, ap_sta_match_addr, mac);
+	sta = adhoc_sta_find(adhoc, mac);
 	if (sta) {
 		l_warn("new station event with already connected STA");
 		return;
@@ -417,7 +467,7 @@ static void adhoc_new_station(struct adhoc_state *adhoc, const uint8_t *mac)
 	memcpy(sta->addr, mac, 6);
 	sta->adhoc = adhoc;
 
-	l_queue_push_tail(adhoc->sta_states, sta);
+	adhoc_sta_add(adhoc, sta);
 
 	l_info("new Station: "MAC" adhoc=%p", MAC_STR(mac), adhoc);
 
@@ -440,19 +490,9 @@ static void adhoc_new_station(struct adhoc_state *adhoc, const uint8_t *mac)
 
 	if (adhoc->group_cipher == IE_RSN_CIPHER_SUITE_NO_GROUP_TRAFFIC)
 		adhoc_start_rsna(sta, NULL);
-	else {
-		msg = nl80211_build_get_key(netdev_get_ifindex(adhoc->netdev),
-					adhoc->gtk_index);
-		sta->gtk_query_cmd_id = l_genl_family_send(adhoc->nl80211, msg,
-							adhoc_gtk_query_cb,
-							sta, NULL);
-		if (!sta->gtk_query_cmd_id) {
-			l_genl_msg_unref(msg);
-			l_error("Issuing GET_KEY failed");
-
-			adhoc_remove_sta(sta);
-			return;
-		}
+	else if (!adhoc_query_gtk(adhoc, sta)) {
+		l_error("Issuing GET_KEY failed");
+		adhoc_remove_sta(sta);
 	}
 }
 
@@ -460,7 +500,7 @@ static void adhoc_del_station(struct adhoc_state *adhoc, const uint8_t *mac)
 {
 	struct sta_state *sta;
 
-	sta = l_queue_find(adhoc->sta_states, ap_sta_match_addr, mac);
+	sta = adhoc_sta_find(adhoc, mac);
 	if (!sta) {
 		l_warn("could not find station "MAC" in list", MAC_STR(mac));
 		return;
@@ -509,12 +549,6 @@ static void adhoc_join_cb(struct netdev *netdev, int result, void *user_data)
 static void adhoc_mlme_notify(struct l_genl_msg *msg, void *user_data)
 {
 	struct adhoc_state *adhoc = user_data;
-	uint32_t ifindex;
-
-	if (nl80211_parse_attrs(msg, NL80211_ATTR_IFINDEX, &ifindex,
-				NL80211_ATTR_UNSPEC) < 0 ||
-			ifindex != netdev_get_ifindex(adhoc->netdev))
-		return;
 
 	switch (l_genl_msg_get_command(msg)) {
 	case NL80211_CMD_JOIN_IBSS:
@@ -535,6 +569,16 @@ static void adhoc_mlme_notify(struct l_genl_msg *msg, void *user_data)
 	}
 }
 
+static unsigned int adhoc_mlme_watch(struct adhoc_state *adhoc)
+{
+	uint32_t ifindex = netdev_get_ifindex(adhoc->netdev);
+
+	return l_genl_family_register_filtered(adhoc->nl80211, "mlme",
+						NL80211_ATTR_IFINDEX,
+						&ifindex, sizeof(ifindex),
+						adhoc_mlme_notify, adhoc, NULL);
+}
+
 static struct l_dbus_message *adhoc_dbus_start(struct l_dbus *dbus,
 						struct l_dbus_message *message,
 						void *user_data)
@@ -573,8 +617,7 @@ static struct l_dbus_message *adhoc_dbus_start(struct l_dbus *dbus,
 			adhoc))
 		return dbus_error_invalid_args(message);
 
-	adhoc->mlme_watch = l_genl_family_register(adhoc->nl80211, "mlme",
-						adhoc_mlme_notify, adhoc, NULL);
+	adhoc->mlme_watch = adhoc_mlme_watch(adhoc);
 	if (!adhoc->mlme_watch)
 		return dbus_error_failed(message);
 
@@ -613,8 +656,7 @@ static struct l_dbus_message *adhoc_dbus_start_open(struct l_dbus *dbus,
 			adhoc))
 		return dbus_error_invalid_args(message);
 
-	adhoc->mlme_watch = l_genl_family_register(adhoc->nl80211, "mlme",
-						adhoc_mlme_notify, adhoc, NULL);
+	adhoc->mlme_watch = adhoc_mlme_watch(adhoc);
 	if (!adhoc->mlme_watch)
 		return dbus_error_failed(message);
 
@@ -783,3 +825,4 @@ static void adhoc_exit(void)
 
 IWD_MODULE(adhoc, adhoc_init, adhoc_exit)
 IWD_MODULE_DEPENDS(adhoc, netdev);
+IWD_MODULE_ON_IFTYPE(adhoc, NL80211_IFTYPE_ADHOC)
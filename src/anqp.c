@@ -25,6 +25,7 @@
 #endif
 
 #include <stdint.h>
+#include <time.h>
 
 #include <ell/ell.h>
 
@@ -36,11 +37,28 @@
 #include "src/iwd.h"
 #include "src/mpdu.h"
 #include "src/frame-xchg.h"
+#include "src/storage.h"
+#include "src/wiphy.h"
+#include "src/nl80211util.h"
 
 #include "linux/nl80211.h"
 
 #define ANQP_GROUP	0
 
+/*
+ * Requests are not sent as soon as they're made.  They're queued and
+ * grouped by channel so that the queries a scan triggers on a given
+ * channel are all sent within a single remain-on-channel period.  Only one
+ * such batch is in flight per wdev, anything queued meanwhile goes into
+ * the next one.  Responses have ANQP_RESPONSE_TIMEOUT ms to arrive, plus
+ * ANQP_BATCH_FRAME_TIME ms for each additional query in the batch.
+ */
+#define ANQP_BATCH_MAX_REQUESTS		8
+#define ANQP_RESPONSE_TIMEOUT		300
+#define ANQP_BATCH_FRAME_TIME		20
+
+struct anqp_batch;
+
 struct anqp_request {
 	uint64_t wdev_id;
 	anqp_response_func_t anqp_cb;
@@ -51,14 +69,278 @@ struct anqp_request {
 	uint8_t *frame;
 	size_t frame_len;
 	uint32_t id;
+	struct anqp_batch *batch;
+	uint32_t tx_cmd_id;
+};
+
+struct anqp_batch {
+	struct wiphy_radio_work_item work;
+	uint64_t wdev_id;
+	uint32_t frequency;
+	uint32_t duration;
+	struct l_queue *requests;
+	struct l_timeout *timeout;
+	uint32_t roc_cmd_id;
+	uint64_t roc_cookie;
+	uint64_t early_roc_cookie;
+	bool have_roc_cookie : 1;
+	bool have_early_roc_cookie : 1;
+	bool on_channel : 1;
 };
 
 static uint8_t anqp_token = 0;
+static uint32_t anqp_request_id;
+static struct l_genl_family *nl80211;
+static struct l_queue *anqp_pending;
+static struct l_queue *anqp_batches;
+static bool anqp_dispatch_scheduled;
+
+#define ANQP_CACHE_DEFAULT_LIFETIME	3600
+#define ANQP_CACHE_MAX_ENTRIES		256
+
+/*
+ * Responses are cached by HESSID, which identifies the hotspot operator
+ * network, or by BSSID for APs that don't advertise one.  The cache is
+ * persisted with wall clock expiry times.
+ */
+struct anqp_cache_key {
+	uint8_t is_hessid;
+	uint8_t addr[6];
+} __attribute__ ((packed));
+
+struct anqp_cache_entry {
+	uint64_t expire_time;
+	size_t len;
+	uint8_t data[];
+};
+
+static struct l_hashtab *anqp_cache;
+static struct l_settings *anqp_cache_settings;
+static uint64_t anqp_cache_lifetime;
+static bool anqp_cache_loaded;
+
+static void anqp_cache_key_init(struct anqp_cache_key *key,
+				const uint8_t *hessid, const uint8_t *bssid)
+{
+	key->is_hessid = hessid && !l_memeqzero(hessid, 6);
+	memcpy(key->addr, key->is_hessid ? hessid : bssid, 6);
+}
+
+static char *anqp_cache_group(const struct anqp_cache_key *key)
+{
+	char *hex = l_util_hexstring(key->addr, 6);
+	char *group = l_strdup_printf("%s_%s",
+					key->is_hessid ? "hessid" : "bssid",
+					hex);
+
+	l_free(hex);
+	return group;
+}
+
+static bool anqp_cache_insert(const struct anqp_cache_key *key,
+				const void *anqp, size_t len,
+				uint64_t expire_time)
+{
+	struct anqp_cache_entry *entry;
+
+	if (l_hashtab_size(anqp_cache) >= ANQP_CACHE_MAX_ENTRIES)
+		return false;
+
+	entry = l_malloc(sizeof(struct anqp_cache_entry) + len);
+	entry->expire_time = expire_time;
+	entry->len = len;
+	memcpy(entry->data, anqp, len);
+
+	l_hashtab_replace(anqp_cache, key, entry, NULL);
+
+	return true;
+}
+
+static bool anqp_cache_entry_load(const char *group, uint64_t now)
+{
+	struct anqp_cache_key key;
+	uint64_t expires;
+	uint8_t *addr;
+	uint8_t *data;
+	size_t len;
+	char *hex;
+	bool ret = false;
+
+	if (!strncmp(group, "hessid_", 7))
+		key.is_hessid = true;
+	else if (!strncmp(group, "bssid_", 6))
+		key.is_hessid = false;
+	else
+		return false;
+
+	addr = l_util_from_hexstring(strchr(group, '_') + 1, &len);
+	if (!addr || len != 6) {
+		l_free(addr);
+		return false;
+	}
+
+	memcpy(key.addr, addr, 6);
+	l_free(addr);
+
+	if (!l_settings_get_uint64(anqp_cache_settings, group, "Expires",
+					&expires) || expires <= now)
+		return false;
+
+	hex = l_settings_get_string(anqp_cache_settings, group, "Response");
+	if (!hex)
+		return false;
+
+	data = l_util_from_hexstring(hex, &len);
+	l_free(hex);
+
+	if (data && len)
+		ret = anqp_cache_insert(&key, data, len,
+				l_time_offset(l_time_now(),
+					(expires - now) * L_USEC_PER_SEC));
+
+	l_free(data);
+	return ret;
+}
+
+static void anqp_cache_load(void)
+{
+	uint64_t now = time(NULL);
+	bool changed = false;
+	char **groups;
+	unsigned int i;
+
+	anqp_cache_loaded = true;
+
+	anqp_cache_settings = storage_anqp_cache_load();
+	if (!anqp_cache_settings)
+		return;
+
+	groups = l_settings_get_groups(anqp_cache_settings);
+
+	for (i = 0; groups[i]; i++) {
+		if (anqp_cache_entry_load(groups[i], now))
+			continue;
+
+		l_settings_remove_group(anqp_cache_settings, groups[i]);
+		changed = true;
+	}
+
+	l_strv_free(groups);
+
+	l_debug("Loaded %u cached ANQP responses", l_hashtab_size(anqp_cache));
+
+	if (changed)
+		storage_anqp_cache_sync(anqp_cache_settings);
+}
+
+static void anqp_cache_remove(const struct anqp_cache_key *key)
+{
+	char *group;
+
+	l_free(l_hashtab_remove(anqp_cache, key));
+
+	if (!anqp_cache_settings)
+		return;
+
+	group = anqp_cache_group(key);
+
+	if (l_settings_remove_group(anqp_cache_settings, group))
+		storage_anqp_cache_sync(anqp_cache_settings);
+
+	l_free(group);
+}
+
+/*
+ * Returns a cached response for the BSS with @hessid, which may be all
+ * zeros, and @bssid, or NULL.  The data is valid until the next call to
+ * any of the anqp_cache_* functions.
+ */
+const void *anqp_cache_lookup(const uint8_t *hessid, const uint8_t *bssid,
+				size_t *out_len)
+{
+	struct anqp_cache_key key;
+	struct anqp_cache_entry *entry;
+
+	if (!anqp_cache)
+		return NULL;
+
+	if (!anqp_cache_loaded)
+		anqp_cache_load();
+
+	anqp_cache_key_init(&key, hessid, bssid);
+
+	entry = l_hashtab_lookup(anqp_cache, &key);
+	if (!entry)
+		return NULL;
+
+	if (l_time_after(l_time_now(), entry->expire_time)) {
+		anqp_cache_remove(&key);
+		return NULL;
+	}
+
+	*out_len = entry->len;
+	return entry->data;
+}
+
+static bool anqp_cache_remove_expired(const void *key, void *value,
+					void *user_data)
+{
+	struct anqp_cache_entry *entry = value;
+	uint64_t now = *(uint64_t *) user_data;
+
+	if (!l_time_after(now, entry->expire_time))
+		return false;
+
+	l_free(entry);
+	return true;
+}
+
+void anqp_cache_add(const uint8_t *hessid, const uint8_t *bssid,
+			const void *anqp, size_t len)
+{
+	struct anqp_cache_key key;
+	uint64_t now = l_time_now();
+	char *group;
+	char *hex;
+
+	if (!anqp_cache || !len)
+		return;
+
+	if (!anqp_cache_loaded)
+		anqp_cache_load();
+
+	if (l_hashtab_size(anqp_cache) >= ANQP_CACHE_MAX_ENTRIES)
+		l_hashtab_foreach_remove(anqp_cache, anqp_cache_remove_expired,
+						&now);
+
+	anqp_cache_key_init(&key, hessid, bssid);
+
+	if (!anqp_cache_insert(&key, anqp, len,
+				l_time_offset(now, anqp_cache_lifetime)))
+		return;
+
+	if (!anqp_cache_settings)
+		anqp_cache_settings = l_settings_new();
+
+	group = anqp_cache_group(&key);
+	hex = l_util_hexstring(anqp, len);
+
+	l_settings_set_string(anqp_cache_settings, group, "Response", hex);
+	l_settings_set_uint64(anqp_cache_settings, group, "Expires",
+				time(NULL) + l_time_to_secs(anqp_cache_lifetime));
+	storage_anqp_cache_sync(anqp_cache_settings);
+
+	l_free(hex);
+	l_free(group);
+}
 
 static void anqp_destroy(void *user_data)
 {
 	struct anqp_request *request = user_data;
 
+	if (request->tx_cmd_id)
+		l_genl_family_cancel(nl80211, request->tx_cmd_id);
+
 	if (request->anqp_destroy)
 		request->anqp_destroy(request->anqp_data);
 
@@ -66,17 +348,99 @@ static void anqp_destroy(void *user_data)
 	l_free(request);
 }
 
+static bool anqp_request_match_id(const void *a, const void *b)
+{
+	const struct anqp_request *request = a;
+	const uint32_t *id = b;
+
+	return request->id == *id;
+}
+
+static struct anqp_request *anqp_find_batched(uint32_t id)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(anqp_batches); entry;
+			entry = entry->next) {
+		struct anqp_batch *batch = entry->data;
+		struct anqp_request *request = l_queue_find(batch->requests,
+							anqp_request_match_id,
+							&id);
+
+		if (request)
+			return request;
+	}
+
+	return NULL;
+}
+
+static void anqp_batch_done(struct anqp_batch *batch)
+{
+	wiphy_radio_work_done(wiphy_find_by_wdev(batch->wdev_id),
+				batch->work.id);
+}
+
+/*
+ * The request is taken off its batch, ending the batch if it was the last
+ * one, before calling back so that the callback is free to cancel or make
+ * other requests.
+ */
+static void anqp_request_done(struct anqp_request *request,
+				enum anqp_result result,
+				const void *anqp, size_t len)
+{
+	struct anqp_batch *batch = request->batch;
+
+	if (batch) {
+		l_queue_remove(batch->requests, request);
+		request->batch = NULL;
+
+		if (l_queue_isempty(batch->requests))
+			anqp_batch_done(batch);
+	}
+
+	if (request->anqp_cb)
+		request->anqp_cb(result, anqp, len, request->anqp_data);
+
+	anqp_destroy(request);
+}
+
+static void anqp_batch_fail(struct anqp_batch *batch, enum anqp_result result)
+{
+	uint32_t ids[ANQP_BATCH_MAX_REQUESTS];
+	unsigned int n_ids = 0;
+	const struct l_queue_entry *entry;
+	unsigned int i;
+
+	for (entry = l_queue_get_entries(batch->requests); entry;
+			entry = entry->next) {
+		struct anqp_request *request = entry->data;
+
+		ids[n_ids++] = request->id;
+	}
+
+	/*
+	 * Any callback may cancel the other requests and the last request
+	 * ends the batch, so look each one up again.
+	 */
+	for (i = 0; i < n_ids; i++) {
+		struct anqp_request *request = anqp_find_batched(ids[i]);
+
+		if (request)
+			anqp_request_done(request, result, NULL, 0);
+	}
+}
+
 /*
- * By using frame-xchg we should get called back here for any frame matching our
- * prefix until the duration expires. If frame-xchg is never signalled 'done'
- * (returning true) we should get a timeout in anqp_frame_timeout. This is
- * why we drop any improperly formatted frames without cleaning up the request.
+ * We get called back here, from anqp_frame_watch_cb, for any frame from the
+ * request's peer matching our prefix until the batch times out.  This is
+ * why we drop any improperly formatted frames without cleaning up the
+ * request.
  */
 static bool anqp_response_frame_event(const struct mmpdu_header *hdr,
 					const void *body, size_t body_len,
-					int rssi, void *user_data)
+					struct anqp_request *request)
 {
-	struct anqp_request *request = user_data;
 	const uint8_t *ptr = body;
 	uint16_t status_code;
 	uint16_t delay;
@@ -149,10 +513,7 @@ static bool anqp_response_frame_event(const struct mmpdu_header *hdr,
 
 	l_debug("ANQP response received from "MAC, MAC_STR(hdr->address_2));
 
-	if (request->anqp_cb)
-		request->anqp_cb(ANQP_SUCCESS, ptr, qrlen, request->anqp_data);
-
-	anqp_destroy(request);
+	anqp_request_done(request, ANQP_SUCCESS, ptr, qrlen);
 
 	return true;
 }
@@ -164,24 +525,332 @@ static const struct frame_xchg_prefix anqp_frame_prefix = {
 	.len = 2,
 };
 
-static void anqp_frame_timeout(int error, void *user_data)
+static void anqp_frame_watch_cb(const struct mmpdu_header *hdr,
+				const void *body, size_t body_len,
+				int rssi, void *user_data)
+{
+	const struct l_queue_entry *entry;
+	const struct l_queue_entry *r;
+
+	for (entry = l_queue_get_entries(anqp_batches); entry;
+			entry = entry->next) {
+		struct anqp_batch *batch = entry->data;
+
+		if (!batch->on_channel)
+			continue;
+
+		for (r = l_queue_get_entries(batch->requests); r; r = r->next) {
+			struct anqp_request *request = r->data;
+			const struct mmpdu_header *tx =
+				(const struct mmpdu_header *) request->frame;
+
+			if (memcmp(hdr->address_1, tx->address_2, 6) ||
+					memcmp(hdr->address_2, tx->address_1, 6))
+				continue;
+
+			if (anqp_response_frame_event(hdr, body, body_len,
+							request))
+				return;
+		}
+	}
+}
+
+static void anqp_tx_cb(struct l_genl_msg *msg, void *user_data)
 {
 	struct anqp_request *request = user_data;
-	enum anqp_result result = ANQP_TIMEOUT;
+	int error = l_genl_msg_get_error(msg);
+
+	request->tx_cmd_id = 0;
+
+	if (error >= 0)
+		return;
+
+	l_error("Sending ANQP request failed: %s (%i)", strerror(-error),
+		-error);
+	anqp_request_done(request, ANQP_FAILED, NULL, 0);
+}
+
+/*
+ * We're now on the batch's channel for the remain-on-channel period so
+ * the frames can go out back to back without a channel switch each.
+ */
+static void anqp_batch_send(struct anqp_batch *batch)
+{
+	const struct l_queue_entry *entry;
+
+	l_debug("Sending %u ANQP requests on %u MHz",
+		l_queue_length(batch->requests), batch->frequency);
+
+	batch->on_channel = true;
+	l_timeout_modify_ms(batch->timeout, batch->duration);
+
+	for (entry = l_queue_get_entries(batch->requests); entry;
+			entry = entry->next) {
+		struct anqp_request *request = entry->data;
+		struct l_genl_msg *msg;
+
+		msg = l_genl_msg_new_sized(NL80211_CMD_FRAME,
+						128 + request->frame_len);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8,
+					&batch->wdev_id);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY_FREQ, 4,
+					&batch->frequency);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_OFFCHANNEL_TX_OK, 0,
+					NULL);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_FRAME,
+					request->frame_len, request->frame);
+
+		request->tx_cmd_id = l_genl_family_send(nl80211, msg,
+							anqp_tx_cb, request,
+							NULL);
+		if (!request->tx_cmd_id) {
+			/* Leave the request to time out with the batch */
+			l_error("Error sending ANQP request");
+			l_genl_msg_unref(msg);
+		}
+	}
+}
+
+static void anqp_roc_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct anqp_batch *batch = user_data;
+	int error = l_genl_msg_get_error(msg);
+
+	batch->roc_cmd_id = 0;
 
 	if (error < 0) {
-		result = ANQP_FAILED;
-		l_error("Sending ANQP request failed: %s (%i)",
-			strerror(-error), -error);
+		l_error("Remain on channel failed: %s (%i)", strerror(-error),
+			-error);
+		anqp_batch_fail(batch, ANQP_FAILED);
+		return;
 	}
 
-	if (request->anqp_cb)
-		request->anqp_cb(result, NULL, 0, request->anqp_data);
+	if (L_WARN_ON(nl80211_parse_attrs(msg, NL80211_ATTR_COOKIE,
+						&batch->roc_cookie,
+						NL80211_ATTR_UNSPEC) < 0)) {
+		anqp_batch_fail(batch, ANQP_FAILED);
+		return;
+	}
 
-	if (request->anqp_destroy)
-		request->anqp_destroy(request->anqp_data);
+	batch->have_roc_cookie = true;
 
-	anqp_destroy(request);
+	/* Some drivers report the ROC start before the command returns */
+	if (batch->have_early_roc_cookie &&
+			batch->early_roc_cookie == batch->roc_cookie)
+		anqp_batch_send(batch);
+}
+
+static void anqp_batch_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct anqp_batch *batch = user_data;
+
+	l_debug("%u ANQP requests on %u MHz timed out",
+		l_queue_length(batch->requests), batch->frequency);
+
+	anqp_batch_fail(batch, ANQP_TIMEOUT);
+}
+
+static bool anqp_batch_match_wdev(const void *a, const void *b)
+{
+	const struct anqp_batch *batch = a;
+	const uint64_t *wdev_id = b;
+
+	return batch->wdev_id == *wdev_id;
+}
+
+static void anqp_mlme_notify(struct l_genl_msg *msg, void *user_data)
+{
+	uint8_t cmd = l_genl_msg_get_command(msg);
+	uint64_t wdev_id;
+	uint64_t cookie;
+	struct anqp_batch *batch;
+
+	if (cmd != NL80211_CMD_REMAIN_ON_CHANNEL &&
+			cmd != NL80211_CMD_CANCEL_REMAIN_ON_CHANNEL)
+		return;
+
+	if (nl80211_parse_attrs(msg, NL80211_ATTR_WDEV, &wdev_id,
+				NL80211_ATTR_COOKIE, &cookie,
+				NL80211_ATTR_UNSPEC) < 0)
+		return;
+
+	/* There's at most one batch per wdev */
+	batch = l_queue_find(anqp_batches, anqp_batch_match_wdev, &wdev_id);
+	if (!batch)
+		return;
+
+	if (!batch->have_roc_cookie) {
+		if (batch->roc_cmd_id && cmd == NL80211_CMD_REMAIN_ON_CHANNEL) {
+			batch->early_roc_cookie = cookie;
+			batch->have_early_roc_cookie = true;
+		}
+
+		return;
+	}
+
+	if (cookie != batch->roc_cookie)
+		return;
+
+	if (cmd == NL80211_CMD_REMAIN_ON_CHANNEL) {
+		if (!batch->on_channel)
+			anqp_batch_send(batch);
+
+		return;
+	}
+
+	/* We've left the channel, no more responses are coming */
+	batch->have_roc_cookie = false;
+	anqp_batch_fail(batch, ANQP_TIMEOUT);
+}
+
+static bool anqp_batch_start(struct wiphy_radio_work_item *item)
+{
+	struct anqp_batch *batch = l_container_of(item, struct anqp_batch,
+							work);
+	struct l_genl_msg *msg;
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_REMAIN_ON_CHANNEL, 64);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &batch->wdev_id);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY_FREQ, 4,
+				&batch->frequency);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_DURATION, 4,
+				&batch->duration);
+
+	batch->roc_cmd_id = l_genl_family_send(nl80211, msg, anqp_roc_cb,
+						batch, NULL);
+	if (!batch->roc_cmd_id) {
+		l_error("Error starting remain on channel");
+		l_genl_msg_unref(msg);
+	}
+
+	/*
+	 * Time out after the ROC duration even if the ROC never starts.
+	 * Once it does start the timeout is restarted from there.
+	 */
+	batch->timeout = l_timeout_create_ms(batch->duration,
+						anqp_batch_timeout, batch,
+						NULL);
+	return false;
+}
+
+static void anqp_schedule_dispatch(void);
+
+static void anqp_batch_destroy(struct wiphy_radio_work_item *item)
+{
+	struct anqp_batch *batch = l_container_of(item, struct anqp_batch,
+							work);
+
+	if (batch->roc_cmd_id)
+		l_genl_family_cancel(nl80211, batch->roc_cmd_id);
+
+	if (batch->have_roc_cookie) {
+		struct l_genl_msg *msg;
+
+		msg = l_genl_msg_new_sized(
+					NL80211_CMD_CANCEL_REMAIN_ON_CHANNEL,
+					32);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8,
+					&batch->wdev_id);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_COOKIE, 8,
+					&batch->roc_cookie);
+		l_genl_family_send(nl80211, msg, NULL, NULL, NULL);
+	}
+
+	l_timeout_remove(batch->timeout);
+	l_queue_remove(anqp_batches, batch);
+
+	/* Only non-empty if the wiphy has gone away */
+	l_queue_destroy(batch->requests, anqp_destroy);
+	l_free(batch);
+
+	if (!l_queue_isempty(anqp_pending))
+		anqp_schedule_dispatch();
+}
+
+static const struct wiphy_radio_work_item_ops anqp_batch_work_ops = {
+	.do_work = anqp_batch_start,
+	.destroy = anqp_batch_destroy,
+};
+
+static bool anqp_request_batch_add(void *data, void *user_data)
+{
+	struct anqp_request *request = data;
+	struct anqp_batch *batch = user_data;
+
+	if (request->wdev_id != batch->wdev_id ||
+			request->frequency != batch->frequency)
+		return false;
+
+	if (l_queue_length(batch->requests) >= ANQP_BATCH_MAX_REQUESTS)
+		return false;
+
+	request->batch = batch;
+	l_queue_push_tail(batch->requests, request);
+	return true;
+}
+
+static bool anqp_request_match_idle_wdev(const void *a, const void *b)
+{
+	const struct anqp_request *request = a;
+
+	return !l_queue_find(anqp_batches, anqp_batch_match_wdev,
+				&request->wdev_id);
+}
+
+/*
+ * Start a batch for each wdev with queued requests and none in flight,
+ * picking the channel of the oldest request.
+ */
+static void anqp_dispatch(void *user_data)
+{
+	struct anqp_request *request;
+
+	anqp_dispatch_scheduled = false;
+
+	while ((request = l_queue_find(anqp_pending,
+					anqp_request_match_idle_wdev, NULL))) {
+		struct wiphy *wiphy = wiphy_find_by_wdev(request->wdev_id);
+		struct anqp_batch *batch;
+		uint32_t max_duration;
+
+		if (!wiphy) {
+			l_queue_remove(anqp_pending, request);
+			anqp_request_done(request, ANQP_FAILED, NULL, 0);
+			continue;
+		}
+
+		batch = l_new(struct anqp_batch, 1);
+		batch->wdev_id = request->wdev_id;
+		batch->frequency = request->frequency;
+		batch->requests = l_queue_new();
+		l_queue_foreach_remove(anqp_pending, anqp_request_batch_add,
+					batch);
+
+		batch->duration = ANQP_RESPONSE_TIMEOUT + ANQP_BATCH_FRAME_TIME *
+					(l_queue_length(batch->requests) - 1);
+
+		max_duration = wiphy_get_max_roc_duration(wiphy);
+		if (max_duration && batch->duration > max_duration)
+			batch->duration = max_duration;
+
+		l_queue_push_tail(anqp_batches, batch);
+		wiphy_radio_work_insert(wiphy, &batch->work, 0,
+					&anqp_batch_work_ops);
+	}
+}
+
+/*
+ * Dispatch from an idle so that all the requests made in one go, such as
+ * for the results of a scan, get grouped together.
+ */
+static void anqp_schedule_dispatch(void)
+{
+	if (anqp_dispatch_scheduled)
+		return;
+
+	anqp_dispatch_scheduled = l_idle_oneshot(anqp_dispatch, NULL, NULL);
+	if (!anqp_dispatch_scheduled)
+		anqp_dispatch(NULL);
 }
 
 static uint8_t *anqp_build_frame(const uint8_t *addr, struct scan_bss *bss,
@@ -225,7 +894,6 @@ uint32_t anqp_request(uint64_t wdev_id, const uint8_t *addr,
 			void *user_data, anqp_destroy_func_t destroy)
 {
 	struct anqp_request *request;
-	struct iovec iov[2];
 
 	request = l_new(struct anqp_request, 1);
 
@@ -239,22 +907,97 @@ uint32_t anqp_request(uint64_t wdev_id, const uint8_t *addr,
 	request->frame = anqp_build_frame(addr, bss, anqp, len,
 						&request->frame_len);
 
-	iov[0].iov_base = request->frame;
-	iov[0].iov_len = request->frame_len;
-	iov[1].iov_base = NULL;
+	if (!++anqp_request_id)
+		anqp_request_id = 1;
 
-	l_debug("Sending ANQP request");
+	request->id = anqp_request_id;
 
-	request->id = frame_xchg_start(request->wdev_id, iov,
-				request->frequency, 0, 300, 0,
-				ANQP_GROUP, anqp_frame_timeout, request, NULL,
-				&anqp_frame_prefix, anqp_response_frame_event,
-				NULL);
+	/* Duplicate watches are dropped so this only registers once */
+	frame_watch_add(wdev_id, ANQP_GROUP, 0x00d0, anqp_frame_prefix.data,
+			anqp_frame_prefix.len, anqp_frame_watch_cb, NULL, NULL);
 
-	return true;
+	l_debug("Queuing ANQP request to "MAC" on %u MHz",
+		MAC_STR(bss->addr), request->frequency);
+
+	l_queue_push_tail(anqp_pending, request);
+	anqp_schedule_dispatch();
+
+	return request->id;
 }
 
 void anqp_cancel(uint32_t id)
 {
-	frame_xchg_cancel(id);
+	struct anqp_request *request;
+	struct anqp_batch *batch;
+
+	request = l_queue_remove_if(anqp_pending, anqp_request_match_id, &id);
+	if (request) {
+		anqp_destroy(request);
+		return;
+	}
+
+	request = anqp_find_batched(id);
+	if (!request)
+		return;
+
+	batch = request->batch;
+	l_queue_remove(batch->requests, request);
+	anqp_destroy(request);
+
+	if (l_queue_isempty(batch->requests))
+		anqp_batch_done(batch);
+}
+
+static int anqp_init(void)
+{
+	uint32_t lifetime;
+
+	anqp_pending = l_queue_new();
+	anqp_batches = l_queue_new();
+
+	nl80211 = l_genl_family_new(iwd_get_genl(), NL80211_GENL_NAME);
+
+	if (!l_genl_family_register(nl80211, "mlme", anqp_mlme_notify,
+					NULL, NULL))
+		l_error("Registering for MLME notifications failed");
+
+	if (!l_settings_get_uint(iwd_get_config(), "General",
+					"ANQPCacheLifetime", &lifetime))
+		lifetime = ANQP_CACHE_DEFAULT_LIFETIME;
+
+	if (!lifetime)
+		return 0;
+
+	anqp_cache_lifetime = lifetime * L_USEC_PER_SEC;
+	anqp_cache = l_hashtab_new(sizeof(struct anqp_cache_key),
+					L_HASHTAB_HASH_FAST);
+
+	return 0;
+}
+
+static void anqp_exit(void)
+{
+	struct anqp_batch *batch;
+
+	l_queue_destroy(anqp_pending, anqp_destroy);
+	anqp_pending = NULL;
+
+	while ((batch = l_queue_peek_head(anqp_batches)))
+		anqp_batch_done(batch);
+
+	l_queue_destroy(anqp_batches, NULL);
+	anqp_batches = NULL;
+
+	l_genl_family_free(nl80211);
+	nl80211 = NULL;
+
+	l_hashtab_destroy(anqp_cache, l_free);
+	anqp_cache = NULL;
+
+	l_settings_free(anqp_cache_settings);
+	anqp_cache_settings = NULL;
+	anqp_cache_loaded = false;
 }
+
+IWD_MODULE(anqp, anqp_init, anqp_exit)
+IWD_MODULE_DEPENDS(anqp, frame_xchg)
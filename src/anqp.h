@@ -39,3 +39,8 @@ uint32_t anqp_request(uint64_t wdev_id, const uint8_t *addr,
 			anqp_response_func_t cb, void *user_data,
 			anqp_destroy_func_t destroy);
 void anqp_cancel(uint32_t id);
+
+const void *anqp_cache_lookup(const uint8_t *hessid, const uint8_t *bssid,
+				size_t *out_len);
+void anqp_cache_add(const uint8_t *hessid, const uint8_t *bssid,
+			const void *anqp, size_t len);
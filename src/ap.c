@@ -25,6 +25,8 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
 #include <linux/if_ether.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -56,6 +58,16 @@
 #include "src/storage.h"
 #include "src/diagnostic.h"
 
+struct ap_acs_channel {
+	uint8_t channel;
+	uint32_t freq;
+	unsigned int bss_count;		/* Overlapping BSSes seen in the scan */
+	int8_t noise;
+	uint64_t time;
+	uint64_t time_busy;
+	bool have_noise : 1;
+};
+
 struct ap_state {
 	struct netdev *netdev;
 	struct l_genl_family *nl80211;
@@ -66,7 +78,20 @@ struct ap_state {
 	char ssid[33];
 	char passphrase[64];
 	uint8_t psk[32];
+	/* Non-zero while the PSK is derived on a worker thread */
+	uint32_t psk_work_id;
+	enum scan_band band;
 	uint8_t channel;
+	uint32_t ch_width;		/* enum nl80211_chan_width */
+	uint32_t center_freq1;
+	uint8_t ht_sec_offset;		/* HT Operation Secondary Ch Offset */
+	uint8_t vht_center_channel;
+	const uint8_t *ht_capa;		/* wiphy's HT Capabilities IE body */
+	const uint8_t *vht_capa;	/* wiphy's VHT Capabilities IE body */
+	uint8_t wmm_ac_params[4][4];	/* AC Parameter Records, BE to VO */
+	struct ap_acs_channel acs_channels[3];
+	uint32_t acs_scan_id;
+	uint32_t acs_survey_id;
 	uint8_t *authorized_macs;
 	unsigned int authorized_macs_num;
 	char wsc_name[33];
@@ -80,6 +105,13 @@ struct ap_state {
 	uint32_t mlme_watch;
 	uint8_t gtk[CRYPTO_MAX_GTK_LEN];
 	uint8_t gtk_index;
+	unsigned int gtk_rekey_interval;
+	struct l_timeout *gtk_rekey_timeout;
+	struct l_timeout *gtk_rekey_retry;
+	unsigned int gtk_rekey_attempt;
+	uint32_t gtk_rekey_cmd_id;
+	uint8_t gtk_rekey_kde[8 + CRYPTO_MAX_GTK_LEN];
+	uint8_t gtk_rekey_rsc[6];
 	struct l_queue *wsc_pbc_probes;
 	struct l_timeout *wsc_pbc_timeout;
 	uint16_t wsc_dpid;
@@ -87,16 +119,47 @@ struct ap_state {
 
 	uint16_t last_aid;
 	struct l_queue *sta_states;
+	struct l_hashtab *sta_index;	/* sta_states keyed by address */
+
+	/* Probe Response up to the extra IEs, rebuilt with the beacon */
+	uint8_t *probe_resp;
+	size_t probe_resp_len;
+	/*
+	 * (Re)Association Response IEs shared by all stations, also rebuilt
+	 * with the beacon: the Supported Rates, HT and VHT, and WMM IEs, in
+	 * this order.  The offsets tell where each part ends.
+	 */
+	uint8_t *assoc_resp_ies;
+	size_t assoc_resp_rates_end;
+	size_t assoc_resp_ht_vht_end;
+	size_t assoc_resp_ies_len;
 
 	struct l_dhcp_server *server;
 	uint32_t rtnl_add_cmd;
 	char *own_ip;
 	unsigned int ip_prefix;
 
+	/* Last GET_STATION dump, shared by GetDiagnostics callers */
+	struct l_queue *sta_info;
+	uint64_t sta_info_time;
+	struct ap_sta_info_dump *sta_info_dump;
+	struct l_queue *sta_info_requests;
+	unsigned int inactivity_timeout;
+	struct l_timeout *inactivity_check;
+
 	bool started : 1;
 	bool gtk_set : 1;
 	bool cleanup_ip : 1;
 	bool use_ip_pool : 1;
+	bool probe_resp_offload : 1;
+	bool beacon_update_pending : 1;
+	bool gtk_rekey_switch : 1;
+	bool uapsd : 1;
+};
+
+struct ap_sta_info_dump {
+	struct ap_state *ap;
+	struct l_queue *info;
 };
 
 struct sta_state {
@@ -119,6 +182,13 @@ struct sta_state {
 	struct l_settings *wsc_settings;
 	uint8_t wsc_uuid_e[16];
 	bool wsc_v2;
+	uint8_t ht_capa[26];
+	uint8_t vht_capa[12];
+	bool ht : 1;
+	bool vht : 1;
+	bool wme : 1;
+	bool gtk_rekey_pending : 1;
+	uint8_t wmm_qos_info;		/* QoS Info from the WMM IE */
 };
 
 struct ap_wsc_pbc_probe_record {
@@ -143,6 +213,10 @@ struct ap_ip_pool pool;
 static uint32_t netdev_watch;
 struct l_netlink *rtnl;
 
+/* All BSSes, several may be sharing a wiphy through separate AP netdevs */
+static struct l_queue *ap_list;
+static bool beacon_update_scheduled;
+
 /*
  * Creates pool of IPs which AP intefaces can use. Each call to ip_pool_get
  * will advance the subnet +1 so there are no IP conflicts between AP
@@ -237,8 +311,16 @@ static const char *broadcast_from_ip(const char *ip)
 	return inet_ntoa(ia);
 }
 
+static void ap_gtk_rekey_check_done(struct ap_state *ap);
+static void ap_gtk_rekey_sta(struct sta_state *sta);
+
 static void ap_stop_handshake(struct sta_state *sta)
 {
+	if (sta->gtk_rekey_pending) {
+		sta->gtk_rekey_pending = false;
+		ap_gtk_rekey_check_done(sta->ap);
+	}
+
 	if (sta->sm) {
 		eapol_sm_free(sta->sm);
 		sta->sm = NULL;
@@ -288,6 +370,13 @@ static void ap_sta_free(void *data)
 	l_free(sta);
 }
 
+static void ap_sta_info_request_abort(void *data)
+{
+	struct l_dbus_message *message = data;
+
+	dbus_pending_reply(&message, dbus_error_aborted(message));
+}
+
 static void ap_reset(struct ap_state *ap)
 {
 	struct netdev *netdev = ap->netdev;
@@ -311,6 +400,47 @@ static void ap_reset(struct ap_state *ap)
 	if (ap->rtnl_add_cmd)
 		l_netlink_cancel(rtnl, ap->rtnl_add_cmd);
 
+	if (ap->psk_work_id) {
+		l_work_cancel(ap->psk_work_id);
+		ap->psk_work_id = 0;
+	}
+
+	if (ap->acs_scan_id) {
+		scan_cancel(netdev_get_wdev_id(netdev), ap->acs_scan_id);
+		ap->acs_scan_id = 0;
+	}
+
+	if (ap->acs_survey_id) {
+		l_genl_family_cancel(ap->nl80211, ap->acs_survey_id);
+		ap->acs_survey_id = 0;
+	}
+
+	l_timeout_remove(ap->gtk_rekey_timeout);
+	ap->gtk_rekey_timeout = NULL;
+	l_timeout_remove(ap->gtk_rekey_retry);
+	ap->gtk_rekey_retry = NULL;
+	ap->gtk_rekey_switch = false;
+
+	if (ap->gtk_rekey_cmd_id) {
+		l_genl_family_cancel(ap->nl80211, ap->gtk_rekey_cmd_id);
+		ap->gtk_rekey_cmd_id = 0;
+	}
+
+	/* A dump in flight cleans up after itself once orphaned */
+	if (ap->sta_info_dump) {
+		ap->sta_info_dump->ap = NULL;
+		ap->sta_info_dump = NULL;
+	}
+
+	l_queue_destroy(ap->sta_info_requests, ap_sta_info_request_abort);
+	ap->sta_info_requests = NULL;
+	l_queue_destroy(ap->sta_info, l_free);
+	ap->sta_info = NULL;
+	l_timeout_remove(ap->inactivity_check);
+	ap->inactivity_check = NULL;
+
+	l_hashtab_destroy(ap->sta_index, NULL);
+	ap->sta_index = NULL;
 	l_queue_destroy(ap->sta_states, ap_sta_free);
 
 	if (ap->rates)
@@ -318,7 +448,14 @@ static void ap_reset(struct ap_state *ap)
 
 	l_queue_destroy(ap->wsc_pbc_probes, l_free);
 
+	l_free(ap->probe_resp);
+	ap->probe_resp = NULL;
+	l_free(ap->assoc_resp_ies);
+	ap->assoc_resp_ies = NULL;
+
 	ap->started = false;
+	ap->beacon_update_pending = false;
+	l_queue_remove(ap_list, ap);
 
 	/* Delete IP if one was set by IWD */
 	if (ap->cleanup_ip)
@@ -372,16 +509,39 @@ static void ap_del_station(struct sta_state *sta, uint16_t reason,
 					ap->user_data);
 }
 
-static bool ap_sta_match_addr(const void *a, const void *b)
+static struct sta_state *ap_sta_find(struct ap_state *ap, const uint8_t *addr)
+{
+	return l_hashtab_lookup(ap->sta_index, addr);
+}
+
+static void ap_sta_add(struct ap_state *ap, struct sta_state *sta)
+{
+	if (!ap->sta_states)
+		ap->sta_states = l_queue_new();
+
+	/* Station addresses are picked by the peers, use a keyed hash */
+	if (!ap->sta_index)
+		ap->sta_index = l_hashtab_new(ETH_ALEN,
+						L_HASHTAB_HASH_SIPHASH);
+
+	l_queue_push_tail(ap->sta_states, sta);
+	l_hashtab_insert(ap->sta_index, sta->addr, sta);
+}
+
+static struct sta_state *ap_sta_remove(struct ap_state *ap,
+					const uint8_t *addr)
 {
-	const struct sta_state *sta = a;
+	struct sta_state *sta = l_hashtab_remove(ap->sta_index, addr);
+
+	if (sta)
+		l_queue_remove(ap->sta_states, sta);
 
-	return !memcmp(sta->addr, b, 6);
+	return sta;
 }
 
 static void ap_remove_sta(struct sta_state *sta)
 {
-	if (!l_queue_remove(sta->ap->sta_states, sta)) {
+	if (!ap_sta_remove(sta->ap, sta->addr)) {
 		l_error("tried to remove station that doesn't exist");
 		return;
 	}
@@ -389,6 +549,137 @@ static void ap_remove_sta(struct sta_state *sta)
 	ap_sta_free(sta);
 }
 
+#define AP_STA_INFO_MAX_AGE_MS		1000
+#define AP_INACTIVITY_CHECK_INTERVAL	60
+#define AP_DEFAULT_INACTIVITY_TIMEOUT	300
+
+static void ap_sta_info_reply(void *data, void *user_data);
+
+/*
+ * Disassociate stations the kernel hasn't seen a frame from in
+ * InactivityTimeout seconds, so that clients which left without telling
+ * us don't hold on to their AID, handshake state and DHCP lease.
+ */
+static void ap_check_inactivity(struct ap_state *ap)
+{
+	const struct l_queue_entry *entry;
+	struct l_queue *inactive;
+	struct sta_state *sta;
+
+	if (!ap->inactivity_timeout)
+		return;
+
+	inactive = l_queue_new();
+
+	for (entry = l_queue_get_entries(ap->sta_info); entry;
+			entry = entry->next) {
+		const struct diagnostic_station_info *info = entry->data;
+
+		if (!info->have_inactive_time ||
+				info->inactive_time / 1000 <
+				ap->inactivity_timeout)
+			continue;
+
+		sta = ap_sta_find(ap, info->addr);
+		if (!sta || !sta->associated)
+			continue;
+
+		l_queue_push_tail(inactive, ap_sta_remove(ap, sta->addr));
+	}
+
+	/*
+	 * Already off the station list so that the AP being stopped from the
+	 * STATION_REMOVED handler doesn't free them under us
+	 */
+	while ((sta = l_queue_pop_head(inactive))) {
+		if (ap->started) {
+			l_debug("Station "MAC" inactive, disassociating",
+				MAC_STR(sta->addr));
+
+			if (ap->server)
+				l_dhcp_server_expire_by_mac(ap->server,
+								sta->addr);
+
+			ap_del_station(sta,
+				MMPDU_REASON_CODE_DISASSOC_DUE_TO_INACTIVITY,
+				true);
+		}
+
+		ap_sta_free(sta);
+	}
+
+	l_queue_destroy(inactive, NULL);
+}
+
+static void ap_sta_info_dump_cb(const struct diagnostic_station_info *info,
+				void *user_data)
+{
+	struct ap_sta_info_dump *dump = user_data;
+
+	l_queue_push_tail(dump->info, l_memdup(info, sizeof(*info)));
+}
+
+static void ap_sta_info_dump_destroy(void *user_data)
+{
+	struct ap_sta_info_dump *dump = user_data;
+	struct ap_state *ap = dump->ap;
+
+	if (!ap) {
+		l_queue_destroy(dump->info, l_free);
+		l_free(dump);
+		return;
+	}
+
+	ap->sta_info_dump = NULL;
+	l_queue_destroy(ap->sta_info, l_free);
+	ap->sta_info = dump->info;
+	ap->sta_info_time = l_time_now();
+	l_free(dump);
+
+	l_queue_foreach(ap->sta_info_requests, ap_sta_info_reply, ap);
+	l_queue_clear(ap->sta_info_requests, NULL);
+
+	ap_check_inactivity(ap);
+}
+
+/* One NL80211_CMD_GET_STATION dump at a time, later callers share it */
+static int ap_sta_info_dump_start(struct ap_state *ap)
+{
+	struct ap_sta_info_dump *dump;
+	int ret;
+
+	if (ap->sta_info_dump)
+		return 0;
+
+	dump = l_new(struct ap_sta_info_dump, 1);
+	dump->ap = ap;
+	dump->info = l_queue_new();
+
+	ret = netdev_get_all_stations(ap->netdev, ap_sta_info_dump_cb, dump,
+					ap_sta_info_dump_destroy);
+	if (ret < 0) {
+		l_queue_destroy(dump->info, NULL);
+		l_free(dump);
+		return ret;
+	}
+
+	ap->sta_info_dump = dump;
+	return 0;
+}
+
+static void ap_inactivity_check_cb(struct l_timeout *timeout,
+					void *user_data)
+{
+	struct ap_state *ap = user_data;
+	int ret = ap_sta_info_dump_start(ap);
+
+	if (ret < 0)
+		l_debug("GET_STATION dump failed: %s (%i)",
+				strerror(-ret), -ret);
+
+	l_timeout_modify(timeout, AP_INACTIVITY_CHECK_INTERVAL);
+}
+
 static void ap_set_sta_cb(struct l_genl_msg *msg, void *user_data)
 {
 	if (l_genl_msg_get_error(msg) < 0)
@@ -629,13 +920,38 @@ static size_t ap_get_wsc_ie_len(struct ap_state *ap,
 	return 256;
 }
 
+static void ap_wsc_probe_req_process(struct ap_state *ap,
+					const struct mmpdu_header *client_frame,
+					size_t client_frame_len)
+{
+	const struct mmpdu_probe_request *req = mmpdu_body(client_frame);
+	size_t req_ies_len = (void *) client_frame + client_frame_len -
+		(void *) req->ies;
+	ssize_t req_wsc_data_size;
+	const uint8_t *wsc_data;
+	uint8_t *wsc_copy = NULL;
+
+	wsc_data = ie_tlv_peek_wsc_payload(req->ies, req_ies_len,
+						&req_wsc_data_size);
+	if (!wsc_data && req_wsc_data_size == -EMSGSIZE)
+		wsc_data = wsc_copy = ie_tlv_extract_wsc_payload(req->ies,
+							req_ies_len,
+							&req_wsc_data_size);
+
+	if (!wsc_data)
+		return;
+
+	ap_process_wsc_probe_req(ap, client_frame->address_2, wsc_data,
+					req_wsc_data_size);
+	l_free(wsc_copy);
+}
+
 static size_t ap_write_wsc_ie(struct ap_state *ap,
 				enum mpdu_management_subtype type,
 				const struct mmpdu_header *client_frame,
 				size_t client_frame_len,
 				uint8_t *out_buf)
 {
-	const uint8_t *from = client_frame->address_2;
 	uint8_t *wsc_data;
 	size_t wsc_data_size;
 	uint8_t *wsc_ie;
@@ -645,24 +961,16 @@ static size_t ap_write_wsc_ie(struct ap_state *ap,
 	/* WSC IE */
 	if (type == MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE) {
 		struct wsc_probe_response wsc_pr = {};
-		const struct mmpdu_probe_request *req =
-			mmpdu_body(client_frame);
-		size_t req_ies_len = (void *) client_frame + client_frame_len -
-			(void *) req->ies;
-		ssize_t req_wsc_data_size;
 
 		/*
 		 * Process the client Probe Request WSC IE first as it may
 		 * cause us to exit "active PBC mode" and that will be
 		 * immediately reflected in our Probe Response WSC IE.
+		 * No client frame when building the offload template.
 		 */
-		wsc_data = ie_tlv_extract_wsc_payload(req->ies, req_ies_len,
-							&req_wsc_data_size);
-		if (wsc_data) {
-			ap_process_wsc_probe_req(ap, from, wsc_data,
-							req_wsc_data_size);
-			l_free(wsc_data);
-		}
+		if (client_frame)
+			ap_wsc_probe_req_process(ap, client_frame,
+							client_frame_len);
 
 		wsc_pr.version2 = true;
 		wsc_pr.state = WSC_STATE_CONFIGURED;
@@ -707,8 +1015,8 @@ static size_t ap_write_wsc_ie(struct ap_state *ap,
 	} else if (L_IN_SET(type, MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_RESPONSE,
 			MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_RESPONSE)) {
 		struct wsc_association_response wsc_resp = {};
-		struct sta_state *sta =
-			l_queue_find(ap->sta_states, ap_sta_match_addr, from);
+		struct sta_state *sta = ap_sta_find(ap,
+						client_frame->address_2);
 
 		if (!sta || sta->assoc_rsne)
 			return 0;
@@ -846,20 +1154,18 @@ static size_t ap_build_beacon_pr_head(struct ap_state *ap,
 	ie_tlv_builder_set_length(&builder, count);
 
 	/* DSSS Parameter Set IE for DSSS, HR, ERP and HT PHY rates */
-	ie_tlv_builder_next(&builder, IE_TYPE_DSSS_PARAMETER_SET);
-	ie_tlv_builder_set_data(&builder, &ap->channel, 1);
+	if (ap->band == SCAN_BAND_2_4_GHZ) {
+		ie_tlv_builder_next(&builder, IE_TYPE_DSSS_PARAMETER_SET);
+		ie_tlv_builder_set_data(&builder, &ap->channel, 1);
+	}
 
 	ie_tlv_builder_finalize(&builder, &len);
 	return 36 + len;
 }
 
-/* Beacon / Probe Response frame portion after the TIM IE */
-static size_t ap_build_beacon_pr_tail(struct ap_state *ap,
-					enum mpdu_management_subtype stype,
-					const struct mmpdu_header *req,
-					size_t req_len, uint8_t *out_buf)
+/* Beacon / Probe Response frame portion after the TIM IE until the extra IEs */
+static size_t ap_build_beacon_pr_rsne(struct ap_state *ap, uint8_t *out_buf)
 {
-	size_t len;
 	struct ie_rsn_info rsn;
 
 	/* TODO: Country IE between TIM IE and RSNE */
@@ -868,12 +1174,180 @@ static size_t ap_build_beacon_pr_tail(struct ap_state *ap,
 	ap_set_rsn_info(ap, &rsn);
 	if (!ie_build_rsne(&rsn, out_buf))
 		return 0;
-	len = 2 + out_buf[1];
 
+	return 2 + out_buf[1];
+}
+
+/*
+ * WMM Parameter Element, WMM v1.2.0 Section 2.2.2.  Stations, HT ones in
+ * particular, won't use QoS data frames and thus A-MPDU aggregation with
+ * a non-QoS AP.  Used in Beacons, Probe Responses and, for WMM stations,
+ * (Re)Association Responses.
+ */
+static size_t ap_write_wmm_ie(struct ap_state *ap, uint8_t *out_buf)
+{
+	static const uint8_t wmm_header[] = {
+		0x00, 0x50, 0xf2, 0x02, 0x01, 0x01,	/* WMM Parameter v1 */
+	};
+	uint8_t *ptr = out_buf;
+
+	*ptr++ = IE_TYPE_VENDOR_SPECIFIC;
+	*ptr++ = sizeof(wmm_header) + 2 + sizeof(ap->wmm_ac_params);
+	memcpy(ptr, wmm_header, sizeof(wmm_header));
+	ptr += sizeof(wmm_header);
+
+	/* QoS Info: U-APSD, Parameter Set Count 0 */
+	*ptr++ = ap->uapsd ? 0x80 : 0x00;
+	*ptr++ = 0;	/* Reserved */
+
+	memcpy(ptr, ap->wmm_ac_params, sizeof(ap->wmm_ac_params));
+	ptr += sizeof(ap->wmm_ac_params);
+
+	return ptr - out_buf;
+}
+
+/*
+ * HT and VHT Capabilities and Operation IEs, used in Beacons, Probe
+ * Responses and (Re)Association Responses.
+ */
+static size_t ap_write_ht_vht_ies(struct ap_state *ap, uint8_t *out_buf)
+{
+	uint8_t *ptr = out_buf;
+	uint16_t ht_cap_info;
+
+	if (!ap->ht_capa)
+		return 0;
+
+	*ptr++ = IE_TYPE_HT_CAPABILITIES;
+	*ptr++ = 26;
+	memcpy(ptr, ap->ht_capa, 26);
+
+	/* Don't claim 40MHz support (or Short GI for 40MHz) on a 20MHz BSS */
+	if (ap->ch_width == NL80211_CHAN_WIDTH_20) {
+		ht_cap_info = l_get_le16(ptr) & ~((1 << 1) | (1 << 6));
+		l_put_le16(ht_cap_info, ptr);
+	}
+
+	ptr += 26;
+
+	*ptr++ = IE_TYPE_HT_OPERATION;
+	*ptr++ = 22;
+	memset(ptr, 0, 22);
+	ptr[0] = ap->channel;
+
+	/* Secondary Channel Offset and STA Channel Width */
+	if (ap->ht_sec_offset)
+		ptr[1] = ap->ht_sec_offset | (1 << 2);
+
+	ptr += 22;
+
+	if (ap->vht_capa) {
+		*ptr++ = IE_TYPE_VHT_CAPABILITIES;
+		*ptr++ = 12;
+		memcpy(ptr, ap->vht_capa, 12);
+		ptr += 12;
+
+		*ptr++ = IE_TYPE_VHT_OPERATION;
+		*ptr++ = 5;
+		ptr[0] = ap->vht_center_channel ? 1 : 0; /* 80MHz or 20/40 */
+		ptr[1] = ap->vht_center_channel;
+		ptr[2] = 0;
+		l_put_le16(0xfffc, ptr + 3);	/* Basic MCS 0-7 for 1 SS */
+		ptr += 5;
+	}
+
+	return ptr - out_buf;
+}
+
+/* Beacon / Probe Response frame portion after the TIM IE */
+static size_t ap_build_beacon_pr_tail(struct ap_state *ap,
+					enum mpdu_management_subtype stype,
+					const struct mmpdu_header *req,
+					size_t req_len, uint8_t *out_buf)
+{
+	size_t len;
+
+	len = ap_build_beacon_pr_rsne(ap, out_buf);
+	if (!len)
+		return 0;
+
+	len += ap_write_ht_vht_ies(ap, out_buf + len);
+	len += ap_write_wmm_ie(ap, out_buf + len);
 	len += ap_write_extra_ies(ap, stype, req, req_len, out_buf + len);
 	return len;
 }
 
+/*
+ * Everything in our Probe Responses except for the destination address and
+ * the WSC and P2P IEs, which depend on the Probe Request, is the same for
+ * all requests so build that part once for every beacon update.
+ */
+static bool ap_build_probe_resp(struct ap_state *ap)
+{
+	static const uint8_t bcast_addr[6] = {
+		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+	};
+	uint8_t buf[512];
+	size_t len, rsne_len;
+
+	len = ap_build_beacon_pr_head(ap,
+					MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
+					bcast_addr, buf, sizeof(buf));
+	if (!len)
+		return false;
+
+	rsne_len = ap_build_beacon_pr_rsne(ap, buf + len);
+	if (!rsne_len)
+		return false;
+
+	len += rsne_len;
+	len += ap_write_ht_vht_ies(ap, buf + len);
+	len += ap_write_wmm_ie(ap, buf + len);
+
+	ap->probe_resp = l_memdup(buf, len);
+	ap->probe_resp_len = len;
+	return true;
+}
+
+/*
+ * The template given to drivers answering Probe Requests themselves.  Only
+ * used without P2P, whose IEs depend on each Probe Request.
+ */
+static uint8_t *ap_build_probe_resp_template(struct ap_state *ap,
+						size_t *out_len)
+{
+	uint8_t *buf;
+	size_t len;
+
+	if (!ap->probe_resp && !ap_build_probe_resp(ap))
+		return NULL;
+
+	buf = l_malloc(ap->probe_resp_len + ap_get_extra_ies_len(ap,
+					MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
+					NULL, 0));
+	memcpy(buf, ap->probe_resp, ap->probe_resp_len);
+	len = ap->probe_resp_len;
+	len += ap_write_extra_ies(ap, MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
+					NULL, 0, buf + len);
+
+	*out_len = len;
+	return buf;
+}
+
+static void ap_append_probe_resp_template(struct ap_state *ap,
+						struct l_genl_msg *msg)
+{
+	L_AUTO_FREE_VAR(uint8_t *, probe_resp) = NULL;
+	size_t probe_resp_len;
+
+	probe_resp = ap_build_probe_resp_template(ap, &probe_resp_len);
+	if (!probe_resp)
+		return;
+
+	l_genl_msg_append_attr(msg, NL80211_ATTR_PROBE_RESP, probe_resp_len,
+				probe_resp);
+}
+
 static void ap_set_beacon_cb(struct l_genl_msg *msg, void *user_data)
 {
 	int error = l_genl_msg_get_error(msg);
@@ -882,7 +1356,7 @@ static void ap_set_beacon_cb(struct l_genl_msg *msg, void *user_data)
 		l_error("SET_BEACON failed: %s (%i)", strerror(-error), -error);
 }
 
-void ap_update_beacon(struct ap_state *ap)
+static void ap_send_beacon_update(struct ap_state *ap)
 {
 	struct l_genl_msg *cmd;
 	uint8_t head[256];
@@ -896,8 +1370,10 @@ void ap_update_beacon(struct ap_state *ap)
 		0xff, 0xff, 0xff, 0xff, 0xff, 0xff
 	};
 
-	if (L_WARN_ON(!ap->started))
-		return;
+	l_free(ap->probe_resp);
+	ap->probe_resp = NULL;
+	l_free(ap->assoc_resp_ies);
+	ap->assoc_resp_ies = NULL;
 
 	head_len = ap_build_beacon_pr_head(ap, MPDU_MANAGEMENT_SUBTYPE_BEACON,
 						bcast_addr, head, sizeof(head));
@@ -907,7 +1383,8 @@ void ap_update_beacon(struct ap_state *ap)
 		return;
 
 	cmd = l_genl_msg_new_sized(NL80211_CMD_SET_BEACON,
-					32 + head_len + tail_len);
+					32 + head_len + tail_len +
+					(ap->probe_resp_offload ? 512 : 0));
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_WDEV, 8, &wdev_id);
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_BEACON_HEAD, head_len, head);
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_BEACON_TAIL, tail_len, tail);
@@ -915,6 +1392,9 @@ void ap_update_beacon(struct ap_state *ap)
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_IE_PROBE_RESP, 0, "");
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_IE_ASSOC_RESP, 0, "");
 
+	if (ap->probe_resp_offload)
+		ap_append_probe_resp_template(ap, cmd);
+
 	if (l_genl_family_send(ap->nl80211, cmd, ap_set_beacon_cb, NULL, NULL))
 		return;
 
@@ -922,13 +1402,60 @@ void ap_update_beacon(struct ap_state *ap)
 	l_error("Issuing SET_BEACON failed");
 }
 
+static void ap_beacon_update_idle(void *user_data)
+{
+	const struct l_queue_entry *entry;
+
+	beacon_update_scheduled = false;
+
+	for (entry = l_queue_get_entries(ap_list); entry;
+			entry = entry->next) {
+		struct ap_state *ap = entry->data;
+
+		if (!ap->beacon_update_pending)
+			continue;
+
+		ap->beacon_update_pending = false;
+
+		if (ap->started)
+			ap_send_beacon_update(ap);
+	}
+}
+
+/*
+ * Beacon changes are batched so that multiple updates to one BSS, or to
+ * the BSSes sharing a radio, issued from the same main loop iteration
+ * result in a single SET_BEACON per BSS.
+ */
+void ap_update_beacon(struct ap_state *ap)
+{
+	if (L_WARN_ON(!ap->started))
+		return;
+
+	/* Probe and Association Responses must reflect it immediately */
+	l_free(ap->probe_resp);
+	ap->probe_resp = NULL;
+	l_free(ap->assoc_resp_ies);
+	ap->assoc_resp_ies = NULL;
+
+	ap->beacon_update_pending = true;
+
+	if (beacon_update_scheduled)
+		return;
+
+	beacon_update_scheduled = l_idle_oneshot(ap_beacon_update_idle,
+							NULL, NULL);
+	if (!beacon_update_scheduled)
+		ap_beacon_update_idle(NULL);
+}
+
 static uint32_t ap_send_mgmt_frame(struct ap_state *ap,
 					const struct mmpdu_header *frame,
 					size_t frame_len,
 					frame_xchg_cb_t callback,
 					void *user_data)
 {
-	uint32_t ch_freq = scan_channel_to_freq(ap->channel, SCAN_BAND_2_4_GHZ);
+	uint32_t ch_freq = scan_channel_to_freq(ap->channel, ap->band);
 	uint64_t wdev_id = netdev_get_wdev_id(ap->netdev);
 	struct iovec iov[2];
 
@@ -993,6 +1520,24 @@ static void ap_handshake_event(struct handshake_state *hs,
 	switch (event) {
 	case HANDSHAKE_EVENT_COMPLETE:
 		ap_new_rsna(sta);
+
+		/*
+		 * The 4-Way Handshake started before a group rekey and
+		 * installed the old GTK, follow up with the new one.
+		 */
+		if (sta->ap->gtk_set && hs->gtk_index != sta->ap->gtk_index &&
+				!sta->ap->gtk_rekey_cmd_id)
+			ap_gtk_rekey_sta(sta);
+
+		break;
+	case HANDSHAKE_EVENT_REKEY_COMPLETE:
+		l_debug("STA "MAC" has the new GTK", MAC_STR(sta->addr));
+
+		if (sta->gtk_rekey_pending) {
+			sta->gtk_rekey_pending = false;
+			ap_gtk_rekey_check_done(sta->ap);
+		}
+
 		break;
 	case HANDSHAKE_EVENT_FAILED:
 		netdev_handshake_failed(hs, va_arg(args, int));
@@ -1150,7 +1695,8 @@ static void ap_start_eap_wsc(struct sta_state *sta)
 	ap_start_handshake(sta, wait_for_eapol_start, NULL);
 }
 
-static struct l_genl_msg *ap_build_cmd_del_key(struct ap_state *ap)
+static struct l_genl_msg *ap_build_cmd_del_key(struct ap_state *ap,
+							uint8_t key_index)
 {
 	uint32_t ifindex = netdev_get_ifindex(ap->netdev);
 	struct l_genl_msg *msg;
@@ -1159,7 +1705,7 @@ static struct l_genl_msg *ap_build_cmd_del_key(struct ap_state *ap)
 
 	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &ifindex);
 	l_genl_msg_enter_nested(msg, NL80211_ATTR_KEY);
-	l_genl_msg_append_attr(msg, NL80211_KEY_IDX, 1, &ap->gtk_index);
+	l_genl_msg_append_attr(msg, NL80211_KEY_IDX, 1, &key_index);
 	l_genl_msg_leave_nested(msg);
 
 	return msg;
@@ -1182,12 +1728,42 @@ static struct l_genl_msg *ap_build_cmd_new_station(struct sta_state *sta)
 			(1 << NL80211_STA_FLAG_ASSOCIATED),
 	};
 
+	if (sta->wme) {
+		flags.mask |= 1 << NL80211_STA_FLAG_WME;
+		flags.set |= 1 << NL80211_STA_FLAG_WME;
+	}
+
 	msg = l_genl_msg_new_sized(NL80211_CMD_NEW_STATION, 300);
 
 	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &ifindex);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_MAC, 6, sta->addr);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_STA_FLAGS2, 8, &flags);
 
+	/* The HT and VHT capabilities can't be changed with SET_STATION */
+	if (sta->ht && sta->ap->ht_capa)
+		l_genl_msg_append_attr(msg, NL80211_ATTR_HT_CAPABILITY, 26,
+					sta->ht_capa);
+
+	if (sta->vht && sta->ap->vht_capa)
+		l_genl_msg_append_attr(msg, NL80211_ATTR_VHT_CAPABILITY, 12,
+					sta->vht_capa);
+
+	/*
+	 * The station's U-APSD enabled ACs, in the same bit order as in its
+	 * QoS Info field, and the Max SP Length
+	 */
+	if (sta->wme && sta->ap->uapsd) {
+		uint8_t queues = sta->wmm_qos_info & 0x0f;
+		uint8_t max_sp = (sta->wmm_qos_info >> 5) & 0x03;
+
+		l_genl_msg_enter_nested(msg, NL80211_ATTR_STA_WME);
+		l_genl_msg_append_attr(msg, NL80211_STA_WME_UAPSD_QUEUES, 1,
+					&queues);
+		l_genl_msg_append_attr(msg, NL80211_STA_WME_MAX_SP, 1,
+					&max_sp);
+		l_genl_msg_leave_nested(msg);
+	}
+
 	return msg;
 }
 
@@ -1205,21 +1781,234 @@ static void ap_gtk_op_cb(struct l_genl_msg *msg, void *user_data)
 	}
 }
 
-static void ap_associate_sta_cb(struct l_genl_msg *msg, void *user_data)
+#define AP_GTK_REKEY_RETRY_MS	1000
+#define AP_GTK_REKEY_ATTEMPTS	3
+
+static bool ap_sta_match_gtk_rekey_pending(const void *data,
+						const void *user_data)
 {
-	struct sta_state *sta = user_data;
-	struct ap_state *ap = sta->ap;
+	const struct sta_state *sta = data;
 
-	if (l_genl_msg_get_error(msg) < 0) {
-		l_error("NEW_STATION/SET_STATION failed: %i",
-			l_genl_msg_get_error(msg));
-		return;
-	}
+	return sta->gtk_rekey_pending;
+}
 
-	/*
-	 * WSC v2.0.5 Section 8.2:
-	 * "Therefore if a WSC IE is present in the (re)association request,
-	 * the AP shall engage in EAP-WSC with the station and shall not
+/*
+ * Called when the last station has acked the new GTK, has left or has
+ * been disconnected for failing to ack it.  Only now is it safe to start
+ * transmitting group traffic with the new key.
+ */
+static void ap_gtk_rekey_finish(struct ap_state *ap)
+{
+	uint32_t ifindex = netdev_get_ifindex(ap->netdev);
+	struct l_genl_msg *msg;
+
+	l_timeout_remove(ap->gtk_rekey_retry);
+	ap->gtk_rekey_retry = NULL;
+
+	if (!ap->gtk_rekey_switch)
+		return;
+
+	ap->gtk_rekey_switch = false;
+
+	l_debug("Switching to GTK index %u", ap->gtk_index);
+
+	msg = nl80211_build_set_key(ifindex, ap->gtk_index);
+	if (!l_genl_family_send(ap->nl80211, msg, ap_gtk_op_cb, NULL, NULL)) {
+		l_genl_msg_unref(msg);
+		l_error("Issuing SET_KEY failed");
+		return;
+	}
+
+	msg = ap_build_cmd_del_key(ap, ap->gtk_index ^ 3);
+	if (!l_genl_family_send(ap->nl80211, msg, ap_gtk_op_cb, NULL, NULL)) {
+		l_genl_msg_unref(msg);
+		l_error("Issuing DEL_KEY failed");
+	}
+}
+
+static void ap_gtk_rekey_check_done(struct ap_state *ap)
+{
+	if (!ap->gtk_rekey_retry)
+		return;
+
+	if (l_queue_find(ap->sta_states, ap_sta_match_gtk_rekey_pending, NULL))
+		return;
+
+	ap_gtk_rekey_finish(ap);
+}
+
+static void ap_gtk_rekey_retry_cb(struct l_timeout *timeout,
+					void *user_data)
+{
+	struct ap_state *ap = user_data;
+	const struct l_queue_entry *entry;
+	size_t kde_len = ap->gtk_rekey_kde[1] + 2;
+
+	if (ap->gtk_rekey_attempt >= AP_GTK_REKEY_ATTEMPTS) {
+		/*
+		 * ap_del_station doesn't remove the station from the list
+		 * so the iteration is safe.  The last one removed finishes
+		 * the rekey through ap_gtk_rekey_check_done.
+		 */
+		for (entry = l_queue_get_entries(ap->sta_states); entry;
+				entry = entry->next) {
+			struct sta_state *sta = entry->data;
+
+			if (!sta->gtk_rekey_pending)
+				continue;
+
+			l_debug("STA "MAC" didn't ack the new GTK",
+				MAC_STR(sta->addr));
+			ap_del_station(sta,
+				MMPDU_REASON_CODE_GROUP_KEY_HANDSHAKE_TIMEOUT,
+				true);
+		}
+
+		return;
+	}
+
+	ap->gtk_rekey_attempt++;
+	l_debug("attempt %u", ap->gtk_rekey_attempt);
+
+	for (entry = l_queue_get_entries(ap->sta_states); entry;
+			entry = entry->next) {
+		struct sta_state *sta = entry->data;
+
+		if (sta->gtk_rekey_pending)
+			eapol_sm_send_gtk_1_of_2(sta->sm, ap->gtk_rekey_kde,
+						kde_len, ap->gtk_rekey_rsc);
+	}
+
+	l_timeout_modify_ms(timeout, AP_GTK_REKEY_RETRY_MS);
+}
+
+/*
+ * Send the new GTK to one station.  A single retry timer is shared by all
+ * stations being rekeyed, each retry goes to those still pending.
+ */
+static void ap_gtk_rekey_sta(struct sta_state *sta)
+{
+	struct ap_state *ap = sta->ap;
+
+	if (!eapol_sm_send_gtk_1_of_2(sta->sm, ap->gtk_rekey_kde,
+					ap->gtk_rekey_kde[1] + 2,
+					ap->gtk_rekey_rsc))
+		return;
+
+	sta->gtk_rekey_pending = true;
+
+	if (ap->gtk_rekey_retry)
+		return;
+
+	ap->gtk_rekey_attempt = 1;
+	ap->gtk_rekey_retry = l_timeout_create_ms(AP_GTK_REKEY_RETRY_MS,
+						ap_gtk_rekey_retry_cb, ap,
+						NULL);
+}
+
+static void ap_gtk_rekey_query_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct ap_state *ap = user_data;
+	enum crypto_cipher group_cipher =
+		ie_rsn_cipher_suite_to_cipher(ap->group_cipher);
+	const void *gtk_rsc = NULL;
+	const struct l_queue_entry *entry;
+
+	ap->gtk_rekey_cmd_id = 0;
+
+	if (l_genl_msg_get_error(msg) >= 0)
+		gtk_rsc = nl80211_parse_get_key_seq(msg);
+
+	if (gtk_rsc)
+		memcpy(ap->gtk_rekey_rsc, gtk_rsc, 6);
+	else
+		memset(ap->gtk_rekey_rsc, 0, 6);
+
+	/* The plaintext Key Data is the same for every station */
+	handshake_util_build_gtk_kde(group_cipher, ap->gtk, ap->gtk_index,
+					ap->gtk_rekey_kde);
+
+	for (entry = l_queue_get_entries(ap->sta_states); entry;
+			entry = entry->next) {
+		struct sta_state *sta = entry->data;
+
+		if (sta->rsna && sta->sm)
+			ap_gtk_rekey_sta(sta);
+	}
+
+	/*
+	 * Stations in the middle of a 4-Way Handshake are caught up when
+	 * it completes.  If nobody needed the new key, switch now.
+	 */
+	ap->gtk_rekey_switch = true;
+
+	if (!ap->gtk_rekey_retry)
+		ap_gtk_rekey_finish(ap);
+}
+
+static void ap_gtk_rekey_start(struct ap_state *ap)
+{
+	uint32_t ifindex = netdev_get_ifindex(ap->netdev);
+	enum crypto_cipher group_cipher =
+		ie_rsn_cipher_suite_to_cipher(ap->group_cipher);
+	int gtk_len = crypto_cipher_key_len(group_cipher);
+	struct l_genl_msg *msg;
+
+	if (ap->gtk_rekey_cmd_id || ap->gtk_rekey_retry) {
+		l_debug("Previous GTK rekey still in progress");
+		return;
+	}
+
+	/*
+	 * Alternate between key indexes 1 and 2 so that the old GTK keeps
+	 * being used for transmission until all stations have the new one
+	 * (802.11-2016 section 12.7.7).
+	 */
+	l_getrandom(ap->gtk, gtk_len);
+	ap->gtk_index ^= 3;
+
+	msg = nl80211_build_new_key_group(ifindex, group_cipher, ap->gtk_index,
+						ap->gtk, gtk_len, NULL, 0, NULL);
+	if (!l_genl_family_send(ap->nl80211, msg, ap_gtk_op_cb, NULL, NULL)) {
+		l_genl_msg_unref(msg);
+		l_error("Issuing NEW_KEY failed");
+		return;
+	}
+
+	msg = nl80211_build_get_key(ifindex, ap->gtk_index);
+	ap->gtk_rekey_cmd_id = l_genl_family_send(ap->nl80211, msg,
+						ap_gtk_rekey_query_cb, ap,
+						NULL);
+	if (!ap->gtk_rekey_cmd_id) {
+		l_genl_msg_unref(msg);
+		l_error("Issuing GET_KEY failed");
+	}
+}
+
+static void ap_gtk_rekey_timeout_cb(struct l_timeout *timeout,
+					void *user_data)
+{
+	struct ap_state *ap = user_data;
+
+	ap_gtk_rekey_start(ap);
+	l_timeout_modify(timeout, ap->gtk_rekey_interval);
+}
+
+static void ap_associate_sta_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct sta_state *sta = user_data;
+	struct ap_state *ap = sta->ap;
+
+	if (l_genl_msg_get_error(msg) < 0) {
+		l_error("NEW_STATION/SET_STATION failed: %i",
+			l_genl_msg_get_error(msg));
+		return;
+	}
+
+	/*
+	 * WSC v2.0.5 Section 8.2:
+	 * "Therefore if a WSC IE is present in the (re)association request,
+	 * the AP shall engage in EAP-WSC with the station and shall not
 	 * attempt any other security handshake."
 	 *
 	 * So no need for group traffic, skip the GTK setup below.
@@ -1286,6 +2075,12 @@ static void ap_associate_sta_cb(struct l_genl_msg *msg, void *user_data)
 		 * just use NL80211_CMD_GET_KEY from now.
 		 */
 		ap->gtk_set = true;
+
+		if (ap->gtk_rekey_interval)
+			ap->gtk_rekey_timeout = l_timeout_create(
+						ap->gtk_rekey_interval,
+						ap_gtk_rekey_timeout_cb,
+						ap, NULL);
 	}
 
 	if (ap->group_cipher == IE_RSN_CIPHER_SUITE_NO_GROUP_TRAFFIC)
@@ -1404,6 +2199,47 @@ static void ap_fail_assoc_resp_cb(int err, void *user_data)
 			"delivered OK");
 }
 
+/*
+ * Only the AID, the status and the extra IEs differ between stations, the
+ * rest of the IEs are built once so that a burst of reassociations, e.g.
+ * after a restart or a channel switch, doesn't redo the work each time.
+ */
+static void ap_build_assoc_resp_ies(struct ap_state *ap)
+{
+	uint8_t buf[192];
+	size_t len = 0;
+	uint32_t r, minr, maxr, count;
+
+	/* Supported Rates IE */
+	buf[len++] = IE_TYPE_SUPPORTED_RATES;
+
+	minr = l_uintset_find_min(ap->rates);
+	maxr = l_uintset_find_max(ap->rates);
+	count = 0;
+	for (r = minr; r <= maxr && count < 8; r++)
+		if (l_uintset_contains(ap->rates, r)) {
+			uint8_t flag = 0;
+
+			/* Mark only the lowest rate as Basic Rate */
+			if (count == 0)
+				flag = 0x80;
+
+			buf[len + 1 + count++] = r | flag;
+		}
+
+	buf[len++] = count;
+	len += count;
+	ap->assoc_resp_rates_end = len;
+
+	len += ap_write_ht_vht_ies(ap, buf + len);
+	ap->assoc_resp_ht_vht_end = len;
+
+	len += ap_write_wmm_ie(ap, buf + len);
+	ap->assoc_resp_ies_len = len;
+
+	ap->assoc_resp_ies = l_memdup(buf, len);
+}
+
 static uint32_t ap_assoc_resp(struct ap_state *ap, struct sta_state *sta,
 				const uint8_t *dest,
 				enum mmpdu_reason_code status_code,
@@ -1415,12 +2251,14 @@ static uint32_t ap_assoc_resp(struct ap_state *ap, struct sta_state *sta,
 		MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_RESPONSE :
 		MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_RESPONSE;
 	L_AUTO_FREE_VAR(uint8_t *, mpdu_buf) =
-		l_malloc(128 + ap_get_extra_ies_len(ap, stype, req, req_len));
+		l_malloc(256 + ap_get_extra_ies_len(ap, stype, req, req_len));
 	struct mmpdu_header *mpdu = (void *) mpdu_buf;
 	struct mmpdu_association_response *resp;
-	size_t ies_len = 0;
+	size_t ies_len;
 	uint16_t capability = IE_BSS_CAP_ESS | IE_BSS_CAP_PRIVACY;
-	uint32_t r, minr, maxr, count;
+
+	if (!ap->assoc_resp_ies)
+		ap_build_assoc_resp_ies(ap);
 
 	memset(mpdu, 0, sizeof(*mpdu));
 
@@ -1438,25 +2276,15 @@ static uint32_t ap_assoc_resp(struct ap_state *ap, struct sta_state *sta,
 	resp->status_code = L_CPU_TO_LE16(status_code);
 	resp->aid = sta ? L_CPU_TO_LE16(sta->aid | 0xc000) : 0;
 
-	/* Supported Rates IE */
-	resp->ies[ies_len++] = IE_TYPE_SUPPORTED_RATES;
-
-	minr = l_uintset_find_min(ap->rates);
-	maxr = l_uintset_find_max(ap->rates);
-	count = 0;
-	for (r = minr; r <= maxr && count < 8; r++)
-		if (l_uintset_contains(ap->rates, r)) {
-			uint8_t flag = 0;
-
-			/* Mark only the lowest rate as Basic Rate */
-			if (count == 0)
-				flag = 0x80;
-
-			resp->ies[ies_len + 1 + count++] = r | flag;
-		}
+	/* HT, VHT and WMM IEs only on success, WMM if the station uses it */
+	if (status_code != 0)
+		ies_len = ap->assoc_resp_rates_end;
+	else if (sta && sta->wme)
+		ies_len = ap->assoc_resp_ies_len;
+	else
+		ies_len = ap->assoc_resp_ht_vht_end;
 
-	resp->ies[ies_len++] = count;
-	ies_len += count;
+	memcpy(resp->ies, ap->assoc_resp_ies, ies_len);
 
 	ies_len += ap_write_extra_ies(ap, stype, req, req_len,
 					resp->ies + ies_len);
@@ -1546,9 +2374,15 @@ static void ap_assoc_reassoc(struct sta_state *sta, bool reassoc,
 	struct l_uintset *rates = NULL;
 	struct ie_rsn_info rsn_info;
 	int err;
+	struct ie_index index;
 	struct ie_tlv_iter iter;
+	const uint8_t *ie;
 	uint8_t *wsc_data = NULL;
 	ssize_t wsc_data_len;
+	const uint8_t *ht_capa = NULL;
+	const uint8_t *vht_capa = NULL;
+	bool wme = false;
+	uint8_t wmm_qos_info = 0;
 
 	if (sta->assoc_resp_cmd_id)
 		return;
@@ -1558,45 +2392,69 @@ static void ap_assoc_reassoc(struct sta_state *sta, bool reassoc,
 		goto unsupported;
 	}
 
-	wsc_data = ie_tlv_extract_wsc_payload(ies, ies_len, &wsc_data_len);
+	ie_index_init(&index, ies, ies_len);
 
-	ie_tlv_iter_init(&iter, ies, ies_len);
+	if (ie_index_find_vendor(&index, microsoft_oui, 0x04))
+		wsc_data = ie_tlv_extract_wsc_payload(ies, ies_len,
+							&wsc_data_len);
 
-	while (ie_tlv_iter_next(&iter))
-		switch (ie_tlv_iter_get_tag(&iter)) {
-		case IE_TYPE_SSID:
-			ssid = (const char *) ie_tlv_iter_get_data(&iter);
-			ssid_len = ie_tlv_iter_get_length(&iter);
-			break;
+	ie = ie_index_find(&index, IE_TYPE_SSID);
+	if (ie) {
+		ssid = (const char *) ie + 2;
+		ssid_len = ie[1];
+	}
 
-		case IE_TYPE_SUPPORTED_RATES:
-		case IE_TYPE_EXTENDED_SUPPORTED_RATES:
-			if (ap_parse_supported_rates(&iter, &rates) < 0) {
-				err = MMPDU_REASON_CODE_INVALID_IE;
-				goto bad_frame;
-			}
+	if ((ie_index_iter_init(&index, IE_TYPE_SUPPORTED_RATES, &iter) &&
+			ap_parse_supported_rates(&iter, &rates) < 0) ||
+			(ie_index_iter_init(&index,
+					IE_TYPE_EXTENDED_SUPPORTED_RATES,
+					&iter) &&
+			ap_parse_supported_rates(&iter, &rates) < 0)) {
+		err = MMPDU_REASON_CODE_INVALID_IE;
+		goto bad_frame;
+	}
 
-			break;
+	/*
+	 * WSC v2.0.5 Section 8.2:
+	 * "Note that during the WSC association [...] the RSN IE and the WPA
+	 * IE are irrelevant and shall be ignored by both the station and AP."
+	 */
+	if (!wsc_data && ie_index_iter_init(&index, IE_TYPE_RSN, &iter)) {
+		if (ie_parse_rsne(&iter, &rsn_info) < 0) {
+			err = MMPDU_REASON_CODE_INVALID_IE;
+			goto bad_frame;
+		}
 
-		case IE_TYPE_RSN:
-			/*
-			 * WSC v2.0.5 Section 8.2:
-			 * "Note that during the WSC association [...] the
-			 * RSN IE and the WPA IE are irrelevant and shall be
-			 * ignored by both the station and AP."
-			 */
-			if (wsc_data)
-				break;
+		rsn = (const uint8_t *) ie_tlv_iter_get_data(&iter) - 2;
+	}
 
-			if (ie_parse_rsne(&iter, &rsn_info) < 0) {
-				err = MMPDU_REASON_CODE_INVALID_IE;
-				goto bad_frame;
-			}
+	ie = ie_index_find(&index, IE_TYPE_HT_CAPABILITIES);
+	if (ie) {
+		if (ie[1] != 26) {
+			err = MMPDU_REASON_CODE_INVALID_IE;
+			goto bad_frame;
+		}
 
-			rsn = (const uint8_t *) ie_tlv_iter_get_data(&iter) - 2;
-			break;
+		ht_capa = ie + 2;
+	}
+
+	ie = ie_index_find(&index, IE_TYPE_VHT_CAPABILITIES);
+	if (ie) {
+		if (ie[1] != 12) {
+			err = MMPDU_REASON_CODE_INVALID_IE;
+			goto bad_frame;
 		}
 
+		vht_capa = ie + 2;
+	}
+
+	/* WMM Information Element, QoS Info follows the OUI Subtype/Version */
+	ie = ie_index_find_vendor(&index, microsoft_oui, 0x02);
+	if (ie && ie[1] >= 7 && ie[6] == 0x00) {
+		wme = true;
+		wmm_qos_info = ie[8];
+	}
+
 	if (!rates || !ssid || (!wsc_data && !rsn) ||
 			ssid_len != strlen(ap->ssid) ||
 			memcmp(ssid, ap->ssid, ssid_len)) {
@@ -1709,6 +2567,17 @@ static void ap_assoc_reassoc(struct sta_state *sta, bool reassoc,
 	sta->capability = *capability;
 	sta->listen_interval = listen_interval;
 
+	sta->ht = ht_capa != NULL;
+	if (ht_capa)
+		memcpy(sta->ht_capa, ht_capa, 26);
+
+	sta->vht = vht_capa != NULL;
+	if (vht_capa)
+		memcpy(sta->vht_capa, vht_capa, 12);
+
+	sta->wme = wme;
+	sta->wmm_qos_info = wmm_qos_info;
+
 	if (sta->rates)
 		l_uintset_free(sta->rates);
 
@@ -1780,7 +2649,7 @@ static void ap_assoc_req_cb(const struct mmpdu_header *hdr, const void *body,
 			memcmp(hdr->address_3, bssid, 6))
 		return;
 
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, from);
+	sta = ap_sta_find(ap, from);
 	if (!sta) {
 		if (!ap_assoc_resp(ap, NULL, from,
 				MMPDU_REASON_CODE_STA_REQ_ASSOC_WITHOUT_AUTH,
@@ -1814,7 +2683,7 @@ static void ap_reassoc_req_cb(const struct mmpdu_header *hdr, const void *body,
 			memcmp(hdr->address_3, bssid, 6))
 		return;
 
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, from);
+	sta = ap_sta_find(ap, from);
 	if (!sta) {
 		err = MMPDU_REASON_CODE_STA_REQ_ASSOC_WITHOUT_AUTH;
 		goto bad_frame;
@@ -1937,15 +2806,27 @@ static void ap_probe_req_cb(const struct mmpdu_header *hdr, const void *body,
 	if (!match)
 		return;
 
-	resp_len = 512 + ap_get_extra_ies_len(ap,
+	/*
+	 * The driver answers from the template, should it still pass Probe
+	 * Requests up we only need them to track PBC Enrollees.
+	 */
+	if (ap->probe_resp_offload) {
+		ap_wsc_probe_req_process(ap, hdr, body + body_len -
+						(void *) hdr);
+		return;
+	}
+
+	if (!ap->probe_resp && !ap_build_probe_resp(ap))
+		return;
+
+	resp_len = ap->probe_resp_len + ap_get_extra_ies_len(ap,
 					MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
 					hdr, body + body_len - (void *) hdr);
-	resp = l_new(uint8_t, resp_len);
-	len = ap_build_beacon_pr_head(ap,
-					MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
-					hdr->address_2, resp, resp_len);
-	len += ap_build_beacon_pr_tail(ap,
-					MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
+	resp = l_malloc(resp_len);
+	memcpy(resp, ap->probe_resp, ap->probe_resp_len);
+	memcpy(((struct mmpdu_header *) resp)->address_1, hdr->address_2, 6);
+	len = ap->probe_resp_len;
+	len += ap_write_extra_ies(ap, MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE,
 					hdr, body + body_len - (void *) hdr,
 					resp + len);
 
@@ -1971,7 +2852,7 @@ static void ap_disassoc_cb(const struct mmpdu_header *hdr, const void *body,
 			memcmp(hdr->address_3, bssid, 6))
 		return;
 
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, hdr->address_2);
+	sta = ap_sta_find(ap, hdr->address_2);
 
 	if (sta && sta->assoc_resp_cmd_id) {
 		l_genl_family_cancel(ap->nl80211, sta->assoc_resp_cmd_id);
@@ -2068,7 +2949,7 @@ static void ap_auth_cb(const struct mmpdu_header *hdr, const void *body,
 		return;
 	}
 
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, from);
+	sta = ap_sta_find(ap, from);
 
 	/*
 	 * Figure 11-13 in 802.11-2016 11.3.2 shows a transition from
@@ -2092,10 +2973,7 @@ static void ap_auth_cb(const struct mmpdu_header *hdr, const void *body,
 	memcpy(sta->addr, from, 6);
 	sta->ap = ap;
 
-	if (!ap->sta_states)
-		ap->sta_states = l_queue_new();
-
-	l_queue_push_tail(ap->sta_states, sta);
+	ap_sta_add(ap, sta);
 
 	/*
 	 * Nothing to do here netlink-wise as we can't receive any data
@@ -2125,8 +3003,7 @@ static void ap_deauth_cb(const struct mmpdu_header *hdr, const void *body,
 			memcmp(hdr->address_3, bssid, 6))
 		return;
 
-	sta = l_queue_remove_if(ap->sta_states, ap_sta_match_addr,
-				hdr->address_2);
+	sta = ap_sta_remove(ap, hdr->address_2);
 	if (!sta)
 		return;
 
@@ -2169,6 +3046,13 @@ static void ap_start_cb(struct l_genl_msg *msg, void *user_data)
 	}
 
 	ap->started = true;
+
+	if (ap->inactivity_timeout)
+		ap->inactivity_check =
+			l_timeout_create(AP_INACTIVITY_CHECK_INTERVAL,
+						ap_inactivity_check_cb,
+						ap, NULL);
+
 	ap->ops->handle_event(AP_EVENT_STARTED, NULL, ap->user_data);
 
 	return;
@@ -2199,8 +3083,7 @@ static struct l_genl_msg *ap_build_cmd_start_ap(struct ap_state *ap)
 	uint32_t nl_akm = CRYPTO_AKM_PSK;
 	uint32_t wpa_version = NL80211_WPA_VERSION_2;
 	uint32_t auth_type = NL80211_AUTHTYPE_OPEN_SYSTEM;
-	uint32_t ch_freq = scan_channel_to_freq(ap->channel, SCAN_BAND_2_4_GHZ);
-	uint32_t ch_width = NL80211_CHAN_WIDTH_20;
+	uint32_t ch_freq = scan_channel_to_freq(ap->channel, ap->band);
 	unsigned int i;
 
 	static const uint8_t bcast_addr[6] = {
@@ -2221,7 +3104,8 @@ static struct l_genl_msg *ap_build_cmd_start_ap(struct ap_state *ap)
 		return NULL;
 
 	cmd = l_genl_msg_new_sized(NL80211_CMD_START_AP, 256 + head_len +
-					tail_len + strlen(ap->ssid));
+					tail_len + strlen(ap->ssid) +
+					(ap->probe_resp_offload ? 512 : 0));
 
 	/* SET_BEACON attrs */
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_BEACON_HEAD, head_len, head);
@@ -2230,6 +3114,9 @@ static struct l_genl_msg *ap_build_cmd_start_ap(struct ap_state *ap)
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_IE_PROBE_RESP, 0, "");
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_IE_ASSOC_RESP, 0, "");
 
+	if (ap->probe_resp_offload)
+		ap_append_probe_resp_template(ap, cmd);
+
 	/* START_AP attrs */
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_BEACON_INTERVAL, 4,
 				&ap->beacon_interval);
@@ -2247,7 +3134,13 @@ static struct l_genl_msg *ap_build_cmd_start_ap(struct ap_state *ap)
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_AKM_SUITES, 4, &nl_akm);
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_AUTH_TYPE, 4, &auth_type);
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_WIPHY_FREQ, 4, &ch_freq);
-	l_genl_msg_append_attr(cmd, NL80211_ATTR_CHANNEL_WIDTH, 4, &ch_width);
+	l_genl_msg_append_attr(cmd, NL80211_ATTR_CHANNEL_WIDTH, 4,
+				&ap->ch_width);
+
+	if (ap->ch_width != NL80211_CHAN_WIDTH_20_NOHT &&
+			ap->ch_width != NL80211_CHAN_WIDTH_20)
+		l_genl_msg_append_attr(cmd, NL80211_ATTR_CENTER_FREQ1, 4,
+					&ap->center_freq1);
 
 	if (wiphy_has_ext_feature(wiphy,
 			NL80211_EXT_FEATURE_CONTROL_PORT_OVER_NL80211)) {
@@ -2273,6 +3166,10 @@ static void ap_ifaddr4_added_cb(int error, uint16_t type, const void *data,
 		goto error;
 	}
 
+	/* START_AP will be sent once the channel and the PSK are ready */
+	if (ap->acs_scan_id || ap->acs_survey_id || ap->psk_work_id)
+		return;
+
 	cmd = ap_build_cmd_start_ap(ap);
 	if (!cmd)
 		goto error;
@@ -2294,28 +3191,31 @@ static bool ap_parse_new_station_ies(const void *data, uint16_t len,
 					uint8_t **rsn_out,
 					struct l_uintset **rates_out)
 {
+	struct ie_index index;
 	struct ie_tlv_iter iter;
 	uint8_t *rsn = NULL;
 	struct l_uintset *rates = NULL;
 
-	ie_tlv_iter_init(&iter, data, len);
+	ie_index_init(&index, data, len);
 
-	while (ie_tlv_iter_next(&iter)) {
-		switch (ie_tlv_iter_get_tag(&iter)) {
-		case IE_TYPE_RSN:
-			if (rsn || ie_parse_rsne(&iter, NULL) < 0)
-				goto parse_error;
+	if (ie_index_count(&index, IE_TYPE_RSN) > 1 ||
+			ie_index_count(&index,
+				IE_TYPE_EXTENDED_SUPPORTED_RATES) > 1)
+		return false;
 
-			rsn = l_memdup(ie_tlv_iter_get_data(&iter) - 2,
-					ie_tlv_iter_get_length(&iter) + 2);
-			break;
-		case IE_TYPE_EXTENDED_SUPPORTED_RATES:
-			if (rates || ap_parse_supported_rates(&iter, &rates) <
-					0)
-				goto parse_error;
+	if (ie_index_iter_init(&index, IE_TYPE_RSN, &iter)) {
+		if (ie_parse_rsne(&iter, NULL) < 0)
+			return false;
 
-			break;
-		}
+		rsn = l_memdup(ie_tlv_iter_get_data(&iter) - 2,
+				ie_tlv_iter_get_length(&iter) + 2);
+	}
+
+	if (ie_index_iter_init(&index, IE_TYPE_EXTENDED_SUPPORTED_RATES,
+				&iter) &&
+			ap_parse_supported_rates(&iter, &rates) < 0) {
+		l_free(rsn);
+		return false;
 	}
 
 	*rsn_out = rsn;
@@ -2326,15 +3226,6 @@ static bool ap_parse_new_station_ies(const void *data, uint16_t len,
 		l_uintset_free(rates);
 
 	return true;
-
-parse_error:
-	if (rsn)
-		l_free(rsn);
-
-	if (rates)
-		l_uintset_free(rates);
-
-	return false;
 }
 
 static void ap_handle_new_station(struct ap_state *ap, struct l_genl_msg *msg)
@@ -2376,7 +3267,7 @@ static void ap_handle_new_station(struct ap_state *ap, struct l_genl_msg *msg)
 	 * Softmac's should already have a station created. The above check
 	 * may also fail for softmac cards.
 	 */
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, mac);
+	sta = ap_sta_find(ap, mac);
 	if (sta)
 		goto cleanup;
 
@@ -2388,10 +3279,7 @@ static void ap_handle_new_station(struct ap_state *ap, struct l_genl_msg *msg)
 
 	sta->associated = true;
 
-	if (!ap->sta_states)
-		ap->sta_states = l_queue_new();
-
-	l_queue_push_tail(ap->sta_states, sta);
+	ap_sta_add(ap, sta);
 
 	msg = nl80211_build_set_station_unauthorized(
 					netdev_get_ifindex(ap->netdev), mac);
@@ -2438,7 +3326,7 @@ static void ap_handle_del_station(struct ap_state *ap, struct l_genl_msg *msg)
 		}
 	}
 
-	sta = l_queue_find(ap->sta_states, ap_sta_match_addr, mac);
+	sta = ap_sta_find(ap, mac);
 	if (!sta)
 		return;
 
@@ -2446,24 +3334,65 @@ static void ap_handle_del_station(struct ap_state *ap, struct l_genl_msg *msg)
 	ap_remove_sta(sta);
 }
 
-static void ap_mlme_notify(struct l_genl_msg *msg, void *user_data)
+/*
+ * The kernel moved the BSS to a new channel, e.g. to follow another
+ * interface on the same radio that did so.  Update the channel state the
+ * Beacon and Probe Response IEs are built from to match.
+ */
+static void ap_channel_switch_event(struct ap_state *ap,
+					struct l_genl_msg *msg)
 {
-	struct ap_state *ap = user_data;
-	uint32_t ifindex;
+	uint32_t freq;
+	uint32_t width;
+	uint32_t center_freq1;
+	enum scan_band band;
+	uint8_t channel;
 
-	if (nl80211_parse_attrs(msg, NL80211_ATTR_IFINDEX, &ifindex,
-				NL80211_ATTR_UNSPEC) < 0 ||
-			ifindex != netdev_get_ifindex(ap->netdev))
+	if (nl80211_parse_attrs(msg, NL80211_ATTR_WIPHY_FREQ, &freq,
+				NL80211_ATTR_CHANNEL_WIDTH, &width,
+				NL80211_ATTR_CENTER_FREQ1, &center_freq1,
+				NL80211_ATTR_UNSPEC) < 0)
 		return;
 
-	switch (l_genl_msg_get_command(msg)) {
-	case NL80211_CMD_STOP_AP:
-		if (ap->start_stop_cmd_id) {
-			l_genl_family_cancel(ap->nl80211,
-						ap->start_stop_cmd_id);
-			ap->start_stop_cmd_id = 0;
-			ap->ops->handle_event(AP_EVENT_START_FAILED, NULL,
-						ap->user_data);
+	channel = scan_freq_to_channel(freq, &band);
+	if (!channel)
+		return;
+
+	l_debug("Channel switched from %u to %u", ap->channel, channel);
+
+	ap->band = band;
+	ap->channel = channel;
+	ap->ch_width = width;
+	ap->center_freq1 = center_freq1;
+	ap->ht_sec_offset = 0;
+	ap->vht_center_channel = 0;
+
+	/* Secondary channel of the 40MHz pair, see ap_select_channel_width */
+	if (width == NL80211_CHAN_WIDTH_40)
+		ap->ht_sec_offset = center_freq1 > freq ? 1 : 3;
+	else if (width == NL80211_CHAN_WIDTH_80) {
+		ap->ht_sec_offset = (channel % 8 == 4 || channel % 8 == 5) ?
+									1 : 3;
+		ap->vht_center_channel = scan_freq_to_channel(center_freq1,
+								NULL);
+	}
+
+	if (ap->started)
+		ap_update_beacon(ap);
+}
+
+static void ap_mlme_notify(struct l_genl_msg *msg, void *user_data)
+{
+	struct ap_state *ap = user_data;
+
+	switch (l_genl_msg_get_command(msg)) {
+	case NL80211_CMD_STOP_AP:
+		if (ap->start_stop_cmd_id) {
+			l_genl_family_cancel(ap->nl80211,
+						ap->start_stop_cmd_id);
+			ap->start_stop_cmd_id = 0;
+			ap->ops->handle_event(AP_EVENT_START_FAILED, NULL,
+						ap->user_data);
 		} else if (ap->started) {
 			ap->started = false;
 			ap->ops->handle_event(AP_EVENT_STOPPING, NULL,
@@ -2480,6 +3409,9 @@ static void ap_mlme_notify(struct l_genl_msg *msg, void *user_data)
 	case NL80211_CMD_DEL_STATION:
 		ap_handle_del_station(ap, msg);
 		break;
+	case NL80211_CMD_CH_SWITCH_NOTIFY:
+		ap_channel_switch_event(ap, msg);
+		break;
 	}
 }
 
@@ -2661,10 +3593,72 @@ static int ap_load_dhcp(struct ap_state *ap, const struct l_settings *config,
 	return err;
 }
 
+struct ap_psk_job {
+	struct ap_state *ap;
+	char passphrase[64];
+	char ssid[33];
+	struct crypto_psk_request req;
+};
+
+static void ap_psk_job_free(void *user_data)
+{
+	struct ap_psk_job *job = user_data;
+
+	explicit_bzero(job, sizeof(*job));
+	l_free(job);
+}
+
+static void ap_psk_work(void *user_data)
+{
+	struct ap_psk_job *job = user_data;
+
+	crypto_psk_derive_batch(&job->req, 1);
+}
+
+static void ap_psk_done(void *user_data)
+{
+	struct ap_psk_job *job = user_data;
+	struct ap_state *ap = job->ap;
+	struct l_genl_msg *cmd;
+
+	ap->psk_work_id = 0;
+
+	if (job->req.result < 0) {
+		l_error("AP couldn't generate the PSK from given "
+			"[Security].Passphrase value: %s (%i)",
+			strerror(-job->req.result), -job->req.result);
+		goto error;
+	}
+
+	memcpy(ap->psk, job->req.psk, sizeof(ap->psk));
+	crypto_psk_cache_add_batch(&job->req, 1);
+
+	/* START_AP will be sent once the channel and address are ready */
+	if (ap->acs_scan_id || ap->acs_survey_id || ap->rtnl_add_cmd)
+		return;
+
+	cmd = ap_build_cmd_start_ap(ap);
+	if (!cmd)
+		goto error;
+
+	ap->start_stop_cmd_id = l_genl_family_send(ap->nl80211, cmd,
+							ap_start_cb, ap, NULL);
+	if (!ap->start_stop_cmd_id) {
+		l_genl_msg_unref(cmd);
+		goto error;
+	}
+
+	return;
+
+error:
+	ap_start_failed(ap);
+}
+
 static bool ap_load_psk(struct ap_state *ap, const struct l_settings *config)
 {
 	L_AUTO_FREE_VAR(char *, passphrase) =
 		l_settings_get_string(config, "Security", "Passphrase");
+	struct ap_psk_job *job;
 	int err;
 
 	if (passphrase) {
@@ -2700,6 +3694,30 @@ static bool ap_load_psk(struct ap_state *ap, const struct l_settings *config)
 		return false;
 	}
 
+	if (crypto_psk_cache_lookup(passphrase, (uint8_t *) ap->ssid,
+					strlen(ap->ssid), ap->psk))
+		return true;
+
+	/*
+	 * With several radios each starting an AP the PBKDF2 runs would
+	 * hold up the netlink traffic of all of them, derive on the worker
+	 * pool and only send START_AP once done.
+	 */
+	job = l_new(struct ap_psk_job, 1);
+	job->ap = ap;
+	strcpy(job->passphrase, passphrase);
+	strcpy(job->ssid, ap->ssid);
+	job->req.passphrase = job->passphrase;
+	job->req.ssid = (const uint8_t *) job->ssid;
+	job->req.ssid_len = strlen(job->ssid);
+
+	ap->psk_work_id = l_work_submit(ap_psk_work, ap_psk_done, job,
+					ap_psk_job_free);
+	if (ap->psk_work_id)
+		return true;
+
+	ap_psk_job_free(job);
+
 	err = crypto_psk_from_passphrase(passphrase, (uint8_t *) ap->ssid,
 						strlen(ap->ssid), ap->psk);
 	if (err < 0) {
@@ -2712,6 +3730,160 @@ static bool ap_load_psk(struct ap_state *ap, const struct l_settings *config)
 	return true;
 }
 
+/*
+ * Pick the widest channel the wiphy supports around the primary channel.
+ * 40MHz and 80MHz channels are only used in the 5GHz band, in 2.4GHz we'd
+ * need to implement the 20/40 BSS Coexistence scanning.
+ */
+static void ap_select_channel_width(struct ap_state *ap)
+{
+	static const uint8_t vht80_centers[] = { 42, 58, 106, 122, 138, 155 };
+	struct wiphy *wiphy = netdev_get_wiphy(ap->netdev);
+	const struct scan_freq_set *freqs = wiphy_get_supported_freqs(wiphy);
+	unsigned int nl_band = ap->band == SCAN_BAND_5_GHZ ?
+		NL80211_BAND_5GHZ : NL80211_BAND_2GHZ;
+	uint32_t freq = scan_channel_to_freq(ap->channel, ap->band);
+	uint32_t sec_freq;
+	unsigned int i;
+	uint8_t center = 0;
+	uint8_t ch;
+
+	ap->ch_width = NL80211_CHAN_WIDTH_20_NOHT;
+	ap->ht_capa = wiphy_get_ht_capabilities(wiphy, nl_band);
+	if (!ap->ht_capa)
+		return;
+
+	ap->ch_width = NL80211_CHAN_WIDTH_20;
+
+	/* Supported Channel Width Set */
+	if (ap->band != SCAN_BAND_5_GHZ || !(l_get_le16(ap->ht_capa) & 0x2))
+		return;
+
+	/* The 40MHz pairs are 36 + 40, 44 + 48, ..., 149 + 153, ... */
+	if (ap->channel % 8 == 4 || ap->channel % 8 == 5) {
+		sec_freq = scan_channel_to_freq(ap->channel + 4, ap->band);
+		ap->ht_sec_offset = 1;
+	} else {
+		sec_freq = scan_channel_to_freq(ap->channel - 4, ap->band);
+		ap->ht_sec_offset = 3;
+	}
+
+	if (!sec_freq || !scan_freq_set_contains(freqs, sec_freq)) {
+		ap->ht_sec_offset = 0;
+		return;
+	}
+
+	ap->ch_width = NL80211_CHAN_WIDTH_40;
+	ap->center_freq1 = (freq + sec_freq) / 2;
+
+	ap->vht_capa = wiphy_get_vht_capabilities(wiphy, nl_band);
+	if (!ap->vht_capa)
+		return;
+
+	for (i = 0; i < L_ARRAY_SIZE(vht80_centers); i++)
+		if (ap->channel >= vht80_centers[i] - 6 &&
+				ap->channel <= vht80_centers[i] + 6)
+			center = vht80_centers[i];
+
+	if (!center)
+		return;
+
+	for (ch = center - 6; ch <= center + 6; ch += 4)
+		if (!scan_freq_set_contains(freqs,
+				scan_channel_to_freq(ch, ap->band)))
+			return;
+
+	ap->ch_width = NL80211_CHAN_WIDTH_80;
+	ap->center_freq1 = scan_channel_to_freq(center, ap->band);
+	ap->vht_center_channel = center;
+}
+
+/*
+ * EDCA parameters advertised for the stations to use, per Access Category
+ * as AIFSN, CWmin, CWmax and TXOP Limit in units of 32us.  The defaults are
+ * those of WMM v1.2.0 Table 5.
+ */
+static const struct {
+	const char *key;
+	unsigned int aifsn;
+	unsigned int cw_min;
+	unsigned int cw_max;
+	unsigned int txop;
+} ap_wmm_acs[4] = {
+	{ "BestEffort",	3, 15, 1023, 0 },
+	{ "Background",	7, 15, 1023, 0 },
+	{ "Video",	2, 7,  15,   94 },
+	{ "Voice",	2, 3,  7,    47 },
+};
+
+static bool ap_parse_wmm_ac(const char *str, unsigned int out[4])
+{
+	char **strv = l_strsplit(str, ',');
+	unsigned int i;
+	bool ret = false;
+
+	if (!strv || l_strv_length(strv) != 4)
+		goto done;
+
+	for (i = 0; i < 4; i++) {
+		char *endp;
+		unsigned long val;
+
+		errno = 0;
+		val = strtoul(strv[i], &endp, 10);
+		if (errno || endp == strv[i] || *endp || val > 65535)
+			goto done;
+
+		out[i] = val;
+	}
+
+	ret = true;
+done:
+	l_strfreev(strv);
+	return ret;
+}
+
+static int ap_load_wmm(struct ap_state *ap, const struct l_settings *config)
+{
+	unsigned int aci;
+
+	for (aci = 0; aci < L_ARRAY_SIZE(ap_wmm_acs); aci++) {
+		L_AUTO_FREE_VAR(char *, strval) = NULL;
+		unsigned int val[4] = {
+			ap_wmm_acs[aci].aifsn,
+			ap_wmm_acs[aci].cw_min,
+			ap_wmm_acs[aci].cw_max,
+			ap_wmm_acs[aci].txop,
+		};
+		uint8_t *params = ap->wmm_ac_params[aci];
+
+		strval = l_settings_get_string(config, "WMM",
+						ap_wmm_acs[aci].key);
+		if (strval && !ap_parse_wmm_ac(strval, val)) {
+			l_error("AP [WMM].%s format wrong",
+					ap_wmm_acs[aci].key);
+			return -EINVAL;
+		}
+
+		/* The CW values are exponents of 2 minus 1, CWmin <= CWmax */
+		if (val[0] < 2 || val[0] > 15 ||
+				val[1] > 32767 || (val[1] & (val[1] + 1)) ||
+				val[2] > 32767 || (val[2] & (val[2] + 1)) ||
+				val[1] > val[2]) {
+			l_error("AP [WMM].%s values out of range",
+					ap_wmm_acs[aci].key);
+			return -EINVAL;
+		}
+
+		params[0] = (aci << 5) | val[0];
+		params[1] = (__builtin_popcount(val[2]) << 4) |
+				__builtin_popcount(val[1]);
+		l_put_le16(val[3], params + 2);
+	}
+
+	return 0;
+}
+
 static int ap_load_config(struct ap_state *ap, const struct l_settings *config,
 				bool *out_wait_dhcp, bool *out_cck_rates)
 {
@@ -2750,18 +3922,32 @@ static int ap_load_config(struct ap_state *ap, const struct l_settings *config,
 	if (l_settings_has_key(config, "General", "Channel")) {
 		unsigned int uintval;
 
-		if (!l_settings_get_uint(config, "General", "Channel",
-						&uintval) ||
-				!scan_channel_to_freq(uintval,
-							SCAN_BAND_2_4_GHZ)) {
+		const struct scan_freq_set *freqs = wiphy_get_supported_freqs(
+					netdev_get_wiphy(ap->netdev));
+		uint32_t freq = 0;
+
+		if (l_settings_get_uint(config, "General", "Channel",
+						&uintval) && uintval <= 255) {
+			ap->band = SCAN_BAND_2_4_GHZ;
+			freq = scan_channel_to_freq(uintval, ap->band);
+
+			if (!freq) {
+				ap->band = SCAN_BAND_5_GHZ;
+				freq = scan_channel_to_freq(uintval, ap->band);
+			}
+		}
+
+		if (!freq || !scan_freq_set_contains(freqs, freq)) {
 			l_error("AP Channel value unsupported");
 			return -EINVAL;
 		}
 
 		ap->channel = uintval;
-	} else
-		/* TODO: Start a Get Survey to decide the channel */
-		ap->channel = 6;
+	} else {
+		/* Selected by ap_acs_start() */
+		ap->band = SCAN_BAND_2_4_GHZ;
+		ap->channel = 0;
+	}
 
 	strval = l_settings_get_string(config, "WSC", "DeviceName");
 	if (strval) {
@@ -2825,6 +4011,36 @@ static int ap_load_config(struct ap_state *ap, const struct l_settings *config,
 		l_strfreev(strvval);
 	}
 
+	if (l_settings_get_value(config, "General", "GroupRekeyInterval")) {
+		unsigned int uintval;
+
+		if (!l_settings_get_uint(config, "General",
+						"GroupRekeyInterval",
+						&uintval)) {
+			l_error("AP [General].GroupRekeyInterval not a valid "
+				"unsigned integer");
+			return -EINVAL;
+		}
+
+		ap->gtk_rekey_interval = uintval;
+	} else
+		ap->gtk_rekey_interval = 0;
+
+	if (l_settings_get_value(config, "General", "InactivityTimeout")) {
+		unsigned int uintval;
+
+		if (!l_settings_get_uint(config, "General",
+						"InactivityTimeout",
+						&uintval)) {
+			l_error("AP [General].InactivityTimeout not a valid "
+				"unsigned integer");
+			return -EINVAL;
+		}
+
+		ap->inactivity_timeout = uintval;
+	} else
+		ap->inactivity_timeout = AP_DEFAULT_INACTIVITY_TIMEOUT;
+
 	if (l_settings_get_value(config, "General", "NoCCKRates")) {
 		bool boolval;
 
@@ -2839,7 +4055,266 @@ static int ap_load_config(struct ap_state *ap, const struct l_settings *config,
 	} else
 		*out_cck_rates = true;
 
-	return 0;
+	return ap_load_wmm(ap, config);
+}
+
+/*
+ * Least loaded channel wins: busy time percentage as reported by the
+ * survey, 10 points per overlapping BSS and a penalty for a raised noise
+ * floor.
+ */
+static unsigned int ap_acs_channel_cost(const struct ap_acs_channel *info)
+{
+	unsigned int cost = info->bss_count * 10;
+
+	if (info->time)
+		cost += info->time_busy * 100 / info->time;
+
+	if (info->have_noise && info->noise > -95)
+		cost += info->noise + 95;
+
+	return cost;
+}
+
+static void ap_acs_done(struct ap_state *ap)
+{
+	struct l_genl_msg *cmd;
+	unsigned int i;
+	unsigned int best_cost = UINT_MAX;
+
+	for (i = 0; i < L_ARRAY_SIZE(ap->acs_channels); i++) {
+		const struct ap_acs_channel *info = &ap->acs_channels[i];
+		unsigned int cost;
+
+		if (!info->channel)
+			continue;
+
+		cost = ap_acs_channel_cost(info);
+
+		l_debug("Channel %u: %u BSSes, busy %"PRIu64"/%"PRIu64" ms, "
+			"noise %i, cost %u", info->channel, info->bss_count,
+			info->time_busy, info->time,
+			info->have_noise ? info->noise : 0, cost);
+
+		if (cost < best_cost) {
+			best_cost = cost;
+			ap->channel = info->channel;
+		}
+	}
+
+	if (!ap->channel)
+		ap->channel = 6;
+
+	l_debug("Selected channel %u", ap->channel);
+
+	ap_select_channel_width(ap);
+
+	/* Still waiting for the IP address or PSK, START_AP is sent then */
+	if (ap->rtnl_add_cmd || ap->psk_work_id)
+		return;
+
+	cmd = ap_build_cmd_start_ap(ap);
+	if (!cmd)
+		goto error;
+
+	ap->start_stop_cmd_id = l_genl_family_send(ap->nl80211, cmd,
+							ap_start_cb, ap, NULL);
+	if (!ap->start_stop_cmd_id) {
+		l_genl_msg_unref(cmd);
+		goto error;
+	}
+
+	return;
+
+error:
+	ap_start_failed(ap);
+}
+
+static struct ap_acs_channel *ap_acs_channel_find(struct ap_state *ap,
+							uint32_t freq)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(ap->acs_channels); i++)
+		if (ap->acs_channels[i].channel &&
+				ap->acs_channels[i].freq == freq)
+			return &ap->acs_channels[i];
+
+	return NULL;
+}
+
+static void ap_acs_survey_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct ap_state *ap = user_data;
+	struct l_genl_attr attr;
+	struct l_genl_attr nested;
+	uint16_t type, len;
+	const void *data;
+	struct ap_acs_channel *info = NULL;
+	struct ap_acs_channel survey = {};
+
+	if (!l_genl_attr_init(&attr, msg))
+		return;
+
+	while (l_genl_attr_next(&attr, &type, NULL, NULL)) {
+		if (type != NL80211_ATTR_SURVEY_INFO)
+			continue;
+
+		if (!l_genl_attr_recurse(&attr, &nested))
+			return;
+
+		while (l_genl_attr_next(&nested, &type, &len, &data)) {
+			switch (type) {
+			case NL80211_SURVEY_INFO_FREQUENCY:
+				if (len != 4)
+					return;
+
+				info = ap_acs_channel_find(ap,
+						l_get_u32(data));
+				break;
+			case NL80211_SURVEY_INFO_NOISE:
+				if (len != 1)
+					return;
+
+				survey.noise = l_get_u8(data);
+				survey.have_noise = true;
+				break;
+			case NL80211_SURVEY_INFO_TIME:
+				if (len != 8)
+					return;
+
+				survey.time = l_get_u64(data);
+				break;
+			case NL80211_SURVEY_INFO_TIME_BUSY:
+				if (len != 8)
+					return;
+
+				survey.time_busy = l_get_u64(data);
+				break;
+			}
+		}
+	}
+
+	if (!info)
+		return;
+
+	info->noise = survey.noise;
+	info->have_noise = survey.have_noise;
+	info->time = survey.time;
+	info->time_busy = survey.time_busy;
+}
+
+static void ap_acs_survey_done(void *user_data)
+{
+	struct ap_state *ap = user_data;
+
+	ap->acs_survey_id = 0;
+	ap_acs_done(ap);
+}
+
+static bool ap_acs_scan_notify(int err, struct l_queue *bss_list,
+				const struct scan_freq_set *freqs,
+				void *user_data)
+{
+	struct ap_state *ap = user_data;
+	const struct l_queue_entry *entry;
+	struct l_genl_msg *msg;
+	uint32_t ifindex = netdev_get_ifindex(ap->netdev);
+	unsigned int i;
+
+	ap->acs_scan_id = 0;
+
+	if (err < 0)
+		l_debug("ACS scan failed: %i, relying on the survey only", err);
+
+	for (entry = l_queue_get_entries(bss_list); entry;
+			entry = entry->next) {
+		const struct scan_bss *bss = entry->data;
+		enum scan_band band;
+		uint8_t channel = scan_freq_to_channel(bss->frequency, &band);
+
+		if (!channel || band != SCAN_BAND_2_4_GHZ)
+			continue;
+
+		/* 2.4GHz channels 5 or more apart don't overlap */
+		for (i = 0; i < L_ARRAY_SIZE(ap->acs_channels); i++) {
+			struct ap_acs_channel *info = &ap->acs_channels[i];
+
+			if (info->channel && channel < info->channel + 5 &&
+					info->channel < channel + 5)
+				info->bss_count++;
+		}
+	}
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_GET_SURVEY, 16);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &ifindex);
+
+	ap->acs_survey_id = l_genl_family_dump(ap->nl80211, msg,
+						ap_acs_survey_cb, ap,
+						ap_acs_survey_done);
+	if (!ap->acs_survey_id) {
+		l_genl_msg_unref(msg);
+		ap_acs_done(ap);
+	}
+
+	return false;
+}
+
+/*
+ * Automatic channel selection between the non-overlapping 2.4GHz channels
+ * based on a passive scan of the band and the channel survey data.
+ */
+static bool ap_acs_start(struct ap_state *ap)
+{
+	static const uint8_t candidates[] = { 6, 1, 11 };
+	struct wiphy *wiphy = netdev_get_wiphy(ap->netdev);
+	const struct scan_freq_set *supported = wiphy_get_supported_freqs(wiphy);
+	struct scan_freq_set *freqs = scan_freq_set_new();
+	unsigned int i, n = 0;
+	uint8_t channel;
+
+	for (channel = 1; channel <= 14; channel++) {
+		uint32_t freq = scan_channel_to_freq(channel,
+							SCAN_BAND_2_4_GHZ);
+
+		if (scan_freq_set_contains(supported, freq))
+			scan_freq_set_add(freqs, freq);
+	}
+
+	for (i = 0; i < L_ARRAY_SIZE(candidates); i++) {
+		uint32_t freq = scan_channel_to_freq(candidates[i],
+							SCAN_BAND_2_4_GHZ);
+
+		if (!scan_freq_set_contains(supported, freq))
+			continue;
+
+		ap->acs_channels[n].channel = candidates[i];
+		ap->acs_channels[n++].freq = freq;
+	}
+
+	ap->acs_scan_id = scan_passive(netdev_get_wdev_id(ap->netdev), freqs,
+					NULL, ap_acs_scan_notify, ap, NULL);
+	scan_freq_set_free(freqs);
+
+	return ap->acs_scan_id != 0;
+}
+
+/* Another BSS already operating, or about to, on the same radio */
+static struct ap_state *ap_find_sibling(struct ap_state *ap)
+{
+	struct wiphy *wiphy = netdev_get_wiphy(ap->netdev);
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(ap_list); entry;
+			entry = entry->next) {
+		struct ap_state *other = entry->data;
+
+		if (other != ap && other->channel &&
+				netdev_get_wiphy(other->netdev) == wiphy)
+			return other;
+	}
+
+	return NULL;
 }
 
 /*
@@ -2860,9 +4335,11 @@ struct ap_state *ap_start(struct netdev *netdev, struct l_settings *config,
 	struct wiphy *wiphy = netdev_get_wiphy(netdev);
 	struct l_genl_msg *cmd;
 	uint64_t wdev_id = netdev_get_wdev_id(netdev);
+	uint32_t ifindex = netdev_get_ifindex(netdev);
 	int err = -EINVAL;
 	bool wait_on_address = false;
 	bool cck_rates = true;
+	struct ap_state *sibling;
 
 	if (err_out)
 		*err_out = err;
@@ -2875,6 +4352,11 @@ struct ap_state *ap_start(struct netdev *netdev, struct l_settings *config,
 	ap->netdev = netdev;
 	ap->ops = ops;
 	ap->user_data = user_data;
+	ap->probe_resp_offload = !ops->write_extra_ies &&
+		wiphy_supports_probe_resp_offload(wiphy,
+					NL80211_PROBE_RESP_OFFLOAD_SUPPORT_WPS |
+					NL80211_PROBE_RESP_OFFLOAD_SUPPORT_WPS2);
+	ap->uapsd = wiphy_supports_ap_uapsd(wiphy);
 
 	err = ap_load_config(ap, config, &wait_on_address, &cck_rates);
 	if (err)
@@ -2882,6 +4364,26 @@ struct ap_state *ap_start(struct netdev *netdev, struct l_settings *config,
 
 	err = -EINVAL;
 
+	/*
+	 * Multiple BSSes on one radio normally require a common channel so
+	 * unless configured otherwise join the channel already in use.
+	 */
+	sibling = ap_find_sibling(ap);
+	if (sibling && !ap->channel) {
+		ap->band = sibling->band;
+		ap->channel = sibling->channel;
+	} else if (sibling && ap->channel != sibling->channel)
+		l_warn("AP on %s uses channel %u, %s already on channel %u",
+			netdev_get_name(netdev), ap->channel,
+			netdev_get_name(sibling->netdev), sibling->channel);
+
+	if (ap->channel)
+		ap_select_channel_width(ap);
+
+	/* No DSSS/CCK rates outside of 2.4GHz */
+	if (ap->band != SCAN_BAND_2_4_GHZ)
+		cck_rates = false;
+
 	/* TODO: Add all ciphers supported by wiphy */
 	ap->ciphers = wiphy_select_cipher(wiphy, 0xffff);
 	ap->group_cipher = wiphy_select_cipher(wiphy, 0xffff);
@@ -2937,12 +4439,29 @@ struct ap_state *ap_start(struct netdev *netdev, struct l_settings *config,
 				NULL, 0, ap_deauth_cb, ap, NULL))
 		goto error;
 
-	ap->mlme_watch = l_genl_family_register(ap->nl80211, "mlme",
+	ap->mlme_watch = l_genl_family_register_filtered(ap->nl80211, "mlme",
+						NL80211_ATTR_IFINDEX,
+						&ifindex, sizeof(ifindex),
 						ap_mlme_notify, ap, NULL);
 	if (!ap->mlme_watch)
 		l_error("Registering for MLME notification failed");
 
-	if (wait_on_address) {
+	if (!ap_list)
+		ap_list = l_queue_new();
+
+	l_queue_push_tail(ap_list, ap);
+
+	if (!ap->channel) {
+		if (!ap_acs_start(ap))
+			goto error;
+
+		if (err_out)
+			*err_out = 0;
+
+		return ap;
+	}
+
+	if (wait_on_address || ap->psk_work_id) {
 		if (err_out)
 			*err_out = 0;
 
@@ -3030,7 +4549,7 @@ void ap_shutdown(struct ap_state *ap, ap_stopped_func_t stopped_func,
 	if (ap->gtk_set) {
 		ap->gtk_set = false;
 
-		cmd = ap_build_cmd_del_key(ap);
+		cmd = ap_build_cmd_del_key(ap, ap->gtk_index);
 		if (!cmd) {
 			l_error("ap_build_cmd_del_key failed");
 			goto free_ap;
@@ -3088,7 +4607,7 @@ bool ap_station_disconnect(struct ap_state *ap, const uint8_t *mac,
 	if (!ap->started)
 		return false;
 
-	sta = l_queue_remove_if(ap->sta_states, ap_sta_match_addr, mac);
+	sta = ap_sta_remove(ap, mac);
 	if (!sta)
 		return false;
 
@@ -3133,6 +4652,8 @@ bool ap_push_button(struct ap_state *ap)
 		return true;
 	}
 
+	eap_wsc_prepare_key_pairs();
+
 	ap->wsc_pbc_timeout = l_timeout_create(AP_WSC_PBC_WALK_TIME,
 						ap_wsc_pbc_timeout_cb, ap,
 						ap_wsc_pbc_timeout_destroy);
@@ -3401,75 +4922,66 @@ static void ap_destroy_interface(void *user_data)
 	l_free(ap_if);
 }
 
-struct diagnostic_data {
-	struct l_dbus_message *pending;
-	struct l_dbus_message_builder *builder;
-};
-
-static void ap_get_station_cb(const struct diagnostic_station_info *info,
-				void *user_data)
+static struct l_dbus_message *ap_build_diagnostics_reply(
+						struct ap_state *ap,
+						struct l_dbus_message *message)
 {
-	struct diagnostic_data *data = user_data;
-
-	/* First station info */
-	if (!data->builder) {
-		struct l_dbus_message *reply =
-				l_dbus_message_new_method_return(data->pending);
+	struct l_dbus_message *reply =
+				l_dbus_message_new_method_return(message);
+	struct l_dbus_message_builder *builder =
+				l_dbus_message_builder_new(reply);
+	const struct l_queue_entry *entry;
 
-		data->builder = l_dbus_message_builder_new(reply);
+	l_dbus_message_builder_enter_array(builder, "a{sv}");
 
-		l_dbus_message_builder_enter_array(data->builder, "a{sv}");
-	}
+	for (entry = l_queue_get_entries(ap->sta_info); entry;
+			entry = entry->next) {
+		const struct diagnostic_station_info *info = entry->data;
 
-	l_dbus_message_builder_enter_array(data->builder, "{sv}");
-	dbus_append_dict_basic(data->builder, "Address", 's',
+		l_dbus_message_builder_enter_array(builder, "{sv}");
+		dbus_append_dict_basic(builder, "Address", 's',
 					util_address_to_string(info->addr));
 
-	diagnostic_info_to_dict(info, data->builder);
-
-	l_dbus_message_builder_leave_array(data->builder);
-}
-
-static void ap_get_station_destroy(void *user_data)
-{
-	struct diagnostic_data *data = user_data;
-	struct l_dbus_message *reply;
-
-	if (!data->builder) {
-		reply = l_dbus_message_new_method_return(data->pending);
-
-		data->builder = l_dbus_message_builder_new(reply);
+		diagnostic_info_to_dict(info, builder);
 
-		l_dbus_message_builder_enter_array(data->builder, "a{sv}");
+		l_dbus_message_builder_leave_array(builder);
 	}
 
-	l_dbus_message_builder_leave_array(data->builder);
-	reply = l_dbus_message_builder_finalize(data->builder);
-	l_dbus_message_builder_destroy(data->builder);
+	l_dbus_message_builder_leave_array(builder);
+	reply = l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
 
-	dbus_pending_reply(&data->pending, reply);
+	return reply;
+}
 
-	l_free(data);
+static void ap_sta_info_reply(void *data, void *user_data)
+{
+	struct l_dbus_message *message = data;
+	struct ap_state *ap = user_data;
+
+	dbus_pending_reply(&message, ap_build_diagnostics_reply(ap, message));
 }
 
 static struct l_dbus_message *ap_dbus_get_diagnostics(struct l_dbus *dbus,
 		struct l_dbus_message *message, void *user_data)
 {
 	struct ap_if_data *ap_if = user_data;
-	struct diagnostic_data *data;
+	struct ap_state *ap = ap_if->ap;
 	int ret;
 
-	data = l_new(struct diagnostic_data, 1);
-	data->pending = l_dbus_message_ref(message);
-
-	ret = netdev_get_all_stations(ap_if->ap->netdev, ap_get_station_cb,
-					data, ap_get_station_destroy);
+	/* Callers polling in a loop get the same dump for a short while */
+	if (ap->sta_info && l_time_diff(ap->sta_info_time, l_time_now()) <
+				AP_STA_INFO_MAX_AGE_MS * L_USEC_PER_MSEC)
+		return ap_build_diagnostics_reply(ap, message);
 
-	if (ret < 0) {
-		l_dbus_message_unref(data->pending);
-		l_free(data);
+	ret = ap_sta_info_dump_start(ap);
+	if (ret < 0)
 		return dbus_error_from_errno(ret, message);
-	}
+
+	if (!ap->sta_info_requests)
+		ap->sta_info_requests = l_queue_new();
+
+	l_queue_push_tail(ap->sta_info_requests, l_dbus_message_ref(message));
 
 	return NULL;
 }
@@ -3578,8 +5090,12 @@ static void ap_exit(void)
 	netdev_watch_remove(netdev_watch);
 	l_dbus_unregister_interface(dbus_get_bus(), IWD_AP_INTERFACE);
 
+	l_queue_destroy(ap_list, NULL);
+	ap_list = NULL;
+
 	ip_pool_destroy();
 }
 
 IWD_MODULE(ap, ap_init, ap_exit)
 IWD_MODULE_DEPENDS(ap, netdev);
+IWD_MODULE_ON_IFTYPE(ap, NL80211_IFTYPE_AP)
@@ -24,8 +24,11 @@
 #include <config.h>
 #endif
 
+#include <limits.h>
 #include <ell/ell.h>
 
+#include "ell/useful.h"
+#include "src/common.h"
 #include "src/blacklist.h"
 #include "src/util.h"
 #include "src/iwd.h"
@@ -47,58 +50,61 @@ static uint64_t blacklist_multiplier;
 static uint64_t blacklist_initial_timeout;
 static uint64_t blacklist_max_timeout;
 
+/*
+ * Entries are indexed by BSSID, or by the interned network_key pointer for
+ * whole networks with the entry holding a reference, and stay around until blacklist_max_timeout after they were
+ * first added so that repeated failures keep increasing expire_time.
+ * Removing them is left to a timeout per entry rather than pruning the
+ * whole list on every operation.
+ */
 struct blacklist_entry {
-	uint8_t addr[6];
+	struct l_hashtab *table;
+	struct l_timeout *prune_timeout;
 	uint64_t added_time;
 	uint64_t expire_time;
+	uint8_t key[];
 };
 
-static struct l_queue *blacklist;
+static struct l_hashtab *bss_blacklist;
+static struct l_hashtab *network_blacklist;
 
-static bool check_if_expired(void *data, void *user_data)
+static void blacklist_entry_free(void *data)
 {
 	struct blacklist_entry *entry = data;
-	uint64_t now = l_get_u64(user_data);
-
-	if (l_time_diff(now, entry->added_time) > blacklist_max_timeout) {
-		l_debug("Removing entry "MAC" on prune", MAC_STR(entry->addr));
-		l_free(entry);
-		return true;
-	}
 
-	return false;
-}
+	if (entry->table == network_blacklist) {
+		const struct network_key *key;
 
-static void blacklist_prune(void)
-{
-	uint64_t now = l_time_now();
+		memcpy(&key, entry->key, sizeof(key));
+		network_key_unref(key);
+	}
 
-	l_queue_foreach_remove(blacklist, check_if_expired, &now);
+	l_timeout_remove(entry->prune_timeout);
+	l_free(entry);
 }
 
-static bool match_addr(const void *a, const void *b)
+static void blacklist_prune(struct l_timeout *timeout, void *user_data)
 {
-	const struct blacklist_entry *entry = a;
-	const uint8_t *addr = b;
+	struct blacklist_entry *entry = user_data;
 
-	if (!memcmp(entry->addr, addr, 6))
-		return true;
+	if (entry->table == bss_blacklist)
+		l_debug("Removing entry "MAC" on prune", MAC_STR(entry->key));
+	else
+		l_debug("Removing network entry on prune");
 
-	return false;
+	l_hashtab_remove(entry->table, entry->key);
+	blacklist_entry_free(entry);
 }
 
-void blacklist_add_bss(const uint8_t *addr)
+/* Returns true if a new entry was created */
+static bool blacklist_add(struct l_hashtab *table, const void *key,
+				size_t key_len)
 {
-	struct blacklist_entry *entry;
-
-	blacklist_prune();
-
-	entry = l_queue_find(blacklist, match_addr, addr);
+	struct blacklist_entry *entry = l_hashtab_lookup(table, key);
+	uint64_t offset;
 
 	if (entry) {
-		uint64_t offset = l_time_diff(entry->added_time,
-							entry->expire_time);
-
+		offset = l_time_diff(entry->added_time, entry->expire_time);
 		offset *= blacklist_multiplier;
 
 		if (offset > blacklist_max_timeout)
@@ -106,51 +112,89 @@ void blacklist_add_bss(const uint8_t *addr)
 
 		entry->expire_time = l_time_offset(entry->added_time, offset);
 
-		return;
+		return false;
 	}
 
-	entry = l_new(struct blacklist_entry, 1);
+	entry = l_malloc(sizeof(struct blacklist_entry) + key_len);
 
+	entry->table = table;
 	entry->added_time = l_time_now();
 	entry->expire_time = l_time_offset(entry->added_time,
 						blacklist_initial_timeout);
-	memcpy(entry->addr, addr, 6);
+	memcpy(entry->key, key, key_len);
 
-	l_queue_push_tail(blacklist, entry);
-}
+	entry->prune_timeout = l_timeout_create(
+				minsize(blacklist_max_timeout / 1000000,
+								UINT_MAX),
+				blacklist_prune, entry, NULL);
+	/* Let the wheel batch prunes, an exact expiry doesn't matter here */
+	l_timeout_set_slack(entry->prune_timeout, 1000);
 
-bool blacklist_contains_bss(const uint8_t *addr)
-{
-	bool ret;
-	uint64_t time_now;
-	struct blacklist_entry *entry;
+	l_hashtab_insert(table, entry->key, entry);
 
-	blacklist_prune();
+	return true;
+}
 
-	entry = l_queue_find(blacklist, match_addr, addr);
+static bool blacklist_contains(struct l_hashtab *table, const void *key)
+{
+	struct blacklist_entry *entry = l_hashtab_lookup(table, key);
 
 	if (!entry)
 		return false;
 
-	time_now = l_time_now();
+	return !l_time_after(l_time_now(), entry->expire_time);
+}
+
+static void blacklist_remove(struct l_hashtab *table, const void *key)
+{
+	struct blacklist_entry *entry = l_hashtab_remove(table, key);
 
-	ret = l_time_after(time_now, entry->expire_time) ? false : true;
+	if (entry)
+		blacklist_entry_free(entry);
+}
 
-	return ret;
+void blacklist_add_bss(const uint8_t *addr)
+{
+	blacklist_add(bss_blacklist, addr, 6);
+}
+
+bool blacklist_contains_bss(const uint8_t *addr)
+{
+	return blacklist_contains(bss_blacklist, addr);
 }
 
 void blacklist_remove_bss(const uint8_t *addr)
 {
-	struct blacklist_entry *entry;
+	blacklist_remove(bss_blacklist, addr);
+}
 
-	blacklist_prune();
+void blacklist_add_network(const char *ssid, enum security security)
+{
+	const struct network_key *key = network_key_get(ssid, security);
 
-	entry = l_queue_remove_if(blacklist, match_addr, addr);
+	/* A new entry keeps the reference */
+	if (!blacklist_add(network_blacklist, &key, sizeof(key)))
+		network_key_unref(key);
+}
 
-	if (!entry)
+bool blacklist_contains_network(const char *ssid, enum security security)
+{
+	const struct network_key *key = network_key_find(ssid, security);
+
+	if (!key)
+		return false;
+
+	return blacklist_contains(network_blacklist, &key);
+}
+
+void blacklist_remove_network(const char *ssid, enum security security)
+{
+	const struct network_key *key = network_key_find(ssid, security);
+
+	if (!key)
 		return;
 
-	l_free(entry);
+	blacklist_remove(network_blacklist, &key);
 }
 
 static int blacklist_init(void)
@@ -176,14 +220,17 @@ static int blacklist_init(void)
 
 	blacklist_max_timeout *= 1000000;
 
-	blacklist = l_queue_new();
+	bss_blacklist = l_hashtab_new(6, L_HASHTAB_HASH_FAST);
+	network_blacklist = l_hashtab_new(sizeof(struct network_key *),
+						L_HASHTAB_HASH_FAST);
 
 	return 0;
 }
 
 static void blacklist_exit(void)
 {
-	l_queue_destroy(blacklist, l_free);
+	l_hashtab_destroy(bss_blacklist, blacklist_entry_free);
+	l_hashtab_destroy(network_blacklist, blacklist_entry_free);
 }
 
 IWD_MODULE(blacklist, blacklist_init, blacklist_exit)
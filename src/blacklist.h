@@ -20,6 +20,12 @@
  *
  */
 
+enum security;
+
 void blacklist_add_bss(const uint8_t *addr);
 bool blacklist_contains_bss(const uint8_t *addr);
 void blacklist_remove_bss(const uint8_t *addr);
+
+void blacklist_add_network(const char *ssid, enum security security);
+bool blacklist_contains_network(const char *ssid, enum security security);
+void blacklist_remove_network(const char *ssid, enum security security);
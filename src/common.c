@@ -28,10 +28,103 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include <ell/ell.h>
+
 #include "src/iwd.h"
 #include "src/common.h"
 #include "src/ie.h"
 
+struct network_key_id {
+	uint8_t ssid_len;
+	uint8_t security;
+	uint8_t ssid[32];
+} __attribute__ ((packed));
+
+static struct l_hashtab *network_keys;
+
+static void network_key_id_init(struct network_key_id *id, const char *ssid,
+				enum security security)
+{
+	memset(id, 0, sizeof(*id));
+	id->ssid_len = strnlen(ssid, sizeof(id->ssid));
+	id->security = security;
+	memcpy(id->ssid, ssid, id->ssid_len);
+}
+
+const struct network_key *network_key_find(const char *ssid,
+						enum security security)
+{
+	struct network_key_id id;
+
+	if (!network_keys)
+		return NULL;
+
+	network_key_id_init(&id, ssid, security);
+
+	return l_hashtab_lookup(network_keys, &id);
+}
+
+const struct network_key *network_key_get(const char *ssid,
+						enum security security)
+{
+	struct network_key_id id;
+	struct network_key *key;
+
+	if (!network_keys)
+		network_keys = l_hashtab_new(sizeof(id), L_HASHTAB_HASH_FAST);
+
+	network_key_id_init(&id, ssid, security);
+
+	key = l_hashtab_lookup(network_keys, &id);
+	if (key)
+		return network_key_ref(key);
+
+	key = l_new(struct network_key, 1);
+	memcpy(key->ssid, id.ssid, id.ssid_len);
+	key->ssid_len = id.ssid_len;
+	key->security = security;
+	key->hash = l_str_hash(key->ssid) ^ security;
+	key->ref_count = 1;
+
+	l_hashtab_insert(network_keys, &id, key);
+
+	return key;
+}
+
+const struct network_key *network_key_ref(const struct network_key *key)
+{
+	struct network_key *k = (struct network_key *) key;
+
+	k->ref_count += 1;
+
+	return key;
+}
+
+void network_key_unref(const struct network_key *key)
+{
+	struct network_key *k = (struct network_key *) key;
+	struct network_key_id id;
+
+	if (!k || --k->ref_count)
+		return;
+
+	network_key_id_init(&id, k->ssid, k->security);
+	l_hashtab_remove(network_keys, &id);
+	l_free(k);
+
+	if (l_hashtab_isempty(network_keys)) {
+		l_hashtab_destroy(network_keys, NULL);
+		network_keys = NULL;
+	}
+}
+
+unsigned int network_key_hash(const void *p)
+{
+	const struct network_key *key = p;
+
+	return key->hash;
+}
+
 const char *security_to_str(enum security security)
 {
 	switch (security) {
@@ -32,6 +32,27 @@ enum security {
 	SECURITY_8021X,
 };
 
+/*
+ * Interned SSID and security type pair.  There is only ever one instance
+ * for a given pair so keys can be compared by pointer and used directly
+ * as hashmap keys, hashed with network_key_hash.
+ */
+struct network_key {
+	char ssid[33];
+	uint8_t ssid_len;
+	enum security security;
+	unsigned int hash;
+	unsigned int ref_count;
+};
+
+const struct network_key *network_key_get(const char *ssid,
+						enum security security);
+const struct network_key *network_key_find(const char *ssid,
+						enum security security);
+const struct network_key *network_key_ref(const struct network_key *key);
+void network_key_unref(const struct network_key *key);
+unsigned int network_key_hash(const void *p);
+
 const char *security_to_str(enum security security);
 bool security_from_str(const char *str, enum security *security);
 enum security security_determine(uint16_t bss_capability,
@@ -70,19 +70,147 @@ size_t crypto_dh5_prime_size = sizeof(crypto_dh5_prime);
 const unsigned char crypto_dh5_generator[] = { 0x2 };
 size_t crypto_dh5_generator_size = sizeof(crypto_dh5_generator);
 
+/*
+ * Each keyed l_checksum is an AF_ALG socket that needs to be bound, keyed
+ * and accept()ed, which costs more than hashing the few hundred bytes we
+ * usually feed it.  The handshakes use the same few keys (PMK, KCK, SAE
+ * and FILS intermediate keys) over and over so the most recently used
+ * keyed objects are kept and only reset between uses.  The keys are wiped
+ * on eviction and in crypto_checksum_pool_flush().
+ */
+#define CHECKSUM_POOL_SIZE	8
+#define CHECKSUM_POOL_MAX_KEY	128
+#define CHECKSUM_CMAC_AES	((enum l_checksum_type) -1)
+
+struct checksum_pool_entry {
+	struct l_checksum *checksum;
+	enum l_checksum_type type;
+	uint8_t key[CHECKSUM_POOL_MAX_KEY];
+	size_t key_len;
+	uint64_t last_used;
+	bool in_use;
+};
+
+static struct checksum_pool_entry checksum_pool[CHECKSUM_POOL_SIZE];
+static uint64_t checksum_pool_clock;
+
+static void checksum_pool_entry_clear(struct checksum_pool_entry *entry)
+{
+	l_checksum_free(entry->checksum);
+	explicit_bzero(entry, sizeof(*entry));
+}
+
+/*
+ * Returns a reset keyed checksum object which must be released with
+ * checksum_pool_put().  Falls back to an unpooled object if the key is too
+ * long or, on nested use, all matching entries are busy.
+ */
+static struct l_checksum *checksum_pool_get(enum l_checksum_type type,
+						const void *key,
+						size_t key_len)
+{
+	struct checksum_pool_entry *entry = NULL;
+	struct l_checksum *checksum;
+	unsigned int i;
+
+	if (key_len > CHECKSUM_POOL_MAX_KEY)
+		goto unpooled;
+
+	for (i = 0; i < CHECKSUM_POOL_SIZE; i++) {
+		struct checksum_pool_entry *e = &checksum_pool[i];
+
+		if (!e->checksum || e->in_use || e->type != type ||
+				e->key_len != key_len ||
+				memcmp(e->key, key, key_len))
+			continue;
+
+		/* Discard the state left over by a failed operation */
+		l_checksum_reset(e->checksum);
+		entry = e;
+		goto done;
+	}
+
+	/* Evict the least recently used entry not in use */
+	for (i = 0; i < CHECKSUM_POOL_SIZE; i++) {
+		struct checksum_pool_entry *e = &checksum_pool[i];
+
+		if (e->in_use)
+			continue;
+
+		if (!entry || !e->checksum ||
+				(entry->checksum &&
+				 e->last_used < entry->last_used))
+			entry = e;
+
+		if (!e->checksum)
+			break;
+	}
+
+	if (!entry)
+		goto unpooled;
+
+	if (type == CHECKSUM_CMAC_AES)
+		checksum = l_checksum_new_cmac_aes(key, key_len);
+	else
+		checksum = l_checksum_new_hmac(type, key, key_len);
+
+	if (!checksum)
+		return NULL;
+
+	checksum_pool_entry_clear(entry);
+	entry->checksum = checksum;
+	entry->type = type;
+	memcpy(entry->key, key, key_len);
+	entry->key_len = key_len;
+
+done:
+	entry->last_used = ++checksum_pool_clock;
+	entry->in_use = true;
+	return entry->checksum;
+
+unpooled:
+	if (type == CHECKSUM_CMAC_AES)
+		return l_checksum_new_cmac_aes(key, key_len);
+
+	return l_checksum_new_hmac(type, key, key_len);
+}
+
+static void checksum_pool_put(struct l_checksum *checksum)
+{
+	unsigned int i;
+
+	for (i = 0; i < CHECKSUM_POOL_SIZE; i++) {
+		if (checksum_pool[i].checksum != checksum)
+			continue;
+
+		checksum_pool[i].in_use = false;
+		return;
+	}
+
+	l_checksum_free(checksum);
+}
+
+void crypto_checksum_pool_flush(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < CHECKSUM_POOL_SIZE; i++)
+		checksum_pool_entry_clear(&checksum_pool[i]);
+}
+
 static bool hmac_common(enum l_checksum_type type,
 		const void *key, size_t key_len,
                 const void *data, size_t data_len, void *output, size_t size)
 {
 	struct l_checksum *hmac;
 
-	hmac = l_checksum_new_hmac(type, key, key_len);
+	hmac = checksum_pool_get(type, key, key_len);
 	if (!hmac)
 		return false;
 
 	l_checksum_update(hmac, data, data_len);
 	l_checksum_get_digest(hmac, output, size);
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
@@ -120,13 +248,13 @@ bool cmac_aes(const void *key, size_t key_len,
 {
 	struct l_checksum *cmac_aes;
 
-	cmac_aes = l_checksum_new_cmac_aes(key, key_len);
+	cmac_aes = checksum_pool_get(CHECKSUM_CMAC_AES, key, key_len);
 	if (!cmac_aes)
 		return false;
 
 	l_checksum_update(cmac_aes, data, data_len);
 	l_checksum_get_digest(cmac_aes, output, size);
-	l_checksum_free(cmac_aes);
+	checksum_pool_put(cmac_aes);
 
 	return true;
 }
@@ -338,16 +466,16 @@ bool aes_siv_encrypt(const uint8_t *key, size_t key_len, const uint8_t *in,
 	 * key is split into two equal halves... K1 is used for S2V and K2 is
 	 * used for CTR
 	 */
-	cmac = l_checksum_new_cmac_aes(key, key_len / 2);
+	cmac = checksum_pool_get(CHECKSUM_CMAC_AES, key, key_len / 2);
 	if (!cmac)
 		return false;
 
 	if (!s2v(cmac, iov, num_ad, v)) {
-		l_checksum_free(cmac);
+		checksum_pool_put(cmac);
 		return false;
 	}
 
-	l_checksum_free(cmac);
+	checksum_pool_put(cmac);
 
 	memcpy(out, v, 16);
 
@@ -412,16 +540,16 @@ bool aes_siv_decrypt(const uint8_t *key, size_t key_len, const uint8_t *in,
 	l_cipher_free(ctr);
 
 check_cmac:
-	cmac = l_checksum_new_cmac_aes(key, key_len / 2);
+	cmac = checksum_pool_get(CHECKSUM_CMAC_AES, key, key_len / 2);
 	if (!cmac)
 		return false;
 
 	if (!s2v(cmac, iov, num_ad, v)) {
-		l_checksum_free(cmac);
+		checksum_pool_put(cmac);
 		return false;
 	}
 
-	l_checksum_free(cmac);
+	checksum_pool_put(cmac);
 
 	if (memcmp(v, in, 16))
 		return false;
@@ -539,12 +667,136 @@ bool crypto_passphrase_is_valid(const char *passphrase)
 	return true;
 }
 
+/*
+ * PBKDF2 with 4096 iterations is expensive on low-end CPUs, so keep the most
+ * recently derived PSKs around.  Entries are looked up by SSID and a digest
+ * of the passphrase so that the passphrase itself is never kept here.
+ */
+#define PSK_CACHE_SIZE 64
+
+struct psk_cache_entry {
+	uint8_t ssid[32];
+	size_t ssid_len;
+	uint8_t digest[32];
+	uint8_t psk[32];
+};
+
+static struct l_queue *psk_cache;
+
+static void psk_cache_entry_free(void *data)
+{
+	struct psk_cache_entry *entry = data;
+
+	explicit_bzero(entry, sizeof(*entry));
+	l_free(entry);
+}
+
+static bool psk_cache_digest(const char *passphrase, uint8_t *out_digest)
+{
+	struct l_checksum *sha256 = l_checksum_new(L_CHECKSUM_SHA256);
+	bool r;
+
+	if (!sha256)
+		return false;
+
+	r = l_checksum_update(sha256, passphrase, strlen(passphrase)) &&
+		l_checksum_get_digest(sha256, out_digest, 32) == 32;
+
+	l_checksum_free(sha256);
+	return r;
+}
+
+struct psk_cache_match_data {
+	const uint8_t *ssid;
+	size_t ssid_len;
+	const uint8_t *digest;
+};
+
+static bool psk_cache_match(const void *a, const void *b)
+{
+	const struct psk_cache_entry *entry = a;
+	const struct psk_cache_match_data *data = b;
+
+	if (entry->ssid_len != data->ssid_len ||
+			memcmp(entry->ssid, data->ssid, data->ssid_len))
+		return false;
+
+	return !data->digest || !memcmp(entry->digest, data->digest, 32);
+}
+
+static bool psk_cache_lookup(const uint8_t *ssid, size_t ssid_len,
+				const uint8_t *digest, uint8_t *out_psk)
+{
+	struct psk_cache_match_data data = { ssid, ssid_len, digest };
+	struct psk_cache_entry *entry;
+
+	entry = l_queue_remove_if(psk_cache, psk_cache_match, &data);
+	if (!entry)
+		return false;
+
+	/* Keep the most recently used entries at the head */
+	l_queue_push_head(psk_cache, entry);
+	memcpy(out_psk, entry->psk, 32);
+
+	return true;
+}
+
+static void psk_cache_add(const uint8_t *ssid, size_t ssid_len,
+				const uint8_t *digest, const uint8_t *psk)
+{
+	struct psk_cache_entry *entry;
+
+	if (!psk_cache)
+		psk_cache = l_queue_new();
+
+	if (l_queue_length(psk_cache) >= PSK_CACHE_SIZE) {
+		entry = l_queue_peek_tail(psk_cache);
+		l_queue_remove(psk_cache, entry);
+		psk_cache_entry_free(entry);
+	}
+
+	entry = l_new(struct psk_cache_entry, 1);
+	memcpy(entry->ssid, ssid, ssid_len);
+	entry->ssid_len = ssid_len;
+	memcpy(entry->digest, digest, 32);
+	memcpy(entry->psk, psk, 32);
+
+	l_queue_push_head(psk_cache, entry);
+}
+
+/*
+ * Removes the cached PSKs for @ssid, or all of the cached PSKs if @ssid is
+ * NULL.
+ */
+void crypto_psk_cache_flush(const unsigned char *ssid, size_t ssid_len)
+{
+	struct psk_cache_match_data data = { ssid, ssid_len, NULL };
+
+	if (!psk_cache)
+		return;
+
+	if (ssid) {
+		struct psk_cache_entry *entry;
+
+		while ((entry = l_queue_remove_if(psk_cache, psk_cache_match,
+							&data)))
+			psk_cache_entry_free(entry);
+
+		return;
+	}
+
+	l_queue_destroy(psk_cache, psk_cache_entry_free);
+	psk_cache = NULL;
+}
+
 int crypto_psk_from_passphrase(const char *passphrase,
 				const unsigned char *ssid, size_t ssid_len,
 				unsigned char *out_psk)
 {
 	bool result;
 	unsigned char psk[32];
+	uint8_t digest[32];
+	bool have_digest;
 
 	if (!passphrase)
 		return -EINVAL;
@@ -558,19 +810,376 @@ int crypto_psk_from_passphrase(const char *passphrase,
 	if (ssid_len == 0 || ssid_len > 32)
 		return -ERANGE;
 
+	have_digest = psk_cache_digest(passphrase, digest);
+
+	if (have_digest && psk_cache_lookup(ssid, ssid_len, digest, psk))
+		goto done;
+
 	result = l_cert_pkcs5_pbkdf2(L_CHECKSUM_SHA1, passphrase,
 					ssid, ssid_len, 4096,
 					psk, sizeof(psk));
-	if (!result)
+	if (!result) {
+		explicit_bzero(digest, sizeof(digest));
 		return -ENOKEY;
+	}
+
+	if (have_digest)
+		psk_cache_add(ssid, ssid_len, digest, psk);
 
+done:
 	if (out_psk)
 		memcpy(out_psk, psk, sizeof(psk));
 
+	explicit_bzero(digest, sizeof(digest));
 	explicit_bzero(psk, sizeof(psk));
 	return 0;
 }
 
+/*
+ * Only succeeds if the PSK is already cached, for callers that would rather
+ * derive it on a worker thread than block the main loop.
+ */
+bool crypto_psk_cache_lookup(const char *passphrase,
+				const unsigned char *ssid, size_t ssid_len,
+				unsigned char *out_psk)
+{
+	uint8_t digest[32];
+	bool found;
+
+	if (!passphrase || !ssid || ssid_len == 0 || ssid_len > 32)
+		return false;
+
+	if (!psk_cache_digest(passphrase, digest))
+		return false;
+
+	found = psk_cache_lookup(ssid, ssid_len, digest, out_psk);
+	explicit_bzero(digest, sizeof(digest));
+
+	return found;
+}
+
+/*
+ * Multi-buffer SHA-1 used to derive several PSKs at once.  The state of each
+ * lane lives in its own column so that every step of the compression
+ * function is a short loop over the lanes, which the compiler is able to turn
+ * into SSE/AVX2/NEON instructions where available.
+ */
+#define SHA1_LANES 4
+
+static inline uint32_t sha1_rol(uint32_t x, unsigned int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static const uint32_t sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+#define SHA1_SCHEDULE(w, i, l)						\
+	((i) < 16 ? w[i][l] :						\
+		(w[(i) & 15][l] = sha1_rol(w[((i) + 13) & 15][l] ^	\
+					w[((i) + 8) & 15][l] ^		\
+					w[((i) + 2) & 15][l] ^		\
+					w[(i) & 15][l], 1)))
+
+#define SHA1_ROUNDS(first, last, f, k)					\
+	for (i = first; i <= last; i++) {				\
+		for (l = 0; l < SHA1_LANES; l++) {			\
+			uint32_t t = sha1_rol(a[l], 5) + (f) + e[l] +	\
+					(k) + SHA1_SCHEDULE(w, i, l);	\
+			e[l] = d[l];					\
+			d[l] = c[l];					\
+			c[l] = sha1_rol(b[l], 30);			\
+			b[l] = a[l];					\
+			a[l] = t;					\
+		}							\
+	}
+
+/* Note: the message schedule is computed in place and destroys @w */
+static void sha1_compress_lanes(uint32_t h[5][SHA1_LANES],
+				uint32_t w[16][SHA1_LANES])
+{
+	uint32_t a[SHA1_LANES], b[SHA1_LANES], c[SHA1_LANES];
+	uint32_t d[SHA1_LANES], e[SHA1_LANES];
+	unsigned int i, l;
+
+	for (l = 0; l < SHA1_LANES; l++) {
+		a[l] = h[0][l];
+		b[l] = h[1][l];
+		c[l] = h[2][l];
+		d[l] = h[3][l];
+		e[l] = h[4][l];
+	}
+
+	SHA1_ROUNDS(0, 19, (b[l] & c[l]) | (~b[l] & d[l]), 0x5a827999)
+	SHA1_ROUNDS(20, 39, b[l] ^ c[l] ^ d[l], 0x6ed9eba1)
+	SHA1_ROUNDS(40, 59, (b[l] & c[l]) | (b[l] & d[l]) | (c[l] & d[l]),
+			0x8f1bbcdc)
+	SHA1_ROUNDS(60, 79, b[l] ^ c[l] ^ d[l], 0xca62c1d6)
+
+	for (l = 0; l < SHA1_LANES; l++) {
+		h[0][l] += a[l];
+		h[1][l] += b[l];
+		h[2][l] += c[l];
+		h[3][l] += d[l];
+		h[4][l] += e[l];
+	}
+}
+
+/*
+ * Hashes the 20-byte digests in @u, as a message following a 64-byte pad
+ * block whose state is @state, and stores the result back in @u.
+ */
+static void sha1_hash_digest_lanes(uint32_t state[5][SHA1_LANES],
+				uint32_t u[5][SHA1_LANES])
+{
+	uint32_t w[16][SHA1_LANES];
+	unsigned int i, l;
+
+	for (l = 0; l < SHA1_LANES; l++) {
+		for (i = 0; i < 5; i++)
+			w[i][l] = u[i][l];
+
+		w[5][l] = 0x80000000;
+
+		for (i = 6; i < 15; i++)
+			w[i][l] = 0;
+
+		/* 672 bits in total */
+		w[15][l] = (64 + 20) * 8;
+	}
+
+	memcpy(u, state, sizeof(uint32_t) * 5 * SHA1_LANES);
+	sha1_compress_lanes(u, w);
+}
+
+static void sha1_load_block(uint32_t w[16][SHA1_LANES], unsigned int lane,
+				const uint8_t *block)
+{
+	unsigned int i;
+
+	for (i = 0; i < 16; i++)
+		w[i][lane] = l_get_be32(block + i * 4);
+}
+
+/*
+ * PBKDF2-HMAC-SHA1 with 4096 iterations for up to SHA1_LANES requests.  Lanes
+ * past @n are filled with a copy of the first request and their output is
+ * discarded.
+ */
+static void pbkdf2_sha1_psk_lanes(struct crypto_psk_request **reqs,
+					unsigned int n)
+{
+	uint32_t istate[5][SHA1_LANES];
+	uint32_t ostate[5][SHA1_LANES];
+	uint32_t w[16][SHA1_LANES];
+	uint32_t u[5][SHA1_LANES];
+	uint32_t t[5][SHA1_LANES];
+	uint8_t block[64];
+	uint8_t psk[SHA1_LANES][40];
+	unsigned int i, l, iter;
+	uint32_t index;
+
+	/* Passphrases are at most 63 bytes, so always fit in the pad block */
+	for (l = 0; l < SHA1_LANES; l++) {
+		const struct crypto_psk_request *req = reqs[l < n ? l : 0];
+		size_t len = strlen(req->passphrase);
+
+		for (i = 0; i < 5; i++)
+			istate[i][l] = ostate[i][l] = sha1_iv[i];
+
+		memset(block, 0x36, sizeof(block));
+		for (i = 0; i < len; i++)
+			block[i] ^= req->passphrase[i];
+
+		sha1_load_block(w, l, block);
+	}
+
+	sha1_compress_lanes(istate, w);
+
+	for (l = 0; l < SHA1_LANES; l++) {
+		const struct crypto_psk_request *req = reqs[l < n ? l : 0];
+		size_t len = strlen(req->passphrase);
+
+		memset(block, 0x5c, sizeof(block));
+		for (i = 0; i < len; i++)
+			block[i] ^= req->passphrase[i];
+
+		sha1_load_block(w, l, block);
+	}
+
+	sha1_compress_lanes(ostate, w);
+
+	/* A 256-bit PSK needs two 160-bit PBKDF2 output blocks */
+	for (index = 1; index <= 2; index++) {
+		for (l = 0; l < SHA1_LANES; l++) {
+			const struct crypto_psk_request *req =
+							reqs[l < n ? l : 0];
+			size_t msg_len = req->ssid_len + 4;
+
+			memset(block, 0, sizeof(block));
+			memcpy(block, req->ssid, req->ssid_len);
+			l_put_be32(index, block + req->ssid_len);
+			block[msg_len] = 0x80;
+			l_put_be64((64 + msg_len) * 8, block + 56);
+
+			sha1_load_block(w, l, block);
+		}
+
+		memcpy(u, istate, sizeof(u));
+		sha1_compress_lanes(u, w);
+		sha1_hash_digest_lanes(ostate, u);
+		memcpy(t, u, sizeof(t));
+
+		for (iter = 1; iter < 4096; iter++) {
+			/* U_i = HMAC(P, U_i-1) */
+			sha1_hash_digest_lanes(istate, u);
+			sha1_hash_digest_lanes(ostate, u);
+
+			for (i = 0; i < 5; i++)
+				for (l = 0; l < SHA1_LANES; l++)
+					t[i][l] ^= u[i][l];
+		}
+
+		for (l = 0; l < SHA1_LANES; l++)
+			for (i = 0; i < 5; i++)
+				l_put_be32(t[i][l],
+						psk[l] + (index - 1) * 20 + i * 4);
+	}
+
+	for (l = 0; l < n; l++)
+		memcpy(reqs[l]->psk, psk[l], 32);
+
+	explicit_bzero(istate, sizeof(istate));
+	explicit_bzero(ostate, sizeof(ostate));
+	explicit_bzero(w, sizeof(w));
+	explicit_bzero(u, sizeof(u));
+	explicit_bzero(t, sizeof(t));
+	explicit_bzero(block, sizeof(block));
+	explicit_bzero(psk, sizeof(psk));
+}
+
+/*
+ * Derives the PSKs for @n requests at once.  The result of each derivation is
+ * stored in the request's result member, with the same semantics as the
+ * return value of crypto_psk_from_passphrase().  A single request is handled
+ * by crypto_psk_from_passphrase() directly.
+ */
+void crypto_psk_from_passphrase_batch(struct crypto_psk_request *reqs,
+					unsigned int n)
+{
+	struct crypto_psk_request *pending[SHA1_LANES];
+	uint8_t digests[SHA1_LANES][32];
+	bool have_digest[SHA1_LANES];
+	unsigned int i;
+	unsigned int n_pending = 0;
+
+	if (n == 1) {
+		reqs[0].result = crypto_psk_from_passphrase(reqs[0].passphrase,
+							reqs[0].ssid,
+							reqs[0].ssid_len,
+							reqs[0].psk);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct crypto_psk_request *req = &reqs[i];
+		uint8_t *digest = digests[n_pending];
+
+		if (!req->passphrase || !req->ssid) {
+			req->result = -EINVAL;
+			goto next;
+		}
+
+		if (!crypto_passphrase_is_valid(req->passphrase) ||
+				req->ssid_len == 0 || req->ssid_len > 32) {
+			req->result = -ERANGE;
+			goto next;
+		}
+
+		req->result = 0;
+		have_digest[n_pending] = psk_cache_digest(req->passphrase,
+								digest);
+
+		if (have_digest[n_pending] && psk_cache_lookup(req->ssid,
+							req->ssid_len,
+							digest, req->psk))
+			goto next;
+
+		pending[n_pending++] = req;
+
+next:
+		if (n_pending < SHA1_LANES && i + 1 < n)
+			continue;
+
+		if (!n_pending)
+			continue;
+
+		pbkdf2_sha1_psk_lanes(pending, n_pending);
+
+		while (n_pending--) {
+			struct crypto_psk_request *done = pending[n_pending];
+
+			if (have_digest[n_pending])
+				psk_cache_add(done->ssid, done->ssid_len,
+						digests[n_pending], done->psk);
+		}
+
+		n_pending = 0;
+	}
+
+	explicit_bzero(digests, sizeof(digests));
+}
+
+/*
+ * Like crypto_psk_from_passphrase_batch() but neither consults nor updates
+ * the PSK cache, so it can be used from a worker thread.  The results can
+ * be added to the cache afterwards with crypto_psk_cache_add_batch().
+ */
+void crypto_psk_derive_batch(struct crypto_psk_request *reqs, unsigned int n)
+{
+	struct crypto_psk_request *pending[SHA1_LANES];
+	unsigned int i;
+	unsigned int n_pending = 0;
+
+	for (i = 0; i < n; i++) {
+		struct crypto_psk_request *req = &reqs[i];
+
+		if (!req->passphrase || !req->ssid)
+			req->result = -EINVAL;
+		else if (!crypto_passphrase_is_valid(req->passphrase) ||
+				req->ssid_len == 0 || req->ssid_len > 32)
+			req->result = -ERANGE;
+		else {
+			req->result = 0;
+			pending[n_pending++] = req;
+		}
+
+		if (n_pending == SHA1_LANES || (n_pending && i + 1 == n)) {
+			pbkdf2_sha1_psk_lanes(pending, n_pending);
+			n_pending = 0;
+		}
+	}
+}
+
+void crypto_psk_cache_add_batch(const struct crypto_psk_request *reqs,
+					unsigned int n)
+{
+	uint8_t digest[32];
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (reqs[i].result < 0)
+			continue;
+
+		if (psk_cache_digest(reqs[i].passphrase, digest))
+			psk_cache_add(reqs[i].ssid, reqs[i].ssid_len, digest,
+					reqs[i].psk);
+	}
+
+	explicit_bzero(digest, sizeof(digest));
+}
+
 bool prf_sha1(const void *key, size_t key_len,
 		const void *prefix, size_t prefix_len,
 		const void *data, size_t data_len, void *output, size_t size)
@@ -586,7 +1195,7 @@ bool prf_sha1(const void *key, size_t key_len,
 		[3] = { .iov_base = &counter, .iov_len = 1 },
 	};
 
-	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA1, key, key_len);
+	hmac = checksum_pool_get(L_CHECKSUM_SHA1, key, key_len);
 	if (!hmac)
 		return false;
 
@@ -605,7 +1214,7 @@ bool prf_sha1(const void *key, size_t key_len,
 		offset += len;
 	}
 
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
@@ -642,7 +1251,7 @@ bool prf_plus_sha1(const void *key, size_t key_len,
 		[4] = { .iov_base = (void *) nil_bytes, .iov_len = 2 },
 	};
 
-	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA1, key, key_len);
+	hmac = checksum_pool_get(L_CHECKSUM_SHA1, key, key_len);
 	if (!hmac)
 		return false;
 
@@ -669,7 +1278,7 @@ bool prf_plus_sha1(const void *key, size_t key_len,
 		iov[0].iov_len = len;
 	}
 
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
@@ -691,7 +1300,7 @@ bool kdf_sha256(const void *key, size_t key_len,
 		[3] = { .iov_base = length_le, .iov_len = 2 },
 	};
 
-	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA256, key, key_len);
+	hmac = checksum_pool_get(L_CHECKSUM_SHA256, key, key_len);
 	if (!hmac)
 		return false;
 
@@ -715,7 +1324,7 @@ bool kdf_sha256(const void *key, size_t key_len,
 		offset += len;
 	}
 
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
@@ -736,7 +1345,7 @@ bool kdf_sha384(const void *key, size_t key_len,
 		[3] = { .iov_base = length_le, .iov_len = 2 },
 	};
 
-	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA384, key, key_len);
+	hmac = checksum_pool_get(L_CHECKSUM_SHA384, key, key_len);
 	if (!hmac)
 		return false;
 
@@ -760,7 +1369,7 @@ bool kdf_sha384(const void *key, size_t key_len,
 		offset += len;
 	}
 
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
@@ -787,7 +1396,7 @@ bool hkdf_extract(enum l_checksum_type type, const uint8_t *key,
 	if (dlen <= 0)
 		return false;
 
-	hmac = l_checksum_new_hmac(type, k, k_len);
+	hmac = checksum_pool_get(type, k, k_len);
 	if (!hmac)
 		return false;
 
@@ -799,13 +1408,13 @@ bool hkdf_extract(enum l_checksum_type type, const uint8_t *key,
 	}
 
 	if (!l_checksum_updatev(hmac, iov, num_args)) {
-		l_checksum_free(hmac);
+		checksum_pool_put(hmac);
 		va_end(va);
 		return false;
 	}
 
 	ret = l_checksum_get_digest(hmac, out, dlen);
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	va_end(va);
 	return (ret == (int) dlen);
@@ -821,7 +1430,7 @@ bool hkdf_expand(enum l_checksum_type type, const uint8_t *key, size_t key_len,
 	uint8_t count = 1;
 	uint8_t *out_ptr = out;
 
-	hmac = l_checksum_new_hmac(type, key, key_len);
+	hmac = checksum_pool_get(type, key, key_len);
 	if (!hmac)
 		return false;
 
@@ -837,13 +1446,13 @@ bool hkdf_expand(enum l_checksum_type type, const uint8_t *key, size_t key_len,
 		iov[2].iov_len = 1;
 
 		if (!l_checksum_updatev(hmac, iov, 3)) {
-			l_checksum_free(hmac);
+			checksum_pool_put(hmac);
 			return false;
 		}
 
 		ret = l_checksum_get_digest(hmac, out_ptr, out_len);
 		if (ret < 0) {
-			l_checksum_free(hmac);
+			checksum_pool_put(hmac);
 			return false;
 		}
 
@@ -862,7 +1471,7 @@ bool hkdf_expand(enum l_checksum_type type, const uint8_t *key, size_t key_len,
 			l_checksum_reset(hmac);
 	}
 
-	l_checksum_free(hmac);
+	checksum_pool_put(hmac);
 
 	return true;
 }
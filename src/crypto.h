@@ -96,6 +96,25 @@ bool crypto_passphrase_is_valid(const char *passphrase);
 int crypto_psk_from_passphrase(const char *passphrase,
 				const unsigned char *ssid, size_t ssid_len,
 				unsigned char *out_psk);
+bool crypto_psk_cache_lookup(const char *passphrase,
+				const unsigned char *ssid, size_t ssid_len,
+				unsigned char *out_psk);
+void crypto_psk_cache_flush(const unsigned char *ssid, size_t ssid_len);
+void crypto_checksum_pool_flush(void);
+
+struct crypto_psk_request {
+	const char *passphrase;
+	const unsigned char *ssid;
+	size_t ssid_len;
+	unsigned char psk[32];
+	int result;
+};
+
+void crypto_psk_from_passphrase_batch(struct crypto_psk_request *reqs,
+					unsigned int n);
+void crypto_psk_derive_batch(struct crypto_psk_request *reqs, unsigned int n);
+void crypto_psk_cache_add_batch(const struct crypto_psk_request *reqs,
+					unsigned int n);
 
 bool kdf_sha256(const void *key, size_t key_len,
 		const void *prefix, size_t prefix_len,
@@ -33,9 +33,15 @@
 #include "src/agent.h"
 #include "src/iwd.h"
 #include "src/dbus.h"
+#include "src/trace.h"
+#include "src/metrics.h"
 
 static struct l_dbus *g_dbus = NULL;
 
+METRICS_HISTOGRAM(dbus_method, "iwd_dbus_method_duration_seconds",
+		"Time taken to answer D-Bus method calls that complete "
+		"asynchronously")
+
 struct l_dbus_message *dbus_error_busy(struct l_dbus_message *msg)
 {
 	return l_dbus_message_new_error(msg, IWD_SERVICE ".InProgress",
@@ -172,6 +178,15 @@ void dbus_pending_reply(struct l_dbus_message **msg,
 				struct l_dbus_message *reply)
 {
 	struct l_dbus *dbus = dbus_get_bus();
+	uint64_t rx_time = l_dbus_message_get_receive_time(*msg);
+
+	if (rx_time)
+		METRICS_OBSERVE(dbus_method, l_time_diff(rx_time,
+							l_time_now()));
+
+	TRACE(dbus_pending_reply, l_dbus_message_get_interface(*msg),
+			l_dbus_message_get_member(*msg),
+			l_dbus_message_is_error(reply));
 
 	l_dbus_send(dbus, reply);
 	l_dbus_message_unref(*msg);
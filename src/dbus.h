@@ -41,10 +41,12 @@
 #define IWD_P2P_WFD_INTERFACE "net.connman.iwd.p2p.Display"
 #define IWD_STATION_DIAGNOSTIC_INTERFACE "net.connman.iwd.StationDiagnostic"
 #define IWD_AP_DIAGNOSTIC_INTERFACE "net.connman.iwd.AccessPointDiagnostic"
+#define IWD_METRICS_INTERFACE "net.connman.iwd.Metrics"
 
 #define IWD_BASE_PATH "/net/connman/iwd"
 #define IWD_AGENT_MANAGER_PATH IWD_BASE_PATH
 #define IWD_P2P_SERVICE_MANAGER_PATH IWD_BASE_PATH
+#define IWD_METRICS_PATH IWD_BASE_PATH
 
 struct l_dbus;
 
@@ -24,11 +24,44 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
+#include <time.h>
 #include <ell/ell.h>
 
 #include "src/diagnostic.h"
 #include "src/dbus.h"
 #include "src/ie.h"
+#include "src/util.h"
+
+static const char *const diagnostic_ac_names[] = {
+	[DIAGNOSTIC_AC_BE] = "BestEffort",
+	[DIAGNOSTIC_AC_BK] = "Background",
+	[DIAGNOSTIC_AC_VI] = "Video",
+	[DIAGNOSTIC_AC_VO] = "Voice",
+};
+
+/* e.g. VoiceTxFrames, VoiceTxRetries, VoiceTxFailed and VoiceRxFrames */
+static void diagnostic_ac_stats_to_dict(const struct diagnostic_ac_stats *stats,
+					struct l_dbus_message_builder *builder)
+{
+	char key[32];
+	unsigned int i;
+
+	for (i = 0; i < __DIAGNOSTIC_AC_COUNT; i++) {
+		const char *ac = diagnostic_ac_names[i];
+
+		snprintf(key, sizeof(key), "%sTxFrames", ac);
+		dbus_append_dict_basic(builder, key, 't', &stats[i].tx_msdu);
+		snprintf(key, sizeof(key), "%sTxRetries", ac);
+		dbus_append_dict_basic(builder, key, 't',
+					&stats[i].tx_msdu_retries);
+		snprintf(key, sizeof(key), "%sTxFailed", ac);
+		dbus_append_dict_basic(builder, key, 't',
+					&stats[i].tx_msdu_failed);
+		snprintf(key, sizeof(key), "%sRxFrames", ac);
+		dbus_append_dict_basic(builder, key, 't', &stats[i].rx_msdu);
+	}
+}
 
 /*
  * Appends values from diagnostic_station_info into a DBus dictionary. This
@@ -110,9 +143,204 @@ bool diagnostic_info_to_dict(const struct diagnostic_station_info *info,
 		dbus_append_dict_basic(builder, "ExpectedThroughput", 'u',
 					&info->expected_throughput);
 
+	if (info->have_connected_time)
+		dbus_append_dict_basic(builder, "ConnectedTime", 'u',
+					&info->connected_time);
+
+	if (info->have_inactive_time)
+		dbus_append_dict_basic(builder, "InactiveTime", 'u',
+					&info->inactive_time);
+
+	if (info->have_tx_retries)
+		dbus_append_dict_basic(builder, "TxRetries", 'u',
+					&info->tx_retries);
+
+	if (info->have_tx_failed)
+		dbus_append_dict_basic(builder, "TxFailed", 'u',
+					&info->tx_failed);
+
+	if (info->have_rx_drop_misc)
+		dbus_append_dict_basic(builder, "RxDropped", 't',
+					&info->rx_drop_misc);
+
+	if (info->have_beacon_loss)
+		dbus_append_dict_basic(builder, "BeaconLoss", 'u',
+					&info->beacon_loss);
+
+	if (info->have_rx_duration)
+		dbus_append_dict_basic(builder, "RxAirtime", 't',
+					&info->rx_duration);
+
+	if (info->have_tx_duration)
+		dbus_append_dict_basic(builder, "TxAirtime", 't',
+					&info->tx_duration);
+
+	if (info->have_ac_stats)
+		diagnostic_ac_stats_to_dict(info->ac_stats, builder);
+
 	return true;
 }
 
+static const char *const diagnostic_phase_names[] = {
+	[DIAGNOSTIC_PHASE_SCAN] = "Scan",
+	[DIAGNOSTIC_PHASE_AUTHENTICATE] = "Authentication",
+	[DIAGNOSTIC_PHASE_ASSOCIATE] = "Association",
+	[DIAGNOSTIC_PHASE_EAP] = "EAP",
+	[DIAGNOSTIC_PHASE_HANDSHAKE] = "Handshake",
+	[DIAGNOSTIC_PHASE_SETTING_KEYS] = "KeySetting",
+	[DIAGNOSTIC_PHASE_IP_CONFIG] = "IPConfiguration",
+};
+
+static const char *const diagnostic_roam_reason_names[] = {
+	[DIAGNOSTIC_ROAM_REASON_NONE] = NULL,
+	[DIAGNOSTIC_ROAM_REASON_LOW_SIGNAL] = "LowSignal",
+	[DIAGNOSTIC_ROAM_REASON_SIGNAL_TREND] = "SignalTrend",
+	[DIAGNOSTIC_ROAM_REASON_AP_DIRECTED] = "APDirected",
+};
+
+static const char *const diagnostic_roam_method_names[] = {
+	[DIAGNOSTIC_ROAM_METHOD_NONE] = NULL,
+	[DIAGNOSTIC_ROAM_METHOD_REASSOCIATION] = "Reassociation",
+	[DIAGNOSTIC_ROAM_METHOD_PREAUTHENTICATION] = "Preauthentication",
+	[DIAGNOSTIC_ROAM_METHOD_FT_OVER_AIR] = "FT-over-Air",
+	[DIAGNOSTIC_ROAM_METHOD_FT_OVER_DS] = "FT-over-DS",
+};
+
+struct diagnostic_timeline *diagnostic_timeline_new(const uint8_t *addr,
+							bool roam)
+{
+	struct diagnostic_timeline *timeline =
+					l_new(struct diagnostic_timeline, 1);
+
+	struct timespec ts;
+
+	memcpy(timeline->addr, addr, 6);
+	timeline->roam = roam;
+	timeline->start_time = l_time_now();
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	timeline->wall_time = ts.tv_sec * L_USEC_PER_SEC +
+						ts.tv_nsec / L_NSEC_PER_USEC;
+
+	return timeline;
+}
+
+/*
+ * Only the first time a phase is reached is recorded, e.g. when retrying
+ * on another BSS the authentication time includes all of the attempts.
+ */
+void diagnostic_timeline_mark(struct diagnostic_timeline *timeline,
+				enum diagnostic_phase phase, uint64_t time)
+{
+	if (!time || timeline->phase_start[phase] || timeline->end_time)
+		return;
+
+	timeline->phase_start[phase] = time;
+
+	if (time < timeline->start_time)
+		timeline->start_time = time;
+}
+
+/* A phase lasts until the start of the next phase that happened */
+static uint64_t diagnostic_phase_duration(
+				const struct diagnostic_timeline *timeline,
+				enum diagnostic_phase phase)
+{
+	unsigned int i;
+
+	for (i = phase + 1; i < __DIAGNOSTIC_PHASE_COUNT; i++)
+		if (timeline->phase_start[i])
+			return l_time_diff(timeline->phase_start[phase],
+						timeline->phase_start[i]);
+
+	return l_time_diff(timeline->phase_start[phase], timeline->end_time);
+}
+
+void diagnostic_timeline_finish(struct diagnostic_timeline *timeline,
+				bool success)
+{
+	char buf[256];
+	int pos = 0;
+	unsigned int i;
+
+	timeline->end_time = l_time_now();
+	timeline->success = success;
+
+	for (i = 0; i < __DIAGNOSTIC_PHASE_COUNT && pos < (int) sizeof(buf);
+			i++) {
+		if (!timeline->phase_start[i])
+			continue;
+
+		pos += snprintf(buf + pos, sizeof(buf) - pos, ", %s: %" PRIu64
+				" ms", diagnostic_phase_names[i],
+				l_time_to_msecs(diagnostic_phase_duration(
+							timeline, i)));
+	}
+
+	if (!pos)
+		buf[0] = '\0';
+
+	l_debug("%s to %s %s after %" PRIu64 " ms%s",
+			timeline->roam ? "Roam" : "Connection",
+			util_address_to_string(timeline->addr),
+			success ? "succeeded" : "failed",
+			l_time_to_msecs(l_time_diff(timeline->start_time,
+							timeline->end_time)),
+			buf);
+}
+
+/*
+ * Appends a finished timeline into a DBus dictionary, with the phase
+ * durations in milliseconds.  Like diagnostic_info_to_dict this expects the
+ * caller to enter and leave the dictionary array.
+ */
+void diagnostic_timeline_to_dict(const struct diagnostic_timeline *timeline,
+				struct l_dbus_message_builder *builder)
+{
+	uint32_t duration;
+	bool success = timeline->success;
+	unsigned int i;
+
+	dbus_append_dict_basic(builder, "Type", 's',
+				timeline->roam ? "roam" : "connect");
+	dbus_append_dict_basic(builder, "Address", 's',
+				util_address_to_string(timeline->addr));
+	dbus_append_dict_basic(builder, "Success", 'b', &success);
+	dbus_append_dict_basic(builder, "StartTime", 't', &timeline->wall_time);
+
+	if (timeline->roam) {
+		uint32_t candidates = timeline->candidates;
+
+		dbus_append_dict_basic(builder, "PreviousAddress", 's',
+				util_address_to_string(timeline->prev_addr));
+
+		if (timeline->reason)
+			dbus_append_dict_basic(builder, "Reason", 's',
+				diagnostic_roam_reason_names[timeline->reason]);
+
+		if (timeline->method)
+			dbus_append_dict_basic(builder, "Method", 's',
+				diagnostic_roam_method_names[timeline->method]);
+
+		dbus_append_dict_basic(builder, "Candidates", 'u',
+					&candidates);
+	}
+
+	duration = l_time_to_msecs(l_time_diff(timeline->start_time,
+							timeline->end_time));
+	dbus_append_dict_basic(builder, "Duration", 'u', &duration);
+
+	for (i = 0; i < __DIAGNOSTIC_PHASE_COUNT; i++) {
+		if (!timeline->phase_start[i])
+			continue;
+
+		duration = l_time_to_msecs(diagnostic_phase_duration(timeline,
+									i));
+		dbus_append_dict_basic(builder, diagnostic_phase_names[i], 'u',
+					&duration);
+	}
+}
+
 const char *diagnostic_akm_suite_to_security(enum ie_rsn_akm_suite akm,
 						bool wpa)
 {
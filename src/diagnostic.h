@@ -29,6 +29,23 @@ enum diagnostic_mcs_type {
 	DIAGNOSTIC_MCS_TYPE_HE,
 };
 
+/* Access categories, in the order of the WMM AC Parameter Records */
+enum diagnostic_ac {
+	DIAGNOSTIC_AC_BE,
+	DIAGNOSTIC_AC_BK,
+	DIAGNOSTIC_AC_VI,
+	DIAGNOSTIC_AC_VO,
+	__DIAGNOSTIC_AC_COUNT,
+};
+
+/* MSDU counters summed over the TIDs of each access category */
+struct diagnostic_ac_stats {
+	uint64_t tx_msdu;
+	uint64_t tx_msdu_retries;
+	uint64_t tx_msdu_failed;
+	uint64_t rx_msdu;
+};
+
 struct diagnostic_station_info {
 	uint8_t addr[6];
 	int8_t cur_rssi;
@@ -43,6 +60,17 @@ struct diagnostic_station_info {
 
 	uint32_t expected_throughput;
 
+	uint32_t inactive_time;		/* Milliseconds */
+	uint32_t connected_time;	/* Seconds */
+
+	uint32_t tx_retries;
+	uint32_t tx_failed;
+	uint64_t rx_drop_misc;
+	uint32_t beacon_loss;
+	uint64_t rx_duration;		/* Airtime in microseconds */
+	uint64_t tx_duration;
+	struct diagnostic_ac_stats ac_stats[__DIAGNOSTIC_AC_COUNT];
+
 	bool have_cur_rssi : 1;
 	bool have_avg_rssi : 1;
 	bool have_rx_mcs : 1;
@@ -50,10 +78,73 @@ struct diagnostic_station_info {
 	bool have_rx_bitrate : 1;
 	bool have_tx_bitrate : 1;
 	bool have_expected_throughput : 1;
+	bool have_inactive_time : 1;
+	bool have_connected_time : 1;
+	bool have_tx_retries : 1;
+	bool have_tx_failed : 1;
+	bool have_rx_drop_misc : 1;
+	bool have_beacon_loss : 1;
+	bool have_rx_duration : 1;
+	bool have_tx_duration : 1;
+	bool have_ac_stats : 1;
+};
+
+/* In the order the phases normally happen in */
+enum diagnostic_phase {
+	DIAGNOSTIC_PHASE_SCAN,
+	DIAGNOSTIC_PHASE_AUTHENTICATE,
+	DIAGNOSTIC_PHASE_ASSOCIATE,
+	DIAGNOSTIC_PHASE_EAP,
+	DIAGNOSTIC_PHASE_HANDSHAKE,
+	DIAGNOSTIC_PHASE_SETTING_KEYS,
+	DIAGNOSTIC_PHASE_IP_CONFIG,
+	__DIAGNOSTIC_PHASE_COUNT,
+};
+
+/* What made us roam */
+enum diagnostic_roam_reason {
+	DIAGNOSTIC_ROAM_REASON_NONE,
+	DIAGNOSTIC_ROAM_REASON_LOW_SIGNAL,
+	DIAGNOSTIC_ROAM_REASON_SIGNAL_TREND,
+	DIAGNOSTIC_ROAM_REASON_AP_DIRECTED,
+};
+
+enum diagnostic_roam_method {
+	DIAGNOSTIC_ROAM_METHOD_NONE,
+	DIAGNOSTIC_ROAM_METHOD_REASSOCIATION,
+	DIAGNOSTIC_ROAM_METHOD_PREAUTHENTICATION,
+	DIAGNOSTIC_ROAM_METHOD_FT_OVER_AIR,
+	DIAGNOSTIC_ROAM_METHOD_FT_OVER_DS,
+};
+
+struct diagnostic_timeline {
+	uint8_t addr[6];
+	/* Monotonic start time of each phase, zero if it didn't happen */
+	uint64_t phase_start[__DIAGNOSTIC_PHASE_COUNT];
+	uint64_t start_time;
+	uint64_t end_time;
+	/* Wall clock start time, for matching up with logs elsewhere */
+	uint64_t wall_time;
+	/* Roams only, the BSS we were leaving and what we knew about it */
+	uint8_t prev_addr[6];
+	enum diagnostic_roam_reason reason;
+	enum diagnostic_roam_method method;
+	uint16_t candidates;
+	bool roam : 1;
+	bool success : 1;
 };
 
 bool diagnostic_info_to_dict(const struct diagnostic_station_info *info,
 				struct l_dbus_message_builder *builder);
 
+struct diagnostic_timeline *diagnostic_timeline_new(const uint8_t *addr,
+							bool roam);
+void diagnostic_timeline_mark(struct diagnostic_timeline *timeline,
+				enum diagnostic_phase phase, uint64_t time);
+void diagnostic_timeline_finish(struct diagnostic_timeline *timeline,
+				bool success);
+void diagnostic_timeline_to_dict(const struct diagnostic_timeline *timeline,
+				struct l_dbus_message_builder *builder);
+
 const char *diagnostic_akm_suite_to_security(enum ie_rsn_akm_suite suite,
 						bool wpa);
@@ -27,6 +27,7 @@
 #include <ctype.h>
 #include <stdio.h>
 #include <errno.h>
+#include <alloca.h>
 #include <ell/ell.h>
 
 #include "src/missing.h"
@@ -68,9 +69,12 @@ enum eap_aka_state {
 struct eap_aka_handle {
 	enum eap_aka_state state;
 	enum eap_type type;
-	/* Identity from SIM */
+	/* Permanent identity from SIM */
 	char *identity;
 
+	/* Identity last sent to the server, used for key derivation */
+	char *eap_identity;
+
 	/* Derived master key */
 	uint8_t mk[EAP_SIM_MK_LEN];
 
@@ -107,6 +111,7 @@ struct eap_aka_handle {
 
 	struct iwd_sim_auth *auth;
 	unsigned int auth_watch;
+	int auth_request;
 };
 
 static void eap_aka_clear_secrets(struct eap_aka_handle *aka)
@@ -123,12 +128,16 @@ static void eap_aka_free(struct eap_state *eap)
 {
 	struct eap_aka_handle *aka = eap_get_data(eap);
 
+	if (aka->auth_request > 0)
+		sim_auth_cancel_request(aka->auth, aka->auth_request);
+
 	if (aka->auth)
 		sim_auth_unregistered_watch_remove(aka->auth, aka->auth_watch);
 
 	eap_aka_clear_secrets(aka);
 
 	l_free(aka->identity);
+	l_free(aka->eap_identity);
 	l_free(aka->kdf_in);
 	l_free(aka);
 
@@ -182,6 +191,28 @@ static void eap_aka_finish(struct eap_state *eap)
 					session_id, sizeof(session_id));
 }
 
+/*
+ * Keep the keys of a successful full authentication for fast
+ * re-authentication, along with the identities from AT_ENCR_DATA.
+ */
+static void eap_aka_save_identities(struct eap_aka_handle *aka)
+{
+	struct eap_sim_cache_entry *entry = eap_sim_cache_get(aka->identity);
+
+	eap_sim_cache_forget_reauth(entry);
+
+	memcpy(entry->mk, aka->mk, EAP_SIM_MK_LEN);
+	memcpy(entry->k_encr, aka->k_encr, EAP_SIM_K_ENCR_LEN);
+	memcpy(entry->k_aut, aka->k_aut, sizeof(aka->k_aut));
+	memcpy(entry->k_re, aka->k_re, EAP_AKA_K_RE_LEN);
+
+	if (!eap_sim_process_next_ids(entry, aka->chal_pkt, aka->pkt_len))
+		l_warn("could not process AT_ENCR_DATA");
+
+	if (!entry->reauth_id)
+		eap_sim_cache_forget_reauth(entry);
+}
+
 static void check_milenage_cb(const uint8_t *res, const uint8_t *ck,
 		const uint8_t *ik, const uint8_t *auts, void *data)
 {
@@ -192,6 +223,8 @@ static void check_milenage_cb(const uint8_t *res, const uint8_t *ck,
 	uint8_t response[resp_len + 4];
 	uint8_t *pos = response;
 
+	aka->auth_request = 0;
+
 	if (auts) {
 		/*
 		 * If AUTS is non NULL then the SQN was not correct, send AUTS
@@ -226,7 +259,7 @@ static void check_milenage_cb(const uint8_t *res, const uint8_t *ck,
 			goto chal_fatal;
 		}
 
-		r = eap_aka_prf_prime(ik_p, ck_p, aka->identity, aka->k_encr,
+		r = eap_aka_prf_prime(ik_p, ck_p, aka->eap_identity, aka->k_encr,
 				aka->k_aut, aka->k_re, aka->msk, aka->emsk);
 		explicit_bzero(ik_p, sizeof(ik_p));
 		explicit_bzero(ck_p, sizeof(ck_p));
@@ -239,7 +272,7 @@ static void check_milenage_cb(const uint8_t *res, const uint8_t *ck,
 		uint8_t prng_buf[160];
 		bool r;
 
-		if (!derive_aka_mk(aka->identity, ik, ck, aka->mk)) {
+		if (!derive_aka_mk(aka->eap_identity, ik, ck, aka->mk)) {
 			l_error("error deriving MK");
 			goto chal_fatal;
 		}
@@ -264,6 +297,8 @@ static void check_milenage_cb(const uint8_t *res, const uint8_t *ck,
 
 	aka->state = EAP_AKA_STATE_CHALLENGE;
 
+	eap_aka_save_identities(aka);
+
 	pos += eap_sim_build_header(eap, aka->type, EAP_AKA_ST_CHALLENGE,
 			pos, resp_len);
 	pos += eap_sim_add_attribute(pos, EAP_SIM_AT_RES,
@@ -320,12 +355,23 @@ static void handle_challenge(struct eap_state *eap, const uint8_t *pkt,
 	bool kdf_func = false;
 	uint16_t kdf_in_len = 0;
 
+	/* Retransmitted Challenge, the response follows once the SIM replies */
+	if (aka->auth_request) {
+		l_debug("Challenge already being processed");
+		return;
+	}
+
 	if (len < 3) {
 		l_error("packet is too small");
 		goto chal_error;
 	}
 
-	if (aka->state != EAP_AKA_STATE_IDENTITY) {
+	/*
+	 * The server may skip AKA-Identity if it recognized the identity,
+	 * e.g. a pseudonym, in the EAP-Response/Identity.
+	 */
+	if (aka->state != EAP_AKA_STATE_UNCONNECTED &&
+			aka->state != EAP_AKA_STATE_IDENTITY) {
 		l_error("invalid packet for EAP-AKA state");
 		goto chal_error;
 	}
@@ -451,8 +497,10 @@ static void handle_challenge(struct eap_state *eap, const uint8_t *pkt,
 	/* Keep RAND for session ID derivation */
 	memcpy(aka->rand, rand, EAP_SIM_RAND_LEN);
 
-	if (sim_auth_check_milenage(aka->auth, rand, autn, check_milenage_cb,
-			eap) < 0) {
+	aka->auth_request = sim_auth_check_milenage(aka->auth, rand, autn,
+							check_milenage_cb, eap);
+	if (aka->auth_request < 0) {
+		aka->auth_request = 0;
 		l_free(aka->chal_pkt);
 		aka->chal_pkt = NULL;
 		goto chal_error;
@@ -564,26 +612,115 @@ static void handle_identity(struct eap_state *eap, const uint8_t *pkt,
 		size_t len)
 {
 	struct eap_aka_handle *aka = eap_get_data(eap);
-	uint8_t response[8 + strlen(aka->identity) + 4];
-	uint8_t *pos = response;
+	struct eap_sim_tlv_iter iter;
+	struct eap_sim_cache_entry *entry;
+	bool permanent_id_req = false;
+	uint8_t *response;
+	uint8_t *pos;
 
 	if (aka->state != EAP_AKA_STATE_UNCONNECTED) {
 		l_error("invalid packet for EAP-AKA state");
-		eap_sim_client_error(eap, aka->type, EAP_SIM_ERROR_PROCESS);
-		return;
+		goto id_error;
+	}
+
+	if (len < 3) {
+		l_error("packet is too small");
+		goto id_error;
+	}
+
+	eap_sim_tlv_iter_init(&iter, pkt + 3, len - 3);
+
+	while (eap_sim_tlv_iter_next(&iter)) {
+		switch (eap_sim_tlv_iter_get_type(&iter)) {
+		case EAP_SIM_AT_PERMANENT_ID_REQ:
+			permanent_id_req = true;
+			break;
+
+		case EAP_SIM_AT_FULLAUTH_ID_REQ:
+		case EAP_SIM_AT_ANY_ID_REQ:
+			break;
+
+		default:
+			l_error("attribute %u was found in Identity",
+					eap_sim_tlv_iter_get_type(&iter));
+			goto id_error;
+		}
 	}
 
+	/*
+	 * AKA-Identity means a full authentication, so the fast
+	 * re-authentication identity we may have sent wasn't accepted.  A
+	 * request for the permanent identity also means that our pseudonym
+	 * is unknown.
+	 */
+	entry = eap_sim_cache_lookup(aka->identity);
+	if (entry) {
+		eap_sim_cache_forget_reauth(entry);
+
+		if (permanent_id_req)
+			eap_sim_cache_set_pseudonym(entry, NULL, 0);
+	}
+
+	l_free(aka->eap_identity);
+	aka->eap_identity = eap_sim_select_identity(aka->identity, false,
+							!permanent_id_req);
+
 	aka->state = EAP_AKA_STATE_IDENTITY;
 	/*
 	 * Build response packet
 	 */
+	response = alloca(8 + EAP_SIM_ROUND(strlen(aka->eap_identity) + 4));
+	pos = response;
+
 	pos += eap_sim_build_header(eap, aka->type, EAP_AKA_ST_IDENTITY, pos,
 			20);
 	pos += eap_sim_add_attribute(pos, EAP_SIM_AT_IDENTITY,
-			EAP_SIM_PAD_LENGTH, (uint8_t *)aka->identity,
-			strlen(aka->identity));
+			EAP_SIM_PAD_LENGTH, (uint8_t *)aka->eap_identity,
+			strlen(aka->eap_identity));
 
 	eap_method_respond(eap, response, pos - response);
+	return;
+
+id_error:
+	eap_sim_client_error(eap, aka->type, EAP_SIM_ERROR_PROCESS);
+}
+
+/*
+ * Handles Re-authentication subtype
+ */
+static void handle_reauthentication(struct eap_state *eap, const uint8_t *pkt,
+		size_t len)
+{
+	struct eap_aka_handle *aka = eap_get_data(eap);
+	struct eap_sim_cache_entry *entry = eap_sim_cache_lookup(aka->identity);
+	uint8_t session_id[EAP_SIM_REAUTH_SESSION_ID_LEN];
+	int r;
+
+	if (aka->state != EAP_AKA_STATE_UNCONNECTED || !entry ||
+			!entry->reauth_id ||
+			strcmp(entry->reauth_id, aka->eap_identity)) {
+		l_error("unexpected Re-authentication");
+		goto reauth_error;
+	}
+
+	r = eap_sim_handle_reauthentication(eap, aka->type, entry,
+					aka->eap_identity, pkt, len,
+					aka->msk, aka->emsk, session_id);
+	if (r == -EAGAIN)
+		return;
+
+	if (r < 0)
+		goto reauth_error;
+
+	eap_method_success(eap);
+	eap_set_key_material(eap, aka->msk, 32, aka->emsk, 32, NULL, 0,
+					session_id, sizeof(session_id));
+
+	aka->state = EAP_AKA_STATE_SUCCESS;
+	return;
+
+reauth_error:
+	eap_sim_client_error(eap, aka->type, EAP_SIM_ERROR_PROCESS);
 }
 
 static void eap_aka_handle_request(struct eap_state *eap,
@@ -609,6 +746,10 @@ static void eap_aka_handle_request(struct eap_state *eap,
 		handle_notification(eap, pkt, len);
 		break;
 
+	case EAP_SIM_ST_REAUTHENTICATION:
+		handle_reauthentication(eap, pkt, len);
+		break;
+
 	default:
 		l_error("unknown EAP-SIM subtype: %u", pkt[0]);
 		goto req_error;
@@ -624,7 +765,7 @@ static const char *eap_aka_get_identity(struct eap_state *eap)
 {
 	struct eap_aka_handle *aka = eap_get_data(eap);
 
-	return aka->identity;
+	return aka->eap_identity;
 }
 
 static void auth_destroyed(void *data)
@@ -632,6 +773,10 @@ static void auth_destroyed(void *data)
 	struct eap_state *eap = data;
 	struct eap_aka_handle *aka = eap_get_data(eap);
 
+	/* Any outstanding request has been dropped along with the provider */
+	aka->auth = NULL;
+	aka->auth_request = 0;
+
 	/*
 	 * If AKA was already successful we can return. Also if the state
 	 * has been set to ERROR, then eap_method_error has already been called,
@@ -695,6 +840,7 @@ static bool eap_aka_common_load_settings(struct eap_state *eap,
 			auth_destroyed, eap);
 	aka->identity = l_strdup_printf("%c%s", id_prefix,
 			iwd_sim_auth_get_nai(aka->auth));
+	aka->eap_identity = eap_sim_select_identity(aka->identity, true, true);
 
 	return true;
 }
@@ -774,6 +920,7 @@ static void eap_aka_exit(void)
 {
 	l_debug("");
 	eap_unregister_method(&eap_aka);
+	eap_sim_cache_flush();
 }
 
 static int eap_aka_prime_init(void)
@@ -786,6 +933,7 @@ static void eap_aka_prime_exit(void)
 {
 	l_debug("");
 	eap_unregister_method(&eap_aka_prime);
+	eap_sim_cache_flush();
 }
 
 EAP_METHOD_BUILTIN(eap_aka, eap_aka_init, eap_aka_exit);
@@ -665,6 +665,7 @@ static void eap_peap_exit(void)
 {
 	l_debug("");
 	eap_unregister_method(&eap_peap);
+	eap_tls_common_cache_flush();
 }
 
 EAP_METHOD_BUILTIN(eap_peap, eap_peap_init, eap_peap_exit)
@@ -44,6 +44,13 @@
 #define EAP_PWD_L_BIT		(1 << 7)
 #define EAP_PWD_M_BIT		(1 << 6)
 
+/*
+ * Hunting-and-pecking always runs all of its iterations, a few of them per
+ * main loop iteration while waiting for the server's commit
+ */
+#define EAP_PWD_PWE_ITERATIONS		20
+#define EAP_PWD_PWE_ASYNC_ITERATIONS	4
+
 enum eap_pwd_prep {
 	EAP_PWD_PREP_NONE =	0x00,
 	EAP_PWD_PREP_MS =	0x01,
@@ -77,6 +84,11 @@ struct eap_pwd_handle {
 	struct l_ecc_scalar *scalar_s;
 	struct l_ecc_scalar *scalar_p;
 	struct l_ecc_scalar *p_rand;
+	uint32_t token;
+	uint8_t *server_id;
+	size_t server_id_len;
+	uint8_t counter;
+	struct l_idle *pwe_idle;
 	uint8_t *rx_frag_buf;
 	uint16_t rx_frag_total;
 	uint16_t rx_frag_count;
@@ -150,6 +162,12 @@ static bool eap_pwd_reset_state(struct eap_state *eap)
 	pwd->prep = EAP_PWD_PREP_NONE;
 	pwd->ciphersuite = 0;
 
+	l_idle_remove(pwd->pwe_idle);
+	pwd->pwe_idle = NULL;
+	l_free(pwd->server_id);
+	pwd->server_id = NULL;
+	pwd->counter = 0;
+
 	l_ecc_point_free(pwd->pwe);
 	pwd->pwe = NULL;
 	l_ecc_point_free(pwd->element_p);
@@ -230,6 +248,79 @@ static void eap_pwd_send_response(struct eap_state *eap,
 	pwd->tx_frag_pos = pwd->tx_frag_buf;
 }
 
+/*
+ * Runs up to @iterations of the hunting-and-pecking loop, returns true once
+ * all of them have been completed.
+ */
+static bool eap_pwd_pwe_step(struct eap_pwd_handle *pwd,
+				unsigned int iterations)
+{
+	uint8_t pwd_seed[32];
+	uint8_t pwd_value[L_ECC_SCALAR_MAX_BYTES];	/* used as X value */
+	size_t nbytes = l_ecc_curve_get_scalar_bytes(pwd->curve);
+
+	for (; iterations && pwd->counter < EAP_PWD_PWE_ITERATIONS;
+			iterations--) {
+		struct l_ecc_point *pwe = NULL;
+
+		pwd->counter++;
+
+		/* pwd-seed = H(token|peer-ID|server-ID|password|counter) */
+		hkdf_extract(L_CHECKSUM_SHA256, NULL, 0, 5, pwd_seed,
+				&pwd->token, 4,
+				pwd->identity, strlen(pwd->identity),
+				pwd->server_id, pwd->server_id_len,
+				pwd->password, strlen(pwd->password),
+				&pwd->counter, (size_t) 1);
+
+		/*
+		 * pwd-value = KDF(pwd-seed, "EAP-pwd Hunting And Pecking",
+		 *                 len(p))
+		 */
+		kdf(pwd_seed, 32, "EAP-pwd Hunting And Pecking",
+				strlen("EAP-pwd Hunting And Pecking"),
+				pwd_value, nbytes);
+
+		if (!(pwd_seed[31] & 1))
+			pwe = l_ecc_point_from_data(pwd->curve,
+					L_ECC_POINT_TYPE_COMPRESSED_BIT1,
+					pwd_value, nbytes);
+		else
+			pwe = l_ecc_point_from_data(pwd->curve,
+					L_ECC_POINT_TYPE_COMPRESSED_BIT0,
+					pwd_value, nbytes);
+
+		if (!pwe)
+			continue;
+
+		if (!pwd->pwe)
+			pwd->pwe = pwe;
+		else
+			l_ecc_point_free(pwe);
+	}
+
+	explicit_bzero(pwd_seed, sizeof(pwd_seed));
+	explicit_bzero(pwd_value, sizeof(pwd_value));
+
+	return pwd->counter >= EAP_PWD_PWE_ITERATIONS;
+}
+
+static void eap_pwd_pwe_done(struct eap_pwd_handle *pwd)
+{
+	l_idle_remove(pwd->pwe_idle);
+	pwd->pwe_idle = NULL;
+	l_free(pwd->server_id);
+	pwd->server_id = NULL;
+}
+
+static void eap_pwd_pwe_async_step(struct l_idle *idle, void *user_data)
+{
+	struct eap_pwd_handle *pwd = user_data;
+
+	if (eap_pwd_pwe_step(pwd, EAP_PWD_PWE_ASYNC_ITERATIONS))
+		eap_pwd_pwe_done(pwd);
+}
+
 static void eap_pwd_handle_id(struct eap_state *eap,
 				const uint8_t *pkt, size_t len)
 {
@@ -237,14 +328,8 @@ static void eap_pwd_handle_id(struct eap_state *eap,
 	uint16_t group;
 	uint8_t rand_fn;
 	uint8_t prf;
-	uint32_t token;
-	uint8_t counter = 0;
 	uint8_t resp[15 + strlen(pwd->identity)];
 	uint8_t *pos;
-	uint8_t pwd_seed[32];
-	uint8_t pwd_value[L_ECC_SCALAR_MAX_BYTES];	/* used as X value */
-	size_t nbytes;
-	bool found = false;
 
 	/*
 	 * Group desc (2) + Random func (1) + prf (1) + token (4) + prep (1) +
@@ -288,7 +373,7 @@ static void eap_pwd_handle_id(struct eap_state *eap,
 	 * order, comprise the Ciphersuite...
 	 */
 	pwd->ciphersuite = l_get_u32(pkt);
-	token = l_get_u32(pkt + 4);
+	pwd->token = l_get_u32(pkt + 4);
 	pwd->prep = pkt[8];
 
 	if (pwd->prep != EAP_PWD_PREP_NONE) {
@@ -299,48 +384,13 @@ static void eap_pwd_handle_id(struct eap_state *eap,
 		goto error;
 	}
 
-	nbytes = l_ecc_curve_get_scalar_bytes(pwd->curve);
-
-	while (counter < 20) {
-		struct l_ecc_point *pwe = NULL;
-
-		counter++;
-
-		/* pwd-seed = H(token|peer-ID|server-ID|password|counter) */
-		hkdf_extract(L_CHECKSUM_SHA256, NULL, 0, 5, pwd_seed, &token, 4,
-				pwd->identity, strlen(pwd->identity), pkt + 9,
-				len - 9, pwd->password, strlen(pwd->password),
-				&counter, (size_t) 1);
-
-		/*
-		 * pwd-value = KDF(pwd-seed, "EAP-pwd Hunting And Pecking",
-		 *                 len(p))
-		 */
-		kdf(pwd_seed, 32, "EAP-pwd Hunting And Pecking",
-				strlen("EAP-pwd Hunting And Pecking"),
-				pwd_value, nbytes);
-
-		if (!(pwd_seed[31] & 1))
-			pwe = l_ecc_point_from_data(pwd->curve,
-					L_ECC_POINT_TYPE_COMPRESSED_BIT1,
-					pwd_value, nbytes);
-		else
-			pwe = l_ecc_point_from_data(pwd->curve,
-					L_ECC_POINT_TYPE_COMPRESSED_BIT0,
-					pwd_value, nbytes);
-
-		if (!pwe)
-			continue;
-
-		if (!found) {
-			found = true;
-			pwd->pwe = pwe;
-		} else
-			l_ecc_point_free(pwe);
-	}
-
-	explicit_bzero(pwd_seed, sizeof(pwd_seed));
-	explicit_bzero(pwd_value, sizeof(pwd_value));
+	/*
+	 * The PWE isn't needed until the server's commit arrives, derive it
+	 * in the background instead of holding up our ID response
+	 */
+	pwd->server_id_len = len - 9;
+	pwd->server_id = l_memdup(pkt + 9, pwd->server_id_len);
+	pwd->pwe_idle = l_idle_create(eap_pwd_pwe_async_step, pwd, NULL);
 
 	pos = resp + 5; /* header */
 	*pos++ = EAP_PWD_EXCH_ID;
@@ -348,7 +398,7 @@ static void eap_pwd_handle_id(struct eap_state *eap,
 	pos += 2;
 	*pos++ = rand_fn;
 	*pos++ = prf;
-	l_put_u32(token, pos);
+	l_put_u32(pwd->token, pos);
 	pos += 4;
 	*pos++ = pwd->prep;
 	memcpy(pos, pwd->identity, strlen(pwd->identity));
@@ -386,6 +436,17 @@ static void eap_pwd_handle_commit(struct eap_state *eap,
 
 	pwd->state = EAP_PWD_STATE_COMMIT;
 
+	/* Finish the PWE derivation if the commit came in before it did */
+	if (pwd->pwe_idle) {
+		eap_pwd_pwe_step(pwd, EAP_PWD_PWE_ITERATIONS);
+		eap_pwd_pwe_done(pwd);
+	}
+
+	if (!pwd->pwe) {
+		l_error("no valid PWE found");
+		goto error;
+	}
+
 	/*
 	 * Commit contains Element_S (nbytes * 2) then Scalar_s (nbytes)
 	 */
@@ -41,15 +41,12 @@
 /*
  * EAP-SIM authentication protocol.
  *
- * Open Items:
- *    - Fast Re-authentication. In order to implement this, the higher level
- *      EAP code would need to know/retrieve a fast re-authentication identity
- *      that it would send in the EAP-Start packet. This ID is provided by
- *      the server during the challenge in full authentication. EAP-SIM does
- *      save this ID, but there is no mechanism to provide it to the upper
- *      level EAP system. Once this is done the server will recognize the
- *      ID and send a SIM/Re-authentication request.
+ * Pseudonyms and fast re-authentication identities received in a full
+ * authentication are kept in the simutil identity cache.  The next
+ * EAP-Response/Identity uses them so that the server can skip the GSM
+ * challenge, which needs a round trip to the SIM.
  *
+ * Open Items:
  *    - Version validation. Perhaps a real SIM card will provide a version
  *      of EAP-SIM that it supports? Currently we accept any version the
  *      server provides.
@@ -83,9 +80,12 @@ enum eap_sim_state {
 
 struct eap_sim_handle {
 	enum eap_sim_state state;
-	/* Identity from SIM */
+	/* Permanent identity from SIM */
 	char *identity;
 
+	/* Identity last sent to the server, used for key derivation */
+	char *eap_identity;
+
 	/* EAP-SIM supported version list */
 	uint16_t *vlist;
 	uint16_t vlist_len;
@@ -117,6 +117,12 @@ struct eap_sim_handle {
 	/* Flag set if AT_ANY_ID_REQ was present */
 	bool any_id_req : 1;
 
+	/* Flag set if AT_FULLAUTH_ID_REQ was present */
+	bool fullauth_id_req : 1;
+
+	/* Flag set if AT_PERMANENT_ID_REQ was present */
+	bool permanent_id_req : 1;
+
 	/* Flag to indicate protected status indications */
 	bool protected : 1;
 
@@ -125,6 +131,7 @@ struct eap_sim_handle {
 
 	struct iwd_sim_auth *auth;
 	unsigned int auth_watch;
+	int auth_request;
 };
 
 static void eap_sim_clear_secrets(struct eap_sim_handle *sim)
@@ -140,12 +147,16 @@ static void eap_sim_free(struct eap_state *eap)
 {
 	struct eap_sim_handle *sim = eap_get_data(eap);
 
+	if (sim->auth_request > 0)
+		sim_auth_cancel_request(sim->auth, sim->auth_request);
+
 	if (sim->auth)
 		sim_auth_unregistered_watch_remove(sim->auth, sim->auth_watch);
 
 	eap_sim_clear_secrets(sim);
 
 	l_free(sim->identity);
+	l_free(sim->eap_identity);
 	l_free(sim->vlist);
 	l_free(sim);
 
@@ -202,9 +213,11 @@ static void handle_start(struct eap_state *eap, const uint8_t *pkt,
 {
 	struct eap_sim_handle *sim = eap_get_data(eap);
 	struct eap_sim_tlv_iter iter;
+	struct eap_sim_cache_entry *entry;
 	uint16_t resp_len;
 	uint8_t *response;
 	uint8_t *pos;
+	bool id_req;
 
 	if (len < 3) {
 		l_error("packet is too small");
@@ -249,11 +262,14 @@ static void handle_start(struct eap_state *eap, const uint8_t *pkt,
 
 			break;
 
-		case EAP_SIM_AT_PERMANENT_ID_REQ:
 		case EAP_SIM_AT_FULLAUTH_ID_REQ:
-			/*
-			 * TODO: Server requesting permanent ID/pseudonym
-			 */
+			sim->fullauth_id_req = true;
+
+			break;
+
+		case EAP_SIM_AT_PERMANENT_ID_REQ:
+			sim->permanent_id_req = true;
+
 			break;
 
 		default:
@@ -265,11 +281,32 @@ static void handle_start(struct eap_state *eap, const uint8_t *pkt,
 
 	sim->state = EAP_SIM_STATE_START;
 
+	/*
+	 * A Start means a full authentication, so the fast re-authentication
+	 * identity we may have sent wasn't accepted.  A request for the
+	 * permanent identity also means that our pseudonym is unknown.
+	 */
+	entry = eap_sim_cache_lookup(sim->identity);
+	if (entry) {
+		eap_sim_cache_forget_reauth(entry);
+
+		if (sim->permanent_id_req)
+			eap_sim_cache_set_pseudonym(entry, NULL, 0);
+	}
+
+	id_req = sim->any_id_req || sim->fullauth_id_req ||
+			sim->permanent_id_req;
+	if (id_req) {
+		l_free(sim->eap_identity);
+		sim->eap_identity = eap_sim_select_identity(sim->identity,
+						false, !sim->permanent_id_req);
+	}
+
 	/* header + AT_NONCE + AT_SELECTED_VERSION */
 	resp_len = (8) + (20) + (4);
-	if (sim->any_id_req) {
+	if (id_req) {
 		/* + AT_IDENTITY */
-		resp_len += EAP_SIM_ROUND(strlen(sim->identity) + 4);
+		resp_len += EAP_SIM_ROUND(strlen(sim->eap_identity) + 4);
 	}
 
 	l_getrandom(sim->nonce, EAP_SIM_NONCE_LEN);
@@ -285,10 +322,10 @@ static void handle_start(struct eap_state *eap, const uint8_t *pkt,
 			EAP_SIM_PAD_NONE, (uint8_t *)&sim->selected_version,
 			2);
 
-	if (sim->any_id_req)
+	if (id_req)
 		pos += eap_sim_add_attribute(pos, EAP_SIM_AT_IDENTITY,
-				EAP_SIM_PAD_LENGTH, (uint8_t *)sim->identity,
-				strlen(sim->identity));
+				EAP_SIM_PAD_LENGTH, (uint8_t *)sim->eap_identity,
+				strlen(sim->eap_identity));
 
 	eap_method_respond(eap, response, resp_len);
 
@@ -314,6 +351,27 @@ static void eap_sim_finish(struct eap_state *eap)
 					session_id, sizeof(session_id));
 }
 
+/*
+ * Keep the keys of a successful full authentication for fast
+ * re-authentication, along with the identities from AT_ENCR_DATA.
+ */
+static void eap_sim_save_identities(struct eap_sim_handle *sim)
+{
+	struct eap_sim_cache_entry *entry = eap_sim_cache_get(sim->identity);
+
+	eap_sim_cache_forget_reauth(entry);
+
+	memcpy(entry->mk, sim->mk, EAP_SIM_MK_LEN);
+	memcpy(entry->k_encr, sim->k_encr, EAP_SIM_K_ENCR_LEN);
+	memcpy(entry->k_aut, sim->k_aut, EAP_SIM_K_AUT_LEN);
+
+	if (!eap_sim_process_next_ids(entry, sim->chal_pkt, sim->pkt_len))
+		l_warn("could not process AT_ENCR_DATA");
+
+	if (!entry->reauth_id)
+		eap_sim_cache_forget_reauth(entry);
+}
+
 static void gsm_callback(const uint8_t *sres, const uint8_t *kc,
 		void *user_data)
 {
@@ -326,13 +384,15 @@ static void gsm_callback(const uint8_t *sres, const uint8_t *kc,
 	uint8_t *mac_pos;
 	bool r;
 
+	sim->auth_request = 0;
+
 	if (!sres || !kc)
 		goto chal_error;
 
 	if (sim->protected)
 		resp_len += 4;
 
-	if (!derive_master_key(sim->identity, kc, sim->nonce, sim->vlist,
+	if (!derive_master_key(sim->eap_identity, kc, sim->nonce, sim->vlist,
 			sim->vlist_len, sim->selected_version, sim->mk)) {
 		l_error("error deriving master key");
 		goto chal_fatal;
@@ -358,12 +418,7 @@ static void gsm_callback(const uint8_t *sres, const uint8_t *kc,
 
 	sim->state = EAP_SIM_STATE_CHALLENGE;
 
-	/*
-	 * TODO: When/If fast re-authentication is supported, the AT_ENCR_DATA
-	 *       attribute would be decrypted here. Currently there is no need
-	 *       or reason to do this without support for fast
-	 *       re-authentication.
-	 */
+	eap_sim_save_identities(sim);
 
 	/* build response packet */
 	pos += eap_sim_build_header(eap, EAP_TYPE_SIM, EAP_SIM_ST_CHALLENGE,
@@ -428,6 +483,12 @@ static void handle_challenge(struct eap_state *eap, const uint8_t *pkt,
 	struct eap_sim_tlv_iter iter;
 	enum eap_sim_error code = EAP_SIM_ERROR_PROCESS;
 
+	/* Retransmitted Challenge, the response follows once the SIM replies */
+	if (sim->auth_request) {
+		l_debug("Challenge already being processed");
+		return;
+	}
+
 	if (sim->state != EAP_SIM_STATE_START) {
 		l_error("invalid packet for EAP-SIM state");
 		goto chal_error;
@@ -453,9 +514,8 @@ static void handle_challenge(struct eap_state *eap, const uint8_t *pkt,
 				goto chal_error;
 			}
 			/*
-			 * TODO: check that RAND's are fresh. Existing RAND's
-			 * should only exist if we are re-authenticating to the
-			 * server, which is currently not implemented.
+			 * TODO: check that RAND's are fresh, i.e. differ from
+			 * the ones used in the previous full authentication.
 			 */
 			memcpy(sim->rands, contents + 2, EAP_SIM_RAND_LEN * 3);
 			break;
@@ -480,7 +540,10 @@ static void handle_challenge(struct eap_state *eap, const uint8_t *pkt,
 	sim->chal_pkt = l_memdup(pkt, len);
 	sim->pkt_len = len;
 
-	if (sim_auth_run_gsm(sim->auth, sim->rands, 3, gsm_callback, eap) < 0) {
+	sim->auth_request = sim_auth_run_gsm(sim->auth, sim->rands, 3,
+						gsm_callback, eap);
+	if (sim->auth_request < 0) {
+		sim->auth_request = 0;
 		l_free(sim->chal_pkt);
 		sim->chal_pkt = NULL;
 		goto chal_error;
@@ -492,6 +555,44 @@ chal_error:
 	eap_sim_client_error(eap, EAP_TYPE_SIM, code);
 }
 
+/*
+ * Handles EAP-SIM Re-authentication subtype
+ */
+static void handle_reauthentication(struct eap_state *eap, const uint8_t *pkt,
+		size_t len)
+{
+	struct eap_sim_handle *sim = eap_get_data(eap);
+	struct eap_sim_cache_entry *entry = eap_sim_cache_lookup(sim->identity);
+	uint8_t session_id[EAP_SIM_REAUTH_SESSION_ID_LEN];
+	int r;
+
+	if (sim->state != EAP_SIM_STATE_UNCONNECTED || !entry ||
+			!entry->reauth_id ||
+			strcmp(entry->reauth_id, sim->eap_identity)) {
+		l_error("unexpected Re-authentication");
+		goto reauth_error;
+	}
+
+	r = eap_sim_handle_reauthentication(eap, EAP_TYPE_SIM, entry,
+					sim->eap_identity, pkt, len,
+					sim->msk, sim->emsk, session_id);
+	if (r == -EAGAIN)
+		return;
+
+	if (r < 0)
+		goto reauth_error;
+
+	eap_method_success(eap);
+	eap_set_key_material(eap, sim->msk, 32, sim->emsk, 32, NULL, 0,
+					session_id, sizeof(session_id));
+
+	sim->state = EAP_SIM_STATE_SUCCESS;
+	return;
+
+reauth_error:
+	eap_sim_client_error(eap, EAP_TYPE_SIM, EAP_SIM_ERROR_PROCESS);
+}
+
 /*
  * Handles EAP-SIM Notification subtype
  */
@@ -606,6 +707,9 @@ static void eap_sim_handle_request(struct eap_state *eap,
 	case EAP_SIM_ST_NOTIFICATION:
 		handle_notification(eap, pkt, len);
 		break;
+	case EAP_SIM_ST_REAUTHENTICATION:
+		handle_reauthentication(eap, pkt, len);
+		break;
 	default:
 		l_error("unknown EAP-SIM subtype: %u", pkt[0]);
 		goto req_error;
@@ -621,7 +725,7 @@ static const char *eap_sim_get_identity(struct eap_state *eap)
 {
 	struct eap_sim_handle *sim = eap_get_data(eap);
 
-	return sim->identity;
+	return sim->eap_identity;
 }
 
 static void auth_destroyed(void *data)
@@ -629,6 +733,10 @@ static void auth_destroyed(void *data)
 	struct eap_state *eap = data;
 	struct eap_sim_handle *sim = eap_get_data(eap);
 
+	/* Any outstanding request has been dropped along with the provider */
+	sim->auth = NULL;
+	sim->auth_request = 0;
+
 	/*
 	 * If AKA was already successful we can return. Also if the state
 	 * has been set to ERROR, then eap_method_error has already been called,
@@ -670,6 +778,9 @@ static bool eap_sim_reset_state(struct eap_state *eap)
 	struct eap_sim_handle *sim = eap_get_data(eap);
 
 	sim->state = EAP_SIM_STATE_UNCONNECTED;
+	sim->any_id_req = false;
+	sim->fullauth_id_req = false;
+	sim->permanent_id_req = false;
 
 	l_free(sim->vlist);
 	sim->vlist = NULL;
@@ -707,6 +818,7 @@ static bool eap_sim_load_settings(struct eap_state *eap,
 	 */
 	sim->identity = l_strdup_printf("%c%s", '1',
 			iwd_sim_auth_get_nai(sim->auth));
+	sim->eap_identity = eap_sim_select_identity(sim->identity, true, true);
 
 	return true;
 }
@@ -733,6 +845,7 @@ static void eap_sim_exit(void)
 {
 	l_debug("");
 	eap_unregister_method(&eap_sim);
+	eap_sim_cache_flush();
 }
 
 EAP_METHOD_BUILTIN(eap_sim, eap_sim_init, eap_sim_exit)
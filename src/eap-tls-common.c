@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <sys/stat.h>
 #include <ell/ell.h>
 
 #include "src/missing.h"
@@ -33,13 +34,57 @@
 #include "src/eap-private.h"
 #include "src/eap-tls-common.h"
 
+/* RFC 5246, Appendix F.1.4: "An upper limit of 24 hours is suggested" */
+#define EAP_TLS_SESSION_LIFETIME (24 * 3600)
+
+static struct l_settings *eap_tls_session_cache;
+static eap_tls_session_cache_load_func_t eap_tls_session_cache_load;
+static eap_tls_session_cache_sync_func_t eap_tls_session_cache_sync;
+
+/*
+ * Parsed certificate files shared by all the TLS-based methods and network
+ * profiles.  Every user gets its own copy of the certificates, which is a
+ * memcpy, so that the files are only read and decoded again once they
+ * change on disk.  Entries still referenced by an ongoing authentication
+ * are never evicted, up to CERT_CACHE_MAX_IDLE unreferenced ones are kept
+ * for reconnections.
+ */
+#define CERT_CACHE_MAX_IDLE 8
+
+enum cert_cache_type {
+	CERT_CACHE_CA_LIST,
+	CERT_CACHE_CERTCHAIN,
+};
+
+struct cert_cache_entry {
+	char *path;
+	enum cert_cache_type type;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	union {
+		struct l_queue *ca_certs;
+		struct l_certchain *certchain;
+	};
+	unsigned int ref_count;
+};
+
+static struct l_queue *cert_cache;
+
+/*
+ * Buffers may reserve headroom in front of the data, where a packet header
+ * can be written so that the data does not have to be copied to be sent.
+ */
 struct databuf {
 	uint8_t *data;
 	size_t len;
 	size_t capacity;
+	size_t headroom;
 };
 
-static struct databuf *databuf_new(size_t capacity)
+static struct databuf *databuf_new_with_headroom(size_t capacity,
+							size_t headroom)
 {
 	struct databuf *databuf;
 
@@ -47,12 +92,18 @@ static struct databuf *databuf_new(size_t capacity)
 		return NULL;
 
 	databuf = l_new(struct databuf, 1);
-	databuf->data = l_malloc(capacity);
+	databuf->data = (uint8_t *) l_malloc(headroom + capacity) + headroom;
 	databuf->capacity = capacity;
+	databuf->headroom = headroom;
 
 	return databuf;
 }
 
+static struct databuf *databuf_new(size_t capacity)
+{
+	return databuf_new_with_headroom(capacity, 0);
+}
+
 static void databuf_append(struct databuf *databuf, const uint8_t *data,
 								size_t data_len)
 {
@@ -65,7 +116,11 @@ static void databuf_append(struct databuf *databuf, const uint8_t *data,
 
 	if (new_len > databuf->capacity) {
 		databuf->capacity = new_len * 2;
-		databuf->data = l_realloc(databuf->data, databuf->capacity);
+		databuf->data = (uint8_t *) l_realloc(databuf->data -
+							databuf->headroom,
+							databuf->headroom +
+							databuf->capacity) +
+							databuf->headroom;
 	}
 
 	memcpy(databuf->data + databuf->len, data, data_len);
@@ -78,7 +133,7 @@ static void databuf_free(struct databuf *databuf)
 	if (!databuf)
 		return;
 
-	l_free(databuf->data);
+	l_free(databuf->data - databuf->headroom);
 	l_free(databuf);
 }
 
@@ -89,6 +144,9 @@ static void databuf_free(struct databuf *databuf)
 #define EAP_TLS_HEADER_OCTET_FLAGS 5
 #define EAP_TLS_HEADER_OCTET_FRAG_LEN 6
 
+/* EAP-TLS header with the expanded type fields and the TLS Message Length */
+#define EAP_TLS_TX_HEADROOM (EAP_TLS_HEADER_LEN + 7 + 4)
+
 enum eap_tls_flag {
 	/* Reserved    = 0x00, */
 	EAP_TLS_FLAG_S    = 0x20,
@@ -113,11 +171,14 @@ struct eap_tls_state {
 
 	bool expecting_frag_ack:1;
 	bool tunnel_ready:1;
+	bool in_tunnel_ready:1;
 
+	struct cert_cache_entry *ca_cert_entry;
 	struct l_queue *ca_cert;
 	struct l_certchain *client_cert;
 	struct l_key *client_key;
 	char **domain_mask;
+	char *session_group;
 
 	const struct eap_tls_variant_ops *variant_ops;
 	void *variant_data;
@@ -155,8 +216,163 @@ static void __eap_tls_common_state_reset(struct eap_tls_state *eap_tls)
 	}
 }
 
+static void cert_cache_entry_free(struct cert_cache_entry *entry)
+{
+	if (entry->type == CERT_CACHE_CA_LIST)
+		l_queue_destroy(entry->ca_certs,
+				(l_queue_destroy_func_t) l_cert_free);
+	else
+		l_certchain_free(entry->certchain);
+
+	l_free(entry->path);
+	l_free(entry);
+}
+
+static void cert_cache_trim(void)
+{
+	const struct l_queue_entry *e;
+	unsigned int idle = 0;
+
+	for (e = l_queue_get_entries(cert_cache); e; e = e->next) {
+		const struct cert_cache_entry *entry = e->data;
+
+		if (!entry->ref_count)
+			idle++;
+	}
+
+	/* The queue is kept in LRU order, oldest first */
+	while (idle > CERT_CACHE_MAX_IDLE) {
+		for (e = l_queue_get_entries(cert_cache); e; e = e->next) {
+			struct cert_cache_entry *entry = e->data;
+
+			if (entry->ref_count)
+				continue;
+
+			l_queue_remove(cert_cache, entry);
+			cert_cache_entry_free(entry);
+			idle--;
+			break;
+		}
+	}
+}
+
+static bool cert_cache_match_ptr(const void *a, const void *b)
+{
+	return a == b;
+}
+
+static void cert_cache_entry_unref(struct cert_cache_entry *entry)
+{
+	if (!entry || --entry->ref_count)
+		return;
+
+	/* Replaced by a newer version of the file while in use */
+	if (!l_queue_find(cert_cache, cert_cache_match_ptr, entry)) {
+		cert_cache_entry_free(entry);
+		return;
+	}
+
+	cert_cache_trim();
+}
+
+static bool cert_cache_entry_matches(const struct cert_cache_entry *entry,
+					const struct stat *st)
+{
+	return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+		entry->size == st->st_size &&
+		entry->mtime.tv_sec == st->st_mtim.tv_sec &&
+		entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Returns a new reference to a valid entry for @path */
+static struct cert_cache_entry *cert_cache_find(const char *path,
+						enum cert_cache_type type,
+						const struct stat *st)
+{
+	const struct l_queue_entry *e;
+
+	for (e = l_queue_get_entries(cert_cache); e; e = e->next) {
+		struct cert_cache_entry *entry = e->data;
+
+		if (entry->type != type || strcmp(entry->path, path))
+			continue;
+
+		l_queue_remove(cert_cache, entry);
+
+		if (!cert_cache_entry_matches(entry, st)) {
+			if (!entry->ref_count)
+				cert_cache_entry_free(entry);
+
+			return NULL;
+		}
+
+		l_queue_push_tail(cert_cache, entry);
+		entry->ref_count++;
+		return entry;
+	}
+
+	return NULL;
+}
+
+/* Takes ownership of @data, returns a new reference */
+static struct cert_cache_entry *cert_cache_add(const char *path,
+						enum cert_cache_type type,
+						const struct stat *st,
+						void *data)
+{
+	struct cert_cache_entry *entry = l_new(struct cert_cache_entry, 1);
+
+	entry->path = l_strdup(path);
+	entry->type = type;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtim;
+
+	if (type == CERT_CACHE_CA_LIST)
+		entry->ca_certs = data;
+	else
+		entry->certchain = data;
+
+	entry->ref_count = 1;
+
+	if (!cert_cache)
+		cert_cache = l_queue_new();
+
+	l_queue_push_tail(cert_cache, entry);
+	cert_cache_trim();
+
+	return entry;
+}
+
+static struct l_queue *cert_list_clone(struct l_queue *certs)
+{
+	struct l_queue *copy = l_queue_new();
+	const struct l_queue_entry *e;
+
+	for (e = l_queue_get_entries(certs); e; e = e->next)
+		l_queue_push_tail(copy, l_cert_clone(e->data));
+
+	return copy;
+}
+
+void eap_tls_common_cache_flush(void)
+{
+	struct cert_cache_entry *entry;
+
+	/* Entries still in use are freed by their last user */
+	while ((entry = l_queue_pop_head(cert_cache)))
+		if (!entry->ref_count)
+			cert_cache_entry_free(entry);
+
+	l_queue_destroy(cert_cache, NULL);
+	cert_cache = NULL;
+}
+
 static void __eap_tls_common_state_free(struct eap_tls_state *eap_tls)
 {
+	cert_cache_entry_unref(eap_tls->ca_cert_entry);
+
 	if (eap_tls->ca_cert)
 		l_queue_destroy(eap_tls->ca_cert,
 					(l_queue_destroy_func_t)l_cert_free);
@@ -167,6 +383,7 @@ static void __eap_tls_common_state_free(struct eap_tls_state *eap_tls)
 		l_key_free(eap_tls->client_key);
 
 	l_strv_free(eap_tls->domain_mask);
+	l_free(eap_tls->session_group);
 	l_free(eap_tls);
 }
 
@@ -210,7 +427,8 @@ static void eap_tls_tunnel_data_send(const uint8_t *data, size_t data_len,
 	struct eap_tls_state *eap_tls = eap_get_data(eap);
 
 	if (!eap_tls->tx_pdu_buf)
-		eap_tls->tx_pdu_buf = databuf_new(data_len);
+		eap_tls->tx_pdu_buf = databuf_new_with_headroom(data_len,
+							EAP_TLS_TX_HEADROOM);
 
 	databuf_append(eap_tls->tx_pdu_buf, data, data_len);
 }
@@ -251,8 +469,12 @@ static void eap_tls_tunnel_ready(const char *peer_identity, void *user_data)
 	if (!eap_tls->variant_ops->tunnel_ready)
 		return;
 
+	eap_tls->in_tunnel_ready = true;
+
 	if (!eap_tls->variant_ops->tunnel_ready(eap, peer_identity))
 		l_tls_close(eap_tls->tunnel);
+
+	eap_tls->in_tunnel_ready = false;
 }
 
 static void eap_tls_debug_hint(void)
@@ -302,36 +524,42 @@ static bool eap_tls_validate_version(struct eap_state *eap,
 static void eap_tls_send_fragment(struct eap_state *eap)
 {
 	struct eap_tls_state *eap_tls = eap_get_data(eap);
+	struct databuf *pdu = eap_tls->tx_pdu_buf;
 	size_t mtu = eap_get_mtu(eap);
-	uint8_t buf[mtu];
-	size_t len = eap_tls->tx_pdu_buf->len - eap_tls->tx_frag_offset;
+	size_t len = pdu->len - eap_tls->tx_frag_offset;
 	size_t header_len = EAP_TLS_HEADER_LEN;
+	uint8_t flags = eap_tls->version_negotiated;
 	uint8_t position = 0;
+	uint8_t *buf;
 
 	if (eap_get_method_type(eap) == EAP_TYPE_EXPANDED) {
 		header_len += 7;
 		position += 7;
 	}
 
-	buf[EAP_TLS_HEADER_OCTET_FLAGS + position] =
-						eap_tls->version_negotiated;
+	if (!eap_tls->tx_frag_offset) {
+		flags |= EAP_TLS_FLAG_L;
+		header_len += 4;
+	}
 
-	if (len > mtu - EAP_TLS_HEADER_LEN - position) {
-		len = mtu - EAP_TLS_HEADER_LEN - position;
-		buf[EAP_TLS_HEADER_OCTET_FLAGS + position] |= EAP_TLS_FLAG_M;
+	if (len > mtu - header_len) {
+		len = mtu - header_len;
+		flags |= EAP_TLS_FLAG_M;
 		eap_tls->expecting_frag_ack = true;
 	}
 
-	if (!eap_tls->tx_frag_offset) {
-		buf[EAP_TLS_HEADER_OCTET_FLAGS + position] |= EAP_TLS_FLAG_L;
-		l_put_be32(eap_tls->tx_pdu_buf->len,
+	/*
+	 * The header is written right in front of the fragment's data, into
+	 * the headroom for the first fragment and over the end of the
+	 * previous, already acknowledged, fragment for the following ones.
+	 */
+	buf = pdu->data + eap_tls->tx_frag_offset - header_len;
+	buf[EAP_TLS_HEADER_OCTET_FLAGS + position] = flags;
+
+	if (flags & EAP_TLS_FLAG_L)
+		l_put_be32(pdu->len,
 				&buf[EAP_TLS_HEADER_OCTET_FRAG_LEN + position]);
-		len -= 4;
-		header_len += 4;
-	}
 
-	memcpy(buf + header_len,
-		eap_tls->tx_pdu_buf->data + eap_tls->tx_frag_offset, len);
 	eap_method_respond(eap, buf, header_len + len);
 
 	eap_tls->tx_frag_last_len = len;
@@ -355,47 +583,39 @@ static bool needs_workaround(struct eap_state *eap)
 			!eap_tls->tunnel_ready;
 }
 
-static void eap_tls_send_response(struct eap_state *eap,
-					const uint8_t *pdu, size_t pdu_len)
+static void eap_tls_send_response(struct eap_state *eap)
 {
 	struct eap_tls_state *eap_tls = eap_get_data(eap);
-	size_t msg_len = EAP_TLS_HEADER_LEN + pdu_len;
+	struct databuf *pdu = eap_tls->tx_pdu_buf;
+	size_t header_len = EAP_TLS_HEADER_LEN;
 	bool set_tls_msg_len = needs_workaround(eap);
+	uint8_t position = 0;
+	uint8_t *buf;
 
-	msg_len += set_tls_msg_len ? 4 : 0;
-
-	if (msg_len <= eap_get_mtu(eap)) {
-		uint8_t *buf;
-		uint8_t extra = 0;
+	header_len += set_tls_msg_len ? 4 : 0;
 
-		if (eap_get_method_type(eap) == EAP_TYPE_EXPANDED) {
-			extra += 7;
-			msg_len += 7;
-		}
+	if (header_len + pdu->len > eap_get_mtu(eap)) {
+		eap_tls->tx_frag_offset = 0;
+		eap_tls_send_fragment(eap);
+		return;
+	}
 
-		buf = l_malloc(msg_len);
+	if (eap_get_method_type(eap) == EAP_TYPE_EXPANDED) {
+		header_len += 7;
+		position += 7;
+	}
 
-		buf[EAP_TLS_HEADER_OCTET_FLAGS + extra] =
+	buf = pdu->data - header_len;
+	buf[EAP_TLS_HEADER_OCTET_FLAGS + position] =
 						eap_tls->version_negotiated;
 
-		if (set_tls_msg_len) {
-			buf[extra + EAP_TLS_HEADER_OCTET_FLAGS] |=
-								EAP_TLS_FLAG_L;
-			l_put_be32(pdu_len,
-				   &buf[extra + EAP_TLS_HEADER_OCTET_FRAG_LEN]);
-
-			extra += 4;
-		}
-
-		memcpy(buf + EAP_TLS_HEADER_LEN + extra, pdu, pdu_len);
-
-		eap_method_respond(eap, buf, msg_len);
-		l_free(buf);
-		return;
+	if (set_tls_msg_len) {
+		buf[EAP_TLS_HEADER_OCTET_FLAGS + position] |= EAP_TLS_FLAG_L;
+		l_put_be32(pdu->len,
+				&buf[EAP_TLS_HEADER_OCTET_FRAG_LEN + position]);
 	}
 
-	eap_tls->tx_frag_offset = 0;
-	eap_tls_send_fragment(eap);
+	eap_method_respond(eap, buf, header_len + pdu->len);
 }
 
 void eap_tls_common_send_empty_response(struct eap_state *eap)
@@ -404,6 +624,14 @@ void eap_tls_common_send_empty_response(struct eap_state *eap)
 	uint8_t buf[EAP_TLS_HEADER_LEN + 7];
 	uint8_t position = 0;
 
+	/*
+	 * In an abbreviated handshake our ChangeCipherSpec and Finished are
+	 * still to be sent when the tunnel comes up and they already serve
+	 * as the acknowledgement.
+	 */
+	if (eap_tls->in_tunnel_ready && eap_tls->tx_pdu_buf)
+		return;
+
 	if (eap_get_method_type(eap) == EAP_TYPE_EXPANDED)
 		position += 7;
 
@@ -564,6 +792,11 @@ static int eap_tls_handle_fragmented_request(struct eap_state *eap,
 	return r;
 }
 
+static void eap_tls_session_cache_update(void *user_data)
+{
+	eap_tls_session_cache_sync(eap_tls_session_cache);
+}
+
 static bool eap_tls_tunnel_init(struct eap_state *eap)
 {
 	struct eap_tls_state *eap_tls = eap_get_data(eap);
@@ -626,6 +859,19 @@ static bool eap_tls_tunnel_init(struct eap_state *eap)
 	if (eap_tls->domain_mask)
 		l_tls_set_domain_mask(eap_tls->tunnel, eap_tls->domain_mask);
 
+	if (eap_tls->session_group && eap_tls_session_cache_sync) {
+		if (!eap_tls_session_cache && eap_tls_session_cache_load)
+			eap_tls_session_cache = eap_tls_session_cache_load();
+
+		if (!eap_tls_session_cache)
+			eap_tls_session_cache = l_settings_new();
+
+		l_tls_set_session_cache(eap_tls->tunnel, eap_tls_session_cache,
+					eap_tls->session_group,
+					EAP_TLS_SESSION_LIFETIME,
+					eap_tls_session_cache_update, NULL);
+	}
+
 	if (!l_tls_start(eap_tls->tunnel)) {
 		l_error("%s: Failed to start the TLS client",
 						eap_get_method_name(eap));
@@ -765,8 +1011,7 @@ proceed:
 		return;
 	}
 
-	eap_tls_send_response(eap, eap_tls->tx_pdu_buf->data,
-						eap_tls->tx_pdu_buf->len);
+	eap_tls_send_response(eap);
 
 	if (eap_tls->phase2_failed)
 		goto error;
@@ -813,8 +1058,7 @@ void eap_tls_common_handle_retransmit(struct eap_state *eap,
 	if (EAP_TLS_HEADER_LEN + eap_tls->tx_pdu_buf->len > eap_get_mtu(eap))
 		eap_tls_send_fragment(eap);
 	else
-		eap_tls_send_response(eap, eap_tls->tx_pdu_buf->data,
-						eap_tls->tx_pdu_buf->len);
+		eap_tls_send_response(eap);
 
 	return;
 
@@ -853,12 +1097,38 @@ static bool is_embedded(const char *str)
 }
 
 static struct l_queue *eap_tls_load_ca_cert(struct l_settings *settings,
-						const char *value)
+					const char *value,
+					struct cert_cache_entry **out_entry)
 {
 	const char *pem;
 
-	if (!is_embedded(value))
-		return l_pem_load_certificate_list(value);
+	if (!is_embedded(value)) {
+		struct cert_cache_entry *entry;
+		struct l_queue *ca_certs;
+		struct stat st;
+
+		if (stat(value, &st) < 0)
+			return NULL;
+
+		entry = cert_cache_find(value, CERT_CACHE_CA_LIST, &st);
+		if (!entry) {
+			ca_certs = l_pem_load_certificate_list(value);
+			if (!ca_certs)
+				return NULL;
+
+			entry = cert_cache_add(value, CERT_CACHE_CA_LIST, &st,
+						ca_certs);
+		}
+
+		ca_certs = cert_list_clone(entry->ca_certs);
+
+		if (out_entry)
+			*out_entry = entry;
+		else
+			cert_cache_entry_unref(entry);
+
+		return ca_certs;
+	}
 
 	pem = load_embedded_pem(settings, value);
 	if (!pem)
@@ -875,17 +1145,44 @@ struct l_certchain *eap_tls_load_client_cert(struct l_settings *settings,
 	const char *pem;
 
 	if (!is_embedded(value)) {
+		struct cert_cache_entry *entry;
 		struct l_certchain *certchain;
+		bool is_encrypted;
+		struct stat st;
 
-		if (l_cert_load_container_file(value, passphrase,
-						&certchain, NULL,
-						out_is_encrypted))
+		if (out_is_encrypted)
+			*out_is_encrypted = false;
+
+		if (stat(value, &st) < 0)
+			return NULL;
+
+		entry = cert_cache_find(value, CERT_CACHE_CERTCHAIN, &st);
+		if (entry) {
+			certchain = l_certchain_clone(entry->certchain);
+			cert_cache_entry_unref(entry);
 			return certchain;
+		}
+
+		if (!l_cert_load_container_file(value, passphrase,
+						&certchain, NULL,
+						&is_encrypted))
+			return NULL;
 
 		if (out_is_encrypted)
-			*out_is_encrypted = false;
+			*out_is_encrypted = is_encrypted;
 
-		return NULL;
+		/*
+		 * Only cache certificates that can be read without the
+		 * passphrase so that a cache hit never skips its check.
+		 */
+		if (!is_encrypted && certchain) {
+			entry = cert_cache_add(value, CERT_CACHE_CERTCHAIN,
+						&st,
+						l_certchain_clone(certchain));
+			cert_cache_entry_unref(entry);
+		}
+
+		return certchain;
 	}
 
 	pem = load_embedded_pem(settings, value);
@@ -936,7 +1233,8 @@ int eap_tls_common_settings_check(struct l_settings *settings,
 	snprintf(setting_key, sizeof(setting_key), "%sCACert", prefix);
 	value = l_settings_get_string(settings, "Security", setting_key);
 	if (value) {
-		struct l_queue *cacerts = eap_tls_load_ca_cert(settings, value);
+		struct l_queue *cacerts = eap_tls_load_ca_cert(settings, value,
+								NULL);
 
 		if (!cacerts) {
 			l_error("Failed to load %s", value);
@@ -966,6 +1264,52 @@ int eap_tls_common_settings_check(struct l_settings *settings,
 	return 0;
 }
 
+/*
+ * Sessions are cached per network and per method, the hash makes sure a
+ * session isn't resumed after the server validation settings have changed.
+ */
+static char *eap_tls_session_group(struct eap_state *eap,
+					struct l_settings *settings,
+					const char *prefix)
+{
+	static const char *keys[] = {
+		"CACert", "ServerDomainMask", "ClientCert", NULL,
+	};
+	const char *peer_id = eap_get_peer_id(eap);
+	struct l_checksum *checksum;
+	uint8_t digest[8];
+	char hex[17];
+	unsigned int i;
+
+	if (!peer_id)
+		return NULL;
+
+	checksum = l_checksum_new(L_CHECKSUM_SHA256);
+	if (!checksum)
+		return NULL;
+
+	for (i = 0; keys[i]; i++) {
+		char setting_key[72];
+		L_AUTO_FREE_VAR(char *, value) = NULL;
+
+		snprintf(setting_key, sizeof(setting_key), "%s%s",
+				prefix, keys[i]);
+		value = l_settings_get_string(settings, "Security",
+						setting_key);
+		l_checksum_update(checksum, value ?: "", value ?
+						strlen(value) + 1 : 1);
+	}
+
+	l_checksum_get_digest(checksum, digest, sizeof(digest));
+	l_checksum_free(checksum);
+
+	for (i = 0; i < sizeof(digest); i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	return l_strdup_printf("%s-%s-%s", peer_id,
+				eap_get_method_name(eap), hex);
+}
+
 bool eap_tls_common_settings_load(struct eap_state *eap,
 				struct l_settings *settings, const char *prefix,
 				const struct eap_tls_variant_ops *variant_ops,
@@ -986,7 +1330,8 @@ bool eap_tls_common_settings_load(struct eap_state *eap,
 	snprintf(setting_key, sizeof(setting_key), "%sCACert", prefix);
 	value = l_settings_get_string(settings, "Security", setting_key);
 	if (value) {
-		eap_tls->ca_cert = eap_tls_load_ca_cert(settings, value);
+		eap_tls->ca_cert = eap_tls_load_ca_cert(settings, value,
+						&eap_tls->ca_cert_entry);
 		if (!eap_tls->ca_cert) {
 			l_error("Could not load CACert %s", value);
 			goto load_error;
@@ -1003,6 +1348,8 @@ bool eap_tls_common_settings_load(struct eap_state *eap,
 		l_free(domain_mask_str);
 	}
 
+	eap_tls->session_group = eap_tls_session_group(eap, settings, prefix);
+
 	eap_set_data(eap, eap_tls);
 
 	return true;
@@ -1077,3 +1424,46 @@ void eap_tls_common_tunnel_close(struct eap_state *eap)
 
 	l_tls_close(eap_tls->tunnel);
 }
+
+void eap_tls_set_session_cache_ops(eap_tls_session_cache_load_func_t load,
+					eap_tls_session_cache_sync_func_t sync)
+{
+	eap_tls_session_cache_load = load;
+	eap_tls_session_cache_sync = sync;
+
+	if (load)
+		return;
+
+	l_settings_free(eap_tls_session_cache);
+	eap_tls_session_cache = NULL;
+}
+
+void eap_tls_forget_peer(const char *peer_id)
+{
+	char **groups;
+	size_t prefix_len = strlen(peer_id);
+	bool changed = false;
+	unsigned int i;
+
+	if (!eap_tls_session_cache && eap_tls_session_cache_load)
+		eap_tls_session_cache = eap_tls_session_cache_load();
+
+	if (!eap_tls_session_cache)
+		return;
+
+	groups = l_settings_get_groups(eap_tls_session_cache);
+
+	for (i = 0; groups[i]; i++) {
+		if (strncmp(groups[i], peer_id, prefix_len) ||
+				groups[i][prefix_len] != '-')
+			continue;
+
+		l_settings_remove_group(eap_tls_session_cache, groups[i]);
+		changed = true;
+	}
+
+	l_strv_free(groups);
+
+	if (changed && eap_tls_session_cache_sync)
+		eap_tls_session_cache_sync(eap_tls_session_cache);
+}
@@ -450,6 +450,7 @@ static void eap_tls_exit(void)
 	l_debug("");
 	eap_unregister_method(&eap_tls);
 	eap_unregister_method(&eap_wfa_tls);
+	eap_tls_common_cache_flush();
 }
 
 EAP_METHOD_BUILTIN(eap_tls, eap_tls_init, eap_tls_exit)
@@ -1163,6 +1163,7 @@ static void eap_ttls_exit(void)
 {
 	l_debug("");
 	eap_unregister_method(&eap_ttls);
+	eap_tls_common_cache_flush();
 }
 
 EAP_METHOD_BUILTIN(eap_ttls, eap_ttls_init, eap_ttls_exit)
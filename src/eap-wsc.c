@@ -39,6 +39,7 @@
 
 #define EAP_WSC_HEADER_LEN	14
 #define EAP_WSC_PDU_MAX_LEN	4096
+#define EAP_WSC_TX_PDU_MAX_LEN	1024
 
 /* WSC v2.0.5, Section 7.7.1 */
 enum wsc_op {
@@ -76,13 +77,100 @@ enum state {
 static struct l_key *dh5_generator;
 static struct l_key *dh5_prime;
 
+/*
+ * Generating the DH5 key pair is the most expensive step in starting a
+ * WSC session.  Keep a couple of pairs precomputed in idle time so the
+ * exchange can start right away once a user presses the button.  Each
+ * pair is handed out exactly once.
+ */
+#define DH5_KEY_POOL_SIZE	2
+
+struct dh5_key_pair {
+	struct l_key *private;
+	uint8_t public_key[192];
+};
+
+static struct dh5_key_pair dh5_key_pool[DH5_KEY_POOL_SIZE];
+static unsigned int dh5_key_pool_len;
+static struct l_idle *dh5_key_pool_idle;
+
+static bool dh5_key_pair_generate(struct dh5_key_pair *pair)
+{
+	size_t len = sizeof(pair->public_key);
+
+	pair->private = l_key_generate_dh_private(crypto_dh5_prime,
+							crypto_dh5_prime_size);
+	if (!pair->private)
+		return false;
+
+	if (!l_key_compute_dh_public(dh5_generator, pair->private, dh5_prime,
+					pair->public_key, &len) ||
+			len != sizeof(pair->public_key)) {
+		l_key_free(pair->private);
+		pair->private = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static void dh5_key_pool_refill(struct l_idle *idle, void *user_data)
+{
+	/* One pair per iteration to keep the main loop responsive */
+	if (dh5_key_pair_generate(&dh5_key_pool[dh5_key_pool_len]) &&
+			++dh5_key_pool_len < DH5_KEY_POOL_SIZE)
+		return;
+
+	l_idle_remove(dh5_key_pool_idle);
+	dh5_key_pool_idle = NULL;
+}
+
+static bool dh5_key_pool_take(struct dh5_key_pair *out)
+{
+	if (!dh5_key_pool_len)
+		return false;
+
+	dh5_key_pool_len -= 1;
+	*out = dh5_key_pool[dh5_key_pool_len];
+	memset(&dh5_key_pool[dh5_key_pool_len], 0, sizeof(*out));
+	return true;
+}
+
+static void dh5_key_pool_clear(void)
+{
+	unsigned int i;
+
+	l_idle_remove(dh5_key_pool_idle);
+	dh5_key_pool_idle = NULL;
+
+	for (i = 0; i < DH5_KEY_POOL_SIZE; i++) {
+		l_key_free(dh5_key_pool[i].private);
+		dh5_key_pool[i].private = NULL;
+	}
+
+	dh5_key_pool_len = 0;
+}
+
+/*
+ * Hint that a WSC exchange is likely to follow shortly, e.g. a PushButton
+ * or StartPin request has been received.  Tops up the key pair pool from
+ * an idle callback.
+ */
+void eap_wsc_prepare_key_pairs(void)
+{
+	if (!dh5_prime || dh5_key_pool_idle ||
+			dh5_key_pool_len == DH5_KEY_POOL_SIZE)
+		return;
+
+	dh5_key_pool_idle = l_idle_create(dh5_key_pool_refill, NULL, NULL);
+}
+
 struct eap_wsc_state {
 	bool registrar;
 	struct wsc_m1 *m1;
 	struct wsc_m2 *m2;
 	struct wsc_credential wpa2_cred;
 	struct wsc_credential open_cred;
-	uint8_t *sent_pdu;
 	size_t sent_len;
 	struct l_key *private;
 	char *device_password;
@@ -104,14 +192,24 @@ struct eap_wsc_state {
 	size_t rx_pdu_buf_offset;
 	size_t tx_frag_offset;
 	size_t tx_last_frag_len;
+	/*
+	 * Outgoing messages are built in place after room for the EAP-WSC
+	 * header and kept here for the Authenticator of the next message and
+	 * for retransmissions
+	 */
+	uint8_t tx_buf[EAP_WSC_HEADER_LEN + EAP_WSC_TX_PDU_MAX_LEN];
 };
 
-static inline void eap_wsc_state_set_sent_pdu(struct eap_wsc_state *wsc,
-						uint8_t *pdu, size_t len)
+static inline uint8_t *eap_wsc_sent_pdu(struct eap_wsc_state *wsc)
 {
-	l_free(wsc->sent_pdu);
-	wsc->sent_pdu = pdu;
-	wsc->sent_len = len;
+	return wsc->tx_buf + EAP_WSC_HEADER_LEN;
+}
+
+/* Returns the buffer to build the next message into, dropping the last one */
+static inline uint8_t *eap_wsc_tx_pdu(struct eap_wsc_state *wsc)
+{
+	wsc->sent_len = 0;
+	return eap_wsc_sent_pdu(wsc);
 }
 
 static inline bool authenticator_check(struct eap_wsc_state *wsc,
@@ -120,7 +218,7 @@ static inline bool authenticator_check(struct eap_wsc_state *wsc,
 	uint8_t authenticator[8];
 	struct iovec iov[2];
 
-	iov[0].iov_base = wsc->sent_pdu;
+	iov[0].iov_base = eap_wsc_sent_pdu(wsc);
 	iov[0].iov_len = wsc->sent_len;
 	iov[1].iov_base = (void *) pdu;
 	iov[1].iov_len = len - 12;
@@ -302,8 +400,7 @@ static void eap_wsc_state_free(struct eap_wsc_state *wsc)
 
 	l_key_free(wsc->private);
 
-	l_free(wsc->sent_pdu);
-	wsc->sent_pdu = NULL;
+	explicit_bzero(wsc->tx_buf, sizeof(wsc->tx_buf));
 	wsc->sent_len = 0;
 
 	if (wsc->rx_pdu_buf) {
@@ -372,7 +469,8 @@ static void eap_wsc_send_fragment(struct eap_state *eap)
 		header_len += 2;
 	}
 
-	memcpy(buf + header_len, wsc->sent_pdu + wsc->tx_frag_offset, len);
+	memcpy(buf + header_len, eap_wsc_sent_pdu(wsc) + wsc->tx_frag_offset,
+									len);
 
 	if (wsc->registrar)
 		eap_method_new_request(eap, buf, header_len + len);
@@ -382,27 +480,23 @@ static void eap_wsc_send_fragment(struct eap_state *eap)
 	wsc->tx_last_frag_len = len;
 }
 
-static void eap_wsc_send_message(struct eap_state *eap,
-						uint8_t *pdu, size_t pdu_len)
+/* The message has been built in place by the caller, see eap_wsc_tx_pdu */
+static void eap_wsc_send_message(struct eap_state *eap, size_t pdu_len)
 {
 	struct eap_wsc_state *wsc = eap_get_data(eap);
 	size_t msg_len = pdu_len + EAP_WSC_HEADER_LEN;
 
-	eap_wsc_state_set_sent_pdu(wsc, pdu, pdu_len);
+	wsc->sent_len = pdu_len;
 
 	if (msg_len <= eap_get_mtu(eap)) {
-		uint8_t *buf = l_malloc(msg_len);
-
-		buf[12] = WSC_OP_MSG;
-		buf[13] = 0;
-		memcpy(buf + EAP_WSC_HEADER_LEN, pdu, pdu_len);
+		wsc->tx_buf[12] = WSC_OP_MSG;
+		wsc->tx_buf[13] = 0;
 
 		if (wsc->registrar)
-			eap_method_new_request(eap, buf, msg_len);
+			eap_method_new_request(eap, wsc->tx_buf, msg_len);
 		else
-			eap_method_respond(eap, buf, msg_len);
+			eap_method_respond(eap, wsc->tx_buf, msg_len);
 
-		l_free(buf);
 		return;
 	}
 
@@ -415,8 +509,7 @@ static void eap_wsc_send_nack(struct eap_state *eap,
 {
 	struct eap_wsc_state *wsc = eap_get_data(eap);
 	struct wsc_nack nack;
-	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
 	uint8_t buf[256];
 
 	/*
@@ -456,28 +549,25 @@ static void eap_wsc_send_nack(struct eap_state *eap,
 
 	nack.configuration_error = error;
 
-	pdu = wsc_build_wsc_nack(&nack, &pdu_len);
-	if (!pdu)
+	pdu_len = wsc_write_wsc_nack(&nack, buf + EAP_WSC_HEADER_LEN,
+					sizeof(buf) - EAP_WSC_HEADER_LEN);
+	if (pdu_len < 0)
 		return;
 
 	buf[12] = WSC_OP_NACK;
 	buf[13] = 0;
-	memcpy(buf + EAP_WSC_HEADER_LEN, pdu, pdu_len);
 
 	if (wsc->registrar)
 		eap_method_new_request(eap, buf, pdu_len + EAP_WSC_HEADER_LEN);
 	else
 		eap_method_respond(eap, buf, pdu_len + EAP_WSC_HEADER_LEN);
-
-	l_free(pdu);
 }
 
 static void eap_wsc_send_done(struct eap_state *eap)
 {
 	struct eap_wsc_state *wsc = eap_get_data(eap);
 	struct wsc_done done;
-	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
 	uint8_t buf[256];
 
 	done.version2 = true;
@@ -486,16 +576,15 @@ static void eap_wsc_send_done(struct eap_state *eap)
 	memcpy(done.registrar_nonce, wsc->m2->registrar_nonce,
 						sizeof(done.registrar_nonce));
 
-	pdu = wsc_build_wsc_done(&done, &pdu_len);
-	if (!pdu)
+	pdu_len = wsc_write_wsc_done(&done, buf + EAP_WSC_HEADER_LEN,
+					sizeof(buf) - EAP_WSC_HEADER_LEN);
+	if (pdu_len < 0)
 		return;
 
 	buf[12] = WSC_OP_DONE;
 	buf[13] = 0;
-	memcpy(buf + EAP_WSC_HEADER_LEN, pdu, pdu_len);
 
 	eap_method_respond(eap, buf, pdu_len + EAP_WSC_HEADER_LEN);
-	l_free(pdu);
 }
 
 static void eap_wsc_send_frag_ack(struct eap_state *eap)
@@ -588,23 +677,26 @@ static void eap_wsc_send_m7(struct eap_state *eap,
 	struct wsc_m7_encrypted_settings m7es;
 	struct wsc_m7 m7;
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
+	/* 20 for SNonce, 12 for Authenticator */
+	uint8_t settings[32];
+	int settings_len;
 	/* 20 for SNonce, 12 for Authenticator, 16 for IV + up to 16 pad */
 	uint8_t encrypted[64];
 	size_t encrypted_len;
 	bool r;
 
 	memcpy(m7es.e_snonce2, wsc->local_snonce2, sizeof(wsc->local_snonce2));
-	pdu = wsc_build_m7_encrypted_settings(&m7es, &pdu_len);
+	settings_len = wsc_write_m7_encrypted_settings(&m7es,
+						settings, sizeof(settings));
 	explicit_bzero(m7es.e_snonce2, sizeof(wsc->local_snonce2));
-	if (!pdu)
+	if (settings_len < 0)
 		return;
 
-	keywrap_authenticator_put(wsc, pdu, pdu_len);
-	r = encrypted_settings_encrypt(wsc, wsc->iv2, pdu, pdu_len,
+	keywrap_authenticator_put(wsc, settings, settings_len);
+	r = encrypted_settings_encrypt(wsc, wsc->iv2, settings, settings_len,
 						encrypted, &encrypted_len);
-	explicit_bzero(pdu, pdu_len);
-	l_free(pdu);
+	explicit_bzero(settings, settings_len);
 
 	if (!r)
 		return;
@@ -613,12 +705,14 @@ static void eap_wsc_send_m7(struct eap_state *eap,
 	memcpy(m7.registrar_nonce, wsc->m2->registrar_nonce,
 						sizeof(m7.registrar_nonce));
 
-	pdu = wsc_build_m7(&m7, encrypted, encrypted_len, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m7(&m7, encrypted, encrypted_len,
+					pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m6_pdu, m6_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M8;
 }
 
@@ -689,23 +783,26 @@ static void eap_wsc_send_m5(struct eap_state *eap,
 	struct wsc_m5_encrypted_settings m5es;
 	struct wsc_m5 m5;
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
+	/* 20 for SNonce, 12 for Authenticator */
+	uint8_t settings[32];
+	int settings_len;
 	/* 20 for SNonce, 12 for Authenticator, 16 for IV + up to 16 pad */
 	uint8_t encrypted[64];
 	size_t encrypted_len;
 	bool r;
 
 	memcpy(m5es.e_snonce1, wsc->local_snonce1, sizeof(wsc->local_snonce1));
-	pdu = wsc_build_m5_encrypted_settings(&m5es, &pdu_len);
+	settings_len = wsc_write_m5_encrypted_settings(&m5es,
+						settings, sizeof(settings));
 	explicit_bzero(m5es.e_snonce1, sizeof(wsc->local_snonce1));
-	if (!pdu)
+	if (settings_len < 0)
 		return;
 
-	keywrap_authenticator_put(wsc, pdu, pdu_len);
-	r = encrypted_settings_encrypt(wsc, wsc->iv1, pdu, pdu_len,
+	keywrap_authenticator_put(wsc, settings, settings_len);
+	r = encrypted_settings_encrypt(wsc, wsc->iv1, settings, settings_len,
 						encrypted, &encrypted_len);
-	explicit_bzero(pdu, pdu_len);
-	l_free(pdu);
+	explicit_bzero(settings, settings_len);
 
 	if (!r)
 		return;
@@ -714,12 +811,14 @@ static void eap_wsc_send_m5(struct eap_state *eap,
 	memcpy(m5.registrar_nonce, wsc->m2->registrar_nonce,
 						sizeof(m5.registrar_nonce));
 
-	pdu = wsc_build_m5(&m5, encrypted, encrypted_len, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m5(&m5, encrypted, encrypted_len,
+					pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m4_pdu, m4_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M6;
 }
 
@@ -795,7 +894,7 @@ static void eap_wsc_send_m3(struct eap_state *eap,
 	struct wsc_m3 m3;
 	struct iovec iov[4];
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
 
 	len = strlen(wsc->device_password);
 
@@ -846,12 +945,13 @@ static void eap_wsc_send_m3(struct eap_state *eap,
 	l_checksum_get_digest(wsc->hmac_auth_key,
 					m3.e_hash2, sizeof(m3.e_hash2));
 
-	pdu = wsc_build_m3(&m3, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m3(&m3, pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m2_pdu, m2_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M4;
 }
 
@@ -965,7 +1065,10 @@ static void eap_wsc_r_send_m8(struct eap_state *eap,
 	struct wsc_m8_encrypted_settings m8es = {};
 	struct wsc_m8 m8;
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
+	/* 2 * credential, 12 for Authenticator */
+	uint8_t settings[512];
+	int settings_len;
 	/* At least: 2 * credential, 12 for Authenticator, 16 for IV + up to 16 pad */
 	uint8_t encrypted[1024];
 	size_t encrypted_len;
@@ -983,17 +1086,16 @@ static void eap_wsc_r_send_m8(struct eap_state *eap,
 		memcpy(&creds[creds_cnt++], &wsc->wpa2_cred,
 			sizeof(struct wsc_credential));
 
-	pdu = wsc_build_m8_encrypted_settings(&m8es, creds, creds_cnt,
-						&pdu_len);
+	settings_len = wsc_write_m8_encrypted_settings(&m8es, creds, creds_cnt,
+						settings, sizeof(settings));
 	explicit_bzero(creds, creds_cnt * sizeof(struct wsc_credential));
-	if (!pdu)
+	if (settings_len < 0)
 		return;
 
-	keywrap_authenticator_put(wsc, pdu, pdu_len);
-	r = encrypted_settings_encrypt(wsc, wsc->iv3, pdu, pdu_len,
+	keywrap_authenticator_put(wsc, settings, settings_len);
+	r = encrypted_settings_encrypt(wsc, wsc->iv3, settings, settings_len,
 						encrypted, &encrypted_len);
-	explicit_bzero(pdu, pdu_len);
-	l_free(pdu);
+	explicit_bzero(settings, settings_len);
 
 	if (!r)
 		return;
@@ -1002,12 +1104,14 @@ static void eap_wsc_r_send_m8(struct eap_state *eap,
 	memcpy(m8.enrollee_nonce, wsc->m1->enrollee_nonce,
 						sizeof(m8.enrollee_nonce));
 
-	pdu = wsc_build_m8(&m8, encrypted, encrypted_len, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m8(&m8, encrypted, encrypted_len,
+					pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m7_pdu, m7_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_DONE;
 }
 
@@ -1078,23 +1182,26 @@ static void eap_wsc_r_send_m6(struct eap_state *eap,
 	struct wsc_m6_encrypted_settings m6es;
 	struct wsc_m6 m6;
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
+	/* 20 for SNonce, 12 for Authenticator */
+	uint8_t settings[32];
+	int settings_len;
 	/* 20 for SNonce, 12 for Authenticator, 16 for IV + up to 16 pad */
 	uint8_t encrypted[64];
 	size_t encrypted_len;
 	bool r;
 
 	memcpy(m6es.r_snonce2, wsc->local_snonce2, sizeof(wsc->local_snonce2));
-	pdu = wsc_build_m6_encrypted_settings(&m6es, &pdu_len);
+	settings_len = wsc_write_m6_encrypted_settings(&m6es,
+						settings, sizeof(settings));
 	explicit_bzero(m6es.r_snonce2, sizeof(wsc->local_snonce2));
-	if (!pdu)
+	if (settings_len < 0)
 		return;
 
-	keywrap_authenticator_put(wsc, pdu, pdu_len);
-	r = encrypted_settings_encrypt(wsc, wsc->iv2, pdu, pdu_len,
+	keywrap_authenticator_put(wsc, settings, settings_len);
+	r = encrypted_settings_encrypt(wsc, wsc->iv2, settings, settings_len,
 						encrypted, &encrypted_len);
-	explicit_bzero(pdu, pdu_len);
-	l_free(pdu);
+	explicit_bzero(settings, settings_len);
 
 	if (!r)
 		return;
@@ -1103,12 +1210,14 @@ static void eap_wsc_r_send_m6(struct eap_state *eap,
 	memcpy(m6.enrollee_nonce, wsc->m1->enrollee_nonce,
 						sizeof(m6.enrollee_nonce));
 
-	pdu = wsc_build_m6(&m6, encrypted, encrypted_len, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m6(&m6, encrypted, encrypted_len,
+					pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m5_pdu, m5_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M7;
 }
 
@@ -1179,7 +1288,10 @@ static void eap_wsc_r_send_m4(struct eap_state *eap,
 	struct wsc_m4_encrypted_settings m4es;
 	struct wsc_m4 m4;
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
+	/* 20 for SNonce, 12 for Authenticator */
+	uint8_t settings[32];
+	int settings_len;
 	/* 20 for SNonce, 12 for Authenticator, 16 for IV + up to 16 pad */
 	uint8_t encrypted[64];
 	size_t encrypted_len;
@@ -1189,16 +1301,16 @@ static void eap_wsc_r_send_m4(struct eap_state *eap,
 	struct iovec iov[4];
 
 	memcpy(m4es.r_snonce1, wsc->local_snonce1, sizeof(wsc->local_snonce1));
-	pdu = wsc_build_m4_encrypted_settings(&m4es, &pdu_len);
+	settings_len = wsc_write_m4_encrypted_settings(&m4es,
+						settings, sizeof(settings));
 	explicit_bzero(m4es.r_snonce1, sizeof(wsc->local_snonce1));
-	if (!pdu)
+	if (settings_len < 0)
 		return;
 
-	keywrap_authenticator_put(wsc, pdu, pdu_len);
-	r = encrypted_settings_encrypt(wsc, wsc->iv1, pdu, pdu_len,
+	keywrap_authenticator_put(wsc, settings, settings_len);
+	r = encrypted_settings_encrypt(wsc, wsc->iv1, settings, settings_len,
 						encrypted, &encrypted_len);
-	explicit_bzero(pdu, pdu_len);
-	l_free(pdu);
+	explicit_bzero(settings, settings_len);
 
 	if (!r)
 		return;
@@ -1250,12 +1362,14 @@ static void eap_wsc_r_send_m4(struct eap_state *eap,
 	l_checksum_get_digest(wsc->hmac_auth_key,
 					m4.r_hash2, sizeof(m4.r_hash2));
 
-	pdu = wsc_build_m4(&m4, encrypted, encrypted_len, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m4(&m4, encrypted, encrypted_len,
+					pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m3_pdu, m3_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M5;
 }
 
@@ -1292,19 +1406,20 @@ static void eap_wsc_r_send_m2(struct eap_state *eap,
 {
 	struct eap_wsc_state *wsc = eap_get_data(eap);
 	uint8_t *pdu;
-	size_t pdu_len;
+	int pdu_len;
 
 	wsc->m2->version2 = true;
 	memcpy(wsc->m2->enrollee_nonce, wsc->m1->enrollee_nonce, 16);
 	wsc->m2->association_state = WSC_ASSOCIATION_STATE_NOT_ASSOCIATED;
 	wsc->m2->configuration_error = WSC_CONFIGURATION_ERROR_NO_ERROR;
 
-	pdu = wsc_build_m2(wsc->m2, &pdu_len);
-	if (!pdu)
+	pdu = eap_wsc_tx_pdu(wsc);
+	pdu_len = wsc_write_m2(wsc->m2, pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
 		return;
 
 	authenticator_put(wsc, m1_pdu, m1_len, pdu, pdu_len);
-	eap_wsc_send_message(eap, pdu, pdu_len);
+	eap_wsc_send_message(eap, pdu_len);
 	wsc->state = STATE_EXPECT_M3;
 }
 
@@ -1467,13 +1582,26 @@ static void eap_wsc_handle_nack(struct eap_state *eap,
 	eap_method_error(eap);
 }
 
+static void eap_wsc_send_m1(struct eap_state *eap)
+{
+	struct eap_wsc_state *wsc = eap_get_data(eap);
+	uint8_t *pdu = eap_wsc_tx_pdu(wsc);
+	int pdu_len;
+
+	pdu_len = wsc_write_m1(wsc->m1, pdu, EAP_WSC_TX_PDU_MAX_LEN);
+	if (pdu_len < 0)
+		return;
+
+	eap_wsc_send_message(eap, pdu_len);
+	wsc->state = STATE_EXPECT_M2;
+}
+
 static void eap_wsc_handle_message(struct eap_state *eap,
 					const uint8_t *pkt, size_t len)
 {
 	struct eap_wsc_state *wsc = eap_get_data(eap);
 	uint8_t op;
 	uint8_t flags;
-	uint8_t *pdu;
 	size_t pdu_len;
 	size_t rx_header_offset = 0;
 
@@ -1504,12 +1632,7 @@ static void eap_wsc_handle_message(struct eap_state *eap,
 		if (wsc->state != STATE_EXPECT_START)
 			return;
 
-		pdu = wsc_build_m1(wsc->m1, &pdu_len);
-		if (!pdu)
-			return;
-
-		eap_wsc_send_message(eap, pdu, pdu_len);
-		wsc->state = STATE_EXPECT_M2;
+		eap_wsc_send_m1(eap);
 		return;
 	case WSC_OP_NACK:
 		if (!len)
@@ -1696,7 +1819,7 @@ static void eap_wsc_handle_retransmit(struct eap_state *eap,
 		}
 	}
 
-	if (!wsc->sent_pdu || !wsc->sent_len) {
+	if (!wsc->sent_len) {
 		eap_method_error(eap);
 		return;
 	}
@@ -1704,14 +1827,11 @@ static void eap_wsc_handle_retransmit(struct eap_state *eap,
 	if (wsc->sent_len + EAP_WSC_HEADER_LEN > eap_get_mtu(eap)) {
 		eap_wsc_send_fragment(eap);
 	} else {
-		size_t msg_len = wsc->sent_len + EAP_WSC_HEADER_LEN;
-		uint8_t buf[msg_len];
-
-		buf[12] = WSC_OP_MSG;
-		buf[13] = 0;
-		memcpy(buf + EAP_WSC_HEADER_LEN, wsc->sent_pdu, wsc->sent_len);
+		wsc->tx_buf[12] = WSC_OP_MSG;
+		wsc->tx_buf[13] = 0;
 
-		eap_method_respond(eap, buf, msg_len);
+		eap_method_respond(eap, wsc->tx_buf,
+					wsc->sent_len + EAP_WSC_HEADER_LEN);
 	}
 }
 
@@ -1841,6 +1961,9 @@ static struct eap_wsc_state *eap_wsc_new_common(struct l_settings *settings,
 	struct eap_wsc_state *wsc;
 	const char *v;
 	uint8_t private_key[192];
+	uint8_t *public_key;
+	struct dh5_key_pair pair;
+	bool precomputed = false;
 	size_t len;
 	unsigned int u32;
 
@@ -1852,6 +1975,8 @@ static struct eap_wsc_state *eap_wsc_new_common(struct l_settings *settings,
 	if (registrar)
 		wsc->m2 = l_new(struct wsc_m2, 1);
 
+	public_key = registrar ? wsc->m2->public_key : wsc->m1->public_key;
+
 	v = l_settings_get_value(settings, "WSC", "EnrolleeMAC");
 	if (!v)
 		goto err;
@@ -1915,6 +2040,14 @@ static struct eap_wsc_state *eap_wsc_new_common(struct l_settings *settings,
 
 		wsc->private = l_key_new(L_KEY_RAW, private_key, 192);
 		explicit_bzero(private_key, 192);
+	} else if (dh5_key_pool_take(&pair)) {
+		wsc->private = pair.private;
+		memcpy(public_key, pair.public_key, sizeof(pair.public_key));
+		explicit_bzero(&pair, sizeof(pair));
+		precomputed = true;
+
+		/* Replace the pair we just used */
+		eap_wsc_prepare_key_pairs();
 	} else
 		wsc->private = l_key_generate_dh_private(crypto_dh5_prime,
 							crypto_dh5_prime_size);
@@ -1923,12 +2056,10 @@ static struct eap_wsc_state *eap_wsc_new_common(struct l_settings *settings,
 		goto err;
 
 	len = sizeof(wsc->m1->public_key);
-	if (!l_key_compute_dh_public(dh5_generator, wsc->private, dh5_prime,
-					registrar ? wsc->m2->public_key :
-					wsc->m1->public_key, &len))
-		goto err;
-
-	if (len != sizeof(wsc->m1->public_key))
+	if (!precomputed && (!l_key_compute_dh_public(dh5_generator,
+					wsc->private, dh5_prime,
+					public_key, &len) ||
+				len != sizeof(wsc->m1->public_key)))
 		goto err;
 
 	if (!load_hexencoded(settings, registrar ? "R-SNonce1" : "E-SNonce1",
@@ -2207,6 +2338,8 @@ static void eap_wsc_exit(void)
 	eap_unregister_method(&eap_wsc);
 	eap_unregister_method(&eap_wsc_r);
 
+	dh5_key_pool_clear();
+
 	l_key_free(dh5_prime);
 	l_key_free(dh5_generator);
 }
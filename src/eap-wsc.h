@@ -24,3 +24,5 @@ enum EAP_WSC_EVENT {
 	EAP_WSC_EVENT_CREDENTIAL_OBTAINED	= 0x0050f200,
 	EAP_WSC_EVENT_CREDENTIAL_SENT		= 0x0050f201,
 };
+
+void eap_wsc_prepare_key_pairs(void);
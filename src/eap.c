@@ -58,6 +58,7 @@ struct eap_state {
 	struct eap_method *method;
 	char *identity;
 	char *identity_setting;
+	char *peer_id;
 	bool authenticator;
 
 	int last_id;
@@ -155,6 +156,7 @@ void eap_free(struct eap_state *eap)
 	eap_free_common(eap);
 	l_timeout_remove(eap->complete_timeout);
 
+	l_free(eap->peer_id);
 	l_free(eap);
 }
 
@@ -174,6 +176,21 @@ const char *eap_get_identity(struct eap_state *eap)
 	return eap->identity;
 }
 
+/*
+ * Identifies the network being authenticated to, so that state cached
+ * by the methods (e.g. TLS sessions) is only reused with the same peer.
+ */
+void eap_set_peer_id(struct eap_state *eap, const char *peer_id)
+{
+	l_free(eap->peer_id);
+	eap->peer_id = l_strdup(peer_id);
+}
+
+const char *eap_get_peer_id(struct eap_state *eap)
+{
+	return eap->peer_id;
+}
+
 static void eap_send_packet(struct eap_state *eap, enum eap_code code,
 				uint8_t id, uint8_t *buf, size_t len)
 {
@@ -42,9 +42,13 @@
 #include "src/handshake.h"
 #include "src/watchlist.h"
 #include "src/erp.h"
+#include "src/pmksa.h"
 #include "src/iwd.h"
+#include "src/trace.h"
+#include "src/metrics.h"
 
 static struct l_queue *state_machines;
+static struct l_hashmap *sm_index;	/* state_machines keyed by peer */
 static struct l_queue *preauths;
 static struct watchlist frame_watches;
 static uint32_t eapol_4way_handshake_time = 2;
@@ -55,6 +59,13 @@ static eapol_tx_packet_func_t tx_packet = NULL;
 static eapol_install_pmk_func_t install_pmk = NULL;
 static void *tx_user_data;
 
+IWD_MODULE_COUNTER(eapol, eapol_sm)
+
+METRICS_COUNTER(handshake_retries, "iwd_handshake_retries_total",
+		"4-Way Handshake messages sent or received again")
+METRICS_COUNTER(eapol_timeouts, "iwd_eapol_timeouts_total",
+		"Handshakes failed on a timeout")
+
 #define VERIFY_IS_ZERO(field)						\
 	do {								\
 		if (!l_memeqzero((field), sizeof((field))))	\
@@ -129,84 +140,111 @@ bool eapol_calculate_mic(enum ie_rsn_akm_suite akm, const uint8_t *kck,
 	}
 }
 
-bool eapol_verify_mic(enum ie_rsn_akm_suite akm, const uint8_t *kck,
-			const struct eapol_key *frame, size_t mic_len)
-{
-	uint8_t mic[MIC_MAXLEN];
-	struct iovec iov[3];
-	struct l_checksum *checksum = NULL;
-
-	iov[0].iov_base = (void *) frame;
-	iov[0].iov_len = offsetof(struct eapol_key, key_data);
-
-	memset(mic, 0, sizeof(mic));
-	iov[1].iov_base = mic;
-	iov[1].iov_len = mic_len;
+#define EAPOL_MIC_CMAC_AES	((enum l_checksum_type) -1)
 
-	iov[2].iov_base = (void *) EAPOL_KEY_DATA(frame, mic_len) - 2;
-	iov[2].iov_len = EAPOL_KEY_DATA_LEN(frame, mic_len) + 2;
+/* Map the Key Descriptor Version and AKM to the MIC algorithm and KCK size */
+static bool eapol_mic_algorithm(enum ie_rsn_akm_suite akm,
+				uint8_t version, size_t mic_len,
+				enum l_checksum_type *type, size_t *kck_len)
+{
+	*kck_len = 16;
 
-	switch (frame->key_descriptor_version) {
+	switch (version) {
 	case EAPOL_KEY_DESCRIPTOR_VERSION_HMAC_MD5_ARC4:
-		checksum = l_checksum_new_hmac(L_CHECKSUM_MD5, kck, 16);
-		break;
+		*type = L_CHECKSUM_MD5;
+		return true;
 	case EAPOL_KEY_DESCRIPTOR_VERSION_HMAC_SHA1_AES:
-		checksum = l_checksum_new_hmac(L_CHECKSUM_SHA1, kck, 16);
-		break;
+		*type = L_CHECKSUM_SHA1;
+		return true;
 	case EAPOL_KEY_DESCRIPTOR_VERSION_AES_128_CMAC_AES:
-		checksum = l_checksum_new_cmac_aes(kck, 16);
-		break;
+		*type = EAPOL_MIC_CMAC_AES;
+		return true;
 	case EAPOL_KEY_DESCRIPTOR_VERSION_AKM_DEFINED:
 		switch (akm) {
 		case IE_RSN_AKM_SUITE_SAE_SHA256:
 		case IE_RSN_AKM_SUITE_FT_OVER_SAE_SHA256:
 		case IE_RSN_AKM_SUITE_OSEN:
-			checksum = l_checksum_new_cmac_aes(kck, 16);
-			break;
+			*type = EAPOL_MIC_CMAC_AES;
+			return true;
 		case IE_RSN_AKM_SUITE_OWE:
 			switch (mic_len) {
 			case 16:
-				checksum = l_checksum_new_hmac(
-							L_CHECKSUM_SHA256,
-							kck, 16);
-				break;
+				*type = L_CHECKSUM_SHA256;
+				return true;
 			case 24:
-				checksum = l_checksum_new_hmac(
-							L_CHECKSUM_SHA384,
-							kck, 24);
-				break;
+				*type = L_CHECKSUM_SHA384;
+				*kck_len = 24;
+				return true;
 			case 32:
-				checksum = l_checksum_new_hmac(
-							L_CHECKSUM_SHA512,
-							kck, 32);
-				break;
+				*type = L_CHECKSUM_SHA512;
+				*kck_len = 32;
+				return true;
 			default:
 				l_error("Invalid MIC length of %zu for OWE",
 						mic_len);
 				return false;
 			}
-
-			break;
 		default:
 			return false;
 		}
-
-		break;
 	default:
 		return false;
 	}
+}
 
-	if (checksum == NULL)
-		return false;
+static struct l_checksum *eapol_mic_checksum_new(enum l_checksum_type type,
+						const uint8_t *kck,
+						size_t kck_len)
+{
+	if (type == EAPOL_MIC_CMAC_AES)
+		return l_checksum_new_cmac_aes(kck, kck_len);
+
+	return l_checksum_new_hmac(type, kck, kck_len);
+}
+
+/* Check the MIC of @frame as if its MIC field was zeroed */
+static bool eapol_mic_check(struct l_checksum *checksum,
+				const struct eapol_key *frame, size_t mic_len)
+{
+	uint8_t mic[MIC_MAXLEN];
+	struct iovec iov[3];
+
+	iov[0].iov_base = (void *) frame;
+	iov[0].iov_len = offsetof(struct eapol_key, key_data);
+
+	memset(mic, 0, sizeof(mic));
+	iov[1].iov_base = mic;
+	iov[1].iov_len = mic_len;
+
+	iov[2].iov_base = (void *) EAPOL_KEY_DATA(frame, mic_len) - 2;
+	iov[2].iov_len = EAPOL_KEY_DATA_LEN(frame, mic_len) + 2;
 
 	l_checksum_updatev(checksum, iov, 3);
 	l_checksum_get_digest(checksum, mic, mic_len);
-	l_checksum_free(checksum);
 
-	if (!memcmp(frame->key_data, mic, mic_len))
-		return true;
+	return !memcmp(frame->key_data, mic, mic_len);
+}
 
-	return false;
+bool eapol_verify_mic(enum ie_rsn_akm_suite akm, const uint8_t *kck,
+			const struct eapol_key *frame, size_t mic_len)
+{
+	enum l_checksum_type type;
+	size_t kck_len;
+	struct l_checksum *checksum;
+	bool r;
+
+	if (!eapol_mic_algorithm(akm, frame->key_descriptor_version, mic_len,
+					&type, &kck_len))
+		return false;
+
+	checksum = eapol_mic_checksum_new(type, kck, kck_len);
+	if (!checksum)
+		return false;
+
+	r = eapol_mic_check(checksum, frame, mic_len);
+	l_checksum_free(checksum);
+
+	return r;
 }
 
 /*
@@ -235,14 +273,19 @@ static size_t eapol_get_mic_length(enum ie_rsn_akm_suite akm, size_t pmk_len)
 	}
 }
 
-uint8_t *eapol_decrypt_key_data(enum ie_rsn_akm_suite akm, const uint8_t *kek,
-				const struct eapol_key *frame,
-				size_t *decrypted_size, size_t mic_len)
+/*
+ * Decrypt the Key Data of @frame into @buf, which must have room for at
+ * least EAPOL_KEY_DATA_LEN bytes, the plaintext is never longer than that.
+ */
+static bool eapol_decrypt_key_data_to(enum ie_rsn_akm_suite akm,
+					const uint8_t *kek,
+					const struct eapol_key *frame,
+					uint8_t *buf, size_t *decrypted_size,
+					size_t mic_len)
 {
 	size_t key_data_len = EAPOL_KEY_DATA_LEN(frame, mic_len);
 	const uint8_t *key_data = EAPOL_KEY_DATA(frame, mic_len);
 	size_t expected_len;
-	uint8_t *buf;
 	size_t kek_len;
 
 	switch (frame->key_descriptor_version) {
@@ -254,7 +297,7 @@ uint8_t *eapol_decrypt_key_data(enum ie_rsn_akm_suite akm, const uint8_t *kek,
 		case IE_RSN_AKM_SUITE_FILS_SHA256:
 		case IE_RSN_AKM_SUITE_FILS_SHA384:
 			if (key_data_len < 16)
-				return NULL;
+				return false;
 
 			expected_len = key_data_len - 16;
 			break;
@@ -263,27 +306,28 @@ uint8_t *eapol_decrypt_key_data(enum ie_rsn_akm_suite akm, const uint8_t *kek,
 		case IE_RSN_AKM_SUITE_OWE:
 		case IE_RSN_AKM_SUITE_OSEN:
 			if (key_data_len < 24 || key_data_len % 8)
-				return NULL;
+				return false;
 
 			expected_len = key_data_len - 8;
 			break;
 		default:
-			return NULL;
+			return false;
 		}
 
 		break;
 	case EAPOL_KEY_DESCRIPTOR_VERSION_HMAC_SHA1_AES:
 	case EAPOL_KEY_DESCRIPTOR_VERSION_AES_128_CMAC_AES:
 		if (key_data_len < 24 || key_data_len % 8)
-			return NULL;
+			return false;
 
 		expected_len = key_data_len - 8;
 		break;
 	default:
-		return NULL;
+		return false;
 	}
 
-	buf = l_new(uint8_t, expected_len);
+	if (!expected_len)
+		return false;
 
 	switch (frame->key_descriptor_version) {
 	case EAPOL_KEY_DESCRIPTOR_VERSION_HMAC_MD5_ARC4:
@@ -360,11 +404,32 @@ uint8_t *eapol_decrypt_key_data(enum ie_rsn_akm_suite akm, const uint8_t *kek,
 	if (decrypted_size)
 		*decrypted_size = expected_len;
 
-	return buf;
+	return true;
 
 error:
-	l_free(buf);
-	return NULL;
+	explicit_bzero(buf, expected_len);
+	return false;
+}
+
+uint8_t *eapol_decrypt_key_data(enum ie_rsn_akm_suite akm, const uint8_t *kek,
+				const struct eapol_key *frame,
+				size_t *decrypted_size, size_t mic_len)
+{
+	size_t len = EAPOL_KEY_DATA_LEN(frame, mic_len);
+	uint8_t *buf;
+
+	if (!len)
+		return NULL;
+
+	buf = l_malloc(len);
+
+	if (!eapol_decrypt_key_data_to(akm, kek, frame, buf, decrypted_size,
+								mic_len)) {
+		l_free(buf);
+		return NULL;
+	}
+
+	return buf;
 }
 
 /*
@@ -677,7 +742,11 @@ bool eapol_verify_gtk_2_of_2(const struct eapol_key *ek, bool is_wpa)
 	return true;
 }
 
-static struct eapol_key *eapol_create_common(
+/* Room needed for a key frame built by the functions below */
+#define EAPOL_KEY_TX_LEN(mic_len, extra_len)				\
+	(EAPOL_FRAME_LEN(mic_len) + (extra_len) + ((mic_len) ? 0 : 16))
+
+static struct eapol_key *eapol_build_common(struct eapol_key *out_frame,
 				enum eapol_protocol_version protocol,
 				enum eapol_key_descriptor_version version,
 				bool secure,
@@ -692,9 +761,6 @@ static struct eapol_key *eapol_create_common(
 	size_t extra_key_len = (mic_len == 0) ? 16 : 0;
 	size_t to_alloc = EAPOL_FRAME_LEN(mic_len);
 
-	struct eapol_key *out_frame = l_malloc(to_alloc + extra_len +
-						extra_key_len);
-
 	memset(out_frame, 0, to_alloc + extra_len);
 
 	out_frame->header.protocol_version = protocol;
@@ -726,7 +792,12 @@ static struct eapol_key *eapol_create_common(
 	return out_frame;
 }
 
-struct eapol_key *eapol_create_ptk_2_of_4(
+/*
+ * The eapol_build_* functions write into a caller supplied buffer of at
+ * least EAPOL_KEY_TX_LEN bytes, the state machine uses a stack buffer so
+ * that answering a handshake or a rekey doesn't allocate.
+ */
+static struct eapol_key *eapol_build_ptk_2_of_4(struct eapol_key *buf,
 				enum eapol_protocol_version protocol,
 				enum eapol_key_descriptor_version version,
 				uint64_t key_replay_counter,
@@ -736,12 +807,13 @@ struct eapol_key *eapol_create_ptk_2_of_4(
 				bool is_wpa,
 				size_t mic_len)
 {
-	return eapol_create_common(protocol, version, false, key_replay_counter,
-					snonce, extra_len, extra_data, 1,
+	return eapol_build_common(buf, protocol, version, false,
+					key_replay_counter, snonce,
+					extra_len, extra_data, 1,
 					is_wpa, mic_len);
 }
 
-struct eapol_key *eapol_create_ptk_4_of_4(
+static struct eapol_key *eapol_build_ptk_4_of_4(struct eapol_key *buf,
 				enum eapol_protocol_version protocol,
 				enum eapol_key_descriptor_version version,
 				uint64_t key_replay_counter,
@@ -751,13 +823,13 @@ struct eapol_key *eapol_create_ptk_4_of_4(
 	uint8_t snonce[32];
 
 	memset(snonce, 0, sizeof(snonce));
-	return eapol_create_common(protocol, version,
+	return eapol_build_common(buf, protocol, version,
 					is_wpa ? false : true,
 					key_replay_counter, snonce, 0, NULL,
 					1, is_wpa, mic_len);
 }
 
-struct eapol_key *eapol_create_gtk_2_of_2(
+static struct eapol_key *eapol_build_gtk_2_of_2(struct eapol_key *buf,
 				enum eapol_protocol_version protocol,
 				enum eapol_key_descriptor_version version,
 				uint64_t key_replay_counter,
@@ -767,13 +839,10 @@ struct eapol_key *eapol_create_gtk_2_of_2(
 	struct eapol_key *step2;
 
 	memset(snonce, 0, sizeof(snonce));
-	step2 = eapol_create_common(protocol, version, true,
+	step2 = eapol_build_common(buf, protocol, version, true,
 					key_replay_counter, snonce,
 					0, NULL, 0, is_wpa, mic_len);
 
-	if (!step2)
-		return step2;
-
 	/*
 	 * WPA_80211_v3_1, Section 2.2.4:
 	 * "The Key Type and Key Index shall not both be 0 in the same message"
@@ -787,6 +856,45 @@ struct eapol_key *eapol_create_gtk_2_of_2(
 	return step2;
 }
 
+struct eapol_key *eapol_create_ptk_2_of_4(
+				enum eapol_protocol_version protocol,
+				enum eapol_key_descriptor_version version,
+				uint64_t key_replay_counter,
+				const uint8_t snonce[],
+				size_t extra_len,
+				const uint8_t *extra_data,
+				bool is_wpa,
+				size_t mic_len)
+{
+	return eapol_build_ptk_2_of_4(
+			l_malloc(EAPOL_KEY_TX_LEN(mic_len, extra_len)),
+			protocol, version, key_replay_counter, snonce,
+			extra_len, extra_data, is_wpa, mic_len);
+}
+
+struct eapol_key *eapol_create_ptk_4_of_4(
+				enum eapol_protocol_version protocol,
+				enum eapol_key_descriptor_version version,
+				uint64_t key_replay_counter,
+				bool is_wpa,
+				size_t mic_len)
+{
+	return eapol_build_ptk_4_of_4(l_malloc(EAPOL_KEY_TX_LEN(mic_len, 0)),
+					protocol, version, key_replay_counter,
+					is_wpa, mic_len);
+}
+
+struct eapol_key *eapol_create_gtk_2_of_2(
+				enum eapol_protocol_version protocol,
+				enum eapol_key_descriptor_version version,
+				uint64_t key_replay_counter,
+				bool is_wpa, uint8_t wpa_key_id, size_t mic_len)
+{
+	return eapol_build_gtk_2_of_2(l_malloc(EAPOL_KEY_TX_LEN(mic_len, 0)),
+					protocol, version, key_replay_counter,
+					is_wpa, wpa_key_id, mic_len);
+}
+
 struct eapol_frame_watch {
 	uint32_t ifindex;
 	struct watchlist_item super;
@@ -822,6 +930,39 @@ static bool eapol_frame_watch_remove(uint32_t id)
 	return watchlist_remove(&frame_watches, id);
 }
 
+/*
+ * Registered state machines are looked up by the interface and the address
+ * of the peer, i.e. the AA for a supplicant and the SPA for an authenticator,
+ * so that frame dispatch doesn't depend on the number of stations on an AP.
+ * The role is part of the key since in IBSS both run against the same peer.
+ */
+struct eapol_sm_key {
+	uint32_t ifindex;
+	uint8_t addr[6];
+	bool authenticator;
+};
+
+static unsigned int eapol_sm_key_hash(const void *p)
+{
+	const struct eapol_sm_key *key = p;
+
+	return util_address_hash(key->addr) ^ key->ifindex ^ key->authenticator;
+}
+
+static int eapol_sm_key_compare(const void *a, const void *b)
+{
+	const struct eapol_sm_key *key_a = a;
+	const struct eapol_sm_key *key_b = b;
+
+	if (key_a->ifindex != key_b->ifindex)
+		return key_a->ifindex < key_b->ifindex ? -1 : 1;
+
+	if (key_a->authenticator != key_b->authenticator)
+		return key_a->authenticator ? 1 : -1;
+
+	return memcmp(key_a->addr, key_b->addr, sizeof(key_a->addr));
+}
+
 struct eapol_sm {
 	struct handshake_state *handshake;
 	enum eapol_protocol_version protocol_version;
@@ -837,10 +978,12 @@ struct eapol_sm {
 	bool require_handshake:1;
 	bool eap_exchanged:1;
 	bool last_eap_unencrypted:1;
+	bool gtk_ack_pending:1;
 	struct eap_state *eap;
 	struct eapol_frame *early_frame;
 	bool early_frame_unencrypted : 1;
-	uint32_t watch_id;
+	bool indexed : 1;
+	struct eapol_sm_key index_key;
 	uint8_t installed_gtk_len;
 	uint8_t installed_gtk[CRYPTO_MAX_GTK_LEN];
 	uint8_t installed_igtk_len;
@@ -860,13 +1003,12 @@ static void eapol_sm_destroy(void *value)
 
 	l_free(sm->early_frame);
 
-	eapol_frame_watch_remove(sm->watch_id);
-
 	sm->installed_gtk_len = 0;
 	explicit_bzero(sm->installed_gtk, sizeof(sm->installed_gtk));
 	sm->installed_igtk_len = 0;
 	explicit_bzero(sm->installed_igtk, sizeof(sm->installed_igtk));
 
+	IWD_COUNTER_DEC(eapol_sm);
 	l_free(sm);
 }
 
@@ -875,6 +1017,7 @@ struct eapol_sm *eapol_sm_new(struct handshake_state *hs)
 	struct eapol_sm *sm;
 
 	sm = l_new(struct eapol_sm, 1);
+	IWD_COUNTER_INC(eapol_sm);
 
 	sm->handshake = hs;
 
@@ -886,9 +1029,41 @@ struct eapol_sm *eapol_sm_new(struct handshake_state *hs)
 	return sm;
 }
 
+static bool eapol_sm_match_key(const void *a, const void *b)
+{
+	const struct eapol_sm *sm = a;
+
+	return !eapol_sm_key_compare(&sm->index_key, b);
+}
+
+static void eapol_sm_unindex(struct eapol_sm *sm)
+{
+	struct eapol_sm *other;
+
+	if (!sm->indexed)
+		return;
+
+	sm->indexed = false;
+
+	if (l_hashmap_lookup(sm_index, &sm->index_key) != sm)
+		return;
+
+	l_hashmap_remove(sm_index, &sm->index_key);
+
+	/*
+	 * Another state machine may have been registered for the same peer,
+	 * fall back to the most recent one, same as the linear lookup did.
+	 */
+	other = l_queue_find(state_machines, eapol_sm_match_key,
+				&sm->index_key);
+	if (other)
+		l_hashmap_insert(sm_index, &other->index_key, other);
+}
+
 void eapol_sm_free(struct eapol_sm *sm)
 {
 	l_queue_remove(state_machines, sm);
+	eapol_sm_unindex(sm);
 
 	eapol_sm_destroy(sm);
 }
@@ -913,6 +1088,73 @@ static void eapol_sm_write(struct eapol_sm *sm, const struct eapol_frame *ef,
 				noencrypt);
 }
 
+/*
+ * The KCK only changes with the PTK, so the keyed MIC object is kept with
+ * the handshake and reused for every EAPoL-Key frame of the PTKSA, group
+ * key handshakes and rekeys included, instead of setting up a new keyed
+ * hash per frame.  It is rebuilt whenever the KCK or algorithm changes.
+ */
+static struct l_checksum *eapol_sm_mic_checksum(struct eapol_sm *sm,
+						const struct eapol_key *frame)
+{
+	struct handshake_state *hs = sm->handshake;
+	const uint8_t *kck = handshake_state_get_kck(hs);
+	enum l_checksum_type type;
+	size_t kck_len;
+
+	if (!eapol_mic_algorithm(hs->akm_suite, frame->key_descriptor_version,
+					sm->mic_len, &type, &kck_len))
+		return NULL;
+
+	if (hs->kck_checksum && hs->kck_checksum_type == (int) type &&
+			hs->kck_checksum_key_len == kck_len &&
+			!memcmp(hs->kck_checksum_key, kck, kck_len)) {
+		l_checksum_reset(hs->kck_checksum);
+		return hs->kck_checksum;
+	}
+
+	l_checksum_free(hs->kck_checksum);
+	explicit_bzero(hs->kck_checksum_key, sizeof(hs->kck_checksum_key));
+
+	hs->kck_checksum = eapol_mic_checksum_new(type, kck, kck_len);
+	if (!hs->kck_checksum)
+		return NULL;
+
+	hs->kck_checksum_type = type;
+	hs->kck_checksum_key_len = kck_len;
+	memcpy(hs->kck_checksum_key, kck, kck_len);
+
+	return hs->kck_checksum;
+}
+
+/* As eapol_calculate_mic, with the handshake's cached KCK checksum */
+static bool eapol_sm_calculate_mic(struct eapol_sm *sm,
+					const struct eapol_key *frame,
+					uint8_t *mic)
+{
+	struct l_checksum *checksum = eapol_sm_mic_checksum(sm, frame);
+
+	if (!checksum)
+		return false;
+
+	l_checksum_update(checksum, frame, EAPOL_FRAME_LEN(sm->mic_len) +
+				EAPOL_KEY_DATA_LEN(frame, sm->mic_len));
+	l_checksum_get_digest(checksum, mic, sm->mic_len);
+
+	return true;
+}
+
+static bool eapol_sm_verify_mic(struct eapol_sm *sm,
+				const struct eapol_key *frame)
+{
+	struct l_checksum *checksum = eapol_sm_mic_checksum(sm, frame);
+
+	if (!checksum)
+		return false;
+
+	return eapol_mic_check(checksum, frame, sm->mic_len);
+}
+
 static inline void handshake_failed(struct eapol_sm *sm, uint16_t reason_code)
 {
 	handshake_event(sm->handshake, HANDSHAKE_EVENT_FAILED, reason_code);
@@ -927,6 +1169,7 @@ static void eapol_timeout(struct l_timeout *timeout, void *user_data)
 	l_timeout_remove(sm->timeout);
 	sm->timeout = NULL;
 
+	METRICS_INC(eapol_timeouts);
 	handshake_failed(sm, MMPDU_REASON_CODE_4WAY_HANDSHAKE_TIMEOUT);
 }
 
@@ -1089,10 +1332,14 @@ static void eapol_ptk_1_of_4_retry(struct l_timeout *timeout, void *user_data)
 	struct eapol_sm *sm = user_data;
 
 	if (sm->frame_retry >= 3) {
+		METRICS_INC(eapol_timeouts);
 		handshake_failed(sm, MMPDU_REASON_CODE_4WAY_HANDSHAKE_TIMEOUT);
 		return;
 	}
 
+	if (timeout)
+		METRICS_INC(handshake_retries);
+
 	eapol_send_ptk_1_of_4(sm);
 
 	eapol_set_key_timeout(sm, eapol_ptk_1_of_4_retry);
@@ -1102,10 +1349,10 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 					const struct eapol_key *ek,
 					bool unencrypted)
 {
-	const uint8_t *kck;
 	struct eapol_key *step2;
 	uint8_t mic[MIC_MAXLEN];
 	uint8_t ies[512];
+	uint8_t frame_buf[EAPOL_KEY_TX_LEN(MIC_MAXLEN, sizeof(ies))];
 	size_t ies_len;
 	const uint8_t *own_ie = sm->handshake->supplicant_ie;
 	const uint8_t *pmkid;
@@ -1116,6 +1363,9 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 	if (!eapol_verify_ptk_1_of_4(ek, sm->mic_len))
 		goto error_unspecified;
 
+	if (!sm->handshake->ptk_start_time)
+		sm->handshake->ptk_start_time = l_time_now();
+
 	pmkid = handshake_util_find_pmkid_kde(EAPOL_KEY_DATA(ek, sm->mic_len),
 					EAPOL_KEY_DATA_LEN(ek, sm->mic_len));
 
@@ -1138,17 +1388,31 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 		bool found = false;
 		int i;
 
-		if (!pmkid)
-			goto error_unspecified;
-
-		for (i = 0; i < rsn_info.num_pmkids; i++)
+		for (i = 0; pmkid && i < rsn_info.num_pmkids; i++)
 			if (!memcmp(rsn_info.pmkids + i * 16, pmkid, 16)) {
 				found = true;
 				break;
 			}
 
-		if (!found)
+		if (!found) {
+			/*
+			 * The authenticator no longer holds the PMKSA we
+			 * offered, forget it and fall back to a full EAP
+			 * authentication if possible.
+			 */
+			pmksa_cache_remove(sm->handshake->spa,
+						sm->handshake->aa,
+						sm->handshake->ssid,
+						sm->handshake->ssid_len);
+
+			if (sm->eap) {
+				l_debug("PMKSA not accepted, starting EAP");
+				__send_eapol_start(sm, unencrypted);
+				return;
+			}
+
 			goto error_unspecified;
+		}
 	} else if (pmkid) {
 		uint8_t own_pmkid[16];
 
@@ -1232,6 +1496,14 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 		memcpy(ies, own_ie, ies_len);
 	}
 
+	/* Repeat the RSNXE we sent in the (Re)Association Request, if any */
+	if (sm->handshake->supplicant_rsnxe) {
+		const uint8_t *rsnxe = sm->handshake->supplicant_rsnxe;
+
+		memcpy(ies + ies_len, rsnxe, rsnxe[1] + 2);
+		ies_len += rsnxe[1] + 2;
+	}
+
 	if (sm->handshake->support_ip_allocation) {
 		/* Wi-Fi P2P Technical Specification v1.7 Table 58 */
 		ies[ies_len++] = IE_TYPE_VENDOR_SPECIFIC;
@@ -1241,20 +1513,17 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 		ies[ies_len++] = 0x01;
 	}
 
-	step2 = eapol_create_ptk_2_of_4(sm->protocol_version,
+	step2 = eapol_build_ptk_2_of_4((struct eapol_key *) frame_buf,
+					sm->protocol_version,
 					ek->key_descriptor_version,
 					L_BE64_TO_CPU(ek->key_replay_counter),
 					sm->handshake->snonce, ies_len, ies,
 					sm->handshake->wpa_ie, sm->mic_len);
 
-	kck = handshake_state_get_kck(sm->handshake);
-
 	if (sm->mic_len) {
-		if (!eapol_calculate_mic(sm->handshake->akm_suite, kck,
-				step2, mic, sm->mic_len)) {
+		if (!eapol_sm_calculate_mic(sm, step2, mic)) {
 			l_info("MIC calculation failed. "
 				"Ensure Kernel Crypto is available.");
-			l_free(step2);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 
 			return;
@@ -1267,14 +1536,12 @@ static void eapol_handle_ptk_1_of_4(struct eapol_sm *sm,
 				handshake_state_get_kek_len(sm->handshake),
 				step2, ies, ies_len)) {
 			l_debug("AES-SIV encryption failed");
-			l_free(step2);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 			return;
 		}
 	}
 
 	eapol_sm_write(sm, (struct eapol_frame *) step2, unencrypted);
-	l_free(step2);
 
 	l_timeout_remove(sm->eapol_start_timeout);
 	sm->eapol_start_timeout = NULL;
@@ -1299,7 +1566,6 @@ static void eapol_send_ptk_3_of_4(struct eapol_sm *sm)
 				sm->handshake->pairwise_cipher);
 	enum crypto_cipher group_cipher = ie_rsn_cipher_suite_to_cipher(
 				sm->handshake->group_cipher);
-	const uint8_t *kck;
 	const uint8_t *kek;
 
 	sm->replay_counter++;
@@ -1365,10 +1631,7 @@ static void eapol_send_ptk_3_of_4(struct eapol_sm *sm)
 	ek->header.packet_len = L_CPU_TO_BE16(EAPOL_FRAME_LEN(sm->mic_len) +
 				key_data_len - 4);
 
-	kck = handshake_state_get_kck(sm->handshake);
-
-	if (!eapol_calculate_mic(sm->handshake->akm_suite, kck, ek,
-			EAPOL_KEY_MIC(ek), sm->mic_len))
+	if (!eapol_sm_calculate_mic(sm, ek, EAPOL_KEY_MIC(ek)))
 		return;
 
 	l_debug("STA: "MAC" retries=%u", MAC_STR(sm->handshake->spa),
@@ -1377,16 +1640,82 @@ static void eapol_send_ptk_3_of_4(struct eapol_sm *sm)
 	eapol_sm_write(sm, (struct eapol_frame *) ek, false);
 }
 
+/*
+ * Send a Group Key Handshake Message 1 of 2 to the Supplicant.  The caller
+ * is expected to rekey many stations at once with the same GTK so it builds
+ * the plaintext Key Data (GTK KDE) only once and we only wrap it with this
+ * station's KEK.  Retransmissions are left to the caller.
+ */
+bool eapol_sm_send_gtk_1_of_2(struct eapol_sm *sm, const uint8_t *key_data,
+				size_t key_data_len, const uint8_t *gtk_rsc)
+{
+	uint8_t frame_buf[512];
+	uint8_t key_data_buf[128];
+	struct eapol_key *ek = (struct eapol_key *) frame_buf;
+	const uint8_t *kek;
+	int encrypted_len;
+
+	if (!sm->handshake->authenticator || !sm->handshake->ptk_complete)
+		return false;
+
+	if (key_data_len > sizeof(key_data_buf) - 16)
+		return false;
+
+	sm->replay_counter++;
+
+	memset(ek, 0, EAPOL_FRAME_LEN(sm->mic_len));
+	ek->header.protocol_version = sm->protocol_version;
+	ek->header.packet_type = 0x3;
+	ek->descriptor_type = EAPOL_DESCRIPTOR_TYPE_80211;
+	ek->key_descriptor_version = EAPOL_KEY_DESCRIPTOR_VERSION_HMAC_SHA1_AES;
+	ek->key_type = false;
+	ek->key_ack = true;
+	ek->key_mic = true;
+	ek->secure = true;
+	ek->encrypted_key_data = true;
+	ek->key_replay_counter = L_CPU_TO_BE64(sm->replay_counter);
+
+	if (gtk_rsc)
+		memcpy(ek->key_rsc, gtk_rsc, 6);
+
+	memcpy(key_data_buf, key_data, key_data_len);
+
+	kek = handshake_state_get_kek(sm->handshake);
+	encrypted_len = eapol_encrypt_key_data(kek, key_data_buf, key_data_len,
+						ek, sm->mic_len);
+	explicit_bzero(key_data_buf, sizeof(key_data_buf));
+
+	if (encrypted_len < 0)
+		return false;
+
+	ek->header.packet_len = L_CPU_TO_BE16(EAPOL_FRAME_LEN(sm->mic_len) +
+				encrypted_len - 4);
+
+	if (!eapol_sm_calculate_mic(sm, ek, EAPOL_KEY_MIC(ek)))
+		return false;
+
+	l_debug("STA: "MAC, MAC_STR(sm->handshake->spa));
+
+	sm->gtk_ack_pending = true;
+	eapol_sm_write(sm, (struct eapol_frame *) ek, false);
+
+	return true;
+}
+
 static void eapol_ptk_3_of_4_retry(struct l_timeout *timeout,
 						void *user_data)
 {
 	struct eapol_sm *sm = user_data;
 
 	if (sm->frame_retry >= EAPOL_PAIRWISE_UPDATE_COUNT) {
+		METRICS_INC(eapol_timeouts);
 		handshake_failed(sm, MMPDU_REASON_CODE_4WAY_HANDSHAKE_TIMEOUT);
 		return;
 	}
 
+	if (timeout)
+		METRICS_INC(handshake_retries);
+
 	eapol_send_ptk_3_of_4(sm);
 
 	eapol_set_key_timeout(sm, eapol_ptk_3_of_4_retry);
@@ -1394,59 +1723,47 @@ static void eapol_ptk_3_of_4_retry(struct l_timeout *timeout,
 	l_debug("attempt %i", sm->frame_retry);
 }
 
-static const uint8_t *eapol_find_rsne(const uint8_t *data, size_t data_len,
-				const uint8_t **optional)
+static const uint8_t *eapol_find_rsne(const struct ie_index *index,
+					const uint8_t **optional)
 {
 	struct ie_tlv_iter iter;
-	const uint8_t *first = NULL;
 
-	ie_tlv_iter_init(&iter, data, data_len);
+	if (!ie_index_iter_init(index, IE_TYPE_RSN, &iter))
+		return NULL;
+
+	if (!optional || ie_index_count(index, IE_TYPE_RSN) < 2)
+		return ie_tlv_iter_get_data(&iter) - 2;
 
 	while (ie_tlv_iter_next(&iter)) {
 		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_RSN)
 			continue;
 
-		if (!first) {
-			first = ie_tlv_iter_get_data(&iter) - 2;
-			continue;
-		}
-
-		if (optional)
-			*optional = ie_tlv_iter_get_data(&iter) - 2;
-
-		return first;
+		*optional = ie_tlv_iter_get_data(&iter) - 2;
+		break;
 	}
 
-	return first;
+	return ie_index_find(index, IE_TYPE_RSN);
 }
 
-static const uint8_t *eapol_find_wfa_kde(const uint8_t *data, size_t data_len,
-					uint8_t oi_type)
+static const uint8_t *eapol_find_wfa_kde(const struct ie_index *index,
+						uint8_t oi_type)
 {
-	struct ie_tlv_iter iter;
-
-	ie_tlv_iter_init(&iter, data, data_len);
-
-	while (ie_tlv_iter_next(&iter)) {
-		if (ie_tlv_iter_get_tag(&iter) == IE_TYPE_VENDOR_SPECIFIC) {
-			if (!is_ie_wfa_ie(iter.data, iter.len, oi_type))
-				continue;
-		} else
-			continue;
+	const uint8_t *ie = ie_index_find_vendor(index, wifi_alliance_oui,
+							oi_type);
 
-		return ie_tlv_iter_get_data(&iter) - 2;
-	}
+	if (!ie || !is_ie_wfa_ie(ie + 2, ie[1], oi_type))
+		return NULL;
 
-	return NULL;
+	return ie;
 }
 
 /* 802.11-2016 Section 12.7.6.3 */
 static void eapol_handle_ptk_2_of_4(struct eapol_sm *sm,
 					const struct eapol_key *ek)
 {
+	struct ie_index index;
 	const uint8_t *rsne;
 	size_t ptk_size;
-	const uint8_t *kck;
 	const uint8_t *aa = sm->handshake->aa;
 
 	l_debug("ifindex=%u", sm->handshake->ifindex);
@@ -1467,18 +1784,17 @@ static void eapol_handle_ptk_2_of_4(struct eapol_sm *sm,
 					L_CHECKSUM_SHA1))
 		return;
 
-	kck = handshake_state_get_kck(sm->handshake);
-
-	if (!eapol_verify_mic(sm->handshake->akm_suite, kck, ek,
-					sm->mic_len))
+	if (!eapol_sm_verify_mic(sm, ek))
 		return;
 
 	/*
 	 * 12.7.6.3 b) 2) "the Authenticator checks that the RSNE bitwise
 	 * matches that from the (Re)Association Request frame.
 	 */
-	rsne = eapol_find_rsne(EAPOL_KEY_DATA(ek, sm->mic_len),
-				EAPOL_KEY_DATA_LEN(ek, sm->mic_len), NULL);
+	ie_index_init(&index, EAPOL_KEY_DATA(ek, sm->mic_len),
+				EAPOL_KEY_DATA_LEN(ek, sm->mic_len));
+
+	rsne = eapol_find_rsne(&index, NULL);
 	if (!rsne || rsne[1] != sm->handshake->supplicant_ie[1] ||
 			memcmp(rsne + 2, sm->handshake->supplicant_ie + 2,
 				rsne[1])) {
@@ -1487,9 +1803,7 @@ static void eapol_handle_ptk_2_of_4(struct eapol_sm *sm,
 	}
 
 	if (sm->handshake->support_ip_allocation) {
-		const uint8_t *ip_req_kde =
-			eapol_find_wfa_kde(EAPOL_KEY_DATA(ek, sm->mic_len),
-					EAPOL_KEY_DATA_LEN(ek, sm->mic_len),
+		const uint8_t *ip_req_kde = eapol_find_wfa_kde(&index,
 					HANDSHAKE_KDE_IP_ADDRESS_REQ & 255);
 
 		if (ip_req_kde &&
@@ -1511,22 +1825,14 @@ static void eapol_handle_ptk_2_of_4(struct eapol_sm *sm,
 	eapol_ptk_3_of_4_retry(NULL, sm);
 }
 
-static const uint8_t *eapol_find_wpa_ie(const uint8_t *data, size_t data_len)
+static const uint8_t *eapol_find_wpa_ie(const struct ie_index *index)
 {
-	struct ie_tlv_iter iter;
-
-	ie_tlv_iter_init(&iter, data, data_len);
-
-	while (ie_tlv_iter_next(&iter)) {
-		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_VENDOR_SPECIFIC)
-			continue;
+	const uint8_t *ie = ie_index_find_vendor(index, microsoft_oui, 1);
 
-		if (is_ie_wpa_ie(ie_tlv_iter_get_data(&iter),
-				ie_tlv_iter_get_length(&iter)))
-			return ie_tlv_iter_get_data(&iter) - 2;
-	}
+	if (!ie || !is_ie_wpa_ie(ie + 2, ie[1]))
+		return NULL;
 
-	return NULL;
+	return ie;
 }
 
 static bool eapol_check_ip_mask(const uint8_t *mask,
@@ -1551,6 +1857,38 @@ static bool eapol_check_ip_mask(const uint8_t *mask,
 		(uint32_t) (mask_uint << __builtin_popcountl(mask_uint)) == 0;
 }
 
+/*
+ * Remember the PMKSA once the 4-Way Handshake has proven that both sides
+ * hold the PMK, a later association to the same BSS can then offer the
+ * PMKID and skip EAP.
+ */
+static void eapol_pmksa_cache_put(struct eapol_sm *sm)
+{
+	struct handshake_state *hs = sm->handshake;
+	struct pmksa pmksa;
+
+	if (hs->authenticator || hs->wpa_ie || hs->osen_ie ||
+			!hs->settings_8021x ||
+			!pmksa_akm_supported(hs->akm_suite))
+		return;
+
+	memset(&pmksa, 0, sizeof(pmksa));
+
+	if (!handshake_state_get_pmkid(hs, pmksa.pmkid))
+		return;
+
+	memcpy(pmksa.spa, hs->spa, 6);
+	memcpy(pmksa.aa, hs->aa, 6);
+	memcpy(pmksa.ssid, hs->ssid, hs->ssid_len);
+	pmksa.ssid_len = hs->ssid_len;
+	pmksa.akm = hs->akm_suite;
+	memcpy(pmksa.pmk, hs->pmk, hs->pmk_len);
+	pmksa.pmk_len = hs->pmk_len;
+
+	pmksa_cache_put(&pmksa);
+	explicit_bzero(&pmksa, sizeof(pmksa));
+}
+
 static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 					const struct eapol_key *ek,
 					const uint8_t *decrypted_key_data,
@@ -1561,10 +1899,12 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 	const uint8_t *kek;
 	struct eapol_key *step4;
 	uint8_t mic[MIC_MAXLEN];
+	uint8_t frame_buf[EAPOL_KEY_TX_LEN(MIC_MAXLEN, 0)];
 	const uint8_t *gtk = NULL;
 	size_t gtk_len;
 	const uint8_t *igtk = NULL;
 	size_t igtk_len;
+	struct ie_index index;
 	const uint8_t *rsne;
 	const uint8_t *optional_rsne = NULL;
 	uint8_t gtk_key_index;
@@ -1593,17 +1933,14 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 	 * not identical to that the STA received in the Beacon or Probe
 	 * Response frame, the STA shall disassociate.
 	 */
+	ie_index_init(&index, decrypted_key_data, decrypted_key_data_size);
+
 	if (sm->handshake->wpa_ie)
-		rsne = eapol_find_wpa_ie(decrypted_key_data,
-					decrypted_key_data_size);
+		rsne = eapol_find_wpa_ie(&index);
 	else if (sm->handshake->osen_ie)
-		rsne = eapol_find_wfa_kde(decrypted_key_data,
-					decrypted_key_data_size,
-					IE_WFA_OI_OSEN);
+		rsne = eapol_find_wfa_kde(&index, IE_WFA_OI_OSEN);
 	else
-		rsne = eapol_find_rsne(decrypted_key_data,
-					decrypted_key_data_size,
-					&optional_rsne);
+		rsne = eapol_find_rsne(&index, &optional_rsne);
 
 	if (!rsne)
 		goto error_ie_different;
@@ -1612,14 +1949,30 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 						sm->handshake->wpa_ie))
 		goto error_ie_different;
 
+	/*
+	 * 802.11-2020, Section 12.7.6.4: the RSNXE must match the one seen in
+	 * the Beacon or Probe Response, or be absent if there was none there.
+	 */
+	if (!sm->handshake->wpa_ie && !sm->handshake->osen_ie) {
+		const uint8_t *rsnxe = ie_index_find(&index, IE_TYPE_RSNX);
+		const uint8_t *ap_rsnxe = sm->handshake->authenticator_rsnxe;
+
+		if (!rsnxe != !ap_rsnxe)
+			goto error_ie_different;
+
+		if (rsnxe && (rsnxe[1] != ap_rsnxe[1] ||
+				memcmp(rsnxe + 2, ap_rsnxe + 2, rsnxe[1])))
+			goto error_ie_different;
+	}
+
 	if (sm->handshake->akm_suite &
 			(IE_RSN_AKM_SUITE_FT_OVER_8021X |
 			 IE_RSN_AKM_SUITE_FT_USING_PSK |
 			 IE_RSN_AKM_SUITE_FT_OVER_SAE_SHA256)) {
-		struct ie_tlv_iter iter;
 		struct ie_rsn_info ie_info;
 		const uint8_t *mde = sm->handshake->mde;
 		const uint8_t *fte = sm->handshake->fte;
+		const uint8_t *ie;
 
 		if (ie_parse_rsne_from_data(rsne, rsne[1] + 2, &ie_info) < 0)
 			goto error_ie_different;
@@ -1628,25 +1981,13 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 						sm->handshake->pmk_r1_name, 16))
 			goto error_ie_different;
 
-		ie_tlv_iter_init(&iter, decrypted_key_data,
-					decrypted_key_data_size);
-
-		while (ie_tlv_iter_next(&iter))
-			switch (ie_tlv_iter_get_tag(&iter)) {
-			case IE_TYPE_MOBILITY_DOMAIN:
-				if (memcmp(ie_tlv_iter_get_data(&iter) - 2,
-						mde, mde[1] + 2))
-					goto error_ie_different;
-
-				break;
-
-			case IE_TYPE_FAST_BSS_TRANSITION:
-				if (memcmp(ie_tlv_iter_get_data(&iter) - 2,
-						fte, fte[1] + 2))
-					goto error_ie_different;
+		ie = ie_index_find(&index, IE_TYPE_MOBILITY_DOMAIN);
+		if (ie && memcmp(ie, mde, mde[1] + 2))
+			goto error_ie_different;
 
-				break;
-			}
+		ie = ie_index_find(&index, IE_TYPE_FAST_BSS_TRANSITION);
+		if (ie && memcmp(ie, fte, fte[1] + 2))
+			goto error_ie_different;
 	}
 
 	/*
@@ -1655,8 +1996,10 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 	 * and we wouldn't get here.  Skip processing the rest of the message
 	 * and send our reply.  Do not install the keys again.
 	 */
-	if (sm->handshake->ptk_complete)
+	if (sm->handshake->ptk_complete) {
+		METRICS_INC(handshake_retries);
 		goto retransmit;
+	}
 
 	/*
 	 * 11.6.6.4: "If a second RSNE is provided in the message, the
@@ -1746,9 +2089,7 @@ static void eapol_handle_ptk_3_of_4(struct eapol_sm *sm,
 		igtk = NULL;
 
 	if (sm->handshake->support_ip_allocation) {
-		const uint8_t *ip_alloc_kde =
-			eapol_find_wfa_kde(decrypted_key_data,
-					decrypted_key_data_size,
+		const uint8_t *ip_alloc_kde = eapol_find_wfa_kde(&index,
 					HANDSHAKE_KDE_IP_ADDRESS_ALLOC & 255);
 
 		if (ip_alloc_kde &&
@@ -1787,7 +2128,8 @@ retransmit:
 	sm->replay_counter = L_BE64_TO_CPU(ek->key_replay_counter);
 	sm->have_replay = true;
 
-	step4 = eapol_create_ptk_4_of_4(sm->protocol_version,
+	step4 = eapol_build_ptk_4_of_4((struct eapol_key *) frame_buf,
+					sm->protocol_version,
 					ek->key_descriptor_version,
 					sm->replay_counter,
 					sm->handshake->wpa_ie, sm->mic_len);
@@ -1796,10 +2138,8 @@ retransmit:
 	kek = handshake_state_get_kek(sm->handshake);
 
 	if (sm->mic_len) {
-		if (!eapol_calculate_mic(sm->handshake->akm_suite, kck,
-				step4, mic, sm->mic_len)) {
+		if (!eapol_sm_calculate_mic(sm, step4, mic)) {
 			l_debug("MIC Calculation failed");
-			l_free(step4);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 			return;
 		}
@@ -1811,14 +2151,12 @@ retransmit:
 				handshake_state_get_kek_len(sm->handshake),
 				step4, NULL, 0)) {
 			l_debug("AES-SIV encryption failed");
-			l_free(step4);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 			return;
 		}
 	}
 
 	eapol_sm_write(sm, (struct eapol_frame *) step4, unencrypted);
-	l_free(step4);
 
 	if (sm->handshake->ptk_complete)
 		return;
@@ -1838,6 +2176,7 @@ retransmit:
 	if (igtk)
 		eapol_install_igtk(sm, igtk_key_index, igtk, igtk_len);
 
+	eapol_pmksa_cache_put(sm);
 	handshake_state_install_ptk(sm->handshake);
 
 	if (rekey_offload)
@@ -1857,7 +2196,6 @@ error_ie_different:
 static void eapol_handle_ptk_4_of_4(struct eapol_sm *sm,
 					const struct eapol_key *ek)
 {
-	const uint8_t *kck;
 
 	l_debug("ifindex=%u", sm->handshake->ifindex);
 
@@ -1867,10 +2205,7 @@ static void eapol_handle_ptk_4_of_4(struct eapol_sm *sm,
 	if (L_BE64_TO_CPU(ek->key_replay_counter) != sm->replay_counter)
 		return;
 
-	kck = handshake_state_get_kck(sm->handshake);
-
-	if (!eapol_verify_mic(sm->handshake->akm_suite, kck, ek,
-				sm->mic_len))
+	if (!eapol_sm_verify_mic(sm, ek))
 		return;
 
 	l_timeout_remove(sm->timeout);
@@ -1887,15 +2222,37 @@ static void eapol_handle_ptk_4_of_4(struct eapol_sm *sm,
 	sm->handshake->ptk_complete = true;
 }
 
+static void eapol_handle_gtk_2_of_2(struct eapol_sm *sm,
+					const struct eapol_key *ek)
+{
+
+	l_debug("ifindex=%u", sm->handshake->ifindex);
+
+	if (!sm->gtk_ack_pending)
+		return;
+
+	if (!eapol_verify_gtk_2_of_2(ek, false))
+		return;
+
+	if (L_BE64_TO_CPU(ek->key_replay_counter) != sm->replay_counter)
+		return;
+
+	if (!eapol_sm_verify_mic(sm, ek))
+		return;
+
+	sm->gtk_ack_pending = false;
+	handshake_event(sm->handshake, HANDSHAKE_EVENT_REKEY_COMPLETE);
+}
+
 static void eapol_handle_gtk_1_of_2(struct eapol_sm *sm,
 					const struct eapol_key *ek,
 					const uint8_t *decrypted_key_data,
 					size_t decrypted_key_data_size,
 					bool unencrypted)
 {
-	const uint8_t *kck;
 	struct eapol_key *step2;
 	uint8_t mic[MIC_MAXLEN];
+	uint8_t frame_buf[EAPOL_KEY_TX_LEN(MIC_MAXLEN, 0)];
 	const uint8_t *gtk;
 	size_t gtk_len;
 	uint8_t gtk_key_index;
@@ -1960,19 +2317,16 @@ static void eapol_handle_gtk_1_of_2(struct eapol_sm *sm,
 	sm->replay_counter = L_BE64_TO_CPU(ek->key_replay_counter);
 	sm->have_replay = true;
 
-	step2 = eapol_create_gtk_2_of_2(sm->protocol_version,
+	step2 = eapol_build_gtk_2_of_2((struct eapol_key *) frame_buf,
+					sm->protocol_version,
 					ek->key_descriptor_version,
 					sm->replay_counter,
 					sm->handshake->wpa_ie, ek->wpa_key_id,
 					sm->mic_len);
 
-	kck = handshake_state_get_kck(sm->handshake);
-
 	if (sm->mic_len) {
-		if (!eapol_calculate_mic(sm->handshake->akm_suite, kck,
-				step2, mic, sm->mic_len)) {
+		if (!eapol_sm_calculate_mic(sm, step2, mic)) {
 			l_debug("MIC calculation failed");
-			l_free(step2);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 			return;
 		}
@@ -1984,14 +2338,12 @@ static void eapol_handle_gtk_1_of_2(struct eapol_sm *sm,
 				handshake_state_get_kek_len(sm->handshake),
 				step2, NULL, 0)) {
 			l_debug("AES-SIV encryption failed");
-			l_free(step2);
 			handshake_failed(sm, MMPDU_REASON_CODE_UNSPECIFIED);
 			return;
 		}
 	}
 
 	eapol_sm_write(sm, (struct eapol_frame *) step2, unencrypted);
-	l_free(step2);
 
 	eapol_install_gtk(sm, gtk_key_index, gtk, gtk_len, ek->key_rsc);
 
@@ -1999,25 +2351,76 @@ static void eapol_handle_gtk_1_of_2(struct eapol_sm *sm,
 		eapol_install_igtk(sm, igtk_key_index, igtk, igtk_len);
 }
 
-static struct eapol_sm *eapol_find_sm(uint32_t ifindex, const uint8_t *aa)
+static struct eapol_sm *eapol_find_sm(uint32_t ifindex, const uint8_t *addr,
+					bool authenticator)
 {
-	const struct l_queue_entry *entry;
-	struct eapol_sm *sm;
+	struct eapol_sm_key key = {
+		.ifindex = ifindex,
+		.authenticator = authenticator,
+	};
 
-	for (entry = l_queue_get_entries(state_machines); entry;
-					entry = entry->next) {
-		sm = entry->data;
+	memcpy(key.addr, addr, sizeof(key.addr));
 
-		if (sm->handshake->ifindex != ifindex)
-			continue;
+	return l_hashmap_lookup(sm_index, &key);
+}
 
-		if (memcmp(sm->handshake->aa, aa, ETH_ALEN))
-			continue;
+static void eapol_key_dispatch(struct eapol_sm *sm,
+				const struct eapol_key *ek,
+				const uint8_t *decrypted_key_data,
+				size_t key_data_len, bool unencrypted)
+{
+	if (ek->key_type == 0) {
+		/* GTK handshake allowed only after PTK handshake complete */
+		if (!sm->handshake->ptk_complete)
+			return;
 
-		return sm;
+		if (sm->handshake->group_cipher ==
+				IE_RSN_CIPHER_SUITE_NO_GROUP_TRAFFIC)
+			return;
+
+		if (!decrypted_key_data)
+			return;
+
+		eapol_handle_gtk_1_of_2(sm, ek, decrypted_key_data,
+					key_data_len, unencrypted);
+		return;
 	}
 
-	return NULL;
+	/* If no MIC, then assume packet 1, otherwise packet 3 */
+	if (!ek->key_mic && !ek->encrypted_key_data)
+		eapol_handle_ptk_1_of_4(sm, ek, unencrypted);
+	else {
+		if (!key_data_len)
+			return;
+
+		eapol_handle_ptk_3_of_4(sm, ek,
+					decrypted_key_data ?:
+					EAPOL_KEY_DATA(ek, sm->mic_len),
+					key_data_len, unencrypted);
+	}
+}
+
+/*
+ * The Key Data is unwrapped into a stack buffer sized for the frame, the
+ * plaintext is never longer than the ciphertext, and wiped once handled.
+ */
+static void eapol_key_handle_encrypted(struct eapol_sm *sm,
+					const struct eapol_key *ek,
+					size_t len, bool unencrypted)
+{
+	uint8_t decrypted_key_data[len];
+	size_t key_data_len;
+
+	if (!eapol_decrypt_key_data_to(sm->handshake->akm_suite,
+				handshake_state_get_kek(sm->handshake), ek,
+				decrypted_key_data, &key_data_len,
+				sm->mic_len))
+		return;
+
+	eapol_key_dispatch(sm, ek, decrypted_key_data, key_data_len,
+				unencrypted);
+
+	explicit_bzero(decrypted_key_data, len);
 }
 
 static void eapol_key_handle(struct eapol_sm *sm,
@@ -2025,10 +2428,6 @@ static void eapol_key_handle(struct eapol_sm *sm,
 				bool unencrypted)
 {
 	const struct eapol_key *ek;
-	const uint8_t *kck;
-	const uint8_t *kek;
-	uint8_t *decrypted_key_data = NULL;
-	size_t key_data_len = 0;
 	uint64_t replay_counter;
 
 	ek = eapol_key_validate((const uint8_t *) frame,
@@ -2079,20 +2478,19 @@ static void eapol_key_handle(struct eapol_sm *sm,
 	if (sm->have_replay && sm->replay_counter >= replay_counter)
 		return;
 
-	kck = handshake_state_get_kck(sm->handshake);
-
 	if (ek->key_mic) {
 		/* Haven't received step 1 yet, so no ptk */
 		if (!sm->handshake->have_snonce)
 			return;
 
-		if (!eapol_verify_mic(sm->handshake->akm_suite, kck, ek,
-					sm->mic_len))
+		if (!eapol_sm_verify_mic(sm, ek))
 			return;
 	}
 
 	if ((ek->encrypted_key_data && !sm->handshake->wpa_ie) ||
 			(ek->key_type == 0 && sm->handshake->wpa_ie)) {
+		size_t len = EAPOL_KEY_DATA_LEN(ek, sm->mic_len);
+
 		/*
 		 * If using a MIC (non-FILS) but haven't received step 1 yet
 		 * we disregard since there will be no ptk
@@ -2100,51 +2498,15 @@ static void eapol_key_handle(struct eapol_sm *sm,
 		if (sm->mic_len && !sm->handshake->have_snonce)
 			return;
 
-		kek = handshake_state_get_kek(sm->handshake);
-
-		decrypted_key_data = eapol_decrypt_key_data(
-					sm->handshake->akm_suite, kek,
-					ek, &key_data_len, sm->mic_len);
-		if (!decrypted_key_data)
+		if (!len)
 			return;
-	} else
-		key_data_len = EAPOL_KEY_DATA_LEN(ek, sm->mic_len);
-
-	if (ek->key_type == 0) {
-		/* GTK handshake allowed only after PTK handshake complete */
-		if (!sm->handshake->ptk_complete)
-			goto done;
-
-		if (sm->handshake->group_cipher ==
-				IE_RSN_CIPHER_SUITE_NO_GROUP_TRAFFIC)
-			goto done;
-
-		if (!decrypted_key_data)
-			goto done;
 
-		eapol_handle_gtk_1_of_2(sm, ek, decrypted_key_data,
-					key_data_len, unencrypted);
-		goto done;
-	}
-
-	/* If no MIC, then assume packet 1, otherwise packet 3 */
-	if (!ek->key_mic && !ek->encrypted_key_data)
-		eapol_handle_ptk_1_of_4(sm, ek, unencrypted);
-	else {
-		if (!key_data_len)
-			goto done;
-
-		eapol_handle_ptk_3_of_4(sm, ek,
-					decrypted_key_data ?:
-					EAPOL_KEY_DATA(ek, sm->mic_len),
-					key_data_len, unencrypted);
+		eapol_key_handle_encrypted(sm, ek, len, unencrypted);
+		return;
 	}
 
-done:
-	if (decrypted_key_data)
-		explicit_bzero(decrypted_key_data, key_data_len);
-
-	l_free(decrypted_key_data);
+	eapol_key_dispatch(sm, ek, NULL, EAPOL_KEY_DATA_LEN(ek, sm->mic_len),
+				unencrypted);
 }
 
 /* This respresentes the eapMsg message in 802.1X Figure 8-1 */
@@ -2264,7 +2626,8 @@ static void eapol_eap_results_cb(const uint8_t *msk_data, size_t msk_len,
 	if (sm->handshake->support_fils && emsk_data && session_id)
 		erp_cache_add(eap_get_identity(sm->eap), session_id,
 				session_len, emsk_data, emsk_len,
-				(const char *)sm->handshake->ssid);
+				(const char *)sm->handshake->ssid,
+				sm->handshake->settings_8021x);
 
 	return;
 
@@ -2318,6 +2681,11 @@ static void eapol_auth_key_handle(struct eapol_sm *sm,
 	if (!sm->handshake->have_anonce)
 		return; /* Not expecting an EAPoL-Key yet */
 
+	if (!ek->key_type) {
+		eapol_handle_gtk_2_of_2(sm, ek);
+		return;
+	}
+
 	key_data_len = EAPOL_KEY_DATA_LEN(ek, sm->mic_len);
 	if (key_data_len != 0)
 		eapol_handle_ptk_2_of_4(sm, ek);
@@ -2423,6 +2791,9 @@ static void eapol_rx_packet(uint16_t proto, const uint8_t *from,
 							eapol_eap_results_cb);
 		}
 
+		if (!sm->eap_exchanged)
+			sm->handshake->eap_start_time = l_time_now();
+
 		sm->eap_exchanged = true;
 		sm->last_eap_unencrypted = unencrypted;
 
@@ -2439,8 +2810,8 @@ static void eapol_rx_packet(uint16_t proto, const uint8_t *from,
 			/*
 			 * Either this is an error (EAP negotiation in
 			 * progress) or the server is giving us a chance to
-			 * use a cached PMK.  We don't yet cache PMKs so
-			 * send an EAPOL-Start if we haven't sent one yet.
+			 * use a cached PMK.  We hold no PMKSA for this BSS
+			 * so send an EAPOL-Start if we haven't sent one yet.
 			 */
 			if (sm->eapol_start_timeout) {
 				l_timeout_remove(sm->eapol_start_timeout);
@@ -2451,6 +2822,13 @@ static void eapol_rx_packet(uint16_t proto, const uint8_t *from,
 			return;
 		}
 
+		/*
+		 * We're doing the 4-Way Handshake with a PMK we already
+		 * hold, an EAPoL-Start now would only restart EAP
+		 */
+		l_timeout_remove(sm->eapol_start_timeout);
+		sm->eapol_start_timeout = NULL;
+
 		eapol_key_handle(sm, frame, unencrypted);
 		break;
 
@@ -2464,7 +2842,7 @@ void __eapol_update_replay_counter(uint32_t ifindex, const uint8_t *spa,
 {
 	struct eapol_sm *sm;
 
-	sm = eapol_find_sm(ifindex, aa);
+	sm = eapol_find_sm(ifindex, aa, false);
 
 	if (!sm)
 		return;
@@ -2497,24 +2875,34 @@ void __eapol_set_install_pmk_func(eapol_install_pmk_func_t func)
 
 void eapol_register(struct eapol_sm *sm)
 {
-	eapol_frame_watch_func_t rx_handler = sm->handshake->authenticator ?
-		eapol_rx_auth_packet : eapol_rx_packet;
+	struct handshake_state *hs = sm->handshake;
+
+	sm->index_key.ifindex = hs->ifindex;
+	sm->index_key.authenticator = hs->authenticator;
+	memcpy(sm->index_key.addr, hs->authenticator ? hs->spa : hs->aa,
+		sizeof(sm->index_key.addr));
 
 	l_queue_push_head(state_machines, sm);
+	l_hashmap_replace(sm_index, &sm->index_key, sm, NULL);
+	sm->indexed = true;
 
-	sm->watch_id = eapol_frame_watch_add(sm->handshake->ifindex,
-						rx_handler, sm);
 	sm->protocol_version = sm->handshake->proto_version;
 }
 
 bool eapol_start(struct eapol_sm *sm)
 {
 	if (sm->handshake->settings_8021x) {
+		_auto_(l_free) char *peer_id = NULL;
+
 		sm->eap = eap_new(eapol_eap_msg_cb, eapol_eap_complete_cb, sm);
 
 		if (!sm->eap)
 			goto eap_error;
 
+		peer_id = l_util_hexstring(sm->handshake->ssid,
+						sm->handshake->ssid_len);
+		eap_set_peer_id(sm->eap, peer_id);
+
 		if (!eap_load_settings(sm->eap, sm->handshake->settings_8021x,
 					"EAP-")) {
 			eap_free(sm->eap);
@@ -2740,6 +3128,7 @@ struct preauth_sm *eapol_preauth_start(const uint8_t *aa,
 					eapol_preauth_destroy_func_t destroy)
 {
 	struct preauth_sm *sm;
+	_auto_(l_free) char *peer_id = NULL;
 
 	sm = l_new(struct preauth_sm, 1);
 
@@ -2754,6 +3143,9 @@ struct preauth_sm *eapol_preauth_start(const uint8_t *aa,
 	if (!sm->eap)
 		goto err_free_sm;
 
+	peer_id = l_util_hexstring(hs->ssid, hs->ssid_len);
+	eap_set_peer_id(sm->eap, peer_id);
+
 	if (!eap_load_settings(sm->eap, hs->settings_8021x, "EAP-"))
 		goto err_free_eap;
 
@@ -2811,12 +3203,14 @@ void __eapol_rx_packet(uint32_t ifindex, const uint8_t *src, uint16_t proto,
 					bool noencrypt)
 {
 	const struct eapol_header *eh;
+	struct eapol_sm *sm;
 
 	/* Validate Header */
 	if (len < sizeof(struct eapol_header))
 		return;
 
 	eh = (const struct eapol_header *) frame;
+	TRACE(eapol_rx, ifindex, eh->packet_type, len);
 
 	switch (eh->protocol_version) {
 	case EAPOL_PROTOCOL_VERSION_2001:
@@ -2830,6 +3224,22 @@ void __eapol_rx_packet(uint32_t ifindex, const uint8_t *src, uint16_t proto,
 	if (len < sizeof(struct eapol_header) + L_BE16_TO_CPU(eh->packet_len))
 		return;
 
+	/*
+	 * In IBSS a supplicant and an authenticator run against each peer,
+	 * each one ignores the frames meant for the other.  Look the second
+	 * one up only after the first returns as it may free both.
+	 */
+	sm = eapol_find_sm(ifindex, src, false);
+	if (sm)
+		eapol_rx_packet(proto, src, (const struct eapol_frame *) eh,
+					noencrypt, sm);
+
+	sm = eapol_find_sm(ifindex, src, true);
+	if (sm)
+		eapol_rx_auth_packet(proto, src,
+					(const struct eapol_frame *) eh,
+					noencrypt, sm);
+
 	WATCHLIST_NOTIFY_MATCHES(&frame_watches,
 					eapol_frame_watch_match_ifindex,
 					L_UINT_TO_PTR(ifindex),
@@ -2844,6 +3254,8 @@ void __eapol_tx_packet(uint32_t ifindex, const uint8_t *dst, uint16_t proto,
 	if (!tx_packet)
 		return;
 
+	TRACE(eapol_tx, ifindex, frame->header.packet_type,
+			L_BE16_TO_CPU(frame->header.packet_len));
 	tx_packet(ifindex, dst, proto, frame, noencrypt, tx_user_data);
 }
 
@@ -2857,6 +3269,9 @@ void __eapol_set_config(struct l_settings *config)
 int eapol_init(void)
 {
 	state_machines = l_queue_new();
+	sm_index = l_hashmap_new();
+	l_hashmap_set_hash_function(sm_index, eapol_sm_key_hash);
+	l_hashmap_set_compare_function(sm_index, eapol_sm_key_compare);
 	preauths = l_queue_new();
 	watchlist_init(&frame_watches, &eapol_frame_watch_ops);
 
@@ -2868,6 +3283,8 @@ void eapol_exit(void)
 	if (!l_queue_isempty(state_machines))
 		l_warn("stale eapol state machines found");
 
+	l_hashmap_destroy(sm_index, NULL);
+	sm_index = NULL;
 	l_queue_destroy(state_machines, eapol_sm_destroy);
 
 	if (!l_queue_isempty(preauths))
@@ -121,6 +121,8 @@ void eapol_sm_set_protocol_version(struct eapol_sm *sm,
 void eapol_sm_set_use_eapol_start(struct eapol_sm *sm, bool enabled);
 void eapol_sm_set_require_handshake(struct eapol_sm *sm, bool enabled);
 void eapol_sm_set_listen_interval(struct eapol_sm *sm, uint16_t interval);
+bool eapol_sm_send_gtk_1_of_2(struct eapol_sm *sm, const uint8_t *key_data,
+				size_t key_data_len, const uint8_t *gtk_rsc);
 void eapol_sm_set_user_data(struct eapol_sm *sm, void *user_data);
 
 void eapol_register(struct eapol_sm *sm);
@@ -27,6 +27,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include <ell/ell.h>
 
@@ -40,6 +42,7 @@
 #include "src/util.h"
 
 #define ERP_DEFAULT_KEY_LIFETIME_US 86400000000
+#define ERP_MAX_EMSK_LEN 64
 
 struct erp_cache_entry {
 	char *id;
@@ -48,8 +51,10 @@ struct erp_cache_entry {
 	void *session_id;
 	size_t session_len;
 	char *ssid;
+	uint8_t profile_digest[32];
 	uint64_t expire_time;
 	uint32_t ref;
+	uint16_t seq;
 	bool invalid : 1;
 };
 
@@ -102,6 +107,13 @@ struct erp_tlv_iter {
 
 static struct l_queue *key_cache;
 
+static struct l_settings *erp_cache_settings;
+static erp_cache_load_func_t erp_cache_load;
+static erp_cache_sync_func_t erp_cache_sync;
+static bool erp_cache_loaded;
+static uint8_t erp_cache_key[32];
+static uint8_t erp_profile_key[32];
+
 static void erp_tlv_iter_init(struct erp_tlv_iter *iter,
 				const unsigned char *tlv, unsigned int len)
 {
@@ -158,27 +170,301 @@ static void erp_cache_entry_destroy(void *data)
 	l_free(entry);
 }
 
-void erp_cache_add(const char *id, const void *session_id,
-			size_t session_len, const void *emsk, size_t emsk_len,
-			const char *ssid)
+/*
+ * Fingerprint of the [Security] group of the network profile the keys were
+ * established with.  Keyed so that the persisted value does not allow
+ * guessing the passwords the profile may contain.
+ */
+static void erp_profile_digest(const struct l_settings *profile,
+				uint8_t out[static 32])
 {
-	struct erp_cache_entry *entry;
+	struct l_checksum *hmac;
+	char **keys;
+	unsigned int i;
 
-	if (!unlikely(id || session_id || emsk))
+	memset(out, 0, 32);
+
+	if (!profile)
 		return;
 
-	entry = l_new(struct erp_cache_entry, 1);
+	keys = l_settings_get_keys(profile, "Security");
+	if (!keys)
+		return;
+
+	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA256, erp_profile_key,
+					sizeof(erp_profile_key));
+	if (!hmac)
+		goto done;
+
+	for (i = 0; keys[i]; i++) {
+		const char *value = l_settings_get_value(profile, "Security",
+								keys[i]);
+
+		l_checksum_update(hmac, keys[i], strlen(keys[i]) + 1);
+		l_checksum_update(hmac, value, strlen(value) + 1);
+	}
+
+	l_checksum_get_digest(hmac, out, 32);
+	l_checksum_free(hmac);
+
+done:
+	l_strv_free(keys);
+}
+
+static char *erp_cache_group(const char *ssid)
+{
+	return l_util_hexstring((const uint8_t *) ssid, strlen(ssid));
+}
+
+/*
+ * Everything stored next to the encrypted EMSK is authenticated as AES-SIV
+ * associated data so that the entry can not be altered or moved to another
+ * network.
+ */
+static void erp_cache_entry_ad(const struct erp_cache_entry *entry,
+				const char *group, uint64_t expires,
+				uint8_t meta[static 10], struct iovec ad[static 5])
+{
+	l_put_be64(expires, meta);
+	l_put_be16(entry->seq, meta + 8);
+
+	ad[0].iov_base = (void *) group;
+	ad[0].iov_len = strlen(group);
+	ad[1].iov_base = entry->id;
+	ad[1].iov_len = strlen(entry->id);
+	ad[2].iov_base = entry->session_id;
+	ad[2].iov_len = entry->session_len;
+	ad[3].iov_base = (void *) entry->profile_digest;
+	ad[3].iov_len = sizeof(entry->profile_digest);
+	ad[4].iov_base = meta;
+	ad[4].iov_len = 10;
+}
+
+static void erp_cache_entry_store(const struct erp_cache_entry *entry)
+{
+	uint64_t now = time(NULL);
+	uint64_t expires;
+	uint8_t meta[10];
+	struct iovec ad[5];
+	uint8_t blob[16 + ERP_MAX_EMSK_LEN];
+	char *group;
+	char *hex;
+
+	if (!erp_cache_sync || entry->emsk_len > ERP_MAX_EMSK_LEN)
+		return;
+
+	if (!erp_cache_settings)
+		erp_cache_settings = l_settings_new();
+
+	expires = now + l_time_to_secs(l_time_diff(l_time_now(),
+							entry->expire_time));
+	group = erp_cache_group(entry->ssid);
+
+	erp_cache_entry_ad(entry, group, expires, meta, ad);
+
+	if (!aes_siv_encrypt(erp_cache_key, sizeof(erp_cache_key), entry->emsk,
+				entry->emsk_len, ad, L_ARRAY_SIZE(ad), blob)) {
+		l_error("Unable to encrypt ERP cache entry");
+		goto done;
+	}
+
+	l_settings_set_string(erp_cache_settings, group, "Identity", entry->id);
+
+	hex = l_util_hexstring(entry->session_id, entry->session_len);
+	l_settings_set_string(erp_cache_settings, group, "SessionId", hex);
+	l_free(hex);
+
+	hex = l_util_hexstring(entry->profile_digest,
+				sizeof(entry->profile_digest));
+	l_settings_set_string(erp_cache_settings, group, "ProfileDigest", hex);
+	l_free(hex);
+
+	hex = l_util_hexstring(blob, 16 + entry->emsk_len);
+	l_settings_set_string(erp_cache_settings, group, "EMSK", hex);
+	explicit_bzero(hex, strlen(hex));
+	l_free(hex);
+
+	l_settings_set_uint64(erp_cache_settings, group, "Expires", expires);
+	l_settings_set_uint(erp_cache_settings, group, "Sequence", entry->seq);
+
+	erp_cache_sync(erp_cache_settings);
+
+done:
+	explicit_bzero(blob, sizeof(blob));
+	l_free(group);
+}
+
+/* Removes the persisted copy of @entry, unless it has been superseded */
+static void erp_cache_entry_forget(const struct erp_cache_entry *entry)
+{
+	char *group;
+	char *stored;
+	char *hex;
+
+	if (!erp_cache_settings)
+		return;
+
+	group = erp_cache_group(entry->ssid);
+	stored = l_settings_get_string(erp_cache_settings, group, "SessionId");
+	hex = l_util_hexstring(entry->session_id, entry->session_len);
+
+	if (stored && !strcmp(stored, hex)) {
+		l_settings_remove_group(erp_cache_settings, group);
+		erp_cache_sync(erp_cache_settings);
+	}
+
+	l_free(hex);
+	l_free(stored);
+	l_free(group);
+}
+
+static bool erp_cache_entry_load(const char *group, uint64_t now)
+{
+	struct erp_cache_entry *entry = l_new(struct erp_cache_entry, 1);
+	uint8_t *ssid = NULL;
+	uint8_t *digest = NULL;
+	uint8_t *blob = NULL;
+	char *hex = NULL;
+	size_t len;
+	size_t blob_len = 0;
+	uint64_t expires;
+	unsigned int seq;
+	uint8_t meta[10];
+	struct iovec ad[5];
+
+	ssid = l_util_from_hexstring(group, &len);
+	if (!ssid || len > 32)
+		goto failed;
+
+	entry->ssid = l_strndup((const char *) ssid, len);
+
+	entry->id = l_settings_get_string(erp_cache_settings, group,
+						"Identity");
+	if (!entry->id)
+		goto failed;
+
+	hex = l_settings_get_string(erp_cache_settings, group, "SessionId");
+	if (!hex)
+		goto failed;
+
+	entry->session_id = l_util_from_hexstring(hex, &entry->session_len);
+	l_free(hex);
+
+	hex = l_settings_get_string(erp_cache_settings, group, "ProfileDigest");
+	if (!hex)
+		goto failed;
+
+	digest = l_util_from_hexstring(hex, &len);
+	l_free(hex);
+
+	if (!entry->session_id || !digest ||
+			len != sizeof(entry->profile_digest))
+		goto failed;
+
+	memcpy(entry->profile_digest, digest, len);
+
+	hex = l_settings_get_string(erp_cache_settings, group, "EMSK");
+	if (!hex)
+		goto failed;
+
+	blob = l_util_from_hexstring(hex, &blob_len);
+	explicit_bzero(hex, strlen(hex));
+	l_free(hex);
+
+	if (!blob || blob_len <= 16 || blob_len > 16 + ERP_MAX_EMSK_LEN)
+		goto failed;
+
+	if (!l_settings_get_uint64(erp_cache_settings, group, "Expires",
+					&expires) || expires <= now)
+		goto failed;
+
+	if (!l_settings_get_uint(erp_cache_settings, group, "Sequence",
+					&seq) || seq >= UINT16_MAX)
+		goto failed;
+
+	entry->seq = seq;
+	entry->emsk_len = blob_len - 16;
+	entry->emsk = l_malloc(entry->emsk_len);
+
+	erp_cache_entry_ad(entry, group, expires, meta, ad);
+
+	if (!aes_siv_decrypt(erp_cache_key, sizeof(erp_cache_key), blob,
+				blob_len, ad, L_ARRAY_SIZE(ad), entry->emsk)) {
+		l_debug("Could not decrypt ERP cache entry %s", group);
+		goto failed;
+	}
 
-	entry->id = l_strdup(id);
-	entry->emsk = l_memdup(emsk, emsk_len);
-	entry->emsk_len = emsk_len;
-	entry->session_id = l_memdup(session_id, session_len);
-	entry->session_len = session_len;
-	entry->ssid = l_strdup(ssid);
 	entry->expire_time = l_time_offset(l_time_now(),
-					ERP_DEFAULT_KEY_LIFETIME_US);
+					(expires - now) * L_USEC_PER_SEC);
 
-	l_queue_push_head(key_cache, entry);
+	l_queue_push_tail(key_cache, entry);
+
+	explicit_bzero(blob, blob_len);
+	l_free(blob);
+	l_free(digest);
+	l_free(ssid);
+
+	return true;
+
+failed:
+	if (blob) {
+		explicit_bzero(blob, blob_len);
+		l_free(blob);
+	}
+
+	if (entry->emsk)
+		explicit_bzero(entry->emsk, entry->emsk_len);
+
+	l_free(digest);
+	l_free(ssid);
+	erp_cache_entry_destroy(entry);
+
+	return false;
+}
+
+static void erp_cache_load_entries(void)
+{
+	uint64_t now = time(NULL);
+	bool changed = false;
+	char **groups;
+	unsigned int i;
+
+	erp_cache_loaded = true;
+
+	if (!erp_cache_load)
+		return;
+
+	erp_cache_settings = erp_cache_load();
+	if (!erp_cache_settings)
+		return;
+
+	groups = l_settings_get_groups(erp_cache_settings);
+
+	for (i = 0; groups[i]; i++) {
+		if (erp_cache_entry_load(groups[i], now))
+			continue;
+
+		l_settings_remove_group(erp_cache_settings, groups[i]);
+		changed = true;
+	}
+
+	l_debug("Loaded %u ERP cache entries", l_queue_length(key_cache));
+
+	l_strv_free(groups);
+
+	if (changed)
+		erp_cache_sync(erp_cache_settings);
+}
+
+static void erp_cache_entry_drop(struct erp_cache_entry *entry)
+{
+	if (entry->ref) {
+		entry->invalid = true;
+		return;
+	}
+
+	l_queue_remove(key_cache, entry);
+	erp_cache_entry_destroy(entry);
 }
 
 static struct erp_cache_entry *find_keycache(const char *id, const char *ssid)
@@ -188,6 +474,9 @@ static struct erp_cache_entry *find_keycache(const char *id, const char *ssid)
 	if (!id && !ssid)
 		return NULL;
 
+	if (!erp_cache_loaded)
+		erp_cache_load_entries();
+
 	for (entry = l_queue_get_entries(key_cache); entry;
 			entry = entry->next) {
 		struct erp_cache_entry *cache = entry->data;
@@ -196,6 +485,8 @@ static struct erp_cache_entry *find_keycache(const char *id, const char *ssid)
 			continue;
 
 		if (l_time_after(l_time_now(), cache->expire_time)) {
+			erp_cache_entry_forget(cache);
+
 			if (!cache->ref) {
 				l_queue_remove(key_cache, cache);
 				erp_cache_entry_destroy(cache);
@@ -215,6 +506,36 @@ static struct erp_cache_entry *find_keycache(const char *id, const char *ssid)
 	return NULL;
 }
 
+void erp_cache_add(const char *id, const void *session_id,
+			size_t session_len, const void *emsk, size_t emsk_len,
+			const char *ssid, const struct l_settings *profile)
+{
+	struct erp_cache_entry *entry;
+
+	if (!unlikely(id || session_id || emsk))
+		return;
+
+	/* Keys from a newer full authentication supersede any older ones */
+	while ((entry = find_keycache(NULL, ssid)))
+		erp_cache_entry_drop(entry);
+
+	entry = l_new(struct erp_cache_entry, 1);
+
+	entry->id = l_strdup(id);
+	entry->emsk = l_memdup(emsk, emsk_len);
+	entry->emsk_len = emsk_len;
+	entry->session_id = l_memdup(session_id, session_len);
+	entry->session_len = session_len;
+	entry->ssid = l_strdup(ssid);
+	entry->expire_time = l_time_offset(l_time_now(),
+					ERP_DEFAULT_KEY_LIFETIME_US);
+	erp_profile_digest(profile, entry->profile_digest);
+
+	l_queue_push_head(key_cache, entry);
+
+	erp_cache_entry_store(entry);
+}
+
 void erp_cache_remove(const char *id)
 {
 	struct erp_cache_entry *entry = find_keycache(id, NULL);
@@ -222,14 +543,18 @@ void erp_cache_remove(const char *id)
 	if (!entry)
 		return;
 
-	if (entry->ref) {
-		entry->invalid = true;
-		return;
-	}
+	erp_cache_entry_forget(entry);
+	erp_cache_entry_drop(entry);
+}
 
-	l_queue_remove(key_cache, entry);
+void erp_cache_flush(const char *ssid)
+{
+	struct erp_cache_entry *entry;
 
-	erp_cache_entry_destroy(entry);
+	while ((entry = find_keycache(NULL, ssid))) {
+		erp_cache_entry_forget(entry);
+		erp_cache_entry_drop(entry);
+	}
 }
 
 struct erp_cache_entry *erp_cache_get(const char *ssid)
@@ -267,6 +592,48 @@ const char *erp_cache_entry_get_identity(struct erp_cache_entry *cache)
 	return cache->id;
 }
 
+bool erp_cache_entry_check_profile(struct erp_cache_entry *cache,
+					const struct l_settings *profile)
+{
+	uint8_t digest[32];
+
+	erp_profile_digest(profile, digest);
+
+	return !memcmp(digest, cache->profile_digest, sizeof(digest));
+}
+
+void erp_set_cache_ops(erp_cache_load_func_t load, erp_cache_sync_func_t sync,
+			const void *secret, size_t secret_len)
+{
+	static const char cache_info[] = "ERP Cache Key";
+	static const char profile_info[] = "ERP Profile Key";
+
+	l_settings_free(erp_cache_settings);
+	erp_cache_settings = NULL;
+	erp_cache_loaded = false;
+	erp_cache_load = NULL;
+	erp_cache_sync = NULL;
+	explicit_bzero(erp_cache_key, sizeof(erp_cache_key));
+
+	if (!load || !sync || !secret)
+		return;
+
+	if (!hkdf_expand(L_CHECKSUM_SHA256, secret, secret_len, cache_info,
+				strlen(cache_info), erp_cache_key,
+				sizeof(erp_cache_key)) ||
+			!hkdf_expand(L_CHECKSUM_SHA256, secret, secret_len,
+					profile_info, strlen(profile_info),
+					erp_profile_key,
+					sizeof(erp_profile_key))) {
+		l_error("Unable to derive the ERP cache keys");
+		explicit_bzero(erp_cache_key, sizeof(erp_cache_key));
+		return;
+	}
+
+	erp_cache_load = load;
+	erp_cache_sync = sync;
+}
+
 #define ERP_RRK_LABEL	"EAP Re-authentication Root Key@ietf.org"
 #define ERP_RIK_LABEL	"Re-authentication Integrity Key@ietf.org"
 #define ERP_RMSK_LABEL	"Re-authentication Master Session Key@ietf.org"
@@ -369,6 +736,13 @@ bool erp_start(struct erp_state *erp)
 	char emsk_name[17];
 	size_t nai_len;
 
+	/*
+	 * RFC 6696 Section 5.3.2 - the sequence number must not be reused
+	 * with the same rIK.  Once exhausted, a full authentication is needed.
+	 */
+	if (erp->cache->seq == UINT16_MAX)
+		return false;
+
 	if (!erp_derive_emsk_name(erp->cache->session_id,
 					erp->cache->session_len, emsk_name))
 		return false;
@@ -380,6 +754,9 @@ bool erp_start(struct erp_state *erp)
 	nai_len = sprintf(erp->keyname_nai, "%s@%s", emsk_name,
 				util_get_domain(erp->cache->id));
 
+	erp->seq = erp->cache->seq++;
+	erp_cache_entry_store(erp->cache);
+
 	*ptr++ = EAP_CODE_INITIATE;
 	*ptr++ = 0;
 	/* Header (8) + TL (2) + NAI (nai_len) + CS (1) + auth tag (16) */
@@ -533,12 +910,21 @@ static int erp_init(void)
 {
 	key_cache = l_queue_new();
 
+	/* Overridden by erp_set_cache_ops when the cache is persisted */
+	l_getrandom(erp_profile_key, sizeof(erp_profile_key));
+
 	return 0;
 }
 
 static void erp_exit(void)
 {
 	l_queue_destroy(key_cache, erp_cache_entry_destroy);
+	key_cache = NULL;
+
+	l_settings_free(erp_cache_settings);
+	erp_cache_settings = NULL;
+	explicit_bzero(erp_cache_key, sizeof(erp_cache_key));
+	explicit_bzero(erp_profile_key, sizeof(erp_profile_key));
 }
 
 IWD_MODULE(erp, erp_init, erp_exit)
@@ -22,6 +22,7 @@
 
 struct erp_state;
 struct erp_cache_entry;
+struct l_settings;
 
 enum erp_result {
 	ERP_RESULT_SUCCESS,
@@ -30,6 +31,8 @@ enum erp_result {
 
 typedef void (*erp_tx_packet_func_t)(const uint8_t *erp_data, size_t len,
 					void *user_data);
+typedef struct l_settings *(*erp_cache_load_func_t)(void);
+typedef void (*erp_cache_sync_func_t)(struct l_settings *cache);
 
 struct erp_state *erp_new(struct erp_cache_entry *cache,
 				erp_tx_packet_func_t tx_packet,
@@ -43,11 +46,17 @@ const void *erp_get_rmsk(struct erp_state *erp, size_t *rmsk_len);
 
 void erp_cache_add(const char *id, const void *session_id, size_t session_len,
 			const void *emsk, size_t emsk_len,
-			const char *ssid);
+			const char *ssid, const struct l_settings *profile);
 
 void erp_cache_remove(const char *id);
+void erp_cache_flush(const char *ssid);
 
 struct erp_cache_entry *erp_cache_get(const char *ssid);
 void erp_cache_put(struct erp_cache_entry *cache);
 
 const char *erp_cache_entry_get_identity(struct erp_cache_entry *cache);
+bool erp_cache_entry_check_profile(struct erp_cache_entry *cache,
+					const struct l_settings *profile);
+
+void erp_set_cache_ops(erp_cache_load_func_t load, erp_cache_sync_func_t sync,
+			const void *secret, size_t secret_len);
@@ -25,6 +25,8 @@
 #include <config.h>
 #endif
 
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include <ell/ell.h>
 
 #include "ell/useful.h"
@@ -41,6 +43,13 @@
 #define FILS_NONCE_LEN		16
 #define FILS_SESSION_LEN	8
 
+#define FILS_HLP_DHCP_CLIENT_PORT	68
+#define FILS_HLP_DHCP_SERVER_PORT	67
+
+static const uint8_t fils_hlp_llc_snap[] = {
+	0xaa, 0xaa, 0x03, 0x00, 0x00, 0x00, 0x08, 0x00
+};
+
 struct fils_sm {
 	struct auth_proto ap;
 	struct erp_state *erp;
@@ -138,6 +147,175 @@ static void fils_erp_tx_func(const uint8_t *eap_data, size_t len,
 	fils->auth(data, ptr - data + tlv_len, fils->user_data);
 }
 
+static uint32_t fils_ip_checksum_add(uint32_t sum, const void *data,
+					size_t len)
+{
+	const uint8_t *ptr = data;
+
+	for (; len > 1; ptr += 2, len -= 2)
+		sum += l_get_be16(ptr);
+
+	if (len)
+		sum += *ptr << 8;
+
+	return sum;
+}
+
+static uint16_t fils_ip_checksum_fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+/*
+ * IEEE 802.11ai - 9.4.2.187 FILS HLP Container element
+ *
+ * Wrap the DHCPDISCOVER in an LLC/SNAP encapsulated IPv4/UDP broadcast
+ * datagram and split it over Fragment elements if it doesn't fit in one
+ * element.
+ */
+static uint8_t *fils_build_hlp_dhcp(const uint8_t *spa, const uint8_t *dhcp,
+					size_t dhcp_len, size_t *out_len)
+{
+	size_t udp_len = sizeof(struct udphdr) + dhcp_len;
+	size_t payload_len = 1 + 12 + sizeof(fils_hlp_llc_snap) +
+				sizeof(struct iphdr) + udp_len;
+	L_AUTO_FREE_VAR(uint8_t *, payload) = l_malloc(payload_len);
+	uint8_t *ptr = payload;
+	struct iphdr ip;
+	struct udphdr udp;
+	uint32_t sum;
+	uint8_t *out;
+	size_t pos = 0;
+	size_t i;
+
+	if (udp_len + sizeof(struct iphdr) > UINT16_MAX)
+		return NULL;
+
+	*ptr++ = IE_TYPE_FILS_HLP_CONTAINER - 256;
+	memset(ptr, 0xff, 6);
+	memcpy(ptr + 6, spa, 6);
+	ptr += 12;
+	memcpy(ptr, fils_hlp_llc_snap, sizeof(fils_hlp_llc_snap));
+	ptr += sizeof(fils_hlp_llc_snap);
+
+	memset(&ip, 0, sizeof(ip));
+	ip.version = 4;
+	ip.ihl = sizeof(ip) / 4;
+	ip.tot_len = L_CPU_TO_BE16(sizeof(ip) + udp_len);
+	ip.ttl = 64;
+	ip.protocol = IPPROTO_UDP;
+	ip.saddr = INADDR_ANY;
+	ip.daddr = INADDR_BROADCAST;
+	ip.check = L_CPU_TO_BE16(fils_ip_checksum_fold(
+				fils_ip_checksum_add(0, &ip, sizeof(ip))));
+
+	memset(&udp, 0, sizeof(udp));
+	udp.source = L_CPU_TO_BE16(FILS_HLP_DHCP_CLIENT_PORT);
+	udp.dest = L_CPU_TO_BE16(FILS_HLP_DHCP_SERVER_PORT);
+	udp.len = L_CPU_TO_BE16(udp_len);
+
+	/* Pseudo header: source, destination, protocol and UDP length */
+	sum = fils_ip_checksum_add(0, &ip.saddr, 8);
+	sum += IPPROTO_UDP + udp_len;
+	sum = fils_ip_checksum_add(sum, &udp, sizeof(udp));
+	sum = fils_ip_checksum_add(sum, dhcp, dhcp_len);
+	udp.check = L_CPU_TO_BE16(fils_ip_checksum_fold(sum));
+
+	/* RFC 768: a computed checksum of zero is transmitted as all ones */
+	if (!udp.check)
+		udp.check = 0xffff;
+
+	memcpy(ptr, &ip, sizeof(ip));
+	ptr += sizeof(ip);
+	memcpy(ptr, &udp, sizeof(udp));
+	ptr += sizeof(udp);
+	memcpy(ptr, dhcp, dhcp_len);
+
+	out = l_malloc(payload_len + 2 * (payload_len / 255 + 1));
+
+	for (i = 0; i < payload_len; i += 255) {
+		size_t chunk = minsize(payload_len - i, 255);
+
+		out[pos++] = i ? IE_TYPE_FRAGMENT : IE_TYPE_EXTENSION;
+		out[pos++] = chunk;
+		memcpy(out + pos, payload + i, chunk);
+		pos += chunk;
+	}
+
+	*out_len = pos;
+	return out;
+}
+
+/*
+ * Reassemble an HLP Container (plus any Fragment elements following it)
+ * and extract the DHCP message from the IPv4/UDP datagram it carries.
+ */
+static void fils_parse_hlp_dhcp(struct fils_sm *fils, const uint8_t *ie,
+				const uint8_t *end)
+{
+	L_AUTO_FREE_VAR(uint8_t *, buf) = l_malloc(end - ie);
+	size_t len = 0;
+	const uint8_t *ptr;
+	const struct iphdr *ip;
+	const struct udphdr *udp;
+	size_t ip_len;
+	size_t udp_len;
+
+	/* Skip the Extension ID, the element length was validated already */
+	memcpy(buf, ie + 3, ie[1] - 1);
+	len = ie[1] - 1;
+	ie += ie[1] + 2;
+
+	while (ie + 2 <= end && ie[0] == IE_TYPE_FRAGMENT &&
+			ie + 2 + ie[1] <= end) {
+		memcpy(buf + len, ie + 2, ie[1]);
+		len += ie[1];
+		ie += ie[1] + 2;
+	}
+
+	if (len < 12 + sizeof(fils_hlp_llc_snap) + sizeof(struct iphdr))
+		return;
+
+	/* Destination MAC must be ours */
+	if (memcmp(buf, fils->hs->spa, 6))
+		return;
+
+	ptr = buf + 12;
+	len -= 12;
+
+	if (memcmp(ptr, fils_hlp_llc_snap, sizeof(fils_hlp_llc_snap)))
+		return;
+
+	ptr += sizeof(fils_hlp_llc_snap);
+	len -= sizeof(fils_hlp_llc_snap);
+
+	ip = (const struct iphdr *) ptr;
+	ip_len = ip->ihl * 4;
+
+	if (ip->version != 4 || ip->protocol != IPPROTO_UDP ||
+			ip_len < sizeof(*ip) ||
+			L_BE16_TO_CPU(ip->tot_len) > len ||
+			ip_len + sizeof(*udp) > L_BE16_TO_CPU(ip->tot_len))
+		return;
+
+	udp = (const struct udphdr *) (ptr + ip_len);
+	udp_len = L_BE16_TO_CPU(udp->len);
+
+	if (L_BE16_TO_CPU(udp->dest) != FILS_HLP_DHCP_CLIENT_PORT ||
+			udp_len < sizeof(*udp) ||
+			ip_len + udp_len > L_BE16_TO_CPU(ip->tot_len))
+		return;
+
+	l_debug("DHCP reply received in HLP container");
+
+	handshake_state_set_fils_dhcp_ack(fils->hs,
+					(const uint8_t *) (udp + 1),
+					udp_len - sizeof(*udp));
+}
+
 static int fils_derive_key_data(struct fils_sm *fils)
 {
 	const void *rmsk;
@@ -149,12 +327,14 @@ static int fils_derive_key_data(struct fils_sm *fils)
 	uint8_t data[44];
 	uint8_t *ptr = data;
 	size_t hash_len;
-	struct iovec iov[4];
+	struct iovec iov[5];
 	size_t iov_elems = 0;
 	size_t fils_ft_len = 0;
 	bool sha384;
 	unsigned int ie_len;
 	uint8_t *rsne = NULL;
+	L_AUTO_FREE_VAR(uint8_t *, hlp) = NULL;
+	size_t hlp_len;
 
 	rmsk = erp_get_rmsk(fils->erp, &rmsk_len);
 
@@ -303,6 +483,22 @@ static int fils_derive_key_data(struct fils_sm *fils)
 		iov_elems += 1;
 	}
 
+	/*
+	 * The HLP Container follows the FILS Session element and is thus
+	 * encrypted along with the rest of the request
+	 */
+	if (fils->hs->fils_dhcp_discover)
+		hlp = fils_build_hlp_dhcp(fils->hs->spa,
+					fils->hs->fils_dhcp_discover,
+					fils->hs->fils_dhcp_discover_len,
+					&hlp_len);
+
+	if (hlp) {
+		iov[iov_elems].iov_base = hlp;
+		iov[iov_elems].iov_len = hlp_len;
+		iov_elems += 1;
+	}
+
 	memcpy(data, fils->nonce, sizeof(fils->nonce));
 	memcpy(data + sizeof(fils->nonce), fils->anonce, sizeof(fils->anonce));
 
@@ -314,6 +510,16 @@ static int fils_derive_key_data(struct fils_sm *fils)
 	return 0;
 }
 
+/*
+ * The authentication server did not accept the rRK, e.g. because it expired
+ * there or it was restored from storage after the server dropped its copy.
+ * Remove it so that the next connection runs a full EAP authentication.
+ */
+static void fils_erp_invalidate(struct fils_sm *fils)
+{
+	erp_cache_remove(erp_cache_entry_get_identity(fils->hs->erp_cache));
+}
+
 static bool fils_start(struct auth_proto *driver)
 {
 	struct fils_sm *fils = l_container_of(driver, struct fils_sm, ap);
@@ -364,8 +570,20 @@ static int fils_rx_authenticate(struct auth_proto *driver, const uint8_t *frame,
 	}
 
 	if (auth->status != 0) {
-		l_debug("invalid status %u", auth->status);
-		return L_LE16_TO_CPU(auth->status);
+		uint16_t status = L_LE16_TO_CPU(auth->status);
+
+		l_debug("invalid status %u", status);
+
+		switch (status) {
+		case MMPDU_STATUS_CODE_FILS_AUTHENTICATION_FAILURE:
+		case MMPDU_STATUS_CODE_UNKNOWN_AUTHENTICATION_SERVER:
+			fils_erp_invalidate(fils);
+			break;
+		default:
+			break;
+		}
+
+		return status;
 	}
 
 	alg = L_LE16_TO_CPU(auth->algorithm);
@@ -446,8 +664,10 @@ static int fils_rx_authenticate(struct auth_proto *driver, const uint8_t *frame,
 
 	memcpy(fils->anonce, anonce, FILS_NONCE_LEN);
 
-	if (erp_rx_packet(fils->erp, wrapped, wrapped_len) < 0)
+	if (erp_rx_packet(fils->erp, wrapped, wrapped_len) < 0) {
+		fils_erp_invalidate(fils);
 		goto invalid_ies;
+	}
 
 	return fils_derive_key_data(fils);
 
@@ -535,6 +755,14 @@ static int fils_rx_associate(struct auth_proto *driver, const uint8_t *frame,
 
 			ap_key_auth = iter.data;
 			break;
+		case IE_TYPE_FILS_HLP_CONTAINER:
+			if (!fils->hs->fils_dhcp_discover ||
+					fils->hs->fils_dhcp_ack)
+				break;
+
+			fils_parse_hlp_dhcp(fils, iter.data - 3,
+					(const uint8_t *) hdr + len);
+			break;
 		}
 	}
 
@@ -43,6 +43,7 @@
 #include "src/netdev.h"
 #include "src/frame-xchg.h"
 #include "src/wiphy.h"
+#include "src/trace.h"
 
 #ifndef SOL_NETLINK
 #define SOL_NETLINK 270
@@ -70,6 +71,26 @@ struct watch_group {
 	uint32_t nl_seq;
 	struct l_queue *write_queue;
 	struct watchlist watches;
+	/*
+	 * Index of the watches by wdev, frame type and the first prefix
+	 * byte so that received frames are only matched against the
+	 * candidate watches.
+	 */
+	struct l_hashmap *buckets;
+};
+
+/* Used as first_byte for watches with an empty prefix */
+#define FRAME_WATCH_ANY_BYTE 0x100
+
+struct frame_watch_key {
+	uint64_t wdev_id;
+	uint16_t frame_type;
+	uint16_t first_byte;
+};
+
+struct frame_watch_bucket {
+	struct frame_watch_key key;
+	struct l_queue *watches;
 };
 
 struct frame_watch {
@@ -78,6 +99,7 @@ struct frame_watch {
 	uint8_t *prefix;
 	size_t prefix_len;
 	struct watch_group *group;
+	struct frame_watch_bucket *bucket;
 	struct watchlist_item super;
 };
 
@@ -93,8 +115,10 @@ static struct l_queue *wdevs;
 struct frame_xchg_data {
 	uint64_t wdev_id;
 	uint32_t freq;
-	struct mmpdu_header *tx_mpdu;
-	size_t tx_mpdu_len;
+	/* Built once from the caller's iovecs and resent on each retry */
+	struct l_genl_msg *tx_msg;
+	uint8_t tx_addr1[6];
+	uint8_t tx_addr2[6];
 	bool tx_acked;
 	uint64_t cookie;
 	bool have_cookie;
@@ -129,6 +153,8 @@ static struct l_queue *frame_xchgs;
 static struct l_genl_family *nl80211;
 static uint32_t nl80211_id;
 
+IWD_MODULE_COUNTER(frame_xchg, frame_watch)
+
 struct frame_prefix_info {
 	uint16_t frame_type;
 	const uint8_t *body;
@@ -136,6 +162,74 @@ struct frame_prefix_info {
 	uint64_t wdev_id;
 };
 
+static unsigned int frame_watch_key_hash(const void *p)
+{
+	const struct frame_watch_key *key = p;
+
+	return (uint32_t) key->wdev_id ^ (key->wdev_id >> 32) ^
+		(key->frame_type << 16) ^ key->first_byte;
+}
+
+static int frame_watch_key_compare(const void *a, const void *b)
+{
+	const struct frame_watch_key *key_a = a;
+	const struct frame_watch_key *key_b = b;
+
+	if (key_a->wdev_id != key_b->wdev_id)
+		return key_a->wdev_id < key_b->wdev_id ? -1 : 1;
+
+	if (key_a->frame_type != key_b->frame_type)
+		return key_a->frame_type < key_b->frame_type ? -1 : 1;
+
+	return (int) key_a->first_byte - (int) key_b->first_byte;
+}
+
+static void frame_watch_bucket_free(void *data)
+{
+	struct frame_watch_bucket *bucket = data;
+
+	l_queue_destroy(bucket->watches, NULL);
+	l_free(bucket);
+}
+
+static struct frame_watch_bucket *frame_watch_bucket_get(
+						struct watch_group *group,
+						uint64_t wdev_id,
+						uint16_t frame_type,
+						uint16_t first_byte,
+						bool create)
+{
+	struct frame_watch_key key = { wdev_id, frame_type, first_byte };
+	struct frame_watch_bucket *bucket;
+
+	bucket = l_hashmap_lookup(group->buckets, &key);
+	if (bucket || !create)
+		return bucket;
+
+	/*
+	 * Buckets are only freed together with the group so that they
+	 * stay valid while being iterated in frame_watch_group_notify.
+	 */
+	bucket = l_new(struct frame_watch_bucket, 1);
+	bucket->key = key;
+	bucket->watches = l_queue_new();
+	l_hashmap_insert(group->buckets, &bucket->key, bucket);
+
+	return bucket;
+}
+
+static const struct l_queue_entry *frame_watch_bucket_entries(
+					struct watch_group *group,
+					const struct frame_prefix_info *info,
+					uint16_t first_byte)
+{
+	struct frame_watch_bucket *bucket =
+		frame_watch_bucket_get(group, info->wdev_id, info->frame_type,
+					first_byte, false);
+
+	return bucket ? l_queue_get_entries(bucket->watches) : NULL;
+}
+
 static bool frame_watch_match_prefix(const void *a, const void *b)
 {
 	const struct watchlist_item *item = a;
@@ -150,6 +244,77 @@ static bool frame_watch_match_prefix(const void *a, const void *b)
 		info->wdev_id == watch->wdev_id;
 }
 
+static void frame_watch_group_free(struct watch_group *group)
+{
+	l_hashmap_destroy(group->buckets, frame_watch_bucket_free);
+	l_free(group);
+}
+
+static unsigned int frame_watch_entry_id(const struct l_queue_entry *entry)
+{
+	const struct frame_watch *watch = entry->data;
+
+	return watch->super.id;
+}
+
+/*
+ * Same as WATCHLIST_NOTIFY_MATCHES but only walks the bucket of watches
+ * with an empty prefix and the bucket for the first byte of the frame
+ * body.  The two are merged by watch ID to preserve the order in which
+ * the watches were added.
+ */
+static void frame_watch_group_notify(struct watch_group *group,
+					const struct frame_prefix_info *info,
+					const struct mmpdu_header *mpdu,
+					int rssi)
+{
+	struct watchlist *watchlist = &group->watches;
+	const struct l_queue_entry *any;
+	const struct l_queue_entry *specific = NULL;
+
+	any = frame_watch_bucket_entries(group, info, FRAME_WATCH_ANY_BYTE);
+
+	if (info->body_len)
+		specific = frame_watch_bucket_entries(group, info,
+							info->body[0]);
+
+	watchlist->in_notify = true;
+
+	while (any || specific) {
+		struct frame_watch *watch;
+		frame_watch_cb_t cb;
+
+		if (!specific || (any && frame_watch_entry_id(any) <
+					frame_watch_entry_id(specific))) {
+			watch = any->data;
+			any = any->next;
+		} else {
+			watch = specific->data;
+			specific = specific->next;
+		}
+
+		if (watch->super.id == 0)
+			continue;
+
+		if (!frame_watch_match_prefix(&watch->super, info))
+			continue;
+
+		cb = watch->super.notify;
+		cb(mpdu, info->body, info->body_len, rssi,
+			watch->super.notify_data);
+
+		if (watchlist->pending_destroy)
+			break;
+	}
+
+	watchlist->in_notify = false;
+
+	if (watchlist->pending_destroy)
+		watchlist_destroy(watchlist);
+	else if (watchlist->stale_items)
+		__watchlist_prune_stale(watchlist);
+}
+
 static void frame_watch_unicast_notify(struct l_genl_msg *msg, void *user_data)
 {
 	struct watch_group *group = user_data;
@@ -231,13 +396,11 @@ static void frame_watch_unicast_notify(struct l_genl_msg *msg, void *user_data)
 	info.body_len = (const uint8_t *) mpdu + frame_len - body;
 	info.wdev_id = *wdev_id;
 
-	WATCHLIST_NOTIFY_MATCHES(&group->watches, frame_watch_match_prefix,
-					&info, frame_watch_cb_t, mpdu,
-					info.body, info.body_len, rssi);
+	frame_watch_group_notify(group, &info, mpdu, rssi);
 
 	/* Has frame_watch_group_destroy been called inside a frame CB? */
 	if (group->watches.pending_destroy)
-		l_free(group);
+		frame_watch_group_free(group);
 }
 
 static void frame_watch_group_destroy(void *data)
@@ -261,7 +424,7 @@ static void frame_watch_group_destroy(void *data)
 	if (group->watches.in_notify)
 		return;
 
-	l_free(group);
+	frame_watch_group_free(group);
 }
 
 static void frame_watch_free(struct watchlist_item *item)
@@ -269,8 +432,11 @@ static void frame_watch_free(struct watchlist_item *item)
 	struct frame_watch *watch =
 		l_container_of(item, struct frame_watch, super);
 
+	l_queue_remove(watch->bucket->watches, watch);
 	l_free(watch->prefix);
 	l_free(watch);
+
+	IWD_COUNTER_DEC(frame_watch);
 }
 
 static const struct watchlist_ops frame_watch_ops = {
@@ -392,6 +558,9 @@ static struct watch_group *frame_watch_group_new(uint64_t wdev_id, uint32_t id)
 	group->id = id;
 	group->wdev_id = wdev_id;
 	watchlist_init(&group->watches, &frame_watch_ops);
+	group->buckets = l_hashmap_new();
+	l_hashmap_set_hash_function(group->buckets, frame_watch_key_hash);
+	l_hashmap_set_compare_function(group->buckets, frame_watch_key_compare);
 
 	if (id == 0) {
 		group->unicast_watch_id = l_genl_add_unicast_watch(
@@ -507,9 +676,9 @@ struct frame_duplicate_info {
 	bool registered : 1;
 };
 
-static bool frame_watch_check_duplicate(void *data, void *user_data)
+static bool frame_watch_check_duplicate(struct watchlist_item *super,
+							void *user_data)
 {
-	struct watchlist_item *super = data;
 	struct frame_watch *watch =
 		l_container_of(super, struct frame_watch, super);
 	struct frame_duplicate_info *info = user_data;
@@ -589,20 +758,25 @@ bool frame_watch_add(uint64_t wdev_id, uint32_t group_id, uint16_t frame_type,
 	if (!group)
 		return false;
 
-	l_queue_foreach_remove(group->watches.items,
-				frame_watch_check_duplicate, &info);
+	watchlist_foreach_remove(&group->watches,
+					frame_watch_check_duplicate, &info);
 
 	if (info.duplicate)
 		return true;
 
 	watch = l_new(struct frame_watch, 1);
+	IWD_COUNTER_INC(frame_watch);
 	watch->frame_type = frame_type;
 	watch->prefix = prefix_len ? l_memdup(prefix, prefix_len) : NULL;
 	watch->prefix_len = prefix_len;
 	watch->wdev_id = wdev_id;
 	watch->group = group;
+	watch->bucket = frame_watch_bucket_get(group, wdev_id, frame_type,
+					prefix_len ? prefix[0] :
+					FRAME_WATCH_ANY_BYTE, true);
 	watchlist_link(&group->watches, &watch->super, handler, user_data,
 			destroy);
+	l_queue_push_tail(watch->bucket->watches, watch);
 
 	if (info.registered)
 		return true;
@@ -639,10 +813,11 @@ bool frame_watch_group_remove(uint64_t wdev_id, uint32_t group_id)
 	return true;
 }
 
-static bool frame_watch_item_remove_wdev(void *data, void *user_data)
+static bool frame_watch_item_remove_wdev(struct watchlist_item *item,
+							void *user_data)
 {
 	struct frame_watch *watch =
-		l_container_of(data, struct frame_watch, super);
+		l_container_of(item, struct frame_watch, super);
 	const uint64_t *wdev_id = user_data;
 
 	if (watch->wdev_id != *wdev_id)
@@ -672,8 +847,8 @@ static bool frame_watch_group_remove_wdev(void *data, void *user_data)
 	 * Have to be careful here because we're messing with watchlist
 	 * internals.
 	 */
-	l_queue_foreach_remove(group->watches.items,
-				frame_watch_item_remove_wdev, user_data);
+	watchlist_foreach_remove(&group->watches,
+					frame_watch_item_remove_wdev, user_data);
 	return false;
 }
 
@@ -689,10 +864,11 @@ struct frame_watch_handler_check_info {
 	void *user_data;
 };
 
-static bool frame_watch_item_remove_by_handler(void *data, void *user_data)
+static bool frame_watch_item_remove_by_handler(struct watchlist_item *item,
+							void *user_data)
 {
 	struct frame_watch *watch =
-		l_container_of(data, struct frame_watch, super);
+		l_container_of(item, struct frame_watch, super);
 	struct frame_watch_handler_check_info *info = user_data;
 
 	if (watch->wdev_id != info->wdev_id ||
@@ -737,7 +913,7 @@ static bool frame_watch_remove_by_handler(uint64_t wdev_id, uint32_t group_id,
 	if (!group)
 		return false;
 
-	return l_queue_foreach_remove(group->watches.items,
+	return watchlist_foreach_remove(&group->watches,
 					frame_watch_item_remove_by_handler,
 					&handler_info) > 0;
 }
@@ -750,26 +926,111 @@ static void frame_xchg_resp_cb(const struct mmpdu_header *mpdu,
 				const void *body, size_t body_len,
 				int rssi, void *user_data);
 
-static void frame_xchg_wait_cancel(struct frame_xchg_data *fx)
+static void frame_xchg_send_wait_cancel(uint64_t wdev_id, uint64_t cookie)
 {
 	struct l_genl_msg *msg;
 
-	if (!fx->have_cookie)
-		return;
-
 	l_debug("");
 
 	msg = l_genl_msg_new_sized(NL80211_CMD_FRAME_WAIT_CANCEL, 32);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &fx->wdev_id);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_COOKIE, 8, &fx->cookie);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &wdev_id);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_COOKIE, 8, &cookie);
 	l_genl_family_send(nl80211, msg, NULL, NULL, NULL);
+}
 
+static void frame_xchg_wait_cancel(struct frame_xchg_data *fx)
+{
+	if (!fx->have_cookie)
+		return;
+
+	frame_xchg_send_wait_cancel(fx->wdev_id, fx->cookie);
 	fx->have_cookie = false;
 }
 
+/*
+ * When an exchange ends while still off-channel, the wait is only cancelled
+ * from an idle callback.  If the next radio work item, started right after,
+ * is another exchange on the same channel it takes over the remaining dwell
+ * instead, and the kernel extends the same remain-on-channel period rather
+ * than switching back and forth.
+ */
+struct frame_xchg_wait {
+	uint64_t wdev_id;
+	uint64_t cookie;
+	uint32_t freq;
+};
+
+static struct l_queue *pending_waits;
+static struct l_idle *pending_waits_idle;
+
+static void frame_xchg_wait_cancel_one(void *data)
+{
+	struct frame_xchg_wait *wait = data;
+
+	frame_xchg_send_wait_cancel(wait->wdev_id, wait->cookie);
+	l_free(wait);
+}
+
+static void frame_xchg_pending_waits_flush(void)
+{
+	l_idle_remove(pending_waits_idle);
+	pending_waits_idle = NULL;
+
+	l_queue_destroy(pending_waits, frame_xchg_wait_cancel_one);
+	pending_waits = NULL;
+}
+
+static void frame_xchg_pending_waits_idle_cb(struct l_idle *idle,
+						void *user_data)
+{
+	frame_xchg_pending_waits_flush();
+}
+
+static void frame_xchg_wait_cancel_deferred(struct frame_xchg_data *fx)
+{
+	struct frame_xchg_wait *wait;
+
+	if (!fx->have_cookie)
+		return;
+
+	wait = l_new(struct frame_xchg_wait, 1);
+	wait->wdev_id = fx->wdev_id;
+	wait->cookie = fx->cookie;
+	wait->freq = fx->freq;
+	fx->have_cookie = false;
+
+	if (!pending_waits)
+		pending_waits = l_queue_new();
+
+	l_queue_push_tail(pending_waits, wait);
+
+	if (!pending_waits_idle)
+		pending_waits_idle = l_idle_create(
+					frame_xchg_pending_waits_idle_cb,
+					NULL, NULL);
+}
+
+static bool frame_xchg_wait_take_over(void *data, void *user_data)
+{
+	struct frame_xchg_wait *wait = data;
+	const struct frame_xchg_data *fx = user_data;
+
+	if (wait->wdev_id != fx->wdev_id)
+		return false;
+
+	/* Another channel's wait would only delay us, end it right away */
+	if (wait->freq != fx->freq)
+		frame_xchg_send_wait_cancel(wait->wdev_id, wait->cookie);
+	else
+		l_debug("Reusing the wait on %u MHz", wait->freq);
+
+	l_free(wait);
+	return true;
+}
+
 static void frame_xchg_reset(struct frame_xchg_data *fx)
 {
-	frame_xchg_wait_cancel(fx);
+	frame_xchg_wait_cancel_deferred(fx);
 
 	if (fx->timeout)
 		l_timeout_remove(fx->timeout);
@@ -783,8 +1044,8 @@ static void frame_xchg_reset(struct frame_xchg_data *fx)
 	fx->early_frame.mpdu = NULL;
 	l_queue_destroy(fx->rx_watches, l_free);
 	fx->rx_watches = NULL;
-	l_free(fx->tx_mpdu);
-	fx->tx_mpdu = NULL;
+	l_genl_msg_unref(fx->tx_msg);
+	fx->tx_msg = NULL;
 	frame_watch_remove_by_handler(fx->wdev_id, fx->group_id,
 					frame_xchg_resp_cb, fx);
 }
@@ -943,33 +1204,9 @@ static bool frame_xchg_tx_retry(struct wiphy_radio_work_item *item)
 {
 	struct frame_xchg_data *fx = l_container_of(item,
 						struct frame_xchg_data, work);
-	struct l_genl_msg *msg;
-	uint32_t duration = fx->resp_timeout;
-
-	/*
-	 * TODO: in Station, AP, P2P-Client, GO or Ad-Hoc modes if we're
-	 * transmitting the frame on the BSS's operating channel we can skip
-	 * NL80211_ATTR_DURATION and we should still receive the frames
-	 * without potentially interfering with other operations.
-	 *
-	 * TODO: we may want to react to NL80211_CMD_CANCEL_REMAIN_ON_CHANNEL
-	 * in the group socket's unicast handler.
-	 */
-
-	msg = l_genl_msg_new_sized(NL80211_CMD_FRAME, 128 + fx->tx_mpdu_len);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &fx->wdev_id);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY_FREQ, 4, &fx->freq);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_OFFCHANNEL_TX_OK, 0, NULL);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_FRAME,
-				fx->tx_mpdu_len, fx->tx_mpdu);
-
-	if (fx->no_cck_rates)
-		l_genl_msg_append_attr(msg, NL80211_ATTR_TX_NO_CCK_RATE, 0,
-					NULL);
+	struct l_genl_msg *msg = l_genl_msg_ref(fx->tx_msg);
 
-	if (duration)
-		l_genl_msg_append_attr(msg, NL80211_ATTR_DURATION, 4,
-					&duration);
+	l_queue_foreach_remove(pending_waits, frame_xchg_wait_take_over, fx);
 
 	fx->tx_cmd_id = l_genl_family_send(nl80211, msg, frame_xchg_tx_cb, fx,
 						NULL);
@@ -985,6 +1222,8 @@ static bool frame_xchg_tx_retry(struct wiphy_radio_work_item *item)
 	fx->early_status = false;
 	fx->retry_cnt++;
 
+	TRACE(frame_xchg_tx, fx->wdev_id, fx->freq, fx->retry_cnt);
+
 	return false;
 }
 
@@ -1003,10 +1242,10 @@ static bool frame_xchg_resp_handle(const struct mmpdu_header *mpdu,
 
 	l_debug("");
 
-	if (memcmp(mpdu->address_1, fx->tx_mpdu->address_2, 6))
+	if (memcmp(mpdu->address_1, fx->tx_addr2, 6))
 		return false;
 
-	if (memcmp(mpdu->address_2, fx->tx_mpdu->address_1, 6))
+	if (memcmp(mpdu->address_2, fx->tx_addr1, 6))
 		return false;
 
 	/*
@@ -1015,6 +1254,7 @@ static bool frame_xchg_resp_handle(const struct mmpdu_header *mpdu,
 	 * wrong addresses.  But the frame callback is free to perform
 	 * its own check.
 	 */
+	TRACE(frame_xchg_rx, fx->wdev_id, fx->tx_acked, rssi);
 
 	for (entry = l_queue_get_entries(fx->rx_watches);
 			entry; entry = entry->next) {
@@ -1131,11 +1371,14 @@ uint32_t frame_xchg_startv(uint64_t wdev_id, struct iovec *frame, uint32_t freq,
 {
 	struct frame_xchg_data *fx;
 	size_t frame_len;
+	size_t iov_len;
 	struct iovec *iov;
-	uint8_t *ptr;
+	uint8_t hdr[16];
+	size_t hdr_len;
 	struct wdev_info *wdev;
 
-	for (frame_len = 0, iov = frame; iov->iov_base; iov++)
+	for (frame_len = 0, iov_len = 0, iov = frame; iov->iov_base;
+			iov++, iov_len++)
 		frame_len += iov->iov_len;
 
 	/*
@@ -1165,12 +1408,17 @@ uint32_t frame_xchg_startv(uint64_t wdev_id, struct iovec *frame, uint32_t freq,
 	fx->user_data = user_data;
 	fx->group_id = group_id;
 
-	fx->tx_mpdu = l_malloc(frame_len);
-	fx->tx_mpdu_len = frame_len;
-	ptr = (uint8_t *) fx->tx_mpdu;
+	/* Addresses 1 and 2, to match responses against */
+	for (hdr_len = 0, iov = frame; iov->iov_base && hdr_len < sizeof(hdr);
+			iov++) {
+		size_t n = minsize(iov->iov_len, sizeof(hdr) - hdr_len);
+
+		memcpy(hdr + hdr_len, iov->iov_base, n);
+		hdr_len += n;
+	}
 
-	for (iov = frame; iov->iov_base; ptr += iov->iov_len, iov++)
-		memcpy(ptr, iov->iov_base, iov->iov_len);
+	memcpy(fx->tx_addr1, hdr + 4, 6);
+	memcpy(fx->tx_addr2, hdr + 10, 6);
 
 	wdev = l_queue_find(wdevs, frame_xchg_wdev_match, &wdev_id);
 	fx->no_cck_rates = wdev &&
@@ -1178,6 +1426,37 @@ uint32_t frame_xchg_startv(uint64_t wdev_id, struct iovec *frame, uint32_t freq,
 		 wdev->iftype == NL80211_IFTYPE_P2P_CLIENT ||
 		 wdev->iftype == NL80211_IFTYPE_P2P_GO);
 
+	/*
+	 * The message doesn't change between retries so the frame is only
+	 * copied once, straight from the caller's iovecs.
+	 *
+	 * TODO: in Station, AP, P2P-Client, GO or Ad-Hoc modes if we're
+	 * transmitting the frame on the BSS's operating channel we can skip
+	 * NL80211_ATTR_DURATION and we should still receive the frames
+	 * without potentially interfering with other operations.
+	 *
+	 * TODO: we may want to react to NL80211_CMD_CANCEL_REMAIN_ON_CHANNEL
+	 * in the group socket's unicast handler.
+	 */
+	fx->tx_msg = l_genl_msg_new_sized(NL80211_CMD_FRAME, 128 + frame_len);
+	l_genl_msg_append_attr(fx->tx_msg, NL80211_ATTR_WDEV, 8, &wdev_id);
+	l_genl_msg_append_attr(fx->tx_msg, NL80211_ATTR_WIPHY_FREQ, 4, &freq);
+	l_genl_msg_append_attr(fx->tx_msg, NL80211_ATTR_OFFCHANNEL_TX_OK, 0,
+				NULL);
+	l_genl_msg_append_attrv(fx->tx_msg, NL80211_ATTR_FRAME, frame,
+				iov_len);
+
+	if (fx->no_cck_rates)
+		l_genl_msg_append_attr(fx->tx_msg, NL80211_ATTR_TX_NO_CCK_RATE,
+					0, NULL);
+
+	if (resp_timeout) {
+		uint32_t duration = resp_timeout;
+
+		l_genl_msg_append_attr(fx->tx_msg, NL80211_ATTR_DURATION, 4,
+					&duration);
+	}
+
 	/*
 	 * Subscribe to the response frames now instead of in the ACK
 	 * callback to save ourselves race condition considerations.
@@ -1404,6 +1683,8 @@ static void frame_xchg_exit(void)
 	watch_groups = NULL;
 	l_queue_destroy(groups, frame_watch_group_destroy);
 
+	frame_xchg_pending_waits_flush();
+
 	l_genl_family_free(nl80211);
 	nl80211 = NULL;
 
@@ -162,41 +162,22 @@ static bool ft_parse_associate_resp_frame(const uint8_t *frame, size_t frame_len
 {
 	const struct mmpdu_header *mpdu;
 	const struct mmpdu_association_response *body;
-	struct ie_tlv_iter iter;
+	struct ie_index index;
 
-	mpdu = mpdu_validate(frame, frame_len);
+	mpdu = mpdu_validate_index(frame, frame_len, &index);
 	if (!mpdu)
 		return false;
 
 	body = mmpdu_body(mpdu);
 
-	ie_tlv_iter_init(&iter, body->ies, (const uint8_t *) mpdu + frame_len -
-				body->ies);
-
-	while (ie_tlv_iter_next(&iter)) {
-		switch (ie_tlv_iter_get_tag(&iter)) {
-		case IE_TYPE_RSN:
-			if (*rsne)
-				return false;
-
-			*rsne = ie_tlv_iter_get_data(&iter) - 2;
-			break;
-
-		case IE_TYPE_MOBILITY_DOMAIN:
-			if (*mde)
-				return false;
-
-			*mde = ie_tlv_iter_get_data(&iter) - 2;
-			break;
-
-		case IE_TYPE_FAST_BSS_TRANSITION:
-			if (*fte)
-				return false;
+	if (ie_index_count(&index, IE_TYPE_RSN) > 1 ||
+			ie_index_count(&index, IE_TYPE_MOBILITY_DOMAIN) > 1 ||
+			ie_index_count(&index, IE_TYPE_FAST_BSS_TRANSITION) > 1)
+		return false;
 
-			*fte = ie_tlv_iter_get_data(&iter) - 2;
-			break;
-		}
-	}
+	*rsne = ie_index_find(&index, IE_TYPE_RSN);
+	*mde = ie_index_find(&index, IE_TYPE_MOBILITY_DOMAIN);
+	*fte = ie_index_find(&index, IE_TYPE_FAST_BSS_TRANSITION);
 
 	*out_status = L_LE16_TO_CPU(body->status_code);
 
@@ -76,10 +76,9 @@ void handshake_state_free(struct handshake_state *s)
 {
 	__typeof__(s->free) destroy = s->free;
 
-	l_free(s->authenticator_ie);
-	l_free(s->supplicant_ie);
-	l_free(s->mde);
-	l_free(s->fte);
+	l_checksum_free(s->kck_checksum);
+	l_free(s->fils_dhcp_discover);
+	l_free(s->fils_dhcp_ack);
 
 	if (s->passphrase) {
 		explicit_bzero(s->passphrase, strlen(s->passphrase));
@@ -92,10 +91,38 @@ void handshake_state_free(struct handshake_state *s)
 		destroy(s);
 }
 
+/*
+ * Element lengths are bounded so they are copied into storage inside the
+ * handshake_state rather than duplicated on the heap, which keeps roam and
+ * FT candidate setup free of allocations.  The source may alias the
+ * destination, e.g. when an IE is set again from its current value.
+ */
+static uint8_t *handshake_state_store_ie(uint8_t *buf, const uint8_t *ie)
+{
+	if (!ie)
+		return NULL;
+
+	memmove(buf, ie, ie[1] + 2u);
+
+	return buf;
+}
+
+#define HANDSHAKE_STORE_IE(s, field, ie)	\
+	((s)->field = handshake_state_store_ie((s)->field##_buf, (ie)))
+
+/* The PMK-R0 and the PMK-R1s derived from it depend on what changed */
+static void handshake_state_forget_ft_keys(struct handshake_state *s)
+{
+	explicit_bzero(s->pmk_r1_cache, sizeof(s->pmk_r1_cache));
+	s->pmk_r1_cache_len = 0;
+	s->have_pmk_r0 = false;
+}
+
 void handshake_state_set_supplicant_address(struct handshake_state *s,
 						const uint8_t *spa)
 {
 	memcpy(s->spa, spa, sizeof(s->spa));
+	handshake_state_forget_ft_keys(s);
 }
 
 void handshake_state_set_authenticator_address(struct handshake_state *s,
@@ -115,6 +142,7 @@ void handshake_state_set_pmk(struct handshake_state *s, const uint8_t *pmk,
 	memcpy(s->pmk, pmk, pmk_len);
 	s->pmk_len = pmk_len;
 	s->have_pmk = true;
+	handshake_state_forget_ft_keys(s);
 }
 
 void handshake_state_set_ptk(struct handshake_state *s, const uint8_t *ptk,
@@ -155,8 +183,7 @@ bool handshake_state_set_authenticator_ie(struct handshake_state *s,
 {
 	struct ie_rsn_info info;
 
-	l_free(s->authenticator_ie);
-	s->authenticator_ie = l_memdup(ie, ie[1] + 2u);
+	HANDSHAKE_STORE_IE(s, authenticator_ie, ie);
 	s->wpa_ie = is_ie_wpa_ie(ie + 2, ie[1]);
 	s->osen_ie = is_ie_wfa_ie(ie + 2, ie[1], IE_WFA_OI_OSEN);
 
@@ -182,8 +209,7 @@ bool handshake_state_set_supplicant_ie(struct handshake_state *s,
 {
 	struct ie_rsn_info info;
 
-	l_free(s->supplicant_ie);
-	s->supplicant_ie = l_memdup(ie, ie[1] + 2u);
+	HANDSHAKE_STORE_IE(s, supplicant_ie, ie);
 	s->wpa_ie = is_ie_wpa_ie(ie + 2, ie[1]);
 	s->osen_ie = is_ie_wfa_ie(ie + 2, ie[1], IE_WFA_OI_OSEN);
 
@@ -214,28 +240,43 @@ void handshake_state_set_ssid(struct handshake_state *s, const uint8_t *ssid,
 {
 	memcpy(s->ssid, ssid, ssid_len);
 	s->ssid_len = ssid_len;
+	handshake_state_forget_ft_keys(s);
+}
+
+void handshake_state_set_authenticator_rsnxe(struct handshake_state *s,
+						const uint8_t *ie)
+{
+	HANDSHAKE_STORE_IE(s, authenticator_rsnxe, ie);
+}
+
+void handshake_state_set_supplicant_rsnxe(struct handshake_state *s,
+						const uint8_t *ie)
+{
+	HANDSHAKE_STORE_IE(s, supplicant_rsnxe, ie);
 }
 
 void handshake_state_set_mde(struct handshake_state *s, const uint8_t *mde)
 {
-	if (s->mde)
-		l_free(s->mde);
+	/* Roaming within the mobility domain keeps the key hierarchy */
+	if (!s->mde || !mde || l_get_le16(s->mde + 2) != l_get_le16(mde + 2))
+		handshake_state_forget_ft_keys(s);
 
-	s->mde = mde ? l_memdup(mde, mde[1] + 2) : NULL;
+	HANDSHAKE_STORE_IE(s, mde, mde);
 }
 
 void handshake_state_set_fte(struct handshake_state *s, const uint8_t *fte)
 {
-	if (s->fte)
-		l_free(s->fte);
-
-	s->fte = fte ? l_memdup(fte, fte[1] + 2) : NULL;
+	HANDSHAKE_STORE_IE(s, fte, fte);
 }
 
 void handshake_state_set_kh_ids(struct handshake_state *s,
 				const uint8_t *r0khid, size_t r0khid_len,
 				const uint8_t *r1khid)
 {
+	if (s->r0khid_len != r0khid_len ||
+			memcmp(s->r0khid, r0khid, r0khid_len))
+		handshake_state_forget_ft_keys(s);
+
 	memcpy(s->r0khid, r0khid, r0khid_len);
 	s->r0khid_len = r0khid_len;
 
@@ -267,6 +308,23 @@ void handshake_state_set_fils_ft(struct handshake_state *s,
 {
 	memcpy(s->fils_ft, fils_ft, fils_ft_len);
 	s->fils_ft_len = fils_ft_len;
+	handshake_state_forget_ft_keys(s);
+}
+
+void handshake_state_set_fils_dhcp_discover(struct handshake_state *s,
+						const uint8_t *msg, size_t len)
+{
+	l_free(s->fils_dhcp_discover);
+	s->fils_dhcp_discover = msg ? l_memdup(msg, len) : NULL;
+	s->fils_dhcp_discover_len = msg ? len : 0;
+}
+
+void handshake_state_set_fils_dhcp_ack(struct handshake_state *s,
+					const uint8_t *msg, size_t len)
+{
+	l_free(s->fils_dhcp_ack);
+	s->fils_dhcp_ack = msg ? l_memdup(msg, len) : NULL;
+	s->fils_dhcp_ack_len = msg ? len : 0;
 }
 
 /*
@@ -391,6 +449,112 @@ static bool handshake_get_key_sizes(struct handshake_state *s, size_t *ptk_size,
 	return true;
 }
 
+static bool handshake_state_derive_pmk_r0(struct handshake_state *s)
+{
+	uint16_t mdid;
+	const uint8_t *xxkey = s->pmk;
+	size_t xxkey_len = 32;
+	bool sha384 = (s->akm_suite & IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384);
+
+	if (s->have_pmk_r0 && s->pmk_r0_akm == s->akm_suite)
+		return true;
+
+	/*
+	 * In a Fast Transition initial mobility domain association
+	 * the PMK maps to the XXKey, except with EAP:
+	 * 802.11-2016 12.7.1.7.3:
+	 *    "If the AKM negotiated is 00-0F-AC:3, then [...] XXKey
+	 *    shall be the second 256 bits of the MSK (which is
+	 *    derived from the IEEE 802.1X authentication), i.e.,
+	 *    XXKey = L(MSK, 256, 256)."
+	 */
+	if (s->akm_suite == IE_RSN_AKM_SUITE_FT_OVER_8021X)
+		xxkey = s->pmk + 32;
+	else if (s->akm_suite & (IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA256 |
+			IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384)) {
+		xxkey = s->fils_ft;
+		xxkey_len = s->fils_ft_len;
+	}
+
+	ie_parse_mobility_domain_from_data(s->mde, s->mde[1] + 2,
+						&mdid, NULL, NULL);
+
+	handshake_state_forget_ft_keys(s);
+
+	if (!crypto_derive_pmk_r0(xxkey, xxkey_len, s->ssid,
+					s->ssid_len, mdid,
+					s->r0khid, s->r0khid_len,
+					s->spa, sha384,
+					s->pmk_r0, s->pmk_r0_name))
+		return false;
+
+	s->have_pmk_r0 = true;
+	s->pmk_r0_akm = s->akm_suite;
+
+	return true;
+}
+
+/*
+ * Returns the PMK-R1 for the given R1KH, deriving it, and the PMK-R0 if
+ * needed, and remembering it for later transitions unless already known.
+ */
+static const struct handshake_pmk_r1 *handshake_state_get_pmk_r1(
+						struct handshake_state *s,
+						const uint8_t *r1khid)
+{
+	bool sha384 = (s->akm_suite & IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384);
+	struct handshake_pmk_r1 *r1;
+	unsigned int i;
+
+	if (!handshake_state_derive_pmk_r0(s))
+		return NULL;
+
+	for (i = 0; i < s->pmk_r1_cache_len; i++)
+		if (!memcmp(s->pmk_r1_cache[i].r1khid, r1khid, 6))
+			return &s->pmk_r1_cache[i];
+
+	/* Replace the oldest entry once full */
+	if (s->pmk_r1_cache_len < L_ARRAY_SIZE(s->pmk_r1_cache))
+		s->pmk_r1_cache_len++;
+	else
+		memmove(s->pmk_r1_cache, s->pmk_r1_cache + 1,
+			sizeof(s->pmk_r1_cache) - sizeof(s->pmk_r1_cache[0]));
+
+	r1 = &s->pmk_r1_cache[s->pmk_r1_cache_len - 1];
+	memcpy(r1->r1khid, r1khid, 6);
+
+	if (!crypto_derive_pmk_r1(s->pmk_r0, r1khid, s->spa,
+					s->pmk_r0_name, sha384,
+					r1->pmk_r1, r1->pmk_r1_name)) {
+		explicit_bzero(r1, sizeof(*r1));
+		s->pmk_r1_cache_len--;
+		return NULL;
+	}
+
+	return r1;
+}
+
+/*
+ * Derives the PMK-R1 for a prospective Fast Transition target ahead of
+ * time so that only the nonce dependent PTK derivation is left once the
+ * authentication response arrives.
+ */
+bool handshake_state_prepare_pmk_r1(struct handshake_state *s,
+					const uint8_t *r1khid)
+{
+	if (!(s->akm_suite & (IE_RSN_AKM_SUITE_FT_OVER_8021X |
+				IE_RSN_AKM_SUITE_FT_USING_PSK |
+				IE_RSN_AKM_SUITE_FT_OVER_SAE_SHA256 |
+				IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA256 |
+				IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384)))
+		return false;
+
+	if (!s->mde || !s->have_pmk_r0)
+		return false;
+
+	return handshake_state_get_pmk_r1(s, r1khid) != NULL;
+}
+
 bool handshake_state_derive_ptk(struct handshake_state *s)
 {
 	size_t ptk_size;
@@ -441,44 +605,17 @@ bool handshake_state_derive_ptk(struct handshake_state *s)
 				IE_RSN_AKM_SUITE_FT_OVER_SAE_SHA256 |
 				IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA256 |
 				IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384)) {
-		uint16_t mdid;
 		uint8_t ptk_name[16];
-		const uint8_t *xxkey = s->pmk;
-		size_t xxkey_len = 32;
 		bool sha384 = (s->akm_suite &
 					IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384);
+		const struct handshake_pmk_r1 *r1;
 
-		/*
-		 * In a Fast Transition initial mobility domain association
-		 * the PMK maps to the XXKey, except with EAP:
-		 * 802.11-2016 12.7.1.7.3:
-		 *    "If the AKM negotiated is 00-0F-AC:3, then [...] XXKey
-		 *    shall be the second 256 bits of the MSK (which is
-		 *    derived from the IEEE 802.1X authentication), i.e.,
-		 *    XXKey = L(MSK, 256, 256)."
-		 */
-		if (s->akm_suite == IE_RSN_AKM_SUITE_FT_OVER_8021X)
-			xxkey = s->pmk + 32;
-		else if (s->akm_suite & (IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA256 |
-				IE_RSN_AKM_SUITE_FT_OVER_FILS_SHA384)) {
-			xxkey = s->fils_ft;
-			xxkey_len = s->fils_ft_len;
-		}
-
-		ie_parse_mobility_domain_from_data(s->mde, s->mde[1] + 2,
-							&mdid, NULL, NULL);
-
-		if (!crypto_derive_pmk_r0(xxkey, xxkey_len, s->ssid,
-						s->ssid_len, mdid,
-						s->r0khid, s->r0khid_len,
-						s->spa, sha384,
-						s->pmk_r0, s->pmk_r0_name))
+		r1 = handshake_state_get_pmk_r1(s, s->r1khid);
+		if (!r1)
 			return false;
 
-		if (!crypto_derive_pmk_r1(s->pmk_r0, s->r1khid, s->spa,
-						s->pmk_r0_name, sha384,
-						s->pmk_r1, s->pmk_r1_name))
-			return false;
+		memcpy(s->pmk_r1, r1->pmk_r1, sizeof(s->pmk_r1));
+		memcpy(s->pmk_r1_name, r1->pmk_r1_name, sizeof(s->pmk_r1_name));
 
 		if (!crypto_derive_ft_ptk(s->pmk_r1, s->pmk_r1_name, s->aa,
 						s->spa, s->snonce, s->anonce,
@@ -921,3 +1058,126 @@ bool handshake_decode_fte_key(struct handshake_state *s, const uint8_t *wrapped,
 
 	return true;
 }
+
+/*
+ * Finite cyclic groups that peers accepted for SAE and OWE, by BSSID and by
+ * SSID.  The next attempt on the same BSS, or a roam within the same ESS,
+ * starts with the group known to work instead of paying an Authentication
+ * or Association round trip for each group the AP rejects.
+ */
+#define HANDSHAKE_GROUP_CACHE_SIZE 16
+
+struct handshake_group_entry {
+	uint8_t id[32];
+	size_t id_len;
+	bool owe : 1;
+	bool ess : 1;
+	unsigned int group;
+};
+
+static struct l_queue *group_cache;
+
+static struct handshake_group_entry *handshake_group_cache_find(bool owe,
+						bool ess, const uint8_t *id,
+						size_t id_len)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(group_cache); entry;
+						entry = entry->next) {
+		struct handshake_group_entry *e = entry->data;
+
+		if (e->owe == owe && e->ess == ess && e->id_len == id_len &&
+				!memcmp(e->id, id, id_len))
+			return e;
+	}
+
+	return NULL;
+}
+
+static void handshake_group_cache_add(bool owe, bool ess, const uint8_t *id,
+					size_t id_len, unsigned int group)
+{
+	struct handshake_group_entry *e;
+
+	if (id_len > sizeof(e->id))
+		return;
+
+	e = handshake_group_cache_find(owe, ess, id, id_len);
+	if (e)
+		l_queue_remove(group_cache, e);
+	else if (l_queue_length(group_cache) >= HANDSHAKE_GROUP_CACHE_SIZE) {
+		e = l_queue_peek_tail(group_cache);
+		l_queue_remove(group_cache, e);
+	} else {
+		if (!group_cache)
+			group_cache = l_queue_new();
+
+		e = l_new(struct handshake_group_entry, 1);
+	}
+
+	memcpy(e->id, id, id_len);
+	e->id_len = id_len;
+	e->owe = owe;
+	e->ess = ess;
+	e->group = group;
+
+	l_queue_push_head(group_cache, e);
+}
+
+void handshake_state_set_accepted_group(struct handshake_state *s,
+					unsigned int group)
+{
+	bool owe = s->akm_suite == IE_RSN_AKM_SUITE_OWE;
+
+	if (s->authenticator)
+		return;
+
+	handshake_group_cache_add(owe, false, s->aa, 6, group);
+
+	if (s->ssid_len)
+		handshake_group_cache_add(owe, true, s->ssid, s->ssid_len,
+						group);
+}
+
+/*
+ * Fill @groups with the supported groups, zero terminated, starting with
+ * the group last accepted by this BSS or, failing that, by this ESS.
+ */
+void handshake_state_get_ecc_groups(const struct handshake_state *s,
+					unsigned int *groups)
+{
+	const unsigned int *supported = l_ecc_curve_get_supported_ike_groups();
+	bool owe = s->akm_suite == IE_RSN_AKM_SUITE_OWE;
+	struct handshake_group_entry *e = NULL;
+	unsigned int preferred = 0;
+	unsigned int i;
+	unsigned int n = 0;
+
+	if (!s->authenticator) {
+		e = handshake_group_cache_find(owe, false, s->aa, 6);
+
+		if (!e && s->ssid_len)
+			e = handshake_group_cache_find(owe, true, s->ssid,
+							s->ssid_len);
+	}
+
+	for (i = 0; e && supported[i]; i++)
+		if (supported[i] == e->group)
+			preferred = e->group;
+
+	if (preferred)
+		groups[n++] = preferred;
+
+	for (i = 0; supported[i] && n < HANDSHAKE_MAX_ECC_GROUPS; i++)
+		if (supported[i] != preferred)
+			groups[n++] = supported[i];
+
+	groups[n] = 0;
+}
+
+void handshake_group_cache_flush(void)
+{
+	l_queue_destroy(group_cache, l_free);
+	group_cache = NULL;
+}
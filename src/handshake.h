@@ -54,6 +54,7 @@ enum handshake_event {
 	HANDSHAKE_EVENT_FAILED,
 	HANDSHAKE_EVENT_REKEY_FAILED,
 	HANDSHAKE_EVENT_EAP_NOTIFY,
+	HANDSHAKE_EVENT_REKEY_COMPLETE,
 };
 
 typedef void (*handshake_event_func_t)(struct handshake_state *hs,
@@ -79,14 +80,32 @@ void __handshake_set_install_tk_func(handshake_install_tk_func_t func);
 void __handshake_set_install_gtk_func(handshake_install_gtk_func_t func);
 void __handshake_set_install_igtk_func(handshake_install_igtk_func_t func);
 
+/* Element header plus the largest possible body */
+#define HANDSHAKE_IE_MAX_LEN	(2 + 255)
+
+struct handshake_pmk_r1 {
+	uint8_t r1khid[6];
+	uint8_t pmk_r1[48];
+	uint8_t pmk_r1_name[16];
+};
+
 struct handshake_state {
 	uint32_t ifindex;
 	uint8_t spa[6];
 	uint8_t aa[6];
+	/* Point into the inline storage below, or NULL if not set */
 	uint8_t *authenticator_ie;
 	uint8_t *supplicant_ie;
+	uint8_t *authenticator_rsnxe;
+	uint8_t *supplicant_rsnxe;
 	uint8_t *mde;
 	uint8_t *fte;
+	uint8_t authenticator_ie_buf[HANDSHAKE_IE_MAX_LEN];
+	uint8_t supplicant_ie_buf[HANDSHAKE_IE_MAX_LEN];
+	uint8_t authenticator_rsnxe_buf[HANDSHAKE_IE_MAX_LEN];
+	uint8_t supplicant_rsnxe_buf[HANDSHAKE_IE_MAX_LEN];
+	uint8_t mde_buf[HANDSHAKE_IE_MAX_LEN];
+	uint8_t fte_buf[HANDSHAKE_IE_MAX_LEN];
 	enum ie_rsn_cipher_suite pairwise_cipher;
 	enum ie_rsn_cipher_suite group_cipher;
 	enum ie_rsn_cipher_suite group_management_cipher;
@@ -96,13 +115,28 @@ struct handshake_state {
 	uint8_t snonce[32];
 	uint8_t anonce[32];
 	uint8_t ptk[136];
+	/* Keyed MIC object for the KCK in ptk, managed by eapol.c */
+	struct l_checksum *kck_checksum;
+	int kck_checksum_type;
+	uint8_t kck_checksum_key[32];
+	size_t kck_checksum_key_len;
 	uint8_t pmk_r0[48];
 	uint8_t pmk_r0_name[16];
 	uint8_t pmk_r1[48];
 	uint8_t pmk_r1_name[16];
+	/* PMK-R1s derived from pmk_r0 for the R1KHs of the mobility domain */
+	struct handshake_pmk_r1 pmk_r1_cache[4];
+	uint8_t pmk_r1_cache_len;
+	enum ie_rsn_akm_suite pmk_r0_akm;
+	bool have_pmk_r0 : 1;
 	uint8_t pmkid[16];
 	uint8_t fils_ft[48];
 	uint8_t fils_ft_len;
+	/* DHCP messages exchanged in FILS HLP containers */
+	uint8_t *fils_dhcp_discover;
+	size_t fils_dhcp_discover_len;
+	uint8_t *fils_dhcp_ack;
+	size_t fils_dhcp_ack_len;
 	struct l_settings *settings_8021x;
 	bool have_snonce : 1;
 	bool ptk_complete : 1;
@@ -131,6 +165,9 @@ struct handshake_state {
 	uint32_t client_ip_addr;
 	uint32_t subnet_mask;
 	uint32_t go_ip_addr;
+	/* Monotonic times of the first EAP frame and of msg 1/4 */
+	uint64_t eap_start_time;
+	uint64_t ptk_start_time;
 	void *user_data;
 
 	void (*free)(struct handshake_state *s);
@@ -163,6 +200,10 @@ bool handshake_state_set_authenticator_ie(struct handshake_state *s,
 						const uint8_t *ie);
 bool handshake_state_set_supplicant_ie(struct handshake_state *s,
 						const uint8_t *ie);
+void handshake_state_set_authenticator_rsnxe(struct handshake_state *s,
+						const uint8_t *ie);
+void handshake_state_set_supplicant_rsnxe(struct handshake_state *s,
+						const uint8_t *ie);
 void handshake_state_set_ssid(struct handshake_state *s,
 					const uint8_t *ssid, size_t ssid_len);
 void handshake_state_set_mde(struct handshake_state *s,
@@ -184,6 +225,11 @@ void handshake_state_set_fils_ft(struct handshake_state *s,
 					const uint8_t *fils_ft,
 					size_t fils_ft_len);
 
+void handshake_state_set_fils_dhcp_discover(struct handshake_state *s,
+						const uint8_t *msg, size_t len);
+void handshake_state_set_fils_dhcp_ack(struct handshake_state *s,
+					const uint8_t *msg, size_t len);
+
 void handshake_state_set_protocol_version(struct handshake_state *s,
 						uint8_t proto_version);
 
@@ -193,6 +239,8 @@ void handshake_state_set_anonce(struct handshake_state *s,
 				const uint8_t *anonce);
 void handshake_state_set_pmkid(struct handshake_state *s, const uint8_t *pmkid);
 bool handshake_state_derive_ptk(struct handshake_state *s);
+bool handshake_state_prepare_pmk_r1(struct handshake_state *s,
+					const uint8_t *r1khid);
 size_t handshake_state_get_ptk_size(struct handshake_state *s);
 size_t handshake_state_get_kck_len(struct handshake_state *s);
 const uint8_t *handshake_state_get_kck(struct handshake_state *s);
@@ -221,6 +269,15 @@ bool handshake_decode_fte_key(struct handshake_state *s, const uint8_t *wrapped,
 void handshake_state_set_gtk(struct handshake_state *s, const uint8_t *key,
 				unsigned int key_index, const uint8_t *rsc);
 
+/* Size of the ECC group lists, not counting the zero terminator */
+#define HANDSHAKE_MAX_ECC_GROUPS 8
+
+void handshake_state_set_accepted_group(struct handshake_state *s,
+					unsigned int group);
+void handshake_state_get_ecc_groups(const struct handshake_state *s,
+					unsigned int *groups);
+void handshake_group_cache_flush(void);
+
 bool handshake_util_ap_ie_matches(const uint8_t *msg_ie,
 					const uint8_t *scan_ie, bool is_wpa);
 
@@ -39,10 +39,25 @@
 #include "src/knownnetworks.h"
 #include "src/storage.h"
 #include "src/scan.h"
+#include "src/hotspot.h"
 
 static struct l_dir_watch *hs20_dir_watch;
 static struct l_queue *hs20_settings;
 
+/*
+ * Configs indexed by each of their NAI realms, lower-cased, by Roaming
+ * Consortium OI and by HESSID.  Each index maps to a queue of the configs
+ * sharing that key.
+ */
+static struct l_hashmap *hs20_realm_index;
+static struct l_hashtab *hs20_oi_index;
+static struct l_hashtab *hs20_hessid_index;
+
+struct hs20_oi_key {
+	uint8_t len;
+	uint8_t oi[5];
+};
+
 struct hs20_config {
 	struct network_info super;
 	char *filename;
@@ -65,11 +80,203 @@ static bool match_filename(const void *a, const void *b)
 	return false;
 }
 
+static char *hs20_realm_lower(const char *realm)
+{
+	char *lower = l_strdup(realm);
+	char *c;
+
+	for (c = lower; *c; c++)
+		if (l_ascii_isupper(*c))
+			*c += 'a' - 'A';
+
+	return lower;
+}
+
+static bool hs20_oi_key_init(struct hs20_oi_key *key, const uint8_t *oi,
+				size_t len)
+{
+	if (len > sizeof(key->oi))
+		return false;
+
+	memset(key, 0, sizeof(*key));
+	key->len = len;
+	memcpy(key->oi, oi, len);
+	return true;
+}
+
+static void hs20_realm_index_add(const char *realm, struct hs20_config *config)
+{
+	struct l_queue *configs = l_hashmap_lookup(hs20_realm_index, realm);
+
+	if (!configs) {
+		configs = l_queue_new();
+		l_hashmap_insert(hs20_realm_index, realm, configs);
+	}
+
+	l_queue_push_tail(configs, config);
+}
+
+static void hs20_realm_index_remove(const char *realm,
+					struct hs20_config *config)
+{
+	struct l_queue *configs = l_hashmap_lookup(hs20_realm_index, realm);
+
+	if (!l_queue_remove(configs, config) || !l_queue_isempty(configs))
+		return;
+
+	l_hashmap_remove(hs20_realm_index, realm);
+	l_queue_destroy(configs, NULL);
+}
+
+static void hs20_tab_index_add(struct l_hashtab *index, const void *key,
+				struct hs20_config *config)
+{
+	struct l_queue *configs = l_hashtab_lookup(index, key);
+
+	if (!configs) {
+		configs = l_queue_new();
+		l_hashtab_insert(index, key, configs);
+	}
+
+	l_queue_push_tail(configs, config);
+}
+
+static void hs20_tab_index_remove(struct l_hashtab *index, const void *key,
+					struct hs20_config *config)
+{
+	struct l_queue *configs = l_hashtab_lookup(index, key);
+
+	if (!l_queue_remove(configs, config) || !l_queue_isempty(configs))
+		return;
+
+	l_hashtab_remove(index, key);
+	l_queue_destroy(configs, NULL);
+}
+
+static void hs20_config_index(struct hs20_config *config, bool add)
+{
+	struct hs20_oi_key oi_key;
+	char **realm;
+
+	for (realm = config->nai_realms; realm && *realm; realm++) {
+		char *lower = hs20_realm_lower(*realm);
+
+		if (add)
+			hs20_realm_index_add(lower, config);
+		else
+			hs20_realm_index_remove(lower, config);
+
+		l_free(lower);
+	}
+
+	if (config->rc && hs20_oi_key_init(&oi_key, config->rc,
+						config->rc_len)) {
+		if (add)
+			hs20_tab_index_add(hs20_oi_index, &oi_key, config);
+		else
+			hs20_tab_index_remove(hs20_oi_index, &oi_key, config);
+	}
+
+	if (!l_memeqzero(config->hessid, 6)) {
+		if (add)
+			hs20_tab_index_add(hs20_hessid_index, config->hessid,
+						config);
+		else
+			hs20_tab_index_remove(hs20_hessid_index,
+						config->hessid, config);
+	}
+}
+
+/*
+ * Of @best and the configs in @configs, returns the one first in the
+ * known network order, i.e. the most recently connected.
+ */
+static struct hs20_config *hs20_config_best(struct l_queue *configs,
+						struct hs20_config *best)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(configs); entry;
+			entry = entry->next) {
+		struct hs20_config *config = entry->data;
+
+		if (!best || l_time_after(config->super.connected_time,
+						best->super.connected_time))
+			best = config;
+	}
+
+	return best;
+}
+
+static struct hs20_config *hs20_oi_best(const uint8_t *oi, size_t len,
+					struct hs20_config *best)
+{
+	struct hs20_oi_key key;
+
+	if (!oi || !hs20_oi_key_init(&key, oi, len))
+		return best;
+
+	return hs20_config_best(l_hashtab_lookup(hs20_oi_index, &key), best);
+}
+
+struct network_info *hotspot_find_by_bss(const struct scan_bss *bss)
+{
+	struct hs20_config *best = NULL;
+	const uint8_t *rc1, *rc2, *rc3;
+	size_t rc1_len, rc2_len, rc3_len;
+
+	if (!l_memeqzero(bss->hessid, 6))
+		best = hs20_config_best(l_hashtab_lookup(hs20_hessid_index,
+								bss->hessid),
+					best);
+
+	if (bss->rc_ie && ie_parse_roaming_consortium_from_data(bss->rc_ie,
+						bss->rc_ie[1] + 2, NULL,
+						&rc1, &rc1_len, &rc2, &rc2_len,
+						&rc3, &rc3_len) >= 0) {
+		best = hs20_oi_best(rc1, rc1_len, best);
+		best = hs20_oi_best(rc2, rc2_len, best);
+		best = hs20_oi_best(rc3, rc3_len, best);
+	}
+
+	return best ? &best->super : NULL;
+}
+
+/*
+ * A configured realm matches a realm in an ANQP response if it is the
+ * same domain, ignoring case, or a parent domain of it.
+ */
+struct network_info *hotspot_find_by_nai_realms(const char **nai_realms)
+{
+	struct hs20_config *best = NULL;
+	const char **realm;
+
+	for (realm = nai_realms; realm && *realm; realm++) {
+		char *lower = hs20_realm_lower(*realm);
+		const char *suffix = lower;
+
+		while (suffix) {
+			best = hs20_config_best(l_hashmap_lookup(
+							hs20_realm_index,
+							suffix), best);
+
+			suffix = strchr(suffix, '.');
+			if (suffix)
+				suffix++;
+		}
+
+		l_free(lower);
+	}
+
+	return best ? &best->super : NULL;
+}
+
 static void hs20_config_free(void *user_data)
 {
 	struct hs20_config *config = user_data;
 
 	l_queue_remove(hs20_settings, config);
+	hs20_config_index(config, false);
 
 	l_strv_free(config->nai_realms);
 	l_free(config->rc);
@@ -181,18 +388,6 @@ static const char *hotspot_network_get_type(const struct network_info *info)
 	return "hotspot";
 }
 
-static bool hotspot_match_hessid(const struct network_info *info,
-					const uint8_t *hessid)
-{
-	struct hs20_config *config = l_container_of(info, struct hs20_config,
-							super);
-
-	if (l_memeqzero(config->hessid, 6) || !hessid)
-		return false;
-
-	return !memcmp(config->hessid, hessid, 6);
-}
-
 static const uint8_t *hotspot_match_roaming_consortium(
 						const struct network_info *info,
 						const uint8_t *rc_ie,
@@ -236,26 +431,6 @@ static const uint8_t *hotspot_match_roaming_consortium(
 	return NULL;
 }
 
-static bool hotspot_match_nai_realms(const struct network_info *info,
-					const char **nai_realms)
-{
-	const char **realms = nai_realms;
-	struct hs20_config *config = l_container_of(info, struct hs20_config,
-							super);
-
-	if (!config->nai_realms || !nai_realms)
-		return false;
-
-	while (*realms) {
-		if (l_strv_contains(config->nai_realms, *realms))
-			return true;
-
-		realms++;
-	}
-
-	return false;
-}
-
 static const struct iovec *hotspot_network_get_ies(
 						const struct network_info *info,
 						struct scan_bss *bss,
@@ -296,6 +471,30 @@ static char *hotspot_network_get_file_path(const struct network_info *info)
 	return l_strdup(config->filename);
 }
 
+/*
+ * Whether @info could be the config matched to a network with this BSS,
+ * i.e. whether the BSS advertises its HESSID or Roaming Consortium OI.
+ * Cheap enough to call for every BSS of a network before doing the full
+ * hotspot_find_by_bss() on the selected one.
+ */
+bool hotspot_bss_matches(const struct network_info *info,
+				const struct scan_bss *bss)
+{
+	struct hs20_config *config = l_container_of(info, struct hs20_config,
+							super);
+
+	if (!info->is_hotspot)
+		return false;
+
+	if (!l_memeqzero(config->hessid, 6) &&
+			!memcmp(config->hessid, bss->hessid, 6))
+		return true;
+
+	return bss->rc_ie && hotspot_match_roaming_consortium(info,
+						bss->rc_ie, bss->rc_ie[1] + 2,
+						NULL);
+}
+
 static struct network_info_ops hotspot_ops = {
 	.open = hotspot_network_open,
 	.touch = hotspot_network_touch,
@@ -307,22 +506,21 @@ static struct network_info_ops hotspot_ops = {
 	.get_type = hotspot_network_get_type,
 	.get_extra_ies = hotspot_network_get_ies,
 	.get_file_path = hotspot_network_get_file_path,
-
-	.match_hessid = hotspot_match_hessid,
-	.match_roaming_consortium = hotspot_match_roaming_consortium,
-	.match_nai_realms = hotspot_match_nai_realms,
 };
 
-static struct hs20_config *hs20_config_new(struct l_settings *settings,
-						char *filename)
+/*
+ * Loads the HESSID, NAI realms and Roaming Consortium of a config, which
+ * networks are matched against.  The config is left untouched on error.
+ */
+static bool hs20_config_load_match(struct hs20_config *config,
+					struct l_settings *settings,
+					const char *filename)
 {
-	struct hs20_config *config;
 	char *hessid_str;
-	char **nai_realms = NULL;
+	uint8_t hessid[6] = {};
+	char **nai_realms;
 	size_t rc_len;
 	uint8_t *rc;
-	char *name;
-	bool autoconnect;
 
 	/* One of HESSID, NAI realms, or Roaming Consortium must be included */
 	hessid_str = l_settings_get_string(settings, "Hotspot", "HESSID");
@@ -333,49 +531,74 @@ static struct hs20_config *hs20_config_new(struct l_settings *settings,
 	rc = l_settings_get_bytes(settings, "Hotspot", "RoamingConsortium",
 								&rc_len);
 
-	if (!l_settings_get_bool(settings, "Settings", "AutoConnect",
-								&autoconnect))
-		autoconnect = true;
-
-	name = l_settings_get_string(settings, "Hotspot", "Name");
-
-	if ((!hessid_str && !nai_realms && !rc) || !name) {
+	if (!hessid_str && !nai_realms && !rc) {
 		l_error("Could not parse hotspot config %s", filename);
 		goto free_values;
 	}
 
-	config = l_new(struct hs20_config, 1);
-
-	if (hessid_str) {
-		if (!util_string_to_address(hessid_str, config->hessid)) {
-			l_error("Invalid HESSID in settings");
-			l_free(config);
-			goto free_values;
-		}
+	if (hessid_str && !util_string_to_address(hessid_str, hessid)) {
+		l_error("Invalid HESSID in settings");
+		goto free_values;
+	}
 
-		l_free(hessid_str);
+	/*
+	 * WiFi Alliance Hotspot 2.0 Spec - Section 3.1.4
+	 *
+	 * "The Consortium OI field is 3 or 5-octet field set to a value
+	 * of a roaming consortium OI"
+	 */
+	if (rc && rc_len != 3 && rc_len != 5) {
+		l_warn("invalid RoamingConsortium length %zu", rc_len);
+		l_free(rc);
+		rc = NULL;
 	}
 
-	if (nai_realms)
-		config->nai_realms = nai_realms;
+	l_free(hessid_str);
 
-	if (rc) {
-		/*
-		 * WiFi Alliance Hotspot 2.0 Spec - Section 3.1.4
-		 *
-		 * "The Consortium OI field is 3 or 5-octet field set to a value
-		 * of a roaming consortium OI"
-		 */
-		if (rc && rc_len != 3 && rc_len != 5) {
-			l_warn("invalid RoamingConsortium length %zu", rc_len);
-			l_free(rc);
-			rc = NULL;
-		}
+	memcpy(config->hessid, hessid, sizeof(hessid));
+
+	l_strv_free(config->nai_realms);
+	config->nai_realms = nai_realms;
+
+	l_free(config->rc);
+	config->rc = rc;
+	config->rc_len = rc ? rc_len : 0;
+
+	return true;
+
+free_values:
+	l_strv_free(nai_realms);
+	l_free(hessid_str);
+	l_free(rc);
+
+	return false;
+}
 
-		config->rc = rc;
-		config->rc_len = rc_len;
+static struct hs20_config *hs20_config_new(struct l_settings *settings,
+						char *filename)
+{
+	struct hs20_config *config;
+	char *name;
+	bool autoconnect;
+
+	name = l_settings_get_string(settings, "Hotspot", "Name");
+	if (!name) {
+		l_error("Could not parse hotspot config %s", filename);
+		return NULL;
+	}
+
+	config = l_new(struct hs20_config, 1);
+
+	if (!hs20_config_load_match(config, settings, filename)) {
+		l_free(config);
+		l_free(name);
+		return NULL;
 	}
 
+	if (!l_settings_get_bool(settings, "Settings", "AutoConnect",
+								&autoconnect))
+		autoconnect = true;
+
 	config->super.is_autoconnectable = autoconnect;
 	config->super.is_hotspot = true;
 	config->super.type = SECURITY_8021X;
@@ -385,17 +608,54 @@ static struct hs20_config *hs20_config_new(struct l_settings *settings,
 
 	config->filename = l_strdup(filename);
 
+	hs20_config_index(config, true);
 	known_networks_add(&config->super);
 
 	return config;
+}
 
-free_values:
-	l_strv_free(nai_realms);
-	l_free(hessid_str);
-	l_free(name);
-	l_free(rc);
+static bool hs20_strv_equal(char **a, char **b)
+{
+	if (!a || !b)
+		return a == b;
 
-	return NULL;
+	for (; *a && *b; a++, b++)
+		if (strcmp(*a, *b))
+			return false;
+
+	return !*a && !*b;
+}
+
+/*
+ * Re-reads the matching criteria of a modified config and moves it to the
+ * index entries for the new ones.  Returns whether they changed, if not
+ * none of the networks need to be matched again.
+ */
+static bool hs20_config_reload_match(struct hs20_config *config,
+					struct l_settings *settings)
+{
+	uint8_t old_hessid[6];
+	char **old_realms = l_strv_copy(config->nai_realms);
+	uint8_t *old_rc = config->rc ?
+				l_memdup(config->rc, config->rc_len) : NULL;
+	size_t old_rc_len = config->rc_len;
+	bool changed = false;
+
+	memcpy(old_hessid, config->hessid, sizeof(old_hessid));
+	hs20_config_index(config, false);
+
+	if (hs20_config_load_match(config, settings, config->filename))
+		changed = memcmp(old_hessid, config->hessid, 6) ||
+			!hs20_strv_equal(old_realms, config->nai_realms) ||
+			old_rc_len != config->rc_len ||
+			(old_rc_len && memcmp(old_rc, config->rc, old_rc_len));
+
+	hs20_config_index(config, true);
+
+	l_strv_free(old_realms);
+	l_free(old_rc);
+
+	return changed;
 }
 
 static void hs20_dir_watch_cb(const char *filename,
@@ -466,6 +726,10 @@ static void hs20_dir_watch_cb(const char *filename,
 							connected_time);
 		known_network_update(&config->super, new);
 
+		/* Networks only need matching again if the criteria changed */
+		if (hs20_config_reload_match(config, new))
+			known_network_notify_updated(&config->super);
+
 		l_settings_free(new);
 
 		break;
@@ -484,6 +748,11 @@ static void hs20_dir_watch_cb(const char *filename,
 	}
 }
 
+static void hs20_index_entry_free(void *data)
+{
+	l_queue_destroy(data, NULL);
+}
+
 static void hs20_dir_watch_destroy(void *user_data)
 {
 	hs20_dir_watch = NULL;
@@ -501,6 +770,10 @@ static int hotspot_init(void)
 		return -ENOENT;
 
 	hs20_settings = l_queue_new();
+	hs20_realm_index = l_hashmap_string_new();
+	hs20_oi_index = l_hashtab_new(sizeof(struct hs20_oi_key),
+					L_HASHTAB_HASH_FAST);
+	hs20_hessid_index = l_hashtab_new(6, L_HASHTAB_HASH_FAST);
 
 	while ((dirent = readdir(dir))) {
 		struct hs20_config *config;
@@ -540,6 +813,14 @@ static void hotspot_exit(void)
 
 	l_queue_destroy(hs20_settings, NULL);
 	hs20_settings = NULL;
+
+	/* The configs themselves are freed with the known networks */
+	l_hashmap_destroy(hs20_realm_index, hs20_index_entry_free);
+	hs20_realm_index = NULL;
+	l_hashtab_destroy(hs20_oi_index, hs20_index_entry_free);
+	hs20_oi_index = NULL;
+	l_hashtab_destroy(hs20_hessid_index, hs20_index_entry_free);
+	hs20_hessid_index = NULL;
 }
 
 IWD_MODULE(hotspot, hotspot_init, hotspot_exit)
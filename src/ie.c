@@ -86,6 +86,115 @@ bool ie_tlv_iter_next(struct ie_tlv_iter *iter)
 	return true;
 }
 
+/*
+ * Build an index of @ies.  Returns false if @len is too large to be indexed,
+ * in which case @index is left empty.
+ */
+bool ie_index_init(struct ie_index *index, const uint8_t *ies, size_t len)
+{
+	struct ie_tlv_iter iter;
+	unsigned int offset = 0;
+
+	memset(index, 0, sizeof(*index));
+
+	if (len > UINT16_MAX)
+		return false;
+
+	index->ies = ies;
+	index->len = len;
+
+	ie_tlv_iter_init(&iter, ies, len);
+
+	while (ie_tlv_iter_next(&iter)) {
+		unsigned int tag = ie_tlv_iter_get_tag(&iter);
+
+		if (tag == IE_TYPE_VENDOR_SPECIFIC) {
+			if (index->n_vendor < IE_INDEX_MAX_VENDOR)
+				index->vendor[index->n_vendor++] = offset;
+			else
+				index->vendor_overflow = true;
+		}
+
+		if (!index->first[tag])
+			index->first[tag] = offset + 1;
+
+		if (index->count[tag] < UINT8_MAX)
+			index->count[tag] += 1;
+
+		offset = iter.pos;
+	}
+
+	return true;
+}
+
+/*
+ * Returns a pointer to the start (the Element ID octet) of the first element
+ * with @tag, or NULL if there is none.
+ */
+const uint8_t *ie_index_find(const struct ie_index *index, unsigned int tag)
+{
+	if (tag >= IE_INDEX_MAX_TAG || !index->first[tag])
+		return NULL;
+
+	return index->ies + index->first[tag] - 1;
+}
+
+/*
+ * Returns a pointer to the start of the first Vendor Specific element
+ * with the given OUI and type, or NULL if there is none.
+ */
+const uint8_t *ie_index_find_vendor(const struct ie_index *index,
+					const unsigned char oui[3],
+					uint8_t type)
+{
+	struct ie_tlv_iter iter;
+	unsigned int i;
+
+	for (i = 0; i < index->n_vendor; i++) {
+		const uint8_t *ie = index->ies + index->vendor[i];
+
+		if (ie[1] >= 4 && !memcmp(ie + 2, oui, 3) && ie[5] == type)
+			return ie;
+	}
+
+	if (!index->vendor_overflow)
+		return NULL;
+
+	/* Too many vendor elements to index, walk the rest */
+	i = index->vendor[IE_INDEX_MAX_VENDOR - 1];
+	ie_tlv_iter_init(&iter, index->ies + i, index->len - i);
+	ie_tlv_iter_next(&iter);
+
+	while (ie_tlv_iter_next(&iter)) {
+		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_VENDOR_SPECIFIC ||
+				iter.len < 4)
+			continue;
+
+		if (!memcmp(iter.data, oui, 3) && iter.data[3] == type)
+			return iter.data - 2;
+	}
+
+	return NULL;
+}
+
+/*
+ * Point @iter at the first element with @tag, as if ie_tlv_iter_next had
+ * just returned it.  Further calls to ie_tlv_iter_next continue with the
+ * elements following it.
+ */
+bool ie_index_iter_init(const struct ie_index *index, unsigned int tag,
+				struct ie_tlv_iter *iter)
+{
+	const uint8_t *ie = ie_index_find(index, tag);
+
+	if (!ie)
+		return false;
+
+	ie_tlv_iter_init(iter, ie, index->ies + index->len - ie);
+
+	return ie_tlv_iter_next(iter);
+}
+
 /*
  * Concatenate all vendor IEs with a given OUI + type.
  *
@@ -168,6 +277,56 @@ static void *ie_tlv_vendor_ie_concat(const unsigned char oui[],
 	return ret;
 }
 
+/*
+ * Like ie_tlv_vendor_ie_concat but returns a pointer into @ies instead of
+ * a copy.  This only works if the payload is carried in a single element,
+ * if it is fragmented over several elements NULL is returned and @out_len
+ * is set to -EMSGSIZE.
+ */
+static const void *ie_tlv_vendor_ie_peek(const unsigned char oui[],
+					unsigned char type,
+					const unsigned char *ies,
+					unsigned int len,
+					bool empty_ok,
+					ssize_t *out_len)
+{
+	struct ie_tlv_iter iter;
+	const unsigned char *data;
+	const unsigned char *ret = NULL;
+	unsigned int ret_len = 0;
+
+	ie_tlv_iter_init(&iter, ies, len);
+
+	while (ie_tlv_iter_next(&iter)) {
+		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_VENDOR_SPECIFIC)
+			continue;
+
+		if (ie_tlv_iter_get_length(&iter) < 4)
+			continue;
+
+		data = ie_tlv_iter_get_data(&iter);
+
+		if (memcmp(data, oui, 3) || data[3] != type)
+			continue;
+
+		if (ret) {
+			*out_len = -EMSGSIZE;
+			return NULL;
+		}
+
+		ret = data + 4;
+		ret_len = ie_tlv_iter_get_length(&iter) - 4;
+	}
+
+	if (!ret_len) {
+		*out_len = (ret && empty_ok) ? 0 : -ENOENT;
+		return NULL;
+	}
+
+	*out_len = ret_len;
+	return ret;
+}
+
 /*
  * Wi-Fi Simple Configuration v2.0.5, Section 8.2:
  * "There may be more than one instance of the Wi-Fi Simple Configuration
@@ -268,6 +427,20 @@ static void *ie_tlv_vendor_ie_encapsulate(const unsigned char oui[],
 	return ret;
 }
 
+/*
+ * Returns the WSC payload in place when it is contained in a single element,
+ * which is by far the most common case, avoiding the copy made by
+ * ie_tlv_extract_wsc_payload.  If the payload is fragmented, NULL is returned
+ * with @out_len set to -EMSGSIZE and ie_tlv_extract_wsc_payload should be
+ * used instead.
+ */
+const void *ie_tlv_peek_wsc_payload(const unsigned char *ies, size_t len,
+							ssize_t *out_len)
+{
+	return ie_tlv_vendor_ie_peek(microsoft_oui, 0x04, ies, len, false,
+					out_len);
+}
+
 void *ie_tlv_encapsulate_wsc_payload(const uint8_t *data, size_t len,
 								size_t *out_len)
 {
@@ -275,6 +448,18 @@ void *ie_tlv_encapsulate_wsc_payload(const uint8_t *data, size_t len,
 						data, len, false, out_len);
 }
 
+/*
+ * Same as ie_tlv_peek_wsc_payload but for the P2P payload.  Like with
+ * ie_tlv_extract_p2p_payload, an empty payload results in NULL and @out_len
+ * set to 0.
+ */
+const void *ie_tlv_peek_p2p_payload(const unsigned char *ies, size_t len,
+							ssize_t *out_len)
+{
+	return ie_tlv_vendor_ie_peek(wifi_alliance_oui, 0x09, ies, len, true,
+					out_len);
+}
+
 void *ie_tlv_encapsulate_p2p_payload(const uint8_t *data, size_t len,
 								size_t *out_len)
 {
@@ -1176,6 +1361,53 @@ bool ie_build_rsne(const struct ie_rsn_info *info, uint8_t *to)
 	return true;
 }
 
+/*
+ * 802.11-2020, Section 9.4.2.241 RSN Extension element.  @rsnxe points to
+ * the whole element.  The low 4 bits of the first octet hold the length of
+ * the Extended RSN Capabilities field minus one.
+ */
+bool ie_rsnxe_capable(const uint8_t *rsnxe, enum ie_rsnx_capability bit)
+{
+	unsigned int field_len;
+
+	if (!rsnxe || rsnxe[0] != IE_TYPE_RSNX || rsnxe[1] < 1)
+		return false;
+
+	field_len = bit_field(rsnxe[2], 0, 4) + 1;
+	if (field_len > rsnxe[1] || bit >= field_len * 8)
+		return false;
+
+	return test_bit(rsnxe + 2, bit);
+}
+
+/*
+ * Builds an RSNXE with the smallest field length able to carry
+ * @capabilities, a bitmap of enum ie_rsnx_capability bits.  Returns false if
+ * there's nothing to advertise and thus no element should be sent.
+ */
+bool ie_build_rsnxe(uint32_t capabilities, uint8_t *to)
+{
+	unsigned int field_len;
+	unsigned int i;
+
+	/* Bits 0-3 are the field length */
+	capabilities &= ~0xfu;
+	if (!capabilities)
+		return false;
+
+	field_len = (32 - __builtin_clz(capabilities) + 7) / 8;
+
+	to[0] = IE_TYPE_RSNX;
+	to[1] = field_len;
+
+	for (i = 0; i < field_len; i++)
+		to[2 + i] = capabilities >> (i * 8);
+
+	to[2] |= field_len - 1;
+
+	return true;
+}
+
 bool ie_rsne_is_wpa3_personal(const struct ie_rsn_info *info)
 {
 	bool is_transition = info->akm_suites & IE_RSN_AKM_SUITE_PSK;
@@ -1763,36 +1995,81 @@ enum ht_vht_channel_width {
 };
 
 /*
- * Base RSSI values for 20MHz (both HT and VHT) channel. These values can be
+ * Base RSSI values for 20MHz (HT, VHT and HE) channel. These values can be
  * used to calculate the minimum RSSI values for all other channel widths. HT
  * MCS indexes are grouped into ranges of 8 (per spatial stream) where VHT are
- * grouped in chunks of 10. This just means HT will not use the last two
- * index's of this array.
+ * grouped in chunks of 10 and HE in chunks of 12. This just means HT and VHT
+ * will not use the last index's of this array.
  */
 static const int32_t ht_vht_base_rssi[] = {
-	-82, -79, -77, -74, -70, -66, -65, -64, -59, -57
+	-82, -79, -77, -74, -70, -66, -65, -64, -59, -57, -54, -52
 };
 
-struct ht_vht_rate {
-	uint64_t rate;
-	uint64_t sgi_rate;
+/*
+ * Single spatial stream data rates in units of 100Kbps, indexed by channel
+ * width, MCS index and whether the short (400ns) guard interval is used.
+ * IEEE 802.11-2016 Tables 19-27 to 19-30 (HT) and 21-30 to 21-46 (VHT).  HT
+ * uses the relative MCS index (0 - 7) for each NSS.  The NSS rates are
+ * exact multiples of these since the number of data bits per symbol scales
+ * with the number of spatial streams.
+ */
+static const uint16_t ht_vht_rates[4][10][2] = {
+	[HT_VHT_CHANNEL_WIDTH_20MHZ] = {
+		{ 65, 72 }, { 130, 144 }, { 195, 217 }, { 260, 289 },
+		{ 390, 433 }, { 520, 578 }, { 585, 650 }, { 650, 722 },
+		{ 780, 867 }, { 867, 963 },
+	},
+	[HT_VHT_CHANNEL_WIDTH_40MHZ] = {
+		{ 135, 150 }, { 270, 300 }, { 405, 450 }, { 540, 600 },
+		{ 810, 900 }, { 1080, 1200 }, { 1215, 1350 }, { 1350, 1500 },
+		{ 1620, 1800 }, { 1800, 2000 },
+	},
+	[HT_VHT_CHANNEL_WIDTH_80MHZ] = {
+		{ 293, 325 }, { 585, 650 }, { 878, 975 }, { 1170, 1300 },
+		{ 1755, 1950 }, { 2340, 2600 }, { 2633, 2925 }, { 2925, 3250 },
+		{ 3510, 3900 }, { 3900, 4333 },
+	},
+	[HT_VHT_CHANNEL_WIDTH_160MHZ] = {
+		{ 585, 650 }, { 1170, 1300 }, { 1755, 1950 }, { 2340, 2600 },
+		{ 3510, 3900 }, { 4680, 5200 }, { 5265, 5850 }, { 5850, 6500 },
+		{ 7020, 7800 }, { 7800, 8667 },
+	},
 };
 
-static const struct ht_vht_rate ht_vht_rates[] = {
-	[HT_VHT_CHANNEL_WIDTH_20MHZ] = {	.rate = 6500000,
-						.sgi_rate = 7200000 },
-	[HT_VHT_CHANNEL_WIDTH_40MHZ] = {	.rate = 13500000,
-						.sgi_rate = 15000000 },
-	[HT_VHT_CHANNEL_WIDTH_80MHZ] = {	.rate = 29300000,
-						.sgi_rate = 32500000 },
-	[HT_VHT_CHANNEL_WIDTH_160MHZ] = {	.rate = 58500000,
-						.sgi_rate = 65000000 },
+/*
+ * Single spatial stream HE SU PPDU data rates in units of 100Kbps using the
+ * 0.8us guard interval, indexed by channel width and MCS index.
+ * IEEE 802.11ax-2021 Tables 27-79 to 27-110.
+ */
+static const uint16_t he_rates[4][12] = {
+	[HT_VHT_CHANNEL_WIDTH_20MHZ] = {
+		86, 172, 258, 344, 516, 688, 774, 860, 1032, 1147, 1290, 1434,
+	},
+	[HT_VHT_CHANNEL_WIDTH_40MHZ] = {
+		172, 344, 516, 688, 1032, 1376, 1549, 1721, 2065, 2294, 2581,
+		2868,
+	},
+	[HT_VHT_CHANNEL_WIDTH_80MHZ] = {
+		360, 721, 1081, 1441, 2162, 2882, 3243, 3603, 4324, 4804, 5404,
+		6004,
+	},
+	[HT_VHT_CHANNEL_WIDTH_160MHZ] = {
+		721, 1441, 2162, 2882, 4324, 5765, 6485, 7206, 8647, 9608,
+		10809, 12010,
+	},
 };
 
+static bool ht_vht_rssi_is_sufficient(uint8_t index,
+					enum ht_vht_channel_width width,
+					int32_t rssi)
+{
+	return rssi >= ht_vht_base_rssi[index] + (int32_t) width * 3;
+}
+
 /*
- * Both HT and VHT rates are calculated in the same fashion. The only difference
- * is a relative MCS index is used for HT since, for each NSS, the formula
- * is the same with relative index's. This is why this is called with index % 8
+ * Both HT and VHT rates are looked up in the same table. The only difference
+ * is a relative MCS index is used for HT since, for each NSS, the rates are
+ * the same with relative index's. This is why this is called with index % 8
  * for HT, but not VHT.
  */
 static bool calculate_ht_vht_data_rate(uint8_t index,
@@ -1800,28 +2077,23 @@ static bool calculate_ht_vht_data_rate(uint8_t index,
 					int32_t rssi, uint8_t nss, bool sgi,
 					uint64_t *data_rate)
 {
-	const struct ht_vht_rate *rate = &ht_vht_rates[width];
-	int32_t width_adjust = width * 3;
-
-	if (rssi < ht_vht_base_rssi[index] + width_adjust)
+	if (!ht_vht_rssi_is_sufficient(index, width, rssi))
 		return false;
 
-	if (sgi)
-		*data_rate = rate->sgi_rate;
-	else
-		*data_rate = rate->rate;
+	*data_rate = (uint64_t) ht_vht_rates[width][index][sgi] * nss * 100000;
 
-	/* adjust base for spatial streams */
-	*data_rate *= nss;
+	return true;
+}
 
-	/*
-	 * As with HT, the VHT rates multiplier jumps up
-	 * by 2 after MCS index 4
-	 */
-	if (index < 4)
-		*data_rate *= index + 1;
-	else
-		*data_rate *= index + 3;
+static bool calculate_he_data_rate(uint8_t index,
+					enum ht_vht_channel_width width,
+					int32_t rssi, uint8_t nss,
+					uint64_t *data_rate)
+{
+	if (!ht_vht_rssi_is_sufficient(index, width, rssi))
+		return false;
+
+	*data_rate = (uint64_t) he_rates[width][index] * nss * 100000;
 
 	return true;
 }
@@ -2003,7 +2275,7 @@ static int ie_parse_vht_capability(struct ie_tlv_iter *vht_iter,
 	tx_mcs_map[1] = *data++;
 
 	/* NSS->MCS map values are grouped in 2-bit values */
-	for (mcs = 15; mcs >= 0; mcs -= 2) {
+	for (mcs = 14; mcs >= 0; mcs -= 2) {
 		uint8_t rx_val = bit_field(rx_mcs_map[mcs / 8],
 							mcs % 8, 2);
 		uint8_t tx_val = bit_field(tx_mcs_map[mcs / 8],
@@ -2130,17 +2402,143 @@ static int ie_parse_vht_capability_from_data(const uint8_t *vht_ie,
 	return ie_parse_vht_capability(&vht_iter, &ht_iter, rssi, data_rate);
 }
 
+/*
+ * Returns the highest MCS index and NSS supported in both directions, out of
+ * a pair of Rx/Tx HE-MCS maps.  IEEE 802.11ax-2021 Figure 9-788eg
+ */
+static bool he_parse_mcs_nss(const uint8_t *rx_map, const uint8_t *tx_map,
+				unsigned int *out_mcs, unsigned int *out_nss)
+{
+	uint16_t rx = l_get_le16(rx_map);
+	uint16_t tx = l_get_le16(tx_map);
+	int nss;
+
+	for (nss = 7; nss >= 0; nss--) {
+		uint8_t rx_val = (rx >> (nss * 2)) & 3;
+		uint8_t tx_val = (tx >> (nss * 2)) & 3;
+
+		/*
+		 * 0 indicates support for MCS 0-7
+		 * 1 indicates support for MCS 0-9
+		 * 2 indicates support for MCS 0-11
+		 * 3 indicates that the NSS is not supported
+		 */
+		if (rx_val == 3 || tx_val == 3)
+			continue;
+
+		*out_mcs = 7 + minsize(rx_val, tx_val) * 2;
+		*out_nss = nss + 1;
+		return true;
+	}
+
+	return false;
+}
+
+static int ie_parse_he_capability(struct ie_tlv_iter *iter, int32_t rssi,
+					uint64_t *data_rate)
+{
+	unsigned int len;
+	const uint8_t *data;
+	const uint8_t *mcs_maps[4] = {};
+	uint8_t width_set;
+	int width;
+	uint64_t highest_rate = 0;
+
+	if (ie_tlv_iter_get_tag(iter) != IE_TYPE_HE_CAPABILITIES)
+		return -EINVAL;
+
+	len = ie_tlv_iter_get_length(iter);
+
+	/* MAC (6), PHY (11) and the mandatory <= 80MHz HE-MCS maps (4) */
+	if (len < 21)
+		return -EINVAL;
+
+	data = ie_tlv_iter_get_data(iter);
+
+	/* HE PHY Capabilities Information, Supported Channel Width Set */
+	width_set = bit_field(data[6], 1, 7);
+
+	mcs_maps[HT_VHT_CHANNEL_WIDTH_20MHZ] = data + 17;
+
+	/* B0 is 40MHz in 2.4GHz, B1 is 40 and 80MHz in 5/6GHz */
+	if (width_set & 0x3)
+		mcs_maps[HT_VHT_CHANNEL_WIDTH_40MHZ] = data + 17;
+
+	if (width_set & 0x2)
+		mcs_maps[HT_VHT_CHANNEL_WIDTH_80MHZ] = data + 17;
+
+	/* B2 is 160MHz in 5/6GHz which adds the 160MHz HE-MCS maps */
+	if ((width_set & 0x4) && len >= 25)
+		mcs_maps[HT_VHT_CHANNEL_WIDTH_160MHZ] = data + 21;
+
+	for (width = HT_VHT_CHANNEL_WIDTH_160MHZ; width >= 0; width--) {
+		unsigned int max_mcs;
+		unsigned int max_nss;
+		unsigned int nss;
+		int mcs;
+
+		if (!mcs_maps[width])
+			continue;
+
+		if (!he_parse_mcs_nss(mcs_maps[width], mcs_maps[width] + 2,
+					&max_mcs, &max_nss))
+			continue;
+
+		for (nss = max_nss; nss > 0; nss--) {
+			for (mcs = max_mcs; mcs >= 0; mcs--) {
+				uint64_t drate;
+
+				if (!calculate_he_data_rate(mcs, width, rssi,
+								nss, &drate))
+					continue;
+
+				if (drate > highest_rate)
+					highest_rate = drate;
+
+				/* Lower MCS index will only have lower rates */
+				goto next_chanwidth;
+			}
+		}
+next_chanwidth: ; /* empty statement */
+	}
+
+	if (highest_rate == 0)
+		return -ENOTSUP;
+
+	*data_rate = highest_rate;
+
+	return 0;
+}
+
+static int ie_parse_he_capability_from_data(const uint8_t *he_ie,
+					size_t he_len, int32_t rssi,
+					uint64_t *data_rate)
+{
+	struct ie_tlv_iter iter;
+
+	ie_tlv_iter_init(&iter, he_ie, he_len);
+
+	if (!ie_tlv_iter_next(&iter))
+		return -EMSGSIZE;
+
+	if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_HE_CAPABILITIES)
+		return -EPROTOTYPE;
+
+	return ie_parse_he_capability(&iter, rssi, data_rate);
+}
+
 /*
  * Calculates the theoretical maximum data rates out of the provided
- * supported rates IE, HT IE, and VHT IE. All 3 parsing functions are allowed
- * to return -ENOTSUP, which indicates that a data rate was not found given
- * the provided data. This is not fatal, it most likely means our RSSI was too
- * low.
+ * supported rates IE, HT IE, VHT IE and HE IE. All parsing functions are
+ * allowed to return -ENOTSUP, which indicates that a data rate was not found
+ * given the provided data. This is not fatal, it most likely means our RSSI
+ * was too low.
  */
 int ie_parse_data_rates(const uint8_t *supp_rates_ie,
 			const uint8_t *ext_supp_rates_ie,
 			const uint8_t *ht_ie,
 			const uint8_t *vht_ie,
+			const uint8_t *he_ie,
 			int32_t rssi,
 			uint64_t *data_rate)
 {
@@ -2151,6 +2549,13 @@ int ie_parse_data_rates(const uint8_t *supp_rates_ie,
 	if (rssi < -82)
 		return -ENOTSUP;
 
+	if (he_ie) {
+		ret = ie_parse_he_capability_from_data(he_ie, IE_LEN(he_ie),
+							rssi, &rate);
+		if (ret == 0)
+			goto done;
+	}
+
 	if (ht_ie && vht_ie) {
 		ret = ie_parse_vht_capability_from_data(vht_ie, IE_LEN(vht_ie),
 							ht_ie, IE_LEN(ht_ie),
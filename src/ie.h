@@ -216,6 +216,8 @@ enum ie_type {
 	IE_TYPE_VENDOR_SPECIFIC                      = 221,
 	/* Reserved 222 - 254 */
 	IE_TYPE_FILS_INDICATION                      = 240,
+	IE_TYPE_FRAGMENT                             = 242,
+	IE_TYPE_RSNX                                 = 244,
 	IE_TYPE_EXTENSION                            = 255,
 
 	IE_TYPE_FILS_REQUEST_PARAMETERS              = 256 + 2,
@@ -232,6 +234,15 @@ enum ie_type {
 	IE_TYPE_FILS_NONCE                           = 256 + 13,
 	IE_TYPE_FUTURE_CHANNEL_GUIDANCE              = 256 + 14,
 	IE_TYPE_OWE_DH_PARAM                         = 256 + 32,
+	IE_TYPE_HE_CAPABILITIES                      = 256 + 35,
+	IE_TYPE_REJECTED_GROUPS                      = 256 + 92,
+	IE_TYPE_ANTI_CLOGGING_TOKEN_CONTAINER        = 256 + 93,
+};
+
+/* 802.11-2020, Table 9-474 Extended RSN Capabilities field bits */
+enum ie_rsnx_capability {
+	IE_RSNX_PROTECTED_TWT = 4,
+	IE_RSNX_SAE_H2E = 5,
 };
 
 /*
@@ -314,6 +325,26 @@ struct ie_tlv_iter {
 	const unsigned char *data;
 };
 
+#define IE_INDEX_MAX_TAG	512
+#define IE_INDEX_MAX_VENDOR	16
+
+/*
+ * Offsets of the elements in an IE buffer, built in a single pass so that
+ * code interested in several different elements does not need to walk the
+ * buffer once per element.  Tags use the same numbering as ie_tlv_iter,
+ * i.e. Extension elements are at 256 + Element ID Extension.  Like with
+ * ie_tlv_iter, indexing stops at the first malformed element.
+ */
+struct ie_index {
+	const uint8_t *ies;
+	uint16_t len;
+	uint16_t first[IE_INDEX_MAX_TAG];	/* offset + 1, 0 if absent */
+	uint8_t count[IE_INDEX_MAX_TAG];
+	uint16_t vendor[IE_INDEX_MAX_VENDOR];	/* offsets */
+	uint8_t n_vendor;
+	bool vendor_overflow : 1;
+};
+
 #define MAX_BUILDER_SIZE (8 * 1024)
 
 struct ie_tlv_builder {
@@ -435,13 +466,31 @@ static inline const unsigned char *ie_tlv_iter_get_data(
 	return iter->data;
 }
 
+bool ie_index_init(struct ie_index *index, const uint8_t *ies, size_t len);
+const uint8_t *ie_index_find(const struct ie_index *index, unsigned int tag);
+const uint8_t *ie_index_find_vendor(const struct ie_index *index,
+					const unsigned char oui[3],
+					uint8_t type);
+bool ie_index_iter_init(const struct ie_index *index, unsigned int tag,
+				struct ie_tlv_iter *iter);
+
+static inline unsigned int ie_index_count(const struct ie_index *index,
+						unsigned int tag)
+{
+	return tag < IE_INDEX_MAX_TAG ? index->count[tag] : 0;
+}
+
 void *ie_tlv_extract_wsc_payload(const uint8_t *ies, size_t len,
 							ssize_t *out_len);
+const void *ie_tlv_peek_wsc_payload(const uint8_t *ies, size_t len,
+							ssize_t *out_len);
 void *ie_tlv_encapsulate_wsc_payload(const uint8_t *data, size_t len,
 							size_t *out_len);
 
 void *ie_tlv_extract_p2p_payload(const uint8_t *ies, size_t len,
 							ssize_t *out_len);
+const void *ie_tlv_peek_p2p_payload(const uint8_t *ies, size_t len,
+							ssize_t *out_len);
 void *ie_tlv_encapsulate_p2p_payload(const uint8_t *data, size_t len,
 							size_t *out_len);
 
@@ -469,6 +518,9 @@ int ie_parse_rsne_from_data(const uint8_t *data, size_t len,
 bool ie_build_rsne(const struct ie_rsn_info *info, uint8_t *to);
 bool ie_rsne_is_wpa3_personal(const struct ie_rsn_info *info);
 
+bool ie_rsnxe_capable(const uint8_t *rsnxe, enum ie_rsnx_capability bit);
+bool ie_build_rsnxe(uint32_t capabilities, uint8_t *to);
+
 int ie_parse_wpa(struct ie_tlv_iter *iter, struct ie_rsn_info *out_info);
 int ie_parse_wpa_from_data(const uint8_t *data, size_t len,
 						struct ie_rsn_info *info);
@@ -494,6 +546,7 @@ int ie_parse_data_rates(const uint8_t *supp_rates_ie,
 			const uint8_t *ext_supp_rates_ie,
 			const uint8_t *ht_ie,
 			const uint8_t *vht_ie,
+			const uint8_t *he_ie,
 			int32_t rssi,
 			uint64_t *data_rate);
 
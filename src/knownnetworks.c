@@ -25,12 +25,14 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include <ell/ell.h>
 
@@ -44,19 +46,50 @@
 #include "src/knownnetworks.h"
 #include "src/scan.h"
 #include "src/util.h"
+#include "src/crypto.h"
+#include "src/pmksa.h"
 #include "src/watchlist.h"
+#include "src/eap.h"
+#include "src/eap-tls-common.h"
+#include "src/erp.h"
 
 static struct l_queue *known_networks;
+static struct l_hashmap *known_networks_index;	/* By network_key */
+static uint32_t known_networks_offset_gen;
+static struct scan_freq_set *recent_freqs;	/* Cached, see below */
+static uint8_t recent_freqs_num_networks;
 static size_t num_known_hidden_networks;
 static struct l_dir_watch *storage_dir_watch;
 static struct watchlist known_network_watches;
 static struct l_settings *known_freqs;
+static struct l_timeout *known_freqs_sync_timeout;
+static struct l_queue *psk_precompute_list;
+static struct l_idle *psk_precompute_idle;
+static struct l_queue *psk_precompute_jobs;
+
+IWD_MODULE_COUNTER(known_networks, known_network)
+
+/*
+ * Metadata of the profiles in the storage directory, keyed by file name
+ * and validated against the file's mtime and size, so that the known
+ * network list can be built at startup without parsing every profile.
+ * The UUID is derived from the path and mtime so it isn't stored.
+ */
+static struct l_settings *known_index;
+
+struct known_network_meta {
+	uint64_t mtime;
+	uint64_t size;
+	bool is_hidden;
+	bool is_autoconnectable;
+};
 
 static void network_info_free(void *data)
 {
 	struct network_info *network = data;
 
-	l_queue_destroy(network->known_frequencies, l_free);
+	scan_freq_set_free(network->neighbor_freqs);
+	network_key_unref(network->key);
 
 	network->ops->free(network);
 }
@@ -93,6 +126,38 @@ static const char *known_network_get_path(const struct network_info *network)
 	return path;
 }
 
+/*
+ * The recent frequencies only change when the known networks are reordered,
+ * added or removed or one of them starts or stops being seen on a frequency.
+ */
+static void known_networks_recent_frequencies_invalidate(void)
+{
+	scan_freq_set_free(recent_freqs);
+	recent_freqs = NULL;
+}
+
+/*
+ * Changes whenever known_network_offset() may return a different value for
+ * any network, i.e. when the known networks are reordered, added, removed
+ * or start or stop being seen.
+ */
+uint32_t known_networks_offset_generation(void)
+{
+	return known_networks_offset_gen;
+}
+
+void known_network_seen_count_inc(struct network_info *info)
+{
+	if (info->seen_count++ == 0)
+		known_networks_offset_gen++;
+}
+
+void known_network_seen_count_dec(struct network_info *info)
+{
+	if (--info->seen_count == 0)
+		known_networks_offset_gen++;
+}
+
 /*
  * Finds the position n of this network_info in the list of known networks
  * sorted by connected_time.  E.g. an offset of 0 means the most recently
@@ -165,6 +230,14 @@ static void known_network_sync(struct network_info *info,
 
 static void known_network_remove(struct network_info *info)
 {
+	if (info->type == SECURITY_8021X) {
+		_auto_(l_free) char *peer_id =
+			l_util_hexstring((const uint8_t *) info->ssid,
+						strlen(info->ssid));
+
+		eap_tls_forget_peer(peer_id);
+	}
+
 	storage_network_remove(info->type, info->ssid);
 }
 
@@ -275,24 +348,58 @@ void network_info_set_uuid(struct network_info *info, const uint8_t *uuid)
 	info->has_uuid = true;
 }
 
+struct roam_freqs_data {
+	struct scan_freq_set *freqs;
+	uint32_t current_freq;
+};
+
+static void known_network_add_roam_freq(uint32_t freq, void *user_data)
+{
+	struct roam_freqs_data *data = user_data;
+
+	if (freq != data->current_freq)
+		scan_freq_set_add(data->freqs, freq);
+}
+
+/* Neighbor report channels older than this are no longer used, in seconds */
+#define KNOWN_NEIGHBOR_MAX_AGE (7 * 24 * 3600)
+
+static bool known_network_neighbors_fresh(const struct network_info *info)
+{
+	uint64_t now = time(NULL);
+
+	return info->neighbor_freqs && info->neighbor_time <= now &&
+		now - info->neighbor_time < KNOWN_NEIGHBOR_MAX_AGE;
+}
+
 struct scan_freq_set *network_info_get_roam_frequencies(
 					const struct network_info *info,
 					uint32_t current_freq,
 					uint8_t max)
 {
 	struct scan_freq_set *freqs;
-	const struct l_queue_entry *entry;
+	unsigned int i;
 
 	freqs = scan_freq_set_new();
 
-	for (entry = l_queue_get_entries(info->known_frequencies); entry && max;
-			entry = entry->next) {
-		struct known_frequency *kn = entry->data;
+	/*
+	 * Channels from a neighbor report received in an earlier session
+	 * or from another AP of the ESS, on top of the known frequencies.
+	 */
+	if (known_network_neighbors_fresh(info)) {
+		struct roam_freqs_data data = { freqs, current_freq };
+
+		scan_freq_set_foreach(info->neighbor_freqs,
+					known_network_add_roam_freq, &data);
+	}
+
+	for (i = 0; i < info->n_known_frequencies && max; i++) {
+		uint32_t frequency = info->known_frequencies[i].frequency;
 
-		if (kn->frequency == current_freq)
+		if (frequency == current_freq)
 			continue;
 
-		scan_freq_set_add(freqs, kn->frequency);
+		scan_freq_set_add(freqs, frequency);
 
 		max--;
 	}
@@ -305,40 +412,11 @@ struct scan_freq_set *network_info_get_roam_frequencies(
 	return freqs;
 }
 
-bool network_info_match_hessid(const struct network_info *info,
-				const uint8_t *hessid)
-{
-	if (!info->ops->match_hessid)
-		return false;
-
-	return info->ops->match_hessid(info, hessid);
-}
-
-const uint8_t *network_info_match_roaming_consortium(
-						const struct network_info *info,
-						const uint8_t *rc,
-						size_t rc_len,
-						size_t *rc_len_out)
-{
-	if (!info->ops->match_roaming_consortium)
-		return NULL;
-
-	return info->ops->match_roaming_consortium(info, rc, rc_len,
-							rc_len_out);
-}
-
-bool network_info_match_nai_realm(const struct network_info *info,
-						const char **nai_realms)
-{
-	if (!info->ops->match_nai_realms)
-		return false;
-
-	return info->ops->match_nai_realms(info, nai_realms);
-}
-
 void known_network_set_connected_time(struct network_info *network,
 					uint64_t connected_time)
 {
+	struct network_info *head;
+
 	if (network->connected_time == connected_time)
 		return;
 
@@ -349,8 +427,42 @@ void known_network_set_connected_time(struct network_info *network,
 				IWD_KNOWN_NETWORK_INTERFACE,
 				"LastConnectedTime");
 
+	/*
+	 * The list is kept ordered for iteration, but the usual update marks
+	 * the network as the most recently connected one, so check the head
+	 * before falling back to a sorted insert.
+	 */
 	l_queue_remove(known_networks, network);
-	l_queue_insert(known_networks, network, connected_time_compare, NULL);
+
+	head = l_queue_peek_head(known_networks);
+	if (!head || connected_time_compare(network, head, NULL) <= 0)
+		l_queue_push_head(known_networks, network);
+	else
+		l_queue_insert(known_networks, network,
+				connected_time_compare, NULL);
+
+	known_networks_offset_gen++;
+	known_networks_recent_frequencies_invalidate();
+}
+
+static void known_network_get_flags(struct l_settings *settings,
+					bool *is_hidden,
+					bool *is_autoconnectable)
+{
+	if (!l_settings_get_bool(settings, "Settings", "Hidden", is_hidden))
+		*is_hidden = false;
+
+	if (!l_settings_get_bool(settings, "Settings", "AutoConnect",
+							is_autoconnectable)) {
+		/* If no entry, default to AutoConnectable=True */
+		*is_autoconnectable = true;
+
+		/* Try legacy property name just in case */
+		if (l_settings_get_bool(settings, "Settings", "Autoconnect",
+							is_autoconnectable))
+			l_warn("Autoconnect setting is deprecated, use"
+					" AutoConnect instead");
+	}
 }
 
 void known_network_update(struct network_info *network,
@@ -359,8 +471,7 @@ void known_network_update(struct network_info *network,
 	bool is_hidden;
 	bool is_autoconnectable;
 
-	if (!l_settings_get_bool(settings, "Settings", "Hidden", &is_hidden))
-		is_hidden = false;
+	known_network_get_flags(settings, &is_hidden, &is_autoconnectable);
 
 	if (network->is_hidden != is_hidden) {
 		if (network->is_hidden && !is_hidden)
@@ -376,21 +487,16 @@ void known_network_update(struct network_info *network,
 
 	network->is_hidden = is_hidden;
 
-	if (!l_settings_get_bool(settings, "Settings", "AutoConnect",
-							&is_autoconnectable)) {
-		/* If no entry, default to AutoConnectable=True */
-		is_autoconnectable = true;
-
-		/* Try legacy property name just in case */
-		if (l_settings_get_bool(settings, "Settings", "Autoconnect",
-							&is_autoconnectable))
-			l_warn("Autoconnect setting is deprecated, use"
-					" AutoConnect instead");
-	}
-
 	known_network_set_autoconnect(network, is_autoconnectable);
 }
 
+void known_network_notify_updated(struct network_info *network)
+{
+	WATCHLIST_NOTIFY(&known_network_watches,
+				known_networks_watch_func_t,
+				KNOWN_NETWORKS_EVENT_UPDATED, network);
+}
+
 bool known_networks_foreach(known_networks_foreach_func_t function,
 				void *user_data)
 {
@@ -409,32 +515,30 @@ bool known_networks_has_hidden(void)
 	return num_known_hidden_networks ? true : false;
 }
 
-static bool network_info_match(const void *a, const void *b)
+struct network_info *known_networks_find_key(const struct network_key *key)
 {
-	const struct network_info *ni_a = a;
-	const struct network_info *ni_b = b;
-
-	if (ni_a->type != ni_b->type)
-		return false;
-
-	if (strcmp(ni_a->ssid, ni_b->ssid))
-		return false;
-
-	return true;
+	return l_hashmap_lookup(known_networks_index, key);
 }
 
 struct network_info *known_networks_find(const char *ssid,
 						enum security security)
 {
-	struct network_info query;
+	const struct network_key *key = network_key_find(ssid, security);
 
-	query.type = security;
-	strcpy(query.ssid, ssid);
+	/* Known networks hold a reference so the key exists if known */
+	if (!key)
+		return NULL;
 
-	return l_queue_find(known_networks, network_info_match, &query);
+	return known_networks_find_key(key);
 }
 
-struct scan_freq_set *known_networks_get_recent_frequencies(
+/*
+ * The set is owned by this module and stays valid until the known networks
+ * or their frequencies change.  It is only rebuilt when that happened since
+ * the last call, which saves the quick scan from walking the known networks
+ * and allocating a set every time.
+ */
+const struct scan_freq_set *known_networks_get_recent_frequencies(
 						uint8_t num_networks_tosearch)
 {
 	/*
@@ -444,60 +548,135 @@ struct scan_freq_set *known_networks_get_recent_frequencies(
 	 * list.
 	 */
 	const struct l_queue_entry *network_entry;
-	const struct l_queue_entry *freq_entry;
-	struct scan_freq_set *set;
+	uint8_t num = num_networks_tosearch;
+	unsigned int i;
 
 	if (!num_networks_tosearch)
 		return NULL;
 
-	set = scan_freq_set_new();
+	if (recent_freqs && recent_freqs_num_networks == num_networks_tosearch)
+		return recent_freqs;
+
+	scan_freq_set_free(recent_freqs);
+	recent_freqs = scan_freq_set_new();
+	recent_freqs_num_networks = num_networks_tosearch;
 
 	for (network_entry = l_queue_get_entries(known_networks);
-				network_entry && num_networks_tosearch;
-				network_entry = network_entry->next,
-						num_networks_tosearch--) {
+				network_entry && num;
+				network_entry = network_entry->next, num--) {
 		const struct network_info *network = network_entry->data;
 
-		for (freq_entry = l_queue_get_entries(
-						network->known_frequencies);
-				freq_entry; freq_entry = freq_entry->next) {
+		for (i = 0; i < network->n_known_frequencies; i++)
+			scan_freq_set_add(recent_freqs,
+				network->known_frequencies[i].frequency);
+	}
+
+	return recent_freqs;
+}
+
+/* Upper bound on the distinct frequencies of all known networks */
+#define KNOWN_FREQUENCY_MAX_WEIGHTED	64
+
+struct known_frequency_weight {
+	uint32_t frequency;
+	uint32_t weight;
+};
+
+/*
+ * Returns up to max_freqs frequencies on which BSSes of known networks were
+ * seen most often.  Every known network contributes the hit count of each
+ * of its frequencies, i.e. how many times one of its BSSes was seen there.
+ */
+struct scan_freq_set *known_networks_get_weighted_frequencies(
+						unsigned int max_freqs)
+{
+	struct known_frequency_weight weights[KNOWN_FREQUENCY_MAX_WEIGHTED];
+	unsigned int n_weights = 0;
+	const struct l_queue_entry *network_entry;
+	struct scan_freq_set *set;
+	unsigned int i;
+	unsigned int j;
+
+	for (network_entry = l_queue_get_entries(known_networks);
+			network_entry; network_entry = network_entry->next) {
+		const struct network_info *network = network_entry->data;
+
+		for (j = 0; j < network->n_known_frequencies; j++) {
 			const struct known_frequency *known_freq =
-							freq_entry->data;
+					&network->known_frequencies[j];
+
+			for (i = 0; i < n_weights; i++)
+				if (weights[i].frequency ==
+						known_freq->frequency)
+					break;
+
+			if (i == n_weights) {
+				if (n_weights == L_ARRAY_SIZE(weights))
+					continue;
 
-			scan_freq_set_add(set, known_freq->frequency);
+				weights[n_weights].frequency =
+							known_freq->frequency;
+				weights[n_weights++].weight = 0;
+			}
+
+			weights[i].weight += known_freq->hits;
 		}
 	}
 
-	return set;
-}
+	if (!n_weights || !max_freqs)
+		return NULL;
 
-static bool known_frequency_match(const void *a, const void *b)
-{
-	const struct known_frequency *known_freq = a;
-	const uint32_t *frequency = b;
+	set = scan_freq_set_new();
 
-	return known_freq->frequency == *frequency;
+	while (max_freqs-- && n_weights) {
+		unsigned int best = 0;
+
+		for (i = 1; i < n_weights; i++)
+			if (weights[i].weight > weights[best].weight)
+				best = i;
+
+		scan_freq_set_add(set, weights[best].frequency);
+		weights[best] = weights[--n_weights];
+	}
+
+	return set;
 }
 
+#define KNOWN_FREQUENCY_MAX_HITS	1024
+
 /*
  * Adds a frequency to the 'known' set of frequencies that this network
- * operates on.  The list is sorted according to most-recently seen
+ * operates on.  The array is sorted according to most-recently seen and
+ * each entry counts how often a BSS of the network was seen on it.  Once
+ * full the least recently seen frequency makes room for the new one.
  */
 int known_network_add_frequency(struct network_info *info, uint32_t frequency)
 {
-	struct known_frequency *known_freq;
+	struct known_frequency *freqs = info->known_frequencies;
+	struct known_frequency known_freq = { frequency, 0 };
+	unsigned int i;
+
+	for (i = 0; i < info->n_known_frequencies; i++)
+		if (freqs[i].frequency == frequency)
+			break;
 
-	if (!info->known_frequencies)
-		info->known_frequencies = l_queue_new();
+	if (i < info->n_known_frequencies)
+		known_freq = freqs[i];
+	else {
+		if (info->n_known_frequencies < KNOWN_FREQUENCY_MAX)
+			info->n_known_frequencies++;
 
-	known_freq = l_queue_remove_if(info->known_frequencies,
-					known_frequency_match, &frequency);
-	if (!known_freq) {
-		known_freq = l_new(struct known_frequency, 1);
-		known_freq->frequency = frequency;
+		i = info->n_known_frequencies - 1;
+		known_networks_recent_frequencies_invalidate();
 	}
 
-	l_queue_push_head(info->known_frequencies, known_freq);
+	memmove(freqs + 1, freqs, i * sizeof(*freqs));
+	freqs[0] = known_freq;
+
+	/* Age the hit counts so that they reflect the recent history */
+	if (++freqs[0].hits >= KNOWN_FREQUENCY_MAX_HITS)
+		for (i = 0; i < info->n_known_frequencies; i++)
+			freqs[i].hits = (freqs[i].hits + 1) / 2;
 
 	return 0;
 }
@@ -642,12 +821,70 @@ static void setup_known_network_interface(struct l_dbus_interface *interface)
 				NULL);
 }
 
+/*
+ * Seconds for which changes to the known frequencies are accumulated before
+ * the file is rewritten, so that roaming around doesn't rewrite it every
+ * time a frequency is added.
+ */
+#define KNOWN_FREQ_SYNC_DELAY 10
+
+static void known_frequencies_sync_timeout(struct l_timeout *timeout,
+						void *user_data)
+{
+	l_timeout_remove(known_freqs_sync_timeout);
+	known_freqs_sync_timeout = NULL;
+
+	storage_known_frequencies_sync(known_freqs);
+}
+
+static void known_frequencies_schedule_sync(void)
+{
+	if (known_freqs_sync_timeout)
+		return;
+
+	known_freqs_sync_timeout = l_timeout_create(KNOWN_FREQ_SYNC_DELAY,
+					known_frequencies_sync_timeout,
+					NULL, NULL);
+}
+
+static void known_frequencies_flush(void)
+{
+	if (!known_freqs_sync_timeout)
+		return;
+
+	l_timeout_remove(known_freqs_sync_timeout);
+	known_freqs_sync_timeout = NULL;
+
+	storage_known_frequencies_sync(known_freqs);
+}
+
 void known_networks_remove(struct network_info *network)
 {
+	IWD_COUNTER_DEC(known_network);
+
 	if (network->is_hidden)
 		num_known_hidden_networks--;
 
+	if (network->type == SECURITY_PSK) {
+		l_queue_remove(psk_precompute_list, network);
+		crypto_psk_cache_flush((const uint8_t *) network->ssid,
+					strlen(network->ssid));
+	}
+
+	if (network->type == SECURITY_8021X) {
+		pmksa_cache_flush((const uint8_t *) network->ssid,
+					strlen(network->ssid));
+		erp_cache_flush(network->ssid);
+	}
+
 	l_queue_remove(known_networks, network);
+	known_networks_offset_gen++;
+	known_networks_recent_frequencies_invalidate();
+
+	if (network->key &&
+			known_networks_find_key(network->key) == network)
+		l_hashmap_remove(known_networks_index, network->key);
+
 	l_dbus_unregister_object(dbus_get_bus(),
 					known_network_get_path(network));
 
@@ -660,7 +897,7 @@ void known_networks_remove(struct network_info *network)
 
 		l_uuid_to_string(network->uuid, uuid, sizeof(uuid));
 		l_settings_remove_group(known_freqs, uuid);
-		storage_known_frequencies_sync(known_freqs);
+		known_frequencies_schedule_sync();
 	}
 
 	network_info_free(network);
@@ -668,7 +905,18 @@ void known_networks_remove(struct network_info *network)
 
 void known_networks_add(struct network_info *network)
 {
+	IWD_COUNTER_INC(known_network);
 	l_queue_insert(known_networks, network, connected_time_compare, NULL);
+
+	/* Hotspot entries have no SSID and are matched by other means */
+	if (!network->is_hotspot) {
+		network->key = network_key_get(network->ssid, network->type);
+		l_hashmap_replace(known_networks_index, network->key, network,
+									NULL);
+	}
+
+	known_networks_offset_gen++;
+	known_networks_recent_frequencies_invalidate();
 	known_network_register_dbus(network);
 
 	WATCHLIST_NOTIFY(&known_network_watches,
@@ -676,12 +924,59 @@ void known_networks_add(struct network_info *network)
 				KNOWN_NETWORKS_EVENT_ADDED, network);
 }
 
+static bool known_network_stat(const char *path,
+				struct known_network_meta *meta)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return false;
+
+	/* Same as l_path_get_mtime */
+	meta->mtime = (uint64_t) st.st_mtim.tv_sec * 1000000 +
+			st.st_mtim.tv_nsec / 1000;
+	meta->size = st.st_size;
+
+	return true;
+}
+
+static bool known_index_get(struct l_settings *index, const char *name,
+				struct known_network_meta *meta)
+{
+	uint64_t mtime;
+	uint64_t size;
+
+	if (!index)
+		return false;
+
+	if (!l_settings_get_uint64(index, name, "MTime", &mtime) ||
+			mtime != meta->mtime)
+		return false;
+
+	if (!l_settings_get_uint64(index, name, "Size", &size) ||
+			size != meta->size)
+		return false;
+
+	return l_settings_get_bool(index, name, "Hidden",
+					&meta->is_hidden) &&
+		l_settings_get_bool(index, name, "AutoConnect",
+					&meta->is_autoconnectable);
+}
+
+static void known_index_set(const char *name,
+				const struct known_network_meta *meta)
+{
+	l_settings_set_uint64(known_index, name, "MTime", meta->mtime);
+	l_settings_set_uint64(known_index, name, "Size", meta->size);
+	l_settings_set_bool(known_index, name, "Hidden", meta->is_hidden);
+	l_settings_set_bool(known_index, name, "AutoConnect",
+				meta->is_autoconnectable);
+}
+
 static void known_network_new(const char *ssid, enum security security,
-					struct l_settings *settings,
+					bool is_hidden, bool is_autoconnectable,
 					uint64_t connected_time)
 {
-	bool is_hidden;
-	bool is_autoconnectable;
 	struct network_info *network;
 
 	network = l_new(struct network_info, 1);
@@ -690,21 +985,6 @@ static void known_network_new(const char *ssid, enum security security,
 	network->connected_time = connected_time;
 	network->ops = &known_network_ops;
 
-	if (!l_settings_get_bool(settings, "Settings", "Hidden",
-					&is_hidden))
-		is_hidden = false;
-
-	if (!l_settings_get_bool(settings, "Settings", "AutoConnect",
-						&is_autoconnectable)) {
-		is_autoconnectable = true;
-
-		/* Try legacy property name just in case */
-		if (l_settings_get_bool(settings, "Settings", "Autoconnect",
-							&is_autoconnectable))
-			l_warn("Autoconnect setting is deprecated, use"
-					" AutoConnect instead");
-	}
-
 	if (is_hidden)
 		num_known_hidden_networks++;
 
@@ -724,6 +1004,8 @@ static void known_networks_watch_cb(const char *filename,
 	struct network_info *network_before;
 	struct l_settings *settings;
 	uint64_t connected_time;
+	struct known_network_meta meta;
+	const char *name;
 
 	/*
 	 * Ignore notifications for the actual directory, we can't do
@@ -740,6 +1022,7 @@ static void known_networks_watch_cb(const char *filename,
 	network_before = known_networks_find(ssid, security);
 
 	full_path = storage_get_network_file_path(security, ssid);
+	name = strrchr(full_path, '/') + 1;
 
 	switch (event) {
 	case L_DIR_WATCH_EVENT_CREATED:
@@ -756,18 +1039,32 @@ static void known_networks_watch_cb(const char *filename,
 
 		if (settings) {
 			connected_time = l_path_get_mtime(full_path);
+			known_network_get_flags(settings, &meta.is_hidden,
+						&meta.is_autoconnectable);
 
 			if (network_before) {
 				known_network_set_connected_time(network_before,
 							connected_time);
 				known_network_update(network_before, settings);
 			} else
-				known_network_new(ssid, security, settings,
+				known_network_new(ssid, security,
+							meta.is_hidden,
+							meta.is_autoconnectable,
 							connected_time);
-		} else if (network_before)
-			known_networks_remove(network_before);
+
+			if (known_network_stat(full_path, &meta))
+				known_index_set(name, &meta);
+			else
+				l_settings_remove_group(known_index, name);
+		} else {
+			if (network_before)
+				known_networks_remove(network_before);
+
+			l_settings_remove_group(known_index, name);
+		}
 
 		l_settings_free(settings);
+		storage_known_network_index_sync(known_index);
 
 		break;
 	case L_DIR_WATCH_EVENT_ACCESSED:
@@ -777,6 +1074,17 @@ static void known_networks_watch_cb(const char *filename,
 			connected_time = l_path_get_mtime(full_path);
 			known_network_set_connected_time(network_before,
 								connected_time);
+
+			/* Only the metadata has changed, e.g. after a touch */
+			if (known_network_stat(full_path, &meta) &&
+					l_settings_has_group(known_index,
+								name)) {
+				l_settings_set_uint64(known_index, name,
+							"MTime", meta.mtime);
+				l_settings_set_uint64(known_index, name,
+							"Size", meta.size);
+				storage_known_network_index_sync(known_index);
+			}
 		}
 
 		break;
@@ -788,19 +1096,18 @@ static void known_networks_watch_destroy(void *user_data)
 	storage_dir_watch = NULL;
 }
 
-static struct l_queue *known_frequencies_from_string(char *freq_set_str)
+static bool known_frequencies_from_string(struct network_info *info,
+						char *freq_set_str)
 {
-	struct l_queue *known_frequencies;
-	struct known_frequency *known_freq;
+	struct known_frequency *freqs = info->known_frequencies;
+	uint8_t n = 0;
 	uint16_t t;
 
 	if (!freq_set_str)
-		return NULL;
+		return false;
 
 	if (*freq_set_str == '\0')
-		return NULL;
-
-	known_frequencies = l_queue_new();
+		return false;
 
 	while (*freq_set_str != '\0') {
 		errno = 0;
@@ -808,40 +1115,34 @@ static struct l_queue *known_frequencies_from_string(char *freq_set_str)
 		t = strtoul(freq_set_str, &freq_set_str, 10);
 
 		if (unlikely(errno == ERANGE || !t || t > 6000))
-			goto error;
+			return false;
 
-		known_freq = l_new(struct known_frequency, 1);
-		known_freq->frequency = t;
+		/* Older files could hold more, keep the most recent ones */
+		if (n == KNOWN_FREQUENCY_MAX)
+			continue;
 
-		l_queue_push_tail(known_frequencies, known_freq);
+		freqs[n].frequency = t;
+		freqs[n++].hits = 1;
 	}
 
-	if (l_queue_isempty(known_frequencies))
-		goto error;
-
-	return known_frequencies;
-
-error:
-	l_queue_destroy(known_frequencies, l_free);
-
-	return NULL;
-}
+	if (!n)
+		return false;
 
-static void known_frequency_to_string(void *data, void *user_data)
-{
-	struct known_frequency *known_freq = data;
-	struct l_string *str = user_data;
+	info->n_known_frequencies = n;
 
-	l_string_append_printf(str, " %u", known_freq->frequency);
+	return true;
 }
 
-static char *known_frequencies_to_string(struct l_queue *known_frequencies)
+static char *known_frequencies_to_string(const struct network_info *info)
 {
 	struct l_string *str;
+	unsigned int i;
 
 	str = l_string_new(100);
 
-	l_queue_foreach(known_frequencies, known_frequency_to_string, str);
+	for (i = 0; i < info->n_known_frequencies; i++)
+		l_string_append_printf(str, " %u",
+					info->known_frequencies[i].frequency);
 
 	return l_string_unwrap(str);
 }
@@ -890,10 +1191,52 @@ static struct network_info *find_network_info_from_path(const char *path)
 	return search.info;
 }
 
+static void known_neighbor_freq_to_string(uint32_t freq, void *user_data)
+{
+	struct l_string *str = user_data;
+
+	l_string_append_printf(str, " %u", freq);
+}
+
+static struct scan_freq_set *known_neighbor_freqs_from_string(
+							const char *str)
+{
+	struct scan_freq_set *freqs;
+	char *end;
+	unsigned long t;
+
+	if (!str)
+		return NULL;
+
+	freqs = scan_freq_set_new();
+
+	while (*str != '\0') {
+		errno = 0;
+		t = strtoul(str, &end, 10);
+
+		if (end == str || errno == ERANGE ||
+				!scan_freq_set_add(freqs, t)) {
+			scan_freq_set_free(freqs);
+			return NULL;
+		}
+
+		str = end;
+	}
+
+	if (scan_freq_set_isempty(freqs)) {
+		scan_freq_set_free(freqs);
+		return NULL;
+	}
+
+	return freqs;
+}
+
 static int known_network_frequencies_load(void)
 {
 	char **groups;
-	struct l_queue *known_frequencies;
+	bool parsed;
+	int roam_offset;
+	unsigned int roam_backoff;
 	uint32_t i;
 	uint8_t uuid[16];
 
@@ -925,19 +1268,40 @@ static int known_network_frequencies_load(void)
 		if (!freq_list)
 			goto invalid_entry;
 
-		known_frequencies = known_frequencies_from_string(freq_list);
+		parsed = l_uuid_from_string(groups[i], uuid) &&
+			known_frequencies_from_string(info, freq_list);
 		l_free(freq_list);
 
-		if (!known_frequencies)
+		if (!parsed)
 			goto invalid_entry;
 
-		if (!l_uuid_from_string(groups[i], uuid)) {
-			l_queue_destroy(known_frequencies, l_free);
-			goto invalid_entry;
+		network_info_set_uuid(info, uuid);
+
+		if (l_settings_get_uint64(known_freqs, groups[i],
+						"neighbors_time",
+						&info->neighbor_time))
+			info->neighbor_freqs =
+				known_neighbor_freqs_from_string(
+					l_settings_get_value(known_freqs,
+							groups[i],
+							"neighbors"));
+
+		if (!known_network_neighbors_fresh(info)) {
+			scan_freq_set_free(info->neighbor_freqs);
+			info->neighbor_freqs = NULL;
 		}
 
-		network_info_set_uuid(info, uuid);
-		info->known_frequencies = known_frequencies;
+		/* Range checked by station against the current settings */
+		if (l_settings_get_int(known_freqs, groups[i], "roam_offset",
+						&roam_offset) &&
+				roam_offset >= INT8_MIN &&
+				roam_offset <= INT8_MAX)
+			info->roam_offset = roam_offset;
+
+		if (l_settings_get_uint(known_freqs, groups[i], "roam_backoff",
+						&roam_backoff) &&
+				roam_backoff <= UINT8_MAX)
+			info->roam_backoff = roam_backoff;
 
 		continue;
 
@@ -946,10 +1310,30 @@ invalid_entry:
 	}
 
 	l_strv_free(groups);
+	known_networks_recent_frequencies_invalidate();
 
 	return 0;
 }
 
+/*
+ * Remembers the channels of the neighbors reported by an AP of the network
+ * so that the first roam scan of a later session, or of a session with an
+ * AP without 802.11k support, can be limited to them.
+ */
+void known_network_set_neighbor_frequencies(struct network_info *info,
+					const struct scan_freq_set *freqs)
+{
+	if (!freqs || scan_freq_set_isempty(freqs))
+		return;
+
+	scan_freq_set_free(info->neighbor_freqs);
+	info->neighbor_freqs = scan_freq_set_new();
+	scan_freq_set_merge(info->neighbor_freqs, freqs);
+	info->neighbor_time = time(NULL);
+
+	known_network_frequency_sync(info);
+}
+
 /*
  * Syncs a single network_info frequency to the global frequency file
  */
@@ -959,13 +1343,13 @@ void known_network_frequency_sync(struct network_info *info)
 	char *file_path;
 	char group[37];
 
-	if (!info->known_frequencies)
+	if (!info->n_known_frequencies)
 		return;
 
 	if (!known_freqs)
 		known_freqs = l_settings_new();
 
-	freq_list_str = known_frequencies_to_string(info->known_frequencies);
+	freq_list_str = known_frequencies_to_string(info);
 
 	file_path = info->ops->get_file_path(info);
 
@@ -976,7 +1360,31 @@ void known_network_frequency_sync(struct network_info *info)
 	l_free(file_path);
 	l_free(freq_list_str);
 
-	storage_known_frequencies_sync(known_freqs);
+	if (info->neighbor_freqs) {
+		struct l_string *str = l_string_new(64);
+
+		scan_freq_set_foreach(info->neighbor_freqs,
+					known_neighbor_freq_to_string, str);
+		freq_list_str = l_string_unwrap(str);
+
+		l_settings_set_value(known_freqs, group, "neighbors",
+					freq_list_str);
+		l_settings_set_uint64(known_freqs, group, "neighbors_time",
+					info->neighbor_time);
+		l_free(freq_list_str);
+	}
+
+	if (info->roam_offset || info->roam_backoff) {
+		l_settings_set_int(known_freqs, group, "roam_offset",
+					info->roam_offset);
+		l_settings_set_uint(known_freqs, group, "roam_backoff",
+					info->roam_backoff);
+	} else {
+		l_settings_remove_key(known_freqs, group, "roam_offset");
+		l_settings_remove_key(known_freqs, group, "roam_backoff");
+	}
+
+	known_frequencies_schedule_sync();
 }
 
 uint32_t known_networks_watch_add(known_networks_watch_func_t func,
@@ -991,11 +1399,180 @@ void known_networks_watch_remove(uint32_t id)
 	watchlist_remove(&known_network_watches, id);
 }
 
+/* Number of profiles handled per main loop iteration */
+#define PSK_PRECOMPUTE_BATCH 4
+
+static char *known_network_get_passphrase(struct network_info *info)
+{
+	struct l_settings *settings = network_info_open_settings(info);
+	char *passphrase = NULL;
+
+	if (!settings)
+		return NULL;
+
+	if (!l_settings_has_key(settings, "Security", "PreSharedKey"))
+		passphrase = l_settings_get_string(settings, "Security",
+								"Passphrase");
+
+	l_settings_free(settings);
+	return passphrase;
+}
+
+struct psk_precompute_job {
+	struct crypto_psk_request reqs[PSK_PRECOMPUTE_BATCH];
+	char *passphrases[PSK_PRECOMPUTE_BATCH];
+	char ssids[PSK_PRECOMPUTE_BATCH][33];
+	unsigned int n;
+	uint32_t id;
+};
+
+static void psk_precompute_job_free(void *user_data)
+{
+	struct psk_precompute_job *job = user_data;
+	unsigned int i;
+
+	l_queue_remove(psk_precompute_jobs, L_UINT_TO_PTR(job->id));
+
+	for (i = 0; i < job->n; i++) {
+		explicit_bzero(job->passphrases[i], strlen(job->passphrases[i]));
+		l_free(job->passphrases[i]);
+	}
+
+	explicit_bzero(job->reqs, sizeof(job->reqs));
+	l_free(job);
+}
+
+/* Runs on a worker thread, only touches the job */
+static void psk_precompute_work(void *user_data)
+{
+	struct psk_precompute_job *job = user_data;
+
+	crypto_psk_derive_batch(job->reqs, job->n);
+}
+
+static void psk_precompute_done(void *user_data)
+{
+	struct psk_precompute_job *job = user_data;
+
+	crypto_psk_cache_add_batch(job->reqs, job->n);
+}
+
+/*
+ * Derives the PSKs of profiles which only contain a Passphrase ahead of time,
+ * so that the PBKDF2 cost is not paid when connecting.  Each main loop
+ * iteration reads a batch of profiles and hands it to the worker pool, the
+ * results end up in the crypto PSK cache.
+ */
+static void known_networks_psk_precompute(struct l_idle *idle,
+						void *user_data)
+{
+	struct psk_precompute_job *job = l_new(struct psk_precompute_job, 1);
+	struct network_info *info;
+
+	while (job->n < PSK_PRECOMPUTE_BATCH &&
+			(info = l_queue_pop_head(psk_precompute_list))) {
+		struct crypto_psk_request *req = &job->reqs[job->n];
+
+		job->passphrases[job->n] = known_network_get_passphrase(info);
+		if (!job->passphrases[job->n])
+			continue;
+
+		l_debug("Precomputing PSK for %s", info->ssid);
+
+		/* The profile may go away while the job is running */
+		strcpy(job->ssids[job->n], info->ssid);
+
+		req->passphrase = job->passphrases[job->n];
+		req->ssid = (const uint8_t *) job->ssids[job->n];
+		req->ssid_len = strlen(info->ssid);
+		job->n++;
+	}
+
+	if (l_queue_isempty(psk_precompute_list)) {
+		l_idle_remove(psk_precompute_idle);
+		psk_precompute_idle = NULL;
+	}
+
+	if (!job->n) {
+		l_free(job);
+		return;
+	}
+
+	job->id = l_work_submit(psk_precompute_work, psk_precompute_done, job,
+					psk_precompute_job_free);
+	if (job->id) {
+		l_queue_push_tail(psk_precompute_jobs, L_UINT_TO_PTR(job->id));
+		return;
+	}
+
+	crypto_psk_from_passphrase_batch(job->reqs, job->n);
+	psk_precompute_job_free(job);
+}
+
+static void known_networks_psk_precompute_start(void)
+{
+	const struct l_queue_entry *entry;
+	bool enabled;
+
+	if (!l_settings_get_bool(iwd_get_config(), "General",
+					"PrecomputePreSharedKeys", &enabled))
+		enabled = false;
+
+	if (!enabled)
+		return;
+
+	psk_precompute_list = l_queue_new();
+	psk_precompute_jobs = l_queue_new();
+
+	for (entry = l_queue_get_entries(known_networks); entry;
+						entry = entry->next) {
+		struct network_info *info = entry->data;
+
+		if (info->type == SECURITY_PSK && !info->is_hotspot)
+			l_queue_push_tail(psk_precompute_list, info);
+	}
+
+	if (l_queue_isempty(psk_precompute_list))
+		return;
+
+	psk_precompute_idle = l_idle_create(known_networks_psk_precompute,
+						NULL, NULL);
+}
+
+static void known_networks_erp_cache_setup(void)
+{
+	_auto_(l_free) char *path = NULL;
+	uint8_t secret[64];
+	ssize_t len;
+
+	path = l_settings_get_string(iwd_get_config(), "General",
+					"ERPCacheKeyFile");
+	if (!path)
+		return;
+
+	len = read_file(secret, sizeof(secret), "%s", path);
+	if (len < 16) {
+		l_error("Unable to read an ERP cache key of at least 16 bytes"
+			" from %s, not persisting the ERP cache", path);
+		goto done;
+	}
+
+	erp_set_cache_ops(storage_erp_cache_load, storage_erp_cache_sync,
+				secret, len);
+
+done:
+	explicit_bzero(secret, sizeof(secret));
+}
+
 static int known_networks_init(void)
 {
 	struct l_dbus *dbus = dbus_get_bus();
 	DIR *dir;
 	struct dirent *dirent;
+	struct l_settings *old_index;
+	unsigned int num_indexed = 0;
+	unsigned int num_parsed = 0;
+	char **groups;
 
 	L_AUTO_FREE_VAR(char *, storage_dir) = storage_get_path(NULL);
 
@@ -1014,13 +1591,22 @@ static int known_networks_init(void)
 		return -ENOENT;
 	}
 
+	eap_tls_set_session_cache_ops(storage_tls_session_cache_load,
+					storage_tls_session_cache_sync);
+	known_networks_erp_cache_setup();
+
 	known_networks = l_queue_new();
+	known_networks_index = l_hashmap_new();
+	l_hashmap_set_hash_function(known_networks_index, network_key_hash);
+	known_index = l_settings_new();
+	old_index = storage_known_network_index_load();
 
 	while ((dirent = readdir(dir))) {
 		const char *ssid;
 		enum security security;
 		struct l_settings *settings;
-		uint64_t connected_time;
+		struct known_network_meta meta;
+		const char *name;
 		L_AUTO_FREE_VAR(char *, full_path) = NULL;
 
 		if (dirent->d_type != DT_REG && dirent->d_type != DT_LNK)
@@ -1031,22 +1617,45 @@ static int known_networks_init(void)
 		if (!ssid)
 			continue;
 
-		settings = storage_network_open(security, ssid);
-
 		full_path = storage_get_network_file_path(security, ssid);
+		name = strrchr(full_path, '/') + 1;
 
-		if (settings) {
-			connected_time = l_path_get_mtime(full_path);
+		if (!known_network_stat(full_path, &meta))
+			continue;
+
+		/* Only parse profiles that changed since the index was saved */
+		if (!known_index_get(old_index, name, &meta)) {
+			settings = storage_network_open(security, ssid);
+			if (!settings)
+				continue;
 
-			known_network_new(ssid, security, settings,
-						connected_time);
+			known_network_get_flags(settings, &meta.is_hidden,
+						&meta.is_autoconnectable);
+			l_settings_free(settings);
+			num_parsed++;
 		}
 
-		l_settings_free(settings);
+		known_network_new(ssid, security, meta.is_hidden,
+					meta.is_autoconnectable, meta.mtime);
+		known_index_set(name, &meta);
+		num_indexed++;
 	}
 
 	closedir(dir);
 
+	groups = old_index ? l_settings_get_groups(old_index) : NULL;
+
+	if (num_parsed || l_strv_length(groups) != num_indexed)
+		storage_known_network_index_sync(known_index);
+
+	l_debug("%u known networks, %u profiles parsed", num_indexed,
+			num_parsed);
+
+	l_strfreev(groups);
+	l_settings_free(old_index);
+
+	known_networks_psk_precompute_start();
+
 	storage_dir_watch = l_dir_watch_new(storage_dir,
 						known_networks_watch_cb, NULL,
 						known_networks_watch_destroy);
@@ -1061,9 +1670,30 @@ static void known_networks_exit(void)
 
 	l_dir_watch_destroy(storage_dir_watch);
 
+	if (psk_precompute_idle)
+		l_idle_remove(psk_precompute_idle);
+
+	l_queue_destroy(psk_precompute_list, NULL);
+	psk_precompute_list = NULL;
+
+	while (!l_queue_isempty(psk_precompute_jobs))
+		l_work_cancel(L_PTR_TO_UINT(
+				l_queue_pop_head(psk_precompute_jobs)));
+
+	l_queue_destroy(psk_precompute_jobs, NULL);
+	psk_precompute_jobs = NULL;
+	crypto_psk_cache_flush(NULL, 0);
+	pmksa_cache_flush(NULL, 0);
+	eap_tls_set_session_cache_ops(NULL, NULL);
+	erp_set_cache_ops(NULL, NULL, NULL, 0);
+
+	l_hashmap_destroy(known_networks_index, NULL);
 	l_queue_destroy(known_networks, network_info_free);
 	known_networks = NULL;
 
+	l_settings_free(known_index);
+	known_index = NULL;
+
 	l_dbus_unregister_interface(dbus, IWD_KNOWN_NETWORK_INTERFACE);
 
 	watchlist_destroy(&known_network_watches);
@@ -1073,7 +1703,10 @@ IWD_MODULE(known_networks, known_networks_init, known_networks_exit)
 
 static void known_frequencies_exit(void)
 {
+	known_networks_recent_frequencies_invalidate();
+	known_frequencies_flush();
 	l_settings_free(known_freqs);
+	known_freqs = NULL;
 }
 
 /*
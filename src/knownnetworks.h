@@ -23,10 +23,13 @@
 enum security;
 struct scan_freq_set;
 struct network_info;
+struct network_key;
 
 enum known_networks_event {
 	KNOWN_NETWORKS_EVENT_ADDED,
 	KNOWN_NETWORKS_EVENT_REMOVED,
+	/* The criteria networks are matched against changed, hotspots only */
+	KNOWN_NETWORKS_EVENT_UPDATED,
 };
 
 struct network_info_ops {
@@ -42,23 +45,30 @@ struct network_info_ops {
 						struct scan_bss *bss,
 						size_t *num_elems);
 	char *(*get_file_path)(const struct network_info *info);
+};
 
-	bool (*match_hessid)(const struct network_info *info,
-						const uint8_t *hessid);
-	const uint8_t *(*match_roaming_consortium)(
-						const struct network_info *info,
-						const uint8_t *rc_ie,
-						size_t rc_len,
-						size_t *rc_len_out);
-	bool (*match_nai_realms)(const struct network_info *info,
-						const char **nai_realms);
+struct known_frequency {
+	uint32_t frequency;
+	uint32_t hits;		/* Times a BSS of the network was seen here */
 };
 
+/* Frequencies remembered per network, the least recently seen is dropped */
+#define KNOWN_FREQUENCY_MAX	16
+
 struct network_info {
 	const struct network_info_ops *ops;
 	char ssid[33];
 	enum security type;
-	struct l_queue *known_frequencies;
+	const struct network_key *key;	/* Set while known, not for hotspot */
+	/* Most recently seen first */
+	struct known_frequency known_frequencies[KNOWN_FREQUENCY_MAX];
+	uint8_t n_known_frequencies;
+	/* Channels from the last neighbor report, persisted with the above */
+	struct scan_freq_set *neighbor_freqs;
+	uint64_t neighbor_time;		/* Wall clock seconds */
+	/* Learned by station's adaptive roaming, persisted with the above */
+	int8_t roam_offset;		/* dB added to RoamThreshold */
+	uint8_t roam_backoff;		/* RoamRetryInterval shift */
 	uint64_t connected_time;	/* Time last connected */
 	int seen_count;			/* Ref count for network.info */
 	uint8_t uuid[16];
@@ -76,21 +86,25 @@ typedef void (*known_networks_watch_func_t)(enum known_networks_event event,
 						void *user_data);
 typedef void (*known_networks_destroy_func_t)(void *user_data);
 
-struct known_frequency {
-	uint32_t frequency;
-};
-
 int known_network_offset(const struct network_info *target);
+uint32_t known_networks_offset_generation(void);
+void known_network_seen_count_inc(struct network_info *info);
+void known_network_seen_count_dec(struct network_info *info);
 bool known_networks_foreach(known_networks_foreach_func_t function,
 				void *user_data);
 bool known_networks_has_hidden(void);
 struct network_info *known_networks_find(const char *ssid,
 						enum security security);
+struct network_info *known_networks_find_key(const struct network_key *key);
 
-struct scan_freq_set *known_networks_get_recent_frequencies(
+const struct scan_freq_set *known_networks_get_recent_frequencies(
 						uint8_t num_networks_tosearch);
+struct scan_freq_set *known_networks_get_weighted_frequencies(
+						unsigned int max_freqs);
 int known_network_add_frequency(struct network_info *info, uint32_t frequency);
 void known_network_frequency_sync(struct network_info *info);
+void known_network_set_neighbor_frequencies(struct network_info *info,
+					const struct scan_freq_set *freqs);
 
 uint32_t known_networks_watch_add(known_networks_watch_func_t func,
 					void *user_data,
@@ -113,19 +127,10 @@ struct scan_freq_set *network_info_get_roam_frequencies(
 					uint32_t current_freq,
 					uint8_t max);
 
-bool network_info_match_hessid(const struct network_info *info,
-				const uint8_t *hessid);
-const uint8_t *network_info_match_roaming_consortium(
-						const struct network_info *info,
-						const uint8_t *rc,
-						size_t rc_len,
-						size_t *rc_len_out);
-bool network_info_match_nai_realm(const struct network_info *info,
-						const char **nai_realms);
-
 void known_networks_add(struct network_info *info);
 void known_network_update(struct network_info *info,
 					struct l_settings *settings);
+void known_network_notify_updated(struct network_info *info);
 void known_network_set_connected_time(struct network_info *network,
 					uint64_t connected_time);
 void known_networks_remove(struct network_info *info);
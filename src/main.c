@@ -42,13 +42,21 @@
 #include "src/rfkill.h"
 #include "src/storage.h"
 #include "src/anqp.h"
+#include "src/crypto.h"
 
 #include "src/backtrace.h"
 
+#define LOG_BUFFER_SIZE		(256 * 1024)
+#define LOG_RATELIMIT_BURST	50
+#define LOG_RATELIMIT_INTERVAL	1000
+
 static struct l_genl *genl;
+static struct l_genl *control_genl;
+static bool control_nl80211_found;
 static struct l_netlink *rtnl;
 static struct l_settings *iwd_config;
 static struct l_timeout *timeout;
+static struct l_signal *stats_signal;
 static const char *interfaces;
 static const char *nointerfaces;
 static const char *phys;
@@ -91,6 +99,11 @@ static void signal_handler(uint32_t signo, void *user_data)
 	}
 }
 
+static void dump_stats_handler(void *user_data)
+{
+	iwd_modules_dump_stats();
+}
+
 const struct l_settings *iwd_get_config(void)
 {
 	return iwd_config;
@@ -101,6 +114,17 @@ struct l_genl *iwd_get_genl(void)
 	return genl;
 }
 
+/*
+ * Socket for latency sensitive commands, e.g. key installation, whose
+ * replies shouldn't queue up behind scan dumps and frame notifications on
+ * the main socket.  It carries no multicast or unicast watches.  Falls back
+ * to the main socket if it couldn't be opened.
+ */
+struct l_genl *iwd_get_control_genl(void)
+{
+	return control_nl80211_found ? control_genl : genl;
+}
+
 struct l_netlink *iwd_get_rtnl(void)
 {
 	return rtnl;
@@ -161,11 +185,8 @@ static void do_debug(const char *str, void *user_data)
 	l_info("%s%s", prefix, str);
 }
 
-static void nl80211_appeared(const struct l_genl_family_info *info,
-							void *user_data)
+static void nl80211_modules_init(void)
 {
-	l_debug("Found nl80211 interface");
-
 	nl80211_complete = true;
 
 	if (iwd_modules_init() < 0) {
@@ -174,6 +195,32 @@ static void nl80211_appeared(const struct l_genl_family_info *info,
 	}
 }
 
+static void control_nl80211_appeared(const struct l_genl_family_info *info,
+							void *user_data)
+{
+	if (info)
+		control_nl80211_found = true;
+	else
+		l_warn("nl80211 not found on the control socket");
+
+	nl80211_modules_init();
+}
+
+static void nl80211_appeared(const struct l_genl_family_info *info,
+							void *user_data)
+{
+	l_debug("Found nl80211 interface");
+
+	/* Family info is per socket, also look nl80211 up on control_genl */
+	if (control_genl && l_genl_request_family(control_genl,
+						NL80211_GENL_NAME,
+						control_nl80211_appeared,
+						NULL, NULL))
+		return;
+
+	nl80211_modules_init();
+}
+
 static void request_name_callback(struct l_dbus *dbus, bool success,
 					bool queued, void *user_data)
 {
@@ -416,6 +463,13 @@ int main(int argc, char *argv[])
 	if (!l_main_init())
 		return EXIT_FAILURE;
 
+	/*
+	 * Keep log formatting and output off the event processing path and
+	 * stop chatty call sites, e.g. per-frame messages, from flooding it
+	 */
+	l_log_set_async(LOG_BUFFER_SIZE);
+	l_log_set_ratelimit(LOG_RATELIMIT_BURST, LOG_RATELIMIT_INTERVAL);
+
 	if (debugopt)
 		l_debug_enable(debugopt);
 
@@ -462,9 +516,18 @@ int main(int argc, char *argv[])
 		goto failed_genl;
 	}
 
+	/* nl80211 replies and events gate connections, dispatch them first */
+	l_genl_set_priority(genl, L_MAIN_PRIORITY_HIGH);
+
 	if (getenv("IWD_GENL_DEBUG"))
 		l_genl_set_debug(genl, do_debug, "[GENL] ", NULL);
 
+	control_genl = l_genl_new();
+	if (!control_genl)
+		l_warn("Failed to open control generic netlink socket");
+	else if (getenv("IWD_GENL_DEBUG"))
+		l_genl_set_debug(control_genl, do_debug, "[GENL-CTRL] ", NULL);
+
 	rtnl = l_netlink_new(NETLINK_ROUTE);
 	if (!rtnl) {
 		l_error("Failed to open route netlink socket");
@@ -487,9 +550,13 @@ int main(int argc, char *argv[])
 	l_dbus_set_disconnect_handler(dbus, dbus_disconnected, NULL, NULL);
 	dbus_init(dbus);
 
+	stats_signal = l_signal_create(SIGUSR1, dump_stats_handler,
+							NULL, NULL);
 	exit_status = l_main_run_with_signal(signal_handler, NULL);
+	l_signal_remove(stats_signal);
 
 	iwd_modules_exit();
+	crypto_checksum_pool_flush();
 	dbus_exit();
 	l_dbus_destroy(dbus);
 
@@ -497,6 +564,7 @@ failed_dbus:
 	l_netlink_destroy(rtnl);
 
 failed_rtnl:
+	l_genl_unref(control_genl);
 	l_genl_unref(genl);
 
 failed_genl:
@@ -506,6 +574,7 @@ failed_dirs:
 	l_settings_free(iwd_config);
 	l_timeout_remove(timeout);
 	l_main_exit();
+	l_log_set_async(0);
 
 	return exit_status;
 }
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <linux/if_ether.h>
 #include <fnmatch.h>
+#include <dirent.h>
 
 #include <ell/ell.h>
 
@@ -43,12 +44,20 @@
 #include "src/common.h"
 #include "src/nl80211cmd.h"
 #include "src/p2p.h"
+#include "src/storage.h"
 
 static struct l_genl_family *nl80211 = NULL;
 static char **whitelist_filter;
 static char **blacklist_filter;
 static bool randomize;
 static bool use_default;
+static unsigned int ap_interfaces;
+/* For reporting how long it took all wiphys present at startup to be ready */
+static uint64_t startup_time;
+static unsigned int startup_pending;
+
+/* Upper limit for [General].AccessPointInterfaces */
+#define MAX_AP_INTERFACES 7
 
 struct wiphy_setup_state {
 	uint32_t id;
@@ -56,6 +65,11 @@ struct wiphy_setup_state {
 	unsigned int pending_cmd_count;
 	bool aborted;
 	bool retry;
+	/* Set up from cached capabilities ahead of the GET_WIPHY dump */
+	bool from_cache;
+	/* Present at startup, counted in startup_pending */
+	bool startup;
+	uint64_t start_time;
 
 	/*
 	 * Data we may need if the driver does not seem to support interface
@@ -87,6 +101,47 @@ static const char *default_if_driver_list[] = {
 	NULL,
 };
 
+/*
+ * Each wiphy is set up independently, its setup commands are queued as
+ * soon as its own previous step completes, so the setup of one wiphy
+ * never waits for the others to finish theirs.
+ */
+static struct wiphy_setup_state *wiphy_setup_state_new(struct wiphy *wiphy,
+							bool startup)
+{
+	struct wiphy_setup_state *state = l_new(struct wiphy_setup_state, 1);
+
+	state->id = wiphy_get_id(wiphy);
+	state->wiphy = wiphy;
+	state->start_time = l_time_now();
+	state->startup = startup && startup_time;
+
+	if (state->startup)
+		startup_pending++;
+
+	return state;
+}
+
+static void manager_wiphy_setup_finished(struct wiphy_setup_state *state)
+{
+	uint64_t now = l_time_now();
+
+	l_debug("Setup of wiphy %u finished in %" PRIu64 " ms", state->id,
+		l_time_to_msecs(l_time_diff(state->start_time, now)));
+
+	if (!state->startup)
+		return;
+
+	state->startup = false;
+
+	if (--startup_pending)
+		return;
+
+	l_debug("All wiphys ready %" PRIu64 " ms after startup",
+		l_time_to_msecs(l_time_diff(startup_time, now)));
+	startup_time = 0;
+}
+
 static void wiphy_setup_state_free(void *data)
 {
 	struct wiphy_setup_state *state = data;
@@ -100,6 +155,7 @@ static void wiphy_setup_state_free(void *data)
 
 static void wiphy_setup_state_destroy(struct wiphy_setup_state *state)
 {
+	manager_wiphy_setup_finished(state);
 	l_queue_remove(pending_wiphys, state);
 	wiphy_setup_state_free(state);
 }
@@ -189,6 +245,8 @@ static void manager_new_p2p_interface_cb(struct l_genl_msg *msg,
 		return;
 	}
 
+	iwd_modules_iftype_appeared(NL80211_IFTYPE_P2P_DEVICE);
+
 	p2p_device_update_from_genl(msg, true);
 }
 
@@ -202,6 +260,84 @@ static void manager_new_interface_done(void *user_data)
 		wiphy_setup_state_destroy(state);
 }
 
+static void manager_new_ap_interface_cb(struct l_genl_msg *msg,
+						void *user_data)
+{
+	struct wiphy_setup_state *state = user_data;
+
+	l_debug("");
+
+	if (state->aborted)
+		return;
+
+	if (l_genl_msg_get_error(msg) < 0) {
+		l_error("NEW_INTERFACE failed for AP interface: %s",
+			strerror(-l_genl_msg_get_error(msg)));
+		return;
+	}
+
+	netdev_create_from_genl(msg, NULL);
+}
+
+/*
+ * Additional AP mode interfaces sharing the radio with the main netdev,
+ * each one can run its own BSS (SSID) through the AccessPoint interface.
+ * The addresses are derived from the permanent address by setting the
+ * locally administered bit so they need to be set on creation.
+ */
+static void manager_create_ap_interfaces(struct wiphy_setup_state *state)
+{
+	struct l_genl_msg *msg;
+	char ifname[32];
+	uint32_t iftype = NL80211_IFTYPE_AP;
+	unsigned int i;
+	unsigned cmd_id;
+
+	if (!ap_interfaces)
+		return;
+
+	if (!wiphy_supports_iftype(state->wiphy, NL80211_IFTYPE_AP) ||
+			!wiphy_has_feature(state->wiphy,
+						NL80211_FEATURE_MAC_ON_CREATE)) {
+		l_debug("%s can't support additional AP interfaces",
+			wiphy_get_name(state->wiphy));
+		return;
+	}
+
+	for (i = 0; i < ap_interfaces; i++) {
+		uint8_t addr[6];
+
+		memcpy(addr, wiphy_get_permanent_address(state->wiphy), 6);
+		addr[0] |= 0x02;
+		addr[5] ^= i;
+
+		snprintf(ifname, sizeof(ifname), "wlan%i-ap%u",
+				(int) state->id, i);
+		l_debug("creating %s", ifname);
+
+		msg = l_genl_msg_new(NL80211_CMD_NEW_INTERFACE);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY, 4, &state->id);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_IFTYPE, 4, &iftype);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_IFNAME,
+					strlen(ifname) + 1, ifname);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_4ADDR, 1, "\0");
+		l_genl_msg_append_attr(msg, NL80211_ATTR_SOCKET_OWNER, 0, "");
+		l_genl_msg_append_attr(msg, NL80211_ATTR_MAC, 6, addr);
+
+		cmd_id = l_genl_family_send(nl80211, msg,
+						manager_new_ap_interface_cb,
+						state,
+						manager_new_interface_done);
+		if (!cmd_id) {
+			l_error("Error sending NEW_INTERFACE for %s", ifname);
+			return;
+		}
+
+		state->pending_cmd_count++;
+	}
+}
+
+
 static void manager_create_interfaces(struct wiphy_setup_state *state)
 {
 	struct l_genl_msg *msg;
@@ -265,6 +401,8 @@ static void manager_create_interfaces(struct wiphy_setup_state *state)
 
 	state->pending_cmd_count++;
 
+	manager_create_ap_interfaces(state);
+
 try_create_p2p:
 	/*
 	 * Require the MAC on create feature so we can send our desired
@@ -502,6 +640,7 @@ static bool manager_check_create_interfaces(void *data, void *user_data)
 		return false;
 
 	/* If we are here, there were no interfaces for this phy */
+	manager_wiphy_setup_finished(state);
 	wiphy_setup_state_free(state);
 	return true;
 }
@@ -538,9 +677,7 @@ static void manager_wiphy_dump_callback(struct l_genl_msg *msg, void *user_data)
 	if (!wiphy || wiphy_is_blacklisted(wiphy))
 		return;
 
-	state = l_new(struct wiphy_setup_state, 1);
-	state->id = id;
-	state->wiphy = wiphy;
+	state = wiphy_setup_state_new(wiphy, true);
 
 	l_debug("New wiphy %s added (%d)", name, id);
 
@@ -559,6 +696,39 @@ static void manager_wiphy_filtered_dump_callback(struct l_genl_msg *msg,
 	wiphy_update_from_genl(state->wiphy, msg);
 }
 
+static void manager_wiphy_setup_complete(struct wiphy_setup_state *state)
+{
+	wiphy_create_complete(state->wiphy);
+	state->use_default = use_default;
+
+	/* If whitelist/blacklist were given only try to use existing
+	 * interfaces same as when the driver does not support
+	 * NEW_INTERFACE or DEL_INTERFACE, otherwise the interface
+	 * names will become meaningless after we've created our own
+	 * interface(s).  Optimally phy name white/blacklists should
+	 * be used.
+	 */
+	if (whitelist_filter || blacklist_filter)
+		state->use_default = true;
+
+	if (!state->use_default) {
+		const char *driver = wiphy_get_driver(state->wiphy);
+
+		if (driver) {
+			const char **e;
+
+			for (e = default_if_driver_list; *e; e++)
+				if (fnmatch(*e, driver, 0) == 0)
+					state->use_default = true;
+		} else
+			state->use_default = true;
+	}
+
+	if (state->use_default)
+		l_info("Wiphy %s will only use the default interface",
+			wiphy_get_name(state->wiphy));
+}
+
 static void manager_wiphy_dump_done(void *user_data)
 {
 	const struct l_queue_entry *e;
@@ -566,36 +736,98 @@ static void manager_wiphy_dump_done(void *user_data)
 	for (e = l_queue_get_entries(pending_wiphys); e; e = e->next) {
 		struct wiphy_setup_state *state = e->data;
 
-		wiphy_create_complete(state->wiphy);
-		state->use_default = use_default;
+		if (state->from_cache)
+			continue;
 
-		/* If whitelist/blacklist were given only try to use existing
-		 * interfaces same as when the driver does not support
-		 * NEW_INTERFACE or DEL_INTERFACE, otherwise the interface
-		 * names will become meaningless after we've created our own
-		 * interface(s).  Optimally phy name white/blacklists should
-		 * be used.
-		 */
-		if (whitelist_filter || blacklist_filter)
-			state->use_default = true;
+		manager_wiphy_setup_complete(state);
+	}
 
-		if (!state->use_default) {
-			const char *driver = wiphy_get_driver(state->wiphy);
+	wiphy_reconcile_cached();
+}
 
-			if (driver) {
-				const char **e;
+/*
+ * Set up every wiphy in the system from the capabilities cached on the
+ * previous run so that the interface setup doesn't have to wait for the
+ * GET_WIPHY dump, which can take a while with many bands and channels.
+ * Only done if all of them have a valid cache entry, otherwise the
+ * regular dump order is used.
+ */
+static bool manager_load_cached_wiphys(void)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct l_queue *created;
+	const struct l_queue_entry *e;
+	bool all_cached = true;
+
+	dir = opendir("/sys/class/ieee80211");
+	if (!dir)
+		return false;
+
+	created = l_queue_new();
+
+	while (all_cached && (dirent = readdir(dir))) {
+		char buf[16];
+		char *endp;
+		ssize_t len;
+		unsigned long id;
+		struct wiphy *wiphy;
+
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		len = read_file(buf, sizeof(buf) - 1,
+				"/sys/class/ieee80211/%s/index",
+				dirent->d_name);
+		if (len <= 0) {
+			all_cached = false;
+			break;
+		}
 
-				for (e = default_if_driver_list; *e; e++)
-					if (fnmatch(*e, driver, 0) == 0)
-						state->use_default = true;
-			} else
-				state->use_default = true;
+		buf[len] = '\0';
+		id = strtoul(buf, &endp, 10);
+
+		if (endp == buf || wiphy_find(id)) {
+			all_cached = false;
+			break;
+		}
+
+		wiphy = wiphy_create_from_cache(id, dirent->d_name);
+		if (!wiphy) {
+			all_cached = false;
+			break;
 		}
 
-		if (state->use_default)
-			l_info("Wiphy %s will only use the default interface",
-				wiphy_get_name(state->wiphy));
+		l_queue_push_tail(created, wiphy);
 	}
+
+	closedir(dir);
+
+	if (!all_cached || l_queue_isempty(created)) {
+		l_queue_destroy(created,
+				(l_queue_destroy_func_t) wiphy_destroy);
+		return false;
+	}
+
+	for (e = l_queue_get_entries(created); e; e = e->next) {
+		struct wiphy *wiphy = e->data;
+		struct wiphy_setup_state *state;
+
+		if (wiphy_is_blacklisted(wiphy))
+			continue;
+
+		state = wiphy_setup_state_new(wiphy, true);
+		state->from_cache = true;
+
+		l_debug("Cached wiphy %s added (%d)", wiphy_get_name(wiphy),
+			state->id);
+
+		l_queue_push_tail(pending_wiphys, state);
+		manager_wiphy_setup_complete(state);
+	}
+
+	l_queue_destroy(created, NULL);
+	return true;
 }
 
 static int manager_wiphy_filtered_dump(uint32_t wiphy_id,
@@ -697,9 +929,7 @@ static void manager_config_notify(struct l_genl_msg *msg, void *user_data)
 		if (!wiphy || wiphy_is_blacklisted(wiphy))
 			return;
 
-		state = l_new(struct wiphy_setup_state, 1);
-		state->id = wiphy_id;
-		state->wiphy = wiphy;
+		state = wiphy_setup_state_new(wiphy, false);
 
 		if (manager_wiphy_filtered_dump(wiphy_id,
 					manager_wiphy_filtered_dump_callback,
@@ -793,6 +1023,7 @@ static int manager_init(void)
 	struct l_genl_msg *msg;
 	unsigned int wiphy_dump;
 	unsigned int interface_dump;
+	bool cached;
 	const char *randomize_str;
 	const char *if_whitelist = iwd_get_iface_whitelist();
 	const char *if_blacklist = iwd_get_iface_blacklist();
@@ -806,6 +1037,8 @@ static int manager_init(void)
 		blacklist_filter = l_strsplit(if_blacklist, ',');
 
 	pending_wiphys = l_queue_new();
+	startup_time = l_time_now();
+	startup_pending = 0;
 
 	if (!l_genl_family_register(nl80211, "config", manager_config_notify,
 					NULL, NULL)) {
@@ -813,30 +1046,6 @@ static int manager_init(void)
 		goto error;
 	}
 
-	msg = l_genl_msg_new_sized(NL80211_CMD_GET_WIPHY, 128);
-	l_genl_msg_append_attr(msg, NL80211_ATTR_SPLIT_WIPHY_DUMP, 0, NULL);
-	wiphy_dump = l_genl_family_dump(nl80211, msg,
-						manager_wiphy_dump_callback,
-						NULL,
-						manager_wiphy_dump_done);
-	if (!wiphy_dump) {
-		l_error("Initial wiphy information dump failed");
-		l_genl_msg_unref(msg);
-		goto error;
-	}
-
-	msg = l_genl_msg_new(NL80211_CMD_GET_INTERFACE);
-	interface_dump = l_genl_family_dump(nl80211, msg,
-						manager_interface_dump_callback,
-						NULL,
-						manager_interface_dump_done);
-	if (!interface_dump) {
-		l_error("Initial interface information dump failed");
-		l_genl_msg_unref(msg);
-		l_genl_family_cancel(nl80211, wiphy_dump);
-		goto error;
-	}
-
 	randomize_str = l_settings_get_value(config, "General",
 							"AddressRandomization");
 	if (randomize_str) {
@@ -856,10 +1065,68 @@ static int manager_init(void)
 					", please use UseDefaultInterface");
 	}
 
+	if (!l_settings_get_uint(config, "General", "AccessPointInterfaces",
+					&ap_interfaces))
+		ap_interfaces = 0;
+
+	if (ap_interfaces > MAX_AP_INTERFACES) {
+		l_warn("[General].AccessPointInterfaces limited to %u",
+			MAX_AP_INTERFACES);
+		ap_interfaces = MAX_AP_INTERFACES;
+	}
+
+	/*
+	 * With all wiphys already set up from the cache the interfaces can
+	 * be created right away, the wiphy dump then only confirms the
+	 * cached capabilities.
+	 */
+	cached = manager_load_cached_wiphys();
+
+	if (cached) {
+		msg = l_genl_msg_new(NL80211_CMD_GET_INTERFACE);
+		interface_dump = l_genl_family_dump(nl80211, msg,
+					manager_interface_dump_callback,
+					NULL, manager_interface_dump_done);
+		if (!interface_dump) {
+			l_error("Initial interface information dump failed");
+			l_genl_msg_unref(msg);
+			goto error;
+		}
+	}
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_GET_WIPHY, 128);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_SPLIT_WIPHY_DUMP, 0, NULL);
+	wiphy_dump = l_genl_family_dump(nl80211, msg,
+						manager_wiphy_dump_callback,
+						NULL,
+						manager_wiphy_dump_done);
+	if (!wiphy_dump) {
+		l_error("Initial wiphy information dump failed");
+		l_genl_msg_unref(msg);
+
+		if (cached)
+			l_genl_family_cancel(nl80211, interface_dump);
+
+		goto error;
+	}
+
+	if (!cached) {
+		msg = l_genl_msg_new(NL80211_CMD_GET_INTERFACE);
+		interface_dump = l_genl_family_dump(nl80211, msg,
+					manager_interface_dump_callback,
+					NULL, manager_interface_dump_done);
+		if (!interface_dump) {
+			l_error("Initial interface information dump failed");
+			l_genl_msg_unref(msg);
+			l_genl_family_cancel(nl80211, wiphy_dump);
+			goto error;
+		}
+	}
+
 	return 0;
 
 error:
-	l_queue_destroy(pending_wiphys, NULL);
+	l_queue_destroy(pending_wiphys, wiphy_setup_state_free);
 	pending_wiphys = NULL;
 
 	l_genl_family_free(nl80211);
@@ -882,3 +1149,4 @@ static void manager_exit(void)
 }
 
 IWD_MODULE(manager, manager_init, manager_exit);
+IWD_MODULE_DEPENDS(manager, wiphy);
@@ -0,0 +1,186 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ell/ell.h>
+
+#include "src/dbus.h"
+#include "src/module.h"
+#include "src/metrics.h"
+
+extern struct metrics_counter __start___iwd_metrics_counter[]
+						__attribute__((weak));
+extern struct metrics_counter __stop___iwd_metrics_counter[]
+						__attribute__((weak));
+extern struct metrics_histogram __start___iwd_metrics_histogram[]
+						__attribute__((weak));
+extern struct metrics_histogram __stop___iwd_metrics_histogram[]
+						__attribute__((weak));
+
+static const uint32_t metrics_bounds_ms[] = { METRICS_HISTOGRAM_BOUNDS_MS };
+
+static void metrics_append_header(struct l_string *out, const char *name,
+					const char *help, const char *type)
+{
+	l_string_append_printf(out, "# HELP %s %s\n", name, help);
+	l_string_append_printf(out, "# TYPE %s %s\n", name, type);
+}
+
+static void metrics_append_counters(struct l_string *out)
+{
+	struct metrics_counter *first;
+	struct metrics_counter *counter;
+	const char *help;
+
+	/*
+	 * Counters of one metric can be spread over several files, gather
+	 * them under the first one seen.  Only one of them needs the help.
+	 */
+	for (first = __start___iwd_metrics_counter;
+			first < __stop___iwd_metrics_counter; first++) {
+		for (counter = __start___iwd_metrics_counter;
+				counter < first; counter++)
+			if (!strcmp(counter->name, first->name))
+				break;
+
+		if (counter < first)
+			continue;
+
+		for (counter = first, help = NULL;
+				counter < __stop___iwd_metrics_counter && !help;
+				counter++)
+			if (!strcmp(counter->name, first->name))
+				help = counter->help;
+
+		metrics_append_header(out, first->name, help ?: "", "counter");
+
+		for (counter = first; counter < __stop___iwd_metrics_counter;
+				counter++) {
+			if (strcmp(counter->name, first->name))
+				continue;
+
+			if (counter->label)
+				l_string_append_printf(out, "%s{%s} %" PRIu64
+							"\n", counter->name,
+							counter->label,
+							counter->value);
+			else
+				l_string_append_printf(out, "%s %" PRIu64 "\n",
+							counter->name,
+							counter->value);
+		}
+	}
+}
+
+static void metrics_append_histograms(struct l_string *out)
+{
+	struct metrics_histogram *h;
+	unsigned int i;
+	uint64_t total;
+
+	for (h = __start___iwd_metrics_histogram;
+			h < __stop___iwd_metrics_histogram; h++) {
+		metrics_append_header(out, h->name, h->help, "histogram");
+
+		for (i = 0, total = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+			total += h->buckets[i];
+			l_string_append_printf(out,
+					"%s_bucket{le=\"%u.%03u\"} %" PRIu64
+					"\n", h->name,
+					metrics_bounds_ms[i] / 1000,
+					metrics_bounds_ms[i] % 1000, total);
+		}
+
+		l_string_append_printf(out, "%s_bucket{le=\"+Inf\"} %" PRIu64
+					"\n", h->name, h->count);
+		l_string_append_printf(out, "%s_sum %" PRIu64 ".%06" PRIu64
+					"\n", h->name, h->sum_us / 1000000,
+					h->sum_us % 1000000);
+		l_string_append_printf(out, "%s_count %" PRIu64 "\n",
+					h->name, h->count);
+	}
+}
+
+static struct l_dbus_message *metrics_get(struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct l_dbus_message *reply;
+	struct l_string *out = l_string_new(4096);
+	char *text;
+
+	metrics_append_counters(out);
+	metrics_append_histograms(out);
+	text = l_string_unwrap(out);
+
+	reply = l_dbus_message_new_method_return(message);
+	l_dbus_message_set_arguments(reply, "s", text);
+	l_free(text);
+
+	return reply;
+}
+
+static void metrics_setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "GetMetrics", 0, metrics_get,
+				"s", "", "metrics");
+}
+
+static int metrics_init(void)
+{
+	struct l_dbus *dbus = dbus_get_bus();
+
+	if (!l_dbus_register_interface(dbus, IWD_METRICS_INTERFACE,
+						metrics_setup_interface,
+						NULL, false)) {
+		l_info("Unable to register %s interface",
+				IWD_METRICS_INTERFACE);
+		return -EIO;
+	}
+
+	if (!l_dbus_object_add_interface(dbus, IWD_METRICS_PATH,
+						IWD_METRICS_INTERFACE, NULL)) {
+		l_info("Unable to register the metrics object on '%s'",
+				IWD_METRICS_PATH);
+		l_dbus_unregister_interface(dbus, IWD_METRICS_INTERFACE);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void metrics_exit(void)
+{
+	struct l_dbus *dbus = dbus_get_bus();
+
+	l_dbus_object_remove_interface(dbus, IWD_METRICS_PATH,
+					IWD_METRICS_INTERFACE);
+	l_dbus_unregister_interface(dbus, IWD_METRICS_INTERFACE);
+}
+
+IWD_MODULE(metrics, metrics_init, metrics_exit)
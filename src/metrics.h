@@ -0,0 +1,94 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Event counters and latency histograms, exported by the metrics module.
+ * Like the module counters these are defined next to the code updating
+ * them and collected from a linker section, so updating one is a plain
+ * increment and doesn't require the metrics module to be linked in.
+ *
+ * Counters sharing a name are exported as a single metric, told apart by
+ * their label, e.g. METRICS_COUNTER_LABEL(foo_auth, "iwd_foo_total",
+ * "phase=\"authentication\"", "Foo events").  Only one of them needs to
+ * carry the help text.
+ */
+
+struct metrics_counter {
+	const char *name;
+	const char *label;
+	const char *help;
+	uint64_t value;
+} __attribute__((aligned(8)));
+
+#define METRICS_COUNTER_LABEL(var, _name, _label, _help)		\
+	static struct metrics_counter __metrics_counter_ ## var	\
+		__attribute__((used, section("__iwd_metrics_counter"),	\
+					aligned(8))) = {		\
+			.name = _name,					\
+			.label = _label,				\
+			.help = _help,					\
+		};
+
+#define METRICS_COUNTER(var, _name, _help)				\
+	METRICS_COUNTER_LABEL(var, _name, NULL, _help)
+
+#define METRICS_INC(var) (__metrics_counter_ ## var.value++)
+
+/* Upper bounds of the histogram buckets, in milliseconds */
+#define METRICS_HISTOGRAM_BOUNDS_MS					\
+	1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+#define METRICS_HISTOGRAM_BUCKETS 12
+
+struct metrics_histogram {
+	const char *name;
+	const char *help;
+	/* Not cumulative, the last one counts what is above all bounds */
+	uint64_t buckets[METRICS_HISTOGRAM_BUCKETS + 1];
+	uint64_t sum_us;
+	uint64_t count;
+} __attribute__((aligned(8)));
+
+#define METRICS_HISTOGRAM(var, _name, _help)				\
+	static struct metrics_histogram __metrics_histogram_ ## var	\
+		__attribute__((used, section("__iwd_metrics_histogram"),\
+					aligned(8))) = {		\
+			.name = _name,					\
+			.help = _help,					\
+		};
+
+#define METRICS_OBSERVE(var, usec)					\
+	metrics_histogram_observe(&__metrics_histogram_ ## var, usec)
+
+static inline void metrics_histogram_observe(struct metrics_histogram *h,
+						uint64_t usec)
+{
+	static const uint32_t bounds_ms[] = { METRICS_HISTOGRAM_BOUNDS_MS };
+	unsigned int i;
+
+	for (i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+		if (usec <= bounds_ms[i] * 1000ULL)
+			break;
+
+	h->buckets[i]++;
+	h->sum_us += usec;
+	h->count++;
+}
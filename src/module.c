@@ -25,6 +25,8 @@
 #endif
 
 #include <errno.h>
+#include <inttypes.h>
+#include <malloc.h>
 #include <ell/ell.h>
 
 #include "src/module.h"
@@ -39,14 +41,24 @@ struct module {
 	struct dependency *depends;
 	bool visited : 1;
 	bool processed : 1;
+	bool on_demand : 1;
 };
 
 extern struct iwd_module_desc __start___iwd_module[];
 extern struct iwd_module_desc __stop___iwd_module[];
 extern struct iwd_module_depends __start___iwd_module_dep[];
 extern struct iwd_module_depends __stop___iwd_module_dep[];
+extern struct iwd_module_counter __start___iwd_module_counter[];
+extern struct iwd_module_counter __stop___iwd_module_counter[];
+/* Not every binary linking module.c has on-demand modules */
+extern struct iwd_module_trigger __start___iwd_module_trigger[]
+						__attribute__((weak));
+extern struct iwd_module_trigger __stop___iwd_module_trigger[]
+						__attribute__((weak));
 
 static struct iwd_module_desc **modules_sorted;
+static struct module *modules_all;
+static struct dependency *deps_all;
 
 static struct module *module_find(struct module *modules, size_t count,
 						const char *name)
@@ -91,10 +103,49 @@ static int module_topological_order(struct module *module,
 	return 0;
 }
 
+static int module_start(struct module *module)
+{
+	struct dependency *d;
+	int r;
+
+	if (module->desc->active)
+		return 0;
+
+	for (d = module->depends; d; d = d->next) {
+		r = module_start(d->module);
+		if (r < 0)
+			return r;
+	}
+
+	r = module->desc->init();
+	if (r < 0) {
+		l_error("Module %s failed to start: %d", module->desc->name, r);
+		return r;
+	}
+
+	module->desc->active = true;
+	return 0;
+}
+
+/* Modules needed by a module started at startup can't wait either */
+static void module_clear_on_demand(struct module *module)
+{
+	struct dependency *d;
+
+	for (d = module->depends; d; d = d->next) {
+		if (!d->module->on_demand)
+			continue;
+
+		d->module->on_demand = false;
+		module_clear_on_demand(d->module);
+	}
+}
+
 int iwd_modules_init(void)
 {
 	struct iwd_module_desc *desc;
 	struct iwd_module_depends *dep;
+	struct iwd_module_trigger *trigger;
 	L_AUTO_FREE_VAR(struct module *, modules) = NULL;
 	L_AUTO_FREE_VAR(struct dependency *, deps) = NULL;
 	L_AUTO_FREE_VAR(struct iwd_module_desc **, sorted) = NULL;
@@ -144,24 +195,72 @@ int iwd_modules_init(void)
 			return -EINVAL;
 	}
 
+	for (trigger = __start___iwd_module_trigger;
+			trigger < __stop___iwd_module_trigger; trigger++) {
+		struct module *module = module_find(modules, n_modules,
+							trigger->self);
+
+		if (!module) {
+			l_error("On-demand module %s not found", trigger->self);
+			return -EINVAL;
+		}
+
+		module->on_demand = true;
+	}
+
+	for (i = 0; i < n_modules; i++)
+		if (!modules[i].on_demand)
+			module_clear_on_demand(&modules[i]);
+
 	modules_sorted = sorted;
 	sorted = NULL;
+	modules_all = modules;
+	modules = NULL;
+	deps_all = deps;
+	deps = NULL;
 
 	for (i = 0; i < n_modules; i++) {
-		desc = modules_sorted[i];
-		r = desc->init();
+		struct module *module = module_find(modules_all, n_modules,
+						modules_sorted[i]->name);
 
-		if (r < 0) {
-			l_error("Module %s failed to start: %d", desc->name, r);
-			return r;
+		if (module->on_demand) {
+			l_debug("Deferring start of module %s",
+					module->desc->name);
+			continue;
 		}
 
-		desc->active = true;
+		r = module_start(module);
+		if (r < 0)
+			return r;
 	}
 
 	return 0;
 }
 
+void iwd_modules_iftype_appeared(uint32_t iftype)
+{
+	struct iwd_module_trigger *trigger;
+	size_t n_modules = (__stop___iwd_module - __start___iwd_module);
+
+	if (!modules_all)
+		return;
+
+	for (trigger = __start___iwd_module_trigger;
+			trigger < __stop___iwd_module_trigger; trigger++) {
+		struct module *module;
+
+		if (trigger->iftype != iftype)
+			continue;
+
+		module = module_find(modules_all, n_modules, trigger->self);
+		if (module->desc->active)
+			continue;
+
+		l_debug("Starting module %s on demand", module->desc->name);
+		module_start(module);
+	}
+}
+
 void iwd_modules_exit(void)
 {
 	struct iwd_module_desc *desc;
@@ -184,4 +283,33 @@ void iwd_modules_exit(void)
 
 	l_free(modules_sorted);
 	modules_sorted = NULL;
+	l_free(modules_all);
+	modules_all = NULL;
+	l_free(deps_all);
+	deps_all = NULL;
+}
+
+void iwd_modules_dump_stats(void)
+{
+	struct iwd_module_counter *counter;
+	unsigned long overflow;
+	unsigned long ratelimited;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+
+	l_info("Heap: %zu bytes in use, %zu bytes free, %zu bytes mmapped",
+			mi.uordblks, mi.fordblks, mi.hblkhd);
+#endif
+
+	for (counter = __start___iwd_module_counter;
+			counter < __stop___iwd_module_counter; counter++)
+		l_info("%s %s: %u current, %u peak, %" PRIu64 " total",
+				counter->module, counter->name,
+				counter->current, counter->peak,
+				counter->total);
+
+	l_log_get_dropped(&overflow, &ratelimited);
+	l_info("Log: %lu messages dropped on overflow, %lu rate limited",
+					overflow, ratelimited);
 }
@@ -47,5 +47,64 @@ struct iwd_module_depends {
 			.target = #dep,					\
 		};
 
+struct iwd_module_trigger {
+	const char *self;
+	uint32_t iftype;
+} __attribute__((aligned(8)));
+
+/*
+ * Start the module on demand, once an interface of the given nl80211
+ * iftype appears, instead of at startup.  Unless another module that is
+ * started at startup depends on it.
+ */
+#define IWD_MODULE_ON_IFTYPE(name, type)				\
+	static struct iwd_module_trigger				\
+				__iwd_module_trigger_##name##_##type	\
+		__attribute__((used, section("__iwd_module_trigger"),	\
+					aligned(8))) = {		\
+			.self = #name,					\
+			.iftype = type,					\
+		};
+
+/*
+ * Live object counters, dumped together with the heap usage on SIGUSR1 to
+ * tell which subsystem is holding on to memory on long running systems.
+ */
+struct iwd_module_counter {
+	const char *module;
+	const char *name;
+	unsigned int current;
+	unsigned int peak;
+	uint64_t total;
+} __attribute__((aligned(8)));
+
+#define IWD_MODULE_COUNTER(mod, object)					\
+	static struct iwd_module_counter __iwd_counter_ ## object	\
+		__attribute__((used, section("__iwd_module_counter"),	\
+					aligned(8))) = {		\
+			.module = #mod,				\
+			.name = #object,				\
+		};
+
+#define IWD_COUNTER_INC(object)						\
+	iwd_module_counter_inc(&__iwd_counter_ ## object)
+#define IWD_COUNTER_DEC(object)						\
+	iwd_module_counter_dec(&__iwd_counter_ ## object)
+
+static inline void iwd_module_counter_inc(struct iwd_module_counter *counter)
+{
+	counter->total++;
+
+	if (++counter->current > counter->peak)
+		counter->peak = counter->current;
+}
+
+static inline void iwd_module_counter_dec(struct iwd_module_counter *counter)
+{
+	counter->current--;
+}
+
 int iwd_modules_init(void);
 void iwd_modules_exit(void);
+void iwd_modules_iftype_appeared(uint32_t iftype);
+void iwd_modules_dump_stats(void);
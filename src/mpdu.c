@@ -49,300 +49,337 @@ static bool validate_mgmt_header(const struct mmpdu_header *mpdu,
 	return true;
 }
 
-/* 802.11-2016 13.11.2 */
-static bool skip_resource_req_resp(struct ie_tlv_iter *iter)
-{
-	struct ie_tlv_iter tmp;
-
-	/*
-	 * This is called when we've seen an RDE so we only need to validate
-	 * and skip IEs representing one or more Resource Descriptors up to
-	 * the end of this Resource Request or Resource Response.
-	 *
-	 * Since the Resource Descriptor specification is complex and,
-	 * especially in the case of a Vendor Specific descriptor and
-	 * in the case of a Resource Response to a failed request (with
-	 * the optional information), there seems to be no strict definition
-	 * of where one request/response ends and the next begins, allow
-	 * any combination of any of the IEs listed in 13.11.2 until an
-	 * IE that doesn't seem to be part of this RDE.
-	 */
-
-	memcpy(&tmp, iter, sizeof(tmp));
-
-	while (ie_tlv_iter_next(&tmp)) {
-		switch (ie_tlv_iter_get_tag(&tmp)) {
-		case IE_TYPE_TSPEC:
-		case IE_TYPE_TCLAS:
-		case IE_TYPE_TCLAS_PROCESSING:
-		case IE_TYPE_EXPEDITED_BANDWIDTH_REQUEST:
-		case IE_TYPE_SCHEDULE:
-		case IE_TYPE_TS_DELAY:
-		case IE_TYPE_RIC_DESCRIPTOR:
-		case IE_TYPE_VENDOR_SPECIFIC:
-			memcpy(iter, &tmp, sizeof(tmp));
-			continue;
-		default:
-			break;
-		}
-		break;
-	}
-
-	return true;
-}
-
-static bool validate_mgmt_ies(const uint8_t *ies, size_t ies_len,
-				const enum ie_type tag_order[], int tag_count)
-{
-	struct ie_tlv_iter iter;
-	enum ie_type tag;
-
-	ie_tlv_iter_init(&iter, ies, ies_len);
-
-	while (ie_tlv_iter_next(&iter)) {
-		int i = 0;
-		tag = ie_tlv_iter_get_tag(&iter);
-
-		/* Check that the tag is part of the valid set */
-		while (i < tag_count && tag_order[i] != tag)
-			i += 1;
-
-		/*
-		 * 802.11-2016 section 9.3.3.2:
-		 * "All fields and elements are mandatory unless stated
-		 * otherwise and appear in the specified, relative order.
-		 * STAs that encounter an element ID they do not recognize
-		 * in the frame body of a received Management frame ignore
-		 * that element and continue to parse the remainder of the
-		 * management frame body (if any) for additional elements
-		 * with recognizable element IDs."
-		 */
-		if (i == tag_count)
-			continue;
-
-		/* Tag found, make sure no duplicates present unless allowed */
-		if (tag != IE_TYPE_VENDOR_SPECIFIC &&
-				tag != IE_TYPE_RIC_DATA &&
-				tag != IE_TYPE_TRANSMIT_POWER_ENVELOPE &&
-				tag != IE_TYPE_MCCAOP_ADVERTISEMENT &&
-				tag != IE_TYPE_EMERGENCY_ALERT_IDENTIFIER &&
-				tag != IE_TYPE_MULTIPLE_BSSID &&
-				tag != IE_TYPE_NEIGHBOR_REPORT &&
-				tag != IE_TYPE_QUIET_CHANNEL) {
-			struct ie_tlv_iter clone;
-
-			memcpy(&clone, &iter, sizeof(clone));
-
-			while (ie_tlv_iter_next(&clone)) {
-				if (ie_tlv_iter_get_tag(&clone) != tag)
-					continue;
-
-				return false;
-			}
-		}
-
-		if (tag == IE_TYPE_RIC_DATA && !skip_resource_req_resp(&iter))
-			return false;
-	}
-
-	return true;
-}
+/*
+ * IE order descriptors.  Each lists the elements defined for a given frame
+ * body, in the order of the corresponding 802.11-2016 section 9.3.3 table,
+ * with the elements that may legitimately occur more than once tagged as
+ * repeatable.
+ */
+#define IE_ORDER_REPEATABLE	0x8000
+#define REPEATABLE(tag)		((tag) | IE_ORDER_REPEATABLE)
 
 /* 802.11-2016 section 9.3.3.6 */
-static bool validate_association_request_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	const struct mmpdu_association_request *body =
-		(const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SSID,
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_POWER_CAPABILITY,
-		IE_TYPE_SUPPORTED_CHANNELS,
-		IE_TYPE_RSN,
-		IE_TYPE_QOS_CAPABILITY,
-		IE_TYPE_RM_ENABLED_CAPABILITIES,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_SUPPORTED_OPERATING_CLASSES,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_QOS_TRAFFIC_CAPABILITY,
-		IE_TYPE_TIM_BROADCAST_REQUEST,
-		IE_TYPE_INTERWORKING,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_association_request))
-		return false;
-
-	*offset += sizeof(struct mmpdu_association_request);
-
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+static const uint16_t association_request_ies[] = {
+	IE_TYPE_SSID,
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_POWER_CAPABILITY,
+	IE_TYPE_SUPPORTED_CHANNELS,
+	IE_TYPE_RSN,
+	IE_TYPE_QOS_CAPABILITY,
+	IE_TYPE_RM_ENABLED_CAPABILITIES,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_SUPPORTED_OPERATING_CLASSES,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_QOS_TRAFFIC_CAPABILITY,
+	IE_TYPE_TIM_BROADCAST_REQUEST,
+	IE_TYPE_INTERWORKING,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
 /* 802.11-2016 section 9.3.3.7 */
-static bool validate_association_response_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	const struct mmpdu_association_response *body =
-		(const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_EDCA_PARAMETER_SET,
-		IE_TYPE_RCPI,
-		IE_TYPE_RSNI,
-		IE_TYPE_RM_ENABLED_CAPABILITIES,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_FAST_BSS_TRANSITION,
-		IE_TYPE_DSE_REGISTERED_LOCATION,
-		IE_TYPE_TIMEOUT_INTERVAL,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_HT_OPERATION,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_BSS_MAX_IDLE_PERIOD,
-		IE_TYPE_TIM_BROADCAST_RESPONSE,
-		IE_TYPE_QOS_MAP_SET,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_association_response))
-		return false;
+static const uint16_t association_response_ies[] = {
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_EDCA_PARAMETER_SET,
+	IE_TYPE_RCPI,
+	IE_TYPE_RSNI,
+	IE_TYPE_RM_ENABLED_CAPABILITIES,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_FAST_BSS_TRANSITION,
+	IE_TYPE_DSE_REGISTERED_LOCATION,
+	IE_TYPE_TIMEOUT_INTERVAL,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_HT_OPERATION,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_BSS_MAX_IDLE_PERIOD,
+	IE_TYPE_TIM_BROADCAST_RESPONSE,
+	IE_TYPE_QOS_MAP_SET,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-	*offset += sizeof(struct mmpdu_association_response);
+/* 802.11-2016 section 9.3.3.8 */
+static const uint16_t reassociation_request_ies[] = {
+	IE_TYPE_SSID,
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_POWER_CAPABILITY,
+	IE_TYPE_SUPPORTED_CHANNELS,
+	IE_TYPE_RSN,
+	IE_TYPE_QOS_CAPABILITY,
+	IE_TYPE_RM_ENABLED_CAPABILITIES,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_FAST_BSS_TRANSITION,
+	REPEATABLE(IE_TYPE_RIC_DATA),
+	IE_TYPE_SUPPORTED_OPERATING_CLASSES,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_QOS_TRAFFIC_CAPABILITY,
+	IE_TYPE_TIM_BROADCAST_REQUEST,
+	IE_TYPE_FMS_REQUEST,
+	IE_TYPE_DMS_REQUEST,
+	IE_TYPE_INTERWORKING,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+/* 802.11-2016 section 9.3.3.9 */
+static const uint16_t reassociation_response_ies[] = {
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_EDCA_PARAMETER_SET,
+	IE_TYPE_RCPI,
+	IE_TYPE_RSNI,
+	IE_TYPE_RM_ENABLED_CAPABILITIES,
+	IE_TYPE_RSN,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_FAST_BSS_TRANSITION,
+	REPEATABLE(IE_TYPE_RIC_DATA),
+	IE_TYPE_DSE_REGISTERED_LOCATION,
+	IE_TYPE_TIMEOUT_INTERVAL,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_HT_OPERATION,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_BSS_MAX_IDLE_PERIOD,
+	IE_TYPE_TIM_BROADCAST_RESPONSE,
+	IE_TYPE_FMS_RESPONSE,
+	IE_TYPE_DMS_RESPONSE,
+	IE_TYPE_QOS_MAP_SET,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-/* 802.11-2016 section 9.3.3.8 */
-static bool validate_reassociation_request_mmpdu(
-						const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	const struct mmpdu_reassociation_request *body =
-		(const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SSID,
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_POWER_CAPABILITY,
-		IE_TYPE_SUPPORTED_CHANNELS,
-		IE_TYPE_RSN,
-		IE_TYPE_QOS_CAPABILITY,
-		IE_TYPE_RM_ENABLED_CAPABILITIES,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_FAST_BSS_TRANSITION,
-		IE_TYPE_RIC_DATA,
-		IE_TYPE_SUPPORTED_OPERATING_CLASSES,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_QOS_TRAFFIC_CAPABILITY,
-		IE_TYPE_TIM_BROADCAST_REQUEST,
-		IE_TYPE_FMS_REQUEST,
-		IE_TYPE_DMS_REQUEST,
-		IE_TYPE_INTERWORKING,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_reassociation_request))
-		return false;
+/* 802.11-2016 section 9.3.3.10 */
+static const uint16_t probe_request_ies[] = {
+	IE_TYPE_SSID,
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_REQUEST,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_DSSS_PARAMETER_SET,
+	IE_TYPE_SUPPORTED_OPERATING_CLASSES,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_SSID_LIST,
+	IE_TYPE_CHANNEL_USAGE,
+	IE_TYPE_INTERWORKING,
+	IE_TYPE_MESH_ID,
+	IE_TYPE_MULTIBAND,
+	IE_TYPE_DMG_CAPABILITIES,
+	IE_TYPE_MULTIPLE_MAC_SUBLAYERS,
+	IE_TYPE_VHT_CAPABILITIES,
+	IE_TYPE_ESTIMATED_SERVICE_PARAMETERS,
+	IE_TYPE_EXTENDED_REQUEST,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-	*offset += sizeof(struct mmpdu_reassociation_request);
+/* 802.11-2016 section 9.3.3.16 */
+static const uint16_t timing_advertisement_ies[] = {
+	IE_TYPE_COUNTRY,
+	IE_TYPE_POWER_CONSTRAINT,
+	IE_TYPE_TIME_ADVERTISEMENT,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+/* 802.11-2016 section 9.3.3.3 */
+static const uint16_t beacon_ies[] = {
+	IE_TYPE_SSID,
+	IE_TYPE_SUPPORTED_RATES,
+	IE_TYPE_DSSS_PARAMETER_SET,
+	IE_TYPE_CF_PARAMETER_SET,
+	IE_TYPE_IBSS_PARAMETER_SET,
+	IE_TYPE_TIM,
+	IE_TYPE_COUNTRY,
+	IE_TYPE_POWER_CONSTRAINT,
+	IE_TYPE_CHANNEL_SWITCH_ANNOUNCEMENT,
+	IE_TYPE_QUIET,
+	IE_TYPE_IBSS_DFS,
+	IE_TYPE_TPC_REPORT,
+	IE_TYPE_ERP,
+	IE_TYPE_EXTENDED_SUPPORTED_RATES,
+	IE_TYPE_RSN,
+	IE_TYPE_BSS_LOAD,
+	IE_TYPE_EDCA_PARAMETER_SET,
+	IE_TYPE_QOS_CAPABILITY,
+	IE_TYPE_AP_CHANNEL_REPORT,
+	IE_TYPE_BSS_AVERAGE_ACCESS_DELAY,
+	IE_TYPE_ANTENNA,
+	IE_TYPE_BSS_AVAILABLE_ADMISSION_CAPACITY,
+	IE_TYPE_BSS_AC_ACCESS_DELAY,
+	IE_TYPE_MEASUREMENT_PILOT_TRANSMISSION,
+	REPEATABLE(IE_TYPE_MULTIPLE_BSSID),
+	IE_TYPE_RM_ENABLED_CAPABILITIES,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_DSE_REGISTERED_LOCATION,
+	IE_TYPE_EXTENDED_CHANNEL_SWITCH_ANNOUNCEMENT,
+	IE_TYPE_SUPPORTED_OPERATING_CLASSES,
+	IE_TYPE_HT_CAPABILITIES,
+	IE_TYPE_HT_OPERATION,
+	IE_TYPE_BSS_COEXISTENCE,
+	IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
+	IE_TYPE_EXTENDED_CAPABILITIES,
+	IE_TYPE_FMS_DESCRIPTOR,
+	IE_TYPE_QOS_TRAFFIC_CAPABILITY,
+	IE_TYPE_TIME_ADVERTISEMENT,
+	IE_TYPE_INTERWORKING,
+	IE_TYPE_ADVERTISEMENT_PROTOCOL,
+	IE_TYPE_ROAMING_CONSORTIUM,
+	REPEATABLE(IE_TYPE_EMERGENCY_ALERT_IDENTIFIER),
+	IE_TYPE_MESH_ID,
+	IE_TYPE_MESH_CONFIGURATION,
+	IE_TYPE_MESH_AWAKE_WINDOW,
+	IE_TYPE_BEACON_TIMING,
+	IE_TYPE_MCCAOP_ADVERTISEMENT_OVERVIEW,
+	REPEATABLE(IE_TYPE_MCCAOP_ADVERTISEMENT),
+	IE_TYPE_MESH_CHANNEL_SWITCH_PARAMETERS,
+	IE_TYPE_QMF_POLICY,
+	IE_TYPE_QLOAD_REPORT,
+	IE_TYPE_HCCA_TXOP_UPDATE_COUNT,
+	IE_TYPE_MULTIBAND,
+	IE_TYPE_VHT_CAPABILITIES,
+	IE_TYPE_VHT_OPERATION,
+	REPEATABLE(IE_TYPE_TRANSMIT_POWER_ENVELOPE),
+	IE_TYPE_CHANNEL_SWITCH_WRAPPER,
+	IE_TYPE_EXTENDED_BSS_LOAD,
+	REPEATABLE(IE_TYPE_QUIET_CHANNEL),
+	IE_TYPE_OPERATING_MODE_NOTIFICATION,
+	IE_TYPE_REDUCED_NEIGHBOR_REPORT,
+	IE_TYPE_TVHT_OPERATION,
+	IE_TYPE_ESTIMATED_SERVICE_PARAMETERS,
+	IE_TYPE_FUTURE_CHANNEL_GUIDANCE,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
+
+/* 802.11-2016 section 9.3.3.12, Shared Key transaction sequence 2 and 3 */
+static const uint16_t authentication_shared_key_ies[] = {
+	IE_TYPE_CHALLENGE_TEXT,
+	IE_TYPE_MULTIBAND,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
 
-/* 802.11-2016 section 9.3.3.9 */
-static bool validate_reassociation_response_mmpdu(
-						const struct mmpdu_header *mpdu,
-						int len, int *offset)
+/*
+ * 802.11-2016 section 9.3.3.12, Fast BSS Transition.  The elements of the
+ * Resource Descriptors following an RDE are not part of this list and are
+ * thus ignored, see 802.11-2016 13.11.2.
+ */
+static const uint16_t authentication_ft_ies[] = {
+	IE_TYPE_RSN,
+	IE_TYPE_MOBILITY_DOMAIN,
+	IE_TYPE_FAST_BSS_TRANSITION,
+	IE_TYPE_TIMEOUT_INTERVAL,
+	REPEATABLE(IE_TYPE_RIC_DATA),
+	IE_TYPE_MULTIBAND,
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
+
+/* 802.11-2016 section 9.3.3.12, non-zero Status Code */
+static const uint16_t authentication_error_ies[] = {
+	REPEATABLE(IE_TYPE_NEIGHBOR_REPORT),
+	REPEATABLE(IE_TYPE_VENDOR_SPECIFIC),
+};
+
+/* 802.11ai-2016 section 9.3.3.12, FILS Shared Key */
+static const uint16_t authentication_fils_ies[] = {
+	IE_TYPE_FILS_SESSION,
+	IE_TYPE_FILS_WRAPPED_DATA,
+};
+
+struct mmpdu_ie_order {
+	const uint16_t *tags;
+	unsigned int n_tags;
+};
+
+#define IE_ORDER(array) { array, L_ARRAY_SIZE(array) }
+
+static const struct mmpdu_ie_order no_ies = { NULL, 0 };
+
+/*
+ * Picks the IE order descriptor for an Authentication frame body, which
+ * depends on the Status Code, the Algorithm and the Transaction Sequence
+ */
+static const struct mmpdu_ie_order *authentication_ie_order(const void *body)
 {
-	const struct mmpdu_reassociation_response *body =
-		(const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_EDCA_PARAMETER_SET,
-		IE_TYPE_RCPI,
-		IE_TYPE_RSNI,
-		IE_TYPE_RM_ENABLED_CAPABILITIES,
-		IE_TYPE_RSN,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_FAST_BSS_TRANSITION,
-		IE_TYPE_RIC_DATA,
-		IE_TYPE_DSE_REGISTERED_LOCATION,
-		IE_TYPE_TIMEOUT_INTERVAL,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_HT_OPERATION,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_BSS_MAX_IDLE_PERIOD,
-		IE_TYPE_TIM_BROADCAST_RESPONSE,
-		IE_TYPE_FMS_RESPONSE,
-		IE_TYPE_DMS_RESPONSE,
-		IE_TYPE_QOS_MAP_SET,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_reassociation_response))
-		return false;
+	const struct mmpdu_authentication *auth = body;
+	uint16_t transaction_sequence;
+	static const struct mmpdu_ie_order shared_key =
+		IE_ORDER(authentication_shared_key_ies);
+	static const struct mmpdu_ie_order ft =
+		IE_ORDER(authentication_ft_ies);
+	static const struct mmpdu_ie_order error =
+		IE_ORDER(authentication_error_ies);
+	static const struct mmpdu_ie_order fils =
+		IE_ORDER(authentication_fils_ies);
+
+	if (L_LE16_TO_CPU(auth->status) != 0)
+		return &error;
+
+	switch (L_LE16_TO_CPU(auth->algorithm)) {
+	case MMPDU_AUTH_ALGO_OPEN_SYSTEM:
+	case MMPDU_AUTH_ALGO_SAE:
+		return &no_ies;
+	case MMPDU_AUTH_ALGO_SHARED_KEY:
+		transaction_sequence =
+			L_LE16_TO_CPU(auth->transaction_sequence);
 
-	*offset += sizeof(struct mmpdu_reassociation_response);
+		if (transaction_sequence < 2 || transaction_sequence > 3)
+			return &no_ies;
 
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+		return &shared_key;
+	case MMPDU_AUTH_ALGO_FT:
+		return &ft;
+	case MMPDU_AUTH_ALGO_FILS_SK:
+	case MMPDU_AUTH_ALGO_FILS_SK_PFS:
+		return &fils;
+	}
 
-/* 802.11-2016 section 9.3.3.10 */
-static bool validate_probe_request_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	const struct mmpdu_probe_request *body = (const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SSID,
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_REQUEST,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_DSSS_PARAMETER_SET,
-		IE_TYPE_SUPPORTED_OPERATING_CLASSES,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_SSID_LIST,
-		IE_TYPE_CHANNEL_USAGE,
-		IE_TYPE_INTERWORKING,
-		IE_TYPE_MESH_ID,
-		IE_TYPE_MULTIBAND,
-		IE_TYPE_DMG_CAPABILITIES,
-		IE_TYPE_MULTIPLE_MAC_SUBLAYERS,
-		IE_TYPE_VHT_CAPABILITIES,
-		IE_TYPE_ESTIMATED_SERVICE_PARAMETERS,
-		IE_TYPE_EXTENDED_REQUEST,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_probe_request))
-		return false;
+	return NULL;
+}
 
-	*offset += sizeof(struct mmpdu_probe_request);
+enum mmpdu_body_flag {
+	/* The body consists of exactly the fixed fields */
+	MMPDU_BODY_EXACT	= 0x1,
+	/* The elements are not checked beyond being indexed */
+	MMPDU_BODY_UNCHECKED	= 0x2,
+};
 
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
+/*
+ * Per-subtype description of a Management frame body: the length of the
+ * fixed fields, which are followed by the elements (if any), and either a
+ * fixed IE order descriptor or a function choosing one based on the fixed
+ * fields.
+ */
+struct mmpdu_body_desc {
+	bool valid : 1;
+	uint8_t flags;
+	uint8_t fixed_len;
+	struct mmpdu_ie_order ie_order;
+	const struct mmpdu_ie_order *(*select_ie_order)(const void *body);
+};
+
+#define BODY(type, array) {					\
+	.valid = true,						\
+	.fixed_len = sizeof(struct type),			\
+	.ie_order = IE_ORDER(array),				\
 }
 
-/* 802.11-2016 section 9.3.3.11 */
-static bool validate_probe_response_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
+static const struct mmpdu_body_desc mmpdu_body_descs[16] = {
+	[MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_REQUEST] =
+		BODY(mmpdu_association_request, association_request_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_RESPONSE] =
+		BODY(mmpdu_association_response, association_response_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_REQUEST] =
+		BODY(mmpdu_reassociation_request, reassociation_request_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_RESPONSE] =
+		BODY(mmpdu_reassociation_response,
+			reassociation_response_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_PROBE_REQUEST] =
+		BODY(mmpdu_probe_request, probe_request_ies),
 	/*
 	 * If this is a response to a frame that could have contained a
 	 * Request or an Extended Request element, then, after all of the
@@ -354,248 +391,125 @@ static bool validate_probe_response_mmpdu(const struct mmpdu_header *mpdu,
 	 *
 	 * Given the above, and the fact that nobody on the planet seems
 	 * to order IEs properly inside the Management frames, we simply skip
-	 * any checking here and return true.
+	 * any checking here.
 	 */
+	[MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE] = {
+		.valid = true,
+		.flags = MMPDU_BODY_UNCHECKED,
+		.fixed_len = sizeof(struct mmpdu_probe_response),
+	},
+	[MPDU_MANAGEMENT_SUBTYPE_TIMING_ADVERTISEMENT] =
+		BODY(mmpdu_timing_advertisement, timing_advertisement_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_BEACON] = BODY(mmpdu_beacon, beacon_ies),
+	[MPDU_MANAGEMENT_SUBTYPE_ATIM] = {
+		.valid = true,
+		.flags = MMPDU_BODY_EXACT,
+	},
+	/* Reason Code, trailing Vendor Specific or MME elements are ignored */
+	[MPDU_MANAGEMENT_SUBTYPE_DISASSOCIATION] = {
+		.valid = true,
+		.fixed_len = 2,
+	},
+	[MPDU_MANAGEMENT_SUBTYPE_AUTHENTICATION] = {
+		.valid = true,
+		.fixed_len = 6,
+		.select_ie_order = authentication_ie_order,
+	},
+	[MPDU_MANAGEMENT_SUBTYPE_DEAUTHENTICATION] = {
+		.valid = true,
+		.fixed_len = 2,
+	},
+	/* Category, the rest is up to the Action frame handlers */
+	[MPDU_MANAGEMENT_SUBTYPE_ACTION] = {
+		.valid = true,
+		.fixed_len = 1,
+	},
+	[MPDU_MANAGEMENT_SUBTYPE_ACTION_NO_ACK] = {
+		.valid = true,
+		.fixed_len = 1,
+	},
+};
 
-	return true;
-}
-
-/* 802.11-2016 section 9.3.3.16 */
-static bool validate_timing_advertisement_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
+/*
+ * 802.11-2016 section 9.3.3.2:
+ * "All fields and elements are mandatory unless stated otherwise and appear
+ * in the specified, relative order.  STAs that encounter an element ID they
+ * do not recognize in the frame body of a received Management frame ignore
+ * that element and continue to parse the remainder of the management frame
+ * body (if any) for additional elements with recognizable element IDs."
+ *
+ * Unrecognized elements are thus skipped and, as in practice few vendors
+ * order the elements properly, only the duplicates of the recognized
+ * non-repeatable elements are rejected.  With the index built this is a
+ * lookup per descriptor entry rather than another walk of the IEs.
+ */
+static bool validate_mgmt_ies(const struct ie_index *index,
+				const struct mmpdu_ie_order *ie_order)
 {
-	const struct mmpdu_timing_advertisement *body =
-		(const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_COUNTRY,
-		IE_TYPE_POWER_CONSTRAINT,
-		IE_TYPE_TIME_ADVERTISEMENT,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_timing_advertisement))
-		return false;
-
-	*offset += sizeof(struct mmpdu_timing_advertisement);
-
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+	unsigned int i;
 
-/* 802.11-2016 section 9.3.3.3 */
-static bool validate_beacon_mmpdu(const struct mmpdu_header *mpdu,
-					int len, int *offset)
-{
-	const struct mmpdu_beacon *body = (const void *) mpdu + *offset;
-	static const enum ie_type ie_order[] = {
-		IE_TYPE_SSID,
-		IE_TYPE_SUPPORTED_RATES,
-		IE_TYPE_DSSS_PARAMETER_SET,
-		IE_TYPE_CF_PARAMETER_SET,
-		IE_TYPE_IBSS_PARAMETER_SET,
-		IE_TYPE_TIM,
-		IE_TYPE_COUNTRY,
-		IE_TYPE_POWER_CONSTRAINT,
-		IE_TYPE_CHANNEL_SWITCH_ANNOUNCEMENT,
-		IE_TYPE_QUIET,
-		IE_TYPE_IBSS_DFS,
-		IE_TYPE_TPC_REPORT,
-		IE_TYPE_ERP,
-		IE_TYPE_EXTENDED_SUPPORTED_RATES,
-		IE_TYPE_RSN,
-		IE_TYPE_BSS_LOAD,
-		IE_TYPE_EDCA_PARAMETER_SET,
-		IE_TYPE_QOS_CAPABILITY,
-		IE_TYPE_AP_CHANNEL_REPORT,
-		IE_TYPE_BSS_AVERAGE_ACCESS_DELAY,
-		IE_TYPE_ANTENNA,
-		IE_TYPE_BSS_AVAILABLE_ADMISSION_CAPACITY,
-		IE_TYPE_BSS_AC_ACCESS_DELAY,
-		IE_TYPE_MEASUREMENT_PILOT_TRANSMISSION,
-		IE_TYPE_MULTIPLE_BSSID,
-		IE_TYPE_RM_ENABLED_CAPABILITIES,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_DSE_REGISTERED_LOCATION,
-		IE_TYPE_EXTENDED_CHANNEL_SWITCH_ANNOUNCEMENT,
-		IE_TYPE_SUPPORTED_OPERATING_CLASSES,
-		IE_TYPE_HT_CAPABILITIES,
-		IE_TYPE_HT_OPERATION,
-		IE_TYPE_BSS_COEXISTENCE,
-		IE_TYPE_OVERLAPPING_BSS_SCAN_PARAMETERS,
-		IE_TYPE_EXTENDED_CAPABILITIES,
-		IE_TYPE_FMS_DESCRIPTOR,
-		IE_TYPE_QOS_TRAFFIC_CAPABILITY,
-		IE_TYPE_TIME_ADVERTISEMENT,
-		IE_TYPE_INTERWORKING,
-		IE_TYPE_ADVERTISEMENT_PROTOCOL,
-		IE_TYPE_ROAMING_CONSORTIUM,
-		IE_TYPE_EMERGENCY_ALERT_IDENTIFIER,
-		IE_TYPE_MESH_ID,
-		IE_TYPE_MESH_CONFIGURATION,
-		IE_TYPE_MESH_AWAKE_WINDOW,
-		IE_TYPE_BEACON_TIMING,
-		IE_TYPE_MCCAOP_ADVERTISEMENT_OVERVIEW,
-		IE_TYPE_MCCAOP_ADVERTISEMENT,
-		IE_TYPE_MESH_CHANNEL_SWITCH_PARAMETERS,
-		IE_TYPE_QMF_POLICY,
-		IE_TYPE_QLOAD_REPORT,
-		IE_TYPE_HCCA_TXOP_UPDATE_COUNT,
-		IE_TYPE_MULTIBAND,
-		IE_TYPE_VHT_CAPABILITIES,
-		IE_TYPE_VHT_OPERATION,
-		IE_TYPE_TRANSMIT_POWER_ENVELOPE,
-		IE_TYPE_CHANNEL_SWITCH_WRAPPER,
-		IE_TYPE_EXTENDED_BSS_LOAD,
-		IE_TYPE_QUIET_CHANNEL,
-		IE_TYPE_OPERATING_MODE_NOTIFICATION,
-		IE_TYPE_REDUCED_NEIGHBOR_REPORT,
-		IE_TYPE_TVHT_OPERATION,
-		IE_TYPE_ESTIMATED_SERVICE_PARAMETERS,
-		IE_TYPE_FUTURE_CHANNEL_GUIDANCE,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-
-	if (len < *offset + (int) sizeof(struct mmpdu_beacon))
-		return false;
+	for (i = 0; i < ie_order->n_tags; i++) {
+		uint16_t tag = ie_order->tags[i];
 
-	*offset += sizeof(struct mmpdu_beacon);
+		if (tag & IE_ORDER_REPEATABLE)
+			continue;
 
-	return validate_mgmt_ies(body->ies, len - *offset, ie_order,
-					L_ARRAY_SIZE(ie_order));
-}
+		if (ie_index_count(index, tag) > 1)
+			return false;
+	}
 
-static bool validate_atim_mmpdu(const struct mmpdu_header *mpdu,
-				int len, int *offset)
-{
-	return *offset == len;
+	return true;
 }
 
-static bool validate_disassociation_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
+static bool validate_mgmt_mpdu(const struct mmpdu_header *mpdu, int len,
+				int *offset, struct ie_index *index)
 {
-	*offset += 2;
-	return *offset <= len;
-}
+	const struct mmpdu_body_desc *desc;
+	const struct mmpdu_ie_order *ie_order;
+	const uint8_t *body;
 
-static bool validate_authentication_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	uint16_t transaction_sequence;
-	const struct mmpdu_authentication *body = (const void *) mpdu + *offset;
-	static const enum ie_type ie_order_shared_key[] = {
-		IE_TYPE_CHALLENGE_TEXT,
-		IE_TYPE_MULTIBAND,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-	static const enum ie_type ie_order_ft[] = {
-		IE_TYPE_RSN,
-		IE_TYPE_MOBILITY_DOMAIN,
-		IE_TYPE_FAST_BSS_TRANSITION,
-		IE_TYPE_TIMEOUT_INTERVAL,
-		IE_TYPE_RIC_DATA,
-		IE_TYPE_FAST_BSS_TRANSITION,
-		IE_TYPE_MULTIBAND,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-	static const enum ie_type ie_order_error[] = {
-		IE_TYPE_NEIGHBOR_REPORT,
-		IE_TYPE_VENDOR_SPECIFIC,
-	};
-	static const enum ie_type ie_order_fils[] = {
-		IE_TYPE_FILS_SESSION,
-		IE_TYPE_FILS_WRAPPED_DATA,
-	};
-
-	if (len < *offset + 6)
+	if (!validate_mgmt_header(mpdu, len, offset))
 		return false;
 
-	*offset += 6;
+	desc = &mmpdu_body_descs[mpdu->fc.subtype];
+	if (!desc->valid)
+		return false;
 
-	if (L_LE16_TO_CPU(L_LE16_TO_CPU(body->status)) != 0)
-		return validate_mgmt_ies(body->ies, len - *offset,
-						ie_order_error,
-						L_ARRAY_SIZE(ie_order_error));
+	body = (const uint8_t *) mpdu + *offset;
 
-	switch (L_LE16_TO_CPU(body->algorithm)) {
-	case MMPDU_AUTH_ALGO_OPEN_SYSTEM:
-		return *offset <= len;
-	case MMPDU_AUTH_ALGO_SHARED_KEY:
-		transaction_sequence =
-			L_LE16_TO_CPU(body->transaction_sequence);
+	if (len < *offset + desc->fixed_len)
+		return false;
 
-		if (transaction_sequence < 2 || transaction_sequence > 3)
-			return *offset <= len;
+	*offset += desc->fixed_len;
 
-		return validate_mgmt_ies(body->ies, len - *offset,
-					ie_order_shared_key,
-					L_ARRAY_SIZE(ie_order_shared_key));
-	case MMPDU_AUTH_ALGO_FT:
-		return validate_mgmt_ies(body->ies, len - *offset, ie_order_ft,
-						L_ARRAY_SIZE(ie_order_ft));
-	case MMPDU_AUTH_ALGO_SAE:
-		return *offset <= len;
-	case MMPDU_AUTH_ALGO_FILS_SK:
-	case MMPDU_AUTH_ALGO_FILS_SK_PFS:
-		return validate_mgmt_ies(body->ies, len - *offset,
-						ie_order_fils,
-						L_ARRAY_SIZE(ie_order_fils));
-	default:
+	if ((desc->flags & MMPDU_BODY_EXACT) && *offset != len)
 		return false;
-	}
 
-	return false;
-}
+	if (desc->select_ie_order) {
+		ie_order = desc->select_ie_order(body);
+		if (!ie_order)
+			return false;
+	} else
+		ie_order = &desc->ie_order;
 
-static bool validate_deauthentication_mmpdu(const struct mmpdu_header *mpdu,
-						int len, int *offset)
-{
-	*offset += 2;
-	return *offset <= len;
-}
+	/* Frames without elements get an empty index at the end of the body */
+	if (!ie_order->n_tags && !(desc->flags & MMPDU_BODY_UNCHECKED))
+		return ie_index_init(index, (const uint8_t *) mpdu + len, 0);
 
-static bool validate_mgmt_mpdu(const struct mmpdu_header *mpdu, int len,
-				int *offset)
-{
-	if (!validate_mgmt_header(mpdu, len, offset))
-		return false;
-
-	switch (mpdu->fc.subtype) {
-	case MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_REQUEST:
-		return validate_association_request_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_ASSOCIATION_RESPONSE:
-		return validate_association_response_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_REQUEST:
-		return validate_reassociation_request_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_REASSOCIATION_RESPONSE:
-		return validate_reassociation_response_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_PROBE_REQUEST:
-		return validate_probe_request_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_PROBE_RESPONSE:
-		return validate_probe_response_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_TIMING_ADVERTISEMENT:
-		return validate_timing_advertisement_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_BEACON:
-		return validate_beacon_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_ATIM:
-		return validate_atim_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_DISASSOCIATION:
-		return validate_disassociation_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_AUTHENTICATION:
-		return validate_authentication_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_DEAUTHENTICATION:
-		return validate_deauthentication_mmpdu(mpdu, len, offset);
-	case MPDU_MANAGEMENT_SUBTYPE_ACTION:
-	case MPDU_MANAGEMENT_SUBTYPE_ACTION_NO_ACK:
-		return *offset + 1 <= len;
-	default:
+	if (!ie_index_init(index, (const uint8_t *) mpdu + *offset,
+				len - *offset))
 		return false;
-	}
 
-	return true;
+	return validate_mgmt_ies(index, ie_order);
 }
 
-const struct mmpdu_header *mpdu_validate(const uint8_t *frame, int len)
+/*
+ * Validates a frame and, as a by-product, indexes the elements of its body
+ * into @index so that the caller can look them up without walking the IEs
+ * once more.  The index is empty for frame bodies without elements.
+ */
+const struct mmpdu_header *mpdu_validate_index(const uint8_t *frame, int len,
+						struct ie_index *index)
 {
 	const struct mpdu_fc *fc;
 	const struct mmpdu_header *mmpdu;
@@ -614,7 +528,7 @@ const struct mmpdu_header *mpdu_validate(const uint8_t *frame, int len)
 	case MPDU_TYPE_MANAGEMENT:
 		mmpdu = (const struct mmpdu_header *) frame;
 
-		if (validate_mgmt_mpdu(mmpdu, len, &offset))
+		if (validate_mgmt_mpdu(mmpdu, len, &offset, index))
 			return mmpdu;
 
 		return NULL;
@@ -623,6 +537,13 @@ const struct mmpdu_header *mpdu_validate(const uint8_t *frame, int len)
 	}
 }
 
+const struct mmpdu_header *mpdu_validate(const uint8_t *frame, int len)
+{
+	struct ie_index index;
+
+	return mpdu_validate_index(frame, len, &index);
+}
+
 size_t mmpdu_header_len(const struct mmpdu_header *mmpdu)
 {
 	return mmpdu->fc.order == 0 ? 24 : 28;
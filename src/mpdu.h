@@ -25,6 +25,8 @@
 #include <asm/byteorder.h>
 #include <linux/types.h>
 
+struct ie_index;
+
 /* Std 802.11, Section 8.2.3 */
 #define IEEE80211_MAX_DATA_LEN		2304
 
@@ -230,6 +232,10 @@ enum mmpdu_status_code {
 	MMPDU_STATUS_CODE_ENABLEMENT_DENIED = 105,
 	MMPDU_STATUS_CODE_RESTRICT_AUTH_GDB = 106,
 	MMPDU_STATUS_CODE_AUTHORIZATION_DEENABLED = 107,
+	/* 108-111 reserved */
+	MMPDU_STATUS_CODE_FILS_AUTHENTICATION_FAILURE = 112,
+	MMPDU_STATUS_CODE_UNKNOWN_AUTHENTICATION_SERVER = 113,
+	MMPDU_STATUS_CODE_SAE_HASH_TO_ELEMENT = 126,
 };
 
 /* 802.11, Section 8.2.4.1.1, Figure 8-2 */
@@ -371,7 +377,7 @@ struct mmpdu_probe_request {
 
 /* 802.11, Section 8.3.3.10 */
 struct mmpdu_probe_response {
-	uint8_t timestamp;
+	__le64 timestamp;
 	__le16 beacon_interval;
 	struct mmpdu_field_capability capability;
 	uint8_t ies[0];
@@ -379,14 +385,14 @@ struct mmpdu_probe_response {
 
 /* 802.11, Section 8.3.3.15 */
 struct mmpdu_timing_advertisement {
-	uint8_t timestamp;
+	__le64 timestamp;
 	struct mmpdu_field_capability capability;
 	uint8_t ies[0];
 } __attribute__ ((packed));
 
 /* 802.11, Section 8.3.3.2 */
 struct mmpdu_beacon {
-	uint8_t timestamp;
+	__le64 timestamp;
 	__le16 beacon_interval;
 	struct mmpdu_field_capability capability;
 	uint8_t ies[0];
@@ -407,5 +413,7 @@ struct mmpdu_deauthentication {
 } __attribute__ ((packed));
 
 const struct mmpdu_header *mpdu_validate(const uint8_t *frame, int len);
+const struct mmpdu_header *mpdu_validate_index(const uint8_t *frame, int len,
+						struct ie_index *index);
 const void *mmpdu_body(const struct mmpdu_header *mpdu);
 size_t mmpdu_header_len(const struct mmpdu_header *mmpdu);
@@ -32,6 +32,7 @@
 #include <linux/rtnetlink.h>
 #include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,12 +42,15 @@
 
 #include "ell/useful.h"
 #include "src/iwd.h"
+#include "src/util.h"
 #include "src/module.h"
 #include "src/netdev.h"
 #include "src/station.h"
 #include "src/common.h"
 #include "src/network.h"
 #include "src/resolve.h"
+#include "src/storage.h"
+#include "src/knownnetworks.h"
 #include "src/netconfig.h"
 
 struct netconfig {
@@ -60,6 +64,9 @@ struct netconfig {
 	char **dns6_overrides;
 
 	const struct l_settings *active_settings;
+	char *network_id;
+	uint8_t *fils_dhcp_ack;
+	size_t fils_dhcp_ack_len;
 
 	netconfig_notify_func_t notify;
 	void *user_data;
@@ -69,10 +76,14 @@ struct netconfig {
 	struct l_acd *acd;
 
 	uint32_t route4_add_gateway_cmd_id;
+	uint32_t route6_add_gateway_cmd_id;
+	struct l_idle *ipv6_disable_idle;
 };
 
 static struct l_netlink *rtnl;
 static struct l_queue *netconfig_list;
+static struct l_settings *dhcp_leases;
+static uint32_t known_networks_watch;
 
 /*
  * Routing priority offset, configurable in main.conf. The route with lower
@@ -120,12 +131,58 @@ static int sysfs_write_ipv6_setting(const char *ifname, const char *setting,
 	return r;
 }
 
+static void netconfig_ipv6_disable_write(struct netconfig *netconfig)
+{
+	struct netdev *netdev = netdev_find(netconfig->ifindex);
+
+	l_idle_remove(l_steal_ptr(netconfig->ipv6_disable_idle));
+
+	if (netdev)
+		sysfs_write_ipv6_setting(netdev_get_name(netdev),
+						"disable_ipv6", "1");
+}
+
+static void netconfig_ipv6_disable_idle_cb(struct l_idle *idle,
+						void *user_data)
+{
+	netconfig_ipv6_disable_write(user_data);
+}
+
+/*
+ * Disabling IPv6 is never urgent, so the sysfs write is left for the next
+ * idle iteration rather than stalling a disconnect or interface setup.  A
+ * pending disable is simply dropped if IPv6 gets re-enabled before then.
+ */
+static void netconfig_ipv6_set_enabled(struct netconfig *netconfig,
+					bool enabled)
+{
+	struct netdev *netdev;
+
+	if (!enabled) {
+		if (!netconfig->ipv6_disable_idle)
+			netconfig->ipv6_disable_idle = l_idle_create(
+					netconfig_ipv6_disable_idle_cb,
+					netconfig, NULL);
+		return;
+	}
+
+	l_idle_remove(l_steal_ptr(netconfig->ipv6_disable_idle));
+
+	netdev = netdev_find(netconfig->ifindex);
+	sysfs_write_ipv6_setting(netdev_get_name(netdev), "disable_ipv6", "0");
+}
+
 static void netconfig_free(void *data)
 {
 	struct netconfig *netconfig = data;
 
+	if (netconfig->ipv6_disable_idle)
+		netconfig_ipv6_disable_write(netconfig);
+
 	l_dhcp_client_destroy(netconfig->dhcp_client);
 	l_dhcp6_client_destroy(netconfig->dhcp6_client);
+	l_free(netconfig->network_id);
+	l_free(netconfig->fils_dhcp_ack);
 
 	l_free(netconfig);
 }
@@ -598,6 +655,23 @@ static void netconfig_route_generic_cb(int error, uint16_t type,
 	}
 }
 
+/*
+ * IPv4 and IPv6 are configured independently of each other.  The link is
+ * reported as connected as soon as either family is usable, the other one
+ * carries on in the background.
+ */
+static void netconfig_family_ready(struct netconfig *netconfig, int family)
+{
+	if (!netconfig->notify)
+		return;
+
+	l_debug("ifindex %u: %s configured first", netconfig->ifindex,
+				family == AF_INET ? "IPv4" : "IPv6");
+
+	netconfig->notify(NETCONFIG_EVENT_CONNECTED, netconfig->user_data);
+	netconfig->notify = NULL;
+}
+
 static void netconfig_route_add_cmd_cb(int error, uint16_t type,
 						const void *data, uint32_t len,
 						void *user_data)
@@ -612,11 +686,24 @@ static void netconfig_route_add_cmd_cb(int error, uint16_t type,
 		return;
 	}
 
-	if (!netconfig->notify)
+	netconfig_family_ready(netconfig, AF_INET);
+}
+
+static void netconfig_route6_add_cmd_cb(int error, uint16_t type,
+						const void *data, uint32_t len,
+						void *user_data)
+{
+	struct netconfig *netconfig = user_data;
+
+	netconfig->route6_add_gateway_cmd_id = 0;
+
+	if (error) {
+		l_error("netconfig: Failed to add IPv6 route. Error %d: %s",
+						error, strerror(-error));
 		return;
+	}
 
-	netconfig->notify(NETCONFIG_EVENT_CONNECTED, netconfig->user_data);
-	netconfig->notify = NULL;
+	netconfig_family_ready(netconfig, AF_INET6);
 }
 
 static bool netconfig_ipv4_routes_install(struct netconfig *netconfig)
@@ -686,21 +773,33 @@ static void netconfig_ipv4_ifaddr_add_cmd_cb(int error, uint16_t type,
 		return;
 	}
 
-	if (!netconfig_ipv4_routes_install(netconfig)) {
-		l_error("netconfig: Failed to install IPv4 routes.");
-		return;
-	}
-
 	netconfig_set_dns(netconfig);
 	netconfig_set_domains(netconfig);
 }
 
+/*
+ * The routes are queued right behind the address instead of from its ACK.
+ * l_netlink hands everything queued in one go to the kernel as a single
+ * batch, which rtnetlink processes in order, so the address is in place
+ * by the time the routes referencing it are looked at and the whole setup
+ * takes one round trip.
+ */
+static void netconfig_ipv4_address_install(struct netconfig *netconfig)
+{
+	L_WARN_ON(!l_rtnl_ifaddr_add(rtnl, netconfig->ifindex,
+					netconfig->v4_address,
+					netconfig_ipv4_ifaddr_add_cmd_cb,
+					netconfig, NULL));
+
+	if (!netconfig_ipv4_routes_install(netconfig))
+		l_error("netconfig: Failed to install IPv4 routes.");
+}
+
 static void netconfig_ipv6_ifaddr_add_cmd_cb(int error, uint16_t type,
 						const void *data, uint32_t len,
 						void *user_data)
 {
 	struct netconfig *netconfig = user_data;
-	struct l_rtnl_route *gateway;
 
 	if (error && error != -EEXIST) {
 		l_error("netconfig: Failed to add IPv6 address. "
@@ -708,15 +807,6 @@ static void netconfig_ipv6_ifaddr_add_cmd_cb(int error, uint16_t type,
 		return;
 	}
 
-	gateway = netconfig_get_static6_gateway(netconfig);
-	if (gateway) {
-		L_WARN_ON(!l_rtnl_route_add(rtnl, netconfig->ifindex,
-						gateway,
-						netconfig_route_generic_cb,
-						netconfig, NULL));
-		l_rtnl_route_free(gateway);
-	}
-
 	netconfig_set_dns(netconfig);
 	netconfig_set_domains(netconfig);
 }
@@ -741,6 +831,113 @@ static void netconfig_ifaddr_del_cmd_cb(int error, uint16_t type,
 				"Error %d: %s", error, strerror(-error));
 }
 
+/*
+ * Remember the DHCPACK received on each network, along with the router's
+ * MAC address, so that a reconnection can confirm the lease using
+ * Detecting Network Attachment (RFC 4436) or INIT-REBOOT instead of going
+ * through DISCOVER.  Times are stored as wall-clock time since the cache
+ * outlives reboots.
+ */
+static void netconfig_dhcp_lease_save(struct netconfig *netconfig)
+{
+	const struct l_dhcp_lease *lease =
+			l_dhcp_client_get_lease(netconfig->dhcp_client);
+	const uint8_t *router_mac =
+			l_dhcp_client_get_router_mac(netconfig->dhcp_client);
+	const void *ack;
+	size_t ack_len;
+	L_AUTO_FREE_VAR(char *, ack_hex) = NULL;
+	L_AUTO_FREE_VAR(char *, old_hex) = NULL;
+	uint64_t now = time(NULL);
+
+	if (!netconfig->network_id || !lease)
+		return;
+
+	ack = l_dhcp_client_get_ack(netconfig->dhcp_client, &ack_len);
+	if (!ack)
+		return;
+
+	if (!dhcp_leases)
+		dhcp_leases = l_settings_new();
+
+	ack_hex = l_util_hexstring(ack, ack_len);
+	old_hex = l_settings_get_string(dhcp_leases, netconfig->network_id,
+					"Ack");
+
+	/* A lease reused through DNA keeps its original times */
+	if (!old_hex || strcmp(old_hex, ack_hex)) {
+		l_settings_set_string(dhcp_leases, netconfig->network_id,
+					"Ack", ack_hex);
+		l_settings_set_uint64(dhcp_leases, netconfig->network_id,
+					"Obtained", now);
+		l_settings_set_uint64(dhcp_leases, netconfig->network_id,
+					"Expires", now +
+					l_dhcp_lease_get_lifetime(lease));
+	}
+
+	if (router_mac)
+		l_settings_set_string(dhcp_leases, netconfig->network_id,
+					"RouterMAC",
+					util_address_to_string(router_mac));
+	else
+		l_settings_remove_key(dhcp_leases, netconfig->network_id,
+					"RouterMAC");
+
+	storage_dhcp_leases_sync(dhcp_leases);
+}
+
+static void netconfig_dhcp_lease_forget(const char *network_id)
+{
+	if (!dhcp_leases || !network_id)
+		return;
+
+	if (l_settings_remove_group(dhcp_leases, network_id))
+		storage_dhcp_leases_sync(dhcp_leases);
+}
+
+static void netconfig_dhcp_lease_restore(struct netconfig *netconfig)
+{
+	L_AUTO_FREE_VAR(char *, ack_hex) = NULL;
+	L_AUTO_FREE_VAR(char *, mac_str) = NULL;
+	L_AUTO_FREE_VAR(uint8_t *, ack) = NULL;
+	size_t ack_len;
+	uint64_t obtained;
+	uint64_t now = time(NULL);
+	uint8_t router_mac[6];
+	bool have_mac;
+
+	if (!dhcp_leases || !netconfig->network_id)
+		return;
+
+	ack_hex = l_settings_get_string(dhcp_leases, netconfig->network_id,
+					"Ack");
+	if (!ack_hex || !l_settings_get_uint64(dhcp_leases,
+						netconfig->network_id,
+						"Obtained", &obtained) ||
+			obtained > now)
+		goto forget;
+
+	ack = l_util_from_hexstring(ack_hex, &ack_len);
+	if (!ack)
+		goto forget;
+
+	mac_str = l_settings_get_string(dhcp_leases, netconfig->network_id,
+					"RouterMAC");
+	have_mac = mac_str && util_string_to_address(mac_str, router_mac);
+
+	if (!l_dhcp_client_set_cached_lease(netconfig->dhcp_client,
+						ack, ack_len, now - obtained,
+						have_mac ? router_mac : NULL))
+		goto forget;
+
+	l_debug("Reusing the cached lease%s",
+		have_mac ? ", checking router reachability" : "");
+	return;
+
+forget:
+	netconfig_dhcp_lease_forget(netconfig->network_id);
+}
+
 static void netconfig_ipv4_dhcp_event_handler(struct l_dhcp_client *client,
 						enum l_dhcp_client_event event,
 						void *userdata)
@@ -765,12 +962,11 @@ static void netconfig_ipv4_dhcp_event_handler(struct l_dhcp_client *client,
 			return;
 		}
 
-		L_WARN_ON(!l_rtnl_ifaddr_add(rtnl, netconfig->ifindex,
-					netconfig->v4_address,
-					netconfig_ipv4_ifaddr_add_cmd_cb,
-					netconfig, NULL));
+		netconfig_ipv4_address_install(netconfig);
+		netconfig_dhcp_lease_save(netconfig);
 		break;
 	case L_DHCP_CLIENT_EVENT_LEASE_RENEWED:
+		netconfig_dhcp_lease_save(netconfig);
 		break;
 	case L_DHCP_CLIENT_EVENT_LEASE_EXPIRED:
 		L_WARN_ON(!l_rtnl_ifaddr_delete(rtnl, netconfig->ifindex,
@@ -782,6 +978,8 @@ static void netconfig_ipv4_dhcp_event_handler(struct l_dhcp_client *client,
 
 		/* Fall through. */
 	case L_DHCP_CLIENT_EVENT_NO_LEASE:
+		netconfig_dhcp_lease_forget(netconfig->network_id);
+
 		/*
 		 * The requested address is no longer available, try to restart
 		 * the client.
@@ -804,8 +1002,12 @@ static void netconfig_dhcp6_event_handler(struct l_dhcp6_client *client,
 	struct netconfig *netconfig = userdata;
 
 	switch (event) {
-	case L_DHCP6_CLIENT_EVENT_IP_CHANGED:
 	case L_DHCP6_CLIENT_EVENT_LEASE_OBTAINED:
+		netconfig_set_dns(netconfig);
+		netconfig_set_domains(netconfig);
+		netconfig_family_ready(netconfig, AF_INET6);
+		break;
+	case L_DHCP6_CLIENT_EVENT_IP_CHANGED:
 	case L_DHCP6_CLIENT_EVENT_LEASE_RENEWED:
 		netconfig_set_dns(netconfig);
 		netconfig_set_domains(netconfig);
@@ -840,6 +1042,10 @@ static void netconfig_reset_v4(struct netconfig *netconfig)
 		l_strfreev(netconfig->dns4_overrides);
 		netconfig->dns4_overrides = NULL;
 
+		/* The router's MAC may have been learned since the ACK */
+		if (netconfig->rtm_protocol == RTPROT_DHCP)
+			netconfig_dhcp_lease_save(netconfig);
+
 		l_dhcp_client_stop(netconfig->dhcp_client);
 		netconfig->rtm_protocol = 0;
 	}
@@ -851,10 +1057,7 @@ static void netconfig_ipv4_acd_event(enum l_acd_event event, void *user_data)
 
 	switch (event) {
 	case L_ACD_EVENT_AVAILABLE:
-		L_WARN_ON(!l_rtnl_ifaddr_add(rtnl, netconfig->ifindex,
-					netconfig->v4_address,
-					netconfig_ipv4_ifaddr_add_cmd_cb,
-					netconfig, NULL));
+		netconfig_ipv4_address_install(netconfig);
 		return;
 	case L_ACD_EVENT_CONFLICT:
 		/*
@@ -899,10 +1102,7 @@ static void netconfig_ipv4_select_and_install(struct netconfig *netconfig)
 			l_acd_destroy(netconfig->acd);
 			netconfig->acd = NULL;
 
-			L_WARN_ON(!l_rtnl_ifaddr_add(rtnl, netconfig->ifindex,
-					netconfig->v4_address,
-					netconfig_ipv4_ifaddr_add_cmd_cb,
-					netconfig, NULL));
+			netconfig_ipv4_address_install(netconfig);
 		}
 
 		return;
@@ -910,8 +1110,30 @@ static void netconfig_ipv4_select_and_install(struct netconfig *netconfig)
 
 	netconfig->rtm_protocol = RTPROT_DHCP;
 
-	if (l_dhcp_client_start(netconfig->dhcp_client))
-		return;
+	/*
+	 * Without DHCPRELEASE the server keeps our lease reserved until it
+	 * expires or we come back.
+	 */
+	l_dhcp_client_set_release_on_stop(netconfig->dhcp_client,
+						!netconfig->network_id);
+
+	if (netconfig->fils_dhcp_ack) {
+		bool started = l_dhcp_client_start_with_ack(
+						netconfig->dhcp_client,
+						netconfig->fils_dhcp_ack,
+						netconfig->fils_dhcp_ack_len);
+
+		l_free(l_steal_ptr(netconfig->fils_dhcp_ack));
+		netconfig->fils_dhcp_ack_len = 0;
+
+		if (started)
+			return;
+	} else {
+		netconfig_dhcp_lease_restore(netconfig);
+
+		if (l_dhcp_client_start(netconfig->dhcp_client))
+			return;
+	}
 
 	l_error("netconfig: Failed to start DHCPv4 client for interface %u",
 							netconfig->ifindex);
@@ -919,8 +1141,8 @@ static void netconfig_ipv4_select_and_install(struct netconfig *netconfig)
 
 static void netconfig_ipv6_select_and_install(struct netconfig *netconfig)
 {
-	struct netdev *netdev = netdev_find(netconfig->ifindex);
 	struct l_rtnl_address *address;
+	struct l_rtnl_route *gateway;
 	bool enabled;
 
 	if (!l_settings_get_bool(netconfig->active_settings, "IPv6",
@@ -932,7 +1154,7 @@ static void netconfig_ipv6_select_and_install(struct netconfig *netconfig)
 		return;
 	}
 
-	sysfs_write_ipv6_setting(netdev_get_name(netdev), "disable_ipv6", "0");
+	netconfig_ipv6_set_enabled(netconfig, true);
 
 	address = netconfig_get_static6_address(netconfig);
 	if (address) {
@@ -941,6 +1163,19 @@ static void netconfig_ipv6_select_and_install(struct netconfig *netconfig)
 					netconfig_ipv6_ifaddr_add_cmd_cb,
 					netconfig, NULL));
 		l_rtnl_address_free(address);
+
+		/* Queued right behind the address, as for IPv4 */
+		gateway = netconfig_get_static6_gateway(netconfig);
+		if (gateway) {
+			netconfig->route6_add_gateway_cmd_id =
+				l_rtnl_route_add(rtnl, netconfig->ifindex,
+						gateway,
+						netconfig_route6_add_cmd_cb,
+						netconfig, NULL);
+			L_WARN_ON(!netconfig->route6_add_gateway_cmd_id);
+			l_rtnl_route_free(gateway);
+		}
+
 		return;
 	}
 
@@ -1034,6 +1269,47 @@ bool netconfig_configure(struct netconfig *netconfig,
 	return true;
 }
 
+/*
+ * Identify the network being configured, e.g. by its profile path, so that
+ * the DHCP lease can be reused on later connections to the same network.
+ * Must be called before netconfig_configure.
+ */
+void netconfig_set_network_id(struct netconfig *netconfig, const char *id)
+{
+	l_free(netconfig->network_id);
+	netconfig->network_id = l_strdup(id);
+}
+
+/*
+ * Build the DHCPDISCOVER sent in the FILS HLP container of the Association
+ * Request.  Returns NULL if the network is configured statically.
+ */
+void *netconfig_build_fils_dhcp_discover(struct netconfig *netconfig,
+					const struct l_settings *active_settings,
+					const uint8_t *mac_address,
+					size_t *out_len)
+{
+	if (l_settings_has_key(active_settings, "IPv4", "Address"))
+		return NULL;
+
+	l_dhcp_client_set_address(netconfig->dhcp_client, ARPHRD_ETHER,
+							mac_address, ETH_ALEN);
+
+	return l_dhcp_client_build_discover(netconfig->dhcp_client, out_len);
+}
+
+/*
+ * Hand over the DHCPACK received in the FILS HLP container, the lease will
+ * be applied by the following netconfig_configure call.
+ */
+void netconfig_set_fils_dhcp_ack(struct netconfig *netconfig,
+					const uint8_t *ack, size_t len)
+{
+	l_free(netconfig->fils_dhcp_ack);
+	netconfig->fils_dhcp_ack = ack ? l_memdup(ack, len) : NULL;
+	netconfig->fils_dhcp_ack_len = ack ? len : 0;
+}
+
 bool netconfig_reconfigure(struct netconfig *netconfig)
 {
 	if (netconfig->rtm_protocol == RTPROT_DHCP) {
@@ -1049,18 +1325,24 @@ bool netconfig_reconfigure(struct netconfig *netconfig)
 
 bool netconfig_reset(struct netconfig *netconfig)
 {
-	struct netdev *netdev = netdev_find(netconfig->ifindex);
-
 	if (netconfig->route4_add_gateway_cmd_id) {
 		l_netlink_cancel(rtnl, netconfig->route4_add_gateway_cmd_id);
 		netconfig->route4_add_gateway_cmd_id = 0;
 	}
 
+	if (netconfig->route6_add_gateway_cmd_id) {
+		l_netlink_cancel(rtnl, netconfig->route6_add_gateway_cmd_id);
+		netconfig->route6_add_gateway_cmd_id = 0;
+	}
+
 	if (netconfig->rtm_protocol || netconfig->rtm_v6_protocol)
 		resolve_revert(netconfig->resolve);
 
 	netconfig_reset_v4(netconfig);
 
+	l_free(l_steal_ptr(netconfig->fils_dhcp_ack));
+	netconfig->fils_dhcp_ack_len = 0;
+
 	if (netconfig->rtm_v6_protocol) {
 		l_strfreev(netconfig->dns6_overrides);
 		netconfig->dns6_overrides = NULL;
@@ -1068,8 +1350,7 @@ bool netconfig_reset(struct netconfig *netconfig)
 		l_dhcp6_client_stop(netconfig->dhcp6_client);
 		netconfig->rtm_v6_protocol = 0;
 
-		sysfs_write_ipv6_setting(netdev_get_name(netdev),
-						"disable_ipv6", "1");
+		netconfig_ipv6_set_enabled(netconfig, false);
 	}
 
 	return true;
@@ -1112,6 +1393,7 @@ struct netconfig *netconfig_new(uint32_t ifindex)
 	l_dhcp_client_set_event_handler(netconfig->dhcp_client,
 					netconfig_ipv4_dhcp_event_handler,
 					netconfig, NULL);
+	l_dhcp_client_set_rapid_commit(netconfig->dhcp_client, true);
 
 	if (getenv("IWD_DHCP_DEBUG"))
 		l_dhcp_client_set_debug(netconfig->dhcp_client, do_debug,
@@ -1136,7 +1418,7 @@ struct netconfig *netconfig_new(uint32_t ifindex)
 	l_queue_push_tail(netconfig_list, netconfig);
 
 	sysfs_write_ipv6_setting(netdev_get_name(netdev), "accept_ra", "0");
-	sysfs_write_ipv6_setting(netdev_get_name(netdev), "disable_ipv6", "1");
+	netconfig_ipv6_set_enabled(netconfig, false);
 
 	return netconfig;
 }
@@ -1155,6 +1437,50 @@ void netconfig_destroy(struct netconfig *netconfig)
 	netconfig_free(netconfig);
 }
 
+static void netconfig_known_network_changed(enum known_networks_event event,
+					const struct network_info *info,
+					void *user_data)
+{
+	char *file_path;
+
+	if (event != KNOWN_NETWORKS_EVENT_REMOVED)
+		return;
+
+	file_path = info->ops->get_file_path(info);
+	netconfig_dhcp_lease_forget(file_path);
+	l_free(file_path);
+}
+
+static void netconfig_dhcp_leases_load(void)
+{
+	uint64_t now = time(NULL);
+	char **groups;
+	unsigned int i;
+	bool changed = false;
+
+	dhcp_leases = storage_dhcp_leases_load();
+	if (!dhcp_leases)
+		return;
+
+	groups = l_settings_get_groups(dhcp_leases);
+
+	for (i = 0; groups[i]; i++) {
+		uint64_t expires;
+
+		if (l_settings_get_uint64(dhcp_leases, groups[i], "Expires",
+						&expires) && expires > now)
+			continue;
+
+		l_settings_remove_group(dhcp_leases, groups[i]);
+		changed = true;
+	}
+
+	l_strfreev(groups);
+
+	if (changed)
+		storage_dhcp_leases_sync(dhcp_leases);
+}
+
 static int netconfig_init(void)
 {
 	uint32_t r;
@@ -1206,6 +1532,11 @@ static int netconfig_init(void)
 
 	netconfig_list = l_queue_new();
 
+	netconfig_dhcp_leases_load();
+	known_networks_watch = known_networks_watch_add(
+					netconfig_known_network_changed,
+					NULL, NULL);
+
 	return 0;
 
 error:
@@ -1222,6 +1553,13 @@ static void netconfig_exit(void)
 	rtnl = NULL;
 
 	l_queue_destroy(netconfig_list, netconfig_free);
+
+	known_networks_watch_remove(known_networks_watch);
+	known_networks_watch = 0;
+
+	l_settings_free(dhcp_leases);
+	dhcp_leases = NULL;
 }
 
 IWD_MODULE(netconfig, netconfig_init, netconfig_exit)
+IWD_MODULE_DEPENDS(netconfig, known_networks)
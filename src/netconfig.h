@@ -34,6 +34,13 @@ bool netconfig_configure(struct netconfig *netconfig,
 				const uint8_t *mac_address,
 				netconfig_notify_func_t notify,
 				void *user_data);
+void netconfig_set_network_id(struct netconfig *netconfig, const char *id);
+void *netconfig_build_fils_dhcp_discover(struct netconfig *netconfig,
+					const struct l_settings *active_settings,
+					const uint8_t *mac_address,
+					size_t *out_len);
+void netconfig_set_fils_dhcp_ack(struct netconfig *netconfig,
+					const uint8_t *ack, size_t len);
 bool netconfig_reconfigure(struct netconfig *netconfig);
 bool netconfig_reset(struct netconfig *netconfig);
 char *netconfig_get_dhcp_server_ipv4(struct netconfig *netconfig);
@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <alloca.h>
 #include <stdio.h>
@@ -39,6 +40,7 @@
 
 #include <ell/ell.h>
 
+#include "ell/useful.h"
 #include "linux/nl80211.h"
 
 #include "src/iwd.h"
@@ -62,6 +64,8 @@
 #include "src/auth-proto.h"
 #include "src/frame-xchg.h"
 #include "src/diagnostic.h"
+#include "src/trace.h"
+#include "src/metrics.h"
 
 #ifndef ENOTSUPP
 #define ENOTSUPP 524
@@ -76,6 +80,7 @@ enum connection_type {
 };
 
 static uint32_t unicast_watch;
+static uint32_t overrun_watch;
 
 struct netdev_handshake_state {
 	struct handshake_state super;
@@ -98,10 +103,16 @@ struct netdev_ft_over_ds_info {
 	struct l_timeout *timeout;
 	netdev_ft_over_ds_cb_t cb;
 	void *user_data;
+	uint64_t expiry;
 
 	bool parsed : 1;
 };
 
+/* FT-over-DS exchanges done ahead of a roam, kept per target AP */
+#define NETDEV_FT_DS_MAX		3
+/* Used unless the AP sets a shorter Reassociation Deadline, in usecs */
+#define NETDEV_FT_DS_LIFETIME		(10 * L_USEC_PER_SEC)
+
 struct netdev {
 	uint32_t index;
 	uint64_t wdev_id;
@@ -143,8 +154,19 @@ struct netdev {
 	uint8_t rssi_levels_num;
 	uint8_t cur_rssi_level_idx;
 	int8_t cur_rssi;
+	int8_t low_signal_threshold;	/* RoamThreshold unless overridden */
+	/* CQM state not yet reported, see netdev_cqm_report() */
+	uint8_t cqm_pending_level_idx;
+	uint64_t cqm_event_time;
+	struct l_timeout *cqm_coalesce_timeout;
 	struct l_timeout *rssi_poll_timeout;
 	uint32_t rssi_poll_cmd_id;
+	/* GET_STATION checking the link after a netlink overrun */
+	uint32_t resync_cmd_id;
+	unsigned int rssi_poll_interval;
+	/* Last GET_STATION results for the connected BSS */
+	struct diagnostic_station_info sta_info;
+	uint64_t sta_info_time;
 	uint8_t set_mac_once[6];
 
 	struct scan_bss *fw_roam_bss;
@@ -155,6 +177,7 @@ struct netdev {
 	netdev_destroy_func_t set_powered_destroy;
 
 	uint32_t get_station_cmd_id;
+	struct l_idle *get_station_idle;
 	netdev_get_station_cb_t get_station_cb;
 	void *get_station_data;
 	netdev_destroy_func_t get_station_destroy;
@@ -169,7 +192,7 @@ struct netdev {
 	struct l_genl_msg *auth_cmd;
 	struct wiphy_radio_work_item work;
 
-	struct netdev_ft_over_ds_info *ft_ds_info;
+	struct l_queue *ft_ds_list;
 
 	bool connected : 1;
 	bool associated : 1;
@@ -178,6 +201,7 @@ struct netdev {
 	bool pae_over_nl80211 : 1;
 	bool in_ft : 1;
 	bool cur_rssi_low : 1;
+	bool cqm_pending_low : 1;
 	bool use_4addr : 1;
 	bool ignore_connect_event : 1;
 	bool expect_connect_failure : 1;
@@ -200,10 +224,31 @@ struct netdev_watch {
 
 static struct l_netlink *rtnl = NULL;
 static struct l_genl_family *nl80211;
+/* Key installation commands, see iwd_get_control_genl() */
+static struct l_genl_family *nl80211_keys;
 static struct l_queue *netdev_list;
 static struct watchlist netdev_watches;
 static bool pae_over_nl80211;
 static bool mac_per_ssid;
+static uint64_t station_info_max_age;
+static uint64_t cqm_coalesce_interval;
+static uint32_t cqm_rssi_hyst;
+static bool pipeline_key_setting;
+/* Last freed handshake, recycled by the next netdev_handshake_state_new */
+static struct netdev_handshake_state *spare_handshake;
+
+METRICS_COUNTER_LABEL(connect_errors, "iwd_nl80211_errors_total",
+		"command=\"connect\"", NULL)
+METRICS_COUNTER_LABEL(authenticate_errors, "iwd_nl80211_errors_total",
+		"command=\"authenticate\"", NULL)
+METRICS_COUNTER_LABEL(associate_errors, "iwd_nl80211_errors_total",
+		"command=\"associate\"", NULL)
+METRICS_COUNTER_LABEL(new_key_errors, "iwd_nl80211_errors_total",
+		"command=\"new_key\"", NULL)
+METRICS_COUNTER_LABEL(set_station_errors, "iwd_nl80211_errors_total",
+		"command=\"set_station\"", NULL)
+METRICS_COUNTER_LABEL(control_port_errors, "iwd_nl80211_errors_total",
+		"command=\"control_port_frame\"", NULL)
 
 const char *netdev_iftype_to_string(uint32_t iftype)
 {
@@ -261,12 +306,12 @@ static void netdev_handshake_state_cancel_rekey(
 					struct netdev_handshake_state *nhs)
 {
 	if (nhs->group_new_key_cmd_id) {
-		l_genl_family_cancel(nl80211, nhs->group_new_key_cmd_id);
+		l_genl_family_cancel(nl80211_keys, nhs->group_new_key_cmd_id);
 		nhs->group_new_key_cmd_id = 0;
 	}
 
 	if (nhs->group_management_new_key_cmd_id) {
-		l_genl_family_cancel(nl80211,
+		l_genl_family_cancel(nl80211_keys,
 					nhs->group_management_new_key_cmd_id);
 		nhs->group_management_new_key_cmd_id = 0;
 	}
@@ -276,19 +321,19 @@ static void netdev_handshake_state_cancel_all(
 					struct netdev_handshake_state *nhs)
 {
 	if (nhs->pairwise_new_key_cmd_id) {
-		l_genl_family_cancel(nl80211, nhs->pairwise_new_key_cmd_id);
+		l_genl_family_cancel(nl80211_keys, nhs->pairwise_new_key_cmd_id);
 		nhs->pairwise_new_key_cmd_id = 0;
 	}
 
 	netdev_handshake_state_cancel_rekey(nhs);
 
 	if (nhs->set_station_cmd_id) {
-		l_genl_family_cancel(nl80211, nhs->set_station_cmd_id);
+		l_genl_family_cancel(nl80211_keys, nhs->set_station_cmd_id);
 		nhs->set_station_cmd_id = 0;
 	}
 
 	if (nhs->set_pmk_cmd_id) {
-		l_genl_family_cancel(nl80211, nhs->set_pmk_cmd_id);
+		l_genl_family_cancel(nl80211_keys, nhs->set_pmk_cmd_id);
 		nhs->set_pmk_cmd_id = 0;
 	}
 }
@@ -299,6 +344,18 @@ static void netdev_handshake_state_free(struct handshake_state *hs)
 		l_container_of(hs, struct netdev_handshake_state, super);
 
 	netdev_handshake_state_cancel_all(nhs);
+
+	/*
+	 * Every connect and roam attempt sets up a new handshake while the
+	 * old one is still in use, so keep one around to avoid a malloc/free
+	 * cycle of this fairly large structure each time.
+	 */
+	if (!spare_handshake && netdev_list) {
+		explicit_bzero(nhs, sizeof(*nhs));
+		spare_handshake = nhs;
+		return;
+	}
+
 	l_free(nhs);
 }
 
@@ -306,7 +363,10 @@ struct handshake_state *netdev_handshake_state_new(struct netdev *netdev)
 {
 	struct netdev_handshake_state *nhs;
 
-	nhs = l_new(struct netdev_handshake_state, 1);
+	if (spare_handshake)
+		nhs = l_steal_ptr(spare_handshake);
+	else
+		nhs = l_new(struct netdev_handshake_state, 1);
 
 	nhs->super.ifindex = netdev->index;
 	nhs->super.free = netdev_handshake_state_free;
@@ -500,6 +560,58 @@ static bool netdev_parse_bitrate(struct l_genl_attr *attr,
 	return true;
 }
 
+static bool netdev_parse_tid_stats(struct l_genl_attr *attr,
+					struct diagnostic_station_info *info)
+{
+	/* 802.1D user priority to access category */
+	static const enum diagnostic_ac tid_to_ac[8] = {
+		DIAGNOSTIC_AC_BE, DIAGNOSTIC_AC_BK,
+		DIAGNOSTIC_AC_BK, DIAGNOSTIC_AC_BE,
+		DIAGNOSTIC_AC_VI, DIAGNOSTIC_AC_VI,
+		DIAGNOSTIC_AC_VO, DIAGNOSTIC_AC_VO,
+	};
+	uint16_t type, len;
+	const void *data;
+	struct l_genl_attr tid_attr;
+
+	/* Nested per TID + 1, with TID 16 holding the non-QoS frames */
+	while (l_genl_attr_next(attr, &type, NULL, NULL)) {
+		struct diagnostic_ac_stats *stats;
+
+		if (!type || type > 17)
+			continue;
+
+		if (!l_genl_attr_recurse(attr, &tid_attr))
+			return false;
+
+		stats = &info->ac_stats[type == 17 ? DIAGNOSTIC_AC_BE :
+						tid_to_ac[(type - 1) & 7]];
+
+		while (l_genl_attr_next(&tid_attr, &type, &len, &data)) {
+			if (len != 8)
+				continue;
+
+			switch (type) {
+			case NL80211_TID_STATS_RX_MSDU:
+				stats->rx_msdu += l_get_u64(data);
+				break;
+			case NL80211_TID_STATS_TX_MSDU:
+				stats->tx_msdu += l_get_u64(data);
+				break;
+			case NL80211_TID_STATS_TX_MSDU_RETRIES:
+				stats->tx_msdu_retries += l_get_u64(data);
+				break;
+			case NL80211_TID_STATS_TX_MSDU_FAILED:
+				stats->tx_msdu_failed += l_get_u64(data);
+				break;
+			}
+		}
+	}
+
+	info->have_ac_stats = true;
+	return true;
+}
+
 static bool netdev_parse_sta_info(struct l_genl_attr *attr,
 					struct diagnostic_station_info *info)
 {
@@ -565,57 +677,190 @@ static bool netdev_parse_sta_info(struct l_genl_attr *attr,
 			info->have_expected_throughput = true;
 
 			break;
+
+		case NL80211_STA_INFO_INACTIVE_TIME:
+			if (len != 4)
+				return false;
+
+			info->inactive_time = l_get_u32(data);
+			info->have_inactive_time = true;
+
+			break;
+
+		case NL80211_STA_INFO_CONNECTED_TIME:
+			if (len != 4)
+				return false;
+
+			info->connected_time = l_get_u32(data);
+			info->have_connected_time = true;
+
+			break;
+
+		case NL80211_STA_INFO_TX_RETRIES:
+			if (len != 4)
+				return false;
+
+			info->tx_retries = l_get_u32(data);
+			info->have_tx_retries = true;
+
+			break;
+
+		case NL80211_STA_INFO_TX_FAILED:
+			if (len != 4)
+				return false;
+
+			info->tx_failed = l_get_u32(data);
+			info->have_tx_failed = true;
+
+			break;
+
+		case NL80211_STA_INFO_RX_DROP_MISC:
+			if (len != 8)
+				return false;
+
+			info->rx_drop_misc = l_get_u64(data);
+			info->have_rx_drop_misc = true;
+
+			break;
+
+		case NL80211_STA_INFO_BEACON_LOSS:
+			if (len != 4)
+				return false;
+
+			info->beacon_loss = l_get_u32(data);
+			info->have_beacon_loss = true;
+
+			break;
+
+		case NL80211_STA_INFO_RX_DURATION:
+			if (len != 8)
+				return false;
+
+			info->rx_duration = l_get_u64(data);
+			info->have_rx_duration = true;
+
+			break;
+
+		case NL80211_STA_INFO_TX_DURATION:
+			if (len != 8)
+				return false;
+
+			info->tx_duration = l_get_u64(data);
+			info->have_tx_duration = true;
+
+			break;
+
+		case NL80211_STA_INFO_TID_STATS:
+			if (!l_genl_attr_recurse(attr, &nested))
+				return false;
+
+			if (!netdev_parse_tid_stats(&nested, info))
+				return false;
+
+			break;
 		}
 	}
 
 	return true;
 }
 
-static void netdev_set_rssi_level_idx(struct netdev *netdev)
+static uint8_t netdev_rssi_level_for(struct netdev *netdev, int rssi)
 {
-	uint8_t new_level;
+	uint8_t level;
 
-	for (new_level = 0; new_level < netdev->rssi_levels_num; new_level++)
-		if (netdev->cur_rssi >= netdev->rssi_levels[new_level])
+	for (level = 0; level < netdev->rssi_levels_num; level++)
+		if (rssi >= netdev->rssi_levels[level])
 			break;
 
-	netdev->cur_rssi_level_idx = new_level;
+	return level;
 }
 
-static void netdev_rssi_poll_cb(struct l_genl_msg *msg, void *user_data)
+static void netdev_set_rssi_level_idx(struct netdev *netdev)
 {
-	struct netdev *netdev = user_data;
-	struct l_genl_attr attr, nested;
-	uint16_t type, len;
-	const void *data;
-	bool found;
-	struct diagnostic_station_info info;
-	uint8_t prev_rssi_level_idx = netdev->cur_rssi_level_idx;
+	netdev->cur_rssi_level_idx = netdev_rssi_level_for(netdev,
+							netdev->cur_rssi);
+}
 
-	netdev->rssi_poll_cmd_id = 0;
+#define RSSI_POLL_MIN_INTERVAL		1
+#define RSSI_POLL_DEFAULT_INTERVAL	6
+#define RSSI_POLL_MAX_INTERVAL		30
+/* Polled RSSI changes within this many dB are considered noise */
+#define RSSI_POLL_HYSTERESIS		2
 
-	if (!l_genl_attr_init(&attr, msg))
-		goto done;
+/*
+ * Unlike CQM, which the kernel applies a hysteresis to, a polled RSSI
+ * hovering around one of the thresholds would flip the level on every
+ * poll.  Only move to a new level once the RSSI is well past the boundary.
+ */
+static void netdev_poll_rssi_level(struct netdev *netdev)
+{
+	uint8_t prev = netdev->cur_rssi_level_idx;
+	uint8_t level = netdev_rssi_level_for(netdev, netdev->cur_rssi);
 
-	found = false;
-	while (l_genl_attr_next(&attr, &type, &len, &data)) {
-		if (type != NL80211_ATTR_STA_INFO)
-			continue;
+	if (level < prev)
+		level = netdev_rssi_level_for(netdev,
+				netdev->cur_rssi - RSSI_POLL_HYSTERESIS);
+	else if (level > prev)
+		level = netdev_rssi_level_for(netdev,
+				netdev->cur_rssi + RSSI_POLL_HYSTERESIS);
 
-		if (!l_genl_attr_recurse(&attr, &nested))
-			goto done;
+	if (level == prev)
+		return;
 
-		if (!netdev_parse_sta_info(&nested, &info))
-			goto done;
+	netdev->cur_rssi_level_idx = level;
+	netdev->cqm_pending_level_idx = level;
 
-		found = true;
-		break;
-	}
+	if (netdev->event_filter)
+		netdev->event_filter(netdev, NETDEV_EVENT_RSSI_LEVEL_NOTIFY,
+					&netdev->cur_rssi_level_idx,
+					netdev->user_data);
+}
 
-	if (!found || !info.have_cur_rssi)
-		goto done;
+static bool netdev_rssi_near_level(struct netdev *netdev)
+{
+	uint8_t i;
+
+	for (i = 0; i < netdev->rssi_levels_num; i++)
+		if (abs(netdev->cur_rssi - netdev->rssi_levels[i]) <=
+				RSSI_POLL_HYSTERESIS * 2)
+			return true;
 
-	netdev->cur_rssi = info.cur_rssi;
+	return false;
+}
+
+static bool netdev_sta_info_is_fresh(struct netdev *netdev,
+					const uint8_t *addr)
+{
+	if (!netdev->sta_info_time || !station_info_max_age)
+		return false;
+
+	if (memcmp(netdev->sta_info.addr, addr, ETH_ALEN))
+		return false;
+
+	return l_time_diff(netdev->sta_info_time, l_time_now()) <
+							station_info_max_age;
+}
+
+/*
+ * Whoever fetched information on the connected BSS, RSSI polling or a
+ * D-Bus diagnostics request, the other gets to reuse it for a while.
+ */
+static void netdev_sta_info_update(struct netdev *netdev,
+				const struct diagnostic_station_info *info)
+{
+	int8_t prev_rssi = netdev->cur_rssi;
+
+	if (!netdev->connected || !netdev->handshake ||
+			memcmp(info->addr, netdev->handshake->aa, ETH_ALEN))
+		return;
+
+	netdev->sta_info = *info;
+	netdev->sta_info_time = l_time_now();
+
+	if (!info->have_cur_rssi)
+		return;
+
+	netdev->cur_rssi = info->cur_rssi;
 
 	/*
 	 * Note we don't have to handle LOW_SIGNAL_THRESHOLD here.  The
@@ -623,15 +868,74 @@ static void netdev_rssi_poll_cb(struct l_genl_msg *msg, void *user_data)
 	 * kernel driver doesn't support multiple thresholds.  So the
 	 * polling only handles the client-supplied threshold list.
 	 */
-	netdev_set_rssi_level_idx(netdev);
-	if (netdev->cur_rssi_level_idx != prev_rssi_level_idx)
-		netdev->event_filter(netdev, NETDEV_EVENT_RSSI_LEVEL_NOTIFY,
-					&netdev->cur_rssi_level_idx,
-					netdev->user_data);
+	if (!netdev->rssi_poll_timeout)
+		return;
+
+	netdev_poll_rssi_level(netdev);
+
+	/*
+	 * Poll quickly close to a threshold, back off while the RSSI stays
+	 * put and return to the default interval once it moves again.
+	 */
+	if (netdev_rssi_near_level(netdev))
+		netdev->rssi_poll_interval = RSSI_POLL_MIN_INTERVAL;
+	else if (abs(netdev->cur_rssi - prev_rssi) <= RSSI_POLL_HYSTERESIS)
+		netdev->rssi_poll_interval = minsize(
+					netdev->rssi_poll_interval * 2,
+					RSSI_POLL_MAX_INTERVAL);
+	else
+		netdev->rssi_poll_interval = RSSI_POLL_DEFAULT_INTERVAL;
+}
+
+static bool netdev_parse_get_station(struct l_genl_msg *msg,
+					struct diagnostic_station_info *info)
+{
+	struct l_genl_attr attr, nested;
+	uint16_t type, len;
+	const void *data;
+
+	if (!l_genl_attr_init(&attr, msg))
+		return false;
+
+	memset(info, 0, sizeof(*info));
+
+	while (l_genl_attr_next(&attr, &type, &len, &data)) {
+		switch (type) {
+		case NL80211_ATTR_STA_INFO:
+			if (!l_genl_attr_recurse(&attr, &nested))
+				return false;
+
+			if (!netdev_parse_sta_info(&nested, info))
+				return false;
+
+			break;
+
+		case NL80211_ATTR_MAC:
+			if (len != 6)
+				return false;
+
+			memcpy(info->addr, data, 6);
+
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void netdev_rssi_poll_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct netdev *netdev = user_data;
+	struct diagnostic_station_info info;
+
+	netdev->rssi_poll_cmd_id = 0;
+
+	if (netdev_parse_get_station(msg, &info))
+		netdev_sta_info_update(netdev, &info);
 
-done:
 	/* Rearm timer */
-	l_timeout_modify(netdev->rssi_poll_timeout, 6);
+	l_timeout_modify(netdev->rssi_poll_timeout,
+				netdev->rssi_poll_interval);
 }
 
 static void netdev_rssi_poll(struct l_timeout *timeout, void *user_data)
@@ -639,6 +943,13 @@ static void netdev_rssi_poll(struct l_timeout *timeout, void *user_data)
 	struct netdev *netdev = user_data;
 	struct l_genl_msg *msg;
 
+	/* Recently fetched for diagnostics, already accounted for */
+	if (netdev_sta_info_is_fresh(netdev, netdev->handshake->aa)) {
+		l_timeout_modify(netdev->rssi_poll_timeout,
+					netdev->rssi_poll_interval);
+		return;
+	}
+
 	msg = l_genl_msg_new_sized(NL80211_CMD_GET_STATION, 64);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &netdev->index);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_MAC, ETH_ALEN,
@@ -660,8 +971,11 @@ static void netdev_rssi_polling_update(struct netdev *netdev)
 		if (netdev->rssi_poll_timeout)
 			return;
 
+		netdev->rssi_poll_interval = RSSI_POLL_DEFAULT_INTERVAL;
 		netdev->rssi_poll_timeout =
-			l_timeout_create(1, netdev_rssi_poll, netdev, NULL);
+			l_timeout_create(RSSI_POLL_MIN_INTERVAL,
+						netdev_rssi_poll, netdev, NULL);
+		l_timeout_set_slack(netdev->rssi_poll_timeout, 250);
 	} else {
 		if (!netdev->rssi_poll_timeout)
 			return;
@@ -687,6 +1001,19 @@ static void netdev_preauth_destroy(void *data)
 	l_free(state);
 }
 
+static void netdev_ft_ds_info_destroy(void *data)
+{
+	struct netdev_ft_over_ds_info *info = data;
+
+	ft_ds_info_free(&info->super);
+}
+
+static void netdev_ft_ds_list_flush(struct netdev *netdev)
+{
+	l_queue_destroy(netdev->ft_ds_list, netdev_ft_ds_info_destroy);
+	netdev->ft_ds_list = NULL;
+}
+
 static void netdev_connect_free(struct netdev *netdev)
 {
 	if (netdev->work.id)
@@ -738,6 +1065,16 @@ static void netdev_connect_free(struct netdev *netdev)
 	netdev->ignore_connect_event = false;
 	netdev->expect_connect_failure = false;
 	netdev->cur_rssi_low = false;
+	netdev->cqm_pending_low = false;
+	netdev->cqm_event_time = 0;
+	l_timeout_remove(netdev->cqm_coalesce_timeout);
+	netdev->cqm_coalesce_timeout = NULL;
+	netdev->sta_info_time = 0;
+
+	if (netdev->resync_cmd_id) {
+		l_genl_family_cancel(nl80211, netdev->resync_cmd_id);
+		netdev->resync_cmd_id = 0;
+	}
 
 	if (netdev->connect_cmd) {
 		l_genl_msg_unref(netdev->connect_cmd);
@@ -754,8 +1091,7 @@ static void netdev_connect_free(struct netdev *netdev)
 		netdev->disconnect_cmd_id = 0;
 	}
 
-	if (netdev->ft_ds_info)
-		ft_ds_info_free(&netdev->ft_ds_info->super);
+	netdev_ft_ds_list_flush(netdev);
 }
 
 static void netdev_connect_failed(struct netdev *netdev,
@@ -766,6 +1102,8 @@ static void netdev_connect_failed(struct netdev *netdev,
 	netdev_event_func_t event_filter = netdev->event_filter;
 	void *connect_data = netdev->user_data;
 
+	TRACE(netdev_connect_failed, netdev->index, result, status_or_reason);
+
 	/* Done this way to allow re-entrant netdev_connect calls */
 	netdev_connect_free(netdev);
 
@@ -846,6 +1184,11 @@ static void netdev_free(void *data)
 		netdev->get_station_cmd_id = 0;
 	}
 
+	if (netdev->get_station_idle) {
+		l_idle_remove(netdev->get_station_idle);
+		netdev->get_station_idle = NULL;
+	}
+
 	if (netdev->fw_roam_bss)
 		scan_bss_free(netdev->fw_roam_bss);
 
@@ -892,11 +1235,75 @@ struct netdev *netdev_find(int ifindex)
 /* Threshold RSSI for roaming to trigger, configurable in main.conf */
 static int LOW_SIGNAL_THRESHOLD;
 
+/*
+ * Tells the event filter about the CQM state changes since the last
+ * report, unless the state has flipped back in the meantime.
+ */
+static void netdev_cqm_flush(struct netdev *netdev)
+{
+	bool low_changed = netdev->cqm_pending_low != netdev->cur_rssi_low;
+	bool level_changed = netdev->cqm_pending_level_idx !=
+						netdev->cur_rssi_level_idx;
+
+	netdev->cur_rssi_low = netdev->cqm_pending_low;
+	netdev->cur_rssi_level_idx = netdev->cqm_pending_level_idx;
+
+	if ((!low_changed && !level_changed) || !netdev->event_filter)
+		return;
+
+	netdev->cqm_event_time = l_time_now();
+
+	if (low_changed)
+		netdev->event_filter(netdev, netdev->cur_rssi_low ?
+					NETDEV_EVENT_RSSI_THRESHOLD_LOW :
+					NETDEV_EVENT_RSSI_THRESHOLD_HIGH,
+					NULL, netdev->user_data);
+
+	if (level_changed && netdev->event_filter)
+		netdev->event_filter(netdev, NETDEV_EVENT_RSSI_LEVEL_NOTIFY,
+					&netdev->cur_rssi_level_idx,
+					netdev->user_data);
+}
+
+static void netdev_cqm_coalesce_timeout(struct l_timeout *timeout,
+					void *user_data)
+{
+	struct netdev *netdev = user_data;
+
+	l_timeout_remove(netdev->cqm_coalesce_timeout);
+	netdev->cqm_coalesce_timeout = NULL;
+
+	netdev_cqm_flush(netdev);
+}
+
+/*
+ * With fading some drivers send bursts of CQM events while the RSSI hovers
+ * around a threshold.  The first change is reported right away, the ones
+ * following it within [General].CQMEventCoalesceInterval are folded into a
+ * single report of the state at the end of that interval.
+ */
+static void netdev_cqm_report(struct netdev *netdev)
+{
+	uint64_t elapsed;
+
+	if (netdev->cqm_coalesce_timeout)
+		return;
+
+	elapsed = l_time_diff(netdev->cqm_event_time, l_time_now());
+
+	if (!netdev->cqm_event_time || elapsed >= cqm_coalesce_interval) {
+		netdev_cqm_flush(netdev);
+		return;
+	}
+
+	netdev->cqm_coalesce_timeout = l_timeout_create_ms(
+			(cqm_coalesce_interval - elapsed) / L_USEC_PER_MSEC + 1,
+			netdev_cqm_coalesce_timeout, netdev, NULL);
+}
+
 static void netdev_cqm_event_rssi_threshold(struct netdev *netdev,
 						uint32_t rssi_event)
 {
-	int event;
-
 	if (!netdev->operational)
 		return;
 
@@ -907,24 +1314,22 @@ static void netdev_cqm_event_rssi_threshold(struct netdev *netdev,
 	if (!netdev->event_filter)
 		return;
 
-	netdev->cur_rssi_low =
+	netdev->cqm_pending_low =
 		(rssi_event == NL80211_CQM_RSSI_THRESHOLD_EVENT_LOW);
-	event = netdev->cur_rssi_low ? NETDEV_EVENT_RSSI_THRESHOLD_LOW :
-		NETDEV_EVENT_RSSI_THRESHOLD_HIGH;
-
-	netdev->event_filter(netdev, event, NULL, netdev->user_data);
+	netdev_cqm_report(netdev);
 }
 
 static void netdev_rssi_level_init(struct netdev *netdev)
 {
 	if (netdev->connected && netdev->rssi_levels_num)
 		netdev_set_rssi_level_idx(netdev);
+
+	netdev->cqm_pending_level_idx = netdev->cur_rssi_level_idx;
 }
 
 static void netdev_cqm_event_rssi_value(struct netdev *netdev, int rssi_val)
 {
-	bool new_rssi_low;
-	uint8_t prev_rssi_level_idx = netdev->cur_rssi_level_idx;
+	int threshold = netdev->low_signal_threshold;
 
 	if (!netdev->connected)
 		return;
@@ -939,24 +1344,20 @@ static void netdev_cqm_event_rssi_value(struct netdev *netdev, int rssi_val)
 	if (!netdev->event_filter)
 		return;
 
-	new_rssi_low = rssi_val < LOW_SIGNAL_THRESHOLD;
-	if (netdev->cur_rssi_low != new_rssi_low) {
-		int event = new_rssi_low ?
-			NETDEV_EVENT_RSSI_THRESHOLD_LOW :
-			NETDEV_EVENT_RSSI_THRESHOLD_HIGH;
+	/*
+	 * The kernel only applies the hysteresis to threshold events, once
+	 * low require the RSSI to be clearly above the threshold again
+	 */
+	if (netdev->cqm_pending_low)
+		threshold += cqm_rssi_hyst;
 
-		netdev->cur_rssi_low = new_rssi_low;
-		netdev->event_filter(netdev, event, NULL, netdev->user_data);
-	}
+	netdev->cqm_pending_low = rssi_val < threshold;
 
-	if (!netdev->rssi_levels_num)
-		return;
+	if (netdev->rssi_levels_num)
+		netdev->cqm_pending_level_idx =
+			netdev_rssi_level_for(netdev, rssi_val);
 
-	netdev_set_rssi_level_idx(netdev);
-	if (netdev->cur_rssi_level_idx != prev_rssi_level_idx)
-		netdev->event_filter(netdev, NETDEV_EVENT_RSSI_LEVEL_NOTIFY,
-					&netdev->cur_rssi_level_idx,
-					netdev->user_data);
+	netdev_cqm_report(netdev);
 }
 
 static void netdev_cqm_event(struct l_genl_msg *msg, struct netdev *netdev)
@@ -1045,6 +1446,9 @@ static void netdev_rekey_offload_event(struct l_genl_msg *msg,
 	}
 }
 
+static void netdev_disconnected(struct netdev *netdev, uint16_t reason_code,
+				bool disconnect_by_ap);
+
 static void netdev_disconnect_event(struct l_genl_msg *msg,
 							struct netdev *netdev)
 {
@@ -1053,8 +1457,6 @@ static void netdev_disconnect_event(struct l_genl_msg *msg,
 	const void *data;
 	uint16_t reason_code = 0;
 	bool disconnect_by_ap = false;
-	netdev_event_func_t event_filter;
-	void *event_data;
 
 	l_debug("");
 
@@ -1086,6 +1488,15 @@ static void netdev_disconnect_event(struct l_genl_msg *msg,
 	l_info("Received Deauthentication event, reason: %hu, from_ap: %s",
 			reason_code, disconnect_by_ap ? "true" : "false");
 
+	netdev_disconnected(netdev, reason_code, disconnect_by_ap);
+}
+
+static void netdev_disconnected(struct netdev *netdev, uint16_t reason_code,
+				bool disconnect_by_ap)
+{
+	netdev_event_func_t event_filter;
+	void *event_data;
+
 	event_filter = netdev->event_filter;
 	event_data = netdev->user_data;
 	netdev_connect_free(netdev);
@@ -1265,6 +1676,8 @@ static void netdev_operstate_cb(int error, uint16_t type,
 
 static void netdev_connect_ok(struct netdev *netdev)
 {
+	TRACE(netdev_connect_ok, netdev->index);
+
 	l_rtnl_set_linkmode_and_operstate(rtnl, netdev->index,
 					IF_LINK_MODE_DORMANT, IF_OPER_UP,
 					netdev_operstate_cb,
@@ -1391,6 +1804,7 @@ static void netdev_set_station_cb(struct l_genl_msg *msg, void *user_data)
 	if (err < 0) {
 		const char *ext_error = l_genl_msg_get_extended_error(msg);
 
+		METRICS_INC(set_station_errors);
 		l_error("Set Station failed for ifindex %d:%s", netdev->index,
 				ext_error ? ext_error : strerror(-err));
 
@@ -1413,6 +1827,8 @@ static void netdev_new_group_key_cb(struct l_genl_msg *msg, void *data)
 	if (err < 0) {
 		const char *ext_error = l_genl_msg_get_extended_error(msg);
 
+		METRICS_INC(new_key_errors);
+
 		l_error("New Key for Group Key failed for ifindex: %d:%s",
 				netdev->index,
 				ext_error ? ext_error : strerror(-err));
@@ -1437,6 +1853,8 @@ static void netdev_new_group_management_key_cb(struct l_genl_msg *msg,
 	if (err < 0) {
 		const char *ext_error = l_genl_msg_get_extended_error(msg);
 
+		METRICS_INC(new_key_errors);
+
 		l_error("New Key for Group Mgmt failed for ifindex: %d:%s",
 				netdev->index,
 				ext_error ? ext_error : strerror(-err));
@@ -1542,7 +1960,7 @@ static void netdev_set_gtk(struct handshake_state *hs, uint16_t key_index,
 					gtk_buf, gtk_len, rsc, rsc_len, addr);
 
 	nhs->group_new_key_cmd_id =
-		l_genl_family_send(nl80211, msg, netdev_new_group_key_cb,
+		l_genl_family_send(nl80211_keys, msg, netdev_new_group_key_cb,
 						nhs, NULL);
 
 	if (nhs->group_new_key_cmd_id > 0)
@@ -1595,7 +2013,7 @@ static void netdev_set_igtk(struct handshake_state *hs, uint16_t key_index,
 					igtk_buf, igtk_len, ipn, ipn_len, NULL);
 
 	nhs->group_management_new_key_cmd_id =
-			l_genl_family_send(nl80211, msg,
+			l_genl_family_send(nl80211_keys, msg,
 				netdev_new_group_management_key_cb,
 				nhs, NULL);
 
@@ -1618,12 +2036,18 @@ static void netdev_new_pairwise_key_cb(struct l_genl_msg *msg, void *data)
 	if (err < 0) {
 		const char *ext_error = l_genl_msg_get_extended_error(msg);
 
+		METRICS_INC(new_key_errors);
+
 		l_error("New Key for Pairwise Key failed for ifindex: %d:%s",
 				netdev->index,
 				ext_error ? ext_error : strerror(-err));
 		goto error;
 	}
 
+	/* Already sent by netdev_set_tk, its reply will follow */
+	if (nhs->set_station_cmd_id)
+		return;
+
 	/*
 	 * Set the AUTHORIZED flag using a SET_STATION command even if
 	 * we're already operational, it will not hurt during re-keying
@@ -1632,7 +2056,7 @@ static void netdev_new_pairwise_key_cb(struct l_genl_msg *msg, void *data)
 	msg = nl80211_build_set_station_authorized(netdev->index, addr);
 
 	nhs->set_station_cmd_id =
-		l_genl_family_send(nl80211, msg, netdev_set_station_cb,
+		l_genl_family_send(nl80211_keys, msg, netdev_set_station_cb,
 					nhs, NULL);
 	if (nhs->set_station_cmd_id > 0)
 		return;
@@ -1738,11 +2162,28 @@ static void netdev_set_tk(struct handshake_state *hs,
 	msg = netdev_build_cmd_new_key_pairwise(netdev, cipher, addr, tk_buf,
 						crypto_cipher_key_len(cipher));
 	nhs->pairwise_new_key_cmd_id =
-		l_genl_family_send(nl80211, msg, netdev_new_pairwise_key_cb,
+		l_genl_family_send(nl80211_keys, msg, netdev_new_pairwise_key_cb,
 						nhs, NULL);
-	if (nhs->pairwise_new_key_cmd_id > 0)
+	if (!nhs->pairwise_new_key_cmd_id)
+		goto send_failed;
+
+	if (!pipeline_key_setting)
 		return;
 
+	/*
+	 * Queue SET_STATION right behind NEW_KEY instead of waiting for
+	 * its ACK.  The kernel processes both in order so the replies come
+	 * back in order too and a NEW_KEY failure is still handled by
+	 * netdev_new_pairwise_key_cb before SET_STATION's reply is seen.
+	 */
+	msg = nl80211_build_set_station_authorized(netdev->index, addr);
+	nhs->set_station_cmd_id =
+		l_genl_family_send(nl80211_keys, msg, netdev_set_station_cb,
+					nhs, NULL);
+	if (nhs->set_station_cmd_id)
+		return;
+
+send_failed:
 	err = -EIO;
 	l_genl_msg_unref(msg);
 invalid_key:
@@ -1787,7 +2228,7 @@ static void netdev_set_pmk(struct handshake_state *hs, const uint8_t *pmk,
 				netdev->handshake->pmk_len,
 				netdev->handshake->pmk);
 
-	nhs->set_pmk_cmd_id = l_genl_family_send(nl80211, msg,
+	nhs->set_pmk_cmd_id = l_genl_family_send(nl80211_keys, msg,
 							netdev_set_pmk_cb,
 							nhs, NULL);
 	if (!nhs->set_pmk_cmd_id) {
@@ -1960,36 +2401,29 @@ static void netdev_send_qos_map_set(struct netdev *netdev,
 static void parse_request_ies(struct netdev *netdev, const uint8_t *ies,
 				size_t ies_len)
 {
-	struct ie_tlv_iter iter;
-	const void *data;
+	struct ie_index index;
+	const uint8_t *ie;
 
 	/*
 	 * The driver may have modified the IEs we passed to CMD_CONNECT
 	 * before sending them out, the actual IE sent is reflected in the
 	 * ATTR_REQ_IE sequence.  These are the values EAPoL will need to use.
 	 */
-	ie_tlv_iter_init(&iter, ies, ies_len);
+	ie_index_init(&index, ies, ies_len);
 
-	while (ie_tlv_iter_next(&iter)) {
-		data = ie_tlv_iter_get_data(&iter);
-
-		switch (ie_tlv_iter_get_tag(&iter)) {
-		case IE_TYPE_RSN:
-			handshake_state_set_supplicant_ie(netdev->handshake,
-								data - 2);
-			break;
-		case IE_TYPE_VENDOR_SPECIFIC:
-			if (!is_ie_wpa_ie(data, ie_tlv_iter_get_length(&iter)))
-				break;
-
-			handshake_state_set_supplicant_ie(netdev->handshake,
-								data - 2);
-			break;
-		case IE_TYPE_MOBILITY_DOMAIN:
-			handshake_state_set_mde(netdev->handshake, data - 2);
-			break;
-		}
+	ie = ie_index_find(&index, IE_TYPE_RSN);
+	if (!ie) {
+		ie = ie_index_find_vendor(&index, microsoft_oui, 1);
+		if (ie && !is_ie_wpa_ie(ie + 2, ie[1]))
+			ie = NULL;
 	}
+
+	if (ie)
+		handshake_state_set_supplicant_ie(netdev->handshake, ie);
+
+	ie = ie_index_find(&index, IE_TYPE_MOBILITY_DOMAIN);
+	if (ie)
+		handshake_state_set_mde(netdev->handshake, ie);
 }
 
 static void netdev_driver_connected(struct netdev *netdev)
@@ -2024,6 +2458,7 @@ static void netdev_connect_event(struct l_genl_msg *msg, struct netdev *netdev)
 	size_t resp_ies_len;
 
 	l_debug("");
+	TRACE(netdev_connect_event, netdev->index);
 
 	if (netdev->aborting)
 		return;
@@ -2321,6 +2756,7 @@ static void netdev_authenticate_event(struct l_genl_msg *msg,
 	uint16_t status_code = MMPDU_STATUS_CODE_UNSPECIFIED;
 
 	l_debug("");
+	TRACE(netdev_authenticate_event, netdev->index);
 
 	if (netdev->aborting)
 		return;
@@ -2394,6 +2830,7 @@ static void netdev_associate_event(struct l_genl_msg *msg,
 	int ret;
 
 	l_debug("");
+	TRACE(netdev_associate_event, netdev->index);
 
 	if (!netdev->connected || netdev->aborting)
 		return;
@@ -2506,6 +2943,7 @@ static void netdev_cmd_connect_cb(struct l_genl_msg *msg, void *user_data)
 		return;
 	}
 
+	METRICS_INC(connect_errors);
 	netdev_connect_failed(netdev, NETDEV_RESULT_ASSOCIATION_FAILED,
 				MMPDU_STATUS_CODE_UNSPECIFIED);
 }
@@ -2556,6 +2994,7 @@ static void netdev_auth_cb(struct l_genl_msg *msg, void *user_data)
 	}
 
 	l_debug("Error during auth: %d", err);
+	METRICS_INC(authenticate_errors);
 
 	if (!netdev->auth_cmd || err != -ENOENT) {
 		netdev_connect_failed(netdev,
@@ -2603,6 +3042,7 @@ static void netdev_assoc_cb(struct l_genl_msg *msg, void *user_data)
 
 	if (l_genl_msg_get_error(msg) < 0) {
 		l_error("Error sending CMD_ASSOCIATE");
+		METRICS_INC(associate_errors);
 
 		netdev_connect_failed(netdev, NETDEV_RESULT_ASSOCIATION_FAILED,
 					MMPDU_STATUS_CODE_UNSPECIFIED);
@@ -2629,11 +3069,19 @@ static void netdev_sae_tx_authenticate(const uint8_t *body,
 	netdev->auth_cmd = l_genl_msg_ref(msg);
 }
 
+static void netdev_sae_pwe_failed(void *user_data)
+{
+	struct netdev *netdev = user_data;
+
+	netdev_connect_failed(netdev, NETDEV_RESULT_AUTHENTICATION_FAILED,
+					MMPDU_STATUS_CODE_UNSPECIFIED);
+}
+
 static void netdev_sae_tx_associate(void *user_data)
 {
 	struct netdev *netdev = user_data;
 	struct l_genl_msg *msg;
-	struct iovec iov[2];
+	struct iovec iov[3];
 	int iov_elems = 0;
 
 	msg = netdev_build_cmd_associate_common(netdev);
@@ -2642,6 +3090,13 @@ static void netdev_sae_tx_associate(void *user_data)
 	iov[iov_elems].iov_len = netdev->handshake->supplicant_ie[1] + 2;
 	iov_elems++;
 
+	if (netdev->handshake->supplicant_rsnxe) {
+		iov[iov_elems].iov_base = netdev->handshake->supplicant_rsnxe;
+		iov[iov_elems].iov_len =
+				netdev->handshake->supplicant_rsnxe[1] + 2;
+		iov_elems++;
+	}
+
 	if (netdev->handshake->mde) {
 		iov[iov_elems].iov_base = netdev->handshake->mde;
 		iov[iov_elems].iov_len = netdev->handshake->mde[1] + 2;
@@ -3035,6 +3490,38 @@ static void netdev_mac_power_down_cb(int error, uint16_t type,
 	req->ref++;
 }
 
+static void netdev_mac_live_change_cb(int error, uint16_t type,
+					const void *data, uint32_t len,
+					void *user_data)
+{
+	struct rtnl_data *req = user_data;
+	struct netdev *netdev = req->netdev;
+
+	netdev->mac_change_cmd_id = 0;
+
+	if (!error) {
+		netdev_mac_power_up_cb(0, type, data, len, user_data);
+		return;
+	}
+
+	/*
+	 * The driver may refuse a live change, e.g. while it is still busy
+	 * with a scan, fall back to taking the interface down
+	 */
+	l_debug("Live MAC change on %u failed (%s), power cycling",
+			netdev->index, strerror(-error));
+
+	netdev->mac_change_cmd_id = l_rtnl_set_powered(rtnl, netdev->index,
+					false, netdev_mac_power_down_cb,
+					req, netdev_mac_destroy);
+	if (!netdev->mac_change_cmd_id) {
+		netdev_mac_change_failed(netdev, req, -EIO);
+		return;
+	}
+
+	req->ref++;
+}
+
 /*
  * TODO: There are some potential race conditions that are being ignored. There
  *       is nothing that IWD itself can do to solve these, they require kernel
@@ -3082,8 +3569,23 @@ static int netdev_start_powered_mac_change(struct netdev *netdev)
 	req->ref++;
 	memcpy(req->addr, new_addr, sizeof(req->addr));
 
-	netdev->mac_change_cmd_id = l_rtnl_set_powered(rtnl, netdev->index,
-					false, netdev_mac_power_down_cb,
+	/*
+	 * Power cycling the interface can add hundreds of milliseconds to
+	 * the connection on some drivers, avoid it if the address can be
+	 * changed while the interface is up.
+	 */
+	if (netdev_get_is_up(netdev) && wiphy_has_ext_feature(netdev->wiphy,
+				NL80211_EXT_FEATURE_POWERED_ADDR_CHANGE)) {
+		l_debug("Setting generated address on ifindex: %d to: "MAC,
+					netdev->index, MAC_STR(new_addr));
+		netdev->mac_change_cmd_id = l_rtnl_set_mac(rtnl,
+					netdev->index, new_addr, false,
+					netdev_mac_live_change_cb, req,
+					netdev_mac_destroy);
+	} else
+		netdev->mac_change_cmd_id = l_rtnl_set_powered(rtnl,
+					netdev->index, false,
+					netdev_mac_power_down_cb,
 					req, netdev_mac_destroy);
 
 	if (!netdev->mac_change_cmd_id) {
@@ -3234,6 +3736,8 @@ static int netdev_connect_common(struct netdev *netdev,
 					netdev_event_func_t event_filter,
 					netdev_connect_cb_t cb, void *user_data)
 {
+	TRACE(netdev_connect, netdev->index, bss->frequency);
+
 	netdev->connect_cmd = cmd_connect;
 	netdev->event_filter = event_filter;
 	netdev->connect_cb = cb;
@@ -3283,8 +3787,11 @@ int netdev_connect(struct netdev *netdev, struct scan_bss *bss,
 	if (netdev_handshake_state_setup_connection_type(hs) < 0)
 		return -ENOTSUP;
 
-	if (nhs->type != CONNECTION_TYPE_SOFTMAC)
+	if (nhs->type != CONNECTION_TYPE_SOFTMAC) {
+		/* SAE H2E is only advertised when we run SAE ourselves */
+		handshake_state_set_supplicant_rsnxe(hs, NULL);
 		goto build_cmd_connect;
+	}
 
 	switch (hs->akm_suite) {
 	case IE_RSN_AKM_SUITE_SAE_SHA256:
@@ -3292,6 +3799,7 @@ int netdev_connect(struct netdev *netdev, struct scan_bss *bss,
 		netdev->ap = sae_sm_new(hs, netdev_sae_tx_authenticate,
 						netdev_sae_tx_associate,
 						netdev);
+		sae_sm_set_async_pwe(netdev->ap, netdev_sae_pwe_failed);
 		break;
 	case IE_RSN_AKM_SUITE_OWE:
 		netdev->ap = owe_sm_new(hs, netdev_owe_tx_authenticate,
@@ -3409,7 +3917,8 @@ int netdev_reassociate(struct netdev *netdev, struct scan_bss *target_bss,
 			netdev_connect_cb_t cb, void *user_data)
 {
 	struct l_genl_msg *cmd_connect;
-	struct netdev_handshake_state;
+	struct netdev_handshake_state *nhs = l_container_of(hs,
+				struct netdev_handshake_state, super);
 	struct handshake_state *old_hs;
 	struct eapol_sm *sm = NULL, *old_sm;
 	bool is_rsn = hs->supplicant_ie != NULL;
@@ -3418,8 +3927,13 @@ int netdev_reassociate(struct netdev *netdev, struct scan_bss *target_bss,
 	if (netdev_handshake_state_setup_connection_type(hs) < 0)
 		return -ENOTSUP;
 
-	/* TODO: SoftMac SAE/FILS Re-Associations are not suppored yet */
-	if (L_WARN_ON(IE_AKM_IS_SAE(hs->akm_suite) ||
+	/*
+	 * TODO: SoftMac SAE/FILS Re-Associations are not suppored yet.  With
+	 * SAE offload the firmware runs SAE again for the new BSS from the
+	 * password in CMD_CONNECT.
+	 */
+	if (L_WARN_ON((IE_AKM_IS_SAE(hs->akm_suite) &&
+				nhs->type != CONNECTION_TYPE_SAE_OFFLOAD) ||
 				IE_AKM_IS_FILS(hs->akm_suite)))
 		return -ENOTSUP;
 
@@ -3428,9 +3942,14 @@ int netdev_reassociate(struct netdev *netdev, struct scan_bss *target_bss,
 	if (!cmd_connect)
 		return -EINVAL;
 
-	if (is_rsn)
+	/* The 4-Way Handshake is done by the firmware when offloaded */
+	if (is_rsn && !is_offload(hs)) {
 		sm = eapol_sm_new(hs);
 
+		if (nhs->type == CONNECTION_TYPE_8021X_OFFLOAD)
+			eapol_sm_set_require_handshake(sm, false);
+	}
+
 	old_sm = netdev->sm;
 	old_hs = netdev->handshake;
 
@@ -3440,10 +3959,7 @@ int netdev_reassociate(struct netdev *netdev, struct scan_bss *target_bss,
 		return err;
 
 	/* In case of a previous failed over-DS attempt */
-	if (netdev->ft_ds_info) {
-		ft_ds_info_free(&netdev->ft_ds_info->super);
-		netdev->ft_ds_info = NULL;
-	}
+	netdev_ft_ds_list_flush(netdev);
 
 	memcpy(netdev->prev_bssid, orig_bss->addr, ETH_ALEN);
 
@@ -3673,11 +4189,11 @@ static int netdev_ft_tx_associate(struct iovec *ie_iov, size_t iov_len,
 		return -EIO;
 	}
 
-	/* No need to keep this around at this point */
-	if (netdev->ft_ds_info) {
-		ft_ds_info_free(&netdev->ft_ds_info->super);
-		netdev->ft_ds_info = NULL;
-	}
+	/*
+	 * No need to keep this around at this point, exchanges with other
+	 * targets were done through the AP we are leaving
+	 */
+	netdev_ft_ds_list_flush(netdev);
 
 	return 0;
 }
@@ -3724,12 +4240,12 @@ static void prepare_ft(struct netdev *netdev, struct scan_bss *target_bss)
 	nhs->igtk_installed = true;
 
 	if (nhs->group_new_key_cmd_id) {
-		l_genl_family_cancel(nl80211, nhs->group_new_key_cmd_id);
+		l_genl_family_cancel(nl80211_keys, nhs->group_new_key_cmd_id);
 		nhs->group_new_key_cmd_id = 0;
 	}
 
 	if (nhs->group_management_new_key_cmd_id) {
-		l_genl_family_cancel(nl80211,
+		l_genl_family_cancel(nl80211_keys,
 			nhs->group_management_new_key_cmd_id);
 		nhs->group_management_new_key_cmd_id = 0;
 	}
@@ -3750,12 +4266,64 @@ static void prepare_ft(struct netdev *netdev, struct scan_bss *target_bss)
 static void netdev_ft_over_ds_auth_failed(struct netdev_ft_over_ds_info *info,
 						uint16_t status)
 {
+	struct netdev *netdev = info->netdev;
+
 	if (info->cb)
-		info->cb(info->netdev, status, info->super.aa, info->user_data);
+		info->cb(netdev, status, info->super.aa, info->user_data);
+
+	l_queue_remove(netdev->ft_ds_list, info);
+	ft_ds_info_free(&info->super);
+}
+
+static bool netdev_ft_ds_info_match(const void *a, const void *b)
+{
+	const struct netdev_ft_over_ds_info *info = a;
+
+	return !memcmp(info->super.aa, b, ETH_ALEN);
+}
+
+static bool netdev_ft_ds_info_expired(void *data, void *user_data)
+{
+	struct netdev_ft_over_ds_info *info = data;
+	uint64_t *now = user_data;
+
+	if (!info->parsed || l_time_before(*now, info->expiry))
+		return false;
 
 	ft_ds_info_free(&info->super);
+	return true;
+}
+
+/*
+ * The AP may limit how long after the FT Response it accepts the
+ * reassociation with a Reassociation Deadline Timeout Interval element
+ */
+static uint64_t netdev_ft_ds_lifetime(const uint8_t *ies, size_t ies_len)
+{
+	struct ie_tlv_iter iter;
+	const uint8_t *data;
+	uint64_t deadline;
+
+	ie_tlv_iter_init(&iter, ies, ies_len);
+
+	while (ie_tlv_iter_next(&iter)) {
+		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_TIMEOUT_INTERVAL ||
+				ie_tlv_iter_get_length(&iter) != 5)
+			continue;
+
+		data = ie_tlv_iter_get_data(&iter);
 
-	info->netdev->ft_ds_info = NULL;
+		/* Reassociation deadline interval, in TUs */
+		if (data[0] != 1)
+			continue;
+
+		deadline = (uint64_t) l_get_le32(data + 1) * 1024;
+
+		if (deadline < NETDEV_FT_DS_LIFETIME)
+			return deadline;
+	}
+
+	return NETDEV_FT_DS_LIFETIME;
 }
 
 static void netdev_ft_response_frame_event(const struct mmpdu_header *hdr,
@@ -3763,11 +4331,17 @@ static void netdev_ft_response_frame_event(const struct mmpdu_header *hdr,
 					int rssi, void *user_data)
 {
 	struct netdev *netdev = user_data;
-	struct netdev_ft_over_ds_info *info = netdev->ft_ds_info;
+	struct netdev_ft_over_ds_info *info;
 	int ret;
 	uint16_t status_code = MMPDU_STATUS_CODE_UNSPECIFIED;
 
-	if (!info)
+	if (body_len < 14)
+		return;
+
+	/* Target AP address */
+	info = l_queue_find(netdev->ft_ds_list, netdev_ft_ds_info_match,
+				body + 8);
+	if (!info || info->parsed)
 		return;
 
 	ret = ft_over_ds_parse_action_response(&info->super, netdev->handshake,
@@ -3785,6 +4359,8 @@ static void netdev_ft_response_frame_event(const struct mmpdu_header *hdr,
 	}
 
 	info->parsed = true;
+	info->expiry = l_time_now() +
+			netdev_ft_ds_lifetime(body + 16, body_len - 16);
 
 	if (info->cb)
 		info->cb(netdev, 0, info->super.aa, info->user_data);
@@ -3870,9 +4446,12 @@ int netdev_fast_transition_over_ds(struct netdev *netdev,
 					struct scan_bss *target_bss,
 					netdev_connect_cb_t cb)
 {
-	struct netdev_ft_over_ds_info *info = netdev->ft_ds_info;
+	struct netdev_ft_over_ds_info *info;
 
-	if (!info || !info->parsed)
+	info = l_queue_find(netdev->ft_ds_list, netdev_ft_ds_info_match,
+				target_bss->addr);
+	if (!info || !info->parsed ||
+			l_time_after(l_time_now(), info->expiry))
 		return -ENOENT;
 
 	if (!netdev->operational)
@@ -3945,10 +4524,7 @@ int netdev_fast_transition_over_ds_action(struct netdev *netdev,
 	struct iovec iovs[5];
 	uint8_t buf[512];
 	size_t len;
-
-	/* TODO: Just allow single outstanding action frame for now */
-	if (netdev->ft_ds_info)
-		return -EALREADY;
+	uint64_t now = l_time_now();
 
 	if (!netdev->operational)
 		return -ENOTCONN;
@@ -3958,6 +4534,17 @@ int netdev_fast_transition_over_ds_action(struct netdev *netdev,
 			l_get_le16(target_bss->mde))
 		return -EINVAL;
 
+	l_queue_foreach_remove(netdev->ft_ds_list, netdev_ft_ds_info_expired,
+				&now);
+
+	/* Either in progress or done and still valid */
+	if (l_queue_find(netdev->ft_ds_list, netdev_ft_ds_info_match,
+				target_bss->addr))
+		return -EALREADY;
+
+	if (l_queue_length(netdev->ft_ds_list) >= NETDEV_FT_DS_MAX)
+		return -EBUSY;
+
 	l_debug("");
 
 	info = l_new(struct netdev_ft_over_ds_info, 1);
@@ -3988,7 +4575,10 @@ int netdev_fast_transition_over_ds_action(struct netdev *netdev,
 
 	iovs[2].iov_base = NULL;
 
-	netdev->ft_ds_info = info;
+	if (!netdev->ft_ds_list)
+		netdev->ft_ds_list = l_queue_new();
+
+	l_queue_push_tail(netdev->ft_ds_list, info);
 
 	info->timeout = l_timeout_create_ms(300, netdev_ft_over_ds_timeout,
 						info, NULL);
@@ -4102,6 +4692,51 @@ int netdev_neighbor_report_req(struct netdev *netdev,
 	return 0;
 }
 
+static void netdev_bss_transition_response_cb(struct l_genl_msg *msg,
+						void *user_data)
+{
+	int err = l_genl_msg_get_error(msg);
+
+	if (err < 0)
+		l_error("Error sending BSS Transition Response: %s (%d)",
+			strerror(-err), -err);
+}
+
+/*
+ * 802.11-2016 9.6.14.10.  The Target BSSID is only included when the
+ * request is accepted.
+ */
+int netdev_bss_transition_response(struct netdev *netdev,
+					uint8_t dialog_token, uint8_t status,
+					const uint8_t *target)
+{
+	uint8_t action_frame[11] = {
+		0x0a, /* Category: WNM */
+		0x08, /* WNM Action: BSS Transition Management Response */
+	};
+	size_t len = 5;
+
+	if (!netdev->connected)
+		return -ENOTCONN;
+
+	action_frame[2] = dialog_token;
+	action_frame[3] = status;
+	action_frame[4] = 0; /* BSS Termination Delay */
+
+	if (!status && target) {
+		memcpy(action_frame + len, target, 6);
+		len += 6;
+	}
+
+	if (!netdev_send_action_frame(netdev, netdev->handshake->aa,
+					action_frame, len, netdev->frequency,
+					netdev_bss_transition_response_cb,
+					NULL))
+		return -EIO;
+
+	return 0;
+}
+
 static void netdev_neighbor_report_frame_event(const struct mmpdu_header *hdr,
 					const void *body, size_t body_len,
 					int rssi, void *user_data)
@@ -4358,6 +4993,40 @@ static void netdev_station_event(struct l_genl_msg *msg,
 			netdev_station_watch_func_t, netdev, mac, added);
 }
 
+/*
+ * The AP has moved the BSS to a new channel with a Channel Switch
+ * Announcement and mac80211 followed it, the association is unaffected.
+ */
+static void netdev_channel_switch_event(struct l_genl_msg *msg,
+					struct netdev *netdev, bool started)
+{
+	uint32_t frequency;
+
+	if (!netdev->connected)
+		return;
+
+	if (nl80211_parse_attrs(msg, NL80211_ATTR_WIPHY_FREQ, &frequency,
+					NL80211_ATTR_UNSPEC) < 0)
+		return;
+
+	if (started) {
+		l_debug("Channel switch to %u MHz started", frequency);
+		return;
+	}
+
+	l_debug("Channel switched from %u to %u MHz", netdev->frequency,
+							frequency);
+
+	if (frequency == netdev->frequency)
+		return;
+
+	netdev->frequency = frequency;
+
+	if (netdev->event_filter)
+		netdev->event_filter(netdev, NETDEV_EVENT_CHANNEL_SWITCHED,
+					&frequency, netdev->user_data);
+}
+
 static struct netdev *netdev_from_message(struct l_genl_msg *msg)
 {
 	uint32_t ifindex;
@@ -4425,6 +5094,7 @@ static bool netdev_get_fw_scan_cb(int err, struct l_queue *bss_list,
 	netdev->fw_roam_bss = bss;
 
 	handshake_state_set_authenticator_ie(netdev->handshake, bss->rsne);
+	handshake_state_set_authenticator_rsnxe(netdev->handshake, bss->rsnxe);
 
 	if (is_offload(netdev->handshake)) {
 		netdev_connect_ok(netdev);
@@ -4567,6 +5237,12 @@ static void netdev_mlme_notify(struct l_genl_msg *msg, void *user_data)
 	case NL80211_CMD_DEL_STATION:
 		netdev_station_event(msg, netdev, false);
 		break;
+	case NL80211_CMD_CH_SWITCH_STARTED_NOTIFY:
+		netdev_channel_switch_event(msg, netdev, true);
+		break;
+	case NL80211_CMD_CH_SWITCH_NOTIFY:
+		netdev_channel_switch_event(msg, netdev, false);
+		break;
 	}
 }
 
@@ -4577,29 +5253,60 @@ static void netdev_pae_destroy(void *user_data)
 	netdev->pae_io = NULL;
 }
 
+/*
+ * Number of EAPoL frames read from the PAE socket per wakeup.  The buffers
+ * are shared by all netdevs since the frames are fully processed before
+ * the next read.
+ */
+#define PAE_RX_BATCH 8
+
+static struct {
+	struct mmsghdr msgs[PAE_RX_BATCH];
+	struct iovec iov[PAE_RX_BATCH];
+	struct sockaddr_ll sll[PAE_RX_BATCH];
+	uint8_t frames[PAE_RX_BATCH][IEEE80211_MAX_DATA_LEN];
+} pae_rx;
+
 static bool netdev_pae_read(struct l_io *io, void *user_data)
 {
 	int fd = l_io_get_fd(io);
-	struct sockaddr_ll sll;
-	socklen_t sll_len;
-	ssize_t bytes;
-	uint8_t frame[IEEE80211_MAX_DATA_LEN];
+	int i;
+	int count;
 
-	memset(&sll, 0, sizeof(sll));
-	sll_len = sizeof(sll);
+	for (i = 0; i < PAE_RX_BATCH; i++) {
+		struct msghdr *hdr = &pae_rx.msgs[i].msg_hdr;
+
+		memset(&pae_rx.sll[i], 0, sizeof(pae_rx.sll[i]));
+		pae_rx.iov[i].iov_base = pae_rx.frames[i];
+		pae_rx.iov[i].iov_len = sizeof(pae_rx.frames[i]);
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->msg_name = &pae_rx.sll[i];
+		hdr->msg_namelen = sizeof(pae_rx.sll[i]);
+		hdr->msg_iov = &pae_rx.iov[i];
+		hdr->msg_iovlen = 1;
+	}
+
+	count = recvmmsg(fd, pae_rx.msgs, PAE_RX_BATCH, MSG_DONTWAIT, NULL);
+	if (count < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
 
-	bytes = recvfrom(fd, frame, sizeof(frame), 0,
-				(struct sockaddr *) &sll, &sll_len);
-	if (bytes <= 0) {
+	if (count <= 0) {
 		l_error("EAPoL read socket: %s", strerror(errno));
 		return false;
 	}
 
-	if (sll.sll_halen != ETH_ALEN)
-		return true;
+	for (i = 0; i < count; i++) {
+		const struct sockaddr_ll *sll = &pae_rx.sll[i];
 
-	__eapol_rx_packet(sll.sll_ifindex, sll.sll_addr,
-				ntohs(sll.sll_protocol), frame, bytes, false);
+		if (!pae_rx.msgs[i].msg_len || sll->sll_halen != ETH_ALEN)
+			continue;
+
+		__eapol_rx_packet(sll->sll_ifindex, sll->sll_addr,
+					ntohs(sll->sll_protocol),
+					pae_rx.frames[i],
+					pae_rx.msgs[i].msg_len, false);
+	}
 
 	return true;
 }
@@ -4690,6 +5397,7 @@ static void netdev_control_port_frame_cb(struct l_genl_msg *msg,
 	if (err >= 0)
 		return;
 
+	METRICS_INC(control_port_errors);
 	ext_error = l_genl_msg_get_extended_error(msg);
 	l_error("CMD_CONTROL_PORT failed: %s",
 			ext_error ? ext_error : strerror(-err));
@@ -4803,12 +5511,12 @@ static struct l_genl_msg *netdev_build_cmd_cqm_rssi_update(
 							size_t levels_num)
 {
 	struct l_genl_msg *msg;
-	uint32_t hyst = 5;
+	uint32_t hyst = cqm_rssi_hyst;
 	int thold_count;
 	int32_t thold_list[levels_num + 2];
 
 	if (levels_num == 0) {
-		thold_list[0] = LOW_SIGNAL_THRESHOLD;
+		thold_list[0] = netdev->low_signal_threshold;
 		thold_count = 1;
 	} else {
 		/*
@@ -4827,13 +5535,14 @@ static struct l_genl_msg *netdev_build_cmd_cqm_rssi_update(
 			if (i && thold_list[thold_count - 1] >= val)
 				return NULL;
 
-			if (val >= LOW_SIGNAL_THRESHOLD && !low_sig_added) {
+			if (val >= netdev->low_signal_threshold &&
+					!low_sig_added) {
 				thold_list[thold_count++] =
-					LOW_SIGNAL_THRESHOLD;
+					netdev->low_signal_threshold;
 				low_sig_added = true;
 
 				/* Duplicate values are not allowed */
-				if (val == LOW_SIGNAL_THRESHOLD)
+				if (val == netdev->low_signal_threshold)
 					continue;
 			}
 
@@ -4865,6 +5574,28 @@ static void netdev_cmd_set_cqm_cb(struct l_genl_msg *msg, void *user_data)
 			ext_error ? ext_error : strerror(-err));
 }
 
+static int netdev_cqm_rssi_update(struct netdev *netdev);
+
+/*
+ * Overrides [General].RoamThreshold for this netdev, used by station to
+ * apply a threshold learned for the connected network
+ */
+int netdev_set_low_signal_threshold(struct netdev *netdev, int threshold)
+{
+	if (threshold < -100 || threshold > 0)
+		return -ERANGE;
+
+	if (netdev->low_signal_threshold == threshold)
+		return 0;
+
+	netdev->low_signal_threshold = threshold;
+
+	if (netdev->type != NL80211_IFTYPE_STATION)
+		return 0;
+
+	return netdev_cqm_rssi_update(netdev);
+}
+
 int netdev_set_rssi_report_levels(struct netdev *netdev, const int8_t *levels,
 					size_t levels_num)
 {
@@ -4905,47 +5636,42 @@ done:
 static void netdev_get_station_cb(struct l_genl_msg *msg, void *user_data)
 {
 	struct netdev *netdev = user_data;
-	struct l_genl_attr attr, nested;
-	uint16_t type, len;
-	const void *data;
 	struct diagnostic_station_info info;
 
 	netdev->get_station_cmd_id = 0;
 
-	if (!l_genl_attr_init(&attr, msg))
-		goto parse_error;
-
-	memset(&info, 0, sizeof(info));
+	if (!netdev_parse_get_station(msg, &info)) {
+		if (netdev->get_station_cb)
+			netdev->get_station_cb(NULL, netdev->get_station_data);
 
-	while (l_genl_attr_next(&attr, &type, &len, &data)) {
-		switch (type) {
-		case NL80211_ATTR_STA_INFO:
-			if (!l_genl_attr_recurse(&attr, &nested))
-				goto parse_error;
+		return;
+	}
 
-			if (!netdev_parse_sta_info(&nested, &info))
-				goto parse_error;
+	netdev_sta_info_update(netdev, &info);
 
-			break;
+	if (netdev->get_station_cb)
+		netdev->get_station_cb(&info, netdev->get_station_data);
+}
 
-		case NL80211_ATTR_MAC:
-			if (len != 6)
-				goto parse_error;
+static void netdev_get_station_cached(struct l_idle *idle, void *user_data)
+{
+	struct netdev *netdev = user_data;
 
-			memcpy(info.addr, data, 6);
+	if (netdev->get_station_cb)
+		netdev->get_station_cb(&netdev->sta_info,
+					netdev->get_station_data);
 
-			break;
-		}
-	}
+	l_idle_remove(idle);
+}
 
-	if (netdev->get_station_cb)
-		netdev->get_station_cb(&info, netdev->get_station_data);
+static void netdev_get_station_idle_destroy(void *user_data)
+{
+	struct netdev *netdev = user_data;
 
-	return;
+	netdev->get_station_idle = NULL;
 
-parse_error:
-	if (netdev->get_station_cb)
-		netdev->get_station_cb(NULL, netdev->get_station_data);
+	if (netdev->get_station_destroy)
+		netdev->get_station_destroy(netdev->get_station_data);
 }
 
 static void netdev_get_station_destroy(void *user_data)
@@ -4964,9 +5690,17 @@ int netdev_get_station(struct netdev *netdev, const uint8_t *mac,
 {
 	struct l_genl_msg *msg;
 
-	if (netdev->get_station_cmd_id)
+	if (netdev->get_station_cmd_id || netdev->get_station_idle)
 		return -EBUSY;
 
+	/* Callers expect the callback to happen asynchronously */
+	if (netdev_sta_info_is_fresh(netdev, mac)) {
+		netdev->get_station_idle = l_idle_create(
+					netdev_get_station_cached, netdev,
+					netdev_get_station_idle_destroy);
+		goto done;
+	}
+
 	msg = l_genl_msg_new_sized(NL80211_CMD_GET_STATION, 64);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &netdev->index);
 	l_genl_msg_append_attr(msg, NL80211_ATTR_MAC, ETH_ALEN, mac);
@@ -4979,6 +5713,7 @@ int netdev_get_station(struct netdev *netdev, const uint8_t *mac,
 		return -EIO;
 	}
 
+done:
 	netdev->get_station_cb = cb;
 	netdev->get_station_data = user_data;
 	netdev->get_station_destroy = destroy;
@@ -4997,12 +5732,72 @@ int netdev_get_current_station(struct netdev *netdev,
 					user_data, destroy);
 }
 
+static void netdev_resync_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct netdev *netdev = user_data;
+	struct diagnostic_station_info info;
+	int err = l_genl_msg_get_error(msg);
+
+	netdev->resync_cmd_id = 0;
+
+	/* The AP is gone, the disconnect event was among those lost */
+	if (err == -ENOENT) {
+		if (!netdev->connected || netdev->disconnect_cmd_id ||
+				netdev->in_ft)
+			return;
+
+		l_info("Link lost during a netlink overrun");
+		netdev_disconnected(netdev, MMPDU_REASON_CODE_UNSPECIFIED,
+					false);
+		return;
+	}
+
+	if (err < 0 || !netdev_parse_get_station(msg, &info))
+		return;
+
+	netdev_sta_info_update(netdev, &info);
+
+	/* Catch up on any CQM event that was lost */
+	if (info.have_cur_rssi)
+		netdev_cqm_event_rssi_value(netdev, info.cur_rssi);
+}
+
+static void netdev_resync(void *data, void *user_data)
+{
+	struct netdev *netdev = data;
+	struct l_genl_msg *msg;
+
+	if (!netdev->operational || !netdev->handshake ||
+			netdev->resync_cmd_id)
+		return;
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_GET_STATION, 64);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_IFINDEX, 4, &netdev->index);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_MAC, ETH_ALEN,
+				netdev->handshake->aa);
+
+	netdev->resync_cmd_id = l_genl_family_send(nl80211, msg,
+							netdev_resync_cb,
+							netdev, NULL);
+	if (!netdev->resync_cmd_id)
+		l_genl_msg_unref(msg);
+}
+
+/*
+ * Link state and signal changes are only notified, check whether any of
+ * those was lost.
+ */
+static void netdev_overrun(void *user_data)
+{
+	l_queue_foreach(netdev_list, netdev_resync, NULL);
+}
+
 int netdev_get_all_stations(struct netdev *netdev, netdev_get_station_cb_t cb,
 				void *user_data, netdev_destroy_func_t destroy)
 {
 	struct l_genl_msg *msg;
 
-	if (netdev->get_station_cmd_id)
+	if (netdev->get_station_cmd_id || netdev->get_station_idle)
 		return -EBUSY;
 
 	msg = l_genl_msg_new_sized(NL80211_CMD_GET_STATION, 64);
@@ -5114,6 +5909,7 @@ static void netdev_set_interface_event(struct l_genl_msg *msg,
 	frame_watch_wdev_remove(wdev_id);
 
 	netdev_setup_interface(netdev);
+	iwd_modules_iftype_appeared(iftype);
 
 	WATCHLIST_NOTIFY(&netdev_watches, netdev_watch_func_t,
 				netdev, NETDEV_WATCH_EVENT_IFTYPE_CHANGE);
@@ -5519,6 +6315,7 @@ static void netdev_initial_up_cb(int error, uint16_t type, const void *data,
 	l_debug("Interface %i initialized", netdev->index);
 
 	scan_wdev_add(netdev->wdev_id);
+	iwd_modules_iftype_appeared(netdev->type);
 
 	WATCHLIST_NOTIFY(&netdev_watches, netdev_watch_func_t,
 				netdev, NETDEV_WATCH_EVENT_NEW);
@@ -5717,6 +6514,7 @@ struct netdev *netdev_create_from_genl(struct l_genl_msg *msg,
 	l_strlcpy(netdev->name, ifname, IFNAMSIZ);
 	netdev->wiphy = wiphy;
 	netdev->pae_over_nl80211 = pae_io == NULL;
+	netdev->low_signal_threshold = LOW_SIGNAL_THRESHOLD;
 
 	if (set_mac)
 		memcpy(netdev->set_mac_once, set_mac, 6);
@@ -5829,14 +6627,44 @@ static int netdev_init(void)
 		goto fail_netlink;
 	}
 
+	nl80211_keys = l_genl_family_new(iwd_get_control_genl(),
+						NL80211_GENL_NAME);
+	if (!nl80211_keys) {
+		l_error("Failed to obtain nl80211 on the control socket");
+		l_genl_family_free(nl80211);
+		nl80211 = NULL;
+		goto fail_netlink;
+	}
+
 	if (!l_settings_get_int(settings, "General", "RoamThreshold",
 					&LOW_SIGNAL_THRESHOLD))
 		LOW_SIGNAL_THRESHOLD = -70;
 
+	if (!l_settings_get_uint(settings, "General", "RoamThresholdHysteresis",
+					&cqm_rssi_hyst))
+		cqm_rssi_hyst = 5;
+
+	if (!l_settings_get_uint64(settings, "General",
+					"CQMEventCoalesceInterval",
+					&cqm_coalesce_interval))
+		cqm_coalesce_interval = 1000;
+
+	cqm_coalesce_interval *= L_USEC_PER_MSEC;
+
 	if (!l_settings_get_bool(settings, "General", "ControlPortOverNL80211",
 					&pae_over_nl80211))
 		pae_over_nl80211 = true;
 
+	if (!l_settings_get_bool(settings, "General", "PipelineKeySetting",
+					&pipeline_key_setting))
+		pipeline_key_setting = false;
+
+	if (!l_settings_get_uint64(settings, "General", "StationInfoMaxAge",
+					&station_info_max_age))
+		station_info_max_age = 1000;
+
+	station_info_max_age *= L_USEC_PER_MSEC;
+
 	rand_addr_str = l_settings_get_value(settings, "General",
 						"AddressRandomization");
 	if (rand_addr_str && !strcmp(rand_addr_str, "network"))
@@ -5859,6 +6687,9 @@ static int netdev_init(void)
 	if (!unicast_watch)
 		l_error("Registering for unicast notification failed");
 
+	overrun_watch = l_genl_add_overrun_watch(genl, netdev_overrun,
+							NULL, NULL);
+
 	if (!l_genl_family_register(nl80211, "mlme", netdev_mlme_notify,
 								NULL, NULL))
 		l_error("Registering for MLME notification failed");
@@ -5887,10 +6718,19 @@ static void netdev_exit(void)
 		return;
 
 	l_genl_remove_unicast_watch(genl, unicast_watch);
+	l_genl_remove_overrun_watch(genl, overrun_watch);
 
 	watchlist_destroy(&netdev_watches);
 	l_queue_destroy(netdev_list, netdev_free);
+	netdev_list = NULL;
+
+	l_free(l_steal_ptr(spare_handshake));
+
+	sae_pwe_cache_flush();
+	handshake_group_cache_flush();
 
+	l_genl_family_free(nl80211_keys);
+	nl80211_keys = NULL;
 	l_genl_family_free(nl80211);
 	nl80211 = NULL;
 
@@ -48,6 +48,7 @@ enum netdev_event {
 	NETDEV_EVENT_RSSI_THRESHOLD_LOW,
 	NETDEV_EVENT_RSSI_THRESHOLD_HIGH,
 	NETDEV_EVENT_RSSI_LEVEL_NOTIFY,
+	NETDEV_EVENT_CHANNEL_SWITCHED,
 };
 
 enum netdev_watch_event {
@@ -189,9 +190,13 @@ int netdev_set_powered(struct netdev *netdev, bool powered,
 
 int netdev_neighbor_report_req(struct netdev *netdev,
 				netdev_neighbor_report_cb_t cb);
+int netdev_bss_transition_response(struct netdev *netdev,
+					uint8_t dialog_token, uint8_t status,
+					const uint8_t *target);
 
 int netdev_set_rssi_report_levels(struct netdev *netdev, const int8_t *levels,
 					size_t levels_num);
+int netdev_set_low_signal_threshold(struct netdev *netdev, int threshold);
 
 int netdev_get_station(struct netdev *netdev, const uint8_t *mac,
 			netdev_get_station_cb_t cb, void *user_data,
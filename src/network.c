@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <alloca.h>
+#include <linux/if_ether.h>
 
 #include <ell/ell.h>
 
@@ -53,13 +54,19 @@
 #include "src/blacklist.h"
 #include "src/util.h"
 #include "src/erp.h"
+#include "src/hotspot.h"
+
+/* Scans a registered network may be missing from before it's removed */
+#define NETWORK_UNSEEN_MAX_SCANS 3
 
 static uint32_t known_networks_watch;
 static uint32_t anqp_watch;
+static bool lazy_registration;
+
+IWD_MODULE_COUNTER(network, network)
 
 struct network {
-	char ssid[33];
-	enum security security;
+	const struct network_key *key;
 	char *object_path;
 	struct station *station;
 	struct network_info *info;
@@ -67,9 +74,9 @@ struct network {
 	char *passphrase;
 	unsigned int agent_request;
 	struct l_queue *bss_list;
+	struct l_hashtab *bss_index;	/* bss_list entries keyed by BSSID */
 	struct l_settings *settings;
 	struct l_queue *secrets;
-	struct l_queue *blacklist; /* temporary blacklist for BSS's */
 	uint8_t hessid[6];
 	char **nai_realms;
 	uint8_t *rc_ie;
@@ -77,11 +84,26 @@ struct network {
 	bool ask_passphrase:1; /* Whether we should force-ask agent */
 	bool is_hs20:1;
 	bool anqp_pending:1;	/* Set if there is a pending ANQP request */
+	bool exported:1;	/* Set if object_path is registered on D-Bus */
+	uint8_t unseen_scans;
 	int rank;
+	/* Inputs of the last rank computation, see network_rank_update */
+	struct {
+		bool valid : 1;
+		bool connected : 1;
+		uint16_t bss_rank;
+		const struct network_info *info;
+		uint32_t offset_gen;
+	} rank_inputs;
 	/* Holds DBus Connect() message if it comes in before ANQP finishes */
 	struct l_dbus_message *connect_after_anqp;
 };
 
+static struct l_hashtab *network_bss_index_new(void)
+{
+	return l_hashtab_new(ETH_ALEN, L_HASHTAB_HASH_FAST);
+}
+
 static bool network_settings_load(struct network *network)
 {
 	if (network->settings)
@@ -124,6 +146,18 @@ static void network_settings_close(struct network *network)
 	network->settings = NULL;
 }
 
+static void network_blacklist_clear(struct network *network)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(network->bss_list); entry;
+			entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+
+		bss->temp_blacklisted = false;
+	}
+}
+
 static bool network_secret_check_cacheable(void *data, void *user_data)
 {
 	struct eap_secret_info *secret = data;
@@ -166,7 +200,7 @@ void network_connected(struct network *network)
 	l_queue_foreach_remove(network->secrets,
 				network_secret_check_cacheable, network);
 
-	l_queue_clear(network->blacklist, NULL);
+	network_blacklist_clear(network);
 }
 
 void network_disconnected(struct network *network)
@@ -227,23 +261,23 @@ struct network *network_create(struct station *station, const char *ssid,
 	struct network *network;
 
 	network = l_new(struct network, 1);
+	IWD_COUNTER_INC(network);
 	network->station = station;
-	strcpy(network->ssid, ssid);
-	network->security = security;
+	network->key = network_key_get(ssid, security);
 
-	network->info = known_networks_find(ssid, security);
+	network->info = known_networks_find_key(network->key);
 	if (network->info)
-		network->info->seen_count++;
+		known_network_seen_count_inc(network->info);
 
 	network->bss_list = l_queue_new();
-	network->blacklist = l_queue_new();
+	network->bss_index = network_bss_index_new();
 
 	return network;
 }
 
 const char *network_get_ssid(const struct network *network)
 {
-	return network->ssid;
+	return network->key->ssid;
 }
 
 const char *network_get_path(const struct network *network)
@@ -253,7 +287,12 @@ const char *network_get_path(const struct network *network)
 
 enum security network_get_security(const struct network *network)
 {
-	return network->security;
+	return network->key->security;
+}
+
+const struct network_key *network_get_key(const struct network *network)
+{
+	return network->key;
 }
 
 const uint8_t *network_get_psk(struct network *network)
@@ -264,8 +303,8 @@ const uint8_t *network_get_psk(struct network *network)
 	network->psk = l_malloc(32);
 
 	if (crypto_psk_from_passphrase(network->passphrase,
-					(unsigned char *)network->ssid,
-					strlen(network->ssid),
+					(unsigned char *)network->key->ssid,
+					network->key->ssid_len,
 					network->psk) < 0) {
 		l_free(network->psk);
 		network->psk = NULL;
@@ -488,11 +527,12 @@ void network_set_info(struct network *network, struct network_info *info)
 {
 	if (info) {
 		network->info = info;
-		network->info->seen_count++;
+		known_network_seen_count_inc(network->info);
 
 		l_queue_foreach(network->bss_list, add_known_frequency, info);
+		network_export(network);
 	} else {
-		network->info->seen_count--;
+		known_network_seen_count_dec(network->info);
 		network->info = NULL;
 	}
 
@@ -612,48 +652,24 @@ void network_connect_failed(struct network *network, bool in_handshake)
 	l_queue_destroy(network->secrets, eap_secret_info_free);
 	network->secrets = NULL;
 
-	l_queue_clear(network->blacklist, NULL);
-}
-
-static bool hotspot_info_matches(struct network *network,
-					const struct network_info *info)
-{
-	struct scan_bss *bss;
-
-	if (!network->is_hs20 || !info->is_hotspot)
-		return false;
-
-	bss = network_bss_select(network, true);
-
-	if (network_info_match_hessid(info, bss->hessid))
-		return true;
-
-	if (network_info_match_roaming_consortium(info, bss->rc_ie,
-							bss->rc_ie[1] + 2,
-							NULL))
-		return true;
-
-	return false;
+	network_blacklist_clear(network);
 }
 
-static bool match_hotspot_network(const struct network_info *info,
-					void *user_data)
+bool network_bss_add(struct network *network, struct scan_bss *bss)
 {
-	struct network *network = user_data;
+	struct network_info *info;
 
-	if (!hotspot_info_matches(network, info))
+	if (!scan_bss_insert_ranked(network->bss_list, bss))
 		return false;
 
-	network_set_info(network, (struct network_info *) info);
+	network->unseen_scans = 0;
 
-	return true;
-}
-
-bool network_bss_add(struct network *network, struct scan_bss *bss)
-{
-	if (!l_queue_insert(network->bss_list, bss, scan_bss_rank_compare,
-									NULL))
-		return false;
+	/*
+	 * In the unlikely case of a duplicate BSSID (e.g. the same BSS seen
+	 * on two frequencies) the index keeps pointing at the first one
+	 */
+	if (!l_hashtab_lookup(network->bss_index, bss->addr))
+		l_hashtab_insert(network->bss_index, bss->addr, bss);
 
 	if (network->info)
 		known_network_add_frequency(network->info, bss->frequency);
@@ -668,18 +684,13 @@ bool network_bss_add(struct network *network, struct scan_bss *bss)
 		return true;
 
 	/* Set the network_info to a matching hotspot entry, if found */
-	known_networks_foreach(match_hotspot_network, network);
+	info = hotspot_find_by_bss(network_bss_select(network, true));
+	if (info)
+		network_set_info(network, info);
 
 	return true;
 }
 
-static bool match_addr(const void *a, const void *b)
-{
-	const struct scan_bss *bss = a;
-
-	return memcmp(bss->addr, b, 6) == 0;
-}
-
 /*
  * Replaces an old scan_bss (if exists) in the bss list with a new bss object.
  * Note this BSS is *not* freed and must be by the caller. scan_bss objects are
@@ -687,13 +698,26 @@ static bool match_addr(const void *a, const void *b)
  */
 bool network_bss_update(struct network *network, struct scan_bss *bss)
 {
-	l_queue_remove_if(network->bss_list, match_addr, bss->addr);
+	struct scan_bss *old = l_hashtab_remove(network->bss_index, bss->addr);
+
+	if (old)
+		l_queue_remove(network->bss_list, old);
 
 	l_queue_insert(network->bss_list, bss, scan_bss_rank_compare, NULL);
+	l_hashtab_insert(network->bss_index, bss->addr, bss);
 
 	return true;
 }
 
+void network_bss_set_frequency(struct network *network, struct scan_bss *bss,
+				uint32_t frequency)
+{
+	bss->frequency = frequency;
+
+	if (network->info)
+		known_network_add_frequency(network->info, frequency);
+}
+
 bool network_bss_list_isempty(struct network *network)
 {
 	return l_queue_isempty(network->bss_list);
@@ -703,22 +727,25 @@ void network_bss_list_clear(struct network *network)
 {
 	l_queue_destroy(network->bss_list, NULL);
 	network->bss_list = l_queue_new();
+
+	l_hashtab_destroy(network->bss_index, NULL);
+	network->bss_index = network_bss_index_new();
 }
 
 struct scan_bss *network_bss_list_pop(struct network *network)
 {
-	return l_queue_pop_head(network->bss_list);
+	struct scan_bss *bss = l_queue_pop_head(network->bss_list);
+
+	if (bss && l_hashtab_lookup(network->bss_index, bss->addr) == bss)
+		l_hashtab_remove(network->bss_index, bss->addr);
+
+	return bss;
 }
 
 struct scan_bss *network_bss_find_by_addr(struct network *network,
 						const uint8_t *addr)
 {
-	return l_queue_find(network->bss_list, match_addr, addr);
-}
-
-static bool match_bss(const void *a, const void *b)
-{
-	return a == b;
+	return l_hashtab_lookup(network->bss_index, addr);
 }
 
 bool network_has_erp_identity(struct network *network)
@@ -745,13 +772,15 @@ bool network_has_erp_identity(struct network *network)
 
 	identity = erp_cache_entry_get_identity(cache);
 
-	ret = strcmp(check_id, identity) == 0;
+	ret = strcmp(check_id, identity) == 0 &&
+		erp_cache_entry_check_profile(cache, settings);
 
 	l_free(check_id);
 	erp_cache_put(cache);
 
 	/*
-	 * The settings file must have change out from under us. In this
+	 * The settings file must have change out from under us, possibly
+	 * while iwd was not running if the entry was persisted. In this
 	 * case we want to remove the ERP entry because it is no longer
 	 * valid.
 	 */
@@ -761,14 +790,40 @@ bool network_has_erp_identity(struct network *network)
 	return ret;
 }
 
+/*
+ * The wiphy_can_connect() verdict only depends on the wiphy and on the
+ * BSS's IEs, so it is worked out once per scan_bss instead of parsing the
+ * RSNE on every selection.  Only the FILS AKMs depend on the ERP identity
+ * hint, which is costly to look up, so that is done only for the BSSes
+ * where it changes the verdict.
+ */
+static bool network_bss_can_connect(struct network *network,
+					struct scan_bss *bss, int *fils_hint)
+{
+	if (!bss->connect_checked) {
+		struct wiphy *wiphy = station_get_wiphy(network->station);
+
+		bss->can_connect = wiphy_can_connect(wiphy, bss, false);
+		bss->can_connect_fils = wiphy_can_connect(wiphy, bss, true);
+		bss->connect_checked = true;
+	}
+
+	if (bss->can_connect == bss->can_connect_fils)
+		return bss->can_connect;
+
+	if (*fils_hint < 0)
+		*fils_hint = network_has_erp_identity(network);
+
+	return *fils_hint ? bss->can_connect_fils : bss->can_connect;
+}
+
 struct scan_bss *network_bss_select(struct network *network,
 						bool fallback_to_blacklist)
 {
 	struct l_queue *bss_list = network->bss_list;
-	struct wiphy *wiphy = station_get_wiphy(network->station);
 	const struct l_queue_entry *bss_entry;
 	struct scan_bss *candidate = NULL;
-	bool fils_hint = network_has_erp_identity(network);
+	int fils_hint = -1;
 
 	for (bss_entry = l_queue_get_entries(bss_list); bss_entry;
 			bss_entry = bss_entry->next) {
@@ -777,7 +832,8 @@ struct scan_bss *network_bss_select(struct network *network,
 		switch (network_get_security(network)) {
 		case SECURITY_PSK:
 		case SECURITY_8021X:
-			if (!wiphy_can_connect(wiphy, bss, fils_hint))
+			if (!network_bss_can_connect(network, bss,
+							&fils_hint))
 				continue;
 			/* fall through */
 		case SECURITY_NONE:
@@ -795,7 +851,7 @@ struct scan_bss *network_bss_select(struct network *network,
 			candidate = bss;
 
 		/* check if temporarily blacklisted */
-		if (l_queue_find(network->blacklist, match_bss, bss))
+		if (bss->temp_blacklisted)
 			continue;
 
 		if (!blacklist_contains_bss(bss->addr))
@@ -1239,7 +1295,7 @@ static struct l_dbus_message *network_connect(struct l_dbus *dbus,
 			network->connect_after_anqp =
 						l_dbus_message_ref(message);
 			l_debug("Pending ANQP request, delaying connect to %s",
-						network->ssid);
+						network->key->ssid);
 			return NULL;
 		}
 
@@ -1296,9 +1352,13 @@ struct l_dbus_message *network_connect_new_hidden_network(
 	return dbus_error_not_supported(message);
 }
 
+/*
+ * The temporary blacklist is a flag on the scan_bss objects.  A fresh
+ * scan_bss for the same BSS, from a new scan, starts out not blacklisted.
+ */
 void network_blacklist_add(struct network *network, struct scan_bss *bss)
 {
-	l_queue_push_head(network->blacklist, bss);
+	bss->temp_blacklisted = true;
 }
 
 const struct iovec *network_get_extra_ies(struct network *network,
@@ -1381,8 +1441,19 @@ static bool network_property_get_known_network(struct l_dbus *dbus,
 	return true;
 }
 
-bool network_register(struct network *network, const char *path)
+/*
+ * Registers the network's object on D-Bus, if not done yet.  With
+ * [General].LazyNetworkRegistration this is deferred until the object is
+ * needed: the network is known, about to be connected to or was listed
+ * by GetOrderedNetworks.
+ */
+bool network_export(struct network *network)
 {
+	const char *path = network->object_path;
+
+	if (network->exported)
+		return true;
+
 	if (!l_dbus_object_add_interface(dbus_get_bus(), path,
 					IWD_NETWORK_INTERFACE, network)) {
 		l_info("Unable to register %s interface",
@@ -1395,11 +1466,50 @@ bool network_register(struct network *network, const char *path)
 		l_info("Unable to register %s interface",
 						L_DBUS_INTERFACE_PROPERTIES);
 
-	network->object_path = l_strdup(path);
+	network->exported = true;
 
 	return true;
 }
 
+bool network_is_exported(const struct network *network)
+{
+	return network->exported;
+}
+
+bool network_register(struct network *network, const char *path)
+{
+	network->object_path = l_strdup(path);
+
+	if (lazy_registration && !network->info)
+		return true;
+
+	if (network_export(network))
+		return true;
+
+	l_free(network->object_path);
+	network->object_path = NULL;
+
+	return false;
+}
+
+/*
+ * Called when a scan found none of the network's BSSs, returns whether
+ * the network should be kept anyway.  With lazy registration, registered
+ * networks are kept for a few scans so that networks at the edge of the
+ * range don't cause an InterfacesRemoved/InterfacesAdded pair on every
+ * other scan.
+ */
+bool network_unseen(struct network *network)
+{
+	if (!lazy_registration || !network->exported)
+		return false;
+
+	/* Out of the ranking until seen again, see network_rank_update */
+	network->rank_inputs.valid = false;
+
+	return ++network->unseen_scans < NETWORK_UNSEEN_MAX_SCANS;
+}
+
 static void network_unregister(struct network *network, int reason)
 {
 	struct l_dbus *dbus = dbus_get_bus();
@@ -1407,10 +1517,12 @@ static void network_unregister(struct network *network, int reason)
 	agent_request_cancel(network->agent_request, reason);
 	network_settings_close(network);
 
-	l_dbus_unregister_object(dbus, network->object_path);
+	if (network->exported)
+		l_dbus_unregister_object(dbus, network->object_path);
 
 	l_free(network->object_path);
 	network->object_path = NULL;
+	network->exported = false;
 }
 
 void network_remove(struct network *network, int reason)
@@ -1422,10 +1534,10 @@ void network_remove(struct network *network, int reason)
 	network->secrets = NULL;
 
 	if (network->info)
-		network->info->seen_count -= 1;
+		known_network_seen_count_dec(network->info);
 
 	l_queue_destroy(network->bss_list, NULL);
-	l_queue_destroy(network->blacklist, NULL);
+	l_hashtab_destroy(network->bss_index, NULL);
 
 	if (network->nai_realms)
 		l_strv_free(network->nai_realms);
@@ -1433,9 +1545,17 @@ void network_remove(struct network *network, int reason)
 	if (network->rc_ie)
 		l_free(network->rc_ie);
 
+	network_key_unref(network->key);
+
+	IWD_COUNTER_DEC(network);
 	l_free(network);
 }
 
+int network_get_rank(const struct network *network)
+{
+	return network->rank;
+}
+
 int network_rank_compare(const void *a, const void *b, void *user)
 {
 	const struct network *new_network = a;
@@ -1444,14 +1564,10 @@ int network_rank_compare(const void *a, const void *b, void *user)
 	return (network->rank > new_network->rank) ? 1 : -1;
 }
 
-void network_rank_update(struct network *network, bool connected)
+static void __network_rank_update(struct network *network,
+					const struct scan_bss *best_bss,
+					bool connected)
 {
-	/*
-	 * Theoretically there may be difference between the BSS selection
-	 * here and in network_bss_select but those should be rare cases.
-	 */
-	struct scan_bss *best_bss = l_queue_peek_head(network->bss_list);
-
 	/*
 	 * The rank should separate networks into four groups that use
 	 * non-overlapping ranges for:
@@ -1487,6 +1603,43 @@ void network_rank_update(struct network *network, bool connected)
 		network->rank = best_bss->rank;
 }
 
+/*
+ * Returns whether the rank has changed or was computed for the first time
+ * since the network was last in range.  The rank is only recomputed if the
+ * best BSS's rank, the known network state or the order of the known
+ * networks changed since the last call, as known_network_offset() is linear
+ * in the number of known networks.
+ */
+bool network_rank_update(struct network *network, bool connected)
+{
+	/*
+	 * Theoretically there may be difference between the BSS selection
+	 * here and in network_bss_select but those should be rare cases.
+	 */
+	struct scan_bss *best_bss = l_queue_peek_head(network->bss_list);
+	uint32_t offset_gen = known_networks_offset_generation();
+	int old_rank = network->rank;
+	bool first = !network->rank_inputs.valid;
+
+	if (!first &&
+			network->rank_inputs.connected == connected &&
+			network->rank_inputs.bss_rank == best_bss->rank &&
+			network->rank_inputs.info == network->info &&
+			(!network->info ||
+			 network->rank_inputs.offset_gen == offset_gen))
+		return false;
+
+	network->rank_inputs.valid = true;
+	network->rank_inputs.connected = connected;
+	network->rank_inputs.bss_rank = best_bss->rank;
+	network->rank_inputs.info = network->info;
+	network->rank_inputs.offset_gen = offset_gen;
+
+	__network_rank_update(network, best_bss, connected);
+
+	return first || network->rank != old_rank;
+}
+
 static void network_unset_hotspot(struct network *network, void *user_data)
 {
 	struct network_info *info = user_data;
@@ -1523,11 +1676,38 @@ static void emit_known_network_removed(struct station *station, void *user_data)
 		station_hide_network(station, network);
 }
 
+static bool network_bss_matches_hotspot(const void *a, const void *b)
+{
+	return hotspot_bss_matches(b, a);
+}
+
 static void network_update_hotspot(struct network *network, void *user_data)
 {
 	struct network_info *info = user_data;
+	struct network_info *best;
+
+	if (!network->is_hs20)
+		return;
 
-	match_hotspot_network(info, network);
+	/*
+	 * Only the networks using @info or with a BSS advertising its
+	 * HESSID or Roaming Consortium can be affected by a change to it,
+	 * skip the BSS selection for all the others.
+	 */
+	if (network->info != info && !l_queue_find(network->bss_list,
+						network_bss_matches_hotspot,
+						info))
+		return;
+
+	best = hotspot_find_by_bss(network_bss_select(network, true));
+	if (best == network->info)
+		return;
+
+	if (network->info)
+		network_set_info(network, NULL);
+
+	if (best)
+		network_set_info(network, best);
 }
 
 static void match_known_network(struct station *station, void *user_data)
@@ -1548,6 +1728,21 @@ static void match_known_network(struct station *station, void *user_data)
 	station_network_foreach(station, network_update_hotspot, info);
 }
 
+static void match_updated_hotspot(struct station *station, void *user_data)
+{
+	struct network_info *info = user_data;
+	struct network *connected_network =
+				station_get_connected_network(station);
+	bool was_connected = connected_network &&
+				connected_network->info == info;
+
+	station_network_foreach(station, network_update_hotspot, info);
+
+	/* The config no longer applies to the network we're connected to */
+	if (was_connected && !connected_network->info)
+		station_disconnect(station);
+}
+
 static void known_networks_changed(enum known_networks_event event,
 					const struct network_info *info,
 					void *user_data)
@@ -1562,6 +1757,9 @@ static void known_networks_changed(enum known_networks_event event,
 	case KNOWN_NETWORKS_EVENT_REMOVED:
 		station_foreach(emit_known_network_removed, (void *) info);
 		break;
+	case KNOWN_NETWORKS_EVENT_UPDATED:
+		station_foreach(match_updated_hotspot, (void *) info);
+		break;
 	}
 }
 
@@ -1573,7 +1771,7 @@ static void anqp_watch_changed(enum station_anqp_state state,
 	if (state == STATION_ANQP_FINISHED && network->connect_after_anqp) {
 		struct l_dbus_message *reply;
 
-		l_debug("ANQP complete, resuming connect to %s", network->ssid);
+		l_debug("ANQP complete, resuming connect to %s", network->key->ssid);
 
 		if (!network_settings_load(network)) {
 			reply = dbus_error_not_configured(
@@ -1629,6 +1827,11 @@ static int network_init(void)
 
 	anqp_watch = station_add_anqp_watch(anqp_watch_changed, NULL, NULL);
 
+	if (!l_settings_get_bool(iwd_get_config(), "General",
+					"LazyNetworkRegistration",
+					&lazy_registration))
+		lazy_registration = false;
+
 	return 0;
 }
 
@@ -24,6 +24,7 @@
 #include <time.h>
 
 enum security;
+struct network_key;
 struct device;
 struct station;
 struct network;
@@ -39,6 +40,7 @@ struct network *network_create(struct station *station, const char *ssid,
 const char *network_get_ssid(const struct network *network);
 const char *network_get_path(const struct network *network);
 enum security network_get_security(const struct network *network);
+const struct network_key *network_get_key(const struct network *network);
 const uint8_t *network_get_psk(struct network *network);
 const char *network_get_passphrase(const struct network *network);
 bool network_set_passphrase(struct network *network, const char *passphrase);
@@ -56,6 +58,8 @@ int network_autoconnect(struct network *network, struct scan_bss *bss);
 void network_connect_failed(struct network *network, bool in_handshake);
 bool network_bss_add(struct network *network, struct scan_bss *bss);
 bool network_bss_update(struct network *network, struct scan_bss *bss);
+void network_bss_set_frequency(struct network *network, struct scan_bss *bss,
+				uint32_t frequency);
 bool network_bss_list_isempty(struct network *network);
 void network_bss_list_clear(struct network *network);
 struct scan_bss *network_bss_list_pop(struct network *network);
@@ -65,11 +69,15 @@ struct scan_bss *network_bss_select(struct network *network,
 					bool fallback_to_blacklist);
 
 bool network_register(struct network *network, const char *path);
+bool network_export(struct network *network);
+bool network_is_exported(const struct network *network);
+bool network_unseen(struct network *network);
 
 void network_remove(struct network *network, int reason);
 
+int network_get_rank(const struct network *network);
 int network_rank_compare(const void *a, const void *b, void *user);
-void network_rank_update(struct network *network, bool connected);
+bool network_rank_update(struct network *network, bool connected);
 
 struct l_dbus_message *network_connect_new_hidden_network(
 						struct network *network,
@@ -138,6 +138,8 @@ static attr_handler handler_for_type(enum nl80211_attrs type)
 	case NL80211_ATTR_ACK:
 		return extract_flag;
 	case NL80211_ATTR_WIPHY_FREQ:
+	case NL80211_ATTR_CHANNEL_WIDTH:
+	case NL80211_ATTR_CENTER_FREQ1:
 		return extract_uint32;
 	default:
 		break;
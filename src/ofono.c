@@ -65,12 +65,18 @@
 #define OFONO_USIM_APPLICATION_IFACE	"org.ofono.USimApplication"
 #define OFONO_ISIM_APPLICATION_IFACE	"org.ofono.ISimApplication"
 
+/*
+ * oFono runs one SimAuthentication request per modem at a time and rejects
+ * any others as busy.  Requests are therefore queued here, the one at the
+ * head being in flight, and the next one is sent as soon as a reply arrives.
+ */
 struct sa_data {
 	char *umts_app_path;
 	char *ims_app_path;
 
-	struct user_cb *pending;
+	struct l_queue *requests;
 	uint32_t serial;
+	int next_id;
 };
 
 struct ofono_modem {
@@ -85,9 +91,12 @@ struct ofono_modem {
 	struct iwd_sim_auth *auth;
 };
 
-struct user_cb {
+struct sa_request {
+	int id;
+	struct l_dbus_message *message;
 	void *cb;
 	void *data;
+	int num_rands;
 	bool is_gsm : 1;
 };
 
@@ -96,24 +105,108 @@ static uint32_t modem_add_watch;
 static uint32_t modem_removed_watch;
 static struct l_queue *modems;
 
-static struct user_cb *new_cb(void *func, void *data, bool is_gsm)
+static void sa_request_free(void *data)
 {
-	struct user_cb *cbd = l_new(struct user_cb, 1);
+	struct sa_request *req = data;
+
+	l_dbus_message_unref(req->message);
+	l_free(req);
+}
+
+static bool sa_request_match_id(const void *a, const void *b)
+{
+	const struct sa_request *req = a;
+
+	return req->id == L_PTR_TO_INT(b);
+}
+
+static void sa_request_fail(struct sa_request *req)
+{
+	if (req->is_gsm) {
+		sim_auth_run_gsm_cb_t cb = req->cb;
+
+		cb(NULL, NULL, req->data);
+	} else {
+		sim_auth_check_milenage_cb_t cb = req->cb;
+
+		cb(NULL, NULL, NULL, NULL, req->data);
+	}
+}
+
+static void gsm_auth_cb(struct l_dbus_message *reply, void *user_data);
+static void ims_auth_cb(struct l_dbus_message *reply, void *user_data);
+
+static bool sa_request_send(struct sa_data *sa_data, struct sa_request *req)
+{
+	struct l_dbus_message *message = req->message;
+
+	req->message = NULL;
+	sa_data->serial = l_dbus_send_with_reply(dbus_get_bus(), message,
+					req->is_gsm ? gsm_auth_cb : ims_auth_cb,
+					sa_data, NULL);
+
+	return sa_data->serial != 0;
+}
+
+/* Sends the request at the head of the queue, if any */
+static void sa_request_next(struct sa_data *sa_data)
+{
+	struct sa_request *req;
+
+	while ((req = l_queue_peek_head(sa_data->requests))) {
+		if (sa_request_send(sa_data, req))
+			return;
+
+		l_queue_pop_head(sa_data->requests);
+		sa_request_fail(req);
+		sa_request_free(req);
+	}
+}
+
+static int sa_request_submit(struct sa_data *sa_data, bool is_gsm,
+				struct l_dbus_message *message,
+				int num_rands, void *cb, void *data)
+{
+	struct sa_request *req = l_new(struct sa_request, 1);
+
+	if (sa_data->next_id <= 0)
+		sa_data->next_id = 1;
+
+	req->id = sa_data->next_id++;
+	req->message = message;
+	req->cb = cb;
+	req->data = data;
+	req->num_rands = num_rands;
+	req->is_gsm = is_gsm;
 
-	cbd->cb = func;
-	cbd->data = data;
-	cbd->is_gsm = is_gsm;
+	l_queue_push_tail(sa_data->requests, req);
 
-	return cbd;
+	if (l_queue_length(sa_data->requests) > 1) {
+		l_debug("Queued auth request %d", req->id);
+		return req->id;
+	}
+
+	if (!sa_request_send(sa_data, req)) {
+		l_queue_remove(sa_data->requests, req);
+		sa_request_free(req);
+		return -EIO;
+	}
+
+	return req->id;
 }
 
-static void free_cb(void *ptr)
+/*
+ * Takes the request the reply is for off the queue and sends the next one
+ * before the reply is processed, to keep the modem busy.
+ */
+static struct sa_request *sa_request_complete(struct sa_data *sa_data)
 {
-	struct sa_data *sa_data = ptr;
+	struct sa_request *req = l_queue_pop_head(sa_data->requests);
 
-	l_free(sa_data->pending);
-	sa_data->pending = NULL;
 	sa_data->serial = 0;
+	sa_request_next(sa_data);
+
+	return req;
 }
 
 /*
@@ -157,8 +250,8 @@ static bool append_byte_array(struct l_dbus_message_builder *builder,
 static void ims_auth_cb(struct l_dbus_message *reply, void *user_data)
 {
 	struct sa_data *sa_data = user_data;
-	struct user_cb *cbd = sa_data->pending;
-	sim_auth_check_milenage_cb_t cb = cbd->cb;
+	struct sa_request *req = sa_request_complete(sa_data);
+	sim_auth_check_milenage_cb_t cb = req->cb;
 	struct l_dbus_message_iter properties;
 	struct l_dbus_message_iter value;
 	const char *prop;
@@ -189,25 +282,25 @@ static void ims_auth_cb(struct l_dbus_message *reply, void *user_data)
 			if (!get_byte_array(&value, auts, 14))
 				goto end;
 
-			cb(NULL, NULL, NULL, auts, cbd->data);
-
-			return;
+			cb(NULL, NULL, NULL, auts, req->data);
+			goto done;
 		}
 	}
 
-	cb(res, ck, ik, NULL, cbd->data);
-
-	return;
+	cb(res, ck, ik, NULL, req->data);
+	goto done;
 
 end:
-	cb(NULL, NULL, NULL, NULL, cbd->data);
+	cb(NULL, NULL, NULL, NULL, req->data);
+done:
+	sa_request_free(req);
 }
 
 static void gsm_auth_cb(struct l_dbus_message *reply, void *user_data)
 {
 	struct sa_data *sa_data = user_data;
-	struct user_cb *cbd = sa_data->pending;
-	sim_auth_run_gsm_cb_t cb = cbd->cb;
+	struct sa_request *req = sa_request_complete(sa_data);
+	sim_auth_run_gsm_cb_t cb = req->cb;
 	struct l_dbus_message_iter array;
 	struct l_dbus_message_iter val;
 	struct l_dbus_message_iter dict;
@@ -227,7 +320,8 @@ static void gsm_auth_cb(struct l_dbus_message *reply, void *user_data)
 
 	while (l_dbus_message_iter_next_entry(&array, &dict)) {
 		while (l_dbus_message_iter_next_entry(&dict, &prop, &val)) {
-			if (sres_pos > NUM_RANDS_MAX || kc_pos > NUM_RANDS_MAX)
+			if (sres_pos >= req->num_rands ||
+					kc_pos >= req->num_rands)
 				goto end;
 
 			if (!strcmp(prop, "SRES")) {
@@ -242,12 +336,16 @@ static void gsm_auth_cb(struct l_dbus_message *reply, void *user_data)
 		}
 	}
 
-	cb((const uint8_t *)sres, (const uint8_t *)kc, cbd->data);
+	if (sres_pos != req->num_rands || kc_pos != req->num_rands)
+		goto end;
 
-	return;
+	cb((const uint8_t *)sres, (const uint8_t *)kc, req->data);
+	goto done;
 
 end:
-	cb(NULL, NULL, cbd->data);
+	cb(NULL, NULL, req->data);
+done:
+	sa_request_free(req);
 }
 
 static int ofono_sim_auth_run_gsm(struct iwd_sim_auth *auth,
@@ -265,13 +363,6 @@ static int ofono_sim_auth_run_gsm(struct iwd_sim_auth *auth,
 		return -EINVAL;
 	}
 
-	if (sa_data->pending) {
-		l_debug("Modem already has outstanding auth request");
-		return -EBUSY;
-	}
-
-	sa_data->pending = new_cb(cb, data, true);
-
 	message = l_dbus_message_new_method_call(dbus, "org.ofono",
 			sa_data->umts_app_path, OFONO_USIM_APPLICATION_IFACE,
 			"GsmAuthenticate");
@@ -292,19 +383,13 @@ static int ofono_sim_auth_run_gsm(struct iwd_sim_auth *auth,
 	if (!l_dbus_message_builder_finalize(builder))
 		goto error;
 
-	sa_data->serial = l_dbus_send_with_reply(dbus, message, gsm_auth_cb,
-			sa_data, free_cb);
-	if (!sa_data->serial)
-		goto error;
-
 	l_dbus_message_builder_destroy(builder);
 
-	return 0;
+	return sa_request_submit(sa_data, true, message, num_rands, cb, data);
 
 error:
 	l_dbus_message_builder_destroy(builder);
-	l_free(sa_data->pending);
-	sa_data->pending = NULL;
+	l_dbus_message_unref(message);
 
 	return -EIO;
 }
@@ -321,13 +406,6 @@ static int ofono_sim_auth_check_milenage(struct iwd_sim_auth *auth,
 	struct l_dbus_message *message;
 	struct l_dbus_message_builder *builder;
 
-	if (sa_data->pending) {
-		l_debug("Modem already has outstanding auth request");
-		return -EBUSY;
-	}
-
-	sa_data->pending = new_cb(cb, data, false);
-
 	/*
 	 * If ISIM is not available, run on USIM application
 	 */
@@ -353,19 +431,13 @@ static int ofono_sim_auth_check_milenage(struct iwd_sim_auth *auth,
 	if (!l_dbus_message_builder_finalize(builder))
 		goto error;
 
-	sa_data->serial = l_dbus_send_with_reply(dbus, message, ims_auth_cb,
-			sa_data, free_cb);
-	if (!sa_data->serial)
-		goto error;
-
 	l_dbus_message_builder_destroy(builder);
 
-	return 0;
+	return sa_request_submit(sa_data, false, message, 0, cb, data);
 
 error:
 	l_dbus_message_builder_destroy(builder);
-	l_free(sa_data->pending);
-	sa_data->pending = NULL;
+	l_dbus_message_unref(message);
 
 	return -EIO;
 }
@@ -373,35 +445,34 @@ error:
 static void ofono_sim_auth_cancel_request(struct iwd_sim_auth *auth, int id)
 {
 	struct sa_data *sa_data = iwd_sim_auth_get_data(auth);
+	struct sa_request *req = l_queue_peek_head(sa_data->requests);
 
-	if (sa_data->pending) {
+	if (req && req->id == id) {
 		l_dbus_cancel(dbus_get_bus(), sa_data->serial);
-		sa_data->pending = NULL;
+		sa_request_free(sa_request_complete(sa_data));
+		return;
 	}
+
+	req = l_queue_remove_if(sa_data->requests, sa_request_match_id,
+					L_INT_TO_PTR(id));
+	if (req)
+		sa_request_free(req);
 }
 
+/*
+ * Outstanding requests are dropped without calling back, the users are
+ * notified through the unregistered watch instead.
+ */
 static void ofono_sim_auth_remove(struct iwd_sim_auth *auth)
 {
 	struct sa_data *sa_data = iwd_sim_auth_get_data(auth);
 
 	l_debug("removing auth data %p", sa_data);
 
-	if (sa_data->pending) {
-		struct user_cb *cbd = sa_data->pending;
-
-		if (cbd->is_gsm) {
-			sim_auth_run_gsm_cb_t cb = cbd->cb;
-
-			cb(NULL, NULL, cbd->data);
-		} else {
-			sim_auth_check_milenage_cb_t cb = cbd->cb;
-
-			cb(NULL, NULL, NULL, NULL, cbd->data);
-		}
-
+	if (sa_data->serial)
 		l_dbus_cancel(dbus_get_bus(), sa_data->serial);
-	}
 
+	l_queue_destroy(sa_data->requests, sa_request_free);
 	l_free(sa_data->ims_app_path);
 	l_free(sa_data->umts_app_path);
 	l_free(sa_data);
@@ -552,6 +623,7 @@ static void get_auth_props_cb(struct l_dbus_message *reply,
 			modem->auth = iwd_sim_auth_create(&ofono_driver);
 
 			sa_data = l_new(struct sa_data, 1);
+			sa_data->requests = l_queue_new();
 
 			iwd_sim_auth_set_data(modem->auth, sa_data);
 			iwd_sim_auth_set_nai(modem->auth, id);
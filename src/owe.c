@@ -32,6 +32,7 @@
 #include "src/owe.h"
 #include "src/mpdu.h"
 #include "src/auth-proto.h"
+#include "src/module.h"
 
 struct owe_sm {
 	struct auth_proto ap;
@@ -41,13 +42,117 @@ struct owe_sm {
 	struct l_ecc_point *public_key;
 	uint8_t retry;
 	uint16_t group;
-	const unsigned int *ecc_groups;
+	unsigned int ecc_groups[HANDSHAKE_MAX_ECC_GROUPS + 1];
 
 	owe_tx_authenticate_func_t auth_tx;
 	owe_tx_associate_func_t assoc_tx;
 	void *user_data;
 };
 
+/*
+ * A small pool of ephemeral key pairs generated in idle time, so that the
+ * scalar multiplication is off the critical path of the Association.  Each
+ * pair is used exactly once.
+ */
+#define OWE_KEY_POOL_SIZE	2
+
+struct owe_key_pair {
+	unsigned int group;
+	struct l_ecc_scalar *private;
+	struct l_ecc_point *public_key;
+};
+
+static struct l_queue *owe_key_pool;
+static struct l_idle *owe_key_pool_idle;
+static unsigned int owe_key_pool_group;
+
+static void owe_key_pair_free(void *data)
+{
+	struct owe_key_pair *pair = data;
+
+	l_ecc_scalar_free(pair->private);
+	l_ecc_point_free(pair->public_key);
+	l_free(pair);
+}
+
+static bool owe_key_pair_match_group(const void *a, const void *b)
+{
+	const struct owe_key_pair *pair = a;
+
+	return pair->group == L_PTR_TO_UINT(b);
+}
+
+static void owe_key_pool_refill(struct l_idle *idle, void *user_data)
+{
+	const struct l_ecc_curve *curve =
+			l_ecc_curve_get_ike_group(owe_key_pool_group);
+	struct owe_key_pair *pair = l_new(struct owe_key_pair, 1);
+
+	/* One pair per iteration to keep the main loop responsive */
+	pair->group = owe_key_pool_group;
+
+	if (!curve || !l_ecdh_generate_key_pair(curve, &pair->private,
+							&pair->public_key)) {
+		l_free(pair);
+		goto done;
+	}
+
+	l_queue_push_tail(owe_key_pool, pair);
+
+	if (l_queue_length(owe_key_pool) < OWE_KEY_POOL_SIZE)
+		return;
+
+done:
+	l_idle_remove(owe_key_pool_idle);
+	owe_key_pool_idle = NULL;
+}
+
+static void owe_key_pool_prepare(unsigned int group)
+{
+	if (!owe_key_pool)
+		return;
+
+	/* Pairs for a group nobody asks for anymore are of no use */
+	if (group != owe_key_pool_group) {
+		l_queue_clear(owe_key_pool, owe_key_pair_free);
+		owe_key_pool_group = group;
+	}
+
+	if (owe_key_pool_idle ||
+			l_queue_length(owe_key_pool) >= OWE_KEY_POOL_SIZE)
+		return;
+
+	owe_key_pool_idle = l_idle_create(owe_key_pool_refill, NULL, NULL);
+}
+
+/*
+ * Hint that an OWE connection is likely to follow, e.g. an OWE network
+ * has been seen in the scan results.
+ */
+void owe_prepare_key_pairs(void)
+{
+	const unsigned int *groups = l_ecc_curve_get_supported_ike_groups();
+
+	/* Stay with the group of the last connection, it may be preferred */
+	owe_key_pool_prepare(owe_key_pool_group ?: groups[0]);
+}
+
+static bool owe_key_pool_take(struct owe_sm *owe)
+{
+	struct owe_key_pair *pair = l_queue_remove_if(owe_key_pool,
+					owe_key_pair_match_group,
+					L_UINT_TO_PTR(owe->group));
+
+	if (!pair)
+		return false;
+
+	owe->private = pair->private;
+	owe->public_key = pair->public_key;
+	l_free(pair);
+
+	return true;
+}
+
 static bool owe_reset(struct owe_sm *owe)
 {
 	/*
@@ -65,10 +170,14 @@ static bool owe_reset(struct owe_sm *owe)
 	if (owe->public_key)
 		l_ecc_point_free(owe->public_key);
 
-	if (!l_ecdh_generate_key_pair(owe->curve, &owe->private,
-					&owe->public_key))
+	if (!owe_key_pool_take(owe) &&
+			!l_ecdh_generate_key_pair(owe->curve, &owe->private,
+							&owe->public_key))
 		return false;
 
+	/* Have a fresh pair ready for the next connection or retry */
+	owe_key_pool_prepare(owe->group);
+
 	return true;
 }
 
@@ -323,6 +432,8 @@ static int owe_rx_associate(struct auth_proto *ap, const uint8_t *frame,
 		return -EBADMSG;
 	}
 
+	handshake_state_set_accepted_group(owe->hs, owe->group);
+
 	return 0;
 
 invalid_ies:
@@ -343,7 +454,7 @@ struct auth_proto *owe_sm_new(struct handshake_state *hs,
 	owe->auth_tx = auth;
 	owe->assoc_tx = assoc;
 	owe->user_data = user_data;
-	owe->ecc_groups = l_ecc_curve_get_supported_ike_groups();
+	handshake_state_get_ecc_groups(hs, owe->ecc_groups);
 
 	owe->ap.start = owe_start;
 	owe->ap.free = owe_free;
@@ -357,3 +468,21 @@ struct auth_proto *owe_sm_new(struct handshake_state *hs,
 
 	return &owe->ap;
 }
+
+static int owe_init(void)
+{
+	owe_key_pool = l_queue_new();
+
+	return 0;
+}
+
+static void owe_exit(void)
+{
+	l_idle_remove(owe_key_pool_idle);
+	owe_key_pool_idle = NULL;
+
+	l_queue_destroy(owe_key_pool, owe_key_pair_free);
+	owe_key_pool = NULL;
+}
+
+IWD_MODULE(owe, owe_init, owe_exit)
@@ -31,3 +31,5 @@ struct auth_proto *owe_sm_new(struct handshake_state *hs,
 				owe_tx_authenticate_func_t auth,
 				owe_tx_associate_func_t assoc,
 				void *user_data);
+
+void owe_prepare_key_pairs(void);
@@ -52,6 +52,7 @@
 #include "src/mpdu.h"
 #include "src/common.h"
 #include "src/wsc.h"
+#include "src/eap-wsc.h"
 #include "src/handshake.h"
 #include "src/crypto.h"
 #include "src/module.h"
@@ -59,6 +60,7 @@
 #include "src/nl80211util.h"
 #include "src/netconfig.h"
 #include "src/ap.h"
+#include "src/storage.h"
 #include "src/p2p.h"
 
 struct p2p_device {
@@ -77,15 +79,17 @@ struct p2p_device {
 	uint8_t listen_oper_class;
 	uint32_t listen_channel;
 	unsigned int scan_interval;
-	time_t next_scan_ts;
+	uint64_t next_scan_ts;
 	struct l_timeout *scan_timeout;
 	uint32_t scan_id;
-	unsigned int chans_per_scan;
-	unsigned int scan_chan_idx;
+	unsigned int scan_count;
+	/* Device Type we're looking for, category 0 if any */
+	struct wsc_primary_device_type discovery_type;
 	uint64_t roc_cookie;
 	unsigned int listen_duration;
 	struct l_queue *discovery_users;
 	struct l_queue *peer_list;
+	struct l_hashtab *peer_table;	/* peer_list indexed by address */
 	unsigned int next_tie_breaker;
 
 	struct p2p_peer *conn_peer;
@@ -133,6 +137,10 @@ struct p2p_device {
 	bool is_go : 1;
 	bool conn_go_tie_breaker : 1;
 	bool conn_peer_added : 1;
+	/* Both sides agreed to keep the group's credentials */
+	bool conn_persistent : 1;
+	/* A stored Persistent Group is being used, no WSC */
+	bool conn_reinvoked : 1;
 };
 
 struct p2p_discovery_user {
@@ -151,6 +159,8 @@ struct p2p_peer {
 	struct p2p_wfd_properties *wfd;
 	/* Whether peer is currently a GO */
 	bool group;
+	/* Whether peer was in the latest discovery scan results */
+	bool seen;
 };
 
 struct p2p_wfd_properties {
@@ -173,6 +183,8 @@ static struct l_queue *p2p_device_list;
 static struct l_settings *p2p_dhcp_settings;
 static struct p2p_wfd_properties *p2p_own_wfd;
 static unsigned int p2p_wfd_disconnect_watch;
+/* Persistent Groups we've been in, indexed by the peer's Device Address */
+static struct l_settings *p2p_persistent_groups;
 
 /*
  * For now we only scan the common 2.4GHz channels, to be replaced with
@@ -236,14 +248,6 @@ static inline bool p2p_peer_operational(struct p2p_peer *peer)
 		 (peer->dev->is_go && peer->dev->conn_peer_added));
 }
 
-static bool p2p_peer_match(const void *a, const void *b)
-{
-	const struct p2p_peer *peer = a;
-	const uint8_t *addr = b;
-
-	return !memcmp(peer->bss->addr, addr, 6);
-}
-
 static const char *p2p_peer_get_path(const struct p2p_peer *peer)
 {
 	static char path[256];
@@ -271,6 +275,9 @@ static void p2p_peer_put(void *user_data)
 {
 	struct p2p_peer *peer = user_data;
 
+	if (l_hashtab_lookup(peer->dev->peer_table, peer->bss->addr) == peer)
+		l_hashtab_remove(peer->dev->peer_table, peer->bss->addr);
+
 	/*
 	 * Removes all interfaces with one call, no need to call
 	 * wsc_dbus_remove_interface.
@@ -282,6 +289,90 @@ static void p2p_peer_put(void *user_data)
 static void p2p_device_discovery_start(struct p2p_device *dev);
 static void p2p_device_discovery_stop(struct p2p_device *dev);
 
+static void p2p_persistent_group_forget(struct p2p_peer *peer)
+{
+	const char *name = util_address_to_string(peer->device_addr);
+
+	if (!l_settings_remove_group(p2p_persistent_groups, name))
+		return;
+
+	l_debug("Forgetting Persistent Group with %s", name);
+	storage_p2p_groups_sync(p2p_persistent_groups);
+}
+
+/*
+ * Load the Persistent Group we've formed with @peer in the past, if any,
+ * into the connection state.  Our role is restored in dev->is_go.
+ */
+static bool p2p_persistent_group_load(struct p2p_device *dev,
+					struct p2p_peer *peer)
+{
+	const char *name = util_address_to_string(peer->device_addr);
+	L_AUTO_FREE_VAR(char *, ssid) = NULL;
+	L_AUTO_FREE_VAR(char *, addr_str) = NULL;
+	uint8_t addr[6];
+	uint8_t *psk;
+	size_t psk_len;
+	bool go;
+
+	if (!l_settings_has_group(p2p_persistent_groups, name))
+		return false;
+
+	ssid = l_settings_get_string(p2p_persistent_groups, name, "SSID");
+	addr_str = l_settings_get_string(p2p_persistent_groups, name,
+						"GroupAddress");
+	psk = l_settings_get_bytes(p2p_persistent_groups, name,
+					"PreSharedKey", &psk_len);
+
+	if (!ssid || strlen(ssid) > 32 || !addr_str ||
+			!util_string_to_address(addr_str, addr) ||
+			!psk || psk_len != 32 ||
+			!l_settings_get_bool(p2p_persistent_groups, name,
+						"GroupOwner", &go) ||
+			(go && memcmp(addr, dev->addr, 6))) {
+		l_error("Invalid Persistent Group for %s", name);
+
+		if (psk) {
+			explicit_bzero(psk, psk_len);
+			l_free(psk);
+		}
+
+		p2p_persistent_group_forget(peer);
+		return false;
+	}
+
+	l_strlcpy(dev->go_group_id.ssid, ssid, sizeof(dev->go_group_id.ssid));
+	memcpy(dev->go_group_id.device_addr, addr, 6);
+	memcpy(dev->conn_psk, psk, 32);
+	explicit_bzero(psk, psk_len);
+	l_free(psk);
+	dev->is_go = go;
+	return true;
+}
+
+static void p2p_persistent_group_save(struct p2p_device *dev)
+{
+	char name[18];
+
+	l_strlcpy(name, util_address_to_string(dev->conn_peer->device_addr),
+			sizeof(name));
+	l_debug("Saving Persistent Group %s with %s",
+		dev->go_group_id.ssid, name);
+
+	if (!p2p_persistent_groups)
+		p2p_persistent_groups = l_settings_new();
+
+	l_settings_set_string(p2p_persistent_groups, name, "SSID",
+				dev->go_group_id.ssid);
+	l_settings_set_string(p2p_persistent_groups, name, "GroupAddress",
+			util_address_to_string(dev->go_group_id.device_addr));
+	l_settings_set_bytes(p2p_persistent_groups, name, "PreSharedKey",
+				dev->conn_psk, 32);
+	l_settings_set_bool(p2p_persistent_groups, name, "GroupOwner",
+				dev->is_go);
+	storage_p2p_groups_sync(p2p_persistent_groups);
+}
+
 /* Callers should reserve 32 bytes, 64 with non-NULL @wfd_clients */
 static size_t p2p_build_wfd_ie(const struct p2p_wfd_properties *wfd,
 				const struct p2p_peer *wfd_client, uint8_t *buf)
@@ -594,6 +685,13 @@ static uint8_t *p2p_build_scan_ies(struct p2p_device *dev, uint8_t *buf,
 	l_strlcpy(wsc_info.device_name, dev->device_info.device_name,
 			sizeof(wsc_info.device_name));
 
+	/*
+	 * 3.2.2: Peers only reply if one of their Device Types matches
+	 * the Requested Device Type, saving us from handling the others.
+	 */
+	if (!dev->conn_peer)
+		wsc_info.requested_device_type = dev->discovery_type;
+
 	wsc_data = wsc_build_probe_request(&wsc_info, &wsc_data_size);
 	if (!wsc_data)
 		return NULL;
@@ -738,6 +836,8 @@ static void p2p_connection_reset(struct p2p_device *dev)
 	explicit_bzero(dev->conn_psk, 32);
 	dev->conn_retry_count = 0;
 	dev->is_go = false;
+	dev->conn_persistent = false;
+	dev->conn_reinvoked = false;
 
 	if (dev->enabled && !dev->start_stop_cmd_id &&
 			!l_queue_isempty(dev->discovery_users))
@@ -850,10 +950,22 @@ static const struct frame_xchg_prefix p2p_frame_pd_resp = {
 	.len = 7,
 };
 
+static const struct frame_xchg_prefix p2p_frame_invitation_resp = {
+	/* Management -> Public Action -> P2P -> Invitation Response */
+	.data = (uint8_t []) {
+		0x04, 0x09, 0x50, 0x6f, 0x9a, 0x09,
+		P2P_ACTION_INVITATION_RESP
+	},
+	.len = 7,
+};
+
 static void p2p_peer_connect_done(struct p2p_device *dev)
 {
 	struct p2p_peer *peer = dev->conn_peer;
 
+	if (dev->conn_persistent && !dev->conn_reinvoked)
+		p2p_persistent_group_save(dev);
+
 	if (!dev->is_go) {
 		/* We can free anything potentially needed for a retry */
 		scan_bss_free(dev->conn_wsc_bss);
@@ -892,7 +1004,9 @@ static void p2p_group_event(enum ap_event_type type, const void *event_data,
 		break;
 
 	case AP_EVENT_STARTED:
-		ap_push_button(dev->group);
+		if (!dev->conn_reinvoked)
+			ap_push_button(dev->group);
+
 		break;
 
 	case AP_EVENT_STATION_ADDED:
@@ -940,6 +1054,21 @@ static void p2p_group_event(enum ap_event_type type, const void *event_data,
 		 * Most of this duplicates the information we already have in
 		 * dev->conn_peer.
 		 */
+		/*
+		 * Without WSC anyone who has the PSK may have associated,
+		 * make sure it's the peer we've invited.
+		 */
+		if (dev->conn_reinvoked) {
+			memcpy(dev->conn_peer_interface_addr, data->mac, 6);
+
+			if (memcmp(req_info.device_info.device_addr,
+					dev->conn_peer->device_addr, 6)) {
+				l_error("Unexpected P2P Client associated");
+				p2p_clear_association_req(&req_info);
+				goto invalid_ie;
+			}
+		}
+
 		dev->conn_peer_capability = req_info.capability;
 		dev->conn_peer_dev_info = req_info.device_info;
 		p2p_clear_association_req(&req_info);
@@ -1188,7 +1317,6 @@ static const struct ap_ops p2p_go_ops = {
 static void p2p_group_start(struct p2p_device *dev)
 {
 	struct l_settings *config = l_settings_new();
-	uint8_t psk[32];
 	char *macs[2] = {};
 	const struct wsc_primary_device_type *pdt =
 		&dev->device_info.primary_device_type;
@@ -1210,9 +1338,12 @@ static void p2p_group_start(struct p2p_device *dev)
 	 * Section 3.1.4.4: "It shall only allow association by the
 	 * P2P Device that it is currently in Group Formation with."
 	 */
-	macs[0] = (char *) util_address_to_string(
+	if (!dev->conn_reinvoked) {
+		macs[0] = (char *) util_address_to_string(
 						dev->conn_peer_interface_addr);
-	l_settings_set_string_list(config, "WSC", "AuthorizedMACs", macs, ',');
+		l_settings_set_string_list(config, "WSC", "AuthorizedMACs",
+						macs, ',');
+	}
 
 	/*
 	 * Section 3.2.1: "The Credentials for a P2P Group issued to a
@@ -1225,20 +1356,28 @@ static void p2p_group_start(struct p2p_device *dev)
 	 * a passphrase.  We have no practical use for the passphrase and
 	 * it's a little costlier to generate for the same cryptographic
 	 * strength as the PSK.
+	 *
+	 * A re-invoked Persistent Group keeps its original PSK.
 	 */
-	if (!l_getrandom(psk, 32)) {
+	if (!dev->conn_reinvoked && !l_getrandom(dev->conn_psk, 32)) {
 		l_error("l_getrandom() failed");
 		l_settings_free(config);
 		p2p_connect_failed(dev);
 		return;
 	}
 
-	l_settings_set_bytes(config, "Security", "PreSharedKey", psk, 32);
+	l_settings_set_bytes(config, "Security", "PreSharedKey",
+				dev->conn_psk, 32);
 
 	l_settings_add_group(config, "IPv4");
 
 	dev->capability.group_caps |= P2P_GROUP_CAP_GO;
-	dev->capability.group_caps |= P2P_GROUP_CAP_GROUP_FORMATION;
+
+	if (!dev->conn_reinvoked)
+		dev->capability.group_caps |= P2P_GROUP_CAP_GROUP_FORMATION;
+
+	if (dev->conn_persistent)
+		dev->capability.group_caps |= P2P_GROUP_CAP_PERSISTENT_GROUP;
 
 	dev->group = ap_start(dev->conn_netdev, config, &p2p_go_ops, NULL, dev);
 	l_settings_free(config);
@@ -1333,6 +1472,14 @@ static void p2p_netdev_connect_cb(struct netdev *netdev,
 	case NETDEV_RESULT_ASSOCIATION_FAILED:
 	case NETDEV_RESULT_HANDSHAKE_FAILED:
 	case NETDEV_RESULT_KEY_SETTING_FAILED:
+		/*
+		 * The GO no longer accepts our stored PSK, the next
+		 * connection will have to go through WSC again.
+		 */
+		if (dev->conn_reinvoked &&
+				result == NETDEV_RESULT_HANDSHAKE_FAILED)
+			p2p_persistent_group_forget(peer);
+
 		/*
 		 * In the AUTHENTICATION_FAILED and ASSOCIATION_FAILED
 		 * cases there's nothing to disconnect.  In the
@@ -1671,6 +1818,8 @@ static void p2p_device_netdev_notify(struct netdev *netdev,
 
 		if (dev->is_go)
 			p2p_group_start(dev);
+		else if (dev->conn_reinvoked)
+			p2p_try_connect_group(dev);
 		else
 			p2p_provision_connect(dev);
 
@@ -1814,6 +1963,33 @@ static bool p2p_provision_scan_notify(int err, struct l_queue *bss_list,
 			l_debug("SSID matched but BSSID didn't match the GO's "
 				"intended interface addr, proceeding anyway");
 
+		/*
+		 * For a re-invoked Persistent Group we already have the
+		 * credentials and skip WSC, only check the Group ID.
+		 */
+		if (dev->conn_reinvoked) {
+			if (bss->source_frame == SCAN_BSS_PROBE_RESP &&
+					bss->p2p_probe_resp_info) {
+				group_id = bss->p2p_probe_resp_info->
+					device_info.device_addr;
+				capability =
+					&bss->p2p_probe_resp_info->capability;
+			} else if (bss->source_frame == SCAN_BSS_BEACON &&
+					bss->p2p_beacon_info) {
+				group_id = bss->p2p_beacon_info->device_addr;
+				capability = &bss->p2p_beacon_info->capability;
+			} else
+				continue;
+
+			if (memcmp(group_id, dev->go_group_id.device_addr, 6)) {
+				l_error("SSID matched but Group ID address "
+					"didn't");
+				continue;
+			}
+
+			goto found;
+		}
+
 		if (!bss->wsc) {
 			l_error("SSID matched but no valid WSC IE");
 			continue;
@@ -1919,6 +2095,7 @@ static bool p2p_provision_scan_notify(int err, struct l_queue *bss_list,
 			}
 		}
 
+found:
 		l_debug("GO found in the scan results");
 
 		dev->conn_wsc_bss = bss;
@@ -2276,7 +2453,7 @@ static void p2p_device_go_negotiation_req_cb(const struct mmpdu_header *mpdu,
 			 !l_memeqzero(mpdu->address_3, 6)))
 		return;
 
-	peer = l_queue_find(dev->peer_list, p2p_peer_match, mpdu->address_2);
+	peer = l_hashtab_lookup(dev->peer_table, mpdu->address_2);
 	if (!peer)
 		return;
 
@@ -2306,21 +2483,9 @@ static void p2p_device_go_negotiation_req_cb(const struct mmpdu_header *mpdu,
 	dev->is_go = P2P_GO_INTENT * 2 + dev->conn_go_tie_breaker >
 		req_info.go_intent * 2;
 
-	if ((req_info.capability.group_caps & P2P_GROUP_CAP_PERSISTENT_GROUP) &&
-			!dev->is_go) {
-		if (peer->wsc.pending_connect) {
-			struct l_dbus_message *reply =
-				dbus_error_not_supported(
-						peer->wsc.pending_connect);
-
-			dbus_pending_reply(&peer->wsc.pending_connect, reply);
-		}
-
-		p2p_connect_failed(dev);
-		l_error("Persistent groups not supported");
-		status = P2P_STATUS_FAIL_INCOMPATIBLE_PARAMS;
-		goto p2p_free;
-	}
+	/* We always offer a Persistent Group, it's up to the peer */
+	dev->conn_persistent = req_info.capability.group_caps &
+		P2P_GROUP_CAP_PERSISTENT_GROUP;
 
 	if (req_info.device_password_id != dev->conn_password_id) {
 		p2p_connect_failed(dev);
@@ -2433,6 +2598,11 @@ respond:
 			l_malloc(sizeof(struct p2p_channel_entries) + 1);
 
 		resp_info.capability = dev->capability;
+
+		if (dev->conn_persistent)
+			resp_info.capability.group_caps |=
+				P2P_GROUP_CAP_PERSISTENT_GROUP;
+
 		memcpy(resp_info.operating_channel.country,
 			dev->listen_country, 3);
 		resp_info.operating_channel.oper_class = dev->listen_oper_class;
@@ -2620,12 +2790,9 @@ static bool p2p_go_negotiation_resp_cb(const struct mmpdu_header *mpdu,
 	dev->is_go = P2P_GO_INTENT * 2 + dev->conn_go_tie_breaker >
 		resp_info.go_intent * 2;
 
-	if ((resp_info.capability.group_caps & P2P_GROUP_CAP_PERSISTENT_GROUP)
-			&& !dev->is_go) {
-		l_error("Persistent groups not supported");
-		p2p_connect_failed(dev);
-		goto p2p_free;
-	}
+	/* We've offered a Persistent Group, check if the peer agrees */
+	dev->conn_persistent = resp_info.capability.group_caps &
+		P2P_GROUP_CAP_PERSISTENT_GROUP;
 
 	if (resp_info.device_password_id != dev->conn_password_id) {
 		l_error("GO Negotiation Response WSC device password ID wrong");
@@ -2704,6 +2871,11 @@ static bool p2p_go_negotiation_resp_cb(const struct mmpdu_header *mpdu,
 
 		/* Build and send the GO Negotiation Confirmation */
 		confirm_info.capability = dev->capability;
+
+		if (dev->conn_persistent)
+			confirm_info.capability.group_caps |=
+				P2P_GROUP_CAP_PERSISTENT_GROUP;
+
 		memcpy(confirm_info.operating_channel.country,
 			dev->listen_country, 3);
 		confirm_info.operating_channel.oper_class = dev->listen_oper_class;
@@ -2810,6 +2982,8 @@ static void p2p_start_go_negotiation(struct p2p_device *dev)
 
 	info.dialog_token = 1;
 	info.capability = dev->capability;
+	/* Offer to keep the group so it can be re-invoked later */
+	info.capability.group_caps |= P2P_GROUP_CAP_PERSISTENT_GROUP;
 	info.go_intent = P2P_GO_INTENT;
 	info.go_tie_breaker = dev->conn_go_tie_breaker;
 	info.config_timeout.go_config_timeout = 50;	/* 500ms */
@@ -3003,6 +3177,186 @@ static void p2p_start_provision_discovery(struct p2p_device *dev)
 	l_free(req_body);
 }
 
+static void p2p_start_group_formation(struct p2p_device *dev)
+{
+	/*
+	 * If peer is already a GO then send the Provision Discovery
+	 * before doing WSC.  If it's not then do Provision Discovery
+	 * optionally as seems to be required by some implementations, and
+	 * start GO negotiation following that.
+	 * TODO: Add a AlwaysUsePD config setting.
+	 */
+	if (dev->conn_peer->group)
+		p2p_start_provision_discovery(dev);
+	else
+		p2p_start_go_negotiation(dev);
+}
+
+/* Drop the stored group state and go through Group Formation instead */
+static void p2p_invitation_fallback(struct p2p_device *dev)
+{
+	dev->conn_persistent = false;
+	dev->conn_reinvoked = false;
+	dev->is_go = false;
+	explicit_bzero(dev->conn_psk, 32);
+	memset(&dev->go_group_id, 0, sizeof(dev->go_group_id));
+
+	p2p_start_group_formation(dev);
+}
+
+static bool p2p_invitation_resp_cb(const struct mmpdu_header *mpdu,
+					const void *body, size_t body_len,
+					int rssi, struct p2p_device *dev)
+{
+	struct p2p_invitation_resp info;
+	int r;
+	enum scan_band band;
+	uint32_t frequency;
+
+	l_debug("");
+
+	if (!dev->conn_peer)
+		return true;
+
+	if (body_len < 8) {
+		l_error("Invitation Response frame too short");
+		p2p_connect_failed(dev);
+		return true;
+	}
+
+	r = p2p_parse_invitation_resp(body + 7, body_len - 7, &info);
+	if (r < 0) {
+		l_error("Invitation Response parse error %s (%i)",
+			strerror(-r), -r);
+		p2p_connect_failed(dev);
+		return true;
+	}
+
+	if (info.dialog_token != 3) {
+		l_error("Invitation Response dialog token doesn't match");
+		p2p_connect_failed(dev);
+		goto p2p_free;
+	}
+
+	if (info.status != P2P_STATUS_SUCCESS) {
+		l_debug("Invitation Response status %i, falling back to "
+			"Group Formation", info.status);
+
+		if (info.status == P2P_STATUS_FAIL_UNKNOWN_P2P_GROUP)
+			p2p_persistent_group_forget(dev->conn_peer);
+
+		p2p_invitation_fallback(dev);
+		goto p2p_free;
+	}
+
+	/* Check whether WFD IE is required, validate it if present */
+	if (!p2p_device_validate_conn_wfd(dev, info.wfd, info.wfd_size)) {
+		p2p_connect_failed(dev);
+		goto p2p_free;
+	}
+
+	/* The client will associate as soon as our group is up */
+	if (dev->is_go) {
+		p2p_device_interface_create(dev);
+		goto p2p_free;
+	}
+
+	band = scan_oper_class_to_band(
+			(const uint8_t *) info.operating_channel.country,
+			info.operating_channel.oper_class);
+	frequency = scan_channel_to_freq(info.operating_channel.channel_num,
+						band);
+	if (!frequency) {
+		l_error("Bad operating channel in Invitation Response");
+		p2p_connect_failed(dev);
+		goto p2p_free;
+	}
+
+	dev->conn_go_oper_freq = frequency;
+	memcpy(dev->conn_peer_interface_addr, info.group_bssid, 6);
+
+	/* Give the GO the time it has asked for to start the group */
+	dev->conn_config_delay = info.config_timeout.go_config_timeout * 10;
+	dev->conn_peer_config_timeout = l_timeout_create_ms(
+						dev->conn_config_delay,
+						p2p_config_timeout, dev,
+						p2p_config_timeout_destroy);
+
+p2p_free:
+	p2p_clear_invitation_resp(&info);
+	return true;
+}
+
+static void p2p_invitation_req_done(int error, void *user_data)
+{
+	struct p2p_device *dev = user_data;
+
+	if (error)
+		l_error("Sending the Invitation Request failed: %s (%i)",
+			strerror(-error), -error);
+	else
+		l_error("No Invitation Response after Request ACKed");
+
+	/* The peer may not support re-invoking groups, try from scratch */
+	p2p_invitation_fallback(dev);
+}
+
+static void p2p_start_invitation(struct p2p_device *dev)
+{
+	struct p2p_invitation_req info = {};
+	uint8_t *req_body;
+	size_t req_len;
+	uint8_t wfd_ie[32];
+	struct iovec iov[16];
+	int iov_len = 0;
+
+	info.dialog_token = 3;
+	info.config_timeout.go_config_timeout = 50;	/* 500ms */
+	info.config_timeout.client_config_timeout = 50;	/* 500ms */
+	info.reinvoke_persistent_group = true;
+
+	/* Section 3.1.5.1: The GO sets the Operating Channel and BSSID */
+	if (dev->is_go) {
+		memcpy(info.operating_channel.country, dev->listen_country, 3);
+		info.operating_channel.oper_class = dev->listen_oper_class;
+		info.operating_channel.channel_num = dev->listen_channel;
+		memcpy(info.group_bssid, dev->conn_addr, 6);
+	}
+
+	p2p_device_fill_channel_list(dev, &info.channel_list);
+	info.group_id = dev->go_group_id;
+	info.device_info = dev->device_info;
+
+	if (dev->conn_own_wfd) {
+		info.wfd = wfd_ie;
+		info.wfd_size = p2p_build_wfd_ie(dev->conn_own_wfd,
+							NULL, wfd_ie);
+	}
+
+	req_body = p2p_build_invitation_req(&info, &req_len);
+	info.wfd = NULL;
+	p2p_clear_invitation_req(&info);
+
+	if (!req_body) {
+		p2p_connect_failed(dev);
+		return;
+	}
+
+	iov[iov_len].iov_base = req_body;
+	iov[iov_len].iov_len = req_len;
+	iov_len++;
+
+	iov[iov_len].iov_base = NULL;
+
+	/* Same timing as the GO Negotiation Request */
+	p2p_peer_frame_xchg(dev->conn_peer, iov, dev->conn_peer->device_addr,
+				100, 600, 256, false, FRAME_GROUP_CONNECT,
+				p2p_invitation_req_done,
+				&p2p_frame_invitation_resp,
+				p2p_invitation_resp_cb, NULL);
+	l_free(req_body);
+}
+
 static bool p2p_peer_get_info(struct p2p_peer *peer,
 				uint16_t *wsc_config_methods,
 				struct p2p_capability_attr **capability)
@@ -3153,17 +3507,31 @@ static void p2p_peer_connect(struct p2p_peer *peer, const char *pin)
 	}
 
 	/*
-	 * Step 2, if peer is already a GO then send the Provision Discovery
-	 * before doing WSC.  If it's not then do Provision Discovery
-	 * optionally as seems to be required by some implementations, and
-	 * start GO negotiation following that.
-	 * TODO: Add a AlwaysUsePD config setting.
+	 * Step 2, if we've been in a Persistent Group with this peer, use
+	 * the stored credentials and skip GO Negotiation and WSC.  If the
+	 * peer is already running the group as GO we can connect directly,
+	 * otherwise invite it to re-invoke the group.
 	 */
-	if (dev->conn_peer->group)
-		p2p_start_provision_discovery(dev);
-	else
-		p2p_start_go_negotiation(dev);
+	if (p2p_persistent_group_load(dev, peer)) {
+		dev->conn_persistent = true;
+		dev->conn_reinvoked = true;
+
+		if (!dev->is_go && peer->group &&
+				peer->bss->ssid_len ==
+				strlen(dev->go_group_id.ssid) &&
+				!memcmp(peer->bss->ssid, dev->go_group_id.ssid,
+					peer->bss->ssid_len)) {
+			dev->conn_go_oper_freq = peer->bss->frequency;
+			memset(dev->conn_peer_interface_addr, 0, 6);
+			p2p_start_client_provision(dev);
+		} else
+			p2p_start_invitation(dev);
 
+		return;
+	}
+
+	/* Step 3, form a new group */
+	p2p_start_group_formation(dev);
 	return;
 
 send_error:
@@ -3243,8 +3611,21 @@ send_reply:
 
 #define SCAN_INTERVAL_MAX	3
 #define SCAN_INTERVAL_STEP	1
-#define CHANS_PER_SCAN_INITIAL	2
-#define CHANS_PER_SCAN		2
+/* Listen State lasts between 1 and 3 one-hundred TU Intervals */
+#define LISTEN_MIN_MS		102
+#define LISTEN_MAX_MS		307
+/* Include the non-social channels in every Nth Search State */
+#define FULL_SCAN_PERIOD	4
+
+static uint32_t p2p_device_listen_remaining(struct p2p_device *dev)
+{
+	uint64_t now = l_time_now();
+
+	if (!l_time_before(now, dev->next_scan_ts))
+		return 0;
+
+	return l_time_diff(now, dev->next_scan_ts) / L_USEC_PER_MSEC;
+}
 
 static bool p2p_device_scan_start(struct p2p_device *dev);
 static void p2p_device_roc_start(struct p2p_device *dev);
@@ -3255,7 +3636,7 @@ static void p2p_device_roc_timeout(struct l_timeout *timeout, void *user_data)
 
 	l_timeout_remove(dev->scan_timeout);
 
-	if (time(NULL) < dev->next_scan_ts) {
+	if (p2p_device_listen_remaining(dev) >= LISTEN_MIN_MS) {
 		/*
 		 * dev->scan_timeout destroy function will have been called
 		 * by now so it won't overwrite the new timeout set by
@@ -3336,15 +3717,10 @@ static void p2p_device_roc_start(struct p2p_device *dev)
 
 	l_debug("");
 
-	/*
-	 * One second granularity is fine here because some randomess
-	 * is desired and the intervals don't have strictly defined
-	 * limits.
-	 */
-	duration = (dev->next_scan_ts - time(NULL)) * 1000;
+	duration = p2p_device_listen_remaining(dev);
 
-	if (duration < 200)
-		duration = 200;
+	if (duration < LISTEN_MIN_MS)
+		duration = LISTEN_MIN_MS;
 
 	/*
 	 * Driver max duration seems to be 5000ms or more for all drivers
@@ -3576,50 +3952,142 @@ static bool p2p_device_peer_add(struct p2p_device *dev, struct p2p_peer *peer)
 			wfd.available)
 		p2p_peer_update_wfd(peer, &wfd);
 
+	/* Addresses are picked by remote devices, use the keyed hash */
+	if (!dev->peer_table)
+		dev->peer_table = l_hashtab_new(6, L_HASHTAB_HASH_SIPHASH);
+
+	l_hashtab_replace(dev->peer_table, peer->bss->addr, peer, NULL);
 	l_queue_push_tail(dev->peer_list, peer);
+	peer->seen = true;
 
 	return true;
 }
 
-struct p2p_peer_move_data {
-	struct l_queue *new_list;
+struct p2p_peer_expire_data {
 	struct p2p_peer *conn_peer;
 	uint64_t now;
 };
 
-static bool p2p_peer_move_recent(void *data, void *user_data)
+static bool p2p_peer_expire(void *data, void *user_data)
 {
 	struct p2p_peer *peer = data;
-	struct p2p_peer_move_data *move_data = user_data;
+	struct p2p_peer_expire_data *expire_data = user_data;
 
-	if (move_data->now > peer->bss->time_stamp + 30 * L_USEC_PER_SEC &&
-			peer != move_data->conn_peer)
-		return false;	/* Old, keep on the list */
+	/* Keep peers recently seen or currently connected */
+	if (peer->seen || peer == expire_data->conn_peer ||
+			expire_data->now <= peer->bss->time_stamp +
+						30 * L_USEC_PER_SEC)
+		return false;
 
-	/* Recently seen or currently connected, move to the new list */
-	l_queue_push_tail(move_data->new_list, peer);
+	p2p_peer_put(peer);
 	return true;
 }
 
-static bool p2p_peer_update_existing(struct scan_bss *bss,
-					struct l_queue *old_list,
-					struct l_queue *new_list)
+static bool p2p_device_type_match(const struct wsc_primary_device_type *want,
+				const struct wsc_primary_device_type *type)
+{
+	if (want->category != type->category)
+		return false;
+
+	/* A zero Sub Category matches the whole Category */
+	if (!want->subcategory)
+		return true;
+
+	return !memcmp(want->oui, type->oui, 3) &&
+		want->oui_type == type->oui_type &&
+		want->subcategory == type->subcategory;
+}
+
+/*
+ * Peers may ignore the Requested Device Type in our Probe Requests and
+ * peers found through their own Probe Requests aren't filtered at all,
+ * so check the Device Types locally too.
+ */
+static bool p2p_device_type_wanted(struct p2p_device *dev,
+				const struct wsc_primary_device_type *primary,
+				struct l_queue *secondary)
+{
+	const struct l_queue_entry *entry;
+
+	if (!dev->discovery_type.category)
+		return true;
+
+	if (p2p_device_type_match(&dev->discovery_type, primary))
+		return true;
+
+	for (entry = l_queue_get_entries(secondary); entry;
+			entry = entry->next)
+		if (p2p_device_type_match(&dev->discovery_type, entry->data))
+			return true;
+
+	return false;
+}
+
+static void p2p_peer_update_info(struct p2p_peer *peer,
+					const struct p2p_probe_resp *info)
+{
+	const char *name = info->device_info.device_name;
+
+	peer->group = !!(info->capability.group_caps & P2P_GROUP_CAP_GO);
+
+	if (strcmp(peer->name, name) && strlen(name) &&
+			l_utf8_validate(name, strlen(name), NULL)) {
+		l_free(peer->name);
+		peer->name = l_strdup(name);
+		l_dbus_property_changed(dbus_get_bus(),
+					p2p_peer_get_path(peer),
+					IWD_P2P_PEER_INTERFACE, "Name");
+	}
+
+	if (memcmp(&peer->primary_device_type,
+			&info->device_info.primary_device_type,
+			sizeof(peer->primary_device_type))) {
+		peer->primary_device_type =
+			info->device_info.primary_device_type;
+		l_dbus_property_changed(dbus_get_bus(),
+					p2p_peer_get_path(peer),
+					IWD_P2P_PEER_INTERFACE, "DeviceCategory");
+		l_dbus_property_changed(dbus_get_bus(),
+					p2p_peer_get_path(peer),
+					IWD_P2P_PEER_INTERFACE,
+					"DeviceSubcategory");
+	}
+}
+
+static bool p2p_peer_update_existing(struct p2p_device *dev,
+					struct scan_bss *bss)
 {
 	struct p2p_peer *peer;
 	struct p2p_wfd_properties wfd;
 
-	peer = l_queue_remove_if(old_list, p2p_peer_match, bss->addr);
+	peer = l_hashtab_lookup(dev->peer_table, bss->addr);
 	if (!peer)
 		return false;
 
+	peer->seen = true;
+
+	/*
+	 * If the peer is sending the same frame on the same channel as
+	 * before, nothing the peer's properties come from has changed.
+	 * Only refresh the signal strength and age.
+	 */
+	if (bss->source_frame == peer->bss->source_frame &&
+			bss->frequency == peer->bss->frequency &&
+			bss->ies_len == peer->bss->ies_len &&
+			!memcmp(bss->ies, peer->bss->ies, bss->ies_len)) {
+		peer->bss->signal_strength = bss->signal_strength;
+		peer->bss->time_stamp = bss->time_stamp;
+		scan_bss_free(bss);
+		return true;
+	}
+
 	/*
-	 * We've seen this peer already, only update the scan_bss object
-	 * and WFD state.  We can update peer->bss even if
+	 * We've seen this peer already, update the scan_bss object and the
+	 * state derived from it.  We can update peer->bss even if
 	 * peer == peer->dev->conn_peer because its .bss is not used by
 	 * .conn_netdev or .conn_enrollee.  .conn_wsc_bss is used for
 	 * both connections and it doesn't come from the discovery scan
 	 * results.
-	 * Some property changes may need to be notified here.
 	 */
 
 	if (peer->device_addr == peer->bss->addr)
@@ -3631,6 +4099,10 @@ static bool p2p_peer_update_existing(struct scan_bss *bss,
 	scan_bss_free(peer->bss);
 	peer->bss = bss;
 
+	if (bss->source_frame == SCAN_BSS_PROBE_RESP &&
+			bss->p2p_probe_resp_info)
+		p2p_peer_update_info(peer, bss->p2p_probe_resp_info);
+
 	if (p2p_own_wfd && p2p_extract_wfd_properties(bss->wfd, bss->wfd_size,
 							&wfd) &&
 			wfd.available)
@@ -3638,7 +4110,6 @@ static bool p2p_peer_update_existing(struct scan_bss *bss,
 	else if (peer->wfd)
 		p2p_peer_update_wfd(peer, NULL);
 
-	l_queue_push_tail(new_list, peer);
 	return true;
 }
 
@@ -3648,15 +4119,23 @@ static bool p2p_scan_notify(int err, struct l_queue *bss_list,
 {
 	struct p2p_device *dev = user_data;
 	const struct l_queue_entry *entry;
-	struct l_queue *old_peer_list = dev->peer_list;
-	struct p2p_peer_move_data move_data;
+	struct p2p_peer_expire_data expire_data;
+	uint32_t listen_ms;
 
 	if (err) {
 		l_debug("P2P scan failed: %s (%i)", strerror(-err), -err);
 		goto schedule;
 	}
 
-	dev->peer_list = l_queue_new();
+	if (!dev->peer_list)
+		dev->peer_list = l_queue_new();
+
+	for (entry = l_queue_get_entries(dev->peer_list); entry;
+			entry = entry->next) {
+		struct p2p_peer *peer = entry->data;
+
+		peer->seen = false;
+	}
 
 	for (entry = l_queue_get_entries(bss_list); entry;
 			entry = entry->next) {
@@ -3669,10 +4148,18 @@ static bool p2p_scan_notify(int err, struct l_queue *bss_list,
 			continue;
 		}
 
-		if (p2p_peer_update_existing(bss, old_peer_list,
-						dev->peer_list))
+		if (p2p_peer_update_existing(dev, bss))
 			continue;
 
+		if (!p2p_device_type_wanted(dev,
+				&bss->p2p_probe_resp_info->
+					device_info.primary_device_type,
+				bss->p2p_probe_resp_info->
+					device_info.secondary_device_types)) {
+			scan_bss_free(bss);
+			continue;
+		}
+
 		peer = l_new(struct p2p_peer, 1);
 		peer->dev = dev;
 		peer->bss = bss;
@@ -3696,15 +4183,12 @@ static bool p2p_scan_notify(int err, struct l_queue *bss_list,
 	}
 
 	/*
-	 * old_peer_list now only contains peers not present in the new
-	 * results.  Move any peers seen in the last 30 secs to the new
-	 * dev->peer_list and unref only the remaining peers.
+	 * Peers not present in the new results are kept if they were seen
+	 * in the last 30 secs, the remaining ones are dropped.
 	 */
-	move_data.new_list = dev->peer_list;
-	move_data.conn_peer = dev->conn_peer;
-	move_data.now = l_time_now();
-	l_queue_foreach_remove(old_peer_list, p2p_peer_move_recent, &move_data);
-	l_queue_destroy(old_peer_list, p2p_peer_put);
+	expire_data.conn_peer = dev->conn_peer;
+	expire_data.now = l_time_now();
+	l_queue_foreach_remove(dev->peer_list, p2p_peer_expire, &expire_data);
 	l_queue_destroy(bss_list, NULL);
 
 schedule:
@@ -3727,11 +4211,24 @@ schedule:
 	 * between 1 and 3 one-hundred TU Intervals.
 	 *
 	 * The Search State duration is implementation dependent.
+	 *
+	 * When looking for a specific Device Type, return to the Search
+	 * State after a single Listen State so that a peer is found within
+	 * a few Search/Listen rounds.  The long listen period still follows
+	 * every full scan to satisfy 3.1.2.1.1.
 	 */
 	if (dev->scan_interval < SCAN_INTERVAL_MAX)
 		dev->scan_interval += SCAN_INTERVAL_STEP;
 
-	dev->next_scan_ts = time(NULL) + dev->scan_interval;
+	if (dev->discovery_type.category && !dev->conn_peer &&
+			dev->scan_count % FULL_SCAN_PERIOD)
+		listen_ms = LISTEN_MIN_MS + l_getrandom_uint32() %
+					(LISTEN_MAX_MS - LISTEN_MIN_MS + 1);
+	else
+		listen_ms = dev->scan_interval * 1000;
+
+	dev->next_scan_ts = l_time_offset(l_time_now(),
+					listen_ms * L_USEC_PER_MSEC);
 
 	p2p_device_roc_start(dev);
 	return true;
@@ -3787,27 +4284,18 @@ static bool p2p_device_scan_start(struct p2p_device *dev)
 	 * Instead of doing a single Scan Phase at the beginning of the Device
 	 * Discovery and then strictly a Find Phase loop as defined in the
 	 * spec, mix both to keep watching for P2P groups on the non-social
-	 * channels, slowly going through a few channels at a time in each
-	 * Scan State iteration.  Scan dev->chans_per_scan channels each time,
-	 * use dev->scan_chan_idx to keep track of which channels we've
-	 * visited recently.
+	 * channels.  P2P Devices are only found on the social channels so
+	 * start with social channel scans, which are short, and only add
+	 * the other channels in every FULL_SCAN_PERIOD'th Search State.
 	 */
-	for (i = 0; i < dev->chans_per_scan; i++) {
-		int idx = dev->scan_chan_idx++;
-		int chan = channels_scan_2_4_other[idx];
-		uint32_t freq = scan_channel_to_freq(chan, SCAN_BAND_2_4_GHZ);
+	if (dev->scan_count++ % FULL_SCAN_PERIOD == FULL_SCAN_PERIOD - 1) {
+		for (i = 0; i < L_ARRAY_SIZE(channels_scan_2_4_other); i++) {
+			int chan = channels_scan_2_4_other[i];
+			uint32_t freq = scan_channel_to_freq(chan,
+							SCAN_BAND_2_4_GHZ);
 
-		if (dev->scan_chan_idx >=
-				L_ARRAY_SIZE(channels_scan_2_4_other)) {
-			dev->scan_chan_idx = 0;
-			/*
-			 * Do fewer channels per scan after we've initially
-			 * gone through the 2.4 band.
-			 */
-			dev->chans_per_scan = CHANS_PER_SCAN;
+			scan_freq_set_add(params.freqs, freq);
 		}
-
-		scan_freq_set_add(params.freqs, freq);
 	}
 
 	dev->scan_id = scan_active_full(dev->wdev_id, &params, NULL,
@@ -3984,7 +4472,8 @@ static void p2p_device_probe_cb(const struct mmpdu_header *mpdu,
 	struct p2p_probe_req p2p_info;
 	struct wsc_probe_request wsc_info;
 	int r;
-	uint8_t *wsc_payload;
+	const uint8_t *wsc_payload;
+	uint8_t *wsc_copy = NULL;
 	ssize_t wsc_len;
 	struct scan_bss *bss;
 	struct p2p_channel_attr *channel;
@@ -4001,12 +4490,16 @@ static void p2p_device_probe_cb(const struct mmpdu_header *mpdu,
 		dev->conn_go_neg_req_timeout && dev->conn_peer &&
 		!memcmp(mpdu->address_2, dev->conn_peer->bss->addr, 6);
 
-	wsc_payload = ie_tlv_extract_wsc_payload(body, body_len, &wsc_len);
+	wsc_payload = ie_tlv_peek_wsc_payload(body, body_len, &wsc_len);
+	if (!wsc_payload && wsc_len == -EMSGSIZE)
+		wsc_payload = wsc_copy = ie_tlv_extract_wsc_payload(body,
+							body_len, &wsc_len);
+
 	if (!wsc_payload)	/* Not a P2P Probe Req, ignore */
 		return;
 
 	r =  wsc_parse_probe_request(wsc_payload, wsc_len, &wsc_info);
-	l_free(wsc_payload);
+	l_free(wsc_copy);
 
 	if (r < 0) {
 		l_error("Probe Request WSC IE parse error %s (%i)",
@@ -4022,7 +4515,7 @@ static void p2p_device_probe_cb(const struct mmpdu_header *mpdu,
 			return;
 	}
 
-	r = p2p_parse_probe_req(body, body_len, &p2p_info);
+	r = p2p_parse_probe_req_shallow(body, body_len, &p2p_info);
 	if (r < 0) {
 		if (r == -ENOENT)	/* Not a P2P Probe Req, ignore */
 			return;
@@ -4038,6 +4531,10 @@ static void p2p_device_probe_cb(const struct mmpdu_header *mpdu,
 	 */
 	p2p_device_send_probe_resp(dev, mpdu->address_2, from_conn_peer);
 
+	if (!from_conn_peer && !p2p_device_type_wanted(dev,
+					&wsc_info.primary_device_type, NULL))
+		goto p2p_free;
+
 	/*
 	 * The peer's listen frequency may be different from ours.
 	 * The Listen Channel attribute is optional but if neither
@@ -4064,7 +4561,7 @@ static void p2p_device_probe_cb(const struct mmpdu_header *mpdu,
 
 	bss->time_stamp = l_time_now();
 
-	if (p2p_peer_update_existing(bss, dev->peer_list, dev->peer_list))
+	if (p2p_peer_update_existing(dev, bss))
 		goto p2p_free;
 
 	peer = l_new(struct p2p_peer, 1);
@@ -4102,9 +4599,11 @@ static void p2p_device_discovery_start(struct p2p_device *dev)
 	if (dev->scan_timeout || dev->scan_id)
 		return;
 
+	/* Get ready for a GO Negotiation with any peer we may discover */
+	eap_wsc_prepare_key_pairs();
+
 	dev->scan_interval = 1;
-	dev->chans_per_scan = CHANS_PER_SCAN_INITIAL;
-	dev->scan_chan_idx = 0;
+	dev->scan_count = 0;
 
 	/*
 	 * 3.1.2.1.1: "The Listen Channel shall be chosen at the beginning of
@@ -4379,13 +4878,28 @@ struct p2p_device *p2p_device_update_from_genl(struct l_genl_msg *msg,
 
 	l_free(str);
 
+	str = l_settings_get_string(iwd_get_config(), "P2P",
+					"DiscoveryDeviceType");
+
+	if (str && !wsc_device_type_from_setting_str(str,
+						&dev->discovery_type)) {
+		l_error("[P2P].DiscoveryDeviceType must use the same format "
+			"as [P2P].DeviceType");
+		memset(&dev->discovery_type, 0, sizeof(dev->discovery_type));
+	}
+
+	l_free(str);
+
 	l_queue_push_tail(p2p_device_list, dev);
 
 	l_debug("Created P2P device %" PRIx64, dev->wdev_id);
 
 	scan_wdev_add(dev->wdev_id);
 
-	if (!l_genl_family_register(dev->nl80211, NL80211_MULTICAST_GROUP_MLME,
+	if (!l_genl_family_register_filtered(dev->nl80211,
+					NL80211_MULTICAST_GROUP_MLME,
+					NL80211_ATTR_WDEV, &dev->wdev_id,
+					sizeof(dev->wdev_id),
 					p2p_mlme_notify, dev, NULL))
 		l_error("Registering for MLME notifications failed");
 
@@ -4416,6 +4930,7 @@ static void p2p_device_free(void *user_data)
 	p2p_connection_reset(dev);
 	l_dbus_unregister_object(dbus_get_bus(), p2p_device_get_path(dev));
 	l_queue_destroy(dev->peer_list, p2p_peer_put);
+	l_hashtab_destroy(dev->peer_table, NULL);
 	l_queue_destroy(dev->discovery_users, p2p_discovery_user_free);
 	l_genl_family_free(dev->nl80211); /* Cancels dev->start_stop_cmd_id */
 	scan_wdev_remove(dev->wdev_id);
@@ -5102,6 +5617,7 @@ static int p2p_init(void)
 
 	p2p_dhcp_settings = l_settings_new();
 	p2p_device_list = l_queue_new();
+	p2p_persistent_groups = storage_p2p_groups_load();
 
 	if (!l_dbus_register_interface(dbus, IWD_P2P_WFD_INTERFACE,
 					p2p_wfd_interface_setup,
@@ -5135,9 +5651,13 @@ static void p2p_exit(void)
 	p2p_device_list = NULL;
 	l_settings_free(p2p_dhcp_settings);
 	p2p_dhcp_settings = NULL;
+	l_settings_free(p2p_persistent_groups);
+	p2p_persistent_groups = NULL;
 }
 
 IWD_MODULE(p2p, p2p_init, p2p_exit)
 IWD_MODULE_DEPENDS(p2p, wiphy)
 IWD_MODULE_DEPENDS(p2p, scan)
 IWD_MODULE_DEPENDS(p2p, netconfig)
+IWD_MODULE_DEPENDS(p2p, ap)
+IWD_MODULE_ON_IFTYPE(p2p, NL80211_IFTYPE_P2P_DEVICE)
@@ -253,10 +253,10 @@ static bool extract_p2p_channel_list(const uint8_t *attr, size_t len,
 }
 
 /* Section 4.1.14 */
-static bool extract_p2p_notice_of_absence(const uint8_t *attr, size_t len,
-						void *data)
+static bool parse_p2p_notice_of_absence(const uint8_t *attr, size_t len,
+					struct p2p_notice_of_absence_attr *out,
+					bool descriptors)
 {
-	struct p2p_notice_of_absence_attr *out = data;
 	uint8_t index;
 	uint8_t ct_window;
 	bool opp_ps;
@@ -275,6 +275,10 @@ static bool extract_p2p_notice_of_absence(const uint8_t *attr, size_t len,
 	out->index = index;
 	out->opp_ps = opp_ps;
 	out->ct_window = ct_window;
+
+	if (!descriptors)
+		return true;
+
 	out->descriptors = l_queue_new();
 
 	while (len) {
@@ -294,11 +298,24 @@ static bool extract_p2p_notice_of_absence(const uint8_t *attr, size_t len,
 	return true;
 }
 
+static bool extract_p2p_notice_of_absence(const uint8_t *attr, size_t len,
+						void *data)
+{
+	return parse_p2p_notice_of_absence(attr, len, data, true);
+}
+
+static bool extract_p2p_notice_of_absence_shallow(const uint8_t *attr,
+							size_t len, void *data)
+{
+	return parse_p2p_notice_of_absence(attr, len, data, false);
+}
+
 /* Section 4.1.15 */
-static bool extract_p2p_device_info(const uint8_t *attr, size_t len,
-					void *data)
+static bool parse_p2p_device_info(const uint8_t *attr, size_t len,
+					struct p2p_device_info_attr *out,
+					bool secondary_types)
 {
-	struct p2p_device_info_attr *out = data;
+	struct wsc_primary_device_type device_type;
 	int r;
 	int name_len;
 	int i;
@@ -326,21 +343,22 @@ static bool extract_p2p_device_info(const uint8_t *attr, size_t len,
 	if (len < 17u + types_num * 8 + 4 + name_len || name_len > 32)
 		return false;
 
-	out->secondary_device_types = l_queue_new();
+	if (secondary_types)
+		out->secondary_device_types = l_queue_new();
 
 	for (i = 0; i < types_num; i++) {
-		struct wsc_primary_device_type *device_type =
-			l_new(struct wsc_primary_device_type, 1);
-
-		l_queue_push_tail(out->secondary_device_types, device_type);
-
 		r = wsc_parse_primary_device_type(attr + 17 + i * 8, 8,
-							device_type);
+							&device_type);
 		if (r < 0) {
 			l_queue_destroy(out->secondary_device_types, l_free);
 			out->secondary_device_types = NULL;
 			return false;
 		}
+
+		if (secondary_types)
+			l_queue_push_tail(out->secondary_device_types,
+						l_memdup(&device_type,
+							sizeof(device_type)));
 	}
 
 	memcpy(out->device_name, attr + 17 + types_num * 8 + 4, name_len);
@@ -348,6 +366,18 @@ static bool extract_p2p_device_info(const uint8_t *attr, size_t len,
 	return true;
 }
 
+static bool extract_p2p_device_info(const uint8_t *attr, size_t len,
+					void *data)
+{
+	return parse_p2p_device_info(attr, len, data, true);
+}
+
+static bool extract_p2p_device_info_shallow(const uint8_t *attr, size_t len,
+						void *data)
+{
+	return parse_p2p_device_info(attr, len, data, false);
+}
+
 static void p2p_clear_client_info_descriptor(void *data)
 {
 	struct p2p_client_info_descriptor *desc = data;
@@ -357,32 +387,25 @@ static void p2p_clear_client_info_descriptor(void *data)
 }
 
 /* Section 4.1.16 */
-static bool extract_p2p_group_info(const uint8_t *attr, size_t len,
-					void *data)
+static bool parse_p2p_group_info(const uint8_t *attr, size_t len,
+					struct l_queue **out)
 {
-	struct l_queue **out = data;
-
 	while (len) {
 		uint8_t desc_len = *attr++;
-		struct p2p_client_info_descriptor *desc;
+		struct p2p_client_info_descriptor desc = {};
+		struct wsc_primary_device_type device_type;
 		int r, name_len, i, types_num;
 
-		if (len < 1u + desc_len)
+		if (len < 1u + desc_len || desc_len < 24)
 			goto error;
 
-		if (!*out)
-			*out = l_queue_new();
-
-		desc = l_new(struct p2p_client_info_descriptor, 1);
-		l_queue_push_tail(*out, desc);
-
-		memcpy(desc->device_addr, attr + 0, 6);
-		memcpy(desc->interface_addr, attr + 6, 6);
-		desc->device_caps = attr[12];
-		desc->wsc_config_methods = l_get_be16(attr + 13);
+		memcpy(desc.device_addr, attr + 0, 6);
+		memcpy(desc.interface_addr, attr + 6, 6);
+		desc.device_caps = attr[12];
+		desc.wsc_config_methods = l_get_be16(attr + 13);
 
 		r = wsc_parse_primary_device_type(attr + 15, 8,
-						&desc->primary_device_type);
+						&desc.primary_device_type);
 		if (r < 0)
 			goto error;
 
@@ -399,24 +422,34 @@ static bool extract_p2p_group_info(const uint8_t *attr, size_t len,
 				name_len > 32)
 			goto error;
 
-		desc->secondary_device_types = l_queue_new();
+		if (out)
+			desc.secondary_device_types = l_queue_new();
 
 		for (i = 0; i < types_num; i++) {
-			struct wsc_primary_device_type *device_type =
-				l_new(struct wsc_primary_device_type, 1);
-
-			l_queue_push_tail(desc->secondary_device_types,
-						device_type);
-
 			r = wsc_parse_primary_device_type(attr + 24 + i * 8, 8,
-								device_type);
-			if (r < 0)
+								&device_type);
+			if (r < 0) {
+				l_queue_destroy(desc.secondary_device_types,
+						l_free);
 				goto error;
+			}
+
+			if (out)
+				l_queue_push_tail(desc.secondary_device_types,
+						l_memdup(&device_type,
+							sizeof(device_type)));
 		}
 
-		memcpy(desc->device_name, attr + 24 + types_num * 8 + 4,
+		memcpy(desc.device_name, attr + 24 + types_num * 8 + 4,
 			name_len);
 
+		if (out) {
+			if (!*out)
+				*out = l_queue_new();
+
+			l_queue_push_tail(*out, l_memdup(&desc, sizeof(desc)));
+		}
+
 		attr += 24 + types_num * 8 + 4 + name_len;
 		len -= 1 + desc_len;
 	}
@@ -424,12 +457,27 @@ static bool extract_p2p_group_info(const uint8_t *attr, size_t len,
 	return true;
 
 error:
-	l_queue_destroy(*out, p2p_clear_client_info_descriptor);
-	*out = NULL;
+	if (out) {
+		l_queue_destroy(*out, p2p_clear_client_info_descriptor);
+		*out = NULL;
+	}
 
 	return false;
 }
 
+static bool extract_p2p_group_info(const uint8_t *attr, size_t len,
+					void *data)
+{
+	return parse_p2p_group_info(attr, len, data);
+}
+
+/* Validate the Group Info without building the list of clients */
+static bool extract_p2p_group_info_shallow(const uint8_t *attr, size_t len,
+						void *data)
+{
+	return parse_p2p_group_info(attr, len, NULL);
+}
+
 /* Section 4.1.17, 4.1.29, ... */
 static bool extract_p2p_group_id(const uint8_t *attr, size_t len,
 					void *data)
@@ -504,6 +552,12 @@ static bool extract_p2p_service_hashes(const uint8_t *attr, size_t len,
 	return true;
 }
 
+static bool extract_p2p_service_hashes_shallow(const uint8_t *attr,
+						size_t len, void *data)
+{
+	return len % 6 == 0;
+}
+
 /* Section 4.1.23 */
 static bool extract_p2p_session_info(const uint8_t *attr, size_t len,
 					void *data)
@@ -538,11 +592,9 @@ static void p2p_clear_advertised_service_descriptor(void *data)
 }
 
 /* Section 4.1.26 */
-static bool extract_p2p_advertised_service_info(const uint8_t *attr, size_t len,
-						void *data)
+static bool parse_p2p_advertised_service_info(const uint8_t *attr, size_t len,
+						struct l_queue **out)
 {
-	struct l_queue **out = data;
-
 	while (len) {
 		struct p2p_advertised_service_descriptor *desc;
 		int name_len;
@@ -557,16 +609,19 @@ static bool extract_p2p_advertised_service_info(const uint8_t *attr, size_t len,
 		if (!l_utf8_validate((const char *) attr + 7, name_len, NULL))
 			goto error;
 
-		if (!*out)
-			*out = l_queue_new();
+		if (out) {
+			if (!*out)
+				*out = l_queue_new();
 
-		desc = l_new(struct p2p_advertised_service_descriptor, 1);
-		l_queue_push_tail(*out, desc);
+			desc = l_new(struct p2p_advertised_service_descriptor,
+					1);
+			l_queue_push_tail(*out, desc);
 
-		desc->advertisement_id = l_get_le32(attr + 0);
-		desc->wsc_config_methods = l_get_be16(attr + 4);
-		desc->service_name = l_strndup((const char *) attr + 7,
-						name_len);
+			desc->advertisement_id = l_get_le32(attr + 0);
+			desc->wsc_config_methods = l_get_be16(attr + 4);
+			desc->service_name = l_strndup((const char *) attr + 7,
+							name_len);
+		}
 
 		attr += 7 + name_len;
 		len -= 7 + name_len;
@@ -575,10 +630,27 @@ static bool extract_p2p_advertised_service_info(const uint8_t *attr, size_t len,
 	return true;
 
 error:
-	l_queue_destroy(*out, p2p_clear_advertised_service_descriptor);
+	if (out) {
+		l_queue_destroy(*out, p2p_clear_advertised_service_descriptor);
+		*out = NULL;
+	}
+
 	return false;
 }
 
+static bool extract_p2p_advertised_service_info(const uint8_t *attr, size_t len,
+						void *data)
+{
+	return parse_p2p_advertised_service_info(attr, len, data);
+}
+
+static bool extract_p2p_advertised_service_info_shallow(const uint8_t *attr,
+							size_t len,
+							void *data)
+{
+	return parse_p2p_advertised_service_info(attr, len, NULL);
+}
+
 /* Section 4.1.27 */
 static bool extract_p2p_session_id(const uint8_t *attr, size_t len, void *data)
 {
@@ -671,6 +743,32 @@ static attr_handler handler_for_type(enum p2p_attr type)
 	return NULL;
 }
 
+/*
+ * Handlers for a shallow parse, where the variable-length lists inside the
+ * attributes are validated but not copied
+ */
+static attr_handler shallow_handler_for_type(enum p2p_attr type)
+{
+	switch (type) {
+	case P2P_ATTR_NOTICE_OF_ABSENCE:
+		return extract_p2p_notice_of_absence_shallow;
+	case P2P_ATTR_P2P_DEVICE_INFO:
+		return extract_p2p_device_info_shallow;
+	case P2P_ATTR_P2P_GROUP_INFO:
+		return extract_p2p_group_info_shallow;
+	case P2P_ATTR_SVC_HASH:
+		return extract_p2p_service_hashes_shallow;
+	case P2P_ATTR_ADVERTISED_SVC_INFO:
+		return extract_p2p_advertised_service_info_shallow;
+	default:
+		break;
+	}
+
+	return handler_for_type(type);
+}
+
+#define P2P_PARSE_MAX_ATTRS	24
+
 struct attr_handler_entry {
 	enum p2p_attr type;
 	unsigned int flags;
@@ -683,85 +781,106 @@ struct attr_handler_entry {
  * and may have allocated memory so the output needs to be deallocated
  * properly even on error return values.
  */
-static int p2p_parse_attrs(const uint8_t *pdu, size_t len, int type, ...)
+static int p2p_parse_attrs_valist(const uint8_t *pdu, size_t len,
+					bool shallow, int type, va_list args)
 {
 	struct p2p_attr_iter iter;
-	uint8_t *p2p_data;
+	const uint8_t *p2p_data;
+	uint8_t *p2p_copy = NULL;
 	ssize_t p2p_len;
-	struct l_queue *entries;
-	va_list args;
-	bool have_required = true;
-	bool parse_error = false;
-	struct attr_handler_entry *entry;
-	const struct l_queue_entry *e;
-
-	p2p_data = ie_tlv_extract_p2p_payload(pdu, len, &p2p_len);
-	if (!p2p_data)
-		return p2p_len;
-
-	p2p_attr_iter_init(&iter, p2p_data, p2p_len);
-
-	va_start(args, type);
-
-	entries = l_queue_new();
+	struct attr_handler_entry entries[P2P_PARSE_MAX_ATTRS];
+	unsigned int n_entries = 0;
+	unsigned int i;
+	int r = 0;
 
 	while (type != -1) {
-		entry = l_new(struct attr_handler_entry, 1);
+		if (L_WARN_ON(n_entries == L_ARRAY_SIZE(entries)))
+			return -EINVAL;
 
-		entry->type = type;
-		entry->flags = va_arg(args, unsigned int);
-		entry->data = va_arg(args, void *);
+		entries[n_entries].type = type;
+		entries[n_entries].flags = va_arg(args, unsigned int);
+		entries[n_entries].data = va_arg(args, void *);
+		entries[n_entries].present = false;
+		n_entries += 1;
 
 		type = va_arg(args, enum p2p_attr);
-		l_queue_push_tail(entries, entry);
 	}
 
-	va_end(args);
+	/* Parse in place unless the payload is split over several IEs */
+	p2p_data = ie_tlv_peek_p2p_payload(pdu, len, &p2p_len);
+	if (!p2p_data && p2p_len == -EMSGSIZE)
+		p2p_data = p2p_copy = ie_tlv_extract_p2p_payload(pdu, len,
+								&p2p_len);
+
+	if (!p2p_data)
+		return p2p_len;
+
+	p2p_attr_iter_init(&iter, p2p_data, p2p_len);
 
 	while (p2p_attr_iter_next(&iter)) {
+		struct attr_handler_entry *entry = NULL;
 		attr_handler handler;
 
-		for (e = l_queue_get_entries(entries); e; e = e->next) {
-			entry = e->data;
-
-			if (p2p_attr_iter_get_type(&iter) == entry->type)
+		for (i = 0; i < n_entries; i++)
+			if (p2p_attr_iter_get_type(&iter) == entries[i].type) {
+				entry = &entries[i];
 				break;
-		}
+			}
 
-		if (!e || entry->present) {
-			parse_error = true;
+		if (!entry || entry->present) {
+			r = -EBADMSG;
 			goto done;
 		}
 
 		entry->present = true;
-		handler = handler_for_type(entry->type);
+
+		if (shallow)
+			handler = shallow_handler_for_type(entry->type);
+		else
+			handler = handler_for_type(entry->type);
 
 		if (!handler(p2p_attr_iter_get_data(&iter),
 				p2p_attr_iter_get_length(&iter), entry->data)) {
-			parse_error = true;
+			r = -EBADMSG;
 			goto done;
 		}
 	}
 
-	for (e = l_queue_get_entries(entries); e; e = e->next) {
-		entry = e->data;
-
-		if (!entry->present && (entry->flags & ATTR_FLAG_REQUIRED)) {
-			have_required = false;
+	for (i = 0; i < n_entries; i++)
+		if (!entries[i].present &&
+				(entries[i].flags & ATTR_FLAG_REQUIRED)) {
+			r = -EINVAL;
 			goto done;
 		}
-	}
 
 done:
-	l_free(p2p_data);
-	l_queue_destroy(entries, l_free);
+	l_free(p2p_copy);
+	return r;
+}
 
-	if (!have_required)
-		return -EINVAL;
-	if (parse_error)
-		return -EBADMSG;
+static int p2p_parse_attrs(const uint8_t *pdu, size_t len, int type, ...)
+{
+	va_list args;
+	int r;
 
-	return 0;
+	va_start(args, type);
+	r = p2p_parse_attrs_valist(pdu, len, false, type, args);
+	va_end(args);
+
+	return r;
+}
+
+static int p2p_parse_attrs_shallow(const uint8_t *pdu, size_t len,
+					int type, ...)
+{
+	va_list args;
+	int r;
+
+	va_start(args, type);
+	r = p2p_parse_attrs_valist(pdu, len, true, type, args);
+	va_end(args);
+
+	return r;
 }
 
 #define REQUIRED(attr, out) \
@@ -770,13 +889,17 @@ done:
 #define OPTIONAL(attr, out) \
 	P2P_ATTR_ ## attr, 0, out
 
+typedef int (*p2p_parse_attrs_func_t)(const uint8_t *pdu, size_t len,
+					int type, ...);
+
 /* Section 4.2.1 */
-int p2p_parse_beacon(const uint8_t *pdu, size_t len, struct p2p_beacon *out)
+static int parse_beacon(const uint8_t *pdu, size_t len, struct p2p_beacon *out,
+			p2p_parse_attrs_func_t parse_attrs)
 {
 	struct p2p_beacon d = {};
 	int r;
 
-	r = p2p_parse_attrs(pdu, len,
+	r = parse_attrs(pdu, len,
 			REQUIRED(P2P_CAPABILITY, &d.capability),
 			REQUIRED(P2P_DEVICE_ID, &d.device_addr),
 			OPTIONAL(NOTICE_OF_ABSENCE, &d.notice_of_absence),
@@ -790,14 +913,34 @@ int p2p_parse_beacon(const uint8_t *pdu, size_t len, struct p2p_beacon *out)
 	return r;
 }
 
+int p2p_parse_beacon(const uint8_t *pdu, size_t len, struct p2p_beacon *out)
+{
+	return parse_beacon(pdu, len, out, p2p_parse_attrs);
+}
+
+/*
+ * The _shallow variants validate the frame just as thoroughly but skip
+ * building the variable-length lists: Notice of Absence descriptors,
+ * secondary device types, Group Info clients, service hashes and
+ * advertised services are left NULL.  This is what discovery wants for
+ * every frame received from every peer, the full parse can still be done
+ * on demand from the frame IEs.
+ */
+int p2p_parse_beacon_shallow(const uint8_t *pdu, size_t len,
+				struct p2p_beacon *out)
+{
+	return parse_beacon(pdu, len, out, p2p_parse_attrs_shallow);
+}
+
 /* Section 4.2.2 */
-int p2p_parse_probe_req(const uint8_t *pdu, size_t len,
-			struct p2p_probe_req *out)
+static int parse_probe_req(const uint8_t *pdu, size_t len,
+				struct p2p_probe_req *out,
+				p2p_parse_attrs_func_t parse_attrs)
 {
 	struct p2p_probe_req d = {};
 	int r;
 
-	r = p2p_parse_attrs(pdu, len,
+	r = parse_attrs(pdu, len,
 			REQUIRED(P2P_CAPABILITY, &d.capability),
 			OPTIONAL(P2P_DEVICE_ID, &d.device_addr),
 			OPTIONAL(LISTEN_CHANNEL, &d.listen_channel),
@@ -821,14 +964,27 @@ int p2p_parse_probe_req(const uint8_t *pdu, size_t len,
 	return r;
 }
 
+int p2p_parse_probe_req(const uint8_t *pdu, size_t len,
+			struct p2p_probe_req *out)
+{
+	return parse_probe_req(pdu, len, out, p2p_parse_attrs);
+}
+
+int p2p_parse_probe_req_shallow(const uint8_t *pdu, size_t len,
+				struct p2p_probe_req *out)
+{
+	return parse_probe_req(pdu, len, out, p2p_parse_attrs_shallow);
+}
+
 /* Section 4.2.3 */
-int p2p_parse_probe_resp(const uint8_t *pdu, size_t len,
-				struct p2p_probe_resp *out)
+static int parse_probe_resp(const uint8_t *pdu, size_t len,
+				struct p2p_probe_resp *out,
+				p2p_parse_attrs_func_t parse_attrs)
 {
 	struct p2p_probe_resp d = {};
 	int r;
 
-	r = p2p_parse_attrs(pdu, len,
+	r = parse_attrs(pdu, len,
 			REQUIRED(P2P_CAPABILITY, &d.capability),
 			OPTIONAL(EXTENDED_LISTEN_TIMING,
 					&d.listen_availability),
@@ -846,6 +1002,18 @@ int p2p_parse_probe_resp(const uint8_t *pdu, size_t len,
 	return r;
 }
 
+int p2p_parse_probe_resp(const uint8_t *pdu, size_t len,
+				struct p2p_probe_resp *out)
+{
+	return parse_probe_resp(pdu, len, out, p2p_parse_attrs);
+}
+
+int p2p_parse_probe_resp_shallow(const uint8_t *pdu, size_t len,
+					struct p2p_probe_resp *out)
+{
+	return parse_probe_resp(pdu, len, out, p2p_parse_attrs_shallow);
+}
+
 /* Section 4.2.4 */
 int p2p_parse_association_req(const uint8_t *pdu, size_t len,
 				struct p2p_association_req *out)
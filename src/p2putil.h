@@ -509,6 +509,12 @@ int p2p_parse_probe_req(const uint8_t *pdu, size_t len,
 			struct p2p_probe_req *out);
 int p2p_parse_probe_resp(const uint8_t *pdu, size_t len,
 				struct p2p_probe_resp *out);
+int p2p_parse_beacon_shallow(const uint8_t *pdu, size_t len,
+				struct p2p_beacon *out);
+int p2p_parse_probe_req_shallow(const uint8_t *pdu, size_t len,
+				struct p2p_probe_req *out);
+int p2p_parse_probe_resp_shallow(const uint8_t *pdu, size_t len,
+					struct p2p_probe_resp *out);
 int p2p_parse_association_req(const uint8_t *pdu, size_t len,
 				struct p2p_association_req *out);
 int p2p_parse_association_resp(const uint8_t *pdu, size_t len,
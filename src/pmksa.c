@@ -0,0 +1,204 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2020  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <ell/ell.h>
+
+#include "src/missing.h"
+#include "src/ie.h"
+#include "src/pmksa.h"
+
+/* dot11RSNAConfigPMKLifetime default, 12 hours */
+#define PMKSA_DEFAULT_LIFETIME_US	(43200ULL * 1000000)
+#define PMKSA_CACHE_SIZE		32
+
+/*
+ * PMK Security Associations established through 802.1X, most recently used
+ * first.  Reconnecting to a BSS we hold a PMKSA for only requires the 4-Way
+ * Handshake, the full EAP exchange is skipped.
+ */
+static struct l_queue *pmksa_cache;
+
+struct pmksa_match_data {
+	const uint8_t *spa;
+	const uint8_t *aa;
+	const uint8_t *ssid;
+	size_t ssid_len;
+};
+
+static void pmksa_free(void *data)
+{
+	struct pmksa *pmksa = data;
+
+	explicit_bzero(pmksa->pmk, sizeof(pmksa->pmk));
+	l_free(pmksa);
+}
+
+static bool pmksa_match(const void *a, const void *b)
+{
+	const struct pmksa *pmksa = a;
+	const struct pmksa_match_data *data = b;
+
+	if (data->spa && memcmp(pmksa->spa, data->spa, 6))
+		return false;
+
+	if (data->aa && memcmp(pmksa->aa, data->aa, 6))
+		return false;
+
+	if (!data->ssid)
+		return true;
+
+	return pmksa->ssid_len == data->ssid_len &&
+			!memcmp(pmksa->ssid, data->ssid, data->ssid_len);
+}
+
+static bool pmksa_remove_expired(void *data, void *user_data)
+{
+	struct pmksa *pmksa = data;
+	uint64_t now = l_get_u64(user_data);
+
+	if (l_time_before(now, pmksa->expiry))
+		return false;
+
+	pmksa_free(pmksa);
+	return true;
+}
+
+static void pmksa_cache_prune(void)
+{
+	uint64_t now = l_time_now();
+
+	l_queue_foreach_remove(pmksa_cache, pmksa_remove_expired, &now);
+}
+
+/*
+ * PMKSA caching is only done for the plain 802.1X AKMs, FT and FILS have
+ * their own key hierarchies and caches
+ */
+bool pmksa_akm_supported(uint32_t akm)
+{
+	return akm == IE_RSN_AKM_SUITE_8021X ||
+		akm == IE_RSN_AKM_SUITE_8021X_SHA256;
+}
+
+const struct pmksa *pmksa_cache_get(const uint8_t *spa, const uint8_t *aa,
+					const uint8_t *ssid, size_t ssid_len,
+					uint32_t akm)
+{
+	struct pmksa_match_data data = { spa, aa, ssid, ssid_len };
+	struct pmksa *pmksa;
+
+	pmksa_cache_prune();
+
+	pmksa = l_queue_find(pmksa_cache, pmksa_match, &data);
+	if (!pmksa || pmksa->akm != akm)
+		return NULL;
+
+	/* Keep the most recently used entries at the head */
+	l_queue_remove(pmksa_cache, pmksa);
+	l_queue_push_head(pmksa_cache, pmksa);
+
+	return pmksa;
+}
+
+/*
+ * Adds or replaces the PMKSA for the spa/aa/ssid combination.  Putting a
+ * PMKSA identical to the cached one, as happens after every 4-Way Handshake
+ * that used the cache, leaves its expiry untouched.
+ */
+void pmksa_cache_put(const struct pmksa *pmksa)
+{
+	struct pmksa_match_data data = { pmksa->spa, pmksa->aa, pmksa->ssid,
+						pmksa->ssid_len };
+	struct pmksa *entry;
+
+	if (L_WARN_ON(pmksa->pmk_len > sizeof(pmksa->pmk) ||
+			pmksa->ssid_len > sizeof(pmksa->ssid)))
+		return;
+
+	if (!pmksa_cache)
+		pmksa_cache = l_queue_new();
+
+	pmksa_cache_prune();
+
+	entry = l_queue_remove_if(pmksa_cache, pmksa_match, &data);
+	if (entry && (entry->akm != pmksa->akm ||
+				memcmp(entry->pmkid, pmksa->pmkid, 16))) {
+		pmksa_free(entry);
+		entry = NULL;
+	}
+
+	if (!entry) {
+		entry = l_memdup(pmksa, sizeof(*pmksa));
+		entry->expiry = l_time_offset(l_time_now(),
+						PMKSA_DEFAULT_LIFETIME_US);
+	}
+
+	l_queue_push_head(pmksa_cache, entry);
+
+	if (l_queue_length(pmksa_cache) > PMKSA_CACHE_SIZE) {
+		entry = l_queue_peek_tail(pmksa_cache);
+		l_queue_remove(pmksa_cache, entry);
+		pmksa_free(entry);
+	}
+}
+
+void pmksa_cache_remove(const uint8_t *spa, const uint8_t *aa,
+					const uint8_t *ssid, size_t ssid_len)
+{
+	struct pmksa_match_data data = { spa, aa, ssid, ssid_len };
+	struct pmksa *pmksa;
+
+	pmksa = l_queue_remove_if(pmksa_cache, pmksa_match, &data);
+	if (pmksa)
+		pmksa_free(pmksa);
+}
+
+static bool pmksa_flush_match(void *data, void *user_data)
+{
+	struct pmksa *pmksa = data;
+
+	if (!pmksa_match(pmksa, user_data))
+		return false;
+
+	pmksa_free(pmksa);
+	return true;
+}
+
+/* Drops the PMKSAs for the given SSID, or all of them if ssid is NULL */
+void pmksa_cache_flush(const uint8_t *ssid, size_t ssid_len)
+{
+	struct pmksa_match_data data = { NULL, NULL, ssid, ssid_len };
+
+	if (!ssid) {
+		l_queue_destroy(pmksa_cache, pmksa_free);
+		pmksa_cache = NULL;
+		return;
+	}
+
+	l_queue_foreach_remove(pmksa_cache, pmksa_flush_match, &data);
+}
@@ -0,0 +1,43 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2020  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+struct pmksa {
+	uint8_t spa[6];
+	uint8_t aa[6];
+	uint8_t ssid[32];
+	size_t ssid_len;
+	uint32_t akm;
+	uint8_t pmkid[16];
+	uint8_t pmk[64];
+	size_t pmk_len;
+	uint64_t expiry;
+};
+
+bool pmksa_akm_supported(uint32_t akm);
+
+const struct pmksa *pmksa_cache_get(const uint8_t *spa, const uint8_t *aa,
+					const uint8_t *ssid, size_t ssid_len,
+					uint32_t akm);
+void pmksa_cache_put(const struct pmksa *pmksa);
+void pmksa_cache_remove(const uint8_t *spa, const uint8_t *aa,
+					const uint8_t *ssid, size_t ssid_len);
+void pmksa_cache_flush(const uint8_t *ssid, size_t ssid_len);
@@ -24,11 +24,16 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 
 #include <ell/ell.h>
 
@@ -372,78 +377,217 @@ static const struct resolve_method_ops resolve_method_systemd_ops = {
 
 char *resolvconf_path;
 
-static bool resolvconf_invoke(const char *ifname, const char *type,
-						const char *content)
-{
-	FILE *resolvconf;
-	L_AUTO_FREE_VAR(char *, cmd) = NULL;
-	int error;
-
-	if (content) {
-		cmd = l_strdup_printf("%s -a %s.%s", resolvconf_path,
-						ifname, type);
-		resolvconf = popen(cmd, "w");
-	} else {
-		cmd = l_strdup_printf("%s -d %s.%s", resolvconf_path,
-						ifname, type);
-		resolvconf = popen(cmd, "r");
+/*
+ * Both the nameservers and the search domains of an interface go into a
+ * single resolvconf record so that a change takes one invocation.  The
+ * resolvconf process is not waited for on the main loop, its exit is
+ * picked up through a pidfd.  Changes made while it is running are
+ * applied once it exits.
+ */
+struct resolvconf {
+	struct resolve super;
+	char *ifname;
+	char *dns;		/* Wanted "nameserver" lines */
+	char *domains;		/* Wanted "search" lines */
+	char *applied;		/* Record content resolvconf has */
+	char *pending;		/* Content being applied by the child */
+	struct l_idle *update;
+	pid_t pid;
+	struct l_io *child_io;
+	bool destroyed : 1;
+};
+
+static struct l_queue *resolvconf_running;
+
+static void resolvconf_update(struct resolvconf *rc);
+
+static void resolvconf_free(struct resolvconf *rc)
+{
+	l_idle_remove(rc->update);
+	l_free(rc->ifname);
+	l_free(rc->dns);
+	l_free(rc->domains);
+	l_free(rc->applied);
+	l_free(rc->pending);
+	l_free(rc);
+}
+
+static void resolvconf_child_exited(struct resolvconf *rc, int status)
+{
+	rc->pid = 0;
+	l_queue_remove(resolvconf_running, rc);
+
+	/* Not retried on failure, only once the wanted content changes */
+	if (status)
+		l_info("resolve: %s exited with status (%d).", resolvconf_path,
+									status);
+
+	l_free(rc->applied);
+	rc->applied = rc->pending;
+	rc->pending = NULL;
+
+	/* Apply whatever changed in the meantime */
+	resolvconf_update(rc);
+}
+
+static void resolvconf_child_io_free(void *user_data)
+{
+	l_io_destroy(user_data);
+}
+
+static bool resolvconf_child_read(struct l_io *io, void *user_data)
+{
+	struct resolvconf *rc = user_data;
+	int status;
+
+	if (waitpid(rc->pid, &status, WNOHANG) <= 0)
+		return true;
+
+	/* Can't be destroyed from its own handler */
+	l_idle_oneshot(resolvconf_child_io_free, io, NULL);
+	rc->child_io = NULL;
+	resolvconf_child_exited(rc, status);
+
+	return false;
+}
+
+static int resolvconf_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static bool resolvconf_spawn(struct resolvconf *rc, const char *content)
+{
+	L_AUTO_FREE_VAR(char *, record) =
+				l_strdup_printf("%s.iwd", rc->ifname);
+	char *argv[] = { resolvconf_path, content ? "-a" : "-d", record,
+				NULL };
+	posix_spawn_file_actions_t actions;
+	int fds[2];
+	int pidfd;
+	int status;
+	int err;
+
+	if (pipe2(fds, O_CLOEXEC) < 0) {
+		l_error("resolve: Failed to create pipe (%s).",
+							strerror(errno));
+		return false;
 	}
 
-	if (!resolvconf) {
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+
+	err = posix_spawn(&rc->pid, resolvconf_path, &actions, NULL, argv,
+				environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fds[0]);
+
+	if (err) {
 		l_error("resolve: Failed to start %s (%s).", resolvconf_path,
-							strerror(errno));
+							strerror(err));
+		close(fds[1]);
+		rc->pid = 0;
 		return false;
 	}
 
-	if (content && fprintf(resolvconf, "%s", content) < 0)
+	/* The records are short enough not to block on the pipe */
+	if (content && write(fds[1], content, strlen(content)) < 0)
 		l_error("resolve: Failed to print into %s stdin.",
 							resolvconf_path);
 
-	error = pclose(resolvconf);
-	if (error < 0)
-		l_error("resolve: Failed to close pipe to %s (%s).",
-					resolvconf_path, strerror(errno));
-	else if (error > 0)
-		l_info("resolve: %s exited with status (%d).", resolvconf_path,
-									error);
+	close(fds[1]);
+
+	rc->pending = l_strdup(content);
+
+	pidfd = resolvconf_pidfd_open(rc->pid);
+	if (pidfd < 0) {
+		/* Older kernels, wait for it here */
+		if (waitpid(rc->pid, &status, 0) < 0)
+			status = -errno;
 
-	return !error;
+		resolvconf_child_exited(rc, status);
+		return true;
+	}
+
+	rc->child_io = l_io_new(pidfd);
+	l_io_set_close_on_destroy(rc->child_io, true);
+	l_io_set_read_handler(rc->child_io, resolvconf_child_read, rc, NULL);
+	l_queue_push_tail(resolvconf_running, rc);
+
+	return true;
 }
 
-struct resolvconf {
-	struct resolve super;
-	bool have_domain : 1;
-	bool have_dns : 1;
-	char *ifname;
-};
+static void resolvconf_update(struct resolvconf *rc)
+{
+	L_AUTO_FREE_VAR(char *, content) = NULL;
+
+	if (rc->pid)
+		return;
+
+	/* After resolve_resolvconf_exit() */
+	if (!resolvconf_path)
+		goto done;
+
+	if (rc->dns || rc->domains)
+		content = l_strdup_printf("%s%s", rc->dns ?: "",
+						rc->domains ?: "");
+
+	/* Nothing to do if resolvconf already has this content */
+	if ((content && rc->applied ? strcmp(content, rc->applied) :
+						content != rc->applied) &&
+			resolvconf_spawn(rc, content))
+		return;
+
+done:
+	if (rc->destroyed)
+		resolvconf_free(rc);
+}
+
+static void resolvconf_update_cb(struct l_idle *idle, void *user_data)
+{
+	struct resolvconf *rc = user_data;
+
+	l_idle_remove(rc->update);
+	rc->update = NULL;
+
+	resolvconf_update(rc);
+}
+
+static void resolvconf_schedule_update(struct resolvconf *rc)
+{
+	/* Lets the DNS and domain changes of one netconfig event coalesce */
+	if (!rc->update)
+		rc->update = l_idle_create(resolvconf_update_cb, rc, NULL);
+}
 
 static void resolve_resolvconf_set_dns(struct resolve *resolve, char **dns_list)
 {
 	struct resolvconf *rc =
 			l_container_of(resolve, struct resolvconf, super);
 	struct l_string *content;
-	L_AUTO_FREE_VAR(char *, str) = NULL;
 
 	if (L_WARN_ON(!resolvconf_path))
 		return;
 
-	if (!dns_list || !dns_list[0]) {
-		if (rc->have_dns)
-			resolvconf_invoke(rc->ifname, "dns", NULL);
-
-		rc->have_dns = false;
-		return;
-	}
+	l_free(rc->dns);
+	rc->dns = NULL;
 
-	content = l_string_new(0);
+	if (dns_list && dns_list[0]) {
+		content = l_string_new(0);
 
-	for (; *dns_list; dns_list++)
-		l_string_append_printf(content, "nameserver %s\n", *dns_list);
+		for (; *dns_list; dns_list++)
+			l_string_append_printf(content, "nameserver %s\n",
+						*dns_list);
 
-	str = l_string_unwrap(content);
+		rc->dns = l_string_unwrap(content);
+	}
 
-	if (resolvconf_invoke(rc->ifname, "dns", str))
-		rc->have_dns = true;
+	resolvconf_schedule_update(rc);
 }
 
 static void resolve_resolvconf_set_domains(struct resolve *resolve,
@@ -452,28 +596,24 @@ static void resolve_resolvconf_set_domains(struct resolve *resolve,
 	struct resolvconf *rc =
 			l_container_of(resolve, struct resolvconf, super);
 	struct l_string *content;
-	L_AUTO_FREE_VAR(char *, str) = NULL;
 
 	if (L_WARN_ON(!resolvconf_path))
 		return;
 
-	if (!domain_list || !domain_list[0]) {
-		if (rc->have_domain)
-			resolvconf_invoke(rc->ifname, "domain", NULL);
+	l_free(rc->domains);
+	rc->domains = NULL;
 
-		rc->have_domain = false;
-		return;
-	}
+	if (domain_list && domain_list[0]) {
+		content = l_string_new(0);
 
-	content = l_string_new(0);
+		for (; *domain_list; domain_list++)
+			l_string_append_printf(content, "search %s\n",
+						*domain_list);
 
-	for (; *domain_list; domain_list++)
-		l_string_append_printf(content, "search %s\n", *domain_list);
-
-	str = l_string_unwrap(content);
+		rc->domains = l_string_unwrap(content);
+	}
 
-	if (resolvconf_invoke(rc->ifname, "domain", str))
-		rc->have_domain = true;
+	resolvconf_schedule_update(rc);
 }
 
 static void resolve_resolvconf_revert(struct resolve *resolve)
@@ -481,14 +621,12 @@ static void resolve_resolvconf_revert(struct resolve *resolve)
 	struct resolvconf *rc =
 			l_container_of(resolve, struct resolvconf, super);
 
-	if (rc->have_dns)
-		resolvconf_invoke(rc->ifname, "dns", NULL);
+	l_free(rc->dns);
+	rc->dns = NULL;
+	l_free(rc->domains);
+	rc->domains = NULL;
 
-	if (rc->have_domain)
-		resolvconf_invoke(rc->ifname, "domain", NULL);
-
-	rc->have_dns = false;
-	rc->have_domain = false;
+	resolvconf_schedule_update(rc);
 }
 
 static void resolve_resolvconf_destroy(struct resolve *resolve)
@@ -496,8 +634,12 @@ static void resolve_resolvconf_destroy(struct resolve *resolve)
 	struct resolvconf *rc =
 			l_container_of(resolve, struct resolvconf, super);
 
-	l_free(rc->ifname);
-	l_free(rc);
+	/* Freed once any pending change has been applied */
+	rc->destroyed = true;
+	l_idle_remove(rc->update);
+	rc->update = NULL;
+
+	resolvconf_update(rc);
 }
 
 static struct resolve_ops resolvconf_ops = {
@@ -529,11 +671,28 @@ static int resolve_resolvconf_init(void)
 	}
 
 	l_debug("resolvconf found as: %s", resolvconf_path);
+	resolvconf_running = l_queue_new();
 	return 0;
 }
 
+static void resolvconf_reap(void *data)
+{
+	struct resolvconf *rc = data;
+
+	waitpid(rc->pid, NULL, 0);
+	rc->pid = 0;
+	l_io_destroy(rc->child_io);
+	rc->child_io = NULL;
+
+	if (rc->destroyed)
+		resolvconf_free(rc);
+}
+
 static void resolve_resolvconf_exit(void)
 {
+	l_queue_destroy(resolvconf_running, resolvconf_reap);
+	resolvconf_running = NULL;
+
 	l_free(resolvconf_path);
 	resolvconf_path = NULL;
 }
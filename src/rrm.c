@@ -110,8 +110,11 @@ struct rrm_beacon_req_info {
 	uint8_t bssid[6];	/* Request filtered by BSSID */
 	char ssid[33];		/* Request filtered by SSID */
 	bool has_ssid;
+	uint8_t measurement_mode;
 	uint32_t scan_id;
 	uint64_t scan_start_time;
+	/* Requests answered with the results of this one's scan */
+	struct l_queue *joined;
 };
 
 /* Per-netdev state */
@@ -143,6 +146,7 @@ struct rrm_beacon_report {
 static struct l_queue *states;
 static struct l_genl_family *nl80211;
 static uint32_t netdev_watch;
+static uint64_t beacon_report_max_age;
 
 static void rrm_info_destroy(void *data)
 {
@@ -152,6 +156,7 @@ static void rrm_info_destroy(void *data)
 						struct rrm_beacon_req_info,
 						info);
 
+	l_queue_destroy(beacon->joined, rrm_info_destroy);
 	l_free(beacon);
 }
 
@@ -208,9 +213,13 @@ static bool rrm_send_response(struct rrm_state *rrm,
 }
 
 static void rrm_reject_measurement_request(struct rrm_state *rrm,
+						struct rrm_request_info *info,
 						uint8_t mode)
 {
-	struct rrm_request_info *info = rrm->pending;
+	struct rrm_beacon_req_info *beacon = l_container_of(info,
+						struct rrm_beacon_req_info,
+						info);
+	struct rrm_request_info *joined;
 	uint8_t frame[8];
 
 	frame[0] = 0x05; /* Category: Radio Measurement */
@@ -225,8 +234,10 @@ static void rrm_reject_measurement_request(struct rrm_state *rrm,
 	if (!rrm_send_response(rrm, frame, sizeof(frame)))
 		l_error("failed to send rejection");
 
+	while ((joined = l_queue_pop_head(beacon->joined)))
+		rrm_reject_measurement_request(rrm, joined, mode);
+
 	rrm_info_destroy(info);
-	rrm->pending = NULL;
 }
 
 static void rrm_build_measurement_report(struct rrm_request_info *info,
@@ -322,15 +333,35 @@ static bool bss_in_request_range(struct rrm_beacon_req_info *beacon,
 	return false;
 }
 
+static bool rrm_beacon_match_bss(struct rrm_beacon_req_info *beacon,
+					struct scan_bss *bss)
+{
+	/* If request included a specific BSSID match only this BSS */
+	if (!util_is_broadcast_address(beacon->bssid) &&
+			memcmp(bss->addr, beacon->bssid, 6) != 0)
+		return false;
+
+	/* If request was for a certain SSID, match only this SSID */
+	if (beacon->has_ssid && strncmp(beacon->ssid,
+						(const char *)bss->ssid,
+						sizeof(bss->ssid)) != 0)
+		return false;
+
+	return true;
+}
+
+/*
+ * Sends a report for @beacon, and for any requests that joined its scan,
+ * built from @bss_list.  @beacon is freed.
+ */
 static bool rrm_report_beacon_results(struct rrm_state *rrm,
+					struct rrm_beacon_req_info *beacon,
 					struct l_queue *bss_list)
 {
-	struct rrm_beacon_req_info *beacon = l_container_of(rrm->pending,
-						struct rrm_beacon_req_info,
-						info);
-	bool wildcard = util_is_broadcast_address(beacon->bssid);
+	struct rrm_request_info *joined;
 	const struct l_queue_entry *entry;
 	uint8_t frame[512];
+	bool ret;
 	uint8_t *ptr = frame;
 
 	*ptr++ = 0x05; /* Category: Radio Measurement */
@@ -343,14 +374,7 @@ static bool rrm_report_beacon_results(struct rrm_state *rrm,
 		uint8_t report[257];
 		size_t report_len;
 
-		/* If request included a specific BSSID match only this BSS */
-		if (!wildcard && memcmp(bss->addr, beacon->bssid, 6) != 0)
-			continue;
-
-		/* If request was for a certain SSID, match only this SSID */
-		if (beacon->has_ssid && strncmp(beacon->ssid,
-							(const char *)bss->ssid,
-							sizeof(bss->ssid)) != 0)
+		if (!rrm_beacon_match_bss(beacon, bss))
 			continue;
 
 		/*
@@ -369,10 +393,20 @@ static bool rrm_report_beacon_results(struct rrm_state *rrm,
 		ptr += report_len + 5;
 	}
 
+	ret = rrm_send_response(rrm, frame, ptr - frame);
+
+	while ((joined = l_queue_pop_head(beacon->joined))) {
+		struct rrm_beacon_req_info *j = l_container_of(joined,
+						struct rrm_beacon_req_info,
+						info);
+
+		j->scan_start_time = beacon->scan_start_time;
+		rrm_report_beacon_results(rrm, j, bss_list);
+	}
+
 	rrm_info_destroy(&beacon->info);
-	rrm->pending = NULL;
 
-	return rrm_send_response(rrm, frame, ptr - frame);
+	return ret;
 }
 
 static void rrm_handle_beacon_table(struct rrm_state *rrm,
@@ -382,14 +416,62 @@ static void rrm_handle_beacon_table(struct rrm_state *rrm,
 
 	bss_list = station_get_bss_list(rrm->station);
 	if (!bss_list) {
-		rrm_reject_measurement_request(rrm, REPORT_REJECT_INCAPABLE);
+		rrm_reject_measurement_request(rrm, &beacon->info,
+						REPORT_REJECT_INCAPABLE);
 		return;
 	}
 
-	if (!rrm_report_beacon_results(rrm, bss_list))
+	if (!rrm_report_beacon_results(rrm, beacon, bss_list))
 		l_error("Error reporting beacon table results");
 }
 
+/*
+ * Whether an active or passive measurement can be answered with the
+ * station's scan results instead of a new scan: every BSS it would report
+ * must have been seen within the last BeaconReportMaxAge, and there must
+ * be at least one.  We have no record of when a channel was scanned with
+ * nothing found so an empty channel always gets scanned.
+ */
+static bool rrm_beacon_cache_is_fresh(struct rrm_state *rrm,
+					struct rrm_beacon_req_info *beacon)
+{
+	const struct l_queue_entry *entry;
+	uint64_t now = l_time_now();
+	bool found = false;
+
+	if (!beacon_report_max_age)
+		return false;
+
+	for (entry = l_queue_get_entries(station_get_bss_list(rrm->station));
+			entry; entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+
+		if (!bss_in_request_range(beacon, bss) ||
+				!rrm_beacon_match_bss(beacon, bss))
+			continue;
+
+		if (l_time_after(now, bss->time_stamp + beacon_report_max_age))
+			return false;
+
+		found = true;
+	}
+
+	return found;
+}
+
+/* Whether @beacon can be answered with the results of @pending's scan */
+static bool rrm_beacon_can_join(struct rrm_beacon_req_info *pending,
+					struct rrm_beacon_req_info *beacon)
+{
+	return pending->scan_id &&
+		pending->measurement_mode == beacon->measurement_mode &&
+		pending->oper_class == beacon->oper_class &&
+		pending->channel == beacon->channel &&
+		pending->duration == beacon->duration &&
+		test_bit(&pending->info.mode, 4) ==
+					test_bit(&beacon->info.mode, 4);
+}
+
 static bool rrm_scan_results(int err, struct l_queue *bss_list,
 				const struct scan_freq_set *freqs,
 				void *userdata)
@@ -400,10 +482,11 @@ static bool rrm_scan_results(int err, struct l_queue *bss_list,
 						info);
 
 	beacon->scan_id = 0;
+	rrm->pending = NULL;
 
 	l_debug("RRM scan results for %u APs", l_queue_length(bss_list));
 
-	rrm_report_beacon_results(rrm, bss_list);
+	rrm_report_beacon_results(rrm, beacon, bss_list);
 	/* We aren't saving this BSS list */
 	return false;
 }
@@ -417,7 +500,9 @@ static void rrm_scan_triggered(int err, void *userdata)
 
 	if (err < 0) {
 		l_error("Could not start RRM scan");
-		rrm_reject_measurement_request(rrm, REPORT_REJECT_INCAPABLE);
+		rrm->pending = NULL;
+		rrm_reject_measurement_request(rrm, &beacon->info,
+						REPORT_REJECT_INCAPABLE);
 		return;
 	}
 
@@ -429,9 +514,10 @@ static void rrm_handle_beacon_scan(struct rrm_state *rrm,
 					struct rrm_beacon_req_info *beacon,
 					bool passive)
 {
-	struct scan_freq_set *freqs = scan_freq_set_new();
+	struct rrm_beacon_req_info *pending;
+	struct scan_freq_set freqs = {};
 	struct scan_parameters params = {
-		.freqs = freqs,
+		.freqs = &freqs,
 		.flush = true,
 		.duration = beacon->duration,
 		.duration_mandatory = test_bit(&beacon->info.mode, 4),
@@ -439,8 +525,40 @@ static void rrm_handle_beacon_scan(struct rrm_state *rrm,
 	enum scan_band band = scan_oper_class_to_band(NULL, beacon->oper_class);
 	uint32_t freq;
 
+	if (rrm_beacon_cache_is_fresh(rrm, beacon)) {
+		l_debug("Reporting cached scan results for channel %u",
+			beacon->channel);
+
+		if (!rrm_report_beacon_results(rrm, beacon,
+					station_get_bss_list(rrm->station)))
+			l_error("Error reporting cached beacon results");
+
+		return;
+	}
+
+	if (rrm->pending) {
+		pending = l_container_of(rrm->pending,
+						struct rrm_beacon_req_info,
+						info);
+
+		if (!rrm_beacon_can_join(pending, beacon)) {
+			l_debug("Measurement already in progress, ignoring");
+			rrm_info_destroy(&beacon->info);
+			return;
+		}
+
+		l_debug("Joining measurement in progress on channel %u",
+			beacon->channel);
+
+		if (!pending->joined)
+			pending->joined = l_queue_new();
+
+		l_queue_push_tail(pending->joined, &beacon->info);
+		return;
+	}
+
 	freq = scan_channel_to_freq(beacon->channel, band);
-	scan_freq_set_add(freqs, freq);
+	scan_freq_set_add(&freqs, freq);
 
 	if (passive)
 		beacon->scan_id = scan_passive_full(rrm->wdev_id, &params,
@@ -453,12 +571,12 @@ static void rrm_handle_beacon_scan(struct rrm_state *rrm,
 						rrm_scan_results, rrm,
 						NULL);
 
-	scan_freq_set_free(freqs);
-
 	if (beacon->scan_id == 0) {
 		rrm_info_destroy(&beacon->info);
-		rrm->pending = NULL;
+		return;
 	}
+
+	rrm->pending = &beacon->info;
 }
 
 static bool rrm_verify_beacon_request(const uint8_t *request, size_t len)
@@ -513,7 +631,6 @@ static void rrm_handle_beacon_request(struct rrm_state *rrm,
 	beacon->info.mode = request[1];
 	beacon->info.type = request[2];
 
-	rrm->pending = &beacon->info;
 	/*
 	 * 802.11-2016 11.11.8
 	 *
@@ -546,6 +663,7 @@ static void rrm_handle_beacon_request(struct rrm_state *rrm,
 
 	beacon->oper_class = request[0];
 	beacon->channel = request[1];
+	beacon->measurement_mode = request[6];
 	beacon->duration = l_get_le16(request + 4);
 	memcpy(beacon->bssid, request + 7, 6);
 
@@ -626,11 +744,13 @@ static void rrm_handle_beacon_request(struct rrm_state *rrm,
 	}
 
 reject_refused:
-	rrm_reject_measurement_request(rrm, REPORT_REJECT_REFUSED);
+	rrm_reject_measurement_request(rrm, &beacon->info,
+					REPORT_REJECT_REFUSED);
 	return;
 
 reject_incapable:
-	rrm_reject_measurement_request(rrm, REPORT_REJECT_INCAPABLE);
+	rrm_reject_measurement_request(rrm, &beacon->info,
+					REPORT_REJECT_INCAPABLE);
 }
 
 static void rrm_cancel_pending(struct rrm_state *rrm)
@@ -702,10 +822,10 @@ static void rrm_frame_watch_cb(const struct mmpdu_header *mpdu,
 	}
 
 	/*
-	 * Ignore if not connected or already have an outstanding request
+	 * Ignore if not connected.  Requests arriving while a measurement
+	 * scan is outstanding may join it, see rrm_handle_beacon_scan.
 	 */
-	if (station_get_state(rrm->station) != STATION_STATE_CONNECTED ||
-				rrm->pending)
+	if (station_get_state(rrm->station) != STATION_STATE_CONNECTED)
 		return;
 
 	bss = station_get_connected_bss(rrm->station);
@@ -852,9 +972,16 @@ static void rrm_netdev_watch(struct netdev *netdev,
 static int rrm_init(void)
 {
 	struct l_genl *genl = iwd_get_genl();
+	uint32_t max_age;
 
 	states = l_queue_new();
 
+	if (!l_settings_get_uint(iwd_get_config(), "Scan",
+					"BeaconReportMaxAge", &max_age))
+		max_age = 0;
+
+	beacon_report_max_age = max_age * L_USEC_PER_MSEC;
+
 	nl80211 = l_genl_family_new(genl, NL80211_GENL_NAME);
 
 	netdev_watch = netdev_watch_add(rrm_netdev_watch, NULL, NULL);
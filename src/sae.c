@@ -34,6 +34,7 @@
 #include "src/mpdu.h"
 #include "src/sae.h"
 #include "src/auth-proto.h"
+#include "src/trace.h"
 
 #define SAE_RETRANSMIT_TIMEOUT	2
 #define SAE_SYNC_MAX		3
@@ -54,14 +55,15 @@ struct sae_sm {
 	const struct l_ecc_curve *curve;
 	unsigned int group;
 	uint8_t group_retry;
-	const unsigned int *ecc_groups;
+	/* Groups to offer, the one last accepted by the peer's ESS first */
+	unsigned int ecc_groups[HANDSHAKE_MAX_ECC_GROUPS + 1];
 	struct l_ecc_scalar *rand;
 	struct l_ecc_scalar *scalar;
 	struct l_ecc_scalar *p_scalar;
 	struct l_ecc_point *element;
 	struct l_ecc_point *p_element;
 	uint16_t send_confirm;
-	uint8_t kck[32];
+	uint8_t kck[64];
 	uint8_t pmk[32];
 	uint8_t pmkid[16];
 	uint8_t *token;
@@ -78,9 +80,47 @@ struct sae_sm {
 
 	sae_tx_authenticate_func_t tx_auth;
 	sae_tx_associate_func_t tx_assoc;
+	sae_failed_func_t failed;
 	void *user_data;
+
+	/* Non-NULL while the initial PWE is derived in idle steps */
+	struct sae_pwe_ctx *pwe_ctx;
+	struct l_idle *pwe_idle;
+	bool async_pwe : 1;
+	/* PWE derived with hash-to-element instead of hunting-and-pecking */
+	bool h2e : 1;
 };
 
+/*
+ * IEEE 802.11-2020 Section 12.4.2: hunting-and-pecking always uses SHA-256,
+ * with hash-to-element the hash depends on the length of the prime.
+ */
+static enum l_checksum_type sae_hash(struct sae_sm *sm)
+{
+	if (!sm->h2e)
+		return L_CHECKSUM_SHA256;
+
+	switch (l_ecc_curve_get_scalar_bytes(sm->curve)) {
+	case 32:
+		return L_CHECKSUM_SHA256;
+	case 48:
+		return L_CHECKSUM_SHA384;
+	default:
+		return L_CHECKSUM_SHA512;
+	}
+}
+
+static size_t sae_hash_len(struct sae_sm *sm)
+{
+	return l_checksum_digest_length(sae_hash(sm));
+}
+
+/* Status code used in our commits, H2E is signalled through it */
+static uint16_t sae_commit_status(struct sae_sm *sm)
+{
+	return sm->h2e ? MMPDU_STATUS_CODE_SAE_HASH_TO_ELEMENT : 0;
+}
+
 static bool sae_pwd_seed(const uint8_t *addr1, const uint8_t *addr2,
 				uint8_t *base, size_t base_len,
 				uint8_t counter, uint8_t *out)
@@ -145,7 +185,7 @@ static struct l_ecc_scalar *sae_pwd_value(const struct l_ecc_curve *curve,
 }
 
 /* IEEE 802.11-2016 - Section 12.4.2 Assumptions on SAE */
-static bool sae_cn(const uint8_t *kck, uint16_t send_confirm,
+static bool sae_cn(struct sae_sm *sm, uint16_t send_confirm,
 			struct l_ecc_scalar *scalar1,
 			struct l_ecc_point *element1,
 			struct l_ecc_scalar *scalar2,
@@ -158,9 +198,10 @@ static bool sae_cn(const uint8_t *kck, uint16_t send_confirm,
 	uint8_t e2[L_ECC_POINT_MAX_BYTES];
 	struct l_checksum *hmac;
 	struct iovec iov[5];
+	size_t hash_len = sae_hash_len(sm);
 	int ret;
 
-	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA256, kck, 32);
+	hmac = l_checksum_new_hmac(sae_hash(sm), sm->kck, hash_len);
 	if (!hmac)
 		return false;
 
@@ -177,11 +218,11 @@ static bool sae_cn(const uint8_t *kck, uint16_t send_confirm,
 
 	l_checksum_updatev(hmac, iov, 5);
 
-	ret = l_checksum_get_digest(hmac, confirm, 32);
+	ret = l_checksum_get_digest(hmac, confirm, hash_len);
 
 	l_checksum_free(hmac);
 
-	return (ret == 32);
+	return (ret == (int) hash_len);
 }
 
 static void sae_reject_authentication(struct sae_sm *sm, uint16_t reason)
@@ -265,83 +306,297 @@ static uint8_t sae_is_quadradic_residue(const struct l_ecc_curve *curve,
 }
 
 /*
- * IEEE 802.11-2016 Section 12.4.4.2.2
- * Generation of the password element with ECC groups
+ * PWEs and H2E PTs are expensive to derive, keep the most recent ones around
+ * so that retries, roams and reconnections can skip the derivation.  PWEs are
+ * keyed by the peer address pair and PTs by the SSID.  The password is only
+ * kept as a digest.
  */
-static bool sae_compute_pwe(struct sae_sm *sm, char *password,
-				const uint8_t *addr1, const uint8_t *addr2)
-{
-	uint8_t found = 0;
-	uint8_t is_residue;
-	uint8_t is_odd = 0;
-	uint8_t counter;
-	uint8_t pwd_seed[32];
-	uint8_t x[L_ECC_SCALAR_MAX_BYTES];
-	uint8_t x_cand[L_ECC_SCALAR_MAX_BYTES];
-	struct l_ecc_scalar *pwd_value;
-	uint8_t *dummy;
+#define SAE_POINT_CACHE_SIZE 8
+
+struct sae_point_cache_entry {
+	unsigned int group;
+	uint8_t id[32];
+	size_t id_len;
+	uint8_t digest[32];
+	uint8_t point[L_ECC_POINT_MAX_BYTES];
+	size_t point_len;
+};
+
+static struct l_queue *pwe_cache;
+static struct l_queue *pt_cache;
+
+/* Number of hunting-and-pecking iterations per main loop iteration */
+#define SAE_PWE_ASYNC_ITERATIONS 5
+#define SAE_PWE_ITERATIONS 30
+
+struct sae_pwe_ctx {
+	const struct l_ecc_curve *curve;
+	uint8_t addr1[6];
+	uint8_t addr2[6];
+	uint8_t *password;
 	uint8_t *base;
+	uint8_t *dummy;
 	size_t base_len;
 	struct l_ecc_scalar *qr;
 	struct l_ecc_scalar *qnr;
-	uint8_t qnr_bin[L_ECC_SCALAR_MAX_BYTES] = {0};
+	uint8_t qnr_bin[L_ECC_SCALAR_MAX_BYTES];
+	uint8_t x[L_ECC_SCALAR_MAX_BYTES];
+	uint8_t found;
+	uint8_t is_odd;
+	uint8_t counter;
+};
+
+static void sae_point_cache_entry_free(void *data)
+{
+	struct sae_point_cache_entry *entry = data;
+
+	explicit_bzero(entry, sizeof(*entry));
+	l_free(entry);
+}
+
+static bool sae_password_digest(const char *password, uint8_t *out_digest)
+{
+	struct l_checksum *sha256 = l_checksum_new(L_CHECKSUM_SHA256);
+	bool r;
+
+	if (!sha256)
+		return false;
+
+	r = l_checksum_update(sha256, password, strlen(password)) &&
+		l_checksum_get_digest(sha256, out_digest, 32) == 32;
+	l_checksum_free(sha256);
+
+	return r;
+}
+
+/* max(addr1, addr2) || min(addr1, addr2), as used by both PWE methods */
+static void sae_addr_pair(const uint8_t *addr1, const uint8_t *addr2,
+				uint8_t *out)
+{
+	if (memcmp(addr1, addr2, 6) > 0) {
+		memcpy(out, addr1, 6);
+		memcpy(out + 6, addr2, 6);
+	} else {
+		memcpy(out, addr2, 6);
+		memcpy(out + 6, addr1, 6);
+	}
+}
+
+static struct sae_point_cache_entry *sae_point_cache_find(
+						struct l_queue *cache,
+						unsigned int group,
+						const uint8_t *id, size_t id_len,
+						const uint8_t *digest)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(cache); entry; entry = entry->next) {
+		struct sae_point_cache_entry *e = entry->data;
+
+		if (e->group == group && e->id_len == id_len &&
+				!memcmp(e->id, id, id_len) &&
+				!memcmp(e->digest, digest, 32))
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct l_ecc_point *sae_point_cache_lookup(struct l_queue *cache,
+						const struct l_ecc_curve *curve,
+						unsigned int group,
+						const uint8_t *id, size_t id_len,
+						const char *password)
+{
+	struct sae_point_cache_entry *e;
+	uint8_t digest[32];
+
+	if (!sae_password_digest(password, digest))
+		return NULL;
+
+	e = sae_point_cache_find(cache, group, id, id_len, digest);
+	explicit_bzero(digest, sizeof(digest));
+
+	if (!e)
+		return NULL;
+
+	/* Keep the most recently used entries at the head */
+	l_queue_remove(cache, e);
+	l_queue_push_head(cache, e);
+
+	return l_ecc_point_from_data(curve, L_ECC_POINT_TYPE_FULL,
+					e->point, e->point_len);
+}
+
+static void sae_point_cache_add(struct l_queue **cache, unsigned int group,
+				const uint8_t *id, size_t id_len,
+				const char *password,
+				const struct l_ecc_point *point)
+{
+	struct sae_point_cache_entry *e;
+	uint8_t digest[32];
+
+	if (id_len > sizeof(e->id) || !sae_password_digest(password, digest))
+		return;
+
+	if (sae_point_cache_find(*cache, group, id, id_len, digest))
+		goto done;
+
+	if (!*cache)
+		*cache = l_queue_new();
+
+	if (l_queue_length(*cache) >= SAE_POINT_CACHE_SIZE) {
+		e = l_queue_peek_tail(*cache);
+		l_queue_remove(*cache, e);
+		sae_point_cache_entry_free(e);
+	}
+
+	e = l_new(struct sae_point_cache_entry, 1);
+	e->group = group;
+	memcpy(e->id, id, id_len);
+	e->id_len = id_len;
+	memcpy(e->digest, digest, sizeof(digest));
+	e->point_len = l_ecc_point_get_data(point, e->point, sizeof(e->point));
+
+	l_queue_push_head(*cache, e);
+
+done:
+	explicit_bzero(digest, sizeof(digest));
+}
+
+static struct l_ecc_point *sae_pwe_cache_lookup(struct sae_sm *sm,
+						const char *password,
+						const uint8_t *addr1,
+						const uint8_t *addr2)
+{
+	uint8_t addrs[12];
+
+	sae_addr_pair(addr1, addr2, addrs);
+
+	return sae_point_cache_lookup(pwe_cache, sm->curve, sm->group,
+					addrs, sizeof(addrs), password);
+}
+
+static void sae_pwe_cache_add(struct sae_sm *sm, const char *password,
+				const uint8_t *addr1, const uint8_t *addr2,
+				const struct l_ecc_point *pwe)
+{
+	uint8_t addrs[12];
+
+	sae_addr_pair(addr1, addr2, addrs);
+	sae_point_cache_add(&pwe_cache, sm->group, addrs, sizeof(addrs),
+				password, pwe);
+}
+
+void sae_pwe_cache_flush(void)
+{
+	l_queue_destroy(pwe_cache, sae_point_cache_entry_free);
+	pwe_cache = NULL;
+	l_queue_destroy(pt_cache, sae_point_cache_entry_free);
+	pt_cache = NULL;
+}
+
+static struct sae_pwe_ctx *sae_pwe_ctx_new(const struct l_ecc_curve *curve,
+						const char *password,
+						const uint8_t *addr1,
+						const uint8_t *addr2)
+{
+	struct sae_pwe_ctx *ctx = l_new(struct sae_pwe_ctx, 1);
+
+	ctx->curve = curve;
+	memcpy(ctx->addr1, addr1, 6);
+	memcpy(ctx->addr2, addr2, 6);
+	ctx->counter = 1;
 
 	/* create qr/qnr prior to beginning hunting-and-pecking loop */
-	qr = sae_new_residue(sm->curve, true);
-	qnr = sae_new_residue(sm->curve, false);
-	l_ecc_scalar_get_data(qnr, qnr_bin, sizeof(qnr_bin));
+	ctx->qr = sae_new_residue(curve, true);
+	ctx->qnr = sae_new_residue(curve, false);
+	l_ecc_scalar_get_data(ctx->qnr, ctx->qnr_bin, sizeof(ctx->qnr_bin));
 
 	/*
 	 * Allocate memory for the base, and set a random dummy to be used in
 	 * additional iterations, once a valid value is found
 	 */
-	base_len = strlen(password);
-	base = l_malloc(base_len * sizeof(*base));
-	dummy = l_malloc(base_len * sizeof(*dummy));
-	l_getrandom(dummy, base_len);
+	ctx->base_len = strlen(password);
+	ctx->password = l_memdup(password, ctx->base_len);
+	ctx->base = l_malloc(ctx->base_len * sizeof(*ctx->base));
+	ctx->dummy = l_malloc(ctx->base_len * sizeof(*ctx->dummy));
+	l_getrandom(ctx->dummy, ctx->base_len);
+
+	return ctx;
+}
+
+static void sae_pwe_ctx_free(struct sae_pwe_ctx *ctx)
+{
+	l_ecc_scalar_free(ctx->qr);
+	l_ecc_scalar_free(ctx->qnr);
+
+	explicit_bzero(ctx->password, ctx->base_len);
+	explicit_bzero(ctx->base, ctx->base_len);
+	l_free(ctx->password);
+	l_free(ctx->dummy);
+	l_free(ctx->base);
+
+	explicit_bzero(ctx, sizeof(*ctx));
+	l_free(ctx);
+}
+
+/*
+ * Runs up to @iterations of the hunting-and-pecking loop, returns true once
+ * all of the iterations have been completed.
+ */
+static bool sae_pwe_ctx_step(struct sae_pwe_ctx *ctx, unsigned int iterations)
+{
+	uint8_t is_residue;
+	uint8_t pwd_seed[32];
+	uint8_t x_cand[L_ECC_SCALAR_MAX_BYTES];
+	struct l_ecc_scalar *pwd_value;
 
 	/*
 	 * Loop with constant time and memory access
 	 * We do 30 iterations instead of the 40 recommended to achieve a
 	 * resonnable security/complexity trade-off.
 	 */
-	for (counter = 1; counter <= 30; counter++) {
+	for (; iterations && ctx->counter <= SAE_PWE_ITERATIONS;
+					iterations--, ctx->counter++) {
 		/*
 		 * Set base to either dummy or password, depending on found's
 		 * value.
 		 * A non-secure version would be:
 		 * 	base = (found ? dummy : password);
 		 */
-		util_secure_select(found, dummy, (uint8_t *)password,
-					base, base_len);
+		util_secure_select(ctx->found, ctx->dummy, ctx->password,
+					ctx->base, ctx->base_len);
 
 		/*
 		 * pwd-seed = H(max(addr1, addr2) || min(addr1, addr2),
 		 *				base || counter)
 		 * pwd-value = KDF-256(pwd-seed, "SAE Hunting and Pecking", p)
 		 */
-		sae_pwd_seed(addr1, addr2, base, base_len, counter, pwd_seed);
+		sae_pwd_seed(ctx->addr1, ctx->addr2, ctx->base, ctx->base_len,
+				ctx->counter, pwd_seed);
 		/*
 		 * The case pwd_value > prime is handled inside, so that
 		 * execution can continue whatever the result is, without
 		 * changing the outcome.
 		 */
-		pwd_value = sae_pwd_value(sm->curve, pwd_seed, qnr_bin);
+		pwd_value = sae_pwd_value(ctx->curve, pwd_seed, ctx->qnr_bin);
 
 		/*
 		 * Check if the candidate is a valid x-coordinate on our curve,
 		 * and convert it from scalar to binary.
 		 */
-		is_residue = sae_is_quadradic_residue(sm->curve, pwd_value,
-								qr, qnr);
+		is_residue = sae_is_quadradic_residue(ctx->curve, pwd_value,
+							ctx->qr, ctx->qnr);
 		l_ecc_scalar_get_data(pwd_value, x_cand, sizeof(x_cand));
 
 		/*
 		 * If we already found the point, we overwrite x with itself.
 		 * Otherwise, we copy the new candidate into x.
 		 */
-		util_secure_select(found, x, x_cand, x, sizeof(x));
-		is_odd = util_secure_select_byte(found, is_odd,
+		util_secure_select(ctx->found, ctx->x, x_cand, ctx->x,
+					sizeof(ctx->x));
+		ctx->is_odd = util_secure_select_byte(ctx->found, ctx->is_odd,
 							pwd_seed[31] & 0x01);
 
 		/*
@@ -349,28 +604,171 @@ static bool sae_compute_pwe(struct sae_sm *sm, char *password,
 		 * of them (with is_residue converted to 0/0xff) handles this
 		 * in constant time.
 		 */
-		found |= is_residue * 0xff;
+		ctx->found |= is_residue * 0xff;
 
 		memset(pwd_seed, 0, sizeof(pwd_seed));
 		l_ecc_scalar_free(pwd_value);
 	}
 
-	l_ecc_scalar_free(qr);
-	l_ecc_scalar_free(qnr);
-	l_free(dummy);
-	l_free(base);
+	return ctx->counter > SAE_PWE_ITERATIONS;
+}
+
+static struct l_ecc_point *sae_pwe_ctx_finish(struct sae_pwe_ctx *ctx)
+{
+	struct l_ecc_point *pwe;
 
-	if (!found) {
+	if (!ctx->found) {
 		l_error("max PWE iterations reached!");
-		return false;
+		return NULL;
 	}
 
-	sm->pwe = l_ecc_point_from_data(sm->curve, !is_odd + 2, x, sizeof(x));
-	if (!sm->pwe) {
+	pwe = l_ecc_point_from_data(ctx->curve, !ctx->is_odd + 2, ctx->x,
+					sizeof(ctx->x));
+	if (!pwe)
 		l_error("computing y failed, was x quadratic residue?");
+
+	return pwe;
+}
+
+/*
+ * IEEE 802.11-2020 Section 12.4.4.2.3
+ * Hash-to-element generation of the password element with ECC groups
+ *
+ * The secret element PT only depends on the SSID, the password and the group
+ * so it is kept in pt_cache and reused across BSSes and connections.
+ */
+static struct l_ecc_point *sae_derive_pt(struct sae_sm *sm,
+						const char *password)
+{
+	static const char *info[2] = {
+		"SAE Hash to Element u1 P1",
+		"SAE Hash to Element u2 P2",
+	};
+	const uint8_t *ssid = sm->handshake->ssid;
+	size_t ssid_len = sm->handshake->ssid_len;
+	enum l_checksum_type sha = sae_hash(sm);
+	size_t hash_len = sae_hash_len(sm);
+	size_t nbytes = l_ecc_curve_get_scalar_bytes(sm->curve);
+	uint8_t pwd_seed[64];
+	uint8_t pwd_value[L_ECC_SCALAR_MAX_BYTES * 3 / 2];
+	struct l_ecc_point *p[2] = { NULL, NULL };
+	struct l_ecc_point *pt = NULL;
+	unsigned int i;
+
+	pt = sae_point_cache_lookup(pt_cache, sm->curve, sm->group,
+					ssid, ssid_len, password);
+	if (pt)
+		return pt;
+
+	/* pwd-seed = HKDF-Extract(ssid, password) */
+	if (!hkdf_extract(sha, ssid, ssid_len, 1, pwd_seed,
+				password, strlen(password)))
+		return NULL;
+
+	for (i = 0; i < 2; i++) {
+		struct l_ecc_scalar *u;
+
+		/*
+		 * pwd-value = HKDF-Expand(pwd-seed, info, len)
+		 * u = pwd-value modulo p
+		 * len = olen(p) + floor(olen(p) / 2) to keep the bias small
+		 */
+		if (!hkdf_expand(sha, pwd_seed, hash_len, info[i],
+					strlen(info[i]), pwd_value,
+					nbytes + nbytes / 2))
+			goto done;
+
+		u = l_ecc_scalar_new_modp(sm->curve, pwd_value,
+						nbytes + nbytes / 2);
+		p[i] = l_ecc_point_from_sswu(u);
+		l_ecc_scalar_free(u);
+
+		if (!p[i])
+			goto done;
+	}
+
+	/* PT = elem-op(P1, P2) */
+	pt = l_ecc_point_new(sm->curve);
+	l_ecc_point_add(pt, p[0], p[1]);
+
+	sae_point_cache_add(&pt_cache, sm->group, ssid, ssid_len, password, pt);
+
+done:
+	l_ecc_point_free(p[0]);
+	l_ecc_point_free(p[1]);
+	explicit_bzero(pwd_seed, sizeof(pwd_seed));
+	explicit_bzero(pwd_value, sizeof(pwd_value));
+
+	return pt;
+}
+
+/*
+ * val = H(0^n, MAX(addr1, addr2) || MIN(addr1, addr2))
+ * val = val modulo (q - 1) + 1
+ * PWE = scalar-op(val, PT)
+ */
+static bool sae_compute_pwe_h2e(struct sae_sm *sm, const char *password,
+				const uint8_t *addr1, const uint8_t *addr2)
+{
+	uint8_t zero_key[64] = { 0 };
+	uint8_t addrs[12];
+	uint8_t hash[64];
+	struct l_ecc_scalar *val;
+	struct l_ecc_point *pt;
+
+	pt = sae_derive_pt(sm, password);
+	if (!pt)
+		return false;
+
+	sae_addr_pair(addr1, addr2, addrs);
+
+	if (!hkdf_extract(sae_hash(sm), zero_key, sae_hash_len(sm), 1, hash,
+				addrs, sizeof(addrs))) {
+		l_ecc_point_free(pt);
 		return false;
 	}
 
+	val = l_ecc_scalar_new_reduced_1_to_n(sm->curve, hash,
+					l_ecc_curve_get_scalar_bytes(sm->curve));
+	explicit_bzero(hash, sizeof(hash));
+
+	if (val) {
+		sm->pwe = l_ecc_point_new(sm->curve);
+		l_ecc_point_multiply(sm->pwe, val, pt);
+		l_ecc_scalar_free(val);
+	}
+
+	l_ecc_point_free(pt);
+
+	return sm->pwe != NULL;
+}
+
+/*
+ * IEEE 802.11-2016 Section 12.4.4.2.2
+ * Generation of the password element with ECC groups
+ */
+static bool sae_compute_pwe(struct sae_sm *sm, char *password,
+				const uint8_t *addr1, const uint8_t *addr2)
+{
+	struct sae_pwe_ctx *ctx;
+
+	if (sm->h2e)
+		return sae_compute_pwe_h2e(sm, password, addr1, addr2);
+
+	sm->pwe = sae_pwe_cache_lookup(sm, password, addr1, addr2);
+	if (sm->pwe)
+		return true;
+
+	ctx = sae_pwe_ctx_new(sm->curve, password, addr1, addr2);
+	sae_pwe_ctx_step(ctx, SAE_PWE_ITERATIONS);
+	sm->pwe = sae_pwe_ctx_finish(ctx);
+	sae_pwe_ctx_free(ctx);
+
+	if (!sm->pwe)
+		return false;
+
+	sae_pwe_cache_add(sm, password, addr1, addr2, sm->pwe);
+
 	return true;
 }
 
@@ -390,7 +788,9 @@ static bool sae_build_commit(struct sae_sm *sm, const uint8_t *addr1,
 		return false;
 	}
 
-	if (!sae_compute_pwe(sm, sm->handshake->passphrase, addr1, addr2)) {
+	/* The PWE may have been obtained asynchronously already */
+	if (!sm->pwe && !sae_compute_pwe(sm, sm->handshake->passphrase,
+						addr1, addr2)) {
 		l_error("could not compute PWE");
 		return false;
 	}
@@ -423,14 +823,14 @@ old_commit:
 	/* transaction */
 	l_put_le16(1, ptr);
 	ptr += 2;
-	/* status success */
-	l_put_le16(0, ptr);
+	/* status success, or SAE_HASH_TO_ELEMENT */
+	l_put_le16(sae_commit_status(sm), ptr);
 	ptr += 2;
 	/* group */
 	l_put_le16(sm->group, ptr);
 	ptr += 2;
 
-	if (sm->token) {
+	if (sm->token && !sm->h2e) {
 		memcpy(ptr, sm->token, sm->token_len);
 		ptr += sm->token_len;
 	}
@@ -438,6 +838,29 @@ old_commit:
 	ptr += l_ecc_scalar_get_data(sm->scalar, ptr, L_ECC_SCALAR_MAX_BYTES);
 	ptr += l_ecc_point_get_data(sm->element, ptr, L_ECC_POINT_MAX_BYTES);
 
+	/* With H2E the groups the peer rejected so far must be listed */
+	if (sm->h2e && sm->group_retry) {
+		unsigned int i;
+
+		*ptr++ = IE_TYPE_EXTENSION;
+		*ptr++ = 1 + sm->group_retry * 2;
+		*ptr++ = IE_TYPE_REJECTED_GROUPS - 256;
+
+		for (i = 0; i < sm->group_retry; i++) {
+			l_put_le16(sm->ecc_groups[i], ptr);
+			ptr += 2;
+		}
+	}
+
+	/* ...and the token is carried in an Anti-Clogging Token Container */
+	if (sm->token && sm->h2e) {
+		*ptr++ = IE_TYPE_EXTENSION;
+		*ptr++ = 1 + sm->token_len;
+		*ptr++ = IE_TYPE_ANTI_CLOGGING_TOKEN_CONTAINER - 256;
+		memcpy(ptr, sm->token, sm->token_len);
+		ptr += sm->token_len;
+	}
+
 	*len = ptr - commit;
 
 	return true;
@@ -445,15 +868,16 @@ old_commit:
 
 static void sae_send_confirm(struct sae_sm *sm)
 {
-	uint8_t confirm[32];
-	uint8_t body[38];
+	uint8_t confirm[64];
+	uint8_t body[70];
 	uint8_t *ptr = body;
+	size_t hash_len = sae_hash_len(sm);
 
 	/*
 	 * confirm = CN(KCK, send-confirm, commit-scalar, COMMIT-ELEMENT,
 	 *			peer-commit-scalar, PEER-COMMIT-ELEMENT)
 	 */
-	sae_cn(sm->kck, sm->sc, sm->scalar, sm->element, sm->p_scalar,
+	sae_cn(sm, sm->sc, sm->scalar, sm->element, sm->p_scalar,
 			sm->p_element, confirm);
 
 	l_put_le16(2, ptr);
@@ -462,12 +886,13 @@ static void sae_send_confirm(struct sae_sm *sm)
 	ptr += 2;
 	l_put_le16(sm->sc, ptr);
 	ptr += 2;
-	memcpy(ptr, confirm, 32);
-	ptr += 32;
+	memcpy(ptr, confirm, hash_len);
+	ptr += hash_len;
 
 	sm->state = SAE_STATE_CONFIRMED;
 
-	sm->tx_auth(body, 38, sm->user_data);
+	TRACE(sae_confirm_tx, sm->handshake->ifindex, sm->sc);
+	sm->tx_auth(body, ptr - body, sm->user_data);
 }
 
 static int sae_process_commit(struct sae_sm *sm, const uint8_t *from,
@@ -476,9 +901,11 @@ static int sae_process_commit(struct sae_sm *sm, const uint8_t *from,
 	uint8_t *ptr = (uint8_t *) frame;
 	uint8_t k[L_ECC_SCALAR_MAX_BYTES];
 	struct l_ecc_point *k_point;
-	uint8_t zero_key[32] = { 0 };
-	uint8_t keyseed[32];
-	uint8_t kck_and_pmk[2][32];
+	uint8_t salt[64] = { 0 };
+	size_t salt_len;
+	uint8_t keyseed[64];
+	uint8_t kck_and_pmk[64 + 32];
+	size_t hash_len = sae_hash_len(sm);
 	uint8_t tmp[L_ECC_SCALAR_MAX_BYTES];
 	struct l_ecc_scalar *tmp_scalar;
 	uint16_t group;
@@ -487,6 +914,8 @@ static int sae_process_commit(struct sae_sm *sm, const uint8_t *from,
 	struct l_ecc_scalar *order;
 	unsigned int nbytes = l_ecc_curve_get_scalar_bytes(sm->curve);
 
+	TRACE(sae_commit_rx, sm->handshake->ifindex, len);
+
 	if (sm->state != SAE_STATE_COMMITTED) {
 		l_error("bad state %u", sm->state);
 		goto reject;
@@ -562,11 +991,25 @@ static int sae_process_commit(struct sae_sm *sm, const uint8_t *from,
 	if (klen < 0)
 		goto reject;
 
-	/* keyseed = H(<0>32, k) */
-	hmac_sha256(zero_key, 32, k, klen, keyseed, 32);
+	/*
+	 * keyseed = H(salt, k), the salt is <0>hash_len unless H2E is used
+	 * and the peer rejected groups, which are then listed in the salt
+	 */
+	salt_len = hash_len;
+
+	if (sm->h2e && sm->group_retry) {
+		unsigned int i;
+
+		for (i = 0; i < sm->group_retry; i++)
+			l_put_le16(sm->ecc_groups[i], salt + i * 2);
+
+		salt_len = sm->group_retry * 2;
+	}
+
+	hkdf_extract(sae_hash(sm), salt, salt_len, 1, keyseed, k, (size_t) klen);
 
 	/*
-	 * kck_and_pmk = KDF-Hash-512(keyseed, "SAE KCK and PMK",
+	 * kck_and_pmk = KDF-Hash-Length(keyseed, "SAE KCK and PMK",
 				(commit-scalar + peer-commit-scalar) mod r)
 	 */
 	tmp_scalar = l_ecc_scalar_new(sm->curve, NULL, 0);
@@ -575,11 +1018,19 @@ static int sae_process_commit(struct sae_sm *sm, const uint8_t *from,
 	l_ecc_scalar_add(tmp_scalar, sm->p_scalar, sm->scalar, order);
 	l_ecc_scalar_get_data(tmp_scalar, tmp, sizeof(tmp));
 
-	kdf_sha256(keyseed, 32, "SAE KCK and PMK", strlen("SAE KCK and PMK"),
-			tmp, nbytes, kck_and_pmk, 64);
+	if (hash_len == 48)
+		kdf_sha384(keyseed, hash_len, "SAE KCK and PMK",
+				strlen("SAE KCK and PMK"), tmp, nbytes,
+				kck_and_pmk, hash_len + 32);
+	else
+		kdf_sha256(keyseed, hash_len, "SAE KCK and PMK",
+				strlen("SAE KCK and PMK"), tmp, nbytes,
+				kck_and_pmk, hash_len + 32);
 
-	memcpy(sm->kck, kck_and_pmk[0], 32);
-	memcpy(sm->pmk, kck_and_pmk[1], 32);
+	memcpy(sm->kck, kck_and_pmk, hash_len);
+	memcpy(sm->pmk, kck_and_pmk + hash_len, 32);
+	explicit_bzero(kck_and_pmk, sizeof(kck_and_pmk));
+	explicit_bzero(keyseed, sizeof(keyseed));
 
 	/*
 	 * PMKID = L((commit-scalar + peer-commit-scalar) mod r, 0, 128)
@@ -604,13 +1055,13 @@ reject:
 
 static bool sae_verify_confirm(struct sae_sm *sm, const uint8_t *frame)
 {
-	uint8_t check[32];
+	uint8_t check[64];
 	uint16_t rc = l_get_le16(frame);
 
-	sae_cn(sm->kck, rc, sm->p_scalar, sm->p_element, sm->scalar,
+	sae_cn(sm, rc, sm->p_scalar, sm->p_element, sm->scalar,
 			sm->element, check);
 
-	if (memcmp(frame + 2, check, 32)) {
+	if (memcmp(frame + 2, check, sae_hash_len(sm))) {
 		l_error("confirm did not match");
 		return false;
 	}
@@ -625,12 +1076,14 @@ static int sae_process_confirm(struct sae_sm *sm, const uint8_t *from,
 {
 	const uint8_t *ptr = frame;
 
+	TRACE(sae_confirm_rx, sm->handshake->ifindex, len);
+
 	if (sm->state != SAE_STATE_CONFIRMED) {
 		l_error("bad state %u", sm->state);
 		goto reject;
 	}
 
-	if (len < 34) {
+	if (len < 2 + sae_hash_len(sm)) {
 		l_error("bad length");
 		goto reject;
 	}
@@ -646,6 +1099,8 @@ static int sae_process_confirm(struct sae_sm *sm, const uint8_t *from,
 
 	sm->state = SAE_STATE_ACCEPTED;
 
+	handshake_state_set_accepted_group(sm->handshake, sm->group);
+
 	sm->tx_assoc(sm->user_data);
 
 	return 0;
@@ -658,8 +1113,12 @@ reject:
 static bool sae_send_commit(struct sae_sm *sm, bool retry)
 {
 	struct handshake_state *hs = sm->handshake;
-	/* regular commit + possible 256 byte token + 6 bytes header */
-	uint8_t commit[L_ECC_SCALAR_MAX_BYTES + L_ECC_POINT_MAX_BYTES + 262];
+	/*
+	 * regular commit + possible 256 byte token + 6 bytes header, plus the
+	 * H2E element headers and rejected groups
+	 */
+	uint8_t commit[L_ECC_SCALAR_MAX_BYTES + L_ECC_POINT_MAX_BYTES + 262 +
+			32];
 	size_t len;
 
 	if (!sae_build_commit(sm, hs->spa, hs->aa, commit, &len, retry))
@@ -667,6 +1126,7 @@ static bool sae_send_commit(struct sae_sm *sm, bool retry)
 
 	sm->state = SAE_STATE_COMMITTED;
 
+	TRACE(sae_commit_tx, sm->handshake->ifindex, sm->group, retry);
 	sm->tx_auth(commit, len, sm->user_data);
 
 	return true;
@@ -707,11 +1167,26 @@ static void sae_process_anti_clogging(struct sae_sm *sm, const uint8_t *ptr,
 	 * going to be 2 bytes less than the passed in length. This is why we
 	 * are checking 3 > len > 258.
 	 */
+	/* With H2E the token comes in an Anti-Clogging Token Container */
+	if (sm->h2e) {
+		if (len < 6 || ptr[2] != IE_TYPE_EXTENSION ||
+				ptr[4] != IE_TYPE_ANTI_CLOGGING_TOKEN_CONTAINER -
+									256 ||
+				ptr[3] < 2 || ptr[3] + 4u > len) {
+			l_error("anti-clogging token container invalid");
+			return;
+		}
+
+		len = ptr[3] + 1;
+		ptr += 3;
+	}
+
 	if (len < 3 || len > 258) {
 		l_error("anti-clogging token size invalid %zu", len);
 		return;
 	}
 
+	l_free(sm->token);
 	sm->token = l_memdup(ptr + 2, len - 2);
 	sm->token_len = len - 2;
 	sm->sync = 0;
@@ -735,7 +1210,7 @@ static int sae_verify_nothing(struct sae_sm *sm, uint16_t transaction,
 		return -EBADMSG;
 
 	/* frame shall be silently discarded and Del event sent */
-	if (status != 0)
+	if (status != sae_commit_status(sm))
 		return -EBADMSG;
 
 	if (len < 2)
@@ -856,6 +1331,11 @@ static int sae_verify_committed(struct sae_sm *sm, uint16_t transaction,
 
 		return -EAGAIN;
 	case 0:
+	case MMPDU_STATUS_CODE_SAE_HASH_TO_ELEMENT:
+		/* The peer must use the same PWE derivation method */
+		if (status != sae_commit_status(sm))
+			return -EBADMSG;
+
 		if (len < 2)
 			return -EBADMSG;
 
@@ -950,7 +1430,7 @@ static int sae_verify_confirmed(struct sae_sm *sm, uint16_t trans,
 	/*
 	 * If the Status is nonzero, the frame shall be silently discarded...
 	 */
-	if (status != 0)
+	if (status != sae_commit_status(sm))
 		return 0;
 
 	/*
@@ -1116,22 +1596,73 @@ static int sae_rx_associate(struct auth_proto *ap, const uint8_t *frame,
 	return 0;
 }
 
+static void sae_pwe_async_stop(struct sae_sm *sm)
+{
+	if (sm->pwe_idle) {
+		l_idle_remove(sm->pwe_idle);
+		sm->pwe_idle = NULL;
+	}
+
+	if (sm->pwe_ctx) {
+		sae_pwe_ctx_free(sm->pwe_ctx);
+		sm->pwe_ctx = NULL;
+	}
+}
+
+static void sae_pwe_async_step(struct l_idle *idle, void *user_data)
+{
+	struct sae_sm *sm = user_data;
+	struct handshake_state *hs = sm->handshake;
+
+	if (!sae_pwe_ctx_step(sm->pwe_ctx, SAE_PWE_ASYNC_ITERATIONS))
+		return;
+
+	sm->pwe = sae_pwe_ctx_finish(sm->pwe_ctx);
+	sae_pwe_async_stop(sm);
+
+	if (sm->pwe)
+		sae_pwe_cache_add(sm, hs->passphrase, hs->spa, hs->aa, sm->pwe);
+
+	if (!sm->pwe || !sae_send_commit(sm, false)) {
+		if (sm->failed)
+			sm->failed(sm->user_data);
+	}
+}
+
 static bool sae_start(struct auth_proto *ap)
 {
 	struct sae_sm *sm = l_container_of(ap, struct sae_sm, ap);
+	struct handshake_state *hs = sm->handshake;
 
 	if (sm->handshake->authenticator)
 		memcpy(sm->peer, sm->handshake->spa, 6);
 	else
 		memcpy(sm->peer, sm->handshake->aa, 6);
 
-	return sae_send_commit(sm, false);
+	/* A cached PT makes the H2E PWE a single scalar multiplication */
+	if (!sm->async_pwe || !hs->passphrase || sm->h2e)
+		return sae_send_commit(sm, false);
+
+	sm->pwe = sae_pwe_cache_lookup(sm, hs->passphrase, hs->spa, hs->aa);
+	if (sm->pwe)
+		return sae_send_commit(sm, false);
+
+	sm->pwe_ctx = sae_pwe_ctx_new(sm->curve, hs->passphrase,
+					hs->spa, hs->aa);
+	sm->pwe_idle = l_idle_create(sae_pwe_async_step, sm, NULL);
+	if (!sm->pwe_idle) {
+		sae_pwe_async_stop(sm);
+		return sae_send_commit(sm, false);
+	}
+
+	return true;
 }
 
 static void sae_free(struct auth_proto *ap)
 {
 	struct sae_sm *sm = l_container_of(ap, struct sae_sm, ap);
 
+	sae_pwe_async_stop(sm);
 	sae_reset_state(sm);
 
 	/* zero out whole structure, including keys */
@@ -1157,9 +1688,10 @@ struct auth_proto *sae_sm_new(struct handshake_state *hs,
 	sm->user_data = user_data;
 	sm->handshake = hs;
 	sm->state = SAE_STATE_NOTHING;
-	sm->ecc_groups = l_ecc_curve_get_supported_ike_groups();
+	handshake_state_get_ecc_groups(hs, sm->ecc_groups);
 	sm->group = sm->ecc_groups[sm->group_retry];
 	sm->curve = l_ecc_curve_get_ike_group(sm->group);
+	sm->h2e = ie_rsnxe_capable(hs->supplicant_rsnxe, IE_RSNX_SAE_H2E);
 
 	sm->ap.start = sae_start;
 	sm->ap.free = sae_free;
@@ -1169,3 +1701,16 @@ struct auth_proto *sae_sm_new(struct handshake_state *hs,
 
 	return &sm->ap;
 }
+
+/*
+ * Makes the PWE derivation for the initial commit run in steps from the main
+ * loop instead of blocking inside auth_proto_start().  The commit is sent once
+ * the PWE is ready, @failed is called if it can't be derived or sent.
+ */
+void sae_sm_set_async_pwe(struct auth_proto *ap, sae_failed_func_t failed)
+{
+	struct sae_sm *sm = l_container_of(ap, struct sae_sm, ap);
+
+	sm->async_pwe = true;
+	sm->failed = failed;
+}
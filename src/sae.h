@@ -26,8 +26,12 @@ struct handshake_state;
 typedef void (*sae_tx_authenticate_func_t)(const uint8_t *data, size_t len,
 						void *user_data);
 typedef void (*sae_tx_associate_func_t)(void *user_data);
+typedef void (*sae_failed_func_t)(void *user_data);
 
 struct auth_proto *sae_sm_new(struct handshake_state *hs,
 				sae_tx_authenticate_func_t tx_auth,
 				sae_tx_associate_func_t tx_assoc,
 				void *user_data);
+
+void sae_sm_set_async_pwe(struct auth_proto *ap, sae_failed_func_t failed);
+void sae_pwe_cache_flush(void);
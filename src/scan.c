@@ -25,6 +25,7 @@
 #endif
 
 #define _GNU_SOURCE
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -50,15 +51,29 @@
 #include "src/p2putil.h"
 #include "src/mpdu.h"
 #include "src/scan.h"
+#include "src/trace.h"
+#include "src/metrics.h"
 
 /* User configurable options */
 static double RANK_5G_FACTOR;
+static bool RANK_THROUGHPUT;
 static uint32_t SCAN_MAX_INTERVAL;
 static uint32_t SCAN_INIT_INTERVAL;
+static uint32_t SCAN_FULL_SWEEP_INTERVAL;
+static uint32_t SCAN_SLICE_CHANNELS;
+static uint32_t SCAN_SLICE_GAP;
+
+/* Channels covered by the periodic scans between two full sweeps */
+#define SCAN_PRIORITY_MAX_FREQS		8
+/* Active scans between two scans probing for all hidden known networks */
+#define SCAN_HIDDEN_SWEEP_INTERVAL	8
+/* Limit on the learned hidden BSSes, forgotten all at once when reached */
+#define SCAN_HIDDEN_MAX_BSSES		256
 
 static struct l_queue *scan_contexts;
 
 static struct l_genl_family *nl80211;
+static unsigned int overrun_watch_id;
 
 struct scan_context;
 
@@ -71,6 +86,15 @@ struct scan_periodic {
 	bool retry:1;
 	uint32_t id;
 	bool needs_active_scan:1;
+	uint32_t count;
+};
+
+struct scan_sched {
+	scan_trigger_func_t trigger;	/* For falling back to periodic scan */
+	scan_notify_func_t callback;
+	void *userdata;
+	uint32_t start_cmd_id;
+	bool running:1;
 };
 
 struct scan_request {
@@ -81,8 +105,17 @@ struct scan_request {
 	scan_destroy_func_t destroy;
 	bool passive:1; /* Active or Passive scan? */
 	struct l_queue *cmds;
+	/* Command of the segment being scanned, requeued if preempted */
+	struct l_genl_msg *running_cmd;
 	/* The time the current scan was started. Reported in TRIGGER_SCAN */
 	uint64_t start_time_tsf;
+	/* Pause between the channel groups of a sliced scan */
+	struct l_timeout *slice_timeout;
+	/* When the kernel first accepted a trigger for this request */
+	uint64_t start_time;
+	bool sliced : 1;
+	/* Set if the results of other networks are to be dropped */
+	char *ssid_filter;
 	struct wiphy_radio_work_item work;
 };
 
@@ -95,6 +128,9 @@ struct scan_context {
 	 */
 	enum scan_state state;
 	struct scan_periodic sp;
+	struct scan_sched sched;
+	scan_net_detect_func_t nd_callback;
+	void *nd_userdata;
 	struct l_queue *requests;
 	/* Non-zero if SCAN_TRIGGER is still running */
 	unsigned int start_cmd_id;
@@ -105,6 +141,8 @@ struct scan_context {
 	 * roamed automatically.
 	 */
 	unsigned int get_fw_scan_cmd_id;
+	/* Non-zero if ABORT_SCAN was sent to resync after a netlink overrun */
+	unsigned int resync_cmd_id;
 	/*
 	 * Whether the top request in the queue has triggered the current
 	 * scan.  May be set and cleared multiple times during a single
@@ -118,16 +156,80 @@ struct scan_context {
 	bool started:1;
 	bool work_started:1;
 	struct wiphy *wiphy;
+	/*
+	 * BSSes parsed during previous GET_SCAN dumps, keyed by BSSID.  Used
+	 * to skip re-parsing the IEs of BSSes that haven't changed since.
+	 */
+	struct l_hashtab *bss_cache;
+	uint32_t bss_cache_generation;
+	/*
+	 * 6GHz channels advertised in the Reduced Neighbor Reports of the
+	 * BSSes found by the last GET_SCAN dump
+	 */
+	struct scan_freq_set rnr_freqs;
+	/*
+	 * SSIDs of the hidden known networks that answered our probes, keyed
+	 * by BSSID, and the SSIDs to probe for in the next active scans
+	 * based on the hidden BSSes found in the last results.  NULL if every
+	 * hidden known network must be probed for.
+	 */
+	struct l_hashtab *hidden_ssids;
+	char **hidden_probe_ssids;
+	uint32_t hidden_scan_count;
+};
+
+struct scan_cache_entry {
+	struct scan_bss *bss;
+	uint32_t ies_hash;
+	uint32_t generation;
+};
+
+/*
+ * A GET_SCAN dump can carry hundreds of BSSes, each with a handful of small
+ * IE copies.  Rather than allocating each of those separately, the BSSes of
+ * a dump and their IE copies are carved out of large chunks.  Every BSS
+ * holds a reference on the chunk it lives in so that the chunk is released
+ * in one go once all of its BSSes are gone, while the few BSSes kept around
+ * longer by station or network only keep their own chunk alive.
+ */
+#define SCAN_ARENA_CHUNK_SIZE 8192
+
+struct scan_arena_chunk {
+	unsigned int refcount;
+	size_t size;
+	size_t used;
+	uint64_t data[];
+};
+
+struct scan_arena {
+	struct scan_arena_chunk *chunk;
 };
 
 struct scan_results {
 	struct scan_context *sc;
+	struct scan_arena arena;
+	struct scan_freq_set rnr_freqs;
 	struct l_queue *bss_list;
 	struct scan_freq_set *freqs;
 	uint64_t time_stamp;
 	struct scan_request *sr;
+	bool sched : 1;
 };
 
+IWD_MODULE_COUNTER(scan, scan_bss)
+
+_Static_assert(offsetof(struct scan_bss, ies) <= 64,
+		"struct scan_bss ranking fields no longer fit a cache line");
+
+METRICS_COUNTER(scans_triggered, "iwd_scans_triggered_total",
+		"Scans triggered by iwd")
+METRICS_COUNTER(scans_aborted, "iwd_scans_aborted_total",
+		"Scans aborted by iwd, the kernel or the driver")
+METRICS_COUNTER_LABEL(trigger_scan_errors, "iwd_nl80211_errors_total",
+		"command=\"trigger_scan\"", "Failed nl80211 commands")
+METRICS_HISTOGRAM(scan_duration, "iwd_scan_duration_seconds",
+		"Time from the first trigger of a scan request to its results")
+
 static bool start_next_scan_request(struct wiphy_radio_work_item *item);
 static void scan_periodic_rearm(struct scan_context *sc);
 
@@ -147,6 +249,110 @@ static bool scan_request_match(const void *a, const void *b)
 	return sr->work.id == id;
 }
 
+static void scan_arena_chunk_unref(struct scan_arena_chunk *chunk)
+{
+	if (--chunk->refcount)
+		return;
+
+	l_free(chunk);
+}
+
+static void *scan_arena_chunk_carve(struct scan_arena_chunk *chunk,
+					size_t len)
+{
+	void *mem = (uint8_t *) chunk->data + chunk->used;
+
+	chunk->used += align_len(len, sizeof(uint64_t));
+	return mem;
+}
+
+static void scan_arena_release(struct scan_arena *arena)
+{
+	if (!arena->chunk)
+		return;
+
+	scan_arena_chunk_unref(arena->chunk);
+	arena->chunk = NULL;
+}
+
+/*
+ * Apart from the retained IE buffer itself a BSS only holds the WSC and WFD
+ * payloads, which are concatenated from distinct vendor elements and thus
+ * never add up to more than another IE buffer's worth.  Each of the three
+ * copies may need alignment padding on top.
+ */
+#define SCAN_BSS_MAX_IE_COPIES 3
+
+static struct scan_bss *scan_bss_new(struct scan_arena *arena, size_t ies_len)
+{
+	struct scan_arena_chunk *chunk;
+	struct scan_bss *bss;
+	size_t need;
+
+	IWD_COUNTER_INC(scan_bss);
+
+	if (!arena) {
+		bss = l_new(struct scan_bss, 1);
+		bss->refcount = 1;
+		return bss;
+	}
+
+	need = align_len(sizeof(struct scan_bss), sizeof(uint64_t)) +
+		2 * ies_len + SCAN_BSS_MAX_IE_COPIES * sizeof(uint64_t);
+	chunk = arena->chunk;
+
+	if (!chunk || chunk->size - chunk->used < need) {
+		size_t size = need > SCAN_ARENA_CHUNK_SIZE ?
+						need : SCAN_ARENA_CHUNK_SIZE;
+
+		scan_arena_release(arena);
+
+		chunk = l_malloc(sizeof(struct scan_arena_chunk) + size);
+		chunk->refcount = 1;
+		chunk->size = size;
+		chunk->used = 0;
+		arena->chunk = chunk;
+	}
+
+	bss = scan_arena_chunk_carve(chunk, sizeof(struct scan_bss));
+	memset(bss, 0, sizeof(struct scan_bss));
+	bss->chunk = chunk;
+	bss->refcount = 1;
+	chunk->refcount++;
+
+	return bss;
+}
+
+static void *scan_bss_memdup(struct scan_bss *bss, const void *mem, size_t len)
+{
+	if (!bss->chunk)
+		return l_memdup(mem, len);
+
+	return memcpy(scan_arena_chunk_carve(bss->chunk, len), mem, len);
+}
+
+/* Moves a buffer returned by one of the ie_tlv_extract_* helpers */
+static void *scan_bss_adopt(struct scan_bss *bss, void *mem, size_t len)
+{
+	void *copy;
+
+	if (!mem || !bss->chunk)
+		return mem;
+
+	copy = scan_bss_memdup(bss, mem, len);
+	l_free(mem);
+
+	return copy;
+}
+
+static void scan_cache_entry_free(void *data)
+{
+	struct scan_cache_entry *entry = data;
+
+	scan_bss_free(entry->bss);
+	l_free(entry);
+}
+
 static void scan_request_free(struct wiphy_radio_work_item *item)
 {
 	struct scan_request *sr = l_container_of(item, struct scan_request,
@@ -157,6 +363,11 @@ static void scan_request_free(struct wiphy_radio_work_item *item)
 
 	l_queue_destroy(sr->cmds, (l_queue_destroy_func_t) l_genl_msg_unref);
 
+	if (sr->running_cmd)
+		l_genl_msg_unref(sr->running_cmd);
+
+	l_timeout_remove(sr->slice_timeout);
+	l_free(sr->ssid_filter);
 	l_free(sr);
 }
 
@@ -188,6 +399,9 @@ static struct scan_context *scan_context_new(uint64_t wdev_id)
 	sc->state = SCAN_STATE_NOT_RUNNING;
 	sc->requests = l_queue_new();
 
+	sc->bss_cache = l_hashtab_new(ETH_ALEN, L_HASHTAB_HASH_FAST);
+	sc->hidden_ssids = l_hashtab_new(ETH_ALEN, L_HASHTAB_HASH_FAST);
+
 	return sc;
 }
 
@@ -216,6 +430,16 @@ static void scan_context_free(struct scan_context *sc)
 	if (sc->get_fw_scan_cmd_id && nl80211)
 		l_genl_family_cancel(nl80211, sc->get_fw_scan_cmd_id);
 
+	if (sc->resync_cmd_id && nl80211)
+		l_genl_family_cancel(nl80211, sc->resync_cmd_id);
+
+	if (sc->sched.start_cmd_id && nl80211)
+		l_genl_family_cancel(nl80211, sc->sched.start_cmd_id);
+
+	l_hashtab_destroy(sc->bss_cache, scan_cache_entry_free);
+	l_hashtab_destroy(sc->hidden_ssids, l_free);
+	l_strv_free(sc->hidden_probe_ssids);
+
 	l_free(sc);
 }
 
@@ -229,6 +453,8 @@ static void scan_request_triggered(struct l_genl_msg *msg, void *userdata)
 
 	err = l_genl_msg_get_error(msg);
 	if (err < 0) {
+		METRICS_INC(trigger_scan_errors);
+
 		/* Scan in progress, assume another scan is running */
 		if (err == -EBUSY) {
 			sc->state = SCAN_STATE_PASSIVE;
@@ -248,10 +474,19 @@ static void scan_request_triggered(struct l_genl_msg *msg, void *userdata)
 	sc->state = sr->passive ? SCAN_STATE_PASSIVE : SCAN_STATE_ACTIVE;
 	l_debug("%s scan triggered for wdev %" PRIx64,
 		sr->passive ? "Passive" : "Active", sc->wdev_id);
+	TRACE(scan_trigger, sc->wdev_id, sr->passive);
+	METRICS_INC(scans_triggered);
+
+	if (!sr->start_time)
+		sr->start_time = l_time_now();
 
 	sc->triggered = true;
 	sc->started = true;
-	l_genl_msg_unref(l_queue_pop_head(sr->cmds));
+
+	if (sr->running_cmd)
+		l_genl_msg_unref(sr->running_cmd);
+
+	sr->running_cmd = l_queue_pop_head(sr->cmds);
 
 	if (sr->trigger) {
 		sr->trigger(0, sr->userdata);
@@ -388,6 +623,16 @@ static struct l_genl_msg *scan_build_cmd(struct scan_context *sc,
 					NL80211_EXT_FEATURE_SCAN_RANDOM_SN))
 		flags |= NL80211_SCAN_FLAG_RANDOM_SN;
 
+	if (params->high_accuracy && wiphy_has_ext_feature(sc->wiphy,
+				NL80211_EXT_FEATURE_HIGH_ACCURACY_SCAN))
+		flags |= NL80211_SCAN_FLAG_HIGH_ACCURACY;
+	else if (params->low_span && wiphy_has_ext_feature(sc->wiphy,
+				NL80211_EXT_FEATURE_LOW_SPAN_SCAN))
+		flags |= NL80211_SCAN_FLAG_LOW_SPAN;
+	else if (params->low_power && wiphy_has_ext_feature(sc->wiphy,
+				NL80211_EXT_FEATURE_LOW_POWER_SCAN))
+		flags |= NL80211_SCAN_FLAG_LOW_POWER;
+
 	if (flags)
 		l_genl_msg_append_attr(msg, NL80211_ATTR_SCAN_FLAGS, 4, &flags);
 
@@ -483,6 +728,7 @@ struct scan_cmds_add_data {
 	struct l_genl_msg **cmd;
 	uint8_t max_ssids_per_scan;
 	uint8_t num_ssids_can_append;
+	char **hidden_ssids;
 };
 
 static bool scan_cmds_add_hidden(const struct network_info *network,
@@ -493,6 +739,10 @@ static bool scan_cmds_add_hidden(const struct network_info *network,
 	if (!network->is_hidden)
 		return true;
 
+	if (data->hidden_ssids &&
+			!l_strv_contains(data->hidden_ssids, network->ssid))
+		return true;
+
 	l_genl_msg_append_attr(*data->cmd, NL80211_ATTR_SSID,
 				strlen(network->ssid), network->ssid);
 	data->num_ssids_can_append--;
@@ -516,20 +766,50 @@ static bool scan_cmds_add_hidden(const struct network_info *network,
 	return true;
 }
 
-static void scan_cmds_add(struct l_queue *cmds, struct scan_context *sc,
-				bool passive,
-				const struct scan_parameters *params)
+/*
+ * Sweeping all of the 6GHz channels would make every scan several times
+ * longer.  Instead scan only the 6GHz Preferred Scanning Channels, on which
+ * standalone 6GHz APs are expected to be found, plus whichever 6GHz channels
+ * have been advertised in the Reduced Neighbor Reports of the 2.4 and 5GHz
+ * BSSes in range.  802.11ax-2021, Section 26.17.2.3.3
+ */
+static bool scan_get_default_freqs(struct scan_context *sc,
+					struct scan_freq_set *out)
+{
+	const struct scan_freq_set *supported =
+				wiphy_get_supported_freqs(sc->wiphy);
+	struct scan_freq_set six_ghz = sc->rnr_freqs;
+	uint8_t channel;
+
+	if (!(wiphy_get_supported_bands(sc->wiphy) & SCAN_BAND_6_GHZ))
+		return false;
+
+	/* PSCs are the 6GHz channels 5, 21, 37, ... 229 */
+	for (channel = 5; channel <= 229; channel += 16)
+		scan_freq_set_add(&six_ghz, scan_channel_to_freq(channel,
+							SCAN_BAND_6_GHZ));
+
+	scan_freq_set_constrain(&six_ghz, supported);
+
+	*out = *supported;
+	memset(out->channels_6ghz, 0, sizeof(out->channels_6ghz));
+	scan_freq_set_merge(out, &six_ghz);
+
+	return true;
+}
+
+static void scan_cmds_add_segment(struct scan_cmds_add_data *data,
+					bool passive, bool first,
+					const struct scan_parameters *params)
 {
+	struct scan_context *sc = data->sc;
+	struct l_queue *cmds = data->cmds;
 	struct l_genl_msg *cmd;
-	struct scan_cmds_add_data data = {
-		sc,
-		params,
-		cmds,
-		&cmd,
-		wiphy_get_max_num_ssids_per_scan(sc->wiphy),
-	};
 
-	cmd = scan_build_cmd(sc, false, passive, params);
+	data->params = params;
+	data->cmd = &cmd;
+
+	cmd = scan_build_cmd(sc, !first, passive, params);
 
 	if (passive) {
 		/* passive scan */
@@ -549,14 +829,101 @@ static void scan_cmds_add(struct l_queue *cmds, struct scan_context *sc,
 		return;
 	}
 
-	data.num_ssids_can_append = data.max_ssids_per_scan;
-	known_networks_foreach(scan_cmds_add_hidden, &data);
+	data->num_ssids_can_append = data->max_ssids_per_scan;
+	known_networks_foreach(scan_cmds_add_hidden, data);
 
 	l_genl_msg_append_attr(cmd, NL80211_ATTR_SSID, 0, NULL);
 	l_genl_msg_leave_nested(cmd);
 	l_queue_push_tail(cmds, cmd);
 }
 
+struct scan_slice_data {
+	struct scan_cmds_add_data *data;
+	bool passive;
+	struct scan_parameters params;
+	struct scan_freq_set slice;
+	unsigned int count;
+	bool first;
+};
+
+static void scan_slice_flush(struct scan_slice_data *sd)
+{
+	if (!sd->count)
+		return;
+
+	sd->params.freqs = &sd->slice;
+	scan_cmds_add_segment(sd->data, sd->passive, sd->first, &sd->params);
+
+	memset(&sd->slice, 0, sizeof(sd->slice));
+	sd->count = 0;
+	sd->first = false;
+}
+
+static void scan_slice_add_freq(uint32_t freq, void *user_data)
+{
+	struct scan_slice_data *sd = user_data;
+
+	scan_freq_set_add(&sd->slice, freq);
+
+	if (++sd->count == SCAN_SLICE_CHANNELS)
+		scan_slice_flush(sd);
+}
+
+static void scan_cmds_add(struct scan_request *sr, struct scan_context *sc,
+				bool passive,
+				const struct scan_parameters *params)
+{
+	struct scan_parameters default_params;
+	struct scan_freq_set default_freqs;
+	struct scan_cmds_add_data data = {
+		sc,
+		params,
+		sr->cmds,
+		NULL,
+		wiphy_get_max_num_ssids_per_scan(sc->wiphy),
+	};
+	struct scan_slice_data sd;
+
+	if (!params->freqs && scan_get_default_freqs(sc, &default_freqs)) {
+		default_params = *params;
+		default_params.freqs = &default_freqs;
+		params = &default_params;
+	}
+
+	/*
+	 * Only probe for the hidden networks whose BSSes were found by the
+	 * previous scan, except for an occasional full sweep in case they
+	 * have moved or the networks were hidden since.
+	 */
+	if (!passive && !params->ssid &&
+			sc->hidden_scan_count++ % SCAN_HIDDEN_SWEEP_INTERVAL)
+		data.hidden_ssids = sc->hidden_probe_ssids;
+
+	if (!params->sliced || !SCAN_SLICE_CHANNELS) {
+		scan_cmds_add_segment(&data, passive, true, params);
+		return;
+	}
+
+	/*
+	 * Scan a few channels at a time with a pause in between so that
+	 * the traffic of the current connection isn't held up for the
+	 * duration of the whole scan.  The results of all the segments
+	 * are fetched and reported together at the end.
+	 */
+	memset(&sd, 0, sizeof(sd));
+	sd.data = &data;
+	sd.passive = passive;
+	sd.params = *params;
+	sd.first = true;
+
+	scan_freq_set_foreach(params->freqs ?:
+				wiphy_get_supported_freqs(sc->wiphy),
+				scan_slice_add_freq, &sd);
+	scan_slice_flush(&sd);
+
+	sr->sliced = l_queue_length(sr->cmds) > 1;
+}
+
 static int scan_request_send_trigger(struct scan_context *sc,
 					struct scan_request *sr)
 {
@@ -578,9 +945,59 @@ static int scan_request_send_trigger(struct scan_context *sc,
 	return -EIO;
 }
 
+/*
+ * Called when higher priority work, e.g. a connection attempt, shows up
+ * while this scan is running.  The segment being scanned gets aborted and
+ * will be scanned again from the start when the request is resumed.
+ */
+static bool scan_request_abort(struct wiphy_radio_work_item *item)
+{
+	struct scan_request *sr = l_container_of(item, struct scan_request,
+							work);
+	struct scan_context *sc = sr->sc;
+	struct l_genl_msg *msg;
+
+	/* Between two segments of a sliced scan, nothing to abort */
+	if (sr->slice_timeout && sr == l_queue_peek_head(sc->requests)) {
+		l_debug("Preempting scan request %u between segments",
+			sr->work.id);
+		sc->work_started = false;
+		return true;
+	}
+
+	/*
+	 * Only once the kernel has confirmed our trigger and as long as the
+	 * results aren't already being fetched.
+	 */
+	if (sr != l_queue_peek_head(sc->requests) || !sc->triggered ||
+			!sr->running_cmd || sc->get_scan_cmd_id ||
+			sc->state == SCAN_STATE_NOT_RUNNING)
+		return false;
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_ABORT_SCAN, 16);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &sc->wdev_id);
+
+	if (!l_genl_family_send(nl80211, msg, NULL, NULL, NULL)) {
+		l_genl_msg_unref(msg);
+		return false;
+	}
+
+	l_debug("Preempting scan request %u", sr->work.id);
+
+	l_queue_push_head(sr->cmds, sr->running_cmd);
+	sr->running_cmd = NULL;
+
+	/* Makes the SCAN_ABORTED event look like that of an external scan */
+	sc->triggered = false;
+	sc->work_started = false;
+
+	return true;
+}
+
 static const struct wiphy_radio_work_item_ops work_ops = {
 	.do_work = start_next_scan_request,
 	.destroy = scan_request_free,
+	.abort = scan_request_abort,
 };
 
 static uint32_t scan_common(uint64_t wdev_id, bool passive,
@@ -606,7 +1023,10 @@ static uint32_t scan_common(uint64_t wdev_id, bool passive,
 	sr->passive = passive;
 	sr->cmds = l_queue_new();
 
-	scan_cmds_add(sr->cmds, sc, passive, params);
+	if (!passive && params->ssid && params->ssid_only)
+		sr->ssid_filter = l_strdup(params->ssid);
+
+	scan_cmds_add(sr, sc, passive, params);
 
 	l_queue_push_tail(sc->requests, sr);
 
@@ -736,15 +1156,47 @@ static bool scan_periodic_notify(int err, struct l_queue *bss_list,
 	return false;
 }
 
+/*
+ * With a FullPeriodicScanInterval above 1 only the first of every that
+ * many periodic scans sweeps all channels.  The ones in between are limited
+ * to the channels where BSSes of known networks were seen most often, which
+ * keeps the radio off channel for much less time.
+ */
+static struct scan_freq_set *scan_periodic_get_freqs(struct scan_context *sc)
+{
+	struct scan_freq_set *freqs;
+
+	if (SCAN_FULL_SWEEP_INTERVAL <= 1 ||
+			!(sc->sp.count % SCAN_FULL_SWEEP_INTERVAL))
+		return NULL;
+
+	freqs = known_networks_get_weighted_frequencies(
+						SCAN_PRIORITY_MAX_FREQS);
+	if (!freqs)
+		return NULL;
+
+	if (!wiphy_constrain_freq_set(sc->wiphy, freqs)) {
+		scan_freq_set_free(freqs);
+		return NULL;
+	}
+
+	return freqs;
+}
+
 static bool scan_periodic_queue(struct scan_context *sc)
 {
+	struct scan_freq_set *freqs;
+
 	if (!l_queue_isempty(sc->requests)) {
 		sc->sp.retry = true;
 		return false;
 	}
 
+	freqs = scan_periodic_get_freqs(sc);
+
 	if (sc->sp.needs_active_scan && known_networks_has_hidden()) {
 		struct scan_parameters params = {
+			.freqs = freqs,
 			.randomize_mac_addr_hint = true
 		};
 
@@ -754,11 +1206,18 @@ static bool scan_periodic_queue(struct scan_context *sc)
 						scan_periodic_triggered,
 						scan_periodic_notify, sc, NULL);
 	} else
-		sc->sp.id = scan_passive(sc->wdev_id, NULL,
+		sc->sp.id = scan_passive(sc->wdev_id, freqs,
 						scan_periodic_triggered,
 						scan_periodic_notify, sc, NULL);
 
-	return sc->sp.id != 0;
+	if (freqs)
+		scan_freq_set_free(freqs);
+
+	if (!sc->sp.id)
+		return false;
+
+	sc->sp.count++;
+	return true;
 }
 
 static bool scan_periodic_is_disabled(void)
@@ -830,82 +1289,507 @@ bool scan_periodic_stop(uint64_t wdev_id)
 	sc->sp.userdata = NULL;
 	sc->sp.retry = false;
 	sc->sp.needs_active_scan = false;
+	sc->sp.count = 0;
 
 	return true;
 }
 
-uint64_t scan_get_triggered_time(uint64_t wdev_id, uint32_t id)
-{
-	struct scan_context *sc;
-	struct scan_request *sr;
+struct scan_sched_match_data {
+	struct l_genl_msg *msg;
+	unsigned int num_matches;
+	bool has_hotspot;
+	uint8_t num_ssids_can_append;
+};
 
-	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
-	if (!sc)
-		return 0;
+static bool scan_sched_count_matches(const struct network_info *network,
+					void *user_data)
+{
+	struct scan_sched_match_data *data = user_data;
 
-	if (!sc->triggered)
-		return 0;
+	if (!network->is_autoconnectable)
+		return true;
 
-	sr = l_queue_find(sc->requests, scan_request_match, L_UINT_TO_PTR(id));
-	if (!sr)
-		return 0;
+	/* Hotspot networks are matched on other IEs than the SSID */
+	if (network->is_hotspot)
+		data->has_hotspot = true;
+	else
+		data->num_matches++;
 
-	return sr->start_time_tsf;
+	return true;
 }
 
-static void scan_periodic_timeout(struct l_timeout *timeout, void *user_data)
+static bool scan_sched_add_match(const struct network_info *network,
+					void *user_data)
 {
-	struct scan_context *sc = user_data;
+	struct scan_sched_match_data *data = user_data;
 
-	l_debug("scan_periodic_timeout: %" PRIx64, sc->wdev_id);
+	if (!network->is_autoconnectable || network->is_hotspot)
+		return true;
 
-	sc->sp.interval *= 2;
-	if (sc->sp.interval > SCAN_MAX_INTERVAL)
-		sc->sp.interval = SCAN_MAX_INTERVAL;
+	l_genl_msg_enter_nested(data->msg, ++data->num_matches);
+	l_genl_msg_append_attr(data->msg, NL80211_SCHED_SCAN_MATCH_ATTR_SSID,
+				strlen(network->ssid), network->ssid);
+	l_genl_msg_leave_nested(data->msg);
 
-	scan_periodic_queue(sc);
+	return true;
 }
 
-static void scan_periodic_timeout_destroy(void *user_data)
+static bool scan_sched_add_hidden(const struct network_info *network,
+					void *user_data)
 {
-	struct scan_context *sc = user_data;
+	struct scan_sched_match_data *data = user_data;
 
-	sc->sp.timeout = NULL;
-}
+	if (!network->is_hidden || !network->is_autoconnectable)
+		return true;
 
-static void scan_periodic_rearm(struct scan_context *sc)
-{
-	l_debug("Arming periodic scan timer: %u", sc->sp.interval);
+	if (!data->num_ssids_can_append)
+		return false;
 
-	if (sc->sp.timeout)
-		l_timeout_modify(sc->sp.timeout, sc->sp.interval);
-	else
-		sc->sp.timeout = l_timeout_create(sc->sp.interval,
-						scan_periodic_timeout, sc,
-						scan_periodic_timeout_destroy);
+	l_genl_msg_append_attr(data->msg, NL80211_ATTR_SSID,
+				strlen(network->ssid), network->ssid);
+	data->num_ssids_can_append--;
+
+	return true;
 }
 
-static bool start_next_scan_request(struct wiphy_radio_work_item *item)
+/*
+ * Appends the attributes shared by NL80211_CMD_START_SCHED_SCAN and the
+ * WoWLAN net-detect trigger.  Returns whether match sets were included.
+ */
+static bool scan_sched_build_attrs(struct scan_context *sc,
+					struct l_genl_msg *msg,
+					uint32_t max_match_sets)
 {
-	struct scan_request *sr = l_container_of(item,
-						struct scan_request, work);
-	struct scan_context *sc = sr->sc;
-
-	sc->work_started = true;
+	struct scan_sched_match_data data = { .msg = msg };
+	struct scan_freq_set freqs;
+	uint32_t interval = SCAN_INIT_INTERVAL * 1000;
+	uint8_t max_ssids = wiphy_get_max_num_sched_scan_ssids(sc->wiphy);
 
-	if (sc->state != SCAN_STATE_NOT_RUNNING)
-		return false;
+	l_genl_msg_append_attr(msg, NL80211_ATTR_SCHED_SCAN_INTERVAL, 4,
+				&interval);
 
-	if (!scan_request_send_trigger(sc, sr))
-		return false;
+	if (scan_get_default_freqs(sc, &freqs))
+		scan_build_attr_scan_frequencies(msg, &freqs);
 
-	sc->work_started = false;
+	if (max_ssids) {
+		l_genl_msg_enter_nested(msg, NL80211_ATTR_SCAN_SSIDS);
 
-	scan_request_failed(sc, sr, -EIO);
+		/* Leave room for the wildcard SSID */
+		data.num_ssids_can_append = max_ssids - 1;
+		known_networks_foreach(scan_sched_add_hidden, &data);
 
-	if (sc->sp.retry) {
-		sc->sp.retry = false;
-		scan_periodic_queue(sc);
+		l_genl_msg_append_attr(msg, NL80211_ATTR_SSID, 0, NULL);
+		l_genl_msg_leave_nested(msg);
+	}
+
+	known_networks_foreach(scan_sched_count_matches, &data);
+
+	/*
+	 * Match sets are a filter so they can only be used if every network
+	 * we may want to connect to can be expressed as one.  Otherwise
+	 * settle for having the firmware wake us up for any BSS found.
+	 */
+	if (data.has_hotspot || !data.num_matches ||
+			data.num_matches > max_match_sets) {
+		l_debug("Not using match sets, %u networks, hotspot: %s",
+				data.num_matches,
+				data.has_hotspot ? "yes" : "no");
+		return false;
+	}
+
+	data.num_matches = 0;
+
+	l_genl_msg_enter_nested(msg, NL80211_ATTR_SCHED_SCAN_MATCH);
+	known_networks_foreach(scan_sched_add_match, &data);
+	l_genl_msg_leave_nested(msg);
+
+	return true;
+}
+
+static struct l_genl_msg *scan_sched_build_cmd(struct scan_context *sc)
+{
+	struct l_genl_msg *msg;
+
+	msg = l_genl_msg_new(NL80211_CMD_START_SCHED_SCAN);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &sc->wdev_id);
+	scan_sched_build_attrs(sc, msg, wiphy_get_max_match_sets(sc->wiphy));
+
+	return msg;
+}
+
+static void scan_sched_start_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct scan_context *sc = user_data;
+	scan_trigger_func_t trigger = sc->sched.trigger;
+	scan_notify_func_t callback = sc->sched.callback;
+	void *userdata = sc->sched.userdata;
+	int err;
+
+	sc->sched.start_cmd_id = 0;
+
+	err = l_genl_msg_get_error(msg);
+	if (err >= 0) {
+		sc->sched.running = true;
+		return;
+	}
+
+	l_debug("Scheduled scan failed: %s(%d), using periodic scan",
+			strerror(-err), -err);
+
+	memset(&sc->sched, 0, sizeof(sc->sched));
+	scan_periodic_start(sc->wdev_id, trigger, callback, userdata);
+}
+
+bool scan_sched_start(uint64_t wdev_id, scan_trigger_func_t trigger,
+				scan_notify_func_t func, void *userdata)
+{
+	struct scan_context *sc;
+	struct l_genl_msg *msg;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+
+	if (!sc) {
+		l_error("scan_sched_start called without scan_wdev_add");
+		return false;
+	}
+
+	if (scan_periodic_is_disabled() || !wiphy_supports_sched_scan(sc->wiphy))
+		return false;
+
+	/* Already running */
+	if (sc->sched.callback)
+		return true;
+
+	if (sc->sp.interval)
+		return false;
+
+	msg = scan_sched_build_cmd(sc);
+
+	sc->sched.start_cmd_id = l_genl_family_send(nl80211, msg,
+							scan_sched_start_cb,
+							sc, NULL);
+	if (!sc->sched.start_cmd_id) {
+		l_genl_msg_unref(msg);
+		return false;
+	}
+
+	l_debug("Starting scheduled scan for wdev %" PRIx64, wdev_id);
+
+	sc->sched.trigger = trigger;
+	sc->sched.callback = func;
+	sc->sched.userdata = userdata;
+
+	return true;
+}
+
+bool scan_sched_stop(uint64_t wdev_id)
+{
+	struct scan_context *sc;
+	struct l_genl_msg *msg;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+
+	if (!sc || !sc->sched.callback)
+		return false;
+
+	l_debug("Stopping scheduled scan for wdev %" PRIx64, wdev_id);
+
+	if (sc->sched.start_cmd_id) {
+		l_genl_family_cancel(nl80211, sc->sched.start_cmd_id);
+		sc->sched.start_cmd_id = 0;
+	}
+
+	/*
+	 * The START command may have been cancelled after reaching the
+	 * kernel so always send STOP, an -ENOENT reply is harmless.
+	 */
+	msg = l_genl_msg_new_sized(NL80211_CMD_STOP_SCHED_SCAN, 16);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &sc->wdev_id);
+
+	if (!l_genl_family_send(nl80211, msg, NULL, NULL, NULL))
+		l_genl_msg_unref(msg);
+
+	memset(&sc->sched, 0, sizeof(sc->sched));
+
+	return true;
+}
+
+static void scan_net_detect_set_cb(struct l_genl_msg *msg, void *user_data)
+{
+	int err = l_genl_msg_get_error(msg);
+
+	if (err < 0)
+		l_debug("Setting WoWLAN net-detect failed: %s(%d)",
+				strerror(-err), -err);
+}
+
+/*
+ * The WoWLAN configuration is only applied by the kernel on suspend so
+ * it can be set whenever we are disconnected.  Unlike a scheduled scan,
+ * waking the host for every BSS found is worse than not waking it at all,
+ * so net-detect is only used if every candidate fits into a match set.
+ */
+bool scan_net_detect_start(uint64_t wdev_id, scan_net_detect_func_t func,
+				void *userdata)
+{
+	struct scan_context *sc;
+	struct l_genl_msg *msg;
+	uint32_t wiphy_id;
+	uint32_t max_match_sets;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+	if (!sc)
+		return false;
+
+	max_match_sets = wiphy_get_max_net_detect_match_sets(sc->wiphy);
+	if (!max_match_sets)
+		return false;
+
+	wiphy_id = wiphy_get_id(sc->wiphy);
+
+	msg = l_genl_msg_new(NL80211_CMD_SET_WOWLAN);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY, 4, &wiphy_id);
+	l_genl_msg_enter_nested(msg, NL80211_ATTR_WOWLAN_TRIGGERS);
+	l_genl_msg_enter_nested(msg, NL80211_WOWLAN_TRIG_NET_DETECT);
+
+	if (!scan_sched_build_attrs(sc, msg, max_match_sets)) {
+		l_genl_msg_unref(msg);
+		return false;
+	}
+
+	l_genl_msg_leave_nested(msg);
+	l_genl_msg_leave_nested(msg);
+
+	if (!l_genl_family_send(nl80211, msg, scan_net_detect_set_cb,
+					NULL, NULL)) {
+		l_genl_msg_unref(msg);
+		return false;
+	}
+
+	l_debug("Enabled WoWLAN net-detect for wdev %" PRIx64, wdev_id);
+
+	sc->nd_callback = func;
+	sc->nd_userdata = userdata;
+
+	return true;
+}
+
+bool scan_net_detect_stop(uint64_t wdev_id)
+{
+	struct scan_context *sc;
+	struct l_genl_msg *msg;
+	uint32_t wiphy_id;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+	if (!sc || !sc->nd_callback)
+		return false;
+
+	sc->nd_callback = NULL;
+	sc->nd_userdata = NULL;
+
+	/* A SET_WOWLAN without triggers disables WoWLAN */
+	wiphy_id = wiphy_get_id(sc->wiphy);
+
+	msg = l_genl_msg_new_sized(NL80211_CMD_SET_WOWLAN, 8);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WIPHY, 4, &wiphy_id);
+
+	if (!l_genl_family_send(nl80211, msg, scan_net_detect_set_cb,
+					NULL, NULL))
+		l_genl_msg_unref(msg);
+
+	return true;
+}
+
+static void scan_parse_net_detect_results(struct l_genl_attr *attr,
+						char *ssid,
+						struct scan_freq_set *freqs,
+						unsigned int *num_matches)
+{
+	struct l_genl_attr match, nested;
+	uint16_t type, len;
+	const void *data;
+
+	while (l_genl_attr_next(attr, NULL, NULL, NULL)) {
+		if (!l_genl_attr_recurse(attr, &match))
+			continue;
+
+		while (l_genl_attr_next(&match, &type, &len, &data)) {
+			switch (type) {
+			case NL80211_ATTR_SSID:
+				if (len > 32)
+					break;
+
+				memcpy(ssid, data, len);
+				ssid[len] = '\0';
+				break;
+			case NL80211_ATTR_SCAN_FREQUENCIES:
+				if (!l_genl_attr_recurse(&match, &nested))
+					break;
+
+				while (l_genl_attr_next(&nested, NULL, &len,
+								&data))
+					if (len == sizeof(uint32_t))
+						scan_freq_set_add(freqs,
+							l_get_u32(data));
+
+				break;
+			}
+		}
+
+		*num_matches += 1;
+	}
+}
+
+/* Reported by the kernel on resume with the reason we were woken up */
+static void scan_wowlan_wakeup(struct scan_context *sc,
+				struct l_genl_msg *msg)
+{
+	struct l_genl_attr attr, triggers, results;
+	uint16_t type;
+	char ssid[33] = {};
+	struct scan_freq_set freqs = {};
+	unsigned int num_matches = 0;
+
+	if (!l_genl_attr_init(&attr, msg))
+		return;
+
+	while (l_genl_attr_next(&attr, &type, NULL, NULL)) {
+		if (type != NL80211_ATTR_WOWLAN_TRIGGERS)
+			continue;
+
+		if (!l_genl_attr_recurse(&attr, &triggers))
+			return;
+
+		while (l_genl_attr_next(&triggers, &type, NULL, NULL)) {
+			if (type != NL80211_WOWLAN_TRIG_NET_DETECT_RESULTS)
+				continue;
+
+			if (!l_genl_attr_recurse(&triggers, &results))
+				return;
+
+			scan_parse_net_detect_results(&results, ssid, &freqs,
+							&num_matches);
+		}
+	}
+
+	if (!num_matches)
+		return;
+
+	l_debug("Woken up by net-detect, %u matches", num_matches);
+
+	sc->nd_callback(num_matches == 1 && ssid[0] ? ssid : NULL,
+			scan_freq_set_isempty(&freqs) ? NULL : &freqs,
+			sc->nd_userdata);
+}
+
+static void scan_mlme_notify(struct l_genl_msg *msg, void *user_data)
+{
+	uint64_t wdev_id;
+	struct scan_context *sc;
+
+	if (l_genl_msg_get_command(msg) != NL80211_CMD_SET_WOWLAN)
+		return;
+
+	if (nl80211_parse_attrs(msg, NL80211_ATTR_WDEV, &wdev_id,
+					NL80211_ATTR_UNSPEC) < 0)
+		return;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+	if (!sc || !sc->nd_callback)
+		return;
+
+	scan_wowlan_wakeup(sc, msg);
+}
+
+uint64_t scan_get_triggered_time(uint64_t wdev_id, uint32_t id)
+{
+	struct scan_context *sc;
+	struct scan_request *sr;
+
+	sc = l_queue_find(scan_contexts, scan_context_match, &wdev_id);
+	if (!sc)
+		return 0;
+
+	if (!sc->triggered)
+		return 0;
+
+	sr = l_queue_find(sc->requests, scan_request_match, L_UINT_TO_PTR(id));
+	if (!sr)
+		return 0;
+
+	return sr->start_time_tsf;
+}
+
+static void scan_periodic_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct scan_context *sc = user_data;
+
+	l_debug("scan_periodic_timeout: %" PRIx64, sc->wdev_id);
+
+	sc->sp.interval *= 2;
+	if (sc->sp.interval > SCAN_MAX_INTERVAL)
+		sc->sp.interval = SCAN_MAX_INTERVAL;
+
+	scan_periodic_queue(sc);
+}
+
+static void scan_periodic_timeout_destroy(void *user_data)
+{
+	struct scan_context *sc = user_data;
+
+	sc->sp.timeout = NULL;
+}
+
+static void scan_periodic_rearm(struct scan_context *sc)
+{
+	l_debug("Arming periodic scan timer: %u", sc->sp.interval);
+
+	if (sc->sp.timeout) {
+		l_timeout_modify(sc->sp.timeout, sc->sp.interval);
+		return;
+	}
+
+	sc->sp.timeout = l_timeout_create(sc->sp.interval,
+					scan_periodic_timeout, sc,
+					scan_periodic_timeout_destroy);
+	l_timeout_set_slack(sc->sp.timeout, 1000);
+}
+
+static void scan_slice_timeout(struct l_timeout *timeout, void *user_data)
+{
+	struct scan_request *sr = user_data;
+	struct scan_context *sc = sr->sc;
+
+	l_timeout_remove(sr->slice_timeout);
+	sr->slice_timeout = NULL;
+
+	/* If preempted the request continues once it gets the radio back */
+	if (sc->work_started && sr == l_queue_peek_head(sc->requests))
+		start_next_scan_request(&sr->work);
+}
+
+static bool start_next_scan_request(struct wiphy_radio_work_item *item)
+{
+	struct scan_request *sr = l_container_of(item,
+						struct scan_request, work);
+	struct scan_context *sc = sr->sc;
+
+	sc->work_started = true;
+
+	/* Resumed from scan_slice_timeout() */
+	if (sc->state != SCAN_STATE_NOT_RUNNING || sr->slice_timeout)
+		return false;
+
+	if (!scan_request_send_trigger(sc, sr))
+		return false;
+
+	sc->work_started = false;
+
+	scan_request_failed(sc, sr, -EIO);
+
+	if (sc->sp.retry) {
+		sc->sp.retry = false;
+		scan_periodic_queue(sc);
 	}
 
 	return true;
@@ -915,9 +1799,9 @@ static bool scan_parse_vendor_specific(struct scan_bss *bss, const void *data,
 					uint16_t len)
 {
 	if (!bss->wpa && is_ie_wpa_ie(data, len))
-		bss->wpa = l_memdup(data - 2, len + 2);
+		bss->wpa = (uint8_t *) data - 2;
 	else if (!bss->osen && is_ie_wfa_ie(data, len, IE_WFA_OI_OSEN))
-		bss->osen = l_memdup(data - 2, len + 2);
+		bss->osen = (uint8_t *) data - 2;
 	else if (is_ie_wfa_ie(data, len, IE_WFA_OI_HS20_INDICATION)) {
 		if (ie_parse_hs20_indication_from_data(data - 2, len + 2,
 					&bss->hs20_version, NULL, NULL) < 0)
@@ -979,16 +1863,86 @@ static bool scan_parse_advertisement_protocol(struct scan_bss *bss,
 	return true;
 }
 
+static void scan_parse_bss_p2p_information_elements(struct scan_bss *bss,
+						const void *data, uint16_t len)
+{
+	switch (bss->source_frame) {
+	case SCAN_BSS_PROBE_RESP:
+		bss->p2p_probe_resp_info = l_new(struct p2p_probe_resp, 1);
+
+		if (p2p_parse_probe_resp_shallow(data, len,
+						bss->p2p_probe_resp_info) == 0)
+			break;
+
+		l_free(bss->p2p_probe_resp_info);
+		bss->p2p_probe_resp_info = NULL;
+		break;
+	case SCAN_BSS_PROBE_REQ:
+		bss->p2p_probe_req_info = l_new(struct p2p_probe_req, 1);
+
+		if (p2p_parse_probe_req_shallow(data, len,
+						bss->p2p_probe_req_info) == 0)
+			break;
+
+		l_free(bss->p2p_probe_req_info);
+		bss->p2p_probe_req_info = NULL;
+		break;
+	case SCAN_BSS_BEACON:
+	{
+		/*
+		 * Beacon and Probe Response P2P IE subelement formats are
+		 * mutually incompatible and can help us distinguish one frame
+		 * subtype from the other if the driver is not exposing enough
+		 * information.  As a result of trusting the frame contents on
+		 * this, no critical code should depend on the
+		 * bss->source_frame information being right.
+		 */
+		struct p2p_beacon info;
+		int r;
+
+		r = p2p_parse_beacon_shallow(data, len, &info);
+		if (r == 0) {
+			bss->p2p_beacon_info = l_memdup(&info, sizeof(info));
+			break;
+		}
+
+		if (r == -ENOENT)
+			break;
+
+		bss->p2p_probe_resp_info = l_new(struct p2p_probe_resp, 1);
+
+		if (p2p_parse_probe_resp_shallow(data, len,
+						bss->p2p_probe_resp_info) == 0) {
+			bss->source_frame = SCAN_BSS_PROBE_RESP;
+			break;
+		}
+
+		l_free(bss->p2p_probe_resp_info);
+		bss->p2p_probe_resp_info = NULL;
+		break;
+	}
+	}
+}
+
 static bool scan_parse_bss_information_elements(struct scan_bss *bss,
 					const void *data, uint16_t len)
 {
 	struct ie_tlv_iter iter;
+	struct ie_index index;
 	bool have_ssid = false;
 
+	/*
+	 * Keep a single copy of the IEs around and have the individual IE
+	 * members of struct scan_bss point into it
+	 */
+	bss->ies = scan_bss_memdup(bss, data, len);
+	bss->ies_len = len;
+	data = bss->ies;
+
 	ie_tlv_iter_init(&iter, data, len);
 
 	while (ie_tlv_iter_next(&iter)) {
-		uint8_t tag = ie_tlv_iter_get_tag(&iter);
+		unsigned int tag = ie_tlv_iter_get_tag(&iter);
 
 		switch (tag) {
 		case IE_TYPE_SSID:
@@ -997,32 +1951,38 @@ static bool scan_parse_bss_information_elements(struct scan_bss *bss,
 
 			memcpy(bss->ssid, iter.data, iter.len);
 			bss->ssid_len = iter.len;
+			bss->ssid_utf8 = util_ssid_is_utf8(iter.len,
+								iter.data);
 			have_ssid = true;
 			break;
 		case IE_TYPE_SUPPORTED_RATES:
 			if (iter.len > 8)
 				return false;
 
-			bss->has_sup_rates =  true;
-			memcpy(bss->supp_rates_ie, iter.data - 2, iter.len + 2);
+			bss->supp_rates_ie = iter.data - 2;
 
 			break;
 		case IE_TYPE_EXTENDED_SUPPORTED_RATES:
-			bss->ext_supp_rates_ie = l_memdup(iter.data - 2,
-								iter.len + 2);
+			if (!bss->ext_supp_rates_ie)
+				bss->ext_supp_rates_ie =
+						(uint8_t *) iter.data - 2;
 			break;
 		case IE_TYPE_RSN:
 			if (!bss->rsne)
-				bss->rsne = l_memdup(iter.data - 2,
-								iter.len + 2);
+				bss->rsne = (uint8_t *) iter.data - 2;
+			break;
+		case IE_TYPE_RSNX:
+			if (!bss->rsnxe)
+				bss->rsnxe = (uint8_t *) iter.data - 2;
 			break;
 		case IE_TYPE_BSS_LOAD:
-			if (ie_parse_bss_load(&iter, NULL, &bss->utilization,
-						NULL) < 0)
+			if (ie_parse_bss_load(&iter, &bss->sta_count,
+						&bss->utilization, NULL) < 0)
 				l_warn("Unable to parse BSS Load IE for "
 					MAC, MAC_STR(bss->addr));
 			else
-				l_debug("Load: %u/255", bss->utilization);
+				l_debug("Load: %u/255, stations: %u",
+					bss->utilization, bss->sta_count);
 
 			break;
 		case IE_TYPE_VENDOR_SPECIFIC:
@@ -1060,7 +2020,7 @@ static bool scan_parse_bss_information_elements(struct scan_bss *bss,
 				return false;
 
 			bss->ht_capable = true;
-			memcpy(bss->ht_ie, iter.data - 2, iter.len + 2);
+			bss->ht_ie = iter.data - 2;
 
 			break;
 		case IE_TYPE_VHT_CAPABILITIES:
@@ -1068,7 +2028,16 @@ static bool scan_parse_bss_information_elements(struct scan_bss *bss,
 				return false;
 
 			bss->vht_capable = true;
-			memcpy(bss->vht_ie, iter.data - 2, iter.len + 2);
+			bss->vht_ie = iter.data - 2;
+
+			break;
+		case IE_TYPE_HE_CAPABILITIES:
+			/* MAC, PHY and <= 80MHz HE-MCS and NSS Set */
+			if (iter.len < 21)
+				return false;
+
+			bss->he_capable = true;
+			bss->he_ie = iter.data - 3;
 
 			break;
 		case IE_TYPE_ADVERTISEMENT_PROTOCOL:
@@ -1093,88 +2062,233 @@ static bool scan_parse_bss_information_elements(struct scan_bss *bss,
 			if (iter.len < 2)
 				return false;
 
-			bss->rc_ie = l_memdup(iter.data - 2, iter.len + 2);
+			if (!bss->rc_ie)
+				bss->rc_ie = (uint8_t *) iter.data - 2;
 
 			break;
-		}
-	}
-
-	bss->wsc = ie_tlv_extract_wsc_payload(data, len, &bss->wsc_size);
+		case IE_TYPE_REDUCED_NEIGHBOR_REPORT:
+			if (!bss->rnr)
+				bss->rnr = iter.data - 2;
 
-	switch (bss->source_frame) {
-	case SCAN_BSS_PROBE_RESP:
-		bss->p2p_probe_resp_info = l_new(struct p2p_probe_resp, 1);
-
-		if (p2p_parse_probe_resp(data, len, bss->p2p_probe_resp_info) ==
-				0)
 			break;
+		}
+	}
 
-		l_free(bss->p2p_probe_resp_info);
-		bss->p2p_probe_resp_info = NULL;
-		break;
-	case SCAN_BSS_PROBE_REQ:
-		bss->p2p_probe_req_info = l_new(struct p2p_probe_req, 1);
+	/*
+	 * Only walk the IEs again to assemble the WSC, P2P or WFD payloads
+	 * if the BSS actually has any of those elements
+	 */
+	ie_index_init(&index, data, len);
 
-		if (p2p_parse_probe_req(data, len, bss->p2p_probe_req_info) ==
-				0)
-			break;
+	if (ie_index_find_vendor(&index, microsoft_oui, 0x04)) {
+		const void *wsc = ie_tlv_peek_wsc_payload(data, len,
+							&bss->wsc_size);
 
-		l_free(bss->p2p_probe_req_info);
-		bss->p2p_probe_req_info = NULL;
-		break;
-	case SCAN_BSS_BEACON:
-	{
 		/*
-		 * Beacon and Probe Response P2P IE subelement formats are
-		 * mutually incompatible and can help us distinguish one frame
-		 * subtype from the other if the driver is not exposing enough
-		 * information.  As a result of trusting the frame contents on
-		 * this, no critical code should depend on the
-		 * bss->source_frame information being right.
+		 * Unless fragmented, the payload can be used straight out
+		 * of the IE copy if that lives in the arena, saving the
+		 * concatenated copy.
 		 */
-		struct p2p_beacon info;
-		int r;
-
-		r = p2p_parse_beacon(data, len, &info);
-		if (r == 0) {
-			bss->p2p_beacon_info = l_memdup(&info, sizeof(info));
-			break;
+		if (wsc && bss->chunk)
+			bss->wsc = (uint8_t *) wsc;
+		else if (wsc)
+			bss->wsc = l_memdup(wsc, bss->wsc_size);
+		else if (bss->wsc_size == -EMSGSIZE) {
+			bss->wsc = ie_tlv_extract_wsc_payload(data, len,
+							&bss->wsc_size);
+			bss->wsc = scan_bss_adopt(bss, bss->wsc,
+							bss->wsc_size);
 		}
+	}
 
-		if (r == -ENOENT)
-			break;
+	if (ie_index_find_vendor(&index, wifi_alliance_oui, 0x09))
+		scan_parse_bss_p2p_information_elements(bss, data, len);
 
-		bss->p2p_probe_resp_info = l_new(struct p2p_probe_resp, 1);
+	if (ie_index_find_vendor(&index, wifi_alliance_oui, 0x0a)) {
+		bss->wfd = ie_tlv_extract_wfd_payload(data, len,
+							&bss->wfd_size);
+		bss->wfd = scan_bss_adopt(bss, bss->wfd, bss->wfd_size);
+	}
 
-		if (p2p_parse_probe_resp(data, len, bss->p2p_probe_resp_info) ==
-				0) {
-			bss->source_frame = SCAN_BSS_PROBE_RESP;
-			break;
-		}
+	return have_ssid;
+}
 
-		l_free(bss->p2p_probe_resp_info);
-		bss->p2p_probe_resp_info = NULL;
-		break;
-	}
+/* FNV-1a, only used to quickly tell apart changed IEs */
+static uint32_t scan_cache_ies_hash(const uint8_t *ies, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= ies[i];
+		hash *= 16777619U;
 	}
 
-	bss->wfd = ie_tlv_extract_wfd_payload(data, len, &bss->wfd_size);
+	return hash;
+}
 
-	return have_ssid;
+/*
+ * Copies over all the IE-derived members of @src into @dst, leaving the
+ * members obtained from the other NL80211_BSS_* attributes intact.
+ */
+static void scan_bss_copy_ies(struct scan_bss *dst,
+				const struct scan_bss *src)
+{
+	struct scan_bss attrs = *dst;
+
+	memcpy(dst, src, sizeof(*dst));
+
+	memcpy(dst->addr, attrs.addr, sizeof(dst->addr));
+	dst->frequency = attrs.frequency;
+	dst->signal_strength = attrs.signal_strength;
+	dst->capability = attrs.capability;
+	dst->source_frame = attrs.source_frame;
+	dst->time_stamp = attrs.time_stamp;
+	dst->parent_tsf = attrs.parent_tsf;
+	dst->chunk = attrs.chunk;
+	dst->refcount = attrs.refcount;
+	dst->rank = 0;
+
+	if (!src->ies)
+		return;
+
+	dst->ies = scan_bss_memdup(dst, src->ies, src->ies_len);
+
+#define REBASE(field)							\
+	if (src->field)							\
+		dst->field = dst->ies + (src->field - src->ies)
+
+	REBASE(rsne);
+	REBASE(rsnxe);
+	REBASE(wpa);
+	REBASE(osen);
+	REBASE(supp_rates_ie);
+	REBASE(ext_supp_rates_ie);
+	REBASE(ht_ie);
+	REBASE(vht_ie);
+	REBASE(he_ie);
+	REBASE(rnr);
+	REBASE(rc_ie);
+
+#undef REBASE
+
+	if (src->wsc)
+		dst->wsc = scan_bss_memdup(dst, src->wsc, src->wsc_size);
+
+	if (src->wfd)
+		dst->wfd = scan_bss_memdup(dst, src->wfd, src->wfd_size);
+}
+
+static bool scan_cache_lookup(struct scan_context *sc, struct scan_bss *bss,
+				const uint8_t *ies, size_t ies_len,
+				uint32_t ies_hash)
+{
+	struct scan_cache_entry *entry;
+
+	entry = l_hashtab_lookup(sc->bss_cache, bss->addr);
+	if (!entry)
+		return false;
+
+	if (entry->bss->frequency != bss->frequency ||
+			entry->bss->source_frame != bss->source_frame ||
+			entry->ies_hash != ies_hash ||
+			entry->bss->ies_len != ies_len ||
+			memcmp(entry->bss->ies, ies, ies_len))
+		return false;
+
+	scan_bss_copy_ies(bss, entry->bss);
+	entry->generation = sc->bss_cache_generation;
+
+	return true;
+}
+
+static void scan_cache_store(struct scan_context *sc,
+				const struct scan_bss *bss, uint32_t ies_hash)
+{
+	struct scan_cache_entry *entry;
+
+	/*
+	 * The P2P info structures are not trivially copyable and P2P devices
+	 * are few, always parse these from scratch.  All of the union members
+	 * are pointers so checking any one of them is enough.
+	 */
+	if (bss->p2p_probe_resp_info)
+		return;
+
+	entry = l_hashtab_lookup(sc->bss_cache, bss->addr);
+	if (entry)
+		scan_bss_free(entry->bss);
+	else
+		entry = l_new(struct scan_cache_entry, 1);
+
+	entry->bss = scan_bss_new(NULL, 0);
+	scan_bss_copy_ies(entry->bss, bss);
+	memcpy(entry->bss->addr, bss->addr, sizeof(bss->addr));
+	entry->bss->frequency = bss->frequency;
+	entry->bss->source_frame = bss->source_frame;
+
+	entry->ies_hash = ies_hash;
+	entry->generation = sc->bss_cache_generation;
+
+	/* Key points into entry->bss->addr which is stable until removal */
+	l_hashtab_replace(sc->bss_cache, entry->bss->addr, entry, NULL);
+}
+
+static bool scan_cache_prune_stale(const void *key, void *value,
+					void *user_data)
+{
+	struct scan_cache_entry *entry = value;
+	struct scan_context *sc = user_data;
+
+	if (entry->generation == sc->bss_cache_generation)
+		return false;
+
+	scan_cache_entry_free(entry);
+	return true;
+}
+
+/*
+ * Checks the SSID element, the first one in Beacons and Probe Responses,
+ * so that the BSSes of other networks can be dropped without parsing the
+ * rest.  Hidden SSIDs are let through as they could still be @ssid.
+ */
+static bool scan_ies_ssid_mismatch(const uint8_t *ies, size_t ies_len,
+					const char *ssid)
+{
+	struct ie_tlv_iter iter;
+
+	ie_tlv_iter_init(&iter, ies, ies_len);
+
+	while (ie_tlv_iter_next(&iter)) {
+		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_SSID)
+			continue;
+
+		if (util_ssid_is_hidden(iter.len, iter.data))
+			return false;
+
+		return iter.len != strlen(ssid) ||
+			memcmp(iter.data, ssid, iter.len);
+	}
+
+	return false;
 }
 
 static struct scan_bss *scan_parse_attr_bss(struct l_genl_attr *attr,
+						struct scan_context *sc,
+						struct scan_arena *arena,
+						const char *ssid_filter,
 						uint32_t *out_seen_ms_ago)
 {
 	uint16_t type, len;
 	const void *data;
-	struct scan_bss *bss;
+	struct scan_bss attrs = {};
+	struct scan_bss *bss = &attrs;
 	const uint8_t *ies = NULL;
-	size_t ies_len;
+	size_t ies_len = 0;
 	const uint8_t *beacon_ies = NULL;
-	size_t beacon_ies_len;
+	size_t beacon_ies_len = 0;
+	uint32_t ies_hash = 0;
 
-	bss = l_new(struct scan_bss, 1);
 	bss->utilization = 127;
 	bss->source_frame = SCAN_BSS_BEACON;
 
@@ -1182,25 +2296,25 @@ static struct scan_bss *scan_parse_attr_bss(struct l_genl_attr *attr,
 		switch (type) {
 		case NL80211_BSS_BSSID:
 			if (len != sizeof(bss->addr))
-				goto fail;
+				return NULL;
 
 			memcpy(bss->addr, data, len);
 			break;
 		case NL80211_BSS_CAPABILITY:
 			if (len != sizeof(uint16_t))
-				goto fail;
+				return NULL;
 
 			bss->capability = *((uint16_t *) data);
 			break;
 		case NL80211_BSS_FREQUENCY:
 			if (len != sizeof(uint32_t))
-				goto fail;
+				return NULL;
 
 			bss->frequency = *((uint32_t *) data);
 			break;
 		case NL80211_BSS_SIGNAL_MBM:
 			if (len != sizeof(int32_t))
-				goto fail;
+				return NULL;
 
 			bss->signal_strength = *((int32_t *) data);
 			break;
@@ -1210,7 +2324,7 @@ static struct scan_bss *scan_parse_attr_bss(struct l_genl_attr *attr,
 			break;
 		case NL80211_BSS_PARENT_TSF:
 			if (len != sizeof(uint64_t))
-				goto fail;
+				return NULL;
 
 			bss->parent_tsf = l_get_u64(data);
 			break;
@@ -1231,7 +2345,7 @@ static struct scan_bss *scan_parse_attr_bss(struct l_genl_attr *attr,
 			if (L_WARN_ON(len != sizeof(uint64_t)))
 				break;
 
-			bss->time_stamp = l_get_u64(data);
+			bss->time_stamp = l_get_u64(data) / L_NSEC_PER_USEC;
 			break;
 		}
 	}
@@ -1247,9 +2361,35 @@ static struct scan_bss *scan_parse_attr_bss(struct l_genl_attr *attr,
 				memcmp(ies, beacon_ies, ies_len)))
 		bss->source_frame = SCAN_BSS_PROBE_RESP;
 
-	if (ies && !scan_parse_bss_information_elements(bss, ies, ies_len))
+	if (ssid_filter && ies &&
+			scan_ies_ssid_mismatch(ies, ies_len, ssid_filter))
+		return NULL;
+
+	/*
+	 * Only now that the size of the IEs is known can the BSS be placed
+	 * in the arena together with its IE copies
+	 */
+	bss = scan_bss_new(arena, ies_len);
+	attrs.chunk = bss->chunk;
+	attrs.refcount = bss->refcount;
+	memcpy(bss, &attrs, sizeof(attrs));
+
+	if (!ies)
+		return bss;
+
+	if (sc) {
+		ies_hash = scan_cache_ies_hash(ies, ies_len);
+
+		if (scan_cache_lookup(sc, bss, ies, ies_len, ies_hash))
+			return bss;
+	}
+
+	if (!scan_parse_bss_information_elements(bss, ies, ies_len))
 		goto fail;
 
+	if (sc)
+		scan_cache_store(sc, bss, ies_hash);
+
 	return bss;
 
 fail:
@@ -1280,6 +2420,9 @@ static struct scan_freq_set *scan_parse_attr_scan_frequencies(
 }
 
 static struct scan_bss *scan_parse_result(struct l_genl_msg *msg,
+						struct scan_context *sc,
+						struct scan_arena *arena,
+						const char *ssid_filter,
 						uint64_t *out_wdev,
 						uint32_t *out_seen_ms_ago)
 {
@@ -1305,7 +2448,9 @@ static struct scan_bss *scan_parse_result(struct l_genl_msg *msg,
 			if (!l_genl_attr_recurse(&attr, &nested))
 				return NULL;
 
-			bss = scan_parse_attr_bss(&nested, out_seen_ms_ago);
+			bss = scan_parse_attr_bss(&nested, sc, arena,
+							ssid_filter,
+							out_seen_ms_ago);
 			break;
 		}
 	}
@@ -1324,6 +2469,37 @@ static struct scan_bss *scan_parse_result(struct l_genl_msg *msg,
 	return bss;
 }
 
+/*
+ * Estimate of the throughput achievable with the BSS: the data rate the
+ * PHY capabilities allow at the received signal strength, scaled down by
+ * the airtime left over by other traffic on the channel and by the
+ * number of stations that are going to contend for it.
+ */
+static double scan_bss_estimate_throughput(const struct scan_bss *bss)
+{
+	static const double STA_COUNT_SCALE = 32.0;
+	static const double MIN_AIRTIME_SHARE = 0.05;
+	uint64_t data_rate;
+	double share;
+
+	if ((!bss->supp_rates_ie && !bss->ext_supp_rates_ie) ||
+			ie_parse_data_rates(bss->supp_rates_ie,
+						bss->ext_supp_rates_ie,
+						bss->ht_ie, bss->vht_ie,
+						bss->he_ie,
+						bss->signal_strength / 100,
+						&data_rate) < 0)
+		data_rate = 1000000;
+
+	share = (255.0 - bss->utilization) / 255.0;
+	share /= 1.0 + bss->sta_count / STA_COUNT_SCALE;
+
+	if (share < MIN_AIRTIME_SHARE)
+		share = MIN_AIRTIME_SHARE;
+
+	return data_rate * share;
+}
+
 static void scan_bss_compute_rank(struct scan_bss *bss)
 {
 	static const double RANK_RSNE_FACTOR = 1.2;
@@ -1342,8 +2518,15 @@ static void scan_bss_compute_rank(struct scan_bss *bss)
 	 * WiFi range is -0 to -100 dBm
 	 */
 
-	/* Heavily slanted towards signal strength */
-	rank = 10000 + bss->signal_strength;
+	/*
+	 * With the throughput model the rank is the estimate in 100 Kbps
+	 * units, the signal strength only counts through the data rate.
+	 * Otherwise heavily slanted towards signal strength.
+	 */
+	if (RANK_THROUGHPUT)
+		rank = 1 + scan_bss_estimate_throughput(bss) / 100000;
+	else
+		rank = 10000 + bss->signal_strength;
 
 	/*
 	 * Prefer RSNE first, WPA second.  Open networks are much less
@@ -1364,20 +2547,23 @@ static void scan_bss_compute_rank(struct scan_bss *bss)
 	if (bss->frequency > 4000)
 		rank *= RANK_5G_FACTOR;
 
+	/* Load and data rate are already part of the throughput estimate */
+	if (RANK_THROUGHPUT)
+		goto done;
+
 	/* Rank loaded APs lower and lighly loaded APs higher */
 	if (bss->utilization >= 192)
 		rank *= RANK_HIGH_UTILIZATION_FACTOR;
 	else if (bss->utilization <= 63)
 		rank *= RANK_LOW_UTILIZATION_FACTOR;
 
-	if (bss->has_sup_rates || bss->ext_supp_rates_ie) {
+	if (bss->supp_rates_ie || bss->ext_supp_rates_ie) {
 		uint64_t data_rate;
 
-		if (ie_parse_data_rates(bss->has_sup_rates ?
-					bss->supp_rates_ie : NULL,
+		if (ie_parse_data_rates(bss->supp_rates_ie,
 					bss->ext_supp_rates_ie,
-					bss->ht_capable ? bss->ht_ie : NULL,
-					bss->vht_capable ? bss->vht_ie : NULL,
+					bss->ht_ie, bss->vht_ie,
+					bss->he_ie,
 					bss->signal_strength / 100,
 					&data_rate) == 0) {
 			double factor = RANK_MAX_SUPPORTED_RATE_FACTOR -
@@ -1393,6 +2579,7 @@ static void scan_bss_compute_rank(struct scan_bss *bss)
 			rank *= RANK_MIN_SUPPORTED_RATE_FACTOR;
 	}
 
+done:
 	irank = rank;
 
 	if (irank > USHRT_MAX)
@@ -1409,7 +2596,7 @@ struct scan_bss *scan_bss_new_from_probe_req(const struct mmpdu_header *mpdu,
 {
 	struct scan_bss *bss;
 
-	bss = l_new(struct scan_bss, 1);
+	bss = scan_bss_new(NULL, 0);
 	memcpy(bss->addr, mpdu->address_2, 6);
 	bss->utilization = 127;
 	bss->source_frame = SCAN_BSS_PROBE_REQ;
@@ -1427,15 +2614,62 @@ fail:
 	return NULL;
 }
 
+/*
+ * Builds a standalone BSS from one GET_SCAN dump entry, going through the
+ * same parsing and ranking as get_scan_callback(), though without the dump
+ * arena and the IE cache.  This lets captured scan results be replayed
+ * outside of a scan context.
+ */
+struct scan_bss *scan_bss_new_from_genl(struct l_genl_msg *msg,
+						uint64_t *out_wdev)
+{
+	struct scan_bss *bss;
+	uint32_t seen_ms_ago = 0;
+
+	bss = scan_parse_result(msg, NULL, NULL, NULL, out_wdev,
+								&seen_ms_ago);
+	if (!bss)
+		return NULL;
+
+	scan_bss_compute_rank(bss);
+	return bss;
+}
+
+/*
+ * Takes a reference on @bss which is otherwise owned by whichever list it
+ * was returned in.  Each reference is dropped with scan_bss_free().
+ */
+struct scan_bss *scan_bss_ref(struct scan_bss *bss)
+{
+	bss->refcount++;
+
+	return bss;
+}
+
+/*
+ * Estimate of the memory held by a BSS.  Arena chunks are only released
+ * once all of their BSSes are, so this is what freeing the BSS is worth
+ * eventually rather than immediately.
+ */
+size_t scan_bss_get_mem_size(const struct scan_bss *bss)
+{
+	size_t size = sizeof(struct scan_bss) + bss->ies_len;
+
+	if (bss->wsc_size > 0)
+		size += bss->wsc_size;
+
+	if (bss->wfd_size > 0)
+		size += bss->wfd_size;
+
+	return size;
+}
+
 void scan_bss_free(struct scan_bss *bss)
 {
-	l_free(bss->ext_supp_rates_ie);
-	l_free(bss->rsne);
-	l_free(bss->wpa);
-	l_free(bss->wsc);
-	l_free(bss->osen);
-	l_free(bss->rc_ie);
-	l_free(bss->wfd);
+	if (--bss->refcount)
+		return;
+
+	IWD_COUNTER_DEC(scan_bss);
 
 	switch (bss->source_frame) {
 	case SCAN_BSS_PROBE_RESP:
@@ -1461,6 +2695,15 @@ void scan_bss_free(struct scan_bss *bss)
 		break;
 	}
 
+	/* IE copies live in the same chunk and go away together with it */
+	if (bss->chunk) {
+		scan_arena_chunk_unref(bss->chunk);
+		return;
+	}
+
+	l_free(bss->ies);
+	l_free(bss->wsc);
+	l_free(bss->wfd);
 	l_free(bss);
 }
 
@@ -1507,6 +2750,96 @@ int scan_bss_rank_compare(const void *a, const void *b, void *user_data)
 	return (bss->rank > new_bss->rank) ? 1 : -1;
 }
 
+/*
+ * Same as l_queue_insert with scan_bss_rank_compare but BSSes coming from
+ * ranked scan results are appended without walking the list.
+ */
+bool scan_bss_insert_ranked(struct l_queue *bss_list, struct scan_bss *bss)
+{
+	const struct scan_bss *tail = l_queue_peek_tail(bss_list);
+
+	if (!tail || tail->rank > bss->rank)
+		return l_queue_push_tail(bss_list, bss);
+
+	return l_queue_insert(bss_list, bss, scan_bss_rank_compare, NULL);
+}
+
+struct scan_bss_sort_entry {
+	struct scan_bss *bss;
+	unsigned int idx;
+};
+
+static int scan_bss_sort_compare(const void *a, const void *b)
+{
+	const struct scan_bss_sort_entry *entry_a = a;
+	const struct scan_bss_sort_entry *entry_b = b;
+
+	if (entry_a->bss->rank != entry_b->bss->rank)
+		return entry_a->bss->rank > entry_b->bss->rank ? -1 : 1;
+
+	/* Ties in the order sorted insertion would leave them: newest first */
+	return entry_a->idx > entry_b->idx ? -1 : 1;
+}
+
+/*
+ * Results are collected in dump order and sorted by rank once the dump is
+ * done instead of being inserted in place one by one
+ */
+static void scan_bss_list_sort(struct l_queue *bss_list)
+{
+	unsigned int len = l_queue_length(bss_list);
+	struct scan_bss_sort_entry *entries;
+	struct scan_bss *bss;
+	unsigned int i = 0;
+
+	if (len < 2)
+		return;
+
+	entries = l_new(struct scan_bss_sort_entry, len);
+
+	while ((bss = l_queue_pop_head(bss_list))) {
+		entries[i].bss = bss;
+		entries[i].idx = i;
+		i++;
+	}
+
+	qsort(entries, len, sizeof(*entries), scan_bss_sort_compare);
+
+	for (i = 0; i < len; i++)
+		l_queue_push_tail(bss_list, entries[i].bss);
+
+	l_free(entries);
+}
+
+/*
+ * Adds the 6GHz channels of the Neighbor AP Information fields found in a
+ * Reduced Neighbor Report element.  802.11ax-2021, Section 9.4.2.170
+ */
+static void scan_parse_rnr_freqs(const uint8_t *rnr,
+					struct scan_freq_set *freqs)
+{
+	const uint8_t *ptr = rnr + 2;
+	const uint8_t *end = ptr + rnr[1];
+
+	while (end - ptr >= 4) {
+		uint8_t tbtt_count = bit_field(ptr[0], 4, 4) + 1;
+		uint8_t tbtt_len = ptr[1];
+		uint8_t oper_class = ptr[2];
+		uint8_t channel = ptr[3];
+		size_t info_len = 4 + tbtt_count * tbtt_len;
+
+		if (info_len > (size_t) (end - ptr))
+			break;
+
+		if (scan_oper_class_to_band(NULL, oper_class) ==
+							SCAN_BAND_6_GHZ)
+			scan_freq_set_add(freqs, scan_channel_to_freq(channel,
+							SCAN_BAND_6_GHZ));
+
+		ptr += info_len;
+	}
+}
+
 static void get_scan_callback(struct l_genl_msg *msg, void *user_data)
 {
 	struct scan_results *results = user_data;
@@ -1517,7 +2850,9 @@ static void get_scan_callback(struct l_genl_msg *msg, void *user_data)
 
 	l_debug("get_scan_callback");
 
-	bss = scan_parse_result(msg, &wdev_id, &seen_ms_ago);
+	bss = scan_parse_result(msg, sc, &results->arena,
+				results->sr ? results->sr->ssid_filter : NULL,
+				&wdev_id, &seen_ms_ago);
 	if (!bss)
 		return;
 
@@ -1532,23 +2867,97 @@ static void get_scan_callback(struct l_genl_msg *msg, void *user_data)
 					seen_ms_ago * L_USEC_PER_MSEC;
 
 	scan_bss_compute_rank(bss);
-	l_queue_insert(results->bss_list, bss, scan_bss_rank_compare, NULL);
+	l_queue_push_tail(results->bss_list, bss);
+
+	if (bss->rnr)
+		scan_parse_rnr_freqs(bss->rnr, &results->rnr_freqs);
+}
+
+static bool scan_hidden_ssids_append(const struct network_info *network,
+					void *user_data)
+{
+	char ***ssids = user_data;
+
+	if (network->is_hidden && !l_strv_contains(*ssids, network->ssid))
+		*ssids = l_strv_append(*ssids, network->ssid);
+
+	return true;
+}
+
+static void scan_learn_hidden_ssid(struct scan_context *sc,
+					const struct scan_bss *bss,
+					char **hidden_known)
+{
+	char ssid[33];
+	char *old;
+
+	memcpy(ssid, bss->ssid, bss->ssid_len);
+	ssid[bss->ssid_len] = '\0';
+
+	if (!l_strv_contains(hidden_known, ssid))
+		return;
+
+	old = l_hashtab_lookup(sc->hidden_ssids, bss->addr);
+	if (old && !strcmp(old, ssid))
+		return;
+
+	if (!old && l_hashtab_size(sc->hidden_ssids) >= SCAN_HIDDEN_MAX_BSSES) {
+		l_hashtab_destroy(sc->hidden_ssids, l_free);
+		sc->hidden_ssids = l_hashtab_new(ETH_ALEN, L_HASHTAB_HASH_FAST);
+	}
+
+	l_hashtab_replace(sc->hidden_ssids, bss->addr, l_strdup(ssid),
+				(void **) &old);
+	l_free(old);
 }
 
 static void discover_hidden_network_bsses(struct scan_context *sc,
 						struct l_queue *bss_list)
 {
 	const struct l_queue_entry *bss_entry;
+	char **hidden_known = l_new(char *, 1);
+	char **probe_ssids = l_new(char *, 1);
+	bool unknown = false;
+
+	known_networks_foreach(scan_hidden_ssids_append, &hidden_known);
+
+	/* First learn which BSSes answered for which hidden network */
+	for (bss_entry = l_queue_get_entries(bss_list); bss_entry;
+						bss_entry = bss_entry->next) {
+		const struct scan_bss *bss = bss_entry->data;
+
+		if (hidden_known[0] &&
+				!util_ssid_is_hidden(bss->ssid_len, bss->ssid))
+			scan_learn_hidden_ssid(sc, bss, hidden_known);
+	}
 
 	for (bss_entry = l_queue_get_entries(bss_list); bss_entry;
 						bss_entry = bss_entry->next) {
-		struct scan_bss *bss = bss_entry->data;
+		const struct scan_bss *bss = bss_entry->data;
+		const char *ssid;
 
 		if (!util_ssid_is_hidden(bss->ssid_len, bss->ssid))
 			continue;
 
 		sc->sp.needs_active_scan = true;
+
+		ssid = l_hashtab_lookup(sc->hidden_ssids, bss->addr);
+		if (!ssid)
+			unknown = true;
+		else if (!l_strv_contains(probe_ssids, ssid))
+			probe_ssids = l_strv_append(probe_ssids, ssid);
+	}
+
+	l_strv_free(hidden_known);
+	l_strv_free(sc->hidden_probe_ssids);
+
+	/* A hidden BSS we know nothing about may be any hidden network */
+	if (unknown) {
+		l_strv_free(probe_ssids);
+		probe_ssids = NULL;
 	}
+
+	sc->hidden_probe_ssids = probe_ssids;
 }
 
 static void scan_finished(struct scan_context *sc,
@@ -1562,6 +2971,11 @@ static void scan_finished(struct scan_context *sc,
 		discover_hidden_network_bsses(sc, bss_list);
 
 	if  (sr) {
+		if (!err && sr->start_time)
+			METRICS_OBSERVE(scan_duration,
+					l_time_diff(sr->start_time,
+							l_time_now()));
+
 		l_queue_remove(sc->requests, sr);
 		sc->started = false;
 		sc->work_started = false;
@@ -1587,16 +3001,86 @@ static void scan_finished(struct scan_context *sc,
 				(l_queue_destroy_func_t) scan_bss_free);
 }
 
+struct scan_share_data {
+	struct scan_context *origin;
+	struct l_queue *bss_list;
+	const struct scan_freq_set *freqs;
+};
+
+static void scan_bss_list_ref_append(void *data, void *user_data)
+{
+	l_queue_push_tail(user_data, scan_bss_ref(data));
+}
+
+static void scan_share_results(void *data, void *user_data)
+{
+	struct scan_context *sc = data;
+	struct scan_share_data *share = user_data;
+	struct l_queue *bss_list;
+
+	if (sc == share->origin || sc->wiphy != share->origin->wiphy)
+		return;
+
+	/* Only contexts with a periodic scan running want passive results */
+	if (!sc->sp.callback)
+		return;
+
+	bss_list = l_queue_new();
+	l_queue_foreach(share->bss_list, scan_bss_list_ref_append, bss_list);
+
+	l_debug("Sharing results of wdev %" PRIx64 " with wdev %" PRIx64,
+			share->origin->wdev_id, sc->wdev_id);
+
+	if (!sc->sp.callback(0, bss_list, share->freqs, sc->sp.userdata))
+		l_queue_destroy(bss_list,
+				(l_queue_destroy_func_t) scan_bss_free);
+
+	/* These results are as good as our own periodic scan */
+	if (sc->sp.timeout && !sc->sp.id)
+		scan_periodic_rearm(sc);
+}
+
 static void get_scan_done(void *user)
 {
 	struct scan_results *results = user;
 	struct scan_context *sc = results->sc;
 
 	l_debug("get_scan_done");
+	TRACE(scan_results, sc->wdev_id, l_queue_length(results->bss_list));
 
 	sc->get_scan_cmd_id = 0;
+	scan_bss_list_sort(results->bss_list);
+
+	/*
+	 * GET_SCAN dumps the entire kernel BSS table so whatever was not
+	 * refreshed by this dump is no longer around
+	 */
+	l_hashtab_foreach_remove(sc->bss_cache, scan_cache_prune_stale, sc);
+	sc->rnr_freqs = results->rnr_freqs;
+
+	/*
+	 * All interfaces on a wiphy share the kernel's BSS table, so rather
+	 * than having every other interface scan the same channels again
+	 * hand them their own references to the BSSes just parsed.
+	 */
+	if (l_queue_length(scan_contexts) > 1) {
+		struct scan_share_data share = {
+			.origin = sc,
+			.bss_list = results->bss_list,
+			.freqs = results->freqs,
+		};
+
+		l_queue_foreach(scan_contexts, scan_share_results, &share);
+	}
 
-	if (l_queue_peek_head(sc->requests) == results->sr)
+	if (results->sched) {
+		if (!sc->sched.callback || !sc->sched.callback(0,
+						results->bss_list,
+						results->freqs,
+						sc->sched.userdata))
+			l_queue_destroy(results->bss_list,
+				(l_queue_destroy_func_t) scan_bss_free);
+	} else if (l_queue_peek_head(sc->requests) == results->sr)
 		scan_finished(sc, 0, results->bss_list,
 						results->freqs, results->sr);
 	else
@@ -1606,6 +3090,7 @@ static void get_scan_done(void *user)
 	if (results->freqs)
 		scan_freq_set_free(results->freqs);
 
+	scan_arena_release(&results->arena);
 	l_free(results);
 }
 
@@ -1650,6 +3135,20 @@ static void scan_parse_new_scan_results(struct l_genl_msg *msg,
 	}
 }
 
+static void scan_get_results(struct scan_context *sc,
+				struct scan_results *results)
+{
+	struct l_genl_msg *scan_msg;
+
+	sc->bss_cache_generation++;
+
+	scan_msg = l_genl_msg_new_sized(NL80211_CMD_GET_SCAN, 8);
+	l_genl_msg_append_attr(scan_msg, NL80211_ATTR_WDEV, 8, &sc->wdev_id);
+	sc->get_scan_cmd_id = l_genl_family_dump(nl80211, scan_msg,
+							get_scan_callback,
+							results, get_scan_done);
+}
+
 static void scan_notify(struct l_genl_msg *msg, void *user_data)
 {
 	struct l_genl_attr attr;
@@ -1698,7 +3197,6 @@ static void scan_notify(struct l_genl_msg *msg, void *user_data)
 	switch (cmd) {
 	case NL80211_CMD_NEW_SCAN_RESULTS:
 	{
-		struct l_genl_msg *scan_msg;
 		struct scan_results *results;
 		bool send_next = false;
 		bool get_results = false;
@@ -1725,6 +3223,11 @@ static void scan_notify(struct l_genl_msg *msg, void *user_data)
 			 */
 			if (l_queue_isempty(sr->cmds))
 				get_results = true;
+			else if (sr->sliced && SCAN_SLICE_GAP)
+				sr->slice_timeout = l_timeout_create_ms(
+							SCAN_SLICE_GAP,
+							scan_slice_timeout,
+							sr, NULL);
 			else
 				send_next = true;
 		} else {
@@ -1769,17 +3272,33 @@ static void scan_notify(struct l_genl_msg *msg, void *user_data)
 		results->bss_list = l_queue_new();
 
 		scan_parse_new_scan_results(msg, results);
+		scan_get_results(sc, results);
+		break;
+	}
 
-		scan_msg = l_genl_msg_new_sized(NL80211_CMD_GET_SCAN, 8);
-		l_genl_msg_append_attr(scan_msg, NL80211_ATTR_WDEV, 8,
-					&sc->wdev_id);
-		sc->get_scan_cmd_id = l_genl_family_dump(nl80211, scan_msg,
-							get_scan_callback,
-							results, get_scan_done);
+	case NL80211_CMD_SCHED_SCAN_RESULTS:
+	{
+		struct scan_results *results;
+
+		/* A dump already underway will cover these results */
+		if (!sc->sched.callback || sc->get_scan_cmd_id)
+			break;
+
+		results = l_new(struct scan_results, 1);
+		results->sc = sc;
+		results->time_stamp = l_time_now();
+		results->bss_list = l_queue_new();
+		results->sched = true;
 
+		scan_get_results(sc, results);
 		break;
 	}
 
+	case NL80211_CMD_SCHED_SCAN_STOPPED:
+		/* Either stopped by us or by the kernel, e.g. on rfkill */
+		sc->sched.running = false;
+		break;
+
 	case NL80211_CMD_TRIGGER_SCAN:
 		if (active_scan)
 			sc->state = SCAN_STATE_ACTIVE;
@@ -1796,6 +3315,7 @@ static void scan_notify(struct l_genl_msg *msg, void *user_data)
 			break;
 
 		sc->state = SCAN_STATE_NOT_RUNNING;
+		METRICS_INC(scans_aborted);
 
 		if (sc->triggered) {
 			sc->triggered = false;
@@ -1826,6 +3346,7 @@ static void get_fw_scan_done(void *userdata)
 	bool new_owner = false;
 
 	sc->get_fw_scan_cmd_id = 0;
+	scan_bss_list_sort(results->bss_list);
 
 	if (sr->callback)
 		new_owner = sr->callback(err, results->bss_list, NULL,
@@ -1839,6 +3360,7 @@ static void get_fw_scan_done(void *userdata)
 		sr->destroy(sr->userdata);
 
 	l_free(sr);
+	scan_arena_release(&results->arena);
 	l_free(results);
 }
 
@@ -1929,6 +3451,22 @@ uint8_t scan_freq_to_channel(uint32_t freq, enum scan_band *out_band)
 		return channel;
 	}
 
+	/* 802.11ax-2021, Section 27.3.23.2 */
+	if (freq == 5935 || (freq > 5950 && freq <= 7115)) {
+		if (freq % 5)
+			return 0;
+
+		if (freq == 5935)
+			channel = 2;
+		else
+			channel = (freq - 5950) / 5;
+
+		if (out_band)
+			*out_band = SCAN_BAND_6_GHZ;
+
+		return channel;
+	}
+
 	return 0;
 }
 
@@ -1950,6 +3488,14 @@ uint32_t scan_channel_to_freq(uint8_t channel, enum scan_band band)
 			return 4000 + 5 * channel;
 	}
 
+	if (band == SCAN_BAND_6_GHZ) {
+		if (channel == 2)
+			return 5935;
+
+		if (channel >= 1 && channel <= 233)
+			return 5950 + 5 * channel;
+	}
+
 	return 0;
 }
 
@@ -2005,10 +3551,11 @@ static const uint8_t oper_class_jp_to_global[] = {
 	/* 128 - 130 is a 1 to 1 mapping */
 };
 
-/* Annex E, table E-4 (only 2.4GHz and 4.9 / 5GHz bands) */
+/* Annex E, table E-4 (only 2.4GHz, 4.9 / 5GHz and 6GHz bands) */
 static const enum scan_band oper_class_to_band_global[] = {
 	[81 ... 84]   = SCAN_BAND_2_4_GHZ,
 	[104 ... 130] = SCAN_BAND_5_GHZ,
+	[131 ... 136] = SCAN_BAND_6_GHZ,
 };
 
 /* Annex E, table E-5 */
@@ -2076,136 +3623,147 @@ enum scan_band scan_oper_class_to_band(const uint8_t *country,
 		return 0;
 }
 
-struct scan_freq_set {
-	uint16_t channels_2ghz;
-	struct l_uintset *channels_5ghz;
-};
-
 struct scan_freq_set *scan_freq_set_new(void)
 {
-	struct scan_freq_set *ret = l_new(struct scan_freq_set, 1);
-
-	/* 802.11-2012, 8.4.2.10 hints that 200 is the largest channel number */
-	ret->channels_5ghz = l_uintset_new_from_range(1, 200);
-
-	return ret;
+	return l_new(struct scan_freq_set, 1);
 }
 
 void scan_freq_set_free(struct scan_freq_set *freqs)
 {
-	l_uintset_free(freqs->channels_5ghz);
 	l_free(freqs);
 }
 
+static uint64_t *scan_freq_set_get_bitmap(struct scan_freq_set *freqs,
+						enum scan_band band)
+{
+	switch (band) {
+	case SCAN_BAND_2_4_GHZ:
+		break;
+	case SCAN_BAND_5_GHZ:
+		return freqs->channels_5ghz;
+	case SCAN_BAND_6_GHZ:
+		return freqs->channels_6ghz;
+	}
+
+	return NULL;
+}
+
 bool scan_freq_set_add(struct scan_freq_set *freqs, uint32_t freq)
 {
 	enum scan_band band;
 	uint8_t channel;
+	uint64_t *bitmap;
 
 	channel = scan_freq_to_channel(freq, &band);
 	if (!channel)
 		return false;
 
-	switch (band) {
-	case SCAN_BAND_2_4_GHZ:
+	if (band == SCAN_BAND_2_4_GHZ) {
 		freqs->channels_2ghz |= 1 << (channel - 1);
 		return true;
-	case SCAN_BAND_5_GHZ:
-		return l_uintset_put(freqs->channels_5ghz, channel);
 	}
 
-	return false;
+	bitmap = scan_freq_set_get_bitmap(freqs, band);
+	if (!bitmap)
+		return false;
+
+	bitmap[channel / 64] |= (uint64_t) 1 << (channel % 64);
+	return true;
 }
 
 bool scan_freq_set_contains(const struct scan_freq_set *freqs, uint32_t freq)
 {
 	enum scan_band band;
 	uint8_t channel;
+	const uint64_t *bitmap;
 
 	channel = scan_freq_to_channel(freq, &band);
 	if (!channel)
 		return false;
 
-	switch (band) {
-	case SCAN_BAND_2_4_GHZ:
+	if (band == SCAN_BAND_2_4_GHZ)
 		return freqs->channels_2ghz & (1 << (channel - 1));
-	case SCAN_BAND_5_GHZ:
-		return l_uintset_contains(freqs->channels_5ghz, channel);
-	}
 
-	return false;
+	bitmap = scan_freq_set_get_bitmap((struct scan_freq_set *) freqs, band);
+	if (!bitmap)
+		return false;
+
+	return bitmap[channel / 64] & ((uint64_t) 1 << (channel % 64));
+}
+
+static bool scan_freq_bitmap_isempty(const uint64_t *bitmap)
+{
+	return !(bitmap[0] | bitmap[1] | bitmap[2] | bitmap[3]);
 }
 
 uint32_t scan_freq_set_get_bands(struct scan_freq_set *freqs)
 {
 	uint32_t bands = 0;
-	uint32_t max;
 
 	if (freqs->channels_2ghz)
 		bands |= SCAN_BAND_2_4_GHZ;
 
-	max = l_uintset_get_max(freqs->channels_5ghz);
-
-	if (l_uintset_find_min(freqs->channels_5ghz) <= max)
+	if (!scan_freq_bitmap_isempty(freqs->channels_5ghz))
 		bands |= SCAN_BAND_5_GHZ;
 
-	return bands;
-}
-
-static void scan_channels_5ghz_add(uint32_t channel, void *user_data)
-{
-	struct l_uintset *to = user_data;
+	if (!scan_freq_bitmap_isempty(freqs->channels_6ghz))
+		bands |= SCAN_BAND_6_GHZ;
 
-	l_uintset_put(to, channel);
+	return bands;
 }
 
 void scan_freq_set_merge(struct scan_freq_set *to,
 					const struct scan_freq_set *from)
 {
+	unsigned int i;
+
 	to->channels_2ghz |= from->channels_2ghz;
 
-	l_uintset_foreach(from->channels_5ghz, scan_channels_5ghz_add,
-							to->channels_5ghz);
+	for (i = 0; i < L_ARRAY_SIZE(to->channels_5ghz); i++) {
+		to->channels_5ghz[i] |= from->channels_5ghz[i];
+		to->channels_6ghz[i] |= from->channels_6ghz[i];
+	}
 }
 
 bool scan_freq_set_isempty(const struct scan_freq_set *set)
 {
-	if (set->channels_2ghz == 0 && l_uintset_isempty(set->channels_5ghz))
-		return true;
-
-	return false;
+	return !set->channels_2ghz &&
+		scan_freq_bitmap_isempty(set->channels_5ghz) &&
+		scan_freq_bitmap_isempty(set->channels_6ghz);
 }
 
-struct channels_5ghz_foreach_data {
-	scan_freq_set_func_t func;
-	void *user_data;
-};
-
-static void scan_channels_5ghz_frequency(uint32_t channel, void *user_data)
+static void scan_freq_bitmap_foreach(const uint64_t *bitmap,
+					enum scan_band band,
+					scan_freq_set_func_t func,
+					void *user_data)
 {
-	const struct channels_5ghz_foreach_data *channels_5ghz_data = user_data;
-	uint32_t freq;
+	unsigned int i;
 
-	freq = scan_channel_to_freq(channel, SCAN_BAND_5_GHZ);
+	for (i = 0; i < 4; i++) {
+		uint64_t word = bitmap[i];
 
-	channels_5ghz_data->func(freq, channels_5ghz_data->user_data);
+		while (word) {
+			uint8_t channel = i * 64 + __builtin_ctzll(word);
+
+			word &= word - 1;
+			func(scan_channel_to_freq(channel, band), user_data);
+		}
+	}
 }
 
 void scan_freq_set_foreach(const struct scan_freq_set *freqs,
 				scan_freq_set_func_t func, void *user_data)
 {
-	struct channels_5ghz_foreach_data data = { };
 	uint8_t channel;
 	uint32_t freq;
 
 	if (unlikely(!freqs || !func))
 		return;
 
-	data.func = func;
-	data.user_data = user_data;
-
-	l_uintset_foreach(freqs->channels_5ghz, scan_channels_5ghz_frequency,
-									&data);
+	scan_freq_bitmap_foreach(freqs->channels_5ghz, SCAN_BAND_5_GHZ,
+					func, user_data);
+	scan_freq_bitmap_foreach(freqs->channels_6ghz, SCAN_BAND_6_GHZ,
+					func, user_data);
 
 	if (!freqs->channels_2ghz)
 		return;
@@ -2222,18 +3780,92 @@ void scan_freq_set_foreach(const struct scan_freq_set *freqs,
 void scan_freq_set_constrain(struct scan_freq_set *set,
 					const struct scan_freq_set *constraint)
 {
-	struct l_uintset *intersection;
+	unsigned int i;
+
+	set->channels_2ghz &= constraint->channels_2ghz;
+
+	for (i = 0; i < L_ARRAY_SIZE(set->channels_5ghz); i++) {
+		set->channels_5ghz[i] &= constraint->channels_5ghz[i];
+		set->channels_6ghz[i] &= constraint->channels_6ghz[i];
+	}
+}
+
+static void scan_resync_cb(struct l_genl_msg *msg, void *user_data)
+{
+	struct scan_context *sc = user_data;
+	struct scan_request *sr = l_queue_peek_head(sc->requests);
 
-	intersection = l_uintset_intersect(constraint->channels_5ghz,
-							set->channels_5ghz);
-	if (!intersection)
-		/* This shouldn't ever be the case. */
+	sc->resync_cmd_id = 0;
+
+	/*
+	 * On success a SCAN_ABORTED follows and restarts the segment.  With
+	 * ENOENT nothing was running anymore, the event saying the scan had
+	 * finished was among those lost.
+	 */
+	if (l_genl_msg_get_error(msg) != -ENOENT ||
+			sc->state == SCAN_STATE_NOT_RUNNING)
 		return;
 
-	l_uintset_free(set->channels_5ghz);
-	set->channels_5ghz = intersection;
+	sc->state = SCAN_STATE_NOT_RUNNING;
 
-	set->channels_2ghz &= constraint->channels_2ghz;
+	if (sc->work_started && sr)
+		start_next_scan_request(&sr->work);
+}
+
+static void scan_context_resync(void *data, void *user_data)
+{
+	struct scan_context *sc = data;
+	struct scan_request *sr = l_queue_peek_head(sc->requests);
+	struct l_genl_msg *msg;
+
+	if (sc->state == SCAN_STATE_NOT_RUNNING || sc->start_cmd_id ||
+			sc->get_scan_cmd_id || sc->resync_cmd_id)
+		return;
+
+	/*
+	 * Whether an external scan is still running can't be queried without
+	 * aborting it.  Assume it is done, if not our trigger gets an EBUSY
+	 * and we're back to waiting for it.
+	 */
+	if (!sc->triggered) {
+		sc->state = SCAN_STATE_NOT_RUNNING;
+
+		if (sc->work_started && sr)
+			start_next_scan_request(&sr->work);
+
+		return;
+	}
+
+	if (!sr->running_cmd)
+		return;
+
+	/*
+	 * Our own scan may have finished with the event lost.  Abort it to
+	 * find out and scan the segment again, the same as when preempted
+	 * but keeping the radio work.
+	 */
+	msg = l_genl_msg_new_sized(NL80211_CMD_ABORT_SCAN, 16);
+	l_genl_msg_append_attr(msg, NL80211_ATTR_WDEV, 8, &sc->wdev_id);
+
+	sc->resync_cmd_id = l_genl_family_send(nl80211, msg, scan_resync_cb,
+						sc, NULL);
+	if (!sc->resync_cmd_id) {
+		l_genl_msg_unref(msg);
+		return;
+	}
+
+	l_debug("Resyncing scan request %u", sr->work.id);
+
+	l_queue_push_head(sr->cmds, sr->running_cmd);
+	sr->running_cmd = NULL;
+
+	/* Makes the SCAN_ABORTED event look like that of an external scan */
+	sc->triggered = false;
+}
+
+static void scan_overrun(void *user_data)
+{
+	l_queue_foreach(scan_contexts, scan_context_resync, NULL);
 }
 
 bool scan_wdev_add(uint64_t wdev_id)
@@ -2254,6 +3886,10 @@ bool scan_wdev_add(uint64_t wdev_id)
 
 	nl80211 = l_genl_family_new(iwd_get_genl(), NL80211_GENL_NAME);
 	l_genl_family_register(nl80211, "scan", scan_notify, NULL, NULL);
+	l_genl_family_register(nl80211, "mlme", scan_mlme_notify, NULL, NULL);
+	overrun_watch_id = l_genl_add_overrun_watch(iwd_get_genl(),
+							scan_overrun,
+							NULL, NULL);
 
 done:
 	return true;
@@ -2272,6 +3908,8 @@ bool scan_wdev_remove(uint64_t wdev_id)
 	scan_context_free(sc);
 
 	if (l_queue_isempty(scan_contexts)) {
+		l_genl_remove_overrun_watch(iwd_get_genl(), overrun_watch_id);
+		overrun_watch_id = 0;
 		l_genl_family_free(nl80211);
 		nl80211 = NULL;
 	}
@@ -2282,6 +3920,7 @@ bool scan_wdev_remove(uint64_t wdev_id)
 static int scan_init(void)
 {
 	const struct l_settings *config = iwd_get_config();
+	const char *model;
 
 	scan_contexts = l_queue_new();
 
@@ -2289,6 +3928,12 @@ static int scan_init(void)
 					&RANK_5G_FACTOR))
 		RANK_5G_FACTOR = 1.0;
 
+	model = l_settings_get_value(config, "Rank", "Model");
+	if (model && !strcmp(model, "throughput"))
+		RANK_THROUGHPUT = true;
+	else if (model && strcmp(model, "signal"))
+		l_warn("Unknown [Rank].Model value: %s, using signal", model);
+
 	if (!l_settings_get_uint(config, "Scan", "InitialPeriodicScanInterval",
 					&SCAN_INIT_INTERVAL))
 		SCAN_INIT_INTERVAL = 10;
@@ -2303,6 +3948,18 @@ static int scan_init(void)
 	if (SCAN_MAX_INTERVAL > UINT16_MAX)
 		SCAN_MAX_INTERVAL = UINT16_MAX;
 
+	if (!l_settings_get_uint(config, "Scan", "FullPeriodicScanInterval",
+					&SCAN_FULL_SWEEP_INTERVAL))
+		SCAN_FULL_SWEEP_INTERVAL = 1;
+
+	if (!l_settings_get_uint(config, "Scan", "SlicedScanChannels",
+					&SCAN_SLICE_CHANNELS))
+		SCAN_SLICE_CHANNELS = 0;
+
+	if (!l_settings_get_uint(config, "Scan", "SlicedScanGap",
+					&SCAN_SLICE_GAP))
+		SCAN_SLICE_GAP = 50;
+
 	return 0;
 }
 
@@ -2311,6 +3968,12 @@ static void scan_exit()
 	l_queue_destroy(scan_contexts,
 				(l_queue_destroy_func_t) scan_context_free);
 	scan_contexts = NULL;
+
+	if (overrun_watch_id) {
+		l_genl_remove_overrun_watch(iwd_get_genl(), overrun_watch_id);
+		overrun_watch_id = 0;
+	}
+
 	l_genl_family_free(nl80211);
 	nl80211 = NULL;
 }
@@ -20,17 +20,30 @@
  *
  */
 
-struct scan_freq_set;
 struct ie_rsn_info;
 struct p2p_probe_resp;
 struct p2p_probe_req;
 struct p2p_beacon;
 struct mmpdu_header;
 struct wiphy;
+struct scan_arena_chunk;
 
 enum scan_band {
 	SCAN_BAND_2_4_GHZ =	0x1,
 	SCAN_BAND_5_GHZ =	0x2,
+	SCAN_BAND_6_GHZ =	0x4,
+};
+
+/*
+ * Fixed-size bitmaps indexed by channel number so that sets can live on the
+ * stack or be embedded and be merged or intersected a word at a time.
+ * 802.11-2012, 8.4.2.10 hints that 200 is the largest 5GHz channel number
+ * and 6GHz channel numbers go up to 233.
+ */
+struct scan_freq_set {
+	uint16_t channels_2ghz;
+	uint64_t channels_5ghz[4];
+	uint64_t channels_6ghz[4];
 };
 
 enum scan_state {
@@ -45,47 +58,70 @@ enum scan_bss_frame_type {
 	SCAN_BSS_BEACON,
 };
 
+/*
+ * The fields used when ranking, sorting and matching BSSes come first and
+ * are kept within a cache line, see the assertion in scan.c.  The rest is
+ * only looked at once a BSS has been picked.
+ */
 struct scan_bss {
-	uint8_t addr[6];
+	uint64_t time_stamp;
 	uint32_t frequency;
 	int32_t signal_strength;
+	uint8_t addr[6];
+	uint16_t rank;
 	uint16_t capability;
+	uint16_t sta_count;	/* From the BSS Load IE, 0 if not present */
+	uint8_t utilization;
+	uint8_t ssid_len;
+	bool mde_present : 1;
+	bool cc_present : 1;
+	bool cap_rm_neighbor_report : 1;
+	bool ht_capable : 1;
+	bool vht_capable : 1;
+	bool he_capable : 1;
+	bool anqp_capable : 1;
+	bool hs20_capable : 1;
+	uint8_t ssid[32];
+	/*
+	 * Copy of NL80211_BSS_INFORMATION_ELEMENTS or of the frame body
+	 * that the IE pointers below point into
+	 */
+	uint8_t *ies;
+	size_t ies_len;
 	uint8_t *rsne;
+	uint8_t *rsnxe;
 	uint8_t *wpa;
 	uint8_t *osen;
 	uint8_t *wsc;		/* Concatenated WSC IEs */
 	ssize_t wsc_size;	/* Size of Concatenated WSC IEs */
-	enum scan_bss_frame_type source_frame;
 	union {
 		struct p2p_probe_resp *p2p_probe_resp_info;
 		struct p2p_probe_req *p2p_probe_req_info;
 		struct p2p_beacon *p2p_beacon_info;
 	};
-	uint8_t mde[3];
-	uint8_t ssid[32];
-	uint8_t ssid_len;
-	uint8_t supp_rates_ie[10];
+	const uint8_t *supp_rates_ie;
 	uint8_t *ext_supp_rates_ie;
-	uint8_t utilization;
-	uint8_t cc[3];
-	uint16_t rank;
-	uint8_t ht_ie[28];
-	uint8_t vht_ie[14];
-	uint64_t time_stamp;
-	uint8_t hessid[6];
+	const uint8_t *ht_ie;
+	const uint8_t *vht_ie;
+	const uint8_t *he_ie;
+	const uint8_t *rnr;	/* Reduced Neighbor Report IE */
 	uint8_t *rc_ie;		/* Roaming consortium IE */
-	uint8_t hs20_version;
-	uint64_t parent_tsf;
 	uint8_t *wfd;		/* Concatenated WFD IEs */
 	ssize_t wfd_size;	/* Size of Concatenated WFD IEs */
-	bool mde_present : 1;
-	bool cc_present : 1;
-	bool cap_rm_neighbor_report : 1;
-	bool has_sup_rates : 1;
-	bool ht_capable : 1;
-	bool vht_capable : 1;
-	bool anqp_capable : 1;
-	bool hs20_capable : 1;
+	uint64_t parent_tsf;
+	struct scan_arena_chunk *chunk;	/* NULL if individually allocated */
+	enum scan_bss_frame_type source_frame;
+	unsigned int refcount;
+	uint8_t mde[3];
+	uint8_t cc[3];
+	uint8_t hessid[6];
+	uint8_t hs20_version;
+	bool ssid_utf8;		/* Checked once when parsing the SSID IE */
+	/* wiphy_can_connect() verdicts, cached by network_bss_select() */
+	bool connect_checked : 1;
+	bool can_connect : 1;
+	bool can_connect_fils : 1;
+	bool temp_blacklisted : 1;	/* See network_blacklist_add() */
 };
 
 struct scan_parameters {
@@ -97,6 +133,26 @@ struct scan_parameters {
 	bool randomize_mac_addr_hint : 1;
 	bool no_cck_rates : 1;
 	bool duration_mandatory : 1;
+	/*
+	 * Hints mapping to NL80211_SCAN_FLAG_LOW_POWER, LOW_SPAN and
+	 * HIGH_ACCURACY, ignored if the driver doesn't support them.  These
+	 * are mutually exclusive, if more than one is set the first one
+	 * listed here takes precedence.
+	 */
+	bool high_accuracy : 1;
+	bool low_span : 1;
+	bool low_power : 1;
+	/*
+	 * Scan a few channels at a time, per [Scan].SlicedScanChannels, to
+	 * avoid long absences from the operating channel while connected
+	 */
+	bool sliced : 1;
+	/*
+	 * Only report the BSSes of the network probed for with ssid, the
+	 * others are dropped while the results are fetched, before their
+	 * IEs are parsed
+	 */
+	bool ssid_only : 1;
 	const char *ssid;	/* Used for direct probe request */
 	const uint8_t *source_mac;
 };
@@ -108,6 +164,9 @@ typedef bool (*scan_notify_func_t)(int err, struct l_queue *bss_list,
 					void *userdata);
 typedef void (*scan_destroy_func_t)(void *userdata);
 typedef void (*scan_freq_set_func_t)(uint32_t freq, void *userdata);
+typedef void (*scan_net_detect_func_t)(const char *ssid,
+					const struct scan_freq_set *freqs,
+					void *userdata);
 
 static inline int scan_bss_addr_cmp(const struct scan_bss *a1,
 					const struct scan_bss *a2)
@@ -149,13 +208,24 @@ void scan_periodic_start(uint64_t wdev_id, scan_trigger_func_t trigger,
 				scan_notify_func_t func, void *userdata);
 bool scan_periodic_stop(uint64_t wdev_id);
 
+bool scan_sched_start(uint64_t wdev_id, scan_trigger_func_t trigger,
+				scan_notify_func_t func, void *userdata);
+bool scan_sched_stop(uint64_t wdev_id);
+
+bool scan_net_detect_start(uint64_t wdev_id, scan_net_detect_func_t func,
+				void *userdata);
+bool scan_net_detect_stop(uint64_t wdev_id);
+
 uint64_t scan_get_triggered_time(uint64_t wdev_id, uint32_t id);
 
 bool scan_get_firmware_scan(uint64_t wdev_id, scan_notify_func_t notify,
 				void *userdata, scan_destroy_func_t destroy);
 
+struct scan_bss *scan_bss_ref(struct scan_bss *bss);
 void scan_bss_free(struct scan_bss *bss);
+size_t scan_bss_get_mem_size(const struct scan_bss *bss);
 int scan_bss_rank_compare(const void *a, const void *b, void *user);
+bool scan_bss_insert_ranked(struct l_queue *bss_list, struct scan_bss *bss);
 
 int scan_bss_get_rsn_info(const struct scan_bss *bss, struct ie_rsn_info *info);
 
@@ -163,6 +233,8 @@ struct scan_bss *scan_bss_new_from_probe_req(const struct mmpdu_header *mpdu,
 						const uint8_t *body,
 						size_t body_len,
 						uint32_t frequency, int rssi);
+struct scan_bss *scan_bss_new_from_genl(struct l_genl_msg *msg,
+						uint64_t *out_wdev);
 
 uint8_t scan_freq_to_channel(uint32_t freq, enum scan_band *out_band);
 uint32_t scan_channel_to_freq(uint8_t channel, enum scan_band band);
@@ -66,6 +66,12 @@ typedef void (*sim_auth_check_milenage_cb_t)(const uint8_t *res,
 typedef void (*sim_auth_run_gsm_cb_t)(const uint8_t *sres,
 		const uint8_t *kc, void *user_data);
 
+/*
+ * Drivers may accept several requests at a time, running them in order.
+ * check_milenage and run_gsm return an ID > 0 identifying the request for
+ * cancel_request.  Outstanding requests are dropped on remove without
+ * calling back.
+ */
 struct iwd_sim_auth_driver {
 	const char *name;
 	int (*check_milenage)(struct iwd_sim_auth *auth, const uint8_t *rand,
@@ -459,6 +459,582 @@ bool eap_sim_verify_mac(struct eap_state *eap, enum eap_type type,
 	return true;
 }
 
+bool eap_sim_derive_reauth_keys(const char *identity, uint16_t counter,
+		const uint8_t *nonce_s, const uint8_t *mk, uint8_t *msk,
+		uint8_t *emsk)
+{
+	struct l_checksum *checksum;
+	struct iovec iov[4];
+	uint8_t counter_be[2];
+	uint8_t xkey[EAP_SIM_MK_LEN];
+	/* PRF output comes in 40 byte blocks, 128 bytes are used */
+	uint8_t prng_buf[160];
+	int ret;
+
+	checksum = l_checksum_new(L_CHECKSUM_SHA1);
+	if (!checksum)
+		return false;
+
+	l_put_be16(counter, counter_be);
+
+	iov[0].iov_base = (void *) identity;
+	iov[0].iov_len = strlen(identity);
+	iov[1].iov_base = counter_be;
+	iov[1].iov_len = 2;
+	iov[2].iov_base = (void *) nonce_s;
+	iov[2].iov_len = EAP_SIM_NONCE_S_LEN;
+	iov[3].iov_base = (void *) mk;
+	iov[3].iov_len = EAP_SIM_MK_LEN;
+
+	l_checksum_updatev(checksum, iov, 4);
+	ret = l_checksum_get_digest(checksum, xkey, sizeof(xkey));
+	l_checksum_free(checksum);
+
+	if (ret != sizeof(xkey))
+		return false;
+
+	eap_sim_fips_prf(xkey, sizeof(xkey), prng_buf, sizeof(prng_buf));
+	explicit_bzero(xkey, sizeof(xkey));
+
+	memcpy(msk, prng_buf, EAP_SIM_MSK_LEN);
+	memcpy(emsk, prng_buf + EAP_SIM_MSK_LEN, EAP_SIM_EMSK_LEN);
+	explicit_bzero(prng_buf, sizeof(prng_buf));
+
+	return true;
+}
+
+bool eap_aka_prf_prime_reauth(const uint8_t *k_re, const char *identity,
+		uint16_t counter, const uint8_t *nonce_s, uint8_t *msk,
+		uint8_t *emsk)
+{
+	static const char *label = "EAP-AKA' re-auth";
+	struct l_checksum *hmac;
+	struct iovec iov[6];
+	uint8_t counter_be[2];
+	uint8_t digest[32];
+	uint8_t i = 0x01;
+	/* 4 iterations give the 128 bytes needed for MSK and EMSK */
+	uint8_t out[128];
+	uint8_t *pos = out;
+
+	hmac = l_checksum_new_hmac(L_CHECKSUM_SHA256, k_re, EAP_AKA_K_RE_LEN);
+	if (!hmac)
+		return false;
+
+	l_put_be16(counter, counter_be);
+
+	iov[0].iov_base = digest;
+	/* initial iteration digest is not used */
+	iov[0].iov_len = 0;
+	iov[1].iov_base = (void *) label;
+	iov[1].iov_len = strlen(label);
+	iov[2].iov_base = (void *) identity;
+	iov[2].iov_len = strlen(identity);
+	iov[3].iov_base = counter_be;
+	iov[3].iov_len = 2;
+	iov[4].iov_base = (void *) nonce_s;
+	iov[4].iov_len = EAP_SIM_NONCE_S_LEN;
+	iov[5].iov_base = &i;
+	iov[5].iov_len = 1;
+
+	while (pos < out + sizeof(out)) {
+		l_checksum_reset(hmac);
+		l_checksum_updatev(hmac, iov, 6);
+		l_checksum_get_digest(hmac, digest, 32);
+		memcpy(pos, digest, 32);
+		pos += 32;
+		i++;
+		/* set the digest length so it can be prepended as Tn */
+		iov[0].iov_len = 32;
+	}
+
+	explicit_bzero(digest, sizeof(digest));
+	l_checksum_free(hmac);
+
+	memcpy(msk, out, EAP_SIM_MSK_LEN);
+	memcpy(emsk, out + EAP_SIM_MSK_LEN, EAP_SIM_EMSK_LEN);
+	explicit_bzero(out, sizeof(out));
+
+	return true;
+}
+
+int eap_sim_decrypt_encr_data(const uint8_t *k_encr, const uint8_t *iv,
+		const uint8_t *encr, uint16_t len, uint8_t *out)
+{
+	struct l_cipher *cipher;
+	bool r;
+
+	/* Skip the reserved bytes, the rest must be whole AES blocks */
+	if (len < 2 + 16 || (len - 2) % 16 || len - 2 > EAP_SIM_ENCR_MAX_LEN)
+		return -1;
+
+	cipher = l_cipher_new(L_CIPHER_AES_CBC, k_encr, EAP_SIM_K_ENCR_LEN);
+	if (!cipher)
+		return -1;
+
+	r = l_cipher_set_iv(cipher, iv + 2, EAP_SIM_IV_LEN) &&
+		l_cipher_decrypt(cipher, encr + 2, out, len - 2);
+	l_cipher_free(cipher);
+
+	return r ? len - 2 : -1;
+}
+
+size_t eap_sim_add_encr_data(uint8_t *buf, const uint8_t *k_encr,
+		const uint8_t *attrs, size_t attrs_len)
+{
+	uint8_t plain[EAP_SIM_ENCR_MAX_LEN];
+	uint8_t iv[EAP_SIM_IV_LEN];
+	struct l_cipher *cipher;
+	size_t plain_len = attrs_len;
+	uint8_t *pos = buf;
+	bool r;
+
+	if (attrs_len % 4 || attrs_len > sizeof(plain) - 4)
+		return 0;
+
+	memcpy(plain, attrs, attrs_len);
+
+	/* AT_PADDING is 4, 8 or 12 bytes long, including its header */
+	if (plain_len % 16)
+		plain_len += eap_sim_add_attribute(plain + plain_len,
+					EAP_SIM_AT_PADDING, EAP_SIM_PAD_NONE,
+					NULL, 16 - (plain_len % 16) - 2);
+
+	if (!l_getrandom(iv, sizeof(iv)))
+		return 0;
+
+	cipher = l_cipher_new(L_CIPHER_AES_CBC, k_encr, EAP_SIM_K_ENCR_LEN);
+	if (!cipher)
+		return 0;
+
+	pos += eap_sim_add_attribute(pos, EAP_SIM_AT_IV, EAP_SIM_PAD_ZERO,
+					iv, sizeof(iv));
+
+	r = l_cipher_set_iv(cipher, iv, sizeof(iv)) &&
+		l_cipher_encrypt(cipher, plain, plain, plain_len);
+	l_cipher_free(cipher);
+
+	if (r)
+		pos += eap_sim_add_attribute(pos, EAP_SIM_AT_ENCR_DATA,
+					EAP_SIM_PAD_ZERO, plain, plain_len);
+
+	explicit_bzero(plain, sizeof(plain));
+
+	return r ? (size_t) (pos - buf) : 0;
+}
+
+bool eap_sim_parse_encr_attrs(const uint8_t *data, size_t len,
+				struct eap_sim_encr_attrs *attrs)
+{
+	struct eap_sim_tlv_iter iter;
+
+	memset(attrs, 0, sizeof(*attrs));
+	attrs->counter = -1;
+
+	eap_sim_tlv_iter_init(&iter, data, len);
+
+	while (eap_sim_tlv_iter_next(&iter)) {
+		const uint8_t *contents = eap_sim_tlv_iter_get_data(&iter);
+		uint16_t length = eap_sim_tlv_iter_get_length(&iter);
+		uint8_t type = eap_sim_tlv_iter_get_type(&iter);
+		uint16_t id_len;
+
+		switch (type) {
+		case EAP_SIM_AT_NEXT_PSEUDONYM:
+		case EAP_SIM_AT_NEXT_REAUTH_ID:
+			if (length < 2)
+				return false;
+
+			id_len = l_get_be16(contents);
+			if (!id_len || id_len > length - 2)
+				return false;
+
+			if (type == EAP_SIM_AT_NEXT_PSEUDONYM) {
+				attrs->pseudonym = (const char *) contents + 2;
+				attrs->pseudonym_len = id_len;
+			} else {
+				attrs->reauth_id = (const char *) contents + 2;
+				attrs->reauth_id_len = id_len;
+			}
+
+			break;
+
+		case EAP_SIM_AT_COUNTER:
+			if (length < 2)
+				return false;
+
+			attrs->counter = l_get_be16(contents);
+			break;
+
+		case EAP_SIM_AT_NONCE_S:
+			if (length < 2 + EAP_SIM_NONCE_S_LEN)
+				return false;
+
+			attrs->nonce_s = contents + 2;
+			break;
+
+		case EAP_SIM_AT_PADDING:
+			break;
+
+		default:
+			/* RFC 4186 Section 8.1 - non-skippable attributes */
+			if (type < 128) {
+				l_error("attribute %u not allowed in "
+					"AT_ENCR_DATA", type);
+				return false;
+			}
+
+			break;
+		}
+	}
+
+	return true;
+}
+
+static struct l_queue *identity_cache;
+
+static void cache_entry_free(void *data)
+{
+	struct eap_sim_cache_entry *entry = data;
+
+	l_free(entry->permanent_id);
+	l_free(entry->pseudonym);
+	l_free(entry->reauth_id);
+	explicit_bzero(entry, sizeof(*entry));
+	l_free(entry);
+}
+
+static bool cache_entry_match(const void *a, const void *b)
+{
+	const struct eap_sim_cache_entry *entry = a;
+
+	return !strcmp(entry->permanent_id, b);
+}
+
+struct eap_sim_cache_entry *eap_sim_cache_lookup(const char *permanent_id)
+{
+	return l_queue_find(identity_cache, cache_entry_match, permanent_id);
+}
+
+struct eap_sim_cache_entry *eap_sim_cache_get(const char *permanent_id)
+{
+	struct eap_sim_cache_entry *entry = eap_sim_cache_lookup(permanent_id);
+
+	if (entry)
+		return entry;
+
+	if (!identity_cache)
+		identity_cache = l_queue_new();
+
+	entry = l_new(struct eap_sim_cache_entry, 1);
+	entry->permanent_id = l_strdup(permanent_id);
+	l_queue_push_tail(identity_cache, entry);
+
+	return entry;
+}
+
+void eap_sim_cache_set_pseudonym(struct eap_sim_cache_entry *entry,
+					const char *pseudonym, size_t len)
+{
+	l_free(entry->pseudonym);
+	entry->pseudonym = pseudonym ? l_strndup(pseudonym, len) : NULL;
+}
+
+void eap_sim_cache_set_reauth(struct eap_sim_cache_entry *entry,
+					const char *reauth_id, size_t len)
+{
+	l_free(entry->reauth_id);
+	entry->reauth_id = reauth_id ? l_strndup(reauth_id, len) : NULL;
+}
+
+void eap_sim_cache_forget_reauth(struct eap_sim_cache_entry *entry)
+{
+	l_free(entry->reauth_id);
+	entry->reauth_id = NULL;
+	entry->counter = 0;
+
+	explicit_bzero(entry->mk, sizeof(entry->mk));
+	explicit_bzero(entry->k_encr, sizeof(entry->k_encr));
+	explicit_bzero(entry->k_aut, sizeof(entry->k_aut));
+	explicit_bzero(entry->k_re, sizeof(entry->k_re));
+}
+
+void eap_sim_cache_remove(const char *permanent_id)
+{
+	struct eap_sim_cache_entry *entry;
+
+	entry = l_queue_remove_if(identity_cache, cache_entry_match,
+					permanent_id);
+	if (entry)
+		cache_entry_free(entry);
+}
+
+void eap_sim_cache_flush(void)
+{
+	l_queue_destroy(identity_cache, cache_entry_free);
+	identity_cache = NULL;
+}
+
+char *eap_sim_select_identity(const char *permanent_id, bool allow_reauth,
+				bool allow_pseudonym)
+{
+	struct eap_sim_cache_entry *entry = eap_sim_cache_lookup(permanent_id);
+	const char *realm;
+
+	if (!entry)
+		return l_strdup(permanent_id);
+
+	if (allow_reauth && entry->reauth_id)
+		return l_strdup(entry->reauth_id);
+
+	if (!allow_pseudonym || !entry->pseudonym)
+		return l_strdup(permanent_id);
+
+	/* The pseudonym is a username, it uses the permanent NAI realm */
+	realm = strchr(permanent_id, '@');
+	if (!realm || strchr(entry->pseudonym, '@'))
+		return l_strdup(entry->pseudonym);
+
+	return l_strdup_printf("%s%s", entry->pseudonym, realm);
+}
+
+bool eap_sim_process_next_ids(struct eap_sim_cache_entry *entry,
+				const uint8_t *pkt, size_t len)
+{
+	struct eap_sim_tlv_iter iter;
+	struct eap_sim_encr_attrs attrs;
+	const uint8_t *iv = NULL;
+	const uint8_t *encr = NULL;
+	uint16_t encr_len = 0;
+	uint8_t plain[EAP_SIM_ENCR_MAX_LEN];
+	int plain_len;
+	bool r;
+
+	if (len < 3)
+		return false;
+
+	eap_sim_tlv_iter_init(&iter, pkt + 3, len - 3);
+
+	while (eap_sim_tlv_iter_next(&iter)) {
+		switch (eap_sim_tlv_iter_get_type(&iter)) {
+		case EAP_SIM_AT_IV:
+			if (eap_sim_tlv_iter_get_length(&iter) <
+					2 + EAP_SIM_IV_LEN)
+				return false;
+
+			iv = eap_sim_tlv_iter_get_data(&iter);
+			break;
+		case EAP_SIM_AT_ENCR_DATA:
+			encr = eap_sim_tlv_iter_get_data(&iter);
+			encr_len = eap_sim_tlv_iter_get_length(&iter);
+			break;
+		}
+	}
+
+	if (!encr)
+		return true;
+
+	if (!iv)
+		return false;
+
+	plain_len = eap_sim_decrypt_encr_data(entry->k_encr, iv, encr,
+						encr_len, plain);
+	if (plain_len < 0)
+		return false;
+
+	r = eap_sim_parse_encr_attrs(plain, plain_len, &attrs);
+	if (r) {
+		if (attrs.pseudonym)
+			eap_sim_cache_set_pseudonym(entry, attrs.pseudonym,
+							attrs.pseudonym_len);
+
+		if (attrs.reauth_id)
+			eap_sim_cache_set_reauth(entry, attrs.reauth_id,
+							attrs.reauth_id_len);
+	}
+
+	explicit_bzero(plain, sizeof(plain));
+
+	return r;
+}
+
+int eap_sim_handle_reauthentication(struct eap_state *eap,
+				enum eap_type type,
+				struct eap_sim_cache_entry *entry,
+				const char *identity,
+				const uint8_t *pkt, size_t len,
+				uint8_t *msk, uint8_t *emsk,
+				uint8_t *session_id)
+{
+	struct eap_sim_tlv_iter iter;
+	struct eap_sim_encr_attrs attrs;
+	const uint8_t *iv = NULL;
+	const uint8_t *encr = NULL;
+	const uint8_t *mac = NULL;
+	uint16_t encr_len = 0;
+	uint8_t plain[EAP_SIM_ENCR_MAX_LEN];
+	uint8_t inner[8];
+	size_t inner_len = 0;
+	/* header + AT_IV + AT_ENCR_DATA + AT_MAC, NONCE_S appended for MAC */
+	uint8_t response[8 + 20 + 20 + 20 + EAP_SIM_NONCE_S_LEN];
+	uint8_t *pos = response;
+	uint8_t *mac_pos;
+	size_t resp_len;
+	size_t n;
+	int plain_len;
+	bool stale;
+	int ret = -EBADMSG;
+
+	if (len < 3)
+		return -EBADMSG;
+
+	eap_sim_tlv_iter_init(&iter, pkt + 3, len - 3);
+
+	while (eap_sim_tlv_iter_next(&iter)) {
+		const uint8_t *contents = eap_sim_tlv_iter_get_data(&iter);
+		uint16_t length = eap_sim_tlv_iter_get_length(&iter);
+
+		switch (eap_sim_tlv_iter_get_type(&iter)) {
+		case EAP_SIM_AT_IV:
+			if (length < 2 + EAP_SIM_IV_LEN)
+				return -EBADMSG;
+
+			iv = contents;
+			break;
+
+		case EAP_SIM_AT_ENCR_DATA:
+			encr = contents;
+			encr_len = length;
+			break;
+
+		case EAP_SIM_AT_MAC:
+			if (length < 2 + EAP_SIM_MAC_LEN)
+				return -EBADMSG;
+
+			mac = contents + 2;
+			break;
+
+		case EAP_SIM_AT_RESULT_IND:
+		case EAP_SIM_AT_CHECKCODE:
+		case EAP_SIM_AT_PADDING:
+			/*
+			 * Protected result indications are not requested in
+			 * the response, success comes with EAP-Success.
+			 */
+			break;
+
+		default:
+			l_error("attribute %u was found in Re-authentication",
+					eap_sim_tlv_iter_get_type(&iter));
+			return -EBADMSG;
+		}
+	}
+
+	if (!iv || !encr || !mac) {
+		l_error("AT_IV, AT_ENCR_DATA or AT_MAC were not found");
+		return -EBADMSG;
+	}
+
+	if (!eap_sim_verify_mac(eap, type, pkt, len, entry->k_aut, NULL, 0))
+		return -EBADMSG;
+
+	plain_len = eap_sim_decrypt_encr_data(entry->k_encr, iv, encr,
+						encr_len, plain);
+	if (plain_len < 0) {
+		l_error("could not decrypt AT_ENCR_DATA");
+		return -EBADMSG;
+	}
+
+	if (!eap_sim_parse_encr_attrs(plain, plain_len, &attrs) ||
+			attrs.counter < 0 || !attrs.nonce_s) {
+		l_error("AT_COUNTER or AT_NONCE_S were not found");
+		goto done;
+	}
+
+	/*
+	 * RFC 4186 Section 5.6: a counter that isn't fresh is echoed back
+	 * with AT_COUNTER_TOO_SMALL, the server then runs a full
+	 * authentication.
+	 */
+	stale = attrs.counter <= entry->counter;
+
+	inner[0] = EAP_SIM_AT_COUNTER;
+	inner[1] = 1;
+	l_put_be16(attrs.counter, inner + 2);
+	inner_len = 4;
+
+	if (stale) {
+		inner_len += eap_sim_add_attribute(inner + inner_len,
+					EAP_SIM_AT_COUNTER_TOO_SMALL,
+					EAP_SIM_PAD_NONE, NULL, 2);
+	} else {
+		bool r;
+
+		if (type == EAP_TYPE_AKA_PRIME)
+			r = eap_aka_prf_prime_reauth(entry->k_re, identity,
+						attrs.counter, attrs.nonce_s,
+						msk, emsk);
+		else
+			r = eap_sim_derive_reauth_keys(identity, attrs.counter,
+						attrs.nonce_s, entry->mk,
+						msk, emsk);
+
+		if (!r) {
+			l_error("could not derive re-authentication keys");
+			goto done;
+		}
+	}
+
+	pos += eap_sim_build_header(eap, type, EAP_SIM_ST_REAUTHENTICATION,
+					pos, 0);
+
+	n = eap_sim_add_encr_data(pos, entry->k_encr, inner, inner_len);
+	if (!n) {
+		l_error("could not encrypt AT_ENCR_DATA");
+		goto done;
+	}
+
+	pos += n;
+	mac_pos = pos;
+	pos += eap_sim_add_attribute(pos, EAP_SIM_AT_MAC, EAP_SIM_PAD_ZERO,
+					NULL, EAP_SIM_MAC_LEN);
+	resp_len = pos - response;
+	l_put_be16(resp_len, response + 2);
+
+	/* The response MAC also covers NONCE_S */
+	memcpy(pos, attrs.nonce_s, EAP_SIM_NONCE_S_LEN);
+
+	if (!eap_sim_derive_mac(type, response,
+				resp_len + EAP_SIM_NONCE_S_LEN, entry->k_aut,
+				mac_pos + 4)) {
+		l_error("could not derive MAC");
+		goto done;
+	}
+
+	eap_method_respond(eap, response, resp_len);
+
+	if (stale) {
+		eap_sim_cache_forget_reauth(entry);
+		ret = -EAGAIN;
+		goto done;
+	}
+
+	/* RFC 5448 Section 3.3 style Session-Id: Type | NONCE_S | MAC */
+	session_id[0] = type;
+	memcpy(session_id + 1, attrs.nonce_s, EAP_SIM_NONCE_S_LEN);
+	memcpy(session_id + 1 + EAP_SIM_NONCE_S_LEN, mac, EAP_SIM_MAC_LEN);
+
+	/* Fast re-authentication identities are only used once */
+	entry->counter = attrs.counter;
+	eap_sim_cache_set_reauth(entry, attrs.reauth_id, attrs.reauth_id_len);
+
+	ret = 0;
+
+done:
+	explicit_bzero(plain, sizeof(plain));
+	return ret;
+}
+
 bool eap_sim_tlv_iter_init(struct eap_sim_tlv_iter *iter, const uint8_t *data,
 		uint32_t len)
 {
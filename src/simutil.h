@@ -35,6 +35,11 @@
 #define EAP_AKA_K_RE_LEN	32
 #define EAP_AKA_IK_LEN		16
 #define EAP_AKA_CK_LEN		16
+#define EAP_SIM_NONCE_S_LEN	16
+#define EAP_SIM_ENCR_MAX_LEN	256
+
+/* RFC 4187, Section 11 - subtype shared by EAP-SIM and EAP-AKA */
+#define EAP_SIM_ST_REAUTHENTICATION	0x0d
 
 /*
  * Possible pad types for EAP-SIM/EAP-AKA attributes
@@ -81,6 +86,7 @@ enum eap_sim_at {
 	EAP_SIM_AT_SELECTED_VERSION	= 0x10,
 	EAP_SIM_AT_FULLAUTH_ID_REQ	= 0x11,
 	EAP_SIM_AT_COUNTER		= 0x13,
+	EAP_SIM_AT_COUNTER_TOO_SMALL	= 0x14,
 	EAP_SIM_AT_NONCE_S		= 0x15,
 	EAP_SIM_AT_CLIENT_ERROR_CODE	= 0x16,
 	EAP_SIM_AT_KDF_INPUT		= 0x17,
@@ -269,6 +275,138 @@ bool eap_sim_verify_mac(struct eap_state *eap, enum eap_type type,
 		const uint8_t *buf, uint16_t len, uint8_t *k_aut,
 		uint8_t *extra, size_t elen);
 
+/*
+ * RFC 4186 Section 7 / RFC 4187 Section 7
+ * Key derivation for fast re-authentication
+ *
+ * XKEY' = SHA1(Identity | counter | NONCE_S | MK)
+ * MSK | EMSK = PRF(XKEY')
+ */
+bool eap_sim_derive_reauth_keys(const char *identity, uint16_t counter,
+		const uint8_t *nonce_s, const uint8_t *mk, uint8_t *msk,
+		uint8_t *emsk);
+
+/*
+ * RFC 5448, Section 3.3
+ *
+ * MK = PRF'(K_re,"EAP-AKA' re-auth"|Identity|counter|NONCE_S)
+ *      MSK  = MK[0..511]
+ *      EMSK = MK[512..1023]
+ */
+bool eap_aka_prf_prime_reauth(const uint8_t *k_re, const char *identity,
+		uint16_t counter, const uint8_t *nonce_s, uint8_t *msk,
+		uint8_t *emsk);
+
+/*
+ * Decrypt the contents of an AT_ENCR_DATA attribute with K_encr and the IV
+ * from AT_IV (AES-128 in CBC mode).
+ *
+ * iv - pointer to the AT_IV data, including the 2 reserved bytes
+ * encr - pointer to the AT_ENCR_DATA data, including the 2 reserved bytes
+ * len - length of the AT_ENCR_DATA data
+ * out - buffer for the plaintext attributes, at least len - 2 bytes
+ *
+ * Returns the length of the plaintext or -1 on error.
+ */
+int eap_sim_decrypt_encr_data(const uint8_t *k_encr, const uint8_t *iv,
+		const uint8_t *encr, uint16_t len, uint8_t *out);
+
+/*
+ * Add AT_IV and AT_ENCR_DATA attributes protecting the plaintext attributes
+ * in attrs, padding them with AT_PADDING as needed.  A random IV is used.
+ *
+ * Returns the number of bytes written to buf or 0 on error.
+ */
+size_t eap_sim_add_encr_data(uint8_t *buf, const uint8_t *k_encr,
+		const uint8_t *attrs, size_t attrs_len);
+
+#define EAP_SIM_REAUTH_SESSION_ID_LEN \
+			(1 + EAP_SIM_NONCE_S_LEN + EAP_SIM_MAC_LEN)
+
+/*
+ * Identities and keys given out by the server for later authentications.
+ * Entries are kept in memory, keyed by the permanent identity, which also
+ * encodes the method through the identity prefix.
+ *
+ * pseudonym - last AT_NEXT_PSEUDONYM, without the realm
+ * reauth_id - last AT_NEXT_REAUTH_ID, a full NAI
+ * counter - last AT_COUNTER value accepted for re-authentication
+ * mk, k_encr, k_aut, k_re - keys from the last full authentication
+ */
+struct eap_sim_cache_entry {
+	char *permanent_id;
+	char *pseudonym;
+	char *reauth_id;
+	uint16_t counter;
+	uint8_t mk[EAP_SIM_MK_LEN];
+	uint8_t k_encr[EAP_SIM_K_ENCR_LEN];
+	uint8_t k_aut[EAP_AKA_PRIME_K_AUT_LEN];
+	uint8_t k_re[EAP_AKA_K_RE_LEN];
+};
+
+struct eap_sim_cache_entry *eap_sim_cache_lookup(const char *permanent_id);
+struct eap_sim_cache_entry *eap_sim_cache_get(const char *permanent_id);
+void eap_sim_cache_set_pseudonym(struct eap_sim_cache_entry *entry,
+					const char *pseudonym, size_t len);
+void eap_sim_cache_set_reauth(struct eap_sim_cache_entry *entry,
+					const char *reauth_id, size_t len);
+void eap_sim_cache_forget_reauth(struct eap_sim_cache_entry *entry);
+void eap_sim_cache_remove(const char *permanent_id);
+void eap_sim_cache_flush(void);
+
+/*
+ * Decrypt the AT_ENCR_DATA of a full authentication Challenge packet, if
+ * present, with entry->k_encr and store any AT_NEXT_PSEUDONYM and
+ * AT_NEXT_REAUTH_ID in entry.
+ */
+bool eap_sim_process_next_ids(struct eap_sim_cache_entry *entry,
+				const uint8_t *pkt, size_t len);
+
+/*
+ * Pick the identity for the next authentication: the fast re-authentication
+ * identity if allowed and known, then the pseudonym decorated with the realm
+ * of the permanent identity, then the permanent identity itself.
+ *
+ * Returns a newly allocated string.
+ */
+char *eap_sim_select_identity(const char *permanent_id, bool allow_reauth,
+				bool allow_pseudonym);
+
+/*
+ * Attributes found inside AT_ENCR_DATA.  Strings point into the decrypted
+ * buffer and are not NUL terminated, counter is -1 if AT_COUNTER was absent.
+ */
+struct eap_sim_encr_attrs {
+	const char *pseudonym;
+	uint16_t pseudonym_len;
+	const char *reauth_id;
+	uint16_t reauth_id_len;
+	int32_t counter;
+	const uint8_t *nonce_s;
+};
+
+bool eap_sim_parse_encr_attrs(const uint8_t *data, size_t len,
+				struct eap_sim_encr_attrs *attrs);
+
+/*
+ * Handle a SIM/AKA Re-authentication request (RFC 4186 Section 5 / RFC 4187
+ * Section 5) using the keys from a previous full authentication in entry.
+ * identity is the fast re-authentication identity that was sent.
+ *
+ * On success the response has been sent, the new MSK, EMSK and Session-Id
+ * are returned and the entry is updated for the next re-authentication.
+ * -EAGAIN means that the counter was stale, the response asking for a full
+ * authentication has been sent and the re-authentication data forgotten.
+ * Any other error should be answered with a client error.
+ */
+int eap_sim_handle_reauthentication(struct eap_state *eap,
+				enum eap_type type,
+				struct eap_sim_cache_entry *entry,
+				const char *identity,
+				const uint8_t *pkt, size_t len,
+				uint8_t *msk, uint8_t *emsk,
+				uint8_t *session_id);
+
 bool eap_sim_tlv_iter_init(struct eap_sim_tlv_iter *iter, const uint8_t *data,
 		uint32_t len);
 
@@ -34,6 +34,7 @@
 
 #include <ell/ell.h>
 
+#include "src/missing.h"
 #include "src/util.h"
 #include "src/iwd.h"
 #include "src/module.h"
@@ -51,20 +52,53 @@
 #include "src/blacklist.h"
 #include "src/mpdu.h"
 #include "src/erp.h"
+#include "src/owe.h"
+#include "src/pmksa.h"
 #include "src/netconfig.h"
+#include "src/storage.h"
 #include "src/anqp.h"
 #include "src/anqputil.h"
 #include "src/diagnostic.h"
 #include "src/frame-xchg.h"
+#include "src/trace.h"
+#include "src/metrics.h"
+#include "src/hotspot.h"
 
 static struct l_queue *station_list;
 static uint32_t netdev_watch;
 static uint32_t mfp_setting;
 static uint32_t roam_retry_interval;
+static uint32_t stats_interval;
+static int roam_threshold;
+static bool adaptive_roaming;
+static uint32_t adaptive_roaming_range;
+static bool ft_prewarm;
 static bool anqp_disabled;
 static bool netconfig_enabled;
+static size_t scan_mem_budget;
 static struct watchlist anqp_watches;
 
+/* Connected BSS signal samples used to anticipate crossing RoamThreshold */
+#define RSSI_TREND_SAMPLES	8
+#define RSSI_TREND_MIN_SAMPLES	4
+#define RSSI_TREND_INTERVAL	2	/* Seconds between samples */
+#define RSSI_TREND_HORIZON	10	/* Seconds to look ahead */
+#define RSSI_TREND_MIN_SLOPE	-0.5	/* dB per second */
+/*
+ * A roam started ahead of the threshold, or to a BSS known from earlier
+ * scans, must gain at least this many dB
+ */
+#define ROAM_CANDIDATE_MIN_GAIN	6
+/* Scan results younger than this are used as roam candidates, in usecs */
+#define ROAM_CANDIDATE_MAX_AGE	(10 * L_USEC_PER_SEC)
+/* Older autoconnect candidates wait for a scan after a failed attempt */
+#define AUTOCONNECT_CANDIDATE_MAX_AGE	(15 * L_USEC_PER_SEC)
+
+struct rssi_sample {
+	uint64_t time;
+	int8_t rssi;
+};
+
 struct station {
 	enum station_state state;
 	struct watchlist state_watches;
@@ -72,11 +106,16 @@ struct station {
 	struct network *connected_network;
 	struct scan_bss *connect_pending_bss;
 	struct network *connect_pending_network;
-	struct l_queue *autoconnect_list;
+	struct l_heap *autoconnect_list;
 	struct l_queue *bss_list;
+	struct l_hashtab *bss_index;	/* bss_list entries keyed by BSSID */
+	size_t bss_mem;			/* Estimated memory held by bss_list */
 	struct l_queue *hidden_bss_list_sorted;
 	struct l_hashmap *networks;
 	struct l_queue *networks_sorted;
+	struct l_hashmap *networks_published;	/* path -> published rank */
+	uint32_t networks_generation;
+	struct l_idle *networks_publish_idle;
 	struct l_dbus_message *connect_pending;
 	struct l_dbus_message *hidden_pending;
 	struct l_dbus_message *disconnect_pending;
@@ -85,13 +124,25 @@ struct station {
 	struct signal_agent *signal_agent;
 	uint32_t dbus_scan_id;
 	uint32_t quick_scan_id;
+	uint32_t direct_probe_id;
 	uint32_t hidden_network_scan_id;
+	uint64_t scan_start_time;
+
+	/* Phases of the ongoing connection or roam, and of the last few */
+	struct diagnostic_timeline *timeline;
+	struct l_queue *timelines;
 
 	/* Roaming related members */
 	struct timespec roam_min_time;
 	struct l_timeout *roam_trigger_timeout;
 	uint32_t roam_scan_id;
 	uint8_t preauth_bssid[6];
+	uint8_t btm_dialog_token;
+	struct l_timeout *rssi_trend_timeout;
+	struct l_timeout *stats_timeout;
+	struct rssi_sample rssi_history[RSSI_TREND_SAMPLES];
+	uint8_t rssi_history_len;
+	uint64_t roam_predicted_time;
 
 	struct wiphy *wiphy;
 	struct netdev *netdev;
@@ -113,11 +164,18 @@ struct station {
 	bool ap_directed_roaming : 1;
 	bool scanning : 1;
 	bool autoconnect : 1;
+	bool direct_probe_pending : 1;
+	bool sta_info_pending : 1;
+	bool rssi_sample_pending : 1;
+	bool stats_signal_pending : 1;
+	bool btm_response_pending : 1;
 };
 
 struct anqp_entry {
 	struct station *station;
 	struct network *network;
+	uint8_t hessid[6];
+	uint8_t bssid[6];
 	uint32_t pending;
 };
 
@@ -131,6 +189,239 @@ struct netdev *station_get_netdev(struct station *station)
 	return station->netdev;
 }
 
+#define STATION_MAX_TIMELINES 8
+
+METRICS_COUNTER(connect_attempts, "iwd_connect_attempts_total",
+		"Connection attempts to a BSS")
+METRICS_COUNTER_LABEL(connect_failed_auth, "iwd_connect_failures_total",
+		"phase=\"authentication\"",
+		"Failed connection attempts to a BSS")
+METRICS_COUNTER_LABEL(connect_failed_assoc, "iwd_connect_failures_total",
+		"phase=\"association\"", NULL)
+METRICS_COUNTER_LABEL(connect_failed_handshake, "iwd_connect_failures_total",
+		"phase=\"handshake\"", NULL)
+METRICS_COUNTER_LABEL(connect_failed_keys, "iwd_connect_failures_total",
+		"phase=\"setting_keys\"", NULL)
+METRICS_COUNTER(roams, "iwd_roams_total", "Roams to another BSS")
+METRICS_COUNTER(roam_failures, "iwd_roam_failures_total",
+		"Roam attempts that didn't end up on another BSS")
+METRICS_HISTOGRAM(connect_duration, "iwd_connect_duration_seconds",
+		"Time from the start of a connection to being connected")
+METRICS_HISTOGRAM(roam_duration, "iwd_roam_duration_seconds",
+		"Time from the start of a roam to being connected again")
+
+static void station_timeline_start(struct station *station,
+					const uint8_t *addr, bool roam)
+{
+	struct diagnostic_timeline *timeline;
+
+	if (station->timeline)
+		return;
+
+	timeline = diagnostic_timeline_new(addr, roam);
+	station->timeline = timeline;
+
+	if (!roam)
+		return;
+
+	memcpy(timeline->prev_addr, station->connected_bss->addr, 6);
+
+	if (station->ap_directed_roaming)
+		timeline->reason = DIAGNOSTIC_ROAM_REASON_AP_DIRECTED;
+	else if (station->signal_low)
+		timeline->reason = DIAGNOSTIC_ROAM_REASON_LOW_SIGNAL;
+	else if (station->roam_predicted_time)
+		timeline->reason = DIAGNOSTIC_ROAM_REASON_SIGNAL_TREND;
+}
+
+static void station_timeline_set_method(struct station *station,
+					enum diagnostic_roam_method method)
+{
+	if (station->timeline)
+		station->timeline->method = method;
+}
+
+static void station_timeline_mark(struct station *station,
+					enum diagnostic_phase phase)
+{
+	if (station->timeline)
+		diagnostic_timeline_mark(station->timeline, phase,
+						l_time_now());
+}
+
+static void station_timeline_mark_handshake(struct station *station,
+						struct handshake_state *hs)
+{
+	if (!station->timeline)
+		return;
+
+	diagnostic_timeline_mark(station->timeline, DIAGNOSTIC_PHASE_EAP,
+					hs->eap_start_time);
+	diagnostic_timeline_mark(station->timeline,
+					DIAGNOSTIC_PHASE_HANDSHAKE,
+					hs->ptk_start_time);
+}
+
+/* Roams with at least this many candidates are taken as a dense ESS */
+#define ADAPTIVE_ROAM_DENSE_CANDIDATES	2
+/* Roams taking longer than this should have started earlier */
+#define ADAPTIVE_ROAM_SLOW_USEC		(500 * L_USEC_PER_MSEC)
+/* RoamRetryInterval is at most multiplied by 1 << this on sparse networks */
+#define ADAPTIVE_ROAM_MAX_BACKOFF	3
+
+static struct network_info *station_adaptive_info(struct station *station)
+{
+	if (!adaptive_roaming || !station->connected_network)
+		return NULL;
+
+	return (struct network_info *)
+		network_get_info(station->connected_network);
+}
+
+static int station_roam_offset_clamp(int offset)
+{
+	int range = adaptive_roaming_range;
+
+	if (offset > range)
+		return range;
+
+	if (offset < -range)
+		return -range;
+
+	return offset;
+}
+
+static int station_roam_threshold(struct station *station)
+{
+	const struct network_info *info = station_adaptive_info(station);
+
+	if (!info)
+		return roam_threshold;
+
+	return roam_threshold + station_roam_offset_clamp(info->roam_offset);
+}
+
+static uint32_t station_roam_retry_interval(struct station *station)
+{
+	const struct network_info *info = station_adaptive_info(station);
+	uint64_t interval = roam_retry_interval;
+
+	if (!info)
+		return roam_retry_interval;
+
+	if (info->roam_backoff < ADAPTIVE_ROAM_MAX_BACKOFF)
+		interval <<= info->roam_backoff;
+	else
+		interval <<= ADAPTIVE_ROAM_MAX_BACKOFF;
+
+	return interval > INT_MAX ? INT_MAX : interval;
+}
+
+/*
+ * With [General].AdaptiveRoaming the outcome of each signal driven roam
+ * nudges the threshold of the network.  Roams that found several
+ * candidates or took long mean the ESS is dense or slow to roam in and
+ * that roaming should start earlier.  Roam scans that found no candidate
+ * at all mean the network is sparse so roam later and scan less often.
+ */
+static void station_roam_learn(struct station *station,
+				const struct diagnostic_timeline *timeline,
+				bool success)
+{
+	struct network_info *info = station_adaptive_info(station);
+	int offset;
+	uint8_t backoff;
+
+	if (!info || !timeline->roam)
+		return;
+
+	if (timeline->reason != DIAGNOSTIC_ROAM_REASON_LOW_SIGNAL &&
+			timeline->reason != DIAGNOSTIC_ROAM_REASON_SIGNAL_TREND)
+		return;
+
+	offset = info->roam_offset;
+	backoff = info->roam_backoff;
+
+	if (success && (timeline->candidates >=
+				ADAPTIVE_ROAM_DENSE_CANDIDATES ||
+			l_time_diff(timeline->start_time, timeline->end_time) >
+				ADAPTIVE_ROAM_SLOW_USEC)) {
+		offset++;
+		backoff = 0;
+	} else if (!success && !timeline->candidates) {
+		offset--;
+
+		if (backoff < ADAPTIVE_ROAM_MAX_BACKOFF)
+			backoff++;
+	}
+
+	offset = station_roam_offset_clamp(offset);
+
+	if (offset == info->roam_offset && backoff == info->roam_backoff)
+		return;
+
+	l_debug("Roam threshold offset %i -> %i dB, retry backoff %u -> %u",
+			info->roam_offset, offset, info->roam_backoff, backoff);
+
+	info->roam_offset = offset;
+	info->roam_backoff = backoff;
+	known_network_frequency_sync(info);
+}
+
+static void station_timeline_finish(struct station *station, bool success)
+{
+	struct diagnostic_timeline *timeline = station->timeline;
+	struct l_dbus_message *signal;
+	struct l_dbus_message_builder *builder;
+
+	if (!timeline)
+		return;
+
+	station->timeline = NULL;
+
+	/* We may have ended up on a different BSS than we started with */
+	if (success && station->connected_bss)
+		memcpy(timeline->addr, station->connected_bss->addr, 6);
+
+	diagnostic_timeline_finish(timeline, success);
+	station_roam_learn(station, timeline, success);
+
+	if (success && adaptive_roaming)
+		netdev_set_low_signal_threshold(station->netdev,
+					station_roam_threshold(station));
+
+	if (timeline->roam && !success)
+		METRICS_INC(roam_failures);
+	else if (timeline->roam) {
+		METRICS_INC(roams);
+		METRICS_OBSERVE(roam_duration, l_time_diff(timeline->start_time,
+							timeline->end_time));
+	} else if (success)
+		METRICS_OBSERVE(connect_duration,
+					l_time_diff(timeline->start_time,
+							timeline->end_time));
+
+	l_queue_push_tail(station->timelines, timeline);
+
+	if (l_queue_length(station->timelines) > STATION_MAX_TIMELINES)
+		l_free(l_queue_pop_head(station->timelines));
+
+	signal = l_dbus_message_new_signal(dbus_get_bus(),
+					netdev_get_path(station->netdev),
+					IWD_STATION_DIAGNOSTIC_INTERFACE,
+					"ConnectionTimeline");
+	builder = l_dbus_message_builder_new(signal);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	diagnostic_timeline_to_dict(timeline, builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), signal);
+}
+
 struct network *station_get_connected_network(struct station *station)
 {
 	return station->connected_network;
@@ -174,12 +465,29 @@ static void station_property_set_scanning(struct station *station,
 static void station_enter_state(struct station *station,
 						enum station_state state);
 
-static void station_autoconnect_next(struct station *station)
+static void station_direct_probe_cancel(struct station *station)
+{
+	if (!station->direct_probe_id)
+		return;
+
+	scan_cancel(netdev_get_wdev_id(station->netdev),
+			station->direct_probe_id);
+	station->direct_probe_id = 0;
+}
+
+/* Try autoconnect candidates in rank order, skipping BSSes older than @since */
+static void station_autoconnect_next_since(struct station *station,
+						uint64_t since)
 {
 	struct autoconnect_entry *entry;
 	int r;
 
-	while ((entry = l_queue_pop_head(station->autoconnect_list))) {
+	while ((entry = l_heap_pop(station->autoconnect_list))) {
+		if (l_time_before(entry->bss->time_stamp, since)) {
+			l_free(entry);
+			continue;
+		}
+
 		l_debug("Considering autoconnecting to BSS '%s' with SSID: %s,"
 			" freq: %u, rank: %u, strength: %i",
 			util_address_to_string(entry->bss->addr),
@@ -187,7 +495,10 @@ static void station_autoconnect_next(struct station *station)
 			entry->bss->frequency, entry->rank,
 			entry->bss->signal_strength);
 
-		if (blacklist_contains_bss(entry->bss->addr)) {
+		if (blacklist_contains_bss(entry->bss->addr) ||
+				blacklist_contains_network(
+					network_get_ssid(entry->network),
+					network_get_security(entry->network))) {
 			l_free(entry);
 			continue;
 		}
@@ -198,6 +509,8 @@ static void station_autoconnect_next(struct station *station)
 		if (!r) {
 			station_enter_state(station, STATION_STATE_CONNECTING);
 
+			station_direct_probe_cancel(station);
+
 			if (station->quick_scan_id) {
 				scan_cancel(netdev_get_wdev_id(station->netdev),
 						station->quick_scan_id);
@@ -210,12 +523,17 @@ static void station_autoconnect_next(struct station *station)
 	}
 }
 
-static int autoconnect_rank_compare(const void *a, const void *b, void *user)
+static void station_autoconnect_next(struct station *station)
+{
+	station_autoconnect_next_since(station, 0);
+}
+
+static int autoconnect_rank_compare(const void *a, const void *b)
 {
-	const struct autoconnect_entry *new_ae = a;
-	const struct autoconnect_entry *ae = b;
+	const struct autoconnect_entry *ae_a = a;
+	const struct autoconnect_entry *ae_b = b;
 
-	return (ae->rank > new_ae->rank) ? 1 : -1;
+	return (int) ae_b->rank - (int) ae_a->rank;
 }
 
 static void station_add_autoconnect_bss(struct station *station,
@@ -233,8 +551,7 @@ static void station_add_autoconnect_bss(struct station *station,
 	entry->network = network;
 	entry->bss = bss;
 	entry->rank = bss->rank * rankmod;
-	l_queue_insert(station->autoconnect_list, entry,
-				autoconnect_rank_compare, NULL);
+	l_heap_push(station->autoconnect_list, entry);
 }
 
 static void bss_free(void *data)
@@ -251,23 +568,33 @@ static void network_free(void *data)
 	network_remove(network, -ESHUTDOWN);
 }
 
+struct process_network_data {
+	struct station *station;
+	struct l_hashmap *moved;
+};
+
 static bool process_network(const void *key, void *data, void *user_data)
 {
 	struct network *network = data;
-	struct station *station = user_data;
+	struct process_network_data *pnd = user_data;
+	struct station *station = pnd->station;
 
 	if (!network_bss_list_isempty(network)) {
 		bool connected = network == station->connected_network;
 
-		/* Build the network list ordered by rank */
-		network_rank_update(network, connected);
-
-		l_queue_insert(station->networks_sorted, network,
-				network_rank_compare, NULL);
+		/* Only networks whose rank changed need to be repositioned */
+		if (network_rank_update(network, connected))
+			l_hashmap_insert(pnd->moved, network, network);
 
 		return false;
 	}
 
+	l_queue_remove(station->networks_sorted, network);
+
+	/* Keep registered networks for a few scans when registering lazily */
+	if (network_unseen(network))
+		return false;
+
 	/* Drop networks that have no more BSSs in range */
 	l_debug("No remaining BSSs for SSID: %s -- Removing network",
 			network_get_ssid(network));
@@ -276,6 +603,232 @@ static bool process_network(const void *key, void *data, void *user_data)
 	return true;
 }
 
+static void network_clear_bss_list(void *data, void *user_data)
+{
+	network_bss_list_clear(data);
+}
+
+static bool network_match_moved(void *data, void *user_data)
+{
+	struct l_hashmap *moved = user_data;
+
+	return l_hashmap_lookup(moved, data) != NULL;
+}
+
+static void network_collect_moved(const void *key, void *value,
+					void *user_data)
+{
+	struct network ***next = user_data;
+
+	*(*next)++ = value;
+}
+
+static int network_rank_cmp_desc(const void *a, const void *b)
+{
+	int rank_a = network_get_rank(*(struct network * const *) a);
+	int rank_b = network_get_rank(*(struct network * const *) b);
+
+	return (rank_a < rank_b) - (rank_a > rank_b);
+}
+
+/*
+ * Reposition the networks whose rank changed in the last scan.  The moved
+ * networks are taken out of networks_sorted, sorted on their own and merged
+ * back in, so the cost is linear in the number of networks plus the sort of
+ * the moved ones rather than a full sorted insert of every network.
+ */
+static void station_networks_reorder(struct station *station,
+					struct l_hashmap *moved)
+{
+	unsigned int n_moved = l_hashmap_size(moved);
+	struct network **sorted;
+	struct network **next;
+	struct l_queue *merged;
+	struct network *network;
+	unsigned int i = 0;
+
+	if (!n_moved)
+		return;
+
+	l_queue_foreach_remove(station->networks_sorted,
+				network_match_moved, moved);
+
+	sorted = l_new(struct network *, n_moved);
+	next = sorted;
+	l_hashmap_foreach(moved, network_collect_moved, &next);
+	qsort(sorted, n_moved, sizeof(*sorted), network_rank_cmp_desc);
+
+	merged = l_queue_new();
+
+	while ((network = l_queue_peek_head(station->networks_sorted))) {
+		if (i < n_moved && network_get_rank(sorted[i]) >=
+					network_get_rank(network)) {
+			l_queue_push_tail(merged, sorted[i++]);
+			continue;
+		}
+
+		l_queue_push_tail(merged,
+				l_queue_pop_head(station->networks_sorted));
+	}
+
+	while (i < n_moved)
+		l_queue_push_tail(merged, sorted[i++]);
+
+	l_free(sorted);
+	l_queue_destroy(station->networks_sorted, NULL);
+	station->networks_sorted = merged;
+}
+
+struct published_network {
+	int32_t rank;
+	int16_t signal_strength;
+};
+
+struct networks_delta {
+	struct l_queue *added;
+	struct l_queue *changed;
+	struct l_hashmap *published;
+};
+
+static void networks_delta_append(struct l_dbus_message_builder *builder,
+					struct l_queue *networks)
+{
+	const struct l_queue_entry *entry;
+
+	l_dbus_message_builder_enter_array(builder, "(oni)");
+
+	for (entry = l_queue_get_entries(networks); entry;
+			entry = entry->next) {
+		const struct network *network = entry->data;
+		int16_t signal_strength = network_get_signal_strength(network);
+		int32_t rank = network_get_rank(network);
+
+		l_dbus_message_builder_enter_struct(builder, "oni");
+		l_dbus_message_builder_append_basic(builder, 'o',
+						network_get_path(network));
+		l_dbus_message_builder_append_basic(builder, 'n',
+							&signal_strength);
+		l_dbus_message_builder_append_basic(builder, 'i', &rank);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+}
+
+static void networks_delta_append_removed(const void *key, void *value,
+						void *user_data)
+{
+	struct l_dbus_message_builder *builder = user_data;
+
+	l_dbus_message_builder_append_basic(builder, 'o', key);
+}
+
+/*
+ * Compare station->networks_sorted with what was last announced through
+ * OrderedNetworksChanged and emit the difference, if any.  Networks are
+ * reported with their rank, which is only meaningful relative to other
+ * networks', so that a new network doesn't cause every network ranked
+ * below it to be reported as changed.
+ */
+static void station_networks_publish(struct station *station)
+{
+	struct networks_delta delta;
+	const struct l_queue_entry *entry;
+	struct l_dbus_message *signal;
+	struct l_dbus_message_builder *builder;
+
+	delta.added = l_queue_new();
+	delta.changed = l_queue_new();
+	delta.published = l_hashmap_string_new();
+
+	for (entry = l_queue_get_entries(station->networks_sorted); entry;
+			entry = entry->next) {
+		struct network *network = entry->data;
+		const char *path = network_get_path(network);
+		struct published_network *pub;
+
+		/* Not registered yet, see [General].LazyNetworkRegistration */
+		if (!network_is_exported(network))
+			continue;
+
+		pub = l_hashmap_remove(station->networks_published, path);
+
+		if (!pub) {
+			pub = l_new(struct published_network, 1);
+			l_queue_push_tail(delta.added, network);
+		} else if (pub->rank != network_get_rank(network) ||
+				pub->signal_strength !=
+				network_get_signal_strength(network))
+			l_queue_push_tail(delta.changed, network);
+
+		pub->rank = network_get_rank(network);
+		pub->signal_strength = network_get_signal_strength(network);
+		l_hashmap_insert(delta.published, path, pub);
+	}
+
+	/* Whatever remains in the old map is no longer in the list */
+	if (l_queue_isempty(delta.added) && l_queue_isempty(delta.changed) &&
+			l_hashmap_isempty(station->networks_published))
+		goto done;
+
+	station->networks_generation += 1;
+
+	signal = l_dbus_message_new_signal(dbus_get_bus(),
+					netdev_get_path(station->netdev),
+					IWD_STATION_INTERFACE,
+					"OrderedNetworksChanged");
+	builder = l_dbus_message_builder_new(signal);
+
+	l_dbus_message_builder_append_basic(builder, 'u',
+						&station->networks_generation);
+	networks_delta_append(builder, delta.added);
+	networks_delta_append(builder, delta.changed);
+
+	l_dbus_message_builder_enter_array(builder, "o");
+	l_hashmap_foreach(station->networks_published,
+				networks_delta_append_removed, builder);
+	l_dbus_message_builder_leave_array(builder);
+
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), signal);
+
+done:
+	l_hashmap_destroy(station->networks_published, l_free);
+	station->networks_published = delta.published;
+	l_queue_destroy(delta.added, NULL);
+	l_queue_destroy(delta.changed, NULL);
+}
+
+static void station_networks_publish_idle(struct l_idle *idle,
+						void *user_data)
+{
+	struct station *station = user_data;
+
+	l_idle_remove(station->networks_publish_idle);
+	station->networks_publish_idle = NULL;
+
+	station_networks_publish(station);
+}
+
+/*
+ * The ordered network list is updated synchronously so that autoconnect can
+ * use it right away, only the D-Bus publication is deferred.  This also
+ * coalesces back to back reorders into a single signal.
+ */
+static void station_networks_schedule_publish(struct station *station)
+{
+	if (station->networks_publish_idle)
+		return;
+
+	station->networks_publish_idle = l_idle_create(
+						station_networks_publish_idle,
+						station, NULL);
+	if (!station->networks_publish_idle)
+		station_networks_publish(station);
+}
+
 static const char *iwd_network_get_path(struct station *station,
 					const char *ssid,
 					enum security security)
@@ -299,9 +852,13 @@ static const char *iwd_network_get_path(struct station *station,
 struct network *station_network_find(struct station *station, const char *ssid,
 					enum security security)
 {
-	const char *path = iwd_network_get_path(station, ssid, security);
+	const struct network_key *key = network_key_find(ssid, security);
+
+	/* Networks hold a reference to their key so none exists without one */
+	if (!key)
+		return NULL;
 
-	return l_hashmap_lookup(station->networks, path);
+	return l_hashmap_lookup(station->networks, key);
 }
 
 static int bss_signal_strength_compare(const void *a, const void *b, void *user)
@@ -312,6 +869,20 @@ static int bss_signal_strength_compare(const void *a, const void *b, void *user)
 	return (bss->signal_strength > new_bss->signal_strength) ? 1 : -1;
 }
 
+static void station_hidden_bss_add(struct station *station,
+					struct scan_bss *bss)
+{
+	const struct scan_bss *tail =
+			l_queue_peek_tail(station->hidden_bss_list_sorted);
+
+	/* Scan results are ranked, so this is mostly an append */
+	if (!tail || tail->signal_strength > bss->signal_strength)
+		l_queue_push_tail(station->hidden_bss_list_sorted, bss);
+	else
+		l_queue_insert(station->hidden_bss_list_sorted, bss,
+					bss_signal_strength_compare, NULL);
+}
+
 /*
  * Returns the network object the BSS was added to or NULL if ignored.
  */
@@ -334,8 +905,7 @@ static struct network *station_add_seen_bss(struct station *station,
 	if (util_ssid_is_hidden(bss->ssid_len, bss->ssid)) {
 		l_debug("BSS has hidden SSID");
 
-		l_queue_insert(station->hidden_bss_list_sorted, bss,
-					bss_signal_strength_compare, NULL);
+		station_hidden_bss_add(station, bss);
 		return NULL;
 	}
 
@@ -354,13 +924,16 @@ static struct network *station_add_seen_bss(struct station *station,
 			return NULL;
 
 		security = security_determine(bss->capability, NULL);
-	} else
+	} else {
 		security = security_determine(bss->capability, &info);
 
-	path = iwd_network_get_path(station, ssid, security);
+		if (info.akm_suites & IE_RSN_AKM_SUITE_OWE)
+			owe_prepare_key_pairs();
+	}
 
-	network = l_hashmap_lookup(station->networks, path);
+	network = station_network_find(station, ssid, security);
 	if (!network) {
+		path = iwd_network_get_path(station, ssid, security);
 		network = network_create(station, ssid, security);
 
 		if (!network_register(network, path)) {
@@ -369,7 +942,7 @@ static struct network *station_add_seen_bss(struct station *station,
 		}
 
 		l_hashmap_insert(station->networks,
-					network_get_path(network), network);
+					network_get_key(network), network);
 		l_debug("Added new Network \"%s\" security %s",
 			network_get_ssid(network), security_to_str(security));
 	}
@@ -393,6 +966,48 @@ static bool bss_match(const void *a, const void *b)
 	return !memcmp(bss_a->ssid, bss_b->ssid, bss_a->ssid_len);
 }
 
+static struct l_hashtab *station_bss_index_new(void)
+{
+	return l_hashtab_new(ETH_ALEN, L_HASHTAB_HASH_FAST);
+}
+
+/*
+ * The kernel may report the same BSSID more than once, typically once with
+ * a hidden SSID and once with the SSID learned from a Probe Response.  Only
+ * one entry per BSSID is indexed, preferring the one with a visible SSID.
+ */
+static void station_bss_index_add(struct l_hashtab *index,
+					struct scan_bss *bss)
+{
+	struct scan_bss *old = l_hashtab_lookup(index, bss->addr);
+
+	if (old) {
+		if (!util_ssid_is_hidden(old->ssid_len, old->ssid) ||
+				util_ssid_is_hidden(bss->ssid_len, bss->ssid))
+			return;
+
+		l_hashtab_remove(index, old->addr);
+	}
+
+	l_hashtab_insert(index, bss->addr, bss);
+}
+
+static struct scan_bss *station_bss_find_match(struct l_hashtab *index,
+						struct l_queue *bss_list,
+						const struct scan_bss *bss)
+{
+	struct scan_bss *found = l_hashtab_lookup(index, bss->addr);
+
+	if (!found)
+		return NULL;
+
+	if (bss_match(found, bss))
+		return found;
+
+	/* Duplicate BSSID with a different SSID, fall back to a full search */
+	return l_queue_find(bss_list, bss_match, bss);
+}
+
 struct bss_expiration_data {
 	struct scan_bss *connected_bss;
 	uint64_t now;
@@ -435,23 +1050,162 @@ static void station_bss_list_remove_expired_bsses(struct station *station,
 	l_queue_foreach_remove(station->bss_list, bss_free_if_expired, &data);
 }
 
-struct nai_search {
-	struct network *network;
-	const char **realms;
-};
+/*
+ * Eviction classes when over the scan result memory budget, least
+ * valuable first.  Within a class weaker and then older BSSes go first.
+ */
+enum bss_evict_class {
+	BSS_EVICT_OPEN,
+	BSS_EVICT_UNKNOWN,
+	BSS_EVICT_KNOWN,	/* Known networks and roam candidates */
+	BSS_EVICT_NEVER,	/* The connected BSS */
+};
+
+struct bss_evict_entry {
+	struct scan_bss *bss;
+	enum bss_evict_class class;
+};
 
-static bool match_nai_realms(const struct network_info *info, void *user_data)
+static enum bss_evict_class station_bss_evict_class(struct station *station,
+							struct scan_bss *bss)
 {
-	struct nai_search *search = user_data;
+	struct scan_bss *connected = station->connected_bss;
+	struct ie_rsn_info info;
+	enum security security;
+	char ssid[33];
 
-	if (!network_info_match_nai_realm(info, search->realms))
-		return false;
+	if (bss == connected)
+		return BSS_EVICT_NEVER;
+
+	if (connected && bss->ssid_len == connected->ssid_len &&
+			!memcmp(bss->ssid, connected->ssid, bss->ssid_len))
+		return BSS_EVICT_KNOWN;
+
+	if (util_ssid_is_hidden(bss->ssid_len, bss->ssid))
+		return BSS_EVICT_UNKNOWN;
+
+	if (scan_bss_get_rsn_info(bss, &info) < 0)
+		security = security_determine(bss->capability, NULL);
+	else
+		security = security_determine(bss->capability, &info);
+
+	memcpy(ssid, bss->ssid, bss->ssid_len);
+	ssid[bss->ssid_len] = '\0';
+
+	if (known_networks_find(ssid, security))
+		return BSS_EVICT_KNOWN;
+
+	return security == SECURITY_NONE ? BSS_EVICT_OPEN : BSS_EVICT_UNKNOWN;
+}
+
+static int bss_ptr_compare(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t) *(struct scan_bss * const *) a;
+	uintptr_t pb = (uintptr_t) *(struct scan_bss * const *) b;
+
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+struct bss_evict_set {
+	struct scan_bss **bsses;
+	unsigned int n;
+};
+
+static bool bss_free_if_evicted(void *data, void *user_data)
+{
+	struct scan_bss *bss = data;
+	struct bss_evict_set *set = user_data;
 
-	network_set_info(search->network, (struct network_info *) info);
+	if (!bsearch(&bss, set->bsses, set->n, sizeof(bss), bss_ptr_compare))
+		return false;
 
+	bss_free(bss);
 	return true;
 }
 
+static int bss_evict_compare(const void *a, const void *b)
+{
+	const struct bss_evict_entry *ea = a;
+	const struct bss_evict_entry *eb = b;
+
+	if (ea->class != eb->class)
+		return ea->class < eb->class ? -1 : 1;
+
+	if (ea->bss->signal_strength != eb->bss->signal_strength)
+		return ea->bss->signal_strength < eb->bss->signal_strength ?
+									-1 : 1;
+
+	if (ea->bss->time_stamp != eb->bss->time_stamp)
+		return ea->bss->time_stamp < eb->bss->time_stamp ? -1 : 1;
+
+	return 0;
+}
+
+/*
+ * Keeps the scan results within the configured [Scan].MemoryBudget by
+ * dropping the least valuable BSSes, see enum bss_evict_class.
+ */
+static void station_bss_list_enforce_budget(struct station *station,
+						struct l_queue *bss_list,
+						struct l_hashtab *bss_index)
+{
+	const struct l_queue_entry *entry;
+	struct bss_evict_entry *entries;
+	struct bss_evict_set set;
+	unsigned int n = 0;
+	unsigned int i;
+	size_t mem = 0;
+
+	for (entry = l_queue_get_entries(bss_list); entry;
+						entry = entry->next)
+		mem += scan_bss_get_mem_size(entry->data);
+
+	station->bss_mem = mem;
+
+	if (!scan_mem_budget || mem <= scan_mem_budget)
+		return;
+
+	entries = l_new(struct bss_evict_entry, l_queue_length(bss_list));
+
+	for (entry = l_queue_get_entries(bss_list); entry;
+						entry = entry->next) {
+		entries[n].bss = entry->data;
+		entries[n].class = station_bss_evict_class(station,
+								entry->data);
+		n++;
+	}
+
+	qsort(entries, n, sizeof(*entries), bss_evict_compare);
+
+	set.bsses = l_new(struct scan_bss *, n);
+	set.n = 0;
+
+	for (i = 0; i < n && mem > scan_mem_budget; i++) {
+		struct scan_bss *bss = entries[i].bss;
+
+		if (entries[i].class == BSS_EVICT_NEVER)
+			break;
+
+		mem -= scan_bss_get_mem_size(bss);
+
+		if (l_hashtab_lookup(bss_index, bss->addr) == bss)
+			l_hashtab_remove(bss_index, bss->addr);
+
+		set.bsses[set.n++] = bss;
+	}
+
+	l_free(entries);
+
+	qsort(set.bsses, set.n, sizeof(struct scan_bss *), bss_ptr_compare);
+	l_queue_foreach_remove(bss_list, bss_free_if_evicted, &set);
+	l_free(set.bsses);
+
+	l_debug("Evicted %u BSSes to stay within budget, %zu of %zu bytes "
+			"used", set.n, mem, scan_mem_budget);
+
+	station->bss_mem = mem;
+}
+
 static void network_add_foreach(struct network *network, void *user_data)
 {
 	struct station *station = user_data;
@@ -492,26 +1246,16 @@ static bool anqp_entry_foreach(void *data, void *user_data)
 	return true;
 }
 
-static void station_anqp_response_cb(enum anqp_result result,
-					const void *anqp, size_t anqp_len,
-					void *user_data)
+/* Returns false if @anqp is not a valid response */
+static bool station_anqp_process(struct network *network,
+					const void *anqp, size_t anqp_len)
 {
-	struct anqp_entry *entry = user_data;
-	struct station *station = entry->station;
-	struct network *network = entry->network;
 	struct anqp_iter iter;
 	uint16_t id;
 	uint16_t len;
 	const void *data;
 	char **realms = NULL;
-	struct nai_search search;
-
-	l_debug("");
-
-	if (result != ANQP_SUCCESS) {
-		/* TODO: try next BSS */
-		goto request_done;
-	}
+	struct network_info *info;
 
 	anqp_iter_init(&iter, anqp, anqp_len);
 
@@ -523,7 +1267,7 @@ static void station_anqp_response_cb(enum anqp_result result,
 
 			realms = anqp_parse_nai_realms(data, len);
 			if (!realms)
-				goto request_done;
+				return false;
 
 			break;
 		default:
@@ -532,18 +1276,34 @@ static void station_anqp_response_cb(enum anqp_result result,
 	}
 
 	if (!realms)
-		goto request_done;
-
-	search.network = network;
-	search.realms = (const char **)realms;
+		return true;
 
-	known_networks_foreach(match_nai_realms, &search);
+	info = hotspot_find_by_nai_realms((const char **) realms);
+	if (info)
+		network_set_info(network, info);
 
 	l_strv_free(realms);
 
-request_done:
+	return true;
+}
+
+static void station_anqp_response_cb(enum anqp_result result,
+					const void *anqp, size_t anqp_len,
+					void *user_data)
+{
+	struct anqp_entry *entry = user_data;
+	struct station *station = entry->station;
+
+	l_debug("");
+
+	/* TODO: try next BSS on failure */
+	if (result == ANQP_SUCCESS &&
+			station_anqp_process(entry->network, anqp, anqp_len))
+		anqp_cache_add(entry->hessid, entry->bssid, anqp, anqp_len);
+
 	entry->pending = 0;
 
+
 	/* Return if there are other pending requests */
 	if (l_queue_find(station->anqp_pending, match_pending, NULL))
 		return;
@@ -551,8 +1311,8 @@ request_done:
 	/* Notify all watchers now that every ANQP request has finished */
 	l_queue_foreach_remove(station->anqp_pending, anqp_entry_foreach, NULL);
 
-	l_queue_destroy(station->autoconnect_list, l_free);
-	station->autoconnect_list = l_queue_new();
+	l_heap_destroy(station->autoconnect_list, l_free);
+	station->autoconnect_list = l_heap_new(autoconnect_rank_compare);
 
 	if (station_is_autoconnecting(station)) {
 		station_network_foreach(station, network_add_foreach, station);
@@ -566,6 +1326,8 @@ static bool station_start_anqp(struct station *station, struct network *network,
 	uint8_t anqp[256];
 	uint8_t *ptr = anqp;
 	struct anqp_entry *entry;
+	const void *cached;
+	size_t cached_len;
 
 	if (!bss->hs20_capable)
 		return false;
@@ -579,9 +1341,19 @@ static bool station_start_anqp(struct station *station, struct network *network,
 		return false;
 	}
 
+	cached = anqp_cache_lookup(bss->hessid, bss->addr, &cached_len);
+	if (cached) {
+		l_debug("Using cached ANQP response for "MAC,
+						MAC_STR(bss->addr));
+		station_anqp_process(network, cached, cached_len);
+		return false;
+	}
+
 	entry = l_new(struct anqp_entry, 1);
 	entry->station = station;
 	entry->network = network;
+	memcpy(entry->hessid, bss->hessid, 6);
+	memcpy(entry->bssid, bss->addr, 6);
 
 	l_put_le16(ANQP_QUERY_LIST, ptr);
 	ptr += 2;
@@ -631,7 +1403,7 @@ static bool bss_free_if_ssid_not_utf8(void *data, void *user_data)
 	if (util_ssid_is_hidden(bss->ssid_len, bss->ssid))
 		return false;
 
-	if (util_ssid_is_utf8(bss->ssid_len, bss->ssid))
+	if (bss->ssid_utf8)
 		return false;
 
 	l_debug("Dropping scan_bss '%s', with non-utf8 SSID",
@@ -640,6 +1412,42 @@ static bool bss_free_if_ssid_not_utf8(void *data, void *user_data)
 	return true;
 }
 
+/*
+ * Most FT deployments use the BSSID as the R1KH-ID, so derive the PMK-R1
+ * for the best BSSes of the mobility domain now rather than on the roam
+ * path.  A target using another R1KH-ID gets its PMK-R1 derived then.
+ */
+static void station_ft_prepare_keys(struct station *station)
+{
+	struct handshake_state *hs;
+	const struct l_queue_entry *entry;
+	unsigned int n = 0;
+	uint16_t mdid;
+
+	if (station->state != STATION_STATE_CONNECTED)
+		return;
+
+	hs = netdev_get_handshake(station->netdev);
+	if (!hs || !hs->mde)
+		return;
+
+	ie_parse_mobility_domain_from_data(hs->mde, hs->mde[1] + 2,
+						&mdid, NULL, NULL);
+
+	for (entry = l_queue_get_entries(station->bss_list);
+			entry && n < L_ARRAY_SIZE(hs->pmk_r1_cache);
+			entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+
+		if (!bss->mde_present || l_get_le16(bss->mde) != mdid ||
+				scan_bss_addr_eq(bss, station->connected_bss))
+			continue;
+
+		if (handshake_state_prepare_pmk_r1(hs, bss->addr))
+			n++;
+	}
+}
+
 /*
  * Used when scan results were obtained; either from scan running
  * inside station module or scans running in other state machines, e.g. wsc
@@ -650,27 +1458,35 @@ void station_set_scan_results(struct station *station,
 					bool add_to_autoconnect)
 {
 	const struct l_queue_entry *bss_entry;
-	struct network *network;
 	bool wait_for_anqp = false;
+	struct process_network_data pnd;
 
 	l_queue_foreach_remove(new_bss_list, bss_free_if_ssid_not_utf8, NULL);
 
-	while ((network = l_queue_pop_head(station->networks_sorted)))
-		network_bss_list_clear(network);
+	/* Keep networks_sorted, it is updated incrementally below */
+	l_queue_foreach(station->networks_sorted, network_clear_bss_list, NULL);
 
 	l_queue_clear(station->hidden_bss_list_sorted, NULL);
 
-	l_queue_destroy(station->autoconnect_list, l_free);
-	station->autoconnect_list = l_queue_new();
+	l_heap_destroy(station->autoconnect_list, l_free);
+	station->autoconnect_list = l_heap_new(autoconnect_rank_compare);
+
+	l_hashtab_destroy(station->bss_index, NULL);
+	station->bss_index = station_bss_index_new();
 
 	station_bss_list_remove_expired_bsses(station, freqs);
 
+	for (bss_entry = l_queue_get_entries(new_bss_list); bss_entry;
+						bss_entry = bss_entry->next)
+		station_bss_index_add(station->bss_index, bss_entry->data);
+
 	for (bss_entry = l_queue_get_entries(station->bss_list); bss_entry;
 						bss_entry = bss_entry->next) {
 		struct scan_bss *old_bss = bss_entry->data;
 		struct scan_bss *new_bss;
 
-		new_bss = l_queue_find(new_bss_list, bss_match, old_bss);
+		new_bss = station_bss_find_match(station->bss_index,
+							new_bss_list, old_bss);
 		if (new_bss) {
 			if (old_bss == station->connected_bss)
 				station->connected_bss = new_bss;
@@ -686,10 +1502,14 @@ void station_set_scan_results(struct station *station,
 		}
 
 		l_queue_push_tail(new_bss_list, old_bss);
+		station_bss_index_add(station->bss_index, old_bss);
 	}
 
 	l_queue_destroy(station->bss_list, NULL);
 
+	station_bss_list_enforce_budget(station, new_bss_list,
+						station->bss_index);
+
 	for (bss_entry = l_queue_get_entries(new_bss_list); bss_entry;
 						bss_entry = bss_entry->next) {
 		struct scan_bss *bss = bss_entry->data;
@@ -704,7 +1524,14 @@ void station_set_scan_results(struct station *station,
 
 	station->bss_list = new_bss_list;
 
-	l_hashmap_foreach_remove(station->networks, process_network, station);
+	station_ft_prepare_keys(station);
+
+	pnd.station = station;
+	pnd.moved = l_hashmap_new();
+	l_hashmap_foreach_remove(station->networks, process_network, &pnd);
+	station_networks_reorder(station, pnd.moved);
+	l_hashmap_destroy(pnd.moved, NULL);
+	station_networks_schedule_publish(station);
 
 	if (!wait_for_anqp && add_to_autoconnect) {
 		station_network_foreach(station, network_add_foreach, station);
@@ -731,10 +1558,14 @@ static void station_handshake_event(struct handshake_state *hs,
 	case HANDSHAKE_EVENT_SETTING_KEYS:
 		l_debug("Setting keys");
 
+		station_timeline_mark_handshake(station, hs);
+		station_timeline_mark(station, DIAGNOSTIC_PHASE_SETTING_KEYS);
+
 		/* If we got here, then our PSK works.  Save if required */
 		network_sync_psk(network);
 		break;
 	case HANDSHAKE_EVENT_FAILED:
+		station_timeline_mark_handshake(station, hs);
 		netdev_handshake_failed(hs, va_arg(args, int));
 		break;
 	case HANDSHAKE_EVENT_REKEY_FAILED:
@@ -744,6 +1575,7 @@ static void station_handshake_event(struct handshake_state *hs,
 	case HANDSHAKE_EVENT_COMPLETE:
 	case HANDSHAKE_EVENT_SETTING_KEYS_FAILED:
 	case HANDSHAKE_EVENT_EAP_NOTIFY:
+	case HANDSHAKE_EVENT_REKEY_COMPLETE:
 		/*
 		 * currently we don't care about any other events. The
 		 * netdev_connect_cb will notify us when the connection is
@@ -863,6 +1695,20 @@ build_ie:
 	if (!handshake_state_set_supplicant_ie(hs, rsne_buf))
 		goto not_supported;
 
+	handshake_state_set_authenticator_rsnxe(hs, bss->rsnxe);
+
+	/*
+	 * Use SAE Hash-to-Element whenever the AP supports it, the PT can
+	 * then be reused for every BSS of the network
+	 */
+	if (IE_AKM_IS_SAE(info.akm_suites) &&
+			ie_rsnxe_capable(bss->rsnxe, IE_RSNX_SAE_H2E)) {
+		uint8_t rsnxe[3];
+
+		if (ie_build_rsnxe(1 << IE_RSNX_SAE_H2E, rsnxe))
+			handshake_state_set_supplicant_rsnxe(hs, rsnxe);
+	}
+
 	if (info.akm_suites & (IE_RSN_AKM_SUITE_FT_OVER_8021X |
 				IE_RSN_AKM_SUITE_FT_USING_PSK |
 				IE_RSN_AKM_SUITE_FT_OVER_SAE_SHA256 |
@@ -892,6 +1738,82 @@ not_supported:
 	return -ENOTSUP;
 }
 
+/* Rebuild the RSNE to include a PMKID */
+static bool station_handshake_set_pmkid(struct handshake_state *hs,
+					const uint8_t *pmkid)
+{
+	struct ie_rsn_info rsn_info;
+	uint8_t rsne_buf[256];
+
+	if (ie_parse_rsne_from_data(hs->supplicant_ie,
+					hs->supplicant_ie[1] + 2,
+					&rsn_info) < 0)
+		return false;
+
+	rsn_info.num_pmkids = 1;
+	rsn_info.pmkids = pmkid;
+
+	ie_build_rsne(&rsn_info, rsne_buf);
+
+	return handshake_state_set_supplicant_ie(hs, rsne_buf);
+}
+
+/*
+ * If we hold a PMKSA for this BSS, offer its PMKID in the RSNE and preload
+ * the PMK so that the authenticator can go straight to the 4-Way Handshake.
+ *
+ * Otherwise, if we hold a PMKSA for another BSS of the same ESS, try
+ * Opportunistic Key Caching: controllers supporting OKC share the PMK
+ * between their APs, so the same PMK is offered with the PMKID derived for
+ * this BSS.  Should the authenticator not recognize the PMKID, eapol falls
+ * back to EAP.
+ */
+static void station_handshake_add_pmksa(struct handshake_state *hs,
+					const uint8_t *spa,
+					struct scan_bss *bss)
+{
+	const struct pmksa *pmksa;
+	uint8_t pmkid[16];
+	bool okc = false;
+
+	if (!hs->settings_8021x || hs->wpa_ie || hs->osen_ie ||
+			!pmksa_akm_supported(hs->akm_suite))
+		return;
+
+	pmksa = pmksa_cache_get(spa, bss->addr, hs->ssid, hs->ssid_len,
+					hs->akm_suite);
+	if (!pmksa) {
+		pmksa = pmksa_cache_get(spa, NULL, hs->ssid, hs->ssid_len,
+					hs->akm_suite);
+		if (!pmksa)
+			return;
+
+		okc = true;
+	}
+
+	handshake_state_set_pmk(hs, pmksa->pmk, pmksa->pmk_len);
+
+	if (okc) {
+		handshake_state_set_supplicant_address(hs, spa);
+		handshake_state_set_authenticator_address(hs, bss->addr);
+
+		if (!handshake_state_get_pmkid(hs, pmkid))
+			goto no_pmkid;
+	} else
+		memcpy(pmkid, pmksa->pmkid, 16);
+
+	if (!station_handshake_set_pmkid(hs, pmkid))
+		goto no_pmkid;
+
+	l_debug("Using %s PMKSA for "MAC, okc ? "opportunistic" : "cached",
+			MAC_STR(bss->addr));
+	return;
+
+no_pmkid:
+	explicit_bzero(hs->pmk, sizeof(hs->pmk));
+	hs->have_pmk = false;
+}
+
 static struct handshake_state *station_handshake_setup(struct station *station,
 							struct network *network,
 							struct scan_bss *bss)
@@ -1001,6 +1923,12 @@ static struct handshake_state *station_handshake_setup(struct station *station,
 		handshake_state_set_supplicant_address(hs, new_addr);
 	}
 
+	if (security == SECURITY_8021X)
+		station_handshake_add_pmksa(hs, override || full_random ?
+					new_addr :
+					netdev_get_address(station->netdev),
+					bss);
+
 	return hs;
 
 no_psk:
@@ -1033,6 +1961,8 @@ static void periodic_scan_trigger(int err, void *user_data)
 {
 	struct station *station = user_data;
 
+	station->scan_start_time = l_time_now();
+
 	station_property_set_scanning(station, true);
 }
 
@@ -1040,6 +1970,9 @@ static void periodic_scan_stop(struct station *station)
 {
 	uint64_t id = netdev_get_wdev_id(station->netdev);
 
+	scan_sched_stop(id);
+	scan_net_detect_stop(id);
+
 	if (scan_periodic_stop(id))
 		station_property_set_scanning(station, false);
 }
@@ -1057,6 +1990,7 @@ static bool station_needs_hidden_network_scan(struct station *station)
 
 static uint32_t station_scan_trigger(struct station *station,
 					struct scan_freq_set *freqs,
+					bool high_accuracy,
 					scan_trigger_func_t triggered,
 					scan_notify_func_t notify,
 					scan_destroy_func_t destroy)
@@ -1067,6 +2001,8 @@ static uint32_t station_scan_trigger(struct station *station,
 	memset(&params, 0, sizeof(params));
 	params.flush = true;
 	params.freqs = freqs;
+	params.high_accuracy = high_accuracy;
+	params.sliced = station->connected_bss != NULL;
 
 	if (wiphy_can_randomize_mac_addr(station->wiphy) ||
 			station->connected_bss ||
@@ -1124,6 +2060,8 @@ static void station_quick_scan_triggered(int err, void *user_data)
 	l_debug("Quick scan triggered for %s",
 					netdev_get_name(station->netdev));
 
+	station->scan_start_time = l_time_now();
+
 	station_property_set_scanning(station, true);
 }
 
@@ -1134,25 +2072,122 @@ static void station_quick_scan_destroy(void *userdata)
 	station->quick_scan_id = 0;
 }
 
+/* Last connection recent enough for a direct probe at startup, in seconds */
+#define DIRECT_PROBE_MAX_AGE (24 * 3600)
+
+static bool station_direct_probe_candidate(const struct network_info *info,
+						void *user_data)
+{
+	const struct network_info **candidate = user_data;
+	uint64_t now = (uint64_t) time(NULL) * L_USEC_PER_SEC;
+
+	/* Known networks are sorted by connected time, newest first */
+	if (!info->connected_time || info->connected_time > now ||
+			now - info->connected_time >
+			DIRECT_PROBE_MAX_AGE * L_USEC_PER_SEC)
+		return false;
+
+	if (!info->is_autoconnectable || info->is_hotspot ||
+			!info->n_known_frequencies)
+		return true;
+
+	*candidate = info;
+	return false;
+}
+
+static bool station_direct_probe_results(int err, struct l_queue *bss_list,
+					const struct scan_freq_set *freqs,
+					void *userdata)
+{
+	struct station *station = userdata;
+
+	if (err || !station_is_autoconnecting(station))
+		return false;
+
+	/*
+	 * The quick scan is still queued behind this one, if the last
+	 * network is found autoconnect cancels it, otherwise it picks up
+	 * from here.
+	 */
+	station_set_scan_results(station, bss_list, freqs, true);
+
+	return true;
+}
+
+static void station_direct_probe_destroy(void *userdata)
+{
+	struct station *station = userdata;
+
+	station->direct_probe_id = 0;
+}
+
+/*
+ * On startup probe for the most recently used network on the channel it
+ * was last seen on before the regular quick scan so that the connection
+ * can be started as soon as the BSS answers.
+ */
+static void station_direct_probe_trigger(struct station *station)
+{
+	const struct network_info *info = NULL;
+	const struct known_frequency *kf;
+	struct scan_freq_set *freqs;
+	struct scan_parameters params;
+
+	known_networks_foreach(station_direct_probe_candidate, &info);
+	if (!info)
+		return;
+
+	kf = &info->known_frequencies[0];
+
+	freqs = scan_freq_set_new();
+	scan_freq_set_add(freqs, kf->frequency);
+
+	if (!wiphy_constrain_freq_set(station->wiphy, freqs)) {
+		scan_freq_set_free(freqs);
+		return;
+	}
+
+	l_debug("Probing for %s on %u before the quick scan", info->ssid,
+			kf->frequency);
+
+	memset(&params, 0, sizeof(params));
+	params.freqs = freqs;
+	params.ssid = info->ssid;
+	params.randomize_mac_addr_hint = true;
+
+	station->direct_probe_id = scan_active_full(
+					netdev_get_wdev_id(station->netdev),
+					&params, NULL,
+					station_direct_probe_results, station,
+					station_direct_probe_destroy);
+	scan_freq_set_free(freqs);
+}
+
 static int station_quick_scan_trigger(struct station *station)
 {
-	struct scan_freq_set *known_freq_set;
+	const struct scan_freq_set *recent_freqs;
+	struct scan_freq_set known_freq_set;
+
+	if (station->direct_probe_pending) {
+		station->direct_probe_pending = false;
+		station_direct_probe_trigger(station);
+	}
 
-	known_freq_set = known_networks_get_recent_frequencies(5);
-	if (!known_freq_set)
+	recent_freqs = known_networks_get_recent_frequencies(5);
+	if (!recent_freqs)
 		return -ENODATA;
 
-	if (!wiphy_constrain_freq_set(station->wiphy, known_freq_set)) {
-		scan_freq_set_free(known_freq_set);
+	/* The cached set is shared, constrain a copy of it */
+	known_freq_set = *recent_freqs;
+
+	if (!wiphy_constrain_freq_set(station->wiphy, &known_freq_set))
 		return -ENOTSUP;
-	}
 
 	station->quick_scan_id = station_scan_trigger(station,
-						known_freq_set,
+						&known_freq_set, false,
 						station_quick_scan_triggered,
 						station_quick_scan_results,
 						station_quick_scan_destroy);
-	scan_freq_set_free(known_freq_set);
 
 	if (!station->quick_scan_id)
 		return -EIO;
@@ -1160,6 +2195,41 @@ static int station_quick_scan_trigger(struct station *station)
 	return 0;
 }
 
+/*
+ * The firmware has already found a known network while we were suspended
+ * so rather than waiting for the next full scan probe only the channels
+ * it was seen on and let autoconnect take it from there.
+ */
+static void station_net_detect(const char *ssid,
+				const struct scan_freq_set *freqs,
+				void *userdata)
+{
+	struct station *station = userdata;
+	struct scan_freq_set nd_freqs;
+	struct scan_parameters params;
+
+	if (!station_is_autoconnecting(station) || station->quick_scan_id ||
+			!freqs)
+		return;
+
+	l_debug("Net-detect found %s, scanning its channels",
+			ssid ? ssid : "known networks");
+
+	nd_freqs = *freqs;
+
+	memset(&params, 0, sizeof(params));
+	params.flush = true;
+	params.freqs = &nd_freqs;
+	params.ssid = ssid;
+	params.randomize_mac_addr_hint = true;
+
+	station->quick_scan_id = scan_active_full(
+					netdev_get_wdev_id(station->netdev),
+					&params, station_quick_scan_triggered,
+					station_quick_scan_results, station,
+					station_quick_scan_destroy);
+}
+
 static const char *station_state_to_string(enum station_state state)
 {
 	switch (state) {
@@ -1182,6 +2252,11 @@ static const char *station_state_to_string(enum station_state state)
 	return "invalid";
 }
 
+static void station_rssi_trend_start(struct station *station);
+static void station_rssi_trend_stop(struct station *station);
+static void station_stats_start(struct station *station);
+static void station_stats_stop(struct station *station);
+
 static void station_enter_state(struct station *station,
 						enum station_state state)
 {
@@ -1192,6 +2267,8 @@ static void station_enter_state(struct station *station,
 	l_debug("Old State: %s, new state: %s",
 			station_state_to_string(station->state),
 			station_state_to_string(state));
+	TRACE(station_state, netdev_get_ifindex(station->netdev),
+			station->state, state);
 
 	disconnected = !station_is_busy(station);
 
@@ -1210,15 +2287,26 @@ static void station_enter_state(struct station *station,
 		station->state = STATION_STATE_AUTOCONNECT_FULL;
 		/* Fall through */
 	case STATION_STATE_AUTOCONNECT_FULL:
+		scan_net_detect_start(id, station_net_detect, station);
+
+		/* Let the firmware do the scanning if it can */
+		if (scan_sched_start(id, periodic_scan_trigger,
+					new_scan_results, station))
+			break;
+
 		scan_periodic_start(id, periodic_scan_trigger,
 					new_scan_results, station);
 		break;
 	case STATION_STATE_CONNECTING:
 		/* Refresh the ordered network list */
-		network_rank_update(station->connected_network, true);
-		l_queue_remove(station->networks_sorted, station->connected_network);
-		l_queue_insert(station->networks_sorted, station->connected_network,
+		if (network_rank_update(station->connected_network, true)) {
+			l_queue_remove(station->networks_sorted,
+					station->connected_network);
+			l_queue_insert(station->networks_sorted,
+					station->connected_network,
 					network_rank_compare, NULL);
+			station_networks_schedule_publish(station);
+		}
 
 		l_dbus_property_changed(dbus, netdev_get_path(station->netdev),
 				IWD_STATION_INTERFACE, "ConnectedNetwork");
@@ -1229,14 +2317,18 @@ static void station_enter_state(struct station *station,
 		periodic_scan_stop(station);
 		break;
 	case STATION_STATE_DISCONNECTED:
+		station_timeline_finish(station, false);
 		periodic_scan_stop(station);
 		break;
 	case STATION_STATE_CONNECTED:
+		station_timeline_finish(station, true);
 		l_dbus_object_add_interface(dbus,
 					netdev_get_path(station->netdev),
 					IWD_STATION_DIAGNOSTIC_INTERFACE,
 					station);
 		periodic_scan_stop(station);
+		station_rssi_trend_start(station);
+		station_stats_start(station);
 		break;
 	case STATION_STATE_DISCONNECTING:
 		l_dbus_object_remove_interface(dbus_get_bus(),
@@ -1301,9 +2393,12 @@ static void station_roam_state_clear(struct station *station)
 {
 	l_timeout_remove(station->roam_trigger_timeout);
 	station->roam_trigger_timeout = NULL;
+	station_rssi_trend_stop(station);
+	station_stats_stop(station);
 	station->preparing_roam = false;
 	station->roam_scan_full = false;
 	station->signal_low = false;
+	station->btm_response_pending = false;
 	station->roam_min_time.tv_sec = 0;
 
 	if (station->roam_scan_id)
@@ -1332,10 +2427,14 @@ static void station_reset_connection_state(struct station *station)
 	station_roam_state_clear(station);
 
 	/* Refresh the ordered network list */
-	network_rank_update(station->connected_network, false);
-	l_queue_remove(station->networks_sorted, station->connected_network);
-	l_queue_insert(station->networks_sorted, station->connected_network,
+	if (network_rank_update(station->connected_network, false)) {
+		l_queue_remove(station->networks_sorted,
+				station->connected_network);
+		l_queue_insert(station->networks_sorted,
+				station->connected_network,
 				network_rank_compare, NULL);
+		station_networks_schedule_publish(station);
+	}
 
 	station->connected_bss = NULL;
 	station->connected_network = NULL;
@@ -1364,21 +2463,100 @@ static void station_disassociated(struct station *station)
 static void station_connect_cb(struct netdev *netdev, enum netdev_result result,
 					void *event_data, void *user_data);
 
-static void station_disconnect_event(struct station *station, void *event_data)
+/*
+ * Link losses the AP didn't ask for: beacon loss or another local
+ * decision, or the AP having dropped our state.  The BSS is likely still
+ * fine so it's worth trying again before scanning.
+ */
+static bool station_disconnect_is_transient(enum netdev_event event,
+						uint16_t reason_code)
 {
-	l_debug("%u", netdev_get_ifindex(station->netdev));
+	if (event == NETDEV_EVENT_DISCONNECT_BY_SME)
+		return true;
 
-	if (station->connect_pending)
-		station_connect_cb(station->netdev,
-					NETDEV_RESULT_HANDSHAKE_FAILED,
-					event_data, station);
-	else
-		station_disassociated(station);
+	switch (reason_code) {
+	case MMPDU_REASON_CODE_DISASSOC_DUE_TO_INACTIVITY:
+	case MMPDU_REASON_CODE_CLASS2_FRAME_FROM_NONAUTH_STA:
+	case MMPDU_REASON_CODE_CLASS3_FRAME_FROM_NONASSOC_STA:
+		return true;
+	}
+
+	return false;
 }
 
-static void station_roam_timeout_rearm(struct station *station, int seconds);
-static int station_roam_scan(struct station *station,
-				struct scan_freq_set *freq_set);
+static void network_add_fresh_foreach(struct network *network,
+					void *user_data)
+{
+	struct station *station = user_data;
+	struct scan_bss *bss = network_bss_select(network, false);
+
+	if (!bss || l_time_after(l_time_now(),
+				bss->time_stamp + ROAM_CANDIDATE_MAX_AGE))
+		return;
+
+	station_add_autoconnect_bss(station, network, bss);
+}
+
+/*
+ * Reconnect to the BSS just lost, then to candidates from recent scan
+ * results, without waiting for the quick scan.  Whatever doesn't work out
+ * leaves the quick scan to carry on as usual.
+ */
+static void station_fast_reconnect(struct station *station,
+					struct network *network,
+					struct scan_bss *bss)
+{
+	struct autoconnect_entry *entry;
+
+	l_heap_destroy(station->autoconnect_list, l_free);
+	station->autoconnect_list = l_heap_new(autoconnect_rank_compare);
+
+	station_network_foreach(station, network_add_fresh_foreach, station);
+
+	if (l_hashtab_lookup(station->bss_index, bss->addr) == bss) {
+		entry = l_new(struct autoconnect_entry, 1);
+		entry->network = network;
+		entry->bss = bss;
+		entry->rank = UINT16_MAX;
+		l_heap_push(station->autoconnect_list, entry);
+	}
+
+	l_debug("Trying %u cached candidates",
+		l_heap_size(station->autoconnect_list));
+
+	station_autoconnect_next(station);
+}
+
+static void station_disconnect_event(struct station *station,
+					enum netdev_event event,
+					void *event_data)
+{
+	struct network *network = station->connected_network;
+	struct scan_bss *bss = station->connected_bss;
+	bool transient;
+
+	l_debug("%u", netdev_get_ifindex(station->netdev));
+
+	if (station->connect_pending) {
+		station_connect_cb(station->netdev,
+					NETDEV_RESULT_HANDSHAKE_FAILED,
+					event_data, station);
+		return;
+	}
+
+	transient = station->state == STATION_STATE_CONNECTED &&
+			station_disconnect_is_transient(event,
+						l_get_u16(event_data));
+
+	station_disassociated(station);
+
+	if (transient && station_is_autoconnecting(station))
+		station_fast_reconnect(station, network, bss);
+}
+
+static void station_roam_timeout_rearm(struct station *station, int seconds);
+static int station_roam_scan(struct station *station,
+				struct scan_freq_set *freq_set);
 
 static uint32_t station_freq_from_neighbor_report(const uint8_t *country,
 		struct ie_neighbor_report_info *info, enum scan_band *out_band)
@@ -1433,13 +2611,11 @@ static void parse_neighbor_report(struct station *station,
 {
 	struct ie_tlv_iter iter;
 	int count_md = 0, count_no_md = 0;
-	struct scan_freq_set *freq_set_md, *freq_set_no_md;
+	struct scan_freq_set freq_set_md = {};
+	struct scan_freq_set freq_set_no_md = {};
 	uint32_t current_freq = 0;
 	struct handshake_state *hs = netdev_get_handshake(station->netdev);
 
-	freq_set_md = scan_freq_set_new();
-	freq_set_no_md = scan_freq_set_new();
-
 	ie_tlv_iter_init(&iter, reports, reports_len);
 
 	/* First see if any of the reports contain the MD bit set */
@@ -1487,11 +2663,11 @@ static void parse_neighbor_report(struct station *station,
 
 		/* Add the frequency to one of the lists */
 		if (info.md && hs->mde) {
-			scan_freq_set_add(freq_set_md, freq);
+			scan_freq_set_add(&freq_set_md, freq);
 
 			count_md += 1;
 		} else {
-			scan_freq_set_add(freq_set_no_md, freq);
+			scan_freq_set_add(&freq_set_no_md, freq);
 
 			count_no_md += 1;
 		}
@@ -1522,18 +2698,27 @@ static void parse_neighbor_report(struct station *station,
 	 * full scan.
 	 */
 	if (count_md) {
-		scan_freq_set_add(freq_set_md, current_freq);
-		*set = freq_set_md;
-		scan_freq_set_free(freq_set_no_md);
+		scan_freq_set_add(&freq_set_md, current_freq);
+		*set = l_memdup(&freq_set_md, sizeof(freq_set_md));
 	} else if (count_no_md) {
-		scan_freq_set_add(freq_set_no_md, current_freq);
-		*set = freq_set_no_md;
-		scan_freq_set_free(freq_set_md);
-	} else {
-		scan_freq_set_free(freq_set_no_md);
-		scan_freq_set_free(freq_set_md);
+		scan_freq_set_add(&freq_set_no_md, current_freq);
+		*set = l_memdup(&freq_set_no_md, sizeof(freq_set_no_md));
+	} else
 		*set = NULL;
-	}
+}
+
+static void station_remember_neighbor_freqs(struct station *station,
+					const struct scan_freq_set *freqs)
+{
+	struct network_info *info;
+
+	if (!freqs || !station->connected_network)
+		return;
+
+	info = (struct network_info *)
+		network_get_info(station->connected_network);
+	if (info)
+		known_network_set_neighbor_frequencies(info, freqs);
 }
 
 static void station_early_neighbor_report_cb(struct netdev *netdev, int err,
@@ -1552,6 +2737,7 @@ static void station_early_neighbor_report_cb(struct netdev *netdev, int err,
 
 	parse_neighbor_report(station, reports, reports_len,
 				&station->roam_freqs);
+	station_remember_neighbor_freqs(station, station->roam_freqs);
 }
 
 static void station_roamed(struct station *station)
@@ -1563,7 +2749,8 @@ static void station_roamed(struct station *station)
 	 * remain low. A subsequent high signal notification will cancel it.
 	 */
 	if (station->signal_low)
-		station_roam_timeout_rearm(station, roam_retry_interval);
+		station_roam_timeout_rearm(station,
+					station_roam_retry_interval(station));
 
 	if (station->netconfig)
 		netconfig_reconfigure(station->netconfig);
@@ -1582,6 +2769,24 @@ static void station_roamed(struct station *station)
 	station_enter_state(station, STATION_STATE_CONNECTED);
 }
 
+#define WNM_BTM_STATUS_ACCEPT				0
+#define WNM_BTM_STATUS_REJECT_NO_CANDIDATES		7
+
+/* Answer the BSS Transition Management Request we're acting on, if any */
+static void station_btm_respond(struct station *station, uint8_t status,
+				const uint8_t *target)
+{
+	if (!station->btm_response_pending)
+		return;
+
+	station->btm_response_pending = false;
+
+	if (netdev_bss_transition_response(station->netdev,
+						station->btm_dialog_token,
+						status, target) < 0)
+		l_warn("Could not send BSS Transition Response");
+}
+
 static void station_roam_retry(struct station *station)
 {
 	/*
@@ -1593,8 +2798,11 @@ static void station_roam_retry(struct station *station)
 	station->roam_scan_full = false;
 	station->ap_directed_roaming = false;
 
+	station_timeline_finish(station, false);
+
 	if (station->signal_low)
-		station_roam_timeout_rearm(station, roam_retry_interval);
+		station_roam_timeout_rearm(station,
+					station_roam_retry_interval(station));
 }
 
 static void station_roam_failed(struct station *station)
@@ -1614,8 +2822,12 @@ static void station_roam_failed(struct station *station)
 	 * We were told by the AP to roam, but failed.  Try ourselves or
 	 * wait for the AP to tell us to roam again
 	 */
-	if (station->ap_directed_roaming)
+	if (station->ap_directed_roaming) {
+		station_btm_respond(station,
+					WNM_BTM_STATUS_REJECT_NO_CANDIDATES,
+					NULL);
 		goto delayed_retry;
+	}
 
 	/*
 	 * If we tried a limited scan, failed and the signal is still low,
@@ -1697,6 +2909,11 @@ static void station_transition_reassociate(struct station *station,
 						struct scan_bss *bss,
 						struct handshake_state *new_hs)
 {
+	/* Unless this follows a preauthentication */
+	if (station->timeline && !station->timeline->method)
+		station_timeline_set_method(station,
+					DIAGNOSTIC_ROAM_METHOD_REASSOCIATION);
+
 	if (netdev_reassociate(station->netdev, bss, station->connected_bss,
 				new_hs, station_netdev_event,
 				station_reassociate_cb, station) < 0) {
@@ -1737,7 +2954,7 @@ static void station_fast_transition_ds_cb(struct netdev *netdev,
 	 */
 
 	/* Make sure we still have our BSS */
-	bss = l_queue_find(station->bss_list, bss_match_bssid, bssid);
+	bss = l_hashtab_lookup(station->bss_index, bssid);
 	if (!bss)
 		goto failed;
 
@@ -1771,8 +2988,7 @@ static void station_preauthenticate_cb(struct netdev *netdev,
 	if (!station->preparing_roam || result == NETDEV_RESULT_ABORTED)
 		return;
 
-	bss = l_queue_find(station->bss_list, bss_match_bssid,
-				station->preauth_bssid);
+	bss = l_hashtab_lookup(station->bss_index, station->preauth_bssid);
 	if (!bss) {
 		l_error("Roam target BSS not found");
 		station_roam_failed(station);
@@ -1789,8 +3005,6 @@ static void station_preauthenticate_cb(struct netdev *netdev,
 
 	if (result == NETDEV_RESULT_OK) {
 		uint8_t pmkid[16];
-		uint8_t rsne_buf[300];
-		struct ie_rsn_info rsn_info;
 
 		handshake_state_set_pmk(new_hs, pmk, 32);
 		handshake_state_set_authenticator_address(new_hs,
@@ -1805,17 +3019,8 @@ static void station_preauthenticate_cb(struct netdev *netdev,
 		 * target_rsne->preauthentication would have been false in
 		 * station_transition_start.
 		 */
-		ie_parse_rsne_from_data(new_hs->supplicant_ie,
-					new_hs->supplicant_ie[1] + 2,
-					&rsn_info);
-
 		handshake_state_get_pmkid(new_hs, pmkid);
-
-		rsn_info.num_pmkids = 1;
-		rsn_info.pmkids = pmkid;
-
-		ie_build_rsne(&rsn_info, rsne_buf);
-		handshake_state_set_supplicant_ie(new_hs, rsne_buf);
+		station_handshake_set_pmkid(new_hs, pmkid);
 	}
 
 	station_transition_reassociate(station, bss, new_hs);
@@ -1834,6 +3039,12 @@ static void station_transition_start(struct station *station,
 	l_debug("%u, target %s", netdev_get_ifindex(station->netdev),
 			util_address_to_string(bss->addr));
 
+	station_timeline_start(station, bss->addr, true);
+	station_timeline_mark(station, DIAGNOSTIC_PHASE_AUTHENTICATE);
+	memcpy(station->timeline->addr, bss->addr, 6);
+
+	station_btm_respond(station, WNM_BTM_STATUS_ACCEPT, bss->addr);
+
 	/* Reset AP roam flag, at this point the roaming behaves the same */
 	station->ap_directed_roaming = false;
 
@@ -1841,8 +3052,13 @@ static void station_transition_start(struct station *station,
 		ie_parse_mobility_domain_from_data(hs->mde, hs->mde[1] + 2,
 							&mdid, NULL, NULL);
 
-	/* Can we use Fast Transition? */
-	if (hs->mde && bss->mde_present && l_get_le16(bss->mde) == mdid) {
+	/*
+	 * Can we use Fast Transition?  Not if SAE was offloaded, the PMK
+	 * needed to derive the FT key hierarchy never left the firmware and
+	 * a reassociation lets the firmware run SAE with the target instead.
+	 */
+	if (hs->mde && bss->mde_present && l_get_le16(bss->mde) == mdid &&
+			!(IE_AKM_IS_SAE(hs->akm_suite) && !hs->have_pmk)) {
 		/* Rebuild handshake RSN for target AP */
 		if (station_build_handshake_rsn(hs, station->wiphy,
 				station->connected_network, bss) < 0) {
@@ -1851,9 +3067,21 @@ static void station_transition_start(struct station *station,
 			return;
 		}
 
+		/* FT-over-DS exchange with this target already done */
+		if (netdev_fast_transition_over_ds(station->netdev, bss,
+					station_fast_transition_cb) == 0) {
+			l_debug("Using prepared FT-over-DS");
+			station_timeline_set_method(station,
+					DIAGNOSTIC_ROAM_METHOD_FT_OVER_DS);
+			goto ft_started;
+		}
+
 		/* FT-over-DS can be better suited for these situations */
 		if ((hs->mde[4] & 1) && (station->ap_directed_roaming ||
 				station->signal_low)) {
+			station_timeline_set_method(station,
+					DIAGNOSTIC_ROAM_METHOD_FT_OVER_DS);
+
 			if (netdev_fast_transition_over_ds_action(
 					station->netdev, bss,
 					station_fast_transition_ds_cb,
@@ -1867,6 +3095,9 @@ static void station_transition_start(struct station *station,
 			 */
 			return;
 		} else {
+			station_timeline_set_method(station,
+					DIAGNOSTIC_ROAM_METHOD_FT_OVER_AIR);
+
 			if (netdev_fast_transition(station->netdev, bss,
 					station_fast_transition_cb) < 0) {
 				station_roam_failed(station);
@@ -1874,6 +3105,7 @@ static void station_transition_start(struct station *station,
 			}
 		}
 
+ft_started:
 		station->connected_bss = bss;
 		station->preparing_roam = false;
 		station_enter_state(station, STATION_STATE_ROAMING);
@@ -1883,14 +3115,23 @@ static void station_transition_start(struct station *station,
 
 	/* Non-FT transition */
 
+	new_hs = station_handshake_setup(station, connected, bss);
+	if (!new_hs) {
+		l_error("station_handshake_setup failed in reassociation");
+		station_roam_failed(station);
+		return;
+	}
+
 	/*
-	 * FT not available, we can try preauthentication if available.
+	 * If we could set up a PMK for the target from the PMKSA cache,
+	 * possibly through OKC, just reassociate.  Otherwise, FT not being
+	 * available, we can try preauthentication if available.
 	 * 802.11-2012 section 11.5.9.2:
 	 * "A STA shall not use preauthentication within the same mobility
 	 * domain if AKM suite type 00-0F-AC:3 or 00-0F-AC:4 is used in
 	 * the current association."
 	 */
-	if (security == SECURITY_8021X &&
+	if (security == SECURITY_8021X && !new_hs->have_pmk &&
 			scan_bss_get_rsn_info(station->connected_bss,
 						&cur_rsne) >= 0 &&
 			scan_bss_get_rsn_info(bss, &target_rsne) >= 0 &&
@@ -1905,18 +3146,15 @@ static void station_transition_start(struct station *station,
 		 * Remain in the preparing_roam state.
 		 */
 		memcpy(station->preauth_bssid, bss->addr, ETH_ALEN);
+		station_timeline_set_method(station,
+				DIAGNOSTIC_ROAM_METHOD_PREAUTHENTICATION);
 
 		if (netdev_preauthenticate(station->netdev, bss,
 						station_preauthenticate_cb,
-						station) >= 0)
+						station) >= 0) {
+			handshake_state_free(new_hs);
 			return;
-	}
-
-	new_hs = station_handshake_setup(station, connected, bss);
-	if (!new_hs) {
-		l_error("station_handshake_setup failed in reassociation");
-		station_roam_failed(station);
-		return;
+		}
 	}
 
 	station_transition_reassociate(station, bss, new_hs);
@@ -1937,21 +3175,133 @@ static void station_roam_scan_triggered(int err, void *user_data)
 	 */
 }
 
+static int8_t station_current_rssi(struct station *station)
+{
+	if (!station->rssi_history_len)
+		return station->connected_bss->signal_strength / 100;
+
+	return station->rssi_history[station->rssi_history_len - 1].rssi;
+}
+
+/*
+ * Checks whether the BSS is part of the connected ESS and, if so, whether
+ * it is a usable roam target and its rank.  BSSes within the FT Mobility
+ * Domain are favored so as to use Fast Roaming, if it is supported.
+ */
+static bool station_roam_candidate(struct station *station,
+					struct scan_bss *bss, bool *seen,
+					double *out_rank)
+{
+	static const double RANK_FT_FACTOR = 1.3;
+	struct network *network = station->connected_network;
+	struct handshake_state *hs = netdev_get_handshake(station->netdev);
+	enum security security;
+	struct ie_rsn_info info;
+	uint16_t mdid;
+	int r;
+
+	/* Skip the BSS we are connected to if doing an AP roam */
+	if (station->ap_directed_roaming && !memcmp(bss->addr,
+			station->connected_bss->addr, 6))
+		return false;
+
+	/* Skip result if it is not part of the ESS */
+
+	if (bss->ssid_len != hs->ssid_len ||
+			memcmp(bss->ssid, hs->ssid, hs->ssid_len))
+		return false;
+
+	memset(&info, 0, sizeof(info));
+	r = scan_bss_get_rsn_info(bss, &info);
+	if (r < 0) {
+		if (r != -ENOENT)
+			return false;
+
+		security = security_determine(bss->capability, NULL);
+	} else
+		security = security_determine(bss->capability, &info);
+
+	if (security != network_get_security(network))
+		return false;
+
+	*seen = true;
+
+	if (!wiphy_can_connect(station->wiphy, bss,
+				network_has_erp_identity(network)))
+		return false;
+
+	if (blacklist_contains_bss(bss->addr))
+		return false;
+
+	*out_rank = bss->rank;
+
+	if (hs->mde && bss->mde_present) {
+		ie_parse_mobility_domain_from_data(hs->mde, hs->mde[1] + 2,
+							&mdid, NULL, NULL);
+
+		if (l_get_le16(bss->mde) == mdid)
+			*out_rank *= RANK_FT_FACTOR;
+	}
+
+	return true;
+}
+
+/*
+ * Scans done while connected, for D-Bus clients or hidden networks, go
+ * through station_set_scan_results and leave the BSSes of the ESS in
+ * bss_list.  If one of
+ * them was seen recently and is clearly stronger than the current BSS, a
+ * roam can go ahead without scanning first.
+ */
+static struct scan_bss *station_roam_cached_candidate(struct station *station,
+							uint16_t *candidates)
+{
+	const struct l_queue_entry *entry;
+	struct scan_bss *best_bss = NULL;
+	double best_bss_rank = 0.0;
+	uint64_t now = l_time_now();
+	bool seen;
+
+	for (entry = l_queue_get_entries(station->bss_list); entry;
+			entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+		double rank;
+
+		if (scan_bss_addr_eq(bss, station->connected_bss))
+			continue;
+
+		if (l_time_after(now, bss->time_stamp + ROAM_CANDIDATE_MAX_AGE))
+			continue;
+
+		if (bss->signal_strength / 100 < station_current_rssi(station) +
+				ROAM_CANDIDATE_MIN_GAIN)
+			continue;
+
+		if (!station_roam_candidate(station, bss, &seen, &rank))
+			continue;
+
+		*candidates += 1;
+
+		if (rank > best_bss_rank) {
+			best_bss = bss;
+			best_bss_rank = rank;
+		}
+	}
+
+	return best_bss;
+}
+
 static bool station_roam_scan_notify(int err, struct l_queue *bss_list,
 					const struct scan_freq_set *freqs,
 					void *userdata)
 {
 	struct station *station = userdata;
 	struct network *network = station->connected_network;
-	struct handshake_state *hs = netdev_get_handshake(station->netdev);
 	struct scan_bss *bss;
 	struct scan_bss *best_bss = NULL;
 	double best_bss_rank = 0.0;
-	static const double RANK_FT_FACTOR = 1.3;
-	uint16_t mdid;
-	enum security orig_security, security;
 	bool seen = false;
-	bool fils_hint = network_has_erp_identity(network);
+	uint16_t candidates = 0;
 
 	if (err) {
 		station_roam_failed(station);
@@ -1964,60 +3314,16 @@ static bool station_roam_scan_notify(int err, struct l_queue *bss_list,
 	 * list in its station->networks entry.
 	 */
 
-	orig_security = network_get_security(network);
-
-	if (hs->mde)
-		ie_parse_mobility_domain_from_data(hs->mde, hs->mde[1] + 2,
-							&mdid, NULL, NULL);
-
-	/*
-	 * BSSes in the bss_list come already ranked with their initial
-	 * association preference rank value.  We only need to add preference
-	 * for BSSes that are within the FT Mobility Domain so as to favor
-	 * Fast Roaming, if it is supported.
-	 */
-
 	while ((bss = l_queue_pop_head(bss_list))) {
 		double rank;
-		struct ie_rsn_info info;
-		int r;
-
-		/* Skip the BSS we are connected to if doing an AP roam */
-		if (station->ap_directed_roaming && !memcmp(bss->addr,
-				station->connected_bss->addr, 6))
-			goto next;
-
-		/* Skip result if it is not part of the ESS */
-
-		if (bss->ssid_len != hs->ssid_len ||
-				memcmp(bss->ssid, hs->ssid, hs->ssid_len))
-			goto next;
-
-		memset(&info, 0, sizeof(info));
-		r = scan_bss_get_rsn_info(bss, &info);
-		if (r < 0) {
-			if (r != -ENOENT)
-				goto next;
-
-			security = security_determine(bss->capability, NULL);
-		} else
-			security = security_determine(bss->capability, &info);
 
-		if (security != orig_security)
-			goto next;
-
-		seen = true;
-
-		if (!wiphy_can_connect(station->wiphy, bss, fils_hint))
-			goto next;
-
-		if (blacklist_contains_bss(bss->addr))
-			goto next;
-
-		rank = bss->rank;
+		if (!station_roam_candidate(station, bss, &seen, &rank)) {
+			scan_bss_free(bss);
+			continue;
+		}
 
-		if (hs->mde && bss->mde_present && l_get_le16(bss->mde) == mdid)
-			rank *= RANK_FT_FACTOR;
+		if (!scan_bss_addr_eq(bss, station->connected_bss))
+			candidates++;
 
 		if (rank > best_bss_rank) {
 			if (best_bss)
@@ -2029,12 +3335,14 @@ static bool station_roam_scan_notify(int err, struct l_queue *bss_list,
 			continue;
 		}
 
-next:
 		scan_bss_free(bss);
 	}
 
 	l_queue_destroy(bss_list, NULL);
 
+	if (station->timeline)
+		station->timeline->candidates = candidates;
+
 	if (!seen)
 		goto fail_free_bss;
 
@@ -2042,6 +3350,20 @@ next:
 	if (!best_bss || scan_bss_addr_eq(best_bss, station->connected_bss))
 		goto fail_free_bss;
 
+	/*
+	 * A roam prepared from the RSSI trend, before the signal actually
+	 * dropped below the threshold, is only worth it for a clearly
+	 * stronger BSS.
+	 */
+	if (!station->signal_low && !station->ap_directed_roaming &&
+			station->roam_predicted_time &&
+			best_bss->signal_strength / 100 <
+			station_current_rssi(station) +
+			ROAM_CANDIDATE_MIN_GAIN) {
+		l_debug("No BSS clearly better than the current one");
+		goto fail_free_bss;
+	}
+
 	bss = network_bss_find_by_addr(network, best_bss->addr);
 	if (bss) {
 		scan_bss_free(best_bss);
@@ -2049,6 +3371,7 @@ next:
 	} else {
 		network_bss_add(network, best_bss);
 		l_queue_push_tail(station->bss_list, best_bss);
+		station_bss_index_add(station->bss_index, best_bss);
 	}
 
 	station_transition_start(station, best_bss);
@@ -2074,17 +3397,28 @@ static void station_roam_scan_destroy(void *userdata)
 static int station_roam_scan(struct station *station,
 				struct scan_freq_set *freq_set)
 {
-	struct scan_parameters params = { .freqs = freq_set, .flush = true };
+	struct scan_parameters params = {
+		.freqs = freq_set,
+		.flush = true,
+		/* Keep the time spent off our operating channel short */
+		.low_span = true,
+		.sliced = true,
+	};
 
 	l_debug("ifindex: %u", netdev_get_ifindex(station->netdev));
 
-	if (station->connected_network)
-		/* Use direct probe request */
+	if (station->connected_network) {
+		/* Use direct probe request, only our ESS is of interest */
 		params.ssid = network_get_ssid(station->connected_network);
+		params.ssid_only = true;
+	}
 
 	if (!freq_set)
 		station->roam_scan_full = true;
 
+	station_timeline_start(station, station->connected_bss->addr, true);
+	station_timeline_mark(station, DIAGNOSTIC_PHASE_SCAN);
+
 	station->roam_scan_id =
 		scan_active_full(netdev_get_wdev_id(station->netdev), &params,
 					station_roam_scan_triggered,
@@ -2145,6 +3479,7 @@ static void station_neighbor_report_cb(struct netdev *netdev, int err,
 	}
 
 	parse_neighbor_report(station, reports, reports_len, &freq_set);
+	station_remember_neighbor_freqs(station, freq_set);
 
 	r = station_roam_scan(station, freq_set);
 
@@ -2158,6 +3493,8 @@ static void station_neighbor_report_cb(struct netdev *netdev, int err,
 static void station_roam_trigger_cb(struct l_timeout *timeout, void *user_data)
 {
 	struct station *station = user_data;
+	struct scan_bss *bss;
+	uint16_t candidates = 0;
 	int r;
 
 	l_debug("%u", netdev_get_ifindex(station->netdev));
@@ -2166,6 +3503,16 @@ static void station_roam_trigger_cb(struct l_timeout *timeout, void *user_data)
 	station->roam_trigger_timeout = NULL;
 	station->preparing_roam = true;
 
+	bss = station_roam_cached_candidate(station, &candidates);
+	if (bss) {
+		l_debug("Roaming to %s from earlier scan results",
+				util_address_to_string(bss->addr));
+		station_timeline_start(station, bss->addr, true);
+		station->timeline->candidates = candidates;
+		station_transition_start(station, bss);
+		return;
+	}
+
 	/*
 	 * If current BSS supports Neighbor Reports, narrow the scan down
 	 * to channels occupied by known neighbors in the ESS. If no neighbor
@@ -2214,120 +3561,469 @@ static void station_roam_timeout_rearm(struct station *station, int seconds)
 	seconds = station->roam_min_time.tv_sec - now.tv_sec +
 		(station->roam_min_time.tv_nsec > now.tv_nsec ? 1 : 0);
 
-	station->roam_trigger_timeout =
-		l_timeout_create(seconds, station_roam_trigger_cb,
-								station, NULL);
+	station->roam_trigger_timeout =
+		l_timeout_create(seconds, station_roam_trigger_cb,
+								station, NULL);
+}
+
+static bool station_cannot_roam(struct station *station)
+{
+	const struct l_settings *config = iwd_get_config();
+	bool disabled;
+
+	/*
+	 * Disable roaming with hardware that can roam automatically. Note this
+	 * is now required for recent kernels which have CQM event support on
+	 * this type of hardware (e.g. brcmfmac).
+	 */
+	if (wiphy_supports_firmware_roam(station->wiphy))
+		return true;
+
+	if (!l_settings_get_bool(config, "Scan", "DisableRoamingScan",
+								&disabled))
+		disabled = false;
+
+	return disabled || station->preparing_roam ||
+					station->state == STATION_STATE_ROAMING;
+}
+
+#define WNM_REQUEST_MODE_PREFERRED_CANDIDATE_LIST	(1 << 0)
+#define WNM_REQUEST_MODE_TERMINATION_IMMINENT		(1 << 3)
+#define WNM_REQUEST_MODE_ESS_DISASSOCIATION_IMMINENT	(1 << 4)
+
+/*
+ * Picks the BSS to go to from the candidate list of a BSS Transition
+ * Management Request among the ones seen in recent scans, by the AP's
+ * preference and then by our own rank.  Saves a scan when the AP wants us
+ * gone soon.
+ */
+static struct scan_bss *station_btm_cached_candidate(struct station *station,
+						const uint8_t *list,
+						size_t list_len,
+						uint16_t *candidates)
+{
+	struct ie_tlv_iter iter;
+	struct scan_bss *best_bss = NULL;
+	int best_pref = -1;
+	double best_rank = 0.0;
+	uint64_t now = l_time_now();
+	bool seen;
+
+	ie_tlv_iter_init(&iter, list, list_len);
+
+	while (ie_tlv_iter_next(&iter)) {
+		struct ie_neighbor_report_info info;
+		struct scan_bss *bss;
+		double rank;
+		int pref = 0;
+
+		if (ie_tlv_iter_get_tag(&iter) != IE_TYPE_NEIGHBOR_REPORT)
+			continue;
+
+		if (ie_parse_neighbor_report(&iter, &info) < 0)
+			continue;
+
+		/* A preference of 0 means the AP doesn't want us there */
+		if (info.bss_transition_pref_present) {
+			if (!info.bss_transition_pref)
+				continue;
+
+			pref = info.bss_transition_pref;
+		}
+
+		bss = l_hashtab_lookup(station->bss_index, info.addr);
+		if (!bss || l_time_after(now, bss->time_stamp +
+						ROAM_CANDIDATE_MAX_AGE))
+			continue;
+
+		if (!station_roam_candidate(station, bss, &seen, &rank))
+			continue;
+
+		*candidates += 1;
+
+		if (pref > best_pref || (pref == best_pref &&
+						rank > best_rank)) {
+			best_bss = bss;
+			best_pref = pref;
+			best_rank = rank;
+		}
+	}
+
+	return best_bss;
+}
+
+static void station_ap_directed_roam(struct station *station,
+					const struct mmpdu_header *hdr,
+					const void *body, size_t body_len)
+{
+	uint32_t pos = 0;
+	uint8_t dialog_token;
+	uint8_t req_mode;
+	uint16_t dtimer;
+	uint8_t valid_interval;
+	struct scan_bss *bss;
+	uint16_t candidates = 0;
+
+	l_debug("ifindex: %u", netdev_get_ifindex(station->netdev));
+
+	if (station_cannot_roam(station))
+		return;
+
+	if (body_len < 7)
+		goto format_error;
+
+	/*
+	 * First two bytes are checked by the frame watch (WNM category and
+	 * WNM action). The third is the dialog token, echoed in our response.
+	 */
+	pos += 2;
+	dialog_token = l_get_u8(body + pos);
+	pos++;
+
+	req_mode = l_get_u8(body + pos);
+	pos++;
+
+	/*
+	 * TODO: Disassociation timer and validity interval are currently not
+	 * used since the BSS transition request is being handled immediately.
+	 */
+	dtimer = l_get_le16(body + pos);
+	pos += 2;
+	valid_interval = l_get_u8(body + pos);
+	pos++;
+
+	l_debug("roam: BSS transition received from AP: "
+			"Disassociation Time: %u, "
+			"Validity interval: %u", dtimer, valid_interval);
+
+	/* check req_mode for optional values */
+	if (req_mode & WNM_REQUEST_MODE_TERMINATION_IMMINENT) {
+		if (pos + 12 > body_len)
+			goto format_error;
+
+		pos += 12;
+	}
+
+	if (req_mode & WNM_REQUEST_MODE_ESS_DISASSOCIATION_IMMINENT ) {
+		uint8_t url_len;
+
+		if (pos + 1 > body_len)
+			goto format_error;
+
+		url_len = l_get_u8(body + pos);
+		pos++;
+
+		if (pos + url_len > body_len)
+			goto format_error;
+
+		pos += url_len;
+	}
+
+	station->ap_directed_roaming = true;
+	station->preparing_roam = true;
+	station->btm_dialog_token = dialog_token;
+	station->btm_response_pending = true;
+
+	l_timeout_remove(station->roam_trigger_timeout);
+	station->roam_trigger_timeout = NULL;
+
+	if (req_mode & WNM_REQUEST_MODE_PREFERRED_CANDIDATE_LIST) {
+		l_debug("roam: AP sent a preferred candidate list");
+
+		bss = station_btm_cached_candidate(station, body + pos,
+							body_len - pos,
+							&candidates);
+		if (bss) {
+			l_debug("roam: Going to %s from earlier scan results",
+					util_address_to_string(bss->addr));
+			station_timeline_start(station, bss->addr, true);
+			station->timeline->candidates = candidates;
+			station_transition_start(station, bss);
+			return;
+		}
+
+		station_neighbor_report_cb(station->netdev, 0, body + pos,
+				body_len - pos,station);
+	} else {
+		l_debug("roam: AP did not include a preferred candidate list");
+		if (station_roam_scan(station, NULL) < 0)
+			station_roam_failed(station);
+	}
+
+	return;
+
+format_error:
+	l_debug("bad AP roam frame formatting");
+}
+
+static void station_rssi_trend_check(struct station *station)
+{
+	const struct rssi_sample *last;
+	double mean_t = 0, mean_rssi = 0, num = 0, den = 0;
+	double slope;
+	uint64_t base;
+	uint64_t now = l_time_now();
+	uint8_t i;
+
+	if (station->rssi_history_len < RSSI_TREND_MIN_SAMPLES)
+		return;
+
+	if (station->signal_low || station->roam_trigger_timeout ||
+			station_cannot_roam(station))
+		return;
+
+	if (station->roam_predicted_time &&
+			l_time_diff(station->roam_predicted_time, now) <
+			station_roam_retry_interval(station) * L_USEC_PER_SEC)
+		return;
+
+	/* Least squares fit of the RSSI over time, in dB per second */
+	base = station->rssi_history[0].time;
+
+	for (i = 0; i < station->rssi_history_len; i++) {
+		const struct rssi_sample *sample = &station->rssi_history[i];
+
+		mean_t += (double) (sample->time - base) / L_USEC_PER_SEC;
+		mean_rssi += sample->rssi;
+	}
+
+	mean_t /= station->rssi_history_len;
+	mean_rssi /= station->rssi_history_len;
+
+	for (i = 0; i < station->rssi_history_len; i++) {
+		const struct rssi_sample *sample = &station->rssi_history[i];
+		double dt = (double) (sample->time - base) / L_USEC_PER_SEC -
+				mean_t;
+
+		num += dt * (sample->rssi - mean_rssi);
+		den += dt * dt;
+	}
+
+	if (den == 0)
+		return;
+
+	slope = num / den;
+	last = &station->rssi_history[station->rssi_history_len - 1];
+
+	if (slope > RSSI_TREND_MIN_SLOPE ||
+			last->rssi + slope * RSSI_TREND_HORIZON >=
+			station_roam_threshold(station))
+		return;
+
+	l_debug("RSSI %i falling at %.1f dB/s, preparing roam early",
+			last->rssi, slope);
+
+	station->roam_predicted_time = now;
+	station_roam_timeout_rearm(station, 1);
+}
+
+#define FT_PREWARM_CANDIDATES	3
+
+/*
+ * While the link is still good run the FT-over-DS exchange with the best
+ * few candidates of the mobility domain seen in recent scans, so that a
+ * later roam to one of them is a single reassociation.  netdev keeps the
+ * results until they expire and refuses to repeat a still valid one.
+ */
+static void station_ft_prewarm(struct station *station)
+{
+	struct handshake_state *hs = netdev_get_handshake(station->netdev);
+	struct scan_bss *top[FT_PREWARM_CANDIDATES] = {};
+	double top_rank[FT_PREWARM_CANDIDATES] = {};
+	const struct l_queue_entry *entry;
+	uint64_t now = l_time_now();
+	uint16_t mdid;
+	bool seen;
+	int i, j;
+
+	if (!ft_prewarm || station->signal_low || station->preparing_roam)
+		return;
+
+	/* Only if the current AP supports FT-over-DS */
+	if (!hs->mde || !(hs->mde[4] & 1))
+		return;
+
+	ie_parse_mobility_domain_from_data(hs->mde, hs->mde[1] + 2,
+						&mdid, NULL, NULL);
+
+	for (entry = l_queue_get_entries(station->bss_list); entry;
+			entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+		double rank;
+
+		if (scan_bss_addr_eq(bss, station->connected_bss) ||
+				!bss->mde_present ||
+				l_get_le16(bss->mde) != mdid)
+			continue;
+
+		if (l_time_after(now, bss->time_stamp + ROAM_CANDIDATE_MAX_AGE))
+			continue;
+
+		if (!station_roam_candidate(station, bss, &seen, &rank))
+			continue;
+
+		for (i = 0; i < FT_PREWARM_CANDIDATES; i++)
+			if (!top[i] || rank > top_rank[i])
+				break;
+
+		if (i == FT_PREWARM_CANDIDATES)
+			continue;
+
+		for (j = FT_PREWARM_CANDIDATES - 1; j > i; j--) {
+			top[j] = top[j - 1];
+			top_rank[j] = top_rank[j - 1];
+		}
+
+		top[i] = bss;
+		top_rank[i] = rank;
+	}
+
+	for (i = 0; i < FT_PREWARM_CANDIDATES && top[i]; i++)
+		if (!netdev_fast_transition_over_ds_action(station->netdev,
+							top[i], NULL, NULL))
+			l_debug("Preparing FT-over-DS to %s",
+				util_address_to_string(top[i]->addr));
+}
+
+static void station_get_diagnostic_cb(
+				const struct diagnostic_station_info *info,
+				void *user_data);
+static void station_get_diagnostic_destroy(void *user_data);
+
+static void station_rssi_trend_sample(struct station *station,
+				const struct diagnostic_station_info *info)
+{
+	struct rssi_sample *sample;
+
+	if (!info || !info->have_cur_rssi ||
+			station->state != STATION_STATE_CONNECTED)
+		return;
+
+	/* Keep the samples oldest first, dropping the oldest when full */
+	if (station->rssi_history_len == RSSI_TREND_SAMPLES)
+		memmove(station->rssi_history, station->rssi_history + 1,
+			sizeof(struct rssi_sample) * (RSSI_TREND_SAMPLES - 1));
+	else
+		station->rssi_history_len++;
+
+	sample = &station->rssi_history[station->rssi_history_len - 1];
+	sample->time = l_time_now();
+	sample->rssi = info->cur_rssi;
+
+	station_rssi_trend_check(station);
+	station_ft_prewarm(station);
 }
 
-static bool station_cannot_roam(struct station *station)
+static void station_emit_stats(struct station *station,
+				const struct diagnostic_station_info *info);
+
+/*
+ * One GET_STATION request at a time serves the RSSI trend, GetDiagnostics
+ * and the Statistics signal, whichever of them want a result when it
+ * comes back.
+ */
+static void station_sta_info_cb(const struct diagnostic_station_info *info,
+					void *user_data)
 {
-	const struct l_settings *config = iwd_get_config();
-	bool disabled;
+	struct station *station = user_data;
 
-	/*
-	 * Disable roaming with hardware that can roam automatically. Note this
-	 * is now required for recent kernels which have CQM event support on
-	 * this type of hardware (e.g. brcmfmac).
-	 */
-	if (wiphy_supports_firmware_roam(station->wiphy))
-		return true;
+	if (station->get_station_pending)
+		station_get_diagnostic_cb(info, station);
 
-	if (!l_settings_get_bool(config, "Scan", "DisableRoamingScan",
-								&disabled))
-		disabled = false;
+	if (station->stats_signal_pending) {
+		station->stats_signal_pending = false;
+		station_emit_stats(station, info);
+	}
 
-	return disabled || station->preparing_roam ||
-					station->state == STATION_STATE_ROAMING;
+	if (station->rssi_sample_pending) {
+		station->rssi_sample_pending = false;
+		station_rssi_trend_sample(station, info);
+	}
 }
 
-#define WNM_REQUEST_MODE_PREFERRED_CANDIDATE_LIST	(1 << 0)
-#define WNM_REQUEST_MODE_TERMINATION_IMMINENT		(1 << 3)
-#define WNM_REQUEST_MODE_ESS_DISASSOCIATION_IMMINENT	(1 << 4)
-
-static void station_ap_directed_roam(struct station *station,
-					const struct mmpdu_header *hdr,
-					const void *body, size_t body_len)
+static void station_sta_info_destroy(void *user_data)
 {
-	uint32_t pos = 0;
-	uint8_t req_mode;
-	uint16_t dtimer;
-	uint8_t valid_interval;
+	struct station *station = user_data;
 
-	l_debug("ifindex: %u", netdev_get_ifindex(station->netdev));
+	station->sta_info_pending = false;
+	station->rssi_sample_pending = false;
+	station->stats_signal_pending = false;
+	station_get_diagnostic_destroy(station);
+}
 
-	if (station_cannot_roam(station))
-		return;
+static int station_sta_info_request(struct station *station)
+{
+	int ret;
 
-	if (body_len < 7)
-		goto format_error;
+	if (station->sta_info_pending)
+		return 0;
 
-	/*
-	 * First two bytes are checked by the frame watch (WNM category and
-	 * WNM action). The third is the dialog token which is not relevant
-	 * because we did not send a BSS transition query -- so skip these
-	 * first three bytes.
-	 */
-	pos += 3;
+	ret = netdev_get_current_station(station->netdev, station_sta_info_cb,
+					station, station_sta_info_destroy);
+	if (ret < 0)
+		return ret;
 
-	req_mode = l_get_u8(body + pos);
-	pos++;
+	station->sta_info_pending = true;
+	return 0;
+}
 
-	/*
-	 * TODO: Disassociation timer and validity interval are currently not
-	 * used since the BSS transition request is being handled immediately.
-	 */
-	dtimer = l_get_le16(body + pos);
-	pos += 2;
-	valid_interval = l_get_u8(body + pos);
-	pos++;
+static void station_rssi_trend_poll(struct l_timeout *timeout,
+					void *user_data)
+{
+	struct station *station = user_data;
 
-	l_debug("roam: BSS transition received from AP: "
-			"Disassociation Time: %u, "
-			"Validity interval: %u", dtimer, valid_interval);
+	if (!station_sta_info_request(station))
+		station->rssi_sample_pending = true;
 
-	/* check req_mode for optional values */
-	if (req_mode & WNM_REQUEST_MODE_TERMINATION_IMMINENT) {
-		if (pos + 12 > body_len)
-			goto format_error;
+	l_timeout_modify(timeout, RSSI_TREND_INTERVAL);
+}
 
-		pos += 12;
-	}
+static void station_rssi_trend_start(struct station *station)
+{
+	station->rssi_history_len = 0;
 
-	if (req_mode & WNM_REQUEST_MODE_ESS_DISASSOCIATION_IMMINENT ) {
-		uint8_t url_len;
+	if (station->rssi_trend_timeout)
+		return;
 
-		if (pos + 1 > body_len)
-			goto format_error;
+	if (wiphy_supports_firmware_roam(station->wiphy))
+		return;
 
-		url_len = l_get_u8(body + pos);
-		pos++;
+	station->rssi_trend_timeout = l_timeout_create(RSSI_TREND_INTERVAL,
+						station_rssi_trend_poll,
+						station, NULL);
+}
 
-		if (pos + url_len > body_len)
-			goto format_error;
+static void station_rssi_trend_stop(struct station *station)
+{
+	l_timeout_remove(station->rssi_trend_timeout);
+	station->rssi_trend_timeout = NULL;
+	station->roam_predicted_time = 0;
+}
 
-		pos += url_len;
-	}
+static void station_stats_poll(struct l_timeout *timeout, void *user_data)
+{
+	struct station *station = user_data;
 
-	station->ap_directed_roaming = true;
-	station->preparing_roam = true;
+	if (!station_sta_info_request(station))
+		station->stats_signal_pending = true;
 
-	l_timeout_remove(station->roam_trigger_timeout);
-	station->roam_trigger_timeout = NULL;
+	l_timeout_modify(timeout, stats_interval);
+}
 
-	if (req_mode & WNM_REQUEST_MODE_PREFERRED_CANDIDATE_LIST) {
-		l_debug("roam: AP sent a preferred candidate list");
-		station_neighbor_report_cb(station->netdev, 0, body + pos,
-				body_len - pos,station);
-	} else {
-		l_debug("roam: AP did not include a preferred candidate list");
-		if (station_roam_scan(station, NULL) < 0)
-			station_roam_failed(station);
-	}
+static void station_stats_start(struct station *station)
+{
+	if (!stats_interval || station->stats_timeout)
+		return;
 
-	return;
+	station->stats_timeout = l_timeout_create(stats_interval,
+						station_stats_poll,
+						station, NULL);
+}
 
-format_error:
-	l_debug("bad AP roam frame formatting");
+static void station_stats_stop(struct station *station)
+{
+	l_timeout_remove(station->stats_timeout);
+	station->stats_timeout = NULL;
 }
 
 static void station_low_rssi(struct station *station)
@@ -2344,13 +4040,16 @@ static void station_low_rssi(struct station *station)
 	station_roam_timeout_rearm(station, 5);
 }
 
+/*
+ * roam_min_time is deliberately kept so that a signal flapping around the
+ * threshold can't trigger roam attempts more often than the retry interval
+ */
 static void station_ok_rssi(struct station *station)
 {
 	l_timeout_remove(station->roam_trigger_timeout);
 	station->roam_trigger_timeout = NULL;
 
 	station->signal_low = false;
-	station->roam_min_time.tv_sec = 0;
 }
 
 static void station_event_roamed(struct station *station, struct scan_bss *new)
@@ -2360,18 +4059,39 @@ static void station_event_roamed(struct station *station, struct scan_bss *new)
 	network_bss_update(station->connected_network, new);
 
 	/* Remove new BSS if it exists in past scan results */
-	stale = l_queue_remove_if(station->bss_list, bss_match_bssid,
-					new->addr);
-	if (stale)
+	stale = l_hashtab_remove(station->bss_index, new->addr);
+	if (stale) {
+		l_queue_remove(station->bss_list, stale);
 		scan_bss_free(stale);
+	}
 
 	station->connected_bss = new;
 
 	l_queue_insert(station->bss_list, new, scan_bss_rank_compare, NULL);
+	station_bss_index_add(station->bss_index, new);
 
 	station_roamed(station);
 }
 
+/*
+ * Keep the connected BSS's frequency current after a Channel Switch
+ * Announcement so that roam scans, neighbor reports and the known
+ * frequencies don't keep using the old channel.
+ */
+static void station_event_channel_switched(struct station *station,
+						uint32_t frequency)
+{
+	struct scan_bss *bss = station->connected_bss;
+
+	if (!bss)
+		return;
+
+	l_debug("Connected BSS "MAC" moved from %u to %u MHz",
+			MAC_STR(bss->addr), bss->frequency, frequency);
+
+	network_bss_set_frequency(station->connected_network, bss, frequency);
+}
+
 static void station_rssi_level_changed(struct station *station,
 					uint8_t level_idx);
 
@@ -2383,13 +4103,15 @@ static void station_netdev_event(struct netdev *netdev, enum netdev_event event,
 	switch (event) {
 	case NETDEV_EVENT_AUTHENTICATING:
 		l_debug("Authenticating");
+		station_timeline_mark(station, DIAGNOSTIC_PHASE_AUTHENTICATE);
 		break;
 	case NETDEV_EVENT_ASSOCIATING:
 		l_debug("Associating");
+		station_timeline_mark(station, DIAGNOSTIC_PHASE_ASSOCIATE);
 		break;
 	case NETDEV_EVENT_DISCONNECT_BY_AP:
 	case NETDEV_EVENT_DISCONNECT_BY_SME:
-		station_disconnect_event(station, event_data);
+		station_disconnect_event(station, event, event_data);
 		break;
 	case NETDEV_EVENT_RSSI_THRESHOLD_LOW:
 		station_low_rssi(station);
@@ -2406,6 +4128,10 @@ static void station_netdev_event(struct netdev *netdev, enum netdev_event event,
 	case NETDEV_EVENT_ROAMED:
 		station_event_roamed(station, (struct scan_bss *) event_data);
 		break;
+	case NETDEV_EVENT_CHANNEL_SWITCHED:
+		station_event_channel_switched(station,
+						l_get_u32(event_data));
+		break;
 	}
 }
 
@@ -2429,6 +4155,25 @@ static bool station_try_next_bss(struct station *station)
 	return true;
 }
 
+static bool station_blacklist_and_try_next_bss(struct station *station)
+{
+	struct network *network = station->connected_network;
+
+	blacklist_add_bss(station->connected_bss->addr);
+
+	if (station_try_next_bss(station))
+		return true;
+
+	/*
+	 * Every BSS of the network has now failed, blacklist the network as
+	 * a whole so that autoconnect skips it without going BSS by BSS
+	 */
+	blacklist_add_network(network_get_ssid(network),
+				network_get_security(network));
+
+	return false;
+}
+
 static bool station_retry_with_reason(struct station *station,
 					uint16_t reason_code)
 {
@@ -2443,9 +4188,7 @@ static bool station_retry_with_reason(struct station *station,
 			reason_code == MMPDU_REASON_CODE_IEEE8021X_FAILED)
 		return false;
 
-	blacklist_add_bss(station->connected_bss->addr);
-
-	return station_try_next_bss(station);
+	return station_blacklist_and_try_next_bss(station);
 }
 
 /* A bit more concise for trying to fit these into 80 characters */
@@ -2468,13 +4211,13 @@ static bool station_retry_with_status(struct station *station,
 	 *       specific BSS on our next attempt. There is currently no way to
 	 *       obtain that IE, but this should be done in the future.
 	 */
-	if (IS_TEMPORARY_STATUS(status_code))
+	if (IS_TEMPORARY_STATUS(status_code)) {
 		network_blacklist_add(station->connected_network,
 						station->connected_bss);
-	else
-		blacklist_add_bss(station->connected_bss->addr);
+		return station_try_next_bss(station);
+	}
 
-	return station_try_next_bss(station);
+	return station_blacklist_and_try_next_bss(station);
 }
 
 static void station_connect_dbus_reply(struct station *station,
@@ -2498,16 +4241,55 @@ static void station_connect_dbus_reply(struct station *station,
 	dbus_pending_reply(&station->connect_pending, reply);
 }
 
+/*
+ * The candidates left over from the scan that led to the failed attempt
+ * are usually still there, go on with those seen recently instead of
+ * waiting for the quick scan.  It keeps running to pick up the rest and
+ * is cancelled if one of these attempts gets going.
+ */
+static void station_autoconnect_failover(struct station *station)
+{
+	uint64_t now = l_time_now();
+
+	if (now < AUTOCONNECT_CANDIDATE_MAX_AGE)
+		return;
+
+	station_autoconnect_next_since(station,
+					now - AUTOCONNECT_CANDIDATE_MAX_AGE);
+}
+
 static void station_connect_cb(struct netdev *netdev, enum netdev_result result,
 					void *event_data, void *user_data)
 {
 	struct station *station = user_data;
+	bool autoconnect = false;
 
 	l_debug("%u, result: %d", netdev_get_ifindex(station->netdev), result);
 
+	switch (result) {
+	case NETDEV_RESULT_OK:
+	case NETDEV_RESULT_ABORTED:
+		break;
+	case NETDEV_RESULT_AUTHENTICATION_FAILED:
+		METRICS_INC(connect_failed_auth);
+		break;
+	case NETDEV_RESULT_ASSOCIATION_FAILED:
+		METRICS_INC(connect_failed_assoc);
+		break;
+	case NETDEV_RESULT_HANDSHAKE_FAILED:
+		METRICS_INC(connect_failed_handshake);
+		break;
+	case NETDEV_RESULT_KEY_SETTING_FAILED:
+		METRICS_INC(connect_failed_keys);
+		break;
+	}
+
 	switch (result) {
 	case NETDEV_RESULT_OK:
 		blacklist_remove_bss(station->connected_bss->addr);
+		blacklist_remove_network(
+			network_get_ssid(station->connected_network),
+			network_get_security(station->connected_network));
 		break;
 	case NETDEV_RESULT_HANDSHAKE_FAILED:
 		/* reason code in this case */
@@ -2528,6 +4310,8 @@ static void station_connect_cb(struct netdev *netdev, enum netdev_result result,
 
 	if (station->connect_pending)
 		station_connect_dbus_reply(station, result);
+	else
+		autoconnect = true;
 
 	if (result != NETDEV_RESULT_OK) {
 		if (result != NETDEV_RESULT_ABORTED) {
@@ -2537,6 +4321,9 @@ static void station_connect_cb(struct netdev *netdev, enum netdev_result result,
 			network_connect_failed(station->connected_network,
 						in_handshake);
 			station_disassociated(station);
+
+			if (autoconnect && station_is_autoconnecting(station))
+				station_autoconnect_failover(station);
 		}
 
 		return;
@@ -2554,14 +4341,31 @@ static void station_connect_cb(struct netdev *netdev, enum netdev_result result,
 
 	network_connected(station->connected_network);
 
-	if (station->netconfig)
+	if (station->netconfig) {
+		struct network *network = station->connected_network;
+		L_AUTO_FREE_VAR(char *, network_id) =
+			storage_get_network_file_path(
+					network_get_security(network),
+					network_get_ssid(network));
+
+		struct handshake_state *hs =
+				netdev_get_handshake(station->netdev);
+
+		station_timeline_mark(station, DIAGNOSTIC_PHASE_IP_CONFIG);
+		netconfig_set_network_id(station->netconfig, network_id);
+
+		if (hs->fils_dhcp_ack)
+			netconfig_set_fils_dhcp_ack(station->netconfig,
+							hs->fils_dhcp_ack,
+							hs->fils_dhcp_ack_len);
+
 		netconfig_configure(station->netconfig,
 					network_get_settings(
 						station->connected_network),
 					netdev_get_address(station->netdev),
 					station_netconfig_event_handler,
 					station);
-	else
+	} else
 		station_enter_state(station, STATION_STATE_CONNECTED);
 }
 
@@ -2573,10 +4377,30 @@ int __station_connect_network(struct station *station, struct network *network,
 	struct handshake_state *hs;
 	int r;
 
+	if (!network_export(network))
+		return -EIO;
+
 	hs = station_handshake_setup(station, network, bss);
 	if (!hs)
 		return -ENOTSUP;
 
+	/* Request a lease within the association when using FILS */
+	if (station->netconfig && IE_AKM_IS_FILS(hs->akm_suite)) {
+		const uint8_t *addr = l_memeqzero(hs->spa, ETH_ALEN) ?
+					netdev_get_address(station->netdev) :
+					hs->spa;
+		L_AUTO_FREE_VAR(uint8_t *, discover);
+		size_t len;
+
+		discover = netconfig_build_fils_dhcp_discover(
+						station->netconfig,
+						network_get_settings(network),
+						addr, &len);
+		if (discover)
+			handshake_state_set_fils_dhcp_discover(hs, discover,
+								len);
+	}
+
 	extra_ies = network_get_extra_ies(network, &iov_elems);
 
 	r = netdev_connect(station->netdev, bss, hs, extra_ies,
@@ -2588,6 +4412,15 @@ int __station_connect_network(struct station *station, struct network *network,
 	}
 
 	l_debug("connecting to BSS "MAC, MAC_STR(bss->addr));
+	METRICS_INC(connect_attempts);
+
+	station_timeline_start(station, bss->addr, false);
+
+	/* Count the scan that found this BSS */
+	if (station_is_autoconnecting(station))
+		diagnostic_timeline_mark(station->timeline,
+						DIAGNOSTIC_PHASE_SCAN,
+						station->scan_start_time);
 
 	station->connected_bss = bss;
 	station->connected_network = network;
@@ -2665,6 +4498,8 @@ void station_connect_network(struct station *station, struct network *network,
 				dbus_error_failed(station->hidden_pending));
 	}
 
+	station_direct_probe_cancel(station);
+
 	if (station->quick_scan_id) {
 		scan_cancel(netdev_get_wdev_id(station->netdev),
 				station->quick_scan_id);
@@ -2752,6 +4587,7 @@ static bool station_hidden_network_scan_results(int err,
 
 		if (station_add_seen_bss(station, bss)) {
 			l_queue_push_tail(station->bss_list, bss);
+			station_bss_index_add(station->bss_index, bss);
 
 			continue;
 		}
@@ -2996,9 +4832,12 @@ static struct l_dbus_message *station_dbus_get_networks(struct l_dbus *dbus,
 	l_dbus_message_builder_enter_array(builder, "(on)");
 
 	for (entry = l_queue_get_entries(sorted); entry; entry = entry->next) {
-		const struct network *network = entry->data;
+		struct network *network = entry->data;
 		int16_t signal_strength = network_get_signal_strength(network);
 
+		if (!network_export(network))
+			continue;
+
 		l_dbus_message_builder_enter_struct(builder, "on");
 		l_dbus_message_builder_append_basic(builder, 'o',
 						network_get_path(network));
@@ -3138,6 +4977,7 @@ static bool station_dbus_scan_subset(struct station *station)
 
 	station->dbus_scan_id = station_scan_trigger(station,
 						station->scan_freqs_order[idx],
+						true,
 						station_dbus_scan_triggered,
 						station_dbus_scan_results,
 						NULL);
@@ -3447,21 +5287,21 @@ int station_hide_network(struct station *station, struct network *network)
 	if (station->connected_network == network)
 		return -EBUSY;
 
-	if (!l_hashmap_lookup(station->networks, path))
+	if (!l_hashmap_lookup(station->networks, network_get_key(network)))
 		return -ENOENT;
 
 	l_queue_remove(station->networks_sorted, network);
-	l_hashmap_remove(station->networks, path);
+	l_hashmap_remove(station->networks, network_get_key(network));
 
 	while ((bss = network_bss_list_pop(network))) {
 		memset(bss->ssid, 0, bss->ssid_len);
 		l_queue_remove_if(station->hidden_bss_list_sorted,
 					bss_match_bssid, bss->addr);
-		l_queue_insert(station->hidden_bss_list_sorted, bss,
-					bss_signal_strength_compare, NULL);
+		station_hidden_bss_add(station, bss);
 	}
 
 	network_remove(network, -ESRCH);
+	station_networks_schedule_publish(station);
 
 	return 0;
 }
@@ -3510,18 +5350,19 @@ static struct station *station_create(struct netdev *netdev)
 	watchlist_init(&station->state_watches, NULL);
 
 	station->bss_list = l_queue_new();
+	station->bss_index = station_bss_index_new();
 	station->hidden_bss_list_sorted = l_queue_new();
 	station->networks = l_hashmap_new();
-	l_hashmap_set_hash_function(station->networks, l_str_hash);
-	l_hashmap_set_compare_function(station->networks,
-				(l_hashmap_compare_func_t) strcmp);
+	l_hashmap_set_hash_function(station->networks, network_key_hash);
 	station->networks_sorted = l_queue_new();
+	station->networks_published = l_hashmap_string_new();
 
 	station->wiphy = netdev_get_wiphy(netdev);
 	station->netdev = netdev;
 
 	l_queue_push_head(station_list, station);
 
+	station->direct_probe_pending = true;
 	station_set_autoconnect(station, true);
 
 	l_dbus_object_add_interface(dbus, netdev_get_path(netdev),
@@ -3531,6 +5372,7 @@ static struct station *station_create(struct netdev *netdev)
 		station->netconfig = netconfig_new(netdev_get_ifindex(netdev));
 
 	station->anqp_pending = l_queue_new();
+	station->timelines = l_queue_new();
 
 	station_fill_scan_freq_subsets(station);
 
@@ -3557,6 +5399,8 @@ static void station_free(struct station *station)
 	}
 
 	periodic_scan_stop(station);
+	station_rssi_trend_stop(station);
+	station_stats_stop(station);
 
 	if (station->signal_agent) {
 		station_signal_agent_release(station->signal_agent,
@@ -3588,17 +5432,25 @@ static void station_free(struct station *station)
 		scan_cancel(netdev_get_wdev_id(station->netdev),
 				station->quick_scan_id);
 
+	station_direct_probe_cancel(station);
+
 	if (station->hidden_network_scan_id)
 		scan_cancel(netdev_get_wdev_id(station->netdev),
 				station->hidden_network_scan_id);
 
 	station_roam_state_clear(station);
 
+	l_free(station->timeline);
+	l_queue_destroy(station->timelines, l_free);
+
+	l_idle_remove(station->networks_publish_idle);
 	l_queue_destroy(station->networks_sorted, NULL);
+	l_hashmap_destroy(station->networks_published, l_free);
 	l_hashmap_destroy(station->networks, network_free);
+	l_hashtab_destroy(station->bss_index, NULL);
 	l_queue_destroy(station->bss_list, bss_free);
 	l_queue_destroy(station->hidden_bss_list_sorted, NULL);
-	l_queue_destroy(station->autoconnect_list, l_free);
+	l_heap_destroy(station->autoconnect_list, l_free);
 
 	watchlist_destroy(&station->state_watches);
 
@@ -3636,6 +5488,10 @@ static void station_setup_interface(struct l_dbus_interface *interface)
 				station_dbus_signal_agent_unregister,
 				"", "o", "path");
 
+	l_dbus_interface_signal(interface, "OrderedNetworksChanged", 0,
+				"ua(oni)a(oni)ao", "generation", "added",
+				"changed", "removed");
+
 	l_dbus_interface_property(interface, "ConnectedNetwork", 0, "o",
 					station_property_get_connected_network,
 					NULL);
@@ -3660,6 +5516,7 @@ static void station_get_diagnostic_cb(
 	struct l_dbus_message *reply;
 	struct l_dbus_message_builder *builder;
 	struct handshake_state *hs = netdev_get_handshake(station->netdev);
+	uint32_t mem;
 
 	if (!info) {
 		reply = dbus_error_aborted(station->get_station_pending);
@@ -3680,6 +5537,15 @@ static void station_get_diagnostic_cb(
 				diagnostic_akm_suite_to_security(hs->akm_suite,
 								hs->wpa_ie));
 
+	mem = station->bss_mem;
+	dbus_append_dict_basic(builder, "ScanResultsMemory", 'u', &mem);
+
+	if (scan_mem_budget) {
+		mem = scan_mem_budget;
+		dbus_append_dict_basic(builder, "ScanResultsMemoryBudget", 'u',
+					&mem);
+	}
+
 	diagnostic_info_to_dict(info, builder);
 
 	l_dbus_message_builder_leave_array(builder);
@@ -3701,6 +5567,34 @@ static void station_get_diagnostic_destroy(void *user_data)
 	}
 }
 
+static void station_emit_stats(struct station *station,
+				const struct diagnostic_station_info *info)
+{
+	struct l_dbus_message *signal;
+	struct l_dbus_message_builder *builder;
+
+	if (!info || station->state != STATION_STATE_CONNECTED)
+		return;
+
+	signal = l_dbus_message_new_signal(dbus_get_bus(),
+					netdev_get_path(station->netdev),
+					IWD_STATION_DIAGNOSTIC_INTERFACE,
+					"Statistics");
+	builder = l_dbus_message_builder_new(signal);
+
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+
+	dbus_append_dict_basic(builder, "ConnectedBss", 's',
+					util_address_to_string(info->addr));
+	diagnostic_info_to_dict(info, builder);
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	l_dbus_send(dbus_get_bus(), signal);
+}
+
 static struct l_dbus_message *station_get_diagnostics(struct l_dbus *dbus,
 						struct l_dbus_message *message,
 						void *user_data)
@@ -3708,9 +5602,10 @@ static struct l_dbus_message *station_get_diagnostics(struct l_dbus *dbus,
 	struct station *station = user_data;
 	int ret;
 
-	ret = netdev_get_current_station(station->netdev,
-				station_get_diagnostic_cb, station,
-				station_get_diagnostic_destroy);
+	if (station->get_station_pending)
+		return dbus_error_busy(message);
+
+	ret = station_sta_info_request(station);
 	if (ret < 0)
 		return dbus_error_from_errno(ret, message);
 
@@ -3719,12 +5614,48 @@ static struct l_dbus_message *station_get_diagnostics(struct l_dbus *dbus,
 	return NULL;
 }
 
+static struct l_dbus_message *station_get_connection_timelines(
+						struct l_dbus *dbus,
+						struct l_dbus_message *message,
+						void *user_data)
+{
+	struct station *station = user_data;
+	struct l_dbus_message *reply;
+	struct l_dbus_message_builder *builder;
+	const struct l_queue_entry *entry;
+
+	reply = l_dbus_message_new_method_return(message);
+	builder = l_dbus_message_builder_new(reply);
+
+	l_dbus_message_builder_enter_array(builder, "a{sv}");
+
+	for (entry = l_queue_get_entries(station->timelines); entry;
+			entry = entry->next) {
+		l_dbus_message_builder_enter_array(builder, "{sv}");
+		diagnostic_timeline_to_dict(entry->data, builder);
+		l_dbus_message_builder_leave_array(builder);
+	}
+
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	return reply;
+}
+
 static void station_setup_diagnostic_interface(
 					struct l_dbus_interface *interface)
 {
 	l_dbus_interface_method(interface, "GetDiagnostics", 0,
 				station_get_diagnostics, "a{sv}", "",
 				"diagnostics");
+	l_dbus_interface_method(interface, "GetConnectionTimelines", 0,
+				station_get_connection_timelines, "aa{sv}", "",
+				"timelines");
+	l_dbus_interface_signal(interface, "Statistics", 0, "a{sv}",
+				"statistics");
+	l_dbus_interface_signal(interface, "ConnectionTimeline", 0, "a{sv}",
+				"timeline");
 }
 
 static void station_destroy_diagnostic_interface(void *user_data)
@@ -3792,6 +5723,8 @@ static void station_netdev_watch(struct netdev *netdev,
 
 static int station_init(void)
 {
+	unsigned int scan_budget_kib;
+
 	station_list = l_queue_new();
 	netdev_watch = netdev_watch_add(station_netdev_watch, NULL, NULL);
 	l_dbus_register_interface(dbus_get_bus(), IWD_STATION_INTERFACE,
@@ -3814,6 +5747,26 @@ static int station_init(void)
 		mfp_setting = 1;
 	}
 
+	if (!l_settings_get_int(iwd_get_config(), "General", "RoamThreshold",
+					&roam_threshold))
+		roam_threshold = -70;
+
+	if (!l_settings_get_bool(iwd_get_config(), "General",
+					"AdaptiveRoaming", &adaptive_roaming))
+		adaptive_roaming = false;
+
+	if (!l_settings_get_uint(iwd_get_config(), "General",
+					"AdaptiveRoamingRange",
+					&adaptive_roaming_range))
+		adaptive_roaming_range = 6;
+
+	if (adaptive_roaming_range > 20)
+		adaptive_roaming_range = 20;
+
+	if (!l_settings_get_bool(iwd_get_config(), "General",
+					"PrepareFastTransition", &ft_prewarm))
+		ft_prewarm = false;
+
 	if (!l_settings_get_uint(iwd_get_config(), "General",
 				"RoamRetryInterval",
 				&roam_retry_interval))
@@ -3822,10 +5775,21 @@ static int station_init(void)
 	if (roam_retry_interval > INT_MAX)
 		roam_retry_interval = INT_MAX;
 
+	if (!l_settings_get_uint(iwd_get_config(), "General",
+				"StatisticsInterval", &stats_interval))
+		stats_interval = 0;
+
+	if (stats_interval > INT_MAX)
+		stats_interval = INT_MAX;
+
 	if (!l_settings_get_bool(iwd_get_config(), "General", "DisableANQP",
 				&anqp_disabled))
 		anqp_disabled = true;
 
+	if (l_settings_get_uint(iwd_get_config(), "Scan", "MemoryBudget",
+				&scan_budget_kib))
+		scan_mem_budget = (size_t) scan_budget_kib * 1024;
+
 	if (!l_settings_get_bool(iwd_get_config(), "General",
 					"EnableNetworkConfiguration",
 					&netconfig_enabled)) {
@@ -34,6 +34,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -47,6 +49,13 @@
 #define STORAGE_FILE_MODE (S_IRUSR | S_IWUSR)
 
 #define KNOWN_FREQ_FILENAME ".known_network.freq"
+#define KNOWN_INDEX_FILENAME ".known_network.index"
+#define DHCP_LEASES_FILENAME ".known_network.leases"
+#define TLS_SESSIONS_FILENAME ".known_network.tls_sessions"
+#define ERP_CACHE_FILENAME ".known_network.erp"
+#define ANQP_CACHE_FILENAME ".hotspot.anqp"
+#define P2P_GROUPS_FILENAME ".p2p.groups"
+#define WIPHY_CACHE_FILENAME ".wiphy.cache"
 
 static char *storage_path = NULL;
 static char *storage_hotspot_path = NULL;
@@ -182,6 +191,251 @@ error_create_dirs:
 	return r;
 }
 
+/*
+ * Profile writes and removals are handed to a worker thread so that slow
+ * storage doesn't stall the main loop.  Jobs are executed in submission
+ * order and their completion is signalled through a pipe watched by the
+ * main loop.  Jobs stay in async_pending until then so that reads of a
+ * file with a write still in flight see the new contents.
+ */
+struct storage_job {
+	char *path;
+	void *data;
+	size_t len;
+	bool remove : 1;
+	bool preserve_times : 1;
+	int result;
+};
+
+static pthread_t async_thread;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static struct l_queue *async_todo;	/* Protected by async_lock */
+static struct l_queue *async_done;	/* Protected by async_lock */
+static bool async_stopping;		/* Protected by async_lock */
+static struct l_queue *async_pending;	/* Main thread only */
+static struct l_io *async_io;
+static int async_pipe[2] = { -1, -1 };
+static bool async_running;
+
+static void storage_job_free(void *data)
+{
+	struct storage_job *job = data;
+
+	if (job->data) {
+		explicit_bzero(job->data, job->len);
+		l_free(job->data);
+	}
+
+	l_free(job->path);
+	l_free(job);
+}
+
+static void storage_job_run(struct storage_job *job)
+{
+	if (job->remove) {
+		job->result = unlink(job->path) < 0 ? -errno : 0;
+		return;
+	}
+
+	job->result = write_file(job->data, job->len, job->preserve_times,
+					"%s", job->path) < 0 ? -EIO : 0;
+}
+
+static void *storage_async_worker(void *user_data)
+{
+	struct storage_job *job;
+	static const char c = 0;
+
+	pthread_mutex_lock(&async_lock);
+
+	while (true) {
+		job = l_queue_pop_head(async_todo);
+		if (!job) {
+			if (async_stopping)
+				break;
+
+			pthread_cond_wait(&async_cond, &async_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&async_lock);
+
+		storage_job_run(job);
+
+		pthread_mutex_lock(&async_lock);
+		l_queue_push_tail(async_done, job);
+
+		if (L_TFR(write(async_pipe[1], &c, 1)) < 0 && errno != EAGAIN)
+			l_error("Storage worker notification failed: %s",
+				strerror(errno));
+	}
+
+	pthread_mutex_unlock(&async_lock);
+
+	return NULL;
+}
+
+static void storage_async_complete(void)
+{
+	struct l_queue *done;
+	struct storage_job *job;
+
+	pthread_mutex_lock(&async_lock);
+	done = async_done;
+	async_done = l_queue_new();
+	pthread_mutex_unlock(&async_lock);
+
+	while ((job = l_queue_pop_head(done))) {
+		if (job->result < 0 && !(job->remove && job->result == -ENOENT))
+			l_error("Failed to %s %s: %s",
+				job->remove ? "remove" : "write", job->path,
+				strerror(-job->result));
+
+		l_queue_remove(async_pending, job);
+		storage_job_free(job);
+	}
+
+	l_queue_destroy(done, NULL);
+}
+
+static bool storage_async_read(struct l_io *io, void *user_data)
+{
+	char buf[64];
+
+	while (L_TFR(read(async_pipe[0], buf, sizeof(buf))) > 0)
+		;
+
+	storage_async_complete();
+
+	return true;
+}
+
+static bool storage_async_start(void)
+{
+	sigset_t all, old;
+	int err;
+
+	if (pipe2(async_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+		return false;
+
+	async_todo = l_queue_new();
+	async_done = l_queue_new();
+	async_pending = l_queue_new();
+
+	/* Signals are handled by the main loop, keep them off the worker */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&async_thread, NULL, storage_async_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err) {
+		l_error("Failed to start the storage worker: %s",
+			strerror(err));
+		goto fail;
+	}
+
+	async_io = l_io_new(async_pipe[0]);
+	l_io_set_read_handler(async_io, storage_async_read, NULL, NULL);
+	async_running = true;
+
+	return true;
+
+fail:
+	l_queue_destroy(async_todo, NULL);
+	l_queue_destroy(async_done, NULL);
+	l_queue_destroy(async_pending, NULL);
+	close(async_pipe[0]);
+	close(async_pipe[1]);
+	async_pipe[0] = async_pipe[1] = -1;
+
+	return false;
+}
+
+static void storage_async_stop(void)
+{
+	if (!async_running)
+		return;
+
+	/* The worker drains async_todo before it exits */
+	pthread_mutex_lock(&async_lock);
+	async_stopping = true;
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	pthread_join(async_thread, NULL);
+	async_running = false;
+
+	storage_async_complete();
+
+	l_io_destroy(async_io);
+	async_io = NULL;
+	close(async_pipe[0]);
+	close(async_pipe[1]);
+	async_pipe[0] = async_pipe[1] = -1;
+
+	l_queue_destroy(async_todo, NULL);
+	l_queue_destroy(async_done, NULL);
+	l_queue_destroy(async_pending, storage_job_free);
+	async_todo = async_done = async_pending = NULL;
+}
+
+/*
+ * Takes ownership of @data.  Falls back to a synchronous write or removal
+ * if the worker isn't running, e.g. in the tools.
+ */
+static int storage_async_submit(char *path, void *data, size_t len,
+				bool preserve_times, bool remove)
+{
+	struct storage_job *job = l_new(struct storage_job, 1);
+
+	job->path = path;
+	job->data = data;
+	job->len = len;
+	job->preserve_times = preserve_times;
+	job->remove = remove;
+
+	if (!async_running) {
+		int r;
+
+		storage_job_run(job);
+		r = job->result;
+		storage_job_free(job);
+
+		return r;
+	}
+
+	l_queue_push_tail(async_pending, job);
+
+	pthread_mutex_lock(&async_lock);
+	l_queue_push_tail(async_todo, job);
+	pthread_cond_signal(&async_cond);
+	pthread_mutex_unlock(&async_lock);
+
+	return 0;
+}
+
+static bool storage_job_match_path(const void *a, const void *b)
+{
+	const struct storage_job *job = a;
+
+	return !strcmp(job->path, b);
+}
+
+/* Returns the most recent job still in flight for @path, if any */
+static const struct storage_job *storage_async_find(const char *path)
+{
+	const struct l_queue_entry *entry;
+	const struct storage_job *found = NULL;
+
+	for (entry = l_queue_get_entries(async_pending); entry;
+						entry = entry->next)
+		if (storage_job_match_path(entry->data, path))
+			found = entry->data;
+
+	return found;
+}
+
 bool storage_create_dirs(void)
 {
 	const char *state_dir;
@@ -221,11 +475,16 @@ bool storage_create_dirs(void)
 		return false;
 	}
 
+	if (!storage_async_start())
+		l_warn("Profiles will be written synchronously");
+
 	return true;
 }
 
 void storage_cleanup_dirs(void)
 {
+	storage_async_stop();
+
 	l_free(storage_path);
 	l_free(storage_hotspot_path);
 }
@@ -348,6 +607,7 @@ const char *storage_network_ssid_from_path(const char *path,
 struct l_settings *storage_network_open(enum security type, const char *ssid)
 {
 	struct l_settings *settings;
+	const struct storage_job *job;
 	char *path;
 
 	if (ssid == NULL)
@@ -355,8 +615,14 @@ struct l_settings *storage_network_open(enum security type, const char *ssid)
 
 	path = storage_get_network_file_path(type, ssid);
 	settings = l_settings_new();
+	job = storage_async_find(path);
 
-	if (!l_settings_load_from_file(settings, path)) {
+	if (job && (job->remove ||
+			!l_settings_load_from_data(settings, job->data,
+							job->len))) {
+		l_settings_free(settings);
+		settings = NULL;
+	} else if (!job && !l_settings_load_from_file(settings, path)) {
 		l_settings_free(settings);
 		settings = NULL;
 	}
@@ -392,21 +658,17 @@ void storage_network_sync(enum security type, const char *ssid,
 
 	path = storage_get_network_file_path(type, ssid);
 	data = l_settings_to_data(settings, &length);
-	write_file(data, length, true, "%s", path);
-	l_free(data);
-	l_free(path);
+	storage_async_submit(path, data, length, true, false);
 }
 
 int storage_network_remove(enum security type, const char *ssid)
 {
 	char *path;
-	int ret;
 
 	path = storage_get_network_file_path(type, ssid);
-	ret = unlink(path);
-	l_free(path);
 
-	return ret < 0 ? -errno : 0;
+	/* Queued so that it can't be overtaken by a pending write */
+	return storage_async_submit(path, NULL, 0, false, true);
 }
 
 struct l_settings *storage_known_frequencies_load(void)
@@ -440,8 +702,215 @@ void storage_known_frequencies_sync(struct l_settings *known_freqs)
 	known_freq_file_path = storage_get_path("/%s", KNOWN_FREQ_FILENAME);
 
 	data = l_settings_to_data(known_freqs, &len);
-	write_file(data, len, false, "%s", known_freq_file_path);
-	l_free(data);
+	storage_async_submit(known_freq_file_path, data, len, false, false);
+}
 
-	l_free(known_freq_file_path);
+struct l_settings *storage_known_network_index_load(void)
+{
+	struct l_settings *index = l_settings_new();
+	char *path = storage_get_path("/%s", KNOWN_INDEX_FILENAME);
+
+	if (!l_settings_load_from_file(index, path)) {
+		l_settings_free(index);
+		index = NULL;
+	}
+
+	l_free(path);
+
+	return index;
+}
+
+void storage_known_network_index_sync(struct l_settings *index)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!index)
+		return;
+
+	path = storage_get_path("/%s", KNOWN_INDEX_FILENAME);
+
+	data = l_settings_to_data(index, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_dhcp_leases_load(void)
+{
+	struct l_settings *leases = l_settings_new();
+	char *path = storage_get_path("/%s", DHCP_LEASES_FILENAME);
+
+	if (!l_settings_load_from_file(leases, path)) {
+		l_settings_free(leases);
+		leases = NULL;
+	}
+
+	l_free(path);
+
+	return leases;
+}
+
+void storage_dhcp_leases_sync(struct l_settings *leases)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!leases)
+		return;
+
+	path = storage_get_path("/%s", DHCP_LEASES_FILENAME);
+
+	data = l_settings_to_data(leases, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_tls_session_cache_load(void)
+{
+	struct l_settings *cache = l_settings_new();
+	char *path = storage_get_path("/%s", TLS_SESSIONS_FILENAME);
+
+	if (!l_settings_load_from_file(cache, path)) {
+		l_settings_free(cache);
+		cache = NULL;
+	}
+
+	l_free(path);
+
+	return cache;
+}
+
+void storage_tls_session_cache_sync(struct l_settings *cache)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!cache)
+		return;
+
+	path = storage_get_path("/%s", TLS_SESSIONS_FILENAME);
+
+	data = l_settings_to_data(cache, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_erp_cache_load(void)
+{
+	struct l_settings *cache = l_settings_new();
+	char *path = storage_get_path("/%s", ERP_CACHE_FILENAME);
+
+	if (!l_settings_load_from_file(cache, path)) {
+		l_settings_free(cache);
+		cache = NULL;
+	}
+
+	l_free(path);
+
+	return cache;
+}
+
+void storage_erp_cache_sync(struct l_settings *cache)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!cache)
+		return;
+
+	path = storage_get_path("/%s", ERP_CACHE_FILENAME);
+
+	data = l_settings_to_data(cache, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_anqp_cache_load(void)
+{
+	struct l_settings *cache = l_settings_new();
+	char *path = storage_get_path("/%s", ANQP_CACHE_FILENAME);
+
+	if (!l_settings_load_from_file(cache, path)) {
+		l_settings_free(cache);
+		cache = NULL;
+	}
+
+	l_free(path);
+
+	return cache;
+}
+
+void storage_anqp_cache_sync(struct l_settings *cache)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!cache)
+		return;
+
+	path = storage_get_path("/%s", ANQP_CACHE_FILENAME);
+
+	data = l_settings_to_data(cache, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_p2p_groups_load(void)
+{
+	struct l_settings *groups = l_settings_new();
+	char *path = storage_get_path("/%s", P2P_GROUPS_FILENAME);
+
+	if (!l_settings_load_from_file(groups, path)) {
+		l_settings_free(groups);
+		groups = NULL;
+	}
+
+	l_free(path);
+
+	return groups;
+}
+
+void storage_p2p_groups_sync(struct l_settings *groups)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!groups)
+		return;
+
+	path = storage_get_path("/%s", P2P_GROUPS_FILENAME);
+
+	data = l_settings_to_data(groups, &len);
+	storage_async_submit(path, data, len, false, false);
+}
+
+struct l_settings *storage_wiphy_cache_load(void)
+{
+	struct l_settings *cache = l_settings_new();
+	char *path = storage_get_path("/%s", WIPHY_CACHE_FILENAME);
+
+	if (!l_settings_load_from_file(cache, path)) {
+		l_settings_free(cache);
+		cache = NULL;
+	}
+
+	l_free(path);
+
+	return cache;
+}
+
+void storage_wiphy_cache_sync(struct l_settings *cache)
+{
+	char *path;
+	char *data;
+	size_t len;
+
+	if (!cache)
+		return;
+
+	path = storage_get_path("/%s", WIPHY_CACHE_FILENAME);
+
+	data = l_settings_to_data(cache, &len);
+	storage_async_submit(path, data, len, false, false);
 }
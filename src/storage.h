@@ -49,3 +49,24 @@ int storage_network_remove(enum security type, const char *ssid);
 
 struct l_settings *storage_known_frequencies_load(void);
 void storage_known_frequencies_sync(struct l_settings *known_freqs);
+
+struct l_settings *storage_known_network_index_load(void);
+void storage_known_network_index_sync(struct l_settings *index);
+
+struct l_settings *storage_dhcp_leases_load(void);
+void storage_dhcp_leases_sync(struct l_settings *leases);
+
+struct l_settings *storage_tls_session_cache_load(void);
+void storage_tls_session_cache_sync(struct l_settings *cache);
+
+struct l_settings *storage_erp_cache_load(void);
+void storage_erp_cache_sync(struct l_settings *cache);
+
+struct l_settings *storage_anqp_cache_load(void);
+void storage_anqp_cache_sync(struct l_settings *cache);
+
+struct l_settings *storage_p2p_groups_load(void);
+void storage_p2p_groups_sync(struct l_settings *groups);
+
+struct l_settings *storage_wiphy_cache_load(void);
+void storage_wiphy_cache_sync(struct l_settings *cache);
@@ -0,0 +1,40 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Static tracepoints on the hot paths, for measuring latencies on live
+ * systems with bpftrace or perf without the cost of debug logging.  With
+ * --enable-usdt each one becomes a USDT probe of the "iwd" provider, e.g.:
+ *
+ *	bpftrace -e 'usdt:/usr/libexec/iwd:iwd:station_state
+ *				{ printf("%d -> %d\n", arg1, arg2); }'
+ *
+ * Otherwise they compile to nothing and the arguments are not evaluated.
+ */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define TRACE(name, ...) STAP_PROBEV(iwd, name, ##__VA_ARGS__)
+#else
+#define TRACE(name, ...) do {} while (0)
+#endif
@@ -174,6 +174,22 @@ bool util_is_valid_sta_address(const uint8_t *addr)
 	return !util_is_broadcast_address(addr) && !util_is_group_address(addr);
 }
 
+/*
+ * Hash and compare functions for l_hashmaps keyed by a 6-byte MAC address.
+ * The OUI carries little entropy so mostly the NIC specific part is used.
+ */
+unsigned int util_address_hash(const void *p)
+{
+	const uint8_t *addr = p;
+
+	return l_get_be32(addr + 2) ^ addr[1];
+}
+
+int util_address_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, 6);
+}
+
 /* This function assumes that identity is not bigger than 253 bytes */
 const char *util_get_domain(const char *identity)
 {
@@ -40,6 +40,9 @@ bool util_is_group_address(const uint8_t *addr);
 bool util_is_broadcast_address(const uint8_t *addr);
 bool util_is_valid_sta_address(const uint8_t *addr);
 
+unsigned int util_address_hash(const void *p);
+int util_address_compare(const void *a, const void *b);
+
 const char *util_get_domain(const char *identity);
 const char *util_get_username(const char *identity);
 
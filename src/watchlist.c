@@ -24,17 +24,12 @@
 #include <config.h>
 #endif
 
+#include <string.h>
 #include <ell/ell.h>
 
 #include "src/watchlist.h"
 
-static bool watchlist_item_match(const void *a, const void *b)
-{
-	const struct watchlist_item *item = a;
-	uint32_t id = L_PTR_TO_UINT(b);
-
-	return item->id == id;
-}
+#define WATCHLIST_MIN_ALLOC 4
 
 static void watchlist_item_free(struct watchlist *watchlist,
 						struct watchlist_item *item)
@@ -48,12 +43,47 @@ static void watchlist_item_free(struct watchlist *watchlist,
 		l_free(item);
 }
 
+/* Items are sorted by ID since IDs only ever increase */
+static int watchlist_find(struct watchlist *watchlist, unsigned int id)
+{
+	unsigned int lo = 0;
+	unsigned int hi = watchlist->n_items;
+
+	if (!id)
+		return -1;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		unsigned int mid_id = watchlist->items[mid]->id;
+
+		/* Stale items don't break the ordering of the others */
+		if (!mid_id) {
+			unsigned int i;
+
+			for (i = lo; i < hi; i++)
+				if (watchlist->items[i]->id == id)
+					return i;
+
+			return -1;
+		}
+
+		if (mid_id == id)
+			return mid;
+
+		if (mid_id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return -1;
+}
+
 struct watchlist *watchlist_new(const struct watchlist_ops *ops)
 {
 	struct watchlist *watchlist;
 
 	watchlist = l_new(struct watchlist, 1);
-	watchlist->items = l_queue_new();
 	watchlist->ops = ops;
 	return watchlist;
 }
@@ -61,8 +91,7 @@ struct watchlist *watchlist_new(const struct watchlist_ops *ops)
 void watchlist_init(struct watchlist *watchlist,
 					const struct watchlist_ops *ops)
 {
-	watchlist->next_id = 0;
-	watchlist->items = l_queue_new();
+	memset(watchlist, 0, sizeof(*watchlist));
 	watchlist->ops = ops;
 }
 
@@ -76,7 +105,14 @@ unsigned int watchlist_link(struct watchlist *watchlist,
 	item->notify_data = notify_data;
 	item->destroy = destroy;
 
-	l_queue_push_tail(watchlist->items, item);
+	if (watchlist->n_items == watchlist->n_alloc) {
+		watchlist->n_alloc = watchlist->n_alloc ?
+			watchlist->n_alloc * 2 : WATCHLIST_MIN_ALLOC;
+		watchlist->items = l_realloc(watchlist->items,
+					watchlist->n_alloc * sizeof(item));
+	}
+
+	watchlist->items[watchlist->n_items++] = item;
 
 	return item->id;
 }
@@ -91,38 +127,71 @@ unsigned int watchlist_add(struct watchlist *watchlist, void *notify,
 	return watchlist_link(watchlist, item, notify, notify_data, destroy);
 }
 
+static void watchlist_unlink(struct watchlist *watchlist, unsigned int i)
+{
+	watchlist->n_items -= 1;
+	memmove(watchlist->items + i, watchlist->items + i + 1,
+			(watchlist->n_items - i) * sizeof(void *));
+}
+
 bool watchlist_remove(struct watchlist *watchlist, unsigned int id)
 {
 	struct watchlist_item *item;
+	int i = watchlist_find(watchlist, id);
 
-	if (watchlist->in_notify) {
-		item = l_queue_find(watchlist->items, watchlist_item_match,
-							L_UINT_TO_PTR(id));
-		if (!item)
-			return false;
+	if (i < 0)
+		return false;
+
+	item = watchlist->items[i];
 
+	if (watchlist->in_notify) {
 		item->id = 0;	/* Mark stale */
 		watchlist->stale_items = true;
 
 		return true;
 	}
 
-	item = l_queue_remove_if(watchlist->items, watchlist_item_match,
-							L_UINT_TO_PTR(id));
-	if (!item)
-		return false;
-
+	watchlist_unlink(watchlist, i);
 	watchlist_item_free(watchlist, item);
 
 	return true;
 }
 
+unsigned int watchlist_foreach_remove(struct watchlist *watchlist,
+					watchlist_remove_func_t func,
+					void *user_data)
+{
+	unsigned int i;
+	unsigned int n = 0;
+
+	for (i = 0; i < watchlist->n_items; i++) {
+		struct watchlist_item *item = watchlist->items[i];
+
+		if (func(item, user_data))
+			continue;
+
+		watchlist->items[n++] = item;
+	}
+
+	i = watchlist->n_items - n;
+	watchlist->n_items = n;
+
+	return i;
+}
+
 static void watchlist_clear(struct watchlist *watchlist)
 {
-	struct watchlist_item *item;
+	/* Item destroy callbacks may still remove other items */
+	while (watchlist->n_items) {
+		struct watchlist_item *item = watchlist->items[0];
 
-	while ((item = l_queue_pop_head(watchlist->items)))
+		watchlist_unlink(watchlist, 0);
 		watchlist_item_free(watchlist, item);
+	}
+
+	l_free(watchlist->items);
+	watchlist->items = NULL;
+	watchlist->n_alloc = 0;
 }
 
 void watchlist_destroy(struct watchlist *watchlist)
@@ -133,24 +202,34 @@ void watchlist_destroy(struct watchlist *watchlist)
 	}
 
 	watchlist_clear(watchlist);
-	l_queue_destroy(watchlist->items, NULL);
-	watchlist->items = NULL;
+	watchlist->pending_destroy = false;
+	watchlist->stale_items = false;
 }
 
 void watchlist_free(struct watchlist *watchlist)
 {
 	watchlist_clear(watchlist);
-	l_queue_destroy(watchlist->items, NULL);
 	l_free(watchlist);
 }
 
 void __watchlist_prune_stale(struct watchlist *watchlist)
 {
-	struct watchlist_item *item;
+	unsigned int i = 0;
+
+	while (i < watchlist->n_items) {
+		struct watchlist_item *item = watchlist->items[i];
+
+		if (item->id) {
+			i++;
+			continue;
+		}
 
-	while ((item = l_queue_remove_if(watchlist->items, watchlist_item_match,
-							L_UINT_TO_PTR(0))))
+		watchlist_unlink(watchlist, i);
 		watchlist_item_free(watchlist, item);
 
+		/* The destroy callback may have removed other items */
+		i = 0;
+	}
+
 	watchlist->stale_items = false;
 }
@@ -33,9 +33,18 @@ struct watchlist_ops {
 	void (*item_free)(struct watchlist_item *item);
 };
 
+/*
+ * Items are kept in an array ordered by ID, which is also the order they
+ * were added in.  Items removed from within a notification are only marked
+ * stale by zeroing their ID and are pruned once the notification is done,
+ * so the array is never shrunk or reordered while it is being walked.
+ * Items added from within a notification are still notified.
+ */
 struct watchlist {
 	int next_id;
-	struct l_queue *items;
+	struct watchlist_item **items;
+	unsigned int n_items;
+	unsigned int n_alloc;
 	bool in_notify : 1;
 	bool stale_items : 1;
 	bool pending_destroy : 1;
@@ -56,17 +65,27 @@ bool watchlist_remove(struct watchlist *watchlist, unsigned int id);
 void watchlist_destroy(struct watchlist *watchlist);
 void watchlist_free(struct watchlist *watchlist);
 
+typedef bool (*watchlist_remove_func_t)(struct watchlist_item *item,
+							void *user_data);
+
+/*
+ * Unlinks the items for which @func returns true, without freeing them.
+ * Within a notification @func must mark items stale instead.
+ */
+unsigned int watchlist_foreach_remove(struct watchlist *watchlist,
+					watchlist_remove_func_t func,
+					void *user_data);
+
 void __watchlist_prune_stale(struct watchlist *watchlist);
 
 #define WATCHLIST_NOTIFY(list, type, args...)				\
 	do {								\
 		struct watchlist *watchlist = (list);			\
-		const struct l_queue_entry *entry =			\
-				l_queue_get_entries(watchlist->items);	\
+		unsigned int i;						\
 									\
 		watchlist->in_notify = true;				\
-		for (; entry; entry = entry->next) {			\
-			struct watchlist_item *item = entry->data;	\
+		for (i = 0; i < watchlist->n_items; i++) {		\
+			struct watchlist_item *item = watchlist->items[i]; \
 			type t = item->notify;				\
 			if (item->id == 0)				\
 				continue;				\
@@ -84,12 +103,11 @@ void __watchlist_prune_stale(struct watchlist *watchlist);
 #define WATCHLIST_NOTIFY_MATCHES(list, match, match_data, type, args...) \
 	do {								\
 		struct watchlist *watchlist = (list);			\
-		const struct l_queue_entry *entry =			\
-				l_queue_get_entries(watchlist->items);	\
+		unsigned int i;						\
 									\
 		watchlist->in_notify = true;				\
-		for (; entry; entry = entry->next) {			\
-			struct watchlist_item *item = entry->data;	\
+		for (i = 0; i < watchlist->n_items; i++) {		\
+			struct watchlist_item *item = watchlist->items[i]; \
 			type t = item->notify;				\
 									\
 			if (item->id == 0)				\
@@ -112,12 +130,11 @@ void __watchlist_prune_stale(struct watchlist *watchlist);
 #define WATCHLIST_NOTIFY_NO_ARGS(list, type)				\
 	do {								\
 		struct watchlist *watchlist = (list);			\
-		const struct l_queue_entry *entry =			\
-				l_queue_get_entries(watchlist->items);	\
+		unsigned int i;						\
 									\
 		watchlist->in_notify = true;				\
-		for (; entry; entry = entry->next) {			\
-			struct watchlist_item *item = entry->data;	\
+		for (i = 0; i < watchlist->n_items; i++) {		\
+			struct watchlist_item *item = watchlist->items[i]; \
 			type t = item->notify;				\
 			if (item->id == 0)				\
 				continue;				\
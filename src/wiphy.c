@@ -55,16 +55,26 @@
 #include "src/watchlist.h"
 #include "src/nl80211util.h"
 #include "src/nl80211cmd.h"
+#include "src/trace.h"
 
 #define EXT_CAP_LEN 10
 
 static struct l_genl_family *nl80211 = NULL;
+static unsigned int overrun_watch;
 static struct l_hwdb *hwdb;
 static char **whitelist_filter;
 static char **blacklist_filter;
 static int mac_randomize_bytes = 6;
 static char regdom_country[2];
 static uint32_t work_ids;
+static uint32_t work_seq;
+
+/*
+ * GET_WIPHY dump messages of each wiphy from the previous run, by wiphy
+ * name, together with the driver and permanent address they were taken
+ * from.  Lets the wiphys be set up at startup before the dump completes.
+ */
+static struct l_settings *wiphy_cache;
 
 struct wiphy {
 	uint32_t id;
@@ -73,10 +83,16 @@ struct wiphy {
 	uint32_t feature_flags;
 	uint8_t ext_features[(NUM_NL80211_EXT_FEATURES + 7) / 8];
 	uint8_t max_num_ssids_per_scan;
+	uint8_t max_num_sched_scan_ssids;
+	uint8_t max_match_sets;
+	uint32_t max_net_detect_match_sets;	/* Zero if not supported */
 	uint32_t max_roc_duration;
 	uint16_t max_scan_ie_len;
+	uint32_t probe_resp_offload;	/* nl80211_probe_resp_offload_support */
 	uint16_t supported_iftypes;
 	uint16_t supported_ciphers;
+	/* Most station interfaces any interface combination allows */
+	uint8_t max_concurrent_stations;
 	struct scan_freq_set *supported_freqs;
 	char *model_str;
 	char *vendor_str;
@@ -85,11 +101,19 @@ struct wiphy {
 	uint8_t extended_capabilities[EXT_CAP_LEN + 2]; /* max bitmap size + IE header */
 	uint8_t *iftype_extended_capabilities[NUM_NL80211_IFTYPES];
 	uint8_t *supported_rates[NUM_NL80211_BANDS];
+	/* HT / VHT Capabilities IE bodies, valid if the ht/vht_bands bit set */
+	uint8_t ht_capabilities[NUM_NL80211_BANDS][26];
+	uint8_t vht_capabilities[NUM_NL80211_BANDS][12];
+	uint8_t ht_bands;
+	uint8_t vht_bands;
 	uint8_t rm_enabled_capabilities[7]; /* 5 size max + header */
 	struct l_genl_family *nl80211;
 	char regdom_country[2];
-	/* Work queue for this radio */
-	struct l_queue *work;
+	/* Work queue for this radio, running item first, and index by id */
+	struct l_heap *work;
+	struct l_hashmap *work_index;
+	/* Messages of the GET_WIPHY dump in progress, for wiphy_cache */
+	struct l_queue *dump_msgs;
 
 	bool support_scheduled_scan:1;
 	bool support_rekey_offload:1;
@@ -100,8 +124,10 @@ struct wiphy {
 	bool soft_rfkill : 1;
 	bool hard_rfkill : 1;
 	bool offchannel_tx_ok : 1;
+	bool support_ap_uapsd : 1;
 	bool blacklisted : 1;
 	bool registered : 1;
+	bool from_cache : 1;
 };
 
 static struct l_queue *wiphy_list = NULL;
@@ -294,6 +320,24 @@ static void destroy_work(void *user_data)
 		work->ops->destroy(work);
 }
 
+/*
+ * Running work stays at the head until it completes or is preempted,
+ * after that items run by priority and in insertion order.
+ */
+static int work_compare(const void *a, const void *b)
+{
+	const struct wiphy_radio_work_item *wa = a;
+	const struct wiphy_radio_work_item *wb = b;
+
+	if (wa->running != wb->running)
+		return wa->running ? -1 : 1;
+
+	if (wa->priority != wb->priority)
+		return wa->priority < wb->priority ? -1 : 1;
+
+	return (int32_t) (wa->seq - wb->seq);
+}
+
 static void wiphy_free(void *data)
 {
 	struct wiphy *wiphy = data;
@@ -313,7 +357,10 @@ static void wiphy_free(void *data)
 	l_free(wiphy->vendor_str);
 	l_free(wiphy->driver_str);
 	l_genl_family_free(wiphy->nl80211);
-	l_queue_destroy(wiphy->work, destroy_work);
+	l_heap_destroy(wiphy->work, destroy_work);
+	l_hashmap_destroy(wiphy->work_index, NULL);
+	l_queue_destroy(wiphy->dump_msgs,
+				(l_queue_destroy_func_t) l_genl_msg_unref);
 	l_free(wiphy);
 }
 
@@ -463,6 +510,26 @@ uint8_t wiphy_get_max_num_ssids_per_scan(struct wiphy *wiphy)
 	return wiphy->max_num_ssids_per_scan;
 }
 
+bool wiphy_supports_sched_scan(struct wiphy *wiphy)
+{
+	return wiphy->support_scheduled_scan;
+}
+
+uint8_t wiphy_get_max_num_sched_scan_ssids(struct wiphy *wiphy)
+{
+	return wiphy->max_num_sched_scan_ssids;
+}
+
+uint8_t wiphy_get_max_match_sets(struct wiphy *wiphy)
+{
+	return wiphy->max_match_sets;
+}
+
+uint32_t wiphy_get_max_net_detect_match_sets(struct wiphy *wiphy)
+{
+	return wiphy->max_net_detect_match_sets;
+}
+
 uint16_t wiphy_get_max_scan_ie_len(struct wiphy *wiphy)
 {
 	return wiphy->max_scan_ie_len;
@@ -483,6 +550,11 @@ bool wiphy_can_offchannel_tx(struct wiphy *wiphy)
 	return wiphy->offchannel_tx_ok;
 }
 
+bool wiphy_supports_ap_uapsd(struct wiphy *wiphy)
+{
+	return wiphy->support_ap_uapsd;
+}
+
 bool wiphy_supports_qos_set_map(struct wiphy *wiphy)
 {
 	return wiphy->support_qos_set_map;
@@ -493,6 +565,19 @@ bool wiphy_supports_firmware_roam(struct wiphy *wiphy)
 	return wiphy->support_fw_roam;
 }
 
+/*
+ * Whether the driver can answer Probe Requests in AP mode itself, given a
+ * template, for BSSes advertising all of the protocols in the
+ * nl80211_probe_resp_offload_support_attr bitmask.  The kernel reports
+ * the attribute only when offloading is available at all.
+ */
+bool wiphy_supports_probe_resp_offload(struct wiphy *wiphy,
+					uint32_t protocols)
+{
+	return wiphy->probe_resp_offload &&
+		(wiphy->probe_resp_offload & protocols) == protocols;
+}
+
 const char *wiphy_get_driver(struct wiphy *wiphy)
 {
 	return wiphy->driver_str;
@@ -635,6 +720,24 @@ const uint8_t *wiphy_get_supported_rates(struct wiphy *wiphy, unsigned int band,
 	return wiphy->supported_rates[band];
 }
 
+const uint8_t *wiphy_get_ht_capabilities(struct wiphy *wiphy,
+						unsigned int band)
+{
+	if (band >= NUM_NL80211_BANDS || !(wiphy->ht_bands & (1 << band)))
+		return NULL;
+
+	return wiphy->ht_capabilities[band];
+}
+
+const uint8_t *wiphy_get_vht_capabilities(struct wiphy *wiphy,
+						unsigned int band)
+{
+	if (band >= NUM_NL80211_BANDS || !(wiphy->vht_bands & (1 << band)))
+		return NULL;
+
+	return wiphy->vht_capabilities[band];
+}
+
 void wiphy_get_reg_domain_country(struct wiphy *wiphy, char *out)
 {
 	char *country = wiphy->regdom_country;
@@ -680,6 +783,9 @@ static void wiphy_print_basic_info(struct wiphy *wiphy)
 		if (bands & SCAN_BAND_5_GHZ)
 			len += sprintf(buf + len, " 5 GHz");
 
+		if (bands & SCAN_BAND_6_GHZ)
+			len += sprintf(buf + len, " 6 GHz");
+
 		l_info("%s", buf);
 	}
 
@@ -709,6 +815,10 @@ static void wiphy_print_basic_info(struct wiphy *wiphy)
 		l_free(joined);
 		l_strfreev(iftypes);
 	}
+
+	if (wiphy->max_concurrent_stations > 1)
+		l_info("\tConcurrent station interfaces: %u",
+			wiphy->max_concurrent_stations);
 }
 
 static void parse_supported_commands(struct wiphy *wiphy,
@@ -852,8 +962,13 @@ static void parse_supported_bands(struct wiphy *wiphy,
 	uint16_t type;
 	struct l_genl_attr attr;
 
+	uint16_t len;
+	const void *data;
+
 	while (l_genl_attr_next(bands, &type, NULL, NULL)) {
 		enum nl80211_band band = type;
+		uint8_t *ht_capa;
+		uint8_t *vht_capa;
 
 		if (band != NL80211_BAND_2GHZ && band != NL80211_BAND_5GHZ)
 			continue;
@@ -861,7 +976,15 @@ static void parse_supported_bands(struct wiphy *wiphy,
 		if (!l_genl_attr_recurse(bands, &attr))
 			continue;
 
-		while (l_genl_attr_next(&attr, &type, NULL, NULL)) {
+		/*
+		 * Build the HT and VHT Capabilities IE bodies in the
+		 * 802.11 format directly, any fields nl80211 doesn't give
+		 * us (Extended HT, TxBF and ASEL Capabilities) are 0.
+		 */
+		ht_capa = wiphy->ht_capabilities[band];
+		vht_capa = wiphy->vht_capabilities[band];
+
+		while (l_genl_attr_next(&attr, &type, &len, &data)) {
 			struct l_genl_attr freqs;
 
 			switch (type) {
@@ -879,11 +1002,75 @@ static void parse_supported_bands(struct wiphy *wiphy,
 				wiphy->supported_rates[band] =
 					parse_supported_rates(&attr);
 				break;
+
+			case NL80211_BAND_ATTR_HT_CAPA:
+				if (len != 2)
+					continue;
+
+				memcpy(ht_capa, data, 2);
+				wiphy->ht_bands |= 1 << band;
+				break;
+
+			case NL80211_BAND_ATTR_HT_AMPDU_FACTOR:
+				if (len != 1)
+					continue;
+
+				ht_capa[2] |= *(const uint8_t *) data & 0x3;
+				break;
+
+			case NL80211_BAND_ATTR_HT_AMPDU_DENSITY:
+				if (len != 1)
+					continue;
+
+				ht_capa[2] |= (*(const uint8_t *) data & 0x7) <<
+						2;
+				break;
+
+			case NL80211_BAND_ATTR_HT_MCS_SET:
+				if (len != 16)
+					continue;
+
+				memcpy(ht_capa + 3, data, 16);
+				break;
+
+			case NL80211_BAND_ATTR_VHT_CAPA:
+				if (len != 4)
+					continue;
+
+				memcpy(vht_capa, data, 4);
+				wiphy->vht_bands |= 1 << band;
+				break;
+
+			case NL80211_BAND_ATTR_VHT_MCS_SET:
+				if (len != 8)
+					continue;
+
+				memcpy(vht_capa + 4, data, 8);
+				break;
 			}
 		}
 	}
 }
 
+static void parse_wowlan_triggers(struct wiphy *wiphy,
+					struct l_genl_attr *attr)
+{
+	uint16_t type, len;
+	const void *data;
+
+	while (l_genl_attr_next(attr, &type, &len, &data)) {
+		if (type != NL80211_WOWLAN_TRIG_NET_DETECT)
+			continue;
+
+		if (len != sizeof(uint32_t)) {
+			l_warn("Invalid WOWLAN_TRIG_NET_DETECT attribute");
+			continue;
+		}
+
+		wiphy->max_net_detect_match_sets = l_get_u32(data);
+	}
+}
+
 static void parse_supported_iftypes(struct wiphy *wiphy,
 						struct l_genl_attr *attr)
 {
@@ -904,6 +1091,83 @@ static void parse_supported_iftypes(struct wiphy *wiphy,
 	}
 }
 
+static unsigned int parse_iface_limit_stations(struct l_genl_attr *attr)
+{
+	uint16_t type, len;
+	const void *data;
+	struct l_genl_attr nested;
+	uint32_t max = 0;
+	bool station = false;
+
+	while (l_genl_attr_next(attr, &type, &len, &data)) {
+		switch (type) {
+		case NL80211_IFACE_LIMIT_MAX:
+			if (len == 4)
+				max = l_get_u32(data);
+			break;
+		case NL80211_IFACE_LIMIT_TYPES:
+			if (!l_genl_attr_recurse(attr, &nested))
+				break;
+
+			while (l_genl_attr_next(&nested, &type, NULL, NULL))
+				if (type == NL80211_IFTYPE_STATION)
+					station = true;
+			break;
+		}
+	}
+
+	return station ? max : 0;
+}
+
+static unsigned int parse_iface_comb_stations(struct l_genl_attr *attr)
+{
+	struct l_genl_attr limit;
+	unsigned int stations = 0;
+
+	while (l_genl_attr_next(attr, NULL, NULL, NULL))
+		if (l_genl_attr_recurse(attr, &limit))
+			stations += parse_iface_limit_stations(&limit);
+
+	return stations;
+}
+
+static void parse_interface_combinations(struct wiphy *wiphy,
+						struct l_genl_attr *attr)
+{
+	struct l_genl_attr comb;
+	struct l_genl_attr limits;
+	uint16_t type, len;
+	const void *data;
+
+	while (l_genl_attr_next(attr, NULL, NULL, NULL)) {
+		uint32_t stations = 0;
+		uint32_t maxnum = UINT8_MAX;
+
+		if (!l_genl_attr_recurse(attr, &comb))
+			continue;
+
+		while (l_genl_attr_next(&comb, &type, &len, &data)) {
+			switch (type) {
+			case NL80211_IFACE_COMB_LIMITS:
+				if (l_genl_attr_recurse(&comb, &limits))
+					stations = parse_iface_comb_stations(
+								&limits);
+				break;
+			case NL80211_IFACE_COMB_MAXNUM:
+				if (len == 4)
+					maxnum = minsize(l_get_u32(data),
+								UINT8_MAX);
+				break;
+			}
+		}
+
+		stations = minsize(stations, maxnum);
+
+		if (stations > wiphy->max_concurrent_stations)
+			wiphy->max_concurrent_stations = stations;
+	}
+}
+
 static void parse_iftype_extended_capabilities(struct wiphy *wiphy,
 						struct l_genl_attr *attr)
 {
@@ -989,6 +1253,25 @@ static void wiphy_parse_attributes(struct wiphy *wiphy,
 				wiphy->max_num_ssids_per_scan =
 							*((uint8_t *) data);
 			break;
+		case NL80211_ATTR_MAX_NUM_SCHED_SCAN_SSIDS:
+			if (len != sizeof(uint8_t))
+				l_warn("Invalid MAX_NUM_SCHED_SCAN_SSIDS "
+					"attribute");
+			else
+				wiphy->max_num_sched_scan_ssids =
+							*((uint8_t *) data);
+			break;
+		case NL80211_ATTR_MAX_MATCH_SETS:
+			if (len != sizeof(uint8_t))
+				l_warn("Invalid MAX_MATCH_SETS attribute");
+			else
+				wiphy->max_match_sets = *((uint8_t *) data);
+			break;
+		case NL80211_ATTR_WOWLAN_TRIGGERS_SUPPORTED:
+			if (l_genl_attr_recurse(&attr, &nested))
+				parse_wowlan_triggers(wiphy, &nested);
+
+			break;
 		case NL80211_ATTR_MAX_SCAN_IE_LEN:
 			if (len != sizeof(uint16_t))
 				l_warn("Invalid MAX_SCAN_IE_LEN attribute");
@@ -1002,9 +1285,16 @@ static void wiphy_parse_attributes(struct wiphy *wiphy,
 			if (l_genl_attr_recurse(&attr, &nested))
 				parse_supported_iftypes(wiphy, &nested);
 			break;
+		case NL80211_ATTR_INTERFACE_COMBINATIONS:
+			if (l_genl_attr_recurse(&attr, &nested))
+				parse_interface_combinations(wiphy, &nested);
+			break;
 		case NL80211_ATTR_OFFCHANNEL_TX_OK:
 			wiphy->offchannel_tx_ok = true;
 			break;
+		case NL80211_ATTR_SUPPORT_AP_UAPSD:
+			wiphy->support_ap_uapsd = true;
+			break;
 		case NL80211_ATTR_EXT_CAPA:
 			memcpy(wiphy->extended_capabilities + 2,
 				data, minsize(EXT_CAP_LEN, len));
@@ -1024,6 +1314,13 @@ static void wiphy_parse_attributes(struct wiphy *wiphy,
 		case NL80211_ATTR_ROAM_SUPPORT:
 			wiphy->support_fw_roam = true;
 			break;
+		case NL80211_ATTR_PROBE_RESP_OFFLOAD:
+			if (len != sizeof(uint32_t))
+				l_warn("Invalid PROBE_RESP_OFFLOAD attribute");
+			else
+				wiphy->probe_resp_offload =
+						*((uint32_t *) data);
+			break;
 		}
 	}
 }
@@ -1034,6 +1331,9 @@ static bool wiphy_get_driver_name(struct wiphy *wiphy)
 	char driver_path[256];
 	ssize_t len;
 
+	if (wiphy->driver_str)
+		return true;
+
 	driver_link = l_strdup_printf("/sys/class/ieee80211/%s/device/driver",
 					wiphy->name);
 	len = readlink(driver_link, driver_path, sizeof(driver_path) - 1);
@@ -1139,17 +1439,97 @@ struct wiphy *wiphy_create(uint32_t wiphy_id, const char *name)
 
 	if (!wiphy_is_managed(name))
 		wiphy->blacklisted = true;
+	else
+		wiphy->dump_msgs = l_queue_new();
 
-	wiphy->work = l_queue_new();
+	wiphy->work = l_heap_new(work_compare);
+	wiphy->work_index = l_hashmap_new();
 
 	return wiphy;
 }
 
+/*
+ * Create a wiphy with the capabilities cached from the previous run,
+ * provided the driver and permanent address still match.  The GET_WIPHY
+ * dump is still expected, wiphy_reconcile_cached() checks it against the
+ * cached copy once it completes.
+ */
+struct wiphy *wiphy_create_from_cache(uint32_t wiphy_id, const char *name)
+{
+	struct wiphy *wiphy;
+	L_AUTO_FREE_VAR(char *, driver) = NULL;
+	L_AUTO_FREE_VAR(char *, addr) = NULL;
+	unsigned int n_msgs;
+	unsigned int i;
+
+	if (!wiphy_is_managed(name))
+		return wiphy_create(wiphy_id, name);
+
+	if (!l_settings_has_group(wiphy_cache, name))
+		return NULL;
+
+	wiphy = wiphy_create(wiphy_id, name);
+
+	if (!wiphy_get_driver_name(wiphy) ||
+			wiphy_get_permanent_addr_from_sysfs(wiphy) < 0)
+		goto stale;
+
+	driver = l_settings_get_string(wiphy_cache, name, "Driver");
+	addr = l_settings_get_string(wiphy_cache, name, "Address");
+
+	if (!driver || strcmp(driver, wiphy->driver_str) || !addr ||
+			strcmp(addr, util_address_to_string(
+						wiphy->permanent_addr)))
+		goto stale;
+
+	if (!l_settings_get_uint(wiphy_cache, name, "Messages", &n_msgs) ||
+			!n_msgs)
+		goto stale;
+
+	for (i = 0; i < n_msgs; i++) {
+		char key[32];
+		uint8_t *data;
+		size_t len;
+		struct l_genl_msg *msg;
+
+		snprintf(key, sizeof(key), "Message%u", i);
+
+		data = l_settings_get_bytes(wiphy_cache, name, key, &len);
+		msg = data ? l_genl_msg_new_from_data(data, len) : NULL;
+		l_free(data);
+
+		if (!msg)
+			goto stale;
+
+		wiphy_parse_attributes(wiphy, msg);
+		l_genl_msg_unref(msg);
+	}
+
+	wiphy->from_cache = true;
+
+	l_debug("Using cached capabilities for %s", name);
+
+	return wiphy;
+
+stale:
+	l_debug("Cached capabilities for %s are stale", name);
+	l_settings_remove_group(wiphy_cache, name);
+	wiphy_destroy(wiphy);
+	return NULL;
+}
+
 void wiphy_update_from_genl(struct wiphy *wiphy, struct l_genl_msg *msg)
 {
 	if (wiphy->blacklisted)
 		return;
 
+	if (wiphy->dump_msgs)
+		l_queue_push_tail(wiphy->dump_msgs, l_genl_msg_ref(msg));
+
+	/* Checked against the cached capabilities once the dump completes */
+	if (wiphy->from_cache)
+		return;
+
 	wiphy_parse_attributes(wiphy, msg);
 }
 
@@ -1288,6 +1668,58 @@ static void wiphy_get_reg_domain(struct wiphy *wiphy)
 	}
 }
 
+static void wiphy_resync_reg_domain(void *data, void *user_data)
+{
+	struct wiphy *wiphy = data;
+
+	if (wiphy->registered)
+		wiphy_get_reg_domain(wiphy);
+}
+
+/* Regulatory changes are only notified, re-read in case one was lost */
+static void wiphy_overrun(void *user_data)
+{
+	l_queue_foreach(wiphy_list, wiphy_resync_reg_domain, NULL);
+}
+
+static void wiphy_cache_store(struct wiphy *wiphy)
+{
+	const struct l_queue_entry *entry;
+	unsigned int n_msgs = 0;
+
+	if (!wiphy_cache)
+		wiphy_cache = l_settings_new();
+
+	l_settings_remove_group(wiphy_cache, wiphy->name);
+
+	if (!wiphy->driver_str || l_memeqzero(wiphy->permanent_addr, 6) ||
+			l_queue_isempty(wiphy->dump_msgs))
+		goto sync;
+
+	l_settings_set_string(wiphy_cache, wiphy->name, "Driver",
+				wiphy->driver_str);
+	l_settings_set_string(wiphy_cache, wiphy->name, "Address",
+				util_address_to_string(wiphy->permanent_addr));
+
+	for (entry = l_queue_get_entries(wiphy->dump_msgs); entry;
+						entry = entry->next) {
+		char key[32];
+		const void *data;
+		size_t len;
+
+		/* Sequence number and port are meaningless once stored */
+		data = l_genl_msg_to_data(entry->data, 0, 0, 0, 0, &len);
+
+		snprintf(key, sizeof(key), "Message%u", n_msgs++);
+		l_settings_set_bytes(wiphy_cache, wiphy->name, key, data, len);
+	}
+
+	l_settings_set_uint(wiphy_cache, wiphy->name, "Messages", n_msgs);
+
+sync:
+	storage_wiphy_cache_sync(wiphy_cache);
+}
+
 void wiphy_create_complete(struct wiphy *wiphy)
 {
 	wiphy_register(wiphy);
@@ -1305,6 +1737,218 @@ void wiphy_create_complete(struct wiphy *wiphy)
 	wiphy_get_reg_domain(wiphy);
 
 	wiphy_print_basic_info(wiphy);
+
+	if (wiphy->from_cache)
+		return;
+
+	wiphy_cache_store(wiphy);
+
+	l_queue_destroy(wiphy->dump_msgs,
+				(l_queue_destroy_func_t) l_genl_msg_unref);
+	wiphy->dump_msgs = NULL;
+}
+
+struct freq_set_cmp {
+	const struct scan_freq_set *other;
+	bool missing;
+};
+
+static void freq_set_check(uint32_t freq, void *user_data)
+{
+	struct freq_set_cmp *cmp = user_data;
+
+	if (!scan_freq_set_contains(cmp->other, freq))
+		cmp->missing = true;
+}
+
+static bool wiphy_freqs_equal(const struct scan_freq_set *a,
+				const struct scan_freq_set *b)
+{
+	struct freq_set_cmp cmp = { .other = b };
+
+	scan_freq_set_foreach(a, freq_set_check, &cmp);
+	if (cmp.missing)
+		return false;
+
+	cmp.other = a;
+	scan_freq_set_foreach(b, freq_set_check, &cmp);
+
+	return !cmp.missing;
+}
+
+static bool wiphy_bytes_equal(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	if (!a || !b)
+		return a == b;
+
+	return !memcmp(a, b, len);
+}
+
+static bool wiphy_capabilities_equal(const struct wiphy *a,
+					const struct wiphy *b)
+{
+	unsigned int i;
+
+	if (a->feature_flags != b->feature_flags ||
+			memcmp(a->ext_features, b->ext_features,
+				sizeof(a->ext_features)) ||
+			a->max_num_ssids_per_scan !=
+				b->max_num_ssids_per_scan ||
+			a->max_num_sched_scan_ssids !=
+				b->max_num_sched_scan_ssids ||
+			a->max_match_sets != b->max_match_sets ||
+			a->max_net_detect_match_sets !=
+				b->max_net_detect_match_sets ||
+			a->max_roc_duration != b->max_roc_duration ||
+			a->max_scan_ie_len != b->max_scan_ie_len ||
+			a->probe_resp_offload != b->probe_resp_offload ||
+			a->supported_iftypes != b->supported_iftypes ||
+			a->supported_ciphers != b->supported_ciphers ||
+			a->max_concurrent_stations !=
+				b->max_concurrent_stations ||
+			memcmp(a->extended_capabilities,
+				b->extended_capabilities,
+				sizeof(a->extended_capabilities)) ||
+			memcmp(a->ht_capabilities, b->ht_capabilities,
+				sizeof(a->ht_capabilities)) ||
+			memcmp(a->vht_capabilities, b->vht_capabilities,
+				sizeof(a->vht_capabilities)) ||
+			a->ht_bands != b->ht_bands ||
+			a->vht_bands != b->vht_bands ||
+			a->support_scheduled_scan !=
+				b->support_scheduled_scan ||
+			a->support_rekey_offload != b->support_rekey_offload ||
+			a->support_adhoc_rsn != b->support_adhoc_rsn ||
+			a->support_qos_set_map != b->support_qos_set_map ||
+			a->support_cmds_auth_assoc !=
+				b->support_cmds_auth_assoc ||
+			a->support_fw_roam != b->support_fw_roam ||
+			a->offchannel_tx_ok != b->offchannel_tx_ok ||
+			a->support_ap_uapsd != b->support_ap_uapsd)
+		return false;
+
+	for (i = 0; i < NUM_NL80211_IFTYPES; i++)
+		if (!wiphy_bytes_equal(a->iftype_extended_capabilities[i],
+					b->iftype_extended_capabilities[i],
+					EXT_CAP_LEN + 2))
+			return false;
+
+	for (i = 0; i < NUM_NL80211_BANDS; i++) {
+		const uint8_t *ra = a->supported_rates[i];
+		const uint8_t *rb = b->supported_rates[i];
+
+		if (!ra || !rb ? ra != rb : strcmp((const char *) ra,
+							(const char *) rb))
+			return false;
+	}
+
+	return wiphy_freqs_equal(a->supported_freqs, b->supported_freqs);
+}
+
+/* Move the capabilities parsed into @from over to @to */
+static void wiphy_capabilities_take(struct wiphy *to, struct wiphy *from)
+{
+	struct scan_freq_set *freqs;
+	unsigned int i;
+
+	to->feature_flags = from->feature_flags;
+	memcpy(to->ext_features, from->ext_features, sizeof(to->ext_features));
+	to->max_num_ssids_per_scan = from->max_num_ssids_per_scan;
+	to->max_num_sched_scan_ssids = from->max_num_sched_scan_ssids;
+	to->max_match_sets = from->max_match_sets;
+	to->max_net_detect_match_sets = from->max_net_detect_match_sets;
+	to->max_roc_duration = from->max_roc_duration;
+	to->max_scan_ie_len = from->max_scan_ie_len;
+	to->probe_resp_offload = from->probe_resp_offload;
+	to->supported_iftypes = from->supported_iftypes;
+	to->supported_ciphers = from->supported_ciphers;
+	to->max_concurrent_stations = from->max_concurrent_stations;
+	memcpy(to->extended_capabilities, from->extended_capabilities,
+				sizeof(to->extended_capabilities));
+	memcpy(to->ht_capabilities, from->ht_capabilities,
+				sizeof(to->ht_capabilities));
+	memcpy(to->vht_capabilities, from->vht_capabilities,
+				sizeof(to->vht_capabilities));
+	to->ht_bands = from->ht_bands;
+	to->vht_bands = from->vht_bands;
+	to->support_scheduled_scan = from->support_scheduled_scan;
+	to->support_rekey_offload = from->support_rekey_offload;
+	to->support_adhoc_rsn = from->support_adhoc_rsn;
+	to->support_qos_set_map = from->support_qos_set_map;
+	to->support_cmds_auth_assoc = from->support_cmds_auth_assoc;
+	to->support_fw_roam = from->support_fw_roam;
+	to->offchannel_tx_ok = from->offchannel_tx_ok;
+	to->support_ap_uapsd = from->support_ap_uapsd;
+
+	/* Swap the allocations so that they are freed along with @from */
+	for (i = 0; i < NUM_NL80211_IFTYPES; i++) {
+		uint8_t *tmp = to->iftype_extended_capabilities[i];
+
+		to->iftype_extended_capabilities[i] =
+					from->iftype_extended_capabilities[i];
+		from->iftype_extended_capabilities[i] = tmp;
+	}
+
+	for (i = 0; i < NUM_NL80211_BANDS; i++) {
+		uint8_t *tmp = to->supported_rates[i];
+
+		to->supported_rates[i] = from->supported_rates[i];
+		from->supported_rates[i] = tmp;
+	}
+
+	freqs = to->supported_freqs;
+	to->supported_freqs = from->supported_freqs;
+	from->supported_freqs = freqs;
+
+	memset(to->rm_enabled_capabilities, 0,
+				sizeof(to->rm_enabled_capabilities));
+	wiphy_setup_rm_enabled_capabilities(to);
+}
+
+/*
+ * Called once the GET_WIPHY dump has completed, compares the real
+ * capabilities of the wiphys set up from the cache with the cached ones
+ * and applies them if they changed, e.g. after a driver or firmware update.
+ */
+void wiphy_reconcile_cached(void)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(wiphy_list); entry;
+						entry = entry->next) {
+		struct wiphy *wiphy = entry->data;
+		struct wiphy *dumped;
+		const struct l_queue_entry *e;
+
+		if (!wiphy->from_cache)
+			continue;
+
+		wiphy->from_cache = false;
+
+		if (l_queue_isempty(wiphy->dump_msgs))
+			goto done;
+
+		dumped = wiphy_new(wiphy->id);
+
+		for (e = l_queue_get_entries(wiphy->dump_msgs); e; e = e->next)
+			wiphy_parse_attributes(dumped, e->data);
+
+		wiphy_set_station_capability_bits(dumped);
+
+		if (!wiphy_capabilities_equal(wiphy, dumped)) {
+			l_info("Capabilities of %s changed since the last run",
+				wiphy->name);
+			wiphy_capabilities_take(wiphy, dumped);
+			wiphy_cache_store(wiphy);
+		}
+
+		wiphy_free(dumped);
+
+done:
+		l_queue_destroy(wiphy->dump_msgs,
+				(l_queue_destroy_func_t) l_genl_msg_unref);
+		wiphy->dump_msgs = NULL;
+	}
 }
 
 bool wiphy_destroy(struct wiphy *wiphy)
@@ -1519,44 +2163,71 @@ static void wiphy_reg_notify(struct l_genl_msg *msg, void *user_data)
 	}
 }
 
+static void wiphy_radio_work_stopped(struct wiphy_radio_work_item *work)
+{
+	uint64_t now = l_time_now();
+
+	if (work->running) {
+		work->run_time += l_time_diff(work->start_time, now);
+		work->running = false;
+	} else
+		work->wait_time += l_time_diff(work->queued_time, now);
+
+	work->queued_time = now;
+}
+
 static void wiphy_radio_work_next(struct wiphy *wiphy)
 {
 	struct wiphy_radio_work_item *work;
 	bool done;
 
-	work = l_queue_peek_head(wiphy->work);
+	work = l_heap_peek(wiphy->work);
 	if (!work)
 		return;
 
 	/*
 	 * Ensures no other work item will get inserted before this one while
-	 * the work is being done.
+	 * the work is being done, unless it first gets preempted.
 	 */
-	work->priority = INT_MIN;
-
-	l_debug("Starting work item %u", work->id);
+	work->start_time = l_time_now();
+	work->wait_time += l_time_diff(work->queued_time, work->start_time);
+	work->running = true;
+
+	l_debug("Starting work item %u after %" PRIu64 " ms in queue",
+			work->id, l_time_to_msecs(work->wait_time));
+	TRACE(radio_work_start, wiphy->id, work->id, work->priority,
+			work->wait_time);
 	done = work->ops->do_work(work);
 
 	if (done) {
+		l_hashmap_remove(wiphy->work_index, L_UINT_TO_PTR(work->id));
+		l_heap_remove(wiphy->work, work->handle);
 		work->id = 0;
 
-		l_queue_remove(wiphy->work, work);
-
 		destroy_work(work);
 
 		wiphy_radio_work_next(wiphy);
 	}
 }
 
-static int insert_by_priority(const void *a, const void *b, void *user_data)
+static void wiphy_radio_work_preempt(struct wiphy *wiphy,
+					struct wiphy_radio_work_item *work,
+					int priority)
 {
-	const struct wiphy_radio_work_item *new = a;
-	const struct wiphy_radio_work_item *work = b;
+	if (!work || !work->running || work->priority <= priority ||
+			!work->ops->abort)
+		return;
+
+	if (!work->ops->abort(work))
+		return;
+
+	l_debug("Work item %u preempted", work->id);
 
-	if (work->priority <= new->priority)
-		return 1;
+	wiphy_radio_work_stopped(work);
 
-	return -1;
+	/* Requeue behind any items already waiting at the same priority */
+	work->seq = ++work_seq;
+	l_heap_update(wiphy->work, work->handle);
 }
 
 uint32_t wiphy_radio_work_insert(struct wiphy *wiphy,
@@ -1564,49 +2235,49 @@ uint32_t wiphy_radio_work_insert(struct wiphy *wiphy,
 				int priority,
 				const struct wiphy_radio_work_item_ops *ops)
 {
+	struct wiphy_radio_work_item *head;
+
 	item->priority = priority;
 	item->ops = ops;
 	item->id = ++work_ids;
+	item->seq = ++work_seq;
+	item->queued_time = l_time_now();
+	item->wait_time = 0;
+	item->run_time = 0;
+	item->running = false;
 
 	l_debug("Inserting work item %u", item->id);
 
-	l_queue_insert(wiphy->work, item, insert_by_priority, NULL);
+	wiphy_radio_work_preempt(wiphy, l_heap_peek(wiphy->work), priority);
 
-	if (l_queue_length(wiphy->work) == 1)
+	item->handle = l_heap_push(wiphy->work, item);
+	l_hashmap_insert(wiphy->work_index, L_UINT_TO_PTR(item->id), item);
+
+	head = l_heap_peek(wiphy->work);
+	if (!head->running)
 		wiphy_radio_work_next(wiphy);
 
 	return item->id;
 }
 
-static bool match_id(const void *a, const void *b)
-{
-	const struct wiphy_radio_work_item *item = a;
-
-	if (item->id == L_PTR_TO_UINT(b))
-		return true;
-
-	return false;
-}
-
 void wiphy_radio_work_done(struct wiphy *wiphy, uint32_t id)
 {
 	struct wiphy_radio_work_item *item;
-	bool next = false;
+	bool next;
 
-	item = l_queue_peek_head(wiphy->work);
+	item = l_hashmap_remove(wiphy->work_index, L_UINT_TO_PTR(id));
 	if (!item)
 		return;
 
-	if (item->id == id) {
-		next = true;
-		l_queue_pop_head(wiphy->work);
-	} else
-		item = l_queue_remove_if(wiphy->work, match_id,
-						L_UINT_TO_PTR(id));
-	if (!item)
-		return;
+	next = item == l_heap_peek(wiphy->work);
+	l_heap_remove(wiphy->work, item->handle);
 
-	l_debug("Work item %u done", id);
+	wiphy_radio_work_stopped(item);
+
+	l_debug("Work item %u done, queued %" PRIu64 " ms, ran %" PRIu64
+			" ms", id, l_time_to_msecs(item->wait_time),
+			l_time_to_msecs(item->run_time));
+	TRACE(radio_work_done, wiphy->id, id, item->run_time);
 
 	item->id = 0;
 
@@ -1618,7 +2289,7 @@ void wiphy_radio_work_done(struct wiphy *wiphy, uint32_t id)
 
 bool wiphy_radio_work_is_running(struct wiphy *wiphy, uint32_t id)
 {
-	struct wiphy_radio_work_item *item = l_queue_peek_head(wiphy->work);
+	struct wiphy_radio_work_item *item = l_heap_peek(wiphy->work);
 
 	if (!item)
 		return false;
@@ -1657,6 +2328,7 @@ static int wiphy_init(void)
 				IWD_WIPHY_INTERFACE);
 
 	hwdb = l_hwdb_new_default();
+	wiphy_cache = storage_wiphy_cache_load();
 
 	if (whitelist)
 		whitelist_filter = l_strsplit(whitelist, ',');
@@ -1680,6 +2352,9 @@ static int wiphy_init(void)
 					wiphy_reg_notify, NULL, NULL))
 		l_error("Registering for regulatory notifications failed");
 
+	overrun_watch = l_genl_add_overrun_watch(genl, wiphy_overrun,
+							NULL, NULL);
+
 	return 0;
 }
 
@@ -1688,6 +2363,9 @@ static void wiphy_exit(void)
 	l_strfreev(whitelist_filter);
 	l_strfreev(blacklist_filter);
 
+	l_genl_remove_overrun_watch(iwd_get_genl(), overrun_watch);
+	overrun_watch = 0;
+
 	l_queue_destroy(wiphy_list, wiphy_free);
 	wiphy_list = NULL;
 
@@ -1698,6 +2376,9 @@ static void wiphy_exit(void)
 	l_dbus_unregister_interface(dbus_get_bus(), IWD_WIPHY_INTERFACE);
 
 	l_hwdb_unref(hwdb);
+
+	l_settings_free(wiphy_cache);
+	wiphy_cache = NULL;
 }
 
 IWD_MODULE(wiphy, wiphy_init, wiphy_exit);
@@ -31,16 +31,32 @@ struct wiphy_radio_work_item;
 typedef bool (*wiphy_radio_work_func_t)(struct wiphy_radio_work_item *item);
 typedef void (*wiphy_radio_work_destroy_func_t)(
 					struct wiphy_radio_work_item *item);
+typedef bool (*wiphy_radio_work_abort_func_t)(
+					struct wiphy_radio_work_item *item);
 
 struct wiphy_radio_work_item_ops {
 	wiphy_radio_work_func_t do_work;
 	wiphy_radio_work_destroy_func_t destroy;
+	/*
+	 * Optional.  Asks a running item to stop so that a higher priority
+	 * item can use the radio.  Returns true if the item has stopped and
+	 * wants do_work called again once it is back at the head of the
+	 * queue, false if it can't be interrupted right now.
+	 */
+	wiphy_radio_work_abort_func_t abort;
 };
 
 struct wiphy_radio_work_item {
 	uint32_t id;
 	int priority;
 	const struct wiphy_radio_work_item_ops *ops;
+	uint64_t queued_time;	/* When last (re)queued */
+	uint64_t start_time;	/* When do_work was last called */
+	uint64_t wait_time;	/* Total time spent queued, in usec */
+	uint64_t run_time;	/* Total time spent running, in usec */
+	unsigned int handle;	/* Handle in the wiphy work heap */
+	uint32_t seq;		/* Keeps FIFO order within a priority */
+	bool running : 1;
 };
 
 enum wiphy_state_watch_event {
@@ -65,6 +81,8 @@ struct wiphy *wiphy_find(int wiphy_id);
 bool wiphy_is_blacklisted(const struct wiphy *wiphy);
 
 struct wiphy *wiphy_create(uint32_t wiphy_id, const char *name);
+struct wiphy *wiphy_create_from_cache(uint32_t wiphy_id, const char *name);
+void wiphy_reconcile_cached(void);
 void wiphy_update_name(struct wiphy *wiphy, const char *name);
 void wiphy_create_complete(struct wiphy *wiphy);
 bool wiphy_destroy(struct wiphy *wiphy);
@@ -86,15 +104,26 @@ bool wiphy_rrm_capable(struct wiphy *wiphy);
 bool wiphy_has_feature(struct wiphy *wiphy, uint32_t feature);
 bool wiphy_has_ext_feature(struct wiphy *wiphy, uint32_t feature);
 uint8_t wiphy_get_max_num_ssids_per_scan(struct wiphy *wiphy);
+bool wiphy_supports_sched_scan(struct wiphy *wiphy);
+uint8_t wiphy_get_max_num_sched_scan_ssids(struct wiphy *wiphy);
+uint8_t wiphy_get_max_match_sets(struct wiphy *wiphy);
+uint32_t wiphy_get_max_net_detect_match_sets(struct wiphy *wiphy);
 uint16_t wiphy_get_max_scan_ie_len(struct wiphy *wiphy);
 uint32_t wiphy_get_max_roc_duration(struct wiphy *wiphy);
 bool wiphy_supports_iftype(struct wiphy *wiphy, uint32_t iftype);
 const uint8_t *wiphy_get_supported_rates(struct wiphy *wiphy, unsigned int band,
 						unsigned int *out_num);
+const uint8_t *wiphy_get_ht_capabilities(struct wiphy *wiphy,
+						unsigned int band);
+const uint8_t *wiphy_get_vht_capabilities(struct wiphy *wiphy,
+						unsigned int band);
 bool wiphy_supports_adhoc_rsn(struct wiphy *wiphy);
 bool wiphy_can_offchannel_tx(struct wiphy *wiphy);
+bool wiphy_supports_ap_uapsd(struct wiphy *wiphy);
 bool wiphy_supports_qos_set_map(struct wiphy *wiphy);
 bool wiphy_supports_firmware_roam(struct wiphy *wiphy);
+bool wiphy_supports_probe_resp_offload(struct wiphy *wiphy,
+					uint32_t protocols);
 const char *wiphy_get_driver(struct wiphy *wiphy);
 const char *wiphy_get_name(struct wiphy *wiphy);
 const uint8_t *wiphy_get_permanent_address(struct wiphy *wiphy);
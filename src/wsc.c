@@ -255,6 +255,7 @@ static void wsc_enrollee_netdev_event(struct netdev *netdev,
 		break;
 	case NETDEV_EVENT_RSSI_THRESHOLD_LOW:
 	case NETDEV_EVENT_RSSI_THRESHOLD_HIGH:
+	case NETDEV_EVENT_CHANNEL_SWITCHED:
 		break;
 	default:
 		l_debug("Unexpected event: %d", event);
@@ -308,6 +309,8 @@ static inline enum wsc_rf_band freq_to_rf_band(uint32_t freq)
 		return WSC_RF_BAND_2_4_GHZ;
 	case SCAN_BAND_5_GHZ:
 		return WSC_RF_BAND_5_0_GHZ;
+	case SCAN_BAND_6_GHZ:
+		break;
 	}
 
 	return WSC_RF_BAND_2_4_GHZ;
@@ -456,8 +459,17 @@ struct wsc_station_dbus {
 	struct l_timeout *walk_timer;
 	uint32_t scan_id;
 	uint32_t station_state_watch;
+	struct scan_freq_set *wps_freqs;	/* Where WSC APs were seen */
+	unsigned int scan_count;
 };
 
+/*
+ * While looking for a PBC registrar only the channels where WSC capable APs
+ * have been seen are probed, with a full scan every WSC_FULL_SCAN_PERIOD
+ * scans to pick up APs that weren't there before.
+ */
+#define WSC_FULL_SCAN_PERIOD 4
+
 #define CONNECT_REPLY(wsc, message)					\
 	if ((wsc)->super.pending_connect)				\
 		dbus_pending_reply(&(wsc)->super.pending_connect,	\
@@ -655,6 +667,10 @@ static void wsc_cancel_scan(struct wsc_station_dbus *wsc)
 	l_free(wsc->wsc_ies);
 	wsc->wsc_ies = 0;
 
+	scan_freq_set_free(wsc->wps_freqs);
+	wsc->wps_freqs = NULL;
+	wsc->scan_count = 0;
+
 	if (wsc->scan_id > 0) {
 		scan_cancel(netdev_get_wdev_id(wsc->netdev), wsc->scan_id);
 		wsc->scan_id = 0;
@@ -682,6 +698,98 @@ static void pin_timeout(struct l_timeout *timeout, void *user_data)
 	CONNECT_REPLY(wsc, wsc_error_time_expired);
 }
 
+static void wsc_add_wps_freqs(struct wsc_station_dbus *wsc,
+				struct l_queue *bss_list)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(bss_list); entry;
+						entry = entry->next) {
+		struct scan_bss *bss = entry->data;
+		enum scan_band band;
+
+		if (!bss->wsc)
+			continue;
+
+		/* WSC is not allowed on 6GHz */
+		if (!scan_freq_to_channel(bss->frequency, &band) ||
+				band == SCAN_BAND_6_GHZ)
+			continue;
+
+		if (!wsc->wps_freqs)
+			wsc->wps_freqs = scan_freq_set_new();
+
+		scan_freq_set_add(wsc->wps_freqs, bss->frequency);
+	}
+}
+
+static bool push_button_scan_results(int err, struct l_queue *bss_list,
+					const struct scan_freq_set *freqs,
+					void *userdata);
+
+static uint32_t push_button_scan(struct wsc_station_dbus *wsc)
+{
+	struct scan_parameters params = {
+		.extra_ie = wsc->wsc_ies,
+		.extra_ie_size = wsc->wsc_ies_size,
+	};
+
+	if (++wsc->scan_count % WSC_FULL_SCAN_PERIOD && wsc->wps_freqs)
+		params.freqs = wsc->wps_freqs;
+
+	return scan_active_full(netdev_get_wdev_id(wsc->netdev), &params,
+				NULL, push_button_scan_results, wsc, NULL);
+}
+
+/*
+ * Only the few attributes needed to spot an active PBC registrar are looked
+ * at, walking the payload in place rather than parsing a full Probe Response
+ * for every WSC capable BSS on every scan.
+ */
+static bool wsc_bss_pbc_active(const struct scan_bss *bss, uint8_t *uuid_e)
+{
+	struct wsc_attr_iter iter;
+	bool selected_registrar = false;
+	bool push_button = false;
+
+	memset(uuid_e, 0, 16);
+	wsc_attr_iter_init(&iter, bss->wsc, bss->wsc_size);
+
+	while (wsc_attr_iter_next(&iter)) {
+		const uint8_t *data = wsc_attr_iter_get_data(&iter);
+		unsigned int len = wsc_attr_iter_get_length(&iter);
+
+		switch (wsc_attr_iter_get_type(&iter)) {
+		case WSC_ATTR_SELECTED_REGISTRAR:
+			if (len != 1)
+				return false;
+
+			selected_registrar = data[0];
+			break;
+		case WSC_ATTR_DEVICE_PASSWORD_ID:
+			if (len != 2)
+				return false;
+
+			push_button = l_get_be16(data) ==
+					WSC_DEVICE_PASSWORD_ID_PUSH_BUTTON;
+			break;
+		case WSC_ATTR_UUID_E:
+			if (len != 16)
+				return false;
+
+			memcpy(uuid_e, data, 16);
+			break;
+		default:
+			break;
+		}
+	}
+
+	l_debug("SelectedRegistar: %s",
+			selected_registrar ? "true" : "false");
+
+	return selected_registrar && push_button;
+}
+
 static bool push_button_scan_results(int err, struct l_queue *bss_list,
 					const struct scan_freq_set *freqs,
 					void *userdata)
@@ -692,8 +800,8 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 	struct scan_bss *target;
 	uint8_t uuid_2g[16];
 	uint8_t uuid_5g[16];
+	uint8_t uuid_e[16];
 	const struct l_queue_entry *bss_entry;
-	struct wsc_probe_response probe_response;
 
 	if (err) {
 		wsc_cancel_scan(wsc);
@@ -706,12 +814,12 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 	bss_5g = NULL;
 
 	wsc->scan_id = 0;
+	wsc_add_wps_freqs(wsc, bss_list);
 
 	for (bss_entry = l_queue_get_entries(bss_list); bss_entry;
 				bss_entry = bss_entry->next) {
 		struct scan_bss *bss = bss_entry->data;
 		enum scan_band band;
-		int err;
 
 		l_debug("bss '%s' with SSID: %s, freq: %u",
 			util_address_to_string(bss->addr),
@@ -723,22 +831,7 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 		if (!bss->wsc)
 			continue;
 
-		err = wsc_parse_probe_response(bss->wsc, bss->wsc_size,
-						&probe_response);
-		if (err < 0) {
-			l_debug("ProbeResponse parse failed: %s",
-							strerror(-err));
-			continue;
-		}
-
-		l_debug("SelectedRegistar: %s",
-			probe_response.selected_registrar ? "true" : "false");
-
-		if (!probe_response.selected_registrar)
-			continue;
-
-		if (probe_response.device_password_id !=
-				WSC_DEVICE_PASSWORD_ID_PUSH_BUTTON)
+		if (!wsc_bss_pbc_active(bss, uuid_e))
 			continue;
 
 		scan_freq_to_channel(bss->frequency, &band);
@@ -751,7 +844,7 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 			}
 
 			bss_2g = bss;
-			memcpy(uuid_2g, probe_response.uuid_e, 16);
+			memcpy(uuid_2g, uuid_e, 16);
 			break;
 
 		case SCAN_BAND_5_GHZ:
@@ -761,9 +854,13 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 			}
 
 			bss_5g = bss;
-			memcpy(uuid_5g, probe_response.uuid_e, 16);
+			memcpy(uuid_5g, uuid_e, 16);
 			break;
 
+		case SCAN_BAND_6_GHZ:
+			/* WSC is not allowed on 6GHz */
+			continue;
+
 		default:
 			return false;
 		}
@@ -780,10 +877,7 @@ static bool push_button_scan_results(int err, struct l_queue *bss_list,
 		target = bss_2g;
 	else {
 		l_debug("No PBC APs found, running the scan again");
-		wsc->scan_id = scan_active(netdev_get_wdev_id(wsc->netdev),
-						wsc->wsc_ies, wsc->wsc_ies_size,
-						NULL, push_button_scan_results,
-						wsc, NULL);
+		wsc->scan_id = push_button_scan(wsc);
 		return false;
 	}
 
@@ -994,12 +1088,20 @@ static bool wsc_initiate_scan(struct wsc_station_dbus *wsc,
 	if (!wsc->wsc_ies)
 		return false;
 
-	wsc->scan_id = scan_active(netdev_get_wdev_id(wsc->netdev),
-					wsc->wsc_ies, wsc->wsc_ies_size,
-					NULL, callback, wsc, NULL);
+	if (dpid == WSC_DEVICE_PASSWORD_ID_PUSH_BUTTON) {
+		/* Start with the channels from the last station scan */
+		wsc_add_wps_freqs(wsc, station_get_bss_list(wsc->station));
+		wsc->scan_id = push_button_scan(wsc);
+	} else
+		wsc->scan_id = scan_active(netdev_get_wdev_id(wsc->netdev),
+						wsc->wsc_ies, wsc->wsc_ies_size,
+						NULL, callback, wsc, NULL);
+
 	if (!wsc->scan_id) {
 		l_free(wsc->wsc_ies);
 		wsc->wsc_ies = NULL;
+		scan_freq_set_free(wsc->wps_freqs);
+		wsc->wps_freqs = NULL;
 
 		return false;
 	}
@@ -1109,6 +1211,8 @@ static struct l_dbus_message *wsc_push_button(struct l_dbus *dbus,
 	if (wsc->pending_connect || wsc->pending_cancel)
 		return dbus_error_busy(message);
 
+	eap_wsc_prepare_key_pairs();
+
 	wsc->pending_connect = l_dbus_message_ref(message);
 	wsc->connect(wsc, NULL);
 	return NULL;
@@ -1130,6 +1234,9 @@ static struct l_dbus_message *wsc_generate_pin(struct l_dbus *dbus,
 	if (!wsc_pin_generate(pin))
 		return dbus_error_failed(message);
 
+	/* The PIN is likely to be entered on the peer shortly */
+	eap_wsc_prepare_key_pairs();
+
 	reply = l_dbus_message_new_method_return(message);
 	l_dbus_message_set_arguments(reply, "s", pin);
 	explicit_bzero(pin, 9);
@@ -1155,6 +1262,8 @@ static struct l_dbus_message *wsc_start_pin(struct l_dbus *dbus,
 	if (!wsc_pin_is_valid(pin))
 		return dbus_error_invalid_format(message);
 
+	eap_wsc_prepare_key_pairs();
+
 	wsc->pending_connect = l_dbus_message_ref(message);
 	wsc->connect(wsc, pin);
 	return NULL;
@@ -25,6 +25,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <stdio.h>
@@ -643,6 +644,15 @@ static attr_handler handler_for_type(enum wsc_attr type)
 	return NULL;
 }
 
+/*
+ * Upper bound on the number of attributes a single message type is parsed
+ * into, the largest being M1 and M2
+ */
+#define WSC_PARSE_MAX_ATTRS	32
+
+/* Internal spec-only flag: parse and validate, but don't store the value */
+#define WSC_ATTR_FLAG_DISCARD	0x80000000
+
 struct attr_handler_entry {
 	enum wsc_attr type;
 	unsigned int flags;
@@ -650,6 +660,16 @@ struct attr_handler_entry {
 	bool present;
 };
 
+/*
+ * Compile-time description of the attributes of a given message.  Values
+ * are stored at @offset within the output structure.
+ */
+struct wsc_attr_spec {
+	enum wsc_attr type;
+	unsigned int flags;
+	size_t offset;
+};
+
 static bool verify_version2(struct wsc_wfa_ext_iter *ext_iter)
 {
 	if (!wsc_wfa_ext_iter_next(ext_iter))
@@ -664,65 +684,41 @@ static bool verify_version2(struct wsc_wfa_ext_iter *ext_iter)
 	return true;
 }
 
-int wsc_parse_attrs(const unsigned char *pdu, unsigned int len,
-			bool *out_version2, struct wsc_wfa_ext_iter *ext_iter,
-			enum wsc_attr authenticator_type,
-			uint8_t *authenticator, int type, ...)
+static int wsc_parse_attr_entries(const unsigned char *pdu, unsigned int len,
+				bool *out_version2,
+				struct wsc_wfa_ext_iter *ext_iter,
+				enum wsc_attr authenticator_type,
+				uint8_t *authenticator,
+				struct attr_handler_entry *entries,
+				unsigned int n_entries)
 {
 	struct wsc_attr_iter iter;
-	struct l_queue *entries;
-	const struct l_queue_entry *e;
-	va_list args;
+	unsigned int e = 0;
+	unsigned int i;
 	bool version2 = false;
 	bool sr = false;
-	bool have_required = true;
-	bool parse_error = false;
 
 	if (ext_iter) /* In case of no WFA extension */
 		wsc_wfa_ext_iter_init(ext_iter, NULL, 0);
 
 	wsc_attr_iter_init(&iter, pdu, len);
 
-	va_start(args, type);
-
-	entries = l_queue_new();
-
-	while (type != WSC_ATTR_INVALID) {
-		struct attr_handler_entry *entry;
-
-		entry = l_new(struct attr_handler_entry, 1);
-
-		entry->type = type;
-		entry->flags = va_arg(args, unsigned int);
-		entry->data = va_arg(args, void *);
-
-		type = va_arg(args, enum wsc_attr);
-		l_queue_push_tail(entries, entry);
-	}
-
-	va_end(args);
-	e = l_queue_get_entries(entries);
-
 	while (wsc_attr_iter_next(&iter)) {
 		attr_handler handler;
-		struct attr_handler_entry *entry;
-		const struct l_queue_entry *e2;
-
-		for (e2 = e; e2; e2 = e2->next) {
-			entry = e2->data;
+		struct attr_handler_entry *entry = NULL;
 
-			if (wsc_attr_iter_get_type(&iter) == entry->type) {
+		for (i = e; i < n_entries; i++) {
+			if (wsc_attr_iter_get_type(&iter) == entries[i].type) {
+				entry = &entries[i];
 				entry->present = true;
 				break;
 			}
 
-			if (entry->flags & WSC_ATTR_FLAG_REQUIRED) {
-				have_required = false;
-				goto done;
-			}
+			if (entries[i].flags & WSC_ATTR_FLAG_REQUIRED)
+				return -EINVAL;
 		}
 
-		if (e2 == NULL) {
+		if (!entry) {
 			if (!ext_iter)
 				break;
 
@@ -733,10 +729,8 @@ int wsc_parse_attrs(const unsigned char *pdu, unsigned int len,
 			if (!wsc_attr_iter_recurse_wfa_ext(&iter, ext_iter))
 				break;
 
-			if (!verify_version2(ext_iter)) {
-				parse_error = true;
-				goto done;
-			}
+			if (!verify_version2(ext_iter))
+				return -EBADMSG;
 
 			version2 = true;
 			continue;
@@ -747,46 +741,31 @@ int wsc_parse_attrs(const unsigned char *pdu, unsigned int len,
 
 		handler = handler_for_type(entry->type);
 
-		if (!handler(&iter, entry->data)) {
-			parse_error = true;
-			goto done;
-		}
+		if (!handler(&iter, entry->data))
+			return -EBADMSG;
 
-		e = e2->next;
+		e = i + 1;
 	}
 
-	for (; e; e = e->next) {
-		struct attr_handler_entry *entry = e->data;
-
-		if (entry->flags & WSC_ATTR_FLAG_REQUIRED) {
-			parse_error = true;
-			goto done;
-		}
-	}
+	for (; e < n_entries; e++)
+		if (entries[e].flags & WSC_ATTR_FLAG_REQUIRED)
+			return -EBADMSG;
 
 	/* Authenticator element must be the last element */
 	if (authenticator) {
 		while (wsc_attr_iter_get_type(&iter) != authenticator_type) {
-			if (!wsc_attr_iter_next(&iter)) {
-				have_required = false;
-				goto done;
-			}
+			if (!wsc_attr_iter_next(&iter))
+				return -EINVAL;
 		}
 
-		if (!extract_authenticator(&iter, authenticator)) {
-			parse_error = true;
-			goto done;
-		}
+		if (!extract_authenticator(&iter, authenticator))
+			return -EBADMSG;
 
-		if (wsc_attr_iter_next(&iter) != false) {
-			parse_error = true;
-			goto done;
-		}
+		if (wsc_attr_iter_next(&iter) != false)
+			return -EBADMSG;
 
-		if (wsc_attr_iter_get_pos(&iter) != len) {
-			parse_error = true;
-			goto done;
-		}
+		if (wsc_attr_iter_get_pos(&iter) != len)
+			return -EBADMSG;
 	}
 
 	/*
@@ -794,58 +773,86 @@ int wsc_parse_attrs(const unsigned char *pdu, unsigned int len,
 	 * If version2 attribute is present in the WFA Vendor field,
 	 * then check the required attributes are present.  Mostly relevant
 	 * for Probe Request messages according to 8.2.4 in WSC 2.0.5
+	 *
+	 * If Selected Registrar is present and true, then certain attributes
+	 * must also be present.
 	 */
-	if (version2) {
-		struct attr_handler_entry *entry;
-
-		for (e = l_queue_get_entries(entries); e; e = e->next) {
-			entry = e->data;
-
-			if (!(entry->flags & WSC_ATTR_FLAG_VERSION2))
-				continue;
+	for (i = 0; i < n_entries; i++) {
+		if (entries[i].present)
+			continue;
 
-			if (entry->present)
-				continue;
+		if (version2 && (entries[i].flags & WSC_ATTR_FLAG_VERSION2))
+			return -EBADMSG;
 
-			parse_error = true;
-			goto done;
-		}
+		if (sr && (entries[i].flags & WSC_ATTR_FLAG_REGISTRAR))
+			return -EBADMSG;
 	}
 
-	/*
-	 * If Selected Registrar is present and true, then certain attributes
-	 * must also be present.
-	 */
-	if (sr) {
-		struct attr_handler_entry *entry;
+	if (out_version2)
+		*out_version2 = version2;
 
-		for (e = l_queue_get_entries(entries); e; e = e->next) {
-			entry = e->data;
+	return 0;
+}
 
-			if (!(entry->flags & WSC_ATTR_FLAG_REGISTRAR))
-				continue;
+int wsc_parse_attrs(const unsigned char *pdu, unsigned int len,
+			bool *out_version2, struct wsc_wfa_ext_iter *ext_iter,
+			enum wsc_attr authenticator_type,
+			uint8_t *authenticator, int type, ...)
+{
+	struct attr_handler_entry entries[WSC_PARSE_MAX_ATTRS];
+	unsigned int n_entries = 0;
+	va_list args;
 
-			if (entry->present)
-				continue;
+	va_start(args, type);
 
-			parse_error = true;
-			goto done;
+	while (type != WSC_ATTR_INVALID) {
+		if (L_WARN_ON(n_entries == L_ARRAY_SIZE(entries))) {
+			va_end(args);
+			return -EINVAL;
 		}
 
+		entries[n_entries].type = type;
+		entries[n_entries].flags = va_arg(args, unsigned int);
+		entries[n_entries].data = va_arg(args, void *);
+		entries[n_entries].present = false;
+		n_entries += 1;
+
+		type = va_arg(args, enum wsc_attr);
 	}
 
-done:
-	l_queue_destroy(entries, l_free);
+	va_end(args);
+
+	return wsc_parse_attr_entries(pdu, len, out_version2, ext_iter,
+					authenticator_type, authenticator,
+					entries, n_entries);
+}
 
-	if (!have_required)
+static int wsc_parse_attrs_spec(const unsigned char *pdu, unsigned int len,
+				bool *out_version2,
+				struct wsc_wfa_ext_iter *ext_iter,
+				const struct wsc_attr_spec *spec,
+				unsigned int n_spec, void *out)
+{
+	struct attr_handler_entry entries[WSC_PARSE_MAX_ATTRS];
+	uint8_t discard[8];
+	unsigned int i;
+
+	if (L_WARN_ON(n_spec > L_ARRAY_SIZE(entries)))
 		return -EINVAL;
-	if (parse_error)
-		return -EBADMSG;
 
-	if (out_version2)
-		*out_version2 = version2;
+	for (i = 0; i < n_spec; i++) {
+		entries[i].type = spec[i].type;
+		entries[i].flags = spec[i].flags & ~WSC_ATTR_FLAG_DISCARD;
+		entries[i].data = (uint8_t *) out + spec[i].offset;
 
-	return 0;
+		if (spec[i].flags & WSC_ATTR_FLAG_DISCARD)
+			entries[i].data = discard;
+
+		entries[i].present = false;
+	}
+
+	return wsc_parse_attr_entries(pdu, len, out_version2, ext_iter,
+					0, NULL, entries, n_spec);
 }
 
 static bool wfa_extract_bool(struct wsc_wfa_ext_iter *iter, void *data)
@@ -943,26 +950,98 @@ int wsc_parse_credential(const uint8_t *pdu, uint32_t len,
 	return 0;
 }
 
+#define ATTR_SPEC(attr, flags, type, field) \
+	{ WSC_ATTR_ ## attr, flags, offsetof(struct type, field) }
+
+#define ATTR_SPEC_DISCARD(attr, flags) \
+	{ WSC_ATTR_ ## attr, (flags) | WSC_ATTR_FLAG_DISCARD, 0 }
+
+static const struct wsc_attr_spec wsc_beacon_spec[] = {
+	ATTR_SPEC_DISCARD(VERSION, WSC_ATTR_FLAG_REQUIRED),
+	ATTR_SPEC(WSC_STATE, WSC_ATTR_FLAG_REQUIRED, wsc_beacon, state),
+	ATTR_SPEC(AP_SETUP_LOCKED, 0, wsc_beacon, ap_setup_locked),
+	ATTR_SPEC(SELECTED_REGISTRAR, 0, wsc_beacon, selected_registrar),
+	ATTR_SPEC(DEVICE_PASSWORD_ID, WSC_ATTR_FLAG_REGISTRAR,
+			wsc_beacon, device_password_id),
+	ATTR_SPEC(SELECTED_REGISTRAR_CONFIGURATION_METHODS,
+			WSC_ATTR_FLAG_REGISTRAR,
+			wsc_beacon, selected_reg_config_methods),
+	ATTR_SPEC(UUID_E, 0, wsc_beacon, uuid_e),
+	ATTR_SPEC(RF_BANDS, 0, wsc_beacon, rf_bands),
+};
+
+static const struct wsc_attr_spec wsc_probe_response_spec[] = {
+	ATTR_SPEC_DISCARD(VERSION, WSC_ATTR_FLAG_REQUIRED),
+	ATTR_SPEC(WSC_STATE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, state),
+	ATTR_SPEC(AP_SETUP_LOCKED, 0, wsc_probe_response, ap_setup_locked),
+	ATTR_SPEC(SELECTED_REGISTRAR, 0,
+			wsc_probe_response, selected_registrar),
+	ATTR_SPEC(DEVICE_PASSWORD_ID, WSC_ATTR_FLAG_REGISTRAR,
+			wsc_probe_response, device_password_id),
+	ATTR_SPEC(SELECTED_REGISTRAR_CONFIGURATION_METHODS,
+			WSC_ATTR_FLAG_REGISTRAR,
+			wsc_probe_response, selected_reg_config_methods),
+	ATTR_SPEC(RESPONSE_TYPE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, response_type),
+	ATTR_SPEC(UUID_E, WSC_ATTR_FLAG_REQUIRED, wsc_probe_response, uuid_e),
+	ATTR_SPEC(MANUFACTURER, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, manufacturer),
+	ATTR_SPEC(MODEL_NAME, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, model_name),
+	ATTR_SPEC(MODEL_NUMBER, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, model_number),
+	ATTR_SPEC(SERIAL_NUMBER, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, serial_number),
+	ATTR_SPEC(PRIMARY_DEVICE_TYPE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, primary_device_type),
+	ATTR_SPEC(DEVICE_NAME, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, device_name),
+	ATTR_SPEC(CONFIGURATION_METHODS, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_response, config_methods),
+	ATTR_SPEC(RF_BANDS, 0, wsc_probe_response, rf_bands),
+};
+
+static const struct wsc_attr_spec wsc_probe_request_spec[] = {
+	ATTR_SPEC_DISCARD(VERSION, WSC_ATTR_FLAG_REQUIRED),
+	ATTR_SPEC(REQUEST_TYPE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, request_type),
+	ATTR_SPEC(CONFIGURATION_METHODS, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, config_methods),
+	ATTR_SPEC(UUID_E, WSC_ATTR_FLAG_REQUIRED, wsc_probe_request, uuid_e),
+	ATTR_SPEC(PRIMARY_DEVICE_TYPE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, primary_device_type),
+	ATTR_SPEC(RF_BANDS, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, rf_bands),
+	ATTR_SPEC(ASSOCIATION_STATE, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, association_state),
+	ATTR_SPEC(CONFIGURATION_ERROR, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, configuration_error),
+	ATTR_SPEC(DEVICE_PASSWORD_ID, WSC_ATTR_FLAG_REQUIRED,
+			wsc_probe_request, device_password_id),
+	ATTR_SPEC(MANUFACTURER, WSC_ATTR_FLAG_VERSION2,
+			wsc_probe_request, manufacturer),
+	ATTR_SPEC(MODEL_NAME, WSC_ATTR_FLAG_VERSION2,
+			wsc_probe_request, model_name),
+	ATTR_SPEC(MODEL_NUMBER, WSC_ATTR_FLAG_VERSION2,
+			wsc_probe_request, model_number),
+	ATTR_SPEC(DEVICE_NAME, WSC_ATTR_FLAG_VERSION2,
+			wsc_probe_request, device_name),
+	ATTR_SPEC(REQUESTED_DEVICE_TYPE, 0,
+			wsc_probe_request, requested_device_type),
+};
+
 int wsc_parse_beacon(const unsigned char *pdu, unsigned int len,
 				struct wsc_beacon *out)
 {
 	int r;
 	struct wsc_wfa_ext_iter iter;
-	uint8_t version;
 
 	memset(out, 0, sizeof(struct wsc_beacon));
 
-	r = wsc_parse_attrs(pdu, len, &out->version2, &iter, 0, NULL,
-		REQUIRED(VERSION, &version),
-		REQUIRED(WSC_STATE, &out->state),
-		OPTIONAL(AP_SETUP_LOCKED, &out->ap_setup_locked),
-		OPTIONAL(SELECTED_REGISTRAR, &out->selected_registrar),
-		REGISTRAR(DEVICE_PASSWORD_ID, &out->device_password_id),
-		REGISTRAR(SELECTED_REGISTRAR_CONFIGURATION_METHODS,
-					&out->selected_reg_config_methods),
-		OPTIONAL(UUID_E, &out->uuid_e),
-		OPTIONAL(RF_BANDS, &out->rf_bands),
-		WSC_ATTR_INVALID);
+	r = wsc_parse_attrs_spec(pdu, len, &out->version2, &iter,
+				wsc_beacon_spec,
+				L_ARRAY_SIZE(wsc_beacon_spec), out);
 
 	if (r < 0)
 		return r;
@@ -1000,29 +1079,12 @@ int wsc_parse_probe_response(const unsigned char *pdu, unsigned int len,
 {
 	int r;
 	struct wsc_wfa_ext_iter iter;
-	uint8_t version;
 
 	memset(out, 0, sizeof(struct wsc_probe_response));
 
-	r = wsc_parse_attrs(pdu, len, &out->version2, &iter, 0, NULL,
-		REQUIRED(VERSION, &version),
-		REQUIRED(WSC_STATE, &out->state),
-		OPTIONAL(AP_SETUP_LOCKED, &out->ap_setup_locked),
-		OPTIONAL(SELECTED_REGISTRAR, &out->selected_registrar),
-		REGISTRAR(DEVICE_PASSWORD_ID, &out->device_password_id),
-		REGISTRAR(SELECTED_REGISTRAR_CONFIGURATION_METHODS,
-					&out->selected_reg_config_methods),
-		REQUIRED(RESPONSE_TYPE, &out->response_type),
-		REQUIRED(UUID_E, &out->uuid_e),
-		REQUIRED(MANUFACTURER, &out->manufacturer),
-		REQUIRED(MODEL_NAME, &out->model_name),
-		REQUIRED(MODEL_NUMBER, &out->model_number),
-		REQUIRED(SERIAL_NUMBER, &out->serial_number),
-		REQUIRED(PRIMARY_DEVICE_TYPE, &out->primary_device_type),
-		REQUIRED(DEVICE_NAME, &out->device_name),
-		REQUIRED(CONFIGURATION_METHODS, &out->config_methods),
-		OPTIONAL(RF_BANDS, &out->rf_bands),
-		WSC_ATTR_INVALID);
+	r = wsc_parse_attrs_spec(pdu, len, &out->version2, &iter,
+				wsc_probe_response_spec,
+				L_ARRAY_SIZE(wsc_probe_response_spec), out);
 
 	if (r < 0)
 		return r;
@@ -1060,26 +1122,12 @@ int wsc_parse_probe_request(const unsigned char *pdu, unsigned int len,
 {
 	int r;
 	struct wsc_wfa_ext_iter iter;
-	uint8_t version;
 
 	memset(out, 0, sizeof(struct wsc_probe_request));
 
-	r = wsc_parse_attrs(pdu, len, &out->version2, &iter, 0, NULL,
-		REQUIRED(VERSION, &version),
-		REQUIRED(REQUEST_TYPE, &out->request_type),
-		REQUIRED(CONFIGURATION_METHODS, &out->config_methods),
-		REQUIRED(UUID_E, &out->uuid_e),
-		REQUIRED(PRIMARY_DEVICE_TYPE, &out->primary_device_type),
-		REQUIRED(RF_BANDS, &out->rf_bands),
-		REQUIRED(ASSOCIATION_STATE, &out->association_state),
-		REQUIRED(CONFIGURATION_ERROR, &out->configuration_error),
-		REQUIRED(DEVICE_PASSWORD_ID, &out->device_password_id),
-		VERSION2(MANUFACTURER, &out->manufacturer),
-		VERSION2(MODEL_NAME, &out->model_name),
-		VERSION2(MODEL_NUMBER, &out->model_number),
-		VERSION2(DEVICE_NAME, &out->device_name),
-		OPTIONAL(REQUESTED_DEVICE_TYPE, &out->requested_device_type),
-		WSC_ATTR_INVALID);
+	r = wsc_parse_attrs_spec(pdu, len, &out->version2, &iter,
+				wsc_probe_request_spec,
+				L_ARRAY_SIZE(wsc_probe_request_spec), out);
 
 	if (r < 0)
 		return r;
@@ -1614,12 +1662,32 @@ struct wsc_attr_builder {
 	uint8_t *buf;
 	size_t offset;
 	uint16_t curlen;
+	bool fixed : 1;
+	bool overflow : 1;
 };
 
-static void wsc_attr_builder_grow(struct wsc_attr_builder *builder)
+/*
+ * Make room for len more bytes in the current attribute.  Builders set up
+ * with wsc_attr_builder_init write into a caller buffer and never grow,
+ * running out of space is recorded and reported by wsc_attr_builder_finish.
+ */
+static bool wsc_attr_builder_reserve(struct wsc_attr_builder *builder,
+					size_t len)
 {
-	builder->buf = l_realloc(builder->buf, builder->capacity * 2);
-	builder->capacity *= 2;
+	if (builder->overflow)
+		return false;
+
+	while (builder->offset + builder->curlen + len > builder->capacity) {
+		if (builder->fixed) {
+			builder->overflow = true;
+			return false;
+		}
+
+		builder->buf = l_realloc(builder->buf, builder->capacity * 2);
+		builder->capacity *= 2;
+	}
+
+	return true;
 }
 
 static bool wsc_attr_builder_start_attr(struct wsc_attr_builder *builder,
@@ -1627,6 +1695,9 @@ static bool wsc_attr_builder_start_attr(struct wsc_attr_builder *builder,
 {
 	uint8_t *bytes;
 
+	if (builder->overflow)
+		return false;
+
 	/* TLVs must be length > 0 */
 	if (builder->curlen == 0 && builder->offset != 0)
 		return false;
@@ -1638,10 +1709,12 @@ static bool wsc_attr_builder_start_attr(struct wsc_attr_builder *builder,
 		builder->offset += builder->curlen;
 	}
 
-	builder->curlen = 4;
+	builder->curlen = 0;
+
+	if (!wsc_attr_builder_reserve(builder, 4))
+		return false;
 
-	if (builder->offset + 4 >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	builder->curlen = 4;
 
 	bytes = builder->buf + builder->offset;
 	l_put_be16(type, bytes);
@@ -1651,8 +1724,8 @@ static bool wsc_attr_builder_start_attr(struct wsc_attr_builder *builder,
 
 static bool wsc_attr_builder_put_u8(struct wsc_attr_builder *builder, uint8_t v)
 {
-	if (builder->offset + builder->curlen + 1 >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, 1))
+		return false;
 
 	builder->buf[builder->offset + builder->curlen] = v;
 	builder->curlen += 1;
@@ -1663,8 +1736,8 @@ static bool wsc_attr_builder_put_u8(struct wsc_attr_builder *builder, uint8_t v)
 static bool wsc_attr_builder_put_u16(struct wsc_attr_builder *builder,
 								uint16_t v)
 {
-	if (builder->offset + builder->curlen + 2 >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, 2))
+		return false;
 
 	l_put_be16(v, builder->buf + builder->offset + builder->curlen);
 	builder->curlen += 2;
@@ -1675,8 +1748,8 @@ static bool wsc_attr_builder_put_u16(struct wsc_attr_builder *builder,
 static bool wsc_attr_builder_put_u32(struct wsc_attr_builder *builder,
 								uint32_t v)
 {
-	if (builder->offset + builder->curlen + 4 >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, 4))
+		return false;
 
 	l_put_be32(v, builder->buf + builder->offset + builder->curlen);
 	builder->curlen += 4;
@@ -1687,8 +1760,8 @@ static bool wsc_attr_builder_put_u32(struct wsc_attr_builder *builder,
 static bool wsc_attr_builder_put_bytes(struct wsc_attr_builder *builder,
 					const void *bytes, size_t size)
 {
-	while (builder->offset + builder->curlen + size >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, size))
+		return false;
 
 	memcpy(builder->buf + builder->offset + builder->curlen, bytes, size);
 	builder->curlen += size;
@@ -1699,8 +1772,8 @@ static bool wsc_attr_builder_put_bytes(struct wsc_attr_builder *builder,
 static bool wsc_attr_builder_put_oui(struct wsc_attr_builder *builder,
 							const uint8_t *oui)
 {
-	if (builder->offset + builder->curlen + 3 >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, 3))
+		return false;
 
 	memcpy(builder->buf + builder->offset + builder->curlen, oui, 3);
 	builder->curlen += 3;
@@ -1720,8 +1793,8 @@ static bool wsc_attr_builder_put_string(struct wsc_attr_builder *builder,
 		len = 1;
 	}
 
-	if (builder->offset + builder->curlen + len >= builder->capacity)
-		wsc_attr_builder_grow(builder);
+	if (!wsc_attr_builder_reserve(builder, len))
+		return false;
 
 	memcpy(builder->buf + builder->offset + builder->curlen, string, len);
 	builder->curlen += len;
@@ -1743,11 +1816,20 @@ static struct wsc_attr_builder *wsc_attr_builder_new(size_t initial_capacity)
 	return builder;
 }
 
-static uint8_t *wsc_attr_builder_free(struct wsc_attr_builder *builder,
-					bool free_contents,
-					size_t *out_size)
+static void wsc_attr_builder_init(struct wsc_attr_builder *builder,
+					uint8_t *buf, size_t len)
 {
-	uint8_t *ret;
+	memset(builder, 0, sizeof(*builder));
+	builder->buf = buf;
+	builder->capacity = len;
+	builder->fixed = true;
+}
+
+/* Returns the length of the attributes written or -EMSGSIZE */
+static int wsc_attr_builder_finish(struct wsc_attr_builder *builder)
+{
+	if (builder->overflow)
+		return -EMSGSIZE;
 
 	if (builder->curlen > 0) {
 		uint8_t *bytes = builder->buf + builder->offset;
@@ -1756,6 +1838,18 @@ static uint8_t *wsc_attr_builder_free(struct wsc_attr_builder *builder,
 		builder->curlen = 0;
 	}
 
+	return builder->offset;
+}
+
+static uint8_t *wsc_attr_builder_free(struct wsc_attr_builder *builder,
+					bool free_contents,
+					size_t *out_size)
+{
+	uint8_t *ret;
+
+	if (wsc_attr_builder_finish(builder) < 0)
+		free_contents = true;
+
 	if (free_contents) {
 		l_free(builder->buf);
 		builder->buf = NULL;
@@ -1970,6 +2064,16 @@ static void build_primary_device_type(struct wsc_attr_builder *builder,
 	wsc_attr_builder_put_u16(builder, pdt->subcategory);
 }
 
+static void build_requested_device_type(struct wsc_attr_builder *builder,
+				const struct wsc_primary_device_type *rdt)
+{
+	wsc_attr_builder_start_attr(builder, WSC_ATTR_REQUESTED_DEVICE_TYPE);
+	wsc_attr_builder_put_u16(builder, rdt->category);
+	wsc_attr_builder_put_oui(builder, rdt->oui);
+	wsc_attr_builder_put_u8(builder, rdt->oui_type);
+	wsc_attr_builder_put_u16(builder, rdt->subcategory);
+}
+
 static void build_public_key(struct wsc_attr_builder *builder,
 						const uint8_t *public_key)
 {
@@ -2108,12 +2212,9 @@ static void wfa_build_authorized_macs(struct wsc_attr_builder *builder,
 	wsc_attr_builder_put_bytes(builder, authorized_macs, count * 6);
 }
 
-uint8_t *wsc_build_credential(const struct wsc_credential *in, size_t *out_len)
+static void build_credential_attrs(struct wsc_attr_builder *builder,
+					const struct wsc_credential *in)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
-
-	builder = wsc_attr_builder_new(128);
 	build_network_index(builder, 1);
 	build_ssid(builder, in->ssid, in->ssid_len);
 	build_authentication_type(builder, in->auth_type);
@@ -2122,20 +2223,38 @@ uint8_t *wsc_build_credential(const struct wsc_credential *in, size_t *out_len)
 	build_mac_address(builder, in->addr);
 
 	/* TODO: Append EAP attrs & Network Key Shareable inside WFA EXT */
+}
 
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_credential(const struct wsc_credential *in, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(128);
+	build_credential_attrs(builder, in);
+
+	return wsc_attr_builder_free(builder, false, out_len);
 }
 
 static void build_credential(struct wsc_attr_builder *builder,
 					const struct wsc_credential *cred)
 {
-	size_t data_len;
-	uint8_t *data = wsc_build_credential(cred, &data_len);
+	/* Network Key is at most 64 bytes, the whole Credential stays small */
+	uint8_t data[256];
+	struct wsc_attr_builder cred_builder;
+	int data_len;
+
+	wsc_attr_builder_init(&cred_builder, data, sizeof(data));
+	build_credential_attrs(&cred_builder, cred);
+	data_len = wsc_attr_builder_finish(&cred_builder);
+
+	if (data_len < 0) {
+		builder->overflow = true;
+		return;
+	}
 
 	wsc_attr_builder_start_attr(builder, WSC_ATTR_CREDENTIAL);
 	wsc_attr_builder_put_bytes(builder, data, data_len);
-	l_free(data);
+	explicit_bzero(data, data_len);
 }
 
 uint8_t *wsc_build_beacon(const struct wsc_beacon *beacon, size_t *out_len)
@@ -2210,6 +2329,11 @@ uint8_t *wsc_build_probe_request(const struct wsc_probe_request *probe_request,
 	build_model_number(builder, probe_request->model_number);
 	build_device_name(builder, probe_request->device_name);
 
+	/* Only ask for a specific Device Type if one was set */
+	if (probe_request->requested_device_type.category)
+		build_requested_device_type(builder,
+				&probe_request->requested_device_type);
+
 	START_WFA_VENDOR_EXTENSION();
 
 	if (!probe_request->request_to_enroll)
@@ -2324,12 +2448,8 @@ done:
 	return ret;
 }
 
-uint8_t *wsc_build_m1(const struct wsc_m1 *m1, size_t *out_len)
+static void build_m1(struct wsc_attr_builder *builder, const struct wsc_m1 *m1)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
-
-	builder = wsc_attr_builder_new(1024);
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M1);
 	build_uuid_e(builder, m1->uuid_e);
@@ -2354,28 +2474,40 @@ uint8_t *wsc_build_m1(const struct wsc_m1 *m1, size_t *out_len)
 	build_os_version(builder, m1->os_version);
 
 	if (!m1->version2)
-		goto done;
+		return;
 
 	START_WFA_VENDOR_EXTENSION();
 
 	if (!m1->request_to_enroll)
-		goto done;
+		return;
 
 	wsc_attr_builder_put_u8(builder, WSC_WFA_EXTENSION_REQUEST_TO_ENROLL);
 	wsc_attr_builder_put_u8(builder, 1);
 	wsc_attr_builder_put_u8(builder, 1);
-
-done:
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_m2(const struct wsc_m2 *m2, size_t *out_len)
+uint8_t *wsc_build_m1(const struct wsc_m1 *m1, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
 	builder = wsc_attr_builder_new(1024);
+	build_m1(builder, m1);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m1(const struct wsc_m1 *m1, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m1(&builder, m1);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m2(struct wsc_attr_builder *builder, const struct wsc_m2 *m2)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M2);
 	build_enrollee_nonce(builder, m2->enrollee_nonce);
@@ -2405,17 +2537,30 @@ uint8_t *wsc_build_m2(const struct wsc_m2 *m2, size_t *out_len)
 
 done:
 	build_authenticator(builder, m2->authenticator);
-
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_m3(const struct wsc_m3 *m3, size_t *out_len)
+uint8_t *wsc_build_m2(const struct wsc_m2 *m2, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
-	builder = wsc_attr_builder_new(256);
+	builder = wsc_attr_builder_new(1024);
+	build_m2(builder, m2);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m2(const struct wsc_m2 *m2, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m2(&builder, m2);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m3(struct wsc_attr_builder *builder, const struct wsc_m3 *m3)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M3);
 	build_registrar_nonce(builder, m3->registrar_nonce);
@@ -2429,18 +2574,31 @@ uint8_t *wsc_build_m3(const struct wsc_m3 *m3, size_t *out_len)
 
 done:
 	build_authenticator(builder, m3->authenticator);
-
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_m4(const struct wsc_m4 *m4, const uint8_t *encrypted,
-			size_t encrypted_len, size_t *out_len)
+uint8_t *wsc_build_m3(const struct wsc_m3 *m3, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
 	builder = wsc_attr_builder_new(256);
+	build_m3(builder, m3);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m3(const struct wsc_m3 *m3, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m3(&builder, m3);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m4(struct wsc_attr_builder *builder, const struct wsc_m4 *m4,
+			const uint8_t *encrypted, size_t encrypted_len)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M4);
 	build_enrollee_nonce(builder, m4->enrollee_nonce);
@@ -2457,9 +2615,35 @@ uint8_t *wsc_build_m4(const struct wsc_m4 *m4, const uint8_t *encrypted,
 
 done:
 	build_authenticator(builder, m4->authenticator);
+}
 
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_m4(const struct wsc_m4 *m4, const uint8_t *encrypted,
+			size_t encrypted_len, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(256);
+	build_m4(builder, m4, encrypted, encrypted_len);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m4(const struct wsc_m4 *m4, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m4(&builder, m4, encrypted, encrypted_len);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m4_encrypted_settings(struct wsc_attr_builder *builder,
+			const struct wsc_m4_encrypted_settings *in)
+{
+	build_r_snonce1(builder, in->r_snonce1);
+	build_key_wrap_authenticator(builder, in->authenticator);
 }
 
 uint8_t *wsc_build_m4_encrypted_settings(
@@ -2469,19 +2653,26 @@ uint8_t *wsc_build_m4_encrypted_settings(
 	struct wsc_attr_builder *builder;
 
 	builder = wsc_attr_builder_new(256);
-	build_r_snonce1(builder, in->r_snonce1);
-	build_key_wrap_authenticator(builder, in->authenticator);
+	build_m4_encrypted_settings(builder, in);
 
 	return wsc_attr_builder_free(builder, false, out_len);
 }
 
-uint8_t *wsc_build_m5(const struct wsc_m5 *m5, const uint8_t *encrypted,
-			size_t encrypted_len, size_t *out_len)
+int wsc_write_m4_encrypted_settings(
+				const struct wsc_m4_encrypted_settings *in,
+				uint8_t *buf, size_t len)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
+	struct wsc_attr_builder builder;
 
-	builder = wsc_attr_builder_new(256);
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m4_encrypted_settings(&builder, in);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m5(struct wsc_attr_builder *builder, const struct wsc_m5 *m5,
+			const uint8_t *encrypted, size_t encrypted_len)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M5);
 	build_registrar_nonce(builder, m5->registrar_nonce);
@@ -2496,9 +2687,35 @@ uint8_t *wsc_build_m5(const struct wsc_m5 *m5, const uint8_t *encrypted,
 
 done:
 	build_authenticator(builder, m5->authenticator);
+}
 
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_m5(const struct wsc_m5 *m5, const uint8_t *encrypted,
+			size_t encrypted_len, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(256);
+	build_m5(builder, m5, encrypted, encrypted_len);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m5(const struct wsc_m5 *m5, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m5(&builder, m5, encrypted, encrypted_len);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m5_encrypted_settings(struct wsc_attr_builder *builder,
+			const struct wsc_m5_encrypted_settings *in)
+{
+	build_e_snonce1(builder, in->e_snonce1);
+	build_key_wrap_authenticator(builder, in->authenticator);
 }
 
 uint8_t *wsc_build_m5_encrypted_settings(
@@ -2508,19 +2725,26 @@ uint8_t *wsc_build_m5_encrypted_settings(
 	struct wsc_attr_builder *builder;
 
 	builder = wsc_attr_builder_new(256);
-	build_e_snonce1(builder, in->e_snonce1);
-	build_key_wrap_authenticator(builder, in->authenticator);
+	build_m5_encrypted_settings(builder, in);
 
 	return wsc_attr_builder_free(builder, false, out_len);
 }
 
-uint8_t *wsc_build_m6(const struct wsc_m6 *m6, const uint8_t *encrypted,
-			size_t encrypted_len, size_t *out_len)
+int wsc_write_m5_encrypted_settings(
+				const struct wsc_m5_encrypted_settings *in,
+				uint8_t *buf, size_t len)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
+	struct wsc_attr_builder builder;
 
-	builder = wsc_attr_builder_new(256);
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m5_encrypted_settings(&builder, in);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m6(struct wsc_attr_builder *builder, const struct wsc_m6 *m6,
+			const uint8_t *encrypted, size_t encrypted_len)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M6);
 	build_enrollee_nonce(builder, m6->enrollee_nonce);
@@ -2535,9 +2759,35 @@ uint8_t *wsc_build_m6(const struct wsc_m6 *m6, const uint8_t *encrypted,
 
 done:
 	build_authenticator(builder, m6->authenticator);
+}
 
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_m6(const struct wsc_m6 *m6, const uint8_t *encrypted,
+			size_t encrypted_len, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(256);
+	build_m6(builder, m6, encrypted, encrypted_len);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m6(const struct wsc_m6 *m6, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m6(&builder, m6, encrypted, encrypted_len);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m6_encrypted_settings(struct wsc_attr_builder *builder,
+			const struct wsc_m6_encrypted_settings *in)
+{
+	build_r_snonce2(builder, in->r_snonce2);
+	build_key_wrap_authenticator(builder, in->authenticator);
 }
 
 uint8_t *wsc_build_m6_encrypted_settings(
@@ -2547,19 +2797,26 @@ uint8_t *wsc_build_m6_encrypted_settings(
 	struct wsc_attr_builder *builder;
 
 	builder = wsc_attr_builder_new(256);
-	build_r_snonce2(builder, in->r_snonce2);
-	build_key_wrap_authenticator(builder, in->authenticator);
+	build_m6_encrypted_settings(builder, in);
 
 	return wsc_attr_builder_free(builder, false, out_len);
 }
 
-uint8_t *wsc_build_m7(const struct wsc_m7 *m7, const uint8_t *encrypted,
-			size_t encrypted_len, size_t *out_len)
+int wsc_write_m6_encrypted_settings(
+				const struct wsc_m6_encrypted_settings *in,
+				uint8_t *buf, size_t len)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
+	struct wsc_attr_builder builder;
 
-	builder = wsc_attr_builder_new(256);
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m6_encrypted_settings(&builder, in);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m7(struct wsc_attr_builder *builder, const struct wsc_m7 *m7,
+			const uint8_t *encrypted, size_t encrypted_len)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M7);
 	build_registrar_nonce(builder, m7->registrar_nonce);
@@ -2574,9 +2831,35 @@ uint8_t *wsc_build_m7(const struct wsc_m7 *m7, const uint8_t *encrypted,
 
 done:
 	build_authenticator(builder, m7->authenticator);
+}
 
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_m7(const struct wsc_m7 *m7, const uint8_t *encrypted,
+			size_t encrypted_len, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(256);
+	build_m7(builder, m7, encrypted, encrypted_len);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m7(const struct wsc_m7 *m7, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m7(&builder, m7, encrypted, encrypted_len);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m7_encrypted_settings(struct wsc_attr_builder *builder,
+			const struct wsc_m7_encrypted_settings *in)
+{
+	build_e_snonce2(builder, in->e_snonce2);
+	build_key_wrap_authenticator(builder, in->authenticator);
 }
 
 uint8_t *wsc_build_m7_encrypted_settings(
@@ -2586,19 +2869,26 @@ uint8_t *wsc_build_m7_encrypted_settings(
 	struct wsc_attr_builder *builder;
 
 	builder = wsc_attr_builder_new(256);
-	build_e_snonce2(builder, in->e_snonce2);
-	build_key_wrap_authenticator(builder, in->authenticator);
+	build_m7_encrypted_settings(builder, in);
 
 	return wsc_attr_builder_free(builder, false, out_len);
 }
 
-uint8_t *wsc_build_m8(const struct wsc_m8 *m8, const uint8_t *encrypted,
-			size_t encrypted_len, size_t *out_len)
+int wsc_write_m7_encrypted_settings(
+				const struct wsc_m7_encrypted_settings *in,
+				uint8_t *buf, size_t len)
 {
-	struct wsc_attr_builder *builder;
-	uint8_t *ret;
+	struct wsc_attr_builder builder;
 
-	builder = wsc_attr_builder_new(256);
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m7_encrypted_settings(&builder, in);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m8(struct wsc_attr_builder *builder, const struct wsc_m8 *m8,
+			const uint8_t *encrypted, size_t encrypted_len)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_M8);
 	build_enrollee_nonce(builder, m8->enrollee_nonce);
@@ -2613,20 +2903,36 @@ uint8_t *wsc_build_m8(const struct wsc_m8 *m8, const uint8_t *encrypted,
 
 done:
 	build_authenticator(builder, m8->authenticator);
-
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_m8_encrypted_settings(
-				const struct wsc_m8_encrypted_settings *in,
-				const struct wsc_credential *creds,
-				unsigned int creds_cnt, size_t *out_len)
+uint8_t *wsc_build_m8(const struct wsc_m8 *m8, const uint8_t *encrypted,
+			size_t encrypted_len, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	unsigned int i;
 
 	builder = wsc_attr_builder_new(256);
+	build_m8(builder, m8, encrypted, encrypted_len);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m8(const struct wsc_m8 *m8, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m8(&builder, m8, encrypted, encrypted_len);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_m8_encrypted_settings(struct wsc_attr_builder *builder,
+			const struct wsc_m8_encrypted_settings *in,
+			const struct wsc_credential *creds,
+			unsigned int creds_cnt)
+{
+	unsigned int i;
 
 	for (i = 0; i < creds_cnt; i++)
 		build_credential(builder, &creds[i]);
@@ -2638,37 +2944,72 @@ uint8_t *wsc_build_m8_encrypted_settings(
 	}
 
 	build_key_wrap_authenticator(builder, in->authenticator);
-
-	return wsc_attr_builder_free(builder, false, out_len);
 }
 
-uint8_t *wsc_build_wsc_ack(const struct wsc_ack *ack, size_t *out_len)
+uint8_t *wsc_build_m8_encrypted_settings(
+				const struct wsc_m8_encrypted_settings *in,
+				const struct wsc_credential *creds,
+				unsigned int creds_cnt, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
 	builder = wsc_attr_builder_new(256);
+	build_m8_encrypted_settings(builder, in, creds, creds_cnt);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_m8_encrypted_settings(
+				const struct wsc_m8_encrypted_settings *in,
+				const struct wsc_credential *creds,
+				unsigned int creds_cnt,
+				uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_m8_encrypted_settings(&builder, in, creds, creds_cnt);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_wsc_ack(struct wsc_attr_builder *builder,
+			const struct wsc_ack *ack)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_WSC_ACK);
 	build_enrollee_nonce(builder, ack->enrollee_nonce);
 	build_registrar_nonce(builder, ack->registrar_nonce);
 
 	if (!ack->version2)
-		goto done;
+		return;
 
 	START_WFA_VENDOR_EXTENSION();
-
-done:
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_wsc_nack(const struct wsc_nack *nack, size_t *out_len)
+uint8_t *wsc_build_wsc_ack(const struct wsc_ack *ack, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
 	builder = wsc_attr_builder_new(256);
+	build_wsc_ack(builder, ack);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_wsc_ack(const struct wsc_ack *ack, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_wsc_ack(&builder, ack);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_wsc_nack(struct wsc_attr_builder *builder,
+			const struct wsc_nack *nack)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_WSC_NACK);
 	build_enrollee_nonce(builder, nack->enrollee_nonce);
@@ -2676,34 +3017,63 @@ uint8_t *wsc_build_wsc_nack(const struct wsc_nack *nack, size_t *out_len)
 	build_configuration_error(builder, nack->configuration_error);
 
 	if (!nack->version2)
-		goto done;
+		return;
 
 	START_WFA_VENDOR_EXTENSION();
-
-done:
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
 }
 
-uint8_t *wsc_build_wsc_done(const struct wsc_done *done, size_t *out_len)
+uint8_t *wsc_build_wsc_nack(const struct wsc_nack *nack, size_t *out_len)
 {
 	struct wsc_attr_builder *builder;
-	uint8_t *ret;
 
 	builder = wsc_attr_builder_new(256);
+	build_wsc_nack(builder, nack);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_wsc_nack(const struct wsc_nack *nack, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_wsc_nack(&builder, nack);
+
+	return wsc_attr_builder_finish(&builder);
+}
+
+static void build_wsc_done(struct wsc_attr_builder *builder,
+			const struct wsc_done *done)
+{
 	build_version(builder, 0x10);
 	build_message_type(builder, WSC_MESSAGE_TYPE_WSC_DONE);
 	build_enrollee_nonce(builder, done->enrollee_nonce);
 	build_registrar_nonce(builder, done->registrar_nonce);
 
 	if (!done->version2)
-		goto done;
+		return;
 
 	START_WFA_VENDOR_EXTENSION();
+}
 
-done:
-	ret = wsc_attr_builder_free(builder, false, out_len);
-	return ret;
+uint8_t *wsc_build_wsc_done(const struct wsc_done *done, size_t *out_len)
+{
+	struct wsc_attr_builder *builder;
+
+	builder = wsc_attr_builder_new(256);
+	build_wsc_done(builder, done);
+
+	return wsc_attr_builder_free(builder, false, out_len);
+}
+
+int wsc_write_wsc_done(const struct wsc_done *done, uint8_t *buf, size_t len)
+{
+	struct wsc_attr_builder builder;
+
+	wsc_attr_builder_init(&builder, buf, len);
+	build_wsc_done(&builder, done);
+
+	return wsc_attr_builder_finish(&builder);
 }
 
 uint8_t *wsc_build_p2p_attrs(const struct wsc_p2p_attrs *attrs, size_t *out_len)
@@ -3073,7 +3443,7 @@ bool wsc_device_type_from_setting_str(const char *value,
 	 * DeviceType=1-0050f204-1
 	 */
 	if (wsc_device_type_from_subcategory_str(out, value))
-		true;
+		return true;
 
 	u = strtoull(value, &endp, 0);
 
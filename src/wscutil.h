@@ -652,6 +652,46 @@ uint8_t *wsc_build_wsc_nack(const struct wsc_nack *nack, size_t *out_len);
 
 uint8_t *wsc_build_wsc_done(const struct wsc_done *done, size_t *out_len);
 
+/*
+ * Same as the wsc_build_* variants above but the message is written into a
+ * caller supplied buffer.  Return the message length or -EMSGSIZE.
+ */
+int wsc_write_m1(const struct wsc_m1 *m1, uint8_t *buf, size_t len);
+int wsc_write_m2(const struct wsc_m2 *m2, uint8_t *buf, size_t len);
+int wsc_write_m3(const struct wsc_m3 *m3, uint8_t *buf, size_t len);
+int wsc_write_m4(const struct wsc_m4 *m4, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len);
+int wsc_write_m4_encrypted_settings(
+				const struct wsc_m4_encrypted_settings *in,
+				uint8_t *buf, size_t len);
+int wsc_write_m5(const struct wsc_m5 *m5, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len);
+int wsc_write_m5_encrypted_settings(
+				const struct wsc_m5_encrypted_settings *in,
+				uint8_t *buf, size_t len);
+int wsc_write_m6(const struct wsc_m6 *m6, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len);
+int wsc_write_m6_encrypted_settings(
+				const struct wsc_m6_encrypted_settings *in,
+				uint8_t *buf, size_t len);
+int wsc_write_m7(const struct wsc_m7 *m7, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len);
+int wsc_write_m7_encrypted_settings(
+				const struct wsc_m7_encrypted_settings *in,
+				uint8_t *buf, size_t len);
+int wsc_write_m8(const struct wsc_m8 *m8, const uint8_t *encrypted,
+			size_t encrypted_len, uint8_t *buf, size_t len);
+int wsc_write_m8_encrypted_settings(
+				const struct wsc_m8_encrypted_settings *in,
+				const struct wsc_credential *creds,
+				unsigned int creds_cnt,
+				uint8_t *buf, size_t len);
+
+int wsc_write_wsc_ack(const struct wsc_ack *ack, uint8_t *buf, size_t len);
+int wsc_write_wsc_nack(const struct wsc_nack *nack, uint8_t *buf, size_t len);
+
+int wsc_write_wsc_done(const struct wsc_done *done, uint8_t *buf, size_t len);
+
 struct wsc_p2p_attrs {
 	bool version;
 	bool version2;
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <getopt.h>
 #include <signal.h>
 #include <time.h>
@@ -116,6 +117,17 @@ enum hwsim_tx_control_flags {
 #define HWSIM_DELAY_MIN_MS		1
 #define HWSIM_MAX_PREFIX_LEN		128
 
+/*
+ * Medium model used between radios that have been given a position: log-
+ * distance path loss on top of the free space loss at 1m.  Frames are lost
+ * below the sensitivity and increasingly likely to be lost within
+ * HWSIM_LOSS_RANGE dB above it.
+ */
+#define HWSIM_TX_POWER			20	/* dBm */
+#define HWSIM_PATH_LOSS_EXPONENT	3.0
+#define HWSIM_SENSITIVITY		-92	/* dBm */
+#define HWSIM_LOSS_RANGE		10	/* dB */
+
 struct hwsim_rule {
 	unsigned int id;
 	uint8_t source[ETH_ALEN];
@@ -406,6 +418,19 @@ struct radio_info_rec {
 	int channels;
 	uint8_t addrs[2][ETH_ALEN];
 	char *name;
+	/* Position in meters, as of position_time, and where it's heading */
+	bool positioned;
+	double x;
+	double y;
+	uint64_t position_time;
+	struct l_queue *path;
+};
+
+/* Reached at an absolute time, coming from the previous one in a line */
+struct hwsim_waypoint {
+	double x;
+	double y;
+	uint64_t time;
 };
 
 struct interface_info_rec {
@@ -417,6 +442,8 @@ struct interface_info_rec {
 
 static struct l_queue *radio_info;
 static struct l_queue *interface_info;
+/* Interface address -> l_queue of interface_info_rec with that address */
+static struct l_hashmap *interface_addr_index;
 
 static struct l_dbus_message *pending_create_msg;
 static uint32_t pending_create_radio_id;
@@ -425,6 +452,7 @@ static void radio_free(void *user_data)
 {
 	struct radio_info_rec *rec = user_data;
 
+	l_queue_destroy(rec->path, l_free);
 	l_free(rec->name);
 	l_free(rec);
 }
@@ -437,10 +465,69 @@ static void interface_free(void *user_data)
 	l_free(rec);
 }
 
+static unsigned int interface_addr_hash(const void *p)
+{
+	/* The low bytes of the address are the ones that differ */
+	return l_get_le32((const uint8_t *) p + 2);
+}
+
+static int interface_addr_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, ETH_ALEN);
+}
+
+static void *interface_addr_copy(const void *p)
+{
+	return l_memdup(p, ETH_ALEN);
+}
+
+static void interface_addr_list_free(void *data)
+{
+	l_queue_destroy(data, NULL);
+}
+
+static void interface_index_add(struct interface_info_rec *rec)
+{
+	struct l_queue *list;
+
+	if (!interface_addr_index) {
+		interface_addr_index = l_hashmap_new();
+		l_hashmap_set_hash_function(interface_addr_index,
+						interface_addr_hash);
+		l_hashmap_set_compare_function(interface_addr_index,
+						interface_addr_compare);
+		l_hashmap_set_key_copy_function(interface_addr_index,
+						interface_addr_copy);
+		l_hashmap_set_key_free_function(interface_addr_index, l_free);
+	}
+
+	list = l_hashmap_lookup(interface_addr_index, rec->addr);
+	if (!list) {
+		list = l_queue_new();
+		l_hashmap_insert(interface_addr_index, rec->addr, list);
+	}
+
+	l_queue_push_tail(list, rec);
+}
+
+static void interface_index_remove(struct interface_info_rec *rec)
+{
+	struct l_queue *list = l_hashmap_lookup(interface_addr_index,
+						rec->addr);
+
+	if (!l_queue_remove(list, rec) || !l_queue_isempty(list))
+		return;
+
+	l_hashmap_remove(interface_addr_index, rec->addr);
+	l_queue_destroy(list, NULL);
+}
+
 static void hwsim_radio_cache_cleanup(void)
 {
+	l_hashmap_destroy(interface_addr_index, interface_addr_list_free);
 	l_queue_destroy(radio_info, radio_free);
 	l_queue_destroy(interface_info, interface_free);
+	interface_addr_index = NULL;
 	radio_info = NULL;
 	interface_info = NULL;
 }
@@ -881,6 +968,7 @@ static void get_interface_callback(struct l_genl_msg *msg, void *user_data)
 			name_change = true;
 
 		l_free(rec->name);
+		interface_index_remove(rec);
 	} else {
 		old = false;
 
@@ -892,6 +980,7 @@ static void get_interface_callback(struct l_genl_msg *msg, void *user_data)
 
 	memcpy(rec->addr, addr, ETH_ALEN);
 	rec->name = l_strndup(ifname, ifname_len);
+	interface_index_add(rec);
 
 	if (!interface_info)
 		interface_info = l_queue_new();
@@ -938,6 +1027,7 @@ static bool interface_info_destroy_by_radio(void *data, void *user_data)
 		return false;
 
 	l_dbus_unregister_object(dbus, interface_get_path(rec));
+	interface_index_remove(rec);
 	interface_free(rec);
 
 	return true;
@@ -1013,6 +1103,7 @@ static void del_interface_event(struct l_genl_msg *msg)
 
 	l_dbus_unregister_object(dbus, interface_get_path(interface));
 	l_queue_remove(interface_info, interface);
+	interface_index_remove(interface);
 	interface_free(interface);
 }
 
@@ -1095,7 +1186,9 @@ static void rtnl_newlink_notify(const struct ifinfomsg *ifi, int bytes)
 				continue;
 
 			addr_change = true;
+			interface_index_remove(rec);
 			memcpy(rec->addr, RTA_DATA(attr), ETH_ALEN);
+			interface_index_add(rec);
 			break;
 		}
 	}
@@ -1166,10 +1259,88 @@ static bool radio_match_addr(const struct radio_info_rec *radio,
 		!memcmp(addr, radio->addrs[1], ETH_ALEN);
 }
 
+static void radio_get_position(struct radio_info_rec *radio, uint64_t now,
+				double *out_x, double *out_y)
+{
+	struct hwsim_waypoint *wp;
+	double frac;
+
+	while ((wp = l_queue_peek_head(radio->path)) && wp->time <= now) {
+		radio->x = wp->x;
+		radio->y = wp->y;
+		radio->position_time = wp->time;
+		l_free(l_queue_pop_head(radio->path));
+	}
+
+	*out_x = radio->x;
+	*out_y = radio->y;
+
+	if (!wp || now <= radio->position_time)
+		return;
+
+	frac = (double) (now - radio->position_time) /
+					(wp->time - radio->position_time);
+	*out_x += (wp->x - radio->x) * frac;
+	*out_y += (wp->y - radio->y) * frac;
+}
+
+/* Fixed seed so that runs of the same scenario see the same losses */
+static uint32_t medium_random(void)
+{
+	static uint32_t state = 2463534242u;
+
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+
+	return state;
+}
+
+/*
+ * Works out the signal strength between two positioned radios, returns
+ * false if the frame is lost on the way.
+ */
+static bool medium_apply(struct radio_info_rec *src_radio,
+				struct radio_info_rec *dst_radio,
+				uint32_t frequency, int32_t *signal)
+{
+	uint64_t now = l_time_now();
+	double src_x, src_y, dst_x, dst_y;
+	double distance, loss, rssi;
+
+	if (!src_radio || !dst_radio || !src_radio->positioned ||
+			!dst_radio->positioned || !frequency)
+		return true;
+
+	radio_get_position(src_radio, now, &src_x, &src_y);
+	radio_get_position(dst_radio, now, &dst_x, &dst_y);
+
+	distance = hypot(src_x - dst_x, src_y - dst_y);
+	if (distance < 1.0)
+		distance = 1.0;
+
+	loss = 20 * log10(frequency) - 27.55 +
+		10 * HWSIM_PATH_LOSS_EXPONENT * log10(distance);
+	rssi = HWSIM_TX_POWER - loss;
+
+	if (rssi < HWSIM_SENSITIVITY)
+		return false;
+
+	*signal = lround(rssi);
+
+	if (rssi >= HWSIM_SENSITIVITY + HWSIM_LOSS_RANGE)
+		return true;
+
+	/* Loss probability falls linearly over the range */
+	return medium_random() / 4294967296.0 <
+				(rssi - HWSIM_SENSITIVITY) / HWSIM_LOSS_RANGE;
+}
+
+/* Rules matching a frame take precedence over the medium model */
 static void process_rules(const struct radio_info_rec *src_radio,
 				const struct radio_info_rec *dst_radio,
-				struct hwsim_frame *frame, bool *drop,
-				uint32_t *delay)
+				struct hwsim_frame *frame, int32_t *signal,
+				bool *drop, uint32_t *delay)
 {
 	const struct l_queue_entry *rule_entry;
 
@@ -1215,7 +1386,7 @@ static void process_rules(const struct radio_info_rec *src_radio,
 		/* Rule deemed to match frame, apply any changes */
 
 		if (rule->signal)
-			frame->signal = rule->signal / 100;
+			*signal = rule->signal / 100;
 
 		*drop = rule->drop;
 
@@ -1227,6 +1398,8 @@ static void process_rules(const struct radio_info_rec *src_radio,
 struct send_frame_info {
 	struct hwsim_frame *frame;
 	struct radio_info_rec *radio;
+	/* As received by this radio */
+	int32_t signal;
 	void *user_data;
 };
 
@@ -1268,8 +1441,7 @@ static bool send_frame(struct send_frame_info *info,
 				info->frame->payload);
 	l_genl_msg_append_attr(msg, HWSIM_ATTR_RX_RATE, 4,
 				&rx_rate);
-	l_genl_msg_append_attr(msg, HWSIM_ATTR_SIGNAL, 4,
-				&info->frame->signal);
+	l_genl_msg_append_attr(msg, HWSIM_ATTR_SIGNAL, 4, &info->signal);
 	l_genl_msg_append_attr(msg, HWSIM_ATTR_FREQ, 4,
 				&info->frame->frequency);
 
@@ -1301,10 +1473,13 @@ static void hwsim_frame_unref(struct hwsim_frame *frame)
 		 */
 
 		if (!(frame->flags & HWSIM_TX_CTL_NO_ACK) && frame->acked) {
-			bool drop = false;
+			bool drop = !medium_apply(frame->ack_radio,
+							frame->src_radio,
+							frame->frequency,
+							&frame->signal);
 
 			process_rules(frame->ack_radio, frame->src_radio,
-					frame, &drop, NULL);
+					frame, &frame->signal, &drop, NULL);
 
 			if (!drop)
 				frame->flags |= HWSIM_TX_STAT_ACK;
@@ -1388,6 +1563,7 @@ static bool send_custom_frame(const uint8_t *addr, uint32_t freq,
 	frame->payload = payload;
 
 	info->frame = frame;
+	info->signal = signal;
 	info->user_data = user_data;
 
 	info->radio = l_queue_find(radio_info, radio_info_match_addr0, addr) ?:
@@ -1408,31 +1584,96 @@ error:
 	return false;
 }
 
-struct interface_match_data {
-	struct radio_info_rec *radio;
-	const uint8_t *addr;
+/*
+ * Frames due at the same time, in milliseconds, share one timeout.  Under
+ * load many frames are forwarded with the same delay within the same
+ * millisecond, so this replaces a timeout per forwarded frame with one per
+ * distinct deadline.
+ */
+struct frame_delay_slot {
+	uint32_t due;
+	struct l_timeout *timeout;
+	struct l_queue *sends;
 };
 
-static bool interface_info_match_dst(const void *a, const void *b)
+static struct l_hashmap *frame_delay_slots;
+
+static void frame_delay_callback(struct l_timeout *timeout, void *user_data)
 {
-	const struct interface_info_rec *rec = a;
-	const struct interface_match_data *dst = b;
+	struct frame_delay_slot *slot = user_data;
+	struct send_frame_info *send_info;
+
+	l_hashmap_remove(frame_delay_slots, L_UINT_TO_PTR(slot->due));
+
+	while ((send_info = l_queue_pop_head(slot->sends))) {
+		if (send_frame(send_info, send_frame_callback,
+						send_frame_destroy))
+			send_info->frame->pending_callback_count++;
+		else
+			send_frame_destroy(send_info);
+	}
+
+	l_queue_destroy(slot->sends, NULL);
+	l_free(slot);
 
-	return rec->radio_rec == dst->radio &&
-		!memcmp(rec->addr, dst->addr, ETH_ALEN);
+	l_timeout_remove(timeout);
 }
 
-static void frame_delay_callback(struct l_timeout *timeout, void *user_data)
+static bool frame_delay_queue(struct send_frame_info *send_info,
+				uint32_t delay)
 {
-	struct send_frame_info *send_info = user_data;
+	uint32_t due = l_time_now() / 1000 + delay;
+	struct frame_delay_slot *slot;
 
-	if (send_frame(send_info, send_frame_callback,
-					send_frame_destroy))
-		send_info->frame->pending_callback_count++;
-	else
-		send_frame_destroy(send_info);
+	if (!frame_delay_slots)
+		frame_delay_slots = l_hashmap_new();
 
-	l_timeout_remove(timeout);
+	slot = l_hashmap_lookup(frame_delay_slots, L_UINT_TO_PTR(due));
+	if (slot) {
+		l_queue_push_tail(slot->sends, send_info);
+		return true;
+	}
+
+	slot = l_new(struct frame_delay_slot, 1);
+	slot->due = due;
+	slot->timeout = l_timeout_create_ms(delay, frame_delay_callback,
+						slot, NULL);
+	if (!slot->timeout) {
+		l_free(slot);
+		return false;
+	}
+
+	slot->sends = l_queue_new();
+	l_queue_push_tail(slot->sends, send_info);
+	l_hashmap_insert(frame_delay_slots, L_UINT_TO_PTR(due), slot);
+
+	return true;
+}
+
+static void forward_frame(struct hwsim_frame *frame,
+				struct radio_info_rec *radio, bool drop)
+{
+	struct send_frame_info *send_info;
+	uint32_t delay = HWSIM_DELAY_MIN_MS;
+	int32_t signal = frame->signal;
+
+	if (!medium_apply(frame->src_radio, radio, frame->frequency, &signal))
+		drop = true;
+
+	process_rules(frame->src_radio, radio, frame, &signal, &drop, &delay);
+
+	if (drop)
+		return;
+
+	send_info = l_new(struct send_frame_info, 1);
+	send_info->radio = radio;
+	send_info->frame = hwsim_frame_ref(frame);
+	send_info->signal = signal;
+
+	if (!frame_delay_queue(send_info, delay)) {
+		l_error("Error delaying frame, frame will be dropped");
+		send_frame_destroy(send_info);
+	}
 }
 
 /*
@@ -1443,65 +1684,62 @@ static void frame_delay_callback(struct l_timeout *timeout, void *user_data)
 static void process_frame(struct hwsim_frame *frame)
 {
 	const struct l_queue_entry *entry;
+	const struct l_queue_entry *prev;
+	struct l_queue *interfaces;
 	bool drop_mcast = false;
 
-	if (util_is_broadcast_address(frame->dst_ether_addr))
-		process_rules(frame->src_radio, NULL, frame, &drop_mcast, NULL);
-
-	for (entry = l_queue_get_entries(radio_info); entry;
-			entry = entry->next) {
-		struct radio_info_rec *radio = entry->data;
-		struct send_frame_info *send_info;
-		bool drop = drop_mcast;
-		uint32_t delay = HWSIM_DELAY_MIN_MS;
+	/*
+	 * The kernel hwsim medium passes multicast frames to all
+	 * radios that are on the same frequency as this frame but
+	 * the netlink medium API only lets userspace pass frames to
+	 * radios by known hardware address.  It does check that the
+	 * receiving radio is on the same frequency though so we can
+	 * send to all known addresses.
+	 *
+	 * If the frame's Receiver Address (RA) is a multicast
+	 * address, then send the frame to every radio that is
+	 * registered.  If it's a unicast address then optimize
+	 * by only forwarding the frame to the radios that have
+	 * at least one interface with this specific address.
+	 */
+	if (util_is_broadcast_address(frame->dst_ether_addr)) {
+		process_rules(frame->src_radio, NULL, frame, &frame->signal,
+				&drop_mcast, NULL);
 
-		if (radio == frame->src_radio)
-			continue;
+		for (entry = l_queue_get_entries(radio_info); entry;
+				entry = entry->next) {
+			struct radio_info_rec *radio = entry->data;
 
-		/*
-		 * The kernel hwsim medium passes multicast frames to all
-		 * radios that are on the same frequency as this frame but
-		 * the netlink medium API only lets userspace pass frames to
-		 * radios by known hardware address.  It does check that the
-		 * receiving radio is on the same frequency though so we can
-		 * send to all known addresses.
-		 *
-		 * If the frame's Receiver Address (RA) is a multicast
-		 * address, then send the frame to every radio that is
-		 * registered.  If it's a unicast address then optimize
-		 * by only forwarding the frame to the radios that have
-		 * at least one interface with this specific address.
-		 */
-		if (!util_is_broadcast_address(frame->dst_ether_addr)) {
-			struct interface_match_data match_data = {
-				radio,
-				frame->dst_ether_addr,
-			};
-			struct interface_info_rec *interface =
-				l_queue_find(interface_info,
-						interface_info_match_dst,
-						&match_data);
-
-			if (!interface)
-				continue;
+			if (radio != frame->src_radio)
+				forward_frame(frame, radio, drop_mcast);
 		}
 
-		process_rules(frame->src_radio, radio, frame, &drop, &delay);
+		goto done;
+	}
+
+	interfaces = l_hashmap_lookup(interface_addr_index,
+					frame->dst_ether_addr);
+
+	for (entry = l_queue_get_entries(interfaces); entry;
+			entry = entry->next) {
+		struct interface_info_rec *interface = entry->data;
+		struct radio_info_rec *radio = interface->radio_rec;
 
-		if (drop)
+		if (radio == frame->src_radio)
 			continue;
 
-		send_info = l_new(struct send_frame_info, 1);
-		send_info->radio = radio;
-		send_info->frame = hwsim_frame_ref(frame);
+		/* Forward only once to radios with several such interfaces */
+		for (prev = l_queue_get_entries(interfaces); prev != entry;
+				prev = prev->next)
+			if (((struct interface_info_rec *) prev->data)->
+							radio_rec == radio)
+				break;
 
-		if (!l_timeout_create_ms(delay, frame_delay_callback,
-						send_info, NULL)) {
-			l_error("Error delaying frame, frame will be dropped");
-			send_frame_destroy(send_info);
-		}
+		if (prev == entry)
+			forward_frame(frame, radio, false);
 	}
 
+done:
 	hwsim_frame_unref(frame);
 }
 
@@ -1882,9 +2120,105 @@ static bool radio_property_get_regdom(struct l_dbus *dbus,
 	return true;
 }
 
+static bool radio_property_get_position(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					struct l_dbus_message_builder *builder,
+					void *user_data)
+{
+	struct radio_info_rec *rec = user_data;
+	double x, y;
+
+	if (!rec->positioned)
+		return false;
+
+	radio_get_position(rec, l_time_now(), &x, &y);
+
+	l_dbus_message_builder_enter_struct(builder, "dd");
+	l_dbus_message_builder_append_basic(builder, 'd', &x);
+	l_dbus_message_builder_append_basic(builder, 'd', &y);
+	l_dbus_message_builder_leave_struct(builder);
+
+	return true;
+}
+
+static struct l_dbus_message *radio_property_set_position(
+					struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					struct l_dbus_message_iter *new_value,
+					l_dbus_property_complete_cb_t complete,
+					void *user_data)
+{
+	struct radio_info_rec *rec = user_data;
+	double x, y;
+
+	if (!l_dbus_message_iter_get_variant(new_value, "(dd)", &x, &y) ||
+			!isfinite(x) || !isfinite(y))
+		return dbus_error_invalid_args(message);
+
+	l_queue_destroy(rec->path, l_free);
+	rec->path = NULL;
+	rec->positioned = true;
+	rec->x = x;
+	rec->y = y;
+	rec->position_time = l_time_now();
+
+	return l_dbus_message_new_method_return(message);
+}
+
+/*
+ * Moves the radio along the given path from where it is now, in straight
+ * lines, taking the given number of milliseconds to reach each waypoint.
+ * Replaces any path it was already following.
+ */
+static struct l_dbus_message *radio_move(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	struct radio_info_rec *rec = user_data;
+	struct l_dbus_message_iter iter;
+	struct l_queue *path = l_queue_new();
+	uint64_t now = l_time_now();
+	uint64_t time = now;
+	double x, y;
+	uint32_t duration;
+
+	if (!rec->positioned ||
+			!l_dbus_message_get_arguments(message, "a(ddu)", &iter))
+		goto invalid_args;
+
+	while (l_dbus_message_iter_next_entry(&iter, &x, &y, &duration)) {
+		struct hwsim_waypoint *wp;
+
+		if (!isfinite(x) || !isfinite(y))
+			goto invalid_args;
+
+		/* Strictly increasing times keep the interpolation simple */
+		time += (duration ?: 1) * 1000ULL;
+
+		wp = l_new(struct hwsim_waypoint, 1);
+		wp->x = x;
+		wp->y = y;
+		wp->time = time;
+		l_queue_push_tail(path, wp);
+	}
+
+	radio_get_position(rec, now, &rec->x, &rec->y);
+	rec->position_time = now;
+	l_queue_destroy(rec->path, l_free);
+	rec->path = path;
+
+	return l_dbus_message_new_method_return(message);
+
+invalid_args:
+	l_queue_destroy(path, l_free);
+	return dbus_error_invalid_args(message);
+}
+
 static void setup_radio_interface(struct l_dbus_interface *interface)
 {
 	l_dbus_interface_method(interface, "Destroy", 0, radio_destroy, "", "");
+	l_dbus_interface_method(interface, "Move", 0, radio_move, "",
+				"a(ddu)", "path");
 
 	l_dbus_interface_property(interface, "Name", 0, "s",
 					radio_property_get_name, NULL);
@@ -1898,6 +2232,9 @@ static void setup_radio_interface(struct l_dbus_interface *interface)
 					radio_property_get_p2p, NULL);
 	l_dbus_interface_property(interface, "RegulatoryDomainIndex", 0, "u",
 					radio_property_get_regdom, NULL);
+	l_dbus_interface_property(interface, "Position", 0, "(dd)",
+					radio_property_get_position,
+					radio_property_set_position);
 }
 
 static struct l_dbus_message *interface_send_frame(struct l_dbus *dbus,
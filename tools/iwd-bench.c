@@ -0,0 +1,1444 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2024  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ell/ell.h>
+
+#define HWSIM_SERVICE "net.connman.hwsim"
+#define HWSIM_RADIO_MANAGER_INTERFACE HWSIM_SERVICE ".RadioManager"
+#define HWSIM_RADIO_INTERFACE HWSIM_SERVICE ".Radio"
+#define HWSIM_RULE_MANAGER_INTERFACE HWSIM_SERVICE ".RuleManager"
+#define HWSIM_RULE_INTERFACE HWSIM_SERVICE ".Rule"
+
+#define IWD_SERVICE "net.connman.iwd"
+#define IWD_ROOT_PATH "/"
+#define IWD_BASE_PATH "/net/connman/iwd"
+#define IWD_AGENT_MANAGER_INTERFACE IWD_SERVICE ".AgentManager"
+#define IWD_AGENT_INTERFACE IWD_SERVICE ".Agent"
+#define IWD_ADAPTER_INTERFACE IWD_SERVICE ".Adapter"
+#define IWD_DEVICE_INTERFACE IWD_SERVICE ".Device"
+#define IWD_STATION_INTERFACE IWD_SERVICE ".Station"
+#define IWD_NETWORK_INTERFACE IWD_SERVICE ".Network"
+#define IWD_AP_INTERFACE IWD_SERVICE ".AccessPoint"
+
+#define BENCH_AGENT_PATH "/iwdbench/agent"
+
+#define SIGNAL_STRONG -3000
+#define SIGNAL_WEAK -9000
+
+/* Distance between neighbouring APs and of the stations' path to them */
+#define WALK_AP_SPACING 60.0
+#define WALK_OFFSET 5.0
+
+struct bench_node {
+	char *name;
+	char *radio_path;
+	char *radio_addr;
+	char *rule_path;
+	char *adapter_path;
+	char *device_path;
+	char *state;
+	uint64_t roam_start;
+	uint64_t connect_start;
+	unsigned int roams;
+	unsigned int disconnects;
+};
+
+struct bench_series {
+	const char *name;
+	unsigned int count;
+	unsigned int failed;
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+};
+
+struct bench_usage {
+	uint64_t cpu_ticks;
+	uint64_t rss_kb;
+	uint64_t hwm_kb;
+};
+
+static struct l_dbus *dbus;
+static struct l_queue *aps;
+static struct l_queue *stations;
+static struct bench_series connect_series = { .name = "Connect" };
+static struct bench_series roam_series = { .name = "Roam" };
+static bool terminated;
+static uint32_t iwd_pid;
+
+static unsigned int num_aps = 1;
+static unsigned int num_stations = 4;
+static unsigned int num_roams;
+static unsigned int soak_seconds;
+static unsigned int walk_seconds;
+static unsigned int timeout_seconds = 30;
+static const char *ssid = "iwd-bench";
+static const char *passphrase = "benchmark";
+static bool use_profile;
+
+static void series_add(struct bench_series *series, uint64_t usec)
+{
+	if (!series->count || usec < series->min)
+		series->min = usec;
+
+	if (usec > series->max)
+		series->max = usec;
+
+	series->total += usec;
+	series->count++;
+}
+
+static void series_print(const struct bench_series *series)
+{
+	if (!series->count) {
+		printf("%-8s %u samples, %u failed\n", series->name, 0,
+							series->failed);
+		return;
+	}
+
+	printf("%-8s %u samples, %u failed, min %" PRIu64 ".%03" PRIu64
+		" ms, avg %" PRIu64 ".%03" PRIu64 " ms, max %" PRIu64 ".%03"
+		PRIu64 " ms\n", series->name, series->count, series->failed,
+		series->min / 1000, series->min % 1000,
+		series->total / series->count / 1000,
+		series->total / series->count % 1000,
+		series->max / 1000, series->max % 1000);
+}
+
+static void node_free(void *data)
+{
+	struct bench_node *node = data;
+
+	l_free(node->name);
+	l_free(node->radio_path);
+	l_free(node->radio_addr);
+	l_free(node->rule_path);
+	l_free(node->adapter_path);
+	l_free(node->device_path);
+	l_free(node->state);
+	l_free(node);
+}
+
+static bool node_match_device(const void *a, const void *b)
+{
+	const struct bench_node *node = a;
+
+	return node->device_path && !strcmp(node->device_path, b);
+}
+
+static bool usage_read(struct bench_usage *usage)
+{
+	char path[64];
+	char buf[1024];
+	unsigned long utime, stime;
+	const char *p;
+	FILE *fp;
+	size_t len;
+
+	memset(usage, 0, sizeof(*usage));
+
+	snprintf(path, sizeof(path), "/proc/%u/stat", iwd_pid);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	len = fread(buf, 1, sizeof(buf) - 1, fp);
+	fclose(fp);
+	buf[len] = '\0';
+
+	/* Skip past the command name, it may contain spaces */
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+						"%lu %lu", &utime, &stime) != 2)
+		return false;
+
+	usage->cpu_ticks = utime + stime;
+
+	snprintf(path, sizeof(path), "/proc/%u/status", iwd_pid);
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return false;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned long kb;
+
+		if (sscanf(buf, "VmRSS: %lu kB", &kb) == 1)
+			usage->rss_kb = kb;
+		else if (sscanf(buf, "VmHWM: %lu kB", &kb) == 1)
+			usage->hwm_kb = kb;
+	}
+
+	fclose(fp);
+
+	return true;
+}
+
+static void usage_print(const char *label, const struct bench_usage *start,
+				const struct bench_usage *end,
+				uint64_t elapsed_usec)
+{
+	long hz = sysconf(_SC_CLK_TCK);
+	uint64_t ticks = end->cpu_ticks - start->cpu_ticks;
+	uint64_t cpu_ms = hz > 0 ? ticks * 1000 / hz : 0;
+	uint64_t pct = elapsed_usec ? cpu_ms * 100000 / elapsed_usec : 0;
+
+	printf("%-8s cpu %" PRIu64 " ms (%" PRIu64 ".%" PRIu64 "%%), "
+		"rss %" PRIu64 " -> %" PRIu64 " kB, peak %" PRIu64 " kB\n",
+		label, cpu_ms, pct / 10, pct % 10,
+		start->rss_kb, end->rss_kb, end->hwm_kb);
+}
+
+static bool wait_until(bool (*cond)(void *), void *user_data,
+					unsigned int timeout_ms)
+{
+	uint64_t deadline = l_time_now() + (uint64_t) timeout_ms * 1000;
+
+	while (!terminated) {
+		uint64_t now;
+		int timeout = 100;
+
+		if (cond && cond(user_data))
+			return true;
+
+		now = l_time_now();
+		if (now >= deadline)
+			break;
+
+		if ((deadline - now) / 1000 < 100)
+			timeout = (deadline - now) / 1000 + 1;
+
+		if (!l_main_prepare())
+			timeout = 0;
+
+		l_main_iterate(timeout);
+	}
+
+	return cond && cond(user_data);
+}
+
+static void bench_sleep(unsigned int ms)
+{
+	wait_until(NULL, NULL, ms);
+}
+
+struct call_data {
+	struct l_dbus_message *reply;
+	bool done;
+};
+
+static void call_callback(struct l_dbus_message *reply, void *user_data)
+{
+	struct call_data *data = user_data;
+
+	data->reply = l_dbus_message_ref(reply);
+	data->done = true;
+}
+
+static bool call_done(void *user_data)
+{
+	struct call_data *data = user_data;
+
+	return data->done;
+}
+
+/*
+ * Send a method call and run the main loop until its reply arrives.  The
+ * returned message is either the method return or a D-Bus error; NULL
+ * means the call timed out or the run was interrupted.
+ */
+static struct l_dbus_message *call_sync(struct l_dbus_message *message)
+{
+	struct call_data data = {};
+	uint32_t serial;
+
+	serial = l_dbus_send_with_reply(dbus, message, call_callback,
+								&data, NULL);
+	if (!serial)
+		return NULL;
+
+	if (!wait_until(call_done, &data, timeout_seconds * 1000)) {
+		l_dbus_cancel(dbus, serial);
+		return NULL;
+	}
+
+	return data.reply;
+}
+
+static bool reply_ok(struct l_dbus_message *reply, const char *what)
+{
+	const char *name, *text;
+
+	if (!reply) {
+		fprintf(stderr, "%s: no reply\n", what);
+		return false;
+	}
+
+	if (!l_dbus_message_get_error(reply, &name, &text))
+		return true;
+
+	fprintf(stderr, "%s: %s %s\n", what, name, text ? text : "");
+	return false;
+}
+
+static bool reply_error_is(struct l_dbus_message *reply, const char *suffix)
+{
+	const char *name;
+	size_t len, slen = strlen(suffix);
+
+	if (!reply || !l_dbus_message_get_error(reply, &name, NULL))
+		return false;
+
+	len = strlen(name);
+
+	return len >= slen && !strcmp(name + len - slen, suffix);
+}
+
+static bool call_simple(const char *service, const char *path,
+				const char *interface, const char *method,
+				const char *what)
+{
+	struct l_dbus_message *message, *reply;
+	bool ok;
+
+	message = l_dbus_message_new_method_call(dbus, service, path,
+							interface, method);
+	l_dbus_message_set_arguments(message, "");
+
+	reply = call_sync(message);
+	ok = reply_ok(reply, what);
+	l_dbus_message_unref(reply);
+
+	return ok;
+}
+
+static char *get_string_property(const char *service, const char *path,
+					const char *interface, const char *name)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_iter variant;
+	const char *value;
+	char *result = NULL;
+
+	message = l_dbus_message_new_method_call(dbus, service, path,
+						L_DBUS_INTERFACE_PROPERTIES,
+						"Get");
+	l_dbus_message_set_arguments(message, "ss", interface, name);
+
+	reply = call_sync(message);
+	if (reply_ok(reply, name) &&
+			l_dbus_message_get_arguments(reply, "v", &variant) &&
+			(l_dbus_message_iter_get_variant(&variant, "s",
+								&value) ||
+			 l_dbus_message_iter_get_variant(&variant, "o",
+								&value)))
+		result = l_strdup(value);
+
+	l_dbus_message_unref(reply);
+
+	return result;
+}
+
+static char *get_first_address(const char *path)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_iter variant, array;
+	const char *value;
+	char *result = NULL;
+
+	message = l_dbus_message_new_method_call(dbus, HWSIM_SERVICE, path,
+						L_DBUS_INTERFACE_PROPERTIES,
+						"Get");
+	l_dbus_message_set_arguments(message, "ss", HWSIM_RADIO_INTERFACE,
+							"Addresses");
+
+	reply = call_sync(message);
+	if (reply_ok(reply, "Addresses") &&
+			l_dbus_message_get_arguments(reply, "v", &variant) &&
+			l_dbus_message_iter_get_variant(&variant, "as",
+								&array) &&
+			l_dbus_message_iter_next_entry(&array, &value))
+		result = l_strdup(value);
+
+	l_dbus_message_unref(reply);
+
+	return result;
+}
+
+static bool set_property(const char *service, const char *path,
+				const char *interface, const char *name,
+				const char *signature, ...)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_builder *builder;
+	va_list args;
+	bool ok;
+
+	message = l_dbus_message_new_method_call(dbus, service, path,
+						L_DBUS_INTERFACE_PROPERTIES,
+						"Set");
+
+	builder = l_dbus_message_builder_new(message);
+	l_dbus_message_builder_append_basic(builder, 's', interface);
+	l_dbus_message_builder_append_basic(builder, 's', name);
+	l_dbus_message_builder_enter_variant(builder, signature);
+
+	va_start(args, signature);
+
+	if (signature[0] == 's')
+		l_dbus_message_builder_append_basic(builder, 's',
+						va_arg(args, const char *));
+	else if (signature[0] == 'n') {
+		int16_t n = va_arg(args, int);
+
+		l_dbus_message_builder_append_basic(builder, 'n', &n);
+	} else if (signature[0] == 'b') {
+		bool b = va_arg(args, int);
+
+		l_dbus_message_builder_append_basic(builder, 'b', &b);
+	} else if (!strcmp(signature, "(dd)")) {
+		double x = va_arg(args, double);
+		double y = va_arg(args, double);
+
+		l_dbus_message_builder_enter_struct(builder, "dd");
+		l_dbus_message_builder_append_basic(builder, 'd', &x);
+		l_dbus_message_builder_append_basic(builder, 'd', &y);
+		l_dbus_message_builder_leave_struct(builder);
+	}
+
+	va_end(args);
+
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	reply = call_sync(message);
+	ok = reply_ok(reply, name);
+	l_dbus_message_unref(reply);
+
+	return ok;
+}
+
+static bool get_iwd_pid(void)
+{
+	struct l_dbus_message *message, *reply;
+	bool ok;
+
+	message = l_dbus_message_new_method_call(dbus, "org.freedesktop.DBus",
+						"/org/freedesktop/DBus",
+						"org.freedesktop.DBus",
+						"GetConnectionUnixProcessID");
+	l_dbus_message_set_arguments(message, "s", IWD_SERVICE);
+
+	reply = call_sync(message);
+	ok = reply_ok(reply, "GetConnectionUnixProcessID") &&
+		l_dbus_message_get_arguments(reply, "u", &iwd_pid);
+	l_dbus_message_unref(reply);
+
+	return ok;
+}
+
+static struct bench_node *radio_create(const char *prefix, unsigned int idx)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_builder *builder;
+	struct bench_node *node;
+	const char *path;
+	char *name;
+
+	name = l_strdup_printf("%s%u", prefix, idx);
+
+	message = l_dbus_message_new_method_call(dbus, HWSIM_SERVICE, "/",
+					HWSIM_RADIO_MANAGER_INTERFACE,
+					"CreateRadio");
+
+	builder = l_dbus_message_builder_new(message);
+	l_dbus_message_builder_enter_array(builder, "{sv}");
+	l_dbus_message_builder_enter_dict(builder, "sv");
+	l_dbus_message_builder_append_basic(builder, 's', "Name");
+	l_dbus_message_builder_enter_variant(builder, "s");
+	l_dbus_message_builder_append_basic(builder, 's', name);
+	l_dbus_message_builder_leave_variant(builder);
+	l_dbus_message_builder_leave_dict(builder);
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	reply = call_sync(message);
+	if (!reply_ok(reply, "CreateRadio") ||
+			!l_dbus_message_get_arguments(reply, "o", &path)) {
+		l_dbus_message_unref(reply);
+		l_free(name);
+		return NULL;
+	}
+
+	node = l_new(struct bench_node, 1);
+	node->name = name;
+	node->radio_path = l_strdup(path);
+	node->radio_addr = get_first_address(path);
+	l_dbus_message_unref(reply);
+
+	return node;
+}
+
+static void radio_destroy(void *data, void *user_data)
+{
+	struct bench_node *node = data;
+
+	if (node->rule_path)
+		call_simple(HWSIM_SERVICE, node->rule_path,
+				HWSIM_RULE_INTERFACE, "Remove", "Remove");
+
+	if (node->radio_path)
+		call_simple(HWSIM_SERVICE, node->radio_path,
+				HWSIM_RADIO_INTERFACE, "Destroy", "Destroy");
+}
+
+static bool radios_create(struct l_queue *queue, const char *prefix,
+							unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct bench_node *node = radio_create(prefix, i);
+
+		if (!node)
+			return false;
+
+		l_queue_push_tail(queue, node);
+	}
+
+	return true;
+}
+
+/*
+ * Walk iwd's object tree and bind each radio to its Adapter (wiphy names
+ * match the hwsim radio names) and then to the Device on that Adapter.
+ */
+static void nodes_bind(struct l_queue *queue, struct l_dbus_message *reply)
+{
+	struct l_dbus_message_iter objects, interfaces, properties, variant;
+	const char *path, *interface, *key;
+
+	if (!l_dbus_message_get_arguments(reply, "a{oa{sa{sv}}}", &objects))
+		return;
+
+	while (l_dbus_message_iter_next_entry(&objects, &path, &interfaces)) {
+		while (l_dbus_message_iter_next_entry(&interfaces, &interface,
+							&properties)) {
+			bool adapter = !strcmp(interface,
+						IWD_ADAPTER_INTERFACE);
+			bool device = !strcmp(interface,
+						IWD_DEVICE_INTERFACE);
+
+			if (!adapter && !device)
+				continue;
+
+			while (l_dbus_message_iter_next_entry(&properties,
+							&key, &variant)) {
+				const struct l_queue_entry *entry;
+				const char *value;
+
+				if (adapter && !strcmp(key, "Name") &&
+					l_dbus_message_iter_get_variant(
+						&variant, "s", &value)) {
+					for (entry = l_queue_get_entries(queue);
+						entry; entry = entry->next) {
+						struct bench_node *node =
+								entry->data;
+
+						if (strcmp(node->name, value))
+							continue;
+
+						l_free(node->adapter_path);
+						node->adapter_path =
+							l_strdup(path);
+					}
+				}
+
+				if (device && !strcmp(key, "Adapter") &&
+					l_dbus_message_iter_get_variant(
+						&variant, "o", &value)) {
+					for (entry = l_queue_get_entries(queue);
+						entry; entry = entry->next) {
+						struct bench_node *node =
+								entry->data;
+
+						if (!node->adapter_path ||
+							strcmp(node->adapter_path,
+								value))
+							continue;
+
+						l_free(node->device_path);
+						node->device_path =
+							l_strdup(path);
+					}
+				}
+			}
+		}
+	}
+}
+
+static bool nodes_bound(void *user_data)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(user_data); entry;
+						entry = entry->next) {
+		const struct bench_node *node = entry->data;
+
+		if (!node->device_path)
+			return false;
+	}
+
+	return true;
+}
+
+static bool nodes_wait_devices(struct l_queue *queue)
+{
+	uint64_t deadline = l_time_now() + timeout_seconds * L_USEC_PER_SEC;
+
+	while (!terminated && l_time_now() < deadline) {
+		struct l_dbus_message *message, *reply;
+
+		message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+					IWD_ROOT_PATH,
+					L_DBUS_INTERFACE_OBJECT_MANAGER,
+					"GetManagedObjects");
+		l_dbus_message_set_arguments(message, "");
+
+		reply = call_sync(message);
+		if (reply_ok(reply, "GetManagedObjects"))
+			nodes_bind(queue, reply);
+
+		l_dbus_message_unref(reply);
+
+		if (nodes_bound(queue))
+			return true;
+
+		bench_sleep(250);
+	}
+
+	fprintf(stderr, "Timed out waiting for iwd devices\n");
+	return false;
+}
+
+static void station_state_changed(struct bench_node *node, const char *state)
+{
+	uint64_t now = l_time_now();
+
+	if (!strcmp(state, "roaming") && !node->roam_start)
+		node->roam_start = now;
+	else if (!strcmp(state, "connected")) {
+		if (node->roam_start) {
+			series_add(&roam_series, now - node->roam_start);
+			node->roams++;
+		} else if (node->connect_start)
+			series_add(&connect_series,
+					now - node->connect_start);
+
+		node->roam_start = 0;
+		node->connect_start = 0;
+	} else if (!strcmp(state, "disconnected") &&
+				node->state && strcmp(node->state, state)) {
+		if (node->roam_start)
+			roam_series.failed++;
+
+		node->roam_start = 0;
+		node->disconnects++;
+	}
+
+	l_free(node->state);
+	node->state = l_strdup(state);
+}
+
+static void properties_changed(struct l_dbus_message *message,
+							void *user_data)
+{
+	struct l_dbus_message_iter changed, invalidated, variant;
+	struct bench_node *node;
+	const char *interface, *key, *value;
+
+	node = l_queue_find(stations, node_match_device,
+				l_dbus_message_get_path(message));
+	if (!node)
+		return;
+
+	if (!l_dbus_message_get_arguments(message, "sa{sv}as", &interface,
+						&changed, &invalidated))
+		return;
+
+	if (strcmp(interface, IWD_STATION_INTERFACE))
+		return;
+
+	while (l_dbus_message_iter_next_entry(&changed, &key, &variant)) {
+		if (strcmp(key, "State"))
+			continue;
+
+		if (l_dbus_message_iter_get_variant(&variant, "s", &value))
+			station_state_changed(node, value);
+	}
+}
+
+static struct l_dbus_message *agent_request_passphrase(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	struct l_dbus_message *reply;
+
+	reply = l_dbus_message_new_method_return(message);
+	l_dbus_message_set_arguments(reply, "s", passphrase);
+
+	return reply;
+}
+
+static struct l_dbus_message *agent_release(struct l_dbus *dbus,
+					struct l_dbus_message *message,
+					void *user_data)
+{
+	return l_dbus_message_new_method_return(message);
+}
+
+static void agent_setup_interface(struct l_dbus_interface *interface)
+{
+	l_dbus_interface_method(interface, "RequestPassphrase", 0,
+				agent_request_passphrase, "s", "o",
+				"passphrase", "network");
+	l_dbus_interface_method(interface, "Release", 0, agent_release,
+				"", "");
+	l_dbus_interface_method(interface, "Cancel", 0, agent_release,
+				"", "s", "reason");
+}
+
+static bool agent_register(void)
+{
+	struct l_dbus_message *message, *reply;
+	bool ok;
+
+	if (!l_dbus_register_interface(dbus, IWD_AGENT_INTERFACE,
+					agent_setup_interface, NULL, false) ||
+			!l_dbus_object_add_interface(dbus, BENCH_AGENT_PATH,
+						IWD_AGENT_INTERFACE, NULL))
+		return false;
+
+	message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+					IWD_BASE_PATH,
+					IWD_AGENT_MANAGER_INTERFACE,
+					"RegisterAgent");
+	l_dbus_message_set_arguments(message, "o", BENCH_AGENT_PATH);
+
+	reply = call_sync(message);
+	ok = reply_ok(reply, "RegisterAgent");
+	l_dbus_message_unref(reply);
+
+	return ok;
+}
+
+static bool ap_start(struct bench_node *node)
+{
+	uint64_t deadline = l_time_now() + timeout_seconds * L_USEC_PER_SEC;
+
+	if (!set_property(IWD_SERVICE, node->device_path,
+				IWD_DEVICE_INTERFACE, "Mode", "s", "ap"))
+		return false;
+
+	/* The AccessPoint interface shows up once the mode switch is done */
+	while (!terminated && l_time_now() < deadline) {
+		struct l_dbus_message *message, *reply;
+		bool ok;
+
+		message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+						node->device_path,
+						IWD_AP_INTERFACE,
+						use_profile ? "StartProfile" :
+								"Start");
+		if (use_profile)
+			l_dbus_message_set_arguments(message, "s", ssid);
+		else
+			l_dbus_message_set_arguments(message, "ss", ssid,
+								passphrase);
+
+		reply = call_sync(message);
+
+		if (reply && !l_dbus_message_is_error(reply)) {
+			l_dbus_message_unref(reply);
+			return true;
+		}
+
+		ok = reply_error_is(reply, ".UnknownMethod") ||
+			reply_error_is(reply, ".UnknownInterface") ||
+			reply_error_is(reply, ".UnknownObject");
+		if (!ok)
+			reply_ok(reply, node->name);
+
+		l_dbus_message_unref(reply);
+
+		if (!ok)
+			return false;
+
+		bench_sleep(100);
+	}
+
+	return false;
+}
+
+static bool scan_done(void *user_data)
+{
+	struct bench_node *node = user_data;
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_iter variant;
+	bool scanning = true;
+
+	message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+						node->device_path,
+						L_DBUS_INTERFACE_PROPERTIES,
+						"Get");
+	l_dbus_message_set_arguments(message, "ss", IWD_STATION_INTERFACE,
+							"Scanning");
+
+	reply = call_sync(message);
+	if (reply && !l_dbus_message_is_error(reply) &&
+			l_dbus_message_get_arguments(reply, "v", &variant))
+		l_dbus_message_iter_get_variant(&variant, "b", &scanning);
+
+	l_dbus_message_unref(reply);
+
+	if (scanning)
+		bench_sleep(50);
+
+	return !scanning;
+}
+
+static char *station_find_network(struct bench_node *node)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_iter array;
+	const char *path;
+	int16_t signal;
+	char *result = NULL;
+
+	message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+						node->device_path,
+						IWD_STATION_INTERFACE,
+						"GetOrderedNetworks");
+	l_dbus_message_set_arguments(message, "");
+
+	reply = call_sync(message);
+	if (!reply_ok(reply, "GetOrderedNetworks") ||
+			!l_dbus_message_get_arguments(reply, "a(on)", &array))
+		goto done;
+
+	while (!result && l_dbus_message_iter_next_entry(&array, &path,
+								&signal)) {
+		char *name = get_string_property(IWD_SERVICE, path,
+						IWD_NETWORK_INTERFACE, "Name");
+
+		if (name && !strcmp(name, ssid))
+			result = l_strdup(path);
+
+		l_free(name);
+	}
+
+done:
+	l_dbus_message_unref(reply);
+	return result;
+}
+
+static bool station_connected(void *user_data)
+{
+	struct bench_node *node = user_data;
+
+	return node->state && !strcmp(node->state, "connected");
+}
+
+/*
+ * Time-to-connect covers the scan as well as the association and
+ * handshake.  Once the first station has connected the network is known,
+ * so later stations may get there through autoconnect before we ask;
+ * either way the clock runs from the start of the attempt.
+ */
+static bool station_connect(struct bench_node *node)
+{
+	struct l_dbus_message *message, *reply;
+	char *network;
+	unsigned int attempt;
+
+	node->connect_start = l_time_now();
+
+	for (attempt = 0; attempt < 3 && !station_connected(node); attempt++) {
+		message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+							node->device_path,
+							IWD_STATION_INTERFACE,
+							"Scan");
+		l_dbus_message_set_arguments(message, "");
+		l_dbus_message_unref(call_sync(message));
+
+		if (!wait_until(scan_done, node, timeout_seconds * 1000))
+			break;
+
+		if (station_connected(node))
+			break;
+
+		network = station_find_network(node);
+		if (!network)
+			continue;
+
+		message = l_dbus_message_new_method_call(dbus, IWD_SERVICE,
+							network,
+							IWD_NETWORK_INTERFACE,
+							"Connect");
+		l_dbus_message_set_arguments(message, "");
+		l_free(network);
+
+		reply = call_sync(message);
+		if (!reply_error_is(reply, ".InProgress") &&
+				!reply_error_is(reply, ".AlreadyConnected") &&
+				!reply_error_is(reply, ".Busy"))
+			reply_ok(reply, node->name);
+
+		l_dbus_message_unref(reply);
+
+		if (wait_until(station_connected, node,
+						timeout_seconds * 1000))
+			break;
+	}
+
+	if (station_connected(node))
+		return true;
+
+	connect_series.failed++;
+	node->connect_start = 0;
+	fprintf(stderr, "%s: failed to connect\n", node->name);
+	return false;
+}
+
+static bool ap_rule_add(struct bench_node *node)
+{
+	struct l_dbus_message *message, *reply;
+	const char *path;
+
+	if (!node->radio_addr)
+		return false;
+
+	message = l_dbus_message_new_method_call(dbus, HWSIM_SERVICE, "/",
+						HWSIM_RULE_MANAGER_INTERFACE,
+						"AddRule");
+	l_dbus_message_set_arguments(message, "");
+
+	reply = call_sync(message);
+	if (!reply_ok(reply, "AddRule") ||
+			!l_dbus_message_get_arguments(reply, "o", &path)) {
+		l_dbus_message_unref(reply);
+		return false;
+	}
+
+	node->rule_path = l_strdup(path);
+	l_dbus_message_unref(reply);
+
+	return set_property(HWSIM_SERVICE, node->rule_path,
+				HWSIM_RULE_INTERFACE, "Source", "s",
+				node->radio_addr) &&
+		set_property(HWSIM_SERVICE, node->rule_path,
+				HWSIM_RULE_INTERFACE, "Bidirectional", "b",
+				true) &&
+		set_property(HWSIM_SERVICE, node->rule_path,
+				HWSIM_RULE_INTERFACE, "SignalStrength", "n",
+				SIGNAL_STRONG);
+}
+
+static bool stations_settled(void *user_data)
+{
+	const struct l_queue_entry *entry;
+
+	for (entry = l_queue_get_entries(stations); entry;
+						entry = entry->next) {
+		const struct bench_node *node = entry->data;
+
+		if (node->roam_start || !station_connected((void *) node))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * There is no way to ask iwd to roam from outside, so each round makes one
+ * AP strong and fades all the others, forcing every station that is not
+ * already on the strong AP through the low-RSSI roam path.
+ */
+static void roam_round(unsigned int round)
+{
+	unsigned int target = round % num_aps;
+	const struct l_queue_entry *entry;
+	const char *target_name = NULL;
+	unsigned int before = roam_series.count;
+	unsigned int i = 0;
+
+	for (entry = l_queue_get_entries(aps); entry; entry = entry->next) {
+		struct bench_node *node = entry->data;
+		bool strong = i++ == target;
+
+		if (strong)
+			target_name = node->name;
+
+		set_property(HWSIM_SERVICE, node->rule_path,
+				HWSIM_RULE_INTERFACE, "SignalStrength", "n",
+				strong ? SIGNAL_STRONG : SIGNAL_WEAK);
+	}
+
+	/* Give the CQM events a chance to fire before checking for quiet */
+	bench_sleep(2000);
+
+	if (!wait_until(stations_settled, NULL, timeout_seconds * 1000))
+		fprintf(stderr, "Round %u: stations did not settle\n", round);
+
+	printf("Round %u: %u roams towards %s\n", round,
+			roam_series.count - before, target_name);
+}
+
+static unsigned int stations_disconnects(void)
+{
+	const struct l_queue_entry *entry;
+	unsigned int total = 0;
+
+	for (entry = l_queue_get_entries(stations); entry;
+						entry = entry->next) {
+		const struct bench_node *node = entry->data;
+
+		total += node->disconnects;
+	}
+
+	return total;
+}
+
+static bool node_place(struct bench_node *node, double x, double y)
+{
+	return set_property(HWSIM_SERVICE, node->radio_path,
+				HWSIM_RADIO_INTERFACE, "Position", "(dd)",
+				x, y);
+}
+
+/* Walks to @x and back, at a constant speed taking @ms each way */
+static bool node_walk(struct bench_node *node, double x, double y,
+							uint32_t ms)
+{
+	struct l_dbus_message *message, *reply;
+	struct l_dbus_message_builder *builder;
+	double home_x = 0.0;
+	bool ok;
+
+	message = l_dbus_message_new_method_call(dbus, HWSIM_SERVICE,
+						node->radio_path,
+						HWSIM_RADIO_INTERFACE, "Move");
+
+	builder = l_dbus_message_builder_new(message);
+	l_dbus_message_builder_enter_array(builder, "(ddu)");
+	l_dbus_message_builder_enter_struct(builder, "ddu");
+	l_dbus_message_builder_append_basic(builder, 'd', &x);
+	l_dbus_message_builder_append_basic(builder, 'd', &y);
+	l_dbus_message_builder_append_basic(builder, 'u', &ms);
+	l_dbus_message_builder_leave_struct(builder);
+	l_dbus_message_builder_enter_struct(builder, "ddu");
+	l_dbus_message_builder_append_basic(builder, 'd', &home_x);
+	l_dbus_message_builder_append_basic(builder, 'd', &y);
+	l_dbus_message_builder_append_basic(builder, 'u', &ms);
+	l_dbus_message_builder_leave_struct(builder);
+	l_dbus_message_builder_leave_array(builder);
+	l_dbus_message_builder_finalize(builder);
+	l_dbus_message_builder_destroy(builder);
+
+	reply = call_sync(message);
+	ok = reply_ok(reply, "Move");
+	l_dbus_message_unref(reply);
+
+	return ok;
+}
+
+/*
+ * The APs stand in a line and every station walks past all of them and
+ * back, so that roams are driven by hwsim's path loss model rather than
+ * by rules.  The signal changes gradually, which is what the roam scan
+ * scheduling and the threshold logic see in the real world.
+ */
+static void walk(void)
+{
+	double end = (num_aps - 1) * WALK_AP_SPACING;
+	const struct l_queue_entry *entry;
+	unsigned int before = roam_series.count;
+	unsigned int disconnects = stations_disconnects();
+
+	for (entry = l_queue_get_entries(stations); entry;
+						entry = entry->next) {
+		struct bench_node *node = entry->data;
+
+		if (!node_walk(node, end, WALK_OFFSET, walk_seconds * 1000))
+			fprintf(stderr, "%s: can't walk\n", node->name);
+	}
+
+	bench_sleep(walk_seconds * 2000);
+
+	if (!wait_until(stations_settled, NULL, timeout_seconds * 1000))
+		fprintf(stderr, "Walk: stations did not settle\n");
+
+	printf("Walk     %u s each way, %u roams, %u disconnects\n",
+			walk_seconds, roam_series.count - before,
+			stations_disconnects() - disconnects);
+}
+
+/*
+ * Let everything sit connected and sample iwd's usage once a second.  Any
+ * group rekeys come from GroupRekeyInterval in the AP profile (see -p).
+ */
+static void soak(void)
+{
+	struct bench_usage start, last, now;
+	uint64_t start_time = l_time_now();
+	unsigned int disconnects = stations_disconnects();
+	unsigned int elapsed;
+
+	usage_read(&start);
+	last = start;
+
+	for (elapsed = 0; elapsed < soak_seconds && !terminated; elapsed++) {
+		bench_sleep(1000);
+
+		if (usage_read(&now))
+			last = now;
+	}
+
+	printf("Soak     %u s, %u disconnects\n", elapsed,
+				stations_disconnects() - disconnects);
+	usage_print("Soak", &start, &last, l_time_now() - start_time);
+}
+
+static void signal_handler(void *user_data)
+{
+	terminated = true;
+}
+
+static void usage(void)
+{
+	printf("iwd-bench - Scale and soak benchmark for iwd on hwsim\n"
+		"Usage:\n");
+	printf("\tiwd-bench [options]\n");
+	printf("Options:\n"
+		"\t-a, --aps <num>           Number of iwd access points\n"
+		"\t-s, --stations <num>      Number of iwd stations\n"
+		"\t-r, --roams <num>         Number of forced roam rounds\n"
+		"\t-d, --duration <secs>     Soak time once connected\n"
+		"\t-w, --walk <secs>         Walk the stations past the APs,\n"
+		"\t                          taking <secs> each way\n"
+		"\t-t, --timeout <secs>      Per-operation timeout\n"
+		"\t-n, --ssid <name>         SSID used by the APs\n"
+		"\t-P, --passphrase <psk>    WPA2 passphrase\n"
+		"\t-p, --profile             Start APs from the SSID's .ap "
+							"profile\n"
+		"\t-v, --version             Show version\n"
+		"\t-h, --help                Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "aps",        required_argument, NULL, 'a' },
+	{ "stations",   required_argument, NULL, 's' },
+	{ "roams",      required_argument, NULL, 'r' },
+	{ "duration",   required_argument, NULL, 'd' },
+	{ "walk",       required_argument, NULL, 'w' },
+	{ "timeout",    required_argument, NULL, 't' },
+	{ "ssid",       required_argument, NULL, 'n' },
+	{ "passphrase", required_argument, NULL, 'P' },
+	{ "profile",    no_argument,       NULL, 'p' },
+	{ "version",    no_argument,       NULL, 'v' },
+	{ "help",       no_argument,       NULL, 'h' },
+	{ }
+};
+
+static bool parse_count(const char *str, unsigned int max,
+						unsigned int *out)
+{
+	char *endp;
+	unsigned long val;
+
+	errno = 0;
+	val = strtoul(str, &endp, 10);
+
+	if (errno || *endp || endp == str || val > max)
+		return false;
+
+	*out = val;
+	return true;
+}
+
+static int bench_run(void)
+{
+	struct bench_usage start, end;
+	const struct l_queue_entry *entry;
+	uint64_t start_time;
+	unsigned int i;
+	unsigned int n = 0;
+
+	if (!get_iwd_pid()) {
+		fprintf(stderr, "iwd is not running\n");
+		return EXIT_FAILURE;
+	}
+
+	usage_read(&start);
+	start_time = l_time_now();
+
+	printf("iwd pid %u, %u APs, %u stations\n", iwd_pid, num_aps,
+							num_stations);
+
+	l_dbus_add_signal_watch(dbus, IWD_SERVICE, NULL,
+					L_DBUS_INTERFACE_PROPERTIES,
+					"PropertiesChanged", L_DBUS_MATCH_NONE,
+					properties_changed, NULL);
+
+	if (!radios_create(aps, "bench-ap", num_aps) ||
+			!radios_create(stations, "bench-sta", num_stations))
+		return EXIT_FAILURE;
+
+	if (!nodes_wait_devices(aps) || !nodes_wait_devices(stations))
+		return EXIT_FAILURE;
+
+	if (!agent_register())
+		return EXIT_FAILURE;
+
+	for (entry = l_queue_get_entries(aps); entry; entry = entry->next) {
+		struct bench_node *node = entry->data;
+
+		bool ok = ap_start(node);
+
+		/* When walking the medium model sets the signal levels */
+		if (ok && walk_seconds)
+			ok = node_place(node, n++ * WALK_AP_SPACING, 0.0);
+		else if (ok)
+			ok = ap_rule_add(node);
+
+		if (!ok) {
+			fprintf(stderr, "%s: AP setup failed\n", node->name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (entry = l_queue_get_entries(stations); entry && walk_seconds;
+							entry = entry->next) {
+		struct bench_node *node = entry->data;
+
+		if (!node_place(node, 0.0, WALK_OFFSET)) {
+			fprintf(stderr, "%s: can't place station\n",
+					node->name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (entry = l_queue_get_entries(stations); entry;
+						entry = entry->next) {
+		struct bench_node *node = entry->data;
+
+		l_free(node->state);
+		node->state = get_string_property(IWD_SERVICE,
+						node->device_path,
+						IWD_STATION_INTERFACE, "State");
+	}
+
+	for (entry = l_queue_get_entries(stations); entry && !terminated;
+							entry = entry->next)
+		station_connect(entry->data);
+
+	if (num_roams && num_aps < 2)
+		fprintf(stderr, "Roaming needs at least two APs\n");
+	else
+		for (i = 0; i < num_roams && !terminated; i++)
+			roam_round(i + 1);
+
+	if (walk_seconds && !terminated)
+		walk();
+
+	if (soak_seconds && !terminated)
+		soak();
+
+	usage_read(&end);
+
+	printf("\n");
+	series_print(&connect_series);
+	series_print(&roam_series);
+	usage_print("Total", &start, &end, l_time_now() - start_time);
+
+	return connect_series.failed || roam_series.failed ?
+						EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void ready_callback(void *user_data)
+{
+	bool *ready = user_data;
+
+	*ready = true;
+}
+
+static bool bus_ready(void *user_data)
+{
+	return *(bool *) user_data;
+}
+
+int main(int argc, char *argv[])
+{
+	struct l_signal *sigint, *sigterm;
+	bool ready = false;
+	int exit_status;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "a:s:r:d:w:t:n:P:pvh",
+						main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'a':
+			if (!parse_count(optarg, 64, &num_aps) || !num_aps) {
+				fprintf(stderr, "Invalid AP count\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (!parse_count(optarg, 1024, &num_stations)) {
+				fprintf(stderr, "Invalid station count\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (!parse_count(optarg, UINT_MAX, &num_roams)) {
+				fprintf(stderr, "Invalid roam count\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'd':
+			if (!parse_count(optarg, UINT_MAX, &soak_seconds)) {
+				fprintf(stderr, "Invalid soak duration\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'w':
+			if (!parse_count(optarg, 3600, &walk_seconds) ||
+						!walk_seconds) {
+				fprintf(stderr, "Invalid walk duration\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			if (!parse_count(optarg, 3600, &timeout_seconds) ||
+						!timeout_seconds) {
+				fprintf(stderr, "Invalid timeout\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'n':
+			ssid = optarg;
+			break;
+		case 'P':
+			passphrase = optarg;
+			break;
+		case 'p':
+			use_profile = true;
+			break;
+		case 'v':
+			printf("%s\n", VERSION);
+			return EXIT_SUCCESS;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind > 0) {
+		fprintf(stderr, "Invalid command line parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	/* Rules would override the signal levels of the medium model */
+	if (walk_seconds && (num_roams || num_aps < 2)) {
+		fprintf(stderr, "Walking needs two APs and no roam rounds\n");
+		return EXIT_FAILURE;
+	}
+
+	if (!l_main_init())
+		return EXIT_FAILURE;
+
+	l_log_set_stderr();
+
+	sigint = l_signal_create(SIGINT, signal_handler, NULL, NULL);
+	sigterm = l_signal_create(SIGTERM, signal_handler, NULL, NULL);
+
+	exit_status = EXIT_FAILURE;
+
+	dbus = l_dbus_new_default(L_DBUS_SYSTEM_BUS);
+	if (!dbus) {
+		fprintf(stderr, "Failed to initialize D-Bus\n");
+		goto done;
+	}
+
+	l_dbus_set_ready_handler(dbus, ready_callback, &ready, NULL);
+
+	if (!wait_until(bus_ready, &ready, timeout_seconds * 1000)) {
+		fprintf(stderr, "D-Bus connection not ready\n");
+		goto done;
+	}
+
+	aps = l_queue_new();
+	stations = l_queue_new();
+
+	exit_status = bench_run();
+
+	/* Tear down even when interrupted, so ignore the terminate flag */
+	terminated = false;
+	l_queue_foreach(stations, radio_destroy, NULL);
+	l_queue_foreach(aps, radio_destroy, NULL);
+
+	l_queue_destroy(stations, node_free);
+	l_queue_destroy(aps, node_free);
+
+done:
+	l_dbus_destroy(dbus);
+	l_signal_remove(sigint);
+	l_signal_remove(sigterm);
+	l_main_exit();
+
+	return exit_status;
+}
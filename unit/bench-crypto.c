@@ -0,0 +1,505 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <ell/ell.h>
+
+#include "src/util.h"
+#include "src/ie.h"
+#include "src/crypto.h"
+#include "src/handshake.h"
+#include "src/mpdu.h"
+#include "src/sae.h"
+#include "src/auth-proto.h"
+
+/*
+ * Micro-benchmarks for the hot crypto paths of the connection setup.  The
+ * inputs are taken from the vectors used by the corresponding unit tests.
+ * Each result is printed as one JSON object per line so that runs can be
+ * compared by scripts.
+ */
+
+#define BENCH_MAX_DATA 1500
+
+static uint64_t min_ns = 200 * L_NSEC_PER_MSEC;
+static const char *filter;
+
+static const size_t data_sizes[] = { 8, 64, 256, BENCH_MAX_DATA };
+
+/* RFC 2202 / RFC 4231 Test Case 1 key */
+static const uint8_t hmac_key[] = {
+	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+	0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b, 0x0b,
+};
+
+/* RFC 4493 Section 4 key */
+static const uint8_t cmac_key[] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+	0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+/* RFC 5297 Appendix A.1 key and associated data */
+static const uint8_t siv_key[] = {
+	0xff, 0xfe, 0xfd, 0xfc, 0xfb, 0xfa, 0xf9, 0xf8, 0xf7, 0xf6,
+	0xf5, 0xf4, 0xf3, 0xf2, 0xf1, 0xf0, 0xf0, 0xf1, 0xf2, 0xf3,
+	0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd,
+	0xfe, 0xff,
+};
+
+static const uint8_t siv_ad[] = {
+	0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+	0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23,
+	0x24, 0x25, 0x26, 0x27,
+};
+
+static const char *psk_passphrase = "password";
+static const unsigned char psk_ssid[] = { 'I', 'E', 'E', 'E' };
+
+static uint8_t spa[] = { 2, 0, 0, 0, 0, 0 };
+static uint8_t aa[] = { 2, 0, 0, 0, 0, 1 };
+static char *sae_passphrase = "secret123";
+static const char *sae_ssid = "TestSSID";
+
+static uint8_t data[BENCH_MAX_DATA];
+static uint8_t output[BENCH_MAX_DATA + 16];
+
+typedef bool (*bench_func_t)(size_t size);
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * L_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool bench_selected(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static void bench_report(const char *name, unsigned int group, size_t size,
+				uint64_t iterations, uint64_t ns)
+{
+	double ns_per_op = (double) ns / iterations;
+
+	printf("{\"name\":\"%s\"", name);
+
+	if (group)
+		printf(",\"group\":%u", group);
+
+	if (size)
+		printf(",\"size\":%zu", size);
+
+	printf(",\"iterations\":%" PRIu64 ",\"ns_per_op\":%.1f",
+			iterations, ns_per_op);
+
+	if (size)
+		printf(",\"mb_per_s\":%.2f", size * 1000.0 / ns_per_op);
+
+	printf("}\n");
+	fflush(stdout);
+}
+
+static void bench_skip(const char *name, const char *reason)
+{
+	if (!bench_selected(name))
+		return;
+
+	printf("{\"name\":\"%s\",\"skipped\":\"%s\"}\n", name, reason);
+	fflush(stdout);
+}
+
+/*
+ * Runs @func in growing batches until at least min_ns have passed so that
+ * the clock is read rarely for the cheap operations.
+ */
+static void bench_run(const char *name, bench_func_t func, size_t size)
+{
+	uint64_t iterations = 0;
+	uint64_t batch = 1;
+	uint64_t start;
+	uint64_t elapsed;
+	uint64_t i;
+
+	if (!bench_selected(name))
+		return;
+
+	/* Warm up any caches or pooled contexts and check for support */
+	if (!func(size)) {
+		bench_skip(name, "failed");
+		return;
+	}
+
+	start = bench_now();
+
+	do {
+		for (i = 0; i < batch; i++)
+			func(size);
+
+		iterations += batch;
+		elapsed = bench_now() - start;
+
+		if (batch < 1 << 16)
+			batch <<= 1;
+	} while (elapsed < min_ns);
+
+	bench_report(name, 0, size, iterations, elapsed);
+}
+
+static void bench_run_sizes(const char *name, bench_func_t func)
+{
+	unsigned int i;
+
+	for (i = 0; i < L_ARRAY_SIZE(data_sizes); i++)
+		bench_run(name, func, data_sizes[i]);
+}
+
+static bool bench_hmac_md5(size_t size)
+{
+	return hmac_md5(hmac_key, 16, data, size, output, 16);
+}
+
+static bool bench_hmac_sha1(size_t size)
+{
+	return hmac_sha1(hmac_key, sizeof(hmac_key), data, size, output, 20);
+}
+
+static bool bench_hmac_sha256(size_t size)
+{
+	return hmac_sha256(hmac_key, sizeof(hmac_key), data, size, output, 32);
+}
+
+static bool bench_hmac_sha384(size_t size)
+{
+	return hmac_sha384(hmac_key, sizeof(hmac_key), data, size, output, 48);
+}
+
+static bool bench_cmac_aes(size_t size)
+{
+	return cmac_aes(cmac_key, sizeof(cmac_key), data, size, output, 16);
+}
+
+static bool bench_aes_siv_encrypt(size_t size)
+{
+	struct iovec iov = {
+		.iov_base = (void *) siv_ad,
+		.iov_len = sizeof(siv_ad),
+	};
+
+	return aes_siv_encrypt(siv_key, sizeof(siv_key), data, size,
+				&iov, 1, output);
+}
+
+static bool bench_aes_siv_decrypt(size_t size)
+{
+	struct iovec iov = {
+		.iov_base = (void *) siv_ad,
+		.iov_len = sizeof(siv_ad),
+	};
+
+	/* output holds the ciphertext left by bench_aes_siv_encrypt */
+	return aes_siv_decrypt(siv_key, sizeof(siv_key), output, size + 16,
+				&iov, 1, data);
+}
+
+/* PTK derivation: PMK and the 76 byte address and nonce block */
+static bool bench_prf_sha1(size_t size)
+{
+	return prf_sha1(hmac_key, sizeof(hmac_key), "Pairwise key expansion",
+				22, data, 76, output, 48);
+}
+
+static bool bench_kdf_sha256(size_t size)
+{
+	return kdf_sha256(hmac_key, sizeof(hmac_key), "Pairwise key expansion",
+				22, data, 76, output, 48);
+}
+
+static bool bench_psk_from_passphrase(size_t size)
+{
+	/* Measure the full PBKDF2 derivation, not a cache hit */
+	crypto_psk_cache_flush(psk_ssid, sizeof(psk_ssid));
+
+	return crypto_psk_from_passphrase(psk_passphrase, psk_ssid,
+						sizeof(psk_ssid), output) == 0;
+}
+
+struct sae_bench_data {
+	uint16_t status;
+	uint16_t group;
+	bool commit_sent;
+};
+
+static void sae_bench_tx_auth(const uint8_t *frame, size_t len,
+				void *user_data)
+{
+	struct sae_bench_data *bd = user_data;
+
+	if (len < 6 || l_get_le16(frame) != 1)
+		return;
+
+	bd->status = l_get_le16(frame + 2);
+	bd->group = l_get_le16(frame + 4);
+	bd->commit_sent = true;
+}
+
+static void sae_bench_tx_assoc(void *user_data)
+{
+}
+
+static size_t sae_bench_reject_frame(uint8_t *frame, uint16_t group)
+{
+	struct mmpdu_header *hdr = (struct mmpdu_header *) frame;
+	struct mmpdu_authentication *auth;
+
+	memset(frame, 0, sizeof(*hdr) + sizeof(*auth) + 2);
+	memcpy(hdr->address_2, aa, 6);
+
+	hdr->fc.type = MPDU_TYPE_MANAGEMENT;
+	hdr->fc.subtype = MPDU_MANAGEMENT_SUBTYPE_AUTHENTICATION;
+	hdr->fc.order = 1;
+
+	auth = (void *) (frame + sizeof(*hdr));
+	l_put_le16(MMPDU_AUTH_ALGO_SAE, &auth->algorithm);
+	l_put_le16(1, &auth->transaction_sequence);
+	l_put_le16(MMPDU_STATUS_CODE_UNSUPP_FINITE_CYCLIC_GROUP, &auth->status);
+	l_put_le16(group, auth->ies);
+
+	return sizeof(*hdr) + sizeof(*auth) + 2;
+}
+
+static void sae_bench_hs_free(struct handshake_state *hs)
+{
+	l_free(hs);
+}
+
+/*
+ * Times the PWE derivation and commit generation for every supported group.
+ * The first group is used by auth_proto_start(), the following ones are
+ * reached by rejecting each commit with "unsupported group", the same way
+ * an AP would.  With @flush the PWE and PT caches are emptied before every
+ * run so that the full derivation is measured.
+ */
+static void bench_sae_commit(const char *name, bool h2e, bool flush)
+{
+	static const uint8_t rsnxe[] = { IE_TYPE_RSNX, 1, 0x20 };
+	const unsigned int *groups = l_ecc_curve_get_supported_ike_groups();
+	uint64_t ns[16] = { 0 };
+	uint64_t iterations[16] = { 0 };
+	uint8_t frame[64];
+	unsigned int n_groups;
+	unsigned int i;
+	uint64_t min;
+
+	if (!bench_selected(name))
+		return;
+
+	for (n_groups = 0; groups[n_groups] && n_groups < L_ARRAY_SIZE(ns);
+			n_groups++)
+		;
+
+	sae_pwe_cache_flush();
+
+	do {
+		struct handshake_state *hs = l_new(struct handshake_state, 1);
+		struct sae_bench_data bd = { 0 };
+		struct auth_proto *ap;
+		uint64_t start;
+
+		hs->free = sae_bench_hs_free;
+		handshake_state_set_supplicant_address(hs, spa);
+		handshake_state_set_authenticator_address(hs, aa);
+		handshake_state_set_passphrase(hs, sae_passphrase);
+
+		if (h2e) {
+			handshake_state_set_ssid(hs, (void *) sae_ssid,
+							strlen(sae_ssid));
+			handshake_state_set_supplicant_rsnxe(hs, rsnxe);
+		}
+
+		if (flush)
+			sae_pwe_cache_flush();
+
+		ap = sae_sm_new(hs, sae_bench_tx_auth, sae_bench_tx_assoc, &bd);
+
+		for (i = 0; i < n_groups; i++) {
+			size_t len;
+
+			bd.commit_sent = false;
+			start = bench_now();
+
+			if (i == 0)
+				auth_proto_start(ap);
+			else {
+				len = sae_bench_reject_frame(frame,
+								groups[i - 1]);
+				auth_proto_rx_authenticate(ap, frame, len);
+			}
+
+			ns[i] += bench_now() - start;
+			iterations[i]++;
+
+			if (!bd.commit_sent || bd.group != groups[i]) {
+				auth_proto_free(ap);
+				handshake_state_free(hs);
+				bench_skip(name, "failed");
+				goto done;
+			}
+		}
+
+		auth_proto_free(ap);
+		handshake_state_free(hs);
+
+		for (i = 1, min = ns[0]; i < n_groups; i++)
+			if (ns[i] < min)
+				min = ns[i];
+	} while (min < min_ns);
+
+	for (i = 0; i < n_groups; i++)
+		bench_report(name, groups[i], 0, iterations[i], ns[i]);
+
+done:
+	sae_pwe_cache_flush();
+}
+
+static void usage(void)
+{
+	printf("bench-crypto - Crypto micro-benchmarks\n"
+		"Usage:\n");
+	printf("\tbench-crypto [options] [filter]\n");
+	printf("Options:\n"
+		"\t-t, --time <msec>      Minimum run time per benchmark\n"
+		"\t-h, --help             Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "time",	required_argument,	NULL, 't' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "t:h", main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 't':
+			min_ns = strtoul(optarg, NULL, 10) * L_NSEC_PER_MSEC;
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind < argc)
+		filter = argv[optind];
+
+	/* RFC 2202 / RFC 4231 Test Case 4 data pattern */
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = 0xcd;
+
+	if (l_checksum_is_supported(L_CHECKSUM_MD5, true))
+		bench_run_sizes("hmac_md5", bench_hmac_md5);
+	else
+		bench_skip("hmac_md5", "unsupported");
+
+	if (l_checksum_is_supported(L_CHECKSUM_SHA1, true))
+		bench_run_sizes("hmac_sha1", bench_hmac_sha1);
+	else
+		bench_skip("hmac_sha1", "unsupported");
+
+	if (l_checksum_is_supported(L_CHECKSUM_SHA256, true))
+		bench_run_sizes("hmac_sha256", bench_hmac_sha256);
+	else
+		bench_skip("hmac_sha256", "unsupported");
+
+	if (l_checksum_is_supported(L_CHECKSUM_SHA384, true))
+		bench_run_sizes("hmac_sha384", bench_hmac_sha384);
+	else
+		bench_skip("hmac_sha384", "unsupported");
+
+	if (l_checksum_cmac_aes_supported())
+		bench_run_sizes("cmac_aes", bench_cmac_aes);
+	else
+		bench_skip("cmac_aes", "unsupported");
+
+	if (l_checksum_cmac_aes_supported() &&
+			l_cipher_is_supported(L_CIPHER_AES_CTR)) {
+		for (i = 0; i < L_ARRAY_SIZE(data_sizes); i++) {
+			bench_run("aes_siv_encrypt", bench_aes_siv_encrypt,
+					data_sizes[i]);
+			bench_run("aes_siv_decrypt", bench_aes_siv_decrypt,
+					data_sizes[i]);
+		}
+	} else {
+		bench_skip("aes_siv_encrypt", "unsupported");
+		bench_skip("aes_siv_decrypt", "unsupported");
+	}
+
+	if (l_checksum_is_supported(L_CHECKSUM_SHA1, true)) {
+		bench_run("prf_sha1", bench_prf_sha1, 0);
+		bench_run("crypto_psk_from_passphrase",
+				bench_psk_from_passphrase, 0);
+	} else {
+		bench_skip("prf_sha1", "unsupported");
+		bench_skip("crypto_psk_from_passphrase", "unsupported");
+	}
+
+	if (l_checksum_is_supported(L_CHECKSUM_SHA256, true))
+		bench_run("kdf_sha256", bench_kdf_sha256, 0);
+	else
+		bench_skip("kdf_sha256", "unsupported");
+
+	if (l_getrandom_is_supported() &&
+			l_checksum_is_supported(L_CHECKSUM_SHA256, true)) {
+		bench_sae_commit("sae_commit", false, true);
+		bench_sae_commit("sae_commit_cached", false, false);
+		bench_sae_commit("sae_commit_h2e", true, true);
+		bench_sae_commit("sae_commit_h2e_cached", true, false);
+	} else
+		bench_skip("sae_commit", "unsupported");
+
+	crypto_checksum_pool_flush();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,774 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2026  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <net/if_arp.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <ell/ell.h>
+
+#include "linux/nl80211.h"
+
+#include "src/util.h"
+#include "src/ie.h"
+#include "src/mpdu.h"
+#include "src/common.h"
+#include "src/scan.h"
+#include "src/iwd.h"
+#include "src/wiphy.h"
+#include "src/knownnetworks.h"
+#include "src/p2putil.h"
+#include "src/eapol.h"
+#include "monitor/pcap.h"
+#include "monitor/analyze.h"
+
+/*
+ * Replays the nl80211 traffic of iwmon captures through the parsers that
+ * iwd's genl handlers run on it.  The captured messages are loaded once
+ * and then fed to each handler in a loop, so that a dense-venue capture
+ * becomes a repeatable benchmark.  Results are printed as one JSON object
+ * per line, like bench-crypto, with the CPU time and the number of heap
+ * allocations per message.
+ *
+ * Besides the complete handlers the individual IE, WSC, P2P and EAPoL-Key
+ * parsers are run on the captured Beacons, Probe Responses and control
+ * port frames, so that changes to any one of them can be measured alone.
+ */
+
+#ifndef ARPHRD_NETLINK
+#define ARPHRD_NETLINK	824
+#endif
+
+#define MAX_SNAPLEN (1024 * 16)
+
+static uint64_t min_ns = 200 * L_NSEC_PER_MSEC;
+static const char *filter;
+static uint16_t nl80211_family;
+
+static struct l_queue *messages;
+
+static uint64_t alloc_count;
+static uint64_t alloc_bytes;
+
+#ifdef __GLIBC__
+/*
+ * Count heap allocations by wrapping the glibc allocator, which catches
+ * everything going through l_malloc() and friends as well.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+/*
+ * scan.c is linked for its result parsing only.  None of the scheduling
+ * code that talks to the wiphy, the configuration or the known networks
+ * runs during a replay, so those dependencies are satisfied with inert
+ * stand-ins.
+ */
+const struct l_settings *iwd_get_config(void)
+{
+	return NULL;
+}
+
+struct l_genl *iwd_get_genl(void)
+{
+	return NULL;
+}
+
+bool known_networks_foreach(known_networks_foreach_func_t function,
+				void *user_data)
+{
+	return false;
+}
+
+bool known_networks_has_hidden(void)
+{
+	return false;
+}
+
+struct scan_freq_set *known_networks_get_weighted_frequencies(
+						unsigned int max_freqs)
+{
+	return NULL;
+}
+
+struct wiphy *wiphy_find(int wiphy_id)
+{
+	return NULL;
+}
+
+uint32_t wiphy_get_id(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+bool wiphy_can_randomize_mac_addr(struct wiphy *wiphy)
+{
+	return false;
+}
+
+bool wiphy_has_ext_feature(struct wiphy *wiphy, uint32_t feature)
+{
+	return false;
+}
+
+bool wiphy_supports_sched_scan(struct wiphy *wiphy)
+{
+	return false;
+}
+
+uint8_t wiphy_get_max_num_ssids_per_scan(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+uint16_t wiphy_get_max_scan_ie_len(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+uint8_t wiphy_get_max_match_sets(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+uint32_t wiphy_get_max_net_detect_match_sets(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+uint8_t wiphy_get_max_num_sched_scan_ssids(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+uint32_t wiphy_get_supported_bands(struct wiphy *wiphy)
+{
+	return 0;
+}
+
+const struct scan_freq_set *wiphy_get_supported_freqs(
+						const struct wiphy *wiphy)
+{
+	return NULL;
+}
+
+const uint8_t *wiphy_get_extended_capabilities(struct wiphy *wiphy,
+							uint32_t iftype)
+{
+	return NULL;
+}
+
+const uint8_t *wiphy_get_supported_rates(struct wiphy *wiphy, unsigned int band,
+						unsigned int *out_num)
+{
+	return NULL;
+}
+
+bool wiphy_constrain_freq_set(const struct wiphy *wiphy,
+						struct scan_freq_set *set)
+{
+	return false;
+}
+
+uint32_t wiphy_radio_work_insert(struct wiphy *wiphy,
+				struct wiphy_radio_work_item *item,
+				int priority,
+				const struct wiphy_radio_work_item_ops *ops)
+{
+	return 0;
+}
+
+void wiphy_radio_work_done(struct wiphy *wiphy, uint32_t id)
+{
+}
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * L_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t bench_cpu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec * L_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static bool bench_selected(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static void bench_skip(const char *name, const char *reason)
+{
+	if (!bench_selected(name))
+		return;
+
+	printf("{\"name\":\"%s\",\"skipped\":\"%s\"}\n", name, reason);
+	fflush(stdout);
+}
+
+/* Returns false for messages the handler would not look at */
+typedef bool (*replay_func_t)(struct l_genl_msg *msg);
+
+static bool replay_scan_result(struct l_genl_msg *msg)
+{
+	struct scan_bss *bss;
+	uint64_t wdev;
+
+	if (l_genl_msg_get_command(msg) != NL80211_CMD_NEW_SCAN_RESULTS)
+		return false;
+
+	bss = scan_bss_new_from_genl(msg, &wdev);
+	if (!bss)
+		return false;
+
+	scan_bss_free(bss);
+	return true;
+}
+
+/*
+ * The individual IE parsers are fed the Beacon and Probe Response IEs of
+ * the captured scan results, to tell their costs apart from the rest of
+ * scan_bss_new_from_genl().
+ */
+static bool replay_get_bss_ies(struct l_genl_msg *msg, const uint8_t **ies,
+				size_t *ies_len, bool *probe_resp)
+{
+	struct l_genl_attr attr, nested;
+	uint16_t type, len;
+	const void *data;
+
+	if (l_genl_msg_get_command(msg) != NL80211_CMD_NEW_SCAN_RESULTS)
+		return false;
+
+	if (!l_genl_attr_init(&attr, msg))
+		return false;
+
+	while (l_genl_attr_next(&attr, &type, &len, &data)) {
+		if (type == NL80211_ATTR_BSS)
+			break;
+	}
+
+	if (type != NL80211_ATTR_BSS || !l_genl_attr_recurse(&attr, &nested))
+		return false;
+
+	*ies = NULL;
+	*probe_resp = false;
+
+	while (l_genl_attr_next(&nested, &type, &len, &data)) {
+		switch (type) {
+		case NL80211_BSS_INFORMATION_ELEMENTS:
+			*ies = data;
+			*ies_len = len;
+			break;
+		case NL80211_BSS_PRESP_DATA:
+			*probe_resp = true;
+			break;
+		}
+	}
+
+	return *ies != NULL;
+}
+
+static const uint8_t *replay_find_ie(const uint8_t *ies, size_t len,
+					unsigned int tag)
+{
+	struct ie_tlv_iter iter;
+
+	ie_tlv_iter_init(&iter, ies, len);
+
+	while (ie_tlv_iter_next(&iter))
+		if (ie_tlv_iter_get_tag(&iter) == tag)
+			return ie_tlv_iter_get_data(&iter) - 2;
+
+	return NULL;
+}
+
+static bool replay_ie_rsne(struct l_genl_msg *msg)
+{
+	const uint8_t *ies;
+	const uint8_t *rsne;
+	size_t ies_len;
+	bool probe_resp;
+	struct ie_rsn_info info;
+
+	if (!replay_get_bss_ies(msg, &ies, &ies_len, &probe_resp))
+		return false;
+
+	rsne = replay_find_ie(ies, ies_len, IE_TYPE_RSN);
+	if (!rsne)
+		return false;
+
+	ie_parse_rsne_from_data(rsne, rsne[1] + 2, &info);
+	return true;
+}
+
+static bool replay_ie_data_rates(struct l_genl_msg *msg)
+{
+	const uint8_t *ies;
+	const uint8_t *supp_rates;
+	size_t ies_len;
+	bool probe_resp;
+	uint64_t rate;
+
+	if (!replay_get_bss_ies(msg, &ies, &ies_len, &probe_resp))
+		return false;
+
+	supp_rates = replay_find_ie(ies, ies_len, IE_TYPE_SUPPORTED_RATES);
+	if (!supp_rates)
+		return false;
+
+	ie_parse_data_rates(supp_rates,
+			replay_find_ie(ies, ies_len,
+					IE_TYPE_EXTENDED_SUPPORTED_RATES),
+			replay_find_ie(ies, ies_len, IE_TYPE_HT_CAPABILITIES),
+			replay_find_ie(ies, ies_len, IE_TYPE_VHT_CAPABILITIES),
+			NULL, -5000, &rate);
+	return true;
+}
+
+static bool replay_ie_index(struct l_genl_msg *msg)
+{
+	const uint8_t *ies;
+	size_t ies_len;
+	bool probe_resp;
+	struct ie_index index;
+
+	if (!replay_get_bss_ies(msg, &ies, &ies_len, &probe_resp))
+		return false;
+
+	return ie_index_init(&index, ies, ies_len);
+}
+
+static bool replay_wsc_ies(struct l_genl_msg *msg)
+{
+	const uint8_t *ies;
+	size_t ies_len;
+	bool probe_resp;
+	uint8_t *wsc;
+	ssize_t wsc_len;
+
+	if (!replay_get_bss_ies(msg, &ies, &ies_len, &probe_resp))
+		return false;
+
+	wsc = ie_tlv_extract_wsc_payload(ies, ies_len, &wsc_len);
+	if (!wsc)
+		return false;
+
+	if (probe_resp) {
+		struct wsc_probe_response info;
+
+		wsc_parse_probe_response(wsc, wsc_len, &info);
+	} else {
+		struct wsc_beacon info;
+
+		wsc_parse_beacon(wsc, wsc_len, &info);
+	}
+
+	l_free(wsc);
+	return true;
+}
+
+static bool replay_p2p_ies(struct l_genl_msg *msg)
+{
+	const uint8_t *ies;
+	size_t ies_len;
+	bool probe_resp;
+	ssize_t p2p_len;
+
+	if (!replay_get_bss_ies(msg, &ies, &ies_len, &probe_resp))
+		return false;
+
+	if (!ie_tlv_peek_p2p_payload(ies, ies_len, &p2p_len) &&
+			p2p_len != -EMSGSIZE)
+		return false;
+
+	if (probe_resp) {
+		struct p2p_probe_resp info;
+
+		if (p2p_parse_probe_resp(ies, ies_len, &info) == 0)
+			p2p_clear_probe_resp(&info);
+	} else {
+		struct p2p_beacon info;
+
+		if (p2p_parse_beacon(ies, ies_len, &info) == 0)
+			p2p_clear_beacon(&info);
+	}
+
+	return true;
+}
+
+/*
+ * EAPoL-Key frames from the control port go through eapol_key_validate()
+ * and then the eapol_verify_* check for the message they look like.
+ */
+static bool replay_eapol_key(struct l_genl_msg *msg)
+{
+	struct l_genl_attr attr;
+	uint16_t type, len;
+	const void *data;
+	const struct eapol_key *ek;
+	bool is_wpa;
+
+	if (l_genl_msg_get_command(msg) != NL80211_CMD_CONTROL_PORT_FRAME)
+		return false;
+
+	if (!l_genl_attr_init(&attr, msg))
+		return false;
+
+	while (l_genl_attr_next(&attr, &type, &len, &data)) {
+		if (type == NL80211_ATTR_FRAME)
+			break;
+	}
+
+	if (type != NL80211_ATTR_FRAME)
+		return false;
+
+	ek = eapol_key_validate(data, len, 16);
+	if (!ek)
+		return false;
+
+	is_wpa = ek->descriptor_type == EAPOL_DESCRIPTOR_TYPE_WPA;
+
+	if (ek->key_ack && !ek->key_mic)
+		eapol_verify_ptk_1_of_4(ek, 16);
+	else if (ek->key_ack && ek->key_type)
+		eapol_verify_ptk_3_of_4(ek, is_wpa, 16);
+	else if (ek->key_ack)
+		eapol_verify_gtk_1_of_2(ek, is_wpa, 16);
+	else if (!ek->key_type)
+		eapol_verify_gtk_2_of_2(ek, is_wpa);
+	else if (ek->secure || !EAPOL_KEY_DATA_LEN(ek, 16))
+		eapol_verify_ptk_4_of_4(ek, is_wpa);
+	else
+		eapol_verify_ptk_2_of_4(ek);
+
+	return true;
+}
+
+/*
+ * The management frame events are validated with mpdu_validate() before
+ * netdev dispatches them anywhere else.
+ */
+static bool replay_mgmt_frame(struct l_genl_msg *msg)
+{
+	struct l_genl_attr attr;
+	uint16_t type, len;
+	const void *data;
+
+	switch (l_genl_msg_get_command(msg)) {
+	case NL80211_CMD_FRAME:
+	case NL80211_CMD_AUTHENTICATE:
+	case NL80211_CMD_ASSOCIATE:
+	case NL80211_CMD_DEAUTHENTICATE:
+	case NL80211_CMD_DISASSOCIATE:
+		break;
+	default:
+		return false;
+	}
+
+	if (!l_genl_attr_init(&attr, msg))
+		return false;
+
+	while (l_genl_attr_next(&attr, &type, &len, &data)) {
+		if (type == NL80211_ATTR_FRAME)
+			return mpdu_validate(data, len) != NULL;
+	}
+
+	return false;
+}
+
+/* The attribute walk every handler pays for, as a baseline */
+static bool replay_attr_walk(struct l_genl_msg *msg)
+{
+	struct l_genl_attr attr;
+	uint16_t type, len;
+	const void *data;
+
+	if (!l_genl_attr_init(&attr, msg))
+		return false;
+
+	while (l_genl_attr_next(&attr, &type, &len, &data))
+		;
+
+	return true;
+}
+
+/*
+ * Runs @func over the matching messages in passes until at least min_ns
+ * have passed, then reports the cost per handled message.
+ */
+static void bench_replay(const char *name, replay_func_t func)
+{
+	struct l_queue *handled;
+	const struct l_queue_entry *entry;
+	uint64_t passes = 0;
+	uint64_t start, cpu_start, elapsed, cpu;
+	uint64_t allocs, bytes;
+	unsigned int count;
+	double per_msg;
+
+	if (!bench_selected(name))
+		return;
+
+	/* The first pass also picks out the messages the handler accepts */
+	handled = l_queue_new();
+
+	for (entry = l_queue_get_entries(messages); entry;
+						entry = entry->next) {
+		if (func(entry->data))
+			l_queue_push_tail(handled, entry->data);
+	}
+
+	count = l_queue_length(handled);
+	if (!count) {
+		l_queue_destroy(handled, NULL);
+		bench_skip(name, "no messages");
+		return;
+	}
+
+	allocs = alloc_count;
+	bytes = alloc_bytes;
+	start = bench_now();
+	cpu_start = bench_cpu_now();
+
+	do {
+		for (entry = l_queue_get_entries(handled); entry;
+						entry = entry->next)
+			func(entry->data);
+
+		passes++;
+		elapsed = bench_now() - start;
+	} while (elapsed < min_ns);
+
+	cpu = bench_cpu_now() - cpu_start;
+	allocs = alloc_count - allocs;
+	bytes = alloc_bytes - bytes;
+	per_msg = (double) passes * count;
+
+	printf("{\"name\":\"%s\",\"messages\":%u,\"passes\":%" PRIu64
+		",\"ns_per_msg\":%.1f,\"cpu_ns_per_msg\":%.1f"
+		",\"allocs_per_msg\":%.2f,\"alloc_bytes_per_msg\":%.1f}\n",
+		name, count, passes, elapsed / per_msg, cpu / per_msg,
+		allocs / per_msg, bytes / per_msg);
+	fflush(stdout);
+
+	l_queue_destroy(handled, NULL);
+}
+
+static void load_genl(const void *buf, uint32_t len)
+{
+	const struct nlmsghdr *nlmsg;
+
+	for (nlmsg = buf; NLMSG_OK(nlmsg, len);
+				nlmsg = NLMSG_NEXT(nlmsg, len)) {
+		struct l_genl_msg *msg;
+		uint16_t id;
+
+		if (nlmsg->nlmsg_type == NLMSG_DONE ||
+				nlmsg->nlmsg_type == NLMSG_ERROR)
+			continue;
+
+		id = analyze_nl80211_family(nlmsg);
+		if (id && !nl80211_family) {
+			nl80211_family = id;
+			continue;
+		}
+
+		if (!nl80211_family || nlmsg->nlmsg_type != nl80211_family)
+			continue;
+
+		msg = l_genl_msg_new_from_data(nlmsg, nlmsg->nlmsg_len);
+		if (msg)
+			l_queue_push_tail(messages, msg);
+	}
+}
+
+static bool load_pcap(const char *pathname)
+{
+	struct pcap *pcap;
+	struct timeval tv;
+	uint8_t *buf;
+	uint32_t snaplen, len, real_len;
+
+	pcap = pcap_open(pathname);
+	if (!pcap) {
+		fprintf(stderr, "Failed to open %s\n", pathname);
+		return false;
+	}
+
+	if (pcap_get_type(pcap) != PCAP_TYPE_LINUX_SLL) {
+		fprintf(stderr, "%s: invalid packet format\n", pathname);
+		pcap_close(pcap);
+		return false;
+	}
+
+	snaplen = pcap_get_snaplen(pcap);
+	if (snaplen > MAX_SNAPLEN)
+		snaplen = MAX_SNAPLEN;
+
+	buf = l_malloc(snaplen);
+
+	while (pcap_read(pcap, &tv, buf, snaplen, &len, &real_len)) {
+		if (len < 16 || len < real_len)
+			continue;
+
+		if (l_get_be16(buf + 2) != ARPHRD_NETLINK ||
+				l_get_be16(buf + 14) != NETLINK_GENERIC)
+			continue;
+
+		load_genl(buf + 16, len - 16);
+	}
+
+	l_free(buf);
+	pcap_close(pcap);
+
+	return true;
+}
+
+static void usage(void)
+{
+	printf("bench-replay - Replay iwmon captures through nl80211 "
+							"handlers\n"
+		"Usage:\n");
+	printf("\tbench-replay [options] [capture.pcap ...]\n");
+	printf("Options:\n"
+		"\t-t, --time <msec>      Minimum run time per handler\n"
+		"\t-f, --filter <name>    Only run matching handlers\n"
+		"\t-n, --nl80211 <id>     nl80211 family id, if the capture "
+						"lacks it\n"
+		"\t-h, --help             Show help options\n");
+}
+
+static const struct option main_options[] = {
+	{ "time",	required_argument,	NULL, 't' },
+	{ "filter",	required_argument,	NULL, 'f' },
+	{ "nl80211",	required_argument,	NULL, 'n' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(argc, argv, "t:f:n:h", main_options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 't':
+			min_ns = strtoul(optarg, NULL, 10) * L_NSEC_PER_MSEC;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'n':
+			nl80211_family = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Run as part of 'make bench' there is nothing to replay */
+	if (optind == argc) {
+		bench_skip("replay", "no capture given");
+		return EXIT_SUCCESS;
+	}
+
+	messages = l_queue_new();
+
+	for (i = optind; i < argc; i++) {
+		if (!load_pcap(argv[i])) {
+			l_queue_destroy(messages,
+					(l_queue_destroy_func_t) l_genl_msg_unref);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!nl80211_family)
+		fprintf(stderr, "No nl80211 family id found, use -n\n");
+
+	bench_replay("attr_walk", replay_attr_walk);
+	bench_replay("scan_result", replay_scan_result);
+	bench_replay("mgmt_frame", replay_mgmt_frame);
+	bench_replay("ie_index", replay_ie_index);
+	bench_replay("ie_rsne", replay_ie_rsne);
+	bench_replay("ie_data_rates", replay_ie_data_rates);
+	bench_replay("wsc_ies", replay_wsc_ies);
+	bench_replay("p2p_ies", replay_p2p_ies);
+	bench_replay("eapol_key", replay_eapol_key);
+
+	l_queue_destroy(messages, (l_queue_destroy_func_t) l_genl_msg_unref);
+
+	return EXIT_SUCCESS;
+}
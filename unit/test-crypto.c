@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
 #include <ell/ell.h>
 
@@ -102,6 +103,79 @@ static void psk_test(const void *data)
 	assert(strcmp(test->psk, psk) == 0);
 }
 
+static void psk_cache_test(const void *data)
+{
+	const struct psk_data *test = data;
+	unsigned char output[32];
+	unsigned char cached[32];
+
+	crypto_psk_cache_flush(NULL, 0);
+
+	assert(!crypto_psk_from_passphrase(test->passphrase,
+						test->ssid, test->ssid_len,
+						output));
+
+	/* Derived again, now from the cache */
+	assert(!crypto_psk_from_passphrase(test->passphrase,
+						test->ssid, test->ssid_len,
+						cached));
+	assert(!memcmp(output, cached, sizeof(output)));
+
+	/* A different passphrase for the same SSID must not hit the cache */
+	assert(!crypto_psk_from_passphrase("notthepassword",
+						test->ssid, test->ssid_len,
+						cached));
+	assert(memcmp(output, cached, sizeof(output)));
+
+	crypto_psk_cache_flush(test->ssid, test->ssid_len);
+
+	assert(!crypto_psk_from_passphrase(test->passphrase,
+						test->ssid, test->ssid_len,
+						cached));
+	assert(!memcmp(output, cached, sizeof(output)));
+
+	crypto_psk_cache_flush(NULL, 0);
+}
+
+static void psk_batch_test(const void *data)
+{
+	static const struct psk_data *cases[] = {
+		&psk_test_case_1, &psk_test_case_2, &psk_test_case_3,
+		&psk_test_case_3, &psk_test_case_1,
+	};
+	struct crypto_psk_request reqs[L_ARRAY_SIZE(cases) + 1];
+	unsigned int i, j;
+	char psk[65];
+
+	crypto_psk_cache_flush(NULL, 0);
+
+	for (i = 0; i < L_ARRAY_SIZE(cases); i++) {
+		reqs[i].passphrase = cases[i]->passphrase;
+		reqs[i].ssid = cases[i]->ssid;
+		reqs[i].ssid_len = cases[i]->ssid_len;
+	}
+
+	/* Too short of a passphrase, must not affect the other requests */
+	reqs[i].passphrase = "short";
+	reqs[i].ssid = psk_test_case_1_ssid;
+	reqs[i].ssid_len = sizeof(psk_test_case_1_ssid);
+
+	crypto_psk_from_passphrase_batch(reqs, L_ARRAY_SIZE(reqs));
+
+	for (i = 0; i < L_ARRAY_SIZE(cases); i++) {
+		assert(reqs[i].result == 0);
+
+		for (j = 0; j < 32; j++)
+			sprintf(psk + (j * 2), "%02x", reqs[i].psk[j]);
+
+		assert(strcmp(cases[i]->psk, psk) == 0);
+	}
+
+	assert(reqs[i].result == -ERANGE);
+
+	crypto_psk_cache_flush(NULL, 0);
+}
+
 struct ptk_data {
 	const unsigned char *pmk;
 	const unsigned char *aa;
@@ -407,6 +481,9 @@ int main(int argc, char *argv[])
 {
 	l_test_init(&argc, &argv);
 
+	/* The batch derivation does not use the kernel's SHA1 */
+	l_test_add("/Passphrase Generator/PSK Batch", psk_batch_test, NULL);
+
 	if (!l_checksum_is_supported(L_CHECKSUM_SHA1, true)) {
 		printf("SHA1 support missing, skipping...\n");
 		goto done;
@@ -423,6 +500,8 @@ int main(int argc, char *argv[])
 			psk_test, &psk_test_case_2);
 	l_test_add("/Passphrase Generator/PSK Test Case 3",
 			psk_test, &psk_test_case_3);
+	l_test_add("/Passphrase Generator/PSK Cache",
+			psk_cache_test, &psk_test_case_2);
 
 	l_test_add("/PTK Derivation/PTK Test Case 1",
 			ptk_test, &ptk_test_1);
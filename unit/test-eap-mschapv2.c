@@ -141,6 +141,11 @@ int main(int argc, char *argv[])
 		goto done;
 	}
 
+	if (!l_cipher_is_supported(L_CIPHER_DES)) {
+		printf("DES support missing, skipping...\n");
+		goto done;
+	}
+
 	l_test_add("MSHAPv2 nt_password-hash",
 			test_nt_password_hash, NULL);
 	l_test_add("MSHAPv2 generate_nt_response",
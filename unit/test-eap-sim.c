@@ -354,6 +354,156 @@ static void test_aka_prf_prime(const void *data)
 	assert(memcmp(emsk, vals->emsk, EAP_SIM_EMSK_LEN) == 0);
 }
 
+static void test_reauth_keys(const void *data)
+{
+	static const char *identity = "Y24fNSrz8BP274jOJaF17WfxI8YO7QX0"
+					"0pMXk9XMMVOw7broaNhTczuFq53aEpOkk3"
+					"L0dm@eapsim.foo";
+	static const uint8_t nonce_s[EAP_SIM_NONCE_S_LEN] = {
+		0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+		0xfe, 0xdc, 0xba, 0x98, 0x76, 0x54, 0x32, 0x10 };
+	struct l_checksum *sha1;
+	uint8_t counter[2] = { 0x00, 0x01 };
+	uint8_t xkey[20];
+	uint8_t prng_buf[160];
+	uint8_t msk[EAP_SIM_MSK_LEN];
+	uint8_t emsk[EAP_SIM_EMSK_LEN];
+
+	assert(eap_sim_derive_reauth_keys(identity, 1, nonce_s, ex_mk,
+						msk, emsk));
+
+	/* XKEY' = SHA1(Identity|counter|NONCE_S|MK) */
+	sha1 = l_checksum_new(L_CHECKSUM_SHA1);
+	l_checksum_update(sha1, identity, strlen(identity));
+	l_checksum_update(sha1, counter, sizeof(counter));
+	l_checksum_update(sha1, nonce_s, sizeof(nonce_s));
+	l_checksum_update(sha1, ex_mk, sizeof(ex_mk));
+	l_checksum_get_digest(sha1, xkey, sizeof(xkey));
+	l_checksum_free(sha1);
+
+	eap_sim_fips_prf(xkey, sizeof(xkey), prng_buf, sizeof(prng_buf));
+
+	/* Unlike the full authentication, MSK and EMSK come first */
+	assert(!memcmp(msk, prng_buf, EAP_SIM_MSK_LEN));
+	assert(!memcmp(emsk, prng_buf + EAP_SIM_MSK_LEN, EAP_SIM_EMSK_LEN));
+}
+
+static void test_encr_attrs(const void *data)
+{
+	static const uint8_t plain[] = {
+		EAP_SIM_AT_NEXT_PSEUDONYM, 0x03, 0x00, 0x06,
+		'p', 's', 'e', 'u', 'd', 'o', 0x00, 0x00,
+		EAP_SIM_AT_NEXT_REAUTH_ID, 0x03, 0x00, 0x08,
+		'r', 'e', '@', 'r', 'e', 'a', 'l', 'm',
+		EAP_SIM_AT_COUNTER, 0x01, 0x00, 0x05,
+		EAP_SIM_AT_PADDING, 0x01, 0x00, 0x00 };
+	static const uint8_t bad[] = {
+		EAP_SIM_AT_RAND, 0x01, 0x00, 0x00 };
+	struct eap_sim_encr_attrs attrs;
+
+	assert(eap_sim_parse_encr_attrs(plain, sizeof(plain), &attrs));
+	assert(attrs.pseudonym_len == 6);
+	assert(!memcmp(attrs.pseudonym, "pseudo", 6));
+	assert(attrs.reauth_id_len == 8);
+	assert(!memcmp(attrs.reauth_id, "re@realm", 8));
+	assert(attrs.counter == 5);
+	assert(!attrs.nonce_s);
+
+	assert(!eap_sim_parse_encr_attrs(bad, sizeof(bad), &attrs));
+}
+
+static void test_identity_cache(const void *data)
+{
+	static const char *permanent = "1234567890@wlan.mnc01.mcc001.org";
+	struct eap_sim_cache_entry *entry;
+	char *id;
+
+	assert(!eap_sim_cache_lookup(permanent));
+
+	id = eap_sim_select_identity(permanent, true, true);
+	assert(!strcmp(id, permanent));
+	l_free(id);
+
+	entry = eap_sim_cache_get(permanent);
+	assert(entry == eap_sim_cache_lookup(permanent));
+
+	eap_sim_cache_set_pseudonym(entry, "pseudonymXX", 9);
+	id = eap_sim_select_identity(permanent, true, true);
+	assert(!strcmp(id, "pseudonym@wlan.mnc01.mcc001.org"));
+	l_free(id);
+
+	id = eap_sim_select_identity(permanent, true, false);
+	assert(!strcmp(id, permanent));
+	l_free(id);
+
+	eap_sim_cache_set_reauth(entry, "reauth@example.com", 18);
+	entry->counter = 3;
+	id = eap_sim_select_identity(permanent, true, true);
+	assert(!strcmp(id, "reauth@example.com"));
+	l_free(id);
+
+	id = eap_sim_select_identity(permanent, false, true);
+	assert(!strcmp(id, "pseudonym@wlan.mnc01.mcc001.org"));
+	l_free(id);
+
+	eap_sim_cache_forget_reauth(entry);
+	assert(!entry->reauth_id);
+	assert(entry->counter == 0);
+	assert(!strcmp(entry->pseudonym, "pseudonym"));
+
+	eap_sim_cache_remove(permanent);
+	assert(!eap_sim_cache_lookup(permanent));
+
+	eap_sim_cache_get(permanent);
+	eap_sim_cache_flush();
+	assert(!eap_sim_cache_lookup(permanent));
+}
+
+static void test_encr_data(const void *data)
+{
+	static const uint8_t k_encr[EAP_SIM_K_ENCR_LEN] = {
+		0x53, 0x6e, 0x5e, 0xbc, 0x44, 0x65, 0x58, 0x2a,
+		0xa6, 0xa8, 0xec, 0x99, 0x86, 0xeb, 0xb6, 0x20 };
+	static const uint8_t attrs[] = {
+		EAP_SIM_AT_COUNTER, 0x01, 0x00, 0x07 };
+	struct eap_sim_tlv_iter iter;
+	struct eap_sim_encr_attrs parsed;
+	uint8_t buf[64];
+	uint8_t plain[EAP_SIM_ENCR_MAX_LEN];
+	const uint8_t *iv = NULL;
+	const uint8_t *encr = NULL;
+	uint16_t encr_len = 0;
+	size_t len;
+	int plain_len;
+
+	len = eap_sim_add_encr_data(buf, k_encr, attrs, sizeof(attrs));
+	/* AT_IV + AT_ENCR_DATA with one AES block */
+	assert(len == 40);
+
+	eap_sim_tlv_iter_init(&iter, buf, len);
+
+	while (eap_sim_tlv_iter_next(&iter)) {
+		if (eap_sim_tlv_iter_get_type(&iter) == EAP_SIM_AT_IV)
+			iv = eap_sim_tlv_iter_get_data(&iter);
+		else if (eap_sim_tlv_iter_get_type(&iter) ==
+				EAP_SIM_AT_ENCR_DATA) {
+			encr = eap_sim_tlv_iter_get_data(&iter);
+			encr_len = eap_sim_tlv_iter_get_length(&iter);
+		}
+	}
+
+	assert(iv && encr);
+	assert(memcmp(encr + 2, attrs, sizeof(attrs)));
+
+	plain_len = eap_sim_decrypt_encr_data(k_encr, iv, encr, encr_len,
+						plain);
+	assert(plain_len == 16);
+	assert(!memcmp(plain, attrs, sizeof(attrs)));
+
+	assert(eap_sim_parse_encr_attrs(plain, plain_len, &parsed));
+	assert(parsed.counter == 7);
+}
+
 int main(int argc, char *argv[])
 {
 	l_test_init(&argc, &argv);
@@ -364,6 +514,12 @@ int main(int argc, char *argv[])
 	l_test_add("EAP-SIM PRNG test", test_prng, NULL);
 	l_test_add("EAP-AKA' Test Case 1", test_aka_prf_prime, &test_case_1);
 	l_test_add("EAP-AKA' Test Case 2", test_aka_prf_prime, &test_case_2);
+	l_test_add("EAP-SIM re-authentication keys", test_reauth_keys, NULL);
+	l_test_add("EAP-SIM encrypted attributes", test_encr_attrs, NULL);
+	l_test_add("EAP-SIM identity cache", test_identity_cache, NULL);
+
+	if (l_cipher_is_supported(L_CIPHER_AES_CBC))
+		l_test_add("EAP-SIM AT_ENCR_DATA", test_encr_data, NULL);
 
 	return l_test_run();
 }
@@ -288,6 +288,71 @@ static void ie_test_reader_extended(const void *data)
 	assert(!ie_tlv_iter_next(&iter));
 }
 
+static void ie_test_index(const void *data)
+{
+	struct ie_index index;
+	struct ie_tlv_iter iter;
+	uint8_t buf[3 + 2 * 6 + 7 + (IE_INDEX_MAX_VENDOR + 2) * 6 + 2];
+	unsigned int pos = 0;
+	unsigned int i;
+
+	/* SSID */
+	buf[pos++] = IE_TYPE_SSID;
+	buf[pos++] = 1;
+	buf[pos++] = 'a';
+
+	/* Two RSNEs, only the lengths and positions matter here */
+	for (i = 0; i < 2; i++) {
+		buf[pos++] = IE_TYPE_RSN;
+		buf[pos++] = 4;
+		memset(buf + pos, i, 4);
+		pos += 4;
+	}
+
+	/* Extension element */
+	buf[pos++] = IE_TYPE_EXTENSION;
+	buf[pos++] = 5;
+	buf[pos++] = IE_TYPE_OWE_DH_PARAM - 256;
+	memset(buf + pos, 0, 4);
+	pos += 4;
+
+	/* More vendor elements than can be indexed, the last two unique */
+	for (i = 0; i < IE_INDEX_MAX_VENDOR + 2; i++) {
+		buf[pos++] = IE_TYPE_VENDOR_SPECIFIC;
+		buf[pos++] = 4;
+		memcpy(buf + pos, microsoft_oui, 3);
+		buf[pos + 3] = i < IE_INDEX_MAX_VENDOR ? 0x02 : i;
+		pos += 4;
+	}
+
+	/* Truncated element, stops the indexing */
+	buf[pos++] = IE_TYPE_HT_CAPABILITIES;
+	buf[pos++] = 26;
+
+	assert(pos == sizeof(buf));
+	assert(ie_index_init(&index, buf, sizeof(buf)));
+
+	assert(ie_index_find(&index, IE_TYPE_SSID) == buf);
+	assert(ie_index_count(&index, IE_TYPE_RSN) == 2);
+	assert(ie_index_find(&index, IE_TYPE_RSN) == buf + 3);
+	assert(ie_index_find(&index, IE_TYPE_OWE_DH_PARAM) == buf + 15);
+	assert(!ie_index_find(&index, IE_TYPE_HT_CAPABILITIES));
+	assert(!ie_index_find(&index, IE_TYPE_MOBILITY_DOMAIN));
+	assert(!ie_index_find(&index, IE_INDEX_MAX_TAG));
+
+	assert(ie_index_iter_init(&index, IE_TYPE_RSN, &iter));
+	assert(ie_tlv_iter_get_data(&iter) == buf + 5);
+	assert(ie_tlv_iter_next(&iter));
+	assert(ie_tlv_iter_get_tag(&iter) == IE_TYPE_RSN);
+	assert(ie_tlv_iter_get_data(&iter) == buf + 11);
+
+	assert(ie_index_find_vendor(&index, microsoft_oui, 0x02) == buf + 22);
+	assert(ie_index_find_vendor(&index, microsoft_oui,
+			IE_INDEX_MAX_VENDOR + 1) == buf + 22 +
+			(IE_INDEX_MAX_VENDOR + 1) * 6);
+	assert(!ie_index_find_vendor(&index, wifi_alliance_oui, 0x02));
+}
+
 static void ie_test_writer_extended(const void *data)
 {
 	struct ie_tlv_builder builder;
@@ -692,6 +757,78 @@ static void ie_test_encapsulate_wsc(const void *data)
 	l_free(packed);
 }
 
+struct ie_data_rate_test {
+	const uint8_t *ht_ie;
+	const uint8_t *vht_ie;
+	const uint8_t *he_ie;
+	int32_t rssi;
+	uint64_t expected_rate;
+};
+
+/* 20MHz only, MCS 0-15 */
+static const uint8_t ht_ie_20mhz_2ss[] = {
+	0x2d, 0x1a, 0x00, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* 40MHz, Short GI for 20 and 40MHz, MCS 0-15 */
+static const uint8_t ht_ie_40mhz_2ss[] = {
+	0x2d, 0x1a, 0x62, 0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* 80MHz, Short GI for 80MHz, MCS 0-9 for 2 spatial streams */
+static const uint8_t vht_ie_80mhz_2ss[] = {
+	0xbf, 0x0c, 0x20, 0x00, 0x00, 0x00, 0xfa, 0xff, 0x00, 0x00, 0xfa,
+	0xff, 0x00, 0x00,
+};
+
+/* 40 and 80MHz in 5GHz, HE-MCS 0-11 for 2 spatial streams */
+static const uint8_t he_ie_80mhz_2ss[] = {
+	0xff, 0x16, 0x23, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfa, 0xff,
+	0xfa, 0xff,
+};
+
+static const struct ie_data_rate_test ie_data_rate_test_ht = {
+	.ht_ie = ht_ie_20mhz_2ss,
+	.rssi = -50,
+	.expected_rate = 130000000,
+};
+
+static const struct ie_data_rate_test ie_data_rate_test_vht = {
+	.ht_ie = ht_ie_40mhz_2ss,
+	.vht_ie = vht_ie_80mhz_2ss,
+	.rssi = -50,
+	.expected_rate = 866600000,
+};
+
+static const struct ie_data_rate_test ie_data_rate_test_he = {
+	.ht_ie = ht_ie_40mhz_2ss,
+	.vht_ie = vht_ie_80mhz_2ss,
+	.he_ie = he_ie_80mhz_2ss,
+	.rssi = -40,
+	.expected_rate = 1200800000,
+};
+
+static const struct ie_data_rate_test ie_data_rate_test_he_low_rssi = {
+	.he_ie = he_ie_80mhz_2ss,
+	.rssi = -60,
+	.expected_rate = 576400000,
+};
+
+static void ie_test_data_rate(const void *data)
+{
+	const struct ie_data_rate_test *test = data;
+	uint64_t rate;
+
+	assert(ie_parse_data_rates(NULL, NULL, test->ht_ie, test->vht_ie,
+					test->he_ie, test->rssi, &rate) == 0);
+	assert(rate == test->expected_rate);
+}
+
 int main(int argc, char *argv[])
 {
 	l_test_init(&argc, &argv);
@@ -706,6 +843,8 @@ int main(int argc, char *argv[])
 	l_test_add("/ie/reader/extended", ie_test_reader_extended, NULL);
 	l_test_add("/ie/writer/extended", ie_test_writer_extended, NULL);
 
+	l_test_add("/ie/index", ie_test_index, NULL);
+
 	l_test_add("/ie/RSN Info Parser/Test Case 1",
 				ie_test_rsne_info, &ie_rsne_info_test_1);
 	l_test_add("/ie/RSN Info Parser/Test Case 2",
@@ -753,5 +892,14 @@ int main(int argc, char *argv[])
 				ie_test_encapsulate_wsc,
 				&ie_tlv_concat_test_data_1);
 
+	l_test_add("/ie/Data Rate/HT", ie_test_data_rate,
+				&ie_data_rate_test_ht);
+	l_test_add("/ie/Data Rate/VHT", ie_test_data_rate,
+				&ie_data_rate_test_vht);
+	l_test_add("/ie/Data Rate/HE", ie_test_data_rate,
+				&ie_data_rate_test_he);
+	l_test_add("/ie/Data Rate/HE Low RSSI", ie_test_data_rate,
+				&ie_data_rate_test_he_low_rssi);
+
 	return l_test_run();
 }
@@ -175,6 +175,39 @@ static void ie_order_test(const void *data)
 	assert(!!mpdu_validate(frame->data, frame->len) == frame->good);
 }
 
+static void ie_index_test(const void *data)
+{
+	struct ie_index index;
+	const struct mmpdu_header *mpdu;
+	const struct mmpdu_probe_request *body;
+	const uint8_t *ie;
+
+	mpdu = mpdu_validate_index(probe_req_good1, sizeof(probe_req_good1),
+					&index);
+	assert(mpdu);
+
+	body = mmpdu_body(mpdu);
+	assert(index.ies == body->ies);
+	assert(index.ies + index.len == probe_req_good1 +
+						sizeof(probe_req_good1));
+
+	ie = ie_index_find(&index, IE_TYPE_SSID);
+	assert(ie == body->ies);
+	assert(ie[1] == 5 && !memcmp(ie + 2, "test1", 5));
+
+	assert(ie_index_find(&index, IE_TYPE_HT_CAPABILITIES));
+	assert(ie_index_count(&index, IE_TYPE_VENDOR_SPECIFIC) == 2);
+	assert(!ie_index_find(&index, IE_TYPE_RSN));
+
+	/* Bodies without elements result in an empty index */
+	mpdu = mpdu_validate_index(deauthentication_data_1,
+					sizeof(deauthentication_data_1),
+					&index);
+	assert(mpdu);
+	assert(index.len == 0);
+	assert(!ie_index_find(&index, IE_TYPE_SSID));
+}
+
 int main(int argc, char *argv[])
 {
 	l_test_init(&argc, &argv);
@@ -192,5 +225,7 @@ int main(int argc, char *argv[])
 	l_test_add("/IE order/Good (Out of Order IE) 2", ie_order_test,
 				&probe_req_ie_out_of_order2_data);
 
+	l_test_add("/IE index/Probe Request", ie_index_test, NULL);
+
 	return l_test_run();
 }
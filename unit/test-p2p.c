@@ -621,6 +621,45 @@ static void p2p_test_parse_probe_resp(const void *data)
 	p2p_clear_probe_resp(&attrs2);
 }
 
+static void p2p_test_parse_probe_resp_shallow(const void *data)
+{
+	const struct p2p_probe_resp_data *test = data;
+	struct p2p_probe_resp attrs1, attrs2;
+
+	assert(p2p_parse_probe_resp(test->ies, test->ies_len, &attrs1) == 0);
+	assert(p2p_parse_probe_resp_shallow(test->ies, test->ies_len,
+						&attrs2) == 0);
+
+	/* The fixed-size fields are the same as with a full parse */
+	assert(!memcmp(&attrs1.capability, &attrs2.capability,
+			sizeof(attrs1.capability)));
+	assert(!memcmp(&attrs1.listen_availability,
+			&attrs2.listen_availability,
+			sizeof(attrs1.listen_availability)));
+	assert(attrs1.notice_of_absence.index ==
+		attrs2.notice_of_absence.index);
+	assert(attrs1.notice_of_absence.ct_window ==
+		attrs2.notice_of_absence.ct_window);
+	assert(!memcmp(attrs1.device_info.device_addr,
+			attrs2.device_info.device_addr, 6));
+	assert(attrs1.device_info.wsc_config_methods ==
+		attrs2.device_info.wsc_config_methods);
+	assert(!memcmp(&attrs1.device_info.primary_device_type,
+			&attrs2.device_info.primary_device_type,
+			sizeof(attrs1.device_info.primary_device_type)));
+	assert(!strcmp(attrs1.device_info.device_name,
+			attrs2.device_info.device_name));
+
+	/* While the lists are not built */
+	assert(!attrs2.notice_of_absence.descriptors);
+	assert(!attrs2.device_info.secondary_device_types);
+	assert(!attrs2.group_clients);
+	assert(!attrs2.advertised_svcs);
+
+	p2p_clear_probe_resp(&attrs1);
+	p2p_clear_probe_resp(&attrs2);
+}
+
 static void p2p_test_build_probe_resp(const void *data)
 {
 	const struct p2p_probe_resp_data *test = data;
@@ -1140,6 +1179,12 @@ int main(int argc, char *argv[])
 			&p2p_probe_resp_data_1);
 	l_test_add("/p2p/parse/Probe Response IEs 2", p2p_test_parse_probe_resp,
 			&p2p_probe_resp_data_2);
+	l_test_add("/p2p/parse/Probe Response IEs 1 shallow",
+			p2p_test_parse_probe_resp_shallow,
+			&p2p_probe_resp_data_1);
+	l_test_add("/p2p/parse/Probe Response IEs 2 shallow",
+			p2p_test_parse_probe_resp_shallow,
+			&p2p_probe_resp_data_2);
 
 	l_test_add("/p2p/build/Probe Response IEs 1", p2p_test_build_probe_resp,
 			&p2p_probe_resp_data_1);
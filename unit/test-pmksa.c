@@ -0,0 +1,132 @@
+/*
+ *
+ *  Wireless daemon for Linux
+ *
+ *  Copyright (C) 2020  Intel Corporation. All rights reserved.
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <assert.h>
+#include <ell/ell.h>
+
+#include "src/ie.h"
+#include "src/pmksa.h"
+
+static const uint8_t spa[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t aa1[6] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x01 };
+static const uint8_t aa2[6] = { 0x02, 0x00, 0x00, 0x00, 0x01, 0x02 };
+
+static void pmksa_fill(struct pmksa *pmksa, const uint8_t *aa,
+					const char *ssid, uint8_t pmkid)
+{
+	memset(pmksa, 0, sizeof(*pmksa));
+	memcpy(pmksa->spa, spa, 6);
+	memcpy(pmksa->aa, aa, 6);
+	pmksa->ssid_len = strlen(ssid);
+	memcpy(pmksa->ssid, ssid, pmksa->ssid_len);
+	pmksa->akm = IE_RSN_AKM_SUITE_8021X;
+	memset(pmksa->pmkid, pmkid, 16);
+	memset(pmksa->pmk, pmkid, 32);
+	pmksa->pmk_len = 32;
+}
+
+static void test_get_put(const void *data)
+{
+	struct pmksa pmksa;
+	const struct pmksa *cached;
+	uint64_t expiry;
+
+	pmksa_fill(&pmksa, aa1, "Enterprise", 1);
+	pmksa_cache_put(&pmksa);
+
+	cached = pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X);
+	assert(cached);
+	assert(!memcmp(cached->pmkid, pmksa.pmkid, 16));
+	assert(cached->pmk_len == 32);
+	assert(!memcmp(cached->pmk, pmksa.pmk, 32));
+	expiry = cached->expiry;
+
+	/* Different BSS, SSID, SPA or AKM */
+	assert(!pmksa_cache_get(spa, aa2, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X));
+	assert(!pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise2", 11,
+					IE_RSN_AKM_SUITE_8021X));
+	assert(!pmksa_cache_get(aa2, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X));
+	assert(!pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X_SHA256));
+
+	/* Putting the same PMKSA again keeps the original lifetime */
+	pmksa_cache_put(&pmksa);
+	cached = pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X);
+	assert(cached && cached->expiry == expiry);
+
+	/* A new PMKSA for the same BSS replaces the old one */
+	pmksa_fill(&pmksa, aa1, "Enterprise", 2);
+	pmksa_cache_put(&pmksa);
+	cached = pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X);
+	assert(cached && !memcmp(cached->pmkid, pmksa.pmkid, 16));
+
+	pmksa_cache_remove(spa, aa1, (const uint8_t *) "Enterprise", 10);
+	assert(!pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X));
+
+	pmksa_cache_flush(NULL, 0);
+}
+
+static void test_flush(const void *data)
+{
+	struct pmksa pmksa;
+
+	pmksa_fill(&pmksa, aa1, "Enterprise", 1);
+	pmksa_cache_put(&pmksa);
+	pmksa_fill(&pmksa, aa2, "Enterprise", 2);
+	pmksa_cache_put(&pmksa);
+	pmksa_fill(&pmksa, aa1, "Other", 3);
+	pmksa_cache_put(&pmksa);
+
+	pmksa_cache_flush((const uint8_t *) "Enterprise", 10);
+
+	assert(!pmksa_cache_get(spa, aa1, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X));
+	assert(!pmksa_cache_get(spa, aa2, (const uint8_t *) "Enterprise", 10,
+					IE_RSN_AKM_SUITE_8021X));
+	assert(pmksa_cache_get(spa, aa1, (const uint8_t *) "Other", 5,
+					IE_RSN_AKM_SUITE_8021X));
+
+	pmksa_cache_flush(NULL, 0);
+	assert(!pmksa_cache_get(spa, aa1, (const uint8_t *) "Other", 5,
+					IE_RSN_AKM_SUITE_8021X));
+}
+
+int main(int argc, char *argv[])
+{
+	l_test_init(&argc, &argv);
+
+	l_test_add("/pmksa/get_put", test_get_put, NULL);
+	l_test_add("/pmksa/flush", test_flush, NULL);
+
+	return l_test_run();
+}
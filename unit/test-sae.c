@@ -390,6 +390,57 @@ static void end_to_end_tx_func(const uint8_t *frame, size_t len, void *user_data
 	td->tx_packet_len = len;
 }
 
+static void test_group_cache(const void *arg)
+{
+	static const uint8_t aa2[] = {2, 0, 0, 0, 0, 2};
+	static const char *ssid = "TestSSID";
+	struct test_data *td = l_new(struct test_data, 1);
+	struct handshake_state *hs1 = test_handshake_state_new(1);
+	struct handshake_state *hs2 = test_handshake_state_new(2);
+	struct auth_proto *ap;
+
+	handshake_state_set_supplicant_address(hs1, spa);
+	handshake_state_set_authenticator_address(hs1, aa);
+	handshake_state_set_passphrase(hs1, passphrase);
+	handshake_state_set_ssid(hs1, (void *) ssid, strlen(ssid));
+
+	/* The BSS, and with it the ESS, accepted group 20 last time */
+	handshake_state_set_accepted_group(hs1, 20);
+
+	ap = sae_sm_new(hs1, end_to_end_tx_func, test_tx_assoc_func, td);
+	assert(auth_proto_start(ap));
+	assert(l_get_le16(td->tx_packet + 2) == 0);
+	assert(l_get_le16(td->tx_packet + 4) == 20);
+	auth_proto_free(ap);
+
+	/* Another BSS in the same ESS */
+	handshake_state_set_supplicant_address(hs2, spa);
+	handshake_state_set_authenticator_address(hs2, aa2);
+	handshake_state_set_passphrase(hs2, passphrase);
+	handshake_state_set_ssid(hs2, (void *) ssid, strlen(ssid));
+
+	ap = sae_sm_new(hs2, end_to_end_tx_func, test_tx_assoc_func, td);
+	assert(auth_proto_start(ap));
+	assert(l_get_le16(td->tx_packet + 4) == 20);
+	auth_proto_free(ap);
+
+	/* A group accepted by the BSS itself takes precedence over the ESS */
+	handshake_state_set_accepted_group(hs1, 19);
+	handshake_state_set_accepted_group(hs2, 20);
+
+	ap = sae_sm_new(hs1, end_to_end_tx_func, test_tx_assoc_func, td);
+	assert(auth_proto_start(ap));
+	assert(l_get_le16(td->tx_packet + 4) == 19);
+	auth_proto_free(ap);
+
+	handshake_state_free(hs1);
+	handshake_state_free(hs2);
+	l_free(td);
+
+	handshake_group_cache_flush();
+	sae_pwe_cache_flush();
+}
+
 static void test_bad_confirm(const void *arg)
 {
 	struct auth_proto *ap1;
@@ -551,6 +602,10 @@ static void test_confirm_after_accept(const void *arg)
 
 static void test_end_to_end(const void *arg)
 {
+	bool h2e = L_PTR_TO_UINT(arg);
+	uint16_t commit_status = h2e ? MMPDU_STATUS_CODE_SAE_HASH_TO_ELEMENT : 0;
+	static const uint8_t rsnxe[] = { IE_TYPE_RSNX, 1, 0x20 };
+	static const char *ssid = "TestSSID";
 	struct auth_proto *ap1;
 	struct auth_proto *ap2;
 	struct test_data *td1 = l_new(struct test_data, 1);
@@ -576,26 +631,36 @@ static void test_end_to_end(const void *arg)
 	handshake_state_set_passphrase(hs2, passphrase);
 	handshake_state_set_authenticator(hs2, true);
 
+	if (h2e) {
+		handshake_state_set_ssid(hs1, (void *) ssid, strlen(ssid));
+		handshake_state_set_supplicant_rsnxe(hs1, rsnxe);
+		handshake_state_set_ssid(hs2, (void *) ssid, strlen(ssid));
+		handshake_state_set_supplicant_rsnxe(hs2, rsnxe);
+	}
+
 	ap1 = sae_sm_new(hs1, end_to_end_tx_func, test_tx_assoc_func, td1);
 	ap2 = sae_sm_new(hs2, end_to_end_tx_func, test_tx_assoc_func, td2);
 
 	/* both peers send out commit */
 	auth_proto_start(ap1);
+	assert(l_get_le16(td1->tx_packet + 2) == commit_status);
 	auth_proto_start(ap2);
+	assert(l_get_le16(td2->tx_packet + 2) == commit_status);
 
 	/* save sm1 commit, tx_packet will get overwritten with confirm */
 	memcpy(tmp_commit, td1->tx_packet, td1->tx_packet_len);
 	tmp_commit_len = td1->tx_packet_len;
 
 	/* rx commit for both peers */
-	frame_len = setup_auth_frame(frame, aa, 1, 0, td2->tx_packet + 4,
+	frame_len = setup_auth_frame(frame, aa, 1, commit_status,
+					td2->tx_packet + 4,
 					td2->tx_packet_len - 4);
 	assert(auth_proto_rx_authenticate(ap1, (uint8_t *)frame,
 						frame_len) == 0);
 
 	/* both peers should now have sent confirm */
-	frame_len = setup_auth_frame(frame, spa, 1, 0, tmp_commit + 4,
-					tmp_commit_len - 4);
+	frame_len = setup_auth_frame(frame, spa, 1, commit_status,
+					tmp_commit + 4, tmp_commit_len - 4);
 	assert(auth_proto_rx_authenticate(ap2, (uint8_t *)frame,
 						frame_len) == 0);
 
@@ -617,6 +682,8 @@ static void test_end_to_end(const void *arg)
 	assert(auth_proto_rx_associate(ap1, (uint8_t *)assoc, frame_len) == 0);
 	assert(auth_proto_rx_associate(ap2, (uint8_t *)assoc, frame_len) == 0);
 
+	assert(!memcmp(hs1->pmk, hs2->pmk, 32));
+
 	handshake_state_free(hs1);
 	handshake_state_free(hs2);
 
@@ -625,6 +692,8 @@ static void test_end_to_end(const void *arg)
 
 	l_free(td1);
 	l_free(td2);
+
+	sae_pwe_cache_flush();
 }
 
 int main(int argc, char *argv[])
@@ -647,9 +716,11 @@ int main(int argc, char *argv[])
 	l_test_add("SAE malformed commit", test_malformed_commit, NULL);
 	l_test_add("SAE malformed confirm", test_malformed_confirm, NULL);
 	l_test_add("SAE bad group", test_bad_group, NULL);
+	l_test_add("SAE group cache", test_group_cache, NULL);
 	l_test_add("SAE bad confirm", test_bad_confirm, NULL);
 	l_test_add("SAE confirm after accept", test_confirm_after_accept, NULL);
-	l_test_add("SAE end-to-end", test_end_to_end, NULL);
+	l_test_add("SAE end-to-end", test_end_to_end, L_UINT_TO_PTR(false));
+	l_test_add("SAE H2E end-to-end", test_end_to_end, L_UINT_TO_PTR(true));
 
 done:
 	return l_test_run();
@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -808,6 +809,30 @@ static void wsc_test_build_m1(const void *data)
 	l_free(out);
 }
 
+static void wsc_test_write_m1(const void *data)
+{
+	const struct m1_data *test = data;
+	struct wsc_m1 m1;
+	uint8_t buf[1024];
+	int len;
+
+	memcpy(&m1, &test->expected, sizeof(m1));
+	memcpy(m1.public_key, test->public_key, 192);
+
+	len = wsc_write_m1(&m1, buf, sizeof(buf));
+	assert(len == (int) test->len);
+	assert(!memcmp(test->pdu, buf, test->len));
+
+	len = wsc_write_m1(&m1, buf, test->len);
+	assert(len == (int) test->len);
+
+	len = wsc_write_m1(&m1, buf, test->len - 1);
+	assert(len == -EMSGSIZE);
+
+	len = wsc_write_m1(&m1, buf, 100);
+	assert(len == -EMSGSIZE);
+}
+
 static bool wsc_compute_authenticator(struct l_key *peer_public_key,
 					struct l_key *private_key,
 					struct l_key *prime,
@@ -2604,6 +2629,8 @@ int main(int argc, char *argv[])
 
 	l_test_add("/wsc/build/m1 1", wsc_test_build_m1, &m1_data_1);
 	l_test_add("/wsc/build/m1 2", wsc_test_build_m1, &m1_data_2);
+	l_test_add("/wsc/write/m1 1", wsc_test_write_m1, &m1_data_1);
+	l_test_add("/wsc/write/m1 2", wsc_test_write_m1, &m1_data_2);
 
 	if (!l_checksum_is_supported(L_CHECKSUM_SHA256, true)) {
 		printf("SHA256 support missing, skipping other tests...\n");
@@ -24,6 +24,7 @@
 #include <config.h>
 #endif
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
@@ -52,6 +53,8 @@
 #define PROP_CONNECTED		"Connected"
 #define PROP_AUTHENTICATED	"Authenticated"
 
+#define PAE_RX_BATCH		16
+
 struct ethdev {
 	uint32_t index;
 	char ifname[IFNAMSIZ];
@@ -63,15 +66,21 @@ struct ethdev {
 	char *path;
 };
 
+struct eapol_key {
+	uint32_t ifindex;
+	uint8_t addr[ETH_ALEN];
+} __attribute__ ((packed));
+
 struct eapol {
 	struct ethdev *dev;
-	uint8_t addr[ETH_ALEN];
+	struct eapol_key key;
 	struct eap_state *eap;
-	struct l_settings *cred;
 };
 
 static struct l_netlink *rtnl = NULL;
 static struct l_queue *ethdev_list = NULL;
+static struct l_hashmap *ethdev_index = NULL;	/* ethdevs by ifindex */
+static struct l_hashtab *eapol_index = NULL;	/* sessions by eapol_key */
 static char **whitelist_filter = NULL;
 static char **blacklist_filter = NULL;
 
@@ -114,34 +123,25 @@ static void eapol_free(void *data)
 
 	l_debug("Freeing EAPoL session");
 
+	l_hashtab_remove(eapol_index, &eapol->key);
+
 	eap_free(eapol->eap);
-	l_settings_free(eapol->cred);
 	l_free(eapol);
 }
 
-static bool eapol_match(const void *a, const void *b)
-{
-	const struct eapol *eapol = a;
-
-	return !memcmp(eapol->addr, b, ETH_ALEN);
-}
-
 static struct eapol *eapol_lookup(struct ethdev *dev, const uint8_t *addr)
 {
-	return l_queue_find(dev->eapol_sessions, eapol_match, addr);
-}
+	struct eapol_key key;
 
-static bool ethdev_match(const void *a, const void *b)
-{
-	const struct ethdev *dev = a;
-	uint32_t index = L_PTR_TO_UINT(b);
+	key.ifindex = dev->index;
+	memcpy(key.addr, addr, ETH_ALEN);
 
-	return (dev->index == index);
+	return l_hashtab_lookup(eapol_index, &key);
 }
 
 static struct ethdev *ethdev_lookup(uint32_t index)
 {
-	return l_queue_find(ethdev_list, ethdev_match, L_UINT_TO_PTR(index));
+	return l_hashmap_lookup(ethdev_index, L_UINT_TO_PTR(index));
 }
 
 static void eap_tx_packet(const uint8_t *eap_data, size_t len, void *user_data)
@@ -227,7 +227,8 @@ static void rx_packet(struct ethdev *dev, const uint8_t *addr,
 		if (!eapol) {
 			eapol = l_new(struct eapol, 1);
 			eapol->dev = dev;
-			memcpy(eapol->addr, addr, ETH_ALEN);
+			eapol->key.ifindex = dev->index;
+			memcpy(eapol->key.addr, addr, ETH_ALEN);
 			eapol->eap = eap_new(eap_tx_packet,
 							eap_complete, eapol);
 			if (!eapol->eap) {
@@ -239,9 +240,11 @@ static void rx_packet(struct ethdev *dev, const uint8_t *addr,
 			l_debug("Created new EAPoL session");
 
 			l_queue_push_tail(dev->eapol_sessions, eapol);
+			l_hashtab_insert(eapol_index, &eapol->key, eapol);
 
-			eapol->cred = network_lookup_security("default");
-			eap_load_settings(eapol->eap, eapol->cred, "EAP-");
+			eap_load_settings(eapol->eap,
+					network_lookup_security("default"),
+					"EAP-");
 
 			eap_set_key_material_func(eapol->eap, eap_key_material);
 			eap_set_event_func(eapol->eap, eap_event);
@@ -266,43 +269,73 @@ static struct sock_filter pae_filter[] = {
 
 static const struct sock_fprog pae_fprog = { .len = 6, .filter = pae_filter };
 
-static bool pae_read(struct l_io *io, void *user_data)
+static void pae_rx_frame(const struct sockaddr_ll *sll,
+					const uint8_t *frame, size_t len)
 {
-	int fd = l_io_get_fd(io);
 	struct ethdev *dev;
-	struct sockaddr_ll sll;
-	socklen_t sll_len;
-	ssize_t bytes;
-	uint8_t frame[1500];
 
-	memset(&sll, 0, sizeof(sll));
-	sll_len = sizeof(sll);
+	if (sll->sll_hatype != ARPHRD_ETHER)
+		return;
 
-	bytes = recvfrom(fd, frame, sizeof(frame), 0,
-					(struct sockaddr *) &sll, &sll_len);
-	if (bytes <= 0) {
-		l_error("Reading from PAE socket failed: %s", strerror(errno));
-		return false;
-	}
+	if (sll->sll_halen != ETH_ALEN)
+		return;
 
-	if (sll.sll_hatype != ARPHRD_ETHER)
-		return true;
+	if (ntohs(sll->sll_protocol) != ETH_P_PAE)
+		return;
 
-	if (sll.sll_halen != ETH_ALEN)
-		return true;
+	if (sll->sll_pkttype != PACKET_HOST &&
+					sll->sll_pkttype != PACKET_MULTICAST)
+		return;
 
-	if (ntohs(sll.sll_protocol) != ETH_P_PAE)
-		return true;
+	dev = ethdev_lookup(sll->sll_ifindex);
+	if (!dev)
+		return;
 
-	if (sll.sll_pkttype != PACKET_HOST &&
-					sll.sll_pkttype != PACKET_MULTICAST)
-		return true;
+	rx_packet(dev, sll->sll_addr, frame, len);
+}
 
-	dev = ethdev_lookup(sll.sll_ifindex);
-	if (!dev)
+/*
+ * All ports share the one PAE socket, so when many of them re-authenticate
+ * at once drain whatever has queued up with a single recvmmsg() instead of
+ * going back through the main loop for every frame.
+ */
+static bool pae_read(struct l_io *io, void *user_data)
+{
+	int fd = l_io_get_fd(io);
+	struct sockaddr_ll sll[PAE_RX_BATCH];
+	struct mmsghdr msgs[PAE_RX_BATCH];
+	struct iovec iov[PAE_RX_BATCH];
+	uint8_t frames[PAE_RX_BATCH][1500];
+	int i;
+	int n;
+
+	memset(msgs, 0, sizeof(msgs));
+	memset(sll, 0, sizeof(sll));
+
+	for (i = 0; i < PAE_RX_BATCH; i++) {
+		iov[i].iov_base = frames[i];
+		iov[i].iov_len = sizeof(frames[i]);
+		msgs[i].msg_hdr.msg_name = &sll[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sll[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg(fd, msgs, PAE_RX_BATCH, MSG_DONTWAIT, NULL);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
 		return true;
 
-	rx_packet(dev, sll.sll_addr, frame, bytes);
+	if (n <= 0) {
+		l_error("Reading from PAE socket failed: %s", strerror(errno));
+		return false;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!msgs[i].msg_len)
+			continue;
+
+		pae_rx_frame(&sll[i], frames[i], msgs[i].msg_len);
+	}
 
 	return true;
 }
@@ -536,6 +569,7 @@ static void newlink_notify(const struct ifinfomsg *ifi, int bytes)
 					L_DBUS_INTERFACE_PROPERTIES, NULL);
 
 		l_queue_push_tail(ethdev_list, dev);
+		l_hashmap_insert(ethdev_index, L_UINT_TO_PTR(dev->index), dev);
 
 		lower_changed = true;
 	}
@@ -582,11 +616,12 @@ static void dellink_notify(const struct ifinfomsg *ifi, int bytes)
 	if (ifi->ifi_type != ARPHRD_ETHER)
 		return;
 
-	dev = l_queue_remove_if(ethdev_list, ethdev_match,
-						L_UINT_TO_PTR(index));
+	dev = l_hashmap_remove(ethdev_index, L_UINT_TO_PTR(index));
 	if (!dev)
 		return;
 
+	l_queue_remove(ethdev_list, dev);
+
 	l_debug("Removing device %u", dev->index);
 
 	ethdev_free(dev);
@@ -737,6 +772,9 @@ bool ethdev_init(const char *whitelist, const char *blacklist)
 	}
 
 	ethdev_list = l_queue_new();
+	ethdev_index = l_hashmap_new();
+	eapol_index = l_hashtab_new(sizeof(struct eapol_key),
+						L_HASHTAB_HASH_FAST);
 
 	if (!l_dbus_register_interface(dbus_app_get(), ADAPTER_INTERFACE,
 					setup_adapter_interface, NULL, false)) {
@@ -777,4 +815,10 @@ void ethdev_exit(void)
 
 	l_queue_destroy(ethdev_list, ethdev_free);
 	ethdev_list = NULL;
+
+	l_hashmap_destroy(ethdev_index, NULL);
+	ethdev_index = NULL;
+
+	l_hashtab_destroy(eapol_index, NULL);
+	eapol_index = NULL;
 }
@@ -39,9 +39,11 @@
 
 struct network {
 	char *name;
+	struct l_settings *security;
 };
 
 static struct l_queue *network_list;
+static struct l_settings *empty_security;
 static struct l_dir_watch *storage_watch;
 static char *storage_path;
 
@@ -71,6 +73,7 @@ static void network_free(void *data)
 
 	l_debug("Freeing network '%s'", net->name);
 
+	l_settings_free(net->security);
 	l_free(net->name);
 	l_free(net);
 }
@@ -95,6 +98,8 @@ static void network_create(const char *name)
 	net = network_lookup(name);
 	if (net) {
 		l_debug("Refresh network '%s'", net->name);
+		l_settings_free(net->security);
+		net->security = NULL;
 		return;
 	}
 
@@ -118,26 +123,40 @@ static void network_reload(const char *name)
 	net = network_lookup(name);
 	if (net) {
 		l_debug("Refresh network '%s'", net->name);
+		l_settings_free(net->security);
+		net->security = NULL;
 		return;
 	}
 }
 
+/*
+ * The parsed settings are kept with the network and shared by all sessions
+ * using it, so that a burst of authentications doesn't re-read and re-parse
+ * the same file for every port.  They are dropped whenever the file changes.
+ * The returned settings are owned by the network module.
+ */
 struct l_settings *network_lookup_security(const char *network)
 {
-	struct l_settings *conf;
+	struct network *net = network_lookup(network);
 	char *path;
 
+	if (!net)
+		return empty_security;
+
+	if (net->security)
+		return net->security;
+
 	path = l_strdup_printf("%s/%s%s", storage_path, network,
 							STORAGEFILE_SUFFIX);
 
 	l_debug("Loading %s", path);
 
-	conf = l_settings_new();
-	l_settings_load_from_file(conf, path);
+	net->security = l_settings_new();
+	l_settings_load_from_file(net->security, path);
 
 	l_free(path);
 
-	return conf;
+	return net->security;
 }
 
 static void network_storage_watch_cb(const char *filename,
@@ -202,6 +221,7 @@ static int network_init(void)
 	}
 
 	network_list = l_queue_new();
+	empty_security = l_settings_new();
 
 	while ((dirent = readdir(dir))) {
 		struct network *net;
@@ -236,6 +256,9 @@ static void network_exit(void)
 	l_queue_destroy(network_list, network_free);
 	network_list = NULL;
 
+	l_settings_free(empty_security);
+	empty_security = NULL;
+
 	l_free(storage_path);
 }
 